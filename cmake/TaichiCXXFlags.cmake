@@ -3,6 +3,12 @@ message("Using C++ compiler: " ${CMAKE_CXX_COMPILER})
 if (TC_DISABLE_SIMD)
     message("SIMD explicitly disabled. This may lead to performance issues.")
     set(CMAKE_CXX_FLAGS "${CMAKE_CXX_FLAGS} -DTC_ISE_NONE")
+elseif (TC_PORTABLE)
+    # One binary for AVX2 and AVX-512 machines: AVX2 as the baseline, and
+    # AVX-512 clones of the hot kernels, selected at load time
+    # (TC_MULTIVERSIONED in util.h)
+    message("Portable build. Using Instruction Set Extension: [AVX2]")
+    set(CMAKE_CXX_FLAGS "${CMAKE_CXX_FLAGS} -DTC_ISE_AVX2 -DTC_PORTABLE")
 else()
     include(${TAICHI_CMAKE_DIR}/OptimizeForArchitecture.cmake)
     OptimizeForArchitecture()
@@ -48,7 +54,12 @@ else()
     else()
         set(CMAKE_CXX_FLAGS "${CMAKE_CXX_FLAGS} -std=c++14")
     endif()
-    set(CMAKE_CXX_FLAGS "${CMAKE_CXX_FLAGS} -march=native\
+    if (TC_PORTABLE)
+        set(CMAKE_CXX_FLAGS "${CMAKE_CXX_FLAGS} -march=haswell -mtune=generic")
+    else()
+        set(CMAKE_CXX_FLAGS "${CMAKE_CXX_FLAGS} -march=native")
+    endif()
+    set(CMAKE_CXX_FLAGS "${CMAKE_CXX_FLAGS}\
          -DGL_DO_NOT_WARN_IF_MULTI_GL_VERSION_HEADERS_INCLUDED -Wall")
 endif ()
 
@@ -8,6 +8,10 @@ file(GLOB TAICHI_CORE_SOURCE
         "include/taichi/*/*/*/*.cpp" "include/taichi/*/*/*.cpp" "include/taichi/*/*.cpp"
         "include/taichi/*/*/*/*.h" "include/taichi/*/*/*.h" "include/taichi/*/*.h")
 
+# The entry points of executables, in TaichiMain.cmake
+file(GLOB TAICHI_MAIN_SOURCE "src/main/*.cpp")
+list(REMOVE_ITEM TAICHI_CORE_SOURCE ${TAICHI_MAIN_SOURCE})
+
 file(GLOB TAICHI_PROJECT_SOURCE
         "projects/*/*/*/*.cpp"
         "projects/*/*/*/*.h"
@@ -23,6 +27,12 @@ add_library(${CORE_LIBRARY_NAME} SHARED ${TAICHI_CORE_SOURCE})
 
 # Optional dependencies
 
+if (TC_USE_MPI)
+    find_package(MPI REQUIRED)
+    include_directories(${MPI_CXX_INCLUDE_PATH})
+    target_link_libraries(${CORE_LIBRARY_NAME} ${MPI_CXX_LIBRARIES})
+endif ()
+
 if (USE_OPENGL)
     #add_subdirectory(external/glfw)
     #include_directories(external/glfw/include)
@@ -42,6 +52,14 @@ if (USE_OPENGL)
     endif ()
 endif ()
 
+if (USE_CUDA)
+    # GPU solvers; needs CMake 3.8 for CUDA as a language
+    enable_language(CUDA)
+    file(GLOB TAICHI_CUDA_SOURCE "src/*/*.cu")
+    target_sources(${CORE_LIBRARY_NAME} PRIVATE ${TAICHI_CUDA_SOURCE})
+    set(CMAKE_CXX_FLAGS "${CMAKE_CXX_FLAGS} -DTC_USE_CUDA")
+endif ()
+
 if (APPLE)
     target_link_libraries(${CORE_LIBRARY_NAME} "-framework Cocoa")
 endif ()
@@ -61,7 +79,7 @@ if (NOT WIN32)
         target_link_libraries(${CORE_LIBRARY_NAME} ${CMAKE_CURRENT_SOURCE_DIR}/external/lib/libtbbmalloc.dylib)
     else()
         # Linux
-        target_link_libraries(${CORE_LIBRARY_NAME} stdc++fs X11)
+        target_link_libraries(${CORE_LIBRARY_NAME} stdc++fs X11 Xext)
         target_link_libraries(${CORE_LIBRARY_NAME} ${CMAKE_CURRENT_SOURCE_DIR}/external/lib/libembree.so.2)
         target_link_libraries(${CORE_LIBRARY_NAME} ${CMAKE_CURRENT_SOURCE_DIR}/external/lib/libtbb.so.2)
         target_link_libraries(${CORE_LIBRARY_NAME} ${CMAKE_CURRENT_SOURCE_DIR}/external/lib/libtbbmalloc.so.2)
@@ -6,3 +6,7 @@ if (WIN32)
     set_target_properties(ti PROPERTIES RUNTIME_OUTPUT_DIRECTORY_DEBUG "${CMAKE_CURRENT_SOURCE_DIR}/bin")
     set_target_properties(ti PROPERTIES RUNTIME_OUTPUT_DIRECTORY_RELEASE "${CMAKE_CURRENT_SOURCE_DIR}/bin")
 endif ()
+
+# Runs render and simulation jobs natively, without the Python interpreter
+add_executable(taichi_batch src/main/taichi_batch.cpp)
+target_link_libraries(taichi_batch ${CORE_LIBRARY_NAME})
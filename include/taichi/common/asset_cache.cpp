@@ -0,0 +1,94 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#include <taichi/common/asset_cache.h>
+
+#include <sys/stat.h>
+#include <cstdio>
+#include <vector>
+
+TC_NAMESPACE_BEGIN
+
+namespace {
+
+constexpr uint64 fnv_offset = 14695981039346656037ull;
+constexpr uint64 fnv_prime = 1099511628211ull;
+
+void mix(uint64 &hash, const std::string &s) {
+  for (char c : s) {
+    hash ^= (uint8)c;
+    hash *= fnv_prime;
+  }
+  // Separates consecutive strings
+  hash ^= 0xff;
+  hash *= fnv_prime;
+}
+
+}  // namespace
+
+AssetCache &AssetCache::get_instance() {
+  static AssetCache cache;
+  return cache;
+}
+
+uint64 AssetCache::get_key(const std::string &interface_name,
+                           const std::string &alias,
+                           const Config &config) {
+  uint64 hash = fnv_offset;
+  mix(hash, interface_name);
+  mix(hash, alias);
+  for (auto &key : config.get_keys()) {
+    std::string value = config.get_string(key);
+    mix(hash, key);
+    uint64 file_hash = value.empty() ? 0 : get_file_hash(value);
+    if (file_hash != 0) {
+      mix(hash, fmt::format("file:{}", file_hash));
+    } else {
+      mix(hash, value);
+    }
+  }
+  return hash;
+}
+
+uint64 AssetCache::get_file_hash(const std::string &fn) {
+  struct stat st;
+  if (stat(fn.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) {
+    return 0;
+  }
+  uint64 stamp = ((uint64)st.st_size * fnv_prime) ^ (uint64)st.st_mtime;
+  {
+    std::lock_guard<std::mutex> _(mut);
+    auto it = file_hashes.find(fn);
+    if (it != file_hashes.end() && it->second.stamp == stamp) {
+      return it->second.hash;
+    }
+  }
+  FILE *f = std::fopen(fn.c_str(), "rb");
+  if (f == nullptr) {
+    return 0;
+  }
+  // FNV-1a over 8-byte words, for the speed of hashing large images
+  uint64 hash = fnv_offset ^ (uint64)st.st_size;
+  std::vector<uint64> buffer(1 << 17);
+  std::size_t n;
+  while ((n = std::fread(buffer.data(), 1, buffer.size() * sizeof(uint64),
+                         f)) > 0) {
+    // Zero-padded last word
+    std::fill((uint8 *)buffer.data() + n,
+              (uint8 *)(buffer.data() + (n + 7) / 8), (uint8)0);
+    for (std::size_t i = 0; i < (n + 7) / 8; i++) {
+      hash ^= buffer[i];
+      hash *= fnv_prime;
+    }
+  }
+  std::fclose(f);
+  // Never 0, which means "not a file"
+  hash |= 1;
+  std::lock_guard<std::mutex> _(mut);
+  file_hashes[fn] = FileHash{stamp, hash};
+  return hash;
+}
+
+TC_NAMESPACE_END
@@ -0,0 +1,117 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+#include <taichi/common/util.h>
+#include <taichi/common/dict.h>
+#include <taichi/common/interface.h>
+#include <taichi/system/statistics.h>
+#include <taichi/system/virtual_memory.h>
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <typeinfo>
+
+TC_NAMESPACE_BEGIN
+
+// Bytes held by |asset|, for the accounting of AssetCache. Interfaces that
+// know theirs overload this next to their declaration.
+template <typename T>
+std::size_t get_asset_memory_usage(const T &asset) {
+  return 0;
+}
+
+// Flyweight cache of initialized units, e.g. textures and materials:
+// create<T>(alias, config) returns the live asset of interface T made by
+// implementation |alias| from an identical config, if there is one, instead
+// of initializing another. Configs are compared by hash, with values that
+// name files hashed by the contents of the files, so that copies of the
+// same image in several directories are also loaded once. Assets are held
+// weakly, and shared assets must not be modified.
+//
+// Reported through Statistics: "asset_cache_hits", "asset_cache_misses",
+// "asset_cache_bytes_saved" (by the hits) and, with the other subsystems,
+// "memory/assets" (of the live cached assets).
+class AssetCache {
+ public:
+  template <typename T>
+  static std::shared_ptr<T> create(const std::string &alias,
+                                   const Config &config) {
+    AssetCache &cache = get_instance();
+    uint64 key = cache.get_key(typeid(T).name(), alias, config);
+    if (auto asset = cache.find<T>(key)) {
+      return asset;
+    }
+    // Initialized without the lock, as units may create assets of their own
+    std::shared_ptr<T> created = create_instance<T>(alias, config);
+    std::lock_guard<std::mutex> _(cache.mut);
+    // Unless another thread got there first
+    if (auto asset = cache.find_locked<T>(key)) {
+      return asset;
+    }
+    int64 bytes = (int64)get_asset_memory_usage(*created);
+    TC_STAT("asset_cache_misses", 1);
+    TC_MEMORY_ALLOCATED("assets", bytes);
+    // Shares ownership of |created|, to account for its release
+    std::shared_ptr<T> asset(created.get(), [created, bytes](T *) {
+      TC_MEMORY_FREED("assets", bytes);
+    });
+    cache.assets[key] = Entry{std::weak_ptr<void>(asset), bytes};
+    return asset;
+  }
+
+  // Of the file contents for config values that name files; rehashed only
+  // if the size or modification time of a file changes
+  uint64 get_key(const std::string &interface_name,
+                 const std::string &alias,
+                 const Config &config);
+
+  static AssetCache &get_instance();
+
+ private:
+  struct Entry {
+    std::weak_ptr<void> asset;
+    int64 bytes;
+  };
+
+  struct FileHash {
+    uint64 stamp;  // Size and modification time
+    uint64 hash;
+  };
+
+  std::mutex mut;
+  std::map<uint64, Entry> assets;
+  std::map<std::string, FileHash> file_hashes;
+
+  template <typename T>
+  std::shared_ptr<T> find(uint64 key) {
+    std::lock_guard<std::mutex> _(mut);
+    return find_locked<T>(key);
+  }
+
+  template <typename T>
+  std::shared_ptr<T> find_locked(uint64 key) {
+    auto it = assets.find(key);
+    if (it == assets.end()) {
+      return nullptr;
+    }
+    auto asset = it->second.asset.lock();
+    if (!asset) {
+      assets.erase(it);
+      return nullptr;
+    }
+    TC_STAT("asset_cache_hits", 1);
+    TC_STAT("asset_cache_bytes_saved", it->second.bytes);
+    return std::static_pointer_cast<T>(asset);
+  }
+
+  // 0 if |fn| is not a regular file
+  uint64 get_file_hash(const std::string &fn);
+};
+
+TC_NAMESPACE_END
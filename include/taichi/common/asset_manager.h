@@ -33,11 +33,15 @@ class AssetManager {
     return std::static_pointer_cast<T>(ptr.lock());
   }
 
+  // Assets shared through AssetCache may be inserted several times, and
+  // keep their id
   template <typename T>
   int insert_asset_(const std::shared_ptr<T> &ptr) {
     if (asset_to_id.find(ptr.get()) != asset_to_id.end()) {
       int existing_id = asset_to_id.find(ptr.get())->second;
-      TC_ASSERT_INFO(id_to_asset[existing_id].expired(), "Asset already exists");
+      if (!id_to_asset[existing_id].expired()) {
+        return existing_id;
+      }
       asset_to_id.erase(ptr.get());
       id_to_asset.erase(existing_id);
     }
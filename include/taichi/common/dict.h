@@ -5,7 +5,10 @@
 
 #pragma once
 
+#include <algorithm>
+#include <cmath>
 #include <map>
+#include <memory>
 #include <string>
 #include <cstdio>
 #include <iostream>
@@ -13,6 +16,7 @@
 #include <vector>
 #include <sstream>
 #include <typeinfo>
+#include <unordered_map>
 
 #include <taichi/math/math.h>
 #include "util.h"
@@ -25,75 +29,204 @@ TC_NAMESPACE_BEGIN
 #define TC_LOAD_CONFIG(name, default_val) \
   this->name = config.get(#name, default_val)
 
+// Values are typed and parsed once, when set: integers, numbers, booleans,
+// strings, vectors of up to 4 components, pointers, nested Dicts and
+// assets. get<T> converts between the kinds where the string form of the
+// value would have parsed, e.g. integers to numbers and numerical strings
+// to numbers, so that values from strings keep working.
 class Dict {
+ public:
+  struct Value {
+    enum class Kind {
+      string,
+      integer,
+      number,
+      boolean,
+      vector,
+      pointer,
+      dict,
+      asset
+    };
+    Kind kind = Kind::string;
+    // The string, or the type name of a pointer or an asset
+    std::string str;
+    // The integer, boolean (0, 1) or pointer address
+    int64 integer = 0;
+    float64 number = 0;
+    int dim = 0;
+    float64 vec[4];
+    // The nested Dict or the asset
+    std::shared_ptr<void> object;
+  };
+
  private:
-  std::map<std::string, std::string> data;
+  std::unordered_map<std::string, Value> data;
 
- public:
-  TC_IO_DEF(data);
+  const Value &get_value(const std::string &key) const {
+    auto it = data.find(key);
+    if (it == data.end()) {
+      TC_ERROR("No key named '{}' found.", key);
+    }
+    return it->second;
+  }
 
-  Dict() = default;
+  static Value make_value(Value::Kind kind) {
+    Value v;
+    v.kind = kind;
+    return v;
+  }
+
+  static Value make_value(bool val) {
+    Value v = make_value(Value::Kind::boolean);
+    v.integer = val;
+    return v;
+  }
 
   template <typename T>
-  Dict(const std::string &key, const T &value) {
-    this->set(key, value);
+  static std::enable_if_t<
+      std::is_integral<T>::value && !std::is_same<T, bool>::value,
+      Value>
+  make_value(T val) {
+    Value v = make_value(Value::Kind::integer);
+    v.integer = (int64)val;
+    return v;
   }
 
-  std::vector<std::string> get_keys() const {
-    std::vector<std::string> keys;
-    for (auto it = data.begin(); it != data.end(); ++it) {
-      keys.push_back(it->first);
+  template <typename T>
+  static std::enable_if_t<std::is_floating_point<T>::value, Value>
+  make_value(T val) {
+    Value v = make_value(Value::Kind::number);
+    v.number = val;
+    return v;
+  }
+
+  template <int N, typename T, InstSetExt ISE>
+  static std::enable_if_t<(N <= 4), Value> make_value(
+      const VectorND<N, T, ISE> &val) {
+    Value v = make_value(Value::Kind::vector);
+    v.dim = N;
+    for (int i = 0; i < N; i++) {
+      v.vec[i] = (float64)val[i];
     }
-    return keys;
+    return v;
   }
 
-  void clear() {
-    data.clear();
+  static Value make_value(const std::string &val) {
+    Value v;
+    v.str = val;
+    return v;
   }
 
-  template <typename V>
-  typename std::enable_if_t<(!type::is_VectorND<V>() &&
-                             !std::is_reference<V>::value &&
-                             !std::is_pointer<V>::value),
-                            V>
-  get(std::string key) const;
+  static Value make_value(const char *val) {
+    return make_value(std::string(val));
+  }
 
-  static bool is_string_integral(const std::string &str) {
-    // TODO: make it correct
-    if (str.find('.') != std::string::npos) {
-      return false;
-    }
-    if (str.find('e') != std::string::npos) {
-      return false;
-    }
-    if (str.find('E') != std::string::npos) {
-      return false;
+  static Value make_value(const Dict &val) {
+    Value v = make_value(Value::Kind::dict);
+    v.object = std::make_shared<Dict>(val);
+    return v;
+  }
+
+  template <typename T>
+  static Value make_value(T *const ptr) {
+    Value v = make_value(Value::Kind::pointer);
+    v.str = typeid(T).name();
+    v.integer = (int64) reinterpret_cast<uint64>(ptr);
+    return v;
+  }
+
+  template <typename T>
+  static Value make_value(const std::shared_ptr<T> &asset) {
+    Value v = make_value(Value::Kind::asset);
+    v.str = typeid(T).name();
+    v.object = asset;
+    return v;
+  }
+
+  // Anything else that can be written to a stream, as a string
+  template <typename T>
+  static std::enable_if_t<!std::is_arithmetic<T>::value &&
+                              !type::is_VectorND<T>() &&
+                              !std::is_convertible<T, std::string>::value,
+                          Value>
+  make_value(const T &val) {
+    std::stringstream ss;
+    ss << val;
+    return make_value(ss.str());
+  }
+
+  static std::string to_string(const Value &v) {
+    std::stringstream ss;
+    switch (v.kind) {
+      case Value::Kind::string:
+        return v.str;
+      case Value::Kind::integer:
+      case Value::Kind::boolean:
+        ss << v.integer;
+        break;
+      case Value::Kind::number:
+        ss << v.number;
+        break;
+      case Value::Kind::vector:
+        ss << "(";
+        for (int i = 0; i < v.dim; i++) {
+          ss << (i ? "," : "") << v.vec[i];
+        }
+        ss << ")";
+        break;
+      case Value::Kind::pointer:
+        ss << v.str << "\t" << v.integer;
+        break;
+      default:
+        TC_ERROR("Dicts and assets have no string form");
     }
-    return true;
+    return ss.str();
   }
 
-  void check_string_integral(const std::string &str) const {
-    if (!is_string_integral(str)) {
-      TC_ERROR(
-          "Getting integral value out of non-integral string '{}' is not "
-          "allowed.",
-          str);
+  float64 get_number(const std::string &key) const {
+    const Value &v = get_value(key);
+    switch (v.kind) {
+      case Value::Kind::number:
+        return v.number;
+      case Value::Kind::integer:
+      case Value::Kind::boolean:
+        return (float64)v.integer;
+      case Value::Kind::string:
+        return std::atof(v.str.c_str());
+      default:
+        TC_ERROR("Value of '{}' is not a number.", key);
     }
+    return 0;
   }
 
-  void check_value_integral(const std::string &key) const {
-    auto str = get_string(key);
-    check_string_integral(str);
+  int64 get_integer(const std::string &key) const {
+    const Value &v = get_value(key);
+    switch (v.kind) {
+      case Value::Kind::integer:
+      case Value::Kind::boolean:
+        return v.integer;
+      case Value::Kind::number:
+        if (v.number != std::floor(v.number)) {
+          TC_ERROR(
+              "Getting integral value out of non-integral number '{}' is "
+              "not allowed.",
+              v.number);
+        }
+        return (int64)v.number;
+      case Value::Kind::string:
+        check_string_integral(v.str);
+        return std::atoll(v.str.c_str());
+      default:
+        TC_ERROR("Value of '{}' is not an integer.", key);
+    }
+    return 0;
   }
 
-  template <
-      typename V,
-      typename std::enable_if<(type::is_VectorND<V>()), V>::type * = nullptr>
-  V get(std::string key) const {
+  // "(x,y)", "[x,y]" or "x,y"
+  template <typename V>
+  static V parse_vector(const std::string &str) {
     constexpr int N = V::dim;
     using T = typename V::ScalarType;
-
-    std::string str = this->get_string(key);
     std::string temp;
     if (str[0] == '(') {
       temp = "(";
@@ -151,16 +284,118 @@ class Dict {
     return ret;
   }
 
-  std::string get(std::string key, const char *default_val) const;
+ public:
+  // Serialized as strings, as before values were typed
+  TC_IO_DECL {
+    std::map<std::string, std::string> strings;
+    if (!TC_SERIALIZER_IS(BinaryInputSerializer)) {
+      for (auto &kv : data) {
+        strings[kv.first] = to_string(kv.second);
+      }
+    }
+    TC_IO(strings);
+    if (TC_SERIALIZER_IS(BinaryInputSerializer)) {
+      auto self = const_cast<Dict *>(this);
+      self->clear();
+      for (auto &kv : strings) {
+        self->set(kv.first, kv.second);
+      }
+    }
+  }
+
+  Dict() = default;
 
   template <typename T>
-  T get(std::string key, const T &default_val) const;
+  Dict(const std::string &key, const T &value) {
+    this->set(key, value);
+  }
 
-  bool has_key(std::string key) const {
+  // Sorted
+  std::vector<std::string> get_keys() const {
+    std::vector<std::string> keys;
+    for (auto it = data.begin(); it != data.end(); ++it) {
+      keys.push_back(it->first);
+    }
+    std::sort(keys.begin(), keys.end());
+    return keys;
+  }
+
+  void clear() {
+    data.clear();
+  }
+
+  template <typename V>
+  typename std::enable_if_t<(!type::is_VectorND<V>() &&
+                             !std::is_reference<V>::value &&
+                             !std::is_pointer<V>::value),
+                            V>
+  get(const std::string &key) const;
+
+  static bool is_string_integral(const std::string &str) {
+    // TODO: make it correct
+    if (str.find('.') != std::string::npos) {
+      return false;
+    }
+    if (str.find('e') != std::string::npos) {
+      return false;
+    }
+    if (str.find('E') != std::string::npos) {
+      return false;
+    }
+    return true;
+  }
+
+  static void check_string_integral(const std::string &str) {
+    if (!is_string_integral(str)) {
+      TC_ERROR(
+          "Getting integral value out of non-integral string '{}' is not "
+          "allowed.",
+          str);
+    }
+  }
+
+  void check_value_integral(const std::string &key) const {
+    get_integer(key);
+  }
+
+  template <
+      typename V,
+      typename std::enable_if<(type::is_VectorND<V>()), V>::type * = nullptr>
+  V get(const std::string &key) const {
+    constexpr int N = V::dim;
+    using T = typename V::ScalarType;
+    const Value &v = get_value(key);
+    if (v.kind == Value::Kind::string) {
+      return parse_vector<V>(v.str);
+    }
+    V ret;
+    if (v.kind == Value::Kind::vector) {
+      TC_ERROR_IF(v.dim < N, "Value of '{}' has {} components instead of {}.",
+                  key, v.dim, N);
+      for (int i = 0; i < N; i++) {
+        TC_ERROR_IF(std::is_integral<T>() && v.vec[i] != std::floor(v.vec[i]),
+                    "Getting integral vector out of non-integral '{}' is not "
+                    "allowed.",
+                    key);
+        ret[i] = (T)v.vec[i];
+      }
+    } else {
+      TC_ERROR_IF(N != 1, "Value of '{}' is not a vector.", key);
+      ret[0] = std::is_integral<T>() ? (T)get_integer(key) : (T)get_number(key);
+    }
+    return ret;
+  }
+
+  std::string get(const std::string &key, const char *default_val) const;
+
+  template <typename T>
+  T get(const std::string &key, const T &default_val) const;
+
+  bool has_key(const std::string &key) const {
     return data.find(key) != data.end();
   }
 
-  std::vector<std::string> get_string_arr(std::string key) const {
+  std::vector<std::string> get_string_arr(const std::string &key) const {
     std::string str = get_string(key);
     std::vector<std::string> strs = split_string(str, ",");
     for (auto &s : strs) {
@@ -170,13 +405,19 @@ class Dict {
   }
 
   template <typename T>
-  T *get_ptr(std::string key) const {
-    std::string val = get_string(key);
-    std::stringstream ss(val);
+  T *get_ptr(const std::string &key) const {
+    const Value &v = get_value(key);
     std::string t;
     int64 ptr_ll;
-    std::getline(ss, t, '\t');
-    ss >> ptr_ll;
+    if (v.kind == Value::Kind::pointer) {
+      t = v.str;
+      ptr_ll = v.integer;
+    } else {
+      // From get_ptr_string()
+      std::stringstream ss(get_string(key));
+      std::getline(ss, t, '\t');
+      ss >> ptr_ll;
+    }
     assert_info(t == typeid(T).name(),
                 "Pointer type mismatch: " + t + " and " + typeid(T).name());
     return reinterpret_cast<T *>(ptr_ll);
@@ -184,18 +425,18 @@ class Dict {
 
   template <typename T>
   std::enable_if_t<std::is_pointer<T>::value, std::remove_pointer_t<T>> get(
-      std::string key) const {
+      const std::string &key) const {
     return get_ptr<std::remove_pointer_t<T>>(key);
   }
 
   template <typename T>
   std::enable_if_t<std::is_reference<T>::value, std::remove_reference_t<T>>
-      &get(std::string key) const {
+      &get(const std::string &key) const {
     return *get_ptr<std::remove_reference_t<T>>(key);
   }
 
   template <typename T>
-  T *get_ptr(std::string key, T *default_value) const {
+  T *get_ptr(const std::string &key, T *default_value) const {
     if (has_key(key)) {
       return get_ptr<T>(key);
     } else {
@@ -203,66 +444,28 @@ class Dict {
     }
   }
 
+  // The asset set as a shared_ptr, or the one registered in AssetManager
+  // with the id of the value
   template <typename T>
-  std::shared_ptr<T> get_asset(std::string key) const {
+  std::shared_ptr<T> get_asset(const std::string &key) const {
+    const Value &v = get_value(key);
+    if (v.kind == Value::Kind::asset) {
+      assert_info(v.str == typeid(T).name(),
+                  "Asset type mismatch: " + v.str + " and " + typeid(T).name());
+      return std::static_pointer_cast<T>(v.object);
+    }
     int id = get<int>(key);
     return AssetManager::get_asset<T>(id);
   }
 
   template <typename T>
-  Dict &set(std::string name, T val) {
-    std::stringstream ss;
-    ss << val;
-    data[name] = ss.str();
-    return *this;
-  }
-
-  Dict &set(std::string name, const char *val) {
-    std::stringstream ss;
-    ss << val;
-    data[name] = ss.str();
-    return *this;
-  }
-
-  Dict &set(std::string name, const Vector2 &val) {
-    std::stringstream ss;
-    ss << "(" << val.x << "," << val.y << ")";
-    data[name] = ss.str();
-    return *this;
-  }
-
-  Dict &set(std::string name, const Vector3 &val) {
-    std::stringstream ss;
-    ss << "(" << val.x << "," << val.y << "," << val.z << ")";
-    data[name] = ss.str();
-    return *this;
-  }
-
-  Dict &set(std::string name, const Vector4 &val) {
-    std::stringstream ss;
-    ss << "(" << val.x << "," << val.y << "," << val.z << "," << val.w << ")";
-    data[name] = ss.str();
-    return *this;
-  }
-
-  Dict &set(std::string name, const Vector2i &val) {
-    std::stringstream ss;
-    ss << "(" << val.x << "," << val.y << ")";
-    data[name] = ss.str();
+  Dict &set(const std::string &name, T val) {
+    data[name] = make_value(val);
     return *this;
   }
 
-  Dict &set(std::string name, const Vector3i &val) {
-    std::stringstream ss;
-    ss << "(" << val.x << "," << val.y << "," << val.z << ")";
-    data[name] = ss.str();
-    return *this;
-  }
-
-  Dict &set(std::string name, const Vector4i &val) {
-    std::stringstream ss;
-    ss << "(" << val.x << "," << val.y << "," << val.z << "," << val.w << ")";
-    data[name] = ss.str();
+  Dict &set(const std::string &name, const char *val) {
+    data[name] = make_value(val);
     return *this;
   }
 
@@ -273,17 +476,8 @@ class Dict {
     return ss.str();
   }
 
-  template <typename T>
-  Dict &set(std::string name, T *const ptr) {
-    data[name] = get_ptr_string(ptr);
-    return *this;
-  }
-
-  std::string get_string(std::string key) const {
-    if (data.find(key) == data.end()) {
-      TC_ERROR("No key named '{}' found.", key);
-    }
-    return data.find(key)->second;
+  std::string get_string(const std::string &key) const {
+    return to_string(get_value(key));
   }
 
   template <typename T>
@@ -294,19 +488,28 @@ class Dict {
 };
 
 template <>
-inline std::string Dict::get<std::string>(std::string key) const {
+inline std::string Dict::get<std::string>(const std::string &key) const {
   return get_string(key);
 }
 
+template <>
+inline Dict Dict::get<Dict>(const std::string &key) const {
+  const Value &v = get_value(key);
+  TC_ERROR_IF(v.kind != Value::Kind::dict, "Value of '{}' is not a Dict.",
+              key);
+  return *std::static_pointer_cast<Dict>(v.object);
+}
+
 template <typename T>
-inline T Dict::get(std::string key, const T &default_val) const {
+inline T Dict::get(const std::string &key, const T &default_val) const {
   if (data.find(key) == data.end()) {
     return default_val;
   } else
     return get<T>(key);
 }
 
-inline std::string Dict::get(std::string key, const char *default_val) const {
+inline std::string Dict::get(const std::string &key,
+                             const char *default_val) const {
   if (data.find(key) == data.end()) {
     return default_val;
   } else
@@ -314,48 +517,56 @@ inline std::string Dict::get(std::string key, const char *default_val) const {
 }
 
 template <>
-inline float32 Dict::get<float32>(std::string key) const {
-  return (float32)std::atof(get_string(key).c_str());
+inline float32 Dict::get<float32>(const std::string &key) const {
+  return (float32)get_number(key);
 }
 
 template <>
-inline float64 Dict::get<float64>(std::string key) const {
-  return (float64)std::atof(get_string(key).c_str());
+inline float64 Dict::get<float64>(const std::string &key) const {
+  return get_number(key);
 }
 
 template <>
-inline int32 Dict::get<int32>(std::string key) const {
-  check_value_integral(key);
-  return std::atoi(get_string(key).c_str());
+inline int32 Dict::get<int32>(const std::string &key) const {
+  return (int32)get_integer(key);
 }
 
 template <>
-inline uint32 Dict::get<uint32>(std::string key) const {
-  check_value_integral(key);
-  return uint32(std::atoll(get_string(key).c_str()));
+inline uint32 Dict::get<uint32>(const std::string &key) const {
+  return uint32(get_integer(key));
 }
 
 template <>
-inline int64 Dict::get<int64>(std::string key) const {
-  check_value_integral(key);
-  return std::atoll(get_string(key).c_str());
+inline int64 Dict::get<int64>(const std::string &key) const {
+  return get_integer(key);
 }
 
 template <>
-inline uint64 Dict::get<uint64>(std::string key) const {
-  check_value_integral(key);
-  return std::stoull(get_string(key));
+inline uint64 Dict::get<uint64>(const std::string &key) const {
+  const Value &v = get_value(key);
+  if (v.kind == Value::Kind::string) {
+    check_string_integral(v.str);
+    return std::stoull(v.str);
+  }
+  return (uint64)get_integer(key);
 }
 
 template <>
-inline bool Dict::get<bool>(std::string key) const {
-  std::string s = get_string(key);
+inline bool Dict::get<bool>(const std::string &key) const {
+  const Value &v = get_value(key);
+  if (v.kind != Value::Kind::string) {
+    int64 i = get_integer(key);
+    assert_info(i == 0 || i == 1,
+                "Unkown identifer for bool: " + std::to_string(i));
+    return i == 1;
+  }
   static std::map<std::string, bool> dict{
       {"true", true},   {"True", true},   {"t", true},  {"1", true},
       {"false", false}, {"False", false}, {"f", false}, {"0", false},
   };
-  assert_info(dict.find(s) != dict.end(), "Unkown identifer for bool: " + s);
-  return dict[s];
+  auto it = dict.find(v.str);
+  assert_info(it != dict.end(), "Unkown identifer for bool: " + v.str);
+  return it->second;
 }
 
 using Config = Dict;
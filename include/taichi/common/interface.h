@@ -10,6 +10,8 @@
 #include <cstring>
 #include <string>
 #include <map>
+#include <unordered_map>
+#include <algorithm>
 #include <functional>
 #include <memory>
 #include <iostream>
@@ -123,63 +125,81 @@ class InterfaceHolder {
       this->name = name;                                                      \
     }                                                                         \
     using FactoryMethod = std::function<std::shared_ptr<T>()>;                \
-    using FactoryUniqueMethod = std::function<std::unique_ptr<T>()>;          \
-    using FactoryUniqueCtorMethod =                                           \
-        std::function<std::unique_ptr<T>(const Dict &config)>;                \
-    using FactoryRawMethod = std::function<T *()>;                            \
-    using FactoryPlacementMethod = std::function<T *(void *)>;                \
-    std::map<std::string, FactoryMethod> implementation_factories;            \
-    std::map<std::string, FactoryUniqueMethod>                                \
-        implementation_unique_factories;                                      \
-    std::map<std::string, FactoryUniqueCtorMethod>                            \
-        implementation_unique_ctor_factories;                                 \
-    std::map<std::string, FactoryRawMethod> implementation_raw_factories;     \
-    std::map<std::string, FactoryPlacementMethod>                             \
-        implementation_placement_factories;                                   \
+    /* Plain function pointers, so that registering at static             */  \
+    /* initialization time costs one hash table insertion per             */  \
+    /* implementation, without std::function allocations                  */  \
+    struct Factories {                                                        \
+      std::shared_ptr<T> (*create)();                                         \
+      std::unique_ptr<T> (*create_unique)();                                  \
+      std::unique_ptr<T> (*create_unique_ctor)(const Dict &config);           \
+      T *(*create_raw)();                                                     \
+      T *(*create_placement)(void *place);                                    \
+      /* Set by insert(alias, f) instead of the pointers above            */  \
+      FactoryMethod custom;                                                   \
+    };                                                                        \
+    std::unordered_map<std::string, Factories> implementations;               \
+    template <typename G>                                                     \
+    static std::shared_ptr<T> make_shared_instance() {                        \
+      return std::make_shared<G>();                                           \
+    }                                                                         \
+    template <typename G>                                                     \
+    static std::unique_ptr<T> make_unique_instance() {                        \
+      return std::make_unique<G>();                                           \
+    }                                                                         \
+    template <typename G>                                                     \
+    static std::unique_ptr<T> make_unique_ctor_instance(const Dict &config) { \
+      return std::make_unique<G>(config);                                     \
+    }                                                                         \
+    template <typename G>                                                     \
+    static T *make_raw_instance() {                                           \
+      return new G();                                                         \
+    }                                                                         \
+    template <typename G>                                                     \
+    static T *make_placement_instance(void *place) {                          \
+      return new (place) G();                                                 \
+    }                                                                         \
+    template <typename G>                                                     \
+    static Factories factories_of() {                                         \
+      return Factories{&make_shared_instance<G>, &make_unique_instance<G>,    \
+                       nullptr, &make_raw_instance<G>,                        \
+                       &make_placement_instance<G>, nullptr};                 \
+    }                                                                         \
+    const Factories &get_factories(const std::string &alias) const {          \
+      auto it = implementations.find(alias);                                  \
+      assert_info(it != implementations.end(),                                \
+                  "Implementation [" + name + "::" + alias + "] not found!"); \
+      return it->second;                                                      \
+    }                                                                         \
     std::vector<std::string> get_implementation_names() const override {      \
       std::vector<std::string> names;                                         \
-      for (auto &kv : implementation_factories) {                             \
+      for (auto &kv : implementations) {                                      \
         names.push_back(kv.first);                                            \
       }                                                                       \
+      std::sort(names.begin(), names.end());                                  \
       return names;                                                           \
     }                                                                         \
     template <typename G>                                                     \
     void insert(const std::string &alias) {                                   \
-      implementation_factories.insert(                                        \
-          std::make_pair(alias, [&]() { return std::make_shared<G>(); }));    \
-      implementation_unique_factories.insert(                                 \
-          std::make_pair(alias, [&]() { return std::make_unique<G>(); }));    \
-      implementation_raw_factories.insert(                                    \
-          std::make_pair(alias, [&]() { return new G(); }));                  \
-      implementation_placement_factories.insert(std::make_pair(               \
-          alias, [&](void *place) { return new (place) G(); }));              \
+      implementations.insert(std::make_pair(alias, factories_of<G>()));       \
     }                                                                         \
     template <typename G>                                                     \
     void insert_new(const std::string &alias) {                               \
       /*with ctor*/                                                           \
-      implementation_factories.insert(                                        \
-          std::make_pair(alias, [&]() { return std::make_shared<G>(); }));    \
-      implementation_unique_factories.insert(                                 \
-          std::make_pair(alias, [&]() { return std::make_unique<G>(); }));    \
-      implementation_unique_ctor_factories.insert(std::make_pair(             \
-          alias,                                                              \
-          [&](const Dict &config) { return std::make_unique<G>(config); }));  \
-      implementation_raw_factories.insert(                                    \
-          std::make_pair(alias, [&]() { return new G(); }));                  \
-      implementation_placement_factories.insert(std::make_pair(               \
-          alias, [&](void *place) { return new (place) G(); }));              \
+      Factories factories = factories_of<G>();                                \
+      factories.create_unique_ctor = &make_unique_ctor_instance<G>;           \
+      implementations.insert(std::make_pair(alias, factories));               \
     }                                                                         \
     void insert(const std::string &alias, const FactoryMethod &f) {           \
-      implementation_factories.insert(std::make_pair(alias, f));              \
+      Factories factories{nullptr, nullptr, nullptr, nullptr, nullptr, f};    \
+      implementations.insert(std::make_pair(alias, factories));               \
     }                                                                         \
     bool has(const std::string &alias) const override {                       \
-      return implementation_factories.find(alias) !=                          \
-             implementation_factories.end();                                  \
+      return implementations.find(alias) != implementations.end();            \
     }                                                                         \
     void remove(const std::string &alias) override {                          \
       assert_info(has(alias),                                                 \
                   std::string("Implemetation ") + alias + " not found!");     \
-      implementation_factories.erase(alias);                                  \
+      implementations.erase(alias);                                           \
     }                                                                         \
     void update(const std::string &alias, const FactoryMethod &f) {           \
       if (has(alias)) {                                                       \
@@ -195,35 +215,33 @@ class InterfaceHolder {
       insert<G>(alias);                                                       \
     }                                                                         \
     std::shared_ptr<T> create(const std::string &alias) {                     \
-      auto factory = implementation_factories.find(alias);                    \
-      assert_info(factory != implementation_factories.end(),                  \
-                  "Implementation [" + name + "::" + alias + "] not found!"); \
-      return (factory->second)();                                             \
+      auto &factories = get_factories(alias);                                 \
+      if (factories.custom) {                                                 \
+        return factories.custom();                                            \
+      }                                                                       \
+      return factories.create();                                              \
     }                                                                         \
     std::unique_ptr<T> create_unique(const std::string &alias) {              \
-      auto factory = implementation_unique_factories.find(alias);             \
-      assert_info(factory != implementation_unique_factories.end(),           \
-                  "Implementation [" + name + "::" + alias + "] not found!"); \
-      return (factory->second)();                                             \
+      return get_method(alias, &Factories::create_unique)();                  \
     }                                                                         \
     std::unique_ptr<T> create_unique_ctor(const std::string &alias,           \
                                           const Dict &config) {               \
-      auto factory = implementation_unique_ctor_factories.find(alias);        \
-      assert_info(factory != implementation_unique_ctor_factories.end(),      \
-                  "Implementation [" + name + "::" + alias + "] not found!"); \
-      return (factory->second)(config);                                       \
+      return get_method(alias, &Factories::create_unique_ctor)(config);       \
     }                                                                         \
     T *create_raw(const std::string &alias) {                                 \
-      auto factory = implementation_raw_factories.find(alias);                \
-      assert_info(factory != implementation_raw_factories.end(),              \
-                  "Implementation [" + name + "::" + alias + "] not found!"); \
-      return (factory->second)();                                             \
+      return get_method(alias, &Factories::create_raw)();                     \
     }                                                                         \
     T *create_placement(const std::string &alias, void *place) {              \
-      auto factory = implementation_placement_factories.find(alias);          \
-      assert_info(factory != implementation_placement_factories.end(),        \
+      return get_method(alias, &Factories::create_placement)(place);          \
+    }                                                                         \
+    /* Implementations registered with a custom factory, or without a     */  \
+    /* config constructor, lack some of the methods                       */  \
+    template <typename F>                                                     \
+    F get_method(const std::string &alias, F Factories::*method) const {      \
+      F f = get_factories(alias).*method;                                     \
+      assert_info(f != nullptr,                                               \
                   "Implementation [" + name + "::" + alias + "] not found!"); \
-      return (factory->second)(place);                                        \
+      return f;                                                               \
     }                                                                         \
     static TC_IMPLEMENTATION_HOLDER_NAME(T) * get_instance() {                \
       return static_cast<TC_IMPLEMENTATION_HOLDER_NAME(T) *>(                 \
@@ -11,6 +11,7 @@
 #include <unordered_map>
 #include <vector>
 #include <memory>
+#include <cstdint>
 #include <cstring>
 #include <cassert>
 #include <iostream>
@@ -37,6 +38,17 @@ TC_EXPORT std::unique_ptr<T> create_instance_unique(const std::string &alias);
 
 class Unit;
 
+class BinaryFileStreamOutput;
+class BinaryFileStreamInput;
+
+// Of the .tcbs streams of taichi/io/binary_stream.h
+void write_stream_bytes(BinaryFileStreamOutput *stream,
+                        const void *data,
+                        std::size_t size);
+void read_stream_bytes(BinaryFileStreamInput *stream,
+                       void *data,
+                       std::size_t size);
+
 namespace type {
 
 template <typename T>
@@ -176,6 +188,21 @@ class Serializer {
   };
 };
 
+// True if the binary serialization of T is exactly its bytes in memory, so
+// that arrays of T are copied in bulk: trivially copyable types without
+// io(), which go through memcpy anyway. Types with io() that write all of
+// their bytes, and nothing else, may opt in by specializing this.
+template <typename T>
+struct is_bytewise_serializable
+    : std::integral_constant<bool,
+                             std::is_trivially_copyable<T>::value &&
+                                 !Serializer::has_io<T>::value &&
+                                 !std::is_pointer<T>::value> {};
+
+// Serialized as first and second, without their padding
+template <typename T, typename G>
+struct is_bytewise_serializable<std::pair<T, G>> : std::false_type {};
+
 inline std::vector<uint8> read_data_from_file(const std::string &fn) {
   std::vector<uint8_t> data;
   std::FILE *f = fopen(fn.c_str(), "rb");
@@ -229,8 +256,13 @@ inline void write_data_to_file(const std::string &fn, uint8_t *data, std::size_t
 template <bool writing>
 class BinarySerializer : public Serializer {
  public:
+  using Stream = typename std::
+      conditional<writing, BinaryFileStreamOutput, BinaryFileStreamInput>::type;
+
   std::vector<uint8_t> data;
   uint8_t *c_data;
+  // If not null, values go to or come from this instead of |data|
+  Stream *stream = nullptr;
 
   std::size_t head;
   std::size_t preserved;
@@ -246,7 +278,17 @@ class BinarySerializer : public Serializer {
     head = sizeof(std::size_t);
   }
 
+  // Values go to, or come from, |stream| as they are serialized; the
+  // serializer keeps no data.
+  void initialize(Stream &stream) {
+    this->stream = &stream;
+    this->c_data = nullptr;
+    head = 0;
+    preserved = 0;
+  }
+
   void write_to_file(const std::string &fn) {
+    TC_ASSERT(stream == nullptr);
     void *ptr = c_data;
     if (!ptr) {
       assert(!data.empty());
@@ -292,6 +334,9 @@ class BinarySerializer : public Serializer {
   }
 
   void finalize() {
+    if (stream) {
+      return;
+    }
     if (writing) {
       if (c_data) {
         *reinterpret_cast<std::size_t *>(&c_data[0]) = head;
@@ -316,9 +361,49 @@ class BinarySerializer : public Serializer {
     }
   }
 
+  // |size| bytes at |ptr|, which are read into it when not writing
+  void serialize_bytes(void *ptr, std::size_t size) {
+    if (size == 0) {
+      return;
+    }
+    if (stream) {
+      stream_bytes(stream, ptr, size);
+    } else if (writing) {
+      std::size_t new_size = head + size;
+      if (c_data) {
+        if (new_size > preserved) {
+          TC_CRITICAL("Preserved Buffer (size {}) Overflow.", preserved);
+        }
+        std::memcpy(&c_data[head], ptr, size);
+      } else {
+        data.resize(new_size);
+        std::memcpy(&data[head], ptr, size);
+      }
+    } else {
+      std::memcpy(ptr, &c_data[head], size);
+    }
+    head += size;
+  }
+
+  // Arrays of types that are serialized as their bytes take one copy
+  template <typename T>
+  using is_bulk =
+      std::integral_constant<bool,
+                             is_bytewise_serializable<T>::value &&
+                                 !std::is_same<T, bool>::value>;
+
   // C-array
   template <typename T, std::size_t n>
-  void operator()(const char *, const TArray<T, n> &val) {
+  typename std::enable_if<is_bulk<T>::value, void>::type operator()(
+      const char *,
+      const TArray<T, n> &val) {
+    serialize_bytes(const_cast<T *>(val), sizeof(T) * n);
+  }
+
+  template <typename T, std::size_t n>
+  typename std::enable_if<!is_bulk<T>::value, void>::type operator()(
+      const char *,
+      const TArray<T, n> &val) {
     if (writing) {
       for (std::size_t i = 0; i < n; i++) {
         this->operator()("", val[i]);
@@ -347,28 +432,7 @@ class BinarySerializer : public Serializer {
     static_assert(!std::is_const<T>::value, "T cannot be const");
     static_assert(!std::is_volatile<T>::value, "T cannot be volatile");
     static_assert(!std::is_pointer<T>::value, "T cannot be pointer");
-    if (writing) {
-      std::size_t new_size = head + sizeof(T);
-      if (c_data) {
-        if (new_size > preserved) {
-          TC_CRITICAL("Preserved Buffer (size {}) Overflow.", preserved);
-        }
-        //*reinterpret_cast<typename type::remove_cvref_t<T> *>(&c_data[head]) =
-        //    val;
-        std::memcpy(&c_data[head], &val, sizeof(T));
-      } else {
-        data.resize(new_size);
-        //*reinterpret_cast<typename type::remove_cvref_t<T> *>(&data[head]) =
-        //    val;
-        std::memcpy(&data[head], &val, sizeof(T));
-      }
-    } else {
-      // get_writable(val) =
-      //    *reinterpret_cast<typename std::remove_reference<T>::type *>(
-      //        &c_data[head]);
-      std::memcpy(&get_writable(val), &c_data[head], sizeof(T));
-    }
-    head += sizeof(T);
+    serialize_bytes(&get_writable(val), sizeof(T));
   }
 
   template <typename T>
@@ -402,6 +466,18 @@ class BinarySerializer : public Serializer {
     }
   }
 
+  static void stream_bytes(BinaryFileStreamOutput *stream,
+                           void *data,
+                           std::size_t size) {
+    write_stream_bytes(stream, data, size);
+  }
+
+  static void stream_bytes(BinaryFileStreamInput *stream,
+                           void *data,
+                           std::size_t size) {
+    read_stream_bytes(stream, data, size);
+  }
+
   template <typename T>
   std::size_t ptr_to_int(T *t) {
     return reinterpret_cast<std::size_t>(t);
@@ -460,8 +536,8 @@ class BinarySerializer : public Serializer {
   }
 
   // std::vector
-  template <typename T>
-  void operator()(const char *, const std::vector<T> &val_) {
+  template <typename T, typename A>
+  void operator()(const char *, const std::vector<T, A> &val_) {
     auto &val = get_writable(val_);
     if (writing) {
       this->operator()("", val.size());
@@ -470,18 +546,41 @@ class BinarySerializer : public Serializer {
       this->operator()("", n);
       val.resize(n);
     }
-    /*
-    for (std::size_t i = 0; i < val.size(); i++) {
-      printf("i %d\n", i);
-      printf("val %d\n", val[i]);
-    }
+    serialize_elements(val, is_bulk<T>());
+  }
+
+  template <typename T, typename A>
+  void serialize_elements(std::vector<T, A> &val, std::true_type) {
+    serialize_bytes(val.data(), sizeof(T) * val.size());
+  }
 
-     */
+  template <typename T, typename A>
+  void serialize_elements(std::vector<T, A> &val, std::false_type) {
     for (std::size_t i = 0; i < val.size(); i++) {
       this->operator()("", val[i]);
     }
   }
 
+  // Zero-copy read of a std::vector<T> of bytewise serializable T from an
+  // in-memory buffer (e.g. a MappedFile): returns its elements where they
+  // are, valid as long as the buffer, and sets |n| to their number. If they
+  // are not aligned for T there, they are copied to |copy| instead.
+  template <typename T>
+  const T *read_view(std::size_t &n, std::vector<T> &copy) {
+    static_assert(!writing, "Views are read");
+    static_assert(is_bulk<T>::value, "T must be bytewise serializable");
+    TC_ASSERT(stream == nullptr);
+    this->operator()("", n);
+    const uint8_t *ptr = &c_data[head];
+    head += sizeof(T) * n;
+    if ((uintptr_t)ptr % alignof(T) == 0) {
+      return reinterpret_cast<const T *>(ptr);
+    }
+    copy.resize(n);
+    std::memcpy((void *)copy.data(), ptr, sizeof(T) * n);
+    return copy.data();
+  }
+
   // std::pair
   template <typename T, typename G>
   void operator()(const char *, const std::pair<T, G> &val) {
@@ -675,8 +774,8 @@ class TextSerializer : public Serializer {
     add_line("}");
   }
 
-  template <typename T>
-  void operator()(const char *key, const std::vector<T> &val) {
+  template <typename T, typename A>
+  void operator()(const char *key, const std::vector<T, A> &val) {
     add_line(key, "[");
     indent++;
     for (std::size_t i = 0; i < val.size(); i++) {
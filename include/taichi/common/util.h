@@ -22,6 +22,7 @@
 #include <memory>
 #include <csignal>
 #include <vector>
+#include <atomic>
 
 //******************************************************************************
 //                                 System State
@@ -208,6 +209,16 @@ using uint64 = uint64_t;
 #define TC_FORCE_INLINE inline __attribute__((always_inline))
 #endif
 
+// Hot kernels of portable builds (TC_PORTABLE) are also compiled for
+// AVX-512, and the clone for the CPU is selected when the library is loaded.
+// Elsewhere the build targets a single instruction set.
+#if defined(TC_PORTABLE) && defined(TC_PLATFORM_LINUX) && \
+    defined(__GNUC__) && !defined(__clang__) && !defined(__AVX512F__)
+#define TC_MULTIVERSIONED __attribute__((target_clones("avx512f", "default")))
+#else
+#define TC_MULTIVERSIONED
+#endif
+
 using float32 = float;
 using float64 = double;
 
@@ -334,6 +345,25 @@ TC_NAMESPACE_BEGIN
     TC_CRITICAL(__VA_ARGS__);              \
   }
 
+// Rate-limited logging, e.g. for warnings inside loops. The state is kept
+// per call site, and neither formats anything when it does not log.
+#define TC_WARN_ONCE(...)                                   \
+  {                                                         \
+    static std::atomic<bool> _logged(false);                \
+    if (!_logged.load(std::memory_order_relaxed) &&         \
+        !_logged.exchange(true, std::memory_order_relaxed)) \
+      TC_WARN(__VA_ARGS__);                                 \
+  }
+
+// Logs the 1st, (n+1)-th, (2n+1)-th... time, at level X (trace, debug,
+// info or warn)
+#define TC_LOG_EVERY_N(X, n, ...)                                      \
+  {                                                                    \
+    static std::atomic<taichi::int64> _count(0);                       \
+    if (_count.fetch_add(1, std::memory_order_relaxed) % (n) == 0)     \
+      SPD_AUGMENTED_LOG(X, __VA_ARGS__);                               \
+  }
+
 #define TC_STOP TC_ERROR("Stopping here")
 #define TC_TAG TC_TRACE("Tagging here")
 
@@ -344,6 +374,7 @@ TC_NAMESPACE_BEGIN
 
 class Logger {
   std::shared_ptr<spdlog::logger> console;
+  bool async;
 
  public:
   Logger();
@@ -355,6 +386,14 @@ class Logger {
   void critical(const std::string &s, bool raise_signal = true);
   void flush();
   void set_level(const std::string &level);
+  // In the asynchronous mode, messages go to a bounded lock-free queue,
+  // and a background thread formats them with the pattern and writes them
+  // out, so that the logging threads do not wait on the terminal. Waits
+  // for the messages logged before; call it while no other thread logs.
+  void set_async(bool async, std::size_t queue_size = 8192);
+  bool is_async() const {
+    return async;
+  }
 };
 
 extern Logger logger;
@@ -364,6 +403,17 @@ namespace zip {
 void write(std::string fn, const uint8 *data, std::size_t len);
 void write(const std::string &fn, const std::string &data);
 std::vector<uint8> read(const std::string fn, bool verbose = false);
+// Raw zlib stream (as zlib's compress2), e.g. for PNG and EXR data
+std::vector<uint8> zlib_compress(const uint8 *data,
+                                 std::size_t len,
+                                 int level = 6);
+// Inverse of zlib_compress, into |output| of the uncompressed size
+void zlib_uncompress(const uint8 *data,
+                     std::size_t len,
+                     uint8 *output,
+                     std::size_t output_len);
+// CRC-32 of |data|, continuing from |crc| (0 to start)
+uint32 crc32_checksum(uint32 crc, const uint8 *data, std::size_t len);
 
 }  // namespace zip
 
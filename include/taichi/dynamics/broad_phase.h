@@ -0,0 +1,131 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+#include <taichi/common/util.h>
+#include <taichi/math/math.h>
+#include <taichi/system/threading.h>
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+TC_NAMESPACE_BEGIN
+
+// Sweep and prune broad phase [Cohen et al. 1995]: boxes are sorted by
+// their lower bound along the axis where the boxes spread most, and every
+// box is tested against the following ones until their lower bound passes
+// its upper bound. The order is kept between updates and repaired by
+// insertion sort, which is close to linear for coherent motion. The sweep
+// runs in parallel over blocks of the order.
+template <int dim>
+class SweepAndPrune {
+ public:
+  using Vector = VectorND<dim, real>;
+  using Pair = std::pair<int, int>;
+
+  explicit SweepAndPrune(int num_threads = -1)
+      : num_threads(num_threads), axis(-1) {
+  }
+
+  // Sets |pairs| to the pairs (i, j), i < j, of overlapping boxes
+  // [lower[i], upper[i]], in an order independent of the threads
+  void update(const std::vector<Vector> &lower,
+              const std::vector<Vector> &upper,
+              std::vector<Pair> &pairs) {
+    TC_ASSERT_INFO(lower.size() == upper.size(),
+                   "lower and upper must have the same size");
+    int n = (int)lower.size();
+    update_order(lower);
+
+    keys.resize(n);
+    for (int k = 0; k < n; k++) {
+      keys[k] = lower[order[k]][axis];
+    }
+    int num_blocks = (n + block_size - 1) / block_size;
+    block_pairs.resize(num_blocks);
+    ThreadedTaskManager::run(num_blocks, num_threads, [&](int b) {
+      std::vector<Pair> &found = block_pairs[b];
+      found.clear();
+      int end = std::min(n, (b + 1) * block_size);
+      for (int k = b * block_size; k < end; k++) {
+        int i = order[k];
+        real limit = upper[i][axis];
+        for (int m = k + 1; m < n && keys[m] <= limit; m++) {
+          int j = order[m];
+          bool overlap = true;
+          for (int d = 0; d < dim; d++) {
+            overlap = overlap && lower[i][d] <= upper[j][d] &&
+                      lower[j][d] <= upper[i][d];
+          }
+          if (overlap) {
+            found.push_back(std::make_pair(std::min(i, j), std::max(i, j)));
+          }
+        }
+      }
+    });
+    pairs.clear();
+    for (auto &found : block_pairs) {
+      pairs.insert(pairs.end(), found.begin(), found.end());
+    }
+  }
+
+  int get_axis() const {
+    return axis;
+  }
+
+ private:
+  static constexpr int block_size = 1024;
+  int num_threads;
+  // The sweep axis, and the boxes sorted by their lower bound along it
+  int axis;
+  std::vector<int> order;
+  std::vector<real> keys;
+  std::vector<std::vector<Pair>> block_pairs;
+
+  // Picks the axis of largest variance of the lower bounds; it only
+  // changes when another axis spreads much more, to keep the order
+  void update_order(const std::vector<Vector> &lower) {
+    int n = (int)lower.size();
+    Vector mean(0.0_f), mean2(0.0_f);
+    for (auto &l : lower) {
+      mean += l;
+      mean2 += l * l;
+    }
+    real inv_n = 1.0_f / std::max(n, 1);
+    Vector variance = mean2 * inv_n - mean * mean * sqr(inv_n);
+    int best = 0;
+    for (int d = 1; d < dim; d++) {
+      if (variance[d] > variance[best]) {
+        best = d;
+      }
+    }
+    if ((int)order.size() != n || axis < 0 ||
+        variance[best] > 2 * variance[axis]) {
+      axis = best;
+      order.resize(n);
+      for (int i = 0; i < n; i++) {
+        order[i] = i;
+      }
+      std::sort(order.begin(), order.end(), [&](int a, int b) {
+        return lower[a][axis] < lower[b][axis];
+      });
+      return;
+    }
+    for (int k = 1; k < n; k++) {
+      int i = order[k];
+      real key = lower[i][axis];
+      int m = k - 1;
+      while (m >= 0 && lower[order[m]][axis] > key) {
+        order[m + 1] = order[m];
+        m--;
+      }
+      order[m + 1] = i;
+    }
+  }
+};
+
+TC_NAMESPACE_END
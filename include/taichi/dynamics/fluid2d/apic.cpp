@@ -23,15 +23,19 @@ void APICLiquid::initialize_solver(const Config &config) {
 }
 
 void APICLiquid::rasterize() {
-  rasterize_component<Particle::get_affine_velocity<0>>(u, u_count);
-  rasterize_component<Particle::get_affine_velocity<1>>(v, v_count);
+  rasterize_component<0, true>(u, u_count);
+  rasterize_component<1, true>(v, v_count);
 }
 
 void APICLiquid::sample_c() {
-  for (auto &p : particles) {
-    p.c[0] = apic_blend * sample_c(p.position, u);
-    p.c[1] = apic_blend * sample_c(p.position, v);
-  }
+  ThreadedTaskManager::run(particle_arrays.size(), num_threads, [&](int i) {
+    Vector2 position = particle_arrays.get_position(i);
+    Vector2 c[2] = {sample_c(position, u), sample_c(position, v)};
+    for (int k = 0; k < 2; k++) {
+      particle_arrays.c[k][0][i] = apic_blend * c[k].x;
+      particle_arrays.c[k][1][i] = apic_blend * c[k].y;
+    }
+  });
 }
 
 Vector2 APICLiquid::sample_c(Vector2 &pos, Array<real> &val) {
@@ -48,6 +52,7 @@ Vector2 APICLiquid::sample_c(Vector2 &pos, Array<real> &val) {
 
 void APICLiquid::substep(real delta_t) {
   Time::Timer _("substep");
+  sort_particles();
   apply_external_forces(delta_t);
   mark_cells();
   rasterize();
@@ -57,6 +62,7 @@ void APICLiquid::substep(real delta_t) {
     advect_liquid_levelset(delta_t);
   }
   simple_extrapolate();
+  apply_viscosity(delta_t);
   TIME(project(delta_t));
   simple_extrapolate();
   apply_boundary_condition();
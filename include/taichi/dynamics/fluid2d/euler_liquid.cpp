@@ -5,6 +5,10 @@
 
 #include <taichi/common/util.h>
 #include "euler_liquid.h"
+#include <taichi/math/array_parallel.h>
+#include <taichi/math/array_sample.h>
+#include <taichi/math/sparse.h>
+#include <taichi/system/statistics.h>
 
 TC_NAMESPACE_BEGIN
 
@@ -38,7 +42,38 @@ void EulerLiquid::initialize_solver(const Config &config) {
   maximum_iterations = config.get("maximum_iterations", 300);
   tolerance = config.get("tolerance", 1e-4f);
   theta_threshold = config.get("theta_threshold", 0.1f);
+  num_threads = config.get("num_threads", -1);
+  extrapolation_layers = config.get("extrapolation_layers", 1);
+  viscosity = config.get("viscosity", 0.0_f);
+  std::string viscosity_solver = config.get("viscosity_solver", "implicit");
+  TC_ERROR_IF(viscosity_solver != "implicit" && viscosity_solver != "explicit",
+              "'viscosity_solver' has to be 'implicit' or 'explicit' instead "
+              "of {}",
+              viscosity_solver);
+  implicit_viscosity = viscosity_solver == "implicit";
+  viscosity_tolerance = config.get("viscosity_tolerance", 1e-6_f);
   initialize_pressure_solver();
+  std::string pressure_solver = config.get("pressure_solver", "mic");
+  assert_info(pressure_solver == "mic" || pressure_solver == "mgpcg",
+              "'pressure_solver' has to be 'mic' or 'mgpcg' instead of " +
+                  pressure_solver);
+  if (pressure_solver == "mgpcg") {
+    auto multigrid_solver = config.get("multigrid_solver", std::string("mg"));
+    multigrid = create_instance<PoissonSolver2D>(multigrid_solver);
+    Config cfg;
+    cfg.set("res", Vector2i(width, height))
+        .set("num_threads", num_threads)
+        .set("padding", "neumann");
+    multigrid->initialize(cfg);
+    TC_ERROR_IF(!multigrid->is_multigrid(),
+                "'multigrid_solver' {} cannot precondition 'mgpcg': it has "
+                "no multigrid cycles",
+                multigrid_solver);
+    multigrid_boundary = PoissonSolver2D::BCArray(Vector2i(width, height));
+    multigrid_diagonal = Array<real>(Vector2i(width, height));
+  } else {
+    multigrid = nullptr;
+  }
   liquid_levelset.initialize(Vector2i(width, height), Vector2(0.5f, 0.5f));
   t = 0;
 }
@@ -132,46 +167,104 @@ void EulerLiquid::level_set_extrapolate() {
   //}
 }
 
-void EulerLiquid::simple_extrapolate() {
+template <typename Active>
+void EulerLiquid::extrapolate_faces(Array<real> &f,
+                                    Vector2i begin,
+                                    Vector2i end,
+                                    const Active &active) {
   const int dx[4]{1, -1, 0, 0};
   const int dy[4]{0, 0, 1, -1};
-  for (int i = 1; i < width; i++) {
-    for (int j = 0; j < height; j++) {
-      if (check_u_activity(i, j))
+  enum : uint8 { UNKNOWN, KNOWN, FRONT, OUTSIDE };
+  Vector2i res = end - begin;
+  if (res.x <= 0 || res.y <= 0) {
+    return;
+  }
+  // Of the faces in [begin, end), column by column
+  std::vector<uint8> state((std::size_t)res.x * res.y);
+  auto get_state = [&](int i, int j) -> uint8 {
+    if (i < begin.x || j < begin.y || i >= end.x || j >= end.y) {
+      return OUTSIDE;
+    }
+    return state[(i - begin.x) * res.y + (j - begin.y)];
+  };
+  ThreadedTaskManager::run(res.x, num_threads, [&](int c) {
+    for (int j = begin.y; j < end.y; j++) {
+      state[c * res.y + j - begin.y] = active(begin.x + c, j) ? KNOWN : UNKNOWN;
+    }
+  });
+  // The first front, gathered by column and concatenated in order
+  std::vector<std::vector<int>> column_fronts(res.x);
+  ThreadedTaskManager::run(res.x, num_threads, [&](int c) {
+    int i = begin.x + c;
+    for (int j = begin.y; j < end.y; j++) {
+      if (get_state(i, j) != UNKNOWN) {
         continue;
-      real sum = 0.0_f, num = 0.0_f;
+      }
       for (int k = 0; k < 4; k++) {
-        int nx = i + dx[k], ny = j + dy[k];
-        if (check_u_activity(nx, ny)) {
-          num += 1.0_f;
-          sum += u[nx][ny];
+        if (get_state(i + dx[k], j + dy[k]) == KNOWN) {
+          column_fronts[c].push_back(c * res.y + j - begin.y);
+          break;
         }
       }
-      if (num == 0.0_f)
-        u[i][j] = 0.0_f;
-      else
-        u[i][j] = sum / num;
     }
+  });
+  std::vector<int> front;
+  for (auto &column_front : column_fronts) {
+    front.insert(front.end(), column_front.begin(), column_front.end());
   }
-  for (int i = 0; i < width; i++) {
-    for (int j = 1; j < height; j++) {
-      if (check_v_activity(i, j))
-        continue;
+  for (int index : front) {
+    state[index] = FRONT;
+  }
+  std::vector<real> values;
+  std::vector<int> next_front;
+  for (int layer = 0; layer < extrapolation_layers && !front.empty();
+       layer++) {
+    // Reads known faces only, which this layer does not write
+    values.resize(front.size());
+    ThreadedTaskManager::run((int)front.size(), num_threads, [&](int l) {
+      int i = begin.x + front[l] / res.y, j = begin.y + front[l] % res.y;
       real sum = 0.0_f, num = 0.0_f;
       for (int k = 0; k < 4; k++) {
         int nx = i + dx[k], ny = j + dy[k];
-        if (check_v_activity(nx, ny)) {
+        if (get_state(nx, ny) == KNOWN) {
           num += 1.0_f;
-          sum += v[nx][ny];
+          sum += f[nx][ny];
         }
       }
-      if (num == 0.0_f)
-        v[i][j] = 0.0_f;
-      else {
-        v[i][j] = sum / num;
+      values[l] = sum / num;
+    });
+    for (int l = 0; l < (int)front.size(); l++) {
+      f[begin.x + front[l] / res.y][begin.y + front[l] % res.y] = values[l];
+      state[front[l]] = KNOWN;
+    }
+    next_front.clear();
+    for (int index : front) {
+      int i = begin.x + index / res.y, j = begin.y + index % res.y;
+      for (int k = 0; k < 4; k++) {
+        int nx = i + dx[k], ny = j + dy[k];
+        if (get_state(nx, ny) == UNKNOWN) {
+          int neighbour = (nx - begin.x) * res.y + (ny - begin.y);
+          state[neighbour] = FRONT;
+          next_front.push_back(neighbour);
+        }
       }
     }
+    std::swap(front, next_front);
   }
+  ThreadedTaskManager::run(res.x, num_threads, [&](int c) {
+    for (int j = begin.y; j < end.y; j++) {
+      if (state[c * res.y + j - begin.y] != KNOWN) {
+        f[begin.x + c][j] = 0.0_f;
+      }
+    }
+  });
+}
+
+void EulerLiquid::simple_extrapolate() {
+  extrapolate_faces(u, Vector2i(1, 0), Vector2i(width, height),
+                    [&](int i, int j) { return check_u_activity(i, j); });
+  extrapolate_faces(v, Vector2i(0, 1), Vector2i(width, height),
+                    [&](int i, int j) { return check_v_activity(i, j); });
 }
 
 void EulerLiquid::step(real delta_t) {
@@ -181,7 +274,6 @@ void EulerLiquid::step(real delta_t) {
     real thres = 0.001f;
     if (purpose_dt < delta_t * thres) {
       purpose_dt = delta_t * thres;
-      printf("substep dt too small, clamp.\n");
       Particle fastest;
       real avg = 0;
       for (auto &p : particles) {
@@ -190,13 +282,15 @@ void EulerLiquid::step(real delta_t) {
         }
         avg += abs(p.velocity.x) + abs(p.velocity.y);
       }
-      printf("Fastest particle:\n");
-      TC_P(fastest.position);
-      TC_P(fastest.velocity);
       avg /= particles.size() * 2;
-      TC_P(avg);
+      TC_WARN(
+          "Substep dt too small, clamped. Fastest particle at ({}, {}) of "
+          "velocity ({}, {}), average speed {}",
+          fastest.position.x, fastest.position.y, fastest.velocity.x,
+          fastest.velocity.y, avg);
     }
     real dt = std::min(delta_t - simulation_time, purpose_dt);
+    TC_STAT("fluid_substeps", 1);
     substep(dt);
     simulation_time += dt;
   }
@@ -207,6 +301,7 @@ void EulerLiquid::compute_liquid_levelset() {
   TC_ERROR("error");
   liquid_levelset.reset(
       1e7f);  // Do not use INF here, otherwise interpolation will get NAN...
+  liquid_levelset.invalidate_narrow_band();
   for (auto &p : particles) {
     for (auto &ind : liquid_levelset.get_rasterization_region(p.position, 3)) {
       Vector2 delta_pos = ind.get_pos() - p.position;
@@ -223,80 +318,90 @@ void EulerLiquid::compute_liquid_levelset() {
 }
 
 void EulerLiquid::advect_liquid_levelset(real delta_t) {
-  Array<real> old = liquid_levelset;
-  for (auto &ind : liquid_levelset.get_region()) {
-    liquid_levelset[ind] = old.sample(
-        ind.get_pos() - delta_t * sample_velocity(ind.get_pos(), u, v));
+  if (!liquid_levelset.has_narrow_band()) {
+    Array<real> old = liquid_levelset;
+    Vector2 offset = liquid_levelset.get_storage_offset();
+    ThreadedTaskManager::run(width, num_threads, [&](int i) {
+      for (int j = 0; j < height; j++) {
+        Vector2 pos = Vector2((real)i, (real)j) + offset;
+        liquid_levelset[i][j] =
+            old.sample(pos - delta_t * sample_velocity(pos, u, v));
+      }
+    });
+  } else {
+    // Cells out of the band hold -+band, and stay so
+    const std::vector<int> &band = liquid_levelset.get_narrow_band();
+    std::vector<real> advected(band.size());
+    Vector2 offset = liquid_levelset.get_storage_offset();
+    ThreadedTaskManager::run((int)band.size(), num_threads, [&](int k) {
+      Vector2 pos =
+          Vector2((real)(band[k] / height), (real)(band[k] % height)) + offset;
+      advected[k] =
+          liquid_levelset.sample(pos - delta_t * sample_velocity(pos, u, v));
+    });
+    ThreadedTaskManager::run((int)band.size(), num_threads, [&](int k) {
+      liquid_levelset.data[band[k]] = advected[k];
+    });
   }
   rebuild_levelset(liquid_levelset, levelset_band + 1);
 }
 
 void EulerLiquid::rebuild_levelset(LevelSet2D &levelset, real band) {
-  // Actually, we use a brute-force initialization here
-  Array<real> old = levelset;
-  levelset.reset(band);
-  auto update = [&](const Index2D &a, const Index2D &b) {
-    real phi_0 = old[a], phi_1 = old[b];
-    if (phi_0 * phi_1 > 0) {
-      return;
-    }
-    // Free surface detected
-    real p = std::abs(phi_0 / (phi_1 - phi_0));
-    Vector2 pos = lerp(p, Vector2(a.i, a.j), Vector2(b.i, b.j));
-    for (int i = std::max(0, int(floor(a.i - band)));
-         i <= std::min(levelset.get_width() - 1, int(b.i + band)); i++) {
-      for (int j = std::max(0, int(floor(a.j - band)));
-           j <= std::min(levelset.get_height() - 1, int(b.j + band)); j++) {
-        real l = length(Vector2(i, j) - pos);
-        levelset[i][j] = std::min(levelset[i][j], l);
-      }
-    }
-  };
-  for (auto &ind : old.get_region()) {
-    if (ind.i > 0) {
-      const Index2D a = ind.neighbour(-1, 0);
-      const Index2D b = ind;
-      update(a, b);
-    }
-    if (ind.j > 0) {
-      const Index2D a = ind.neighbour(0, -1);
-      const Index2D b = ind;
-      update(a, b);
-    }
-  }
-  for (auto &ind : levelset.get_region()) {
-    levelset[ind] *= sgn(old[ind]);
-  }
+  levelset.redistance(band);
 }
 
 EulerLiquid::Array<real> EulerLiquid::advect(const Array<real> &arr,
                                              real delta_t) {
   Array<real> arr_out(arr.get_res(), 0, arr.get_storage_offset());
-  for (auto &ind : arr.get_region()) {
-    Vector2 position = ind.get_pos();
-    Vector2 velocity = sample_velocity(position);
-    velocity = sample_velocity(position - delta_t * 0.5f * velocity);
-    arr_out[ind] = arr.sample(position - delta_t * velocity);
-  }
+  advect({&arr}, {&arr_out}, delta_t);
   return arr_out;
 }
 
-bool EulerLiquid::check_diag_domination() {
-  for (auto &ind : Ad.get_region()) {
-    real res = Ad[ind];
-    res -= abs(Ax[ind]);
-    res -= abs(Ay[ind]);
-    if (ind.i > 0) {
-      res -= abs(Ax[ind + Vector2i(-1, 0)]);
-    }
-    if (ind.j > 0) {
-      res -= abs(Ay[ind + Vector2i(0, -1)]);
-    }
-    if (res < -1e-7f) {
-      return false;
-    }
+void EulerLiquid::advect(const std::vector<const Array<real> *> &src,
+                         const std::vector<Array<real> *> &dst,
+                         real delta_t) {
+  const Array<real> &grid = *src[0];
+  for (auto f : src) {
+    TC_ASSERT_INFO(f->get_res() == grid.get_res() &&
+                       f->get_storage_offset() == grid.get_storage_offset(),
+                   "Fields advected together must have the same shape");
   }
-  return true;
+  Vector2i res = grid.get_res();
+  Vector2 offset = grid.get_storage_offset();
+  // Columns are independent; samples are visited in memory order
+  ThreadedTaskManager::run(res[0], num_threads, [&](int i) {
+    for (int j = 0; j < res[1]; j++) {
+      Vector2 position = Vector2((real)i, (real)j) + offset;
+      Vector2 velocity = sample_velocity(position);
+      velocity = sample_velocity(position - delta_t * 0.5f * velocity);
+      BilinearStencil stencil(grid, position - delta_t * velocity);
+      for (int f = 0; f < (int)src.size(); f++) {
+        (*dst[f])[i][j] = stencil.sample(*src[f]);
+      }
+    }
+  });
+}
+
+bool EulerLiquid::check_diag_domination() {
+  return reduce_columns(true,
+                        [&](int i) {
+                          for (int j = 0; j < height; j++) {
+                            real res = Ad[i][j];
+                            res -= abs(Ax[i][j]);
+                            res -= abs(Ay[i][j]);
+                            if (i > 0) {
+                              res -= abs(Ax[i - 1][j]);
+                            }
+                            if (j > 0) {
+                              res -= abs(Ay[i][j - 1]);
+                            }
+                            if (res < -1e-7f) {
+                              return false;
+                            }
+                          }
+                          return true;
+                        },
+                        [](bool a, bool b) { return a && b; });
 }
 
 void EulerLiquid::advect(real delta_t) {
@@ -321,21 +426,17 @@ void EulerLiquid::advect(real delta_t) {
   }
   */
   Array<real> new_u = advect(u, delta_t), new_v = advect(v, delta_t);
-  u = new_u;
-  v = new_v;
+  std::swap(u.data, new_u.data);
+  std::swap(v.data, new_v.data);
 }
 
 void EulerLiquid::apply_external_forces(real delta_t) {
-  for (int i = 1; i < width; i++) {
-    for (int j = 0; j < height; j++) {
-      u[i][j] += gravity.x * delta_t;
-    }
-  }
-  for (int i = 0; i < width; i++) {
-    for (int j = 1; j < height; j++) {
-      v[i][j] += gravity.y * delta_t;
-    }
-  }
+  parallel_for(Vector2i(1, 0), Vector2i(width, height),
+               [&](const Vector2i &ind) { u[ind] += gravity.x * delta_t; },
+               num_threads);
+  parallel_for(Vector2i(0, 1), Vector2i(width, height),
+               [&](const Vector2i &ind) { v[ind] += gravity.y * delta_t; },
+               num_threads);
 }
 
 Vector2 EulerLiquid::position_noise() {
@@ -347,15 +448,38 @@ bool EulerLiquid::inside(int x, int y) {
 }
 
 void EulerLiquid::update_velocity_weights() {
-  for (auto &ind : u.get_region()) {
-    u_weight[ind] = LevelSet2D::fraction_outside(
-        boundary_levelset[ind],
-        boundary_levelset[ind.neighbour(Vector2i(0, 1))]);
-  }
-  for (auto &ind : v.get_region()) {
-    v_weight[ind] = LevelSet2D::fraction_outside(
-        boundary_levelset[ind],
-        boundary_levelset[ind.neighbour(Vector2i(1, 0))]);
+  parallel_for(u.get_region(),
+               [&](const Vector2i &ind) {
+                 u_weight[ind] = LevelSet2D::fraction_outside(
+                     boundary_levelset[ind],
+                     boundary_levelset[ind + Vector2i(0, 1)]);
+               },
+               num_threads);
+  parallel_for(v.get_region(),
+               [&](const Vector2i &ind) {
+                 v_weight[ind] = LevelSet2D::fraction_outside(
+                     boundary_levelset[ind],
+                     boundary_levelset[ind + Vector2i(1, 0)]);
+               },
+               num_threads);
+}
+
+template <typename F>
+void EulerLiquid::for_each_tile_wavefront(bool forward, const F &tile) {
+  // Tiles on an anti-diagonal are independent
+  constexpr int tile_size = 32;
+  int tiles_x = (width + tile_size - 1) / tile_size;
+  int tiles_y = (height + tile_size - 1) / tile_size;
+  for (int k = 0; k < tiles_x + tiles_y - 1; k++) {
+    int d = forward ? k : tiles_x + tiles_y - 2 - k;
+    int begin = std::max(0, d - tiles_y + 1), end = std::min(tiles_x, d + 1);
+    ThreadedTaskManager::run(
+        [&](int ti) {
+          int i0 = ti * tile_size, j0 = (d - ti) * tile_size;
+          tile(i0, std::min(i0 + tile_size, width), j0,
+               std::min(j0 + tile_size, height));
+        },
+        begin, end, num_threads);
   }
 }
 
@@ -367,7 +491,7 @@ void EulerLiquid::prepare_for_pressure_solve() {
   particles.clear();
   const real theta_threshold = 0.01f;
   Array<char> boundary_cell(Vector2i(width, height), false);
-  for (int i = 0; i < width; i++) {
+  ThreadedTaskManager::run(width, num_threads, [&](int i) {
     for (int j = 0; j < height; j++) {
       int fluid_corner = 0, boundary_corner = 0;
       fluid_corner += liquid_levelset.sample(Vector2(i + 0, j + 0)) < 0;
@@ -382,24 +506,27 @@ void EulerLiquid::prepare_for_pressure_solve() {
         boundary_cell[i][j] = true;
       }
     }
-  }
-  for (auto &ind : cell_types.get_region()) {
-    int i = ind.i, j = ind.j;
+  });
+  // Each cell writes its own coefficients only
+  parallel_for(cell_types.get_region(), [&](const Vector2i &ind) {
+    int i = ind.x, j = ind.y;
+    Vector2 pos = Vector2((real)i, (real)j) + cell_types.get_storage_offset();
     real phi = liquid_levelset[ind];
     if (phi >= 0) {
       if (!boundary_cell[i][j]) {
-        continue;
+        return;
       }
-    } else {
     }
     real lhs = 0;
     real neighbour_phi;
-    TC_ERROR("vel_weight may be used uninitialized");
-    real vel_weight = 0;
+    real vel_weight;
 
-    neighbour_phi = liquid_levelset.sample(ind.get_pos() - Vector2(1, 0));
+    // Faces to liquid (or boundary) cells couple the pressures; faces to
+    // air get the ghost fluid pressure at the interface, scaling the face
+    // weight by 1 / theta
+    neighbour_phi = liquid_levelset.sample(pos - Vector2(1, 0));
+    vel_weight = u_weight[ind];
     if (neighbour_phi < 0 || boundary_cell[i][j] || boundary_cell[i - 1][j]) {
-      vel_weight = u_weight[ind];
       lhs += vel_weight;
     } else {
       real theta =
@@ -407,9 +534,9 @@ void EulerLiquid::prepare_for_pressure_solve() {
       lhs += vel_weight / theta;
     }
 
-    neighbour_phi = liquid_levelset.sample(ind.get_pos() + Vector2(1, 0));
+    neighbour_phi = liquid_levelset.sample(pos + Vector2(1, 0));
+    vel_weight = u_weight[i + 1][j];
     if (neighbour_phi < 0 || boundary_cell[i][j] || boundary_cell[i + 1][j]) {
-      vel_weight = u_weight[ind.neighbour(Vector2i(1, 0))];
       lhs += vel_weight;
       Ax[i][j] -= vel_weight;
     } else {
@@ -418,9 +545,9 @@ void EulerLiquid::prepare_for_pressure_solve() {
       lhs += vel_weight / theta;
     }
 
-    neighbour_phi = liquid_levelset.sample(ind.get_pos() - Vector2(0, 1));
+    neighbour_phi = liquid_levelset.sample(pos - Vector2(0, 1));
+    vel_weight = v_weight[ind];
     if (neighbour_phi < 0 || boundary_cell[i][j] || boundary_cell[i][j - 1]) {
-      vel_weight = v_weight[ind];
       lhs += vel_weight;
     } else {
       real theta =
@@ -428,9 +555,9 @@ void EulerLiquid::prepare_for_pressure_solve() {
       lhs += vel_weight / theta;
     }
 
-    neighbour_phi = liquid_levelset.sample(ind.get_pos() + Vector2(0, 1));
+    neighbour_phi = liquid_levelset.sample(pos + Vector2(0, 1));
+    vel_weight = v_weight[i][j + 1];
     if (neighbour_phi < 0 || boundary_cell[i][j] || boundary_cell[i][j + 1]) {
-      vel_weight = v_weight[ind.neighbour(Vector2i(0, 1))];
       lhs += vel_weight;
       Ay[i][j] -= vel_weight;
     } else {
@@ -440,46 +567,52 @@ void EulerLiquid::prepare_for_pressure_solve() {
     }
 
     Ad[ind] = lhs;
-  }
+  }, num_threads);
 
   if (!check_diag_domination()) {
-    printf("Warning: Non diagonally dominant matrix found!\n");
+    TC_WARN("Non diagonally dominant matrix found");
+  }
+
+  if (multigrid) {
+    // E is the MIC(0) factor, which only its preconditioner uses
+    return;
   }
 
   real tao = 0.97f, sigma = 0.25f;
 
-  for (auto &ind : cell_types.get_region()) {
-    if (Ad[ind] > 0) {
-      real e = Ad[ind];
-      real e_tao = 0.0_f;
-      Index2D nei;
-      nei = ind.neighbour(Vector2i(-1, 0));
-      if (cell_types.inside(nei) && Ad[nei] > 0) {
-        e -= sqr(Ax[nei] * E[nei]);
-        e_tao -= Ax[nei] * Ay[nei] * sqr(E[nei]);
-      }
-      nei = ind.neighbour(Vector2i(0, -1));
-      if (cell_types.inside(nei) && Ad[nei] > 0) {
-        e -= sqr(Ay[nei] * E[nei]);
-        e_tao -= Ay[nei] * Ax[nei] * sqr(E[nei]);
-      }
-      e += e_tao * tao;
-      if (e < sigma * Ad[ind])
-        e = Ad[ind];
-      assert_info(e >= 0, "Negative e!");
-      E[ind] = 1.0_f / sqrtf(e);
-      if (!is_normal(E[ind])) {
-        TC_P(E[ind]);
-        TC_P(e);
-        printf("Bad E.\n");
+  // E of a cell depends on those of its left and lower neighbours
+  for_each_tile_wavefront(true, [&](int i0, int i1, int j0, int j1) {
+    for (int i = i0; i < i1; i++) {
+      for (int j = j0; j < j1; j++) {
+        if (Ad[i][j] <= 0) {
+          continue;
+        }
+        real e = Ad[i][j];
+        real e_tao = 0.0_f;
+        if (i > 0 && Ad[i - 1][j] > 0) {
+          e -= sqr(Ax[i - 1][j] * E[i - 1][j]);
+          e_tao -= Ax[i - 1][j] * Ay[i - 1][j] * sqr(E[i - 1][j]);
+        }
+        if (j > 0 && Ad[i][j - 1] > 0) {
+          e -= sqr(Ay[i][j - 1] * E[i][j - 1]);
+          e_tao -= Ay[i][j - 1] * Ax[i][j - 1] * sqr(E[i][j - 1]);
+        }
+        e += e_tao * tao;
+        if (e < sigma * Ad[i][j])
+          e = Ad[i][j];
+        assert_info(e >= 0, "Negative e!");
+        E[i][j] = 1.0_f / sqrtf(e);
+        if (!is_normal(E[i][j])) {
+          TC_WARN_ONCE("Bad E = {} of e = {}", E[i][j], e);
+        }
       }
     }
-  }
+  });
 }
 
-EulerLiquid::Array<real> EulerLiquid::apply_A(const Array<real> &x) {
-  Array<real> y(Vector2i(width, height));
-  for (int i = 0; i < width; i++) {
+double EulerLiquid::apply_A(const Array<real> &x, Array<real> &y) {
+  return sum_columns([&](int i) {
+    double dot = 0;
     for (int j = 0; j < height; j++) {
       if (Ad[i][j] > 0) {
         real t = 0;
@@ -496,40 +629,43 @@ EulerLiquid::Array<real> EulerLiquid::apply_A(const Array<real> &x) {
       } else {
         y[i][j] = 0;
       }
+      dot += x[i][j] * y[i][j];
     }
-  }
-  return y;
+    return dot;
+  });
 }
 
-EulerLiquid::Array<real> EulerLiquid::solve_pressure_naive() {
-  static int total_count = 0;
+const EulerLiquid::Array<real> &EulerLiquid::solve_pressure_naive() {
+  Array<real> &r = residual, &s = search_direction;
+  auto dot = [&](const Array<real> &a, const Array<real> &b) {
+    return dot_product(a, b, num_threads);
+  };
   int count = 0;
-  Array<real> r = get_rhs(), z, s;
-  z = apply_preconditioner(r);
+  get_rhs(r);
+  if (multigrid) {
+    update_multigrid_boundary();
+  }
+  precondition(r, z);
   s = z;
-#define CH(v)         \
-  if (!v.is_normal()) \
-    printf("Abnormal value doring CG: %s [Ln %d]\n", #v, __LINE__);
   pressure = 0;
-  double sigma = z.dot_double(r);
+  double sigma = dot(z, r);
   double zs;
 
   for (count = 0; count < maximum_iterations; count++) {
-    z = apply_A(s);
-    zs = z.dot_double(s);
-    double alpha = sigma / max(1e-6, zs);
-    pressure = pressure.add((real)alpha, s);
-    r = r.add(-(real)alpha, z);
-    if (r.abs_max() < tolerance)
+    zs = apply_A(s, z);
+    real alpha = (real)(sigma / max(1e-6, zs));
+    // Fused updates of the pressure and the residual, with its norm
+    if (p_update_solution_and_residual(pressure, r, alpha, s, z,
+                                       num_threads) < tolerance)
       break;
-    z = apply_preconditioner(r);
-    double sigma_new = z.dot_double(r);
-    double beta = sigma_new / sigma;
-    s = z.add((real)beta, s);
+    precondition(r, z);
+    double sigma_new = dot(z, r);
+    real beta = (real)(sigma_new / sigma);
+    p_add_in_place2(z, beta, s, num_threads);
     sigma = sigma_new;
   }
-  total_count += count;
-  printf("t = %f, iterated %d times, avg = %f\n", t, count, total_count / t);
+  TC_TRACE("Pressure solve: {} iterations at t = {}", count, t);
+  TC_STAT("pressure_cg_iterations", count);
   return pressure;
 }
 
@@ -539,19 +675,21 @@ void EulerLiquid::project(real delta_t) {
   prepare_for_pressure_solve();
   p = solve_pressure_naive();
   if (!(p.is_normal())) {
-    printf("Abnormal pressure!!!!!\n");
+    TC_WARN("Abnormal pressure at t = {}", t);
   }
   apply_pressure(p);
   apply_boundary_condition();
 }
 
 void EulerLiquid::mark_cells() {
-  cell_types = CellType::AIR;
-  for (auto &ind : cell_types.get_region()) {
-    if (liquid_levelset.sample(ind.get_pos()) < 0) {
-      cell_types[ind] = CellType::WATER;
+  Vector2 offset = cell_types.get_storage_offset();
+  ThreadedTaskManager::run(width, num_threads, [&](int i) {
+    for (int j = 0; j < height; j++) {
+      Vector2 pos = Vector2((real)i, (real)j) + offset;
+      cell_types[i][j] =
+          liquid_levelset.sample(pos) < 0 ? CellType::WATER : CellType::AIR;
     }
-  }
+  });
   /*
   for (auto &particle : particles) {
       int x = (int)particle.position.x, y = (int)particle.position.y;
@@ -567,27 +705,32 @@ void EulerLiquid::substep(real delta_t) {
   update_velocity_weights();
   apply_external_forces(delta_t);
   mark_cells();
+  apply_viscosity(delta_t);
   project(delta_t);
   simple_extrapolate();
   advect(delta_t);
   advect_liquid_levelset(delta_t);
-  for (auto &ind : liquid_levelset.get_region())
-    liquid_levelset[ind] = std::max(liquid_levelset[ind],
-                                    -boundary_levelset.sample(ind.get_pos()));
+  Vector2 offset = liquid_levelset.get_storage_offset();
+  ThreadedTaskManager::run(width, num_threads, [&](int i) {
+    for (int j = 0; j < height; j++) {
+      Vector2 pos = Vector2((real)i, (real)j) + offset;
+      liquid_levelset[i][j] =
+          std::max(liquid_levelset[i][j], -boundary_levelset.sample(pos));
+    }
+  });
   t += delta_t;
 }
 
 void EulerLiquid::apply_pressure(const Array<real> &p) {
-  for (int i = 0; i < width - 1; i++) {
-    for (int j = 0; j < height; j++) {
+  // Column i updates the faces u[i + 1] and v[i]
+  ThreadedTaskManager::run(width, num_threads, [&](int i) {
+    for (int j = 0; i < width - 1 && j < height; j++) {
       real theta = LevelSet2D::fraction_inside(liquid_levelset[i][j],
                                                liquid_levelset[i + 1][j]);
       if (u_weight[i + 1][j] > 0 && theta > 0)
         u[i + 1][j] +=
             (p[i][j] - p[i + 1][j]) / std::max(theta_threshold, theta);
     }
-  }
-  for (int i = 0; i < width; i++) {
     for (int j = 0; j < height - 1; j++) {
       real theta = LevelSet2D::fraction_inside(liquid_levelset[i][j],
                                                liquid_levelset[i][j + 1]);
@@ -595,35 +738,48 @@ void EulerLiquid::apply_pressure(const Array<real> &p) {
         v[i][j + 1] +=
             (p[i][j] - p[i][j + 1]) / std::max(theta_threshold, theta);
     }
-  }
-  for (int i = 0; i < width; i++) {
-    for (int j = 0; j < height; j++) {
-      if (liquid_levelset[i][j] > 0) {
-        continue;
-      }
-      real div = 0;
-      div += u[i][j] * u_weight[i][j];
-      div += v[i][j] * v_weight[i][j];
-      div -= u[i + 1][j] * u_weight[i + 1][j];
-      div -= v[i][j + 1] * v_weight[i][j + 1];
-      if (abs(div) > 1e-3) {
-        printf("%d  %d div %f\n", i, j, div);
-      }
-    }
+  });
+  // The first divergent cell, in column order
+  Vector3 divergent = reduce_columns(
+      Vector3(0),
+      [&](int i) {
+        for (int j = 0; j < height; j++) {
+          if (liquid_levelset[i][j] > 0) {
+            continue;
+          }
+          real div = 0;
+          div += u[i][j] * u_weight[i][j];
+          div += v[i][j] * v_weight[i][j];
+          div -= u[i + 1][j] * u_weight[i + 1][j];
+          div -= v[i][j + 1] * v_weight[i][j + 1];
+          if (abs(div) > 1e-3) {
+            return Vector3(div, (real)i, (real)j);
+          }
+        }
+        return Vector3(0);
+      },
+      [](const Vector3 &a, const Vector3 &b) { return a.x != 0 ? a : b; });
+  if (divergent.x != 0) {
+    TC_LOG_EVERY_N(warn, 1000, "Divergence {} at ({}, {})", divergent.x,
+                   (int)divergent.y, (int)divergent.z);
   }
 }
 
 void EulerLiquid::apply_boundary_condition() {
-  for (auto &ind : u.get_region()) {
-    if (u_weight[ind] == 0.0_f) {
-      u[ind] = 0.0_f;
-    }
-  }
-  for (auto &ind : v.get_region()) {
-    if (v_weight[ind] == 0.0_f) {
-      v[ind] = 0.0_f;
-    }
-  }
+  parallel_for(u.get_region(),
+               [&](const Vector2i &ind) {
+                 if (u_weight[ind] == 0.0_f) {
+                   u[ind] = 0.0_f;
+                 }
+               },
+               num_threads);
+  parallel_for(v.get_region(),
+               [&](const Vector2i &ind) {
+                 if (v_weight[ind] == 0.0_f) {
+                   v[ind] = 0.0_f;
+                 }
+               },
+               num_threads);
 }
 
 real EulerLiquid::get_current_time() {
@@ -644,96 +800,221 @@ LevelSet2D EulerLiquid::get_liquid_levelset() {
   return liquid_levelset;
 }
 
-EulerLiquid::Array<real> EulerLiquid::apply_preconditioner(
-    const Array<real> &r) {
-  q = 0;
-  z = 0;
+void EulerLiquid::apply_preconditioner(const Array<real> &r, Array<real> &z) {
   assert_info(E.is_normal(), "Abnormal E!\n");
-  for (int i = 0; i < width; i++) {
+  // Cell (i, j) of a pass depends on its left and lower neighbours
+  // (forward) or its right and upper ones (backward) only
+  for_each_tile_wavefront(true, [&](int i0, int i1, int j0, int j1) {
+    for (int i = i0; i < i1; i++) {
+      for (int j = j0; j < j1; j++) {
+        if (Ad[i][j] > 0) {
+          real t = r[i][j];
+          if (i > 0)
+            t -= Ax[i - 1][j] * E[i - 1][j] * q[i - 1][j];
+          if (j > 0)
+            t -= Ay[i][j - 1] * E[i][j - 1] * q[i][j - 1];
+          q[i][j] = t * E[i][j];
+        } else {
+          q[i][j] = 0;
+        }
+      }
+    }
+  });
+  for_each_tile_wavefront(false, [&](int i0, int i1, int j0, int j1) {
+    for (int i = i1 - 1; i >= i0; i--) {
+      for (int j = j1 - 1; j >= j0; j--) {
+        if (Ad[i][j] > 0) {
+          real t = q[i][j];
+          if (i < width - 1) {
+            t -= Ax[i][j] * E[i][j] * z[i + 1][j];
+          }
+          if (j < height - 1) {
+            t -= Ay[i][j] * E[i][j] * z[i][j + 1];
+          }
+          z[i][j] = t * E[i][j];
+        } else {
+          z[i][j] = 0;
+        }
+      }
+    }
+  });
+}
+
+void EulerLiquid::precondition(const Array<real> &r, Array<real> &z) {
+  if (multigrid) {
+    multigrid->v_cycle(r, z);
+  } else {
+    apply_preconditioner(r, z);
+  }
+}
+
+void EulerLiquid::update_multigrid_boundary() {
+  Vector2 offset = multigrid_boundary.get_storage_offset();
+  ThreadedTaskManager::run(width, num_threads, [&](int i) {
     for (int j = 0; j < height; j++) {
+      PoissonSolver2D::CellType type;
       if (Ad[i][j] > 0) {
-        real t = r[i][j];
-        if (i > 0)
-          t -= Ax[i - 1][j] * E[i - 1][j] * q[i - 1][j];
-        if (j > 0)
-          t -= Ay[i][j - 1] * E[i][j - 1] * q[i][j - 1];
-        q[i][j] = t * E[i][j];
+        type = PoissonSolver2D::INTERIOR;
+      } else if (boundary_levelset.sample(Vector2((real)i, (real)j) +
+                                          offset) < 0) {
+        type = PoissonSolver2D::NEUMANN;
+      } else {
+        type = PoissonSolver2D::DIRICHLET;
       }
+      multigrid_boundary[i][j] = type;
     }
-  }
-  for (int i = width - 1; i >= 0; i--) {
-    for (int j = height - 1; j >= 0; j--) {
+  });
+  // What the ghost fluid adds to the diagonal over the unit stencil,
+  // mostly 1 / theta - 1 at the free surface
+  const int dx[4]{1, -1, 0, 0};
+  const int dy[4]{0, 0, 1, -1};
+  ThreadedTaskManager::run(width, num_threads, [&](int i) {
+    for (int j = 0; j < height; j++) {
+      real diagonal = 0;
       if (Ad[i][j] > 0) {
-        real t = q[i][j];
-        if (i < width - 1) {
-          t -= Ax[i][j] * E[i][j] * z[i + 1][j];
+        for (int k = 0; k < 4; k++) {
+          Vector2i n(i + dx[k], j + dy[k]);
+          if (multigrid_boundary.inside(n) &&
+              multigrid_boundary[n] != PoissonSolver2D::NEUMANN) {
+            diagonal += 1;
+          }
         }
-        if (j < height - 1) {
-          t -= Ay[i][j] * E[i][j] * z[i][j + 1];
-        }
-        z[i][j] = t * E[i][j];
+        diagonal = std::max(Ad[i][j] - diagonal, 0.0_f);
       }
+      multigrid_diagonal[i][j] = diagonal;
     }
-  }
-  return z;
+  });
+  multigrid->set_boundary_condition(multigrid_boundary, multigrid_diagonal);
 }
 
-EulerLiquid::Array<real> EulerLiquid::get_rhs() {
-  Array<real> r(Vector2i(width, height), 0);
+void EulerLiquid::get_rhs(Array<real> &r) {
   real correction = get_volume_correction();
-  for (auto &ind : cell_types.get_region()) {
-    if (Ad[ind] > 0) {
-      real rhs = -u[ind.neighbour(Vector2i(1, 0))] *
-                     u_weight[ind.neighbour(Vector2i(1, 0))] +
-                 u[ind] * u_weight[ind] -
-                 v[ind.neighbour(Vector2i(0, 1))] *
-                     v_weight[ind.neighbour(Vector2i(0, 1))] +
-                 v[ind] * v_weight[ind];
-      r[ind] = rhs + correction;
-    }
-  }
-  return r;
+  ThreadedTaskManager::run(
+      [&](int i) {
+        for (int j = 0; j < height; j++) {
+          if (Ad[i][j] > 0) {
+            real rhs = -u[i + 1][j] * u_weight[i + 1][j] +
+                       u[i][j] * u_weight[i][j] -
+                       v[i][j + 1] * v_weight[i][j + 1] +
+                       v[i][j] * v_weight[i][j];
+            r[i][j] = rhs + correction;
+          } else {
+            r[i][j] = 0;
+          }
+        }
+      },
+      0, width, num_threads);
 }
 
 void EulerLiquid::apply_viscosity(real delta_t) {
-  // static real tmp[2048][2048];
-  // for (int i = 1; i < width; i++) {
-  //    for (int j = 1; j < height - 1; j++) {
-  //        real sum = u[i][j] * 4;
-  //        sum -= u[i - 1][j];
-  //        sum -= u[i + 1][j];
-  //        sum -= u[i][j - 1];
-  //        sum -= u[i][j + 1];
-  //        tmp[i][j] = sum;
-  //    }
-  //}
-  // for (int i = 1; i < width; i++) {
-  //    for (int j = 1; j < height - 1; j++) {
-  //        u[i][j] -= viscosity * delta_t * tmp[i][j];
-  //    }
-  //}
-  // for (int i = 1; i < width - 1; i++) {
-  //    for (int j = 1; j < height; j++) {
-  //        real sum = v[i][j] * 4;
-  //        sum -= v[i - 1][j];
-  //        sum -= v[i + 1][j];
-  //        sum -= v[i][j - 1];
-  //        sum -= v[i][j + 1];
-  //        tmp[i][j] = sum;
-  //    }
-  //}
-  // for (int i = 1; i < width - 1; i++) {
-  //    for (int j = 1; j < height; j++) {
-  //        v[i][j] -= viscosity * delta_t * tmp[i][j];
-  //    }
-  //}
+  if (viscosity <= 0) {
+    return;
+  }
+  // The unknowns are the liquid faces of u, then those of v
+  Array<real> *fields[2] = {&u, &v};
+  const Array<real> *weights[2] = {&u_weight, &v_weight};
+  Array<int> indices[2] = {Array<int>(u.get_res(), -1),
+                           Array<int>(v.get_res(), -1)};
+  std::vector<Vector3i> faces;
+  for (int c = 0; c < 2; c++) {
+    for (int i = 0; i < fields[c]->get_width(); i++) {
+      for (int j = 0; j < fields[c]->get_height(); j++) {
+        bool active = c == 0 ? check_u_activity(i, j) : check_v_activity(i, j);
+        if (active && (*weights[c])[i][j] > 0) {
+          indices[c][i][j] = (int)faces.size();
+          faces.push_back(Vector3i(c, i, j));
+        }
+      }
+    }
+  }
+  int n = (int)faces.size();
+  if (n == 0) {
+    return;
+  }
+  // Per face and direction, the unknown of the neighbour, or air (stress
+  // free, so left out) or solid (no slip, so zero)
+  constexpr int air = -1, solid = -2;
+  const int dx[4]{1, -1, 0, 0};
+  const int dy[4]{0, 0, 1, -1};
+  std::vector<int> neighbours(4 * n);
+  sparse::parallel_for(n, num_threads, [&](int k) {
+    int c = faces[k][0], i = faces[k][1], j = faces[k][2];
+    for (int d = 0; d < 4; d++) {
+      int nx = i + dx[d], ny = j + dy[d];
+      int &neighbour = neighbours[4 * k + d];
+      if (!fields[c]->inside(nx, ny) || (*weights[c])[nx][ny] == 0) {
+        neighbour = solid;
+      } else {
+        neighbour = std::max(indices[c][nx][ny], air);
+      }
+    }
+  });
+  Array1D<real> x(n);
+  sparse::parallel_for(n, num_threads, [&](int k) {
+    x[k] = (*fields[faces[k][0]])[faces[k][1]][faces[k][2]];
+  });
+  real coefficient = viscosity * delta_t;
+  if (implicit_viscosity) {
+    // Backward Euler, (I - dt nu L) x = x_old, symmetric positive definite
+    SparseMatrix A(n, num_threads);
+    for (int k = 0; k < n; k++) {
+      real diagonal = 1;
+      for (int d = 0; d < 4; d++) {
+        int neighbour = neighbours[4 * k + d];
+        if (neighbour != air) {
+          diagonal += coefficient;
+        }
+        if (neighbour >= 0) {
+          A.insert(k, neighbour, -coefficient);
+        }
+      }
+      A.insert(k, k, diagonal);
+    }
+    A.compress();
+    Array1D<real> b = x;
+    int iterations = conjugate_gradient(A, b, x, viscosity_tolerance,
+                                        maximum_iterations, num_threads);
+    if (iterations < 0) {
+      TC_WARN("Viscosity solve not converged in {} iterations",
+              maximum_iterations);
+    } else {
+      TC_STAT("viscosity_cg_iterations", iterations);
+    }
+  } else {
+    // Forward Euler, in as many steps as its stability takes
+    int steps = std::max(1, (int)std::ceil(4 * coefficient));
+    real step_coefficient = coefficient / steps;
+    Array1D<real> x_new(n);
+    for (int s = 0; s < steps; s++) {
+      sparse::parallel_for(n, num_threads, [&](int k) {
+        real laplacian = 0;
+        for (int d = 0; d < 4; d++) {
+          int neighbour = neighbours[4 * k + d];
+          if (neighbour != air) {
+            laplacian += (neighbour >= 0 ? x[neighbour] : 0.0_f) - x[k];
+          }
+        }
+        x_new[k] = x[k] + step_coefficient * laplacian;
+      });
+      std::swap(x.data, x_new.data);
+    }
+    TC_STAT("viscosity_explicit_steps", steps);
+  }
+  sparse::parallel_for(n, num_threads, [&](int k) {
+    (*fields[faces[k][0]])[faces[k][1]][faces[k][2]] = x[k];
+  });
 }
 
 int EulerLiquid::count_water_cells() {
-  int ret = 0;
-  for (auto &cell : cell_types)
-    ret += cell == CellType::WATER;
-  return ret;
+  return reduce_columns(0,
+                        [&](int i) {
+                          int ret = 0;
+                          for (int j = 0; j < height; j++) {
+                            ret += cell_types[i][j] == CellType::WATER;
+                          }
+                          return ret;
+                        },
+                        [](int a, int b) { return a + b; });
 }
 
 void EulerLiquid::initialize_volume_controller() {
@@ -809,6 +1090,9 @@ void EulerLiquid::initialize_pressure_solver() {
   p = Array<real>(Vector2i(width, height), 0.0_f);
   q = Array<real>(Vector2i(width, height));
   z = Array<real>(Vector2i(width, height));
+  residual = Array<real>(Vector2i(width, height));
+  search_direction = Array<real>(Vector2i(width, height));
+  column_sums.resize(width);
   water_cell_index = Array<int>(Vector2i(width, height));
 }
 
@@ -827,12 +1111,7 @@ real EulerLiquid::get_dt_with_cfl_1() {
 }
 
 real EulerLiquid::get_max_grid_speed() {
-  real maximum_speed = 0;
-  for (auto &vel : u)
-    maximum_speed = max(abs(vel), maximum_speed);
-  for (auto &vel : v)
-    maximum_speed = max(abs(vel), maximum_speed);
-  return maximum_speed;
+  return max(p_abs_max(u, num_threads), p_abs_max(v, num_threads));
 }
 
 EulerLiquid::Array<real> EulerLiquid::get_density() {
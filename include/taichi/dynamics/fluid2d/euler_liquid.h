@@ -8,9 +8,11 @@
 #include <memory>
 #include "fluid.h"
 #include <taichi/system/timer.h>
+#include <taichi/system/threading.h>
 #include <taichi/math/array_2d.h>
 #include <taichi/visualization/image_buffer.h>
 #include <taichi/math/levelset.h>
+#include <taichi/dynamics/poisson_solver.h>
 
 TC_NAMESPACE_BEGIN
 
@@ -20,9 +22,23 @@ class EulerLiquid : public Fluid {
   Array<real> Ad, Ax, Ay, E;
   Array<int> water_cell_index;
   void apply_pressure(const Array<real> &p);
-  Array<real> apply_A(const Array<real> &x);
-  Array<real> apply_preconditioner(const Array<real> &x);
-  Array<real> get_rhs();
+  // y = A x; returns the dot product of x and y
+  double apply_A(const Array<real> &x, Array<real> &y);
+  // z = M^-1 r for the MIC(0) factor M, using q for the forward pass. The
+  // triangular solves run over tiles by wavefront, in parallel along the
+  // anti-diagonals of tiles, with the same result as in serial.
+  void apply_preconditioner(const Array<real> &r, Array<real> &z);
+  // The preconditioner selected by "pressure_solver": MIC(0) for "mic"
+  // (default), a cycle of the PoissonSolver2D "multigrid_solver" ("mg" by
+  // default) for "mgpcg"
+  void precondition(const Array<real> &r, Array<real> &z);
+  // Cells of the multigrid preconditioner: the unknowns of the liquid
+  // system are interior, solid cells Neumann and air cells Dirichlet. The
+  // ghost fluid terms go to the diagonal of the multigrid, while fractional
+  // face weights are approximated by unit ones; the CG on the exact system
+  // makes up for the difference.
+  void update_multigrid_boundary();
+  void get_rhs(Array<real> &r);
   void apply_boundary_condition();
   real volume_correction_factor;
   real levelset_band;
@@ -34,6 +50,24 @@ class EulerLiquid : public Fluid {
 
   int width, height;
   Array<real> pressure, q, z;
+  // Residual and search direction of the pressure solve
+  Array<real> residual, search_direction;
+  // Per column partial results of reductions, summed in order so that
+  // they do not depend on the number of threads
+  std::vector<double> column_sums;
+  // -1 uses all cores
+  int num_threads;
+  // Layers of faces that simple_extrapolate() fills beyond the active ones
+  int extrapolation_layers;
+  // Kinematic, in cells^2 per unit time; none if zero
+  real viscosity;
+  // Backward Euler by CG, or forward Euler in substeps as stability takes
+  bool implicit_viscosity;
+  real viscosity_tolerance;
+  // Null for MIC(0) preconditioning
+  std::shared_ptr<PoissonSolver2D> multigrid;
+  PoissonSolver2D::BCArray multigrid_boundary;
+  Array<real> multigrid_diagonal;
   real target_water_cells;
   real last_water_cells;
   real integrate_water_cells_difference;
@@ -69,18 +103,67 @@ class EulerLiquid : public Fluid {
 
   bool check_v_activity(int i, int j);
 
+  // Fills the inactive faces of u and v from the active ones, a layer of
+  // faces at a time; faces beyond extrapolation_layers are zeroed
   virtual void simple_extrapolate();
 
+  // Extrapolates |f| over its faces in [begin, end) that are not
+  // |active(i, j)|. Each face of the front gets the average of its known
+  // neighbours, in parallel; the next front is the unknown neighbours of
+  // the last one, so that the cost after the first layer follows the front.
+  template <typename Active>
+  void extrapolate_faces(Array<real> &f,
+                         Vector2i begin,
+                         Vector2i end,
+                         const Active &active);
+
   void level_set_extrapolate();
 
   bool inside(int x, int y);
 
   virtual void prepare_for_pressure_solve();
 
-  virtual Array<real> solve_pressure_naive();
+  virtual const Array<real> &solve_pressure_naive();
+
+  // Sum over the columns i of |f(i)|, evaluated in parallel
+  template <typename F>
+  double sum_columns(const F &f) {
+    ThreadedTaskManager::run([&](int i) { column_sums[i] = f(i); }, 0, width,
+                             num_threads);
+    double sum = 0;
+    for (int i = 0; i < width; i++) {
+      sum += column_sums[i];
+    }
+    return sum;
+  }
+
+  // combine(...combine(identity, f(0))..., f(width - 1)) over the columns,
+  // with the f(i) evaluated in parallel
+  template <typename T, typename F, typename C>
+  T reduce_columns(const T &identity, const F &f, const C &combine) {
+    return ThreadedTaskManager::reduce(
+        0, width, num_threads, identity,
+        [&](int begin, int end) {
+          T ret = identity;
+          for (int i = begin; i < end; i++) {
+            ret = combine(ret, f(i));
+          }
+          return ret;
+        },
+        combine, 1);
+  }
+
+  // Calls |tile(i0, i1, j0, j1)| for the tiles of the cells, in an order
+  // where cell (i, j) follows its left and lower neighbours (forward) or
+  // its right and upper ones (backward): tiles by anti-diagonal, which
+  // run in parallel
+  template <typename F>
+  void for_each_tile_wavefront(bool forward, const F &tile);
 
   virtual void project(real delta_t);
 
+  // Diffuses the velocity of the liquid faces by 'viscosity', with no slip
+  // at solid faces and no stress towards air
   virtual void apply_viscosity(real delta_t);
 
   int count_water_cells();
@@ -131,6 +214,12 @@ class EulerLiquid : public Fluid {
 
   virtual Array<real> advect(const Array<real> &arr, real delta_t);
 
+  // Semi-Lagrangian advection of the fields of |src|, of the same shape,
+  // into |dst|: the fields share one backtrace and one stencil per sample
+  void advect(const std::vector<const Array<real> *> &src,
+              const std::vector<Array<real> *> &dst,
+              real delta_t);
+
   virtual bool check_diag_domination();
 
   virtual void update_velocity_weights();
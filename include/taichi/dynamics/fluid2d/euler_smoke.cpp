@@ -4,17 +4,24 @@
 *******************************************************************************/
 
 #include "euler_smoke.h"
+#include <taichi/math/array_parallel.h>
 
 TC_NAMESPACE_BEGIN
 
 void EulerSmoke::apply_external_forces(real delta_t) {
-  for (auto &ind : v.get_region()) {
-    if (boundary_levelset.sample(ind) > 0) {
-      real force =
-          -buoyancy_alpha * density[ind] + buoyancy_beta * temperature[ind];
-      v[ind] += delta_t * force;
-    }
-  }
+  Vector2 offset = v.get_storage_offset();
+  parallel_for(v.get_region(),
+               [&](const Vector2i &ind) {
+                 if (boundary_levelset.sample(
+                         Vector2((real)ind.x, (real)ind.y) + offset) > 0) {
+                   // The top faces take the buoyancy of the cells below
+                   Vector2i cell(ind.x, std::min(ind.y, height - 1));
+                   real force = -buoyancy_alpha * density[cell] +
+                                buoyancy_beta * temperature[cell];
+                   v[ind] += delta_t * force;
+                 }
+               },
+               num_threads);
 }
 
 void EulerSmoke::initialize(const Config &config) {
@@ -53,14 +60,23 @@ void EulerSmoke::emit(real delta_t) {
             "is within the boundary)\n");
       }
     }
-    for (auto &ind : temperature.get_region()) {
-      if (boundary_levelset.sample(ind.get_pos()) > 0) {
-        if (length(ind.get_pos() - c) < r) {
-          temperature[ind] = init_temperature;
-          density[ind] = init_density;
+    // The cells that the disk may cover
+    Vector2 offset = temperature.get_storage_offset();
+    Vector2i begin(std::max(0, (int)std::floor(c.x - r - offset.x)),
+                   std::max(0, (int)std::floor(c.y - r - offset.y)));
+    Vector2i end(std::min(width, (int)std::ceil(c.x + r - offset.x) + 1),
+                 std::min(height, (int)std::ceil(c.y + r - offset.y) + 1));
+    auto cells = [&](int i) {
+      for (int j = begin.y; j < end.y; j++) {
+        Vector2 pos = Vector2((real)i, (real)j) + offset;
+        if (boundary_levelset.sample(pos) > 0 && length(pos - c) < r) {
+          temperature[i][j] = init_temperature;
+          density[i][j] = init_density;
         }
       }
-    }
+    };
+    ThreadedTaskManager::run(begin.x, std::max(begin.x, end.x), num_threads,
+                             cells);
   }
 }
 
@@ -72,8 +88,12 @@ void EulerSmoke::substep(real delta_t) {
   advect(delta_t);
   t += delta_t;
 
-  density = advect(density, delta_t);
-  temperature = advect(temperature, delta_t);
+  // Density and temperature share their backtraces
+  Array<real> new_density = density.same_shape(0),
+              new_temperature = temperature.same_shape(0);
+  advect({&density, &temperature}, {&new_density, &new_temperature}, delta_t);
+  std::swap(density.data, new_density.data);
+  std::swap(temperature.data, new_temperature.data);
 }
 
 TC_IMPLEMENTATION(Fluid, EulerSmoke, "smoke");
@@ -4,20 +4,94 @@
 *******************************************************************************/
 
 #include "flip_liquid.h"
-#include <taichi/nearest_neighbour/point_cloud.h>
+#include <taichi/nearest_neighbour/neighbour_grid.h>
+#include <taichi/math/array_3d_layout.h>
+
+#include <algorithm>
 
 TC_NAMESPACE_BEGIN
 
-void FLIPLiquid::clamp_particle(Particle &p) {
-  p.position = EulerLiquid::clamp_particle_position(
-      p.position);  // Avoid out of bound levelset query
-  Vector2 sample_position = p.position;
-  real phi = boundary_levelset.sample(sample_position) - padding;
+void FLIPLiquid::ParticleArrays::push_back(const Particle &p) {
+  for (int k = 0; k < 2; k++) {
+    position[k].push_back(p.position[k]);
+    velocity[k].push_back(p.velocity[k]);
+    for (int d = 0; d < 2; d++) {
+      c[k][d].push_back(p.c[k][d]);
+    }
+  }
+  temperature.push_back(p.temperature);
+  radius.push_back(p.radius);
+  color.push_back(p.color);
+  id.push_back(p.id);
+}
+
+Fluid::Particle FLIPLiquid::ParticleArrays::get_particle(int i) const {
+  Particle p(get_position(i), get_velocity(i));
+  p.id = id[i];
+  for (int k = 0; k < 2; k++) {
+    p.c[k] = Vector2(c[k][0][i], c[k][1][i]);
+  }
+  p.weight = Vector2(0.0_f);
+  p.temperature = temperature[i];
+  p.radius = radius[i];
+  p.color = color[i];
+  return p;
+}
+
+void FLIPLiquid::ParticleArrays::permute(const std::vector<int> &order) {
+  auto apply = [&](auto &values) {
+    auto old = values;
+    for (int i = 0; i < (int)order.size(); i++) {
+      values[i] = old[order[i]];
+    }
+  };
+  for (int k = 0; k < 2; k++) {
+    apply(position[k]);
+    apply(velocity[k]);
+    for (int d = 0; d < 2; d++) {
+      apply(c[k][d]);
+    }
+  }
+  apply(temperature);
+  apply(radius);
+  apply(color);
+  apply(id);
+}
+
+void FLIPLiquid::clamp_particle(int i) {
+  // Avoid out of bound levelset query
+  Vector2 position = EulerLiquid::clamp_particle_position(
+      particle_arrays.get_position(i));
+  Vector2 velocity = particle_arrays.get_velocity(i);
+  real phi = boundary_levelset.sample(position) - padding;
   if (phi < 0) {
-    auto grad = boundary_levelset.get_normalized_gradient(sample_position);
-    p.position -= phi * grad;
-    p.velocity -= dot(grad, p.velocity) * grad;
+    auto grad = boundary_levelset.get_normalized_gradient(position);
+    position -= phi * grad;
+    velocity -= dot(grad, velocity) * grad;
+  }
+  particle_arrays.set_position(i, position);
+  particle_arrays.set_velocity(i, velocity);
+}
+
+void FLIPLiquid::sort_particles() {
+  if (particle_sort_interval <= 0 ||
+      substeps_since_sort++ % particle_sort_interval != 0) {
+    return;
+  }
+  int n = particle_arrays.size();
+  std::vector<std::pair<uint32, int>> keys(n);
+  for (int i = 0; i < n; i++) {
+    int x = clamp((int)particle_arrays.position[0][i], 0, width - 1);
+    int y = clamp((int)particle_arrays.position[1][i], 0, height - 1);
+    keys[i] = std::make_pair(morton_code(x, y), i);
+  }
+  // Ties are broken by the previous order, so that sorting is deterministic
+  std::sort(keys.begin(), keys.end());
+  std::vector<int> order(n);
+  for (int i = 0; i < n; i++) {
+    order[i] = keys[i].second;
   }
+  particle_arrays.permute(order);
 }
 
 void FLIPLiquid::initialize_solver(const Config &config) {
@@ -27,6 +101,8 @@ void FLIPLiquid::initialize_solver(const Config &config) {
   advection_order = config.get("advection_order", 2);
   correction_strength = config.get("correction_strength", 0.1f);
   correction_neighbours = config.get("correction_neighbours", 5);
+  particle_sort_interval = config.get("particle_sort_interval", 4);
+  substeps_since_sort = 0;
   u_backup = Array<real>(u.get_res(), 0.0_f, Vector2(0.0_f, 0.5f));
   v_backup = Array<real>(v.get_res(), 0.0_f, Vector2(0.5f, 0.0_f));
   u_count = Array<real>(u.get_res(), 0.0_f);
@@ -43,41 +119,48 @@ Vector2 FLIPLiquid::sample_velocity(Vector2 position,
 
 void FLIPLiquid::advect(real delta_t) {
   real lerp = powf(FLIP_alpha, delta_t / 0.01f);
-  real max_movement = 0.0_f;
-  for (auto &p : particles) {
+  TC_ASSERT_INFO(1 <= advection_order && advection_order <= 3,
+                 "advection_order must be in [1, 2, 3].");
+  // Particles only read the grid and write themselves
+  ThreadedTaskManager::run(particle_arrays.size(), num_threads, [&](int i) {
+    Vector2 position = particle_arrays.get_position(i);
+    Vector2 velocity = particle_arrays.get_velocity(i);
     if (advection_order == 3) {
-      Vector2 velocity_1 = sample_velocity(p.position, p.velocity, lerp);
+      Vector2 velocity_1 = sample_velocity(position, velocity, lerp);
       Vector2 velocity_2 = sample_velocity(
-          (p.position + delta_t * 0.5_f * velocity_1), p.velocity, lerp);
+          (position + delta_t * 0.5_f * velocity_1), velocity, lerp);
       Vector2 velocity_3 = sample_velocity(
-          (p.position + delta_t * 0.75_f * velocity_2), p.velocity, lerp);
-      p.velocity = (2.0_f / 9.0_f) * velocity_1 + (3.0_f / 9.0_f) * velocity_2 +
-                   (4.0_f / 9.0_f) * velocity_3;
+          (position + delta_t * 0.75_f * velocity_2), velocity, lerp);
+      velocity = (2.0_f / 9.0_f) * velocity_1 + (3.0_f / 9.0_f) * velocity_2 +
+                 (4.0_f / 9.0_f) * velocity_3;
     } else if (advection_order == 2) {
-      Vector2 velocity_1 = sample_velocity(p.position, p.velocity, lerp);
+      Vector2 velocity_1 = sample_velocity(position, velocity, lerp);
       Vector2 velocity_2 =
-          sample_velocity(p.position - delta_t * velocity_1, p.velocity, lerp);
-      p.velocity = 0.5_f * (velocity_1 + velocity_2);
-    } else if (advection_order == 1) {
-      p.velocity = sample_velocity(p.position, p.velocity, lerp);
+          sample_velocity(position - delta_t * velocity_1, velocity, lerp);
+      velocity = 0.5_f * (velocity_1 + velocity_2);
     } else {
-      TC_ERROR("advection_order must be in [1, 2, 3].");
+      velocity = sample_velocity(position, velocity, lerp);
     }
-    p.move(delta_t * p.velocity);
-    max_movement = std::max(max_movement, length(p.velocity * delta_t));
-    clamp_particle(p);
-  }
+    particle_arrays.set_position(i, position + delta_t * velocity);
+    particle_arrays.set_velocity(i, velocity);
+    clamp_particle(i);
+  });
 }
 
 void FLIPLiquid::apply_external_forces(real delta_t) {
-  for (auto &p : particles) {
-    p.velocity += delta_t * gravity;
+  int n = particle_arrays.size();
+  for (int k = 0; k < 2; k++) {
+    real *velocity = particle_arrays.velocity[k].data();
+    real dv = delta_t * gravity[k];
+    for (int i = 0; i < n; i++) {
+      velocity[i] += dv;
+    }
   }
 }
 
 void FLIPLiquid::rasterize() {
-  rasterize_component<Particle::get_velocity<0>>(u, u_count);
-  rasterize_component<Particle::get_velocity<1>>(v, v_count);
+  rasterize_component<0, false>(u, u_count);
+  rasterize_component<1, false>(v, v_count);
 }
 
 void FLIPLiquid::step(real delta_t) {
@@ -91,6 +174,7 @@ void FLIPLiquid::backup_velocity_field() {
 }
 
 void FLIPLiquid::substep(real delta_t) {
+  sort_particles();
   apply_external_forces(delta_t);
   mark_cells();
   rasterize();
@@ -98,6 +182,7 @@ void FLIPLiquid::substep(real delta_t) {
   apply_boundary_condition();
   compute_liquid_levelset();
   simple_extrapolate();
+  apply_viscosity(delta_t);
   project(delta_t);
   simple_extrapolate();
   advect(delta_t);
@@ -107,81 +192,147 @@ void FLIPLiquid::substep(real delta_t) {
 void FLIPLiquid::reseed() {
 }
 
+void FLIPLiquid::add_particle(Particle &particle) {
+  EulerLiquid::add_particle(particle);
+  particle_arrays.push_back(particle);
+}
+
+std::vector<Fluid::Particle> FLIPLiquid::get_particles() {
+  std::vector<Particle> particles;
+  particles.reserve(particle_arrays.size());
+  for (int i = 0; i < particle_arrays.size(); i++) {
+    particles.push_back(particle_arrays.get_particle(i));
+  }
+  return particles;
+}
+
 void FLIPLiquid::correct_particle_positions(real delta_t, bool clear_c) {
   if (correction_strength == 0.0_f && !clear_c) {
     return;
   }
-  NearestNeighbour2D nn;
   real range = 0.5f;
-  std::vector<Vector2> positions;
-  for (auto &p : particles) {
-    positions.push_back(p.position);
-  }
-  nn.initialize(positions);
-  std::vector<Vector2> delta_pos(particles.size());
-  for (int i = 0; i < (int)particles.size(); i++) {
-    delta_pos[i] = Vector2(0);
-    auto &p = particles[i];
+  int n = particle_arrays.size();
+  std::vector<Vector2> positions(n);
+  for (int i = 0; i < n; i++) {
+    positions[i] = particle_arrays.get_position(i);
+  }
+  NeighbourGrid2D grid(positions, range, num_threads);
+  // The queries run in parallel; the pushes are then accumulated serially,
+  // in particle order, since each one also moves the neighbour
+  int m = correction_neighbours;
+  std::vector<int> neighbours(n * m);
+  ThreadedTaskManager::run(n, num_threads, [&](int i) {
     std::vector<int> neighbour_index;
-    std::vector<real> neighbour_dist;
-    nn.query_n(p.position, correction_neighbours, neighbour_index,
-               neighbour_dist);
-    for (auto nei_index : neighbour_index) {
+    std::vector<real> neighbour_dist2;
+    grid.query_n(positions[i], m, neighbour_index, neighbour_dist2);
+    std::copy(neighbour_index.begin(), neighbour_index.end(),
+              neighbours.begin() + i * m);
+    if (clear_c && (m <= 1 || neighbour_dist2[1] > 1.5f)) {
+      for (int k = 0; k < 2; k++) {
+        particle_arrays.c[k][0][i] = particle_arrays.c[k][1][i] = 0.0_f;
+      }
+    }
+  });
+  std::vector<Vector2> delta_pos(n, Vector2(0));
+  for (int i = 0; i < n; i++) {
+    for (int j = 0; j < m; j++) {
+      int nei_index = neighbours[i * m + j];
       if (nei_index == -1) {
         break;
       }
-      auto &nei = particles[nei_index];
-      real dist = length(p.position - nei.position);
-      Vector2 dir = (p.position - nei.position) / Vector2(dist);
+      real dist = length(positions[i] - positions[nei_index]);
+      Vector2 dir = (positions[i] - positions[nei_index]) / Vector2(dist);
       if (dist > 1e-4f && dist < range) {
         real a = correction_strength * delta_t * pow(1 - dist / range, 2);
         delta_pos[i] += a * dir;
         delta_pos[nei_index] -= a * dir;
       }
     }
-    if (clear_c && (neighbour_index.size() <= 1 || neighbour_dist[1] > 1.5f)) {
-      p.c[0] = p.c[1] = Vector2(0.0_f);
-    }
-  }
-  for (int i = 0; i < (int)particles.size(); i++) {
-    particles[i].position += delta_pos[i];
-    clamp_particle(particles[i]);
   }
+  ThreadedTaskManager::run(n, num_threads, [&](int i) {
+    particle_arrays.set_position(i, positions[i] + delta_pos[i]);
+    clamp_particle(i);
+  });
 }
 
-template <real (*T)(const Fluid::Particle &, const Vector2 &)>
+template <int k, bool affine>
 void FLIPLiquid::rasterize_component(Array<real> &val, Array<real> &count) {
   val = 0;
   count = 0;
   real inv_kernel_size = 1.0_f / kernel_size;
   int extent = (kernel_size + 1) / 2;
-  for (auto &p : particles) {
-    for (auto &ind : val.get_rasterization_region(p.position, extent)) {
-      Vector2 delta_pos = ind.get_pos() - p.position;
+  const real *x = particle_arrays.position[0].data();
+  const real *y = particle_arrays.position[1].data();
+  const real *velocity = particle_arrays.velocity[k].data();
+  const real *c_x = particle_arrays.c[k][0].data();
+  const real *c_y = particle_arrays.c[k][1].data();
+  auto scatter = [&](int i) {
+    Vector2 position(x[i], y[i]);
+    for (auto &ind : val.get_rasterization_region(position, extent)) {
+      Vector2 delta_pos = ind.get_pos() - position;
       real weight = kernel(inv_kernel_size * delta_pos);
-      val[ind] += weight * T(p, delta_pos);
+      real value = velocity[i];
+      if (affine) {
+        value += c_x[i] * delta_pos.x + c_y[i] * delta_pos.y;
+      }
+      val[ind] += weight * value;
       count[ind] += weight;
     }
+  };
+
+  // Particles are binned into strips of whole columns, wide enough that
+  // the stencils of particles two strips apart never overlap. The even
+  // strips are then scattered in parallel, followed by the odd ones,
+  // without locks. Each strip keeps the particle order, so the sums do not
+  // depend on the number of threads.
+  int width = val.get_width();
+  int strip_width = std::max(8, 2 * extent);
+  int num_strips = (width + strip_width - 1) / strip_width;
+  int n = particle_arrays.size();
+  std::vector<int> strip(n), strip_begin(num_strips + 1, 0);
+  for (int i = 0; i < n; i++) {
+    strip[i] = clamp((int)std::floor(x[i]), 0, width - 1) / strip_width;
+    strip_begin[strip[i] + 1]++;
   }
-  for (auto ind : val.get_region()) {
-    if (count[ind] > 0) {
-      val[ind] /= count[ind];
-    }
+  for (int s = 0; s < num_strips; s++) {
+    strip_begin[s + 1] += strip_begin[s];
+  }
+  std::vector<int> strip_particles(n);
+  std::vector<int> strip_end(strip_begin.begin(), strip_begin.end() - 1);
+  for (int i = 0; i < n; i++) {
+    strip_particles[strip_end[strip[i]]++] = i;
   }
+  for (int parity = 0; parity < 2; parity++) {
+    ThreadedTaskManager::run(
+        [&](int t) {
+          int s = 2 * t + parity;
+          for (int p = strip_begin[s]; p < strip_begin[s + 1]; p++) {
+            scatter(strip_particles[p]);
+          }
+        },
+        0, (num_strips + 1 - parity) / 2, num_threads);
+  }
+
+  int height = val.get_height();
+  ThreadedTaskManager::run(
+      [&](int i) {
+        for (int j = 0; j < height; j++) {
+          if (count[i][j] > 0) {
+            val[i][j] /= count[i][j];
+          }
+        }
+      },
+      0, width, num_threads);
 }
 
-template void FLIPLiquid::rasterize_component<Fluid::Particle::get_velocity<0>>(
-    Array<real> &val,
-    Array<real> &count);
-template void FLIPLiquid::rasterize_component<Fluid::Particle::get_velocity<1>>(
-    Array<real> &val,
-    Array<real> &count);
-template void FLIPLiquid::rasterize_component<
-    Fluid::Particle::get_affine_velocity<0>>(Array<real> &val,
-                                             Array<real> &count);
-template void FLIPLiquid::rasterize_component<
-    Fluid::Particle::get_affine_velocity<1>>(Array<real> &val,
-                                             Array<real> &count);
+template void FLIPLiquid::rasterize_component<0, false>(Array<real> &val,
+                                                        Array<real> &count);
+template void FLIPLiquid::rasterize_component<1, false>(Array<real> &val,
+                                                        Array<real> &count);
+template void FLIPLiquid::rasterize_component<0, true>(Array<real> &val,
+                                                       Array<real> &count);
+template void FLIPLiquid::rasterize_component<1, true>(Array<real> &val,
+                                                       Array<real> &count);
 
 TC_IMPLEMENTATION(Fluid, FLIPLiquid, "flip_liquid");
 
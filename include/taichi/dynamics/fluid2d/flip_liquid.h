@@ -6,11 +6,58 @@
 #pragma once
 
 #include "taichi/dynamics/fluid2d/euler_liquid.h"
+#include <taichi/system/threading.h>
 
 TC_NAMESPACE_BEGIN
 
 class FLIPLiquid : public EulerLiquid {
  protected:
+  // The particles as a structure of arrays, so that the transfers stream
+  // through one component at a time. Kept sorted by cell in Morton order
+  // (see sort_particles()), so that consecutive particles touch the same
+  // grid cache lines.
+  struct ParticleArrays {
+    std::vector<real> position[2], velocity[2];
+    // Component d of Particle::c[k], for APIC
+    std::vector<real> c[2][2];
+    std::vector<real> temperature, radius;
+    std::vector<Vector3> color;
+    std::vector<long long> id;
+
+    int size() const {
+      return (int)id.size();
+    }
+
+    Vector2 get_position(int i) const {
+      return Vector2(position[0][i], position[1][i]);
+    }
+
+    Vector2 get_velocity(int i) const {
+      return Vector2(velocity[0][i], velocity[1][i]);
+    }
+
+    void set_position(int i, const Vector2 &p) {
+      position[0][i] = p.x;
+      position[1][i] = p.y;
+    }
+
+    void set_velocity(int i, const Vector2 &v) {
+      velocity[0][i] = v.x;
+      velocity[1][i] = v.y;
+    }
+
+    void push_back(const Particle &p);
+
+    Particle get_particle(int i) const;
+
+    // Particle i becomes the particle previously at order[i]
+    void permute(const std::vector<int> &order);
+  };
+
+  ParticleArrays particle_arrays;
+  // Substeps between two sorts; 0 disables sorting
+  int particle_sort_interval;
+  int substeps_since_sort;
   Array<real> u_backup;
   Array<real> v_backup;
   Array<real> u_count;
@@ -21,7 +68,11 @@ class FLIPLiquid : public EulerLiquid {
   real correction_strength;
   int correction_neighbours;
 
-  void clamp_particle(Particle &p);
+  void clamp_particle(int i);
+
+  // Sorts the particles by cell if particle_sort_interval substeps passed
+  // since the last sort
+  void sort_particles();
 
   virtual void initialize_solver(const Config &config);
 
@@ -33,7 +84,9 @@ class FLIPLiquid : public EulerLiquid {
 
   virtual void rasterize();
 
-  template <real (*T)(const Particle &, const Vector2 &)>
+  // Transfers velocity component |k| to |val|, with the APIC affine term
+  // if |affine|
+  template <int k, bool affine>
   void rasterize_component(Array<real> &val, Array<real> &count);
 
   virtual void backup_velocity_field();
@@ -49,6 +102,10 @@ class FLIPLiquid : public EulerLiquid {
   }
 
   virtual void step(real delta_t);
+
+  virtual void add_particle(Particle &particle) override;
+
+  virtual std::vector<Particle> get_particles() override;
 };
 
 TC_NAMESPACE_END
@@ -9,6 +9,7 @@
 #include <taichi/common/interface.h>
 #include <taichi/math/array_2d.h>
 #include <taichi/math/levelset.h>
+#include <taichi/io/frame_writer.h>
 
 TC_NAMESPACE_BEGIN
 
@@ -94,11 +95,42 @@ class Fluid {
     return Array<real>(Vector2i(0, 0));
   }
 
+  // The fields that write_frame() copies: the particle positions and the
+  // density
+  virtual void snapshot_frame(FrameWriter::Frame &frame) {
+    std::vector<Particle> particles = get_particles();
+    std::vector<Vector2> positions(particles.size());
+    for (int i = 0; i < (int)particles.size(); i++) {
+      positions[i] = particles[i].position;
+    }
+    frame.add("particle_positions", std::move(positions));
+    frame.add("density", get_density());
+  }
+
+  // Copies the fields of snapshot_frame() and writes them to the stream
+  // |fn| in the background, waiting while two frames are still being
+  // written; see Simulation::write_frame()
+  void write_frame(const std::string &fn) {
+    if (!frame_writer) {
+      frame_writer = std::make_shared<FrameWriter>();
+    }
+    FrameWriter::Frame frame;
+    snapshot_frame(frame);
+    frame_writer->write(fn, std::move(frame));
+  }
+
+  void flush_frames() {
+    if (frame_writer) {
+      frame_writer->flush();
+    }
+  }
+
   virtual ~Fluid() {
   }
 
  protected:
   std::vector<Particle> particles;
+  std::shared_ptr<FrameWriter> frame_writer;
 };
 
 TC_INTERFACE(Fluid);
@@ -12,6 +12,7 @@ TC_NAMESPACE_BEGIN
 class PoissonSolver2D : public Unit {
  protected:
   typedef Array2D<real> Array;
+  int last_iterations = 0;
 
  public:
   typedef unsigned char CellType;
@@ -22,7 +23,31 @@ class PoissonSolver2D : public Unit {
 
   virtual void run(const Array &b, Array &x, real tolerance){};
 
+  // Iterations (V-cycles, or Krylov steps) of the last run()
+  virtual int get_last_iterations() const {
+    return last_iterations;
+  }
+
+  // Whether v_cycle() and the extra diagonal are supported, as needed to
+  // precondition, e.g. by multigrid solvers; check before using them
+  virtual bool is_multigrid() const {
+    return false;
+  }
+
+  // One multigrid cycle from a zero guess, x ~= L^-1 b, to precondition
+  // Krylov solvers of systems close to L. Only with is_multigrid().
+  virtual void v_cycle(const Array &b, Array &x) {
+    TC_NOT_IMPLEMENTED
+  }
+
   virtual void set_boundary_condition(const BCArray &boundary){};
+
+  // Same, with |extra_diagonal| added to the diagonal of interior cells.
+  // Only with is_multigrid().
+  virtual void set_boundary_condition(const BCArray &boundary,
+                                      const Array &extra_diagonal) {
+    TC_NOT_IMPLEMENTED
+  }
 };
 
 TC_INTERFACE(PoissonSolver2D);
@@ -31,6 +56,7 @@ class PoissonSolver3D : public Unit {
  protected:
   typedef Array3D<real> Array;
   int maximum_iterations;
+  int last_iterations = 0;
 
  public:
   typedef unsigned char CellType;
@@ -41,8 +67,15 @@ class PoissonSolver3D : public Unit {
 
   void initialize(const Config &config);
 
+  // Solves L x = b; |x| holds the initial guess, e.g. the previous
+  // solution of a time-coherent problem, or 0
   virtual void run(const Array &b, Array &x, real tolerance){};
 
+  // Iterations (V-cycles, or Krylov steps) of the last run()
+  virtual int get_last_iterations() const {
+    return last_iterations;
+  }
+
   virtual void set_boundary_condition(const BCArray &boundary){};
 };
 
@@ -9,6 +9,8 @@
 #include <taichi/visualization/particle_visualization.h>
 #include <vector>
 #include <taichi/math/levelset.h>
+#include <taichi/system/threading.h>
+#include <taichi/io/frame_writer.h>
 
 TC_NAMESPACE_BEGIN
 
@@ -18,6 +20,11 @@ class Simulation : public Unit {
   real current_t = 0.0_f;
   int num_threads;
   std::string working_directory;
+  // Returned by get_render_particles_view()
+  std::vector<RenderParticle> render_particles;
+  // Of write_frame(), created by the first call
+  int max_pending_frames;
+  std::shared_ptr<FrameWriter> frame_writer;
 
  public:
   static constexpr int dim = dim_;
@@ -34,6 +41,7 @@ class Simulation : public Unit {
 
   Simulation() {
     num_threads = -1;
+    max_pending_frames = 2;
   }
 
   virtual real get_current_time() const {
@@ -43,7 +51,11 @@ class Simulation : public Unit {
   virtual void initialize(const Config &config) override {
     // Use all threads by default
     num_threads = config.get("num_threads", -1);
+    if (config.has_key("pin_threads")) {
+      ThreadedTaskManager::set_thread_pinning(config.get<bool>("pin_threads"));
+    }
     working_directory = config.get("working_directory", "/tmp/");
+    max_pending_frames = config.get("max_pending_frames", 2);
   }
 
   virtual std::string add_particles(const Config &config) {
@@ -60,6 +72,74 @@ class Simulation : public Unit {
     return std::vector<RenderParticle>();
   }
 
+  // The same particles in a buffer owned by the simulation, valid until the
+  // next call. Exported by reference, so that large particle sets are not
+  // reallocated and copied for Python every frame.
+  virtual const std::vector<RenderParticle> &get_render_particles_view() {
+    render_particles = get_render_particles();
+    return render_particles;
+  }
+
+  // The fields that write_frame() copies; the render particles by default
+  virtual void snapshot_frame(FrameWriter::Frame &frame) const {
+    frame.add("render_particles", get_render_particles());
+  }
+
+  // Copies the fields of snapshot_frame() and writes them to the stream
+  // |fn| in the background, during the next steps. Waits while
+  // 'max_pending_frames' frames are still being written.
+  void write_frame(const std::string &fn) {
+    FrameWriter::Frame frame;
+    snapshot_frame(frame);
+    get_frame_writer().write(fn, std::move(frame));
+  }
+
+  // Saves the state of binary_io() to the stream |fn|: the fields of
+  // TC_IO_DEF_WITH_BASE in subclasses, after those of Simulation. The state
+  // is serialized to memory and written in the background after the
+  // frames queued before, so that the simulation only waits for the copy.
+  void save_checkpoint(const std::string &fn) {
+    BinaryOutputSerializer writer;
+    writer.initialize();
+    binary_io(writer);
+    writer.finalize();
+    FrameWriter::Frame frame;
+    frame.add_bytes("checkpoint", std::move(writer.data));
+    get_frame_writer().write(fn, std::move(frame));
+  }
+
+  // Restores the state of save_checkpoint() into a simulation initialized
+  // with the same config
+  virtual void load_checkpoint(const std::string &fn) {
+    // The checkpoint may still be pending
+    flush_frames();
+    BinaryFileStreamInput stream(fn);
+    TC_ERROR_IF(!stream.has_field("checkpoint"), "[{}] is not a checkpoint",
+                fn);
+    std::vector<uint8> data(stream.get_field_size("checkpoint"));
+    stream.seek("checkpoint");
+    stream.read(data.data(), data.size());
+    BinaryInputSerializer reader;
+    reader.initialize((void *)data.data());
+    binary_io(reader);
+    reader.finalize();
+  }
+
+  // Waits until the frames of write_frame() are written
+  void flush_frames() {
+    if (frame_writer) {
+      frame_writer->flush();
+    }
+  }
+
+  FrameWriter &get_frame_writer() {
+    if (!frame_writer) {
+      frame_writer =
+          std::make_shared<FrameWriter>(max_pending_frames, 1, num_threads);
+    }
+    return *frame_writer;
+  }
+
   virtual void set_levelset(const DynamicLevelSet<dim> &levelset) {
     this->levelset = levelset;
   }
@@ -4,14 +4,16 @@
 *******************************************************************************/
 
 #include <taichi/geometry/factory.h>
+#include <taichi/system/threading.h>
 
 TC_NAMESPACE_BEGIN
 
-std::vector<Triangle> Mesh3D::generate(const Vector2i res,
-                                       const Function23 *surf,
-                                       const Function23 *norm,
-                                       const Function22 *uv,
-                                       bool smooth_normal) {
+MeshData Mesh3D::generate_indexed(const Vector2i res,
+                                  const Function23 *surf,
+                                  const Function23 *norm,
+                                  const Function22 *uv,
+                                  bool smooth_normal,
+                                  int num_threads) {
   const Vector2 dp = Vector2(1.0) / res.cast<real>();
 
   assert_info(surf != nullptr, "Surface function cannot be null");
@@ -19,70 +21,90 @@ std::vector<Triangle> Mesh3D::generate(const Vector2i res,
   auto get_normal_at = [&](const Vector2 &p) -> Vector3 {
     if (norm) {
       return normalized((*norm)(p));
-    } else if (smooth_normal) {
+    } else {
       Vector3 u = normalized((*surf)(p + dp * Vector2(1, 0)) -
                              (*surf)(p + dp * Vector2(-1, 0)));
       Vector3 v = normalized((*surf)(p + dp * Vector2(0, 1)) -
                              (*surf)(p + dp * Vector2(0, -1)));
       return normalized(cross(u, v));
-    } else {
-      // Useless value
-      return Vector3(1, 0, 0);
     }
   };
-  auto get_uv_at = [&](const Vector2 &p) -> Vector2 {
-    if (uv) {
-      return (*uv)(p);
-    } else {
-      return p;
-    }
-  };
-  Array2D<Vector3> vertices(res + Vector2i(1));
-  Array2D<Vector3> normals(res + Vector2i(1));
-  Array2D<Vector2> uvs(res + Vector2i(1));
-  for (int i = 0; i < res[0] + 1; i++) {
-    for (int j = 0; j < res[1] + 1; j++) {
-      Vector2 p = Vector2(real(i), real(j)) / res.cast<real>();
-      vertices[i][j] = (*surf)(p);
-      normals[i][j] = get_normal_at(p);
-      uvs[i][j] = get_uv_at(p);
-    }
-  }
-  std::vector<Triangle> triangles;
-  int counter = 0;
+
+  // Vertex (i, j) of the grid is i * (res[1] + 1) + j
+  int columns = res[1] + 1;
+  int num_vertices = (res[0] + 1) * columns;
+  MeshData data;
+  data.positions.resize(num_vertices);
+  data.uvs.resize(num_vertices);
   if (smooth_normal) {
-    for (int i = 0; i < res[0]; i++) {
-      for (int j = 0; j < res[1]; j++) {
-        triangles.push_back(
-            Triangle(vertices[i][j], vertices[i + 1][j], vertices[i + 1][j + 1],
-                     normals[i][j], normals[i + 1][j], normals[i + 1][j + 1],
-                     uvs[i][j], uvs[i + 1][j], uvs[i + 1][j + 1], counter++));
-        triangles.push_back(
-            Triangle(vertices[i][j], vertices[i + 1][j + 1], vertices[i][j + 1],
-                     normals[i][j], normals[i + 1][j + 1], normals[i][j + 1],
-                     uvs[i][j], uvs[i + 1][j + 1], uvs[i][j + 1], counter++));
-      }
-    }
-  } else {
-    for (int i = 0; i < res[0]; i++) {
-      for (int j = 0; j < res[1]; j++) {
-        Vector3 normal;
-        normal = normalized(cross(vertices[i + 1][j] - vertices[i][j],
-                                  vertices[i + 1][j + 1] - vertices[i][j]));
-        triangles.push_back(Triangle(vertices[i][j], vertices[i + 1][j],
-                                     vertices[i + 1][j + 1], normal, normal,
-                                     normal, uvs[i][j], uvs[i + 1][j],
-                                     uvs[i + 1][j + 1], counter++));
-        normal = normalized(cross(vertices[i + 1][j + 1] - vertices[i][j],
-                                  vertices[i][j + 1] - vertices[i][j]));
-        triangles.push_back(Triangle(vertices[i][j], vertices[i + 1][j + 1],
-                                     vertices[i][j + 1], normal, normal, normal,
-                                     uvs[i][j], uvs[i + 1][j + 1],
-                                     uvs[i][j + 1], counter++));
-      }
-    }
+    data.normals.resize(num_vertices);
   }
+  ThreadedTaskManager::run(
+      [&](int i) {
+        for (int j = 0; j < columns; j++) {
+          Vector2 p = Vector2(real(i), real(j)) / res.cast<real>();
+          int v = i * columns + j;
+          data.positions[v] = (*surf)(p);
+          data.uvs[v] = uv ? (*uv)(p) : p;
+          if (smooth_normal) {
+            data.normals[v] = get_normal_at(p);
+          }
+        }
+      },
+      0, res[0] + 1, num_threads);
+
+  // Triangles (i, j), (i + 1, j), (i + 1, j + 1) and (i, j),
+  // (i + 1, j + 1), (i, j + 1) of each cell
+  int num_triangles = 2 * res[0] * res[1];
+  data.position_indices.resize(num_triangles * 3);
+  ThreadedTaskManager::run(
+      [&](int i) {
+        for (int j = 0; j < res[1]; j++) {
+          int v00 = i * columns + j, v01 = v00 + 1;
+          int v10 = v00 + columns, v11 = v10 + 1;
+          int *index = &data.position_indices[(i * res[1] + j) * 6];
+          int cell[6] = {v00, v10, v11, v00, v11, v01};
+          std::copy(cell, cell + 6, index);
+        }
+      },
+      0, res[0], num_threads);
+  data.uv_indices = data.position_indices;
+  data.normal_indices = smooth_normal ? data.position_indices
+                                      : std::vector<int>(num_triangles * 3, -1);
+  return data;
+}
+
+std::vector<Triangle> Mesh3D::generate(const Vector2i res,
+                                       const Function23 *surf,
+                                       const Function23 *norm,
+                                       const Function22 *uv,
+                                       bool smooth_normal,
+                                       int num_threads) {
+  MeshData data =
+      generate_indexed(res, surf, norm, uv, smooth_normal, num_threads);
+  std::vector<Triangle> triangles(data.get_num_triangles());
+  ThreadedTaskManager::run(
+      [&](int t) {
+        const int *index = &data.position_indices[t * 3];
+        Vector3 v[3], normal[3];
+        Vector2 uvs[3];
+        for (int k = 0; k < 3; k++) {
+          v[k] = data.positions[index[k]];
+          uvs[k] = data.uvs[index[k]];
+        }
+        if (smooth_normal) {
+          for (int k = 0; k < 3; k++) {
+            normal[k] = data.normals[index[k]];
+          }
+        } else {
+          normal[0] = normal[1] = normal[2] =
+              normalized(cross(v[1] - v[0], v[2] - v[0]));
+        }
+        triangles[t] = Triangle(v[0], v[1], v[2], normal[0], normal[1],
+                                normal[2], uvs[0], uvs[1], uvs[2], t);
+      },
+      0, (int)triangles.size(), num_threads);
   return triangles;
 }
 
-TC_NAMESPACE_END
\ No newline at end of file
+TC_NAMESPACE_END
@@ -11,6 +11,7 @@
 #include <taichi/math/array_2d.h>
 
 #include <taichi/geometry/primitives.h>
+#include <taichi/io/mesh_reader.h>
 
 TC_NAMESPACE_BEGIN
 
@@ -33,14 +34,31 @@ using Function31 = VectorFunction<3, 1, real>;
 using Function32 = VectorFunction<3, 2, real>;
 using Function33 = VectorFunction<3, 3, real>;
 
+// Tessellations of parametric surfaces over [0, 1]^2, with two triangles
+// per cell of a res[0] x res[1] grid. The functions are evaluated at the
+// vertices of the grid by rows, on 'num_threads' threads (-1: all), so they
+// must be thread safe (those from Python take the GIL).
 class Mesh3D {
  public:
-  // norm and uv can be null
+  // norm and uv can be null. Normals are those of |norm|, or finite
+  // differences of |surf|, with |smooth_normal|, and those of the faces
+  // otherwise.
   static std::vector<Triangle> generate(const Vector2i res,
                                         const Function23 *surf,
                                         const Function23 *norm,
                                         const Function22 *uv,
-                                        bool smooth_normal);
+                                        bool smooth_normal,
+                                        int num_threads = -1);
+
+  // The same triangles, indexed: the vertices of the grid are shared, and
+  // flat normals are left to the faces (normal indices -1), as for
+  // Mesh::load_mesh_data()
+  static MeshData generate_indexed(const Vector2i res,
+                                   const Function23 *surf,
+                                   const Function23 *norm,
+                                   const Function22 *uv,
+                                   bool smooth_normal,
+                                   int num_threads = -1);
 };
 
 TC_NAMESPACE_END
@@ -17,6 +17,7 @@ class Ray {
   Ray(Vector3 orig, Vector3 dir, real time = 0)
       : orig(orig), dir(dir), time(time), dist(DIST_INFINITE) {
     triangle_id = -1;
+    instance_id = -1;
   }
 
   Vector3 at(real d) const {
@@ -26,6 +27,10 @@ class Ray {
   Vector3 orig, dir;
   real time, dist;
   int triangle_id;
+  // Index of the hit instance, -1 for non-instanced geometry. For instance
+  // hits |triangle_id| is local to the instanced mesh. Sphere hits report
+  // the id of their set, see RayIntersection::add_spheres.
+  int instance_id;
   Vector3 geometry_normal;
   real u, v;
 
@@ -87,7 +92,11 @@ struct Triangle {
   }
 
   Triangle get_transformed(const Matrix4 &transform) const {
-    const Matrix4 normal_transform = transposed(inversed(transform));
+    return get_transformed(transform, transposed(inversed(transform)));
+  }
+
+  Triangle get_transformed(const Matrix4 &transform,
+                           const Matrix4 &normal_transform) const {
     return Triangle(multiply_matrix4(transform, v[0], 1.0_f),
                     multiply_matrix4(transform, v[0] + v10, 1.0_f),
                     multiply_matrix4(transform, v[0] + v20, 1.0_f),
@@ -160,6 +169,42 @@ struct Triangle {
     }
     return v[0] + v10 * x + v20 * y;
   }
+  // Of the triangle as seen from |p| (Van Oosterom and Strackee)
+  real get_solid_angle(const Vector3 &p) const {
+    Vector3 a = normalized(v[0] - p), b = normalized(v[1] - p),
+            c = normalized(v[2] - p);
+    return std::abs(
+        2 * std::atan2(dot(a, cross(b, c)),
+                       1 + dot(a, b) + dot(b, c) + dot(c, a)));
+  }
+  // A direction from |p| to the triangle, uniform in solid angle (Arvo,
+  // "Stratified Sampling of Spherical Triangles"). Loses precision for
+  // solid angles below about 1e-4.
+  Vector3 sample_direction(const Vector3 &p, real x, real y) const {
+    Vector3 a = normalized(v[0] - p), b = normalized(v[1] - p),
+            c = normalized(v[2] - p);
+    Vector3 n_ab = normalized(cross(a, b)), n_bc = normalized(cross(b, c)),
+            n_ca = normalized(cross(c, a));
+    // Inner angles at a, b and c
+    real alpha = angle_between(n_ab, -n_ca), beta = angle_between(n_bc, -n_ab),
+         gamma = angle_between(n_ca, -n_bc);
+    // The subtriangle with a fraction |x| of the area, by its vertex on ca
+    real area = pi + x * (alpha + beta + gamma - pi);
+    real sin_alpha = std::sin(alpha), cos_alpha = std::cos(alpha);
+    real sin_phi = std::sin(area) * cos_alpha - std::cos(area) * sin_alpha,
+         cos_phi = std::cos(area) * cos_alpha + std::sin(area) * sin_alpha;
+    real k1 = cos_phi + cos_alpha, k2 = sin_phi - sin_alpha * dot(a, b);
+    real cos_b = (k2 + (k2 * cos_phi - k1 * sin_phi) * cos_alpha) /
+                 ((k2 * sin_phi + k1 * cos_phi) * sin_alpha);
+    cos_b = clamp(cos_b, -1.0_f, 1.0_f);
+    real sin_b = std::sqrt(std::max(0.0_f, 1 - cos_b * cos_b));
+    Vector3 c_sub = cos_b * a + sin_b * normalized(c - dot(c, a) * a);
+    // Uniform along the arc from b, in the height above b
+    real cos_theta = 1 - y * (1 - dot(c_sub, b));
+    real sin_theta = std::sqrt(std::max(0.0_f, 1 - cos_theta * cos_theta));
+    return normalized(cos_theta * b +
+                      sin_theta * normalized(c_sub - dot(c_sub, b) * b));
+  }
   real get_height(const Vector3 &p) const {
     return dot(normal, p - v[0]);
   }
@@ -184,6 +229,16 @@ struct Triangle {
   Vector3 get_center() const {
     return (v[0] + v[1] + v[2]) * (1.0_f / 3);
   }
+
+ private:
+  // Accurate for nearly (anti)parallel unit vectors too
+  static real angle_between(const Vector3 &a, const Vector3 &b) {
+    if (dot(a, b) < 0) {
+      return pi - 2 * std::asin(std::min(1.0_f, length(a + b) * 0.5_f));
+    } else {
+      return 2 * std::asin(std::min(1.0_f, length(a - b) * 0.5_f));
+    }
+  }
 };
 
 class BoundingBox {
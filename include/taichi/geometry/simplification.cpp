@@ -0,0 +1,379 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#include <taichi/geometry/simplification.h>
+
+#include <algorithm>
+#include <limits>
+#include <queue>
+
+TC_NAMESPACE_BEGIN
+
+namespace {
+
+// Sum of the squared distances to a set of planes, as the symmetric 4x4
+// matrix of the planes (n, d), in double for the large sums
+struct Quadric {
+  double q[10] = {0};  // 00 01 02 03 11 12 13 22 23 33
+
+  void add_plane(const Vector3 &n, real d, double weight = 1) {
+    double a = n.x, b = n.y, c = n.z, e = d;
+    q[0] += weight * a * a, q[1] += weight * a * b, q[2] += weight * a * c;
+    q[3] += weight * a * e, q[4] += weight * b * b, q[5] += weight * b * c;
+    q[6] += weight * b * e, q[7] += weight * c * c, q[8] += weight * c * e;
+    q[9] += weight * e * e;
+  }
+
+  void operator+=(const Quadric &o) {
+    for (int i = 0; i < 10; i++) {
+      q[i] += o.q[i];
+    }
+  }
+
+  double evaluate(const Vector3 &p) const {
+    double x = p.x, y = p.y, z = p.z;
+    return q[0] * x * x + q[4] * y * y + q[7] * z * z +
+           2 * (q[1] * x * y + q[2] * x * z + q[5] * y * z) +
+           2 * (q[3] * x + q[6] * y + q[8] * z) + q[9];
+  }
+};
+
+// Of the planes of open edges, against moving them, which opens cracks at
+// seams (vertices split for texture coordinates or normals).
+constexpr double boundary_weight = 1000;
+
+// Vertex |from| into |to|, valid while neither has changed since
+struct Collapse {
+  double cost;
+  int from, to;
+  int from_version, to_version;
+
+  // Cheapest on top of std::priority_queue, ties broken by the vertices
+  bool operator<(const Collapse &o) const {
+    if (cost != o.cost) {
+      return cost > o.cost;
+    }
+    if (from != o.from) {
+      return from > o.from;
+    }
+    return to > o.to;
+  }
+};
+
+class Simplifier {
+ public:
+  Simplifier(const std::vector<Vector3> &positions,
+             const std::vector<int> &indices)
+      : positions(positions), tri(indices) {
+    int n = (int)positions.size();
+    int m = (int)indices.size() / 3;
+    face_alive.assign(m, true);
+    num_alive = m;
+    vertex_faces.resize(n);
+    version.assign(n, 0);
+    removed.assign(n, false);
+    collapsed_into.assign(n, -1);
+    quadrics.resize(n);
+    std::vector<std::pair<uint64, int>> edges;
+    for (int f = 0; f < m; f++) {
+      const int *v = &tri[f * 3];
+      if (v[0] == v[1] || v[1] == v[2] || v[2] == v[0]) {
+        face_alive[f] = false;
+        num_alive--;
+        continue;
+      }
+      Vector3 normal = get_normal(v[0], v[1], v[2]);
+      real len = length(normal);
+      if (len > 0) {
+        normal = normal / len;
+        for (int k = 0; k < 3; k++) {
+          quadrics[v[k]].add_plane(normal, -dot(normal, positions[v[k]]));
+        }
+      }
+      for (int k = 0; k < 3; k++) {
+        vertex_faces[v[k]].push_back(f);
+        edges.push_back(std::make_pair(get_edge_key(v[k], v[(k + 1) % 3]),
+                                       f * 3 + k));
+      }
+    }
+    std::sort(edges.begin(), edges.end());
+    for (int i = 0; i < (int)edges.size(); i++) {
+      uint64 key = edges[i].first;
+      if (i > 0 && edges[i - 1].first == key) {
+        continue;
+      }
+      int a = (int)(key >> 32), b = (int)(key & 0xffffffffu);
+      bool open = i + 1 == (int)edges.size() || edges[i + 1].first != key;
+      if (open) {
+        int corner = edges[i].second;
+        const int *v = &tri[corner / 3 * 3];
+        Vector3 normal = get_normal(v[0], v[1], v[2]);
+        Vector3 side = cross(positions[b] - positions[a], normal);
+        real len = length(side);
+        if (len > 0) {
+          side = side / len;
+          real d = -dot(side, positions[a]);
+          quadrics[a].add_plane(side, d, boundary_weight);
+          quadrics[b].add_plane(side, d, boundary_weight);
+        }
+      }
+    }
+    // With the complete quadrics
+    for (int i = 0; i < (int)edges.size(); i++) {
+      uint64 key = edges[i].first;
+      if (i == 0 || edges[i - 1].first != key) {
+        push_collapse((int)(key >> 32), (int)(key & 0xffffffffu));
+      }
+    }
+  }
+
+  std::vector<MeshLevelOfDetail> simplify(int levels, real ratio) {
+    std::vector<MeshLevelOfDetail> result;
+    for (int l = 0; l < levels; l++) {
+      int previous = num_alive;
+      int target = (int)(previous * ratio);
+      if (target < 1) {
+        break;
+      }
+      while (num_alive > target && !heap.empty()) {
+        Collapse c = heap.top();
+        heap.pop();
+        if (removed[c.from] || removed[c.to] ||
+            version[c.from] != c.from_version ||
+            version[c.to] != c.to_version || !can_collapse(c.from, c.to)) {
+          continue;
+        }
+        collapse(c.from, c.to);
+      }
+      if (num_alive == previous) {
+        break;
+      }
+      // Coarser levels are never reported closer
+      real error = get_error();
+      if (!result.empty()) {
+        error = std::max(error, result.back().error);
+      }
+      result.emplace_back();
+      MeshLevelOfDetail &level = result.back();
+      level.indices.reserve(num_alive * 3);
+      for (int f = 0; f < (int)face_alive.size(); f++) {
+        if (face_alive[f]) {
+          level.indices.insert(level.indices.end(), &tri[f * 3],
+                               &tri[f * 3] + 3);
+        }
+      }
+      level.error = error;
+    }
+    return result;
+  }
+
+ private:
+  static uint64 get_edge_key(int a, int b) {
+    if (a > b) {
+      std::swap(a, b);
+    }
+    return ((uint64)a << 32) | (uint64)b;
+  }
+
+  Vector3 get_normal(int a, int b, int c) const {
+    return cross(positions[b] - positions[a], positions[c] - positions[a]);
+  }
+
+  bool contains(int f, int v) const {
+    return tri[f * 3] == v || tri[f * 3 + 1] == v || tri[f * 3 + 2] == v;
+  }
+
+  // Sorted vertices sharing a triangle with |v|, without |v|
+  std::vector<int> get_neighbours(int v) const {
+    std::vector<int> neighbours;
+    for (int f : vertex_faces[v]) {
+      if (!face_alive[f]) {
+        continue;
+      }
+      for (int k = 0; k < 3; k++) {
+        if (tri[f * 3 + k] != v) {
+          neighbours.push_back(tri[f * 3 + k]);
+        }
+      }
+    }
+    std::sort(neighbours.begin(), neighbours.end());
+    neighbours.erase(std::unique(neighbours.begin(), neighbours.end()),
+                     neighbours.end());
+    return neighbours;
+  }
+
+  // The largest distance of a vertex of the full mesh from the triangles
+  // around the vertex it has been collapsed into
+  real get_error() {
+    real error = 0;
+    for (int v = 0; v < (int)positions.size(); v++) {
+      int r = v;
+      while (collapsed_into[r] != -1) {
+        r = collapsed_into[r];
+      }
+      // Shortens the chains for the next levels
+      collapsed_into[v] = r == v ? -1 : r;
+      if (r == v || vertex_faces[r].empty()) {
+        continue;
+      }
+      real distance = std::numeric_limits<real>::infinity();
+      for (int f : vertex_faces[r]) {
+        if (face_alive[f]) {
+          distance = std::min(distance, get_distance(positions[v], f));
+        }
+      }
+      if (distance < std::numeric_limits<real>::infinity()) {
+        error = std::max(error, distance);
+      }
+    }
+    return error;
+  }
+
+  // From |p| to triangle |f| [Ericson 2004, 5.1.5]
+  real get_distance(const Vector3 &p, int f) const {
+    const Vector3 &a = positions[tri[f * 3]], &b = positions[tri[f * 3 + 1]],
+                  &c = positions[tri[f * 3 + 2]];
+    Vector3 ab = b - a, ac = c - a, ap = p - a;
+    real d1 = dot(ab, ap), d2 = dot(ac, ap);
+    if (d1 <= 0 && d2 <= 0) {
+      return length(ap);
+    }
+    Vector3 bp = p - b;
+    real d3 = dot(ab, bp), d4 = dot(ac, bp);
+    if (d3 >= 0 && d4 <= d3) {
+      return length(bp);
+    }
+    real vc = d1 * d4 - d3 * d2;
+    if (vc <= 0 && d1 >= 0 && d3 <= 0) {
+      return length(ap - d1 / (d1 - d3) * ab);
+    }
+    Vector3 cp = p - c;
+    real d5 = dot(ab, cp), d6 = dot(ac, cp);
+    if (d6 >= 0 && d5 <= d6) {
+      return length(cp);
+    }
+    real vb = d5 * d2 - d1 * d6;
+    if (vb <= 0 && d2 >= 0 && d6 <= 0) {
+      return length(ap - d2 / (d2 - d6) * ac);
+    }
+    real va = d3 * d6 - d5 * d4;
+    if (va <= 0 && d4 - d3 >= 0 && d5 - d6 >= 0) {
+      real w = (d4 - d3) / ((d4 - d3) + (d5 - d6));
+      return length(bp - w * (c - b));
+    }
+    real denom = va + vb + vc;
+    if (denom <= 0) {
+      // Degenerate
+      return length(ap);
+    }
+    return length(ap - (vb / denom) * ab - (vc / denom) * ac);
+  }
+
+  // Into the endpoint of the lower error of the two
+  void push_collapse(int a, int b) {
+    Quadric q = quadrics[a];
+    q += quadrics[b];
+    double cost_a = q.evaluate(positions[a]);
+    double cost_b = q.evaluate(positions[b]);
+    if (cost_a < cost_b || (cost_a == cost_b && a < b)) {
+      std::swap(a, b);
+      std::swap(cost_a, cost_b);
+    }
+    heap.push(Collapse{std::max(cost_b, 0.0), a, b, version[a], version[b]});
+  }
+
+  bool can_collapse(int from, int to) const {
+    // Link condition: the common neighbours are those of the shared faces
+    int shared = 0;
+    for (int f : vertex_faces[from]) {
+      if (face_alive[f] && contains(f, to)) {
+        shared++;
+      }
+    }
+    std::vector<int> a = get_neighbours(from), b = get_neighbours(to);
+    std::vector<int> common;
+    std::set_intersection(a.begin(), a.end(), b.begin(), b.end(),
+                          std::back_inserter(common));
+    if (shared == 0 || (int)common.size() != shared) {
+      return false;
+    }
+    // No remaining triangle may flip or degenerate
+    for (int f : vertex_faces[from]) {
+      if (!face_alive[f] || contains(f, to)) {
+        continue;
+      }
+      int v[3];
+      for (int k = 0; k < 3; k++) {
+        v[k] = tri[f * 3 + k] == from ? to : tri[f * 3 + k];
+      }
+      Vector3 before = get_normal(tri[f * 3], tri[f * 3 + 1], tri[f * 3 + 2]);
+      Vector3 after = get_normal(v[0], v[1], v[2]);
+      real len = length(before);
+      if (len > 0 && dot(before, after) <= 0.2_f * len * length(after)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  void collapse(int from, int to) {
+    for (int f : vertex_faces[from]) {
+      if (!face_alive[f]) {
+        continue;
+      }
+      if (contains(f, to)) {
+        face_alive[f] = false;
+        num_alive--;
+        continue;
+      }
+      for (int k = 0; k < 3; k++) {
+        if (tri[f * 3 + k] == from) {
+          tri[f * 3 + k] = to;
+        }
+      }
+      vertex_faces[to].push_back(f);
+    }
+    quadrics[to] += quadrics[from];
+    removed[from] = true;
+    collapsed_into[from] = to;
+    vertex_faces[from].clear();
+    version[to]++;
+    auto &faces = vertex_faces[to];
+    faces.erase(std::remove_if(faces.begin(), faces.end(),
+                               [&](int f) { return !face_alive[f]; }),
+                faces.end());
+    for (int w : get_neighbours(to)) {
+      push_collapse(to, w);
+    }
+  }
+
+  const std::vector<Vector3> &positions;
+  std::vector<int> tri;
+  std::vector<bool> face_alive;
+  int num_alive;
+  std::vector<std::vector<int>> vertex_faces;
+  std::vector<int> version;
+  std::vector<bool> removed;
+  std::vector<int> collapsed_into;
+  std::vector<Quadric> quadrics;
+  std::priority_queue<Collapse> heap;
+};
+
+}  // namespace
+
+std::vector<MeshLevelOfDetail> simplify_mesh(
+    const std::vector<Vector3> &positions,
+    const std::vector<int> &indices,
+    int levels,
+    real ratio) {
+  TC_ERROR_IF(indices.size() % 3 != 0,
+              "Mesh indices must come in threes, not {}", indices.size());
+  TC_ERROR_IF(ratio <= 0 || ratio >= 1,
+              "Simplification ratios are in (0, 1), not {}", ratio);
+  Simplifier simplifier(positions, indices);
+  return simplifier.simplify(levels, ratio);
+}
+
+TC_NAMESPACE_END
@@ -0,0 +1,41 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+#include <taichi/common/util.h>
+#include <taichi/common/serialization.h>
+#include <taichi/math/math.h>
+
+#include <vector>
+
+TC_NAMESPACE_BEGIN
+
+// A simplified version of an indexed triangle mesh: triangles over (a
+// subset of) the vertices of the full mesh, so that they keep their
+// shading attributes.
+struct MeshLevelOfDetail {
+  std::vector<int> indices;  // Three per triangle
+  // The largest distance of a vertex of the full mesh from the triangles
+  // around the vertex it was collapsed into, in object space
+  real error = 0;
+
+  TC_IO_DEF(indices, error);
+};
+
+// Up to |levels| successively coarser levels of the mesh |indices| (three
+// per triangle) over |positions|, each with |ratio| of the triangles of the
+// previous one. Edges are collapsed in the order of their quadric error
+// [Garland and Heckbert 1997], into the endpoint of lower error, unless
+// that would flip a triangle or make the surface non-manifold. Open edges
+// are kept in place by planes perpendicular to their triangle. Fewer levels
+// are returned if the mesh can not be simplified further. Deterministic.
+std::vector<MeshLevelOfDetail> simplify_mesh(
+    const std::vector<Vector3> &positions,
+    const std::vector<int> &indices,
+    int levels,
+    real ratio = 0.5_f);
+
+TC_NAMESPACE_END
@@ -0,0 +1,121 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#include "denoiser.h"
+#include "kernels.h"
+#include <taichi/physics/physics_constants.h>
+
+TC_NAMESPACE_BEGIN
+
+// B3 spline, by the distance to the center
+static const real atrous_kernel[3] = {3.0_f / 8, 1.0_f / 4, 1.0_f / 16};
+
+Array2D<Vector3> atrous_denoise(const Array2D<Vector3> &color,
+                                const Array2D<Vector3> &albedo,
+                                const Array2D<Vector3> &normal,
+                                const Array2D<real> &depth,
+                                const Array2D<real> &variance,
+                                const DenoiserConfig &config) {
+  const Vector2i res = color.get_res();
+  TC_ERROR_IF(albedo.get_res() != res || normal.get_res() != res ||
+                  depth.get_res() != res,
+              "Denoiser features do not match the image");
+  TC_ERROR_IF(!variance.empty() && variance.get_res() != res,
+              "Denoiser variance does not match the image");
+  const int width = res[0], height = res[1];
+  const int num_threads = config.num_threads;
+
+  // Demodulated by the albedo; channels without albedo are kept as they are
+  Array2D<Vector3> modulation(res), input(res), output(res);
+  Array2D<real> var(res), var_output(res);
+  Array2D<uint8> hit(res);
+  parallel_for_pixels(res, [&](int i, int j) {
+    hit[i][j] = length2(normal[i][j]) > 0;
+    for (int k = 0; k < 3; k++) {
+      modulation[i][j][k] = albedo[i][j][k] > 1e-3_f ? albedo[i][j][k] : 1;
+    }
+    input[i][j] = color[i][j] / modulation[i][j];
+  }, num_threads);
+  parallel_for_pixels(res, [&](int i, int j) {
+    real scale = luminance(modulation[i][j]);
+    if (!variance.empty()) {
+      var[i][j] = variance[i][j] / (scale * scale);
+      return;
+    }
+    // Of the luminance of the hit pixels around
+    real sum = 0, sum2 = 0;
+    int n = 0;
+    for (int x = std::max(i - 1, 0); x <= std::min(i + 1, width - 1); x++) {
+      for (int y = std::max(j - 1, 0); y <= std::min(j + 1, height - 1); y++) {
+        if (hit[x][y] == hit[i][j]) {
+          real l = luminance(input[x][y]);
+          sum += l;
+          sum2 += l * l;
+          n++;
+        }
+      }
+    }
+    var[i][j] = std::max(sum2 / n - (sum / n) * (sum / n), 0.0_f);
+  }, num_threads);
+
+  for (int iteration = 0; iteration < config.iterations; iteration++) {
+    const int step = 1 << iteration;
+    // Columns in parallel; the pixels of a column are contiguous
+    ThreadedTaskManager::run(
+        [&](int i) {
+          for (int j = 0; j < height; j++) {
+            if (!hit[i][j]) {
+              output[i][j] = input[i][j];
+              var_output[i][j] = var[i][j];
+              continue;
+            }
+            const Vector3 n_p = normal[i][j];
+            const real z_p = depth[i][j];
+            const real l_p = luminance(input[i][j]);
+            const real inv_sigma_l =
+                1 / (config.sigma_color * std::sqrt(var[i][j]) + 1e-6_f);
+            const real inv_sigma_z =
+                1 / (config.sigma_depth * std::abs(z_p) * step + 1e-6_f);
+            Vector3 sum(0.0_f);
+            real weight_sum = 0, var_sum = 0;
+            for (int dx = -2; dx <= 2; dx++) {
+              int x = i + dx * step;
+              if (x < 0 || x >= width) {
+                continue;
+              }
+              for (int dy = -2; dy <= 2; dy++) {
+                int y = j + dy * step;
+                if (y < 0 || y >= height || !hit[x][y]) {
+                  continue;
+                }
+                real w_n = std::pow(std::max(dot(n_p, normal[x][y]), 0.0_f),
+                                    config.sigma_normal);
+                real w_z = std::exp(-std::abs(z_p - depth[x][y]) * inv_sigma_z);
+                real w_l = std::exp(-std::abs(l_p - luminance(input[x][y])) *
+                                    inv_sigma_l);
+                real w = atrous_kernel[std::abs(dx)] *
+                         atrous_kernel[std::abs(dy)] * w_n * w_z * w_l;
+                sum += w * input[x][y];
+                weight_sum += w;
+                var_sum += w * w * var[x][y];
+              }
+            }
+            // The center has a weight of (3 / 8)^2
+            output[i][j] = sum / weight_sum;
+            var_output[i][j] = var_sum / (weight_sum * weight_sum);
+          }
+        },
+        0, width, num_threads);
+    std::swap(input, output);
+    std::swap(var, var_output);
+  }
+
+  parallel_for_pixels(res, [&](int i, int j) {
+    output[i][j] = input[i][j] * modulation[i][j];
+  }, num_threads);
+  return output;
+}
+
+TC_NAMESPACE_END
@@ -0,0 +1,41 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+#include <taichi/math/math.h>
+#include <taichi/math/array_2d.h>
+
+TC_NAMESPACE_BEGIN
+
+struct DenoiserConfig {
+  // Passes of the 5x5 kernel, with holes of 1, 2, 4, ... pixels
+  int iterations = 5;
+  // Of the luminance difference, in standard deviations
+  real sigma_color = 4;
+  // Exponent of the cosine between normals
+  real sigma_normal = 128;
+  // Of the depth difference, relative to the depth, per pixel of distance
+  real sigma_depth = 0.05_f;
+  int num_threads = -1;
+};
+
+// Edge-avoiding a-trous wavelet filter (after Dammertz et al., "Edge-Avoiding
+// A-Trous Wavelet Transform for fast Global Illumination Filtering", with
+// the variance-guided weights of SVGF) of |color|, the mean of the samples
+// of every pixel. The first-hit |albedo|, |normal| and |depth| (zero where
+// nothing was hit) stop the filter at edges; the color is divided by the
+// albedo before filtering and multiplied back after, to keep texture.
+// |variance| is of the mean luminance of the pixels; where it is empty, it
+// is estimated from the 3x3 neighbourhoods. Pixels without a hit are kept.
+Array2D<Vector3> atrous_denoise(
+    const Array2D<Vector3> &color,
+    const Array2D<Vector3> &albedo,
+    const Array2D<Vector3> &normal,
+    const Array2D<real> &depth,
+    const Array2D<real> &variance,
+    const DenoiserConfig &config = DenoiserConfig());
+
+TC_NAMESPACE_END
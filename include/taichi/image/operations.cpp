@@ -4,6 +4,7 @@
 *******************************************************************************/
 
 #include "operations.h"
+#include "kernels.h"
 
 TC_NAMESPACE_BEGIN
 
@@ -23,74 +24,86 @@ Array2D<Vector3> blur_with_depth(const Array2D<Vector3> &image,
   auto ret = image.same_shape();
   constexpr int max_radius = 50;
 
-  std::vector<real> kernel(max_radius, 0.0_f);
-
-  for (auto &ind : image.get_region()) {
-    int radius;
-    real sigma = aperature * std::abs(depth[ind].x - focal_plane) + 1e-7f;
-    if (filter_type == 0) {
-      // Gaussian
-      radius = int(std::ceil(sigma * 3.0f));
-      for (int i = 0; i <= radius; i++)
-        kernel[i] = std::exp(-0.5f * i * i / sigma / sigma);
-    } else {
-      // Binomial
-      radius = (int)(std::round(sigma) / 2);
-      for (int i = 0; i <= radius; i++)
-        kernel[i] = binomial(radius * 2 + 1, radius - i);
-    }
-    // normalize kernel
-    real kernel_tot(0.0);
-    for (int i = 0; i <= radius; i++) {
-      kernel_tot += kernel[i] * (1 + (i != 0));
-    }
-    for (int i = 0; i <= radius; i++) {
-      kernel[i] /= kernel_tot;
-    }
-    Vector3 tot(0.0_f);
-    for (int i = -radius; i <= radius; i++) {
-      for (int j = -radius; j <= radius; j++) {
-        Vector2i coord(clamp(ind.i + i, 0, image.get_width() - 1),
-                       clamp(ind.j + j, 0, image.get_height() - 1));
-        tot += kernel[std::abs(i)] * kernel[std::abs(j)] * image[coord];
-      }
-    }
-    ret[ind] = tot;
-  }
+  ThreadedTaskManager::run(
+      [&](int x) {
+        std::vector<real> kernel(max_radius, 0.0_f);
+        for (int y = 0; y < image.get_height(); y++) {
+          int radius;
+          real sigma =
+              aperature * std::abs(depth[x][y].x - focal_plane) + 1e-7f;
+          if (filter_type == 0) {
+            // Gaussian
+            radius = int(std::ceil(sigma * 3.0f));
+            for (int i = 0; i <= radius; i++)
+              kernel[i] = std::exp(-0.5f * i * i / sigma / sigma);
+          } else {
+            // Binomial
+            radius = (int)(std::round(sigma) / 2);
+            for (int i = 0; i <= radius; i++)
+              kernel[i] = binomial(radius * 2 + 1, radius - i);
+          }
+          // normalize kernel
+          real kernel_tot(0.0);
+          for (int i = 0; i <= radius; i++) {
+            kernel_tot += kernel[i] * (1 + (i != 0));
+          }
+          for (int i = 0; i <= radius; i++) {
+            kernel[i] /= kernel_tot;
+          }
+          Vector3 tot(0.0_f);
+          for (int i = -radius; i <= radius; i++) {
+            const Vector3 *column =
+                image[clamp(x + i, 0, image.get_width() - 1)];
+            Vector3 column_tot(0.0_f);
+            for (int j = -radius; j <= radius; j++) {
+              column_tot += kernel[std::abs(j)] *
+                            column[clamp(y + j, 0, image.get_height() - 1)];
+            }
+            tot += kernel[std::abs(i)] * column_tot;
+          }
+          ret[x][y] = tot;
+        }
+      },
+      0, image.get_width(), -1);
   return ret;
 }
 
 Array2D<Vector3> seam_carving(const Array2D<Vector3> &image) {
   Array2D<Vector3> carved(Vector2i(image.get_width() - 1, image.get_height()));
 
+  std::vector<real> energy(image.get_width(), 0.0_f);
+  ThreadedTaskManager::run(
+      [&](int i) {
+        real total_energy = 0.0_f;
+        for (int j = 1; j < image.get_height() - 1; j++) {
+          for (int k = 0; k < 3; k++) {
+            real grad_x = image[i + 1][j + 1][k] + image[i + 1][j][k] * 2 +
+                          image[i + 1][j - 1][k] - image[i - 1][j + 1][k] -
+                          image[i - 1][j][k] * 2 - image[i - 1][j - 1][k];
+            real grad_y = image[i + 1][j + 1][k] + image[i][j + 1][k] * 2 +
+                          image[i][j - 1][k] - image[i + 1][j + 1][k] -
+                          image[i][j + 1][k] * 2 - image[i][j - 1][k];
+            total_energy += pow<2>(grad_x) + pow<2>(grad_y);
+          }
+        }
+        energy[i] = total_energy;
+      },
+      1, image.get_width() - 1, -1);
+
   real minimum_energy = std::numeric_limits<real>::infinity();
   int minimum_energy_column = -1;
-
   for (int i = 1; i < image.get_width() - 1; i++) {
-    real total_energy = 0.0_f;
-    for (int j = 1; j < image.get_height() - 1; j++) {
-      for (int k = 0; k < 3; k++) {
-        real grad_x = image[i + 1][j + 1][k] + image[i + 1][j][k] * 2 +
-                      image[i + 1][j - 1][k] - image[i - 1][j + 1][k] -
-                      image[i - 1][j][k] * 2 - image[i - 1][j - 1][k];
-        real grad_y = image[i + 1][j + 1][k] + image[i][j + 1][k] * 2 +
-                      image[i][j - 1][k] - image[i + 1][j + 1][k] -
-                      image[i][j + 1][k] * 2 - image[i][j - 1][k];
-        total_energy += pow<2>(grad_x) + pow<2>(grad_y);
-      }
-    }
-    if (total_energy < minimum_energy) {
-      minimum_energy = total_energy;
+    if (energy[i] < minimum_energy) {
+      minimum_energy = energy[i];
       minimum_energy_column = i;
     }
   }
 
-  for (auto &ind : carved.get_region()) {
-    carved[ind] = image[ind.get_ipos() +
-                        Vector2i(int(ind.i >= minimum_energy_column), 0)];
-  }
+  parallel_for_pixels(carved.get_res(), [&](int i, int j) {
+    carved[i][j] = image[i + int(i >= minimum_energy_column)][j];
+  });
 
   return carved;
 }
 
-TC_NAMESPACE_END
\ No newline at end of file
+TC_NAMESPACE_END
@@ -5,41 +5,139 @@
 
 #pragma once
 
-#include <taichi/common/interface.h>
+#include <taichi/common/util.h>
 #include <cstdio>
+#include <deque>
+#include <future>
+#include <map>
+#include <string>
+#include <vector>
 
 TC_NAMESPACE_BEGIN
 
-class BinaryFileStreamInput final {
+// Streams of bytes in .tcbs files, e.g. from BinarySerializer::initialize(),
+// for the simulation caches that are too large to serialize in memory. The
+// stream is cut into chunks of 'chunk_size' bytes, which are compressed
+// on their own, in parallel, by fast deflate, and written as they are
+// done, so that memory holds a few chunks instead of the whole stream.
+// An index at the end of the file lists the chunks and the named fields,
+// for reading from any of them without decompressing the ones before.
+//
+// Layout: a header (magic, version, chunk size), the chunks, the index
+// (for every chunk its file offset, compressed and uncompressed size; for
+// every field its name and stream offset) and its file offset, with the
+// magic again.
+class BinaryFileStreamOutput {
+ public:
+  // 'level' of deflate (0 stores the chunks), and at most 'num_threads'
+  // chunks (-1: a chunk per core) in compression at once
+  BinaryFileStreamOutput(const std::string &fn,
+                         std::size_t chunk_size = std::size_t(1) << 22,
+                         int level = 1,
+                         int num_threads = -1);
+
+  ~BinaryFileStreamOutput();
+
+  void write(const void *data, std::size_t size);
+
+  // Names the bytes written from here on, for BinaryFileStreamInput::seek()
+  void begin_field(const std::string &name);
+
+  // The offset in the (uncompressed) stream
+  uint64 tell() const {
+    return offset;
+  }
+
+  // Writes the last chunk and the index; called by the destructor otherwise
+  void close();
+
  private:
-  FILE *f;
+  struct Chunk {
+    uint64 file_offset, compressed_size, size;
+  };
+
+  void flush_chunk();
+  void write_front_chunk();
 
+  std::FILE *f;
+  std::size_t chunk_size;
+  int level;
+  int num_threads;
+  uint64 offset, file_offset;
+  std::vector<uint8> buffer;
+  // Sizes and bytes of the chunks in compression, in stream order
+  std::deque<std::pair<uint64, std::future<std::vector<uint8>>>> pending;
+  std::vector<Chunk> chunks;
+  std::vector<std::pair<std::string, uint64>> fields;
+};
+
+class BinaryFileStreamInput {
  public:
-  BinaryFileStreamInput(const std::string &fn) {
-    f = std::fopen(fn.c_str(), "rb");
+  // Decompresses up to 'num_threads' chunks (-1: a chunk per core) ahead of
+  // sequential reads
+  BinaryFileStreamInput(const std::string &fn, int num_threads = -1);
+
+  ~BinaryFileStreamInput();
+
+  void read(void *data, std::size_t size);
+
+  void seek(uint64 offset);
+
+  // To the start of the field 'name' of BinaryFileStreamOutput::begin_field()
+  void seek(const std::string &name);
+
+  bool has_field(const std::string &name) const {
+    return fields.find(name) != fields.end();
   }
 
-  template <typename T>
-  BinaryFileStreamInput operator>>(const T &t) {
+  // The bytes of the field 'name', up to the next field or the end
+  uint64 get_field_size(const std::string &name) const;
+
+  std::vector<std::string> get_fields() const;
+
+  uint64 tell() const {
+    return offset;
   }
 
-  BinaryFileStreamInput() {
-    std::fclose(f);
+  // Of the uncompressed stream
+  uint64 size() const {
+    return total_size;
   }
-};
 
-class BinaryFileStreamOutput final {
  private:
-  FILE *f;
+  struct Chunk {
+    uint64 file_offset, compressed_size, size;
+  };
 
- public:
-  BinaryFileStreamOutput(const std::string &fn) {
-    f = std::fopen(fn.c_str(), "wb");
-  }
+  // Makes chunk 'i' current, and starts decompressing the ones after it
+  void load_chunk(int i);
+  std::shared_future<std::vector<uint8>> fetch_chunk(int i);
 
-  BinaryFileStreamOutput() {
-    std::fclose(f);
-  }
+  std::FILE *f;
+  std::size_t chunk_size;
+  int num_threads;
+  uint64 offset, total_size;
+  std::vector<Chunk> chunks;
+  std::map<std::string, uint64> fields;
+  int current;
+  std::vector<uint8> current_data;
+  std::map<int, std::shared_future<std::vector<uint8>>> prefetched;
 };
 
-TC_NAMESPACE_END
\ No newline at end of file
+template <typename T>
+void write_to_binary_stream(const T &t, const std::string &file_name) {
+  BinaryFileStreamOutput stream(file_name);
+  BinaryOutputSerializer writer;
+  writer.initialize(stream);
+  writer(t);
+}
+
+template <typename T>
+void read_from_binary_stream(T &t, const std::string &file_name) {
+  BinaryFileStreamInput stream(file_name);
+  BinaryInputSerializer reader;
+  reader.initialize(stream);
+  reader(t);
+}
+
+TC_NAMESPACE_END
@@ -0,0 +1,99 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+#include <taichi/io/binary_stream.h>
+#include <taichi/common/serialization.h>
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+TC_NAMESPACE_BEGIN
+
+// Writes simulation frames to .tcbs binary streams in the background. A
+// frame holds copies of its fields, taken when it is queued (at the end of
+// a step); the serialization, compression and writing happen on a thread
+// of the writer, with the compression of the chunks in parallel, while the
+// simulation goes on. At most 'max_pending_frames' frames are held at once,
+// so that a solver producing frames faster than the disk takes them waits
+// in write() instead of filling the memory.
+class FrameWriter {
+ public:
+  // The fields of a frame, each a field of its stream named for
+  // BinaryFileStreamInput::seek()
+  class Frame {
+   public:
+    // Copies (or takes) |value|, serialized by BinaryOutputSerializer
+    template <typename T>
+    void add(const std::string &name, T value) {
+      auto data = std::make_shared<T>(std::move(value));
+      fields.push_back([name, data](BinaryFileStreamOutput &stream) {
+        stream.begin_field(name);
+        BinaryOutputSerializer writer;
+        writer.initialize(stream);
+        writer(*data);
+      });
+    }
+
+    // Written as they are, for BinaryFileStreamInput::read()
+    void add_bytes(const std::string &name, std::vector<uint8> bytes) {
+      auto data = std::make_shared<std::vector<uint8>>(std::move(bytes));
+      fields.push_back([name, data](BinaryFileStreamOutput &stream) {
+        stream.begin_field(name);
+        stream.write(data->data(), data->size());
+      });
+    }
+
+    int get_num_fields() const {
+      return (int)fields.size();
+    }
+
+   private:
+    friend class FrameWriter;
+    std::vector<std::function<void(BinaryFileStreamOutput &)>> fields;
+  };
+
+  // 'level' of deflate, and 'num_threads' compressing the chunks of a
+  // frame (-1: a chunk per core)
+  explicit FrameWriter(int max_pending_frames = 2,
+                       int level = 1,
+                       int num_threads = -1);
+
+  // Writes the frames still queued
+  ~FrameWriter();
+
+  // Queues |frame| for file |fn|, waiting while max_pending_frames frames
+  // are queued or being written
+  void write(const std::string &fn, Frame frame);
+
+  // Waits until every queued frame is written
+  void flush();
+
+  // Frames queued or being written
+  int get_num_pending();
+
+ private:
+  void run();
+
+  int max_pending_frames;
+  int level;
+  int num_threads;
+  std::mutex mutex;
+  // Signaled when a frame is queued, and when one is written
+  std::condition_variable queued, written;
+  std::deque<std::pair<std::string, Frame>> frames;
+  int num_pending;
+  bool stopping;
+  std::thread thread;
+};
+
+TC_NAMESPACE_END
@@ -0,0 +1,75 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+#include <taichi/common/util.h>
+#include <taichi/math/math.h>
+#include <taichi/math/array_2d.h>
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+TC_NAMESPACE_BEGIN
+
+// One plane of an output image. |channels| names the components of |data|
+// that are stored, e.g. "RGB", "XYZ" or "Y" (the first component only).
+// Multi-layer formats prefix them with the layer name, as in "albedo.R";
+// the layer named "" is the beauty image.
+struct ImageLayer {
+  std::string name;
+  std::string channels;
+  Array2D<Vector3> data;
+};
+
+// Tiled, ZIP-compressed OpenEXR file with 32-bit float channels
+void write_exr(const std::string &fn,
+               const std::vector<ImageLayer> &layers,
+               int tile_size = 64);
+
+// 16-bit RGB PNG of |img| clamped to [0, 1]; no gamma is applied
+void write_png16(const std::string &fn, const Array2D<Vector3> &img);
+
+// In-memory 8-bit RGB PNG of |height| rows of |width| pixels, top row
+// first, |stride| bytes apart; |compression| is the zlib level
+std::vector<uint8> encode_png8(const uint8 *rgb,
+                               int width,
+                               int height,
+                               int stride,
+                               int compression = 6);
+
+// Runs writes (conversion, compression and file I/O) on a background
+// thread, in the order they are pushed. At most |capacity| writes are
+// pending: push() blocks until there is room, so that a renderer producing
+// frames faster than they are written does not pile them up in memory.
+class AsyncImageWriter {
+ public:
+  explicit AsyncImageWriter(int capacity = 2);
+
+  // Finishes the pending writes
+  ~AsyncImageWriter();
+
+  void push(std::function<void()> task);
+
+  // Waits until the pending writes are finished
+  void flush();
+
+ private:
+  int capacity;
+  std::deque<std::function<void()>> tasks;
+  bool busy, stopping;
+  std::mutex mutex;
+  std::condition_variable changed;
+  std::thread thread;
+
+  void run();
+};
+
+TC_NAMESPACE_END
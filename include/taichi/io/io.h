@@ -10,11 +10,20 @@
 #include <vector>
 #include <cstdio>
 #include <cstdlib>
+#include <sys/stat.h>
+#include <future>
+#include <memory>
 
 #if !defined(TC_PLATFORM_OSX)
 #include <experimental/filesystem>
 #endif
 
+#if defined(TC_PLATFORM_UNIX)
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
 TC_NAMESPACE_BEGIN
 
 inline void create_directories(const std::string &dir) {
@@ -46,37 +55,329 @@ bool read_from_disk(T &dat, std::string fn) {
   return true;
 }
 
+using WushiParticles = std::map<std::string, std::vector<float32>>;
+
+// Identifies the contents of file |fn|: its size, modification time and an
+// FNV-1a hash of its bytes. 0 if it cannot be read.
+inline uint64 get_file_stamp(const std::string &fn) {
+  struct stat st;
+  if (stat(fn.c_str(), &st) != 0) {
+    return 0;
+  }
+  FILE *f = fopen(fn.c_str(), "rb");
+  if (f == nullptr) {
+    return 0;
+  }
+  uint64 hash = 14695981039346656037ull;
+  auto mix = [&](uint64 v) {
+    hash ^= v;
+    hash *= 1099511628211ull;
+  };
+  mix((uint64)st.st_size);
+  mix((uint64)st.st_mtime);
+  std::vector<uint8> buffer(1 << 20);
+  while (size_t n = fread(buffer.data(), 1, buffer.size(), f)) {
+    for (size_t i = 0; i < n; i++) {
+      mix(buffer[i]);
+    }
+  }
+  fclose(f);
+  return hash == 0 ? 1 : hash;
+}
+
+// Read-only view of a whole file, memory-mapped where supported (read into
+// memory elsewhere). data() is null if the file cannot be read or is empty.
+class MappedFile {
+ public:
+  explicit MappedFile(const std::string &fn) {
+#if defined(TC_PLATFORM_UNIX)
+    int fd = open(fn.c_str(), O_RDONLY);
+    if (fd < 0) {
+      return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+      void *ptr = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE,
+                       fd, 0);
+      if (ptr != MAP_FAILED) {
+        ptr_ = (const uint8 *)ptr;
+        size_ = (size_t)st.st_size;
+      }
+    }
+    close(fd);
+#else
+    FILE *f = fopen(fn.c_str(), "rb");
+    if (f == nullptr) {
+      return;
+    }
+    fseek(f, 0, SEEK_END);
+    buffer.resize((size_t)std::max(0L, ftell(f)));
+    fseek(f, 0, SEEK_SET);
+    if (!buffer.empty() &&
+        fread(buffer.data(), 1, buffer.size(), f) == buffer.size()) {
+      ptr_ = buffer.data();
+      size_ = buffer.size();
+    }
+    fclose(f);
+#endif
+  }
+
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  ~MappedFile() {
+#if defined(TC_PLATFORM_UNIX)
+    if (ptr_ != nullptr) {
+      munmap((void *)ptr_, size_);
+    }
+#endif
+  }
+
+  const uint8 *data() const {
+    return ptr_;
+  }
+
+  size_t size() const {
+    return size_;
+  }
+
+  // Reads the pages of the file in, e.g. on a prefetch thread, so that
+  // later accesses do not fault to disk
+  void prefetch() const {
+#if defined(TC_PLATFORM_UNIX)
+    if (ptr_ == nullptr) {
+      return;
+    }
+    madvise((void *)ptr_, size_, MADV_WILLNEED);
+    long page_size = sysconf(_SC_PAGESIZE);
+    volatile uint8 sum = 0;
+    for (size_t i = 0; i < size_; i += (size_t)page_size) {
+      sum += ptr_[i];
+    }
+#endif
+  }
+
+ private:
+  const uint8 *ptr_ = nullptr;
+  size_t size_ = 0;
+#if !defined(TC_PLATFORM_UNIX)
+  std::vector<uint8> buffer;
+#endif
+};
+
+// Files of write_vector_to_disk: a header of vector_file_header_size
+// bytes, with vector_file_magic, the number of elements and their size,
+// then the elements, which are thus aligned in mapped files for
+// MappedVector. Files of only the number of elements before them, as
+// written before the header, are still read.
+constexpr uint64 vector_file_magic = 0x31434556434354ull;  // "TCCVEC1"
+constexpr std::size_t vector_file_header_size = 64;
+
 template <typename T>
 void write_vector_to_disk(std::vector<T> *p_vec, std::string fn) {
   std::vector<T> &vec = *p_vec;
   FILE *f = fopen(fn.c_str(), "wb");
-  size_t length = vec.size();
-  fwrite(&length, sizeof(length), 1, f);
-  fwrite(&vec[0], sizeof(vec[0]), length, f);
+  TC_ERROR_IF(f == nullptr, "Cannot open file [{}] for writing", fn);
+  uint64 header[vector_file_header_size / sizeof(uint64)] = {
+      vector_file_magic, (uint64)vec.size(), (uint64)sizeof(T)};
+  fwrite(header, sizeof(header), 1, f);
+  fwrite(vec.data(), sizeof(T), vec.size(), f);
   fclose(f);
 }
 
+// The elements of a file of write_vector_to_disk, read in place from the
+// mapped file (by the page cache, without reads or copies), unless they
+// are not aligned for T, as in files without the header, which are read
+// into memory
+template <typename T>
+class MappedVector {
+ public:
+  explicit MappedVector(const std::string &fn) : file(fn) {
+    const uint8 *p = file.data();
+    if (p == nullptr || file.size() < sizeof(uint64)) {
+      return;
+    }
+    uint64 header[3];
+    std::size_t offset;
+    std::memcpy(header, p, std::min(sizeof(header), file.size()));
+    if (header[0] == vector_file_magic) {
+      if (file.size() < vector_file_header_size || header[2] != sizeof(T)) {
+        return;
+      }
+      size_ = (std::size_t)header[1];
+      offset = vector_file_header_size;
+    } else {
+      size_ = (std::size_t)header[0];
+      offset = sizeof(uint64);
+    }
+    if (file.size() < offset + size_ * sizeof(T)) {
+      size_ = 0;
+      return;
+    }
+    valid = true;
+    p += offset;
+    if ((uintptr_t)p % alignof(T) == 0) {
+      ptr_ = reinterpret_cast<const T *>(p);
+    } else {
+      buffer.resize(size_);
+      std::memcpy((void *)buffer.data(), p, size_ * sizeof(T));
+      ptr_ = buffer.data();
+    }
+  }
+
+  MappedVector(const MappedVector &) = delete;
+  MappedVector &operator=(const MappedVector &) = delete;
+
+  // False if the file cannot be read, or is not of elements of type T
+  bool is_valid() const {
+    return valid;
+  }
+
+  bool is_mapped() const {
+    return valid && buffer.empty() && size_ > 0;
+  }
+
+  const T *data() const {
+    return ptr_;
+  }
+
+  std::size_t size() const {
+    return size_;
+  }
+
+  const T &operator[](std::size_t i) const {
+    return ptr_[i];
+  }
+
+  const T *begin() const {
+    return ptr_;
+  }
+
+  const T *end() const {
+    return ptr_ + size_;
+  }
+
+  void prefetch() const {
+    file.prefetch();
+  }
+
+ private:
+  MappedFile file;
+  bool valid = false;
+  const T *ptr_ = nullptr;
+  std::size_t size_ = 0;
+  std::vector<T> buffer;
+};
+
 template <typename T>
 bool read_vector_from_disk(std::vector<T> *p_vec, std::string fn) {
-  std::vector<T> &vec = *p_vec;
-  FILE *f = fopen(fn.c_str(), "rb");
-  if (f == nullptr) {
+  MappedVector<T> mapped(fn);
+  if (!mapped.is_valid()) {
     return false;
   }
-  size_t length;
-  size_t ret = fread(&length, sizeof(length), 1, f);
-  if (ret != 1) {
+  p_vec->assign(mapped.begin(), mapped.end());
+  return true;
+}
+
+// The frames of a sequence, e.g. of simulation outputs, named by
+// fmt::format(pattern, frame), as views of type View (e.g. MappedVector)
+// made from their file names. Getting a frame starts mapping and reading
+// in the next one on a thread of its own, so that it is in memory when
+// the caller is done with this one.
+template <typename View>
+class FramePrefetcher {
+ public:
+  explicit FramePrefetcher(const std::string &pattern) : pattern(pattern) {
+  }
+
+  ~FramePrefetcher() {
+    if (next.valid()) {
+      next.wait();
+    }
+  }
+
+  std::shared_ptr<View> get(int frame) {
+    std::shared_ptr<View> view;
+    if (next.valid() && next_frame == frame) {
+      view = next.get();
+    } else {
+      if (next.valid()) {
+        next.wait();
+      }
+      view = load(get_file_name(frame));
+    }
+    next_frame = frame + 1;
+    next = std::async(std::launch::async, &FramePrefetcher::load,
+                      get_file_name(next_frame));
+    return view;
+  }
+
+  std::string get_file_name(int frame) const {
+    return fmt::format(pattern, frame);
+  }
+
+ private:
+  static std::shared_ptr<View> load(const std::string &fn) {
+    auto view = std::make_shared<View>(fn);
+    view->prefetch();
+    return view;
+  }
+
+  std::string pattern;
+  int next_frame = -1;
+  std::future<std::shared_ptr<View>> next;
+};
+
+// Binary caches of data derived from a source file, e.g. processed images
+// or parsed meshes. Each is tagged with a format |version| and the
+// get_file_stamp of its source, and is only read back if both match.
+template <typename... Args>
+bool read_binary_cache(const std::string &fn,
+                       uint64 version,
+                       uint64 stamp,
+                       Args &... args) {
+  MappedFile file(fn);
+  uint64 header[2] = {0, 0};
+  if (file.data() == nullptr ||
+      file.size() < sizeof(std::size_t) + sizeof(header) ||
+      *reinterpret_cast<const std::size_t *>(file.data()) != file.size()) {
     return false;
   }
-  vec.resize(length);
-  ret = fread(&vec[0], sizeof(vec[0]), length, f);
-  if (ret != length) {
+  std::memcpy(header, file.data() + sizeof(std::size_t), sizeof(header));
+  if (header[0] != version || header[1] != stamp) {
     return false;
   }
-  fclose(f);
+  BinaryInputSerializer reader;
+  reader.initialize(const_cast<uint8 *>(file.data()));
+  reader(header);
+  int unused[] = {(reader(args), 0)...};
+  (void)unused;
+  reader.finalize();
   return true;
 }
 
-using WushiParticles = std::map<std::string, std::vector<float32>>;
+// Not fatal if the file cannot be written, e.g. next to a source in a
+// read-only directory
+template <typename... Args>
+bool write_binary_cache(const std::string &fn,
+                        uint64 version,
+                        uint64 stamp,
+                        const Args &... args) {
+  BinaryOutputSerializer writer;
+  writer.initialize();
+  uint64 header[2] = {version, stamp};
+  writer(header);
+  int unused[] = {(writer(args), 0)...};
+  (void)unused;
+  writer.finalize();
+  FILE *f = fopen(fn.c_str(), "wb");
+  if (f == nullptr) {
+    TC_WARN("Cannot write cache [{}]", fn);
+    return false;
+  }
+  bool ok = fwrite(writer.data.data(), 1, writer.head, f) == writer.head;
+  fclose(f);
+  return ok;
+}
 
 TC_NAMESPACE_END
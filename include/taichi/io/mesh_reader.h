@@ -0,0 +1,48 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+#include <taichi/common/util.h>
+#include <taichi/math/math.h>
+
+#include <string>
+#include <vector>
+
+TC_NAMESPACE_BEGIN
+
+// Triangle mesh as stored in a file: unique attributes, and three indices
+// into them per triangle
+struct MeshData {
+  std::vector<Vector3> positions;
+  std::vector<Vector3> normals;
+  std::vector<Vector2> uvs;
+  // -1 where the file has no normal / uv for a corner
+  std::vector<int> position_indices;
+  std::vector<int> normal_indices;
+  std::vector<int> uv_indices;
+
+  int get_num_triangles() const {
+    return (int)position_indices.size() / 3;
+  }
+
+  TC_IO_DEF(positions,
+            normals,
+            uvs,
+            position_indices,
+            normal_indices,
+            uv_indices);
+};
+
+// Reads an OBJ or PLY (ASCII or binary) file, chosen by extension, and
+// triangulates polygons as fans. OBJ files are parsed in parallel chunks.
+// With |cache|, the result is also stored in <fn>.mesh.tcb, which later
+// calls memory-map instead of parsing as long as the source is unchanged.
+void read_mesh(const std::string &fn,
+               MeshData &data,
+               bool cache = true,
+               int num_threads = -1);
+
+TC_NAMESPACE_END
@@ -4,6 +4,7 @@
 *******************************************************************************/
 #pragma once
 #include <taichi/util.h>
+#include <taichi/system/threading.h>
 
 TC_NAMESPACE_BEGIN
 
@@ -19,27 +20,55 @@ struct OptiXMesh {
   std::vector<std::array<uint32, 3>> faces;
   TC_IO_DEF(vertices, faces);
 
-  void recompute_normals() {
-    for (auto &v : vertices) {
-      v.normal = Vector3(0);
-    }
+  // Area-weighted normals of the faces around each vertex, in parallel over
+  // the faces and then over the vertices, which gather the normals of
+  // their faces in a fixed order
+  void recompute_normals(int num_threads = -1) {
+    int num_vertices = (int)vertices.size(), num_faces = (int)faces.size();
+    std::vector<Vector3> face_normals(num_faces);
+    ThreadedTaskManager::run(
+        [&](int i) {
+          const auto &f = faces[i];
+          const Vector3 &a = vertices[f[0]].position;
+          face_normals[i] = cross(vertices[f[1]].position - a,
+                                  vertices[f[2]].position - a);
+        },
+        0, num_faces, num_threads);
+    // The faces of vertex v are vertex_faces[offsets[v]:offsets[v + 1]]
+    std::vector<int> offsets(num_vertices + 1, 0), vertex_faces(num_faces * 3);
     for (auto &f : faces) {
-      int a = f[0], b = f[1], c = f[2];
-      vertices[a].normal += cross(vertices[b].position - vertices[a].position,
-                                  vertices[c].position - vertices[a].position);
-    }
-    for (auto &v : vertices) {
-      if (length2(v.normal) != 0) {
-        v.normal = normalized(v.normal);
-      } else {
-        v.normal = Vector3(0, 1, 0);
+      for (int k = 0; k < 3; k++) {
+        offsets[f[k] + 1]++;
       }
-      if (std::abs(v.normal.y > 0.9_f)) {
-        v.tangent = normalized(cross(v.normal, Vector3(0, 1, 0)));
-      } else {
-        v.tangent = normalized(cross(v.normal, Vector3(1, 0, 0)));
+    }
+    for (int v = 0; v < num_vertices; v++) {
+      offsets[v + 1] += offsets[v];
+    }
+    std::vector<int> cursor(offsets.begin(), offsets.end() - 1);
+    for (int i = 0; i < num_faces; i++) {
+      for (int k = 0; k < 3; k++) {
+        vertex_faces[cursor[faces[i][k]]++] = i;
       }
     }
+    ThreadedTaskManager::run(
+        [&](int i) {
+          Vertex &v = vertices[i];
+          v.normal = Vector3(0);
+          for (int k = offsets[i]; k < offsets[i + 1]; k++) {
+            v.normal += face_normals[vertex_faces[k]];
+          }
+          if (length2(v.normal) != 0) {
+            v.normal = normalized(v.normal);
+          } else {
+            v.normal = Vector3(0, 1, 0);
+          }
+          if (std::abs(v.normal.y) > 0.9_f) {
+            v.tangent = normalized(cross(v.normal, Vector3(1, 0, 0)));
+          } else {
+            v.tangent = normalized(cross(v.normal, Vector3(0, 1, 0)));
+          }
+        },
+        0, num_vertices, num_threads);
   }
 };
 
@@ -48,6 +77,10 @@ struct OptiXParticle {
   TC_IO_DEF(position_and_radius);
 };
 
+template <>
+struct is_bytewise_serializable<OptiXParticle>
+    : is_bytewise_serializable<Vector4> {};
+
 struct OptiXScene {
   std::vector<OptiXMesh> meshes;
   std::vector<OptiXParticle> particles;
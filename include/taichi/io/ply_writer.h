@@ -2,14 +2,27 @@
     Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
     The use of this software is governed by the LICENSE file.
 *******************************************************************************/
-#include <taichi/util.h>
+
+#pragma once
+
+#include <taichi/common/util.h>
+#include <taichi/math/math.h>
+
+#include <string>
+#include <vector>
 
 TC_NAMESPACE_BEGIN
 
+struct RenderParticle;
+
+// Writes a PLY mesh or point cloud: indexed vertices (float positions and
+// uchar colors from [0, 1]), and faces of vertex indices. The file is
+// written by close(), or by the destructor, as binary_little_endian or
+// ascii. Either way the elements are formatted into chunks in parallel, on
+// 'num_threads' threads (-1: all), and the chunks are written in order with
+// large writes.
 class PLYWriter {
  public:
-  FILE *file;
-
   struct Vertex {
     Vector3 position;
     Vector3 color;
@@ -18,62 +31,60 @@ class PLYWriter {
     }
   };
 
-  std::vector<Vertex> vertices;
-  std::vector<int> face_vertices_count;
+  explicit PLYWriter(const std::string &file_name,
+                     bool binary = true,
+                     int num_threads = -1);
 
-  PLYWriter(const std::string &file_name) {
-    file = fopen(file_name.c_str(), "w");
-  }
+  ~PLYWriter();
+
+  PLYWriter(const PLYWriter &) = delete;
+  PLYWriter &operator=(const PLYWriter &) = delete;
+
+  // Appends |n| vertices, colored |colors| (green if null), and returns the
+  // index of the first
+  int add_vertices(const Vector3 *positions, const Vector3 *colors, int n);
 
-  void add_face(const std::vector<Vertex> &vert) {
-    vertices.insert(vertices.end(), vert.begin(), vert.end());
-    face_vertices_count.push_back(vert.size());
+  int add_vertex(Vector3 position, Vector3 color = Vector3(0, 1, 0)) {
+    return add_vertices(&position, &color, 1);
   }
 
-  void add_face(const std::vector<Vector3> &vert_) {
-    std::vector<Vertex> vert;
-    for (auto v : vert_) {
-      vert.push_back(Vertex(v, Vector3(0, 1, 0)));
-    }
-    vertices.insert(vertices.end(), vert.begin(), vert.end());
-    face_vertices_count.push_back(vert.size());
+  // Vertices without faces, for point clouds
+  int add_points(const Vector3 *positions, const Vector3 *colors, int n) {
+    return add_vertices(positions, colors, n);
   }
 
-  ~PLYWriter() {
-    std::string header =
-        "ply\n"
-        "format ascii 1.0\n"
-        "element vertex {}\n"
-        "property float x\n"
-        "property float y\n"
-        "property float z\n"
-        "property uchar red\n"
-        "property uchar green\n"
-        "property uchar blue\n"
-        "element face {}\n"
-        "property list uchar int vertex_index\n"
-        "end_header\n";
-
-    fmt::print(file, header, vertices.size(), face_vertices_count.size());
-
-    for (auto v : vertices) {
-      Vector3i color = (v.color * 255.0_f).template cast<int>();
-      fmt::print(file, "{} {} {} {} {} {}\n", v.position.x, v.position.y,
-                 v.position.z, color.x, color.y, color.z);
-    }
+  // Of the positions and the colors (without alpha) of |particles|
+  int add_points(const std::vector<RenderParticle> &particles);
 
-    int begin, end = 0;
-    for (auto count : face_vertices_count) {
-      begin = end;
-      end += count;
-      fmt::print(file, "{} ", count);
-      for (int i = begin; i < end; i++) {
-        fmt::print(file, "{} ", i);
-      }
-      fmt::print(file, "\n");
-    }
-    fclose(file);
+  // |n| faces of |vertices_per_face| vertex indices each, from |indices|
+  void add_faces(const int *indices, int n, int vertices_per_face = 3);
+
+  // A face of new vertices
+  void add_face(const std::vector<Vertex> &vert);
+
+  void add_face(const std::vector<Vector3> &vert);
+
+  int get_num_vertices() const {
+    return (int)positions.size();
   }
+
+  int get_num_faces() const {
+    return (int)face_sizes.size();
+  }
+
+  // Writes the file; nothing can be added after
+  void close();
+
+ private:
+  std::string file_name;
+  bool binary;
+  int num_threads;
+  bool closed = false;
+
+  std::vector<Vector3> positions;
+  std::vector<uint8> colors;  // RGB
+  std::vector<uint8> face_sizes;
+  std::vector<int> face_indices;
 };
 
-TC_NAMESPACE_END
\ No newline at end of file
+TC_NAMESPACE_END
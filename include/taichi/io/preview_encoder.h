@@ -0,0 +1,62 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+#include <taichi/common/util.h>
+#include <taichi/common/dict.h>
+#include <taichi/math/math.h>
+#include <taichi/math/array_2d.h>
+
+#include <string>
+#include <vector>
+
+TC_NAMESPACE_BEGIN
+
+// Base64 of |len| bytes, 12 bits per table lookup
+std::string encode_base64(const uint8 *data, std::size_t len);
+
+// Encodes render previews for streaming to clients, e.g. the render server.
+// Each call tone-maps (exposure and gamma), quantizes to 8 bits, and
+// compresses and base64-encodes tiles as PNGs, in one parallel pass over
+// the tiles. Only tiles whose 8-bit pixels changed since the previous call
+// are returned, so that converged or untouched regions are not sent again.
+class PreviewEncoder {
+ public:
+  // Tile |x|, |y| (pixels, from the top left) of |width| x |height|
+  struct Tile {
+    int x, y, width, height;
+    std::string png_base64;
+  };
+
+  // Config:
+  //   tile_size:   edge length of tiles in pixels (64)
+  //   exposure:    scale applied before the gamma (1)
+  //   gamma:       display gamma (2.2)
+  //   compression: zlib level of the PNGs (1)
+  explicit PreviewEncoder(const Config &config);
+
+  // The tiles that changed since the last call; all tiles on the first call,
+  // after reset(), or when the resolution of |image| changes
+  std::vector<Tile> encode(const Array2D<Vector3> &image);
+
+  // Makes the next encode() return all tiles, e.g. for a new client
+  void reset() {
+    last.clear();
+  }
+
+ private:
+  int tile_size;
+  real exposure;
+  int compression;
+  // 8-bit values of [0, 1] after exposure, in |lut_size| steps
+  static constexpr int lut_size = 1 << 14;
+  std::vector<uint8> lut;
+  Vector2i res;
+  // The 8-bit RGB pixels of the last call, top row first
+  std::vector<uint8> last;
+};
+
+TC_NAMESPACE_END
@@ -12,6 +12,7 @@
 #include <iterator>
 
 #include "array_fwd.h"
+#include "array_storage.h"
 #include "linalg.h"
 
 TC_NAMESPACE_BEGIN
@@ -198,6 +199,15 @@ class RegionND<2> {
   Index2D end() {
     return index_end;
   }
+
+  // The first cell, and one past the last along every axis
+  Vector2i get_start_corner() const {
+    return Vector2i(x[0], y[0]);
+  }
+
+  Vector2i get_end_corner() const {
+    return Vector2i(x[1], y[1]);
+  }
 };
 
 typedef RegionND<2> Region2D;
@@ -206,12 +216,12 @@ template <typename T>
 class ArrayND<2, T> {
  protected:
   Region2D region;
-  typedef typename std::vector<T>::iterator iterator;
+  typedef typename ArrayStorage<T>::iterator iterator;
   int size;
   Vector2i res;
   Vector2 storage_offset = Vector2(0.5f, 0.5f);  // defualt : center storage
  public:
-  std::vector<T> data;
+  ArrayStorage<T> data;
   template <typename S>
   using Array2D = ArrayND<2, S>;
 
@@ -238,7 +248,7 @@ class ArrayND<2, T> {
     this->res = res;
     region = Region2D(0, res[0], 0, res[1], storage_offset);
     size = res[0] * res[1];
-    data = std::vector<T>(size, init);
+    data = allocate_array_storage(res[0], res[1], init);
     this->storage_offset = storage_offset;
   }
 
@@ -350,6 +360,8 @@ class ArrayND<2, T> {
     return sum;
   }
 
+  // Serial, as the other reductions of the members; dot_product() and
+  // p_abs_max() of array_parallel.h are the parallel ones
   double dot_double(const Array2D<T> &b) const {
     double sum = 0;
     assert(same_dim(b));
@@ -663,7 +675,7 @@ class ArrayND<2, T> {
     return out;
   }
 
-  const std::vector<T> &get_data() const {
+  const ArrayStorage<T> &get_data() const {
     return this->data;
   }
 
@@ -671,6 +683,18 @@ class ArrayND<2, T> {
     return 2;
   }
 
+  TC_IO_DECL {
+    TC_IO(res);
+    TC_IO(storage_offset);
+    TC_IO(data);
+    if (TC_SERIALIZER_IS(BinaryInputSerializer)) {
+      // Derived from the above
+      auto self = const_cast<ArrayND<2, T> *>(this);
+      self->size = res[0] * res[1];
+      self->region = Region2D(0, res[0], 0, res[1], storage_offset);
+    }
+  }
+
   void flip(int axis) {
     if (axis == 0) {
       for (int i = 0; i < res[0] / 2; i++) {
@@ -12,6 +12,7 @@
 #include <iterator>
 
 #include "array_fwd.h"
+#include "array_storage.h"
 #include "linalg.h"
 
 TC_NAMESPACE_BEGIN
@@ -229,6 +230,15 @@ class RegionND<3> {
     return index_end;
   }
 
+  // The first cell, and one past the last along every axis
+  Vector3i get_start_corner() const {
+    return Vector3i(x[0], y[0], z[0]);
+  }
+
+  Vector3i get_end_corner() const {
+    return Vector3i(x[1], y[1], z[1]);
+  }
+
   TC_IO_DECL {
     TC_IO(x);
     TC_IO(y);
@@ -245,7 +255,7 @@ template <typename T>
 class ArrayND<3, T> {
  protected:
   Region3D region;
-  typedef typename std::vector<T>::iterator iterator;
+  typedef typename ArrayStorage<T>::iterator iterator;
   int size;
   Vector3i res;
   int stride;
@@ -278,10 +288,19 @@ class ArrayND<3, T> {
   };
 
  public:
-  std::vector<T> data;
+  ArrayStorage<T> data;
   template <typename S>
   using Array3D = ArrayND<3, S>;
 
+  TC_IO_DECL {
+    TC_IO(region);
+    TC_IO(size);
+    TC_IO(res);
+    TC_IO(stride);
+    TC_IO(storage_offset);
+    TC_IO(data);
+  }
+
   TC_FORCE_INLINE int get_size() const {
     return size;
   }
@@ -303,7 +322,7 @@ class ArrayND<3, T> {
     region = Region3D(0, res[0], 0, res[1], 0, res[2], storage_offset);
     size = res[0] * res[1] * res[2];
     stride = res[1] * res[2];
-    data = std::vector<T>(size, init);
+    data = allocate_array_storage(res[0], (int64)stride, init);
     this->storage_offset = storage_offset;
   }
 
@@ -398,6 +417,8 @@ class ArrayND<3, T> {
     return sum;
   }
 
+  // Serial, as the other reductions of the members; dot_product() and
+  // p_abs_max() of array_parallel.h are the parallel ones
   double dot_double(const Array3D<T> &b) const {
     double sum = 0;
     assert(same_dim(b));
@@ -686,11 +707,11 @@ class ArrayND<3, T> {
     return true;
   }
 
-  const std::vector<T> &get_data() const {
+  const ArrayStorage<T> &get_data() const {
     return this->data;
   }
 
-  std::vector<T> &get_data() {
+  ArrayStorage<T> &get_data() {
     return this->data;
   }
 
@@ -0,0 +1,341 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+#include <taichi/common/util.h>
+#include <taichi/math/math.h>
+#include <taichi/math/array_3d.h>
+
+#include <vector>
+
+TC_NAMESPACE_BEGIN
+
+// Memory layouts of 3D grids, mapping cells (i, j, k) to offsets in
+// storage. for_each_cell() visits the cells in storage order, which is how
+// stencil loops should run over non-linear layouts.
+
+// x-major with k contiguous, as Array3D
+class LinearLayout3D {
+ public:
+  void initialize(const Vector3i &res) {
+    this->res = res;
+    stride_i = (int64)res[1] * res[2];
+    stride_j = res[2];
+  }
+
+  int64 get_storage_size() const {
+    return stride_i * res[0];
+  }
+
+  TC_FORCE_INLINE int64 get_offset(int i, int j, int k) const {
+    return i * stride_i + j * stride_j + k;
+  }
+
+  template <typename F>
+  void for_each_cell(const F &f) const {
+    for (int i = 0; i < res[0]; i++) {
+      for (int j = 0; j < res[1]; j++) {
+        for (int k = 0; k < res[2]; k++) {
+          f(i, j, k);
+        }
+      }
+    }
+  }
+
+ private:
+  Vector3i res;
+  int64 stride_i, stride_j;
+};
+
+// Blocks of block_size^3 cells, each contiguous and x-major inside, laid
+// out x-major. The grid is padded to whole blocks, so that a 7-point
+// neighbourhood spans at most four blocks, instead of three planes of the
+// grid.
+template <int log2_block_size>
+class BlockedLayout3D {
+ public:
+  static constexpr int block_size = 1 << log2_block_size;
+  static constexpr int block_volume = block_size * block_size * block_size;
+
+  void initialize(const Vector3i &res) {
+    this->res = res;
+    for (int d = 0; d < 3; d++) {
+      block_res[d] = (res[d] + block_size - 1) >> log2_block_size;
+    }
+    block_stride_i = (int64)block_res[1] * block_res[2] * block_volume;
+    block_stride_j = (int64)block_res[2] * block_volume;
+  }
+
+  int64 get_storage_size() const {
+    return block_stride_i * block_res[0];
+  }
+
+  TC_FORCE_INLINE int64 get_offset(int i, int j, int k) const {
+    constexpr int mask = block_size - 1;
+    return (i >> log2_block_size) * block_stride_i +
+           (j >> log2_block_size) * block_stride_j +
+           ((int64)(k >> log2_block_size) << (3 * log2_block_size)) +
+           ((((i & mask) << log2_block_size) | (j & mask))
+            << log2_block_size) +
+           (k & mask);
+  }
+
+  template <typename F>
+  void for_each_cell(const F &f) const {
+    for (int bi = 0; bi < block_res[0]; bi++) {
+      for (int bj = 0; bj < block_res[1]; bj++) {
+        for (int bk = 0; bk < block_res[2]; bk++) {
+          int i_end = std::min(res[0], (bi + 1) * block_size);
+          int j_end = std::min(res[1], (bj + 1) * block_size);
+          int k_end = std::min(res[2], (bk + 1) * block_size);
+          for (int i = bi * block_size; i < i_end; i++) {
+            for (int j = bj * block_size; j < j_end; j++) {
+              for (int k = bk * block_size; k < k_end; k++) {
+                f(i, j, k);
+              }
+            }
+          }
+        }
+      }
+    }
+  }
+
+ private:
+  Vector3i res, block_res;
+  int64 block_stride_i, block_stride_j;
+};
+
+// Interleaves the bits of |x| and |y| (16 bits each): the 2D Morton code,
+// for ordering pixels or cells of 2D grids
+inline uint32 morton_code(uint32 x, uint32 y) {
+  auto spread = [](uint32 v) {
+    v = (v | (v << 8)) & 0x00FF00FFu;
+    v = (v | (v << 4)) & 0x0F0F0F0Fu;
+    v = (v | (v << 2)) & 0x33333333u;
+    v = (v | (v << 1)) & 0x55555555u;
+    return v;
+  };
+  return spread(x) | (spread(y) << 1);
+}
+
+// Morton (Z-order) curve over the cells: bits of i, j and k interleaved.
+// Storage covers the cube of the smallest power of two at least the
+// largest side, so that the layout suits near-cubic grids only.
+class MortonLayout3D {
+ public:
+  void initialize(const Vector3i &res) {
+    this->res = res;
+    side = 1;
+    while (side < std::max(std::max(res[0], res[1]), res[2])) {
+      side *= 2;
+    }
+    TC_ASSERT_INFO(side <= 1024, "Morton layouts are at most 1024 wide");
+  }
+
+  int64 get_storage_size() const {
+    return (int64)side * side * side;
+  }
+
+  TC_FORCE_INLINE int64 get_offset(int i, int j, int k) const {
+    return (spread(i) << 2) | (spread(j) << 1) | spread(k);
+  }
+
+  template <typename F>
+  void for_each_cell(const F &f) const {
+    int64 size = get_storage_size();
+    for (int64 code = 0; code < size; code++) {
+      int i = compact(code >> 2), j = compact(code >> 1), k = compact(code);
+      if (i < res[0] && j < res[1] && k < res[2]) {
+        f(i, j, k);
+      }
+    }
+  }
+
+ private:
+  Vector3i res;
+  int side;
+
+  TC_FORCE_INLINE static int64 spread(int64 v) {
+    v = (v | (v << 16)) & 0x030000FF;
+    v = (v | (v << 8)) & 0x0300F00F;
+    v = (v | (v << 4)) & 0x030C30C3;
+    v = (v | (v << 2)) & 0x09249249;
+    return v;
+  }
+
+  static int compact(int64 v) {
+    v &= 0x09249249;
+    v = (v ^ (v >> 2)) & 0x030C30C3;
+    v = (v ^ (v >> 4)) & 0x0300F00F;
+    v = (v ^ (v >> 8)) & 0x030000FF;
+    v = (v ^ (v >> 16)) & 0x000003FF;
+    return (int)v;
+  }
+};
+
+// A 3D grid with the indexing and sampling of Array3D, stored in |Layout|.
+// |data| includes the padding of the layout, so that it holds more than
+// get_size() values for blocked and Morton layouts.
+template <typename T, typename Layout = LinearLayout3D>
+class LayoutArray3D {
+ public:
+  std::vector<T> data;
+
+  LayoutArray3D() : res(0) {
+  }
+
+  explicit LayoutArray3D(const Vector3i &res,
+                         T init = T(0),
+                         Vector3 storage_offset = Vector3(0.5f)) {
+    initialize(res, init, storage_offset);
+  }
+
+  explicit LayoutArray3D(const Array3D<T> &arr) {
+    initialize(arr.get_res(), T(0), arr.get_storage_offset());
+    for (auto &ind : arr.get_region()) {
+      (*this)[ind] = arr[ind];
+    }
+  }
+
+  void initialize(const Vector3i &res,
+                  T init = T(0),
+                  Vector3 storage_offset = Vector3(0.5f)) {
+    this->res = res;
+    this->storage_offset = storage_offset;
+    region = Region3D(Vector3i(0), res, storage_offset);
+    layout.initialize(res);
+    data.assign(layout.get_storage_size(), init);
+  }
+
+  Array3D<T> to_array() const {
+    Array3D<T> arr(res, T(0), storage_offset);
+    for (auto &ind : region) {
+      arr[ind] = (*this)[ind];
+    }
+    return arr;
+  }
+
+  const Layout &get_layout() const {
+    return layout;
+  }
+
+  Vector3i get_res() const {
+    return res;
+  }
+
+  int get_width() const {
+    return res[0];
+  }
+
+  int get_height() const {
+    return res[1];
+  }
+
+  int get_depth() const {
+    return res[2];
+  }
+
+  // Cells, without the padding
+  int get_size() const {
+    return res[0] * res[1] * res[2];
+  }
+
+  const Region3D &get_region() const {
+    return region;
+  }
+
+  Vector3 get_storage_offset() const {
+    return storage_offset;
+  }
+
+  bool inside(int i, int j, int k) const {
+    return 0 <= i && i < res[0] && 0 <= j && j < res[1] && 0 <= k && k < res[2];
+  }
+
+  bool inside(const Vector3i &pos) const {
+    return inside(pos[0], pos[1], pos[2]);
+  }
+
+  bool inside(const Index3D &index) const {
+    return inside(index.i, index.j, index.k);
+  }
+
+  TC_FORCE_INLINE T &get(int i, int j, int k) {
+    return data[layout.get_offset(i, j, k)];
+  }
+
+  TC_FORCE_INLINE const T &get(int i, int j, int k) const {
+    return data[layout.get_offset(i, j, k)];
+  }
+
+  T &operator[](const Vector3i &pos) {
+    return get(pos[0], pos[1], pos[2]);
+  }
+
+  const T &operator[](const Vector3i &pos) const {
+    return get(pos[0], pos[1], pos[2]);
+  }
+
+  T &operator[](const Index3D &index) {
+    return get(index.i, index.j, index.k);
+  }
+
+  const T &operator[](const Index3D &index) const {
+    return get(index.i, index.j, index.k);
+  }
+
+  void reset(T value) {
+    std::fill(data.begin(), data.end(), value);
+  }
+
+  // Calls |f(i, j, k)| for every cell, in storage order
+  template <typename F>
+  void for_each_cell(const F &f) const {
+    layout.for_each_cell(f);
+  }
+
+  // Trilinear, as Array3D::sample
+  T sample(real x, real y, real z) const {
+    x = clamp(x - storage_offset.x, 0.0_f, res[0] - 1.0_f - eps);
+    y = clamp(y - storage_offset.y, 0.0_f, res[1] - 1.0_f - eps);
+    z = clamp(z - storage_offset.z, 0.0_f, res[2] - 1.0_f - eps);
+    int x_i = clamp(int(x), 0, res[0] - 2);
+    int y_i = clamp(int(y), 0, res[1] - 2);
+    int z_i = clamp(int(z), 0, res[2] - 2);
+    real x_r = x - x_i;
+    real y_r = y - y_i;
+    real z_r = z - z_i;
+    return lerp(
+        z_r,
+        lerp(x_r, lerp(y_r, get(x_i, y_i, z_i), get(x_i, y_i + 1, z_i)),
+             lerp(y_r, get(x_i + 1, y_i, z_i), get(x_i + 1, y_i + 1, z_i))),
+        lerp(x_r, lerp(y_r, get(x_i, y_i, z_i + 1), get(x_i, y_i + 1, z_i + 1)),
+             lerp(y_r, get(x_i + 1, y_i, z_i + 1),
+                  get(x_i + 1, y_i + 1, z_i + 1))));
+  }
+
+  T sample(const Vector3 &v) const {
+    return sample(v.x, v.y, v.z);
+  }
+
+  T sample(const Index3D &v) const {
+    return sample(v.get_pos());
+  }
+
+ private:
+  Vector3i res;
+  Vector3 storage_offset;
+  Region3D region;
+  Layout layout;
+};
+
+template <typename T, int log2_block_size = 2>
+using BlockedArray3D = LayoutArray3D<T, BlockedLayout3D<log2_block_size>>;
+
+template <typename T>
+using MortonArray3D = LayoutArray3D<T, MortonLayout3D>;
+
+TC_NAMESPACE_END
@@ -0,0 +1,283 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+#include <taichi/common/util.h>
+#include <taichi/math/math.h>
+#include <taichi/math/array_2d.h>
+#include <taichi/math/array_3d.h>
+#include <taichi/system/threading.h>
+
+#include <algorithm>
+#include <numeric>
+#include <vector>
+
+TC_NAMESPACE_BEGIN
+
+// Parallel loops over the cells of regions, and parallel, in-place
+// arithmetic on arrays with contiguous |data| and get_size(), i.e. ArrayND
+// and the Array2D / Array3D of scalars or vectors. Every arithmetic
+// function is a single pass over its operands and allocates no arrays, and
+// fused variants return the reduction that iterative solvers need next.
+// Arrays are split into blocks of vector_block_size entries;
+// reductions sum per block, so that they do not depend on the threads.
+
+constexpr int vector_block_size = 4096;
+
+template <typename F>
+void for_each_vector_block(int size, int num_threads, const F &f) {
+  int num_blocks = (size + vector_block_size - 1) / vector_block_size;
+  ThreadedTaskManager::run(num_blocks, num_threads, [&](int block) {
+    f(block, block * vector_block_size,
+      std::min(size, (block + 1) * vector_block_size));
+  });
+}
+
+namespace array_parallel {
+
+inline float64 inner(float32 a, float32 b) {
+  return (float64)a * b;
+}
+
+inline float64 inner(float64 a, float64 b) {
+  return a * b;
+}
+
+template <int dim, typename T, InstSetExt ISE>
+inline float64 inner(const VectorND<dim, T, ISE> &a,
+                     const VectorND<dim, T, ISE> &b) {
+  return a.dot(b);
+}
+
+inline real abs_max(float32 a) {
+  return (real)std::abs(a);
+}
+
+inline real abs_max(float64 a) {
+  return (real)std::abs(a);
+}
+
+template <int dim, typename T, InstSetExt ISE>
+inline real abs_max(const VectorND<dim, T, ISE> &a) {
+  return a.abs_max();
+}
+
+// Sum of |f(begin, end)| over the blocks
+template <typename F>
+float64 sum_blocks(int size, int num_threads, const F &f) {
+  return ThreadedTaskManager::reduce(
+      0, size, num_threads, 0.0, f,
+      [](float64 x, float64 y) { return x + y; }, vector_block_size);
+}
+
+// Maximum of |f(begin, end)| (non-negative) over the blocks
+template <typename F>
+real max_blocks(int size, int num_threads, const F &f) {
+  return ThreadedTaskManager::reduce(
+      0, size, num_threads, 0.0_f, f,
+      [](real x, real y) { return std::max(x, y); }, vector_block_size);
+}
+
+template <typename F>
+void for_each_cell_in_slab(const Vector2i &start,
+                           const Vector2i &end,
+                           int i_begin,
+                           int i_end,
+                           const F &f) {
+  for (int i = i_begin; i < i_end; i++) {
+    for (int j = start[1]; j < end[1]; j++) {
+      f(Vector2i(i, j));
+    }
+  }
+}
+
+template <typename F>
+void for_each_cell_in_slab(const Vector3i &start,
+                           const Vector3i &end,
+                           int i_begin,
+                           int i_end,
+                           const F &f) {
+  for (int i = i_begin; i < i_end; i++) {
+    for (int j = start[1]; j < end[1]; j++) {
+      for (int k = start[2]; k < end[2]; k++) {
+        f(Vector3i(i, j, k));
+      }
+    }
+  }
+}
+
+}  // namespace array_parallel
+
+// Calls |f(ind)|, with integer cell coordinates ind, for the cells in
+// [start, end), in parallel over slabs of consecutive slices along the
+// first axis. Slabs hold at least |grain_size| cells, and their cells are
+// visited in memory order. Calls of different cells must not conflict.
+template <int dim, typename F>
+void parallel_for(const VectorND<dim, int> &start,
+                  const VectorND<dim, int> &end,
+                  const F &f,
+                  int num_threads = -1,
+                  int grain_size = region_grain_size) {
+  int64 cells_per_slice = 1;
+  for (int d = 1; d < dim; d++) {
+    cells_per_slice *= std::max(end[d] - start[d], 0);
+  }
+  for_each_slab(std::max(end[0] - start[0], 0), cells_per_slice,
+                [&](int slab_begin, int slab_end) {
+                  array_parallel::for_each_cell_in_slab(
+                      start, end, start[0] + slab_begin, start[0] + slab_end,
+                      f);
+                },
+                num_threads, grain_size);
+}
+
+template <int dim, typename F>
+void parallel_for(const RegionND<dim> &region,
+                  const F &f,
+                  int num_threads = -1,
+                  int grain_size = region_grain_size) {
+  parallel_for(region.get_start_corner(), region.get_end_corner(), f,
+               num_threads, grain_size);
+}
+
+template <typename T>
+float64 dot_product(const T &a, const T &b, int num_threads = -1) {
+  assert_info(a.get_size() == b.get_size(),
+              "Arrays for dot product must have same shapes.");
+  return array_parallel::sum_blocks(
+      a.get_size(), num_threads, [&](int begin, int end) {
+        float64 sum = 0;
+        for (int i = begin; i < end; i++) {
+          sum += array_parallel::inner(a.data[i], b.data[i]);
+        }
+        return sum;
+      });
+}
+
+template <typename T>
+real p_abs_max(const T &a, int num_threads = -1) {
+  return array_parallel::max_blocks(
+      a.get_size(), num_threads, [&](int begin, int end) {
+        real max_val = 0;
+        for (int i = begin; i < end; i++) {
+          max_val = std::max(max_val, array_parallel::abs_max(a.data[i]));
+        }
+        return max_val;
+      });
+}
+
+// Sum of the entries of an array of scalars
+template <typename T>
+float64 p_sum(const T &a, int num_threads = -1) {
+  return array_parallel::sum_blocks(
+      a.get_size(), num_threads, [&](int begin, int end) {
+        float64 sum = 0;
+        for (int i = begin; i < end; i++) {
+          sum += a.data[i];
+        }
+        return sum;
+      });
+}
+
+// b = a, for arrays of the same shape and possibly other entry types, e.g.
+// between the float32 and float64 arrays of mixed precision solvers
+template <typename A, typename B>
+void p_copy(const A &a, B &b, int num_threads = -1) {
+  assert_info(a.get_size() == b.get_size(),
+              "Arrays for copy must have same shapes.");
+  for_each_vector_block(a.get_size(), num_threads,
+                        [&](int block, int begin, int end) {
+                          for (int i = begin; i < end; i++) {
+                            b.data[i] = a.data[i];
+                          }
+                        });
+}
+
+// a = a + alpha * b
+template <typename S, typename T>
+void p_add_in_place(T &a, const S alpha, const T &b, int num_threads = -1) {
+  assert_info(a.get_size() == b.get_size(),
+              "Arrays for add_in_place must have same shapes.");
+  for_each_vector_block(a.get_size(), num_threads,
+                        [&](int block, int begin, int end) {
+                          for (int i = begin; i < end; i++) {
+                            a.data[i] = a.data[i] + alpha * b.data[i];
+                          }
+                        });
+}
+
+// b = a + alpha * b
+template <typename S, typename T>
+void p_add_in_place2(const T &a, const S alpha, T &b, int num_threads = -1) {
+  assert_info(a.get_size() == b.get_size(),
+              "Arrays for add_in_place must have same shapes.");
+  for_each_vector_block(a.get_size(), num_threads,
+                        [&](int block, int begin, int end) {
+                          for (int i = begin; i < end; i++) {
+                            b.data[i] = a.data[i] + alpha * b.data[i];
+                          }
+                        });
+}
+
+// a = a + alpha * b, returning the abs max of the new a
+template <typename S, typename T>
+real p_add_in_place_abs_max(T &a,
+                            const S alpha,
+                            const T &b,
+                            int num_threads = -1) {
+  assert_info(a.get_size() == b.get_size(),
+              "Arrays for add_in_place must have same shapes.");
+  return array_parallel::max_blocks(
+      a.get_size(), num_threads, [&](int begin, int end) {
+        real max_val = 0;
+        for (int i = begin; i < end; i++) {
+          a.data[i] = a.data[i] + alpha * b.data[i];
+          max_val = std::max(max_val, array_parallel::abs_max(a.data[i]));
+        }
+        return max_val;
+      });
+}
+
+// The conjugate gradient step x = x + alpha * p, r = r - alpha * q, in one
+// pass, returning the abs max of the new r
+template <typename S, typename T>
+real p_update_solution_and_residual(T &x,
+                                    T &r,
+                                    const S alpha,
+                                    const T &p,
+                                    const T &q,
+                                    int num_threads = -1) {
+  assert_info(x.get_size() == r.get_size() &&
+                  x.get_size() == p.get_size() &&
+                  x.get_size() == q.get_size(),
+              "Arrays for the CG update must have same shapes.");
+  return array_parallel::max_blocks(
+      x.get_size(), num_threads, [&](int begin, int end) {
+        real max_val = 0;
+        for (int i = begin; i < end; i++) {
+          x.data[i] = x.data[i] + alpha * p.data[i];
+          r.data[i] = r.data[i] - alpha * q.data[i];
+          max_val = std::max(max_val, array_parallel::abs_max(r.data[i]));
+        }
+        return max_val;
+      });
+}
+
+// a = a - shift for arrays of scalars, returning the abs max of the new a
+template <typename S, typename T>
+real p_subtract_abs_max(T &a, const S shift, int num_threads = -1) {
+  return array_parallel::max_blocks(
+      a.get_size(), num_threads, [&](int begin, int end) {
+        real max_val = 0;
+        for (int i = begin; i < end; i++) {
+          a.data[i] -= shift;
+          max_val = std::max(max_val, array_parallel::abs_max(a.data[i]));
+        }
+        return max_val;
+      });
+}
+
+TC_NAMESPACE_END
@@ -0,0 +1,95 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+#include <taichi/math/array.h>
+#include <array>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+TC_NAMESPACE_BEGIN
+
+// Temporary arrays of a substep or a solver iteration, kept by shape for
+// the next ones, which then neither allocate nor fault their pages in
+// again. Arrays come back with the cells of their last use, so passes
+// must write every cell they read. The pool must outlive its handles.
+template <int dim, typename T>
+class ArrayPool {
+ public:
+  using Array = ArrayND<dim, T>;
+  using Vectori = VectorND<dim, int>;
+  using Vector = VectorND<dim, real>;
+
+  // Gives the array back to its pool
+  class Releaser {
+   public:
+    explicit Releaser(ArrayPool *pool = nullptr) : pool(pool) {
+    }
+
+    void operator()(Array *arr) const {
+      pool->release(arr);
+    }
+
+   private:
+    ArrayPool *pool;
+  };
+
+  using Handle = std::unique_ptr<Array, Releaser>;
+
+  Handle acquire(const Vectori &res, const Vector &storage_offset) {
+    Key key = get_key(res, storage_offset);
+    {
+      std::lock_guard<std::mutex> _(mut);
+      auto &arrays = free_arrays[key];
+      if (!arrays.empty()) {
+        Array *arr = arrays.back().release();
+        arrays.pop_back();
+        return Handle(arr, Releaser(this));
+      }
+    }
+    return Handle(new Array(res, T(0), storage_offset), Releaser(this));
+  }
+
+  Handle acquire(const Vectori &res) {
+    return acquire(res, Vector(0.5_f));
+  }
+
+  Handle acquire_like(const Array &arr) {
+    return acquire(arr.get_res(), arr.get_storage_offset());
+  }
+
+  // Frees the arrays in the pool
+  void clear() {
+    std::lock_guard<std::mutex> _(mut);
+    free_arrays.clear();
+  }
+
+ private:
+  using Key = std::pair<std::array<int, dim>, std::array<real, dim>>;
+
+  static Key get_key(const Vectori &res, const Vector &storage_offset) {
+    Key key;
+    for (int i = 0; i < dim; i++) {
+      key.first[i] = res[i];
+      key.second[i] = storage_offset[i];
+    }
+    return key;
+  }
+
+  void release(Array *arr) {
+    std::lock_guard<std::mutex> _(mut);
+    free_arrays[get_key(arr->get_res(), arr->get_storage_offset())]
+        .push_back(std::unique_ptr<Array>(arr));
+  }
+
+  std::mutex mut;
+  std::map<Key, std::vector<std::unique_ptr<Array>>> free_arrays;
+};
+
+TC_NAMESPACE_END
@@ -0,0 +1,317 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+#include <taichi/common/util.h>
+#include <taichi/math/array_2d.h>
+#include <taichi/math/array_3d.h>
+#include <taichi/math/interpolation.h>
+
+#include <immintrin.h>
+#include <type_traits>
+
+TC_NAMESPACE_BEGIN
+
+// Interpolation of Array2D and Array3D beyond their sample() members:
+// stencils that share the weights of one position between arrays of the
+// same shape, batches of positions (gathered eight at a time with AVX2 for
+// float32 arrays), a branch-free path for stencils known to be inside the
+// array, and monotonic cubic interpolation. Linear variants give the
+// values of sample().
+
+// The bilinear interpolation of Array2D::sample() at a position
+struct BilinearStencil {
+  int base, stride_x;
+  real x_r, y_r;
+
+  template <typename T>
+  BilinearStencil(const Array2D<T> &arr, const Vector2 &pos) {
+    Vector2i res = arr.get_res();
+    Vector2 offset = arr.get_storage_offset();
+    real x = clamp(pos.x - offset.x, 0.0_f, res[0] - 1.0_f - eps);
+    real y = clamp(pos.y - offset.y, 0.0_f, res[1] - 1.0_f - eps);
+    int x_i = clamp(int(x), 0, res[0] - 2);
+    int y_i = clamp(int(y), 0, res[1] - 2);
+    x_r = x - x_i;
+    y_r = y - y_i;
+    stride_x = res[1];
+    base = x_i * stride_x + y_i;
+  }
+
+  template <typename T>
+  T sample(const Array2D<T> &arr) const {
+    const T *p = &arr.data[base];
+    const T *px = p + stride_x;
+    return lerp(x_r, lerp(y_r, p[0], p[1]), lerp(y_r, px[0], px[1]));
+  }
+};
+
+// The trilinear interpolation of Array3D::sample() at a position
+struct TrilinearStencil {
+  int base, stride_x, stride_y;
+  real x_r, y_r, z_r;
+
+  template <typename T>
+  TrilinearStencil(const Array3D<T> &arr, const Vector3 &pos) {
+    Vector3i res = arr.get_res();
+    Vector3 offset = arr.get_storage_offset();
+    real x = clamp(pos.x - offset.x, 0.0_f, res[0] - 1.0_f - eps);
+    real y = clamp(pos.y - offset.y, 0.0_f, res[1] - 1.0_f - eps);
+    real z = clamp(pos.z - offset.z, 0.0_f, res[2] - 1.0_f - eps);
+    int x_i = clamp(int(x), 0, res[0] - 2);
+    int y_i = clamp(int(y), 0, res[1] - 2);
+    int z_i = clamp(int(z), 0, res[2] - 2);
+    x_r = x - x_i;
+    y_r = y - y_i;
+    z_r = z - z_i;
+    stride_y = res[2];
+    stride_x = res[1] * res[2];
+    base = x_i * stride_x + y_i * stride_y + z_i;
+  }
+
+  template <typename T>
+  T sample(const Array3D<T> &arr) const {
+    const T *p = &arr.data[base];
+    const T *px = p + stride_x;
+    return lerp(z_r,
+                lerp(x_r, lerp(y_r, p[0], p[stride_y]),
+                     lerp(y_r, px[0], px[stride_y])),
+                lerp(x_r, lerp(y_r, p[1], p[stride_y + 1]),
+                     lerp(y_r, px[1], px[stride_y + 1])));
+  }
+
+  // Clamps |v| to the range of the samples interpolated from
+  real clamp_to_samples(const Array3D<real> &arr, real v) const {
+    const real *p = &arr.data[base];
+    real lo = p[0], hi = p[0];
+    for (int dx = 0; dx < 2; dx++) {
+      for (int dy = 0; dy < 2; dy++) {
+        for (int dz = 0; dz < 2; dz++) {
+          real s = p[dx * stride_x + dy * stride_y + dz];
+          lo = std::min(lo, s);
+          hi = std::max(hi, s);
+        }
+      }
+    }
+    return clamp(v, lo, hi);
+  }
+};
+
+// sample() for positions whose stencils are inside the array, i.e.
+// storage_offset <= pos < storage_offset + res - 1 on every axis, without
+// the clamping to the borders
+template <typename T>
+TC_FORCE_INLINE T sample_interior(const Array2D<T> &arr, const Vector2 &pos) {
+  Vector2 p = pos - arr.get_storage_offset();
+  int x_i = int(p.x), y_i = int(p.y);
+  real x_r = p.x - x_i, y_r = p.y - y_i;
+  const T *q = &arr.data[x_i * arr.get_res()[1] + y_i];
+  const T *qx = q + arr.get_res()[1];
+  return lerp(x_r, lerp(y_r, q[0], q[1]), lerp(y_r, qx[0], qx[1]));
+}
+
+template <typename T>
+TC_FORCE_INLINE T sample_interior(const Array3D<T> &arr, const Vector3 &pos) {
+  Vector3 p = pos - arr.get_storage_offset();
+  int x_i = int(p.x), y_i = int(p.y), z_i = int(p.z);
+  real x_r = p.x - x_i, y_r = p.y - y_i, z_r = p.z - z_i;
+  const int stride_y = arr.get_res()[2];
+  const int stride_x = arr.get_res()[1] * stride_y;
+  const T *q = &arr.data[x_i * stride_x + y_i * stride_y + z_i];
+  const T *qx = q + stride_x;
+  return lerp(z_r,
+              lerp(x_r, lerp(y_r, q[0], q[stride_y]),
+                   lerp(y_r, qx[0], qx[stride_y])),
+              lerp(x_r, lerp(y_r, q[1], q[stride_y + 1]),
+                   lerp(y_r, qx[1], qx[stride_y + 1])));
+}
+
+// out[i] = arr.sample(pos[i]) for i in [0, n)
+template <typename T>
+void sample_batch(const Array2D<T> &arr,
+                  const Vector2 *pos,
+                  int n,
+                  T *out) {
+  for (int i = 0; i < n; i++) {
+    out[i] = BilinearStencil(arr, pos[i]).sample(arr);
+  }
+}
+
+template <typename T>
+void sample_batch(const Array3D<T> &arr,
+                  const Vector3 *pos,
+                  int n,
+                  T *out) {
+  for (int i = 0; i < n; i++) {
+    out[i] = TrilinearStencil(arr, pos[i]).sample(arr);
+  }
+}
+
+#if defined(__AVX2__)
+namespace array_sample {
+
+// Component |c| of pos[0] to pos[7]
+template <typename Vector>
+TC_FORCE_INLINE __m256 gather_component(const Vector *pos, int c) {
+  constexpr int stride = sizeof(Vector) / sizeof(float32);
+  const __m256i index =
+      _mm256_setr_epi32(0, stride, 2 * stride, 3 * stride, 4 * stride,
+                        5 * stride, 6 * stride, 7 * stride);
+  return _mm256_i32gather_ps((const float32 *)pos + c, index, 4);
+}
+
+// The clamped cell index and the fraction of eight coordinates along an
+// axis of |res| samples, as in sample()
+TC_FORCE_INLINE __m256i locate(__m256 x, float32 offset, int res, __m256 &r) {
+  x = _mm256_sub_ps(x, _mm256_set1_ps(offset));
+  x = _mm256_min_ps(_mm256_max_ps(x, _mm256_setzero_ps()),
+                    _mm256_set1_ps(res - 1.0_f - eps));
+  __m256i i = _mm256_cvttps_epi32(x);
+  i = _mm256_min_epi32(i, _mm256_set1_epi32(res - 2));
+  r = _mm256_sub_ps(x, _mm256_cvtepi32_ps(i));
+  return i;
+}
+
+TC_FORCE_INLINE __m256 lerp8(__m256 a, __m256 x_0, __m256 x_1) {
+  return _mm256_add_ps(
+      _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(1.0f), a), x_0),
+      _mm256_mul_ps(a, x_1));
+}
+
+}  // namespace array_sample
+
+inline void sample_batch(const Array2D<float32> &arr,
+                         const Vector2 *pos,
+                         int n,
+                         float32 *out) {
+  using namespace array_sample;
+  const Vector2i res = arr.get_res();
+  const Vector2 offset = arr.get_storage_offset();
+  const float32 *data = arr.data.data();
+  const __m256i stride_x = _mm256_set1_epi32(res[1]);
+  int i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256 x_r, y_r;
+    __m256i x_i = locate(gather_component(pos + i, 0), offset.x, res[0], x_r);
+    __m256i y_i = locate(gather_component(pos + i, 1), offset.y, res[1], y_r);
+    __m256i base = _mm256_add_epi32(_mm256_mullo_epi32(x_i, stride_x), y_i);
+    __m256i base_x = _mm256_add_epi32(base, stride_x);
+    __m256 p00 = _mm256_i32gather_ps(data, base, 4);
+    __m256 p01 = _mm256_i32gather_ps(data + 1, base, 4);
+    __m256 p10 = _mm256_i32gather_ps(data, base_x, 4);
+    __m256 p11 = _mm256_i32gather_ps(data + 1, base_x, 4);
+    _mm256_storeu_ps(out + i, lerp8(x_r, lerp8(y_r, p00, p01),
+                                    lerp8(y_r, p10, p11)));
+  }
+  for (; i < n; i++) {
+    out[i] = BilinearStencil(arr, pos[i]).sample(arr);
+  }
+}
+
+inline void sample_batch(const Array3D<float32> &arr,
+                         const Vector3 *pos,
+                         int n,
+                         float32 *out) {
+  using namespace array_sample;
+  const Vector3i res = arr.get_res();
+  const Vector3 offset = arr.get_storage_offset();
+  const float32 *data = arr.data.data();
+  const int sy = res[2], sx = res[1] * res[2];
+  const __m256i stride_y = _mm256_set1_epi32(sy);
+  const __m256i stride_x = _mm256_set1_epi32(sx);
+  int i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256 x_r, y_r, z_r;
+    __m256i x_i = locate(gather_component(pos + i, 0), offset.x, res[0], x_r);
+    __m256i y_i = locate(gather_component(pos + i, 1), offset.y, res[1], y_r);
+    __m256i z_i = locate(gather_component(pos + i, 2), offset.z, res[2], z_r);
+    __m256i base = _mm256_add_epi32(
+        _mm256_add_epi32(_mm256_mullo_epi32(x_i, stride_x),
+                         _mm256_mullo_epi32(y_i, stride_y)),
+        z_i);
+    // Corners (dx, dy, dz) at base + dx * sx + dy * sy + dz
+    __m256i base_x = _mm256_add_epi32(base, stride_x);
+    __m256i base_y = _mm256_add_epi32(base, stride_y);
+    __m256i base_xy = _mm256_add_epi32(base_x, stride_y);
+    __m256 p000 = _mm256_i32gather_ps(data, base, 4);
+    __m256 p001 = _mm256_i32gather_ps(data + 1, base, 4);
+    __m256 p010 = _mm256_i32gather_ps(data, base_y, 4);
+    __m256 p011 = _mm256_i32gather_ps(data + 1, base_y, 4);
+    __m256 p100 = _mm256_i32gather_ps(data, base_x, 4);
+    __m256 p101 = _mm256_i32gather_ps(data + 1, base_x, 4);
+    __m256 p110 = _mm256_i32gather_ps(data, base_xy, 4);
+    __m256 p111 = _mm256_i32gather_ps(data + 1, base_xy, 4);
+    _mm256_storeu_ps(
+        out + i,
+        lerp8(z_r,
+              lerp8(x_r, lerp8(y_r, p000, p010), lerp8(y_r, p100, p110)),
+              lerp8(x_r, lerp8(y_r, p001, p011), lerp8(y_r, p101, p111))));
+  }
+  for (; i < n; i++) {
+    out[i] = TrilinearStencil(arr, pos[i]).sample(arr);
+  }
+}
+#endif
+
+namespace array_sample {
+
+// The cell of |x| along an axis of |res| samples, as in sample(), and the
+// four taps around it, clamped to the array
+TC_FORCE_INLINE void cubic_taps(real x, int res, int taps[4], real &r) {
+  x = clamp(x, 0.0_f, res - 1.0_f - eps);
+  int i = clamp(int(x), 0, res - 2);
+  r = x - i;
+  for (int k = 0; k < 4; k++) {
+    taps[k] = clamp(i - 1 + k, 0, res - 1);
+  }
+}
+
+}  // namespace array_sample
+
+// Bicubic interpolation through monotonic_cubic() along each axis: no
+// overshoot beyond the samples along an axis, e.g. for advecting densities
+template <typename T>
+T sample_monotonic_cubic(const Array2D<T> &arr, const Vector2 &pos) {
+  static_assert(std::is_floating_point<T>::value,
+                "Monotonic cubic interpolation is for arrays of scalars");
+  Vector2 p = pos - arr.get_storage_offset();
+  int tx[4], ty[4];
+  real x_r, y_r;
+  array_sample::cubic_taps(p.x, arr.get_res()[0], tx, x_r);
+  array_sample::cubic_taps(p.y, arr.get_res()[1], ty, y_r);
+  T f[4];
+  for (int a = 0; a < 4; a++) {
+    const T *line = arr[tx[a]];
+    f[a] = monotonic_cubic(line[ty[0]], line[ty[1]], line[ty[2]], line[ty[3]],
+                           y_r);
+  }
+  return monotonic_cubic(f[0], f[1], f[2], f[3], x_r);
+}
+
+template <typename T>
+T sample_monotonic_cubic(const Array3D<T> &arr, const Vector3 &pos) {
+  static_assert(std::is_floating_point<T>::value,
+                "Monotonic cubic interpolation is for arrays of scalars");
+  Vector3 p = pos - arr.get_storage_offset();
+  int tx[4], ty[4], tz[4];
+  real x_r, y_r, z_r;
+  array_sample::cubic_taps(p.x, arr.get_res()[0], tx, x_r);
+  array_sample::cubic_taps(p.y, arr.get_res()[1], ty, y_r);
+  array_sample::cubic_taps(p.z, arr.get_res()[2], tz, z_r);
+  T f[4];
+  for (int a = 0; a < 4; a++) {
+    T g[4];
+    for (int b = 0; b < 4; b++) {
+      const T &line = arr.get(tx[a], ty[b], 0);
+      g[b] = monotonic_cubic((&line)[tz[0]], (&line)[tz[1]], (&line)[tz[2]],
+                             (&line)[tz[3]], z_r);
+    }
+    f[a] = monotonic_cubic(g[0], g[1], g[2], g[3], y_r);
+  }
+  return monotonic_cubic(f[0], f[1], f[2], f[3], x_r);
+}
+
+TC_NAMESPACE_END
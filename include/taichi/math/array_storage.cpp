@@ -0,0 +1,109 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#include "array_storage.h"
+#include <taichi/system/threading.h>
+#include <taichi/system/virtual_memory.h>
+
+#include <cstdlib>
+
+#if defined(TC_PLATFORM_UNIX)
+#include <sys/mman.h>
+#else
+#include <malloc.h>
+#include <windows.h>
+#endif
+
+TC_NAMESPACE_BEGIN
+
+static std::size_t round_up(std::size_t bytes, std::size_t alignment) {
+  return (bytes + alignment - 1) / alignment * alignment;
+}
+
+void *allocate_array_memory(std::size_t bytes) {
+  TC_MEMORY_ALLOCATED("arrays", bytes);
+  if (bytes < array_page_backed_bytes) {
+    void *ptr = nullptr;
+    bytes = round_up(std::max<std::size_t>(bytes, 1), array_alignment);
+#if defined(TC_PLATFORM_UNIX)
+    if (posix_memalign(&ptr, array_alignment, bytes) != 0) {
+      ptr = nullptr;
+    }
+#else
+    ptr = _aligned_malloc(bytes, array_alignment);
+#endif
+    TC_ERROR_IF(ptr == nullptr, "Array allocation ({} B) failed.", bytes);
+    return ptr;
+  }
+  bytes = round_up(bytes, array_page_backed_bytes);
+#if defined(TC_PLATFORM_UNIX)
+  // Over-map by a huge page, and unmap the ends around the aligned block
+  std::size_t mapped_bytes = bytes + array_page_backed_bytes;
+  void *mapped = mmap(nullptr, mapped_bytes, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  TC_ERROR_IF(mapped == MAP_FAILED, "Array allocation ({} B) failed.", bytes);
+  char *begin = (char *)mapped;
+  char *aligned = (char *)round_up((std::size_t)begin, array_page_backed_bytes);
+  char *end = begin + mapped_bytes;
+  if (aligned != begin) {
+    munmap(begin, aligned - begin);
+  }
+  if (aligned + bytes != end) {
+    munmap(aligned + bytes, end - (aligned + bytes));
+  }
+#if defined(MADV_HUGEPAGE)
+  madvise(aligned, bytes, MADV_HUGEPAGE);
+#endif
+  return aligned;
+#else
+  void *ptr =
+      VirtualAlloc(nullptr, bytes, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+  TC_ERROR_IF(ptr == nullptr, "Array allocation ({} B) failed.", bytes);
+  return ptr;
+#endif
+}
+
+void free_array_memory(void *ptr, std::size_t bytes) {
+  TC_MEMORY_FREED("arrays", bytes);
+  if (bytes < array_page_backed_bytes) {
+#if defined(TC_PLATFORM_UNIX)
+    free(ptr);
+#else
+    _aligned_free(ptr);
+#endif
+    return;
+  }
+#if defined(TC_PLATFORM_UNIX)
+  if (munmap(ptr, round_up(bytes, array_page_backed_bytes)) != 0)
+#else
+  if (!VirtualFree(ptr, 0, MEM_RELEASE))
+#endif
+    TC_ERROR("Failed to free array memory ({} B)", bytes);
+}
+
+void for_each_slab(int slices,
+                   int64 cells_per_slice,
+                   const std::function<void(int, int)> &f,
+                   int num_threads,
+                   int grain_size) {
+  if (slices <= 0 || cells_per_slice <= 0) {
+    return;
+  }
+  int slices_per_slab = (int)std::max<int64>(
+      1, (grain_size + cells_per_slice - 1) / cells_per_slice);
+  int num_slabs = (slices + slices_per_slab - 1) / slices_per_slab;
+#if !defined(TC_AMALGAMATED)
+  if (num_slabs > 1 && num_threads != 1) {
+    ThreadedTaskManager::run(num_slabs, num_threads, [&](int slab) {
+      int begin = slab * slices_per_slab;
+      f(begin, std::min(slices, begin + slices_per_slab));
+    });
+    return;
+  }
+#endif
+  f(0, slices);
+}
+
+TC_NAMESPACE_END
@@ -0,0 +1,110 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+#include <taichi/common/util.h>
+
+#include <algorithm>
+#include <functional>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+TC_NAMESPACE_BEGIN
+
+// Storage of the cells of Array2D and Array3D. Blocks are 64-byte aligned;
+// blocks of at least array_page_backed_bytes are mapped from virtual
+// memory, as in VirtualMemoryAllocator, aligned to, and advised as, huge
+// pages. Mapped pages are placed on the NUMA node of the thread that first
+// writes them, so arrays are not filled on allocation but on the slabs of
+// parallel_for, by the threads that run later stencils on them.
+
+constexpr std::size_t array_alignment = 64;
+constexpr std::size_t array_page_backed_bytes = std::size_t(1) << 21;
+
+// Cells per task of parallel_for; smaller regions run on the calling thread
+constexpr int region_grain_size = 4096;
+
+void *allocate_array_memory(std::size_t bytes);
+
+void free_array_memory(void *ptr, std::size_t bytes);
+
+// Calls |f(begin, end)| for the slabs [begin, end) of consecutive slices
+// along the first axis that parallel_for runs as tasks, in parallel
+void for_each_slab(int slices,
+                   int64 cells_per_slice,
+                   const std::function<void(int, int)> &f,
+                   int num_threads = -1,
+                   int grain_size = region_grain_size);
+
+template <typename T>
+class ArrayAllocator {
+ public:
+  using value_type = T;
+
+  template <typename U>
+  struct rebind {
+    using other = ArrayAllocator<U>;
+  };
+
+  ArrayAllocator() = default;
+
+  template <typename U>
+  ArrayAllocator(const ArrayAllocator<U> &) {
+  }
+
+  T *allocate(std::size_t n) {
+    return reinterpret_cast<T *>(allocate_array_memory(n * sizeof(T)));
+  }
+
+  void deallocate(T *ptr, std::size_t n) {
+    free_array_memory(ptr, n * sizeof(T));
+  }
+
+  // Cells of trivially destructible types are left unconstructed by
+  // resize(), until they are assigned
+  template <typename U>
+  void construct(U *ptr) {
+    if (!std::is_trivially_destructible<U>::value) {
+      ::new ((void *)ptr) U();
+    }
+  }
+
+  template <typename U, typename... Args>
+  void construct(U *ptr, Args &&... args) {
+    ::new ((void *)ptr) U(std::forward<Args>(args)...);
+  }
+};
+
+template <typename T, typename U>
+bool operator==(const ArrayAllocator<T> &, const ArrayAllocator<U> &) {
+  return true;
+}
+
+template <typename T, typename U>
+bool operator!=(const ArrayAllocator<T> &, const ArrayAllocator<U> &) {
+  return false;
+}
+
+template <typename T>
+using ArrayStorage = std::vector<T, ArrayAllocator<T>>;
+
+// |slices| slices of |cells_per_slice| cells, all |init|, written by the
+// threads of parallel_for
+template <typename T>
+ArrayStorage<T> allocate_array_storage(int slices,
+                                       int64 cells_per_slice,
+                                       const T &init) {
+  ArrayStorage<T> data(slices * cells_per_slice);
+  for_each_slab(slices, cells_per_slice, [&](int begin, int end) {
+    std::fill(data.begin() + begin * cells_per_slice,
+              data.begin() + end * cells_per_slice, init);
+  });
+  return data;
+}
+
+TC_NAMESPACE_END
@@ -27,6 +27,12 @@ class RunningAverage {
     total_weight += weight;
   }
 
+  // Of the values of both
+  void merge(const RunningAverage &o) {
+    total_value += o.total_value;
+    total_weight += o.total_weight;
+  }
+
   real get_average() {
     if (total_weight == 0) {
       return safe_value;
@@ -13,12 +13,51 @@
 
 TC_NAMESPACE_BEGIN
 
+// sample(r, pdf) is O(1) through a Walker alias table. The overload that
+// also returns the CDF searches it, for callers that rescale |r| into the
+// chosen element's interval.
 class DiscreteSampler {
  private:
   std::vector<real> pdf;
   std::vector<real> cdf;
+  // Bucket i picks i if the scaled sample is below alias_prob[i], otherwise
+  // alias[i]
+  std::vector<real> alias_prob;
+  std::vector<int> alias;
   bool zero_total_pdf;
 
+  // Vose's method
+  void build_alias_table() {
+    int n = (int)pdf.size();
+    alias_prob.resize(n);
+    alias.resize(n);
+    std::vector<int> small, large;
+    std::vector<real> scaled(n);
+    for (int i = 0; i < n; i++) {
+      scaled[i] = pdf[i] * n;
+      alias[i] = i;
+      (scaled[i] < 1 ? small : large).push_back(i);
+    }
+    while (!small.empty() && !large.empty()) {
+      int s = small.back(), l = large.back();
+      small.pop_back();
+      alias_prob[s] = scaled[s];
+      alias[s] = l;
+      scaled[l] -= 1 - scaled[s];
+      if (scaled[l] < 1) {
+        large.pop_back();
+        small.push_back(l);
+      }
+    }
+    // Only rounding errors are left
+    for (int i : large) {
+      alias_prob[i] = 1;
+    }
+    for (int i : small) {
+      alias_prob[i] = 1;
+    }
+  }
+
  public:
   DiscreteSampler() {
   }
@@ -37,7 +76,7 @@ class DiscreteSampler {
     // float sum = std::accumulate(unnormalized_pdf.begin(),
     // unnormalized_pdf.end(), 0.0_f);
     assert(unnormalized_pdf.size() != 0);
-    float sum = 0.0_f;
+    real sum = 0.0_f;
     for (int i = 0; i < (int)unnormalized_pdf.size(); i++) {
       real pdf = unnormalized_pdf[i];
       assert_info(pdf >= 0, "No negative pdf allowed!");
@@ -45,10 +84,11 @@ class DiscreteSampler {
     }
     if (!allow_zero_total_pdf) {
       assert_info(sum > 0, "Sum of pdf is zero.");
+      zero_total_pdf = false;
     } else {
       zero_total_pdf = sum < 1e-20f;
     }
-    float inv_sum = 1.0_f / std::max(sum, 1e-30f);
+    real inv_sum = 1.0_f / std::max(sum, 1e-30_f);
     this->pdf.resize(unnormalized_pdf.size());
     this->cdf.resize(unnormalized_pdf.size());
     for (int i = 0; i < (int)pdf.size(); i++) {
@@ -58,6 +98,7 @@ class DiscreteSampler {
         cdf[i] += cdf[i - 1];
       }
     }
+    build_alias_table();
   }
 
   int sample(real r, real &pdf_out) const {
@@ -65,8 +106,10 @@ class DiscreteSampler {
       pdf_out = 0.0_f;
       return 0;
     }
-    int index = int(std::lower_bound(cdf.begin(), cdf.end(), r) - cdf.begin());
-    index = std::min(index, get_num_elements() - 1);
+    int n = get_num_elements();
+    real scaled = r * n;
+    int bucket = std::min(std::max(int(scaled), 0), n - 1);
+    int index = scaled - bucket < alias_prob[bucket] ? bucket : alias[bucket];
     pdf_out = pdf[index];
     return index;
   }
@@ -96,6 +139,8 @@ class DiscreteSampler {
   real get_cdf(int id) const {
     return cdf[id];
   }
+
+  TC_IO_DEF(pdf, cdf, alias_prob, alias, zero_total_pdf);
 };
 
 inline void test_discrete_sampler() {
@@ -0,0 +1,331 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+#include "vector_pack.h"
+
+#include <cstring>
+#include <cfloat>
+
+TC_NAMESPACE_BEGIN
+
+// Approximations of exp, log, pow, sincos, atan2 and acos for float32
+// scalars and ScalarPacks of float32, written once over the lane-wise
+// operators: batch kernels over packs get them in AVX or AVX-512 registers,
+// and the array packs of other targets are left to the auto-vectorizer.
+// The polynomials are those of Cephes, branch-free through select(); errors
+// are within a few float32 ulps (bounds below). float64 lanes call std.
+namespace fast_math {
+
+// Primitives of float32 scalars; those of packs are their friends
+TC_FORCE_INLINE float32 min(float32 a, float32 b) {
+  return std::min(a, b);
+}
+
+TC_FORCE_INLINE float32 max(float32 a, float32 b) {
+  return std::max(a, b);
+}
+
+TC_FORCE_INLINE float32 select(bool mask, float32 a, float32 b) {
+  return mask ? a : b;
+}
+
+TC_FORCE_INLINE float32 sqrt(float32 x) {
+  return std::sqrt(x);
+}
+
+TC_FORCE_INLINE float32 floor(float32 x) {
+  return std::floor(x);
+}
+
+// 2^n, for integral n in [-126, 127]
+TC_FORCE_INLINE float32 exp2i(float32 n) {
+  int32 bits = ((int32)n + 127) << 23;
+  float32 ret;
+  std::memcpy(&ret, &bits, sizeof(ret));
+  return ret;
+}
+
+// The m in [0.5, 1) and e of x = m 2^e, for positive normal x
+TC_FORCE_INLINE float32 frexp(float32 x, float32 &e) {
+  int32 bits;
+  std::memcpy(&bits, &x, sizeof(bits));
+  e = (float32)(((bits >> 23) & 0xff) - 126);
+  bits = (bits & (int32)0x807fffff) | 0x3f000000;
+  float32 m;
+  std::memcpy(&m, &bits, sizeof(m));
+  return m;
+}
+
+// Lane by lane, for packs without the intrinsics below
+template <int width>
+TC_FORCE_INLINE ScalarPack<float32, width> floor(
+    const ScalarPack<float32, width> &x) {
+  float32 d[width];
+  x.store(d);
+  for (int i = 0; i < width; i++) {
+    d[i] = std::floor(d[i]);
+  }
+  return ScalarPack<float32, width>::load(d);
+}
+
+template <int width>
+TC_FORCE_INLINE ScalarPack<float32, width> exp2i(
+    const ScalarPack<float32, width> &n) {
+  float32 d[width];
+  n.store(d);
+  for (int i = 0; i < width; i++) {
+    d[i] = exp2i(d[i]);
+  }
+  return ScalarPack<float32, width>::load(d);
+}
+
+template <int width>
+TC_FORCE_INLINE ScalarPack<float32, width> frexp(
+    const ScalarPack<float32, width> &x,
+    ScalarPack<float32, width> &e) {
+  float32 d[width], f[width];
+  x.store(d);
+  for (int i = 0; i < width; i++) {
+    d[i] = frexp(d[i], f[i]);
+  }
+  e = ScalarPack<float32, width>::load(f);
+  return ScalarPack<float32, width>::load(d);
+}
+
+#if defined(__AVX__)
+TC_FORCE_INLINE ScalarPack<float32, 8> floor(const ScalarPack<float32, 8> &x) {
+  return ScalarPack<float32, 8>(_mm256_floor_ps(x.v));
+}
+#endif
+
+#if defined(__AVX2__)
+TC_FORCE_INLINE ScalarPack<float32, 8> exp2i(const ScalarPack<float32, 8> &n) {
+  __m256i bits = _mm256_add_epi32(_mm256_cvtps_epi32(n.v),
+                                  _mm256_set1_epi32(127));
+  return ScalarPack<float32, 8>(
+      _mm256_castsi256_ps(_mm256_slli_epi32(bits, 23)));
+}
+
+TC_FORCE_INLINE ScalarPack<float32, 8> frexp(const ScalarPack<float32, 8> &x,
+                                             ScalarPack<float32, 8> &e) {
+  __m256i bits = _mm256_castps_si256(x.v);
+  __m256i exponent = _mm256_and_si256(_mm256_srli_epi32(bits, 23),
+                                      _mm256_set1_epi32(0xff));
+  e = ScalarPack<float32, 8>(_mm256_cvtepi32_ps(
+      _mm256_sub_epi32(exponent, _mm256_set1_epi32(126))));
+  bits = _mm256_or_si256(
+      _mm256_and_si256(bits, _mm256_set1_epi32((int32)0x807fffff)),
+      _mm256_set1_epi32(0x3f000000));
+  return ScalarPack<float32, 8>(_mm256_castsi256_ps(bits));
+}
+#endif
+
+#if defined(__AVX512F__)
+TC_FORCE_INLINE ScalarPack<float32, 16> floor(
+    const ScalarPack<float32, 16> &x) {
+  return ScalarPack<float32, 16>(
+      _mm512_roundscale_ps(x.v, _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC));
+}
+
+TC_FORCE_INLINE ScalarPack<float32, 16> exp2i(
+    const ScalarPack<float32, 16> &n) {
+  __m512i bits = _mm512_add_epi32(_mm512_cvtps_epi32(n.v),
+                                  _mm512_set1_epi32(127));
+  return ScalarPack<float32, 16>(
+      _mm512_castsi512_ps(_mm512_slli_epi32(bits, 23)));
+}
+
+TC_FORCE_INLINE ScalarPack<float32, 16> frexp(
+    const ScalarPack<float32, 16> &x,
+    ScalarPack<float32, 16> &e) {
+  __m512i bits = _mm512_castps_si512(x.v);
+  __m512i exponent = _mm512_and_epi32(_mm512_srli_epi32(bits, 23),
+                                      _mm512_set1_epi32(0xff));
+  e = ScalarPack<float32, 16>(_mm512_cvtepi32_ps(
+      _mm512_sub_epi32(exponent, _mm512_set1_epi32(126))));
+  bits = _mm512_or_epi32(
+      _mm512_and_epi32(bits, _mm512_set1_epi32((int32)0x807fffff)),
+      _mm512_set1_epi32(0x3f000000));
+  return ScalarPack<float32, 16>(_mm512_castsi512_ps(bits));
+}
+#endif
+
+// Relative error below 2e-7; 0 below -87.3, and e^88 above 88
+template <typename S>
+TC_FORCE_INLINE S exp(const S &x_) {
+  // e^x = 2^n e^r, with n the nearest integer to x / ln 2
+  S x = min(max(x_, S(-87.33f)), S(88.0f));
+  S n = floor(x * S(1.44269504088896341f) + S(0.5f));
+  S r = x - n * S(0.693359375f) + n * S(2.12194440e-4f);
+  S p = S(1.9875691500e-4f);
+  p = p * r + S(1.3981999507e-3f);
+  p = p * r + S(8.3334519073e-3f);
+  p = p * r + S(4.1665795894e-2f);
+  p = p * r + S(1.6666665459e-1f);
+  p = p * r + S(5.0000001201e-1f);
+  return select(x_ < S(-87.33f), S(0.0f),
+                (p * r * r + r + S(1.0f)) * exp2i(n));
+}
+
+// Absolute error below 2e-7 around 1, relative elsewhere. x is clamped to
+// FLT_MIN, so that log(0) is -87.3 and pow(0, y) vanishes for y > 0.
+template <typename S>
+TC_FORCE_INLINE S log(const S &x_) {
+  S e;
+  S m = frexp(max(x_, S(FLT_MIN)), e);
+  // x = (1 + f) 2^e, with 1 + f in [sqrt(1/2), sqrt(2))
+  auto small = m < S(0.707106781186547524f);
+  e = select(small, e - S(1.0f), e);
+  S f = select(small, m + m, m) - S(1.0f);
+  S z = f * f;
+  S p = S(7.0376836292e-2f);
+  p = p * f - S(1.1514610310e-1f);
+  p = p * f + S(1.1676998740e-1f);
+  p = p * f - S(1.2420140846e-1f);
+  p = p * f + S(1.4249322787e-1f);
+  p = p * f - S(1.6668057665e-1f);
+  p = p * f + S(2.0000714765e-1f);
+  p = p * f - S(2.4999993993e-1f);
+  p = p * f + S(3.3333331174e-1f);
+  S y = p * f * z - e * S(2.12194440e-4f) - S(0.5f) * z;
+  return f + y + e * S(0.693359375f);
+}
+
+// x^y for x > 0, as exp(y log(x)): relative error below 2e-7 (1 + |y log x|)
+template <typename S>
+TC_FORCE_INLINE S pow(const S &x, const S &y) {
+  return exp(y * log(x));
+}
+
+// Absolute errors below 2e-7 for |x| up to 8192
+template <typename S>
+TC_FORCE_INLINE void sincos(const S &x, S &s, S &c) {
+  // x = q pi / 2 + r with |r| <= pi / 4, pi / 2 split in three for r
+  S q = floor(x * S(0.636619772367581343f) + S(0.5f));
+  S r = x - q * S(1.5703125f) - q * S(4.837512969970703125e-4f) -
+        q * S(7.54978995489188216e-8f);
+  S z = r * r;
+  S sr = S(-1.9515295891e-4f);
+  sr = sr * z + S(8.3321608736e-3f);
+  sr = sr * z - S(1.6666654611e-1f);
+  sr = sr * z * r + r;
+  S cr = S(2.443315711809948e-5f);
+  cr = cr * z - S(1.388731625493765e-3f);
+  cr = cr * z + S(4.166664568298827e-2f);
+  cr = cr * z * z - S(0.5f) * z + S(1.0f);
+  // The quadrant q mod 4 swaps and negates them
+  S quadrant = q - S(4.0f) * floor(q * S(0.25f));
+  auto odd = quadrant - S(2.0f) * floor(quadrant * S(0.5f)) == S(1.0f);
+  S next = quadrant + S(1.0f);
+  next = select(next == S(4.0f), S(0.0f), next);
+  s = select(odd, cr, sr);
+  c = select(odd, sr, cr);
+  s = select(quadrant >= S(2.0f), -s, s);
+  c = select(next >= S(2.0f), -c, c);
+}
+
+// In [-pi, pi], absolute error below 3e-7; atan2(0, 0) is 0
+template <typename S>
+TC_FORCE_INLINE S atan2(const S &y, const S &x) {
+  S ax = max(x, -x), ay = max(y, -y);
+  S t = min(ax, ay) / max(max(ax, ay), S(FLT_MIN));
+  // atan(t) = pi / 4 + atan((t - 1) / (t + 1)) above tan(pi / 8)
+  auto large = t > S(0.414213562373095049f);
+  S u = select(large, (t - S(1.0f)) / (t + S(1.0f)), t);
+  S z = u * u;
+  S p = S(8.05374449538e-2f);
+  p = p * z - S(1.38776856032e-1f);
+  p = p * z + S(1.99777106478e-1f);
+  p = p * z - S(3.33329491539e-1f);
+  S a = p * z * u + u;
+  a = select(large, a + S(0.785398163397448310f), a);
+  a = select(ay > ax, S(1.57079632679489662f) - a, a);
+  a = select(x < S(0.0f), S(3.14159265358979324f) - a, a);
+  return select(y < S(0.0f), -a, a);
+}
+
+// In [0, pi], absolute error below 3e-7; x is clamped to [-1, 1]
+template <typename S>
+TC_FORCE_INLINE S acos(const S &x) {
+  S a = min(max(x, -x), S(1.0f));
+  // acos(a) = 2 asin(sqrt((1 - a) / 2)) above 1 / 2, pi / 2 - asin(a) below
+  auto large = a > S(0.5f);
+  S s = select(large, sqrt((S(1.0f) - a) * S(0.5f)), a);
+  S z = s * s;
+  S p = S(4.2163199048e-2f);
+  p = p * z + S(2.4181311049e-2f);
+  p = p * z + S(4.5470025998e-2f);
+  p = p * z + S(7.4953002686e-2f);
+  p = p * z + S(1.6666752422e-1f);
+  p = p * z * s + s;
+  S r = select(large, p + p, S(1.57079632679489662f) - p);
+  return select(x < S(0.0f), S(3.14159265358979324f) - r, r);
+}
+
+// float64 lanes, with TC_USE_DOUBLE in particular
+TC_FORCE_INLINE float64 exp(float64 x) {
+  return std::exp(x);
+}
+
+TC_FORCE_INLINE float64 log(float64 x) {
+  return std::log(x);
+}
+
+TC_FORCE_INLINE float64 pow(float64 x, float64 y) {
+  return std::pow(x, y);
+}
+
+TC_FORCE_INLINE void sincos(float64 x, float64 &s, float64 &c) {
+  s = std::sin(x);
+  c = std::cos(x);
+}
+
+TC_FORCE_INLINE float64 atan2(float64 y, float64 x) {
+  return std::atan2(y, x);
+}
+
+TC_FORCE_INLINE float64 acos(float64 x) {
+  return std::acos(x);
+}
+
+#define TC_FAST_MATH_FLOAT64_PACK(name, expr)                         \
+  template <int width>                                                \
+  TC_FORCE_INLINE ScalarPack<float64, width> name(                    \
+      const ScalarPack<float64, width> &x_,                           \
+      const ScalarPack<float64, width> &y_ = 0) {                     \
+    float64 x[width], y[width];                                       \
+    x_.store(x);                                                      \
+    y_.store(y);                                                      \
+    for (int i = 0; i < width; i++) {                                 \
+      x[i] = expr;                                                    \
+    }                                                                 \
+    return ScalarPack<float64, width>::load(x);                       \
+  }
+TC_FAST_MATH_FLOAT64_PACK(exp, std::exp(x[i]))
+TC_FAST_MATH_FLOAT64_PACK(log, std::log(x[i]))
+TC_FAST_MATH_FLOAT64_PACK(pow, std::pow(x[i], y[i]))
+TC_FAST_MATH_FLOAT64_PACK(atan2, std::atan2(x[i], y[i]))
+TC_FAST_MATH_FLOAT64_PACK(acos, std::acos(x[i]))
+#undef TC_FAST_MATH_FLOAT64_PACK
+
+template <int width>
+TC_FORCE_INLINE void sincos(const ScalarPack<float64, width> &x,
+                            ScalarPack<float64, width> &s,
+                            ScalarPack<float64, width> &c) {
+  float64 d[width], sd[width], cd[width];
+  x.store(d);
+  for (int i = 0; i < width; i++) {
+    sd[i] = std::sin(d[i]);
+    cd[i] = std::cos(d[i]);
+  }
+  s = ScalarPack<float64, width>::load(sd);
+  c = ScalarPack<float64, width>::load(cd);
+}
+
+}  // namespace fast_math
+
+TC_NAMESPACE_END
@@ -0,0 +1,211 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#include "fft.h"
+
+#include <cmath>
+
+TC_NAMESPACE_BEGIN
+
+namespace {
+
+const float64 two_pi = 6.283185307179586476925286766559;
+
+bool is_power_of_two(int n) {
+  return (n & (n - 1)) == 0;
+}
+
+// Without the NaN recovery of operator*, which is a library call
+inline FFT::Complex multiply(const FFT::Complex &a, const FFT::Complex &b) {
+  return FFT::Complex(a.real() * b.real() - a.imag() * b.imag(),
+                      a.real() * b.imag() + a.imag() * b.real());
+}
+
+}  // namespace
+
+FFT::FFT(int n) : n(n) {
+  TC_ERROR_IF(n <= 0, "FFT length must be positive instead of {}", n);
+  m = n;
+  if (!is_power_of_two(n)) {
+    m = 1;
+    while (m < 2 * n - 1) {
+      m *= 2;
+    }
+  }
+  bit_reversal.resize(m);
+  for (int i = 1, j = 0; i < m; i++) {
+    int bit = m >> 1;
+    for (; j & bit; bit >>= 1) {
+      j ^= bit;
+    }
+    j ^= bit;
+    bit_reversal[i] = j;
+  }
+  twiddles.resize(m / 2);
+  for (int k = 0; k < m / 2; k++) {
+    twiddles[k] = std::polar(1.0, -two_pi * k / m);
+  }
+  if (m == n) {
+    return;
+  }
+  // X[k] = chirp[k] sum_j (x[j] chirp[j]) conj(chirp[k - j]), from
+  // 2 j k = j^2 + k^2 - (k - j)^2: a convolution with conj(chirp), wrapped
+  // to length m
+  chirp.resize(n);
+  for (int k = 0; k < n; k++) {
+    // Reduced exactly, for the precision of large k
+    int64 k2 = (int64)k * k % (2 * (int64)n);
+    chirp[k] = std::polar(1.0, -0.5 * two_pi * k2 / n);
+  }
+  chirp_spectrum.assign(m, Complex(0));
+  chirp_spectrum[0] = std::conj(chirp[0]);
+  for (int k = 1; k < n; k++) {
+    chirp_spectrum[k] = chirp_spectrum[m - k] = std::conj(chirp[k]);
+  }
+  radix2(chirp_spectrum.data(), false);
+  for (auto &c : chirp_spectrum) {
+    c /= (float64)m;
+  }
+}
+
+void FFT::radix2(Complex *data, bool inverse) const {
+  for (int i = 0; i < m; i++) {
+    int j = bit_reversal[i];
+    if (i < j) {
+      std::swap(data[i], data[j]);
+    }
+  }
+  // The inverse with conjugate twiddles
+  const float64 sign = inverse ? -1 : 1;
+  for (int len = 2; len <= m; len *= 2) {
+    int half = len / 2, step = m / len;
+    for (int k = 0; k < half; k++) {
+      const Complex &t = twiddles[k * step];
+      Complex w(t.real(), sign * t.imag());
+      for (int i = k; i < m; i += len) {
+        Complex u = data[i], v = multiply(data[i + half], w);
+        data[i] = u + v;
+        data[i + half] = u - v;
+      }
+    }
+  }
+}
+
+void FFT::transform(Complex *data, bool inverse, Complex *work) const {
+  if (m == n) {
+    radix2(data, inverse);
+    return;
+  }
+  // The inverse as conj(forward(conj(x)))
+  for (int k = 0; k < n; k++) {
+    Complex x = inverse ? std::conj(data[k]) : data[k];
+    work[k] = multiply(x, chirp[k]);
+  }
+  std::fill(work + n, work + m, Complex(0));
+  radix2(work, false);
+  for (int k = 0; k < m; k++) {
+    work[k] = multiply(work[k], chirp_spectrum[k]);
+  }
+  radix2(work, true);
+  for (int k = 0; k < n; k++) {
+    Complex x = multiply(work[k], chirp[k]);
+    data[k] = inverse ? std::conj(x) : x;
+  }
+}
+
+TrigonometricTransform::TrigonometricTransform(int n, Type type)
+    : n(n), type(type), fft(type == DCT ? n : 2 * n + 2) {
+  if (type == DCT) {
+    shift.resize(n);
+    for (int k = 0; k < n; k++) {
+      shift[k] = std::polar(1.0, -0.25 * two_pi * k / n);
+    }
+  }
+}
+
+float64 TrigonometricTransform::get_eigenvalue(int k) const {
+  float64 frequency = type == DCT ? 0.5 * two_pi * k / n
+                                  : 0.5 * two_pi * (k + 1) / (n + 1);
+  return 2 - 2 * std::cos(frequency);
+}
+
+// The DCT as the real part of the DFT V of the permuted samples v, shifted
+// by a quarter sample, where V[k] and V[n - k] of the two real lines are
+// separated by their symmetry; the DST as the DFT of the odd extension of
+// the samples, imaginary for real lines.
+void TrigonometricTransform::forward(float64 *x,
+                                     float64 *y,
+                                     std::vector<FFT::Complex> &work) const {
+  using Complex = FFT::Complex;
+  int length = fft.get_length();
+  work.resize(length + fft.get_work_size());
+  Complex *s = work.data();
+  std::fill(s, s + length, Complex(0));
+  for (int j = 0; j < n; j++) {
+    Complex c(x[j], y ? y[j] : 0);
+    if (type == DCT) {
+      s[get_permuted(j)] = c;
+    } else {
+      s[j + 1] = c;
+      s[length - 1 - j] = -c;
+    }
+  }
+  fft.transform(s, false, s + length);
+  if (type == DST) {
+    for (int k = 0; k < n; k++) {
+      x[k] = -0.5 * s[k + 1].imag();
+      if (y) {
+        y[k] = 0.5 * s[k + 1].real();
+      }
+    }
+    return;
+  }
+  for (int k = 0; k < n; k++) {
+    Complex z = s[k], z_mirror = std::conj(s[(n - k) % n]);
+    Complex sum = z + z_mirror, difference = z - z_mirror;
+    x[k] = multiply(shift[k], 0.5 * sum).real();
+    if (y) {
+      // (z - conj(z[n - k])) / 2i
+      Complex v(0.5 * difference.imag(), -0.5 * difference.real());
+      y[k] = multiply(shift[k], v).real();
+    }
+  }
+}
+
+void TrigonometricTransform::inverse(float64 *x,
+                                     float64 *y,
+                                     std::vector<FFT::Complex> &work) const {
+  using Complex = FFT::Complex;
+  if (type == DST) {
+    // DST-I is its own inverse, up to (n + 1) / 2
+    forward(x, y, work);
+    for (int j = 0; j < n; j++) {
+      x[j] *= 2.0 / (n + 1);
+      if (y) {
+        y[j] *= 2.0 / (n + 1);
+      }
+    }
+    return;
+  }
+  // V[k] = conj(shift[k]) (X[k] - i X[n - k]), with X[n] = 0
+  work.resize(n + fft.get_work_size());
+  Complex *s = work.data();
+  for (int k = 0; k < n; k++) {
+    Complex vx(x[k], k == 0 ? 0 : -x[n - k]);
+    Complex vy = y ? Complex(y[k], k == 0 ? 0 : -y[n - k]) : Complex(0);
+    s[k] = multiply(std::conj(shift[k]), vx + Complex(-vy.imag(), vy.real())) /
+           (float64)n;
+  }
+  fft.transform(s, true, s + n);
+  for (int j = 0; j < n; j++) {
+    Complex v = s[get_permuted(j)];
+    x[j] = v.real();
+    if (y) {
+      y[j] = v.imag();
+    }
+  }
+}
+
+TC_NAMESPACE_END
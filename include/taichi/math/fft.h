@@ -0,0 +1,90 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+#include <taichi/common/util.h>
+
+#include <complex>
+#include <vector>
+
+TC_NAMESPACE_BEGIN
+
+// Plan of the discrete Fourier transform of length n,
+//   X[k] = sum_j x[j] exp(-2 pi i j k / n),
+// and of its inverse, without the 1 / n. Powers of two run radix-2, other
+// lengths as a convolution of power-of-two length [Bluestein 1970], so that
+// all lengths are O(n log n). Plans are immutable and can be shared by
+// threads, each with its own |work|.
+class FFT {
+ public:
+  using Complex = std::complex<float64>;
+
+  FFT(int n = 1);
+
+  int get_length() const {
+    return n;
+  }
+
+  // Complex numbers of |work| that transform() needs
+  int get_work_size() const {
+    return m == n ? 0 : m;
+  }
+
+  // In place on data[0..n)
+  void transform(Complex *data, bool inverse, Complex *work) const;
+
+ private:
+  int n;
+  int m;  // Length of the radix-2 transforms, n unless Bluestein
+  std::vector<int> bit_reversal;
+  std::vector<Complex> twiddles;  // exp(-2 pi i k / m), k < m / 2
+  std::vector<Complex> chirp;     // exp(-pi i k^2 / n), k < n
+  std::vector<Complex> chirp_spectrum;
+
+  void radix2(Complex *data, bool inverse) const;
+};
+
+// Real trigonometric transforms of length n, the eigenbases of the 1D
+// Laplacian of cell-centered samples [Strang 1999]:
+//   DCT (DCT-II) X[k] = sum_j x[j] cos(pi k (j + 1/2) / n),
+//     with a Neumann wall on either side, eigenvalues 2 - 2 cos(pi k / n);
+//   DST (DST-I)  X[k] = sum_j x[j] sin(pi (k + 1) (j + 1) / (n + 1)),
+//     with zero samples beyond either side, eigenvalues
+//     2 - 2 cos(pi (k + 1) / (n + 1)).
+// inverse() undoes forward() exactly (DCT-III and the scaled DST-I). Real
+// lines are transformed in pairs, as the real and imaginary parts of one
+// complex FFT: of length n for the DCT [Makhoul 1980], 2n + 2 for the DST.
+class TrigonometricTransform {
+ public:
+  enum Type { DCT, DST };
+
+  TrigonometricTransform(int n = 1, Type type = DCT);
+
+  int get_length() const {
+    return n;
+  }
+
+  // Of the Laplacian stencil (-1, 2, -1) in mode k
+  float64 get_eigenvalue(int k) const;
+
+  // In place on the lines x[0..n) and y[0..n); |y| may be null
+  void forward(float64 *x, float64 *y, std::vector<FFT::Complex> &work) const;
+
+  void inverse(float64 *x, float64 *y, std::vector<FFT::Complex> &work) const;
+
+ private:
+  int n;
+  Type type;
+  FFT fft;
+  std::vector<FFT::Complex> shift;  // exp(-pi i k / (2 n)), for the DCT
+
+  // The DCT reorders the samples: even ones first, then the odd reversed
+  int get_permuted(int j) const {
+    return j % 2 == 0 ? j / 2 : n - 1 - j / 2;
+  }
+};
+
+TC_NAMESPACE_END
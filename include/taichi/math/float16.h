@@ -0,0 +1,143 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+#include <taichi/common/util.h>
+
+#include <cmath>
+#include <cstring>
+#include <string>
+#if defined(__F16C__)
+#include <immintrin.h>
+#endif
+
+TC_NAMESPACE_BEGIN
+
+// Compact storage of the values of large assets (texture pyramids, voxel
+// grids): IEEE half precision, through F16C where the target has it,
+// bfloat16 (the upper half of a float32), and 8-bit sRGB for LDR colors.
+// Conversions to storage round to nearest, ties to even.
+enum class StorageFormat { full, float16, bfloat16, srgb8 };
+
+// "full" (real), "float16", "bfloat16" or "srgb8"
+inline StorageFormat get_storage_format(const std::string &name) {
+  if (name == "full") {
+    return StorageFormat::full;
+  } else if (name == "float16") {
+    return StorageFormat::float16;
+  } else if (name == "bfloat16") {
+    return StorageFormat::bfloat16;
+  } else if (name == "srgb8") {
+    return StorageFormat::srgb8;
+  }
+  TC_ERROR("Unknown storage format " + name +
+           ", should be full, float16, bfloat16 or srgb8");
+  return StorageFormat::full;
+}
+
+inline uint32 float32_bits(float32 f) {
+  uint32 x;
+  std::memcpy(&x, &f, sizeof(x));
+  return x;
+}
+
+inline float32 bits_float32(uint32 x) {
+  float32 f;
+  std::memcpy(&f, &x, sizeof(f));
+  return f;
+}
+
+inline uint16 float32_to_float16(float32 f) {
+#if defined(__F16C__)
+  return (uint16)_cvtss_sh(f, _MM_FROUND_TO_NEAREST_INT);
+#else
+  uint32 x = float32_bits(f);
+  uint16 sign = (uint16)((x >> 16) & 0x8000);
+  x &= 0x7fffffff;
+  if (x >= 0x7f800000) {
+    // Infinity, or a quiet NaN
+    return sign | 0x7c00 | (x > 0x7f800000 ? 0x200 : 0);
+  }
+  if (x >= 0x477ff000) {
+    // Rounds past 65504
+    return sign | 0x7c00;
+  }
+  if (x < 0x38800000) {
+    // Subnormal: multiples of 2^-24, exact in float32 before rounding
+    return sign | (uint16)std::nearbyint(bits_float32(x) * 16777216.0f);
+  }
+  // Rebias the exponent from 127 to 15, and round the 13 dropped bits
+  x += 0xc8000fff + ((x >> 13) & 1);
+  return sign | (uint16)(x >> 13);
+#endif
+}
+
+inline float32 float16_to_float32(uint16 h) {
+#if defined(__F16C__)
+  return _cvtsh_ss(h);
+#else
+  uint32 sign = (uint32)(h & 0x8000) << 16;
+  uint32 exponent = (h >> 10) & 0x1f, mantissa = h & 0x3ff;
+  if (exponent == 0) {
+    float32 f = mantissa * (1.0f / 16777216.0f);
+    return sign ? -f : f;
+  }
+  if (exponent == 31) {
+    return bits_float32(sign | 0x7f800000 | (mantissa << 13));
+  }
+  return bits_float32(sign | ((exponent + 112) << 23) | (mantissa << 13));
+#endif
+}
+
+// Four consecutive values, as one vector conversion with F16C
+inline void float16_to_float32x4(const uint16 *h, float32 *out) {
+#if defined(__F16C__)
+  _mm_storeu_ps(out, _mm_cvtph_ps(_mm_loadl_epi64((const __m128i *)h)));
+#else
+  for (int i = 0; i < 4; i++) {
+    out[i] = float16_to_float32(h[i]);
+  }
+#endif
+}
+
+inline uint16 float32_to_bfloat16(float32 f) {
+  uint32 x = float32_bits(f);
+  if ((x & 0x7fffffff) > 0x7f800000) {
+    return (uint16)((x >> 16) | 0x40);
+  }
+  x += 0x7fff + ((x >> 16) & 1);
+  return (uint16)(x >> 16);
+}
+
+inline float32 bfloat16_to_float32(uint16 b) {
+  return bits_float32((uint32)b << 16);
+}
+
+// Of linear values in [0, 1], clamped
+inline uint8 linear_to_srgb8(float32 v) {
+  v = std::min(std::max(v, 0.0f), 1.0f);
+  float32 s = v <= 0.0031308f ? 12.92f * v
+                              : 1.055f * std::pow(v, 1 / 2.4f) - 0.055f;
+  return (uint8)(s * 255 + 0.5f);
+}
+
+inline float32 srgb8_to_linear(uint8 v) {
+  struct Table {
+    float32 values[256];
+
+    Table() {
+      for (int i = 0; i < 256; i++) {
+        float32 s = i / 255.0f;
+        values[i] = s <= 0.04045f ? s / 12.92f
+                                  : std::pow((s + 0.055f) / 1.055f, 2.4f);
+      }
+    }
+  };
+  static const Table table;
+  return table.values[v];
+}
+
+TC_NAMESPACE_END
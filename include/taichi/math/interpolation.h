@@ -7,6 +7,8 @@
 
 #include <taichi/common/util.h>
 
+#include <cmath>
+
 TC_NAMESPACE_BEGIN
 
 inline float catmull_rom(float f_m_1,
@@ -28,4 +30,28 @@ inline float catmull_rom(float *pf_m_1, float x_r) {
   return catmull_rom(*pf_m_1, *(pf_m_1 + 1), *(pf_m_1 + 2), *(pf_m_1 + 3), x_r);
 }
 
+// Cubic Hermite interpolation between f_0 and f_1, at x_r in [0, 1], with
+// the central differences as slopes, limited as by Fritsch and Carlson
+// (1980): zero at extrema and at most three times the secant, so that the
+// curve is monotonic and stays between f_0 and f_1
+template <typename T>
+TC_FORCE_INLINE T monotonic_cubic(T f_m_1, T f_0, T f_1, T f_2, real x_r) {
+  T t = x_r;
+  T s = f_1 - f_0;
+  T s_0 = (f_1 - f_m_1) * T(0.5);
+  T s_1 = (f_2 - f_0) * T(0.5);
+  if (s_0 * s <= 0) {
+    s_0 = 0;
+  } else if (std::abs(s_0) > 3 * std::abs(s)) {
+    s_0 = 3 * s;
+  }
+  if (s_1 * s <= 0) {
+    s_1 = 0;
+  } else if (std::abs(s_1) > 3 * std::abs(s)) {
+    s_1 = 3 * s;
+  }
+  return f_0 +
+         t * (s_0 + t * ((3 * s - 2 * s_0 - s_1) + t * (s_0 + s_1 - 2 * s)));
+}
+
 TC_NAMESPACE_END
@@ -4,6 +4,11 @@
 *******************************************************************************/
 
 #include "levelset.h"
+#include <taichi/system/threading.h>
+
+#include <algorithm>
+#include <functional>
+#include <queue>
 
 TC_NAMESPACE_BEGIN
 
@@ -11,6 +16,7 @@ template <int DIM>
 void LevelSet<DIM>::add_sphere(typename LevelSet<DIM>::Vector center,
                                real radius,
                                bool inside_out) {
+  invalidate_narrow_band();
   for (auto &ind : this->get_region()) {
     Vector sample = ind.get_pos();
     real dist = (inside_out ? -1 : 1) * (length(center - sample) - radius);
@@ -20,6 +26,7 @@ void LevelSet<DIM>::add_sphere(typename LevelSet<DIM>::Vector center,
 
 template <>
 void LevelSet<2>::add_polygon(std::vector<Vector2> polygon, bool inside_out) {
+  invalidate_narrow_band();
   for (auto &ind : this->get_region()) {
     Vector2 p = ind.get_pos();
     real dist = ((inside_polygon(p, polygon) ^ inside_out) ? -1 : 1) *
@@ -159,6 +166,7 @@ Array3D<real> LevelSet<3>::rasterize(Vector3i output_res) {
 template <int DIM>
 void LevelSet<DIM>::add_plane(const typename LevelSet<DIM>::Vector &normal_,
                               real d) {
+  invalidate_narrow_band();
   Vector normal = normalized(normal_);
   real coeff = 1.0_f / length(normal);
   for (auto &ind : this->get_region()) {
@@ -179,6 +187,7 @@ template <>
 void LevelSet<3>::add_cuboid(Vector3 lower_boundry,
                              Vector3 upper_boundry,
                              bool inside_out) {
+  invalidate_narrow_band();
   for (auto &ind : this->get_region()) {
     Vector3 sample = ind.get_pos();
     Vector3 b = (upper_boundry - lower_boundry) * 0.5_f;
@@ -195,6 +204,7 @@ void LevelSet<3>::add_cuboid(Vector3 lower_boundry,
 
 template <int DIM>
 void LevelSet<DIM>::add_slope(const Vector &center, real radius, real angle) {
+  invalidate_narrow_band();
   TC_ASSERT_INFO(0 <= radius, "Radius should be non-negative");
   TC_ASSERT_INFO(0 <= angle && angle <= pi, "Angle should be in [0, PI]");
   for (auto &ind : this->get_region()) {
@@ -224,6 +234,7 @@ void LevelSet<DIM>::add_slope(const Vector &center, real radius, real angle) {
 
 template <>
 void LevelSet<3>::add_cylinder(const Vector &center, real radius, bool inside_out) {
+  invalidate_narrow_band();
   for (auto &ind : this->get_region()) {
     Vector sample = ind.get_pos();
     real dist;
@@ -235,11 +246,154 @@ void LevelSet<3>::add_cylinder(const Vector &center, real radius, bool inside_ou
 
 template <int DIM>
 void LevelSet<DIM>::global_increase(real delta) {
+  invalidate_narrow_band();
   for (auto &ind : this->get_region()) {
     this->set(ind, Array::get(ind) + delta);
   }
 }
 
+template <int DIM>
+void LevelSet<DIM>::redistance(real band) {
+  auto &phi = this->data;
+  const int size = (int)phi.size();
+  int stride[DIM];
+  stride[DIM - 1] = 1;
+  for (int d = DIM - 2; d >= 0; d--) {
+    stride[d] = stride[d + 1] * this->res[d + 1];
+  }
+  if ((int)marks.size() != size) {
+    marks.assign(size, FAR);
+    narrow_band_valid = false;
+  }
+  std::vector<int> candidates;
+  if (narrow_band_valid) {
+    candidates.swap(narrow_band);
+  } else {
+    candidates.resize(size);
+    for (int c = 0; c < size; c++) {
+      candidates[c] = c;
+    }
+  }
+  narrow_band.clear();
+  // Calls |f(axis, n)| for the grid neighbours n of cell c
+  auto for_each_neighbour = [&](int c, const auto &f) {
+    for (int d = 0; d < DIM; d++) {
+      int x = c / stride[d] % this->res[d];
+      if (x > 0) {
+        f(d, c - stride[d]);
+      }
+      if (x < this->res[d] - 1) {
+        f(d, c + stride[d]);
+      }
+    }
+  };
+
+  // Cells next to a crossing get the distance to the plane through the
+  // crossings nearest along each axis
+  std::vector<std::pair<int, real>> seeds;
+  for (int c : candidates) {
+    real p = phi[c];
+    real nearest[DIM];
+    std::fill(nearest, nearest + DIM, INF);
+    for_each_neighbour(c, [&](int d, int n) {
+      real q = phi[n];
+      if ((p < 0) != (q < 0)) {
+        nearest[d] = std::min(nearest[d], p / (p - q));
+      }
+    });
+    real inv_dist2 = 0;
+    bool crossing = false, on_crossing = false;
+    for (int d = 0; d < DIM; d++) {
+      if (nearest[d] < INF) {
+        crossing = true;
+        on_crossing = on_crossing || nearest[d] == 0;
+        inv_dist2 += 1.0_f / sqr(nearest[d]);
+      }
+    }
+    if (crossing) {
+      seeds.push_back(std::make_pair(
+          c, on_crossing ? 0.0_f : 1.0_f / std::sqrt(inv_dist2)));
+    }
+  }
+  for (auto &seed : seeds) {
+    real dist = std::min(seed.second, band);
+    phi[seed.first] = phi[seed.first] < 0 ? -dist : dist;
+    marks[seed.first] = ACCEPTED;
+    narrow_band.push_back(seed.first);
+  }
+
+  // March outwards in order of distance, with the first-order upwind
+  // solution of |grad phi| = 1 from the accepted neighbours
+  using Entry = std::pair<real, int>;
+  std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry>> heap;
+  std::vector<int> tentative;
+  auto update = [&](int c) {
+    if (marks[c] == ACCEPTED) {
+      return;
+    }
+    if (marks[c] == FAR) {
+      marks[c] = TENTATIVE;
+      tentative.push_back(c);
+      phi[c] = phi[c] < 0 ? -INF : INF;
+    }
+    real a[DIM];
+    std::fill(a, a + DIM, INF);
+    for_each_neighbour(c, [&](int d, int n) {
+      if (marks[n] == ACCEPTED) {
+        a[d] = std::min(a[d], std::abs(phi[n]));
+      }
+    });
+    std::sort(a, a + DIM);
+    real dist = a[0] + 1, sum = a[0], sum2 = sqr(a[0]);
+    // Solve sum_i (dist - a[i])^2 = 1 over the k + 1 smallest a[i]
+    for (int k = 1; k < DIM && dist > a[k]; k++) {
+      sum += a[k];
+      sum2 += sqr(a[k]);
+      real discriminant = sqr(sum) - (k + 1) * (sum2 - 1);
+      dist = (sum + std::sqrt(std::max(discriminant, 0.0_f))) / (k + 1);
+    }
+    if (dist < std::abs(phi[c])) {
+      phi[c] = phi[c] < 0 ? -dist : dist;
+      heap.push(Entry(dist, c));
+    }
+  };
+  for (auto &seed : seeds) {
+    for_each_neighbour(seed.first, [&](int d, int n) { update(n); });
+  }
+  while (!heap.empty()) {
+    Entry top = heap.top();
+    heap.pop();
+    int c = top.second;
+    if (marks[c] == ACCEPTED) {
+      continue;
+    }
+    if (top.first >= band) {
+      break;
+    }
+    marks[c] = ACCEPTED;
+    narrow_band.push_back(c);
+    for_each_neighbour(c, [&](int d, int n) { update(n); });
+  }
+
+  // Clamp what is left of the previous band and the front, and leave all
+  // the marks FAR
+  for (int c : candidates) {
+    if (marks[c] != ACCEPTED) {
+      phi[c] = phi[c] < 0 ? -band : band;
+    }
+  }
+  for (int c : tentative) {
+    if (marks[c] != ACCEPTED) {
+      phi[c] = phi[c] < 0 ? -band : band;
+    }
+    marks[c] = FAR;
+  }
+  for (int c : narrow_band) {
+    marks[c] = FAR;
+  }
+  narrow_band_valid = true;
+}
+
 template <>
 Vector3 LevelSet<3>::get_gradient(const Vector3 &pos) const {
   assert_info(inside(pos),
@@ -303,12 +457,48 @@ void DynamicLevelSet<DIM>::initialize(real _t0,
   t1 = _t1;
   levelset0 = std::make_shared<LevelSet<DIM>>(_ls0);
   levelset1 = std::make_shared<LevelSet<DIM>>(_ls1);
+  blended_valid = false;
+  varying_cells.clear();
+  if (_ls0.get_res() != _ls1.get_res() ||
+      _ls0.get_storage_offset() != _ls1.get_storage_offset()) {
+    blended = LevelSet<DIM>();
+    return;
+  }
+  blended = _ls0;
+  int size = (int)_ls0.get_size();
+  varying_cells.resize(size);
+  int num_varying = ThreadedTaskManager::compact(
+      0, size, -1, [&](int i) { return _ls0.data[i] != _ls1.data[i]; },
+      [&](int i, int j) { varying_cells[j] = i; });
+  varying_cells.resize(num_varying);
+}
+
+template <int DIM>
+void DynamicLevelSet<DIM>::update(real t, int num_threads) {
+  if (!levelset0 || blended.get_res() != levelset0->get_res()) {
+    return;
+  }
+  if (!(blended_valid && t == blended_t)) {
+    real alpha = (t - t0) / (t1 - t0);
+    const LevelSet<DIM> &ls0 = *levelset0, &ls1 = *levelset1;
+    ThreadedTaskManager::run(
+        (int)varying_cells.size(), num_threads, [&](int k) {
+          int i = varying_cells[k];
+          blended.data[i] = lerp(alpha, ls0.data[i], ls1.data[i]);
+        });
+    blended_t = t;
+    blended_valid = true;
+    TC_STAT("dynamic_levelset_blended_cells", varying_cells.size());
+  }
 }
 
 template <>
 DynamicLevelSet<2>::Vector DynamicLevelSet<2>::get_spatial_gradient(
     const DynamicLevelSet<2>::Vector &pos,
     real t) const {
+  if (auto ls = get_blended(t)) {
+    return ls->get_normalized_gradient(pos);
+  }
   Vector2 gxy0 = levelset0->get_gradient(pos);
   Vector2 gxy1 = levelset1->get_gradient(pos);
   real gx = lerp((t - t0) / (t1 - t0), gxy0.x, gxy1.x);
@@ -324,6 +514,9 @@ template <>
 DynamicLevelSet<3>::Vector DynamicLevelSet<3>::get_spatial_gradient(
     const DynamicLevelSet<3>::Vector &pos,
     real t) const {
+  if (auto ls = get_blended(t)) {
+    return ls->get_normalized_gradient(pos);
+  }
   Vector3 gxyz0 = levelset0->get_gradient(pos);
   Vector3 gxyz1 = levelset1->get_gradient(pos);
   real gx = lerp((t - t0) / (t1 - t0), gxyz0.x, gxyz1.x);
@@ -349,6 +542,9 @@ template <int DIM>
 real DynamicLevelSet<DIM>::sample(
     const typename DynamicLevelSet<DIM>::Vector &pos,
     real t) const {
+  if (auto ls = get_blended(t)) {
+    return ls->get(pos);
+  }
   real l1 = levelset0->get(pos);
   real l2 = levelset1->get(pos);
   return lerp((t - t0) / (t1 - t0), l1, l2);
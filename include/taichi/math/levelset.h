@@ -6,6 +6,7 @@
 #pragma once
 
 #include <memory>
+#include <vector>
 #include <taichi/common/util.h>
 #include "array.h"
 #include "math.h"
@@ -35,6 +36,28 @@ class LevelSet : public ArrayND<DIM, real> {
                   Vector offset = Vector(0.5f),
                   real value = INF) {
     Array::initialize(res, value, offset);
+    invalidate_narrow_band();
+  }
+
+  // Signed distance (in cells) within |band| cells of the zero crossings,
+  // by fast marching from the crossings, and -+band elsewhere; signs are
+  // kept. The cells within the band are indexed, and the next call only
+  // looks for crossings among them, in O(band) rather than O(domain), which
+  // holds as long as the interface moves by less than band - 1 cells in
+  // between. Call invalidate_narrow_band() after other changes.
+  void redistance(real band);
+
+  void invalidate_narrow_band() {
+    narrow_band_valid = false;
+  }
+
+  bool has_narrow_band() const {
+    return narrow_band_valid;
+  }
+
+  // Linear indices of the cells with |phi| < band after redistance()
+  const std::vector<int> &get_narrow_band() const {
+    return narrow_band;
   }
 
   // 2D
@@ -79,11 +102,19 @@ class LevelSet : public ArrayND<DIM, real> {
   static real fraction_outside(real phi_a, real phi_b) {
     return 1.0_f - fraction_inside(phi_a, phi_b);
   }
+
+ private:
+  bool narrow_band_valid = false;
+  std::vector<int> narrow_band;
+  // Fast marching state of every cell, all FAR in between redistance()
+  enum : uint8 { FAR, TENTATIVE, ACCEPTED };
+  std::vector<uint8> marks;
 };
 
 typedef LevelSet<2> LevelSet2D;
 typedef LevelSet<3> LevelSet3D;
 
+// Linear in time between levelset0 at t0 and levelset1 at t1
 template <int DIM>
 class DynamicLevelSet {
  public:
@@ -106,6 +137,15 @@ class DynamicLevelSet {
                   const LevelSet<DIM> &_ls0,
                   const LevelSet<DIM> &_ls1);
 
+  // Blends the two level sets at time |t| into one, in parallel, for the
+  // queries at |t| until the next update(): sample() and
+  // get_spatial_gradient() then read one level set instead of two. Only
+  // the cells where levelset0 and levelset1 differ are blended, e.g. the
+  // narrow bands of redistanced ones; the others were copied once by
+  // initialize(). Call before, not during, parallel queries (once per
+  // substep). Level sets of different shapes are not cached.
+  void update(real t, int num_threads = -1);
+
   // returns gradient (normalized)
   Vector get_spatial_gradient(const Vector &pos, real t) const;
 
@@ -114,6 +154,19 @@ class DynamicLevelSet {
   real sample(const Vector &pos, real t) const;
 
   ArrayND<DIM, real> rasterize(Vectori res, real t);
+
+ private:
+  // Of the last update(), if any
+  bool blended_valid = false;
+  real blended_t;
+  LevelSet<DIM> blended;
+  // Linear indices of the cells where the two level sets differ
+  std::vector<int> varying_cells;
+
+  // The level set to read at |t|, or null for blending the two
+  const LevelSet<DIM> *get_blended(real t) const {
+    return blended_valid && t == blended_t ? &blended : nullptr;
+  }
 };
 
 typedef DynamicLevelSet<2> DynamicLevelSet2D;
@@ -864,6 +864,14 @@ using Vector2i = VectorND<2, int, default_instruction_set>;
 using Vector3i = VectorND<3, int, default_instruction_set>;
 using Vector4i = VectorND<4, int, default_instruction_set>;
 
+// Serialized as |d|, which spans the whole vector (SIMD padding included)
+template <int dim, typename T, InstSetExt ISE>
+struct is_bytewise_serializable<VectorND<dim, T, ISE>>
+    : std::integral_constant<bool,
+                             is_bytewise_serializable<T>::value &&
+                                 sizeof(VectorND<dim, T, ISE>) ==
+                                     sizeof(VectorND<dim, T, ISE>::d)> {};
+
 // FMA: a * b + c
 template <typename T>
 TC_FORCE_INLINE typename std::
@@ -129,6 +129,37 @@ TC_FORCE_INLINE int rand<int>() noexcept {
   return rand_int();
 }
 
+// PCG32 (O'Neill, "PCG: A Family of Simple Fast Space-Efficient
+// Statistically Good Algorithms for Random Number Generation"). Unlike
+// rand(), instances are independent, so each thread or Markov chain can own
+// one; different |stream|s give uncorrelated sequences for the same seed.
+class PCG32 {
+ public:
+  PCG32(uint64 seed = 0, uint64 stream = 0) {
+    state = 0;
+    inc = (stream << 1u) | 1u;
+    next_uint();
+    state += seed;
+    next_uint();
+  }
+
+  TC_FORCE_INLINE uint32 next_uint() noexcept {
+    uint64 old = state;
+    state = old * 6364136223846793005ull + inc;
+    uint32 xorshifted = uint32(((old >> 18u) ^ old) >> 27u);
+    uint32 rot = uint32(old >> 59u);
+    return (xorshifted >> rot) | (xorshifted << ((~rot + 1u) & 31));
+  }
+
+  // Uniform in [0, 1)
+  TC_FORCE_INLINE real next() noexcept {
+    return (next_uint() >> 8) * real(1.0 / 16777216.0);
+  }
+
+ private:
+  uint64 state, inc;
+};
+
 inline int is_prime(int a) noexcept {
   assert(a >= 2);
   for (int i = 2; i * i <= a; i++) {
@@ -0,0 +1,120 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#include "sdf.h"
+#include <taichi/system/threading.h>
+
+TC_NAMESPACE_BEGIN
+
+void SDFEmptySpaceGrid::initialize(const SDF &sdf,
+                                   const Vector3 &lower,
+                                   const Vector3 &upper,
+                                   int resolution,
+                                   real eps,
+                                   int num_threads) {
+  TC_ERROR_IF(resolution <= 0, "SDF grid resolution must be positive");
+  Vector3 extent = upper - lower;
+  TC_ERROR_IF(!(extent.min() > 0), "Empty SDF grid bounds");
+  this->lower = lower;
+  cell_size = extent.max() / resolution;
+  inv_cell_size = 1.0_f / cell_size;
+  for (int k = 0; k < 3; k++) {
+    res[k] = std::max(1, (int)std::ceil(extent[k] * inv_cell_size));
+  }
+  this->eps = eps;
+  bounds.assign((std::size_t)res.x * res.y * res.z, 0);
+  const real half_diagonal = std::sqrt(3.0_f) * 0.5_f * cell_size;
+  ThreadedTaskManager::run(res.x, num_threads, [&](int i) {
+    for (int j = 0; j < res.y; j++) {
+      for (int k = 0; k < res.z; k++) {
+        Vector3 center =
+            lower + cell_size * Vector3(i + 0.5_f, j + 0.5_f, k + 0.5_f);
+        bounds[((std::size_t)i * res.y + j) * res.z + k] =
+            (float32)(sdf.eval(center) - half_diagonal);
+      }
+    }
+  });
+}
+
+real SDFEmptySpaceGrid::get_skip_distance(const Vector3 &p,
+                                          const Vector3 &dir,
+                                          real &bound) const {
+  Vector3 local = (p - lower) * inv_cell_size;
+  int index[3];
+  for (int k = 0; k < 3; k++) {
+    // Also for NaNs
+    if (!(local[k] >= 0 && local[k] < res[k])) {
+      return 0;
+    }
+    index[k] = std::min((int)local[k], res[k] - 1);
+  }
+  bound = bounds[((std::size_t)index[0] * res.y + index[1]) * res.z + index[2]];
+  if (!(bound > eps)) {
+    return 0;
+  }
+  real t = std::numeric_limits<real>::max();
+  for (int k = 0; k < 3; k++) {
+    if (dir[k] > 0) {
+      t = std::min(t, (index[k] + 1 - local[k]) * cell_size / dir[k]);
+    } else if (dir[k] < 0) {
+      t = std::min(t, (index[k] - local[k]) * cell_size / dir[k]);
+    }
+  }
+  // Into the next cell
+  return t + 1e-4_f * cell_size;
+}
+
+int SDFEmptySpaceGrid::get_num_empty_cells() const {
+  int count = 0;
+  for (auto bound : bounds) {
+    count += bound > eps;
+  }
+  return count;
+}
+
+real SphereTracer::march(const Vector3 &orig,
+                         const Vector3 &dir,
+                         real limit) const {
+  real t = 0, step = 0, last_radius = 0, relaxation = omega;
+  for (int i = 0; i < max_steps; i++) {
+    const Vector3 p = orig + t * dir;
+    real bound;
+    if (grid != nullptr) {
+      real skip = grid->get_skip_distance(p, dir, bound);
+      // After a relaxed step, only if the bound shows the spheres overlap
+      if (skip > 0 && (relaxation <= 1 || bound + last_radius >= step)) {
+        t += skip;
+        if (t > limit) {
+          break;
+        }
+        // The spheres before do not overlap the ones after
+        step = last_radius = 0;
+        relaxation = omega;
+        continue;
+      }
+    }
+    real d = sdf->eval(p);
+    real radius = std::abs(d);
+    bool overshot = relaxation > 1 && radius + last_radius < step;
+    if (overshot) {
+      // Back into the sphere of the last step, without relaxation
+      step -= relaxation * step;
+      relaxation = 1;
+    } else {
+      if (d < std::max(eps, cone * t)) {
+        break;
+      }
+      step = d * relaxation;
+    }
+    last_radius = radius;
+    t += step;
+    if (t > limit) {
+      break;
+    }
+  }
+  return t;
+}
+
+TC_NAMESPACE_END
@@ -7,6 +7,7 @@
 
 #include <taichi/common/interface.h>
 #include "math.h"
+#include <vector>
 
 TC_NAMESPACE_BEGIN
 
@@ -72,4 +73,75 @@ inline real cut(real a, real b) {
 
 TC_INTERFACE(SDF);
 
+// The normal of the surface of |sdf| at |p|, by central differences of step
+// |h| along the vertices of a tetrahedron (4 evaluations instead of 6)
+inline Vector3 get_sdf_normal(const SDF &sdf, const Vector3 &p, real h) {
+  const Vector3 k[4] = {Vector3(1, -1, -1), Vector3(-1, -1, 1),
+                        Vector3(-1, 1, -1), Vector3(1, 1, 1)};
+  Vector3 n(0);
+  for (int i = 0; i < 4; i++) {
+    n += k[i] * sdf.eval(p + h * k[i]);
+  }
+  if (dot(n, n) < 1e-20f) {
+    return Vector3(1, 0, 0);
+  }
+  return normalized(n);
+}
+
+// Empty-space skipping for sphere tracing. The cells of a grid over
+// [lower, upper] that no surface of an SDF can reach, i.e. where its
+// distance at the center exceeds half the diagonal (by the Lipschitz bound
+// of distance fields; conservative for distance estimates), are found once,
+// so that rays cross them without evaluating the SDF.
+class SDFEmptySpaceGrid {
+ public:
+  SDFEmptySpaceGrid() {
+  }
+
+  // The cells are cubes, |resolution| along the longest side. Cells are
+  // only empty if the distance in them is over |eps|.
+  void initialize(const SDF &sdf,
+                  const Vector3 &lower,
+                  const Vector3 &upper,
+                  int resolution,
+                  real eps,
+                  int num_threads = -1);
+
+  // The distance along |dir| to leave the cell of |p| if it is empty, with
+  // a lower bound of the distance to the surface in the cell; 0 if it is
+  // not, or outside the grid
+  real get_skip_distance(const Vector3 &p,
+                         const Vector3 &dir,
+                         real &bound) const;
+
+  int get_num_empty_cells() const;
+
+ private:
+  Vector3 lower;
+  real cell_size = 0, inv_cell_size = 0;
+  Vector3i res = Vector3i(0);
+  real eps = 0;
+  // Lower bounds of the distance in the cells
+  std::vector<float32> bounds;
+};
+
+// Sphere tracing, over-relaxed (Keinert et al. 2014, Enhanced Sphere
+// Tracing) by |omega| in [1, 2): steps are |omega| times the distance and
+// taken back once consecutive spheres no longer overlap. Rays stop where
+// the distance is under max(eps, cone * t), |cone| being e.g. the angle of
+// a pixel, as more precision is not seen further away.
+class SphereTracer {
+ public:
+  const SDF *sdf = nullptr;
+  // Optional; not owned
+  const SDFEmptySpaceGrid *grid = nullptr;
+  real eps = 1e-5_f;
+  real omega = 1;
+  real cone = 0;
+  int max_steps = 1000;
+
+  // The distance of the first hit, or over |limit| if there is none
+  real march(const Vector3 &orig, const Vector3 &dir, real limit) const;
+};
+
 TC_NAMESPACE_END
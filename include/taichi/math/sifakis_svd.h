@@ -1,6 +1,7 @@
 #include <cmath>
 #include <immintrin.h>
 #include <algorithm>
+#include <cstring>
 #include <taichi/common/util.h>
 
 namespace SifakisSVD {
@@ -54,1137 +55,1179 @@ constexpr float Sine_Pi_Over_Eight =
 constexpr float Cosine_Pi_Over_Eight =
     0.9238795325112867f;  //.5 * sqrt(2. + sqrt(2.));
 
-template <int sweeps = 4>
-TC_FORCE_INLINE void svd(const float a11,
-                         const float a12,
-                         const float a13,
-                         const float a21,
-                         const float a22,
-                         const float a23,
-                         const float a31,
-                         const float a32,
-                         const float a33,
-                         float &u11,
-                         float &u12,
-                         float &u13,
-                         float &u21,
-                         float &u22,
-                         float &u23,
-                         float &u31,
-                         float &u32,
-                         float &u33,
-                         float &v11,
-                         float &v12,
-                         float &v13,
-                         float &v21,
-                         float &v22,
-                         float &v23,
-                         float &v31,
-                         float &v32,
-                         float &v33,
-                         float &sigma1,
-                         float &sigma2,
-                         float &sigma3) {
-  // var
-  union {
-    float f;
-    unsigned int ui;
-  } Sfour_gamma_squared;
-  union {
-    float f;
-    unsigned int ui;
-  } Ssine_pi_over_eight;
-  union {
-    float f;
-    unsigned int ui;
-  } Scosine_pi_over_eight;
-  union {
-    float f;
-    unsigned int ui;
-  } Sone_half;
-  union {
-    float f;
-    unsigned int ui;
-  } Sone;
-  union {
-    float f;
-    unsigned int ui;
-  } Stiny_number;
-  union {
-    float f;
-    unsigned int ui;
-  } Ssmall_number;
-  union {
-    float f;
-    unsigned int ui;
-  } Sa11;
-  union {
-    float f;
-    unsigned int ui;
-  } Sa21;
-  union {
-    float f;
-    unsigned int ui;
-  } Sa31;
-  union {
-    float f;
-    unsigned int ui;
-  } Sa12;
-  union {
-    float f;
-    unsigned int ui;
-  } Sa22;
-  union {
-    float f;
-    unsigned int ui;
-  } Sa32;
-  union {
-    float f;
-    unsigned int ui;
-  } Sa13;
-  union {
-    float f;
-    unsigned int ui;
-  } Sa23;
-  union {
-    float f;
-    unsigned int ui;
-  } Sa33;
-
-  union {
-    float f;
-    unsigned int ui;
-  } Sv11;
-  union {
-    float f;
-    unsigned int ui;
-  } Sv21;
-  union {
-    float f;
-    unsigned int ui;
-  } Sv31;
-  union {
-    float f;
-    unsigned int ui;
-  } Sv12;
-  union {
-    float f;
-    unsigned int ui;
-  } Sv22;
-  union {
-    float f;
-    unsigned int ui;
-  } Sv32;
-  union {
-    float f;
-    unsigned int ui;
-  } Sv13;
-  union {
-    float f;
-    unsigned int ui;
-  } Sv23;
-  union {
-    float f;
-    unsigned int ui;
-  } Sv33;
-  union {
-    float f;
-    unsigned int ui;
-  } Su11;
-  union {
-    float f;
-    unsigned int ui;
-  } Su21;
-  union {
-    float f;
-    unsigned int ui;
-  } Su31;
-  union {
-    float f;
-    unsigned int ui;
-  } Su12;
-  union {
-    float f;
-    unsigned int ui;
-  } Su22;
-  union {
-    float f;
-    unsigned int ui;
-  } Su32;
-  union {
-    float f;
-    unsigned int ui;
-  } Su13;
-  union {
-    float f;
-    unsigned int ui;
-  } Su23;
-  union {
-    float f;
-    unsigned int ui;
-  } Su33;
-  union {
-    float f;
-    unsigned int ui;
-  } Sc;
-  union {
-    float f;
-    unsigned int ui;
-  } Ss;
-  union {
-    float f;
-    unsigned int ui;
-  } Sch;
-  union {
-    float f;
-    unsigned int ui;
-  } Ssh;
-  union {
-    float f;
-    unsigned int ui;
-  } Stmp1;
-  union {
-    float f;
-    unsigned int ui;
-  } Stmp2;
-  union {
-    float f;
-    unsigned int ui;
-  } Stmp3;
-  union {
-    float f;
-    unsigned int ui;
-  } Stmp4;
-  union {
-    float f;
-    unsigned int ui;
-  } Stmp5;
-  union {
-    float f;
-    unsigned int ui;
-  } Sqvs;
-  union {
-    float f;
-    unsigned int ui;
-  } Sqvvx;
-  union {
-    float f;
-    unsigned int ui;
-  } Sqvvy;
-  union {
-    float f;
-    unsigned int ui;
-  } Sqvvz;
-
-  union {
-    float f;
-    unsigned int ui;
-  } Ss11;
-  union {
-    float f;
-    unsigned int ui;
-  } Ss21;
-  union {
-    float f;
-    unsigned int ui;
-  } Ss31;
-  union {
-    float f;
-    unsigned int ui;
-  } Ss22;
-  union {
-    float f;
-    unsigned int ui;
-  } Ss32;
-  union {
-    float f;
-    unsigned int ui;
-  } Ss33;
+// Lanes of the kernel: one float, the 8 of an __m256 with AVX, or the 16 of
+// an __m512 with AVX-512. The kernel is written once in the operations
+// below, as the scalar, SSE and AVX variants of the original implementation
+// are. Masks have all bits of true lanes set.
+
+template <typename F>
+F splat(float f);
+
+template <>
+TC_FORCE_INLINE float splat<float>(float f) {
+  return f;
+}
+
+TC_FORCE_INLINE unsigned int to_bits(float f) {
+  unsigned int u;
+  std::memcpy(&u, &f, sizeof(u));
+  return u;
+}
+
+TC_FORCE_INLINE float from_bits(unsigned int u) {
+  float f;
+  std::memcpy(&f, &u, sizeof(f));
+  return f;
+}
+
+TC_FORCE_INLINE float add(float a, float b) {
+  return a + b;
+}
+
+TC_FORCE_INLINE float sub(float a, float b) {
+  return a - b;
+}
+
+TC_FORCE_INLINE float mul(float a, float b) {
+  return a * b;
+}
+
+TC_FORCE_INLINE float max(float a, float b) {
+  return std::max(a, b);
+}
+
+TC_FORCE_INLINE float bit_and(float a, float b) {
+  return from_bits(to_bits(a) & to_bits(b));
+}
+
+TC_FORCE_INLINE float bit_or(float a, float b) {
+  return from_bits(to_bits(a) | to_bits(b));
+}
+
+TC_FORCE_INLINE float bit_xor(float a, float b) {
+  return from_bits(to_bits(a) ^ to_bits(b));
+}
+
+// ~a & b
+TC_FORCE_INLINE float and_not(float a, float b) {
+  return from_bits(~to_bits(a) & to_bits(b));
+}
+
+TC_FORCE_INLINE float ge(float a, float b) {
+  return from_bits(a >= b ? 0xffffffff : 0);
+}
+
+TC_FORCE_INLINE float le(float a, float b) {
+  return from_bits(a <= b ? 0xffffffff : 0);
+}
+
+TC_FORCE_INLINE float lt(float a, float b) {
+  return from_bits(a < b ? 0xffffffff : 0);
+}
+
+#if defined(__AVX__)
+template <>
+TC_FORCE_INLINE __m256 splat<__m256>(float f) {
+  return _mm256_set1_ps(f);
+}
+
+TC_FORCE_INLINE __m256 rsqrt(__m256 a) {
+  return _mm256_rsqrt_ps(a);
+}
+
+TC_FORCE_INLINE __m256 add(__m256 a, __m256 b) {
+  return _mm256_add_ps(a, b);
+}
+
+TC_FORCE_INLINE __m256 sub(__m256 a, __m256 b) {
+  return _mm256_sub_ps(a, b);
+}
+
+TC_FORCE_INLINE __m256 mul(__m256 a, __m256 b) {
+  return _mm256_mul_ps(a, b);
+}
+
+TC_FORCE_INLINE __m256 max(__m256 a, __m256 b) {
+  return _mm256_max_ps(a, b);
+}
+
+TC_FORCE_INLINE __m256 bit_and(__m256 a, __m256 b) {
+  return _mm256_and_ps(a, b);
+}
+
+TC_FORCE_INLINE __m256 bit_or(__m256 a, __m256 b) {
+  return _mm256_or_ps(a, b);
+}
+
+TC_FORCE_INLINE __m256 bit_xor(__m256 a, __m256 b) {
+  return _mm256_xor_ps(a, b);
+}
+
+TC_FORCE_INLINE __m256 and_not(__m256 a, __m256 b) {
+  return _mm256_andnot_ps(a, b);
+}
+
+TC_FORCE_INLINE __m256 ge(__m256 a, __m256 b) {
+  return _mm256_cmp_ps(a, b, _CMP_GE_OQ);
+}
+
+TC_FORCE_INLINE __m256 le(__m256 a, __m256 b) {
+  return _mm256_cmp_ps(a, b, _CMP_LE_OQ);
+}
+
+TC_FORCE_INLINE __m256 lt(__m256 a, __m256 b) {
+  return _mm256_cmp_ps(a, b, _CMP_LT_OQ);
+}
+#endif
+
+#if defined(__AVX512F__) || defined(TC_SIFAKIS_SVD_AVX512)
+template <>
+TC_FORCE_INLINE __m512 splat<__m512>(float f) {
+  return _mm512_set1_ps(f);
+}
+
+// 14 bits instead of the 12 of rsqrtps
+TC_FORCE_INLINE __m512 rsqrt(__m512 a) {
+  return _mm512_rsqrt14_ps(a);
+}
+
+TC_FORCE_INLINE __m512 add(__m512 a, __m512 b) {
+  return _mm512_add_ps(a, b);
+}
+
+TC_FORCE_INLINE __m512 sub(__m512 a, __m512 b) {
+  return _mm512_sub_ps(a, b);
+}
+
+TC_FORCE_INLINE __m512 mul(__m512 a, __m512 b) {
+  return _mm512_mul_ps(a, b);
+}
+
+TC_FORCE_INLINE __m512 max(__m512 a, __m512 b) {
+  return _mm512_max_ps(a, b);
+}
+
+// Bitwise operations on floats need AVX-512DQ; those on integers do not
+TC_FORCE_INLINE __m512 bit_and(__m512 a, __m512 b) {
+  return _mm512_castsi512_ps(
+      _mm512_and_si512(_mm512_castps_si512(a), _mm512_castps_si512(b)));
+}
+
+TC_FORCE_INLINE __m512 bit_or(__m512 a, __m512 b) {
+  return _mm512_castsi512_ps(
+      _mm512_or_si512(_mm512_castps_si512(a), _mm512_castps_si512(b)));
+}
+
+TC_FORCE_INLINE __m512 bit_xor(__m512 a, __m512 b) {
+  return _mm512_castsi512_ps(
+      _mm512_xor_si512(_mm512_castps_si512(a), _mm512_castps_si512(b)));
+}
+
+TC_FORCE_INLINE __m512 and_not(__m512 a, __m512 b) {
+  return _mm512_castsi512_ps(
+      _mm512_andnot_si512(_mm512_castps_si512(a), _mm512_castps_si512(b)));
+}
+
+TC_FORCE_INLINE __m512 to_mask(__mmask16 mask) {
+  return _mm512_castsi512_ps(_mm512_maskz_set1_epi32(mask, -1));
+}
+
+TC_FORCE_INLINE __m512 ge(__m512 a, __m512 b) {
+  return to_mask(_mm512_cmp_ps_mask(a, b, _CMP_GE_OQ));
+}
+
+TC_FORCE_INLINE __m512 le(__m512 a, __m512 b) {
+  return to_mask(_mm512_cmp_ps_mask(a, b, _CMP_LE_OQ));
+}
+
+TC_FORCE_INLINE __m512 lt(__m512 a, __m512 b) {
+  return to_mask(_mm512_cmp_ps_mask(a, b, _CMP_LT_OQ));
+}
+#endif
+
+// The widest lanes of the target, for batches of matrices. Portable builds
+// include this file again with TC_SIFAKIS_SVD_AVX512, in a namespace
+// compiled for AVX-512 (svd.cpp).
+#if defined(__AVX512F__) || defined(TC_SIFAKIS_SVD_AVX512)
+using Lanes = __m512;
+constexpr int lane_width = 16;
+
+TC_FORCE_INLINE Lanes load_lanes(const float *p) {
+  return _mm512_loadu_ps(p);
+}
+
+TC_FORCE_INLINE void store_lanes(float *p, Lanes a) {
+  _mm512_storeu_ps(p, a);
+}
+#elif defined(__AVX__)
+using Lanes = __m256;
+constexpr int lane_width = 8;
+
+TC_FORCE_INLINE Lanes load_lanes(const float *p) {
+  return _mm256_loadu_ps(p);
+}
+
+TC_FORCE_INLINE void store_lanes(float *p, Lanes a) {
+  _mm256_storeu_ps(p, a);
+}
+#else
+using Lanes = float;
+constexpr int lane_width = 1;
+
+TC_FORCE_INLINE Lanes load_lanes(const float *p) {
+  return *p;
+}
+
+TC_FORCE_INLINE void store_lanes(float *p, Lanes a) {
+  *p = a;
+}
+#endif
+
+// A = U diag(sigma) V^T, with rotations U and V, in every lane
+template <int sweeps = 4, typename F>
+TC_FORCE_INLINE void svd(const F a11,
+                         const F a12,
+                         const F a13,
+                         const F a21,
+                         const F a22,
+                         const F a23,
+                         const F a31,
+                         const F a32,
+                         const F a33,
+                         F &u11,
+                         F &u12,
+                         F &u13,
+                         F &u21,
+                         F &u22,
+                         F &u23,
+                         F &u31,
+                         F &u32,
+                         F &u33,
+                         F &v11,
+                         F &v12,
+                         F &v13,
+                         F &v21,
+                         F &v22,
+                         F &v23,
+                         F &v31,
+                         F &v32,
+                         F &v33,
+                         F &sigma1,
+                         F &sigma2,
+                         F &sigma3) {
+  F Sfour_gamma_squared, Ssine_pi_over_eight, Scosine_pi_over_eight, Sone_half,
+    Sone, Stiny_number, Ssmall_number, Sa11, Sa21, Sa31, Sa12, Sa22, Sa32, Sa13,
+    Sa23, Sa33, Sv11, Sv21, Sv31, Sv12, Sv22, Sv32, Sv13, Sv23, Sv33, Su11,
+    Su21, Su31, Su12, Su22, Su32, Su13, Su23, Su33, Sc, Ss, Sch, Ssh, Stmp1,
+    Stmp2, Stmp3, Stmp4, Stmp5, Sqvs, Sqvvx, Sqvvy, Sqvvz, Ss11, Ss21, Ss31,
+    Ss22, Ss32, Ss33;
 
   // compute
-  Sfour_gamma_squared.f = Four_Gamma_Squared;
-  Ssine_pi_over_eight.f = Sine_Pi_Over_Eight;
-  Scosine_pi_over_eight.f = Cosine_Pi_Over_Eight;
-  Sone_half.f = 0.5f;
-  Sone.f = 1.0f;
-  Stiny_number.f = 1.e-20f;
-  Ssmall_number.f = 1.e-12f;
-
-  Sa11.f = a11;
-  Sa21.f = a21;
-  Sa31.f = a31;
-  Sa12.f = a12;
-  Sa22.f = a22;
-  Sa32.f = a32;
-  Sa13.f = a13;
-  Sa23.f = a23;
-  Sa33.f = a33;
-
-  Sqvs.f = 1.0f;
-  Sqvvx.f = 0.0f;
-  Sqvvy.f = 0.0f;
-  Sqvvz.f = 0.0f;
-
-  Ss11.f = Sa11.f * Sa11.f;
-  Stmp1.f = Sa21.f * Sa21.f;
-  Ss11.f = Stmp1.f + Ss11.f;
-  Stmp1.f = Sa31.f * Sa31.f;
-  Ss11.f = Stmp1.f + Ss11.f;
-
-  Ss21.f = Sa12.f * Sa11.f;
-  Stmp1.f = Sa22.f * Sa21.f;
-  Ss21.f = Stmp1.f + Ss21.f;
-  Stmp1.f = Sa32.f * Sa31.f;
-  Ss21.f = Stmp1.f + Ss21.f;
-
-  Ss31.f = Sa13.f * Sa11.f;
-  Stmp1.f = Sa23.f * Sa21.f;
-  Ss31.f = Stmp1.f + Ss31.f;
-  Stmp1.f = Sa33.f * Sa31.f;
-  Ss31.f = Stmp1.f + Ss31.f;
-
-  Ss22.f = Sa12.f * Sa12.f;
-  Stmp1.f = Sa22.f * Sa22.f;
-  Ss22.f = Stmp1.f + Ss22.f;
-  Stmp1.f = Sa32.f * Sa32.f;
-  Ss22.f = Stmp1.f + Ss22.f;
-
-  Ss32.f = Sa13.f * Sa12.f;
-  Stmp1.f = Sa23.f * Sa22.f;
-  Ss32.f = Stmp1.f + Ss32.f;
-  Stmp1.f = Sa33.f * Sa32.f;
-  Ss32.f = Stmp1.f + Ss32.f;
-
-  Ss33.f = Sa13.f * Sa13.f;
-  Stmp1.f = Sa23.f * Sa23.f;
-  Ss33.f = Stmp1.f + Ss33.f;
-  Stmp1.f = Sa33.f * Sa33.f;
-  Ss33.f = Stmp1.f + Ss33.f;
+  Sfour_gamma_squared = splat<F>(Four_Gamma_Squared);
+  Ssine_pi_over_eight = splat<F>(Sine_Pi_Over_Eight);
+  Scosine_pi_over_eight = splat<F>(Cosine_Pi_Over_Eight);
+  Sone_half = splat<F>(0.5f);
+  Sone = splat<F>(1.0f);
+  Stiny_number = splat<F>(1.e-20f);
+  Ssmall_number = splat<F>(1.e-12f);
+
+  Sa11 = a11;
+  Sa21 = a21;
+  Sa31 = a31;
+  Sa12 = a12;
+  Sa22 = a22;
+  Sa32 = a32;
+  Sa13 = a13;
+  Sa23 = a23;
+  Sa33 = a33;
+
+  Sqvs = splat<F>(1.0f);
+  Sqvvx = splat<F>(0.0f);
+  Sqvvy = splat<F>(0.0f);
+  Sqvvz = splat<F>(0.0f);
+
+  Ss11 = mul(Sa11, Sa11);
+  Stmp1 = mul(Sa21, Sa21);
+  Ss11 = add(Stmp1, Ss11);
+  Stmp1 = mul(Sa31, Sa31);
+  Ss11 = add(Stmp1, Ss11);
+
+  Ss21 = mul(Sa12, Sa11);
+  Stmp1 = mul(Sa22, Sa21);
+  Ss21 = add(Stmp1, Ss21);
+  Stmp1 = mul(Sa32, Sa31);
+  Ss21 = add(Stmp1, Ss21);
+
+  Ss31 = mul(Sa13, Sa11);
+  Stmp1 = mul(Sa23, Sa21);
+  Ss31 = add(Stmp1, Ss31);
+  Stmp1 = mul(Sa33, Sa31);
+  Ss31 = add(Stmp1, Ss31);
+
+  Ss22 = mul(Sa12, Sa12);
+  Stmp1 = mul(Sa22, Sa22);
+  Ss22 = add(Stmp1, Ss22);
+  Stmp1 = mul(Sa32, Sa32);
+  Ss22 = add(Stmp1, Ss22);
+
+  Ss32 = mul(Sa13, Sa12);
+  Stmp1 = mul(Sa23, Sa22);
+  Ss32 = add(Stmp1, Ss32);
+  Stmp1 = mul(Sa33, Sa32);
+  Ss32 = add(Stmp1, Ss32);
+
+  Ss33 = mul(Sa13, Sa13);
+  Stmp1 = mul(Sa23, Sa23);
+  Ss33 = add(Stmp1, Ss33);
+  Stmp1 = mul(Sa33, Sa33);
+  Ss33 = add(Stmp1, Ss33);
 
   for (int sweep = 0; sweep < sweeps; sweep++) {
-    Ssh.f = Ss21.f * Sone_half.f;
-    Stmp5.f = Ss11.f - Ss22.f;
-
-    Stmp2.f = Ssh.f * Ssh.f;
-    Stmp1.ui = (Stmp2.f >= Stiny_number.f) ? 0xffffffff : 0;
-    Ssh.ui = Stmp1.ui & Ssh.ui;
-    Sch.ui = Stmp1.ui & Stmp5.ui;
-    Stmp2.ui = ~Stmp1.ui & Sone.ui;
-    Sch.ui = Sch.ui | Stmp2.ui;
-
-    Stmp1.f = Ssh.f * Ssh.f;
-    Stmp2.f = Sch.f * Sch.f;
-    Stmp3.f = Stmp1.f + Stmp2.f;
-    Stmp4.f = rsqrt(Stmp3.f);
-    Ssh.f = Stmp4.f * Ssh.f;
-    Sch.f = Stmp4.f * Sch.f;
-
-    Stmp1.f = Sfour_gamma_squared.f * Stmp1.f;
-    Stmp1.ui = (Stmp2.f <= Stmp1.f) ? 0xffffffff : 0;
-
-    Stmp2.ui = Ssine_pi_over_eight.ui & Stmp1.ui;
-    Ssh.ui = ~Stmp1.ui & Ssh.ui;
-    Ssh.ui = Ssh.ui | Stmp2.ui;
-    Stmp2.ui = Scosine_pi_over_eight.ui & Stmp1.ui;
-    Sch.ui = ~Stmp1.ui & Sch.ui;
-    Sch.ui = Sch.ui | Stmp2.ui;
-
-    Stmp1.f = Ssh.f * Ssh.f;
-    Stmp2.f = Sch.f * Sch.f;
-    Sc.f = Stmp2.f - Stmp1.f;
-    Ss.f = Sch.f * Ssh.f;
-    Ss.f = Ss.f + Ss.f;
-
-    Stmp3.f = Stmp1.f + Stmp2.f;
-    Ss33.f = Ss33.f * Stmp3.f;
-    Ss31.f = Ss31.f * Stmp3.f;
-    Ss32.f = Ss32.f * Stmp3.f;
-    Ss33.f = Ss33.f * Stmp3.f;
-
-    Stmp1.f = Ss.f * Ss31.f;
-    Stmp2.f = Ss.f * Ss32.f;
-    Ss31.f = Sc.f * Ss31.f;
-    Ss32.f = Sc.f * Ss32.f;
-    Ss31.f = Stmp2.f + Ss31.f;
-    Ss32.f = Ss32.f - Stmp1.f;
-
-    Stmp2.f = Ss.f * Ss.f;
-    Stmp1.f = Ss22.f * Stmp2.f;
-    Stmp3.f = Ss11.f * Stmp2.f;
-    Stmp4.f = Sc.f * Sc.f;
-    Ss11.f = Ss11.f * Stmp4.f;
-    Ss22.f = Ss22.f * Stmp4.f;
-    Ss11.f = Ss11.f + Stmp1.f;
-    Ss22.f = Ss22.f + Stmp3.f;
-    Stmp4.f = Stmp4.f - Stmp2.f;
-    Stmp2.f = Ss21.f + Ss21.f;
-    Ss21.f = Ss21.f * Stmp4.f;
-    Stmp4.f = Sc.f * Ss.f;
-    Stmp2.f = Stmp2.f * Stmp4.f;
-    Stmp5.f = Stmp5.f * Stmp4.f;
-    Ss11.f = Ss11.f + Stmp2.f;
-    Ss21.f = Ss21.f - Stmp5.f;
-    Ss22.f = Ss22.f - Stmp2.f;
-
-    Stmp1.f = Ssh.f * Sqvvx.f;
-    Stmp2.f = Ssh.f * Sqvvy.f;
-    Stmp3.f = Ssh.f * Sqvvz.f;
-    Ssh.f = Ssh.f * Sqvs.f;
-
-    Sqvs.f = Sch.f * Sqvs.f;
-    Sqvvx.f = Sch.f * Sqvvx.f;
-    Sqvvy.f = Sch.f * Sqvvy.f;
-    Sqvvz.f = Sch.f * Sqvvz.f;
-
-    Sqvvz.f = Sqvvz.f + Ssh.f;
-    Sqvs.f = Sqvs.f - Stmp3.f;
-    Sqvvx.f = Sqvvx.f + Stmp2.f;
-    Sqvvy.f = Sqvvy.f - Stmp1.f;
-    Ssh.f = Ss32.f * Sone_half.f;
-    Stmp5.f = Ss22.f - Ss33.f;
-
-    Stmp2.f = Ssh.f * Ssh.f;
-    Stmp1.ui = (Stmp2.f >= Stiny_number.f) ? 0xffffffff : 0;
-    Ssh.ui = Stmp1.ui & Ssh.ui;
-    Sch.ui = Stmp1.ui & Stmp5.ui;
-    Stmp2.ui = ~Stmp1.ui & Sone.ui;
-    Sch.ui = Sch.ui | Stmp2.ui;
-
-    Stmp1.f = Ssh.f * Ssh.f;
-    Stmp2.f = Sch.f * Sch.f;
-    Stmp3.f = Stmp1.f + Stmp2.f;
-    Stmp4.f = rsqrt(Stmp3.f);
-    Ssh.f = Stmp4.f * Ssh.f;
-    Sch.f = Stmp4.f * Sch.f;
-
-    Stmp1.f = Sfour_gamma_squared.f * Stmp1.f;
-    Stmp1.ui = (Stmp2.f <= Stmp1.f) ? 0xffffffff : 0;
-
-    Stmp2.ui = Ssine_pi_over_eight.ui & Stmp1.ui;
-    Ssh.ui = ~Stmp1.ui & Ssh.ui;
-    Ssh.ui = Ssh.ui | Stmp2.ui;
-    Stmp2.ui = Scosine_pi_over_eight.ui & Stmp1.ui;
-    Sch.ui = ~Stmp1.ui & Sch.ui;
-    Sch.ui = Sch.ui | Stmp2.ui;
-
-    Stmp1.f = Ssh.f * Ssh.f;
-    Stmp2.f = Sch.f * Sch.f;
-    Sc.f = Stmp2.f - Stmp1.f;
-    Ss.f = Sch.f * Ssh.f;
-    Ss.f = Ss.f + Ss.f;
-
-    Stmp3.f = Stmp1.f + Stmp2.f;
-    Ss11.f = Ss11.f * Stmp3.f;
-    Ss21.f = Ss21.f * Stmp3.f;
-    Ss31.f = Ss31.f * Stmp3.f;
-    Ss11.f = Ss11.f * Stmp3.f;
-
-    Stmp1.f = Ss.f * Ss21.f;
-    Stmp2.f = Ss.f * Ss31.f;
-    Ss21.f = Sc.f * Ss21.f;
-    Ss31.f = Sc.f * Ss31.f;
-    Ss21.f = Stmp2.f + Ss21.f;
-    Ss31.f = Ss31.f - Stmp1.f;
-
-    Stmp2.f = Ss.f * Ss.f;
-    Stmp1.f = Ss33.f * Stmp2.f;
-    Stmp3.f = Ss22.f * Stmp2.f;
-    Stmp4.f = Sc.f * Sc.f;
-    Ss22.f = Ss22.f * Stmp4.f;
-    Ss33.f = Ss33.f * Stmp4.f;
-    Ss22.f = Ss22.f + Stmp1.f;
-    Ss33.f = Ss33.f + Stmp3.f;
-    Stmp4.f = Stmp4.f - Stmp2.f;
-    Stmp2.f = Ss32.f + Ss32.f;
-    Ss32.f = Ss32.f * Stmp4.f;
-    Stmp4.f = Sc.f * Ss.f;
-    Stmp2.f = Stmp2.f * Stmp4.f;
-    Stmp5.f = Stmp5.f * Stmp4.f;
-    Ss22.f = Ss22.f + Stmp2.f;
-    Ss32.f = Ss32.f - Stmp5.f;
-    Ss33.f = Ss33.f - Stmp2.f;
-
-    Stmp1.f = Ssh.f * Sqvvx.f;
-    Stmp2.f = Ssh.f * Sqvvy.f;
-    Stmp3.f = Ssh.f * Sqvvz.f;
-    Ssh.f = Ssh.f * Sqvs.f;
-
-    Sqvs.f = Sch.f * Sqvs.f;
-    Sqvvx.f = Sch.f * Sqvvx.f;
-    Sqvvy.f = Sch.f * Sqvvy.f;
-    Sqvvz.f = Sch.f * Sqvvz.f;
-
-    Sqvvx.f = Sqvvx.f + Ssh.f;
-    Sqvs.f = Sqvs.f - Stmp1.f;
-    Sqvvy.f = Sqvvy.f + Stmp3.f;
-    Sqvvz.f = Sqvvz.f - Stmp2.f;
-    Ssh.f = Ss31.f * Sone_half.f;
-    Stmp5.f = Ss33.f - Ss11.f;
-
-    Stmp2.f = Ssh.f * Ssh.f;
-    Stmp1.ui = (Stmp2.f >= Stiny_number.f) ? 0xffffffff : 0;
-    Ssh.ui = Stmp1.ui & Ssh.ui;
-    Sch.ui = Stmp1.ui & Stmp5.ui;
-    Stmp2.ui = ~Stmp1.ui & Sone.ui;
-    Sch.ui = Sch.ui | Stmp2.ui;
-
-    Stmp1.f = Ssh.f * Ssh.f;
-    Stmp2.f = Sch.f * Sch.f;
-    Stmp3.f = Stmp1.f + Stmp2.f;
-    Stmp4.f = rsqrt(Stmp3.f);
-    Ssh.f = Stmp4.f * Ssh.f;
-    Sch.f = Stmp4.f * Sch.f;
-
-    Stmp1.f = Sfour_gamma_squared.f * Stmp1.f;
-    Stmp1.ui = (Stmp2.f <= Stmp1.f) ? 0xffffffff : 0;
-
-    Stmp2.ui = Ssine_pi_over_eight.ui & Stmp1.ui;
-    Ssh.ui = ~Stmp1.ui & Ssh.ui;
-    Ssh.ui = Ssh.ui | Stmp2.ui;
-    Stmp2.ui = Scosine_pi_over_eight.ui & Stmp1.ui;
-    Sch.ui = ~Stmp1.ui & Sch.ui;
-    Sch.ui = Sch.ui | Stmp2.ui;
-
-    Stmp1.f = Ssh.f * Ssh.f;
-    Stmp2.f = Sch.f * Sch.f;
-    Sc.f = Stmp2.f - Stmp1.f;
-    Ss.f = Sch.f * Ssh.f;
-    Ss.f = Ss.f + Ss.f;
-
-    Stmp3.f = Stmp1.f + Stmp2.f;
-    Ss22.f = Ss22.f * Stmp3.f;
-    Ss32.f = Ss32.f * Stmp3.f;
-    Ss21.f = Ss21.f * Stmp3.f;
-    Ss22.f = Ss22.f * Stmp3.f;
-
-    Stmp1.f = Ss.f * Ss32.f;
-    Stmp2.f = Ss.f * Ss21.f;
-    Ss32.f = Sc.f * Ss32.f;
-    Ss21.f = Sc.f * Ss21.f;
-    Ss32.f = Stmp2.f + Ss32.f;
-    Ss21.f = Ss21.f - Stmp1.f;
-
-    Stmp2.f = Ss.f * Ss.f;
-    Stmp1.f = Ss11.f * Stmp2.f;
-    Stmp3.f = Ss33.f * Stmp2.f;
-    Stmp4.f = Sc.f * Sc.f;
-    Ss33.f = Ss33.f * Stmp4.f;
-    Ss11.f = Ss11.f * Stmp4.f;
-    Ss33.f = Ss33.f + Stmp1.f;
-    Ss11.f = Ss11.f + Stmp3.f;
-    Stmp4.f = Stmp4.f - Stmp2.f;
-    Stmp2.f = Ss31.f + Ss31.f;
-    Ss31.f = Ss31.f * Stmp4.f;
-    Stmp4.f = Sc.f * Ss.f;
-    Stmp2.f = Stmp2.f * Stmp4.f;
-    Stmp5.f = Stmp5.f * Stmp4.f;
-    Ss33.f = Ss33.f + Stmp2.f;
-    Ss31.f = Ss31.f - Stmp5.f;
-    Ss11.f = Ss11.f - Stmp2.f;
-
-    Stmp1.f = Ssh.f * Sqvvx.f;
-    Stmp2.f = Ssh.f * Sqvvy.f;
-    Stmp3.f = Ssh.f * Sqvvz.f;
-    Ssh.f = Ssh.f * Sqvs.f;
-
-    Sqvs.f = Sch.f * Sqvs.f;
-    Sqvvx.f = Sch.f * Sqvvx.f;
-    Sqvvy.f = Sch.f * Sqvvy.f;
-    Sqvvz.f = Sch.f * Sqvvz.f;
-
-    Sqvvy.f = Sqvvy.f + Ssh.f;
-    Sqvs.f = Sqvs.f - Stmp2.f;
-    Sqvvz.f = Sqvvz.f + Stmp1.f;
-    Sqvvx.f = Sqvvx.f - Stmp3.f;
+    Ssh = mul(Ss21, Sone_half);
+    Stmp5 = sub(Ss11, Ss22);
+
+    Stmp2 = mul(Ssh, Ssh);
+    Stmp1 = ge(Stmp2, Stiny_number);
+    Ssh = bit_and(Stmp1, Ssh);
+    Sch = bit_and(Stmp1, Stmp5);
+    Stmp2 = and_not(Stmp1, Sone);
+    Sch = bit_or(Sch, Stmp2);
+
+    Stmp1 = mul(Ssh, Ssh);
+    Stmp2 = mul(Sch, Sch);
+    Stmp3 = add(Stmp1, Stmp2);
+    Stmp4 = rsqrt(Stmp3);
+    Ssh = mul(Stmp4, Ssh);
+    Sch = mul(Stmp4, Sch);
+
+    Stmp1 = mul(Sfour_gamma_squared, Stmp1);
+    Stmp1 = le(Stmp2, Stmp1);
+
+    Stmp2 = bit_and(Ssine_pi_over_eight, Stmp1);
+    Ssh = and_not(Stmp1, Ssh);
+    Ssh = bit_or(Ssh, Stmp2);
+    Stmp2 = bit_and(Scosine_pi_over_eight, Stmp1);
+    Sch = and_not(Stmp1, Sch);
+    Sch = bit_or(Sch, Stmp2);
+
+    Stmp1 = mul(Ssh, Ssh);
+    Stmp2 = mul(Sch, Sch);
+    Sc = sub(Stmp2, Stmp1);
+    Ss = mul(Sch, Ssh);
+    Ss = add(Ss, Ss);
+
+    Stmp3 = add(Stmp1, Stmp2);
+    Ss33 = mul(Ss33, Stmp3);
+    Ss31 = mul(Ss31, Stmp3);
+    Ss32 = mul(Ss32, Stmp3);
+    Ss33 = mul(Ss33, Stmp3);
+
+    Stmp1 = mul(Ss, Ss31);
+    Stmp2 = mul(Ss, Ss32);
+    Ss31 = mul(Sc, Ss31);
+    Ss32 = mul(Sc, Ss32);
+    Ss31 = add(Stmp2, Ss31);
+    Ss32 = sub(Ss32, Stmp1);
+
+    Stmp2 = mul(Ss, Ss);
+    Stmp1 = mul(Ss22, Stmp2);
+    Stmp3 = mul(Ss11, Stmp2);
+    Stmp4 = mul(Sc, Sc);
+    Ss11 = mul(Ss11, Stmp4);
+    Ss22 = mul(Ss22, Stmp4);
+    Ss11 = add(Ss11, Stmp1);
+    Ss22 = add(Ss22, Stmp3);
+    Stmp4 = sub(Stmp4, Stmp2);
+    Stmp2 = add(Ss21, Ss21);
+    Ss21 = mul(Ss21, Stmp4);
+    Stmp4 = mul(Sc, Ss);
+    Stmp2 = mul(Stmp2, Stmp4);
+    Stmp5 = mul(Stmp5, Stmp4);
+    Ss11 = add(Ss11, Stmp2);
+    Ss21 = sub(Ss21, Stmp5);
+    Ss22 = sub(Ss22, Stmp2);
+
+    Stmp1 = mul(Ssh, Sqvvx);
+    Stmp2 = mul(Ssh, Sqvvy);
+    Stmp3 = mul(Ssh, Sqvvz);
+    Ssh = mul(Ssh, Sqvs);
+
+    Sqvs = mul(Sch, Sqvs);
+    Sqvvx = mul(Sch, Sqvvx);
+    Sqvvy = mul(Sch, Sqvvy);
+    Sqvvz = mul(Sch, Sqvvz);
+
+    Sqvvz = add(Sqvvz, Ssh);
+    Sqvs = sub(Sqvs, Stmp3);
+    Sqvvx = add(Sqvvx, Stmp2);
+    Sqvvy = sub(Sqvvy, Stmp1);
+    Ssh = mul(Ss32, Sone_half);
+    Stmp5 = sub(Ss22, Ss33);
+
+    Stmp2 = mul(Ssh, Ssh);
+    Stmp1 = ge(Stmp2, Stiny_number);
+    Ssh = bit_and(Stmp1, Ssh);
+    Sch = bit_and(Stmp1, Stmp5);
+    Stmp2 = and_not(Stmp1, Sone);
+    Sch = bit_or(Sch, Stmp2);
+
+    Stmp1 = mul(Ssh, Ssh);
+    Stmp2 = mul(Sch, Sch);
+    Stmp3 = add(Stmp1, Stmp2);
+    Stmp4 = rsqrt(Stmp3);
+    Ssh = mul(Stmp4, Ssh);
+    Sch = mul(Stmp4, Sch);
+
+    Stmp1 = mul(Sfour_gamma_squared, Stmp1);
+    Stmp1 = le(Stmp2, Stmp1);
+
+    Stmp2 = bit_and(Ssine_pi_over_eight, Stmp1);
+    Ssh = and_not(Stmp1, Ssh);
+    Ssh = bit_or(Ssh, Stmp2);
+    Stmp2 = bit_and(Scosine_pi_over_eight, Stmp1);
+    Sch = and_not(Stmp1, Sch);
+    Sch = bit_or(Sch, Stmp2);
+
+    Stmp1 = mul(Ssh, Ssh);
+    Stmp2 = mul(Sch, Sch);
+    Sc = sub(Stmp2, Stmp1);
+    Ss = mul(Sch, Ssh);
+    Ss = add(Ss, Ss);
+
+    Stmp3 = add(Stmp1, Stmp2);
+    Ss11 = mul(Ss11, Stmp3);
+    Ss21 = mul(Ss21, Stmp3);
+    Ss31 = mul(Ss31, Stmp3);
+    Ss11 = mul(Ss11, Stmp3);
+
+    Stmp1 = mul(Ss, Ss21);
+    Stmp2 = mul(Ss, Ss31);
+    Ss21 = mul(Sc, Ss21);
+    Ss31 = mul(Sc, Ss31);
+    Ss21 = add(Stmp2, Ss21);
+    Ss31 = sub(Ss31, Stmp1);
+
+    Stmp2 = mul(Ss, Ss);
+    Stmp1 = mul(Ss33, Stmp2);
+    Stmp3 = mul(Ss22, Stmp2);
+    Stmp4 = mul(Sc, Sc);
+    Ss22 = mul(Ss22, Stmp4);
+    Ss33 = mul(Ss33, Stmp4);
+    Ss22 = add(Ss22, Stmp1);
+    Ss33 = add(Ss33, Stmp3);
+    Stmp4 = sub(Stmp4, Stmp2);
+    Stmp2 = add(Ss32, Ss32);
+    Ss32 = mul(Ss32, Stmp4);
+    Stmp4 = mul(Sc, Ss);
+    Stmp2 = mul(Stmp2, Stmp4);
+    Stmp5 = mul(Stmp5, Stmp4);
+    Ss22 = add(Ss22, Stmp2);
+    Ss32 = sub(Ss32, Stmp5);
+    Ss33 = sub(Ss33, Stmp2);
+
+    Stmp1 = mul(Ssh, Sqvvx);
+    Stmp2 = mul(Ssh, Sqvvy);
+    Stmp3 = mul(Ssh, Sqvvz);
+    Ssh = mul(Ssh, Sqvs);
+
+    Sqvs = mul(Sch, Sqvs);
+    Sqvvx = mul(Sch, Sqvvx);
+    Sqvvy = mul(Sch, Sqvvy);
+    Sqvvz = mul(Sch, Sqvvz);
+
+    Sqvvx = add(Sqvvx, Ssh);
+    Sqvs = sub(Sqvs, Stmp1);
+    Sqvvy = add(Sqvvy, Stmp3);
+    Sqvvz = sub(Sqvvz, Stmp2);
+    Ssh = mul(Ss31, Sone_half);
+    Stmp5 = sub(Ss33, Ss11);
+
+    Stmp2 = mul(Ssh, Ssh);
+    Stmp1 = ge(Stmp2, Stiny_number);
+    Ssh = bit_and(Stmp1, Ssh);
+    Sch = bit_and(Stmp1, Stmp5);
+    Stmp2 = and_not(Stmp1, Sone);
+    Sch = bit_or(Sch, Stmp2);
+
+    Stmp1 = mul(Ssh, Ssh);
+    Stmp2 = mul(Sch, Sch);
+    Stmp3 = add(Stmp1, Stmp2);
+    Stmp4 = rsqrt(Stmp3);
+    Ssh = mul(Stmp4, Ssh);
+    Sch = mul(Stmp4, Sch);
+
+    Stmp1 = mul(Sfour_gamma_squared, Stmp1);
+    Stmp1 = le(Stmp2, Stmp1);
+
+    Stmp2 = bit_and(Ssine_pi_over_eight, Stmp1);
+    Ssh = and_not(Stmp1, Ssh);
+    Ssh = bit_or(Ssh, Stmp2);
+    Stmp2 = bit_and(Scosine_pi_over_eight, Stmp1);
+    Sch = and_not(Stmp1, Sch);
+    Sch = bit_or(Sch, Stmp2);
+
+    Stmp1 = mul(Ssh, Ssh);
+    Stmp2 = mul(Sch, Sch);
+    Sc = sub(Stmp2, Stmp1);
+    Ss = mul(Sch, Ssh);
+    Ss = add(Ss, Ss);
+
+    Stmp3 = add(Stmp1, Stmp2);
+    Ss22 = mul(Ss22, Stmp3);
+    Ss32 = mul(Ss32, Stmp3);
+    Ss21 = mul(Ss21, Stmp3);
+    Ss22 = mul(Ss22, Stmp3);
+
+    Stmp1 = mul(Ss, Ss32);
+    Stmp2 = mul(Ss, Ss21);
+    Ss32 = mul(Sc, Ss32);
+    Ss21 = mul(Sc, Ss21);
+    Ss32 = add(Stmp2, Ss32);
+    Ss21 = sub(Ss21, Stmp1);
+
+    Stmp2 = mul(Ss, Ss);
+    Stmp1 = mul(Ss11, Stmp2);
+    Stmp3 = mul(Ss33, Stmp2);
+    Stmp4 = mul(Sc, Sc);
+    Ss33 = mul(Ss33, Stmp4);
+    Ss11 = mul(Ss11, Stmp4);
+    Ss33 = add(Ss33, Stmp1);
+    Ss11 = add(Ss11, Stmp3);
+    Stmp4 = sub(Stmp4, Stmp2);
+    Stmp2 = add(Ss31, Ss31);
+    Ss31 = mul(Ss31, Stmp4);
+    Stmp4 = mul(Sc, Ss);
+    Stmp2 = mul(Stmp2, Stmp4);
+    Stmp5 = mul(Stmp5, Stmp4);
+    Ss33 = add(Ss33, Stmp2);
+    Ss31 = sub(Ss31, Stmp5);
+    Ss11 = sub(Ss11, Stmp2);
+
+    Stmp1 = mul(Ssh, Sqvvx);
+    Stmp2 = mul(Ssh, Sqvvy);
+    Stmp3 = mul(Ssh, Sqvvz);
+    Ssh = mul(Ssh, Sqvs);
+
+    Sqvs = mul(Sch, Sqvs);
+    Sqvvx = mul(Sch, Sqvvx);
+    Sqvvy = mul(Sch, Sqvvy);
+    Sqvvz = mul(Sch, Sqvvz);
+
+    Sqvvy = add(Sqvvy, Ssh);
+    Sqvs = sub(Sqvs, Stmp2);
+    Sqvvz = add(Sqvvz, Stmp1);
+    Sqvvx = sub(Sqvvx, Stmp3);
   }
 
-  Stmp2.f = Sqvs.f * Sqvs.f;
-  Stmp1.f = Sqvvx.f * Sqvvx.f;
-  Stmp2.f = Stmp1.f + Stmp2.f;
-  Stmp1.f = Sqvvy.f * Sqvvy.f;
-  Stmp2.f = Stmp1.f + Stmp2.f;
-  Stmp1.f = Sqvvz.f * Sqvvz.f;
-  Stmp2.f = Stmp1.f + Stmp2.f;
-
-  Stmp1.f = rsqrt(Stmp2.f);
-  Stmp4.f = Stmp1.f * Sone_half.f;
-  Stmp3.f = Stmp1.f * Stmp4.f;
-  Stmp3.f = Stmp1.f * Stmp3.f;
-  Stmp3.f = Stmp2.f * Stmp3.f;
-  Stmp1.f = Stmp1.f + Stmp4.f;
-  Stmp1.f = Stmp1.f - Stmp3.f;
-
-  Sqvs.f = Sqvs.f * Stmp1.f;
-  Sqvvx.f = Sqvvx.f * Stmp1.f;
-  Sqvvy.f = Sqvvy.f * Stmp1.f;
-  Sqvvz.f = Sqvvz.f * Stmp1.f;
-
-  Stmp1.f = Sqvvx.f * Sqvvx.f;
-  Stmp2.f = Sqvvy.f * Sqvvy.f;
-  Stmp3.f = Sqvvz.f * Sqvvz.f;
-  Sv11.f = Sqvs.f * Sqvs.f;
-  Sv22.f = Sv11.f - Stmp1.f;
-  Sv33.f = Sv22.f - Stmp2.f;
-  Sv33.f = Sv33.f + Stmp3.f;
-  Sv22.f = Sv22.f + Stmp2.f;
-  Sv22.f = Sv22.f - Stmp3.f;
-  Sv11.f = Sv11.f + Stmp1.f;
-  Sv11.f = Sv11.f - Stmp2.f;
-  Sv11.f = Sv11.f - Stmp3.f;
-  Stmp1.f = Sqvvx.f + Sqvvx.f;
-  Stmp2.f = Sqvvy.f + Sqvvy.f;
-  Stmp3.f = Sqvvz.f + Sqvvz.f;
-  Sv32.f = Sqvs.f * Stmp1.f;
-  Sv13.f = Sqvs.f * Stmp2.f;
-  Sv21.f = Sqvs.f * Stmp3.f;
-  Stmp1.f = Sqvvy.f * Stmp1.f;
-  Stmp2.f = Sqvvz.f * Stmp2.f;
-  Stmp3.f = Sqvvx.f * Stmp3.f;
-  Sv12.f = Stmp1.f - Sv21.f;
-  Sv23.f = Stmp2.f - Sv32.f;
-  Sv31.f = Stmp3.f - Sv13.f;
-  Sv21.f = Stmp1.f + Sv21.f;
-  Sv32.f = Stmp2.f + Sv32.f;
-  Sv13.f = Stmp3.f + Sv13.f;
-  Stmp2.f = Sa12.f;
-  Stmp3.f = Sa13.f;
-  Sa12.f = Sv12.f * Sa11.f;
-  Sa13.f = Sv13.f * Sa11.f;
-  Sa11.f = Sv11.f * Sa11.f;
-  Stmp1.f = Sv21.f * Stmp2.f;
-  Sa11.f = Sa11.f + Stmp1.f;
-  Stmp1.f = Sv31.f * Stmp3.f;
-  Sa11.f = Sa11.f + Stmp1.f;
-  Stmp1.f = Sv22.f * Stmp2.f;
-  Sa12.f = Sa12.f + Stmp1.f;
-  Stmp1.f = Sv32.f * Stmp3.f;
-  Sa12.f = Sa12.f + Stmp1.f;
-  Stmp1.f = Sv23.f * Stmp2.f;
-  Sa13.f = Sa13.f + Stmp1.f;
-  Stmp1.f = Sv33.f * Stmp3.f;
-  Sa13.f = Sa13.f + Stmp1.f;
-
-  Stmp2.f = Sa22.f;
-  Stmp3.f = Sa23.f;
-  Sa22.f = Sv12.f * Sa21.f;
-  Sa23.f = Sv13.f * Sa21.f;
-  Sa21.f = Sv11.f * Sa21.f;
-  Stmp1.f = Sv21.f * Stmp2.f;
-  Sa21.f = Sa21.f + Stmp1.f;
-  Stmp1.f = Sv31.f * Stmp3.f;
-  Sa21.f = Sa21.f + Stmp1.f;
-  Stmp1.f = Sv22.f * Stmp2.f;
-  Sa22.f = Sa22.f + Stmp1.f;
-  Stmp1.f = Sv32.f * Stmp3.f;
-  Sa22.f = Sa22.f + Stmp1.f;
-  Stmp1.f = Sv23.f * Stmp2.f;
-  Sa23.f = Sa23.f + Stmp1.f;
-  Stmp1.f = Sv33.f * Stmp3.f;
-  Sa23.f = Sa23.f + Stmp1.f;
-
-  Stmp2.f = Sa32.f;
-  Stmp3.f = Sa33.f;
-  Sa32.f = Sv12.f * Sa31.f;
-  Sa33.f = Sv13.f * Sa31.f;
-  Sa31.f = Sv11.f * Sa31.f;
-  Stmp1.f = Sv21.f * Stmp2.f;
-  Sa31.f = Sa31.f + Stmp1.f;
-  Stmp1.f = Sv31.f * Stmp3.f;
-  Sa31.f = Sa31.f + Stmp1.f;
-  Stmp1.f = Sv22.f * Stmp2.f;
-  Sa32.f = Sa32.f + Stmp1.f;
-  Stmp1.f = Sv32.f * Stmp3.f;
-  Sa32.f = Sa32.f + Stmp1.f;
-  Stmp1.f = Sv23.f * Stmp2.f;
-  Sa33.f = Sa33.f + Stmp1.f;
-  Stmp1.f = Sv33.f * Stmp3.f;
-  Sa33.f = Sa33.f + Stmp1.f;
-
-  Stmp1.f = Sa11.f * Sa11.f;
-  Stmp4.f = Sa21.f * Sa21.f;
-  Stmp1.f = Stmp1.f + Stmp4.f;
-  Stmp4.f = Sa31.f * Sa31.f;
-  Stmp1.f = Stmp1.f + Stmp4.f;
-
-  Stmp2.f = Sa12.f * Sa12.f;
-  Stmp4.f = Sa22.f * Sa22.f;
-  Stmp2.f = Stmp2.f + Stmp4.f;
-  Stmp4.f = Sa32.f * Sa32.f;
-  Stmp2.f = Stmp2.f + Stmp4.f;
-
-  Stmp3.f = Sa13.f * Sa13.f;
-  Stmp4.f = Sa23.f * Sa23.f;
-  Stmp3.f = Stmp3.f + Stmp4.f;
-  Stmp4.f = Sa33.f * Sa33.f;
-  Stmp3.f = Stmp3.f + Stmp4.f;
-
-  Stmp4.ui = (Stmp1.f < Stmp2.f) ? 0xffffffff : 0;
-
-  Stmp5.ui = Sa11.ui ^ Sa12.ui;
-  Stmp5.ui = Stmp5.ui & Stmp4.ui;
-  Sa11.ui = Sa11.ui ^ Stmp5.ui;
-  Sa12.ui = Sa12.ui ^ Stmp5.ui;
-
-  Stmp5.ui = Sa21.ui ^ Sa22.ui;
-  Stmp5.ui = Stmp5.ui & Stmp4.ui;
-  Sa21.ui = Sa21.ui ^ Stmp5.ui;
-  Sa22.ui = Sa22.ui ^ Stmp5.ui;
-
-  Stmp5.ui = Sa31.ui ^ Sa32.ui;
-  Stmp5.ui = Stmp5.ui & Stmp4.ui;
-  Sa31.ui = Sa31.ui ^ Stmp5.ui;
-  Sa32.ui = Sa32.ui ^ Stmp5.ui;
-
-  Stmp5.ui = Sv11.ui ^ Sv12.ui;
-  Stmp5.ui = Stmp5.ui & Stmp4.ui;
-  Sv11.ui = Sv11.ui ^ Stmp5.ui;
-  Sv12.ui = Sv12.ui ^ Stmp5.ui;
-
-  Stmp5.ui = Sv21.ui ^ Sv22.ui;
-  Stmp5.ui = Stmp5.ui & Stmp4.ui;
-  Sv21.ui = Sv21.ui ^ Stmp5.ui;
-  Sv22.ui = Sv22.ui ^ Stmp5.ui;
-
-  Stmp5.ui = Sv31.ui ^ Sv32.ui;
-  Stmp5.ui = Stmp5.ui & Stmp4.ui;
-  Sv31.ui = Sv31.ui ^ Stmp5.ui;
-  Sv32.ui = Sv32.ui ^ Stmp5.ui;
-
-  Stmp5.ui = Stmp1.ui ^ Stmp2.ui;
-  Stmp5.ui = Stmp5.ui & Stmp4.ui;
-  Stmp1.ui = Stmp1.ui ^ Stmp5.ui;
-  Stmp2.ui = Stmp2.ui ^ Stmp5.ui;
-
-  Stmp5.f = -2.0f;
-  Stmp5.ui = Stmp5.ui & Stmp4.ui;
-  Stmp4.f = 1.0f;
-  Stmp4.f = Stmp4.f + Stmp5.f;
-
-  Sa12.f = Sa12.f * Stmp4.f;
-  Sa22.f = Sa22.f * Stmp4.f;
-  Sa32.f = Sa32.f * Stmp4.f;
-
-  Sv12.f = Sv12.f * Stmp4.f;
-  Sv22.f = Sv22.f * Stmp4.f;
-  Sv32.f = Sv32.f * Stmp4.f;
-  Stmp4.ui = (Stmp1.f < Stmp3.f) ? 0xffffffff : 0;
-
-  Stmp5.ui = Sa11.ui ^ Sa13.ui;
-  Stmp5.ui = Stmp5.ui & Stmp4.ui;
-  Sa11.ui = Sa11.ui ^ Stmp5.ui;
-  Sa13.ui = Sa13.ui ^ Stmp5.ui;
-
-  Stmp5.ui = Sa21.ui ^ Sa23.ui;
-  Stmp5.ui = Stmp5.ui & Stmp4.ui;
-  Sa21.ui = Sa21.ui ^ Stmp5.ui;
-  Sa23.ui = Sa23.ui ^ Stmp5.ui;
-
-  Stmp5.ui = Sa31.ui ^ Sa33.ui;
-  Stmp5.ui = Stmp5.ui & Stmp4.ui;
-  Sa31.ui = Sa31.ui ^ Stmp5.ui;
-  Sa33.ui = Sa33.ui ^ Stmp5.ui;
-
-  Stmp5.ui = Sv11.ui ^ Sv13.ui;
-  Stmp5.ui = Stmp5.ui & Stmp4.ui;
-  Sv11.ui = Sv11.ui ^ Stmp5.ui;
-  Sv13.ui = Sv13.ui ^ Stmp5.ui;
-
-  Stmp5.ui = Sv21.ui ^ Sv23.ui;
-  Stmp5.ui = Stmp5.ui & Stmp4.ui;
-  Sv21.ui = Sv21.ui ^ Stmp5.ui;
-  Sv23.ui = Sv23.ui ^ Stmp5.ui;
-
-  Stmp5.ui = Sv31.ui ^ Sv33.ui;
-  Stmp5.ui = Stmp5.ui & Stmp4.ui;
-  Sv31.ui = Sv31.ui ^ Stmp5.ui;
-  Sv33.ui = Sv33.ui ^ Stmp5.ui;
-
-  Stmp5.ui = Stmp1.ui ^ Stmp3.ui;
-  Stmp5.ui = Stmp5.ui & Stmp4.ui;
-  Stmp1.ui = Stmp1.ui ^ Stmp5.ui;
-  Stmp3.ui = Stmp3.ui ^ Stmp5.ui;
-
-  Stmp5.f = -2.0f;
-  Stmp5.ui = Stmp5.ui & Stmp4.ui;
-  Stmp4.f = 1.0f;
-  Stmp4.f = Stmp4.f + Stmp5.f;
-
-  Sa11.f = Sa11.f * Stmp4.f;
-  Sa21.f = Sa21.f * Stmp4.f;
-  Sa31.f = Sa31.f * Stmp4.f;
-
-  Sv11.f = Sv11.f * Stmp4.f;
-  Sv21.f = Sv21.f * Stmp4.f;
-  Sv31.f = Sv31.f * Stmp4.f;
-  Stmp4.ui = (Stmp2.f < Stmp3.f) ? 0xffffffff : 0;
-
-  Stmp5.ui = Sa12.ui ^ Sa13.ui;
-  Stmp5.ui = Stmp5.ui & Stmp4.ui;
-  Sa12.ui = Sa12.ui ^ Stmp5.ui;
-  Sa13.ui = Sa13.ui ^ Stmp5.ui;
-
-  Stmp5.ui = Sa22.ui ^ Sa23.ui;
-  Stmp5.ui = Stmp5.ui & Stmp4.ui;
-  Sa22.ui = Sa22.ui ^ Stmp5.ui;
-  Sa23.ui = Sa23.ui ^ Stmp5.ui;
-
-  Stmp5.ui = Sa32.ui ^ Sa33.ui;
-  Stmp5.ui = Stmp5.ui & Stmp4.ui;
-  Sa32.ui = Sa32.ui ^ Stmp5.ui;
-  Sa33.ui = Sa33.ui ^ Stmp5.ui;
-
-  Stmp5.ui = Sv12.ui ^ Sv13.ui;
-  Stmp5.ui = Stmp5.ui & Stmp4.ui;
-  Sv12.ui = Sv12.ui ^ Stmp5.ui;
-  Sv13.ui = Sv13.ui ^ Stmp5.ui;
-
-  Stmp5.ui = Sv22.ui ^ Sv23.ui;
-  Stmp5.ui = Stmp5.ui & Stmp4.ui;
-  Sv22.ui = Sv22.ui ^ Stmp5.ui;
-  Sv23.ui = Sv23.ui ^ Stmp5.ui;
-
-  Stmp5.ui = Sv32.ui ^ Sv33.ui;
-  Stmp5.ui = Stmp5.ui & Stmp4.ui;
-  Sv32.ui = Sv32.ui ^ Stmp5.ui;
-  Sv33.ui = Sv33.ui ^ Stmp5.ui;
-
-  Stmp5.ui = Stmp2.ui ^ Stmp3.ui;
-  Stmp5.ui = Stmp5.ui & Stmp4.ui;
-  Stmp2.ui = Stmp2.ui ^ Stmp5.ui;
-  Stmp3.ui = Stmp3.ui ^ Stmp5.ui;
-
-  Stmp5.f = -2.0f;
-  Stmp5.ui = Stmp5.ui & Stmp4.ui;
-  Stmp4.f = 1.0f;
-  Stmp4.f = Stmp4.f + Stmp5.f;
-
-  Sa13.f = Sa13.f * Stmp4.f;
-  Sa23.f = Sa23.f * Stmp4.f;
-  Sa33.f = Sa33.f * Stmp4.f;
-
-  Sv13.f = Sv13.f * Stmp4.f;
-  Sv23.f = Sv23.f * Stmp4.f;
-  Sv33.f = Sv33.f * Stmp4.f;
-  Su11.f = 1.0f;
-  Su21.f = 0.0f;
-  Su31.f = 0.0f;
-  Su12.f = 0.0f;
-  Su22.f = 1.0f;
-  Su32.f = 0.0f;
-  Su13.f = 0.0f;
-  Su23.f = 0.0f;
-  Su33.f = 1.0f;
-  Ssh.f = Sa21.f * Sa21.f;
-  Ssh.ui = (Ssh.f >= Ssmall_number.f) ? 0xffffffff : 0;
-
-  Ssh.ui = Ssh.ui & Sa21.ui;
-
-  Stmp5.f = 0.0f;
-  Sch.f = Stmp5.f - Sa11.f;
-  Sch.f = std::max(Sch.f, Sa11.f);
-  Sch.f = std::max(Sch.f, Ssmall_number.f);
-  Stmp5.ui = (Sa11.f >= Stmp5.f) ? 0xffffffff : 0;
-
-  Stmp1.f = Sch.f * Sch.f;
-  Stmp2.f = Ssh.f * Ssh.f;
-  Stmp2.f = Stmp1.f + Stmp2.f;
-  Stmp1.f = rsqrt(Stmp2.f);
-
-  Stmp4.f = Stmp1.f * Sone_half.f;
-  Stmp3.f = Stmp1.f * Stmp4.f;
-  Stmp3.f = Stmp1.f * Stmp3.f;
-  Stmp3.f = Stmp2.f * Stmp3.f;
-  Stmp1.f = Stmp1.f + Stmp4.f;
-  Stmp1.f = Stmp1.f - Stmp3.f;
-  Stmp1.f = Stmp1.f * Stmp2.f;
-
-  Sch.f = Sch.f + Stmp1.f;
-
-  Stmp1.ui = ~Stmp5.ui & Ssh.ui;
-  Stmp2.ui = ~Stmp5.ui & Sch.ui;
-  Sch.ui = Stmp5.ui & Sch.ui;
-  Ssh.ui = Stmp5.ui & Ssh.ui;
-  Sch.ui = Sch.ui | Stmp1.ui;
-  Ssh.ui = Ssh.ui | Stmp2.ui;
-
-  Stmp1.f = Sch.f * Sch.f;
-  Stmp2.f = Ssh.f * Ssh.f;
-  Stmp2.f = Stmp1.f + Stmp2.f;
-  Stmp1.f = rsqrt(Stmp2.f);
-
-  Stmp4.f = Stmp1.f * Sone_half.f;
-  Stmp3.f = Stmp1.f * Stmp4.f;
-  Stmp3.f = Stmp1.f * Stmp3.f;
-  Stmp3.f = Stmp2.f * Stmp3.f;
-  Stmp1.f = Stmp1.f + Stmp4.f;
-  Stmp1.f = Stmp1.f - Stmp3.f;
-
-  Sch.f = Sch.f * Stmp1.f;
-  Ssh.f = Ssh.f * Stmp1.f;
-
-  Sc.f = Sch.f * Sch.f;
-  Ss.f = Ssh.f * Ssh.f;
-  Sc.f = Sc.f - Ss.f;
-  Ss.f = Ssh.f * Sch.f;
-  Ss.f = Ss.f + Ss.f;
-
-  Stmp1.f = Ss.f * Sa11.f;
-  Stmp2.f = Ss.f * Sa21.f;
-  Sa11.f = Sc.f * Sa11.f;
-  Sa21.f = Sc.f * Sa21.f;
-  Sa11.f = Sa11.f + Stmp2.f;
-  Sa21.f = Sa21.f - Stmp1.f;
-
-  Stmp1.f = Ss.f * Sa12.f;
-  Stmp2.f = Ss.f * Sa22.f;
-  Sa12.f = Sc.f * Sa12.f;
-  Sa22.f = Sc.f * Sa22.f;
-  Sa12.f = Sa12.f + Stmp2.f;
-  Sa22.f = Sa22.f - Stmp1.f;
-
-  Stmp1.f = Ss.f * Sa13.f;
-  Stmp2.f = Ss.f * Sa23.f;
-  Sa13.f = Sc.f * Sa13.f;
-  Sa23.f = Sc.f * Sa23.f;
-  Sa13.f = Sa13.f + Stmp2.f;
-  Sa23.f = Sa23.f - Stmp1.f;
-
-  Stmp1.f = Ss.f * Su11.f;
-  Stmp2.f = Ss.f * Su12.f;
-  Su11.f = Sc.f * Su11.f;
-  Su12.f = Sc.f * Su12.f;
-  Su11.f = Su11.f + Stmp2.f;
-  Su12.f = Su12.f - Stmp1.f;
-
-  Stmp1.f = Ss.f * Su21.f;
-  Stmp2.f = Ss.f * Su22.f;
-  Su21.f = Sc.f * Su21.f;
-  Su22.f = Sc.f * Su22.f;
-  Su21.f = Su21.f + Stmp2.f;
-  Su22.f = Su22.f - Stmp1.f;
-
-  Stmp1.f = Ss.f * Su31.f;
-  Stmp2.f = Ss.f * Su32.f;
-  Su31.f = Sc.f * Su31.f;
-  Su32.f = Sc.f * Su32.f;
-  Su31.f = Su31.f + Stmp2.f;
-  Su32.f = Su32.f - Stmp1.f;
-  Ssh.f = Sa31.f * Sa31.f;
-  Ssh.ui = (Ssh.f >= Ssmall_number.f) ? 0xffffffff : 0;
-
-  Ssh.ui = Ssh.ui & Sa31.ui;
-
-  Stmp5.f = 0.0f;
-  Sch.f = Stmp5.f - Sa11.f;
-  Sch.f = std::max(Sch.f, Sa11.f);
-  Sch.f = std::max(Sch.f, Ssmall_number.f);
-  Stmp5.ui = (Sa11.f >= Stmp5.f) ? 0xffffffff : 0;
-
-  Stmp1.f = Sch.f * Sch.f;
-  Stmp2.f = Ssh.f * Ssh.f;
-  Stmp2.f = Stmp1.f + Stmp2.f;
-  Stmp1.f = rsqrt(Stmp2.f);
-
-  Stmp4.f = Stmp1.f * Sone_half.f;
-  Stmp3.f = Stmp1.f * Stmp4.f;
-  Stmp3.f = Stmp1.f * Stmp3.f;
-  Stmp3.f = Stmp2.f * Stmp3.f;
-  Stmp1.f = Stmp1.f + Stmp4.f;
-  Stmp1.f = Stmp1.f - Stmp3.f;
-  Stmp1.f = Stmp1.f * Stmp2.f;
-
-  Sch.f = Sch.f + Stmp1.f;
-
-  Stmp1.ui = ~Stmp5.ui & Ssh.ui;
-  Stmp2.ui = ~Stmp5.ui & Sch.ui;
-  Sch.ui = Stmp5.ui & Sch.ui;
-  Ssh.ui = Stmp5.ui & Ssh.ui;
-  Sch.ui = Sch.ui | Stmp1.ui;
-  Ssh.ui = Ssh.ui | Stmp2.ui;
-
-  Stmp1.f = Sch.f * Sch.f;
-  Stmp2.f = Ssh.f * Ssh.f;
-  Stmp2.f = Stmp1.f + Stmp2.f;
-  Stmp1.f = rsqrt(Stmp2.f);
-
-  Stmp4.f = Stmp1.f * Sone_half.f;
-  Stmp3.f = Stmp1.f * Stmp4.f;
-  Stmp3.f = Stmp1.f * Stmp3.f;
-  Stmp3.f = Stmp2.f * Stmp3.f;
-  Stmp1.f = Stmp1.f + Stmp4.f;
-  Stmp1.f = Stmp1.f - Stmp3.f;
-
-  Sch.f = Sch.f * Stmp1.f;
-  Ssh.f = Ssh.f * Stmp1.f;
-
-  Sc.f = Sch.f * Sch.f;
-  Ss.f = Ssh.f * Ssh.f;
-  Sc.f = Sc.f - Ss.f;
-  Ss.f = Ssh.f * Sch.f;
-  Ss.f = Ss.f + Ss.f;
-
-  Stmp1.f = Ss.f * Sa11.f;
-  Stmp2.f = Ss.f * Sa31.f;
-  Sa11.f = Sc.f * Sa11.f;
-  Sa31.f = Sc.f * Sa31.f;
-  Sa11.f = Sa11.f + Stmp2.f;
-  Sa31.f = Sa31.f - Stmp1.f;
-
-  Stmp1.f = Ss.f * Sa12.f;
-  Stmp2.f = Ss.f * Sa32.f;
-  Sa12.f = Sc.f * Sa12.f;
-  Sa32.f = Sc.f * Sa32.f;
-  Sa12.f = Sa12.f + Stmp2.f;
-  Sa32.f = Sa32.f - Stmp1.f;
-
-  Stmp1.f = Ss.f * Sa13.f;
-  Stmp2.f = Ss.f * Sa33.f;
-  Sa13.f = Sc.f * Sa13.f;
-  Sa33.f = Sc.f * Sa33.f;
-  Sa13.f = Sa13.f + Stmp2.f;
-  Sa33.f = Sa33.f - Stmp1.f;
-
-  Stmp1.f = Ss.f * Su11.f;
-  Stmp2.f = Ss.f * Su13.f;
-  Su11.f = Sc.f * Su11.f;
-  Su13.f = Sc.f * Su13.f;
-  Su11.f = Su11.f + Stmp2.f;
-  Su13.f = Su13.f - Stmp1.f;
-
-  Stmp1.f = Ss.f * Su21.f;
-  Stmp2.f = Ss.f * Su23.f;
-  Su21.f = Sc.f * Su21.f;
-  Su23.f = Sc.f * Su23.f;
-  Su21.f = Su21.f + Stmp2.f;
-  Su23.f = Su23.f - Stmp1.f;
-
-  Stmp1.f = Ss.f * Su31.f;
-  Stmp2.f = Ss.f * Su33.f;
-  Su31.f = Sc.f * Su31.f;
-  Su33.f = Sc.f * Su33.f;
-  Su31.f = Su31.f + Stmp2.f;
-  Su33.f = Su33.f - Stmp1.f;
-  Ssh.f = Sa32.f * Sa32.f;
-  Ssh.ui = (Ssh.f >= Ssmall_number.f) ? 0xffffffff : 0;
-
-  Ssh.ui = Ssh.ui & Sa32.ui;
-
-  Stmp5.f = 0.0f;
-  Sch.f = Stmp5.f - Sa22.f;
-  Sch.f = std::max(Sch.f, Sa22.f);
-  Sch.f = std::max(Sch.f, Ssmall_number.f);
-  Stmp5.ui = (Sa22.f >= Stmp5.f) ? 0xffffffff : 0;
-
-  Stmp1.f = Sch.f * Sch.f;
-  Stmp2.f = Ssh.f * Ssh.f;
-  Stmp2.f = Stmp1.f + Stmp2.f;
-  Stmp1.f = rsqrt(Stmp2.f);
-
-  Stmp4.f = Stmp1.f * Sone_half.f;
-  Stmp3.f = Stmp1.f * Stmp4.f;
-  Stmp3.f = Stmp1.f * Stmp3.f;
-  Stmp3.f = Stmp2.f * Stmp3.f;
-  Stmp1.f = Stmp1.f + Stmp4.f;
-  Stmp1.f = Stmp1.f - Stmp3.f;
-  Stmp1.f = Stmp1.f * Stmp2.f;
-
-  Sch.f = Sch.f + Stmp1.f;
-
-  Stmp1.ui = ~Stmp5.ui & Ssh.ui;
-  Stmp2.ui = ~Stmp5.ui & Sch.ui;
-  Sch.ui = Stmp5.ui & Sch.ui;
-  Ssh.ui = Stmp5.ui & Ssh.ui;
-  Sch.ui = Sch.ui | Stmp1.ui;
-  Ssh.ui = Ssh.ui | Stmp2.ui;
-
-  Stmp1.f = Sch.f * Sch.f;
-  Stmp2.f = Ssh.f * Ssh.f;
-  Stmp2.f = Stmp1.f + Stmp2.f;
-  Stmp1.f = rsqrt(Stmp2.f);
-
-  Stmp4.f = Stmp1.f * Sone_half.f;
-  Stmp3.f = Stmp1.f * Stmp4.f;
-  Stmp3.f = Stmp1.f * Stmp3.f;
-  Stmp3.f = Stmp2.f * Stmp3.f;
-  Stmp1.f = Stmp1.f + Stmp4.f;
-  Stmp1.f = Stmp1.f - Stmp3.f;
-
-  Sch.f = Sch.f * Stmp1.f;
-  Ssh.f = Ssh.f * Stmp1.f;
-
-  Sc.f = Sch.f * Sch.f;
-  Ss.f = Ssh.f * Ssh.f;
-  Sc.f = Sc.f - Ss.f;
-  Ss.f = Ssh.f * Sch.f;
-  Ss.f = Ss.f + Ss.f;
-
-  Stmp1.f = Ss.f * Sa21.f;
-  Stmp2.f = Ss.f * Sa31.f;
-  Sa21.f = Sc.f * Sa21.f;
-  Sa31.f = Sc.f * Sa31.f;
-  Sa21.f = Sa21.f + Stmp2.f;
-  Sa31.f = Sa31.f - Stmp1.f;
-
-  Stmp1.f = Ss.f * Sa22.f;
-  Stmp2.f = Ss.f * Sa32.f;
-  Sa22.f = Sc.f * Sa22.f;
-  Sa32.f = Sc.f * Sa32.f;
-  Sa22.f = Sa22.f + Stmp2.f;
-  Sa32.f = Sa32.f - Stmp1.f;
-
-  Stmp1.f = Ss.f * Sa23.f;
-  Stmp2.f = Ss.f * Sa33.f;
-  Sa23.f = Sc.f * Sa23.f;
-  Sa33.f = Sc.f * Sa33.f;
-  Sa23.f = Sa23.f + Stmp2.f;
-  Sa33.f = Sa33.f - Stmp1.f;
-
-  Stmp1.f = Ss.f * Su12.f;
-  Stmp2.f = Ss.f * Su13.f;
-  Su12.f = Sc.f * Su12.f;
-  Su13.f = Sc.f * Su13.f;
-  Su12.f = Su12.f + Stmp2.f;
-  Su13.f = Su13.f - Stmp1.f;
-
-  Stmp1.f = Ss.f * Su22.f;
-  Stmp2.f = Ss.f * Su23.f;
-  Su22.f = Sc.f * Su22.f;
-  Su23.f = Sc.f * Su23.f;
-  Su22.f = Su22.f + Stmp2.f;
-  Su23.f = Su23.f - Stmp1.f;
-
-  Stmp1.f = Ss.f * Su32.f;
-  Stmp2.f = Ss.f * Su33.f;
-  Su32.f = Sc.f * Su32.f;
-  Su33.f = Sc.f * Su33.f;
-  Su32.f = Su32.f + Stmp2.f;
-  Su33.f = Su33.f - Stmp1.f;
+  Stmp2 = mul(Sqvs, Sqvs);
+  Stmp1 = mul(Sqvvx, Sqvvx);
+  Stmp2 = add(Stmp1, Stmp2);
+  Stmp1 = mul(Sqvvy, Sqvvy);
+  Stmp2 = add(Stmp1, Stmp2);
+  Stmp1 = mul(Sqvvz, Sqvvz);
+  Stmp2 = add(Stmp1, Stmp2);
+
+  Stmp1 = rsqrt(Stmp2);
+  Stmp4 = mul(Stmp1, Sone_half);
+  Stmp3 = mul(Stmp1, Stmp4);
+  Stmp3 = mul(Stmp1, Stmp3);
+  Stmp3 = mul(Stmp2, Stmp3);
+  Stmp1 = add(Stmp1, Stmp4);
+  Stmp1 = sub(Stmp1, Stmp3);
+
+  Sqvs = mul(Sqvs, Stmp1);
+  Sqvvx = mul(Sqvvx, Stmp1);
+  Sqvvy = mul(Sqvvy, Stmp1);
+  Sqvvz = mul(Sqvvz, Stmp1);
+
+  Stmp1 = mul(Sqvvx, Sqvvx);
+  Stmp2 = mul(Sqvvy, Sqvvy);
+  Stmp3 = mul(Sqvvz, Sqvvz);
+  Sv11 = mul(Sqvs, Sqvs);
+  Sv22 = sub(Sv11, Stmp1);
+  Sv33 = sub(Sv22, Stmp2);
+  Sv33 = add(Sv33, Stmp3);
+  Sv22 = add(Sv22, Stmp2);
+  Sv22 = sub(Sv22, Stmp3);
+  Sv11 = add(Sv11, Stmp1);
+  Sv11 = sub(Sv11, Stmp2);
+  Sv11 = sub(Sv11, Stmp3);
+  Stmp1 = add(Sqvvx, Sqvvx);
+  Stmp2 = add(Sqvvy, Sqvvy);
+  Stmp3 = add(Sqvvz, Sqvvz);
+  Sv32 = mul(Sqvs, Stmp1);
+  Sv13 = mul(Sqvs, Stmp2);
+  Sv21 = mul(Sqvs, Stmp3);
+  Stmp1 = mul(Sqvvy, Stmp1);
+  Stmp2 = mul(Sqvvz, Stmp2);
+  Stmp3 = mul(Sqvvx, Stmp3);
+  Sv12 = sub(Stmp1, Sv21);
+  Sv23 = sub(Stmp2, Sv32);
+  Sv31 = sub(Stmp3, Sv13);
+  Sv21 = add(Stmp1, Sv21);
+  Sv32 = add(Stmp2, Sv32);
+  Sv13 = add(Stmp3, Sv13);
+  Stmp2 = Sa12;
+  Stmp3 = Sa13;
+  Sa12 = mul(Sv12, Sa11);
+  Sa13 = mul(Sv13, Sa11);
+  Sa11 = mul(Sv11, Sa11);
+  Stmp1 = mul(Sv21, Stmp2);
+  Sa11 = add(Sa11, Stmp1);
+  Stmp1 = mul(Sv31, Stmp3);
+  Sa11 = add(Sa11, Stmp1);
+  Stmp1 = mul(Sv22, Stmp2);
+  Sa12 = add(Sa12, Stmp1);
+  Stmp1 = mul(Sv32, Stmp3);
+  Sa12 = add(Sa12, Stmp1);
+  Stmp1 = mul(Sv23, Stmp2);
+  Sa13 = add(Sa13, Stmp1);
+  Stmp1 = mul(Sv33, Stmp3);
+  Sa13 = add(Sa13, Stmp1);
+
+  Stmp2 = Sa22;
+  Stmp3 = Sa23;
+  Sa22 = mul(Sv12, Sa21);
+  Sa23 = mul(Sv13, Sa21);
+  Sa21 = mul(Sv11, Sa21);
+  Stmp1 = mul(Sv21, Stmp2);
+  Sa21 = add(Sa21, Stmp1);
+  Stmp1 = mul(Sv31, Stmp3);
+  Sa21 = add(Sa21, Stmp1);
+  Stmp1 = mul(Sv22, Stmp2);
+  Sa22 = add(Sa22, Stmp1);
+  Stmp1 = mul(Sv32, Stmp3);
+  Sa22 = add(Sa22, Stmp1);
+  Stmp1 = mul(Sv23, Stmp2);
+  Sa23 = add(Sa23, Stmp1);
+  Stmp1 = mul(Sv33, Stmp3);
+  Sa23 = add(Sa23, Stmp1);
+
+  Stmp2 = Sa32;
+  Stmp3 = Sa33;
+  Sa32 = mul(Sv12, Sa31);
+  Sa33 = mul(Sv13, Sa31);
+  Sa31 = mul(Sv11, Sa31);
+  Stmp1 = mul(Sv21, Stmp2);
+  Sa31 = add(Sa31, Stmp1);
+  Stmp1 = mul(Sv31, Stmp3);
+  Sa31 = add(Sa31, Stmp1);
+  Stmp1 = mul(Sv22, Stmp2);
+  Sa32 = add(Sa32, Stmp1);
+  Stmp1 = mul(Sv32, Stmp3);
+  Sa32 = add(Sa32, Stmp1);
+  Stmp1 = mul(Sv23, Stmp2);
+  Sa33 = add(Sa33, Stmp1);
+  Stmp1 = mul(Sv33, Stmp3);
+  Sa33 = add(Sa33, Stmp1);
+
+  Stmp1 = mul(Sa11, Sa11);
+  Stmp4 = mul(Sa21, Sa21);
+  Stmp1 = add(Stmp1, Stmp4);
+  Stmp4 = mul(Sa31, Sa31);
+  Stmp1 = add(Stmp1, Stmp4);
+
+  Stmp2 = mul(Sa12, Sa12);
+  Stmp4 = mul(Sa22, Sa22);
+  Stmp2 = add(Stmp2, Stmp4);
+  Stmp4 = mul(Sa32, Sa32);
+  Stmp2 = add(Stmp2, Stmp4);
+
+  Stmp3 = mul(Sa13, Sa13);
+  Stmp4 = mul(Sa23, Sa23);
+  Stmp3 = add(Stmp3, Stmp4);
+  Stmp4 = mul(Sa33, Sa33);
+  Stmp3 = add(Stmp3, Stmp4);
+
+  Stmp4 = lt(Stmp1, Stmp2);
+
+  Stmp5 = bit_xor(Sa11, Sa12);
+  Stmp5 = bit_and(Stmp5, Stmp4);
+  Sa11 = bit_xor(Sa11, Stmp5);
+  Sa12 = bit_xor(Sa12, Stmp5);
+
+  Stmp5 = bit_xor(Sa21, Sa22);
+  Stmp5 = bit_and(Stmp5, Stmp4);
+  Sa21 = bit_xor(Sa21, Stmp5);
+  Sa22 = bit_xor(Sa22, Stmp5);
+
+  Stmp5 = bit_xor(Sa31, Sa32);
+  Stmp5 = bit_and(Stmp5, Stmp4);
+  Sa31 = bit_xor(Sa31, Stmp5);
+  Sa32 = bit_xor(Sa32, Stmp5);
+
+  Stmp5 = bit_xor(Sv11, Sv12);
+  Stmp5 = bit_and(Stmp5, Stmp4);
+  Sv11 = bit_xor(Sv11, Stmp5);
+  Sv12 = bit_xor(Sv12, Stmp5);
+
+  Stmp5 = bit_xor(Sv21, Sv22);
+  Stmp5 = bit_and(Stmp5, Stmp4);
+  Sv21 = bit_xor(Sv21, Stmp5);
+  Sv22 = bit_xor(Sv22, Stmp5);
+
+  Stmp5 = bit_xor(Sv31, Sv32);
+  Stmp5 = bit_and(Stmp5, Stmp4);
+  Sv31 = bit_xor(Sv31, Stmp5);
+  Sv32 = bit_xor(Sv32, Stmp5);
+
+  Stmp5 = bit_xor(Stmp1, Stmp2);
+  Stmp5 = bit_and(Stmp5, Stmp4);
+  Stmp1 = bit_xor(Stmp1, Stmp5);
+  Stmp2 = bit_xor(Stmp2, Stmp5);
+
+  Stmp5 = splat<F>(-2.0f);
+  Stmp5 = bit_and(Stmp5, Stmp4);
+  Stmp4 = splat<F>(1.0f);
+  Stmp4 = add(Stmp4, Stmp5);
+
+  Sa12 = mul(Sa12, Stmp4);
+  Sa22 = mul(Sa22, Stmp4);
+  Sa32 = mul(Sa32, Stmp4);
+
+  Sv12 = mul(Sv12, Stmp4);
+  Sv22 = mul(Sv22, Stmp4);
+  Sv32 = mul(Sv32, Stmp4);
+  Stmp4 = lt(Stmp1, Stmp3);
+
+  Stmp5 = bit_xor(Sa11, Sa13);
+  Stmp5 = bit_and(Stmp5, Stmp4);
+  Sa11 = bit_xor(Sa11, Stmp5);
+  Sa13 = bit_xor(Sa13, Stmp5);
+
+  Stmp5 = bit_xor(Sa21, Sa23);
+  Stmp5 = bit_and(Stmp5, Stmp4);
+  Sa21 = bit_xor(Sa21, Stmp5);
+  Sa23 = bit_xor(Sa23, Stmp5);
+
+  Stmp5 = bit_xor(Sa31, Sa33);
+  Stmp5 = bit_and(Stmp5, Stmp4);
+  Sa31 = bit_xor(Sa31, Stmp5);
+  Sa33 = bit_xor(Sa33, Stmp5);
+
+  Stmp5 = bit_xor(Sv11, Sv13);
+  Stmp5 = bit_and(Stmp5, Stmp4);
+  Sv11 = bit_xor(Sv11, Stmp5);
+  Sv13 = bit_xor(Sv13, Stmp5);
+
+  Stmp5 = bit_xor(Sv21, Sv23);
+  Stmp5 = bit_and(Stmp5, Stmp4);
+  Sv21 = bit_xor(Sv21, Stmp5);
+  Sv23 = bit_xor(Sv23, Stmp5);
+
+  Stmp5 = bit_xor(Sv31, Sv33);
+  Stmp5 = bit_and(Stmp5, Stmp4);
+  Sv31 = bit_xor(Sv31, Stmp5);
+  Sv33 = bit_xor(Sv33, Stmp5);
+
+  Stmp5 = bit_xor(Stmp1, Stmp3);
+  Stmp5 = bit_and(Stmp5, Stmp4);
+  Stmp1 = bit_xor(Stmp1, Stmp5);
+  Stmp3 = bit_xor(Stmp3, Stmp5);
+
+  Stmp5 = splat<F>(-2.0f);
+  Stmp5 = bit_and(Stmp5, Stmp4);
+  Stmp4 = splat<F>(1.0f);
+  Stmp4 = add(Stmp4, Stmp5);
+
+  Sa11 = mul(Sa11, Stmp4);
+  Sa21 = mul(Sa21, Stmp4);
+  Sa31 = mul(Sa31, Stmp4);
+
+  Sv11 = mul(Sv11, Stmp4);
+  Sv21 = mul(Sv21, Stmp4);
+  Sv31 = mul(Sv31, Stmp4);
+  Stmp4 = lt(Stmp2, Stmp3);
+
+  Stmp5 = bit_xor(Sa12, Sa13);
+  Stmp5 = bit_and(Stmp5, Stmp4);
+  Sa12 = bit_xor(Sa12, Stmp5);
+  Sa13 = bit_xor(Sa13, Stmp5);
+
+  Stmp5 = bit_xor(Sa22, Sa23);
+  Stmp5 = bit_and(Stmp5, Stmp4);
+  Sa22 = bit_xor(Sa22, Stmp5);
+  Sa23 = bit_xor(Sa23, Stmp5);
+
+  Stmp5 = bit_xor(Sa32, Sa33);
+  Stmp5 = bit_and(Stmp5, Stmp4);
+  Sa32 = bit_xor(Sa32, Stmp5);
+  Sa33 = bit_xor(Sa33, Stmp5);
+
+  Stmp5 = bit_xor(Sv12, Sv13);
+  Stmp5 = bit_and(Stmp5, Stmp4);
+  Sv12 = bit_xor(Sv12, Stmp5);
+  Sv13 = bit_xor(Sv13, Stmp5);
+
+  Stmp5 = bit_xor(Sv22, Sv23);
+  Stmp5 = bit_and(Stmp5, Stmp4);
+  Sv22 = bit_xor(Sv22, Stmp5);
+  Sv23 = bit_xor(Sv23, Stmp5);
+
+  Stmp5 = bit_xor(Sv32, Sv33);
+  Stmp5 = bit_and(Stmp5, Stmp4);
+  Sv32 = bit_xor(Sv32, Stmp5);
+  Sv33 = bit_xor(Sv33, Stmp5);
+
+  Stmp5 = bit_xor(Stmp2, Stmp3);
+  Stmp5 = bit_and(Stmp5, Stmp4);
+  Stmp2 = bit_xor(Stmp2, Stmp5);
+  Stmp3 = bit_xor(Stmp3, Stmp5);
+
+  Stmp5 = splat<F>(-2.0f);
+  Stmp5 = bit_and(Stmp5, Stmp4);
+  Stmp4 = splat<F>(1.0f);
+  Stmp4 = add(Stmp4, Stmp5);
+
+  Sa13 = mul(Sa13, Stmp4);
+  Sa23 = mul(Sa23, Stmp4);
+  Sa33 = mul(Sa33, Stmp4);
+
+  Sv13 = mul(Sv13, Stmp4);
+  Sv23 = mul(Sv23, Stmp4);
+  Sv33 = mul(Sv33, Stmp4);
+  Su11 = splat<F>(1.0f);
+  Su21 = splat<F>(0.0f);
+  Su31 = splat<F>(0.0f);
+  Su12 = splat<F>(0.0f);
+  Su22 = splat<F>(1.0f);
+  Su32 = splat<F>(0.0f);
+  Su13 = splat<F>(0.0f);
+  Su23 = splat<F>(0.0f);
+  Su33 = splat<F>(1.0f);
+  Ssh = mul(Sa21, Sa21);
+  Ssh = ge(Ssh, Ssmall_number);
+
+  Ssh = bit_and(Ssh, Sa21);
+
+  Stmp5 = splat<F>(0.0f);
+  Sch = sub(Stmp5, Sa11);
+  Sch = max(Sch, Sa11);
+  Sch = max(Sch, Ssmall_number);
+  Stmp5 = ge(Sa11, Stmp5);
+
+  Stmp1 = mul(Sch, Sch);
+  Stmp2 = mul(Ssh, Ssh);
+  Stmp2 = add(Stmp1, Stmp2);
+  Stmp1 = rsqrt(Stmp2);
+
+  Stmp4 = mul(Stmp1, Sone_half);
+  Stmp3 = mul(Stmp1, Stmp4);
+  Stmp3 = mul(Stmp1, Stmp3);
+  Stmp3 = mul(Stmp2, Stmp3);
+  Stmp1 = add(Stmp1, Stmp4);
+  Stmp1 = sub(Stmp1, Stmp3);
+  Stmp1 = mul(Stmp1, Stmp2);
+
+  Sch = add(Sch, Stmp1);
+
+  Stmp1 = and_not(Stmp5, Ssh);
+  Stmp2 = and_not(Stmp5, Sch);
+  Sch = bit_and(Stmp5, Sch);
+  Ssh = bit_and(Stmp5, Ssh);
+  Sch = bit_or(Sch, Stmp1);
+  Ssh = bit_or(Ssh, Stmp2);
+
+  Stmp1 = mul(Sch, Sch);
+  Stmp2 = mul(Ssh, Ssh);
+  Stmp2 = add(Stmp1, Stmp2);
+  Stmp1 = rsqrt(Stmp2);
+
+  Stmp4 = mul(Stmp1, Sone_half);
+  Stmp3 = mul(Stmp1, Stmp4);
+  Stmp3 = mul(Stmp1, Stmp3);
+  Stmp3 = mul(Stmp2, Stmp3);
+  Stmp1 = add(Stmp1, Stmp4);
+  Stmp1 = sub(Stmp1, Stmp3);
+
+  Sch = mul(Sch, Stmp1);
+  Ssh = mul(Ssh, Stmp1);
+
+  Sc = mul(Sch, Sch);
+  Ss = mul(Ssh, Ssh);
+  Sc = sub(Sc, Ss);
+  Ss = mul(Ssh, Sch);
+  Ss = add(Ss, Ss);
+
+  Stmp1 = mul(Ss, Sa11);
+  Stmp2 = mul(Ss, Sa21);
+  Sa11 = mul(Sc, Sa11);
+  Sa21 = mul(Sc, Sa21);
+  Sa11 = add(Sa11, Stmp2);
+  Sa21 = sub(Sa21, Stmp1);
+
+  Stmp1 = mul(Ss, Sa12);
+  Stmp2 = mul(Ss, Sa22);
+  Sa12 = mul(Sc, Sa12);
+  Sa22 = mul(Sc, Sa22);
+  Sa12 = add(Sa12, Stmp2);
+  Sa22 = sub(Sa22, Stmp1);
+
+  Stmp1 = mul(Ss, Sa13);
+  Stmp2 = mul(Ss, Sa23);
+  Sa13 = mul(Sc, Sa13);
+  Sa23 = mul(Sc, Sa23);
+  Sa13 = add(Sa13, Stmp2);
+  Sa23 = sub(Sa23, Stmp1);
+
+  Stmp1 = mul(Ss, Su11);
+  Stmp2 = mul(Ss, Su12);
+  Su11 = mul(Sc, Su11);
+  Su12 = mul(Sc, Su12);
+  Su11 = add(Su11, Stmp2);
+  Su12 = sub(Su12, Stmp1);
+
+  Stmp1 = mul(Ss, Su21);
+  Stmp2 = mul(Ss, Su22);
+  Su21 = mul(Sc, Su21);
+  Su22 = mul(Sc, Su22);
+  Su21 = add(Su21, Stmp2);
+  Su22 = sub(Su22, Stmp1);
+
+  Stmp1 = mul(Ss, Su31);
+  Stmp2 = mul(Ss, Su32);
+  Su31 = mul(Sc, Su31);
+  Su32 = mul(Sc, Su32);
+  Su31 = add(Su31, Stmp2);
+  Su32 = sub(Su32, Stmp1);
+  Ssh = mul(Sa31, Sa31);
+  Ssh = ge(Ssh, Ssmall_number);
+
+  Ssh = bit_and(Ssh, Sa31);
+
+  Stmp5 = splat<F>(0.0f);
+  Sch = sub(Stmp5, Sa11);
+  Sch = max(Sch, Sa11);
+  Sch = max(Sch, Ssmall_number);
+  Stmp5 = ge(Sa11, Stmp5);
+
+  Stmp1 = mul(Sch, Sch);
+  Stmp2 = mul(Ssh, Ssh);
+  Stmp2 = add(Stmp1, Stmp2);
+  Stmp1 = rsqrt(Stmp2);
+
+  Stmp4 = mul(Stmp1, Sone_half);
+  Stmp3 = mul(Stmp1, Stmp4);
+  Stmp3 = mul(Stmp1, Stmp3);
+  Stmp3 = mul(Stmp2, Stmp3);
+  Stmp1 = add(Stmp1, Stmp4);
+  Stmp1 = sub(Stmp1, Stmp3);
+  Stmp1 = mul(Stmp1, Stmp2);
+
+  Sch = add(Sch, Stmp1);
+
+  Stmp1 = and_not(Stmp5, Ssh);
+  Stmp2 = and_not(Stmp5, Sch);
+  Sch = bit_and(Stmp5, Sch);
+  Ssh = bit_and(Stmp5, Ssh);
+  Sch = bit_or(Sch, Stmp1);
+  Ssh = bit_or(Ssh, Stmp2);
+
+  Stmp1 = mul(Sch, Sch);
+  Stmp2 = mul(Ssh, Ssh);
+  Stmp2 = add(Stmp1, Stmp2);
+  Stmp1 = rsqrt(Stmp2);
+
+  Stmp4 = mul(Stmp1, Sone_half);
+  Stmp3 = mul(Stmp1, Stmp4);
+  Stmp3 = mul(Stmp1, Stmp3);
+  Stmp3 = mul(Stmp2, Stmp3);
+  Stmp1 = add(Stmp1, Stmp4);
+  Stmp1 = sub(Stmp1, Stmp3);
+
+  Sch = mul(Sch, Stmp1);
+  Ssh = mul(Ssh, Stmp1);
+
+  Sc = mul(Sch, Sch);
+  Ss = mul(Ssh, Ssh);
+  Sc = sub(Sc, Ss);
+  Ss = mul(Ssh, Sch);
+  Ss = add(Ss, Ss);
+
+  Stmp1 = mul(Ss, Sa11);
+  Stmp2 = mul(Ss, Sa31);
+  Sa11 = mul(Sc, Sa11);
+  Sa31 = mul(Sc, Sa31);
+  Sa11 = add(Sa11, Stmp2);
+  Sa31 = sub(Sa31, Stmp1);
+
+  Stmp1 = mul(Ss, Sa12);
+  Stmp2 = mul(Ss, Sa32);
+  Sa12 = mul(Sc, Sa12);
+  Sa32 = mul(Sc, Sa32);
+  Sa12 = add(Sa12, Stmp2);
+  Sa32 = sub(Sa32, Stmp1);
+
+  Stmp1 = mul(Ss, Sa13);
+  Stmp2 = mul(Ss, Sa33);
+  Sa13 = mul(Sc, Sa13);
+  Sa33 = mul(Sc, Sa33);
+  Sa13 = add(Sa13, Stmp2);
+  Sa33 = sub(Sa33, Stmp1);
+
+  Stmp1 = mul(Ss, Su11);
+  Stmp2 = mul(Ss, Su13);
+  Su11 = mul(Sc, Su11);
+  Su13 = mul(Sc, Su13);
+  Su11 = add(Su11, Stmp2);
+  Su13 = sub(Su13, Stmp1);
+
+  Stmp1 = mul(Ss, Su21);
+  Stmp2 = mul(Ss, Su23);
+  Su21 = mul(Sc, Su21);
+  Su23 = mul(Sc, Su23);
+  Su21 = add(Su21, Stmp2);
+  Su23 = sub(Su23, Stmp1);
+
+  Stmp1 = mul(Ss, Su31);
+  Stmp2 = mul(Ss, Su33);
+  Su31 = mul(Sc, Su31);
+  Su33 = mul(Sc, Su33);
+  Su31 = add(Su31, Stmp2);
+  Su33 = sub(Su33, Stmp1);
+  Ssh = mul(Sa32, Sa32);
+  Ssh = ge(Ssh, Ssmall_number);
+
+  Ssh = bit_and(Ssh, Sa32);
+
+  Stmp5 = splat<F>(0.0f);
+  Sch = sub(Stmp5, Sa22);
+  Sch = max(Sch, Sa22);
+  Sch = max(Sch, Ssmall_number);
+  Stmp5 = ge(Sa22, Stmp5);
+
+  Stmp1 = mul(Sch, Sch);
+  Stmp2 = mul(Ssh, Ssh);
+  Stmp2 = add(Stmp1, Stmp2);
+  Stmp1 = rsqrt(Stmp2);
+
+  Stmp4 = mul(Stmp1, Sone_half);
+  Stmp3 = mul(Stmp1, Stmp4);
+  Stmp3 = mul(Stmp1, Stmp3);
+  Stmp3 = mul(Stmp2, Stmp3);
+  Stmp1 = add(Stmp1, Stmp4);
+  Stmp1 = sub(Stmp1, Stmp3);
+  Stmp1 = mul(Stmp1, Stmp2);
+
+  Sch = add(Sch, Stmp1);
+
+  Stmp1 = and_not(Stmp5, Ssh);
+  Stmp2 = and_not(Stmp5, Sch);
+  Sch = bit_and(Stmp5, Sch);
+  Ssh = bit_and(Stmp5, Ssh);
+  Sch = bit_or(Sch, Stmp1);
+  Ssh = bit_or(Ssh, Stmp2);
+
+  Stmp1 = mul(Sch, Sch);
+  Stmp2 = mul(Ssh, Ssh);
+  Stmp2 = add(Stmp1, Stmp2);
+  Stmp1 = rsqrt(Stmp2);
+
+  Stmp4 = mul(Stmp1, Sone_half);
+  Stmp3 = mul(Stmp1, Stmp4);
+  Stmp3 = mul(Stmp1, Stmp3);
+  Stmp3 = mul(Stmp2, Stmp3);
+  Stmp1 = add(Stmp1, Stmp4);
+  Stmp1 = sub(Stmp1, Stmp3);
+
+  Sch = mul(Sch, Stmp1);
+  Ssh = mul(Ssh, Stmp1);
+
+  Sc = mul(Sch, Sch);
+  Ss = mul(Ssh, Ssh);
+  Sc = sub(Sc, Ss);
+  Ss = mul(Ssh, Sch);
+  Ss = add(Ss, Ss);
+
+  Stmp1 = mul(Ss, Sa21);
+  Stmp2 = mul(Ss, Sa31);
+  Sa21 = mul(Sc, Sa21);
+  Sa31 = mul(Sc, Sa31);
+  Sa21 = add(Sa21, Stmp2);
+  Sa31 = sub(Sa31, Stmp1);
+
+  Stmp1 = mul(Ss, Sa22);
+  Stmp2 = mul(Ss, Sa32);
+  Sa22 = mul(Sc, Sa22);
+  Sa32 = mul(Sc, Sa32);
+  Sa22 = add(Sa22, Stmp2);
+  Sa32 = sub(Sa32, Stmp1);
+
+  Stmp1 = mul(Ss, Sa23);
+  Stmp2 = mul(Ss, Sa33);
+  Sa23 = mul(Sc, Sa23);
+  Sa33 = mul(Sc, Sa33);
+  Sa23 = add(Sa23, Stmp2);
+  Sa33 = sub(Sa33, Stmp1);
+
+  Stmp1 = mul(Ss, Su12);
+  Stmp2 = mul(Ss, Su13);
+  Su12 = mul(Sc, Su12);
+  Su13 = mul(Sc, Su13);
+  Su12 = add(Su12, Stmp2);
+  Su13 = sub(Su13, Stmp1);
+
+  Stmp1 = mul(Ss, Su22);
+  Stmp2 = mul(Ss, Su23);
+  Su22 = mul(Sc, Su22);
+  Su23 = mul(Sc, Su23);
+  Su22 = add(Su22, Stmp2);
+  Su23 = sub(Su23, Stmp1);
+
+  Stmp1 = mul(Ss, Su32);
+  Stmp2 = mul(Ss, Su33);
+  Su32 = mul(Sc, Su32);
+  Su33 = mul(Sc, Su33);
+  Su32 = add(Su32, Stmp2);
+  Su33 = sub(Su33, Stmp1);
   // end
 
-  u11 = Su11.f;
-  u21 = Su21.f;
-  u31 = Su31.f;
-  u12 = Su12.f;
-  u22 = Su22.f;
-  u32 = Su32.f;
-  u13 = Su13.f;
-  u23 = Su23.f;
-  u33 = Su33.f;
-
-  v11 = Sv11.f;
-  v21 = Sv21.f;
-  v31 = Sv31.f;
-  v12 = Sv12.f;
-  v22 = Sv22.f;
-  v32 = Sv32.f;
-  v13 = Sv13.f;
-  v23 = Sv23.f;
-  v33 = Sv33.f;
-
-  sigma1 = Sa11.f;
-  sigma2 = Sa22.f;
-  sigma3 = Sa33.f;
+  u11 = Su11;
+  u21 = Su21;
+  u31 = Su31;
+  u12 = Su12;
+  u22 = Su22;
+  u32 = Su32;
+  u13 = Su13;
+  u23 = Su23;
+  u33 = Su33;
+
+  v11 = Sv11;
+  v21 = Sv21;
+  v31 = Sv31;
+  v12 = Sv12;
+  v22 = Sv22;
+  v32 = Sv32;
+  v13 = Sv13;
+  v23 = Sv23;
+  v33 = Sv33;
+
+  sigma1 = Sa11;
+  sigma2 = Sa22;
+  sigma3 = Sa33;
   // output
 }
 
+// svd<5> of lane_width matrices, each array holding entry i (row major) of
+// matrix l at [i * lane_width + l], with the singular values in |sigma|
+inline void svd_lanes(const float *a, float *u, float *v, float *sigma) {
+  Lanes A[9], U[9], V[9], S[3];
+  for (int i = 0; i < 9; i++) {
+    A[i] = load_lanes(a + i * lane_width);
+  }
+  // clang-format off
+  svd<5>(A[0], A[1], A[2], A[3], A[4], A[5], A[6], A[7], A[8],
+         U[0], U[1], U[2], U[3], U[4], U[5], U[6], U[7], U[8],
+         V[0], V[1], V[2], V[3], V[4], V[5], V[6], V[7], V[8],
+         S[0], S[1], S[2]);
+  // clang-format on
+  for (int i = 0; i < 9; i++) {
+    store_lanes(u + i * lane_width, U[i]);
+    store_lanes(v + i * lane_width, V[i]);
+  }
+  for (int i = 0; i < 3; i++) {
+    store_lanes(sigma + i * lane_width, S[i]);
+  }
+}
+
 }  // namespace SifakisSVD
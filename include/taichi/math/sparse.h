@@ -7,61 +7,394 @@
 
 #include "math.h"
 #include "array_1d.h"
+#include <taichi/system/threading.h>
+
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+#include <vector>
 
 TC_NAMESPACE_BEGIN
 
-class SparseMatrix {
+// Square sparse matrices of block_size x block_size blocks, in compressed
+// sparse row (BSR) form. Entries are first inserted as triplets, in any
+// order and with duplicates, and compress() sorts and sums them, in
+// parallel over the rows. Vectors are Array1D<real> of block_size entries
+// per block row. Blocks are stored row-major, and with a compile-time
+// block_size the block products in multiply() are unrolled.
+template <int block_size>
+class BlockSparseMatrix {
+ public:
+  static constexpr int block_volume = block_size * block_size;
+
  private:
-  struct Entry {
-    int j;
-    real val;
+  // Block rows (and columns)
+  int n;
+  int num_threads;
+  // Inserted and not compressed yet
+  std::vector<int> triplet_rows, triplet_columns;
+  std::vector<real> triplet_values;
+  // The blocks of block row i are k in [row_begin[i], row_begin[i + 1]), of
+  // block column columns[k] and values values[k * block_volume ...]
+  std::vector<int> row_begin, columns;
+  std::vector<real> values;
 
-    Entry() {
-    }
+ public:
+  BlockSparseMatrix(int n, int num_threads = -1)
+      : n(n), num_threads(num_threads) {
+    row_begin.assign(n + 1, 0);
+  }
 
-    Entry(int j, real val) : j(j), val(val) {
-    }
-  };
+  BlockSparseMatrix() : BlockSparseMatrix(0) {
+  }
 
-  // TODO: This is slow... make some low-level optimizations here...
-  std::vector<std::vector<Entry>> entries;
+  int get_num_block_rows() const {
+    return n;
+  }
 
-  int n;
+  int get_size() const {
+    return n * block_size;
+  }
 
- public:
-  SparseMatrix(int n) : n(n) {
-    entries.resize(n);
+  int get_num_blocks() const {
+    return (int)columns.size();
   }
 
-  SparseMatrix() {
+  bool is_compressed() const {
+    return triplet_rows.empty();
   }
 
+  // Adds |value| to the scalar entry (i, j)
   void insert(int i, int j, real value) {
-    for (int k = 0; k < (int)entries[i].size(); k++) {
-      if (entries[i][k].j == j) {
-        entries[i][k].val += value;
-        return;
+    real block[block_volume] = {0};
+    block[i % block_size * block_size + j % block_size] = value;
+    insert_block(i / block_size, j / block_size, (const real *)block);
+  }
+
+  // Adds the row-major |block| to block (i, j)
+  void insert_block(int i, int j, const real *block) {
+    TC_ASSERT_INFO(0 <= i && i < n && 0 <= j && j < n,
+                   "Block index out of range");
+    triplet_rows.push_back(i);
+    triplet_columns.push_back(j);
+    triplet_values.insert(triplet_values.end(), block, block + block_volume);
+  }
+
+  // For matrices with operator()(row, column), e.g. MatrixND
+  template <typename M>
+  void insert_block(int i, int j, const M &m) {
+    real block[block_volume];
+    for (int r = 0; r < block_size; r++) {
+      for (int c = 0; c < block_size; c++) {
+        block[r * block_size + c] = m(r, c);
       }
     }
-    entries[i].push_back(Entry(j, value));
+    insert_block(i, j, (const real *)block);
   }
 
   void clear() {
+    triplet_rows.clear();
+    triplet_columns.clear();
+    triplet_values.clear();
+    row_begin.assign(n + 1, 0);
+    columns.clear();
+    values.clear();
+  }
+
+  // Sums the inserted triplets, and the blocks already compressed, into
+  // sorted rows. Duplicates are summed in insertion order, so that the
+  // result does not depend on the threads.
+  void compress() {
+    if (is_compressed()) {
+      return;
+    }
+    // Blocks compressed before come first
+    std::vector<int> rows, cols;
+    std::vector<real> vals;
+    rows.reserve(columns.size() + triplet_rows.size());
     for (int i = 0; i < n; i++) {
-      entries[i].clear();
+      rows.insert(rows.end(), row_begin[i + 1] - row_begin[i], i);
     }
+    rows.insert(rows.end(), triplet_rows.begin(), triplet_rows.end());
+    cols.swap(columns);
+    cols.insert(cols.end(), triplet_columns.begin(), triplet_columns.end());
+    vals.swap(values);
+    vals.insert(vals.end(), triplet_values.begin(), triplet_values.end());
+    triplet_rows = std::vector<int>();
+    triplet_columns = std::vector<int>();
+    triplet_values = std::vector<real>();
+
+    // Counting sort by row, stable
+    int num_triplets = (int)rows.size();
+    std::vector<int> start(n + 1, 0);
+    for (int t = 0; t < num_triplets; t++) {
+      start[rows[t] + 1]++;
+    }
+    std::partial_sum(start.begin(), start.end(), start.begin());
+    std::vector<int> order(num_triplets);
+    std::vector<int> cursor(start.begin(), start.end() - 1);
+    for (int t = 0; t < num_triplets; t++) {
+      order[cursor[rows[t]]++] = t;
+    }
+
+    // Sort every row by column and count the distinct ones
+    std::vector<int> row_size(n);
+    ThreadedTaskManager::run(n, num_threads, [&](int i) {
+      auto begin = order.begin() + start[i], end = order.begin() + start[i + 1];
+      std::sort(begin, end, [&](int a, int b) {
+        return cols[a] < cols[b] || (cols[a] == cols[b] && a < b);
+      });
+      int count = 0;
+      for (auto it = begin; it != end; ++it) {
+        count += it == begin || cols[*it] != cols[*(it - 1)];
+      }
+      row_size[i] = count;
+    });
+    row_begin.assign(n + 1, 0);
+    std::partial_sum(row_size.begin(), row_size.end(), row_begin.begin() + 1);
+    columns.resize(row_begin[n]);
+    values.assign((std::size_t)row_begin[n] * block_volume, 0.0_f);
+    ThreadedTaskManager::run(n, num_threads, [&](int i) {
+      int k = row_begin[i] - 1;
+      for (int s = start[i]; s < start[i + 1]; s++) {
+        int t = order[s];
+        if (s == start[i] || cols[t] != cols[order[s - 1]]) {
+          k++;
+          columns[k] = cols[t];
+        }
+        for (int e = 0; e < block_volume; e++) {
+          values[k * block_volume + e] += vals[t * block_volume + e];
+        }
+      }
+    });
+  }
+
+  // Scalar entry (i, j), zero if not stored
+  real get(int i, int j) const {
+    TC_ASSERT_INFO(is_compressed(), "Call compress() first");
+    int bi = i / block_size, bj = j / block_size;
+    auto begin = columns.begin() + row_begin[bi];
+    auto end = columns.begin() + row_begin[bi + 1];
+    auto it = std::lower_bound(begin, end, bj);
+    if (it == end || *it != bj) {
+      return 0;
+    }
+    return values[(it - columns.begin()) * block_volume +
+                  i % block_size * block_size + j % block_size];
   }
 
-  Array1D<real> multiply(const Array1D<real> &x) {
-    Array1D<real> y(x.get_dim());
+  // The diagonal blocks, row-major, zero where not stored
+  std::vector<real> get_diagonal_blocks() const {
+    TC_ASSERT_INFO(is_compressed(), "Call compress() first");
+    std::vector<real> diagonal((std::size_t)n * block_volume, 0.0_f);
+    ThreadedTaskManager::run(n, num_threads, [&](int i) {
+      for (int k = row_begin[i]; k < row_begin[i + 1]; k++) {
+        if (columns[k] == i) {
+          std::copy(values.begin() + k * block_volume,
+                    values.begin() + (k + 1) * block_volume,
+                    diagonal.begin() + i * block_volume);
+        }
+      }
+    });
+    return diagonal;
+  }
+
+  // y = A x
+  void multiply(const Array1D<real> &x, Array1D<real> &y) const {
+    TC_ASSERT_INFO(is_compressed(), "Call compress() first");
+    TC_ASSERT_INFO(x.size == get_size(), "Wrong vector size");
+    if (y.size != get_size()) {
+      y = Array1D<real>(get_size());
+    }
+    const real *x_data = x.data.data();
+    real *y_data = y.data.data();
+    ThreadedTaskManager::run(n, num_threads, [&](int i) {
+      real sum[block_size] = {0};
+      for (int k = row_begin[i]; k < row_begin[i + 1]; k++) {
+        const real *block = &values[k * block_volume];
+        const real *x_j = x_data + columns[k] * block_size;
+        for (int r = 0; r < block_size; r++) {
+          for (int c = 0; c < block_size; c++) {
+            sum[r] += block[r * block_size + c] * x_j[c];
+          }
+        }
+      }
+      for (int r = 0; r < block_size; r++) {
+        y_data[i * block_size + r] = sum[r];
+      }
+    });
+  }
 
+  Array1D<real> multiply(const Array1D<real> &x) const {
+    Array1D<real> y(get_size());
+    multiply(x, y);
     return y;
   }
 
   TC_IO_DECL {
     TC_IO(n);
-    TC_IO(entries);
+    TC_IO(num_threads);
+    TC_IO(triplet_rows);
+    TC_IO(triplet_columns);
+    TC_IO(triplet_values);
+    TC_IO(row_begin);
+    TC_IO(columns);
+    TC_IO(values);
   }
 };
 
+using SparseMatrix = BlockSparseMatrix<1>;
+
+namespace sparse {
+
+constexpr int vector_block_size = 4096;
+
+// Sums over fixed blocks, so that results do not depend on the threads
+template <typename F>
+float64 parallel_sum(int size, int num_threads, const F &f) {
+  int num_blocks = (size + vector_block_size - 1) / vector_block_size;
+  std::vector<float64> sums(num_blocks);
+  ThreadedTaskManager::run(num_blocks, num_threads, [&](int b) {
+    float64 sum = 0;
+    int end = std::min(size, (b + 1) * vector_block_size);
+    for (int i = b * vector_block_size; i < end; i++) {
+      sum += f(i);
+    }
+    sums[b] = sum;
+  });
+  return std::accumulate(sums.begin(), sums.end(), 0.0);
+}
+
+template <typename F>
+void parallel_for(int size, int num_threads, const F &f) {
+  int num_blocks = (size + vector_block_size - 1) / vector_block_size;
+  ThreadedTaskManager::run(num_blocks, num_threads, [&](int b) {
+    int end = std::min(size, (b + 1) * vector_block_size);
+    for (int i = b * vector_block_size; i < end; i++) {
+      f(i);
+    }
+  });
+}
+
+// Inverts the row-major block_size x block_size |block| in place, by
+// Gauss-Jordan elimination with partial pivoting. Singular blocks become
+// zero, which leaves their rows unpreconditioned.
+template <int block_size>
+void invert_block(real *block) {
+  float64 a[block_size][2 * block_size];
+  for (int r = 0; r < block_size; r++) {
+    for (int c = 0; c < block_size; c++) {
+      a[r][c] = block[r * block_size + c];
+      a[r][block_size + c] = r == c;
+    }
+  }
+  for (int c = 0; c < block_size; c++) {
+    int pivot = c;
+    for (int r = c + 1; r < block_size; r++) {
+      if (std::abs(a[r][c]) > std::abs(a[pivot][c])) {
+        pivot = r;
+      }
+    }
+    if (std::abs(a[pivot][c]) < 1e-30) {
+      std::fill(block, block + block_size * block_size, 0.0_f);
+      return;
+    }
+    for (int e = 0; e < 2 * block_size; e++) {
+      std::swap(a[c][e], a[pivot][e]);
+    }
+    float64 inv = 1 / a[c][c];
+    for (int e = 0; e < 2 * block_size; e++) {
+      a[c][e] *= inv;
+    }
+    for (int r = 0; r < block_size; r++) {
+      if (r != c) {
+        float64 factor = a[r][c];
+        for (int e = 0; e < 2 * block_size; e++) {
+          a[r][e] -= factor * a[c][e];
+        }
+      }
+    }
+  }
+  for (int r = 0; r < block_size; r++) {
+    for (int c = 0; c < block_size; c++) {
+      block[r * block_size + c] = (real)a[r][block_size + c];
+    }
+  }
+}
+
+}  // namespace sparse
+
+// Solves A x = b for a symmetric positive definite, compressed A by
+// conjugate gradients preconditioned with the inverses of the diagonal
+// blocks (Jacobi for SparseMatrix). Starts from |x| as given, resized to
+// zero if needed, and stops when |r|_2 <= tolerance * |b|_2. Returns the
+// number of iterations, or -1 if max_iterations (the size of the system if
+// negative) were not enough.
+template <int block_size>
+int conjugate_gradient(const BlockSparseMatrix<block_size> &A,
+                       const Array1D<real> &b,
+                       Array1D<real> &x,
+                       real tolerance = 1e-6_f,
+                       int max_iterations = -1,
+                       int num_threads = -1) {
+  constexpr int block_volume = block_size * block_size;
+  int size = A.get_size();
+  TC_ASSERT_INFO(b.size == size, "Wrong right-hand side size");
+  if (x.size != size) {
+    x = Array1D<real>(size, 0.0_f);
+  }
+  if (max_iterations < 0) {
+    max_iterations = std::max(size, 1);
+  }
+  std::vector<real> inv_diagonal = A.get_diagonal_blocks();
+  ThreadedTaskManager::run(A.get_num_block_rows(), num_threads, [&](int i) {
+    sparse::invert_block<block_size>(&inv_diagonal[i * block_volume]);
+  });
+  auto precondition = [&](const Array1D<real> &r, Array1D<real> &z) {
+    ThreadedTaskManager::run(A.get_num_block_rows(), num_threads, [&](int i) {
+      const real *inv = &inv_diagonal[i * block_volume];
+      for (int row = 0; row < block_size; row++) {
+        real sum = 0;
+        for (int c = 0; c < block_size; c++) {
+          sum += inv[row * block_size + c] * r[i * block_size + c];
+        }
+        z[i * block_size + row] = sum;
+      }
+    });
+  };
+  auto dot = [&](const Array1D<real> &u, const Array1D<real> &v) {
+    return sparse::parallel_sum(size, num_threads,
+                                [&](int i) { return (float64)u[i] * v[i]; });
+  };
+
+  Array1D<real> r(size), z(size), p(size), Ap(size);
+  A.multiply(x, Ap);
+  sparse::parallel_for(size, num_threads, [&](int i) { r[i] = b[i] - Ap[i]; });
+  float64 threshold = sqr(tolerance) * dot(b, b);
+  if (dot(r, r) <= threshold) {
+    return 0;
+  }
+  precondition(r, z);
+  p = z;
+  float64 rz = dot(r, z);
+  for (int iteration = 1; iteration <= max_iterations; iteration++) {
+    A.multiply(p, Ap);
+    real alpha = (real)(rz / dot(p, Ap));
+    sparse::parallel_for(size, num_threads, [&](int i) {
+      x[i] += alpha * p[i];
+      r[i] -= alpha * Ap[i];
+    });
+    if (dot(r, r) <= threshold) {
+      return iteration;
+    }
+    precondition(r, z);
+    float64 rz_new = dot(r, z);
+    real beta = (real)(rz_new / rz);
+    rz = rz_new;
+    sparse::parallel_for(size, num_threads,
+                         [&](int i) { p[i] = z[i] + beta * p[i]; });
+  }
+  return -1;
+}
+
 TC_NAMESPACE_END
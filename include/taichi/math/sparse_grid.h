@@ -0,0 +1,206 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+#include <taichi/common/util.h>
+#include <taichi/math/math.h>
+#include <taichi/system/threading.h>
+#include <taichi/system/virtual_memory.h>
+
+#include <cstring>
+#include <memory>
+#include <type_traits>
+#include <vector>
+
+TC_NAMESPACE_BEGIN
+
+// Sparse 3D grid in the manner of SPGrid
+// (http://pages.cs.wisc.edu/~sifakis/papers/SPGrid.pdf): the values of a
+// block of block_size^3 cells are contiguous, and blocks are laid out in
+// Morton order of their coordinates in a virtual memory reservation that
+// covers the whole domain. Pages are only backed by physical memory once
+// written to, and untouched cells read as zero, so that memory scales with
+// the occupied part of the domain. Blocks holding data are marked with
+// activate(); passes run over the active blocks only, in memory order.
+template <typename T, int log2_block_size = 3>
+class SparseGrid3D {
+  static_assert(std::is_trivially_copyable<T>::value,
+                "Values of a sparse grid are zero-initialized by the OS");
+
+ public:
+  static constexpr int block_size = 1 << log2_block_size;
+  static constexpr int block_volume = block_size * block_size * block_size;
+
+  SparseGrid3D() : res(0), block_res(0), side(0), data(nullptr) {
+  }
+
+  explicit SparseGrid3D(const Vector3i &res) {
+    initialize(res);
+  }
+
+  void initialize(const Vector3i &res) {
+    this->res = res;
+    side = 1;
+    for (int d = 0; d < 3; d++) {
+      block_res[d] = (res[d] + block_size - 1) >> log2_block_size;
+      while (side < block_res[d]) {
+        side *= 2;
+      }
+    }
+    // Morton codes of block coordinates have 10 bits per axis
+    TC_ASSERT_INFO(side <= 1024, "Sparse grids are at most 1024 blocks wide");
+    std::size_t page_size = VirtualMemoryAllocator::page_size;
+    std::size_t bytes = (std::size_t)side * side * side * block_bytes();
+    bytes = (bytes + page_size - 1) / page_size * page_size;
+    memory = std::make_unique<VirtualMemoryAllocator>(bytes);
+    data = reinterpret_cast<T *>(memory->ptr);
+    active_flags.assign((std::size_t)side * side * side, 0);
+    active_blocks.clear();
+  }
+
+  Vector3i get_res() const {
+    return res;
+  }
+
+  Vector3i get_block_res() const {
+    return block_res;
+  }
+
+  bool inside(const Vector3i &cell) const {
+    return 0 <= cell[0] && cell[0] < res[0] && 0 <= cell[1] &&
+           cell[1] < res[1] && 0 <= cell[2] && cell[2] < res[2];
+  }
+
+  // Writing to a cell does not activate its block
+  T &operator[](const Vector3i &cell) {
+    return data[get_offset(cell)];
+  }
+
+  const T &operator[](const Vector3i &cell) const {
+    return data[get_offset(cell)];
+  }
+
+  // Not thread-safe
+  void activate(const Vector3i &cell) {
+    active_flags[get_block_code(cell)] = 1;
+  }
+
+  bool is_active(const Vector3i &cell) const {
+    return active_flags[get_block_code(cell)] != 0;
+  }
+
+  // Call after activate() and before iterating over the active blocks
+  void update_active_blocks() {
+    active_blocks.clear();
+    for (int64 code = 0; code < (int64)active_flags.size(); code++) {
+      if (active_flags[code]) {
+        active_blocks.push_back(code);
+      }
+    }
+  }
+
+  int get_num_active_blocks() const {
+    return (int)active_blocks.size();
+  }
+
+  // Calls |f(block_begin, values)| for every active block, where |values|
+  // holds the block_volume values of the cells block_begin + (i, j, k),
+  // with 0 <= i, j, k < block_size, at index
+  // (i * block_size + j) * block_size + k. Cells outside the grid are
+  // included for blocks on its upper boundary.
+  template <typename F>
+  void for_each_active_block(const F &f, int num_threads = -1) {
+    ThreadedTaskManager::run(get_num_active_blocks(), num_threads, [&](int b) {
+      int64 code = active_blocks[b];
+      f(decode(code) * Vector3i(block_size), data + code * block_volume);
+    });
+  }
+
+  // Zeroes and deactivates every block; pages of active blocks are
+  // returned to the OS where blocks cover whole pages, unless
+  // |release_pages| is false, e.g. for grids refilled every time step, which
+  // would fault their pages in again
+  void clear(bool release_pages = true) {
+    ThreadedTaskManager::run(get_num_active_blocks(), -1, [&](int b) {
+      T *block = data + active_blocks[b] * block_volume;
+      if (release_pages) {
+        release(block);
+      } else {
+        std::memset((void *)block, 0, block_bytes());
+      }
+    });
+    std::fill(active_flags.begin(), active_flags.end(), 0);
+    active_blocks.clear();
+  }
+
+  // Identifies the block of |cell|; blocks in Morton order have increasing
+  // codes
+  int64 get_block_code(const Vector3i &cell) const {
+    return (spread(cell[0] >> log2_block_size) << 2) |
+           (spread(cell[1] >> log2_block_size) << 1) |
+           spread(cell[2] >> log2_block_size);
+  }
+
+  // The first cell of the block of |code|
+  Vector3i get_block_begin(int64 code) const {
+    return decode(code) * Vector3i(block_size);
+  }
+
+ private:
+  Vector3i res, block_res;
+  // Blocks per axis of the Morton-ordered address space, a power of two
+  int side;
+  std::unique_ptr<VirtualMemoryAllocator> memory;
+  T *data;
+  // Per Morton code of a block
+  std::vector<uint8> active_flags;
+  std::vector<int64> active_blocks;
+
+  static constexpr std::size_t block_bytes() {
+    return block_volume * sizeof(T);
+  }
+
+  static void release(T *block) {
+#if defined(TC_PLATFORM_UNIX)
+    if (block_bytes() % VirtualMemoryAllocator::page_size == 0) {
+      madvise(block, block_bytes(), MADV_DONTNEED);
+      return;
+    }
+#endif
+    std::memset((void *)block, 0, block_bytes());
+  }
+
+  static int64 spread(int64 v) {
+    v = (v | (v << 16)) & 0x030000FF;
+    v = (v | (v << 8)) & 0x0300F00F;
+    v = (v | (v << 4)) & 0x030C30C3;
+    v = (v | (v << 2)) & 0x09249249;
+    return v;
+  }
+
+  static int compact(int64 v) {
+    v &= 0x09249249;
+    v = (v ^ (v >> 2)) & 0x030C30C3;
+    v = (v ^ (v >> 4)) & 0x0300F00F;
+    v = (v ^ (v >> 8)) & 0x030000FF;
+    v = (v ^ (v >> 16)) & 0x000003FF;
+    return (int)v;
+  }
+
+  static Vector3i decode(int64 code) {
+    return Vector3i(compact(code >> 2), compact(code >> 1), compact(code));
+  }
+
+  int64 get_offset(const Vector3i &cell) const {
+    constexpr int mask = block_size - 1;
+    return get_block_code(cell) * block_volume +
+           ((((cell[0] & mask) << log2_block_size) | (cell[1] & mask))
+            << log2_block_size) +
+           (cell[2] & mask);
+  }
+};
+
+TC_NAMESPACE_END
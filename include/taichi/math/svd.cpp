@@ -12,6 +12,23 @@
 #include <taichi/testing.h>
 #include "sifakis_svd.h"
 #include "svd.h"
+#include "vector_pack.h"
+#include <taichi/system/cpu_features.h>
+
+// Portable builds target AVX2, and add the AVX-512 kernel of svd_batch,
+// selected by the CPU at run time
+#if defined(TC_PORTABLE) && !defined(__AVX512F__) && defined(__GNUC__) && \
+    !defined(__clang__)
+#define TC_SVD_BATCH_AVX512
+#pragma GCC push_options
+#pragma GCC target("avx512f")
+#define TC_SIFAKIS_SVD_AVX512
+namespace avx512 {
+#include "sifakis_svd.h"
+}
+#undef TC_SIFAKIS_SVD_AVX512
+#pragma GCC pop_options
+#endif
 
 //#define TC_USE_EIGEN_SVD
 
@@ -186,6 +203,222 @@ void polar_decomp(const MatrixND<dim, T> &A,
   s = v * sig * transposed(v);
 }
 
+// Batches of |width| matrices through |kernel|, i.e. svd_lanes()
+template <int width>
+static void svd_batch_lanes(const Matrix3f *m,
+                            int n,
+                            Matrix3f *u,
+                            Matrix3f *sig,
+                            Matrix3f *v,
+                            void (*kernel)(const float *,
+                                           float *,
+                                           float *,
+                                           float *)) {
+  // Entries of the matrices of a batch, lane by lane
+  alignas(64) float a[9][width], u_lanes[9][width], v_lanes[9][width],
+      sigma_lanes[3][width];
+  for (int begin = 0; begin < n; begin += width) {
+    int count = std::min(width, n - begin);
+    for (int l = 0; l < width; l++) {
+      // Idle lanes repeat the last matrix
+      const Matrix3f &mat = m[begin + std::min(l, count - 1)];
+      for (int i = 0; i < 9; i++) {
+        a[i][l] = mat(i / 3, i % 3);
+      }
+    }
+    kernel(a[0], u_lanes[0], v_lanes[0], sigma_lanes[0]);
+    for (int l = 0; l < count; l++) {
+      const Matrix3f &mat = m[begin + l];
+      Matrix3f &u_l = u[begin + l], &sig_l = sig[begin + l],
+               &v_l = v[begin + l];
+      // As svd()
+      if ((mat - Matrix3f(Vector3f(mat[0][0], mat[1][1], mat[2][2])))
+              .frobenius_norm2() < 1e-7f) {
+        sig_l = mat;
+        u_l = v_l = Matrix3f(1);
+      } else {
+        for (int i = 0; i < 9; i++) {
+          u_l(i / 3, i % 3) = u_lanes[i][l];
+          v_l(i / 3, i % 3) = v_lanes[i][l];
+        }
+        sig_l = Matrix3f(
+            Vector3f(sigma_lanes[0][l], sigma_lanes[1][l], sigma_lanes[2][l]));
+      }
+      ensure_non_negative_singular_values(u_l, sig_l);
+    }
+  }
+}
+
+void svd_batch(const Matrix3f *m,
+               int n,
+               Matrix3f *u,
+               Matrix3f *sig,
+               Matrix3f *v) {
+#if defined(TC_SVD_BATCH_AVX512)
+  if (get_cpu_features().avx512f) {
+    svd_batch_lanes<avx512::SifakisSVD::lane_width>(
+        m, n, u, sig, v, avx512::SifakisSVD::svd_lanes);
+    return;
+  }
+#endif
+  svd_batch_lanes<SifakisSVD::lane_width>(m, n, u, sig, v,
+                                          SifakisSVD::svd_lanes);
+}
+
+void polar_decomp_batch(const Matrix3f *m, int n, Matrix3f *r, Matrix3f *s) {
+  constexpr int batch_size = 256;
+  Matrix3f u[batch_size], sig[batch_size], v[batch_size];
+  for (int begin = 0; begin < n; begin += batch_size) {
+    int count = std::min(batch_size, n - begin);
+    svd_batch(m + begin, count, u, sig, v);
+    for (int i = 0; i < count; i++) {
+      r[begin + i] = u[i] * transposed(v[i]);
+      s[begin + i] = v[i] * sig[i] * transposed(v[i]);
+    }
+  }
+}
+
+// The Jacobi rotation by tan(theta) = t that zeroes the entry (p, q) of the
+// symmetric matrix of diagonal |d| and off-diagonal entries |o| (o[r] is
+// the entry of the pair of indices other than r), lane by lane. |t| is the
+// smaller root of t^2 + 2 t cot(2 theta) - 1. The rotation is accumulated
+// in the columns of |v|.
+template <int p, int q, int r, typename Scalar>
+TC_FORCE_INLINE void sym_eig_rotate(Scalar d[3], Scalar o[3], Scalar v[3][3]) {
+  using T = typename std::decay<decltype(d[0][0])>::type;
+  const Scalar zero(T(0)), one(T(1)), two(T(2));
+  // Of matrices scaled to entries of at most one, entries this small do not
+  // change the eigenvalues, and flushing them avoids denormal operands
+  // (orders of magnitude slower) once the rotations converged
+  const Scalar negligible(std::numeric_limits<T>::epsilon() / 64);
+  Scalar apq = select(max(o[r], -o[r]) > negligible, o[r], zero);
+  Scalar tau = d[q] - d[p];
+  Scalar denom = max(tau, -tau) + sqrt(tau * tau + two * two * apq * apq);
+  Scalar t = select(tau < zero, -two, two) * apq / denom;
+  t = select(denom > zero, t, zero);
+  Scalar c = one / sqrt(one + t * t), s = t * c;
+  d[p] -= t * apq;
+  d[q] += t * apq;
+  o[r] = zero;
+  Scalar arp = o[q], arq = o[p];
+  o[q] = c * arp - s * arq;
+  o[p] = s * arp + c * arq;
+  for (int k = 0; k < 3; k++) {
+    Scalar vkp = v[k][p], vkq = v[k][q];
+    v[k][p] = c * vkp - s * vkq;
+    v[k][q] = s * vkp + c * vkq;
+  }
+}
+
+// Swaps eigenvalues i and j, and their eigenvectors, where d[j] < d[i]
+template <int i, int j, typename Scalar>
+TC_FORCE_INLINE void sym_eig_sort(Scalar d[3], Scalar v[3][3]) {
+  auto swap = d[j] < d[i];
+  Scalar di = d[i];
+  d[i] = select(swap, d[j], di);
+  d[j] = select(swap, di, d[j]);
+  for (int k = 0; k < 3; k++) {
+    Scalar vki = v[k][i];
+    v[k][i] = select(swap, v[k][j], vki);
+    v[k][j] = select(swap, vki, v[k][j]);
+  }
+}
+
+// Cyclic Jacobi, with eigenvalues sorted in ascending order
+template <typename Scalar>
+TC_FORCE_INLINE void sym_eig_lanes(Scalar d[3], Scalar o[3], Scalar v[3][3]) {
+  // Random and nearly degenerate matrices converge to rounding after three
+  // sweeps, in both precisions; one more for margin
+  constexpr int sweeps = 4;
+  using T = typename std::decay<decltype(d[0][0])>::type;
+  for (int i = 0; i < 3; i++) {
+    for (int j = 0; j < 3; j++) {
+      v[i][j] = Scalar(T(i == j));
+    }
+  }
+  Scalar scale(T(0));
+  for (int i = 0; i < 3; i++) {
+    scale = max(scale, max(max(d[i], -d[i]), max(o[i], -o[i])));
+  }
+  Scalar inv_scale = select(scale > Scalar(T(0)), Scalar(T(1)) / scale,
+                            Scalar(T(1)));
+  for (int i = 0; i < 3; i++) {
+    d[i] *= inv_scale;
+    o[i] *= inv_scale;
+  }
+  for (int sweep = 0; sweep < sweeps; sweep++) {
+    sym_eig_rotate<0, 1, 2>(d, o, v);
+    sym_eig_rotate<0, 2, 1>(d, o, v);
+    sym_eig_rotate<1, 2, 0>(d, o, v);
+  }
+  for (int i = 0; i < 3; i++) {
+    d[i] *= scale;
+  }
+  sym_eig_sort<0, 1>(d, v);
+  sym_eig_sort<1, 2>(d, v);
+  sym_eig_sort<0, 1>(d, v);
+}
+
+template <typename T, int width>
+static void sym_eig_batch_lanes(const MatrixND<3, T> *m,
+                                int n,
+                                MatrixND<3, T> *q,
+                                VectorND<3, T> *lambda) {
+  using Scalar = ScalarPack<T, width>;
+  alignas(64) T lanes[6][width], v_lanes[3][3][width];
+  for (int begin = 0; begin < n; begin += width) {
+    int count = std::min(width, n - begin);
+    for (int l = 0; l < width; l++) {
+      // Idle lanes repeat the last matrix
+      const MatrixND<3, T> &mat = m[begin + std::min(l, count - 1)];
+      lanes[0][l] = mat(0, 0);
+      lanes[1][l] = mat(1, 1);
+      lanes[2][l] = mat(2, 2);
+      lanes[3][l] = mat(1, 2);
+      lanes[4][l] = mat(0, 2);
+      lanes[5][l] = mat(0, 1);
+    }
+    Scalar d[3], o[3], v[3][3];
+    for (int i = 0; i < 3; i++) {
+      d[i] = Scalar::load(lanes[i]);
+      o[i] = Scalar::load(lanes[3 + i]);
+    }
+    sym_eig_lanes(d, o, v);
+    for (int i = 0; i < 3; i++) {
+      d[i].store(lanes[i]);
+      for (int j = 0; j < 3; j++) {
+        v[i][j].store(v_lanes[i][j]);
+      }
+    }
+    for (int l = 0; l < count; l++) {
+      for (int i = 0; i < 3; i++) {
+        lambda[begin + l][i] = lanes[i][l];
+        for (int j = 0; j < 3; j++) {
+          q[begin + l](i, j) = v_lanes[i][j][l];
+        }
+      }
+    }
+  }
+}
+
+template <typename T>
+void sym_eig(const MatrixND<3, T> &m,
+             MatrixND<3, T> &q,
+             VectorND<3, T> &lambda) {
+  sym_eig_batch_lanes<T, 1>(&m, 1, &q, &lambda);
+}
+
+template void sym_eig(const Matrix3f &, Matrix3f &, Vector3f &);
+template void sym_eig(const Matrix3d &, Matrix3d &, Vector3d &);
+
+void sym_eig_batch(const Matrix3f *m, int n, Matrix3f *q, Vector3f *lambda) {
+  sym_eig_batch_lanes<float32, default_pack_width<float32>>(m, n, q, lambda);
+}
+
+void sym_eig_batch(const Matrix3d *m, int n, Matrix3d *q, Vector3d *lambda) {
+  sym_eig_batch_lanes<float64, default_pack_width<float64>>(m, n, q, lambda);
+}
+
 void svd_eigen3(void const *A_, void *u_, void *sig_, void *v_) {
   Eigen::Matrix3d A = *reinterpret_cast<Eigen::Matrix3d const *>(A_);
   Eigen::Matrix3d u;
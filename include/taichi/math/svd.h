@@ -69,6 +69,31 @@ extern void qr_decomp(const MatrixND<dim, T> &A,
                       MatrixND<dim, T> &q,
                       MatrixND<dim, T> &r);
 
+// svd() and polar_decomp() of the 3x3 matrices m[0] to m[n - 1], with the
+// Sifakis kernel running over the SIMD lanes of the target
+void svd_batch(const Matrix3f *m,
+               int n,
+               Matrix3f *u,
+               Matrix3f *sig,
+               Matrix3f *v);
+
+void polar_decomp_batch(const Matrix3f *m, int n, Matrix3f *r, Matrix3f *s);
+
+// Eigenvalues |lambda|, in ascending order, and orthonormal eigenvectors,
+// the columns of |q|, of the symmetric 3x3 matrix |m| (of which only the
+// upper triangle is read), i.e. m = q * Matrix(lambda) * transposed(q).
+// Cyclic Jacobi with a fixed number of sweeps, so that the _batch versions
+// run the same rotations over the SIMD lanes of the target (8 floats or 4
+// doubles with AVX2, twice that with AVX-512).
+template <typename T>
+void sym_eig(const MatrixND<3, T> &m,
+             MatrixND<3, T> &q,
+             VectorND<3, T> &lambda);
+
+void sym_eig_batch(const Matrix3f *m, int n, Matrix3f *q, Vector3f *lambda);
+
+void sym_eig_batch(const Matrix3d *m, int n, Matrix3d *q, Vector3d *lambda);
+
 void svd_eigen2(void const *A_, void *u_, void *sig_, void *v_);
 
 void svd_eigen3(void const *A_, void *u_, void *sig_, void *v_);
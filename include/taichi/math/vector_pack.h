@@ -0,0 +1,708 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+#include <taichi/common/util.h>
+#include "linalg.h"
+
+#include <immintrin.h>
+#include <cmath>
+
+TC_NAMESPACE_BEGIN
+
+// Packs of |width| scalars, vectors and matrices, stored as structures of
+// arrays: VectorPack<3, float32, 8> holds 8 vectors in three ScalarPacks of
+// 8 lanes, each an __m256 with AVX. Arithmetic is lane by lane, so that
+// kernels over batches of vectors are written once with the operators of
+// VectorND and MatrixND. ScalarPacks of float32 and float64 are registers
+// with AVX (8 and 4 lanes) and AVX-512 (16 and 8 lanes); other widths and
+// targets use arrays, left to the auto-vectorizer.
+
+#if defined(__AVX512F__)
+constexpr int simd_register_bytes = 64;
+#elif defined(__AVX__)
+constexpr int simd_register_bytes = 32;
+#else
+constexpr int simd_register_bytes = 16;
+#endif
+
+// Lanes of the widest registers of the target
+template <typename T>
+constexpr int default_pack_width = simd_register_bytes / (int)sizeof(T);
+
+template <typename T, int width>
+struct ScalarPack {
+  static constexpr bool simd = false;
+  T d[width];
+
+  struct Mask {
+    bool d[width];
+  };
+
+  TC_FORCE_INLINE ScalarPack(T x = T(0)) {
+    for (int i = 0; i < width; i++) {
+      d[i] = x;
+    }
+  }
+
+  static TC_FORCE_INLINE ScalarPack load(const T *p) {
+    ScalarPack ret;
+    for (int i = 0; i < width; i++) {
+      ret.d[i] = p[i];
+    }
+    return ret;
+  }
+
+  TC_FORCE_INLINE void store(T *p) const {
+    for (int i = 0; i < width; i++) {
+      p[i] = d[i];
+    }
+  }
+
+  TC_FORCE_INLINE T operator[](int i) const {
+    return d[i];
+  }
+
+#define TC_SCALAR_PACK_BINARY(op, expr)                             \
+  friend TC_FORCE_INLINE ScalarPack op(const ScalarPack &a,         \
+                                       const ScalarPack &b) {       \
+    ScalarPack ret;                                                 \
+    for (int i = 0; i < width; i++) {                               \
+      ret.d[i] = expr;                                              \
+    }                                                               \
+    return ret;                                                     \
+  }
+  TC_SCALAR_PACK_BINARY(operator+, a.d[i] + b.d[i])
+  TC_SCALAR_PACK_BINARY(operator-, a.d[i] - b.d[i])
+  TC_SCALAR_PACK_BINARY(operator*, a.d[i] * b.d[i])
+  TC_SCALAR_PACK_BINARY(operator/, a.d[i] / b.d[i])
+  TC_SCALAR_PACK_BINARY(min, std::min(a.d[i], b.d[i]))
+  TC_SCALAR_PACK_BINARY(max, std::max(a.d[i], b.d[i]))
+#undef TC_SCALAR_PACK_BINARY
+
+#define TC_SCALAR_PACK_COMPARISON(op)                                   \
+  friend TC_FORCE_INLINE Mask operator op(const ScalarPack &a,          \
+                                          const ScalarPack &b) {        \
+    Mask ret;                                                           \
+    for (int i = 0; i < width; i++) {                                   \
+      ret.d[i] = a.d[i] op b.d[i];                                      \
+    }                                                                   \
+    return ret;                                                         \
+  }
+  TC_SCALAR_PACK_COMPARISON(<)
+  TC_SCALAR_PACK_COMPARISON(<=)
+  TC_SCALAR_PACK_COMPARISON(>)
+  TC_SCALAR_PACK_COMPARISON(>=)
+  TC_SCALAR_PACK_COMPARISON(==)
+#undef TC_SCALAR_PACK_COMPARISON
+
+  TC_FORCE_INLINE ScalarPack operator-() const {
+    ScalarPack ret;
+    for (int i = 0; i < width; i++) {
+      ret.d[i] = -d[i];
+    }
+    return ret;
+  }
+
+  friend TC_FORCE_INLINE ScalarPack sqrt(const ScalarPack &a) {
+    ScalarPack ret;
+    for (int i = 0; i < width; i++) {
+      ret.d[i] = std::sqrt(a.d[i]);
+    }
+    return ret;
+  }
+
+  // Lanes of |a| where |mask| is set, and of |b| elsewhere
+  friend TC_FORCE_INLINE ScalarPack select(const Mask &mask,
+                                           const ScalarPack &a,
+                                           const ScalarPack &b) {
+    ScalarPack ret;
+    for (int i = 0; i < width; i++) {
+      ret.d[i] = mask.d[i] ? a.d[i] : b.d[i];
+    }
+    return ret;
+  }
+
+  friend TC_FORCE_INLINE bool any(const Mask &mask) {
+    for (int i = 0; i < width; i++) {
+      if (mask.d[i]) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  friend TC_FORCE_INLINE bool all(const Mask &mask) {
+    for (int i = 0; i < width; i++) {
+      if (!mask.d[i]) {
+        return false;
+      }
+    }
+    return true;
+  }
+};
+
+// Members of the register specializations, for the intrinsics named
+// prefix_op_suffix, e.g. _mm256_add_ps
+#define TC_SCALAR_PACK_REGISTER(T, width, Register, prefix, suffix)         \
+  static constexpr bool simd = true;                                        \
+  Register v;                                                               \
+                                                                            \
+  TC_FORCE_INLINE ScalarPack(T x = T(0)) : v(prefix##_set1_##suffix(x)) {   \
+  }                                                                         \
+                                                                            \
+  TC_FORCE_INLINE explicit ScalarPack(Register v) : v(v) {                  \
+  }                                                                         \
+                                                                            \
+  static TC_FORCE_INLINE ScalarPack load(const T *p) {                      \
+    return ScalarPack(prefix##_loadu_##suffix(p));                          \
+  }                                                                         \
+                                                                            \
+  TC_FORCE_INLINE void store(T *p) const {                                  \
+    prefix##_storeu_##suffix(p, v);                                         \
+  }                                                                         \
+                                                                            \
+  TC_FORCE_INLINE T operator[](int i) const {                               \
+    T d[width];                                                             \
+    store(d);                                                               \
+    return d[i];                                                            \
+  }                                                                         \
+                                                                            \
+  friend TC_FORCE_INLINE ScalarPack operator+(const ScalarPack &a,          \
+                                              const ScalarPack &b) {        \
+    return ScalarPack(prefix##_add_##suffix(a.v, b.v));                     \
+  }                                                                         \
+                                                                            \
+  friend TC_FORCE_INLINE ScalarPack operator-(const ScalarPack &a,          \
+                                              const ScalarPack &b) {        \
+    return ScalarPack(prefix##_sub_##suffix(a.v, b.v));                     \
+  }                                                                         \
+                                                                            \
+  friend TC_FORCE_INLINE ScalarPack operator*(const ScalarPack &a,          \
+                                              const ScalarPack &b) {        \
+    return ScalarPack(prefix##_mul_##suffix(a.v, b.v));                     \
+  }                                                                         \
+                                                                            \
+  friend TC_FORCE_INLINE ScalarPack operator/(const ScalarPack &a,          \
+                                              const ScalarPack &b) {        \
+    return ScalarPack(prefix##_div_##suffix(a.v, b.v));                     \
+  }                                                                         \
+                                                                            \
+  friend TC_FORCE_INLINE ScalarPack min(const ScalarPack &a,                \
+                                        const ScalarPack &b) {              \
+    return ScalarPack(prefix##_min_##suffix(a.v, b.v));                     \
+  }                                                                         \
+                                                                            \
+  friend TC_FORCE_INLINE ScalarPack max(const ScalarPack &a,                \
+                                        const ScalarPack &b) {              \
+    return ScalarPack(prefix##_max_##suffix(a.v, b.v));                     \
+  }                                                                         \
+                                                                            \
+  friend TC_FORCE_INLINE ScalarPack sqrt(const ScalarPack &a) {             \
+    return ScalarPack(prefix##_sqrt_##suffix(a.v));                         \
+  }                                                                         \
+                                                                            \
+  TC_FORCE_INLINE ScalarPack operator-() const {                            \
+    return ScalarPack(prefix##_sub_##suffix(prefix##_setzero_##suffix(), v)); \
+  }
+
+// Masks of AVX are registers with all bits of true lanes set
+#define TC_SCALAR_PACK_AVX_MASK(width, Register, suffix)                  \
+  struct Mask {                                                           \
+    Register m;                                                           \
+  };                                                                      \
+                                                                          \
+  friend TC_FORCE_INLINE Mask operator<(const ScalarPack &a,              \
+                                        const ScalarPack &b) {            \
+    return Mask{_mm256_cmp_##suffix(a.v, b.v, _CMP_LT_OQ)};               \
+  }                                                                       \
+                                                                          \
+  friend TC_FORCE_INLINE Mask operator<=(const ScalarPack &a,             \
+                                         const ScalarPack &b) {           \
+    return Mask{_mm256_cmp_##suffix(a.v, b.v, _CMP_LE_OQ)};               \
+  }                                                                       \
+                                                                          \
+  friend TC_FORCE_INLINE Mask operator>(const ScalarPack &a,              \
+                                        const ScalarPack &b) {            \
+    return Mask{_mm256_cmp_##suffix(a.v, b.v, _CMP_GT_OQ)};               \
+  }                                                                       \
+                                                                          \
+  friend TC_FORCE_INLINE Mask operator>=(const ScalarPack &a,             \
+                                         const ScalarPack &b) {           \
+    return Mask{_mm256_cmp_##suffix(a.v, b.v, _CMP_GE_OQ)};               \
+  }                                                                       \
+                                                                          \
+  friend TC_FORCE_INLINE Mask operator==(const ScalarPack &a,             \
+                                         const ScalarPack &b) {           \
+    return Mask{_mm256_cmp_##suffix(a.v, b.v, _CMP_EQ_OQ)};               \
+  }                                                                       \
+                                                                          \
+  friend TC_FORCE_INLINE ScalarPack select(const Mask &mask,              \
+                                           const ScalarPack &a,           \
+                                           const ScalarPack &b) {         \
+    return ScalarPack(_mm256_blendv_##suffix(b.v, a.v, mask.m));          \
+  }                                                                       \
+                                                                          \
+  friend TC_FORCE_INLINE bool any(const Mask &mask) {                     \
+    return _mm256_movemask_##suffix(mask.m) != 0;                         \
+  }                                                                       \
+                                                                          \
+  friend TC_FORCE_INLINE bool all(const Mask &mask) {                     \
+    return _mm256_movemask_##suffix(mask.m) == (1 << width) - 1;          \
+  }
+
+// Masks of AVX-512 are mask registers, of a bit per lane
+#define TC_SCALAR_PACK_AVX512_MASK(width, MaskRegister, suffix)           \
+  struct Mask {                                                           \
+    MaskRegister m;                                                       \
+  };                                                                      \
+                                                                          \
+  friend TC_FORCE_INLINE Mask operator<(const ScalarPack &a,              \
+                                        const ScalarPack &b) {            \
+    return Mask{_mm512_cmp_##suffix##_mask(a.v, b.v, _CMP_LT_OQ)};        \
+  }                                                                       \
+                                                                          \
+  friend TC_FORCE_INLINE Mask operator<=(const ScalarPack &a,             \
+                                         const ScalarPack &b) {           \
+    return Mask{_mm512_cmp_##suffix##_mask(a.v, b.v, _CMP_LE_OQ)};        \
+  }                                                                       \
+                                                                          \
+  friend TC_FORCE_INLINE Mask operator>(const ScalarPack &a,              \
+                                        const ScalarPack &b) {            \
+    return Mask{_mm512_cmp_##suffix##_mask(a.v, b.v, _CMP_GT_OQ)};        \
+  }                                                                       \
+                                                                          \
+  friend TC_FORCE_INLINE Mask operator>=(const ScalarPack &a,             \
+                                         const ScalarPack &b) {           \
+    return Mask{_mm512_cmp_##suffix##_mask(a.v, b.v, _CMP_GE_OQ)};        \
+  }                                                                       \
+                                                                          \
+  friend TC_FORCE_INLINE Mask operator==(const ScalarPack &a,             \
+                                         const ScalarPack &b) {           \
+    return Mask{_mm512_cmp_##suffix##_mask(a.v, b.v, _CMP_EQ_OQ)};        \
+  }                                                                       \
+                                                                          \
+  friend TC_FORCE_INLINE ScalarPack select(const Mask &mask,              \
+                                           const ScalarPack &a,           \
+                                           const ScalarPack &b) {         \
+    return ScalarPack(_mm512_mask_blend_##suffix(mask.m, b.v, a.v));      \
+  }                                                                       \
+                                                                          \
+  friend TC_FORCE_INLINE bool any(const Mask &mask) {                     \
+    return mask.m != 0;                                                   \
+  }                                                                       \
+                                                                          \
+  friend TC_FORCE_INLINE bool all(const Mask &mask) {                     \
+    return mask.m == (MaskRegister)((1 << width) - 1);                    \
+  }
+
+#if defined(__AVX__)
+template <>
+struct ScalarPack<float32, 8> {
+  TC_SCALAR_PACK_REGISTER(float32, 8, __m256, _mm256, ps)
+  TC_SCALAR_PACK_AVX_MASK(8, __m256, ps)
+};
+
+template <>
+struct ScalarPack<float64, 4> {
+  TC_SCALAR_PACK_REGISTER(float64, 4, __m256d, _mm256, pd)
+  TC_SCALAR_PACK_AVX_MASK(4, __m256d, pd)
+};
+#endif
+
+#if defined(__AVX512F__)
+template <>
+struct ScalarPack<float32, 16> {
+  TC_SCALAR_PACK_REGISTER(float32, 16, __m512, _mm512, ps)
+  TC_SCALAR_PACK_AVX512_MASK(16, __mmask16, ps)
+};
+
+template <>
+struct ScalarPack<float64, 8> {
+  TC_SCALAR_PACK_REGISTER(float64, 8, __m512d, _mm512, pd)
+  TC_SCALAR_PACK_AVX512_MASK(8, __mmask8, pd)
+};
+#endif
+
+#undef TC_SCALAR_PACK_REGISTER
+#undef TC_SCALAR_PACK_AVX_MASK
+#undef TC_SCALAR_PACK_AVX512_MASK
+
+template <typename T, int width>
+TC_FORCE_INLINE ScalarPack<T, width> &operator+=(
+    ScalarPack<T, width> &a,
+    const ScalarPack<T, width> &b) {
+  return a = a + b;
+}
+
+template <typename T, int width>
+TC_FORCE_INLINE ScalarPack<T, width> &operator-=(
+    ScalarPack<T, width> &a,
+    const ScalarPack<T, width> &b) {
+  return a = a - b;
+}
+
+template <typename T, int width>
+TC_FORCE_INLINE ScalarPack<T, width> &operator*=(
+    ScalarPack<T, width> &a,
+    const ScalarPack<T, width> &b) {
+  return a = a * b;
+}
+
+template <typename T, int width>
+TC_FORCE_INLINE ScalarPack<T, width> &operator/=(
+    ScalarPack<T, width> &a,
+    const ScalarPack<T, width> &b) {
+  return a = a / b;
+}
+
+// |width| vectors of VectorND<dim, T>, component by component
+template <int dim__, typename T, int width__ = default_pack_width<T>>
+struct VectorPack {
+  static constexpr int dim = dim__;
+  static constexpr int width = width__;
+  using Scalar = ScalarPack<T, width>;
+  using Vector = VectorND<dim, T>;
+
+  Scalar d[dim];
+
+  TC_FORCE_INLINE VectorPack() {
+  }
+
+  TC_FORCE_INLINE explicit VectorPack(const Scalar &x) {
+    for (int i = 0; i < dim; i++) {
+      d[i] = x;
+    }
+  }
+
+  // Every lane |v|
+  TC_FORCE_INLINE explicit VectorPack(const Vector &v) {
+    for (int i = 0; i < dim; i++) {
+      d[i] = Scalar(v[i]);
+    }
+  }
+
+  TC_FORCE_INLINE VectorPack(const Scalar &x, const Scalar &y) {
+    static_assert(dim == 2, "Two components for two-dimensional packs only");
+    d[0] = x;
+    d[1] = y;
+  }
+
+  TC_FORCE_INLINE VectorPack(const Scalar &x,
+                             const Scalar &y,
+                             const Scalar &z) {
+    static_assert(dim == 3,
+                  "Three components for three-dimensional packs only");
+    d[0] = x;
+    d[1] = y;
+    d[2] = z;
+  }
+
+  TC_FORCE_INLINE VectorPack(const Scalar &x,
+                             const Scalar &y,
+                             const Scalar &z,
+                             const Scalar &w) {
+    static_assert(dim == 4, "Four components for four-dimensional packs only");
+    d[0] = x;
+    d[1] = y;
+    d[2] = z;
+    d[3] = w;
+  }
+
+  // The vectors p[0] to p[width - 1]
+  template <InstSetExt ISE>
+  static VectorPack load(const VectorND<dim, T, ISE> *p) {
+    T lanes[dim][width];
+    for (int l = 0; l < width; l++) {
+      for (int i = 0; i < dim; i++) {
+        lanes[i][l] = p[l][i];
+      }
+    }
+    VectorPack ret;
+    for (int i = 0; i < dim; i++) {
+      ret.d[i] = Scalar::load(lanes[i]);
+    }
+    return ret;
+  }
+
+  template <InstSetExt ISE>
+  void store(VectorND<dim, T, ISE> *p) const {
+    T lanes[dim][width];
+    for (int i = 0; i < dim; i++) {
+      d[i].store(lanes[i]);
+    }
+    for (int l = 0; l < width; l++) {
+      for (int i = 0; i < dim; i++) {
+        p[l][i] = lanes[i][l];
+      }
+    }
+  }
+
+  // The vector of lane |l|
+  Vector get(int l) const {
+    Vector ret;
+    for (int i = 0; i < dim; i++) {
+      ret[i] = d[i][l];
+    }
+    return ret;
+  }
+
+  TC_FORCE_INLINE Scalar &operator[](int i) {
+    return d[i];
+  }
+
+  TC_FORCE_INLINE const Scalar &operator[](int i) const {
+    return d[i];
+  }
+
+#define TC_VECTOR_PACK_BINARY(op, Other, other)                       \
+  friend TC_FORCE_INLINE VectorPack operator op(const VectorPack &a,  \
+                                                const Other &b) {     \
+    VectorPack ret;                                                   \
+    for (int i = 0; i < dim; i++) {                                   \
+      ret.d[i] = a.d[i] op other;                                     \
+    }                                                                 \
+    return ret;                                                       \
+  }                                                                   \
+                                                                      \
+  friend TC_FORCE_INLINE VectorPack &operator op##=(VectorPack &a,    \
+                                                    const Other &b) { \
+    return a = a op b;                                                \
+  }
+  TC_VECTOR_PACK_BINARY(+, VectorPack, b.d[i])
+  TC_VECTOR_PACK_BINARY(-, VectorPack, b.d[i])
+  TC_VECTOR_PACK_BINARY(*, VectorPack, b.d[i])
+  TC_VECTOR_PACK_BINARY(/, VectorPack, b.d[i])
+  TC_VECTOR_PACK_BINARY(*, Scalar, b)
+  TC_VECTOR_PACK_BINARY(/, Scalar, b)
+#undef TC_VECTOR_PACK_BINARY
+
+  friend TC_FORCE_INLINE VectorPack operator*(const Scalar &a,
+                                              const VectorPack &b) {
+    return b * a;
+  }
+
+  TC_FORCE_INLINE VectorPack operator-() const {
+    VectorPack ret;
+    for (int i = 0; i < dim; i++) {
+      ret.d[i] = -d[i];
+    }
+    return ret;
+  }
+
+  friend TC_FORCE_INLINE Scalar dot(const VectorPack &a, const VectorPack &b) {
+    Scalar ret = a.d[0] * b.d[0];
+    for (int i = 1; i < dim; i++) {
+      ret += a.d[i] * b.d[i];
+    }
+    return ret;
+  }
+
+  friend TC_FORCE_INLINE Scalar length2(const VectorPack &a) {
+    return dot(a, a);
+  }
+
+  friend TC_FORCE_INLINE Scalar length(const VectorPack &a) {
+    return sqrt(dot(a, a));
+  }
+
+  friend TC_FORCE_INLINE VectorPack normalized(const VectorPack &a) {
+    return a * (Scalar(T(1)) / length(a));
+  }
+
+  friend TC_FORCE_INLINE VectorPack min(const VectorPack &a,
+                                        const VectorPack &b) {
+    VectorPack ret;
+    for (int i = 0; i < dim; i++) {
+      ret.d[i] = min(a.d[i], b.d[i]);
+    }
+    return ret;
+  }
+
+  friend TC_FORCE_INLINE VectorPack max(const VectorPack &a,
+                                        const VectorPack &b) {
+    VectorPack ret;
+    for (int i = 0; i < dim; i++) {
+      ret.d[i] = max(a.d[i], b.d[i]);
+    }
+    return ret;
+  }
+
+  friend TC_FORCE_INLINE VectorPack select(const typename Scalar::Mask &mask,
+                                           const VectorPack &a,
+                                           const VectorPack &b) {
+    VectorPack ret;
+    for (int i = 0; i < dim; i++) {
+      ret.d[i] = select(mask, a.d[i], b.d[i]);
+    }
+    return ret;
+  }
+};
+
+template <typename T, int width>
+TC_FORCE_INLINE VectorPack<3, T, width> cross(
+    const VectorPack<3, T, width> &a,
+    const VectorPack<3, T, width> &b) {
+  return VectorPack<3, T, width>(a[1] * b[2] - a[2] * b[1],
+                                 a[2] * b[0] - a[0] * b[2],
+                                 a[0] * b[1] - a[1] * b[0]);
+}
+
+// |width| matrices of MatrixND<dim, T>, stored by columns as MatrixND
+template <int dim__, typename T, int width__ = default_pack_width<T>>
+struct MatrixPack {
+  static constexpr int dim = dim__;
+  static constexpr int width = width__;
+  using Scalar = ScalarPack<T, width>;
+  using Vector = VectorPack<dim, T, width>;
+  using Matrix = MatrixND<dim, T>;
+
+  Vector d[dim];
+
+  TC_FORCE_INLINE MatrixPack() {
+  }
+
+  // Every lane |x| times the identity
+  TC_FORCE_INLINE explicit MatrixPack(const Scalar &x) {
+    for (int i = 0; i < dim; i++) {
+      for (int j = 0; j < dim; j++) {
+        d[i][j] = i == j ? x : Scalar(T(0));
+      }
+    }
+  }
+
+  // Every lane |m|
+  TC_FORCE_INLINE explicit MatrixPack(const Matrix &m) {
+    for (int i = 0; i < dim; i++) {
+      d[i] = Vector(m[i]);
+    }
+  }
+
+  // The matrices p[0] to p[width - 1]
+  template <InstSetExt ISE>
+  static MatrixPack load(const MatrixND<dim, T, ISE> *p) {
+    T lanes[dim][dim][width];
+    for (int l = 0; l < width; l++) {
+      for (int i = 0; i < dim; i++) {
+        for (int j = 0; j < dim; j++) {
+          lanes[i][j][l] = p[l][i][j];
+        }
+      }
+    }
+    MatrixPack ret;
+    for (int i = 0; i < dim; i++) {
+      for (int j = 0; j < dim; j++) {
+        ret.d[i][j] = Scalar::load(lanes[i][j]);
+      }
+    }
+    return ret;
+  }
+
+  template <InstSetExt ISE>
+  void store(MatrixND<dim, T, ISE> *p) const {
+    T lanes[dim][dim][width];
+    for (int i = 0; i < dim; i++) {
+      for (int j = 0; j < dim; j++) {
+        d[i][j].store(lanes[i][j]);
+      }
+    }
+    for (int l = 0; l < width; l++) {
+      for (int i = 0; i < dim; i++) {
+        for (int j = 0; j < dim; j++) {
+          p[l][i][j] = lanes[i][j][l];
+        }
+      }
+    }
+  }
+
+  Matrix get(int l) const {
+    Matrix ret;
+    for (int i = 0; i < dim; i++) {
+      ret[i] = d[i].get(l);
+    }
+    return ret;
+  }
+
+  // Column |i|
+  TC_FORCE_INLINE Vector &operator[](int i) {
+    return d[i];
+  }
+
+  TC_FORCE_INLINE const Vector &operator[](int i) const {
+    return d[i];
+  }
+
+  // Entry of row |i| and column |j|
+  TC_FORCE_INLINE Scalar &operator()(int i, int j) {
+    return d[j][i];
+  }
+
+  TC_FORCE_INLINE const Scalar &operator()(int i, int j) const {
+    return d[j][i];
+  }
+
+  friend TC_FORCE_INLINE MatrixPack operator+(const MatrixPack &a,
+                                              const MatrixPack &b) {
+    MatrixPack ret;
+    for (int i = 0; i < dim; i++) {
+      ret.d[i] = a.d[i] + b.d[i];
+    }
+    return ret;
+  }
+
+  friend TC_FORCE_INLINE MatrixPack operator-(const MatrixPack &a,
+                                              const MatrixPack &b) {
+    MatrixPack ret;
+    for (int i = 0; i < dim; i++) {
+      ret.d[i] = a.d[i] - b.d[i];
+    }
+    return ret;
+  }
+
+  friend TC_FORCE_INLINE MatrixPack operator*(const Scalar &a,
+                                              const MatrixPack &b) {
+    MatrixPack ret;
+    for (int i = 0; i < dim; i++) {
+      ret.d[i] = b.d[i] * a;
+    }
+    return ret;
+  }
+
+  friend TC_FORCE_INLINE Vector operator*(const MatrixPack &a,
+                                          const Vector &b) {
+    Vector ret = a.d[0] * b[0];
+    for (int i = 1; i < dim; i++) {
+      ret += a.d[i] * b[i];
+    }
+    return ret;
+  }
+
+  friend TC_FORCE_INLINE MatrixPack operator*(const MatrixPack &a,
+                                              const MatrixPack &b) {
+    MatrixPack ret;
+    for (int i = 0; i < dim; i++) {
+      ret.d[i] = a * b.d[i];
+    }
+    return ret;
+  }
+
+  friend TC_FORCE_INLINE MatrixPack transposed(const MatrixPack &a) {
+    MatrixPack ret;
+    for (int i = 0; i < dim; i++) {
+      for (int j = 0; j < dim; j++) {
+        ret.d[i][j] = a.d[j][i];
+      }
+    }
+    return ret;
+  }
+};
+
+using Vector3fPack = VectorPack<3, float32>;
+using Vector3dPack = VectorPack<3, float64>;
+using Matrix3fPack = MatrixPack<3, float32>;
+using Matrix3dPack = MatrixPack<3, float64>;
+
+TC_NAMESPACE_END
@@ -0,0 +1,264 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+#include <taichi/common/util.h>
+#include <taichi/math/math.h>
+#include <taichi/system/threading.h>
+
+#include <algorithm>
+#include <atomic>
+#include <utility>
+#include <vector>
+
+TC_NAMESPACE_BEGIN
+
+// Neighbour search on a uniform grid of cells (a cell-linked list) over the
+// bounding box of a point set. The points are binned with a counting sort,
+// in O(n), and stored in cell order, so that the points of a query are
+// contiguous in memory. Queries are const and can run concurrently.
+template <int DIM>
+class NeighbourGrid {
+ public:
+  using Vector = VectorND<DIM, real>;
+  using VectorI = VectorND<DIM, int>;
+
+  NeighbourGrid() {
+    initialize(std::vector<Vector>(), 1.0_f);
+  }
+
+  NeighbourGrid(const std::vector<Vector> &points,
+                real cell_size,
+                int num_threads = -1) {
+    initialize(points, cell_size, num_threads);
+  }
+
+  // |cell_size| is best set to the radius of the queries. It is enlarged
+  // when the points are so sparse that there would be many more cells than
+  // points.
+  void initialize(const std::vector<Vector> &points,
+                  real cell_size,
+                  int num_threads = -1) {
+    TC_ASSERT_INFO(cell_size > 0, "cell_size must be positive");
+    int n = (int)points.size();
+    lower = Vector(0.0_f);
+    Vector upper(0.0_f);
+    if (n > 0) {
+      lower = upper = points[0];
+    }
+    for (auto &p : points) {
+      for (int d = 0; d < DIM; d++) {
+        lower[d] = std::min(lower[d], p[d]);
+        upper[d] = std::max(upper[d], p[d]);
+      }
+    }
+    int64 num_cells;
+    while (true) {
+      num_cells = 1;
+      for (int d = 0; d < DIM; d++) {
+        res[d] = (int)((upper[d] - lower[d]) / cell_size) + 1;
+        num_cells *= res[d];
+      }
+      if (num_cells <= 4 * (int64)n + 1024) {
+        break;
+      }
+      cell_size *= 2;
+    }
+    this->cell_size = cell_size;
+    inv_cell_size = 1.0_f / cell_size;
+
+    std::vector<int> key(n);
+    std::vector<std::atomic<int>> count(num_cells);
+    for (auto &c : count) {
+      c.store(0, std::memory_order_relaxed);
+    }
+    ThreadedTaskManager::run(n, num_threads, [&](int i) {
+      key[i] = linearize(get_cell(points[i]));
+      count[key[i]].fetch_add(1, std::memory_order_relaxed);
+    });
+    cell_begin.resize(num_cells + 1);
+    cell_begin[0] = 0;
+    for (int64 c = 0; c < num_cells; c++) {
+      cell_begin[c + 1] = cell_begin[c] + count[c].load();
+      // From now on the insertion cursor of the cell
+      count[c].store(cell_begin[c], std::memory_order_relaxed);
+    }
+    sorted_index.resize(n);
+    ThreadedTaskManager::run(n, num_threads, [&](int i) {
+      sorted_index[count[key[i]].fetch_add(1)] = i;
+    });
+    // The scatter above is racy in its order within a cell
+    ThreadedTaskManager::run((int)num_cells, num_threads, [&](int c) {
+      std::sort(sorted_index.begin() + cell_begin[c],
+                sorted_index.begin() + cell_begin[c + 1]);
+    });
+    sorted_points.resize(n);
+    ThreadedTaskManager::run(n, num_threads, [&](int i) {
+      sorted_points[i] = points[sorted_index[i]];
+    });
+  }
+
+  int get_num_points() const {
+    return (int)sorted_index.size();
+  }
+
+  real get_cell_size() const {
+    return cell_size;
+  }
+
+  // Calls |f(index, dist2)| for every point within |radius| of |p|, where
+  // |dist2| is the squared distance
+  template <typename F>
+  void for_each_neighbour(const Vector &p, real radius, const F &f) const {
+    VectorI begin = get_cell(p - Vector(radius));
+    VectorI end = get_cell(p + Vector(radius)) + VectorI(1);
+    real radius2 = radius * radius;
+    for_each_cell(begin, end, [&](int c) {
+      for (int k = cell_begin[c]; k < cell_begin[c + 1]; k++) {
+        real dist2 = (sorted_points[k] - p).length2();
+        if (dist2 <= radius2) {
+          f(sorted_index[k], dist2);
+        }
+      }
+    });
+  }
+
+  // Indices of the points within |radius| of |p|, nearest first
+  void query_radius(const Vector &p,
+                    real radius,
+                    std::vector<int> &index) const {
+    std::vector<std::pair<real, int>> found;
+    for_each_neighbour(p, radius, [&](int i, real dist2) {
+      found.push_back(std::make_pair(dist2, i));
+    });
+    std::sort(found.begin(), found.end());
+    index.resize(found.size());
+    for (int i = 0; i < (int)found.size(); i++) {
+      index[i] = found[i].second;
+    }
+  }
+
+  // The |n| points nearest to |p|, nearest first, with their squared
+  // distances. As in NearestNeighbour2D::query_n, missing neighbours are
+  // padded with index -1 and distance 1e30.
+  void query_n(const Vector &p,
+               int n,
+               std::vector<int> &index,
+               std::vector<real> &dist2) const {
+    // (squared distance, index) of the nearest points so far, sorted
+    std::vector<std::pair<real, int>> best;
+    best.reserve(n + 1);
+    auto visit = [&](int c) {
+      for (int k = cell_begin[c]; k < cell_begin[c + 1]; k++) {
+        auto candidate = std::make_pair((sorted_points[k] - p).length2(),
+                                        sorted_index[k]);
+        if ((int)best.size() == n && !(candidate < best.back())) {
+          continue;
+        }
+        best.insert(std::upper_bound(best.begin(), best.end(), candidate),
+                    candidate);
+        if ((int)best.size() > n) {
+          best.pop_back();
+        }
+      }
+    };
+    // Visit rings of cells around the cell of |p|. Once rings 0 to r - 1
+    // are visited, the other points are at least (r - 1) * cell_size away.
+    VectorI center = get_cell(p);
+    int max_ring = 0;
+    for (int d = 0; d < DIM; d++) {
+      max_ring =
+          std::max(max_ring, std::max(center[d], res[d] - 1 - center[d]));
+    }
+    for (int ring = 0; ring <= max_ring && n > 0; ring++) {
+      if (ring > 0 && (int)best.size() == n) {
+        real bound = (ring - 1) * cell_size;
+        if (best.back().first <= bound * bound) {
+          break;
+        }
+      }
+      VectorI begin, end;
+      for (int d = 0; d < DIM; d++) {
+        begin[d] = std::max(center[d] - ring, 0);
+        end[d] = std::min(center[d] + ring + 1, res[d]);
+      }
+      for_each_cell(begin, end, ring, center, visit);
+    }
+    index.assign(n, -1);
+    dist2.assign(n, 1e30_f);
+    for (int i = 0; i < (int)best.size(); i++) {
+      dist2[i] = best[i].first;
+      index[i] = best[i].second;
+    }
+  }
+
+ private:
+  Vector lower;
+  real cell_size, inv_cell_size;
+  VectorI res;
+  // Points of cell c: sorted_index[cell_begin[c]..cell_begin[c + 1])
+  std::vector<int> cell_begin;
+  std::vector<int> sorted_index;
+  std::vector<Vector> sorted_points;
+
+  // Clamped to the grid, so that every position has a cell
+  VectorI get_cell(const Vector &p) const {
+    VectorI cell;
+    for (int d = 0; d < DIM; d++) {
+      real x = (p[d] - lower[d]) * inv_cell_size;
+      cell[d] = (int)std::floor(clamp(x, 0.0_f, (real)(res[d] - 1)));
+    }
+    return cell;
+  }
+
+  int linearize(const VectorI &cell) const {
+    int c = 0;
+    for (int d = 0; d < DIM; d++) {
+      c = c * res[d] + cell[d];
+    }
+    return c;
+  }
+
+  // Calls |f(c)| for the cells in [begin, end), in memory order
+  template <typename F>
+  void for_each_cell(const VectorI &begin,
+                     const VectorI &end,
+                     const F &f) const {
+    for_each_cell(begin, end, 0, begin, f);
+  }
+
+  // Same, for the cells at Chebyshev distance |ring| from |center| only
+  template <typename F>
+  void for_each_cell(const VectorI &begin,
+                     const VectorI &end,
+                     int ring,
+                     const VectorI &center,
+                     const F &f) const {
+    VectorI cell = begin;
+    while (true) {
+      int dist = 0;
+      for (int d = 0; d < DIM; d++) {
+        dist = std::max(dist, std::abs(cell[d] - center[d]));
+      }
+      if (dist >= ring) {
+        f(linearize(cell));
+      }
+      int d = DIM - 1;
+      while (d >= 0 && ++cell[d] == end[d]) {
+        cell[d] = begin[d];
+        d--;
+      }
+      if (d < 0) {
+        return;
+      }
+    }
+  }
+};
+
+using NeighbourGrid2D = NeighbourGrid<2>;
+using NeighbourGrid3D = NeighbourGrid<3>;
+
+TC_NAMESPACE_END
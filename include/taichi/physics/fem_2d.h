@@ -1,8 +1,15 @@
+#pragma once
+
 #include <taichi/common/util.h>
 #include <taichi/math.h>
 #include <taichi/system/timer.h>
 #include <taichi/common/dict.h>
 #include <taichi/system/profiler.h>
+#include <taichi/system/threading.h>
+#include <taichi/math/array_parallel.h>
+
+#include <algorithm>
+#include <numeric>
 
 TC_NAMESPACE_BEGIN
 
@@ -92,7 +99,7 @@ class HexFEMSolver {
 
   // returns: Kx
   virtual Array<Vector> apply_K(const Array<real> &density,
-                                Array<Vector> x) const {
+                                const Array<Vector> &x) const {
     TC_NOT_IMPLEMENTED;
     return x;
   }
@@ -167,53 +174,258 @@ inline std::vector<float64> get_Ke<2>(Material material) {
   return Ke;
 }
 
-template <typename T>
-float64 dot_product(const T &a, const T &b) {
-  assert_info(a.get_size() == b.get_size(),
-              "Arrays for dot product must have same shapes.");
-  float64 sum(0);
-  int size = a.get_size();
-#pragma omp parallel for reduction(+ : sum)
-  for (int i = 0; i < size; i++) {
-    sum += a.data[i].dot(b.data[i]);
+// Geometric multigrid V-cycles for the stiffness matrix of
+// CPUCGHexFEMSolver, to precondition its CG. Every level stores its matrix
+// as 3^dim-point stencils of dim x dim blocks on the nodes, in the layout of
+// Array<Vector> (the last axis is contiguous). The finest level is assembled
+// from the element densities with the fixed degrees of freedom removed;
+// coarser levels are Galerkin products P^T A P with the bilinear
+// interpolation P from coarse node I at fine node 2 I, so that the density
+// contrast carries over to the coarse levels. Smoothing is damped block
+// Jacobi, the same before and after the coarse correction, which keeps the
+// preconditioner symmetric. 2D only, like the solver.
+template <int dim>
+class HexFEMMultigrid {
+ public:
+  using Vector = VectorND<dim, real>;
+  using Vectori = VectorND<dim, int>;
+  using Matrix = MatrixND<dim, real>;
+  static constexpr int stencil_size = pow<dim>(3);
+
+  int num_threads = -1;
+  int smoothing_steps = 2;
+  int coarsest_steps = 50;
+  real jacobi_weight = 0.6_f;
+
+  // Stencil offset (a, b), with a, b in [-1, 1]
+  static int get_offset_index(int a, int b) {
+    return (a + 1) * 3 + (b + 1);
   }
-  return sum;
-}
 
-template <typename T>
-real p_abs_max(const T &a) {
-  real max_val(0);
-  int size = a.get_size();
-#pragma omp parallel for reduction(max : max_val)
-  for (int i = 0; i < size; i++) {
-    max_val = std::max(max_val, a.data[i].abs_max());
+  // |stencils| is the matrix of the finest level ([node * stencil_size +
+  // offset]) and |free| has 1 for the free and 0 for the fixed degrees of
+  // freedom of every node
+  void initialize(const Vectori &num_nodes,
+                  std::vector<Matrix> stencils,
+                  const std::vector<Vector> &free) {
+    levels.clear();
+    levels.emplace_back();
+    levels[0].res = num_nodes;
+    levels[0].stencils = std::move(stencils);
+    this->free = free;
+    int n = num_nodes[0] * num_nodes[1];
+    // Remove the rows and columns of the fixed degrees of freedom
+    ThreadedTaskManager::run(num_nodes[0], num_threads, [&](int i) {
+      for (int j = 0; j < num_nodes[1]; j++) {
+        int f = i * num_nodes[1] + j;
+        for (int a = -1; a <= 1; a++) {
+          for (int b = -1; b <= 1; b++) {
+            int gi = i + a, gj = j + b;
+            if (!inside(num_nodes, gi, gj)) {
+              continue;
+            }
+            int g = gi * num_nodes[1] + gj;
+            Matrix &block = levels[0].stencils[f * stencil_size +
+                                               get_offset_index(a, b)];
+            for (int p = 0; p < dim; p++) {
+              for (int q = 0; q < dim; q++) {
+                block(p, q) *= free[f][p] * free[g][q];
+              }
+            }
+          }
+        }
+      }
+    });
+    while (levels.back().res[0] > 3 && levels.back().res[1] > 3) {
+      levels.emplace_back();
+      coarsen(levels[levels.size() - 2], levels.back());
+    }
+    for (auto &level : levels) {
+      int size = level.res[0] * level.res[1];
+      level.x.assign(size, Vector(0.0_f));
+      level.b.assign(size, Vector(0.0_f));
+      level.residual.assign(size, Vector(0.0_f));
+      level.inv_diagonals.resize(size);
+      for (int f = 0; f < size; f++) {
+        Matrix diagonal = level.stencils[f * stencil_size + stencil_size / 2];
+        for (int p = 0; p < dim; p++) {
+          if (&level == &levels[0] && free[f][p] == 0) {
+            diagonal(p, p) = 1;
+          }
+        }
+        real det = determinant(diagonal);
+        level.inv_diagonals[f] =
+            std::abs(det) > 1e-30_f ? inversed(diagonal) : Matrix(0.0_f);
+      }
+    }
+    TC_ASSERT_INFO((int)levels[0].x.size() == n, "Incorrect stencil size");
   }
-  return max_val;
-}
 
-// a = a + alpha * b
-template <typename S, typename T>
-void p_add_in_place(T &a, const S alpha, const T &b) {
-  assert_info(a.get_size() == b.get_size(),
-              "Arrays for add_in_place must have same shapes.");
-  int size = a.get_size();
-#pragma omp parallel for
-  for (int i = 0; i < size; i++) {
-    a.data[i] = a.data[i] + alpha * b.data[i];
+  int get_num_levels() const {
+    return (int)levels.size();
   }
-}
 
-// b = a + alpha * b
-template <typename S, typename T>
-void p_add_in_place2(const T &a, const S alpha, T &b) {
-  assert_info(a.get_size() == b.get_size(),
-              "Arrays for add_in_place must have same shapes.");
-  int size = a.get_size();
-#pragma omp parallel for
-  for (int i = 0; i < size; i++) {
-    b.data[i] = a.data[i] + alpha * b.data[i];
+  // z ~= A^-1 r, with the fixed degrees of freedom of r and z zero
+  template <typename Array>
+  void v_cycle(const Array &r, Array &z) {
+    std::copy(r.data.begin(), r.data.end(), levels[0].b.begin());
+    run(0);
+    std::copy(levels[0].x.begin(), levels[0].x.end(), z.data.begin());
   }
-}
+
+ private:
+  struct Level {
+    // Nodes
+    Vectori res;
+    std::vector<Matrix> stencils, inv_diagonals;
+    std::vector<Vector> x, b, residual;
+  };
+  std::vector<Level> levels;
+  std::vector<Vector> free;
+
+  static bool inside(const Vectori &res, int i, int j) {
+    return 0 <= i && i < res[0] && 0 <= j && j < res[1];
+  }
+
+  // The coarse nodes interpolating to fine node coordinate |f|, with their
+  // weights; returns their number
+  static int get_parents(int f, int parents[2], real weights[2]) {
+    if (f % 2 == 0) {
+      parents[0] = f / 2;
+      weights[0] = 1;
+      return 1;
+    }
+    parents[0] = f / 2;
+    parents[1] = f / 2 + 1;
+    weights[0] = weights[1] = 0.5_f;
+    return 2;
+  }
+
+  void coarsen(const Level &fine, Level &coarse) {
+    coarse.res = fine.res / Vectori(2) + Vectori(1);
+    coarse.stencils.assign(coarse.res[0] * coarse.res[1] * stencil_size,
+                           Matrix(0.0_f));
+    ThreadedTaskManager::run(coarse.res[0], num_threads, [&](int ci) {
+      for (int cj = 0; cj < coarse.res[1]; cj++) {
+        Matrix *row =
+            &coarse.stencils[(ci * coarse.res[1] + cj) * stencil_size];
+        // Fine nodes f in the support of coarse node I, with weights P(f, I)
+        for (int fa = -1; fa <= 1; fa++) {
+          for (int fb = -1; fb <= 1; fb++) {
+            int fi = ci * 2 + fa, fj = cj * 2 + fb;
+            if (!inside(fine.res, fi, fj)) {
+              continue;
+            }
+            real wf = (fa == 0 ? 1 : 0.5_f) * (fb == 0 ? 1 : 0.5_f);
+            const Matrix *fine_row =
+                &fine.stencils[(fi * fine.res[1] + fj) * stencil_size];
+            for (int ga = -1; ga <= 1; ga++) {
+              for (int gb = -1; gb <= 1; gb++) {
+                int gi = fi + ga, gj = fj + gb;
+                if (!inside(fine.res, gi, gj)) {
+                  continue;
+                }
+                Matrix block = wf * fine_row[get_offset_index(ga, gb)];
+                int pi[2], pj[2];
+                real wi[2], wj[2];
+                int ni = get_parents(gi, pi, wi);
+                int nj = get_parents(gj, pj, wj);
+                for (int u = 0; u < ni; u++) {
+                  for (int v = 0; v < nj; v++) {
+                    row[get_offset_index(pi[u] - ci, pj[v] - cj)] +=
+                        (wi[u] * wj[v]) * block;
+                  }
+                }
+              }
+            }
+          }
+        }
+      }
+    });
+  }
+
+  // residual = b - A x
+  void compute_residual(Level &level) {
+    const Vectori res = level.res;
+    ThreadedTaskManager::run(res[0], num_threads, [&](int i) {
+      for (int j = 0; j < res[1]; j++) {
+        int f = i * res[1] + j;
+        const Matrix *row = &level.stencils[f * stencil_size];
+        Vector sum = level.b[f];
+        for (int a = -1; a <= 1; a++) {
+          for (int b = -1; b <= 1; b++) {
+            if (inside(res, i + a, j + b)) {
+              sum -= row[get_offset_index(a, b)] *
+                     level.x[(i + a) * res[1] + j + b];
+            }
+          }
+        }
+        level.residual[f] = sum;
+      }
+    });
+  }
+
+  void smooth(Level &level, int steps) {
+    for (int k = 0; k < steps; k++) {
+      compute_residual(level);
+      ThreadedTaskManager::run(level.res[0], num_threads, [&](int i) {
+        for (int j = 0; j < level.res[1]; j++) {
+          int f = i * level.res[1] + j;
+          level.x[f] +=
+              jacobi_weight * (level.inv_diagonals[f] * level.residual[f]);
+        }
+      });
+    }
+  }
+
+  void run(int l) {
+    Level &level = levels[l];
+    std::fill(level.x.begin(), level.x.end(), Vector(0.0_f));
+    if (l + 1 == (int)levels.size()) {
+      smooth(level, coarsest_steps);
+      return;
+    }
+    smooth(level, smoothing_steps);
+    compute_residual(level);
+    Level &coarse = levels[l + 1];
+    // Restriction, b_c = P^T residual
+    ThreadedTaskManager::run(coarse.res[0], num_threads, [&](int ci) {
+      for (int cj = 0; cj < coarse.res[1]; cj++) {
+        Vector sum(0.0_f);
+        for (int fa = -1; fa <= 1; fa++) {
+          for (int fb = -1; fb <= 1; fb++) {
+            int fi = ci * 2 + fa, fj = cj * 2 + fb;
+            if (inside(level.res, fi, fj)) {
+              real wf = (fa == 0 ? 1 : 0.5_f) * (fb == 0 ? 1 : 0.5_f);
+              sum += wf * level.residual[fi * level.res[1] + fj];
+            }
+          }
+        }
+        coarse.b[ci * coarse.res[1] + cj] = sum;
+      }
+    });
+    run(l + 1);
+    // Prolongation, x += P x_c, not to the fixed degrees of freedom
+    ThreadedTaskManager::run(level.res[0], num_threads, [&](int i) {
+      int pi[2], pj[2];
+      real wi[2], wj[2];
+      int ni = get_parents(i, pi, wi);
+      for (int j = 0; j < level.res[1]; j++) {
+        int nj = get_parents(j, pj, wj);
+        Vector sum(0.0_f);
+        for (int u = 0; u < ni; u++) {
+          for (int v = 0; v < nj; v++) {
+            sum += (wi[u] * wj[v]) * coarse.x[pi[u] * coarse.res[1] + pj[v]];
+          }
+        }
+        int f = i * level.res[1] + j;
+        level.x[f] += l == 0 ? sum * free[f] : sum;
+      }
+    });
+    smooth(level, smoothing_steps);
+  }
+};
+
 template <int dim>
 class CPUCGHexFEMSolver : public HexFEMSolver<dim> {
  public:
@@ -232,13 +444,35 @@ class CPUCGHexFEMSolver : public HexFEMSolver<dim> {
   using typename Base::Vector;
   using typename Base::Vectori;
 
+  // Multigrid preconditioning of the CG, off by default
   bool use_preconditioner;
 
   int cg_restart;
 
+  // -1 uses all cores
+  int num_threads = -1;
+
   template <typename T>
   using Array = ArrayND<dim, T>;
 
+  static constexpr int num_element_nodes = pow<dim>(2);
+
+  // Ke in dim x dim blocks, ke_blocks[n][m][p][q] coupling axis p of the
+  // element node n with axis q of the element node m, where element node
+  // (i0, i1) is 2 * i0 + i1
+  real ke_blocks[num_element_nodes][num_element_nodes][dim][dim];
+
+  // CG workspace, kept over solves
+  Array<Vector> f, r, p, Kp, Kx, z;
+
+  // Kept over solves too, and rebuilt once the stiffness of an element
+  // changed by more than this (relative) factor since, as the densities of
+  // topology optimization converge
+  real multigrid_rebuild_tolerance;
+  HexFEMMultigrid<dim> multigrid;
+  bool multigrid_valid;
+  Array<real> multigrid_density;
+
   void initialize(Vectori res, int penalty) {
     Config config;
     config.set("res", res);
@@ -247,6 +481,26 @@ class CPUCGHexFEMSolver : public HexFEMSolver<dim> {
     config.set("material", &material);
     Base::initialize(config);
     cg_restart = config.get<int>("cg_restart", 0);
+    use_preconditioner = false;
+    multigrid_rebuild_tolerance = 0.2_f;
+    multigrid_valid = false;
+    for (int n = 0; n < num_element_nodes; n++) {
+      for (int m = 0; m < num_element_nodes; m++) {
+        for (int i = 0; i < dim; i++) {
+          for (int j = 0; j < dim; j++) {
+            int row = get_index(n / 2, n % 2, i);
+            int column = get_index(m / 2, m % 2, j);
+            ke_blocks[n][m][i][j] = (real)Ke(row, column);
+          }
+        }
+      }
+    }
+  }
+
+  void set_boundary_condition(
+      const typename Base::BoundaryCondition &boundary_condition) override {
+    Base::set_boundary_condition(boundary_condition);
+    multigrid_valid = false;
   }
 
   void enforce_boundary_condition(Array<Vector> &u) const {
@@ -261,75 +515,159 @@ class CPUCGHexFEMSolver : public HexFEMSolver<dim> {
     }
   }
 
+  // Gather form: every node sums the contributions of the elements around
+  // it, so that rows of nodes are independent and run in parallel
   void apply_K_impl(const Array<real> &density,
-                    Array<Vector> &x,
+                    const Array<Vector> &x,
                     Array<Vector> &Kx,
                     bool profile = false) const {
-    Kx.reset(Vector(0));
     assert(Kx.get_res() == x.get_res());
-    int penalty = int(this->penalty);
-    for (auto ind : density.get_region()) {
-      real d = density[ind];
-      real scale = d;
-      for (int i = 1; i < penalty; i++) {
-        scale *= d;
-      }
-      for (int offsetKxi = 0; offsetKxi < dim; offsetKxi++) {
-        for (int offsetKxj = 0; offsetKxj < dim; offsetKxj++) {
-          for (int offsetxi = 0; offsetxi < dim; offsetxi++) {
-            for (int offsetxj = 0; offsetxj < dim; offsetxj++) {
-              real tmp[2] = {0, 0};
-              const Vector x_in = x[ind + Vector2i(offsetxi, offsetxj)];
-              for (int i = 0; i < dim; i++) {
-                for (int j = 0; j < dim; j++) {
-                  int row = get_index(offsetKxi, offsetKxj, i);
-                  int column = get_index(offsetxi, offsetxj, j);
-                  const real coeff = Ke(row, column);
-                  tmp[i] += coeff * x_in[j];
-                }
+    const Vectori num_elements = density.get_res();
+    const int height = x.get_res()[1];
+    const int penalty = int(this->penalty);
+    ThreadedTaskManager::run(x.get_res()[0], num_threads, [&](int i) {
+      for (int j = 0; j < height; j++) {
+        Vector sum(0.0_f);
+        for (int n = 0; n < num_element_nodes; n++) {
+          // The node is element node n of element (ei, ej)
+          int ei = i - n / 2, ej = j - n % 2;
+          if (ei < 0 || ej < 0 || ei >= num_elements[0] ||
+              ej >= num_elements[1]) {
+            continue;
+          }
+          real d = density[ei][ej];
+          real scale = d;
+          for (int k = 1; k < penalty; k++) {
+            scale *= d;
+          }
+          Vector element_sum(0.0_f);
+          for (int m = 0; m < num_element_nodes; m++) {
+            const Vector &x_in = x[ei + m / 2][ej + m % 2];
+            for (int p = 0; p < dim; p++) {
+              for (int q = 0; q < dim; q++) {
+                element_sum[p] += ke_blocks[n][m][p][q] * x_in[q];
               }
-              for (int i = 0; i < dim; i++)
-                Kx[ind + Vector2i(offsetKxi, offsetKxj)][i] += tmp[i] * scale;
             }
           }
+          sum += scale * element_sum;
         }
+        Kx[i][j] = sum;
       }
-    }
+    });
   }
 
   // returns: project(Kx)
   Array<Vector> apply_K(const Array<real> &density,
-                        Array<Vector> x) const override {
-    enforce_boundary_condition(x);
-    Array<Vector> Kx = x.same_shape(Vector(0.0_f));
-    apply_K_impl(density, x, Kx);
+                        const Array<Vector> &x) const override {
+    Array<Vector> Kx = apply_K_no_projection(density, x);
     project(Kx);
     return Kx;
   }
 
   // returns: Kx
   Array<Vector> apply_K_no_projection(const Array<real> &density,
-                                      Array<Vector> x) const {
-    enforce_boundary_condition(x);
+                                      const Array<Vector> &x) const {
+    Array<Vector> x_bc = x;
+    enforce_boundary_condition(x_bc);
     Array<Vector> Kx = x.same_shape(Vector(0.0_f));
-    apply_K_impl(density, x, Kx);
+    apply_K_impl(density, x_bc, Kx);
     return Kx;
   }
 
+  // K as the stencils of HexFEMMultigrid
+  void assemble_K(const Array<real> &density,
+                  std::vector<typename HexFEMMultigrid<dim>::Matrix> &stencils)
+      const {
+    using Matrix = typename HexFEMMultigrid<dim>::Matrix;
+    constexpr int stencil_size = HexFEMMultigrid<dim>::stencil_size;
+    const Vectori num_elements = density.get_res();
+    const Vectori num_nodes = num_elements + Vectori(1);
+    const int penalty = int(this->penalty);
+    stencils.assign(num_nodes[0] * num_nodes[1] * stencil_size,
+                    Matrix(0.0_f));
+    ThreadedTaskManager::run(num_nodes[0], num_threads, [&](int i) {
+      for (int j = 0; j < num_nodes[1]; j++) {
+        Matrix *row = &stencils[(i * num_nodes[1] + j) * stencil_size];
+        for (int n = 0; n < num_element_nodes; n++) {
+          int ei = i - n / 2, ej = j - n % 2;
+          if (ei < 0 || ej < 0 || ei >= num_elements[0] ||
+              ej >= num_elements[1]) {
+            continue;
+          }
+          real d = density[ei][ej];
+          real scale = d;
+          for (int k = 1; k < penalty; k++) {
+            scale *= d;
+          }
+          for (int m = 0; m < num_element_nodes; m++) {
+            Matrix &block = row[HexFEMMultigrid<dim>::get_offset_index(
+                ei + m / 2 - i, ej + m % 2 - j)];
+            for (int p = 0; p < dim; p++) {
+              for (int q = 0; q < dim; q++) {
+                block(p, q) += scale * ke_blocks[n][m][p][q];
+              }
+            }
+          }
+        }
+      }
+    });
+  }
+
+  void update_multigrid(const Array<real> &density) {
+    if (multigrid_valid &&
+        multigrid_density.get_res() == density.get_res()) {
+      real max_change = 0;
+      for (int i = 0; i < density.get_size(); i++) {
+        real ratio =
+            density.data[i] / std::max(multigrid_density.data[i], 1e-20_f);
+        max_change = std::max(
+            max_change, std::abs(std::pow(ratio, this->penalty) - 1));
+      }
+      if (max_change <= multigrid_rebuild_tolerance) {
+        return;
+      }
+    }
+    std::vector<typename HexFEMMultigrid<dim>::Matrix> stencils;
+    assemble_K(density, stencils);
+    Vectori num_nodes = density.get_res() + Vectori(1);
+    Array<Vector> free(num_nodes, Vector(1.0_f));
+    project(free);
+    multigrid.num_threads = num_threads;
+    multigrid.initialize(
+        num_nodes, std::move(stencils),
+        std::vector<Vector>(free.data.begin(), free.data.end()));
+    multigrid_density = density;
+    multigrid_valid = true;
+  }
+
   Array<Vector> solve(const Array<real> &density,
                       const Array<Vector> &f_,
                       const Array<Vector> &initial_guess,
                       Array<real> &dc,
                       real &objective_out) {
     Array<Vector> x = initial_guess;
-    Array<Vector> r;
-    Array<Vector> p;
+    if (r.get_res() != x.get_res()) {
+      f = r = p = Kp = Kx = z = x.same_shape(Vector(0.0_f));
+    }
+    if (use_preconditioner) {
+      update_multigrid(density);
+    }
+    // Without preconditioning, z is r
+    Array<Vector> &z = use_preconditioner ? this->z : r;
 
-    Array<Vector> x0 = initial_guess.same_shape(Vector(0.0_f));
+    // p is free until the first iteration
+    Array<Vector> &x0 = p;
+    x0.reset(Vector(0.0_f));
     enforce_boundary_condition(x0);
     TC_P(x0.abs_max());
 
-    auto f = f_ - apply_K_no_projection(density, x0);
+    apply_K_impl(density, x0, Kx);
+    for_each_vector_block(f.get_size(), num_threads,
+                          [&](int block, int begin, int end) {
+                            for (int i = begin; i < end; i++) {
+                              f.data[i] = f_.data[i] - Kx.data[i];
+                            }
+                          });
     TC_P(f.abs_max());
 
     real tolerance = cg_tolerance * f.abs_max();
@@ -337,10 +675,8 @@ class CPUCGHexFEMSolver : public HexFEMSolver<dim> {
 
     int num_iterations;
 
-    real rTr;
+    real rTz;
     real alpha, beta;
-    Array<Vector> Kp = x.same_shape(Vector(0.0_f));
-    Array<Vector> Kx = x.same_shape(Vector(0.0_f));
 
     float64 t_apply_time = 0;
     float64 t_start = Time::get_time();
@@ -352,29 +688,37 @@ class CPUCGHexFEMSolver : public HexFEMSolver<dim> {
           before_restart = r.abs_max();
         }
         apply_K_impl(density, x, Kx);
-        r = f - Kx;
+        for_each_vector_block(r.get_size(), num_threads,
+                              [&](int block, int begin, int end) {
+                                for (int i = begin; i < end; i++) {
+                                  r.data[i] = f.data[i] - Kx.data[i];
+                                }
+                              });
         project(r);
-        p = r;
+        if (use_preconditioner) {
+          multigrid.v_cycle(r, z);
+        }
+        p = z;
         if (k) {
-          restart_ratio =
-              std::max(restart_ratio, p_abs_max(r) / before_restart);
+          restart_ratio = std::max(restart_ratio,
+                                   p_abs_max(r, num_threads) / before_restart);
         }
       }
 
-      Profiler _("cg_iteration");
+      TC_PROFILER("cg_iteration");
       // auto t_cg = Time::get_time();
       apply_K_impl(density, p, Kp, true);
       // t_apply_time += Time::get_time() - t_cg;
       project(Kp);
       {
-        Profiler __("dp1");
-        rTr = dot_product(r, r);
-        alpha = rTr / (dot_product(p, Kp) + 1e-100_f);
+        TC_PROFILER("dp1");
+        rTz = dot_product(r, z, num_threads);
+        alpha = rTz / (dot_product(p, Kp, num_threads) + 1e-100_f);
       }
       {
-        Profiler __("vec_add1");
-        p_add_in_place(x, alpha, p);
-        p_add_in_place(r, -alpha, Kp);
+        TC_PROFILER("vec_add1");
+        p_add_in_place(x, alpha, p, num_threads);
+        p_add_in_place(r, -alpha, Kp, num_threads);
       }
       if (print_residuals) {
         TC_P(r.abs_max());
@@ -383,12 +727,16 @@ class CPUCGHexFEMSolver : public HexFEMSolver<dim> {
           printf("iter %d, %f\n", k, r.abs_max());
         }
       }
-      if (k >= cg_min_iterations && p_abs_max(r) < tolerance) {
+      if (k >= cg_min_iterations && p_abs_max(r, num_threads) < tolerance) {
         printf("CG converged in %d iterations\n", k);
         break;
       }
-      TC_PROFILE("dp2", beta = dot_product(r, r) / (rTr + 1e-100_f));
-      TC_PROFILE("vec_add2", p_add_in_place2(r, beta, p));
+      if (use_preconditioner) {
+        TC_PROFILE("v_cycle", multigrid.v_cycle(r, z));
+      }
+      TC_PROFILE("dp2", beta = dot_product(r, z, num_threads) /
+                                (rTz + 1e-100_f));
+      TC_PROFILE("vec_add2", p_add_in_place2(z, beta, p, num_threads));
     }
 
     if (p_abs_max(r) >= tolerance) {
@@ -148,26 +148,79 @@ double radiance_from_wavelength_and_temperature(double wavelength,
           1);
 }
 
-Vector3d rgb_from_temperature(float temp) {
-  Vector3d radiance(0);
-  Vector3d c;
-  for (int i = 0; i < 256; i++) {
-    double lambda = 360.0_f + (750.0_f - 360.0_f) * (i + 0.5f) / 256.0f;
-    Vector3d color(spectrum_to_rgb[i * 4], spectrum_to_rgb[i * 4 + 1],
-                   spectrum_to_rgb[i * 4 + 2]);
-    double intensity =
-        radiance_from_wavelength_and_temperature(lambda * 1e-9, temp);
-    radiance += color * intensity;
+// The table in single precision, and the bin of wavelength i of each lane
+static const Vector3 *get_rgb_table() {
+  static const std::vector<Vector3> table = [] {
+    std::vector<Vector3> t(spectrum_bins);
+    for (int i = 0; i < spectrum_bins; i++) {
+      t[i] = Vector3((real)spectrum_to_rgb[i * 4],
+                     (real)spectrum_to_rgb[i * 4 + 1],
+                     (real)spectrum_to_rgb[i * 4 + 2]);
+    }
+    return t;
+  }();
+  return table.data();
+}
+
+static int wavelength_bin(real wavelength) {
+  real x = (wavelength - spectrum_lower) *
+           (spectrum_bins / (spectrum_upper - spectrum_lower));
+  // Also for NaNs
+  return x >= 0 && x < spectrum_bins ? (int)x : -1;
+}
+
+Vector3 rgb_from_wavelength(real wavelength) {
+  int bin = wavelength_bin(wavelength);
+  return bin >= 0 ? get_rgb_table()[bin] : Vector3(0.0_f);
+}
+
+void rgb_from_wavelengths(const real wavelengths[4], Vector3 rgb[4]) {
+  const Vector3 *table = get_rgb_table();
+  int bins[4];
+  for (int k = 0; k < 4; k++) {
+    bins[k] = wavelength_bin(wavelengths[k]);
   }
-  for (int i = 0; i < 3; i++) {
-    radiance[i] = std::max(radiance[i], 0.0);
+  for (int k = 0; k < 4; k++) {
+    rgb[k] = bins[k] >= 0 ? table[bins[k]] : Vector3(0.0_f);
   }
-  return radiance;
 }
+
+void sample_hero_wavelengths(real u, real wavelengths[4]) {
+  const real range = spectrum_upper - spectrum_lower;
+  for (int k = 0; k < 4; k++) {
+    real x = u + k * 0.25_f;
+    x -= (real)(x >= 1);
+    wavelengths[k] = spectrum_lower + range * x;
+  }
+}
+
+// Planck's law, as c1 / lambda^5 / (exp(c2 / (lambda T)) - 1). The factors
+// of the bins do not depend on the temperature, so they are computed once,
+// and every entry of the table costs an exp per bin.
 Spectrum::Spectrum() {
+  std::vector<double> c1(spectrum_bins), c2(spectrum_bins);
+  for (int i = 0; i < spectrum_bins; i++) {
+    double lambda = (spectrum_lower + (spectrum_upper - spectrum_lower) *
+                                          (i + 0.5) / spectrum_bins) *
+                    1e-9;
+    c1[i] = 1e-12 * 2.0 * plank_constant * pow((double)speed_of_light, 2.0) /
+            pow(lambda, 5.0);
+    c2[i] = plank_constant * speed_of_light / (lambda * boltzmann_constant);
+  }
   samples.resize(maximum_temperature);
-  for (int i = 0; i < maximum_temperature; i++) {
-    samples[i] = rgb_from_temperature((float)i);
+  for (int t = 0; t < maximum_temperature; t++) {
+    Vector3d radiance(0);
+    double inv_t = 1.0 / t;
+    for (int i = 0; i < spectrum_bins; i++) {
+      double intensity = c1[i] / (exp(c2[i] * inv_t) - 1);
+      radiance += Vector3d(spectrum_to_rgb[i * 4], spectrum_to_rgb[i * 4 + 1],
+                           spectrum_to_rgb[i * 4 + 2]) *
+                  intensity;
+    }
+    for (int i = 0; i < 3; i++) {
+      radiance[i] = std::max(radiance[i], 0.0);
+    }
+    samples[t] = radiance;
   }
 }
 
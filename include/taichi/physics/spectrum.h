@@ -10,16 +10,38 @@
 
 TC_NAMESPACE_BEGIN
 
+// The linear sRGB response to wavelengths is tabulated in |spectrum_bins|
+// bins over [spectrum_lower, spectrum_upper) nm
+constexpr int spectrum_bins = 256;
+constexpr real spectrum_lower = 360;
+constexpr real spectrum_upper = 750;
+
+// Weight of the bin of |wavelength| (nm) in the color; 0 outside the range.
+// A spectrum's color is the sum over the bins of the weight times the
+// radiance at the bin, so with uniform wavelengths, the estimate of a
+// sample is spectrum_bins times the weight times the radiance.
+Vector3 rgb_from_wavelength(real wavelength);
+
+// Of four wavelengths at once, e.g. the ones of a hero wavelength sample
+void rgb_from_wavelengths(const real wavelengths[4], Vector3 rgb[4]);
+
+// Hero wavelength sampling (Wilkie et al., "Hero Wavelength Spectral
+// Sampling"): |u| picks the hero in the range, and the other three are
+// rotated from it by quarters of the range. Each has a pdf of
+// 1 / (spectrum_upper - spectrum_lower).
+void sample_hero_wavelengths(real u, real wavelengths[4]);
+
+// Linear sRGB of black bodies, tabulated by the kelvin
 class Spectrum {
   std::vector<Vector3d> samples;
   const int maximum_temperature = 20000;
 
  public:
   Spectrum();
-  Vector3d sample(real temperature) {
+  Vector3d sample(real temperature) const {
     assert_info(0 <= temperature && temperature < maximum_temperature,
                 "Spectrum Query out of Range");
-    int index = (int)floor(temperature);
+    int index = std::min((int)floor(temperature), maximum_temperature - 2);
     double frac = temperature - index;
     return samples[index] * (1 - frac) + samples[index + 1] * (frac);
   }
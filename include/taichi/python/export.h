@@ -14,6 +14,9 @@
 #include <pybind11/pybind11.h>
 #include <pybind11/operators.h>
 #include <pybind11/stl.h>
+#include <chrono>
+#include <functional>
+#include <future>
 #include <vector>
 
 #if defined(_MSC_VER)
@@ -44,9 +47,57 @@ void export_io(py::module &m);
 
 void export_ndarray(py::module &m);
 
-#define DEFINE_VECTOR_OF_NAMED(x, name)                                   \
-  py::class_<std::vector<x>>(m, name)                                     \
-      .def(py::init<>())                                                  \
+// A native call run on its own thread, e.g. a render stage, so that Python
+// threads keep running meanwhile. The objects it uses must not be touched
+// by Python until it is done; |references| keeps them alive. Exceptions of
+// the call are raised by wait().
+class AsyncCall {
+ public:
+  AsyncCall(const std::function<void()> &f, py::tuple references)
+      : future(std::async(std::launch::async, f).share()),
+        references(references) {
+  }
+
+  // The |references| are released with the GIL held, but not before the
+  // call is done
+  ~AsyncCall() {
+    if (!done()) {
+      py::gil_scoped_release release;
+      future.wait();
+    }
+  }
+
+  bool done() const {
+    return future.wait_for(std::chrono::seconds(0)) ==
+           std::future_status::ready;
+  }
+
+  // Waits for at most |timeout| seconds, or with no limit if it is < 0,
+  // with the GIL released; returns done()
+  bool wait(real timeout) {
+    {
+      py::gil_scoped_release release;
+      if (timeout < 0) {
+        future.wait();
+      } else {
+        future.wait_for(std::chrono::duration<real>(timeout));
+      }
+    }
+    if (!done()) {
+      return false;
+    }
+    future.get();
+    return true;
+  }
+
+ private:
+  std::shared_future<void> future;
+  py::tuple references;
+};
+
+// The list methods of std::vector<x>, on the py::class_ |cls|
+#define DEFINE_VECTOR_METHODS(x, cls)                                     \
+  cls.def(py::init<>())                                                   \
       .def("clear", &std::vector<x>::clear)                               \
       .def("append",                                                      \
            [](std::vector<x> &vec, const x &val) { vec.push_back(val); }) \
@@ -58,7 +109,10 @@ void export_ndarray(py::module &m);
            },                                                             \
            py::keep_alive<0, 1>())                                        \
       .def("write", &write_vector_to_disk<x>)                             \
-      .def("read", &read_vector_from_disk<x>);
+      .def("read", &read_vector_from_disk<x>)
+
+#define DEFINE_VECTOR_OF_NAMED(x, name) \
+  DEFINE_VECTOR_METHODS(x, py::class_<std::vector<x>>(m, name))
 
 #define DEFINE_VECTOR_OF(x) DEFINE_VECTOR_OF_NAMED(x, #x "List");
 
@@ -0,0 +1,131 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+#include <taichi/common/util.h>
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+TC_NAMESPACE_BEGIN
+
+// Bump allocation of the temporaries of a sample, a packet or a substep,
+// which are freed together, when the ArenaScope around them ends. Blocks
+// are kept for later scopes, so that once the arena has grown to the
+// largest scope, loops of scopes allocate without malloc. An arena is
+// used by one thread; get_thread_arena() gives each thread its own.
+class Arena {
+ public:
+  struct Marker {
+    int block;
+    std::size_t offset;
+  };
+
+  explicit Arena(std::size_t block_size = std::size_t(1) << 16);
+
+  void *allocate(std::size_t bytes,
+                 std::size_t alignment = alignof(std::max_align_t));
+
+  // Frees |ptr| if it is the last allocation, e.g. the old buffer of a
+  // vector that grows in place; other allocations wait for their scope
+  void deallocate(void *ptr, std::size_t bytes);
+
+  Marker get_marker() const {
+    return Marker{current, offset};
+  }
+
+  // Frees the allocations made since |marker|
+  void reset(const Marker &marker) {
+    current = marker.block;
+    offset = marker.offset;
+  }
+
+  // In the blocks, including the freed parts
+  std::size_t get_capacity() const;
+
+  static Arena &get_thread_arena();
+
+ private:
+  struct Block {
+    std::unique_ptr<char[]> data;
+    std::size_t size;
+  };
+
+  std::size_t block_size;
+  std::vector<Block> blocks;
+  int current;
+  std::size_t offset;
+};
+
+class ArenaScope {
+ public:
+  explicit ArenaScope(Arena &arena = Arena::get_thread_arena())
+      : arena(arena), marker(arena.get_marker()) {
+  }
+
+  ~ArenaScope() {
+    arena.reset(marker);
+  }
+
+  ArenaScope(const ArenaScope &) = delete;
+  ArenaScope &operator=(const ArenaScope &) = delete;
+
+ private:
+  Arena &arena;
+  Arena::Marker marker;
+};
+
+// For containers that live in an ArenaScope, on the thread arena by default
+template <typename T>
+class ArenaAllocator {
+ public:
+  using value_type = T;
+
+  template <typename U>
+  struct rebind {
+    using other = ArenaAllocator<U>;
+  };
+
+  ArenaAllocator() : arena(&Arena::get_thread_arena()) {
+  }
+
+  explicit ArenaAllocator(Arena &arena) : arena(&arena) {
+  }
+
+  template <typename U>
+  ArenaAllocator(const ArenaAllocator<U> &o) : arena(o.get_arena()) {
+  }
+
+  T *allocate(std::size_t n) {
+    return reinterpret_cast<T *>(arena->allocate(n * sizeof(T), alignof(T)));
+  }
+
+  void deallocate(T *ptr, std::size_t n) {
+    arena->deallocate(ptr, n * sizeof(T));
+  }
+
+  Arena *get_arena() const {
+    return arena;
+  }
+
+  template <typename U>
+  bool operator==(const ArenaAllocator<U> &o) const {
+    return arena == o.get_arena();
+  }
+
+  template <typename U>
+  bool operator!=(const ArenaAllocator<U> &o) const {
+    return arena != o.get_arena();
+  }
+
+ private:
+  Arena *arena;
+};
+
+template <typename T>
+using ArenaVector = std::vector<T, ArenaAllocator<T>>;
+
+TC_NAMESPACE_END
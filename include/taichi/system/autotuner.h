@@ -0,0 +1,62 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+#include <taichi/common/util.h>
+
+#include <functional>
+#include <string>
+#include <vector>
+
+TC_NAMESPACE_BEGIN
+
+// Per-machine values of the performance parameters of kernels (grain
+// sizes, thresholds for going parallel, tile sizes), which differ between
+// machines but not in the results. A parameter is looked up by name and
+// thread count in the profile of the machine, which is loaded on first
+// use. With tuning on, a parameter missing from the profile is benchmarked
+// over its candidates on first use, and the fastest is added to the
+// profile and saved; otherwise it has its default value.
+//
+// Tuning is on with TC_AUTOTUNE=1 in the environment, or set_tuning(true)
+// in a tuning run. The profile is the file TC_TUNING_PROFILE, by default
+// ~/.taichi/tuning_<host name>.txt, of lines "<name> <threads> <value>".
+class Autotuner {
+ public:
+  // The value of |name| for |num_threads| (-1: the default number): from
+  // the profile, or the candidate with the smallest benchmark(value), in
+  // seconds, if tuning, or |default_value|
+  static int get(const std::string &name,
+                 int num_threads,
+                 int default_value,
+                 const std::vector<int> &candidates,
+                 const std::function<double(int)> &benchmark);
+
+  // The value of the profile, or |default_value|, for parameters that are
+  // not benchmarked
+  static int get(const std::string &name, int num_threads, int default_value);
+
+  // Sets the value in the profile, without saving it
+  static void set(const std::string &name, int num_threads, int value);
+
+  static void set_tuning(bool tuning);
+
+  static bool get_tuning();
+
+  // Replaces the profile with the one of |path|, if it exists
+  static void load(const std::string &path);
+
+  static void save(const std::string &path);
+
+  static std::string get_profile_path();
+
+  // The smallest time of |repetitions| calls of |f|, after a warm-up one,
+  // in seconds: a benchmark of a candidate
+  static double time_best_of(const std::function<void()> &f,
+                             int repetitions = 3);
+};
+
+TC_NAMESPACE_END
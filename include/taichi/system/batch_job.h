@@ -0,0 +1,98 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+#include <taichi/common/util.h>
+#include <taichi/common/dict.h>
+#include <taichi/common/interface.h>
+#include <taichi/common/serialization.h>
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+TC_NAMESPACE_BEGIN
+
+class Scene;
+class Renderer;
+
+// A render or a simulation that runs natively, e.g. on render nodes by the
+// taichi_batch executable, without the Python interpreter. Jobs are lists
+// of sections, run in order. In text job files a section is a header
+//   [type implementation @name]
+// followed by its "key = value" config lines, with "#" comment lines.
+// Types are
+//   texture, surface_material, volume_material, camera, envmap:
+//                units, created with create_instance and their config;
+//                identical textures and surface materials are shared
+//   mesh:        Mesh, with the config of Mesh::initialize plus material,
+//                scale, rotation (Euler angles) and translate
+//   scene:       camera, envmap, envmap_sample_prob, atmosphere, bundle
+//   renderer:    a Renderer of the scene, finalized first
+//   render:      stages, time_budget (seconds), output (an fmt pattern of
+//                the stage number), output_interval, checkpoint,
+//                checkpoint_interval (stages), resume
+//   simulation2, simulation3:
+//                a Simulation, created and initialized
+//   particles:   the config of add_particles of the simulation
+//   simulate:    frames, frame_dt, substeps, output (a pattern of the frame
+//                number for write_frame, or for point clouds of the render
+//                particles if .ply), checkpoint, checkpoint_interval
+//                (frames), resume
+// Values "@name" refer to the units and meshes of earlier sections. Outputs
+// and checkpoints are written in the background while the job continues.
+class BatchJob {
+ public:
+  struct Section {
+    std::string type;
+    std::string implementation;
+    std::string name;
+    Config config;
+
+    TC_IO_DEF(type, implementation, name, config);
+  };
+
+  std::vector<Section> sections;
+
+  TC_IO_DEF(sections);
+
+  // Text job files, or the BinarySerializer form (.tcb) of save()
+  void load(const std::string &fn);
+  void save(const std::string &fn) const;
+
+  void parse(const std::string &text);
+  std::string to_text() const;
+
+  // "section.key=value", for e.g. the worker id of a node; sets the key in
+  // the sections of that type or @name
+  void set_value(const std::string &assignment);
+
+  void run();
+
+ private:
+  void run_section(Section &section);
+  // Replaces the "@name" values of |config| with their asset ids
+  void resolve_references(Config &config) const;
+  template <typename T>
+  void add_asset(const std::string &name, std::shared_ptr<T> asset);
+  // Shared with earlier units of the same config, through AssetCache
+  template <typename T>
+  void add_unit(const Section &section, bool shared = false);
+  void render(const Config &config);
+  template <typename T>
+  void simulate(std::shared_ptr<T> simulation, const Config &config);
+
+  // Held here, since AssetManager keeps weak references only
+  std::vector<std::shared_ptr<void>> assets;
+  std::map<std::string, int> asset_ids;
+  std::shared_ptr<Scene> scene;
+  std::shared_ptr<Renderer> renderer;
+  std::shared_ptr<Unit> simulation;
+  int simulation_dim = 0;
+};
+
+TC_NAMESPACE_END
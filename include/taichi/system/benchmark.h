@@ -8,14 +8,51 @@
 #include <taichi/common/interface.h>
 #include <taichi/system/timer.h>
 
+#include <map>
+#include <string>
+#include <vector>
+
 TC_NAMESPACE_BEGIN
 
+// Statistics of the per-element costs of the trials of a benchmark. The
+// mean and standard deviation leave out outliers, samples further than
+// three scaled median absolute deviations from the median.
+struct BenchmarkStatistics {
+  std::vector<float64> samples;
+  float64 mean, median, p95, stddev, min, max;
+  int num_outliers;
+  // "cycles" (time stamp counter), "core_cycles" or "s"
+  std::string unit;
+  // Benchmark-specific results, e.g. rays per second
+  std::map<std::string, float64> metrics;
+
+  BenchmarkStatistics(const std::vector<float64> &samples,
+                      const std::string &unit);
+
+  std::string to_json() const;
+};
+
 class Benchmark : public Unit {
  protected:
   int dummy;
   int warm_up_iterations;
   int64 workload;
   bool returns_time;
+  int trials;
+  // Logical CPU the trials run on, or -1
+  int pin_to_cpu;
+  // "tsc": time stamp counter cycles, which count at a constant rate;
+  // "core_cycles": cycles of the core running the calling thread
+  // (Linux perf events, falls back to "tsc"), independent of its frequency;
+  // "time": seconds
+  std::string timing;
+  // Comma-separated hardware events (see PerfCounterGroup) counted over the
+  // trials, reported per element in the metrics as "<event>_per_element",
+  // with "ipc" when both cycles and instructions are counted; "" for none
+  std::string perf_counters;
+  // Benchmark-specific results of the current run_trials(), e.g. filled by
+  // finalize(), returned in BenchmarkStatistics::metrics
+  std::map<std::string, float64> metrics;
 
   virtual void setup(){};
 
@@ -28,30 +65,24 @@ class Benchmark : public Unit {
     warm_up_iterations = config.get("warm_up_iterations", 16);
     workload = config.get("workload", int64(1024));
     returns_time = config.get("returns_time", false);
+    trials = config.get("trials", 1);
+    pin_to_cpu = config.get("pin_to_cpu", -1);
+    timing = config.get("timing", returns_time ? "time" : "tsc");
+    perf_counters = config.get("perf_counters", std::string(""));
+    TC_ASSERT_INFO(trials >= 1, "Benchmarks need at least one trial");
+    TC_ASSERT_INFO(
+        timing == "tsc" || timing == "core_cycles" || timing == "time",
+        "Benchmark timing must be tsc, core_cycles or time");
   }
 
-  // returns cycles per element (default) / time per element
+  // Costs per element of |trials| runs of |iterations| iterations each,
+  // after the warm-up iterations
+  virtual BenchmarkStatistics run_trials(int iterations = 16);
+
+  // returns cycles per element (default) / time per element, the median
+  // of the trials
   virtual real run(int iterations = 16) {
-    setup();
-    for (int i = 0; i < warm_up_iterations; i++) {
-      iterate();
-    }
-    double start_t;
-    if (returns_time)
-      start_t = Time::get_time();
-    else
-      start_t = (double)Time::get_cycles();
-    for (int i = 0; i < iterations; i++) {
-      iterate();
-    }
-    double end_t;
-    if (returns_time)
-      end_t = Time::get_time();
-    else
-      end_t = (double)Time::get_cycles();
-    real elapsed = (real)(end_t - start_t);
-    finalize();
-    return elapsed / (iterations * workload);
+    return (real)run_trials(iterations).median;
   }
 
   virtual bool test() const override {
@@ -0,0 +1,29 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+#include <taichi/common/util.h>
+
+#include <string>
+
+TC_NAMESPACE_BEGIN
+
+// Instruction set extensions of the CPU running the program, as reported
+// by cpuid, for kernels that dispatch at run time rather than on the
+// default_instruction_set of the build
+struct CPUFeatures {
+  bool sse4_2 = false;
+  bool avx = false;
+  bool avx2 = false;
+  bool fma = false;
+  bool avx512f = false;
+
+  std::string get_name() const;
+};
+
+const CPUFeatures &get_cpu_features();
+
+TC_NAMESPACE_END
@@ -1,16 +1,24 @@
+#pragma once
+
 #include "virtual_memory.h"
+#include <taichi/system/statistics.h>
+#include <fstream>
+#include <map>
+#include <string>
 
 TC_NAMESPACE_BEGIN
 
+// The peak resident memory of this process, since it started
+uint64 get_peak_memory_usage();
+
+// Samples are read from the OS, without Python, so that monitors run on
+// threads of their own, and in binaries without the interpreter.
 class MemoryMonitor {
-  // avoid including py::dict
-  // py::dict locals;
-  void *locals;
+  int pid;
   std::ofstream log;
 
  public:
   MemoryMonitor(int pid, std::string output_fn);
-  ~MemoryMonitor();
   uint64 get_usage() const;
   void append_sample();
 };
@@ -19,4 +27,31 @@ void start_memory_monitoring(std::string output_fn,
                              int pid = -1,
                              real interval = 1);
 
+// The peak resident memory of this process in a scope, e.g. a render or a
+// simulation step. Usage is sampled at the start and the end of the scope,
+// and every 'interval' seconds meanwhile once start_memory_sampling() has
+// been called. Phases nest, but are meant for one thread: peaks of phases
+// running on several threads at once are those of the whole process.
+class MemoryPhase {
+ public:
+  explicit MemoryPhase(const std::string &name);
+  ~MemoryPhase();
+
+  // The highest peak of each phase name
+  static std::map<std::string, uint64> get_peaks();
+  static void clear();
+
+  // Raises the peak of the phases running
+  static void sample();
+
+ private:
+  std::string name;
+  uint64 outer_peak;
+};
+
+// Starts the sampling thread of the phases, once; later calls do nothing
+void start_memory_sampling(real interval = 0.01_f);
+
+#define TC_MEMORY_PHASE(name) taichi::MemoryPhase _memory_phase(name);
+
 TC_NAMESPACE_END
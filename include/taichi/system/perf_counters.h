@@ -0,0 +1,67 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+#include <taichi/common/util.h>
+
+#include <string>
+#include <vector>
+
+TC_NAMESPACE_BEGIN
+
+// A group of hardware performance counters of the calling thread (Linux
+// perf events), scheduled onto the PMU together so that their ratios are
+// consistent. Events are named
+//   cycles, instructions, branches, branch_misses, cache_references,
+//   cache_misses, l1d_read_misses, llc_read_misses, dtlb_read_misses,
+//   stalled_cycles_frontend, stalled_cycles_backend,
+//   task_clock (nanoseconds), page_faults (software events)
+// or given as "raw:<hex code>" for model-specific events, e.g. the packed
+// floating point instructions retired by width, for vector instruction
+// mixes. Counts are scaled up when the kernel multiplexes the group. Where
+// perf events are not available (other platforms, perf_event_paranoid, or
+// virtual machines without a PMU), the group is invalid and reads zeros.
+class PerfCounterGroup {
+ public:
+  explicit PerfCounterGroup(const std::vector<std::string> &events);
+
+  // Comma-separated, as in "instructions,cache_misses"
+  static std::vector<std::string> parse_events(const std::string &events);
+
+  ~PerfCounterGroup();
+
+  PerfCounterGroup(const PerfCounterGroup &) = delete;
+  PerfCounterGroup &operator=(const PerfCounterGroup &) = delete;
+
+  bool valid() const {
+    return !fds.empty();
+  }
+
+  const std::vector<std::string> &get_events() const {
+    return events;
+  }
+
+  // The counts since the group was opened, one per event, into |counts|
+  void read(uint64 *counts) const;
+
+  void read(std::vector<uint64> &counts) const {
+    counts.resize(events.size());
+    read(counts.data());
+  }
+
+  std::vector<uint64> read() const {
+    std::vector<uint64> counts;
+    read(counts);
+    return counts;
+  }
+
+ private:
+  std::vector<std::string> events;
+  // fds[0] leads the group
+  std::vector<int> fds;
+};
+
+TC_NAMESPACE_END
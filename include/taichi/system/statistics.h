@@ -0,0 +1,78 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+#include <taichi/common/util.h>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+TC_NAMESPACE_BEGIN
+
+// Named event counters, e.g. the rays traced or the V-cycles run, for the
+// throughput and the efficiency of renderers and solvers. Every thread
+// adds to its own counters, which only it writes, so that counting is a
+// plain load and store; get_counters() sums the counters of all threads
+// with atomic loads, and may be called while they count. As with
+// TC_PROFILE, counter names are interned once per call site of TC_STAT.
+class Statistics {
+ public:
+  static constexpr int max_counters = 256;
+
+  struct ThreadCounters {
+    std::atomic<int64> values[max_counters];
+
+    ThreadCounters() {
+      for (auto &v : values) {
+        v.store(0, std::memory_order_relaxed);
+      }
+    }
+  };
+
+  // The id of a counter name; thread safe, but takes a lock
+  static int get_counter_id(const std::string &name);
+
+  static ThreadCounters &get_thread_counters() {
+    thread_local ThreadCounters *counters = get_instance().register_thread();
+    return *counters;
+  }
+
+  static void add(int id, int64 value) {
+    auto &v = get_thread_counters().values[id];
+    v.store(v.load(std::memory_order_relaxed) + value,
+            std::memory_order_relaxed);
+  }
+
+  // The sums over all threads of the counters interned so far
+  static std::map<std::string, int64> get_counters();
+
+  // Resets the counters of all threads. Counts added meanwhile by other
+  // threads may be lost.
+  static void clear();
+
+ private:
+  std::mutex mut;
+  std::vector<std::string> names;
+  std::map<std::string, int> ids;
+  // Kept after their threads exit, for their counts
+  std::vector<std::unique_ptr<ThreadCounters>> threads;
+
+  ThreadCounters *register_thread();
+
+  static Statistics &get_instance();
+};
+
+// |name| is interned once per call site, and so must not vary there
+#define TC_STAT(name, value)                                            \
+  {                                                                     \
+    static const int _counter = taichi::Statistics::get_counter_id(name); \
+    taichi::Statistics::add(_counter, (taichi::int64)(value));          \
+  }
+
+TC_NAMESPACE_END
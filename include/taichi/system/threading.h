@@ -6,7 +6,9 @@
 #pragma once
 
 #include <taichi/common/util.h>
+#include <taichi/system/statistics.h>
 
+#include <immintrin.h>
 #include <atomic>
 #include <functional>
 #include <thread>
@@ -18,6 +20,8 @@
 #include <unistd.h>
 #endif
 #if !defined(TC_AMALGAMATED)
+// For the observers of the arenas, which pin their threads
+#define TBB_PREVIEW_LOCAL_OBSERVER 1
 #include <tbb/tbb.h>
 #define TBB_PREVIEW_GLOBAL_CONTROL 1
 #include <tbb/global_control.h>
@@ -25,9 +29,16 @@
 
 TC_NAMESPACE_BEGIN
 
+// Test-and-test-and-set: waiting threads spin on loads of their cached
+// copy of the latch, with exponentially more pauses between attempts, and
+// only write the line when it looks free. With set_contention_counter(),
+// acquisitions that had to wait, and the attempts they made, are counted
+// in Statistics, to find the hot locks.
 class Spinlock {
  protected:
   std::atomic<bool> latch;
+  int contention_counter = -1;
+  int spin_counter = -1;
 
  public:
   Spinlock() : Spinlock(false) {
@@ -40,11 +51,14 @@ class Spinlock {
   Spinlock(int flag) : Spinlock(flag != 0) {
   }
 
+  bool try_lock() {
+    return !latch.load(std::memory_order_relaxed) &&
+           !latch.exchange(true, std::memory_order_acquire);
+  }
+
   void lock() {
-    bool unlatched = false;
-    while (!latch.compare_exchange_weak(unlatched, true,
-                                        std::memory_order_acquire)) {
-      unlatched = false;
+    if (!try_lock()) {
+      lock_contended();
     }
   }
 
@@ -52,16 +66,67 @@ class Spinlock {
     latch.store(false, std::memory_order_release);
   }
 
+  // Counts the contended acquisitions as "<name>_contentions" and their
+  // attempts as "<name>_spins"
+  void set_contention_counter(const std::string &name) {
+    contention_counter = Statistics::get_counter_id(name + "_contentions");
+    spin_counter = Statistics::get_counter_id(name + "_spins");
+  }
+
   Spinlock(const Spinlock &o) {
     // We just ignore racing condition here...
     latch.store(o.latch.load());
+    contention_counter = o.contention_counter;
+    spin_counter = o.spin_counter;
   }
 
   Spinlock &operator=(const Spinlock &o) {
     // We just ignore racing condition here...
     latch.store(o.latch.load());
+    contention_counter = o.contention_counter;
+    spin_counter = o.spin_counter;
     return *this;
   }
+
+ private:
+  static constexpr int max_backoff = 64;
+
+  TC_FORCE_INLINE static void pause() {
+    _mm_pause();
+  }
+
+  void lock_contended() {
+    int backoff = 1;
+    int64 spins = 0;
+    while (true) {
+      while (latch.load(std::memory_order_relaxed)) {
+        for (int i = 0; i < backoff; i++) {
+          pause();
+        }
+        spins++;
+        if (backoff < max_backoff) {
+          backoff *= 2;
+        } else {
+          // e.g. the holder was preempted
+          std::this_thread::yield();
+        }
+      }
+      if (!latch.exchange(true, std::memory_order_acquire)) {
+        break;
+      }
+    }
+    if (contention_counter >= 0) {
+      Statistics::add(contention_counter, 1);
+      Statistics::add(spin_counter, spins);
+    }
+  }
+};
+
+// A lock per cache line, for arrays of locks that are taken together
+// (e.g. per pixel or per cell), without false sharing between them
+class alignas(64) PaddedSpinlock : public Spinlock {
+ public:
+  using Spinlock::Spinlock;
 };
 
 class ThreadedTaskManager {
@@ -76,18 +141,49 @@ class ThreadedTaskManager {
     }
   };
 #endif
+#if !defined(TC_AMALGAMATED)
+  // The arena of |num_threads| threads (-1: the default number), created by
+  // the first call for that count and kept for the later ones
+  static tbb::task_arena &get_arena(int num_threads);
+#endif
+
+  // With pinning, the threads of the arenas are pinned to the CPUs of the
+  // process, in the order of their NUMA nodes, while they work in them,
+  // and parallel loops give the same iterations to the same threads in
+  // every call. Workers then reuse the memory they first touched, e.g. the
+  // slabs of arrays, which stays on their node. Off by default; set by the
+  // "pin_threads" of Renderer and Simulation configs.
+  static void set_thread_pinning(bool pin);
+
+  static bool get_thread_pinning();
+
+  // The CPUs the process may run on, by NUMA node; one node where there is
+  // no NUMA information (non-Linux)
+  static const std::vector<std::vector<int>> &get_numa_nodes();
+
   template <typename T>
   void static run(const T &target, int begin, int end, int num_threads) {
 #if !defined(TC_AMALGAMATED)
-    if (num_threads > 0) {
-      tbb::task_arena limited_arena(num_threads);
-      limited_arena.execute([&]() { tbb::parallel_for(begin, end, target); });
+    TC_ASSERT_INFO(
+        num_threads > 0 || num_threads == -1,
+        fmt::format(
+            "num_threads must be a positive number or -1, instead of [{}]",
+            num_threads));
+    if (get_thread_pinning()) {
+      get_arena(num_threads).execute([&]() {
+        // The same split, onto the same threads, in every call
+        tbb::parallel_for(tbb::blocked_range<int>(begin, end),
+                          [&](const tbb::blocked_range<int> &r) {
+                            for (int i = r.begin(); i < r.end(); i++) {
+                              target(i);
+                            }
+                          },
+                          tbb::static_partitioner());
+      });
+    } else if (num_threads > 0) {
+      get_arena(num_threads).execute(
+          [&]() { tbb::parallel_for(begin, end, target); });
     } else {
-      TC_ASSERT_INFO(
-          num_threads == -1,
-          fmt::format(
-              "num_threads must be a positive number or -1, instead of [{}]",
-              num_threads));
       tbb::parallel_for(begin, end, target);
     }
 #else
@@ -109,6 +205,163 @@ class ThreadedTaskManager {
   void static run(int end, int num_threads, const T &target) {
     return run(target, 0, end, num_threads);
   }
+
+  // Deterministic reductions and scans: [begin, end) is split into blocks
+  // of |block_size| items, a partition that only depends on the range, the
+  // blocks run in parallel as in run(), and their results are combined in
+  // block order. Results are the same for any num_threads and schedule,
+  // even for operations that are not associative, like sums of floats.
+  static constexpr int default_block_size = 4096;
+
+  // combine(...combine(combine(identity, f(b_0)), f(b_1))..., f(b_k)) of
+  // the blocks b_i = (begin_i, end_i), with f(begin_i, end_i) of type T
+  template <typename T, typename F, typename C>
+  T static reduce(int begin,
+                  int end,
+                  int num_threads,
+                  const T &identity,
+                  const F &f,
+                  const C &combine,
+                  int block_size = default_block_size) {
+    std::vector<T> partial(get_num_blocks(begin, end, block_size), identity);
+    for_each_block(begin, end, num_threads, block_size,
+                   [&](int block, int block_begin, int block_end) {
+                     partial[block] = f(block_begin, block_end);
+                   });
+    T ret = identity;
+    for (const T &p : partial) {
+      ret = combine(ret, p);
+    }
+    return ret;
+  }
+
+  // Exclusive scan: calls output(i, prefix) for i in [begin, end), where
+  // prefix combines identity and f(begin), ..., f(i - 1), and returns the
+  // combination of all. f(i) is evaluated twice, once per pass, and before
+  // output(i, prefix), which may then overwrite it (in-place scans).
+  template <typename T, typename F, typename C, typename O>
+  T static scan(int begin,
+                int end,
+                int num_threads,
+                const T &identity,
+                const F &f,
+                const C &combine,
+                const O &output,
+                int block_size = default_block_size) {
+    std::vector<T> prefix(get_num_blocks(begin, end, block_size), identity);
+    for_each_block(begin, end, num_threads, block_size,
+                   [&](int block, int block_begin, int block_end) {
+                     T sum = identity;
+                     for (int i = block_begin; i < block_end; i++) {
+                       sum = combine(sum, f(i));
+                     }
+                     prefix[block] = sum;
+                   });
+    T total = identity;
+    for (auto &p : prefix) {
+      T block_total = p;
+      p = total;
+      total = combine(total, block_total);
+    }
+    for_each_block(begin, end, num_threads, block_size,
+                   [&](int block, int block_begin, int block_end) {
+                     T sum = prefix[block];
+                     for (int i = block_begin; i < block_end; i++) {
+                       T value = f(i);
+                       output(i, sum);
+                       sum = combine(sum, value);
+                     }
+                   });
+    return total;
+  }
+
+  // Stream compaction: calls output(i, j) for the items i of [begin, end)
+  // with predicate(i), j being the rank of i among them, and returns their
+  // number
+  template <typename P, typename O>
+  int static compact(int begin,
+                     int end,
+                     int num_threads,
+                     const P &predicate,
+                     const O &output,
+                     int block_size = default_block_size) {
+    return scan(begin, end, num_threads, 0,
+                [&](int i) { return predicate(i) ? 1 : 0; },
+                [](int a, int b) { return a + b; },
+                [&](int i, int j) {
+                  if (predicate(i)) {
+                    output(i, j);
+                  }
+                },
+                block_size);
+  }
+
+ private:
+  static int get_num_blocks(int begin, int end, int block_size) {
+    return std::max(0, (end - begin + block_size - 1) / block_size);
+  }
+
+  // Calls |f(block, block_begin, block_end)| for the blocks of the range
+  template <typename F>
+  void static for_each_block(int begin,
+                             int end,
+                             int num_threads,
+                             int block_size,
+                             const F &f) {
+    int num_blocks = get_num_blocks(begin, end, block_size);
+    auto body = [&](int block) {
+      int block_begin = begin + block * block_size;
+      f(block, block_begin, std::min(end, block_begin + block_size));
+    };
+#if !defined(TC_AMALGAMATED)
+    run(num_blocks, num_threads, body);
+#else
+    for (int block = 0; block < num_blocks; block++) {
+      body(block);
+    }
+#endif
+  }
+};
+
+// Tasks with dependencies: a node starts once the nodes of its incoming
+// edges have finished, and nodes without pending dependencies run in
+// parallel, on the work-stealing threads of ThreadedTaskManager (with
+// whose parallel loops in them they share the threads). A graph may be
+// run several times.
+class TaskGraph {
+ public:
+  explicit TaskGraph(int num_threads = -1) : num_threads(num_threads) {
+  }
+
+  // Returns the id of the node
+  int add_node(const std::function<void()> &task);
+
+  // |after| starts once |before| has finished
+  void add_edge(int before, int after);
+
+  // A node that starts once |before| has finished
+  int add_continuation(int before, const std::function<void()> &task) {
+    int node = add_node(task);
+    add_edge(before, node);
+    return node;
+  }
+
+  int get_num_nodes() const {
+    return (int)nodes.size();
+  }
+
+  // Returns once all nodes have finished
+  void run();
+
+ private:
+  struct Node {
+    std::function<void()> task;
+    std::vector<int> successors;
+    int num_predecessors;
+  };
+
+  int num_threads;
+  std::vector<Node> nodes;
 };
 
 class PID {
@@ -130,4 +383,23 @@ class PID {
   }
 };
 
+// Pins the calling thread to logical CPU |cpu| while alive, and restores
+// its affinity on destruction; does nothing for cpu = -1, or on platforms
+// without thread affinities (macOS)
+class ThreadPinning {
+ public:
+  explicit ThreadPinning(int cpu);
+
+  ~ThreadPinning();
+
+  bool is_pinned() const {
+    return pinned;
+  }
+
+ private:
+  bool pinned;
+  // The previous affinity mask (cpu_set_t or DWORD_PTR)
+  uint64 saved_mask[16];
+};
+
 TC_NAMESPACE_END
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <taichi/common/util.h>
+#include <taichi/system/statistics.h>
 
 #if defined(TC_PLATFORM_UNIX)
 #include <sys/mman.h>
@@ -10,6 +11,13 @@
 
 TC_NAMESPACE_BEGIN
 
+// Net bytes allocated by a subsystem, as the statistics counter
+// "memory/<subsystem>"; |subsystem| is a string literal
+#define TC_MEMORY_ALLOCATED(subsystem, bytes) \
+  TC_STAT("memory/" subsystem, (taichi::int64)(bytes))
+#define TC_MEMORY_FREED(subsystem, bytes) \
+  TC_STAT("memory/" subsystem, -(taichi::int64)(bytes))
+
 // Cross-platform virtual memory allocator
 class VirtualMemoryAllocator {
  public:
@@ -31,6 +39,7 @@ class VirtualMemoryAllocator {
     TC_ERROR_IF(((uint64_t)ptr) % page_size != 0,
                 "Allocated address ({:}) is not aligned by page size {}", ptr,
                 page_size);
+    TC_MEMORY_ALLOCATED("virtual_memory", size);
   }
 
   ~VirtualMemoryAllocator() {
@@ -40,9 +49,11 @@ class VirtualMemoryAllocator {
     if (!VirtualFree(ptr, size, MEM_RELEASE))
 #endif
       TC_ERROR("Failed to free virtual memory ({} B)", size);
+    TC_MEMORY_FREED("virtual_memory", size);
   }
 };
 
+// Resident memory, of this process by default
 float64 get_memory_usage_gb(int pid = -1);
 uint64 get_memory_usage(int pid = -1);
 
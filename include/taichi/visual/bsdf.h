@@ -63,6 +63,12 @@ class BSDF {
     return material->is_index_matched();
   }
 
+  bool get_fixed_transmittance(const Vector3 &in_dir,
+                               Vector3 &transmittance) const {
+    return material->get_fixed_transmittance(world_to_local * in_dir, uv,
+                                             transmittance);
+  }
+
   bool is_entering(const Vector3 &in_dir) const {
     return bool((!front) ^ (dot(geometry_normal, in_dir) > 0));
   }
@@ -0,0 +1,195 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+#include <taichi/geometry/primitives.h>
+#include <immintrin.h>
+#include <atomic>
+#include <limits>
+#include <vector>
+
+TC_NAMESPACE_BEGIN
+
+// Built-in SAH BVH, for builds without Embree and for the device scenes of
+// GPU renderers, which upload |nodes| and |primitives| as they are.
+//
+// Nodes are 32 bytes: a single precision box, the index of the first child
+// (children are allocated in pairs) or of the first primitive, and the number
+// of primitives (0 for interior nodes). The same structure is used for the
+// triangles of each mesh and, at the top level, for instances.
+class BVH {
+ public:
+  struct Node {
+    float32 lower[3];
+    float32 upper[3];
+    int32 offset;
+    uint16 count;
+    uint16 axis;
+  };
+  static_assert(sizeof(Node) == 32, "BVH nodes should be 32 bytes");
+
+  struct Box {
+    Vector3f lower, upper;
+
+    Box() : lower(std::numeric_limits<float32>::max()),
+            upper(-std::numeric_limits<float32>::max()) {
+    }
+
+    void extend(const Box &o) {
+      lower = min(lower, o.lower);
+      upper = max(upper, o.upper);
+    }
+
+    void extend(const Vector3f &p) {
+      lower = min(lower, p);
+      upper = max(upper, p);
+    }
+
+    float32 area() const {
+      Vector3f d = upper - lower;
+      if (d.x < 0) {
+        return 0;
+      }
+      return 2 * (d.x * d.y + d.y * d.z + d.z * d.x);
+    }
+  };
+
+  // Ray data in the form used by the box test
+  struct TraversalRay {
+    __m128 orig, inv_dir;
+    bool dir_negative[3];
+
+    TraversalRay(const Ray &ray) {
+      orig = _mm_setr_ps((float32)ray.orig.x, (float32)ray.orig.y,
+                         (float32)ray.orig.z, 0);
+      float32 inv[3];
+      for (int i = 0; i < 3; i++) {
+        // Avoid NaNs for axis-aligned rays (0 * inf)
+        float32 d = (float32)ray.dir[i];
+        if (std::abs(d) < 1e-20f) {
+          d = d < 0 ? -1e-20f : 1e-20f;
+        }
+        inv[i] = 1.0f / d;
+        dir_negative[i] = d < 0;
+      }
+      inv_dir = _mm_setr_ps(inv[0], inv[1], inv[2], 0);
+    }
+  };
+
+  std::vector<Node> nodes;
+  // Primitive indices, in leaf order
+  std::vector<int> primitives;
+
+  void build(const std::vector<Box> &boxes);
+
+  // Recomputes node bounds for moved primitives, keeping the tree topology.
+  void refit(const std::vector<Box> &boxes);
+
+  // Calls leaf(primitive, t_far) for every primitive whose leaf box is hit
+  // within (t_near, t_far). |leaf| may shrink t_far, and returns true to
+  // terminate traversal (any-hit queries).
+  template <typename T>
+  void traverse(const TraversalRay &ray,
+                float32 t_near,
+                float32 &t_far,
+                const T &leaf) const {
+    if (nodes.empty()) {
+      return;
+    }
+    int stack[64];
+    int stack_size = 0;
+    int current = 0;
+    while (true) {
+      const Node &node = nodes[current];
+      if (intersect_box(node, ray, t_near, t_far)) {
+        if (node.count > 0) {
+          for (int i = 0; i < node.count; i++) {
+            if (leaf(primitives[node.offset + i], t_far)) {
+              return;
+            }
+          }
+        } else {
+          // Front-to-back order along the split axis
+          int first = node.offset, second = node.offset + 1;
+          if (ray.dir_negative[node.axis]) {
+            std::swap(first, second);
+          }
+          TC_ASSERT(stack_size < 64);
+          stack[stack_size++] = second;
+          current = first;
+          continue;
+        }
+      }
+      if (stack_size == 0) {
+        break;
+      }
+      current = stack[--stack_size];
+    }
+  }
+
+  Box get_bounds() const {
+    Box box;
+    if (!nodes.empty()) {
+      box.lower = Vector3f(nodes[0].lower[0], nodes[0].lower[1],
+                           nodes[0].lower[2]);
+      box.upper = Vector3f(nodes[0].upper[0], nodes[0].upper[1],
+                           nodes[0].upper[2]);
+    }
+    return box;
+  }
+
+ private:
+  static constexpr int num_bins = 16;
+  static constexpr int max_leaf_size = 8;
+  // Ranges larger than this are built as parallel tasks
+  static constexpr int parallel_threshold = 4096;
+
+  // Build-time state
+  std::atomic<int> *num_nodes = nullptr;
+  const std::vector<Box> *boxes = nullptr;
+  std::vector<Vector3f> centroids;
+
+  static TC_FORCE_INLINE bool intersect_box(const Node &node,
+                                            const TraversalRay &ray,
+                                            float32 t_near,
+                                            float32 t_far) {
+    // Lane 3 reads neighbouring fields and is ignored.
+    __m128 lower = _mm_loadu_ps(node.lower);
+    __m128 upper = _mm_loadu_ps(node.upper);
+    __m128 t0 = _mm_mul_ps(_mm_sub_ps(lower, ray.orig), ray.inv_dir);
+    __m128 t1 = _mm_mul_ps(_mm_sub_ps(upper, ray.orig), ray.inv_dir);
+    __m128 t_min = _mm_min_ps(t0, t1);
+    __m128 t_max = _mm_max_ps(t0, t1);
+    alignas(16) float32 a[4], b[4];
+    _mm_store_ps(a, t_min);
+    _mm_store_ps(b, t_max);
+    float32 enter = std::max(std::max(a[0], a[1]), std::max(a[2], t_near));
+    float32 exit = std::min(std::min(b[0], b[1]), std::min(b[2], t_far));
+    return enter <= exit;
+  }
+
+  void build_node(int node_index, int begin, int end);
+
+  void make_leaf(Node &node, const Box &bounds, int begin, int end) {
+    set_bounds(node, bounds);
+    node.offset = begin;
+    node.count = (uint16)(end - begin);
+    node.axis = 0;
+  }
+
+  static void set_bounds(Node &node, const Box &bounds) {
+    for (int i = 0; i < 3; i++) {
+      // Pad by one ulp-ish so float boxes never clip double precision hits
+      float32 pad = 1e-6f * std::max(std::abs(bounds.lower[i]),
+                                     std::abs(bounds.upper[i])) +
+                    1e-9f;
+      node.lower[i] = bounds.lower[i] - pad;
+      node.upper[i] = bounds.upper[i] + pad;
+    }
+  }
+};
+
+TC_NAMESPACE_END
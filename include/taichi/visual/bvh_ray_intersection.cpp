@@ -0,0 +1,596 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#include "ray_intersection.h"
+#include "bvh.h"
+#include <taichi/common/serialization.h>
+#include <taichi/io/io.h>
+#include <algorithm>
+#if !defined(TC_AMALGAMATED)
+#include <tbb/task_group.h>
+#endif
+
+TC_NAMESPACE_BEGIN
+
+void BVH::build(const std::vector<Box> &boxes) {
+  int n = (int)boxes.size();
+  nodes.clear();
+  primitives.resize(n);
+  if (n == 0) {
+    return;
+  }
+  this->boxes = &boxes;
+  centroids.resize(n);
+  for (int i = 0; i < n; i++) {
+    primitives[i] = i;
+    centroids[i] = 0.5f * (boxes[i].lower + boxes[i].upper);
+  }
+  nodes.resize(2 * n);
+  std::atomic<int> allocated(1);
+  num_nodes = &allocated;
+  build_node(0, 0, n);
+  nodes.resize(allocated);
+  num_nodes = nullptr;
+  centroids.clear();
+  centroids.shrink_to_fit();
+  this->boxes = nullptr;
+}
+
+void BVH::refit(const std::vector<Box> &boxes) {
+  // Children are always allocated after their parent
+  for (int i = (int)nodes.size() - 1; i >= 0; i--) {
+    Node &node = nodes[i];
+    Box bounds;
+    if (node.count > 0) {
+      for (int j = 0; j < node.count; j++) {
+        bounds.extend(boxes[primitives[node.offset + j]]);
+      }
+    } else {
+      for (int c = 0; c < 2; c++) {
+        const Node &child = nodes[node.offset + c];
+        bounds.extend(
+            Vector3f(child.lower[0], child.lower[1], child.lower[2]));
+        bounds.extend(
+            Vector3f(child.upper[0], child.upper[1], child.upper[2]));
+      }
+    }
+    set_bounds(node, bounds);
+  }
+}
+
+void BVH::build_node(int node_index, int begin, int end) {
+  Box bounds, centroid_bounds;
+  for (int i = begin; i < end; i++) {
+    bounds.extend((*boxes)[primitives[i]]);
+    centroid_bounds.extend(centroids[primitives[i]]);
+  }
+  Node &node = nodes[node_index];
+  int count = end - begin;
+  if (count <= 2) {
+    make_leaf(node, bounds, begin, end);
+    return;
+  }
+
+  // Binned SAH over all three axes
+  int best_axis = -1, best_bin = -1;
+  float32 best_cost = std::numeric_limits<float32>::max();
+  for (int axis = 0; axis < 3; axis++) {
+    float32 lo = centroid_bounds.lower[axis], hi = centroid_bounds.upper[axis];
+    if (hi - lo < 1e-12f) {
+      continue;
+    }
+    float32 scale = num_bins / (hi - lo);
+    Box bin_bounds[num_bins];
+    int bin_count[num_bins] = {0};
+    for (int i = begin; i < end; i++) {
+      int p = primitives[i];
+      int b = std::min(num_bins - 1, (int)((centroids[p][axis] - lo) * scale));
+      bin_count[b]++;
+      bin_bounds[b].extend((*boxes)[p]);
+    }
+    // Sweep from the right, then from the left
+    float32 right_area[num_bins];
+    int right_count[num_bins];
+    Box acc;
+    int acc_count = 0;
+    for (int b = num_bins - 1; b > 0; b--) {
+      acc.extend(bin_bounds[b]);
+      acc_count += bin_count[b];
+      right_area[b] = acc.area();
+      right_count[b] = acc_count;
+    }
+    acc = Box();
+    acc_count = 0;
+    for (int b = 0; b < num_bins - 1; b++) {
+      acc.extend(bin_bounds[b]);
+      acc_count += bin_count[b];
+      if (acc_count == 0 || right_count[b + 1] == 0) {
+        continue;
+      }
+      float32 cost =
+          acc_count * acc.area() + right_count[b + 1] * right_area[b + 1];
+      if (cost < best_cost) {
+        best_cost = cost;
+        best_axis = axis;
+        best_bin = b;
+      }
+    }
+  }
+
+  int mid;
+  if (best_axis == -1) {
+    // All centroids coincide: split by index
+    if (count <= max_leaf_size) {
+      make_leaf(node, bounds, begin, end);
+      return;
+    }
+    best_axis = 0;
+    mid = begin + count / 2;
+  } else {
+    // Traversal cost is taken as one primitive test
+    float32 leaf_cost = count * bounds.area();
+    if (count <= max_leaf_size && leaf_cost <= best_cost + bounds.area()) {
+      make_leaf(node, bounds, begin, end);
+      return;
+    }
+    float32 lo = centroid_bounds.lower[best_axis];
+    float32 scale = num_bins / (centroid_bounds.upper[best_axis] - lo);
+    int axis = best_axis, split = best_bin;
+    mid = (int)(std::partition(primitives.begin() + begin,
+                               primitives.begin() + end,
+                               [&](int p) {
+                                 int b = std::min(
+                                     num_bins - 1,
+                                     (int)((centroids[p][axis] - lo) * scale));
+                                 return b <= split;
+                               }) -
+                primitives.begin());
+    if (mid == begin || mid == end) {
+      mid = begin + count / 2;
+    }
+  }
+
+  int children = num_nodes->fetch_add(2);
+  set_bounds(node, bounds);
+  node.offset = children;
+  node.count = 0;
+  node.axis = (uint16)best_axis;
+#if !defined(TC_AMALGAMATED)
+  if (count > parallel_threshold) {
+    tbb::task_group group;
+    group.run([&] { build_node(children, begin, mid); });
+    build_node(children + 1, mid, end);
+    group.wait();
+    return;
+  }
+#endif
+  build_node(children, begin, mid);
+  build_node(children + 1, mid, end);
+}
+
+class BVHRayIntersection : public RayIntersection {
+ public:
+  void clear() override;
+
+  void build() override;
+
+  void query(Ray &ray) override;
+
+  bool occlude(Ray &ray) override;
+
+  void add_triangle(Triangle &triangle) override;
+
+  int add_prototype(const std::vector<Triangle> &triangles,
+                    const std::vector<Vector4f> &vertices,
+                    const std::vector<int32> &indices) override;
+
+  void add_instance(int prototype, const Matrix4 &transform) override;
+
+  void add_spheres(const std::vector<Vector4f> &spheres, int id) override;
+
+  bool update_triangles(int begin,
+                        const std::vector<Triangle> &triangles) override;
+
+  bool update_instance(int instance, const Matrix4 &transform) override;
+
+  void commit_updates() override;
+
+  bool write_structure(const std::string &fn, uint64 stamp) override;
+
+  bool read_structure(const std::string &fn, uint64 stamp) override;
+
+ private:
+  // Precomputed for Moller-Trumbore intersection. In float32, the
+  // precision of the boxes and of the Embree backend, whatever |real| is.
+  struct CompactTriangle {
+    Vector3f v0, e1, e2;
+    int id;
+
+    CompactTriangle(const Triangle &tri)
+        : v0(tri.v[0].cast<float32>()),
+          e1(tri.v10.cast<float32>()),
+          e2(tri.v20.cast<float32>()),
+          id(tri.id) {
+    }
+  };
+
+  struct Mesh {
+    std::vector<CompactTriangle> triangles;
+    BVH bvh;
+
+    std::vector<BVH::Box> get_boxes() const;
+
+    void build() {
+      bvh.build(get_boxes());
+    }
+
+    // Closest hit in local space. Returns true if |ray| was updated.
+    bool query(Ray &ray) const;
+
+    bool occlude(const Ray &ray) const;
+  };
+
+  struct Instance {
+    int prototype;
+    Matrix4 world_to_local;
+  };
+
+  // Spheres of add_spheres, in world space
+  struct SphereSet {
+    const std::vector<Vector4f> *spheres;
+    int id;
+    BVH bvh;
+
+    void build();
+
+    bool query(Ray &ray) const;
+
+    bool occlude(const Ray &ray) const;
+  };
+
+  Mesh mesh;
+  std::vector<Mesh> prototypes;
+  std::vector<std::pair<int, Matrix4>> instance_transforms;
+  std::vector<Instance> instances;
+  BVH instance_bvh;
+  std::vector<SphereSet> sphere_sets;
+  bool mesh_dirty = false, instances_dirty = false;
+
+  void build_instances();
+
+  static bool intersect(const CompactTriangle &tri,
+                        const Vector3f &orig,
+                        const Vector3f &dir,
+                        float32 t_far,
+                        float32 &t,
+                        float32 &u,
+                        float32 &v) {
+    Vector3f p = cross(dir, tri.e2);
+    float32 det = dot(tri.e1, p);
+    if (std::abs(det) < 1e-20f) {
+      return false;
+    }
+    float32 inv_det = 1.0f / det;
+    Vector3f s = orig - tri.v0;
+    u = dot(s, p) * inv_det;
+    if (u < 0 || u > 1) {
+      return false;
+    }
+    Vector3f q = cross(s, tri.e1);
+    v = dot(dir, q) * inv_det;
+    if (v < 0 || u + v > 1) {
+      return false;
+    }
+    t = dot(tri.e2, q) * inv_det;
+    // Same near plane as the Embree backend
+    return eps * 10 < t && t < t_far;
+  }
+
+  Ray to_local(const Instance &instance, const Ray &ray) const {
+    Ray local = ray;
+    local.orig = multiply_matrix4(instance.world_to_local, ray.orig, 1.0_f);
+    local.dir = multiply_matrix4(instance.world_to_local, ray.dir, 0.0_f);
+    return local;
+  }
+};
+
+std::vector<BVH::Box> BVHRayIntersection::Mesh::get_boxes() const {
+  std::vector<BVH::Box> boxes(triangles.size());
+  for (int i = 0; i < (int)triangles.size(); i++) {
+    const CompactTriangle &tri = triangles[i];
+    boxes[i].extend(tri.v0);
+    boxes[i].extend(tri.v0 + tri.e1);
+    boxes[i].extend(tri.v0 + tri.e2);
+  }
+  return boxes;
+}
+
+bool BVHRayIntersection::Mesh::query(Ray &ray) const {
+  BVH::TraversalRay traversal_ray(ray);
+  const Vector3f orig = ray.orig.cast<float32>();
+  const Vector3f dir = ray.dir.cast<float32>();
+  float32 t_far = (float32)ray.dist;
+  bool hit = false;
+  bvh.traverse(traversal_ray, 0.0f, t_far, [&](int p, float32 &t_far) {
+    float32 t, u, v;
+    if (intersect(triangles[p], orig, dir, t_far, t, u, v)) {
+      ray.dist = t;
+      ray.u = u;
+      ray.v = v;
+      ray.triangle_id = triangles[p].id;
+      t_far = t;
+      hit = true;
+    }
+    return false;
+  });
+  return hit;
+}
+
+bool BVHRayIntersection::Mesh::occlude(const Ray &ray) const {
+  BVH::TraversalRay traversal_ray(ray);
+  const Vector3f orig = ray.orig.cast<float32>();
+  const Vector3f dir = ray.dir.cast<float32>();
+  float32 t_far = (float32)ray.dist;
+  bool hit = false;
+  bvh.traverse(traversal_ray, 0.0f, t_far, [&](int p, float32 &t_far) {
+    float32 t, u, v;
+    hit = intersect(triangles[p], orig, dir, t_far, t, u, v);
+    return hit;
+  });
+  return hit;
+}
+
+void BVHRayIntersection::SphereSet::build() {
+  std::vector<BVH::Box> boxes(spheres->size());
+  for (int i = 0; i < (int)spheres->size(); i++) {
+    const Vector4f &sphere = (*spheres)[i];
+    Vector3f center(sphere.x, sphere.y, sphere.z);
+    boxes[i].extend(center - Vector3f(sphere.w));
+    boxes[i].extend(center + Vector3f(sphere.w));
+  }
+  bvh.build(boxes);
+}
+
+bool BVHRayIntersection::SphereSet::query(Ray &ray) const {
+  BVH::TraversalRay traversal_ray(ray);
+  const Vector3f orig = ray.orig.cast<float32>();
+  const Vector3f dir = ray.dir.cast<float32>();
+  float32 t_far = (float32)ray.dist;
+  bool hit = false;
+  bvh.traverse(traversal_ray, 0.0f, t_far, [&](int p, float32 &t_far) {
+    float32 t;
+    if (intersect_sphere((*spheres)[p], orig, dir, eps * 10, t_far, t)) {
+      ray.dist = t;
+      ray.u = ray.v = 0;
+      ray.triangle_id = p;
+      ray.instance_id = id;
+      t_far = t;
+      hit = true;
+    }
+    return false;
+  });
+  return hit;
+}
+
+bool BVHRayIntersection::SphereSet::occlude(const Ray &ray) const {
+  BVH::TraversalRay traversal_ray(ray);
+  const Vector3f orig = ray.orig.cast<float32>();
+  const Vector3f dir = ray.dir.cast<float32>();
+  float32 t_far = (float32)ray.dist;
+  bool hit = false;
+  bvh.traverse(traversal_ray, 0.0f, t_far, [&](int p, float32 &t_far) {
+    float32 t;
+    hit = intersect_sphere((*spheres)[p], orig, dir, eps * 10, t_far, t);
+    return hit;
+  });
+  return hit;
+}
+
+void BVHRayIntersection::clear() {
+  mesh = Mesh();
+  prototypes.clear();
+  instance_transforms.clear();
+  instances.clear();
+  instance_bvh = BVH();
+  sphere_sets.clear();
+  mesh_dirty = instances_dirty = false;
+}
+
+void BVHRayIntersection::add_triangle(Triangle &triangle) {
+  mesh.triangles.push_back(CompactTriangle(triangle));
+}
+
+int BVHRayIntersection::add_prototype(const std::vector<Triangle> &triangles,
+                                      const std::vector<Vector4f> &vertices,
+                                      const std::vector<int32> &indices) {
+  prototypes.emplace_back();
+  for (auto &tri : triangles) {
+    prototypes.back().triangles.push_back(CompactTriangle(tri));
+  }
+  return (int)prototypes.size() - 1;
+}
+
+void BVHRayIntersection::add_instance(int prototype, const Matrix4 &transform) {
+  instance_transforms.push_back(std::make_pair(prototype, transform));
+}
+
+void BVHRayIntersection::add_spheres(const std::vector<Vector4f> &spheres,
+                                     int id) {
+  sphere_sets.push_back(SphereSet{&spheres, id, BVH()});
+}
+
+void BVHRayIntersection::build() {
+  mesh.build();
+  for (auto &prototype : prototypes) {
+    prototype.build();
+  }
+  build_instances();
+  for (auto &set : sphere_sets) {
+    set.build();
+  }
+}
+
+void BVHRayIntersection::build_instances() {
+  instances.clear();
+  std::vector<BVH::Box> boxes;
+  for (auto &it : instance_transforms) {
+    instances.push_back(Instance{it.first, inversed(it.second)});
+    // World bounds of the transformed local box corners
+    BVH::Box local = prototypes[it.first].bvh.get_bounds(), world;
+    for (int c = 0; c < 8; c++) {
+      Vector3 corner((c & 1) ? local.upper.x : local.lower.x,
+                     (c & 2) ? local.upper.y : local.lower.y,
+                     (c & 4) ? local.upper.z : local.lower.z);
+      world.extend(
+          multiply_matrix4(it.second, corner, 1.0_f).cast<float32>());
+    }
+    boxes.push_back(world);
+  }
+  instance_bvh.build(boxes);
+}
+
+// Refitting keeps the tree valid for any vertex motion; quality degrades
+// only if triangles move far from their original neighbours.
+bool BVHRayIntersection::update_triangles(
+    int begin,
+    const std::vector<Triangle> &triangles) {
+  for (int i = 0; i < (int)triangles.size(); i++) {
+    const Triangle &tri = triangles[i];
+    mesh.triangles[begin + i] = CompactTriangle(tri);
+  }
+  mesh_dirty = true;
+  return true;
+}
+
+bool BVHRayIntersection::update_instance(int instance,
+                                         const Matrix4 &transform) {
+  instance_transforms[instance].second = transform;
+  instances_dirty = true;
+  return true;
+}
+
+void BVHRayIntersection::commit_updates() {
+  if (mesh_dirty) {
+    mesh.bvh.refit(mesh.get_boxes());
+  }
+  if (instances_dirty) {
+    // The top level is small; rebuild it for a good tree
+    build_instances();
+  }
+  mesh_dirty = instances_dirty = false;
+}
+
+constexpr uint64 bvh_structure_magic = 0x31485642435443ull;  // "TCBVH1"
+
+// The BVHs of the mesh and of the prototypes, after the stamp and their
+// triangle counts, to check that they were built for this geometry
+bool BVHRayIntersection::write_structure(const std::string &fn,
+                                         uint64 stamp) {
+  std::vector<int> counts;
+  counts.push_back((int)mesh.triangles.size());
+  for (auto &prototype : prototypes) {
+    counts.push_back((int)prototype.triangles.size());
+  }
+  BinaryOutputSerializer writer;
+  writer.initialize();
+  writer(nullptr, bvh_structure_magic, stamp, counts, mesh.bvh.nodes,
+         mesh.bvh.primitives);
+  for (auto &prototype : prototypes) {
+    writer(nullptr, prototype.bvh.nodes, prototype.bvh.primitives);
+  }
+  writer.finalize();
+  writer.write_to_file(fn);
+  return true;
+}
+
+bool BVHRayIntersection::read_structure(const std::string &fn,
+                                        uint64 stamp) {
+  MappedFile file(fn);
+  std::size_t size = 0;
+  if (file.data() == nullptr || file.size() < sizeof(size)) {
+    return false;
+  }
+  std::memcpy(&size, file.data(), sizeof(size));
+  if (size != file.size()) {
+    return false;
+  }
+  BinaryInputSerializer reader;
+  reader.initialize((void *)file.data());
+  uint64 magic, file_stamp;
+  std::vector<int> counts;
+  reader(nullptr, magic, file_stamp, counts);
+  if (magic != bvh_structure_magic || file_stamp != stamp ||
+      counts.size() != prototypes.size() + 1 ||
+      counts[0] != (int)mesh.triangles.size()) {
+    return false;
+  }
+  for (int i = 0; i < (int)prototypes.size(); i++) {
+    if (counts[i + 1] != (int)prototypes[i].triangles.size()) {
+      return false;
+    }
+  }
+  reader(nullptr, mesh.bvh.nodes, mesh.bvh.primitives);
+  for (auto &prototype : prototypes) {
+    reader(nullptr, prototype.bvh.nodes, prototype.bvh.primitives);
+  }
+  reader.finalize();
+  build_instances();
+  // Not part of the structure
+  for (auto &set : sphere_sets) {
+    set.build();
+  }
+  return true;
+}
+
+void BVHRayIntersection::query(Ray &ray) {
+  ray.dist = Ray::DIST_INFINITE;
+  ray.triangle_id = -1;
+  ray.instance_id = -1;
+  mesh.query(ray);
+  for (auto &set : sphere_sets) {
+    set.query(ray);
+  }
+  if (instances.empty()) {
+    return;
+  }
+  BVH::TraversalRay traversal_ray(ray);
+  float32 t_far = (float32)ray.dist;
+  instance_bvh.traverse(traversal_ray, 0.0f, t_far, [&](int i, float32 &t_far) {
+    Ray local = to_local(instances[i], ray);
+    if (prototypes[instances[i].prototype].query(local)) {
+      ray.dist = local.dist;
+      ray.u = local.u;
+      ray.v = local.v;
+      ray.triangle_id = local.triangle_id;
+      ray.instance_id = i;
+      t_far = (float32)ray.dist;
+    }
+    return false;
+  });
+}
+
+bool BVHRayIntersection::occlude(Ray &ray) {
+  if (mesh.occlude(ray)) {
+    return true;
+  }
+  for (auto &set : sphere_sets) {
+    if (set.occlude(ray)) {
+      return true;
+    }
+  }
+  BVH::TraversalRay traversal_ray(ray);
+  float32 t_far = (float32)ray.dist;
+  bool hit = false;
+  instance_bvh.traverse(traversal_ray, 0.0f, t_far, [&](int i, float32 &) {
+    hit = prototypes[instances[i].prototype].occlude(
+        to_local(instances[i], ray));
+    return hit;
+  });
+  return hit;
+}
+
+TC_IMPLEMENTATION(RayIntersection, BVHRayIntersection, "bvh");
+
+TC_NAMESPACE_END
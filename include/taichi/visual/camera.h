@@ -23,6 +23,21 @@ class Camera : public Unit {
     return Ray(Vector3(0), Vector3(0));
   }
 
+  // Dimensions of its sequence that sample() draws for each ray
+  virtual int get_sample_dimensions() const {
+    return 2;
+  }
+
+  // The rays of |count| samples at once: rays[i] is sample(offsets[i], size,
+  // r), with r drawing samples[i * get_sample_dimensions() + k] as its k-th
+  // dimension. Cameras override this to trace tiles and wavefronts without
+  // a virtual call per ray.
+  virtual void generate_rays(const Vector2 *offsets,
+                             Vector2 size,
+                             const real *samples,
+                             int count,
+                             Ray *rays);
+
   Vector3 get_origin() {
     return multiply_matrix4(transform, origin, 1);
   }
@@ -39,6 +54,12 @@ class Camera : public Unit {
     return 1.0_f;
   }
 
+  // The size of a pixel on the image plane at distance one, for cameras
+  // that call update_basis(); zero for the others
+  real get_pixel_footprint() const {
+    return length(world_up) / res[1];
+  }
+
   int get_width() const {
     return res[0];
   }
@@ -59,6 +80,33 @@ class Camera : public Unit {
     this->right = cross(dir, up);
   }
 
+  // From the camera space, by update_basis(): the origin and the direction
+  // of the camera, and the offsets of the image plane (at distance one) per
+  // unit of the pixel coordinates in [-0.5, 0.5]
+  Vector3 world_origin, world_dir, world_right, world_up;
+
+  void update_basis(real tan_half_fov) {
+    world_origin = multiply_matrix4(transform, origin, 1);
+    world_dir = multiply_matrix4(transform, dir, 0);
+    world_right =
+        multiply_matrix4(transform, tan_half_fov * aspect_ratio * right, 0);
+    world_up = multiply_matrix4(transform, tan_half_fov * up, 0);
+  }
+
+  // The normalized direction of a pixel coordinate (x, y)
+  Vector3 get_world_dir(real x, real y) const {
+    return normalized(world_dir + x * world_right + y * world_up);
+  }
+
+  // Rays of generate_rays() from world_origin through the image plane,
+  // with |dims| samples per ray of which the first two jitter the pixel
+  void generate_pinhole_rays(const Vector2 *offsets,
+                             Vector2 size,
+                             const real *samples,
+                             int dims,
+                             int count,
+                             Ray *rays) const;
+
   Vector2 random_offset(Vector2 offset, Vector2 size, real u, real v) {
     return Vector2(offset.x + u * size.x - 0.5f, offset.y + v * size.y - 0.5f);
   }
@@ -11,6 +11,7 @@
 #include <taichi/math/math.h>
 #include <taichi/visual/sampler.h>
 #include <taichi/math/discrete_sampler.h>
+#include <taichi/math/fast_math.h>
 #include <taichi/visualization/image_buffer.h>
 #include <taichi/physics/physics_constants.h>
 #include <memory>
@@ -45,8 +46,15 @@ class EnvironmentMap : public Unit {
   Vector2i res;
   DiscreteSampler row_sampler;
   std::vector<DiscreteSampler> col_samplers;
+  int num_threads;
+  void flip_rows();
   void build_cdfs();
 
+  // Processed image and CDFs of an image file, stored next to it as
+  // <filepath>.envmap.tcb and tagged with the |stamp| of the source file
+  bool load_cache(const std::string &fn, uint64 stamp);
+  void save_cache(const std::string &fn, uint64 stamp) const;
+
   Vector3 uv_to_direction(const Vector2 &uv) const {
     real theta = uv.y * pi;
     real phi = uv.x * 2 * pi;
@@ -58,8 +66,8 @@ class EnvironmentMap : public Unit {
 
   Vector2 direction_to_uv(const Vector3 &dir_) const {
     auto dir = multiply_matrix4(world2local, normalized(dir_), 0);
-    real theta = std::acos(dir.y);
-    real phi = std::atan2(dir.z, dir.x);
+    real theta = fast_math::acos(dir.y);
+    real phi = fast_math::atan2(dir.z, dir.x);
     if (phi < 0) {
       phi += 2 * pi;
     }
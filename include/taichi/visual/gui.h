@@ -182,6 +182,7 @@ class Canvas {
                                   std::min(a_i.y, b_i.y) - radius_i);
       auto range_higher = Vector2i(std::max(a_i.x, b_i.x) + radius_i,
                                    std::max(a_i.y, b_i.y) + radius_i);
+      canvas.mark_dirty(range_lower, range_higher + Vector2i(1));
       auto direction = normalized(b - a);
       auto l = length(b - a);
       auto tangent = Vector2(-direction.y, direction.x);
@@ -250,6 +251,8 @@ class Canvas {
       auto center = canvas.transform(_center);
       auto center_i = (center + Vector2(0.5_f)).template cast<int>();
       auto radius_i = (int)std::ceil(_radius + 0.5_f);
+      canvas.mark_dirty(center_i - Vector2i(radius_i),
+                        center_i + Vector2i(radius_i + 1));
       for (int i = -radius_i; i <= radius_i; i++) {
         for (int j = -radius_i; j <= radius_i; j++) {
           real dist =
@@ -262,12 +265,109 @@ class Canvas {
     }
   };
 
+  // A primitive of a Batch, in image coordinates
+  struct Shape {
+    enum class Type { circle, segment, triangle };
+    Type type;
+    Vector2 a, b, c;
+    real radius;
+    Vector4 color;
+  };
+
+  // Shapes drawn together, e.g. the particles or the velocity field of a
+  // simulation, on destruction or by draw(). They are binned by tiles of
+  // the image, which are drawn in parallel, with the shapes of a tile in
+  // the order they were added. Edges are anti-aliased by the coverage of
+  // the pixel centers: discs and segments (of |radius|) by their distance,
+  // triangles by their distance to the edges.
+  struct Batch {
+    Canvas &canvas;
+    std::vector<Shape> shapes;
+
+    explicit Batch(Canvas &canvas) : canvas(canvas) {
+    }
+
+    Batch(Batch &&) = default;
+
+    Batch &circle(Vector2 center, real radius, Vector4 color) {
+      shapes.push_back(Shape{Shape::Type::circle, canvas.transform(center),
+                             Vector2(0), Vector2(0), radius, color});
+      return *this;
+    }
+
+    Batch &circles(const std::vector<Vector2> &centers,
+                   real radius,
+                   Vector4 color) {
+      shapes.reserve(shapes.size() + centers.size());
+      for (auto &center : centers) {
+        circle(center, radius, color);
+      }
+      return *this;
+    }
+
+    Batch &line(Vector2 a, Vector2 b, real radius, Vector4 color) {
+      shapes.push_back(Shape{Shape::Type::segment, canvas.transform(a),
+                             canvas.transform(b), Vector2(0), radius, color});
+      return *this;
+    }
+
+    Batch &triangle(Vector2 a, Vector2 b, Vector2 c, Vector4 color) {
+      shapes.push_back(Shape{Shape::Type::triangle, canvas.transform(a),
+                             canvas.transform(b), canvas.transform(c), 0,
+                             color});
+      return *this;
+    }
+
+    void draw() {
+      canvas.draw_shapes(shapes);
+      shapes.clear();
+    }
+
+    ~Batch() {
+      draw();
+    }
+  };
+
  public:
   Array2D<Vector4> &img;
   Matrix3 transform_matrix;
+  // The bounding box [dirty_begin, dirty_end) of the pixels drawn since
+  // clear_dirty(), for the damage tracking of GUI. Drawing into |img|
+  // other than by the methods here needs mark_dirty().
+  Vector2i dirty_begin, dirty_end;
 
   Canvas(Array2D<Vector4> &img) : img(img) {
     transform_matrix = Matrix3(Vector3(img.get_res().cast<real>(), 1.0_f));
+    mark_dirty();
+  }
+
+  void mark_dirty(Vector2i begin, Vector2i end) {
+    begin = Vector2i(std::max(begin.x, 0), std::max(begin.y, 0));
+    end = Vector2i(std::min(end.x, img.get_width()),
+                   std::min(end.y, img.get_height()));
+    if (!(begin.x < end.x && begin.y < end.y)) {
+      return;
+    }
+    if (is_dirty()) {
+      begin = Vector2i(std::min(begin.x, dirty_begin.x),
+                       std::min(begin.y, dirty_begin.y));
+      end = Vector2i(std::max(end.x, dirty_end.x),
+                     std::max(end.y, dirty_end.y));
+    }
+    dirty_begin = begin;
+    dirty_end = end;
+  }
+
+  void mark_dirty() {
+    mark_dirty(Vector2i(0), img.get_res());
+  }
+
+  bool is_dirty() const {
+    return dirty_begin.x < dirty_end.x && dirty_begin.y < dirty_end.y;
+  }
+
+  void clear_dirty() {
+    dirty_begin = dirty_end = Vector2i(0);
   }
 
   TC_FORCE_INLINE Vector2 transform(Vector2 x) const {
@@ -278,6 +378,13 @@ class Canvas {
     return Circle(*this, center);
   }
 
+  Batch batch() {
+    return Batch(*this);
+  }
+
+  // Draws the shapes of a Batch; |num_threads| = -1 for all cores
+  void draw_shapes(const std::vector<Shape> &shapes, int num_threads = -1);
+
   Circle circle(real x, real y) {
     return Circle(*this, Vector2(x, y));
   }
@@ -310,6 +417,10 @@ class Canvas {
     // convert to screen space
     start = transform(start);
     end = transform(end);
+    mark_dirty(Vector2i((int)std::floor(std::min(start.x, end.x)),
+                        (int)std::floor(std::min(start.y, end.y))),
+               Vector2i((int)std::floor(std::max(start.x, end.x)) + 1,
+                        (int)std::floor(std::max(start.y, end.y)) + 1));
     real len = length(end - start);
     int samples = (int)len * 2 + 4;
     for (int i = 0; i < samples; i++) {
@@ -335,6 +446,10 @@ class Canvas {
     limits[0].y = min(a.y, min(b.y, c.y));
     limits[1].x = max(a.x, max(b.x, c.x));
     limits[1].y = max(a.y, max(b.y, c.y));
+    mark_dirty(Vector2i((int)std::floor(limits[0].x),
+                        (int)std::floor(limits[0].y)),
+               Vector2i((int)std::ceil(limits[1].x),
+                        (int)std::ceil(limits[1].y)));
     for (int i = (int)std::floor(limits[0].x); i < (int)std::ceil(limits[1].x);
          i++) {
       for (int j = (int)std::floor(limits[0].y);
@@ -363,14 +478,20 @@ class Canvas {
     auto ttf_path = root_dir + std::string("/assets/fonts/go/Go-Regular.ttf");
 #endif
     img.write_text(ttf_path, str, size, position.x, position.y, color);
+    // Glyphs are at most |size| wide, below the line of |position|
+    int size_i = (int)std::ceil(size);
+    mark_dirty(Vector2i((int)position.x, (int)position.y - size_i - 2),
+               Vector2i((int)position.x + size_i * (int)str.size() + 4,
+                        (int)position.y + 1));
   }
 
   void clear(Vector4 color) {
     img.reset(color);
+    mark_dirty();
   }
 
   void clear(int c) {
-    img.reset((1.0_f / 255) * Vector4(c / 65536, c / 256 % 256, c % 256, 255));
+    clear((1.0_f / 255) * Vector4(c / 65536, c / 256 % 256, c % 256, 255));
   }
 
   ~Canvas() {
@@ -381,6 +502,17 @@ class Canvas {
   }
 };
 
+// Converts the pixels [begin, end) of |img| to 8-bit RGBA (or BGRA), with
+// the channels truncated and clamped to [0, 255], as by SIMD where Vector4
+// is. |data| is a top-down image of img.get_width() pixels per row. The
+// alpha is set to |alpha|, or taken from the image if it is negative.
+void convert_to_rgba8(const Array2D<Vector4> &img,
+                      Vector2i begin,
+                      Vector2i end,
+                      uint8 *data,
+                      bool bgra,
+                      int alpha = -1);
+
 #if defined(TC_GUI_X11)
 
 class CXImage;
@@ -390,7 +522,11 @@ class GUIBaseX11 {
   void *display;
   void *visual;
   unsigned long window;
-  CXImage *img;
+  // Two images, by shared memory where the X server supports it, for
+  // converting into one while the server reads the other
+  CXImage *img[2];
+  int back;
+  Vector2i last_dirty_begin, last_dirty_end;
 };
 
 using GUIBase = GUIBaseX11;
@@ -437,6 +573,9 @@ class GUI : public GUIBase {
   Vector2i cursor_pos;
   bool button_status[3];
   int widget_height;
+  // Only the pixels drawn by the canvas (and widgets) are converted and
+  // blitted if set, instead of the whole frame
+  bool damage_tracking = false;
 
   void set_mouse_pos(int x, int y) {
     cursor_pos = Vector2i(x, y);
@@ -485,6 +624,7 @@ class GUI : public GUIBase {
     }
 
     virtual void redraw(Canvas &canvas) {
+      canvas.mark_dirty(rect.pos, rect.pos + rect.size);
       Vector4 color =
           hover ? color_from_hex(widget_bg) : color_from_hex(widget_hover);
       for (int i = 1; i < rect.size[0] - 1; i++) {
@@ -710,6 +850,25 @@ class GUI : public GUIBase {
 
   void set_title(std::string title);
 
+  void set_damage_tracking(bool val) {
+    damage_tracking = val;
+  }
+
+  // The pixels [begin, end) for redraw() to convert and show; false if
+  // there are none. Clears the dirty region of the canvas.
+  bool get_redraw_region(Vector2i &begin, Vector2i &end) {
+    if (damage_tracking) {
+      begin = canvas->dirty_begin;
+      end = canvas->dirty_end;
+    } else {
+      begin = Vector2i(0);
+      end = Vector2i(width, height);
+    }
+    bool dirty = !damage_tracking || canvas->is_dirty();
+    canvas->clear_dirty();
+    return dirty;
+  }
+
   void redraw_widgets() {
     auto old_transform_matrix = canvas->transform_matrix;
     canvas->set_idendity_transform_matrix();
@@ -0,0 +1,185 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#include "light_bvh.h"
+#include <algorithm>
+
+TC_NAMESPACE_BEGIN
+
+// Smallest cone containing cones (a, theta_a) and (b, theta_b)
+static void merge_cones(Vector3 a,
+                        real theta_a,
+                        Vector3 b,
+                        real theta_b,
+                        Vector3 &axis,
+                        real &theta) {
+  if (theta_b > theta_a) {
+    std::swap(a, b);
+    std::swap(theta_a, theta_b);
+  }
+  real theta_d = std::acos(clamp(dot(a, b), -1.0_f, 1.0_f));
+  if (std::min(theta_d + theta_b, pi) <= theta_a) {
+    axis = a;
+    theta = theta_a;
+    return;
+  }
+  theta = (theta_a + theta_d + theta_b) * 0.5_f;
+  if (theta >= pi || theta_d < 1e-6_f) {
+    axis = a;
+    theta = pi;
+    return;
+  }
+  // Rotate a towards b by theta_r
+  real theta_r = theta - theta_a;
+  axis = normalized(std::sin(theta_d - theta_r) * a +
+                    std::sin(theta_r) * b);
+}
+
+void LightBVH::build(const std::vector<Triangle> &triangles,
+                     const std::vector<real> &powers) {
+  nodes.clear();
+  leaf_of_light.assign(triangles.size(), -1);
+  if (triangles.empty()) {
+    return;
+  }
+  std::vector<int> lights(triangles.size());
+  for (int i = 0; i < (int)lights.size(); i++) {
+    lights[i] = i;
+  }
+  nodes.reserve(2 * triangles.size());
+  build_node(lights, 0, (int)lights.size(), -1, triangles, powers);
+}
+
+int LightBVH::build_node(std::vector<int> &lights,
+                         int begin,
+                         int end,
+                         int parent,
+                         const std::vector<Triangle> &triangles,
+                         const std::vector<real> &powers) {
+  int index = (int)nodes.size();
+  nodes.emplace_back();
+  if (end - begin == 1) {
+    int light = lights[begin];
+    const Triangle &tri = triangles[light];
+    Node &node = nodes[index];
+    node.lower = min(min(tri.v[0], tri.v[1]), tri.v[2]);
+    node.upper = max(max(tri.v[0], tri.v[1]), tri.v[2]);
+    node.axis = tri.normal;
+    node.theta_o = 0;
+    node.power = powers[light];
+    node.children[0] = node.children[1] = -1;
+    node.parent = parent;
+    node.light = light;
+    leaf_of_light[light] = index;
+    return index;
+  }
+  // Median split along the longest axis of the centroid bounds
+  Vector3 lower(std::numeric_limits<real>::max());
+  Vector3 upper(-std::numeric_limits<real>::max());
+  for (int i = begin; i < end; i++) {
+    Vector3 c = triangles[lights[i]].get_center();
+    lower = min(lower, c);
+    upper = max(upper, c);
+  }
+  Vector3 extent = upper - lower;
+  int axis = 0;
+  if (extent[1] > extent[axis])
+    axis = 1;
+  if (extent[2] > extent[axis])
+    axis = 2;
+  int mid = (begin + end) / 2;
+  std::nth_element(lights.begin() + begin, lights.begin() + mid,
+                   lights.begin() + end, [&](int a, int b) {
+                     return triangles[a].get_center()[axis] <
+                            triangles[b].get_center()[axis];
+                   });
+  int left = build_node(lights, begin, mid, index, triangles, powers);
+  int right = build_node(lights, mid, end, index, triangles, powers);
+  // |nodes| may have been reallocated
+  const Node &l = nodes[left], &r = nodes[right];
+  Node &node = nodes[index];
+  node.lower = min(l.lower, r.lower);
+  node.upper = max(l.upper, r.upper);
+  merge_cones(l.axis, l.theta_o, r.axis, r.theta_o, node.axis, node.theta_o);
+  node.power = l.power + r.power;
+  node.children[0] = left;
+  node.children[1] = right;
+  node.parent = parent;
+  node.light = -1;
+  return index;
+}
+
+// Upper bound of the power |node| emits towards |pos|
+real LightBVH::importance(const Node &node, const Vector3 &pos) const {
+  Vector3 center = 0.5_f * (node.lower + node.upper);
+  Vector3 d = pos - center;
+  real dist2 = dot(d, d);
+  real radius2 = 0.25_f * dot(node.upper - node.lower, node.upper - node.lower);
+  if (dist2 <= radius2) {
+    // Inside the bounding sphere: no orientation bound, and the distance is
+    // clamped to the node size.
+    return node.power / std::max(radius2, 1e-20_f);
+  }
+  real dist = std::sqrt(dist2);
+  real theta = std::acos(clamp(dot(node.axis, d) / dist, -1.0_f, 1.0_f));
+  real theta_u = std::asin(std::sqrt(radius2 / dist2));
+  real theta_p = std::max(0.0_f, theta - node.theta_o - theta_u);
+  if (theta_p >= pi / 2) {
+    return 0;
+  }
+  return node.power * std::cos(theta_p) / dist2;
+}
+
+real LightBVH::child_probability(const Node &node,
+                                 int child,
+                                 const Vector3 &pos) const {
+  const Node &a = nodes[node.children[child]];
+  const Node &b = nodes[node.children[1 - child]];
+  real ia = importance(a, pos), ib = importance(b, pos);
+  if (ia + ib <= 0) {
+    // Nothing shines on |pos|; fall back to power
+    ia = a.power;
+    ib = b.power;
+  }
+  if (ia + ib <= 0) {
+    return 0.5_f;
+  }
+  return ia / (ia + ib);
+}
+
+int LightBVH::sample(real r, const Vector3 &pos, real &pdf) const {
+  pdf = 1;
+  int current = 0;
+  while (nodes[current].light == -1) {
+    const Node &node = nodes[current];
+    real p = child_probability(node, 0, pos);
+    // Reuse |r| for the next level
+    if (r < p) {
+      r = r / p;
+      pdf *= p;
+      current = node.children[0];
+    } else {
+      r = (r - p) / (1 - p);
+      pdf *= 1 - p;
+      current = node.children[1];
+    }
+    r = clamp(r, 0.0_f, 1 - 1e-7_f);
+  }
+  return nodes[current].light;
+}
+
+real LightBVH::pdf(int light, const Vector3 &pos) const {
+  real pdf = 1;
+  int current = leaf_of_light[light];
+  while (nodes[current].parent != -1) {
+    const Node &parent = nodes[nodes[current].parent];
+    int child = parent.children[0] == current ? 0 : 1;
+    pdf *= child_probability(parent, child, pos);
+    current = nodes[current].parent;
+  }
+  return pdf;
+}
+
+TC_NAMESPACE_END
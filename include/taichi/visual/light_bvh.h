@@ -0,0 +1,64 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+#include <taichi/geometry/primitives.h>
+
+TC_NAMESPACE_BEGIN
+
+// Many-light selection (after Conty and Kulla, "Importance Sampling of Many
+// Lights with Adaptive Tree Splitting"). Each node bounds its emitters with a
+// box, a cone of normals and their total power. Sampling descends the tree,
+// choosing children in proportion to an upper bound of the power they send
+// towards the shading point, so that distant or back-facing lights are rarely
+// picked. Emitters are one-sided triangles.
+class LightBVH {
+ public:
+  // |powers[i]| is the total power emitted by |triangles[i]|
+  void build(const std::vector<Triangle> &triangles,
+             const std::vector<real> &powers);
+
+  bool empty() const {
+    return nodes.empty();
+  }
+
+  // Returns the index (into the build arrays) of a light picked for |pos|
+  int sample(real r, const Vector3 &pos, real &pdf) const;
+
+  // Probability of sample() picking |light| for |pos|
+  real pdf(int light, const Vector3 &pos) const;
+
+  TC_IO_DEF(nodes, leaf_of_light);
+
+ private:
+  struct Node {
+    Vector3 lower, upper;
+    // Bounding cone of emitter normals
+    Vector3 axis;
+    real theta_o;
+    real power;
+    int children[2];
+    int parent;
+    // Light index for leaves, -1 otherwise
+    int light;
+  };
+
+  std::vector<Node> nodes;
+  std::vector<int> leaf_of_light;
+
+  int build_node(std::vector<int> &lights,
+                 int begin,
+                 int end,
+                 int parent,
+                 const std::vector<Triangle> &triangles,
+                 const std::vector<real> &powers);
+
+  real importance(const Node &node, const Vector3 &pos) const;
+
+  real child_probability(const Node &node, int child, const Vector3 &pos) const;
+};
+
+TC_NAMESPACE_END
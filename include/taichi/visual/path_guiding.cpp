@@ -0,0 +1,287 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#include "path_guiding.h"
+#include <taichi/system/threading.h>
+
+TC_NAMESPACE_BEGIN
+
+// Of the quadtrees; deeper quadrants would lose the random numbers' bits
+constexpr int max_quadtree_depth = 20;
+
+Vector2 direction_to_square(const Vector3 &dir) {
+  real cos_theta = clamp(dir.z, -1.0_f, 1.0_f);
+  real phi = std::atan2(dir.y, dir.x);
+  if (phi < 0) {
+    phi += 2 * pi;
+  }
+  return Vector2(clamp((cos_theta + 1) * 0.5_f, 0.0_f, 1.0_f),
+                 clamp(phi * (0.5_f / pi), 0.0_f, 1.0_f));
+}
+
+Vector3 square_to_direction(const Vector2 &p) {
+  real cos_theta = 2 * p.x - 1;
+  real sin_theta = std::sqrt(std::max(0.0_f, 1 - cos_theta * cos_theta));
+  real phi = 2 * pi * p.y;
+  return Vector3(sin_theta * std::cos(phi), sin_theta * std::sin(phi),
+                 cos_theta);
+}
+
+static void atomic_add(std::atomic<float32> &a, float32 value) {
+  float32 old = a.load(std::memory_order_relaxed);
+  while (!a.compare_exchange_weak(old, old + value,
+                                  std::memory_order_relaxed)) {
+  }
+}
+
+// The quadrant (x + 2y) of |p|, which is moved into the quadrant's square
+static int descend(Vector2 &p) {
+  int x = p.x >= 0.5_f, y = p.y >= 0.5_f;
+  p = p * 2.0_f - Vector2((real)x, (real)y);
+  return x + 2 * y;
+}
+
+DirectionalQuadtree::Node::Node() {
+  for (int q = 0; q < 4; q++) {
+    sums[q].store(0, std::memory_order_relaxed);
+    children[q] = 0;
+  }
+}
+
+DirectionalQuadtree::Node::Node(const Node &o) {
+  *this = o;
+}
+
+DirectionalQuadtree::Node &DirectionalQuadtree::Node::operator=(
+    const Node &o) {
+  for (int q = 0; q < 4; q++) {
+    sums[q].store(o.sums[q].load(std::memory_order_relaxed),
+                  std::memory_order_relaxed);
+    children[q] = o.children[q];
+  }
+  return *this;
+}
+
+real DirectionalQuadtree::Node::get_total() const {
+  real total = 0;
+  for (int q = 0; q < 4; q++) {
+    total += sums[q].load(std::memory_order_relaxed);
+  }
+  return total;
+}
+
+DirectionalQuadtree::DirectionalQuadtree() : nodes(1) {
+}
+
+void DirectionalQuadtree::record(const Vector3 &dir, real value) {
+  Vector2 p = direction_to_square(dir);
+  int n = 0;
+  while (true) {
+    int q = descend(p);
+    atomic_add(nodes[n].sums[q], (float32)value);
+    if (nodes[n].children[q] == 0) {
+      break;
+    }
+    n = nodes[n].children[q];
+  }
+}
+
+Vector3 DirectionalQuadtree::sample(real u, real v) const {
+  const real one_minus_eps = 1 - 1e-6_f;
+  Vector2 origin(0.0_f);
+  real size = 1;
+  int n = 0;
+  while (true) {
+    const Node &node = nodes[n];
+    real sums[4];
+    for (int q = 0; q < 4; q++) {
+      sums[q] = node.sums[q].load(std::memory_order_relaxed);
+    }
+    real total = sums[0] + sums[1] + sums[2] + sums[3];
+    if (!(total > 0)) {
+      // Uniform in the square with no radiance
+      origin += size * Vector2(u, v);
+      break;
+    }
+    // The column, then the quadrant in it, reusing the random numbers
+    real p_left = (sums[0] + sums[2]) / total;
+    int x = u >= p_left;
+    u = x ? (u - p_left) / (1 - p_left) : u / p_left;
+    real p_bottom = sums[x] / (sums[x] + sums[x + 2]);
+    int y = v >= p_bottom;
+    v = y ? (v - p_bottom) / (1 - p_bottom) : v / p_bottom;
+    u = clamp(u, 0.0_f, one_minus_eps);
+    v = clamp(v, 0.0_f, one_minus_eps);
+    size *= 0.5_f;
+    origin += size * Vector2((real)x, (real)y);
+    int child = node.children[x + 2 * y];
+    if (child == 0) {
+      origin += size * Vector2(u, v);
+      break;
+    }
+    n = child;
+  }
+  return square_to_direction(origin);
+}
+
+real DirectionalQuadtree::pdf(const Vector3 &dir) const {
+  Vector2 p = direction_to_square(dir);
+  real density = 1;
+  int n = 0;
+  while (true) {
+    const Node &node = nodes[n];
+    real total = node.get_total();
+    if (!(total > 0)) {
+      break;
+    }
+    int q = descend(p);
+    density *= 4 * node.sums[q].load(std::memory_order_relaxed) / total;
+    if (density == 0 || node.children[q] == 0) {
+      break;
+    }
+    n = node.children[q];
+  }
+  return density * (0.25_f / pi);
+}
+
+void DirectionalQuadtree::refine(const DirectionalQuadtree &tree,
+                                 real threshold,
+                                 int max_depth) {
+  max_depth = std::min(max_depth, max_quadtree_depth);
+  nodes.assign(1, Node());
+  real total = tree.get_total();
+  if (!(total > 0)) {
+    return;
+  }
+  struct Task {
+    // Of this tree, and of |tree| (-1 where it is coarser)
+    int node, source;
+    // Of the total, in the node
+    real fraction;
+    int depth;
+  };
+  std::vector<Task> tasks{Task{0, 0, 1, 1}};
+  while (!tasks.empty()) {
+    Task task = tasks.back();
+    tasks.pop_back();
+    for (int q = 0; q < 4; q++) {
+      real fraction;
+      int source = -1;
+      if (task.source >= 0) {
+        const Node &node = tree.nodes[task.source];
+        fraction = node.sums[q].load(std::memory_order_relaxed) / total;
+        if (node.children[q] != 0) {
+          source = node.children[q];
+        }
+      } else {
+        // Uniform in the leaves of |tree|
+        fraction = task.fraction * 0.25_f;
+      }
+      if (fraction > threshold && task.depth < max_depth) {
+        int child = (int)nodes.size();
+        nodes.emplace_back();
+        nodes[task.node].children[q] = child;
+        tasks.push_back(Task{child, source, fraction, task.depth + 1});
+      }
+    }
+  }
+}
+
+void PathGuide::initialize(const Vector3 &lower, const Vector3 &upper) {
+  // A cube, so that the splits along the axes in turn keep cells cubic
+  real size = std::max((upper - lower).max(), 1e-6_f) * 1.001_f;
+  Vector3 center = (lower + upper) * 0.5_f;
+  this->lower = center - Vector3(size * 0.5_f);
+  inv_size = Vector3(1.0_f / size);
+  nodes.assign(1, Node{0, {0, 0}, 0});
+  leaves.clear();
+  leaves.push_back(std::make_unique<Leaf>());
+}
+
+int PathGuide::find_leaf(const Vector3 &pos) const {
+  Vector3 p = (pos - lower) * inv_size;
+  for (int k = 0; k < 3; k++) {
+    // Also for NaNs
+    p[k] = p[k] >= 0 ? std::min(p[k], 1.0_f) : 0;
+  }
+  int n = 0;
+  while (nodes[n].leaf < 0) {
+    int axis = nodes[n].axis;
+    int c = p[axis] >= 0.5_f;
+    p[axis] = p[axis] * 2 - c;
+    n = nodes[n].children[c];
+  }
+  return nodes[n].leaf;
+}
+
+const DirectionalQuadtree *PathGuide::get_sampling_tree(
+    const Vector3 &pos) const {
+  const DirectionalQuadtree &tree = leaves[find_leaf(pos)]->sampling;
+  return tree.get_total() > 0 ? &tree : nullptr;
+}
+
+real PathGuide::estimate_radiance(const Vector3 &pos,
+                                  const Vector3 &dir) const {
+  const Leaf &leaf = *leaves[find_leaf(pos)];
+  if (leaf.sampling_records == 0) {
+    return 0;
+  }
+  real total = leaf.sampling.get_total();
+  if (!(total > 0)) {
+    return 0;
+  }
+  return total / leaf.sampling_records * leaf.sampling.pdf(dir);
+}
+
+void PathGuide::record(const Vector3 &pos, const Vector3 &dir, real value) {
+  Leaf &leaf = *leaves[find_leaf(pos)];
+  leaf.num_records.fetch_add(1, std::memory_order_relaxed);
+  if (value > 0 && std::isfinite(value)) {
+    leaf.building.record(dir, value);
+  }
+}
+
+void PathGuide::update(int64 spatial_threshold,
+                       real directional_threshold,
+                       int num_threads) {
+  for (auto &leaf : leaves) {
+    leaf->sampling = leaf->building;
+    leaf->sampling_records = leaf->num_records.load(std::memory_order_relaxed);
+  }
+  // The halves of a split leaf share its records, and may split again
+  for (int n = 0; n < (int)nodes.size(); n++) {
+    int l = nodes[n].leaf;
+    if (l < 0) {
+      continue;
+    }
+    Leaf &leaf = *leaves[l];
+    int64 records = leaf.num_records.load(std::memory_order_relaxed);
+    if (records <= spatial_threshold) {
+      continue;
+    }
+    auto half = std::make_unique<Leaf>();
+    half->sampling = leaf.sampling;
+    half->sampling_records = leaf.sampling_records;
+    half->building = leaf.building;
+    half->num_records.store(records / 2, std::memory_order_relaxed);
+    leaf.num_records.store(records - records / 2, std::memory_order_relaxed);
+    leaves.push_back(std::move(half));
+    int axis = (nodes[n].axis + 1) % 3;
+    int child = (int)nodes.size();
+    nodes.push_back(Node{axis, {0, 0}, l});
+    nodes.push_back(Node{axis, {0, 0}, (int)leaves.size() - 1});
+    nodes[n].children[0] = child;
+    nodes[n].children[1] = child + 1;
+    nodes[n].leaf = -1;
+  }
+  ThreadedTaskManager::run((int)leaves.size(), num_threads, [&](int i) {
+    Leaf &leaf = *leaves[i];
+    leaf.building.refine(leaf.sampling, directional_threshold,
+                         max_quadtree_depth);
+    leaf.num_records.store(0, std::memory_order_relaxed);
+  });
+}
+
+TC_NAMESPACE_END
@@ -0,0 +1,126 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+#include <taichi/math/math.h>
+#include <atomic>
+#include <memory>
+#include <vector>
+
+TC_NAMESPACE_BEGIN
+
+// Directions as points of the unit square, by (cos theta, phi). The map
+// preserves area, so that densities on the square are 4 pi times the ones
+// in solid angle.
+Vector2 direction_to_square(const Vector3 &dir);
+
+Vector3 square_to_direction(const Vector2 &p);
+
+// Quadtree over the square of directions, with the radiance recorded in
+// every quadrant of its nodes, for sampling in proportion to it. Records
+// are atomic adds, so that threads splat into one tree without locks; the
+// structure changes only in refine().
+class DirectionalQuadtree {
+ public:
+  DirectionalQuadtree();
+
+  void record(const Vector3 &dir, real value);
+
+  real get_total() const {
+    return nodes[0].get_total();
+  }
+
+  // The tree must have a total > 0
+  Vector3 sample(real u, real v) const;
+
+  // In solid angle, of sample()
+  real pdf(const Vector3 &dir) const;
+
+  // Rebuilds the structure from the distribution of |tree|: quadrants with
+  // more than |threshold| of its total are subdivided, up to |max_depth|,
+  // and the others merged. The sums start from zero.
+  void refine(const DirectionalQuadtree &tree, real threshold, int max_depth);
+
+  int get_num_nodes() const {
+    return (int)nodes.size();
+  }
+
+ private:
+  struct Node {
+    std::atomic<float32> sums[4];
+    // 0 for the quadrants that are leaves
+    int children[4];
+
+    Node();
+    Node(const Node &o);
+    Node &operator=(const Node &o);
+
+    real get_total() const;
+  };
+
+  std::vector<Node> nodes;
+};
+
+// Online path guiding (after Mueller et al., "Practical Path Guiding for
+// Efficient Light-Transport Simulation"): a binary tree over the scene,
+// split at the middle along x, y and z in turn, keeps two quadtrees in
+// every leaf. Paths sample directions from the quadtrees built in the last
+// iteration, while they record the radiance they find into the ones of
+// this iteration. update() ends an iteration; as the iterations take twice
+// the samples of the ones before, the leaves and the quadtrees get finer.
+class PathGuide {
+ public:
+  void initialize(const Vector3 &lower, const Vector3 &upper);
+
+  // nullptr if the leaf of |pos| has no radiance to sample from yet
+  const DirectionalQuadtree *get_sampling_tree(const Vector3 &pos) const;
+
+  // Radiance |value| arriving at |pos| from |dir|, divided by the pdf of
+  // |dir|; thread safe
+  void record(const Vector3 &pos, const Vector3 &dir, real value);
+
+  // Leaves with over |spatial_threshold| records are split, and quadrants
+  // with over |directional_threshold| of the radiance of their leaf
+  // subdivided
+  void update(int64 spatial_threshold,
+              real directional_threshold,
+              int num_threads = -1);
+
+  // Incident luminance at |pos| from |dir|, by the records of the last
+  // iteration: their mean is the integral of the radiance over the sphere,
+  // which the sampling quadtree distributes. 0 if there were none.
+  real estimate_radiance(const Vector3 &pos, const Vector3 &dir) const;
+
+  int get_num_leaves() const {
+    return (int)leaves.size();
+  }
+
+ private:
+  struct Leaf {
+    DirectionalQuadtree sampling, building;
+    std::atomic<int64> num_records;
+    // Behind |sampling|
+    int64 sampling_records;
+
+    Leaf() : num_records(0), sampling_records(0) {
+    }
+  };
+
+  struct Node {
+    int axis;
+    int children[2];
+    // -1 for interior nodes
+    int leaf;
+  };
+
+  int find_leaf(const Vector3 &pos) const;
+
+  Vector3 lower, inv_size;
+  std::vector<Node> nodes;
+  std::vector<std::unique_ptr<Leaf>> leaves;
+};
+
+TC_NAMESPACE_END
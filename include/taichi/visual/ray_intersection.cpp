@@ -4,6 +4,9 @@
 *******************************************************************************/
 
 #include "ray_intersection.h"
+#include <cstring>
+#include <list>
+#include <mutex>
 
 TC_NAMESPACE_BEGIN
 
@@ -17,8 +20,38 @@ class BruteForceRayIntersection : public RayIntersection {
 
   void add_triangle(Triangle &triangle) override;
 
+  int add_prototype(const std::vector<Triangle> &triangles,
+                    const std::vector<Vector4f> &vertices,
+                    const std::vector<int32> &indices) override;
+
+  void add_instance(int prototype, const Matrix4 &transform) override;
+
+  void add_spheres(const std::vector<Vector4f> &spheres, int id) override;
+
+  bool update_triangles(int begin,
+                        const std::vector<Triangle> &triangles) override;
+
+  bool update_instance(int instance, const Matrix4 &transform) override;
+
  private:
+  struct Instance {
+    int prototype;
+    Matrix4 world_to_local;
+  };
+
   std::vector<Triangle> triangles;
+  std::vector<std::vector<Triangle>> prototypes;
+  std::vector<Instance> instances;
+  std::vector<std::pair<const std::vector<Vector4f> *, int>> sphere_sets;
+
+  // Returns a copy of |ray| in the local space of |instance|. Directions are
+  // not normalized, so hit distances stay the same.
+  Ray to_local(const Instance &instance, const Ray &ray) const {
+    Ray local = ray;
+    local.orig = multiply_matrix4(instance.world_to_local, ray.orig, 1.0_f);
+    local.dir = multiply_matrix4(instance.world_to_local, ray.dir, 0.0_f);
+    return local;
+  }
 
   // Inherited via RayIntersection
   virtual bool occlude(Ray &ray) override;
@@ -26,6 +59,9 @@ class BruteForceRayIntersection : public RayIntersection {
 
 void BruteForceRayIntersection::clear() {
   triangles.clear();
+  prototypes.clear();
+  instances.clear();
+  sphere_sets.clear();
 }
 
 void BruteForceRayIntersection::build() {
@@ -35,13 +71,100 @@ void BruteForceRayIntersection::query(Ray &ray) {
   for (auto &triangle : triangles) {
     triangle.intersect(ray);
   }
+  for (int i = 0; i < (int)instances.size(); i++) {
+    Ray local = to_local(instances[i], ray);
+    for (auto &triangle : prototypes[instances[i].prototype]) {
+      triangle.intersect(local);
+    }
+    if (local.dist < ray.dist) {
+      ray.dist = local.dist;
+      ray.u = local.u;
+      ray.v = local.v;
+      ray.triangle_id = local.triangle_id;
+      ray.instance_id = i;
+    }
+  }
+  const Vector3f orig = ray.orig.cast<float32>();
+  const Vector3f dir = ray.dir.cast<float32>();
+  for (auto &set : sphere_sets) {
+    for (int i = 0; i < (int)set.first->size(); i++) {
+      float32 t;
+      if (intersect_sphere((*set.first)[i], orig, dir, eps * 10,
+                           (float32)ray.dist, t)) {
+        ray.dist = t;
+        ray.u = ray.v = 0;
+        ray.triangle_id = i;
+        ray.instance_id = set.second;
+      }
+    }
+  }
 }
 
 void BruteForceRayIntersection::add_triangle(Triangle &triangle) {
   triangles.push_back(triangle);
 }
 
+int BruteForceRayIntersection::add_prototype(
+    const std::vector<Triangle> &triangles,
+    const std::vector<Vector4f> &vertices,
+    const std::vector<int32> &indices) {
+  prototypes.push_back(triangles);
+  return (int)prototypes.size() - 1;
+}
+
+void BruteForceRayIntersection::add_instance(int prototype,
+                                             const Matrix4 &transform) {
+  instances.push_back(Instance{prototype, inversed(transform)});
+}
+
+void BruteForceRayIntersection::add_spheres(
+    const std::vector<Vector4f> &spheres,
+    int id) {
+  sphere_sets.push_back(std::make_pair(&spheres, id));
+}
+
+bool BruteForceRayIntersection::update_triangles(
+    int begin,
+    const std::vector<Triangle> &triangles) {
+  std::copy(triangles.begin(), triangles.end(),
+            this->triangles.begin() + begin);
+  return true;
+}
+
+bool BruteForceRayIntersection::update_instance(int instance,
+                                                const Matrix4 &transform) {
+  instances[instance].world_to_local = inversed(transform);
+  return true;
+}
+
 bool BruteForceRayIntersection::occlude(Ray &ray) {
+  for (auto &triangle : triangles) {
+    Ray test_ray = ray;
+    triangle.intersect(test_ray);
+    if (test_ray.triangle_id != -1) {
+      return true;
+    }
+  }
+  for (auto &instance : instances) {
+    for (auto &triangle : prototypes[instance.prototype]) {
+      Ray test_ray = to_local(instance, ray);
+      triangle.intersect(test_ray);
+      if (test_ray.triangle_id != -1) {
+        return true;
+      }
+    }
+  }
+  const Vector3f orig = ray.orig.cast<float32>();
+  const Vector3f dir = ray.dir.cast<float32>();
+  for (auto &set : sphere_sets) {
+    for (auto &sphere : *set.first) {
+      float32 t;
+      if (intersect_sphere(sphere, orig, dir, eps * 10, (float32)ray.dist,
+                           t)) {
+        return true;
+      }
+    }
+  }
   return false;
 }
 
@@ -86,8 +209,289 @@ void error_handler(const RTCError code, const char *str = nullptr) {
 TC_IMPLEMENTATION(RayIntersection, BruteForceRayIntersection, "bf");
 
 #if !defined(TC_DISABLE_EMBREE)
+
+// 8-wide packets need AVX at runtime, see rtcIntersect8.
+#if defined(TC_ISE_AVX) || defined(TC_ISE_AVX2)
+#define TC_EMBREE_PACKET_WIDTH 8
+#endif
+
+// All Embree scenes live on one process-wide device, so that repeated
+// builds (renderers, mesh textures) don't each spin up a device and its
+// thread pool.
+static RTCDevice get_embree_device() {
+  static RTCDevice device = [] {
+    RTCDevice device = rtcNewDevice(NULL);
+    error_handler(rtcDeviceGetError(device));
+    rtcDeviceSetErrorFunction(device, error_handler);
+    return device;
+  }();
+  return device;
+}
+
+// Owns a committed RTCScene
+struct EmbreeScene {
+  RTCScene scene;
+
+  explicit EmbreeScene(RTCScene scene) : scene(scene) {
+  }
+
+  ~EmbreeScene() {
+    rtcDeleteScene(scene);
+  }
+};
+
+struct RTCVertex {
+  float32 x, y, z, a;
+};
+struct RTCTriangle {
+  int32 v[3];
+};
+static_assert(sizeof(Vector4f) == sizeof(RTCVertex),
+              "Shared vertices must have a 16-byte stride");
+
+// The query of EmbreeRayIntersection::occlude_filtered on this thread, if
+// one is running. Plain occlusion queries find none and keep every hit.
+struct EmbreeFilterContext {
+  const std::function<bool(const Ray &)> *filter;
+  const Ray *ray;
+  int geom_id;
+};
+
+static thread_local const EmbreeFilterContext *embree_filter_context =
+    nullptr;
+
+static void embree_occlusion_filter(void *, RTCRay &rtc_ray) {
+  const EmbreeFilterContext *context = embree_filter_context;
+  if (context == nullptr) {
+    return;
+  }
+  Ray hit = *context->ray;
+  hit.dist = rtc_ray.tfar;
+  hit.u = rtc_ray.u;
+  hit.v = rtc_ray.v;
+  hit.triangle_id = (int)rtc_ray.primID;
+  hit.instance_id =
+      rtc_ray.geomID != (unsigned)context->geom_id ? (int)rtc_ray.instID : -1;
+  if (!(*context->filter)(hit)) {
+    // Rejected: the traversal goes on
+    rtc_ray.geomID = RTC_INVALID_GEOMETRY_ID;
+  }
+}
+
+// Adds one triangle mesh to |scene|. Without |copy| the buffers are
+// referenced and must outlive the scene. Occlusion queries go through
+// embree_occlusion_filter.
+static unsigned add_triangle_mesh(RTCScene scene,
+                                  RTCGeometryFlags flags,
+                                  const Vector4f *vertices,
+                                  int num_vertices,
+                                  const int32 *indices,
+                                  int num_triangles,
+                                  bool copy) {
+  unsigned id =
+      rtcNewTriangleMesh(scene, flags, num_triangles, num_vertices, 1);
+  rtcSetOcclusionFilterFunction(scene, id, embree_occlusion_filter);
+  if (!copy) {
+    rtcSetBuffer2(scene, id, RTC_VERTEX_BUFFER, vertices, 0, sizeof(RTCVertex),
+                  num_vertices);
+    rtcSetBuffer2(scene, id, RTC_INDEX_BUFFER, indices, 0, sizeof(RTCTriangle),
+                  num_triangles);
+    return id;
+  }
+  void *mapped = rtcMapBuffer(scene, id, RTC_VERTEX_BUFFER);
+  std::memcpy(mapped, vertices, sizeof(RTCVertex) * num_vertices);
+  rtcUnmapBuffer(scene, id, RTC_VERTEX_BUFFER);
+  mapped = rtcMapBuffer(scene, id, RTC_INDEX_BUFFER);
+  std::memcpy(mapped, indices, sizeof(RTCTriangle) * num_triangles);
+  rtcUnmapBuffer(scene, id, RTC_INDEX_BUFFER);
+  return id;
+}
+
+// Spheres of add_spheres, as an Embree user geometry. Hits set instID to
+// |id|, which set_instance_id then reports.
+struct EmbreeSphereSet {
+  const std::vector<Vector4f> *spheres;
+  int id;
+  unsigned geom_id;
+};
+
+static void embree_sphere_bounds(void *,
+                                 void *user_data,
+                                 size_t item,
+                                 size_t,
+                                 RTCBounds &bounds) {
+  auto set = static_cast<const EmbreeSphereSet *>(user_data);
+  const Vector4f &sphere = (*set->spheres)[item];
+  bounds.lower_x = sphere.x - sphere.w;
+  bounds.lower_y = sphere.y - sphere.w;
+  bounds.lower_z = sphere.z - sphere.w;
+  bounds.upper_x = sphere.x + sphere.w;
+  bounds.upper_y = sphere.y + sphere.w;
+  bounds.upper_z = sphere.z + sphere.w;
+}
+
+// Whether sphere |item| blocks the ray within (t_near, t_far). User
+// geometries have no filter functions, so both of its hits go through the
+// filter of occlude_filtered here, as they would in embree_occlusion_filter.
+static bool embree_sphere_occludes(const EmbreeSphereSet &set,
+                                   size_t item,
+                                   const Vector3f &orig,
+                                   const Vector3f &dir,
+                                   float32 t_near,
+                                   float32 t_far) {
+  float32 t[2];
+  if (!intersect_sphere((*set.spheres)[item], orig, dir, t[0], t[1])) {
+    return false;
+  }
+  const EmbreeFilterContext *context = embree_filter_context;
+  for (int k = 0; k < 2; k++) {
+    if (t[k] <= t_near || t[k] >= t_far) {
+      continue;
+    }
+    if (context == nullptr) {
+      return true;
+    }
+    Ray hit = *context->ray;
+    hit.dist = t[k];
+    hit.u = hit.v = 0;
+    hit.triangle_id = (int)item;
+    hit.instance_id = set.id;
+    if ((*context->filter)(hit)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static void embree_sphere_intersect(void *user_data,
+                                    RTCRay &ray,
+                                    size_t item) {
+  auto set = static_cast<const EmbreeSphereSet *>(user_data);
+  float32 t;
+  if (intersect_sphere((*set->spheres)[item],
+                       Vector3f(ray.org[0], ray.org[1], ray.org[2]),
+                       Vector3f(ray.dir[0], ray.dir[1], ray.dir[2]),
+                       ray.tnear, ray.tfar, t)) {
+    ray.tfar = t;
+    ray.u = ray.v = 0;
+    ray.geomID = set->geom_id;
+    ray.primID = (unsigned)item;
+    ray.instID = (unsigned)set->id;
+  }
+}
+
+static void embree_sphere_occluded(void *user_data, RTCRay &ray, size_t item) {
+  auto set = static_cast<const EmbreeSphereSet *>(user_data);
+  if (embree_sphere_occludes(*set, item,
+                             Vector3f(ray.org[0], ray.org[1], ray.org[2]),
+                             Vector3f(ray.dir[0], ray.dir[1], ray.dir[2]),
+                             ray.tnear, ray.tfar)) {
+    ray.geomID = 0;
+  }
+}
+
+#if defined(TC_EMBREE_PACKET_WIDTH)
+static void embree_sphere_intersect8(const void *valid,
+                                     void *user_data,
+                                     RTCRay8 &ray,
+                                     size_t item) {
+  auto set = static_cast<const EmbreeSphereSet *>(user_data);
+  for (int i = 0; i < 8; i++) {
+    if (static_cast<const int32 *>(valid)[i] == 0) {
+      continue;
+    }
+    float32 t;
+    if (intersect_sphere((*set->spheres)[item],
+                         Vector3f(ray.orgx[i], ray.orgy[i], ray.orgz[i]),
+                         Vector3f(ray.dirx[i], ray.diry[i], ray.dirz[i]),
+                         ray.tnear[i], ray.tfar[i], t)) {
+      ray.tfar[i] = t;
+      ray.u[i] = ray.v[i] = 0;
+      ray.geomID[i] = set->geom_id;
+      ray.primID[i] = (unsigned)item;
+      ray.instID[i] = (unsigned)set->id;
+    }
+  }
+}
+
+static void embree_sphere_occluded8(const void *valid,
+                                    void *user_data,
+                                    RTCRay8 &ray,
+                                    size_t item) {
+  auto set = static_cast<const EmbreeSphereSet *>(user_data);
+  for (int i = 0; i < 8; i++) {
+    if (static_cast<const int32 *>(valid)[i] != 0 &&
+        embree_sphere_occludes(
+            *set, item, Vector3f(ray.orgx[i], ray.orgy[i], ray.orgz[i]),
+            Vector3f(ray.dirx[i], ray.diry[i], ray.dirz[i]), ray.tnear[i],
+            ray.tfar[i])) {
+      ray.geomID[i] = 0;
+    }
+  }
+}
+#endif
+
+// Process-wide cache of committed single-mesh scenes, keyed by a hash of
+// their vertex and index data (and so of mesh file and transform). Scenes
+// hold their own copy of the buffers. The least recently used entries are
+// dropped once the cache is full; scenes still in use stay alive.
+class EmbreeSceneCache {
+ public:
+  static std::shared_ptr<EmbreeScene> get(const Vector4f *vertices,
+                                          int num_vertices,
+                                          const int32 *indices,
+                                          int num_triangles,
+                                          RTCAlgorithmFlags algorithm_flags) {
+    uint64 key = 14695981039346656037ull;  // FNV-1a
+    auto hash = [&](const void *data, std::size_t size) {
+      auto bytes = reinterpret_cast<const unsigned char *>(data);
+      for (std::size_t i = 0; i < size; i++) {
+        key = (key ^ bytes[i]) * 1099511628211ull;
+      }
+    };
+    hash(&num_vertices, sizeof(num_vertices));
+    hash(&num_triangles, sizeof(num_triangles));
+    hash(&algorithm_flags, sizeof(algorithm_flags));
+    hash(vertices, sizeof(RTCVertex) * num_vertices);
+    hash(indices, sizeof(RTCTriangle) * num_triangles);
+
+    static std::mutex mutex;
+    static std::list<std::pair<uint64, std::shared_ptr<EmbreeScene>>> entries;
+    std::lock_guard<std::mutex> _(mutex);
+    for (auto it = entries.begin(); it != entries.end(); it++) {
+      if (it->first == key) {
+        entries.splice(entries.begin(), entries, it);
+        return it->second;
+      }
+    }
+    RTCScene scene = rtcDeviceNewScene(get_embree_device(), RTC_SCENE_STATIC,
+                                       algorithm_flags);
+    add_triangle_mesh(scene, RTC_GEOMETRY_STATIC, vertices, num_vertices,
+                      indices, num_triangles, true);
+    rtcCommit(scene);
+    error_handler(rtcDeviceGetError(get_embree_device()));
+    entries.emplace_front(key, std::make_shared<EmbreeScene>(scene));
+    if ((int)entries.size() > capacity) {
+      entries.pop_back();
+    }
+    return entries.front().second;
+  }
+
+ private:
+  static constexpr int capacity = 32;
+};
+
 class EmbreeRayIntersection : public RayIntersection {
  public:
+  void initialize(const Config &config) override {
+    dynamic = config.get("dynamic_scene", false);
+    cache = config.get("bvh_cache", false);
+  }
+
+  ~EmbreeRayIntersection() {
+    release_scenes();
+  }
+
   void clear() override;
 
   void build() override;
@@ -96,58 +500,219 @@ class EmbreeRayIntersection : public RayIntersection {
 
   void add_triangle(Triangle &triangle) override;
 
+  bool set_shared_buffers(const Vector4f *vertices,
+                          int num_vertices,
+                          const int32 *indices,
+                          int num_triangles) override;
+
+  int add_prototype(const std::vector<Triangle> &triangles,
+                    const std::vector<Vector4f> &vertices,
+                    const std::vector<int32> &indices) override;
+
+  void add_instance(int prototype, const Matrix4 &transform) override;
+
+  void add_spheres(const std::vector<Vector4f> &spheres, int id) override;
+
   virtual bool occlude(Ray &ray) override;
 
+  bool occlude_filtered(
+      Ray &ray,
+      const std::function<bool(const Ray &)> &filter) override;
+
+  bool update_triangles(int begin,
+                        const std::vector<Triangle> &triangles) override;
+
+  bool update_instance(int instance, const Matrix4 &transform) override;
+
+  void commit_updates() override;
+
+#if defined(TC_EMBREE_PACKET_WIDTH)
+  void query_batch(Ray *rays, int n) override;
+
+  void occlude_batch(Ray *rays, int n, bool *occluded) override;
+#endif
+
  private:
-  std::vector<Triangle> triangles;
-  RTCDevice rtc_device;
-  RTCScene rtc_scene;
+  // Vertices of the triangles of add_triangle, three each, in the float32
+  // that Embree reads, so that no copy of the triangles in |real| is kept
+  std::vector<Vector4f> soup_vertices;
+  std::vector<int32> soup_indices;
+  // Shared buffers, used instead of the soup if set
+  const Vector4f *shared_vertices = nullptr;
+  const int32 *shared_indices = nullptr;
+  int num_shared_vertices = 0;
+  int num_shared_triangles = 0;
+
+  struct Prototype {
+    const std::vector<Vector4f> *vertices;
+    const std::vector<int32> *indices;
+  };
+  std::vector<Prototype> prototypes;
+  std::vector<std::pair<int, Matrix4>> instances;
+  std::vector<std::shared_ptr<EmbreeScene>> prototype_scenes;
+  // Their addresses are the user data of the geometries; fixed after build()
+  std::vector<EmbreeSphereSet> sphere_sets;
+
+  // Built with RTC_SCENE_DYNAMIC, so that vertices can be refitted and
+  // instances moved without recreating the scene
+  bool dynamic = false;
+  // Reuse scenes with identical geometry through EmbreeSceneCache
+  bool cache = false;
+
+  RTCScene rtc_scene = nullptr;
+  std::shared_ptr<EmbreeScene> scene_holder;
+  // Geometry id of the non-instanced triangles in rtc_scene. Instances get
+  // geometry ids 0, 1, ... in order and this comes after them, so that it
+  // never equals the geometry id (0) of a triangle inside an instance.
   int geom_id;
+
+  void release_scenes() {
+    // The top level scene references the prototypes; drop it first
+    scene_holder = nullptr;
+    rtc_scene = nullptr;
+    prototype_scenes.clear();
+  }
+
+  void set_transform(unsigned instance, const Matrix4 &m) {
+    // 3x4 column-major: upper rows of the four columns
+    float32 xfm[12];
+    for (int c = 0; c < 4; c++) {
+      for (int r = 0; r < 3; r++) {
+        xfm[c * 3 + r] = (float32)m[c][r];
+      }
+    }
+    rtcSetTransform2(rtc_scene, instance, RTC_MATRIX_COLUMN_MAJOR, xfm);
+  }
+
+  void set_instance_id(Ray &ray, unsigned geom, unsigned inst) const {
+    if (geom != RTC_INVALID_GEOMETRY_ID && geom != (unsigned)geom_id) {
+      ray.instance_id = (int)inst;
+    } else {
+      ray.instance_id = -1;
+    }
+  }
 };
 
+int EmbreeRayIntersection::add_prototype(const std::vector<Triangle> &triangles,
+                                         const std::vector<Vector4f> &vertices,
+                                         const std::vector<int32> &indices) {
+  prototypes.push_back(Prototype{&vertices, &indices});
+  return (int)prototypes.size() - 1;
+}
 
-void EmbreeRayIntersection::build() {
-  _MM_SET_FLUSH_ZERO_MODE(_MM_FLUSH_ZERO_ON);
-  _MM_SET_DENORMALS_ZERO_MODE(_MM_DENORMALS_ZERO_ON);
-  int num_triangles = (int)triangles.size(), num_vertices = num_triangles * 3;
-  RTCGeometryFlags geom_flags = RTC_GEOMETRY_STATIC;
+void EmbreeRayIntersection::add_instance(int prototype,
+                                         const Matrix4 &transform) {
+  instances.push_back(std::make_pair(prototype, transform));
+}
 
-  rtc_device = rtcNewDevice(NULL);
+void EmbreeRayIntersection::add_spheres(const std::vector<Vector4f> &spheres,
+                                        int id) {
+  sphere_sets.push_back(
+      EmbreeSphereSet{&spheres, id, RTC_INVALID_GEOMETRY_ID});
+}
 
-  error_handler(rtcDeviceGetError(rtc_device));
-  rtcDeviceSetErrorFunction(rtc_device, error_handler);
+bool EmbreeRayIntersection::set_shared_buffers(const Vector4f *vertices,
+                                               int num_vertices,
+                                               const int32 *indices,
+                                               int num_triangles) {
+  shared_vertices = vertices;
+  shared_indices = indices;
+  num_shared_vertices = num_vertices;
+  num_shared_triangles = num_triangles;
+  return true;
+}
 
-  rtc_scene = rtcDeviceNewScene(rtc_device, RTC_SCENE_STATIC, RTC_INTERSECT1);
-  geom_id =
-      rtcNewTriangleMesh(rtc_scene, geom_flags, num_triangles, num_vertices, 1);
+void EmbreeRayIntersection::build() {
+  _MM_SET_FLUSH_ZERO_MODE(_MM_FLUSH_ZERO_ON);
+  _MM_SET_DENORMALS_ZERO_MODE(_MM_DENORMALS_ZERO_ON);
+  release_scenes();
+
+  const Vector4f *vertices = shared_vertices;
+  const int32 *indices = shared_indices;
+  int num_vertices = num_shared_vertices;
+  int num_triangles = num_shared_triangles;
+  if (shared_vertices == nullptr) {
+    vertices = soup_vertices.data();
+    indices = soup_indices.data();
+    num_vertices = (int)soup_vertices.size();
+    num_triangles = (int)soup_indices.size() / 3;
+  }
 
-  struct RTCVertex {
-    float32 x, y, z, a;
-  };
-  struct RTCTriangle {
-    int32 v[3];
-  };
+  RTCDevice rtc_device = get_embree_device();
+  RTCAlgorithmFlags algorithm_flags = RTC_INTERSECT1;
+#if defined(TC_EMBREE_PACKET_WIDTH)
+  algorithm_flags = RTCAlgorithmFlags(algorithm_flags | RTC_INTERSECT8);
+#endif
+  bool use_cache = cache && !dynamic;
+
+  if (use_cache && instances.empty() && sphere_sets.empty() &&
+      num_triangles > 0) {
+    scene_holder = EmbreeSceneCache::get(vertices, num_vertices, indices,
+                                         num_triangles, algorithm_flags);
+    rtc_scene = scene_holder->scene;
+    geom_id = 0;
+    return;
+  }
 
-  RTCVertex *vertices =
-      (RTCVertex *)rtcMapBuffer(rtc_scene, geom_id, RTC_VERTEX_BUFFER);
-  for (int i = 0; i < num_triangles; i++) {
-    for (int k = 0; k < 3; k++) {
-      *(Vector4f *)(&vertices[i * 3 + k]) = Vector4(triangles[i].v[k], 0).cast<float32>();
+  RTCGeometryFlags geom_flags = RTC_GEOMETRY_STATIC;
+  RTCSceneFlags scene_flags = RTC_SCENE_STATIC;
+  if (dynamic) {
+    geom_flags = RTC_GEOMETRY_DEFORMABLE;
+    scene_flags = RTC_SCENE_DYNAMIC;
+  }
+  rtc_scene = rtcDeviceNewScene(rtc_device, scene_flags, algorithm_flags);
+  scene_holder = std::make_shared<EmbreeScene>(rtc_scene);
+
+  for (auto &prototype : prototypes) {
+    const Vector4f *prototype_vertices = prototype.vertices->data();
+    const int32 *prototype_indices = prototype.indices->data();
+    int num_prototype_vertices = (int)prototype.vertices->size();
+    int num_prototype_triangles = (int)prototype.indices->size() / 3;
+    if (use_cache) {
+      prototype_scenes.push_back(EmbreeSceneCache::get(
+          prototype_vertices, num_prototype_vertices, prototype_indices,
+          num_prototype_triangles, algorithm_flags));
+      continue;
     }
+    RTCScene scene =
+        rtcDeviceNewScene(rtc_device, RTC_SCENE_STATIC, algorithm_flags);
+    add_triangle_mesh(scene, RTC_GEOMETRY_STATIC, prototype_vertices,
+                      num_prototype_vertices, prototype_indices,
+                      num_prototype_triangles, false);
+    rtcCommit(scene);
+    prototype_scenes.push_back(std::make_shared<EmbreeScene>(scene));
+  }
+  for (int i = 0; i < (int)instances.size(); i++) {
+    unsigned id = rtcNewInstance2(
+        rtc_scene, prototype_scenes[instances[i].first]->scene);
+    TC_ASSERT(id == (unsigned)i);
+    set_transform(id, instances[i].second);
   }
-  rtcUnmapBuffer(rtc_scene, geom_id, RTC_VERTEX_BUFFER);
 
-  RTCTriangle *triangles =
-      (RTCTriangle *)rtcMapBuffer(rtc_scene, geom_id, RTC_INDEX_BUFFER);
-  for (int i = 0; i < num_triangles; i++) {
-    for (int k = 0; k < 3; k++) {
-      triangles[i].v[k] = i * 3 + k;
+  if (num_triangles == 0 && (!instances.empty() || !sphere_sets.empty())) {
+    geom_id = (int)RTC_INVALID_GEOMETRY_ID;
+  } else {
+    geom_id = add_triangle_mesh(rtc_scene, geom_flags, vertices, num_vertices,
+                                indices, num_triangles, false);
+  }
+  for (auto &set : sphere_sets) {
+    if (set.spheres->empty()) {
+      continue;
     }
+    unsigned id = rtcNewUserGeometry3(rtc_scene, RTC_GEOMETRY_STATIC,
+                                      set.spheres->size());
+    set.geom_id = id;
+    rtcSetUserData(rtc_scene, id, &set);
+    rtcSetBoundsFunction3(rtc_scene, id, embree_sphere_bounds, nullptr);
+    rtcSetIntersectFunction(rtc_scene, id, embree_sphere_intersect);
+    rtcSetOccludedFunction(rtc_scene, id, embree_sphere_occluded);
+#if defined(TC_EMBREE_PACKET_WIDTH)
+    rtcSetIntersectFunction8(rtc_scene, id, embree_sphere_intersect8);
+    rtcSetOccludedFunction8(rtc_scene, id, embree_sphere_occluded8);
+#endif
   }
-  rtcUnmapBuffer(rtc_scene, geom_id, RTC_INDEX_BUFFER);
-
   rtcCommit(rtc_scene);
-  error_handler(rtcDeviceGetError(rtc_device));
+  error_handler(rtcDeviceGetError(get_embree_device()));
 }
 
 void EmbreeRayIntersection::query(Ray &ray) {
@@ -160,12 +725,14 @@ void EmbreeRayIntersection::query(Ray &ray) {
   rtc_ray.mask = -1;
   rtc_ray.geomID = RTC_INVALID_GEOMETRY_ID;
   rtc_ray.primID = RTC_INVALID_GEOMETRY_ID;
+  rtc_ray.instID = RTC_INVALID_GEOMETRY_ID;
 
   rtcIntersect(rtc_scene, rtc_ray);
   ray.u = rtc_ray.u;
   ray.v = rtc_ray.v;
   ray.dist = rtc_ray.tfar;
   ray.triangle_id = rtc_ray.primID;
+  set_instance_id(ray, rtc_ray.geomID, rtc_ray.instID);
   return;
   Vector3 normal = Vector3(rtc_ray.Ng[0], rtc_ray.Ng[1],
                            rtc_ray.Ng[2]);  // What the hell happened to Ng???
@@ -174,14 +741,18 @@ void EmbreeRayIntersection::query(Ray &ray) {
 }
 
 void EmbreeRayIntersection::add_triangle(Triangle &triangle) {
-  triangles.push_back(triangle);
+  for (int k = 0; k < 3; k++) {
+    soup_indices.push_back((int32)soup_vertices.size());
+    soup_vertices.push_back(Vector4(triangle.v[k], 0).cast<float32>());
+  }
 }
 
+// Any-hit query: Embree stops at the first intersection in (tnear, ray.dist)
+// and sets geomID to 0, without computing hit distance or barycentrics.
 bool EmbreeRayIntersection::occlude(Ray &ray) {
-  assert(false);  // TODO
   RTCRay rtc_ray;
-  *(Vector3f *)rtc_ray.org = ray.orig.cast<float32>();
-  *(Vector3f *)rtc_ray.dir = ray.dir.cast<float32>();
+  *reinterpret_cast<Vector3f *>(rtc_ray.org) = ray.orig.cast<float32>();
+  *reinterpret_cast<Vector3f *>(rtc_ray.dir) = ray.dir.cast<float32>();
   rtc_ray.tnear = eps * 10;
   rtc_ray.tfar = ray.dist;
   rtc_ray.time = 0.0_f;
@@ -189,20 +760,127 @@ bool EmbreeRayIntersection::occlude(Ray &ray) {
   rtc_ray.geomID = RTC_INVALID_GEOMETRY_ID;
   rtc_ray.primID = RTC_INVALID_GEOMETRY_ID;
 
-  rtcIntersect(rtc_scene, rtc_ray);
-  ray.u = rtc_ray.u;
-  ray.v = rtc_ray.v;
-  ray.dist = rtc_ray.tfar;
-  ray.triangle_id = rtc_ray.primID;
-  return false;
+  rtcOccluded(rtc_scene, rtc_ray);
+  return rtc_ray.geomID != RTC_INVALID_GEOMETRY_ID;
 }
 
-void EmbreeRayIntersection::clear() {
-  triangles.clear();
-  rtcDeleteScene(rtc_scene);
-  rtcDeleteDevice(rtc_device);
+// One traversal: hits the filter lets pass are rejected in
+// embree_occlusion_filter
+bool EmbreeRayIntersection::occlude_filtered(
+    Ray &ray,
+    const std::function<bool(const Ray &)> &filter) {
+  EmbreeFilterContext context{&filter, &ray, geom_id};
+  embree_filter_context = &context;
+  bool occluded = occlude(ray);
+  embree_filter_context = nullptr;
+  return occluded;
+}
+
+#if defined(TC_EMBREE_PACKET_WIDTH)
+// Fills the first |count| lanes of |packet| and masks out the rest.
+static void fill_rtc_ray8(RTCRay8 &packet,
+                          int32 *valid,
+                          const Ray *rays,
+                          int count,
+                          bool limit_distance) {
+  for (int i = 0; i < 8; i++) {
+    valid[i] = i < count ? -1 : 0;
+    if (i >= count) {
+      continue;
+    }
+    const Ray &ray = rays[i];
+    packet.orgx[i] = (float32)ray.orig.x;
+    packet.orgy[i] = (float32)ray.orig.y;
+    packet.orgz[i] = (float32)ray.orig.z;
+    packet.dirx[i] = (float32)ray.dir.x;
+    packet.diry[i] = (float32)ray.dir.y;
+    packet.dirz[i] = (float32)ray.dir.z;
+    packet.tnear[i] = eps * 10;
+    packet.tfar[i] = limit_distance ? (float32)ray.dist : Ray::DIST_INFINITE;
+    packet.time[i] = 0.0_f;
+    packet.mask[i] = (unsigned)-1;
+    packet.geomID[i] = RTC_INVALID_GEOMETRY_ID;
+    packet.primID[i] = RTC_INVALID_GEOMETRY_ID;
+    packet.instID[i] = RTC_INVALID_GEOMETRY_ID;
+  }
 }
 
+void EmbreeRayIntersection::query_batch(Ray *rays, int n) {
+  for (int begin = 0; begin < n; begin += TC_EMBREE_PACKET_WIDTH) {
+    int count = std::min(TC_EMBREE_PACKET_WIDTH, n - begin);
+    RTCRay8 packet;
+    alignas(32) int32 valid[8];
+    fill_rtc_ray8(packet, valid, rays + begin, count, false);
+    rtcIntersect8(valid, rtc_scene, packet);
+    for (int i = 0; i < count; i++) {
+      Ray &ray = rays[begin + i];
+      ray.u = packet.u[i];
+      ray.v = packet.v[i];
+      ray.dist = packet.tfar[i];
+      ray.triangle_id = packet.primID[i];
+      set_instance_id(ray, packet.geomID[i], packet.instID[i]);
+    }
+  }
+}
+
+void EmbreeRayIntersection::occlude_batch(Ray *rays, int n, bool *occluded) {
+  for (int begin = 0; begin < n; begin += TC_EMBREE_PACKET_WIDTH) {
+    int count = std::min(TC_EMBREE_PACKET_WIDTH, n - begin);
+    RTCRay8 packet;
+    alignas(32) int32 valid[8];
+    fill_rtc_ray8(packet, valid, rays + begin, count, true);
+    rtcOccluded8(valid, rtc_scene, packet);
+    for (int i = 0; i < count; i++) {
+      occluded[begin + i] = packet.geomID[i] != RTC_INVALID_GEOMETRY_ID;
+    }
+  }
+}
+#endif
+
+bool EmbreeRayIntersection::update_triangles(
+    int begin,
+    const std::vector<Triangle> &triangles) {
+  if (!dynamic || geom_id == (int)RTC_INVALID_GEOMETRY_ID) {
+    return false;
+  }
+  if (shared_vertices == nullptr) {
+    for (int i = 0; i < (int)triangles.size(); i++) {
+      for (int k = 0; k < 3; k++) {
+        soup_vertices[(begin + i) * 3 + k] =
+            Vector4(triangles[i].v[k], 0).cast<float32>();
+      }
+    }
+  }
+  rtcUpdateBuffer(rtc_scene, geom_id, RTC_VERTEX_BUFFER);
+  return true;
+}
+
+bool EmbreeRayIntersection::update_instance(int instance,
+                                            const Matrix4 &transform) {
+  if (!dynamic) {
+    return false;
+  }
+  instances[instance].second = transform;
+  set_transform(instance, transform);
+  rtcUpdate(rtc_scene, instance);
+  return true;
+}
+
+void EmbreeRayIntersection::commit_updates() {
+  rtcCommit(rtc_scene);
+  error_handler(rtcDeviceGetError(get_embree_device()));
+}
+
+void EmbreeRayIntersection::clear() {
+  soup_vertices.clear();
+  soup_indices.clear();
+  shared_vertices = nullptr;
+  shared_indices = nullptr;
+  prototypes.clear();
+  instances.clear();
+  release_scenes();
+  sphere_sets.clear();
+}
 
 TC_IMPLEMENTATION(RayIntersection, EmbreeRayIntersection, "embree");
 #endif
@@ -9,9 +9,66 @@
 #include <embree2/rtcore.h>
 #include <embree2/rtcore_ray.h>
 #include <taichi/common/interface.h>
+#include <functional>
 
 TC_NAMESPACE_BEGIN
 
+// Backend used when none is specified. Builds without Embree fall back to the
+// built-in BVH.
+#if defined(TC_DISABLE_EMBREE) || defined(TC_AMALGAMATED)
+#define TC_DEFAULT_RAY_INTERSECTION "bvh"
+#else
+#define TC_DEFAULT_RAY_INTERSECTION "embree"
+#endif
+
+// Distances t0 <= t1 at which |orig| + t |dir| enters and leaves the sphere
+// |sphere| (center, radius), in the stable form of Haines et al., "Precision
+// Improvements for Ray/Sphere Intersection", so that small spheres far from
+// the origin of the ray are still hit. Returns false if the ray misses.
+inline bool intersect_sphere(const Vector4f &sphere,
+                             const Vector3f &orig,
+                             const Vector3f &dir,
+                             float32 &t0,
+                             float32 &t1) {
+  Vector3f f = orig - Vector3f(sphere.x, sphere.y, sphere.z);
+  float32 r2 = sphere.w * sphere.w;
+  float32 a = dot(dir, dir);
+  float32 b = -dot(f, dir);
+  Vector3f l = f + (b / a) * dir;
+  float32 discriminant = r2 - dot(l, l);
+  if (discriminant < 0) {
+    return false;
+  }
+  float32 c = dot(f, f) - r2;
+  float32 q = b + std::copysign(std::sqrt(a * discriminant), b);
+  if (q == 0) {
+    // Grazing the sphere at |orig|: both roots are 0
+    t0 = t1 = 0;
+    return true;
+  }
+  t0 = c / q;
+  t1 = q / a;
+  if (t0 > t1) {
+    std::swap(t0, t1);
+  }
+  return true;
+}
+
+// Nearest hit of the sphere in (t_near, t_far)
+inline bool intersect_sphere(const Vector4f &sphere,
+                             const Vector3f &orig,
+                             const Vector3f &dir,
+                             float32 t_near,
+                             float32 t_far,
+                             float32 &t) {
+  float32 t0, t1;
+  if (!intersect_sphere(sphere, orig, dir, t0, t1)) {
+    return false;
+  }
+  t = t0 > t_near ? t0 : t1;
+  return t_near < t && t < t_far;
+}
+
 class RayIntersection : public Unit {
  public:
   virtual void clear() = 0;
@@ -20,9 +77,117 @@ class RayIntersection : public Unit {
 
   virtual void query(Ray &ray) = 0;
 
+  // Returns true if anything is hit within (0, ray.dist). Hit information
+  // in |ray| is not updated.
   virtual bool occlude(Ray &ray) = 0;
 
+  // Occlusion query that passes through some surfaces: |filter| sees hits
+  // in (0, ray.dist), with dist, u, v, triangle_id and instance_id set, and
+  // returns true for the ones that block the ray. Hits come in no
+  // particular order, and may repeat. Returns true if one blocked. The
+  // default restarts a closest-hit query after each hit; backends with
+  // any-hit filters do it in one traversal.
+  virtual bool occlude_filtered(
+      Ray &ray,
+      const std::function<bool(const Ray &)> &filter) {
+    real traveled = 0;
+    for (int i = 0; i < max_filtered_hits; i++) {
+      Ray next(ray.at(traveled), ray.dir, ray.time);
+      query(next);
+      if (next.triangle_id == -1 || traveled + next.dist >= ray.dist) {
+        return false;
+      }
+      Ray hit = next;
+      hit.orig = ray.orig;
+      hit.dist = traveled + next.dist;
+      if (filter(hit)) {
+        return true;
+      }
+      traveled = hit.dist + 1e-3_f;
+    }
+    return true;
+  }
+
+  // Rays through more surfaces are taken as blocked
+  static constexpr int max_filtered_hits = 100;
+
+  // Batched versions of query and occlude. Backends may override these with
+  // packet traversal; the defaults process one ray at a time.
+  virtual void query_batch(Ray *rays, int n) {
+    for (int i = 0; i < n; i++) {
+      query(rays[i]);
+    }
+  }
+
+  virtual void occlude_batch(Ray *rays, int n, bool *occluded) {
+    for (int i = 0; i < n; i++) {
+      occluded[i] = occlude(rays[i]);
+    }
+  }
+
   virtual void add_triangle(Triangle &triangle) = 0;
+
+  // Zero-copy alternative to add_triangle: |vertices| (16-byte stride) and
+  // |indices| (three per triangle, triangle i gets id i) are referenced,
+  // not copied, and must outlive the acceleration structure. Returns false
+  // if the backend needs triangles from add_triangle instead.
+  virtual bool set_shared_buffers(const Vector4f *vertices,
+                                  int num_vertices,
+                                  const int32 *indices,
+                                  int num_triangles) {
+    return false;
+  }
+
+  // Two-level geometry. add_prototype registers object-space geometry
+  // shared by several instances and returns its id; |vertices| and |indices|
+  // follow set_shared_buffers and, like |triangles| (local ids), must
+  // outlive the acceleration structure. add_instance places a prototype;
+  // hits on it report the index of the add_instance call in
+  // ray.instance_id and the local triangle id in ray.triangle_id.
+  virtual int add_prototype(const std::vector<Triangle> &triangles,
+                            const std::vector<Vector4f> &vertices,
+                            const std::vector<int32> &indices) = 0;
+
+  virtual void add_instance(int prototype, const Matrix4 &transform) = 0;
+
+  // Analytic spheres (center, radius), e.g. simulation particles, at 16
+  // bytes each instead of a tessellated mesh. |spheres| must outlive the
+  // acceleration structure. Hits report |id| in ray.instance_id, the index
+  // of the sphere in ray.triangle_id and u = v = 0; |id| must differ from
+  // the instance ids.
+  virtual void add_spheres(const std::vector<Vector4f> &spheres, int id) {
+    TC_ERROR("This ray intersection backend does not support spheres");
+  }
+
+  // Dynamic scenes. After build(), the triangles with ids starting at
+  // |begin| moved without changing topology: the shared vertex buffer has
+  // been rewritten, and |triangles| holds their new positions for backends
+  // that copied them. update_instance moves an instance. Changes take effect
+  // on commit_updates(). Both return false if the backend can only rebuild
+  // from scratch.
+  virtual bool update_triangles(int begin,
+                                const std::vector<Triangle> &triangles) {
+    return false;
+  }
+
+  virtual bool update_instance(int instance, const Matrix4 &transform) {
+    return false;
+  }
+
+  virtual void commit_updates() {
+  }
+
+  // Prebuilt acceleration structures, for scene bundles. After the geometry
+  // has been added, read_structure takes the place of build() with a
+  // structure saved by write_structure for the same geometry and |stamp|.
+  // Both return false if the backend can not do this.
+  virtual bool write_structure(const std::string &fn, uint64 stamp) {
+    return false;
+  }
+
+  virtual bool read_structure(const std::string &fn, uint64 stamp) {
+    return false;
+  }
 };
 
 TC_INTERFACE(RayIntersection);
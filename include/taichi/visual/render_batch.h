@@ -0,0 +1,48 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+#include <taichi/visual/renderer.h>
+
+TC_NAMESPACE_BEGIN
+
+// Renders many views (cameras, e.g. of a turntable) of one static scene.
+// The views share the scene geometry, built once by the first view, and
+// the textures and light structures of the scene; each keeps its own
+// output. A stage renders a stage of every view at once, so that the tiles
+// of all views are interleaved over the threads and small or converged
+// views do not leave cores idle.
+class RenderBatch {
+ public:
+  // Creates |cameras.size()| renderers |name| with |config|
+  RenderBatch(const std::string &name,
+              const Config &config,
+              std::shared_ptr<Scene> scene,
+              const std::vector<std::shared_ptr<Camera>> &cameras);
+
+  void render_stage();
+
+  int get_num_views() const {
+    return (int)views.size();
+  }
+
+  std::shared_ptr<Renderer> get_view(int i) const {
+    return views[i];
+  }
+
+  // Writes the output of view i to fmt::format(pattern, i), e.g. with
+  // pattern "view_{:04d}.png"
+  void write_outputs(const std::string &pattern);
+
+  // Call after moving meshes or instances of the scene
+  void update_scene();
+
+ private:
+  std::vector<std::shared_ptr<Renderer>> views;
+  int num_threads;
+};
+
+TC_NAMESPACE_END
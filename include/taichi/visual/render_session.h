@@ -0,0 +1,73 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+#include <taichi/visual/renderer.h>
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+
+TC_NAMESPACE_BEGIN
+
+// Runs render stages on a background thread (each stage still fans out over
+// TBB), so that interactive callers can poll previews instead of driving the
+// renderer. Previews are double-buffered: the session fills the back buffer
+// and swaps it in, and get_preview() only waits for a swap, never for a
+// stage. The renderer must not be used directly while a session runs.
+class RenderSession {
+ public:
+  // Config:
+  //   time_budget:      seconds to render for; <= 0 for no limit
+  //   max_stages:       stages to render; -1 for no limit
+  //   preview_interval: minimum seconds between two previews
+  RenderSession(std::shared_ptr<Renderer> renderer, const Config &config);
+
+  ~RenderSession();
+
+  void start();
+
+  // Asks the session to stop after the current stage; does not wait
+  void cancel();
+
+  // Blocks until the session has stopped
+  void wait();
+
+  bool is_running() const {
+    return running.load();
+  }
+
+  int get_stage_count() const {
+    return stage_count.load();
+  }
+
+  // Latest preview (empty before the first one), and the number of stages
+  // it includes
+  Array2D<Vector3> get_preview();
+  int get_preview_stage_count();
+
+ private:
+  void run();
+  void update_preview();
+
+  std::shared_ptr<Renderer> renderer;
+  real time_budget;
+  int max_stages;
+  real preview_interval;
+
+  std::thread thread;
+  std::atomic<bool> running, cancelled;
+  std::atomic<int> stage_count;
+
+  // Guards |front| and readers of previews[front]; previews[1 - front] is
+  // only touched by the session thread
+  std::mutex preview_mutex;
+  Array2D<Vector3> previews[2];
+  int preview_stage_counts[2];
+  int front;
+};
+
+TC_NAMESPACE_END
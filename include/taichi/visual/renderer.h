@@ -9,21 +9,200 @@
 #include <taichi/visual/scene.h>
 #include <taichi/visual/scene_geometry.h>
 #include <taichi/visualization/image_buffer.h>
+#include <taichi/io/image_writer.h>
+#include <taichi/image/denoiser.h>
 #include <taichi/system/timer.h>
 #include <taichi/common/interface.h>
 
+#include <future>
+
 TC_NAMESPACE_BEGIN
+
+// Implements the checkpoint virtuals of a renderer with its
+//   template <typename S> void checkpoint_io(S &serializer)
+#define TC_RENDERER_CHECKPOINT                                           \
+  void write_checkpoint(BinaryOutputSerializer &serializer) override { \
+    checkpoint_io(serializer);                                         \
+  }                                                                    \
+  void read_checkpoint(BinaryInputSerializer &serializer) override {   \
+    checkpoint_io(serializer);                                         \
+  }
+
+// For renderers whose state (e.g. Markov chains) is not checkpointed, so
+// that they do not inherit an incomplete implementation
+#define TC_RENDERER_NO_CHECKPOINT                                   \
+  void write_checkpoint(BinaryOutputSerializer &) override {        \
+    TC_ERROR("This renderer does not support checkpoints");         \
+  }                                                                 \
+  void read_checkpoint(BinaryInputSerializer &) override {          \
+    TC_ERROR("This renderer does not support checkpoints");         \
+  }
+
 class Renderer : public Unit {
  public:
   virtual void initialize(const Config &config) override;
   virtual void render_stage(){};
   virtual void set_scene(std::shared_ptr<Scene> scene);
+  // Renders through |camera| instead of the camera of the scene. Call after
+  // set_scene() and before initialize().
+  void set_camera(std::shared_ptr<Camera> camera);
+  // Traces rays through |sg|, built for the same scene (e.g. by another
+  // renderer), instead of building one in initialize()
+  void set_scene_geometry(std::shared_ptr<SceneGeometry> sg) {
+    this->sg = sg;
+  }
+  std::shared_ptr<SceneGeometry> get_scene_geometry() const {
+    return sg;
+  }
+  // Call after moving meshes or instances of the scene (next frame of an
+  // animation). Renderers that accumulate samples start over, through
+  // reset_accumulation().
+  virtual void update_scene();
+  // Drops what progressive renderers accumulated from the samples so far
+  // (sums, sample counts, radii, Markov chains), e.g. when the scene is no
+  // longer the one they were drawn from. Nothing by default.
+  virtual void reset_accumulation() {
+  }
+  // Call after editing the parameters of materials in place, with camera
+  // and geometry unchanged, so that renderers can keep what they cached
+  // about them. By default the same as update_scene().
+  virtual void material_changed() {
+    update_scene();
+  }
   virtual Array2D<Vector3> get_output() {
     return Array2D<Vector3>(Vector2i(width, height));
   };
+  // get_output() through the a-trous denoiser, guided by the surface AOVs
+  // and, where the renderer has it, the variance of the pixels
+  Array2D<Vector3> get_denoised_output();
+  // With "denoise" on, write_output() and the previews of RenderSession
+  // are denoised, and .exr files get a "denoised" layer
+  bool is_denoising() const {
+    return denoise;
+  }
+  // Queues |fn| to be written in the background, in order; blocks only
+  // while output_queue_size writes are pending. .exr files get the linear
+  // layers of get_output_layers(); other formats the exposure-normalized,
+  // gamma-corrected output, with 16 bits per channel for .png files if
+  // png_bit_depth is 16.
   virtual void write_output(std::string fn);
+  // Waits for the queued outputs to be written
+  void wait_for_output();
+  // The output and the auxiliary images of denoisers and compositing:
+  // first-hit albedo, shading normals and depth, plus renderer-specific
+  // layers
+  virtual std::vector<ImageLayer> get_output_layers();
+  // True once further stages would not improve the output noticeably, for
+  // renderers that measure their error
+  virtual bool is_converged() {
+    return false;
+  }
+  // For distributed rendering: the samples accumulated so far, in a binary
+  // form that ImageAccumulator::accumulate_binary() merges
+  virtual std::vector<uint8> get_partial_output() {
+    TC_ERROR("This renderer does not support partial output");
+    return std::vector<uint8>();
+  }
+
+  // Saves the progressive state (e.g. sample sums and counters) to |fn|,
+  // a .tcb or .tcb.zip file. The state is serialized before returning, but
+  // the file is compressed and written in the background; the previous
+  // checkpoint is finished first. Files are replaced atomically.
+  void save_checkpoint(const std::string &fn);
+  // Waits for the checkpoint being written, if any
+  void wait_for_checkpoint();
+  // Resumes from a checkpoint of a renderer initialized with the same
+  // config and scene
+  void load_checkpoint(const std::string &fn);
+
+  // Restricts rendering to pixels [x0, x1) x [y0, y1) of |window|, clipped to
+  // the frame ("crop_window" in the config); the rest of the output keeps
+  // what was rendered so far. An empty window renders the whole frame.
+  void set_crop_window(Vector4i window);
+  // Tiles overlapping these regions (in pixels, like the crop window) are
+  // rendered first in every stage
+  void set_priority_regions(const std::vector<Vector4i> &regions);
 
  protected:
+  // Screen-space work unit of render stages: pixels [begin, end)
+  struct Tile {
+    Vector2i begin, end;
+  };
+
+  static constexpr int tile_size = 16;
+  // The tiles of the crop window, clipped to it. In Morton order, so that
+  // the contiguous ranges TBB hands to a thread (and steals from it) are
+  // compact on screen, with the tiles of priority regions first.
+  std::vector<Tile> tiles;
+
+  // As requested, and clipped to the frame
+  Vector4i crop_window = Vector4i(0);
+  Vector2i crop_begin, crop_end;
+  std::vector<Vector4i> priority_regions;
+
+  bool is_cropped() const {
+    return crop_begin != Vector2i(0) || crop_end != Vector2i(width, height);
+  }
+
+  int get_crop_area() const {
+    return (crop_end.x - crop_begin.x) * (crop_end.y - crop_begin.y);
+  }
+
+  // Rebuilds |tiles| for the crop window and the priority regions
+  void build_tiles();
+
+  // Called after set_crop_window() or set_priority_regions() rebuilt the
+  // tiles; renderers update the state that refers to tiles, or, if
+  // |crop_changed|, to the pixels sampled so far
+  virtual void tiles_changed(bool crop_changed) {
+  }
+
+  // Calls |func(tile)| for every tile; each tile is processed by one thread.
+  template <typename T>
+  void for_each_tile(const T &func) {
+    ThreadedTaskManager::run([&](int t) { func(tiles[t]); }, 0,
+                             (int)tiles.size(), num_threads);
+  }
+
+  // Same, for the tiles with indices in |subset|
+  template <typename T>
+  void for_each_tile(const std::vector<int> &subset, const T &func) {
+    ThreadedTaskManager::run([&](int t) { func(tiles[subset[t]]); }, 0,
+                             (int)subset.size(), num_threads);
+  }
+
+  virtual void write_checkpoint(BinaryOutputSerializer &serializer) {
+    TC_ERROR("This renderer does not support checkpoints");
+  }
+
+  virtual void read_checkpoint(BinaryInputSerializer &serializer) {
+    TC_ERROR("This renderer does not support checkpoints");
+  }
+
+  std::future<void> checkpoint_writer;
+  // Created by the first write_output()
+  std::unique_ptr<AsyncImageWriter> output_writer;
+  int output_queue_size;
+  int png_bit_depth;
+
+  // Albedo (estimated from BSDF samples), shading normal and depth (along
+  // the ray) of the surfaces seen through the pixel centers; zero where no
+  // surface is hit. Traced once per scene, and cached until update_scene().
+  void get_surface_aovs(Array2D<Vector3> &albedo,
+                        Array2D<Vector3> &normal,
+                        Array2D<real> &depth);
+
+  // Of the mean luminance of the pixels, for the denoiser; empty if the
+  // renderer does not track it
+  virtual Array2D<real> get_output_variance() {
+    return Array2D<real>();
+  }
+
+  bool denoise = false;
+  DenoiserConfig denoiser_config;
+  Array2D<Vector3> aov_albedo, aov_normal;
+  Array2D<real> aov_depth;
+
   std::shared_ptr<Camera> camera;
   std::shared_ptr<Scene> scene;
   std::shared_ptr<RayIntersection> ray_intersection;
@@ -31,6 +210,9 @@ class Renderer : public Unit {
   int width, height;
   int min_path_length, max_path_length;
   int num_threads;
+  // Workers of a distributed render take disjoint sample ranges: worker
+  // |worker_id| renders the stages worker_id, worker_id + num_workers, ...
+  int worker_id, num_workers;
   bool path_length_in_range(int path_length) {
     return min_path_length <= path_length && path_length <= max_path_length;
   }
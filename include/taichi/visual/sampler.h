@@ -28,6 +28,11 @@ class StateSequence {
     return cursor;
   }
 
+  // Skips |count| dimensions
+  void skip(int count) {
+    cursor += count;
+  }
+
   void assert_cursor_pos(int cursor) const {
     assert_info(
         this->cursor == cursor,
@@ -48,16 +53,52 @@ class StateSequence {
   }
 };
 
+// Renderers that number the samples of each pixel apart, sample k of pixel
+// p being instance k * num_pixels + p, set "num_pixels" in the config, so
+// that the samples of a pixel are a low-discrepancy sequence of their own
 class Sampler : public Unit {
  public:
   virtual real sample(int d, long long i) const = 0;
+
+  // Writes dimensions [d0, d0 + count) of sample |i| to |out|. Samplers that
+  // can share work between dimensions override this.
+  virtual void fill(long long i, int d0, int count, real *out) const {
+    for (int k = 0; k < count; k++) {
+      out[k] = sample(d0 + k, i);
+    }
+  }
 };
 TC_INTERFACE(Sampler);
 
+// Draws dimensions from the sampler |buffer_size| at a time, so that the
+// virtual call and range checks are paid once per batch
 class RandomStateSequence : public StateSequence {
+ public:
+  static constexpr int buffer_size = 16;
+
  private:
   std::shared_ptr<Sampler> sampler;
   long long instance;
+  real buffer[buffer_size];
+  // Dimensions in |buffer| start here; none are buffered yet
+  int buffer_begin = 0, buffer_end = 0;
+
+  void refill() {
+    assert_info(sampler != nullptr, "null sampler");
+    sampler->fill(instance, cursor, buffer_size, buffer);
+    for (int k = 0; k < buffer_size; k++) {
+      real &ret = buffer[k];
+      assert_info(ret >= 0, "sampler output should be non-neg");
+      if (ret > 1 + 1e-5f) {
+        TC_WARN_ONCE("Sampler returns value > 1: [{}]", ret);
+      }
+      if (ret >= 1) {
+        ret = 0;
+      }
+    }
+    buffer_begin = cursor;
+    buffer_end = cursor + buffer_size;
+  }
 
  public:
   RandomStateSequence(std::shared_ptr<Sampler> sampler, long long instance)
@@ -65,16 +106,10 @@ class RandomStateSequence : public StateSequence {
   }
 
   real sample() override {
-    assert_info(sampler != nullptr, "null sampler");
-    real ret = sampler->sample(cursor++, instance);
-    assert_info(ret >= 0, "sampler output should be non-neg");
-    if (ret > 1 + 1e-5f) {
-      printf("Warning: sampler returns value > 1: [%f]", ret);
-    }
-    if (ret >= 1) {
-      ret = 0;
+    if (cursor >= buffer_end || cursor < buffer_begin) {
+      refill();
     }
-    return ret;
+    return buffer[cursor++ - buffer_begin];
   }
 };
 
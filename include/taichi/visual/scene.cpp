@@ -6,91 +6,87 @@
 #include <taichi/visual/scene.h>
 #include <taichi/visual/surface_material.h>
 
-#define TINYOBJLOADER_IMPLEMENTATION
-#include <tiny_obj_loader.h>
+#include <taichi/geometry/simplification.h>
+#include <taichi/io/io.h>
+#include <taichi/io/mesh_reader.h>
+#include <taichi/common/serialization.h>
+#include <taichi/system/threading.h>
+
+#include <chrono>
+#include <fstream>
+#include <tuple>
 
 TC_NAMESPACE_BEGIN
 
 void Mesh::initialize(const Config &config) {
   transform = Matrix4(1.0_f);
+  lod_levels = config.get("lod_levels", 0);
+  lod_error = config.get("lod_error", 1.0_f);
   std::string filepath = config.get_string("filename");
   if (!filepath.empty())
-    load_from_file(filepath, config.get("reverse_vertices", false));
+    load_from_file(filepath, config.get("reverse_vertices", false),
+                   config.get("cache", true));
 }
 
 void Mesh::load_from_file(const std::string &file_path_,
-                          bool reverse_vertices) {
-  tinyobj::attrib_t attrib;
-  std::vector<tinyobj::shape_t> shapes;
-  std::vector<tinyobj::material_t> materials;
-
+                          bool reverse_vertices,
+                          bool cache) {
   std::string file_path = absolute_path(file_path_);
+  MeshData data;
+  read_mesh(file_path, data, cache);
+  load_mesh_data(data, reverse_vertices);
+}
 
-  std::string err;
-  bool ret =
-      tinyobj::LoadObj(&attrib, &shapes, &materials, &err, file_path.c_str());
-
-  if (!err.empty()) {  // `err` may contain warning message.
-    TC_ERROR(err);
+void Mesh::load_mesh_data(const MeshData &data, bool reverse_vertices) {
+  // Triangles are appended, as with several files in one mesh
+  int first = (int)untransformed_triangles.size();
+  int num_triangles = data.get_num_triangles();
+  bool indexed = untransformed_triangles.empty() && positions.empty();
+  if (indexed) {
+    positions = data.positions;
+    faces.resize(num_triangles);
+  } else {
+    positions.clear();
+    faces.clear();
   }
-
-  TC_ASSERT_INFO(ret, "Loading " + file_path + " failed");
-
-  // Loop over shapes
-  for (size_t s = 0; s < shapes.size(); s++) {
-    // Loop over faces(polygon)
-    size_t index_offset = 0;
-    for (size_t f = 0; f < shapes[s].mesh.num_face_vertices.size(); f++) {
-      int fv = shapes[s].mesh.num_face_vertices[f];
-
-      // Loop over vertices in the face.
-      TC_ASSERT_INFO(fv == 3, "Only triangles supported...");
-      int i = (int)vertices.size(), j = i + 1, k = i + 2;
-      if (reverse_vertices) {
-        std::swap(j, k);
-      }
-      bool has_normal = false;
-      for (int v = 0; v < fv; v++) {
-        // access to vertex
-        tinyobj::index_t idx = shapes[s].mesh.indices[index_offset + v];
-        float vx = attrib.vertices[3 * idx.vertex_index + 0];
-        float vy = attrib.vertices[3 * idx.vertex_index + 1];
-        float vz = attrib.vertices[3 * idx.vertex_index + 2];
-        vertices.push_back(Vector3(vx, vy, vz));
-        if (idx.normal_index != -1) {
-          float nx = attrib.normals[3 * idx.normal_index + 0];
-          float ny = attrib.normals[3 * idx.normal_index + 1];
-          float nz = attrib.normals[3 * idx.normal_index + 2];
-          has_normal = true;
-          normals.push_back(Vector3(nx, ny, nz));
-        } else {
-          // should be consistent
-          assert(!has_normal);
-          has_normal = false;
+  untransformed_triangles.resize(first + num_triangles);
+  ThreadedTaskManager::run(
+      [&](int t) {
+        const int *p = &data.position_indices[t * 3];
+        const int *n = &data.normal_indices[t * 3];
+        const int *uv = &data.uv_indices[t * 3];
+        Vector3 v[3], normal[3];
+        Vector2 uvs[3];
+        for (int k = 0; k < 3; k++) {
+          v[k] = data.positions[p[k]];
+          uvs[k] = uv[k] == -1 ? Vector2(0.0_f) : data.uvs[uv[k]];
         }
-        float tx = 0.0_f, ty = 0.0_f;
-        if (idx.texcoord_index != -1) {
-          tx = attrib.texcoords[2 * idx.texcoord_index + 0];
-          ty = attrib.texcoords[2 * idx.texcoord_index + 1];
+        bool has_normal = n[0] != -1 && n[1] != -1 && n[2] != -1;
+        if (has_normal) {
+          for (int k = 0; k < 3; k++) {
+            normal[k] = data.normals[n[k]];
+          }
+        } else {
+          Vector3 generated_normal = cross(v[1] - v[0], v[2] - v[0]);
+          if (length(generated_normal) > 1e-6f) {
+            generated_normal = normalize(generated_normal);
+          }
+          normal[0] = normal[1] = normal[2] = generated_normal;
         }
-        uvs.push_back(Vector2(tx, ty));
-      }
-      if (!has_normal) {
-        Vector3 *a = &vertices[vertices.size()] - 3;
-        Vector3 generated_normal = cross(a[1] - a[0], a[2] - a[0]);
-        if (length(generated_normal) > 1e-6f) {
-          generated_normal = normalize(generated_normal);
+        int i = 0, j = 1, k = 2;
+        if (reverse_vertices) {
+          std::swap(j, k);
         }
-        for (int v = 0; v < fv; v++) {
-          normals.push_back(generated_normal);
+        untransformed_triangles[first + t] =
+            Triangle(v[i], v[j], v[k], normal[i], normal[j], normal[k],
+                     uvs[i], uvs[j], uvs[k], first + t);
+        if (indexed) {
+          faces[t].vert_ind[0] = p[i];
+          faces[t].vert_ind[1] = p[j];
+          faces[t].vert_ind[2] = p[k];
         }
-      }
-      untransformed_triangles.push_back(
-          Triangle(vertices[i], vertices[j], vertices[k], normals[i],
-                   normals[j], normals[k], uvs[i], uvs[j], uvs[k], i / 3));
-      index_offset += fv;
-    }
-  }
+      },
+      0, num_triangles, -1);
 }
 
 void Mesh::set_material(std::shared_ptr<SurfaceMaterial> material) {
@@ -106,12 +102,64 @@ void Mesh::set_material(std::shared_ptr<SurfaceMaterial> material) {
 }
 
 IntersectionInfo Scene::get_intersection_info(int triangle_id, Ray &ray) {
-  IntersectionInfo inter;
   if (triangle_id == -1) {
+    return IntersectionInfo();
+  }
+  if (ray.instance_id >= (int)instances.size()) {
+    return get_sphere_intersection_info(ray);
+  }
+  if (ray.instance_id != -1) {
+    const MeshInstance &instance = instances[ray.instance_id];
+    const MeshPrototype &prototype = prototypes[instance.prototype];
+    IntersectionInfo inter = get_intersection_info(
+        prototype.triangles[triangle_id].get_transformed(
+            instance.transform, instance.normal_transform),
+        ray);
+    inter.instance_id = ray.instance_id;
+    inter.material = prototype.mesh.material.get();
     return inter;
   }
+  // Only the hit triangle's attributes are fetched
+  IntersectionInfo inter =
+      get_intersection_info(get_triangle(triangle_id), ray);
+  inter.material = get_mesh_from_triangle_id(triangle_id)->material.get();
+  return inter;
+}
+
+IntersectionInfo Scene::get_sphere_intersection_info(const Ray &ray) const {
+  const SphereSet &set = sphere_sets[ray.instance_id - instances.size()];
+  const Vector4f &sphere = set.spheres[ray.triangle_id];
+  Vector3 center(sphere.x, sphere.y, sphere.z);
+  Vector3 n = normalized(ray.at(ray.dist) - center);
+  IntersectionInfo inter;
+  inter.intersected = true;
+  // Projected back onto the sphere, for rays that start on its surface
+  inter.pos = center + (real)sphere.w * n;
+  inter.front = dot(ray.dir, n) < 0;
+  inter.normal = inter.front ? n : -n;
+  inter.geometry_normal = inter.normal;
+  // Longitude and colatitude
+  inter.uv = Vector2(std::atan2(n.y, n.x) / (2 * pi) + 0.5_f,
+                     std::acos(clamp(n.z, -1.0_f, 1.0_f)) / pi);
+  inter.tri_coord = Vector2(0.0_f);
+  inter.dt_du = inter.dt_dv = Vector2(0.0_f);
+  inter.dist = ray.dist;
+  inter.triangle_id = ray.triangle_id;
+  inter.instance_id = ray.instance_id;
+  inter.material = set.material.get();
+  Vector3 axis = std::abs(inter.normal.z) < 0.9_f ? Vector3(0, 0, 1)
+                                                  : Vector3(1, 0, 0);
+  Vector3 u = normalized(cross(axis, inter.normal));
+  Vector3 v = cross(inter.normal, u);
+  inter.to_world = Matrix3(u, v, inter.normal);
+  inter.to_local = transposed(inter.to_world);
+  return inter;
+}
+
+IntersectionInfo Scene::get_intersection_info(const Triangle &t,
+                                              Ray &ray) const {
+  IntersectionInfo inter;
   inter.intersected = true;
-  Triangle &t = triangles[triangle_id];
   real coord_u = ray.u, coord_v = ray.v;
   inter.tri_coord.x = coord_u;
   inter.tri_coord.y = coord_u;
@@ -126,7 +174,7 @@ IntersectionInfo Scene::get_intersection_info(int triangle_id, Ray &ray) {
   inter.normal = inter.front ? normal : -normal;
   // TODO: why unused?
   // Mesh *mesh = triangle_id_to_mesh[t.id];
-  inter.triangle_id = triangle_id;
+  inter.triangle_id = t.id;
   inter.dist = ray.dist;
   // inter.material = mesh->material.get();
   Vector3 u = normalized(t.v[1] - t.v[0]);
@@ -147,28 +195,600 @@ void Scene::add_mesh(std::shared_ptr<Mesh> mesh) {
   meshes.push_back(*mesh);
 }
 
-void Scene::finalize_geometry() {
-  int triangle_count = 0;
-  for (auto &mesh : meshes) {
-    triangle_id_start[&mesh] = triangle_count;
-    auto sub = mesh.get_triangles();
-    for (int i = 0; i < (int)sub.size(); i++) {
-      sub[i].id = triangle_count + i;
+void Scene::add_instance(std::shared_ptr<Mesh> mesh, const Matrix4 &transform) {
+  TC_ASSERT_INFO(mesh->emission == 0,
+                 "Emissive meshes can not be instanced");
+  auto it = prototype_ids.find(mesh.get());
+  int prototype;
+  if (it == prototype_ids.end()) {
+    prototype = (int)prototypes.size();
+    prototype_ids[mesh.get()] = prototype;
+    prototypes.emplace_back();
+    prototypes.back().mesh = *mesh;
+  } else {
+    prototype = it->second;
+  }
+  MeshInstance instance;
+  instance.base = instance.prototype = prototype;
+  instance.transform = transform * mesh->transform;
+  instance.normal_transform = transposed(inversed(instance.transform));
+  instances.push_back(instance);
+}
+
+void Scene::add_spheres(const std::vector<Vector4> &spheres,
+                        std::shared_ptr<SurfaceMaterial> material) {
+  TC_ASSERT_INFO(!material->is_emissive(),
+                 "Spheres can not be light sources");
+  sphere_sets.emplace_back();
+  SphereSet &set = sphere_sets.back();
+  set.spheres.reserve(spheres.size());
+  for (auto &sphere : spheres) {
+    set.spheres.push_back(sphere.cast<float32>());
+  }
+  set.material = material;
+}
+
+// Header of scene bundles, followed by a BundleMesh per mesh and the
+// finalized scene data
+struct SceneBundleHeader {
+  uint32 magic;
+  uint32 version;
+  uint32 real_size;
+  uint64 stamp;
+};
+
+constexpr uint32 scene_bundle_magic = 0x42534354;  // "TCSB"
+constexpr uint32 scene_bundle_version = 1;
+
+// What the bundled data of a mesh was computed from
+struct BundleMesh {
+  uint64 hash;
+  int num_triangles;
+  real emission;
+  Matrix4 transform;
+};
+
+// FNV-1a of the untransformed geometry of |mesh|
+static uint64 get_mesh_hash(const Mesh &mesh) {
+  uint64 hash = 14695981039346656037ull;
+  auto mix = [&](const real *values, int n) {
+    for (int i = 0; i < n; i++) {
+      uint64 bits = 0;
+      std::memcpy(&bits, &values[i], sizeof(real));
+      hash ^= bits;
+      hash *= 1099511628211ull;
+    }
+  };
+  for (auto &t : mesh.untransformed_triangles) {
+    for (int k = 0; k < 3; k++) {
+      mix(&t.v[k][0], 3);
     }
-    triangle_count += (int)sub.size();
-    triangles.insert(triangles.end(), sub.begin(), sub.end());
+    mix(&t.n0[0], 3);
+    mix(&t.n10[0], 3);
+    mix(&t.n20[0], 3);
+    mix(&t.uv0[0], 2);
+    mix(&t.uv10[0], 2);
+    mix(&t.uv20[0], 2);
+  }
+  return hash;
+}
+
+void Scene::finalize_geometry() {
+  TC_ASSERT_INFO(meshes.size() <= std::numeric_limits<uint16>::max() + 1u,
+                 "Too many meshes");
+  finalize_meshes();
+  build_light_bvh();
+  finalize_prototypes();
+}
+
+// World-space triangles and buffers of all meshes, transformed in parallel
+void Scene::finalize_meshes() {
+  int num_meshes = (int)meshes.size();
+  std::vector<int> triangle_start(num_meshes + 1, 0);
+  mesh_vertex_start.assign(num_meshes + 1, 0);
+  int num_emissive = 0;
+  for (int m = 0; m < num_meshes; m++) {
+    const Mesh &mesh = meshes[m];
+    int n = (int)mesh.untransformed_triangles.size();
+    triangle_start[m + 1] = triangle_start[m] + n;
+    // Without connectivity, three vertices per triangle
+    mesh_vertex_start[m + 1] =
+        mesh_vertex_start[m] +
+        (mesh.is_indexed() ? (int)mesh.positions.size() : 3 * n);
     if (mesh.emission > 0) {
-      emissive_triangles.insert(emissive_triangles.end(), sub.begin(),
-                                sub.end());
+      num_emissive += n;
+    }
+  }
+  num_triangles = triangle_start[num_meshes];
+  triangle_positions.resize(num_triangles);
+  triangle_shading.resize(num_triangles);
+  triangle_mesh_ids.resize(num_triangles);
+  triangle_thermal.assign(num_triangles, TriangleThermal{0, 0});
+  vertex_buffer.resize(mesh_vertex_start[num_meshes]);
+  index_buffer.resize(3 * num_triangles);
+  emissive_triangles.resize(num_emissive);
+  int first_emissive = 0;
+  for (int m = 0; m < num_meshes; m++) {
+    Mesh &mesh = meshes[m];
+    int start = triangle_start[m];
+    int base = mesh_vertex_start[m];
+    triangle_id_start[&mesh] = start;
+    bool indexed = mesh.is_indexed();
+    Triangle *emissive =
+        mesh.emission > 0 ? &emissive_triangles[first_emissive] : nullptr;
+    Matrix4 normal_transform = transposed(inversed(mesh.transform));
+    ThreadedTaskManager::run(
+        [&](int i) {
+          Triangle tri = mesh.untransformed_triangles[i].get_transformed(
+              mesh.transform, normal_transform);
+          tri.id = start + i;
+          set_triangle(tri);
+          triangle_mesh_ids[start + i] = (uint16)m;
+          int32 *indices = &index_buffer[3 * (start + i)];
+          for (int k = 0; k < 3; k++) {
+            if (indexed) {
+              indices[k] = base + mesh.faces[i].vert_ind[k];
+            } else {
+              indices[k] = base + 3 * i + k;
+              vertex_buffer[indices[k]] =
+                  Vector4(tri.v[k], 0.0_f).cast<float32>();
+            }
+          }
+          if (emissive) {
+            emissive[i] = tri;
+          }
+        },
+        0, triangle_start[m + 1] - start, -1);
+    if (indexed) {
+      ThreadedTaskManager::run(
+          [&](int i) {
+            Vector3 world =
+                multiply_matrix4(mesh.transform, mesh.positions[i], 1.0_f);
+            vertex_buffer[base + i] = Vector4(world, 0.0_f).cast<float32>();
+          },
+          0, (int)mesh.positions.size(), -1);
     }
-    for (auto &tri : sub) {
-      triangle_id_to_mesh[tri.id] = &mesh;
+    if (emissive) {
+      first_emissive += triangle_start[m + 1] - start;
     }
   }
-  num_triangles = triangle_count;
-  printf("Scene loaded. Triangle count: %d\n", triangle_count);
+}
+
+// Levels of detail of a prototype, as cached in Scene::get_lod_file()
+struct LodCacheEntry {
+  uint64 hash;
+  int num_vertices;  // Of the connectivity the levels index
+  int levels;
+  std::vector<MeshLevelOfDetail> lods;
+
+  TC_IO_DEF(hash, num_vertices, levels, lods);
 };
 
+// Vertices of equal positions merged, for the connectivity of a triangle
+// soup
+static void weld_vertices(const std::vector<Triangle> &triangles,
+                          std::vector<Vector3> &positions,
+                          std::vector<int> &indices) {
+  std::map<std::tuple<real, real, real>, int> ids;
+  indices.resize(triangles.size() * 3);
+  for (int i = 0; i < (int)triangles.size(); i++) {
+    for (int k = 0; k < 3; k++) {
+      const Vector3 &v = triangles[i].v[k];
+      auto it = ids.emplace(std::make_tuple(v.x, v.y, v.z),
+                            (int)positions.size());
+      if (it.second) {
+        positions.push_back(v);
+      }
+      indices[i * 3 + k] = it.first->second;
+    }
+  }
+}
+
+void Scene::finalize_prototypes() {
+  int instanced_triangle_count = 0;
+  std::vector<LodCacheEntry> lod_cache;
+  bool lod_cache_loaded = false, lod_cache_changed = false;
+  int num_prototypes = (int)prototypes.size();
+  for (int id = 0; id < num_prototypes; id++) {
+    auto &prototype = prototypes[id];
+    auto &mesh = prototype.mesh;
+    bool indexed = mesh.is_indexed();
+    // Connectivity and hash for the levels of detail, before the geometry
+    // moves
+    std::vector<Vector3> lod_positions;
+    std::vector<int> lod_indices;
+    uint64 hash = 0;
+    if (mesh.lod_levels > 0) {
+      hash = get_mesh_hash(mesh);
+      if (indexed) {
+        lod_positions = mesh.positions;
+        for (auto &face : mesh.faces) {
+          lod_indices.insert(lod_indices.end(), face.vert_ind,
+                             face.vert_ind + 3);
+        }
+      } else {
+        weld_vertices(mesh.untransformed_triangles, lod_positions,
+                      lod_indices);
+      }
+    }
+    // The prototype keeps the only copy of the geometry
+    prototype.triangles = std::move(mesh.untransformed_triangles);
+    for (int i = 0; i < (int)prototype.triangles.size(); i++) {
+      prototype.triangles[i].id = i;
+    }
+    if (indexed) {
+      for (auto &p : mesh.positions) {
+        prototype.vertex_buffer.push_back(Vector4(p, 0.0_f).cast<float32>());
+      }
+      for (auto &face : mesh.faces) {
+        for (int k = 0; k < 3; k++) {
+          prototype.index_buffer.push_back(face.vert_ind[k]);
+        }
+      }
+    } else {
+      for (auto &tri : prototype.triangles) {
+        for (int k = 0; k < 3; k++) {
+          prototype.vertex_buffer.push_back(
+              Vector4(tri.v[k], 0.0_f).cast<float32>());
+          prototype.index_buffer.push_back(
+              (int32)prototype.vertex_buffer.size() - 1);
+        }
+      }
+    }
+    mesh.positions.clear();
+    mesh.faces.clear();
+    instanced_triangle_count += (int)prototype.triangles.size();
+    // Bounding sphere about the center of the bounding box
+    Vector3 lower(std::numeric_limits<real>::infinity());
+    Vector3 upper = -lower;
+    for (auto &tri : prototype.triangles) {
+      for (int k = 0; k < 3; k++) {
+        lower = min(lower, tri.v[k]);
+        upper = max(upper, tri.v[k]);
+      }
+    }
+    prototype.center = 0.5_f * (lower + upper);
+    for (auto &tri : prototype.triangles) {
+      for (int k = 0; k < 3; k++) {
+        prototype.radius =
+            std::max(prototype.radius, length(tri.v[k] - prototype.center));
+      }
+    }
+    if (mesh.lod_levels == 0) {
+      continue;
+    }
+    // Simplified once per geometry, if there is a bundle to cache it with
+    if (!lod_cache_loaded && !bundle_file.empty() &&
+        std::ifstream(get_lod_file()).good()) {
+      read_from_binary_file(lod_cache, get_lod_file());
+    }
+    lod_cache_loaded = true;
+    int levels = mesh.lod_levels;
+    int num_vertices = (int)lod_positions.size();
+    auto it = std::find_if(lod_cache.begin(), lod_cache.end(),
+                           [&](const LodCacheEntry &entry) {
+                             return entry.hash == hash &&
+                                    entry.num_vertices == num_vertices &&
+                                    entry.levels == levels;
+                           });
+    if (it == lod_cache.end()) {
+      lod_cache.push_back(
+          LodCacheEntry{hash, num_vertices, levels,
+                        simplify_mesh(lod_positions, lod_indices, levels)});
+      lod_cache_changed = true;
+      it = lod_cache.end() - 1;
+    }
+    add_levels_of_detail(id, lod_positions, lod_indices, it->lods);
+  }
+  if (lod_cache_changed && !bundle_file.empty()) {
+    write_to_binary_file(lod_cache, get_lod_file());
+  }
+  printf("Scene loaded. Triangle count: %d\n", num_triangles);
+  if (!instances.empty()) {
+    TC_TRACE("Instances: {}, unique instanced triangles: {}",
+             instances.size(), instanced_triangle_count);
+  }
+}
+
+void Scene::add_levels_of_detail(int p,
+                                 const std::vector<Vector3> &positions,
+                                 const std::vector<int> &indices,
+                                 const std::vector<MeshLevelOfDetail> &lods) {
+  // Shading attributes per vertex: the average normal and the first
+  // texture coordinates of its corners, as seams are not kept apart
+  int num_vertices = (int)positions.size();
+  std::vector<Vector3> normals(num_vertices);
+  std::vector<Vector2> uvs(num_vertices);
+  std::vector<bool> has_uv(num_vertices, false);
+  const std::vector<Triangle> &triangles = prototypes[p].triangles;
+  for (int i = 0; i < (int)triangles.size(); i++) {
+    const Triangle &t = triangles[i];
+    Vector3 corner_normals[3] = {t.n0, t.n0 + t.n10, t.n0 + t.n20};
+    Vector2 corner_uvs[3] = {t.uv0, t.uv0 + t.uv10, t.uv0 + t.uv20};
+    for (int k = 0; k < 3; k++) {
+      int v = indices[i * 3 + k];
+      normals[v] += corner_normals[k];
+      if (!has_uv[v]) {
+        uvs[v] = corner_uvs[k];
+        has_uv[v] = true;
+      }
+    }
+  }
+  for (auto &n : normals) {
+    real len = length(n);
+    if (len > 0) {
+      n = n / len;
+    }
+  }
+  for (auto &lod : lods) {
+    MeshPrototype level;
+    level.mesh = prototypes[p].mesh;
+    level.mesh.lod_levels = 0;
+    level.center = prototypes[p].center;
+    level.radius = prototypes[p].radius;
+    // Only the vertices still in use, renumbered
+    std::vector<int> ids(num_vertices, -1);
+    int n = (int)lod.indices.size() / 3;
+    for (int i = 0; i < n; i++) {
+      const int *v = &lod.indices[i * 3];
+      for (int k = 0; k < 3; k++) {
+        if (ids[v[k]] == -1) {
+          ids[v[k]] = (int)level.vertex_buffer.size();
+          level.vertex_buffer.push_back(
+              Vector4(positions[v[k]], 0.0_f).cast<float32>());
+        }
+        level.index_buffer.push_back(ids[v[k]]);
+      }
+      level.triangles.push_back(
+          Triangle(positions[v[0]], positions[v[1]], positions[v[2]],
+                   normals[v[0]], normals[v[1]], normals[v[2]], uvs[v[0]],
+                   uvs[v[1]], uvs[v[2]], i));
+    }
+    prototypes[p].lods.push_back((int)prototypes.size());
+    prototypes[p].lod_errors.push_back(lod.error);
+    prototypes.push_back(std::move(level));
+  }
+}
+
+// Per instance, the coarsest level whose error, at the distance of the
+// nearest point of its bounding sphere, covers at most lod_error pixels
+void Scene::select_levels_of_detail() {
+  bool has_lods = false;
+  for (auto &prototype : prototypes) {
+    has_lods = has_lods || !prototype.lods.empty();
+  }
+  if (!has_lods) {
+    return;
+  }
+  Vector3 eye = camera ? camera->get_origin() : Vector3(0);
+  real footprint = camera ? camera->get_pixel_footprint() : 0;
+  int simplified = 0;
+  for (auto &instance : instances) {
+    const MeshPrototype &base = prototypes[instance.base];
+    instance.prototype = instance.base;
+    real scale = 0;
+    for (int k = 0; k < 3; k++) {
+      Vector3 axis(0);
+      axis[k] = 1;
+      scale = std::max(scale,
+                       length(multiply_matrix4(instance.transform, axis, 0)));
+    }
+    Vector3 center = multiply_matrix4(instance.transform, base.center, 1);
+    real distance = length(center - eye) - base.radius * scale;
+    real tolerance = base.mesh.lod_error * footprint * distance;
+    for (int l = 0; l < (int)base.lods.size(); l++) {
+      if (distance <= 0 || base.lod_errors[l] * scale > tolerance) {
+        break;
+      }
+      instance.prototype = base.lods[l];
+    }
+    simplified += instance.prototype != instance.base;
+  }
+  TC_TRACE("Instances with simplified geometry: {}", simplified);
+  // Acceleration structures of the bundle depend on the levels
+  if (bundle_stamp != 0) {
+    for (auto &instance : instances) {
+      bundle_stamp ^= (uint64)instance.prototype;
+      bundle_stamp *= 1099511628211ull;
+    }
+  }
+}
+
+void Scene::update_emission_cdf() {
+  std::vector<real> emissions(num_triangles);
+  ThreadedTaskManager::run(
+      [&](int i) {
+        emissions[i] = get_triangle_area(i) *
+                       pow(triangle_thermal[i].temperature, 4.0_f);
+      },
+      0, num_triangles, -1);
+  total_emission = (real)ThreadedTaskManager::reduce(
+      0, num_triangles, -1, 0.0,
+      [&](int begin, int end) {
+        float64 sum = 0;
+        for (int i = begin; i < end; i++) {
+          sum += emissions[i];
+        }
+        return sum;
+      },
+      [](float64 a, float64 b) { return a + b; });
+  emission_sampler.initialize(emissions, true);
+}
+
+bool Scene::read_bundle() {
+  MappedFile file(bundle_file);
+  std::size_t size = 0;
+  if (file.data() == nullptr || file.size() < sizeof(size)) {
+    return false;
+  }
+  // The serializer records the size of what it wrote first
+  std::memcpy(&size, file.data(), sizeof(size));
+  if (size != file.size()) {
+    return false;
+  }
+  BinaryInputSerializer reader;
+  reader.initialize((void *)file.data());
+  SceneBundleHeader header;
+  reader(header);
+  if (header.magic != scene_bundle_magic ||
+      header.version != scene_bundle_version ||
+      header.real_size != sizeof(real)) {
+    return false;
+  }
+  std::vector<BundleMesh> bundled;
+  reader(bundled);
+  if (bundled.size() != meshes.size()) {
+    return false;
+  }
+  std::vector<uint8> matches(meshes.size());
+  ThreadedTaskManager::run(
+      [&](int m) {
+        const Mesh &mesh = meshes[m];
+        const BundleMesh &b = bundled[m];
+        int n = (int)mesh.untransformed_triangles.size();
+        // Meshes without geometry take that of the bundle
+        matches[m] = b.emission == mesh.emission &&
+                     b.transform == mesh.transform &&
+                     (n == 0 || (n == b.num_triangles &&
+                                 b.hash == get_mesh_hash(mesh)));
+      },
+      0, (int)meshes.size(), -1);
+  for (auto match : matches) {
+    if (!match) {
+      return false;
+    }
+  }
+  std::vector<int> triangle_start;
+  std::vector<int> emissive_ids;
+  reader(nullptr, num_triangles, triangle_positions, triangle_shading,
+         triangle_mesh_ids, vertex_buffer, index_buffer, mesh_vertex_start,
+         triangle_start, emissive_ids, light_bvh, emission_sampler,
+         light_emission_sampler, total_emission, light_total_emission,
+         light_total_area);
+  reader.finalize();
+  for (int m = 0; m < (int)meshes.size(); m++) {
+    triangle_id_start[&meshes[m]] = triangle_start[m];
+  }
+  triangle_thermal.assign(num_triangles, TriangleThermal{0, 0});
+  emissive_triangles.clear();
+  emissive_triangle_index.clear();
+  for (int id : emissive_ids) {
+    emissive_triangle_index[id] = (int)emissive_triangles.size();
+    emissive_triangles.push_back(get_triangle(id));
+  }
+  bundle_stamp = header.stamp;
+  return true;
+}
+
+void Scene::write_bundle() {
+  SceneBundleHeader header;
+  std::memset(&header, 0, sizeof(header));
+  header.magic = scene_bundle_magic;
+  header.version = scene_bundle_version;
+  header.real_size = sizeof(real);
+  header.stamp =
+      (uint64)std::chrono::system_clock::now().time_since_epoch().count() ^
+      ((uint64)num_triangles << 40);
+  std::vector<BundleMesh> bundled(meshes.size());
+  std::vector<int> triangle_start(meshes.size());
+  ThreadedTaskManager::run(
+      [&](int m) {
+        const Mesh &mesh = meshes[m];
+        BundleMesh &b = bundled[m];
+        b.hash = get_mesh_hash(mesh);
+        b.num_triangles = (int)mesh.untransformed_triangles.size();
+        b.emission = mesh.emission;
+        b.transform = mesh.transform;
+        triangle_start[m] = triangle_id_start[&mesh];
+      },
+      0, (int)meshes.size(), -1);
+  std::vector<int> emissive_ids;
+  for (auto &tri : emissive_triangles) {
+    emissive_ids.push_back(tri.id);
+  }
+  BinaryOutputSerializer writer;
+  writer.initialize();
+  writer(nullptr, header, bundled, num_triangles, triangle_positions,
+         triangle_shading, triangle_mesh_ids, vertex_buffer, index_buffer,
+         mesh_vertex_start, triangle_start, emissive_ids, light_bvh,
+         emission_sampler, light_emission_sampler, total_emission,
+         light_total_emission, light_total_area);
+  writer.finalize();
+  writer.write_to_file(bundle_file);
+  bundle_stamp = header.stamp;
+}
+
+void Scene::set_mesh_transform(int mesh_index, const Matrix4 &transform) {
+  TC_ASSERT_INFO(0 <= mesh_index && mesh_index < (int)meshes.size(),
+                 "Mesh index out of range");
+  Mesh &mesh = meshes[mesh_index];
+  int count = mesh_index + 1 < (int)meshes.size()
+                  ? triangle_id_start[&meshes[mesh_index + 1]]
+                  : num_triangles;
+  count -= triangle_id_start[&mesh];
+  TC_ERROR_IF((int)mesh.untransformed_triangles.size() != count,
+              "Mesh {} has its geometry only in the scene bundle, and can "
+              "not be moved",
+              mesh_index);
+  mesh.transform = transform;
+  bundle_stamp = 0;
+  int start = triangle_id_start[&mesh];
+  // Meshes are moved every frame of an animation
+  static thread_local std::vector<Triangle> sub;
+  mesh.get_triangles(sub);
+  for (int i = 0; i < (int)sub.size(); i++) {
+    sub[i].id = start + i;
+    set_triangle(sub[i]);
+  }
+  int base = mesh_vertex_start[mesh_index];
+  if (mesh.is_indexed()) {
+    for (int i = 0; i < (int)mesh.positions.size(); i++) {
+      Vector3 world = multiply_matrix4(transform, mesh.positions[i], 1.0_f);
+      vertex_buffer[base + i] = Vector4(world, 0.0_f).cast<float32>();
+    }
+  } else {
+    for (int i = 0; i < (int)sub.size(); i++) {
+      for (int k = 0; k < 3; k++) {
+        vertex_buffer[base + i * 3 + k] =
+            Vector4(sub[i].v[k], 0.0_f).cast<float32>();
+      }
+    }
+  }
+  if (mesh.emission > 0) {
+    // Emissive triangles are copies; gather them again in mesh order
+    emissive_triangles.clear();
+    for (int i = 0; i < num_triangles; i++) {
+      if (get_mesh_from_triangle_id(i)->emission > 0) {
+        emissive_triangles.push_back(get_triangle(i));
+      }
+    }
+    update_light_emission_cdf();
+    build_light_bvh();
+  }
+  dirty_meshes.insert(mesh_index);
+}
+
+void Scene::set_instance_transform(int instance, const Matrix4 &transform) {
+  TC_ASSERT_INFO(0 <= instance && instance < (int)instances.size(),
+                 "Instance index out of range");
+  MeshInstance &inst = instances[instance];
+  bundle_stamp = 0;
+  inst.transform = transform * prototypes[inst.prototype].mesh.transform;
+  inst.normal_transform = transposed(inversed(inst.transform));
+  dirty_instances.insert(instance);
+}
+
+void Scene::build_light_bvh() {
+  std::vector<real> powers;
+  emissive_triangle_index.clear();
+  for (int i = 0; i < (int)emissive_triangles.size(); i++) {
+    const Triangle &tri = emissive_triangles[i];
+    powers.push_back(tri.area * get_mesh_from_triangle_id(tri.id)->emission);
+    emissive_triangle_index[tri.id] = i;
+  }
+  light_bvh.build(emissive_triangles, powers);
+}
+
 void Scene::finalize_lighting() {
   if (!emissive_triangles.empty()) {
     update_emission_cdf();
@@ -180,8 +800,20 @@ void Scene::finalize_lighting() {
 }
 
 void Scene::finalize() {
+  if (!bundle_file.empty() && read_bundle()) {
+    finalize_prototypes();
+    if (emissive_triangles.empty()) {
+      finalize_lighting();
+    }
+    select_levels_of_detail();
+    return;
+  }
   finalize_geometry();
   finalize_lighting();
+  if (!bundle_file.empty()) {
+    write_bundle();
+  }
+  select_levels_of_detail();
 }
 
 TC_NAMESPACE_END
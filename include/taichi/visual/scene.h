@@ -10,11 +10,14 @@
 #include <taichi/visual/surface_material.h>
 #include <taichi/visual/envmap.h>
 #include <taichi/visual/volume_material.h>
+#include <taichi/visual/light_bvh.h>
 #include <taichi/physics/physics_constants.h>
 #include <taichi/physics/spectrum.h>
 #include <taichi/math/discrete_sampler.h>
 
 #include <map>
+#include <unordered_map>
+#include <set>
 #include <deque>
 
 TC_NAMESPACE_BEGIN
@@ -24,6 +27,9 @@ struct Photon {
   real energy;
 };
 
+struct MeshData;
+struct MeshLevelOfDetail;
+
 // TODO: Rename Mesh -> Object, and use Mesh for purely geoemtric mesh (without
 // material)
 class Mesh {
@@ -33,11 +39,23 @@ class Mesh {
 
   void initialize(const Config &config);
   void set_material(std::shared_ptr<SurfaceMaterial> material);
+  // OBJ or PLY; parsed files are cached next to them unless |cache| is false
   void load_from_file(const std::string &file_path,
-                      bool reverse_vertices = false);
+                      bool reverse_vertices = false,
+                      bool cache = true);
+  // The same for geometry read or built elsewhere, e.g. from numpy arrays
+  void load_mesh_data(const MeshData &data, bool reverse_vertices = false);
   std::vector<Triangle> untransformed_triangles;
   void set_untransformed_triangles(const std::vector<Triangle> &triangles) {
     untransformed_triangles = triangles;
+    // Connectivity is unknown for triangle soups
+    positions.clear();
+    faces.clear();
+  }
+  // True if |faces| index |positions| for every untransformed triangle, so
+  // that vertices can be shared in the scene's vertex buffer.
+  bool is_indexed() const {
+    return !positions.empty() && faces.size() == untransformed_triangles.size();
   }
   // bounding box
   BoundingBox get_bounding_box() {
@@ -61,10 +79,17 @@ class Mesh {
   }
   std::vector<Triangle> get_triangles() {
     std::vector<Triangle> triangles;
-    for (auto t : untransformed_triangles) {
-      triangles.push_back(t.get_transformed(transform));
-    }
+    get_triangles(triangles);
     return triangles;
+  }
+  // Same, overwriting |triangles|, which keeps its capacity
+  void get_triangles(std::vector<Triangle> &triangles) {
+    triangles.clear();
+    triangles.reserve(untransformed_triangles.size());
+    Matrix4 normal_transform = transposed(inversed(transform));
+    for (auto &t : untransformed_triangles) {
+      triangles.push_back(t.get_transformed(transform, normal_transform));
+    }
     /*
     vector<Triangle> triangles;
     for (auto face : faces) {
@@ -101,10 +126,9 @@ class Mesh {
   }
 
   bool need_voxelization;
-  std::vector<Vector3> vertices;
-  std::vector<Vector3> normals;
-  std::vector<Vector2> uvs;
   real initial_temperature;
+  // Unique (untransformed) vertex positions, indexed by |faces|
+  std::vector<Vector3> positions;
   std::vector<Face> faces;
   Matrix4 transform;
   real emission;
@@ -113,11 +137,15 @@ class Mesh {
   real sub_div_limit;
   Vector3 emission_color;
   std::shared_ptr<SurfaceMaterial> material;
+  // Levels of detail of instances, see Scene::add_instance
+  int lod_levels = 0;
+  real lod_error = 1;  // Pixels
 };
 
 struct IntersectionInfo {
   IntersectionInfo() {
     triangle_id = -1;
+    instance_id = -1;
     intersected = false;
   }
 
@@ -133,6 +161,46 @@ struct IntersectionInfo {
   Matrix3 to_world;
   real dist;
   int triangle_id;
+  // See Ray::instance_id. Instance hits always set |material|.
+  int instance_id;
+};
+
+// Scene triangles are stored split by access pattern: positions for
+// sampling and intersection, and shading attributes, read only for hits.
+struct TrianglePositions {
+  Vector3 v0, v10, v20;
+};
+
+struct TriangleShading {
+  Vector3 n0, n10, n20;
+  Vector2 uv0, uv10, uv20;
+};
+
+// Object-space geometry shared by all instances of a mesh
+struct MeshPrototype {
+  Mesh mesh;
+  std::vector<Triangle> triangles;  // Ids are local to the prototype
+  std::vector<Vector4f> vertex_buffer;
+  std::vector<int32> index_buffer;
+  // Of the full geometry: the prototypes of its coarser levels of detail,
+  // and their errors (object space), finest first
+  std::vector<int> lods;
+  std::vector<real> lod_errors;
+  // Object-space bounding sphere
+  Vector3 center;
+  real radius = 0;
+};
+
+struct MeshInstance {
+  int base;       // The prototype of the full geometry
+  int prototype;  // The level of detail in use: |base| or one of its lods
+  Matrix4 transform, normal_transform;
+};
+
+// Analytic spheres sharing a material, see Scene::add_spheres
+struct SphereSet {
+  std::vector<Vector4f> spheres;  // Center and radius
+  std::shared_ptr<SurfaceMaterial> material;
 };
 
 class Scene {
@@ -161,8 +229,57 @@ class Scene {
 
   void add_mesh(std::shared_ptr<Mesh> mesh);
 
+  // Places |mesh| with world transform |transform| * mesh->transform. All
+  // instances of the same Mesh object share one copy of its geometry.
+  // Instanced meshes can not be light sources. With mesh->lod_levels > 0,
+  // finalize() also builds that many coarser versions of the geometry, each
+  // with half the triangles of the previous one, and gives each instance the
+  // coarsest whose error from the camera is within mesh->lod_error pixels.
+  // Levels are chosen once, by finalize(), so that all the stages of a
+  // render see the same geometry.
+  void add_instance(std::shared_ptr<Mesh> mesh, const Matrix4 &transform);
+
+  // Spheres (center, radius), e.g. simulation particles, intersected
+  // analytically at 16 bytes each instead of being tessellated. They can not
+  // be light sources. Hits on set k report instance id instances.size() + k
+  // and the index of the sphere as triangle id.
+  void add_spheres(const std::vector<Vector4> &spheres,
+                   std::shared_ptr<SurfaceMaterial> material);
+
   void finalize_geometry();
 
+  // Scene bundles. With a bundle file set before finalize(), the finalized
+  // geometry and light sampling data are read from the (memory-mapped)
+  // bundle instead of being computed, if it was written for meshes of the
+  // same geometry, transforms and emission; otherwise they are computed
+  // and the bundle is rewritten. Meshes may then be added without geometry
+  // (no "filename"), in the order of the bundle, but can not be moved.
+  // Ray intersection backends that can also keep their acceleration
+  // structure, in get_structure_file(). |fn| ends with ".tcb".
+  void set_bundle(const std::string &fn) {
+    TC_ERROR_IF(!ends_with(fn, ".tcb"),
+                "Scene bundles must end with .tcb. [Filename = {}]", fn);
+    bundle_file = fn;
+  }
+
+  // "scene.accel.tcb" for bundle "scene.tcb"
+  std::string get_structure_file() const {
+    return bundle_file.substr(0, bundle_file.size() - 4) + ".accel.tcb";
+  }
+
+  // "scene.lod.tcb", the levels of detail of instanced meshes, by geometry
+  std::string get_lod_file() const {
+    return bundle_file.substr(0, bundle_file.size() - 4) + ".lod.tcb";
+  }
+
+  // Animation. After finalize(), moves mesh |mesh_index| (in add_mesh order)
+  // or instance |instance| to a new world transform. The world-space
+  // geometry is updated immediately; ray intersection picks the change up
+  // on the next SceneGeometry::update(). Topology never changes.
+  void set_mesh_transform(int mesh_index, const Matrix4 &transform);
+
+  void set_instance_transform(int instance, const Matrix4 &transform);
+
   void finalize_lighting();
 
   void finalize();
@@ -180,38 +297,40 @@ class Scene {
     light_emission_sampler.initialize(emissions);
   }
 
+  // Builds |light_bvh| over |emissive_triangles|
+  void build_light_bvh();
+
   real get_average_emission() const {
     return light_total_emission / light_total_area;
   }
 
-  void update_emission_cdf() {
-    emission_cdf.clear();
-    total_emission = 0;
-    for (auto tri : triangles) {
-      real e = tri.area * pow(tri.temperature, 4.0_f);
-      emission_cdf.push_back(e);
-      total_emission += e;
-    }
-    real inv_tot = 1.0_f / total_emission;
-    for (int i = 0; i < (int)emission_cdf.size() - 1; i++) {
-      emission_cdf[i + 1] += emission_cdf[i];
-    }
-    emission_cdf.push_back(1);
-    for (auto &e : emission_cdf) {
-      e *= inv_tot;
-    }
+  void update_emission_cdf();
+
+  // Assembles the full triangle from the split storage
+  Triangle get_triangle(int id) const {
+    const TrianglePositions &p = triangle_positions[id];
+    const TriangleShading &s = triangle_shading[id];
+    return Triangle(p.v0, p.v0 + p.v10, p.v0 + p.v20, s.n0, s.n0 + s.n10,
+                    s.n0 + s.n20, s.uv0, s.uv0 + s.uv10, s.uv0 + s.uv20, id);
   }
 
-  std::vector<Triangle> &get_triangles() {
-    return triangles;
+  real get_triangle_area(int id) const {
+    const TrianglePositions &p = triangle_positions[id];
+    return 0.5_f * length(cross(p.v10, p.v20));
   }
 
-  Triangle get_triangle(int id) const {
-    return triangles[id];
+  // Overwrites triangle |t.id|
+  void set_triangle(const Triangle &t) {
+    triangle_positions[t.id] = TrianglePositions{t.v[0], t.v10, t.v20};
+    triangle_shading[t.id] =
+        TriangleShading{t.n0, t.n10, t.n20, t.uv0, t.uv10, t.uv20};
   }
 
   IntersectionInfo get_intersection_info(int triangle_id, Ray &ray);
 
+  // Hit info from a triangle already in world space
+  IntersectionInfo get_intersection_info(const Triangle &t, Ray &ray) const;
+
   const Triangle &sample_triangle_light_emission(real r, real &pdf) const {
     int e_tid = light_emission_sampler.sample(r, pdf);
     return emissive_triangles[e_tid];
@@ -236,8 +355,36 @@ class Scene {
     }
   }
 
+  // As above, but lights are picked through |light_bvh| in proportion to
+  // their (bounded) contribution at |pos|, not just their power.
+  void sample_light_source(real r,
+                           const Vector3 &pos,
+                           real &pdf,
+                           const Triangle *&triangle,
+                           const EnvironmentMap *&envmap) const {
+    if (r < envmap_sample_prob) {
+      triangle = nullptr;
+      envmap = this->envmap.get();
+      pdf = envmap_sample_prob;
+    } else {
+      real scale = 1 - envmap_sample_prob;
+      real r_light = std::min((r - envmap_sample_prob) / scale, 1 - 1e-7_f);
+      triangle = &emissive_triangles[light_bvh.sample(r_light, pos, pdf)];
+      envmap = nullptr;
+      pdf *= scale;
+    }
+  }
+
+  real get_triangle_pdf(int id, const Vector3 &pos) const {
+    auto it = emissive_triangle_index.find(id);
+    if (it == emissive_triangle_index.end()) {
+      return 0;
+    }
+    return (1 - envmap_sample_prob) * light_bvh.pdf(it->second, pos);
+  }
+
   real get_triangle_pdf(int id) const {
-    return (1 - envmap_sample_prob) * triangles[id].area *
+    return (1 - envmap_sample_prob) * get_triangle_area(id) *
            get_mesh_from_triangle_id(id)->emission / light_total_emission;
   }
 
@@ -246,28 +393,26 @@ class Scene {
   }
 
   void sample_photon(Photon &p, real r, real delta_t, real weight) {
-    int tid = std::min(
-        int(std::lower_bound(emission_cdf.begin(), emission_cdf.end(), r) -
-            emission_cdf.begin()),
-        (int)triangles.size() - 1);
-    Triangle &t = triangles[tid];
-    Mesh *mesh = triangle_id_to_mesh[tid];
+    int tid = emission_sampler.sample(r);
+    Triangle t = get_triangle(tid);
+    TriangleThermal &thermal = triangle_thermal[tid];
+    const Mesh *mesh = get_mesh_from_triangle_id(tid);
     weight = t.area / total_triangle_area;
     p.dir = random_diffuse(t.normal);
     p.pos = t.sample_point();
     p.energy = weight * total_emission * delta_t * stefan_boltzmann_constant;
     if (!mesh->const_temp) {
-      t.temperature -= p.energy / t.heat_capacity;
-      t.temperature = std::max(t.temperature, 0.0_f);
+      thermal.temperature -= p.energy / thermal.heat_capacity;
+      thermal.temperature = std::max(thermal.temperature, 0.0_f);
     }
   }
 
   void recieve_photon(int triangle_id, real energy) {
     int tid = triangle_id;
-    Triangle &t = triangles[tid];
-    Mesh *mesh = triangle_id_to_mesh[tid];
+    TriangleThermal &thermal = triangle_thermal[tid];
+    const Mesh *mesh = get_mesh_from_triangle_id(tid);
     if (!mesh->const_temp)
-      t.temperature += energy / t.heat_capacity;
+      thermal.temperature += energy / thermal.heat_capacity;
   }
 
   real get_temperature(int triangle_id, real u, real v) {
@@ -288,19 +433,19 @@ class Scene {
 
   Vector3 get_coord(int triangle_id, real u, real v) const {
     real cooef[3]{1 - u - v, u, v};
-    Mesh *mesh = triangle_id_to_mesh.find(triangle_id)->second;
+    const Mesh *mesh = get_mesh_from_triangle_id(triangle_id);
     Vector3 temp(0);
     for (int i = 0; i < 3; i++) {
       int vertice_index =
           mesh->faces[triangle_id - triangle_id_start.find(mesh)->second]
               .vert_ind[i];
-      temp += mesh->vertices[vertice_index] * cooef[i];
+      temp += mesh->positions[vertice_index] * cooef[i];
     }
     return temp;
   }
 
-  Mesh *get_mesh_from_triangle_id(int triangle_id) const {
-    return triangle_id_to_mesh.find(triangle_id)->second;
+  const Mesh *get_mesh_from_triangle_id(int triangle_id) const {
+    return &meshes[triangle_mesh_ids[triangle_id]];
   }
 
   real get_triangle_emission(int triangle_id) const {
@@ -309,15 +454,38 @@ class Scene {
 
   DiscreteSampler light_emission_sampler;
   std::shared_ptr<Camera> camera;
-  std::vector<Triangle> triangles;
+  std::vector<TrianglePositions> triangle_positions;
+  std::vector<TriangleShading> triangle_shading;
+  // Index into |meshes|, which holds the material
+  std::vector<uint16> triangle_mesh_ids;
+  struct TriangleThermal {
+    real temperature, heat_capacity;
+  };
+  std::vector<TriangleThermal> triangle_thermal;
+  // Indexed world-space geometry built by finalize_geometry: triangle i uses
+  // vertices index_buffer[3i .. 3i + 2]. Ray intersection backends may
+  // reference these buffers directly instead of copying triangles.
+  std::vector<Vector4f> vertex_buffer;
+  std::vector<int32> index_buffer;
+  std::vector<MeshPrototype> prototypes;
+  std::vector<MeshInstance> instances;
+  std::map<const Mesh *, int> prototype_ids;
+  std::vector<SphereSet> sphere_sets;
+  // First vertex of each mesh in |vertex_buffer|, plus the total at the end
+  std::vector<int> mesh_vertex_start;
+  // Moved since the last SceneGeometry::update()
+  std::set<int> dirty_meshes, dirty_instances;
   std::vector<Triangle> emissive_triangles;
-  std::vector<real> emission_cdf;
+  // Triangle id to index in |emissive_triangles|
+  std::unordered_map<int, int> emissive_triangle_index;
+  LightBVH light_bvh;
+  // Thermal emission, see sample_photon
+  DiscreteSampler emission_sampler;
   real total_emission;
   real light_total_emission;
   real light_total_area;
   std::vector<Mesh> meshes;
-  std::map<int, Mesh *> triangle_id_to_mesh;
-  std::map<Mesh *, int> triangle_id_start;
+  std::map<const Mesh *, int> triangle_id_start;
   int num_triangles;
   real sub_divide_limit;
   real total_triangle_area;
@@ -325,6 +493,30 @@ class Scene {
   std::shared_ptr<VolumeMaterial> atmosphere_material;
   std::shared_ptr<EnvironmentMap> envmap;
   real envmap_sample_prob;
+  std::string bundle_file;
+  // Identifies the contents of the bundle; 0 if there is none, or the scene
+  // has changed since it was read or written
+  uint64 bundle_stamp = 0;
+
+ private:
+  IntersectionInfo get_sphere_intersection_info(const Ray &ray) const;
+
+  void finalize_meshes();
+
+  void finalize_prototypes();
+
+  // Appends the levels of detail of prototype |p|, of |positions| and
+  // |indices| (three per triangle) with |lods|
+  void add_levels_of_detail(int p,
+                            const std::vector<Vector3> &positions,
+                            const std::vector<int> &indices,
+                            const std::vector<MeshLevelOfDetail> &lods);
+
+  void select_levels_of_detail();
+
+  bool read_bundle();
+
+  void write_bundle();
 };
 
 TC_NAMESPACE_END
@@ -5,29 +5,62 @@
 
 #pragma once
 
+#include <taichi/system/statistics.h>
 #include "ray_intersection.h"
 #include "scene.h"
 
 TC_NAMESPACE_BEGIN
 
-// Generates Intersection Information for scene using ray_intersection
+// Generates Intersection Information for scene using ray_intersection.
+// Counts the "rays" and the "shadow_rays" (occlusion queries) in Statistics.
 class SceneGeometry {
  public:
   SceneGeometry(std::shared_ptr<Scene> scene,
                 std::shared_ptr<RayIntersection> ray_intersection) {
     this->scene = scene;
     this->ray_intersection = ray_intersection;
-    for (auto &tri : scene->get_triangles()) {
-      ray_intersection->add_triangle(tri);
-    }
-    rebuild();
+    load();
   }
 
   void rebuild() {
     ray_intersection->build();
   }
 
+  // Applies the mesh and instance moves recorded by the scene since the
+  // last update, refitting in place when the backend supports it and
+  // rebuilding everything otherwise.
+  void update() {
+    if (scene->dirty_meshes.empty() && scene->dirty_instances.empty()) {
+      return;
+    }
+    bool updated = true;
+    for (int mesh_index : scene->dirty_meshes) {
+      const Mesh &mesh = scene->meshes[mesh_index];
+      int begin = scene->triangle_id_start[&mesh];
+      std::vector<Triangle> triangles;
+      for (int i = 0; i < (int)mesh.untransformed_triangles.size(); i++) {
+        triangles.push_back(scene->get_triangle(begin + i));
+      }
+      updated =
+          updated && ray_intersection->update_triangles(begin, triangles);
+    }
+    for (int instance : scene->dirty_instances) {
+      updated = updated &&
+                ray_intersection->update_instance(
+                    instance, scene->instances[instance].transform);
+    }
+    scene->dirty_meshes.clear();
+    scene->dirty_instances.clear();
+    if (updated) {
+      ray_intersection->commit_updates();
+    } else {
+      ray_intersection->clear();
+      load();
+    }
+  }
+
   int query_hit_triangle_id(Ray &ray) {
+    TC_STAT("rays", 1);
     ray_intersection->query(ray);
     return ray.triangle_id;
   }
@@ -37,12 +70,72 @@ class SceneGeometry {
     return scene->get_intersection_info(tri_id, ray);
   }
 
-  IntersectionInfo occlude(Ray &ray) {
-    int tri_id = query_hit_triangle_id(ray);
-    return scene->get_intersection_info(tri_id, ray);
+  void query_batch(Ray *rays, int n, IntersectionInfo *infos) {
+    TC_STAT("rays", n);
+    ray_intersection->query_batch(rays, n);
+    for (int i = 0; i < n; i++) {
+      infos[i] = scene->get_intersection_info(rays[i].triangle_id, rays[i]);
+    }
+  }
+
+  void occlude_batch(Ray *rays, int n, bool *occluded) {
+    TC_STAT("shadow_rays", n);
+    ray_intersection->occlude_batch(rays, n, occluded);
+  }
+
+  // Visibility only: no hit info is constructed.
+  bool occlude(Ray &ray) {
+    TC_STAT("shadow_rays", 1);
+    return ray_intersection->occlude(ray);
+  }
+
+  // Visibility through the surfaces |filter| lets pass, by returning false
+  // for their hit info. See RayIntersection::occlude_filtered.
+  bool occlude_filtered(
+      Ray &ray,
+      const std::function<bool(const IntersectionInfo &)> &filter) {
+    TC_STAT("shadow_rays", 1);
+    return ray_intersection->occlude_filtered(ray, [&](const Ray &hit) {
+      Ray copy = hit;
+      return filter(scene->get_intersection_info(hit.triangle_id, copy));
+    });
   }
 
  private:
+  void load() {
+    bool shared = ray_intersection->set_shared_buffers(
+        scene->vertex_buffer.data(), (int)scene->vertex_buffer.size(),
+        scene->index_buffer.data(), (int)scene->index_buffer.size() / 3);
+    if (!shared) {
+      for (int i = 0; i < scene->num_triangles; i++) {
+        Triangle tri = scene->get_triangle(i);
+        ray_intersection->add_triangle(tri);
+      }
+    }
+    for (auto &prototype : scene->prototypes) {
+      ray_intersection->add_prototype(prototype.triangles,
+                                      prototype.vertex_buffer,
+                                      prototype.index_buffer);
+    }
+    for (auto &instance : scene->instances) {
+      ray_intersection->add_instance(instance.prototype, instance.transform);
+    }
+    // Sphere sets take the ids after the instances
+    for (int i = 0; i < (int)scene->sphere_sets.size(); i++) {
+      ray_intersection->add_spheres(scene->sphere_sets[i].spheres,
+                                    (int)scene->instances.size() + i);
+    }
+    if (scene->bundle_stamp == 0) {
+      rebuild();
+      return;
+    }
+    std::string fn = scene->get_structure_file();
+    if (!ray_intersection->read_structure(fn, scene->bundle_stamp)) {
+      rebuild();
+      ray_intersection->write_structure(fn, scene->bundle_stamp);
+    }
+  }
+
   std::shared_ptr<Scene> scene;
   std::shared_ptr<RayIntersection> ray_intersection;
 };
@@ -43,6 +43,63 @@ class SurfaceEventClassifier {
   }
 };
 
+// Shading inputs and outputs of a batch of hits on one material, stored as
+// structure of arrays so that per-material kernels vectorize over lanes.
+// Directions are in the local shading frame, as in the scalar interface.
+struct SurfaceBatch {
+  int size = 0;
+  std::vector<real> in_x, in_y, in_z;
+  // Output of sample_batch, input of evaluate_batch and
+  // probability_density_batch
+  std::vector<real> out_x, out_y, out_z;
+  std::vector<real> uv_x, uv_y;
+  // Random numbers of sample_batch
+  std::vector<real> u, v;
+  std::vector<real> f_x, f_y, f_z, pdf;
+  std::vector<SurfaceEvent> event;
+
+  void resize(int n) {
+    size = n;
+    for (auto *c : {&in_x, &in_y, &in_z, &out_x, &out_y, &out_z, &uv_x, &uv_y,
+                    &u, &v, &f_x, &f_y, &f_z, &pdf}) {
+      c->resize(n);
+    }
+    event.resize(n);
+  }
+
+  Vector3 get_in(int i) const {
+    return Vector3(in_x[i], in_y[i], in_z[i]);
+  }
+
+  Vector3 get_out(int i) const {
+    return Vector3(out_x[i], out_y[i], out_z[i]);
+  }
+
+  Vector2 get_uv(int i) const {
+    return Vector2(uv_x[i], uv_y[i]);
+  }
+
+  Vector3 get_f(int i) const {
+    return Vector3(f_x[i], f_y[i], f_z[i]);
+  }
+
+  void set_in(int i, const Vector3 &d) {
+    in_x[i] = d.x, in_y[i] = d.y, in_z[i] = d.z;
+  }
+
+  void set_out(int i, const Vector3 &d) {
+    out_x[i] = d.x, out_y[i] = d.y, out_z[i] = d.z;
+  }
+
+  void set_uv(int i, const Vector2 &uv) {
+    uv_x[i] = uv.x, uv_y[i] = uv.y;
+  }
+
+  void set_f(int i, const Vector3 &f) {
+    f_x[i] = f.x, f_y[i] = f.y, f_z[i] = f.z;
+  }
+};
+
 class SurfaceMaterial : public Unit {
  protected:
   std::shared_ptr<VolumeMaterial> internal_material = nullptr;
@@ -94,9 +151,46 @@ class SurfaceMaterial : public Unit {
     return Vector3(0.0_f);
   }
 
+  // Batched sample, evaluate_bsdf and probability_density over all lanes of
+  // |batch|, with the same results as the scalar calls. The defaults loop
+  // over the scalar interface; common materials override them with SoA
+  // kernels.
+  virtual void sample_batch(SurfaceBatch &batch) const {
+    for (int i = 0; i < batch.size; i++) {
+      Vector3 out_dir, f;
+      sample(batch.get_in(i), batch.u[i], batch.v[i], out_dir, f,
+             batch.pdf[i], batch.event[i], batch.get_uv(i));
+      batch.set_out(i, out_dir);
+      batch.set_f(i, f);
+    }
+  }
+
+  virtual void evaluate_batch(SurfaceBatch &batch) const {
+    for (int i = 0; i < batch.size; i++) {
+      batch.set_f(i, evaluate_bsdf(batch.get_in(i), batch.get_out(i),
+                                   batch.get_uv(i)));
+    }
+  }
+
+  virtual void probability_density_batch(SurfaceBatch &batch) const {
+    for (int i = 0; i < batch.size; i++) {
+      batch.pdf[i] = probability_density(batch.get_in(i), batch.get_out(i),
+                                         batch.get_uv(i));
+    }
+  }
+
   static std::shared_ptr<Texture> get_color_sampler(const Config &config,
                                                     const std::string &name);
 
+  // Samples |texture| at the uv of every lane of |batch| into |r|, |g| and
+  // |b|, each resized to batch.size. Texture lookups stay virtual, so
+  // kernels gather them first and then run the arithmetic over lanes.
+  static void sample_texture_batch(const Texture &texture,
+                                   const SurfaceBatch &batch,
+                                   std::vector<real> &r,
+                                   std::vector<real> &g,
+                                   std::vector<real> &b);
+
   virtual bool is_delta() const {
     return false;
   }
@@ -109,6 +203,15 @@ class SurfaceMaterial : public Unit {
     return false;
   }
 
+  // For surfaces that every ray from |in| passes straight through, with no
+  // random event and no volume entered or left: true, with |transmittance|
+  // the f cos of the pass. Shadow rays test them in one traversal.
+  virtual bool get_fixed_transmittance(const Vector3 &in,
+                                       const Vector2 &uv,
+                                       Vector3 &transmittance) const {
+    return false;
+  }
+
   virtual real get_importance(const Vector2 &uv) const {
     TC_ERROR("no impl");
     return 0;
@@ -11,6 +11,8 @@
 
 TC_NAMESPACE_BEGIN
 
+class TextureCompiler;
+
 class Texture : public Unit {
  public:
   virtual void initialize(const Config &config) {
@@ -25,6 +27,31 @@ class Texture : public Unit {
     return Vector4(0.0_f);
   }
 
+  // out[i] = sample(coords[i]) for i in [0, n), for textures with
+  // vectorized evaluation to override
+  virtual void sample_batch(const Vector3 *coords, int n, Vector4 *out) const {
+    for (int i = 0; i < n; i++) {
+      out[i] = sample(coords[i]);
+    }
+  }
+
+  // Lookup averaged over a footprint |width| wide (in texture coordinates),
+  // for textures with a MIP pyramid. Others ignore |width|.
+  virtual Vector4 sample_filtered(const Vector2 &coord, real width) const {
+    return sample(coord);
+  }
+
+  // Emits the instructions evaluating this texture at coordinate |coord|
+  // and returns the register of the result (see texture_compiler.h). The
+  // default calls sample().
+  virtual int compile(TextureCompiler &compiler, int coord) const;
+
+  // Bytes of the data held by the texture itself, e.g. its texels, but not
+  // by the textures it refers to or by shared caches
+  virtual std::size_t get_memory_usage() const {
+    return 0;
+  }
+
   Vector3 sample3(const Vector2 &coord) const {
     Vector4 tmp = sample(coord);
     return Vector3(tmp.x, tmp.y, tmp.z);
@@ -65,4 +92,8 @@ class Texture : public Unit {
 
 TC_INTERFACE(Texture);
 
+inline std::size_t get_asset_memory_usage(const Texture &texture) {
+  return texture.get_memory_usage();
+}
+
 TC_NAMESPACE_END
@@ -0,0 +1,143 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+#include <taichi/visual/texture_pyramid.h>
+
+#include <cstdio>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+TC_NAMESPACE_BEGIN
+
+// Tiles of out-of-core textures, shared by all of them within a memory
+// budget. Tiles are read from disk when first touched and the least
+// recently used are evicted once the budget is exceeded. In front of the
+// shared (locked) cache, each thread keeps a small direct-mapped cache of its
+// last tiles, so that repeated lookups of a tile take no lock. These keep
+// evicted tiles alive until replaced, so memory use may exceed the budget by
+// micro_cache_size tiles per sampling thread.
+class TextureCache {
+ public:
+  static constexpr int micro_cache_size = 16;
+
+  using Tile = std::vector<uint8>;
+
+  static TextureCache &get_instance();
+
+  ~TextureCache();
+
+  // In bytes; evicts tiles at once if needed
+  void set_budget(std::size_t budget);
+
+  std::size_t get_budget() const {
+    return budget;
+  }
+
+  // Bytes of the tiles in the shared cache
+  std::size_t get_memory_usage();
+
+  // Registers file |fn|, whose tiles of |tile_bytes| start at byte
+  // |data_offset|. Returns the id of the file for get_tile().
+  int open(const std::string &fn, int64 data_offset, int tile_bytes);
+
+  // Tile |tile| of file |file|, valid until the next call from this thread
+  const Tile *get_tile(int file, int tile);
+
+ private:
+  struct File {
+    std::string fn;
+    std::FILE *f;
+    int64 data_offset;
+    int tile_bytes;
+    // Of seeking and reading f
+    std::mutex mutex;
+  };
+
+  struct Entry {
+    std::shared_ptr<const Tile> tile;
+    // In lru
+    std::list<uint64>::iterator position;
+  };
+
+  TextureCache() {
+  }
+
+  std::shared_ptr<const Tile> load_tile(int file, int tile);
+
+  void evict();
+
+  std::size_t budget = (std::size_t)1 << 30;
+  std::size_t memory_usage = 0;
+  std::mutex mutex;
+  std::vector<std::unique_ptr<File>> files;
+  // Keyed by file << 32 | tile; lru has the most recently used first
+  std::unordered_map<uint64, Entry> entries;
+  std::list<uint64> lru;
+};
+
+// A TexturePyramid kept on disk as a "tiled texture" (.tct) file, whose
+// texels are fetched through the TextureCache. Lookups match those of the
+// pyramid it was written from.
+class TiledTexturePyramid : public PyramidSampling<TiledTexturePyramid> {
+ public:
+  // Of the files, in texels
+  static constexpr int tile_size = 64;
+
+  // Returns false if |fn| is not a tiled texture file
+  bool open(const std::string &fn);
+
+  // The stamp given to write() (that of the source image)
+  uint64 get_source_stamp() const {
+    return source_stamp;
+  }
+
+  StorageFormat get_format() const {
+    return format;
+  }
+
+  int get_num_levels() const {
+    return (int)levels.size();
+  }
+
+  Vector2i get_res(int level = 0) const {
+    return levels[level].res;
+  }
+
+  Vector4 get_texel(int level, int i, int j) const {
+    const Level &l = levels[level];
+    int tile = l.first_tile + (j / tile_size) * l.tiles_x + i / tile_size;
+    const uint8 *texels =
+        TextureCache::get_instance().get_tile(file, tile)->data();
+    int t = (j % tile_size) * tile_size + i % tile_size;
+    return decode_texel(texels + t * texel_bytes, format);
+  }
+
+  // Writes |pyramid| to |fn| in the format of the pyramid
+  static void write(const std::string &fn,
+                    const TexturePyramid &pyramid,
+                    uint64 source_stamp);
+
+ private:
+  struct Level {
+    Vector2i res;
+    int tiles_x;
+    // Index of the first tile of the level in the file
+    int first_tile;
+  };
+
+  int file = -1;
+  uint64 source_stamp = 0;
+  StorageFormat format = StorageFormat::full;
+  int texel_bytes = 16;
+  std::vector<Level> levels;
+};
+
+TC_NAMESPACE_END
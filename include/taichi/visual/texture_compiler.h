@@ -0,0 +1,117 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+#include <taichi/visual/texture.h>
+
+#include <functional>
+#include <map>
+#include <vector>
+
+TC_NAMESPACE_BEGIN
+
+// A texture graph flattened into straight-line code over registers, each
+// holding a coordinate (in xyz) or a value. run() replaces one virtual call
+// per graph node with one switch per instruction; textures that cannot be
+// compiled are called through a sample instruction.
+class TextureProgram {
+ public:
+  enum class Op {
+    constant,  // dst = value
+    affine,    // dst = m * a + t
+    fract,     // dst = fract(a)
+    repeat,    // dst = (a - floor(a * t) * value) * t, value = 1 / t
+    mul,       // dst = a * b
+    linear,    // dst = alpha * a + beta * b, rgb clamped to [0, 1] if |clamp|
+    bound,     // dst = alpha <= a[axis] < beta ? b : value
+    sample,    // dst = texture->sample(a)
+  };
+
+  struct Instruction {
+    Op op;
+    int dst, a, b;
+    Matrix3 m;
+    Vector3 t;
+    Vector4 value;
+    real alpha, beta;
+    int axis;
+    bool clamp;
+    const Texture *texture;
+  };
+
+  std::vector<Instruction> instructions;
+  int num_registers = 1;
+  // Register 0 holds the input coordinate
+  int result = 0;
+
+  Vector4 run(const Vector3 &coord) const;
+
+  // run() of coords[0] to coords[n - 1], an instruction at a time over
+  // chunks of points, so that sample instructions go through sample_batch()
+  void run_batch(const Vector3 *coords, int n, Vector4 *out) const;
+};
+
+// Builds a TextureProgram from a texture graph. Texture::compile emits the
+// instructions of one node, given the coordinate its parent samples it at.
+// Coordinates are kept symbolic as affine maps of a register, so chains of
+// zoom/translate/rotate/flip fold into at most one instruction. Nodes sampled
+// twice at the same coordinate are evaluated once, and operations on
+// constants are folded.
+class TextureCompiler {
+ public:
+  TextureCompiler();
+
+  // Coordinate handle of the input coordinate
+  int input() const {
+    return 0;
+  }
+
+  // Coordinate f(|coord|), for an affine |f|
+  int transform(int coord, const std::function<Vector3(Vector3)> &f);
+
+  // Value register of |texture| sampled at |coord|
+  int compile(const Texture &texture, int coord);
+
+  // Coordinate handles from registers and back
+  int coord_from_register(int reg);
+  int materialize(int coord);
+
+  int emit_constant(const Vector4 &value);
+  int emit_fract(int reg);
+  // Returns a coordinate handle
+  int emit_repeat(int coord, const Vector3 &repeat);
+  int emit_mul(int a, int b);
+  int emit_linear(real alpha, int a, real beta, int b, bool clamp);
+  int emit_bound(int coord,
+                 int axis,
+                 const Vector2 &bounds,
+                 int value,
+                 const Vector4 &outside);
+  int emit_sample(const Texture &texture, int coord);
+
+  TextureProgram finish(int result);
+
+ private:
+  struct Coord {
+    int reg;
+    Matrix3 m;
+    Vector3 t;
+  };
+
+  TextureProgram program;
+  std::vector<Coord> coords;
+  // Constant value of each register, if known
+  std::map<int, Vector4> constants;
+  std::map<std::pair<const Texture *, int>, int> compiled;
+  std::map<int, int> materialized;
+
+  int add_coord(int reg, const Matrix3 &m, const Vector3 &t);
+  static TextureProgram::Instruction instruction(TextureProgram::Op op);
+  int emit(TextureProgram::Instruction inst);
+  bool is_constant(int reg) const;
+};
+
+TC_NAMESPACE_END
@@ -0,0 +1,253 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+#include <taichi/math/math.h>
+#include <taichi/math/array_2d.h>
+#include <taichi/math/float16.h>
+
+#include <cstring>
+#include <vector>
+
+TC_NAMESPACE_BEGIN
+
+// Bytes of a texel of four channels in |format|: 16 for full (float32
+// channels), 8 for float16 and bfloat16, 4 for srgb8, whose alpha is linear
+inline int get_texel_bytes(StorageFormat format) {
+  if (format == StorageFormat::full) {
+    return 16;
+  }
+  return format == StorageFormat::srgb8 ? 4 : 8;
+}
+
+inline void encode_texel(const Vector4 &texel,
+                         StorageFormat format,
+                         uint8 *out) {
+  for (int c = 0; c < 4; c++) {
+    float32 v = (float32)texel[c];
+    if (format == StorageFormat::full) {
+      std::memcpy(out + 4 * c, &v, sizeof(v));
+    } else if (format == StorageFormat::float16) {
+      uint16 h = float32_to_float16(v);
+      std::memcpy(out + 2 * c, &h, sizeof(h));
+    } else if (format == StorageFormat::bfloat16) {
+      uint16 b = float32_to_bfloat16(v);
+      std::memcpy(out + 2 * c, &b, sizeof(b));
+    } else if (c < 3) {
+      out[c] = linear_to_srgb8(v);
+    } else {
+      out[c] = (uint8)(std::min(std::max(v, 0.0f), 1.0f) * 255 + 0.5f);
+    }
+  }
+}
+
+inline Vector4 decode_texel(const uint8 *in, StorageFormat format) {
+  float32 v[4];
+  if (format == StorageFormat::full) {
+    std::memcpy(v, in, sizeof(v));
+  } else if (format == StorageFormat::float16) {
+    uint16 h[4];
+    std::memcpy(h, in, sizeof(h));
+    float16_to_float32x4(h, v);
+  } else if (format == StorageFormat::bfloat16) {
+    for (int c = 0; c < 4; c++) {
+      uint16 b;
+      std::memcpy(&b, in + 2 * c, sizeof(b));
+      v[c] = bfloat16_to_float32(b);
+    }
+  } else {
+    for (int c = 0; c < 3; c++) {
+      v[c] = srgb8_to_linear(in[c]);
+    }
+    v[3] = in[3] * (1.0f / 255);
+  }
+  return Vector4(v[0], v[1], v[2], v[3]);
+}
+
+// Filtered lookups of a MIP pyramid |Pyramid|, which provides
+// get_num_levels(), get_res(level) and get_texel(level, i, j)
+template <typename Pyramid>
+class PyramidSampling {
+ public:
+  // Level of detail whose texels are |width| wide (in [0, 1] texture
+  // coordinates)
+  real get_lod(real width) const {
+    Vector2i res = pyramid().get_res(0);
+    real texels = width * std::max(res[0], res[1]);
+    return texels > 1 ? std::log2(texels) : 0.0_f;
+  }
+
+  // Trilinear lookup; |lod| is clamped to the available levels
+  Vector4 sample(const Vector2 &coord, real lod) const {
+    int num_levels = pyramid().get_num_levels();
+    lod = clamp(lod, 0.0_f, num_levels - 1.0_f);
+    int level = (int)lod;
+    real t = lod - level;
+    Vector4 ret = sample_level(level, coord);
+    if (t > 0 && level + 1 < num_levels) {
+      ret = lerp(t, ret, sample_level(level + 1, coord));
+    }
+    return ret;
+  }
+
+  Vector4 sample(const Vector2 &coord) const {
+    return sample_level(0, coord);
+  }
+
+  // Bilinear lookup within one level
+  Vector4 sample_level(int level, const Vector2 &coord) const {
+    const Pyramid &p = pyramid();
+    const Vector2i res = p.get_res(level);
+    real x = clamp(coord.x * res[0] - 0.5_f, 0.0_f, res[0] - 1.0_f - eps);
+    real y = clamp(coord.y * res[1] - 0.5_f, 0.0_f, res[1] - 1.0_f - eps);
+    int x_i = clamp(int(x), 0, std::max(res[0] - 2, 0));
+    int y_i = clamp(int(y), 0, std::max(res[1] - 2, 0));
+    int x_j = std::min(x_i + 1, res[0] - 1);
+    int y_j = std::min(y_i + 1, res[1] - 1);
+    real x_r = x - x_i;
+    real y_r = y - y_i;
+    Vector4 t00 = p.get_texel(level, x_i, y_i);
+    Vector4 t01 = p.get_texel(level, x_i, y_j);
+    Vector4 t10 = p.get_texel(level, x_j, y_i);
+    Vector4 t11 = p.get_texel(level, x_j, y_j);
+    return lerp(x_r, lerp(y_r, t00, t01), lerp(y_r, t10, t11));
+  }
+
+ private:
+  const Pyramid &pyramid() const {
+    return *static_cast<const Pyramid *>(this);
+  }
+};
+
+// MIP pyramid of an image, each level a 2x box-filtered copy of the one
+// above. Texels are stored in tile_size x tile_size tiles, so that the four
+// texels of a bilinear fetch (and nearby fetches) mostly share cache lines.
+// Level 0 lookups match Array2D<Vector4>::sample_relative_coord. Texels
+// may be kept in a compact StorageFormat, decoded on lookup.
+class TexturePyramid : public PyramidSampling<TexturePyramid> {
+ public:
+  static constexpr int tile_size = 4;
+
+  TexturePyramid() {
+  }
+
+  TexturePyramid(const Array2D<Vector4> &image,
+                 StorageFormat format = StorageFormat::full) {
+    initialize(image, format);
+  }
+
+  void initialize(const Array2D<Vector4> &image,
+                  StorageFormat format = StorageFormat::full) {
+    TC_ASSERT_INFO(image.get_width() > 0 && image.get_height() > 0,
+                   "empty image");
+    levels.clear();
+    data.clear();
+    this->format = StorageFormat::full;
+    add_level(image.get_res());
+    for (int i = 0; i < image.get_width(); i++) {
+      for (int j = 0; j < image.get_height(); j++) {
+        texel(0, i, j) = image.get(i, j);
+      }
+    }
+    while (levels.back().res[0] > 1 || levels.back().res[1] > 1) {
+      int l = (int)levels.size();
+      Vector2i above = levels.back().res;
+      Vector2i res(std::max(1, above[0] / 2), std::max(1, above[1] / 2));
+      add_level(res);
+      for (int i = 0; i < res[0]; i++) {
+        for (int j = 0; j < res[1]; j++) {
+          int i0 = std::min(2 * i, above[0] - 1);
+          int i1 = std::min(2 * i + 1, above[0] - 1);
+          int j0 = std::min(2 * j, above[1] - 1);
+          int j1 = std::min(2 * j + 1, above[1] - 1);
+          texel(l, i, j) =
+              0.25_f * (texel(l - 1, i0, j0) + texel(l - 1, i0, j1) +
+                        texel(l - 1, i1, j0) + texel(l - 1, i1, j1));
+        }
+      }
+    }
+    compact(format);
+  }
+
+  StorageFormat get_format() const {
+    return format;
+  }
+
+  int get_num_levels() const {
+    return (int)levels.size();
+  }
+
+  Vector2i get_res(int level = 0) const {
+    return levels[level].res;
+  }
+
+  // Bytes of the texels of all levels
+  std::size_t get_memory_usage() const {
+    return data.size() * sizeof(Vector4) + packed.size();
+  }
+
+  Vector4 get_texel(int level, int i, int j) const {
+    std::size_t t = texel_index(level, i, j);
+    if (format == StorageFormat::full) {
+      return data[t];
+    }
+    return decode_texel(&packed[t * texel_bytes], format);
+  }
+
+ private:
+  struct Level {
+    Vector2i res;
+    int tiles_x;
+    // Of texel (0, 0) in |data|
+    int offset;
+  };
+
+  std::vector<Level> levels;
+  StorageFormat format = StorageFormat::full;
+  int texel_bytes = 16;
+  // Texels in the full format, or their encoding in |packed|
+  std::vector<Vector4> data;
+  std::vector<uint8> packed;
+
+  // Replaces the full-precision texels by their |format| encoding
+  void compact(StorageFormat format) {
+    this->format = format;
+    texel_bytes = get_texel_bytes(format);
+    packed.clear();
+    if (format == StorageFormat::full) {
+      return;
+    }
+    packed.resize(data.size() * texel_bytes);
+    for (std::size_t t = 0; t < data.size(); t++) {
+      encode_texel(data[t], format, &packed[t * texel_bytes]);
+    }
+    std::vector<Vector4>().swap(data);
+  }
+
+  void add_level(Vector2i res) {
+    Level level;
+    level.res = res;
+    level.tiles_x = (res[0] + tile_size - 1) / tile_size;
+    int tiles_y = (res[1] + tile_size - 1) / tile_size;
+    level.offset = (int)data.size();
+    levels.push_back(level);
+    data.resize(data.size() +
+                (size_t)level.tiles_x * tiles_y * tile_size * tile_size);
+  }
+
+  int texel_index(int level, int i, int j) const {
+    const Level &l = levels[level];
+    int tile = (j / tile_size) * l.tiles_x + i / tile_size;
+    return l.offset + (tile * tile_size + j % tile_size) * tile_size +
+           i % tile_size;
+  }
+
+  Vector4 &texel(int level, int i, int j) {
+    return data[texel_index(level, i, j)];
+  }
+};
+
+TC_NAMESPACE_END
@@ -69,13 +69,13 @@ class VolumeMaterial : public Unit {
 
   virtual Vector3 phase_evaluate(const Vector3 &pos,
                                  const Vector3 &in_dir,
-                                 const Vector3 &out_dir) {
+                                 const Vector3 &out_dir) const {
     return Vector3(1.0_f, 1.0_f, 1.0_f);
   }
 
   virtual real phase_probability_density(const Vector3 &pos,
                                          const Vector3 &in_dir,
-                                         const Vector3 &out_dir) {
+                                         const Vector3 &out_dir) const {
     return 1 / 4 / pi;
   }
 
@@ -94,24 +94,39 @@ class VolumeMaterial : public Unit {
 
 TC_INTERFACE(VolumeMaterial);
 
+// The media a path is nested in, innermost on top. They are kept inline, so
+// that stacks are made and copied, e.g. for every shadow ray, without
+// allocation.
 class VolumeStack {
-  std::vector<VolumeMaterial const *> stack;
-
  public:
+  static constexpr int capacity = 16;
+
   VolumeStack();
-  void push(VolumeMaterial const *vol) {
-    stack.push_back(vol);
+
+  // False if the stack is full, and |vol| not pushed
+  bool push(VolumeMaterial const *vol) {
+    if (count == capacity) {
+      return false;
+    }
+    stack[count++] = vol;
+    return true;
   }
   void pop() {
-    stack.pop_back();
+    if (count > 0) {
+      count--;
+    }
   }
-  VolumeMaterial const *top() {
-    return stack.back();
+  VolumeMaterial const *top() const {
+    return stack[count - 1];
   }
 
   size_t size() const {
-    return stack.size();
+    return (size_t)count;
   }
+
+ private:
+  VolumeMaterial const *stack[capacity];
+  int count = 0;
 };
 
 class VolumeStackPushGuard {
@@ -121,7 +136,8 @@ class VolumeStackPushGuard {
  public:
   VolumeStackPushGuard(VolumeStack &stack, const VolumeMaterial &volume)
       : stack(stack) {
-    stack.push(&volume);
+    bool pushed = stack.push(&volume);
+    TC_ASSERT_INFO(pushed, "Volume stack overflow");
   }
   ~VolumeStackPushGuard() {
     stack.pop();
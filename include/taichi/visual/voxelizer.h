@@ -8,12 +8,279 @@
 #include <functional>
 #include <taichi/common/interface.h>
 #include <taichi/math/math.h>
+#include <taichi/math/array_3d.h>
+#include <taichi/geometry/primitives.h>
+#include <taichi/system/threading.h>
+
+#include <algorithm>
+#include <vector>
 
 TC_NAMESPACE_BEGIN
 
+// Scan-converts closed triangle meshes into voxel grids, whose voxel
+// (i, j, k) is sampled at origin + Vector3(i, j, k) * dx. Triangles are
+// binned to the grid rows (j) they cover, and rows are processed in
+// parallel: each column (i, j) collects the z of the triangles crossing it,
+// and voxels are filled by the winding number of the crossings below them.
 class Voxelizer {
  protected:
+  Vector3i res;
+  Vector3 origin;
+  real dx;
+  int num_threads;
+
  public:
+  Voxelizer(const Vector3i &res,
+            const Vector3 &origin,
+            real dx,
+            int num_threads = -1)
+      : res(res), origin(origin), dx(dx), num_threads(num_threads) {
+    TC_ASSERT_INFO(dx > 0, "voxel size must be positive");
+  }
+
+  // 1 for voxels inside the mesh (non-zero winding number), 0 elsewhere.
+  // With |conservative|, voxels (cubes of side dx around the samples) that
+  // touch a triangle are also set, so thin parts are not lost.
+  Array3D<real> voxelize(const std::vector<Triangle> &triangles,
+                         bool conservative = false) const {
+    Array3D<real> ret(res, 0.0_f);
+    auto rows = bin_rows(triangles, conservative ? 0.5_f * dx : 0.0_f);
+    ThreadedTaskManager::run(
+        [&](int j) {
+          fill_row(triangles, rows[j], j, ret);
+          if (conservative) {
+            for (int t : rows[j]) {
+              Vector3i lower, upper;
+              get_range(triangles[t], 0.5_f * dx, lower, upper);
+              for (int i = lower.x; i <= upper.x; i++) {
+                for (int k = lower.z; k <= upper.z; k++) {
+                  if (triangle_box_overlap(get_pos(i, j, k), 0.5_f * dx,
+                                           triangles[t].v)) {
+                    ret[i][j][k] = 1.0_f;
+                  }
+                }
+              }
+            }
+          }
+        },
+        0, res.y, num_threads);
+    return ret;
+  }
+
+  // Signed distance to the mesh (negative inside) at voxels within |band|
+  // voxels of a triangle, and -+band * dx elsewhere
+  Array3D<real> signed_distance(const std::vector<Triangle> &triangles,
+                                real band) const {
+    Array3D<real> ret = voxelize(triangles);
+    real max_dist = band * dx;
+    auto rows = bin_rows(triangles, max_dist);
+    ThreadedTaskManager::run(
+        [&](int j) {
+          std::vector<real> dist(res.x * res.z, max_dist);
+          for (int t : rows[j]) {
+            Vector3i lower, upper;
+            get_range(triangles[t], max_dist, lower, upper);
+            for (int i = lower.x; i <= upper.x; i++) {
+              for (int k = lower.z; k <= upper.z; k++) {
+                real &d = dist[i * res.z + k];
+                d = std::min(d, point_triangle_distance(get_pos(i, j, k),
+                                                        triangles[t].v));
+              }
+            }
+          }
+          for (int i = 0; i < res.x; i++) {
+            for (int k = 0; k < res.z; k++) {
+              real d = dist[i * res.z + k];
+              ret[i][j][k] = ret[i][j][k] > 0 ? -d : d;
+            }
+          }
+        },
+        0, res.y, num_threads);
+    return ret;
+  }
+
+  Vector3 get_pos(int i, int j, int k) const {
+    return origin + Vector3(i, j, k) * dx;
+  }
+
+  // Separating axis test of a triangle and the cube of half side |half|
+  // around |center| [Akenine-Moller 2001]
+  static bool triangle_box_overlap(const Vector3 &center,
+                                   real half,
+                                   const Vector3 *triangle) {
+    Vector3 v[3];
+    for (int i = 0; i < 3; i++) {
+      v[i] = triangle[i] - center;
+    }
+    auto separated = [&](const Vector3 &axis) {
+      real r = half * (std::abs(axis.x) + std::abs(axis.y) + std::abs(axis.z));
+      real p0 = dot(v[0], axis), p1 = dot(v[1], axis), p2 = dot(v[2], axis);
+      return std::min(p0, std::min(p1, p2)) > r ||
+             std::max(p0, std::max(p1, p2)) < -r;
+    };
+    Vector3 e[3] = {v[1] - v[0], v[2] - v[1], v[0] - v[2]};
+    for (int k = 0; k < 3; k++) {
+      Vector3 axis(0.0_f);
+      axis[k] = 1.0_f;
+      if (separated(axis)) {
+        return false;
+      }
+      for (int i = 0; i < 3; i++) {
+        if (separated(cross(axis, e[i]))) {
+          return false;
+        }
+      }
+    }
+    return !separated(cross(e[0], e[1]));
+  }
+
+  // [Ericson 2004, 5.1.5]
+  static real point_triangle_distance(const Vector3 &p,
+                                      const Vector3 *triangle) {
+    const Vector3 &a = triangle[0], &b = triangle[1], &c = triangle[2];
+    Vector3 ab = b - a, ac = c - a, ap = p - a;
+    real d1 = dot(ab, ap), d2 = dot(ac, ap);
+    if (d1 <= 0 && d2 <= 0) {
+      return length(p - a);
+    }
+    Vector3 bp = p - b;
+    real d3 = dot(ab, bp), d4 = dot(ac, bp);
+    if (d3 >= 0 && d4 <= d3) {
+      return length(p - b);
+    }
+    real vc = d1 * d4 - d3 * d2;
+    if (vc <= 0 && d1 >= 0 && d3 <= 0) {
+      return length(p - (a + ab * (d1 / (d1 - d3))));
+    }
+    Vector3 cp = p - c;
+    real d5 = dot(ab, cp), d6 = dot(ac, cp);
+    if (d6 >= 0 && d5 <= d6) {
+      return length(p - c);
+    }
+    real vb = d5 * d2 - d1 * d6;
+    if (vb <= 0 && d2 >= 0 && d6 <= 0) {
+      return length(p - (a + ac * (d2 / (d2 - d6))));
+    }
+    real va = d3 * d6 - d5 * d4;
+    if (va <= 0 && (d4 - d3) >= 0 && (d5 - d6) >= 0) {
+      return length(p - (b + (c - b) * ((d4 - d3) / ((d4 - d3) + (d5 - d6)))));
+    }
+    real denom = 1.0_f / (va + vb + vc);
+    return length(p - (a + ab * (vb * denom) + ac * (vc * denom)));
+  }
+
+ protected:
+  struct Crossing {
+    real z;
+    int winding;
+    bool operator<(const Crossing &o) const {
+      return z < o.z;
+    }
+  };
+
+  // Voxels whose samples are within |margin| of the bounding box of |t|,
+  // padded by one voxel against rounding (the exact tests decide). Empty
+  // (some lower > upper) if it is outside the grid.
+  void get_range(const Triangle &t,
+                 real margin,
+                 Vector3i &lower,
+                 Vector3i &upper) const {
+    for (int k = 0; k < 3; k++) {
+      real lo = std::min(t.v[0][k], std::min(t.v[1][k], t.v[2][k])) - margin;
+      real hi = std::max(t.v[0][k], std::max(t.v[1][k], t.v[2][k])) + margin;
+      lower[k] = std::max((int)std::floor((lo - origin[k]) / dx), 0);
+      upper[k] =
+          std::min((int)std::floor((hi - origin[k]) / dx) + 1, res[k] - 1);
+    }
+  }
+
+  std::vector<std::vector<int>> bin_rows(const std::vector<Triangle> &triangles,
+                                         real margin) const {
+    std::vector<std::vector<int>> rows(res.y);
+    for (int t = 0; t < (int)triangles.size(); t++) {
+      Vector3i lower, upper;
+      get_range(triangles[t], margin, lower, upper);
+      // Triangles below the grid still count for the winding numbers
+      if (lower.x > upper.x) {
+        continue;
+      }
+      for (int j = lower.y; j <= upper.y; j++) {
+        rows[j].push_back(t);
+      }
+    }
+    return rows;
+  }
+
+  // 2D edge function of p against a -> b, computed in a canonical vertex
+  // order so that triangles sharing the edge get exactly opposite values
+  static float64 edge_function(const Vector3 &a,
+                               const Vector3 &b,
+                               float64 px,
+                               float64 py) {
+    bool swapped = b.x < a.x || (b.x == a.x && b.y < a.y);
+    const Vector3 &s = swapped ? b : a, &e = swapped ? a : b;
+    float64 w = ((float64)e.x - s.x) * (py - s.y) -
+                ((float64)e.y - s.y) * (px - s.x);
+    return swapped ? -w : w;
+  }
+
+  void fill_row(const std::vector<Triangle> &triangles,
+                const std::vector<int> &row,
+                int j,
+                Array3D<real> &ret) const {
+    std::vector<std::vector<Crossing>> columns(res.x);
+    float64 py = origin.y + (float64)j * dx;
+    for (int t : row) {
+      const Vector3 *v = triangles[t].v;
+      float64 area = edge_function(v[0], v[1], v[2].x, v[2].y);
+      if (area == 0) {
+        // Parallel to the columns
+        continue;
+      }
+      real orientation = area > 0 ? 1.0_f : -1.0_f;
+      Vector3i lower, upper;
+      get_range(triangles[t], 0.0_f, lower, upper);
+      for (int i = lower.x; i <= upper.x; i++) {
+        float64 px = origin.x + (float64)i * dx;
+        float64 w[3];
+        bool inside = true;
+        for (int k = 0; k < 3 && inside; k++) {
+          const Vector3 &a = v[(k + 1) % 3], &b = v[(k + 2) % 3];
+          w[k] = edge_function(a, b, px, py) * orientation;
+          if (w[k] == 0) {
+            // Top-left rule: of two triangles sharing an edge through the
+            // column exactly one counts it
+            float64 ex = (b.x - a.x) * orientation,
+                    ey = (b.y - a.y) * orientation;
+            inside = ey > 0 || (ey == 0 && ex < 0);
+          } else {
+            inside = w[k] > 0;
+          }
+        }
+        if (!inside) {
+          continue;
+        }
+        float64 sum = w[0] + w[1] + w[2];
+        real z = real((w[0] * v[0].z + w[1] * v[1].z + w[2] * v[2].z) / sum);
+        // Entering a counter-clockwise (outward) mesh upwards crosses
+        // faces facing down
+        columns[i].push_back(Crossing{z, area > 0 ? -1 : 1});
+      }
+    }
+    for (int i = 0; i < res.x; i++) {
+      auto &crossings = columns[i];
+      std::sort(crossings.begin(), crossings.end());
+      int winding = 0;
+      size_t c = 0;
+      for (int k = 0; k < res.z; k++) {
+        real z = origin.z + k * dx;
+        while (c < crossings.size() && crossings[c].z < z) {
+          winding += crossings[c++].winding;
+        }
+        ret[i][j][k] = winding != 0 ? 1.0_f : 0.0_f;
+      }
+    }
+  }
 };
 
 TC_NAMESPACE_END
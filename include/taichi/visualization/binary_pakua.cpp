@@ -0,0 +1,236 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#include <cstdio>
+#include <cstring>
+#include <taichi/visualization/pakua.h>
+
+#if defined(TC_PLATFORM_UNIX)
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+TC_NAMESPACE_BEGIN
+
+// Frames of typed, length-prefixed buffers instead of JSON text. A frame is
+// a BinaryPakuaFrameHeader followed by |num_buffers| buffers, each a
+// BinaryPakuaBufferHeader and its (optionally zlib-compressed) payload of
+// float32 or int32 values in native (little-endian) byte order:
+//   points.position, points.color (3 per point), points.size
+//   lines.position, lines.color, lines.width (3, 3 and 1 per vertex),
+//     lines.start (first vertex of each line, int32)
+//   triangles.position, triangles.color (3 per vertex, 3 vertices each)
+// Frames go to "frame_directory" as {frame:04}.tcpk, renamed into place once
+// complete (use a tmpfs directory such as /dev/shm to share them in memory),
+// or are streamed to a TCP listener at "host":"port". "compression" is the
+// zlib level, 0 (default) for none.
+struct BinaryPakuaFrameHeader {
+  uint32 magic;
+  uint32 version;
+  uint32 frame;
+  uint32 num_buffers;
+};
+
+struct BinaryPakuaBufferHeader {
+  char name[24];
+  uint32 type;        // 0 for float32, 1 for int32
+  uint32 compressed;  // 1 if |num_bytes| of zlib stream follow
+  uint64 num_elements;
+  uint64 num_bytes;
+};
+
+constexpr uint32 binary_pakua_magic = 0x4b504354;  // "TCPK"
+constexpr uint32 binary_pakua_version = 1;
+
+class BinaryPakua : public Pakua {
+  int frame_count;
+  std::string frame_directory;
+  int compression;
+  int socket_fd;
+
+  std::vector<float32> point_position, point_color, point_size;
+  std::vector<float32> line_position, line_color, line_width;
+  std::vector<int32> line_start;
+  std::vector<float32> triangle_position, triangle_color;
+  std::vector<uint8> frame;
+
+  static void append(std::vector<float32> &buffer, const Vector &v) {
+    buffer.push_back((float32)v[0]);
+    buffer.push_back((float32)v[1]);
+    buffer.push_back((float32)v[2]);
+  }
+
+  void append_bytes(const void *data, std::size_t size) {
+    auto bytes = reinterpret_cast<const uint8 *>(data);
+    frame.insert(frame.end(), bytes, bytes + size);
+  }
+
+  template <typename T>
+  void append_buffer(const char *name, const std::vector<T> &buffer) {
+    BinaryPakuaBufferHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::strncpy(header.name, name, sizeof(header.name) - 1);
+    header.type = std::is_same<T, int32>::value ? 1 : 0;
+    header.num_elements = buffer.size();
+    auto data = reinterpret_cast<const uint8 *>(buffer.data());
+    std::size_t size = buffer.size() * sizeof(T);
+    if (compression > 0 && size > 0) {
+      std::vector<uint8> compressed =
+          zip::zlib_compress(data, size, compression);
+      header.compressed = 1;
+      header.num_bytes = compressed.size();
+      append_bytes(&header, sizeof(header));
+      append_bytes(compressed.data(), compressed.size());
+    } else {
+      header.num_bytes = size;
+      append_bytes(&header, sizeof(header));
+      append_bytes(data, size);
+    }
+  }
+
+  void connect_to(const std::string &host, int port) {
+#if defined(TC_PLATFORM_UNIX)
+    socket_fd = socket(AF_INET, SOCK_STREAM, 0);
+    TC_ERROR_IF(socket_fd < 0, "Can not create a socket for Pakua");
+    sockaddr_in address;
+    std::memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons((uint16)port);
+    TC_ERROR_IF(inet_pton(AF_INET, host.c_str(), &address.sin_addr) != 1,
+                "Invalid Pakua host {}", host);
+    TC_ERROR_IF(connect(socket_fd, (sockaddr *)&address, sizeof(address)) < 0,
+                "Can not connect to Pakua at {}:{}", host, port);
+#else
+    TC_ERROR("Streaming Pakua frames over sockets is not supported on this "
+             "platform; use frame_directory instead");
+#endif
+  }
+
+  void send_frame() {
+#if defined(TC_PLATFORM_UNIX)
+    std::size_t sent = 0;
+    while (sent < frame.size()) {
+      int flags = 0;
+#if defined(MSG_NOSIGNAL)
+      flags = MSG_NOSIGNAL;
+#endif
+      ssize_t n = send(socket_fd, frame.data() + sent, frame.size() - sent,
+                       flags);
+      TC_ERROR_IF(n <= 0, "Pakua connection lost after {} frames",
+                  frame_count);
+      sent += n;
+    }
+#endif
+  }
+
+  void write_frame() {
+    std::string fn = fmt::format("{}/{:04}.tcpk", frame_directory, frame_count);
+    std::string tmp = fn + ".tmp";
+    std::FILE *f = std::fopen(tmp.c_str(), "wb");
+    TC_ERROR_IF(f == nullptr, "Can not write Pakua frame {}", tmp);
+    std::size_t written = std::fwrite(frame.data(), 1, frame.size(), f);
+    std::fclose(f);
+    TC_ERROR_IF(written != frame.size(), "Can not write Pakua frame {}", tmp);
+    TC_ERROR_IF(std::rename(tmp.c_str(), fn.c_str()) != 0,
+                "Can not rename Pakua frame {} to {}", tmp, fn);
+  }
+
+ public:
+  BinaryPakua() : socket_fd(-1) {
+  }
+
+  ~BinaryPakua() {
+#if defined(TC_PLATFORM_UNIX)
+    if (socket_fd >= 0) {
+      close(socket_fd);
+    }
+#endif
+  }
+
+  void initialize(const Config &config) override {
+    Pakua::initialize(config);
+    frame_directory = config.get("frame_directory", std::string(""));
+    compression = config.get("compression", 0);
+    TC_ERROR_IF(compression < 0 || compression > 9,
+                "Pakua compression must be a zlib level in [0, 9], not {}",
+                compression);
+    int port = config.get("port", -1);
+    TC_ERROR_IF(frame_directory.empty() == (port < 0),
+                "Binary Pakua needs exactly one of frame_directory and port");
+    if (port >= 0) {
+      connect_to(config.get("host", std::string("127.0.0.1")), port);
+    }
+    frame_count = 0;
+  }
+
+  void add_point(Vector pos, Vector color, real size = 1.0f) override {
+    append(point_position, pos);
+    append(point_color, color);
+    point_size.push_back((float32)size);
+  }
+
+  void add_line(const std::vector<Vector> &pos_v,
+                const std::vector<Vector> &color_v,
+                real width = 1.0f) override {
+    TC_ASSERT(pos_v.size() == color_v.size());
+    line_start.push_back((int32)(line_position.size() / 3));
+    for (int i = 0; i < (int)pos_v.size(); i++) {
+      append(line_position, pos_v[i]);
+      append(line_color, color_v[i]);
+      line_width.push_back((float32)width);
+    }
+  }
+
+  void add_triangle(const std::vector<Vector> &pos_v,
+                    const std::vector<Vector> &color_v) override {
+    TC_ASSERT(pos_v.size() == 3);
+    TC_ASSERT(color_v.size() == 3);
+    for (int i = 0; i < 3; i++) {
+      append(triangle_position, pos_v[i]);
+      append(triangle_color, color_v[i]);
+    }
+  }
+
+  // Buffers keep their capacity from frame to frame
+  void start() override {
+    point_position.clear();
+    point_color.clear();
+    point_size.clear();
+    line_position.clear();
+    line_color.clear();
+    line_width.clear();
+    line_start.clear();
+    triangle_position.clear();
+    triangle_color.clear();
+  }
+
+  void finish() override {
+    frame.clear();
+    BinaryPakuaFrameHeader header{binary_pakua_magic, binary_pakua_version,
+                                  (uint32)frame_count, 9};
+    append_bytes(&header, sizeof(header));
+    append_buffer("points.position", point_position);
+    append_buffer("points.color", point_color);
+    append_buffer("points.size", point_size);
+    append_buffer("lines.position", line_position);
+    append_buffer("lines.color", line_color);
+    append_buffer("lines.width", line_width);
+    append_buffer("lines.start", line_start);
+    append_buffer("triangles.position", triangle_position);
+    append_buffer("triangles.color", triangle_color);
+    if (socket_fd >= 0) {
+      send_frame();
+    } else {
+      write_frame();
+    }
+    frame_count += 1;
+  }
+};
+
+TC_IMPLEMENTATION(Pakua, BinaryPakua, "binary");
+
+TC_NAMESPACE_END
@@ -5,28 +5,44 @@
 
 #pragma once
 
+#include <atomic>
 #include <memory>
 #include <taichi/math/math.h>
 #include <taichi/math/array_2d.h>
+#include <taichi/physics/physics_constants.h>
 #include <taichi/system/threading.h>
 
 TC_NAMESPACE_BEGIN
 
+// Per-pixel running averages. Each thread accumulates into its own tiles,
+// which are allocated on first touch, so accumulate() takes no lock and
+// threads working on different parts of the image never share a cache line.
+// Tiles are merged into the shared buffer and freed by flush(), which
+// get_averaged() calls; neither may run concurrently with accumulate().
+// A thread thus holds only the tiles it touched since the last flush.
+// The variance of sample luminance is tracked as well (Welford within a
+// tile, merged with Chan et al.'s pairwise update), for adaptive sampling.
 template <typename T>
 class ImageAccumulator {
  public:
-  std::vector<Spinlock> locks;
+  static constexpr int tile_size = 16;
 
   ImageAccumulator() {
   }
 
-  ImageAccumulator(Vector2i res) : buffer(res), counter(res), res(res) {
-    for (int i = 0; i < res[0] * res[1]; i++) {
-      locks.push_back(Spinlock());
-    }
+  ImageAccumulator(Vector2i res)
+      : buffer(res),
+        counter(res),
+        mean(res),
+        m2(res),
+        res(res),
+        local(std::make_unique<ThreadTiles>()) {
+    num_tiles_y = (res[1] + tile_size - 1) / tile_size;
+    num_tiles = (res[0] + tile_size - 1) / tile_size * num_tiles_y;
   }
 
   Array2D<T> get_averaged(T default_value = T(0)) {
+    flush();
     Array2D<T> result(res);
     for (int i = 0; i < res[0]; i++) {
       for (int j = 0; j < res[1]; j++) {
@@ -42,22 +58,118 @@ class ImageAccumulator {
   }
 
   void accumulate(int x, int y, T val) {
-    int lock_id = x * res[1] + y;
-    locks[lock_id].lock();
-    counter[x][y]++;
-    buffer[x][y] += val;
-    locks[lock_id].unlock();
+#if !defined(TC_AMALGAMATED)
+    TileSet &tiles = local->local();
+#else
+    TileSet &tiles = *local;
+#endif
+    if (tiles.empty()) {
+      tiles.resize(num_tiles);
+    }
+    auto &tile = tiles[x / tile_size * num_tiles_y + y / tile_size];
+    if (!tile) {
+      tile = std::make_unique<Tile>();
+    }
+    int i = x % tile_size * tile_size + y % tile_size;
+    tile->sum[i] += val;
+    tile->count[i]++;
+    real l = scalar(val);
+    real delta = l - tile->mean[i];
+    tile->mean[i] += delta / tile->count[i];
+    tile->m2[i] += delta * (l - tile->mean[i]);
   }
 
   void accumulate(ImageAccumulator<T> &other) {
+    flush();
+    other.flush();
     for (int i = 0; i < res[0]; i++) {
       for (int j = 0; j < res[1]; j++) {
-        counter[i][j] += other.counter[i][j];
-        buffer[i][j] += other.buffer[i][j];
+        merge(i, j, other.buffer[i][j], other.counter[i][j],
+              other.mean[i][j], other.m2[i][j]);
       }
     }
   }
 
+  // Merges the thread-local tiles into the shared buffer and frees them
+  void flush() {
+    if (!local) {
+      return;
+    }
+#if !defined(TC_AMALGAMATED)
+    for (auto &tiles : *local) {
+      flush(tiles);
+    }
+#else
+    flush(*local);
+#endif
+  }
+
+  // Sums, counts and luminance statistics in binary form. Renders of
+  // disjoint sample ranges (e.g. on different nodes) are combined by
+  // accumulate_binary()ing the results into one accumulator.
+  std::vector<uint8> to_binary() {
+    flush();
+    BinaryOutputSerializer ser;
+    ser.initialize();
+    ser("res", res);
+    ser("buffer", buffer.get_data());
+    ser("counter", counter.get_data());
+    ser("mean", mean.get_data());
+    ser("m2", m2.get_data());
+    ser.finalize();
+    ser.data.resize(ser.head);
+    return ser.data;
+  }
+
+  // Adds the samples in |data|, written by to_binary(). A default-constructed
+  // accumulator takes the resolution of |data|.
+  void accumulate_binary(const std::vector<uint8> &data) {
+    BinaryInputSerializer ser;
+    ser.initialize(const_cast<uint8 *>(data.data()));
+    Vector2i data_res;
+    std::vector<T> sum_b;
+    std::vector<int> count_b;
+    std::vector<real> mean_b, m2_b;
+    ser("res", data_res);
+    ser("buffer", sum_b);
+    ser("counter", count_b);
+    ser("mean", mean_b);
+    ser("m2", m2_b);
+    ser.finalize();
+    if (!local) {
+      *this = ImageAccumulator<T>(data_res);
+    }
+    TC_ASSERT_INFO(data_res == res, "Resolutions of partial images differ");
+    flush();
+    for (int i = 0; i < res[0]; i++) {
+      for (int j = 0; j < res[1]; j++) {
+        int k = i * res[1] + j;
+        merge(i, j, sum_b[k], count_b[k], mean_b[k], m2_b[k]);
+      }
+    }
+  }
+
+  // The queries below see the samples merged by the last flush()
+  int get_count(int x, int y) const {
+    return counter[x][y];
+  }
+
+  // Sample variance of the luminance of pixel (x, y)
+  real get_variance(int x, int y) const {
+    int n = counter[x][y];
+    return n > 1 ? m2[x][y] / (n - 1) : std::numeric_limits<real>::infinity();
+  }
+
+  // Standard error of the mean luminance, relative to the mean. Very dark
+  // pixels are measured against |min_mean| instead.
+  real get_relative_error(int x, int y, real min_mean = 1e-3_f) const {
+    int n = counter[x][y];
+    if (n < 2) {
+      return std::numeric_limits<real>::infinity();
+    }
+    return std::sqrt(get_variance(x, y) / n) / std::max(mean[x][y], min_mean);
+  }
+
   int get_width() const {
     return res[0];
   }
@@ -67,9 +179,153 @@ class ImageAccumulator {
   }
 
  private:
+  struct Tile {
+    T sum[tile_size * tile_size];
+    int count[tile_size * tile_size];
+    // Luminance statistics of the samples in |sum|
+    real mean[tile_size * tile_size];
+    real m2[tile_size * tile_size];
+
+    Tile() {
+      clear();
+    }
+
+    void clear() {
+      std::fill(sum, sum + tile_size * tile_size, T(0));
+      std::fill(count, count + tile_size * tile_size, 0);
+      std::fill(mean, mean + tile_size * tile_size, 0.0_f);
+      std::fill(m2, m2 + tile_size * tile_size, 0.0_f);
+    }
+  };
+
+  using TileSet = std::vector<std::unique_ptr<Tile>>;
+#if !defined(TC_AMALGAMATED)
+  using ThreadTiles = tbb::enumerable_thread_specific<TileSet>;
+#else
+  using ThreadTiles = TileSet;
+#endif
+
+  void flush(TileSet &tiles) {
+    for (int t = 0; t < (int)tiles.size(); t++) {
+      Tile *tile = tiles[t].get();
+      if (!tile) {
+        continue;
+      }
+      int x0 = t / num_tiles_y * tile_size, y0 = t % num_tiles_y * tile_size;
+      int x1 = std::min(x0 + tile_size, res[0]);
+      int y1 = std::min(y0 + tile_size, res[1]);
+      for (int x = x0; x < x1; x++) {
+        for (int y = y0; y < y1; y++) {
+          int i = (x - x0) * tile_size + (y - y0);
+          merge(x, y, tile->sum[i], tile->count[i], tile->mean[i],
+                tile->m2[i]);
+        }
+      }
+      tiles[t].reset();
+    }
+  }
+
+  static real scalar(const Vector3 &v) {
+    return luminance(v);
+  }
+
+  static real scalar(real v) {
+    return v;
+  }
+
+  // Adds |n| samples with the given sum and luminance statistics to pixel
+  // (x, y)
+  void merge(int x, int y, const T &sum, int n, real mean_b, real m2_b) {
+    if (n == 0) {
+      return;
+    }
+    int n_a = counter[x][y];
+    real total = real(n_a + n);
+    real delta = mean_b - mean[x][y];
+    mean[x][y] += delta * n / total;
+    m2[x][y] += m2_b + delta * delta * n_a * n / total;
+    buffer[x][y] += sum;
+    counter[x][y] += n;
+  }
+
   Array2D<T> buffer;
   Array2D<int> counter;
+  Array2D<real> mean, m2;
+  Vector2i res;
+  int num_tiles = 0, num_tiles_y = 0;
+  std::unique_ptr<ThreadTiles> local;
+};
+
+// Lock-free sum of splats that may land anywhere on the image (e.g. light
+// paths connected to the camera), where thread-local tiles would grow into a
+// copy of the whole frame per thread. Channels are added with CAS loops.
+class SplatBuffer {
+ public:
+  SplatBuffer() {
+  }
+
+  SplatBuffer(Vector2i res)
+      : res(res), data(new std::atomic<real>[res[0] * res[1] * 3]) {
+    clear();
+  }
+
+  void clear() {
+    for (int i = 0; i < res[0] * res[1] * 3; i++) {
+      data[i].store(0, std::memory_order_relaxed);
+    }
+  }
+
+  void add(int x, int y, const Vector3 &val) {
+    std::atomic<real> *p = &data[(x * res[1] + y) * 3];
+    for (int k = 0; k < 3; k++) {
+      if (val[k] == 0) {
+        continue;
+      }
+      real old = p[k].load(std::memory_order_relaxed);
+      while (!p[k].compare_exchange_weak(old, old + val[k],
+                                         std::memory_order_relaxed)) {
+      }
+    }
+  }
+
+  Vector3 get(int x, int y) const {
+    const std::atomic<real> *p = &data[(x * res[1] + y) * 3];
+    return Vector3(p[0].load(std::memory_order_relaxed),
+                   p[1].load(std::memory_order_relaxed),
+                   p[2].load(std::memory_order_relaxed));
+  }
+
+  // Returns the sums multiplied by |scale|
+  Array2D<Vector3> get_scaled(real scale) const {
+    Array2D<Vector3> result(res);
+    for (int i = 0; i < res[0]; i++) {
+      for (int j = 0; j < res[1]; j++) {
+        result[i][j] = get(i, j) * scale;
+      }
+    }
+    return result;
+  }
+
+  TC_IO_DECL {
+    Array2D<Vector3> sums;
+    if (TC_SERIALIZER_IS(BinaryOutputSerializer)) {
+      sums = get_scaled(1.0_f);
+    }
+    TC_IO(sums);
+    if (TC_SERIALIZER_IS(BinaryInputSerializer)) {
+      auto self = const_cast<SplatBuffer *>(this);
+      *self = SplatBuffer(Vector2i(sums.get_width(), sums.get_height()));
+      for (int i = 0; i < res[0]; i++) {
+        for (int j = 0; j < res[1]; j++) {
+          self->add(i, j, sums[i][j]);
+        }
+      }
+    }
+  }
+
+ private:
   Vector2i res;
+  std::unique_ptr<std::atomic<real>[]> data;
 };
 
 TC_NAMESPACE_END
@@ -5,6 +5,7 @@
 
 #include "particle_visualization.h"
 #include <taichi/math/array_3d.h>
+#include <taichi/system/threading.h>
 
 TC_NAMESPACE_BEGIN
 
@@ -115,15 +116,187 @@ class ParticleShadowMapRenderer : public ParticleRenderer {
 
 TC_IMPLEMENTATION(ParticleRenderer, ParticleShadowMapRenderer, "shadow_map");
 
+// A binned point-splat rasterizer, for previews of millions of particles
+// (without shadows). The particles are projected in parallel, in chunks,
+// and binned by the screen tiles their splats cover; then every tile is
+// composited on its own, in parallel, as no other tile writes its pixels.
+// Splats are discs of |radius| pixels, and cover at least the pixel of
+// their particle. They are either composited back to front with their
+// alpha, as by shadow_map, or added (|additive|, e.g. for densities, which
+// needs no sorting).
+class ParticleSplatRenderer : public ParticleRenderer {
+ private:
+  int tile_size;
+  real radius;
+  real alpha;
+  bool additive;
+  int num_threads;
+
+  struct Splat {
+    // In pixels, and the distance along the camera direction
+    real u, v, depth;
+  };
+
+ public:
+  virtual void initialize(const Config &config) override {
+    tile_size = config.get("tile_size", 16);
+    radius = config.get("radius", 0.0_f);
+    alpha = config.get("alpha", 1.0_f);
+    additive = config.get("additive", false);
+    num_threads = config.get("num_threads", -1);
+    TC_ERROR_IF(tile_size <= 0, "tile_size must be positive");
+  }
+
+  virtual void render(
+      Array2D<Vector3> &buffer,
+      const std::vector<RenderParticle> &particles) const override {
+    if (particles.empty()) {
+      return;
+    }
+    TC_ASSERT(camera);
+    const int width = buffer.get_width(), height = buffer.get_height();
+    const int tiles_x = (width + tile_size - 1) / tile_size;
+    const int tiles_y = (height + tile_size - 1) / tile_size;
+    const int num_tiles = tiles_x * tiles_y;
+    const int n = (int)particles.size();
+    // At most 256 chunks, for the per-chunk tile counts
+    const int chunk_size = std::max(1 << 14, (n + 255) / 256);
+    const int num_chunks = (n + chunk_size - 1) / chunk_size;
+    const Vector3 origin = camera->get_origin(), dir = camera->get_dir();
+
+    std::vector<Splat> splats(n);
+    // The pixels and tiles covered by a splat; none if behind the camera
+    // or off the screen
+    auto get_pixels = [&](const Splat &s, Vector4i &pixels) {
+      if (s.depth <= 0 || s.u + radius < 0 || s.u - radius >= width ||
+          s.v + radius < 0 || s.v - radius >= height) {
+        return false;
+      }
+      pixels = Vector4i((int)std::floor(s.u - radius),
+                        (int)std::floor(s.v - radius),
+                        (int)std::floor(s.u + radius),
+                        (int)std::floor(s.v + radius));
+      pixels = Vector4i(std::max(pixels[0], 0), std::max(pixels[1], 0),
+                        std::min(pixels[2], width - 1),
+                        std::min(pixels[3], height - 1));
+      return pixels[0] <= pixels[2] && pixels[1] <= pixels[3];
+    };
+    // Per chunk and tile, the bins of the chunk in the tile, which are
+    // counted, then offset in |bins|, where they are in chunk order
+    std::vector<int> offsets((std::size_t)num_chunks * num_tiles, 0);
+    ThreadedTaskManager::run(num_chunks, num_threads, [&](int c) {
+      int *counts = &offsets[(std::size_t)c * num_tiles];
+      for (int i = c * chunk_size; i < std::min(n, (c + 1) * chunk_size);
+           i++) {
+        const Vector3 position = particles[i].position;
+        Splat &s = splats[i];
+        s.depth = dot(dir, position - origin);
+        if (s.depth > 0) {
+          camera->get_pixel_coordinate(normalized(position - origin), s.u,
+                                       s.v);
+          s.u *= width;
+          s.v *= height;
+        }
+        Vector4i pixels;
+        if (!get_pixels(s, pixels)) {
+          continue;
+        }
+        for (int x = pixels[0] / tile_size; x <= pixels[2] / tile_size; x++) {
+          for (int y = pixels[1] / tile_size; y <= pixels[3] / tile_size;
+               y++) {
+            counts[x * tiles_y + y]++;
+          }
+        }
+      }
+    });
+    std::vector<int> tile_begin(num_tiles + 1);
+    int total = 0;
+    for (int t = 0; t < num_tiles; t++) {
+      tile_begin[t] = total;
+      for (int c = 0; c < num_chunks; c++) {
+        int count = offsets[(std::size_t)c * num_tiles + t];
+        offsets[(std::size_t)c * num_tiles + t] = total;
+        total += count;
+      }
+    }
+    tile_begin[num_tiles] = total;
+    std::vector<int> bins(total);
+    ThreadedTaskManager::run(num_chunks, num_threads, [&](int c) {
+      int *next = &offsets[(std::size_t)c * num_tiles];
+      for (int i = c * chunk_size; i < std::min(n, (c + 1) * chunk_size);
+           i++) {
+        Vector4i pixels;
+        if (!get_pixels(splats[i], pixels)) {
+          continue;
+        }
+        for (int x = pixels[0] / tile_size; x <= pixels[2] / tile_size; x++) {
+          for (int y = pixels[1] / tile_size; y <= pixels[3] / tile_size;
+               y++) {
+            bins[next[x * tiles_y + y]++] = i;
+          }
+        }
+      }
+    });
+
+    const real radius2 = radius * radius;
+    ThreadedTaskManager::run(num_tiles, num_threads, [&](int t) {
+      int *begin = bins.data() + tile_begin[t];
+      int *end = bins.data() + tile_begin[t + 1];
+      if (begin == end) {
+        return;
+      }
+      if (!additive) {
+        // Back to front; the bins are in particle order for ties
+        std::stable_sort(begin, end, [&](int a, int b) {
+          return splats[a].depth > splats[b].depth;
+        });
+      }
+      const int x0 = t / tiles_y * tile_size, y0 = t % tiles_y * tile_size;
+      const int x1 = std::min(x0 + tile_size, width) - 1;
+      const int y1 = std::min(y0 + tile_size, height) - 1;
+      for (int *it = begin; it != end; it++) {
+        const Splat &s = splats[*it];
+        const Vector4 &color = particles[*it].color;
+        const Vector3 rgb(color.x, color.y, color.z);
+        const real a = color.w * alpha;
+        Vector4i pixels;
+        get_pixels(s, pixels);
+        // The pixel of the particle, covered by even the smallest discs
+        const int u = (int)std::floor(s.u), v = (int)std::floor(s.v);
+        for (int x = std::max(pixels[0], x0); x <= std::min(pixels[2], x1);
+             x++) {
+          for (int y = std::max(pixels[1], y0); y <= std::min(pixels[3], y1);
+               y++) {
+            if (sqr(x + 0.5_f - s.u) + sqr(y + 0.5_f - s.v) > radius2 &&
+                (x != u || y != v)) {
+              continue;
+            }
+            Vector3 &pixel = buffer[x][y];
+            if (additive) {
+              pixel += rgb * a;
+            } else {
+              pixel = lerp(a, pixel, rgb);
+            }
+          }
+        }
+      }
+    });
+  }
+};
+
+TC_IMPLEMENTATION(ParticleRenderer, ParticleSplatRenderer, "splat");
+
 std::shared_ptr<Texture> rasterize_render_particles(
     const Config &config,
-    const std::vector<RenderParticle> &particles) {
+    const RenderParticle *particles,
+    std::size_t num_particles) {
   Vector3i resolution = config.get<Vector3i>("resolution");
   Array3D<Vector4> array(resolution, Vector4(0));
   auto kernel = [](const Vector3 &d) {
     return std::abs(d.x) * std::abs(d.y) * std::abs(d.z);
   };
-  for (auto const &p : particles) {
+  for (std::size_t i = 0; i < num_particles; i++) {
+    const RenderParticle &p = particles[i];
     const Vector3 pos = p.position + 0.5_f * resolution.cast<real>();
     for (auto &ind : array.get_rasterization_region(pos, 1)) {
       Vector4 color(p.color.x, p.color.y, p.color.z, 1.0_f);
@@ -30,6 +30,15 @@ struct RenderParticle {
   }
 };
 
+// Serialized as its two vectors, between which there is no padding
+template <>
+struct is_bytewise_serializable<RenderParticle>
+    : std::integral_constant<bool,
+                             is_bytewise_serializable<Vector3>::value &&
+                                 is_bytewise_serializable<Vector4>::value &&
+                                 sizeof(RenderParticle) ==
+                                     sizeof(Vector3) + sizeof(Vector4)> {};
+
 class ParticleRenderer {
  protected:
   std::shared_ptr<Camera> camera;
@@ -48,7 +57,15 @@ class ParticleRenderer {
 
 std::shared_ptr<Texture> rasterize_render_particles(
     const Config &config,
-    const std::vector<RenderParticle> &particles);
+    const RenderParticle *particles,
+    std::size_t num_particles);
+
+inline std::shared_ptr<Texture> rasterize_render_particles(
+    const Config &config,
+    const std::vector<RenderParticle> &particles) {
+  return rasterize_render_particles(config, particles.data(),
+                                    particles.size());
+}
 
 TC_INTERFACE(ParticleRenderer)
 
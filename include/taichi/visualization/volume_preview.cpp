@@ -0,0 +1,184 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#include "volume_preview.h"
+#include <taichi/system/threading.h>
+
+TC_NAMESPACE_BEGIN
+
+void VolumePreview::set_volume(const Array3D<real> &density,
+                               const Array3D<real> *emission) {
+  TC_ERROR_IF(emission && emission->get_res() != density.get_res(),
+              "The emission field of a preview has the shape of its density");
+  this->density = &density;
+  this->emission = emission;
+  pyramid.clear();
+  Vector3i res = density.get_res();
+  Level level;
+  level.res = (res + Vector3i(brick_size - 1)) / Vector3i(brick_size);
+  level.size = brick_size;
+  level.ranges.resize(level.res.x * level.res.y * level.res.z);
+  ThreadedTaskManager::run(level.res.x, num_threads, [&](int bx) {
+    for (int by = 0; by < level.res.y; by++) {
+      for (int bz = 0; bz < level.res.z; bz++) {
+        Vector3i brick(bx, by, bz);
+        // Samples in the brick interpolate the cells one beyond it
+        Vector3i begin = max(brick * brick_size - Vector3i(1), Vector3i(0)),
+                 end = min((brick + Vector3i(1)) * brick_size + Vector3i(1),
+                           res);
+        Range range{density[begin], density[begin], 0, 0};
+        if (emission) {
+          range.emission_min = range.emission_max = (*emission)[begin];
+        }
+        for (int i = begin.x; i < end.x; i++) {
+          for (int j = begin.y; j < end.y; j++) {
+            for (int k = begin.z; k < end.z; k++) {
+              real d = density[i][j][k];
+              range.density_min = std::min(range.density_min, d);
+              range.density_max = std::max(range.density_max, d);
+              if (emission) {
+                real e = (*emission)[i][j][k];
+                range.emission_min = std::min(range.emission_min, e);
+                range.emission_max = std::max(range.emission_max, e);
+              }
+            }
+          }
+        }
+        level.ranges[(bx * level.res.y + by) * level.res.z + bz] = range;
+      }
+    }
+  });
+  pyramid.push_back(std::move(level));
+  while (pyramid.back().res.max() > 1) {
+    const Level &fine = pyramid.back();
+    Level coarse;
+    coarse.res = (fine.res + Vector3i(1)) / Vector3i(2);
+    coarse.size = fine.size * 2;
+    coarse.ranges.resize(coarse.res.x * coarse.res.y * coarse.res.z);
+    for (int bx = 0; bx < coarse.res.x; bx++) {
+      for (int by = 0; by < coarse.res.y; by++) {
+        for (int bz = 0; bz < coarse.res.z; bz++) {
+          Vector3i brick(bx, by, bz);
+          Range range = fine.get(brick * 2);
+          for (int c = 1; c < 8; c++) {
+            Vector3i child =
+                brick * 2 + Vector3i(c >> 2, (c >> 1) & 1, c & 1);
+            if (child.x >= fine.res.x || child.y >= fine.res.y ||
+                child.z >= fine.res.z) {
+              continue;
+            }
+            const Range &r = fine.get(child);
+            range.density_min = std::min(range.density_min, r.density_min);
+            range.density_max = std::max(range.density_max, r.density_max);
+            range.emission_min =
+                std::min(range.emission_min, r.emission_min);
+            range.emission_max =
+                std::max(range.emission_max, r.emission_max);
+          }
+          coarse.ranges[(bx * coarse.res.y + by) * coarse.res.z + bz] =
+              range;
+        }
+      }
+    }
+    pyramid.push_back(std::move(coarse));
+  }
+}
+
+Vector3 VolumePreview::trace(const Vector3 &origin, int axis) const {
+  Vector3i res = density->get_res();
+  int depth = res[axis];
+  Vector3 color(0.0_f);
+  real transmittance = 1.0_f;
+  // Through |length| cells of constant density and emission; the steps of
+  // a sample per cell telescope to the same segment
+  auto integrate = [&](real d, real e, real length) {
+    Vector3 radiance = density_color * d + emission_color * e;
+    real a = absorption * std::max(d, 0.0_f);
+    if (a > 0) {
+      real opacity = -std::expm1(-a * length);
+      color += transmittance * opacity / a * radiance;
+      transmittance *= 1.0_f - opacity;
+    } else {
+      color += transmittance * length * radiance;
+    }
+  };
+  Vector3 pos = origin;
+  Vector3i cell;
+  for (int i = 0; i < 3; i++) {
+    cell[i] = clamp((int)pos[i], 0, res[i] - 1);
+  }
+  int s = 0;
+  while (s < depth && transmittance >= min_transmittance) {
+    cell[axis] = s;
+    // The coarsest constant brick with the sample, or the non-constant
+    // brick of level 0
+    int l = (int)pyramid.size() - 1;
+    Vector3i brick;
+    for (; l >= 0; l--) {
+      brick = cell / Vector3i(pyramid[l].size);
+      if (pyramid[l].get(brick).is_constant()) {
+        break;
+      }
+    }
+    if (l >= 0) {
+      const Range &range = pyramid[l].get(brick);
+      int end = std::min(depth, (brick[axis] + 1) * pyramid[l].size);
+      integrate(range.density_min, range.emission_min, (real)(end - s));
+      s = end;
+      continue;
+    }
+    int end = std::min(depth, (brick[axis] + 1) * brick_size);
+    for (; s < end && transmittance >= min_transmittance; s++) {
+      pos[axis] = s + 0.5_f;
+      integrate(density->sample(pos), emission ? emission->sample(pos) : 0,
+                1.0_f);
+    }
+  }
+  return color;
+}
+
+void VolumePreview::render(Array2D<Vector3> &buffer,
+                           Vector2i lower,
+                           Vector2i upper,
+                           int axis) const {
+  TC_ERROR_IF(density == nullptr, "Previews need set_volume() first");
+  TC_ERROR_IF(downsample < 1, "Previews need downsample >= 1 instead of {}",
+              downsample);
+  Vector2i size = upper - lower;
+  if (size.x <= 0 || size.y <= 0) {
+    return;
+  }
+  Vector3i res = density->get_res();
+  int axis_x = axis == 0 ? 1 : 0, axis_y = axis == 2 ? 1 : 2;
+  Vector2i blocks = (size + Vector2i(downsample - 1)) / Vector2i(downsample);
+  constexpr int tile_size = 16;
+  Vector2i tiles = (blocks + Vector2i(tile_size - 1)) / Vector2i(tile_size);
+  ThreadedTaskManager::run(tiles.x * tiles.y, num_threads, [&](int t) {
+    Vector2i tile(t % tiles.x, t / tiles.x);
+    Vector2i begin = tile * tile_size,
+             end = min(begin + Vector2i(tile_size), blocks);
+    for (int bi = begin.x; bi < end.x; bi++) {
+      for (int bj = begin.y; bj < end.y; bj++) {
+        // Through the center of the block, cut at the edges of the view
+        Vector2i p0 = Vector2i(bi, bj) * downsample,
+                 p1 = min(p0 + Vector2i(downsample), size);
+        Vector3 origin(0.0_f);
+        origin[axis_x] = (p0.x + p1.x) * 0.5_f / size.x * res[axis_x];
+        origin[axis_y] = (p0.y + p1.y) * 0.5_f / size.y * res[axis_y];
+        Vector3 color = trace(origin, axis);
+        for (int c = 0; c < 3; c++) {
+          color[c] = clamp(color[c], 0.0_f, 1.0_f);
+        }
+        for (int i = p0.x; i < p1.x; i++) {
+          for (int j = p0.y; j < p1.y; j++) {
+            buffer[lower.x + i][lower.y + j] = color;
+          }
+        }
+      }
+    }
+  });
+}
+
+TC_NAMESPACE_END
@@ -0,0 +1,78 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+#include <taichi/math/array_3d.h>
+#include <taichi/visualization/image_buffer.h>
+
+#include <vector>
+
+TC_NAMESPACE_BEGIN
+
+// Ray-marched previews of the cell fields of 3D simulations, e.g. the smoke
+// density: orthographic views along an axis, integrating emission and
+// absorption front to back with a sample per cell. Regions where the fields
+// are constant, empty space in particular, are crossed in one step, found
+// through a min/max pyramid of bricks; rays stop once nearly opaque, and
+// tiles of pixels are rendered in parallel.
+class VolumePreview {
+ public:
+  // Per cell of ray and unit of density, the absorption; per cell of ray
+  // and unit of density or emission, the radiance emitted
+  real absorption = 1.0_f;
+  Vector3 density_color = Vector3(1.0_f);
+  Vector3 emission_color = Vector3(0.0_f);
+  // Rays stop once their transmittance drops below this
+  real min_transmittance = 1e-3_f;
+  // A ray per block of downsample x downsample pixels, for faster previews
+  // at a reduced resolution
+  int downsample = 1;
+  int num_threads = -1;
+
+  // The fields of the next renders, which must outlive them; |emission|
+  // (optional) has the shape of |density|
+  void set_volume(const Array3D<real> &density,
+                  const Array3D<real> *emission = nullptr);
+
+  // The view along +axis, in the pixels [lower, upper) of |buffer|; the
+  // other two axes, in order, are those of the image. Channels are clamped
+  // to [0, 1].
+  void render(Array2D<Vector3> &buffer,
+              Vector2i lower,
+              Vector2i upper,
+              int axis) const;
+
+ private:
+  struct Range {
+    real density_min, density_max, emission_min, emission_max;
+
+    bool is_constant() const {
+      return density_min == density_max && emission_min == emission_max;
+    }
+  };
+
+  // Bricks of brick_size^3 cells at level 0, of twice the edge at each
+  // level above; their ranges cover the cells trilinear samples in them
+  // read
+  static constexpr int brick_size = 8;
+  struct Level {
+    Vector3i res;
+    int size;
+    std::vector<Range> ranges;
+
+    const Range &get(const Vector3i &brick) const {
+      return ranges[(brick.x * res.y + brick.y) * res.z + brick.z];
+    }
+  };
+
+  Vector3 trace(const Vector3 &origin, int axis) const;
+
+  const Array3D<real> *density = nullptr;
+  const Array3D<real> *emission = nullptr;
+  std::vector<Level> pyramid;
+};
+
+TC_NAMESPACE_END
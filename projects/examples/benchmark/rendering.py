@@ -0,0 +1,35 @@
+import sys
+
+import taichi as tc
+from taichi.misc.settings import get_num_cores
+
+# Renderer throughput on the reference scenes of the 'renderer' benchmark.
+# Usage: rendering.py [results.json [baseline.json]]
+renderers = ['pt', 'bdpt', 'vcm', 'sppm', 'pssmlt', 'ups']
+scenes = ['cornell_box', 'glossy_interior', 'caustics', 'volumetric_block']
+
+if __name__ == '__main__':
+  results = {}
+  for renderer in renderers:
+    for scene in scenes:
+      for num_threads in sorted({1, get_num_cores()}):
+        benchmark = tc.system.Benchmark(
+            'renderer',
+            renderer=renderer,
+            scene=scene,
+            res=(256, 256),
+            num_threads=num_threads,
+            warm_up_iterations=2,
+            trials=5,
+            timing='time')
+        stats = benchmark.run_trials(2)
+        name = '%s_%s_%dt' % (renderer, scene, num_threads)
+        print('%-40s %8.3f Mrays/s %8.3f Msamples/s' %
+              (name, stats.metrics['rays_per_second'] * 1e-6,
+               stats.metrics['samples_per_second'] * 1e-6))
+        results[name] = stats
+  if len(sys.argv) > 1:
+    tc.system.save_benchmark_results(results, sys.argv[1])
+  if len(sys.argv) > 2:
+    regressions = tc.system.compare_with_baseline(results, sys.argv[2])
+    sys.exit(1 if regressions else 0)
@@ -0,0 +1,94 @@
+import sys
+
+import taichi as tc
+from taichi.misc.settings import get_num_cores
+
+# Strong and weak scaling of the simulation benchmarks over thread counts.
+# Strong scaling keeps the problem size; weak scaling grows it with the
+# number of threads, so that each thread keeps the cells (or particles) of
+# the single-threaded run.
+# Usage: simulation.py [results.json [baseline.json]]
+
+# name: (benchmark, config, size key, dimensions of the size, the
+# throughput metric)
+benchmarks = {
+    'poisson_3d_mgpcg': ('poisson_3d', dict(solver='mgpcg'), 'res', 3,
+                         'cells_per_second'),
+    'poisson_3d_mg': ('poisson_3d', dict(solver='mg'), 'res', 3,
+                      'cells_per_second'),
+    'poisson_2d_mgpcg': ('poisson_2d', dict(solver='mgpcg'), 'res', 2,
+                         'cells_per_second'),
+    'poisson_3d_spectral': ('poisson_3d', dict(solver='spectral'), 'res', 3,
+                            'cells_per_second'),
+    'smoke_3d': ('smoke_3d', dict(), 'res', 3, 'cells_per_second'),
+    'nbody': ('nbody', dict(), 'num_particles', 1, 'particles_per_second'),
+    'apic_liquid': ('fluid_2d', dict(simulator='apic_liquid'), 'res', 2,
+                    'cells_per_second'),
+}
+
+base_sizes = {
+    'res': {
+        2: 256,
+        3: 64
+    },
+    'num_particles': {
+        1: 65536
+    },
+}
+
+
+def get_thread_counts():
+  counts = []
+  n = 1
+  while n < get_num_cores():
+    counts.append(n)
+    n *= 2
+  return counts + [get_num_cores()]
+
+
+def run(name, num_threads, scale):
+  benchmark, config, size_key, dim, metric = benchmarks[name]
+  size = int(round(base_sizes[size_key][dim] * scale**(1.0 / dim)))
+  if size_key == 'res':
+    size = (size,) * dim
+  config = dict(config)
+  config[size_key] = size
+  b = tc.system.Benchmark(
+      benchmark,
+      num_threads=num_threads,
+      warm_up_iterations=1,
+      trials=5,
+      timing='time',
+      **config)
+  stats = b.run_trials(2)
+  return stats, stats.metrics[metric]
+
+
+if __name__ == '__main__':
+  results = {}
+  for name in sorted(benchmarks):
+    print(name)
+    print('  %8s %14s %10s %14s %10s' % ('threads', 'strong', 'efficiency',
+                                         'weak', 'efficiency'))
+    strong_base, weak_base = None, None
+    for num_threads in get_thread_counts():
+      strong, strong_throughput = run(name, num_threads, 1)
+      weak, weak_throughput = run(name, num_threads, num_threads)
+      if strong_base is None:
+        strong_base, weak_base = strong_throughput, weak_throughput
+      # Ideal scaling multiplies the throughput by the number of threads
+      print('  %8d %14.4g %9.1f%% %14.4g %9.1f%%' %
+            (num_threads, strong_throughput,
+             100 * strong_throughput / (strong_base * num_threads),
+             weak_throughput,
+             100 * weak_throughput / (weak_base * num_threads)))
+      results['%s_strong_%dt' % (name, num_threads)] = strong
+      results['%s_weak_%dt' % (name, num_threads)] = weak
+    for key in ['iterations', 'bytes_per_cell', 'bandwidth']:
+      if key in strong.metrics:
+        print('  %s: %.4g' % (key, strong.metrics[key]))
+  if len(sys.argv) > 1:
+    tc.system.save_benchmark_results(results, sys.argv[1])
+  if len(sys.argv) > 2:
+    regressions = tc.system.compare_with_baseline(results, sys.argv[2])
+    sys.exit(1 if regressions else 0)
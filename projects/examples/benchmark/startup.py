@@ -0,0 +1,42 @@
+import subprocess
+import sys
+import time
+'''
+Startup time of short-lived workers: `import taichi` (Python setup and
+loading the core library, including its static registration of units), and
+the first create_instance, each in fresh processes.
+
+Usage: python3 startup.py [runs] [-X importtime]
+'''
+
+stages = [
+    ('import', 'import taichi'),
+    ('import + create_instance',
+     'import taichi as tc; tc.core.create_benchmark("matrix4s")'),
+]
+
+
+def time_process(code, extra_args):
+  t = time.time()
+  subprocess.check_call([sys.executable] + extra_args + ['-c', code],
+                        stdout=subprocess.DEVNULL)
+  return time.time() - t
+
+
+if __name__ == '__main__':
+  runs = 10
+  extra_args = []
+  for arg in sys.argv[1:]:
+    if arg.isdigit():
+      runs = int(arg)
+    else:
+      # e.g. -X importtime, for the time spent in each imported module
+      extra_args.append(arg)
+  if extra_args:
+    runs = 1
+  # The first run also warms the file system cache
+  time_process(stages[0][1], [])
+  for name, code in stages:
+    times = sorted(time_process(code, extra_args) for i in range(runs))
+    print('%-26s median %7.3f s  min %7.3f s' %
+          (name, times[len(times) // 2], times[0]))
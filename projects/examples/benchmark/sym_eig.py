@@ -0,0 +1,22 @@
+import sys
+
+import taichi as tc
+
+# Usage: sym_eig.py [results.json [baseline.json]]
+if __name__ == '__main__':
+  workload = 100000
+  results = {}
+  for batched in [False, True]:
+    benchmark = tc.system.Benchmark(
+        'sym_eig', workload=workload, batched=batched, trials=20, pin_to_cpu=0)
+    assert benchmark.test()
+    stats = benchmark.run_trials(10)
+    name = 'sym_eig_batched' if batched else 'sym_eig_per_matrix'
+    print('%-18s median %.3f  p95 %.3f  stddev %.3f %s' %
+          (name, stats.median, stats.p95, stats.stddev, stats.unit))
+    results[name] = stats
+  if len(sys.argv) > 1:
+    tc.system.save_benchmark_results(results, sys.argv[1])
+  if len(sys.argv) > 2:
+    regressions = tc.system.compare_with_baseline(results, sys.argv[2])
+    sys.exit(1 if regressions else 0)
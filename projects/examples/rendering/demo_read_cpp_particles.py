@@ -80,8 +80,11 @@ def create_volumetric_block():
   fn = 'particles.bin'  # or your file name...
   import os
   print(os.getcwd())
-  particles = tc.core.RenderParticles()
-  assert particles.read(fn)
+  # Viewed in the mapped file, without reading it into a copy; for frame
+  # sequences, tc.core.RenderParticleFrames('frames/{:04d}.bin').get(frame)
+  # also reads the next frame in meanwhile
+  particles = tc.core.MappedRenderParticles(fn)
+  assert particles.is_valid()
   # pls. use the same resolution as in the .bin file...
   res = (128, 128, 64)
   # 5 is the density
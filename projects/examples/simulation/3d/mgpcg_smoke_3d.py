@@ -51,7 +51,7 @@ if __name__ == '__main__':
         temperature=tc.Texture('const', value=(1, 0, 0, 0)),
         initial_velocity=tc.Texture('const', value=(0, 100, 0, 0)))
     smoke.step(0.03)
-    particles = smoke.c.get_render_particles()
+    particles = smoke.c.get_render_particles_view()
     width, height = 512, 1024
     image_buffer = tc.core.Array2DVector3(
         Vectori(width, height), Vector(0, 0, 0.0))
@@ -4,6 +4,8 @@ import os
 import shutil
 import sys
 import ctypes
+import importlib
+import importlib.util
 import subprocess
 
 if sys.version_info[0] < 3 or sys.version_info[1] < 5:
@@ -11,10 +13,7 @@ if sys.version_info[0] < 3 or sys.version_info[1] < 5:
   print("Current version:", sys.version_info)
   exit(-1)
 
-try:
-  import pip
-except Exception as e:
-  print(e)
+if importlib.util.find_spec('pip') is None:
   print('  Please install pip3.')
   print('    [Ubuntu] sudo apt-get install python-pip3')
   print('    [Arch Linux] sudo pacman -S python-pip')
@@ -37,9 +36,16 @@ def is_release():
   return not os.path.exists(os.path.join(package_root() + '../CMakeLists.txt'))
 
 def install_package(pkg):
+  import pip
   pip.main(['install', '--user', pkg])
 
 
+def is_package_installed(import_name):
+  # Locating the package is enough; importing scipy, PyQt5, flask... here
+  # would dominate the startup time of taichi
+  return importlib.util.find_spec(import_name) is not None
+
+
 def check_for_packages():
   for pkg in required_packages:
     if isinstance(pkg, tuple):
@@ -48,12 +54,11 @@ def check_for_packages():
     else:
       import_name = pkg
 
-    try:
-      exec('import {}'.format(import_name))
-    except ImportError as e:
+    if not is_package_installed(import_name):
       print("Installing package:", pkg)
       install_package(pkg)
       print('Checking installation of "{}"'.format(import_name))
+      importlib.invalidate_caches()
       exec('import {}'.format(import_name))
 
 
@@ -191,6 +196,9 @@ def build():
   if is_ci():
     print('  Note: building for CI. SIMD disabled.')
     flags += ' -DTC_DISABLE_SIMD:BOOL=1'
+  if os.environ.get('TC_PORTABLE', '0') != '0':
+    print('  Note: portable build for AVX2 and AVX-512 machines.')
+    flags += ' -DTC_PORTABLE:BOOL=1'
   if get_os_name() == 'win':
     flags += ' -G "Visual Studio 15 Win64"'
   cmake_ret = os.system('cmake .. ' + flags)
@@ -342,23 +350,9 @@ def at_startup():
 
 
 def start_memory_monitoring(output_fn, pid=-1, interval=1):
-  import os, psutil, time
-  if pid == -1:
-    pid = os.getpid()
-  import multiprocessing
-  def task():
-    with open(output_fn, 'w') as f:
-      process = psutil.Process(pid)
-      while True:
-        try:
-          mem = process.memory_info().rss
-        except:
-          mem = -1
-        time.sleep(interval)
-        print(time.time(), mem, file=f)
-        f.flush()
-  proc = multiprocessing.Process(target=task, daemon=True)
-  proc.start()
+  """Appends 'time rss' lines to |output_fn| every |interval| seconds, from a
+  native thread"""
+  tc_core.start_memory_monitoring(output_fn, pid, interval)
 
 
 @atexit.register
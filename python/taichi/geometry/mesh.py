@@ -4,17 +4,24 @@ import taichi as tc
 from taichi.misc.util import *
 
 
-def create_mesh_from_functions(res, surface, normal=None, uv=None, smooth=True):
+# indexed: a MeshData of shared vertices for Mesh, instead of triangles
+def create_mesh_from_functions(res,
+                               surface,
+                               normal=None,
+                               uv=None,
+                               smooth=True,
+                               indexed=False):
   surface = tc.core.function23_from_py_obj(surface)
   if normal:
     normal = tc.core.function23_from_py_obj(normal)
   else:
     normal = None
   if uv:
-    uv = tc.core.function22_from_py_obj
+    uv = tc.core.function22_from_py_obj(uv)
   else:
     uv = None
-  return tc.core.generate_mesh(Vectori(res), surface, normal, uv, smooth)
+  generate = tc.core.generate_mesh_data if indexed else tc.core.generate_mesh
+  return generate(Vectori(res), surface, normal, uv, smooth)
 
 
 def create_sphere(res=(60, 60), smooth=True):
@@ -30,21 +30,17 @@ def get_unique_task_id():
 
 import copy
 import numpy as np
-import ctypes
 
 
 def config_from_dict(args):
   from taichi.core import tc_core
   from taichi.visual import SurfaceMaterial
+  # Numbers, strings, vectors, tuples and nested dicts are converted to typed
+  # values in C++; anything else to its string
   d = copy.copy(args)
   for k in d:
     if isinstance(d[k], SurfaceMaterial):
       d[k] = d[k].id
-    if isinstance(d[k], tc_core.Vector2f):
-      d[k] = '({}, {})'.format(d[k].x, d[k].y)
-    if isinstance(d[k], tc_core.Vector3f):
-      d[k] = '({}, {}, {})'.format(d[k].x, d[k].y, d[k].z)
-    d[k] = str(d[k])
   return tc_core.config_from_dict(d)
 
 
@@ -146,8 +142,8 @@ def array2d_to_image(arr,
         arr, tc_core.Array2DVector4)
   import pyglet
   rasterized = arr.rasterize(width, height)
-  raw_data = np.empty((width, height, arr.get_channels()), dtype=np.float32)
-  rasterized.to_ndarray(raw_data.ctypes.data_as(ctypes.c_void_p).value)
+  raw_data = rasterized.to_ndarray().reshape(
+      (width, height, arr.get_channels()))
   if transform == 'levelset':
     raw_data = (raw_data <= 0).astype(np.float32)
   else:
@@ -177,9 +173,7 @@ def array2d_to_image(arr,
 
 def image_buffer_to_image(arr):
   import pyglet
-  raw_data = np.empty(
-      (arr.get_width() * arr.get_height() * 3,), dtype='float32')
-  arr.to_ndarray(raw_data.ctypes.data_as(ctypes.c_void_p).value)
+  raw_data = arr.to_ndarray().reshape((arr.get_width() * arr.get_height() * 3,))
   dat = (raw_data * 255.0).astype('uint8')
   dat.reshape((len(raw_data) / 3, 3))
   data_string = dat.tostring()
@@ -188,13 +182,15 @@ def image_buffer_to_image(arr):
   return image_data
 
 
-def image_buffer_to_ndarray(arr, bgr=False):
+# With copy=False, a view of the cells of arr that is valid while arr is not
+# reinitialized
+def image_buffer_to_ndarray(arr, bgr=False, copy=True):
   channels = arr.get_channels()
-  raw_data = np.empty(
-      (arr.get_width() * arr.get_height() * channels,), dtype='float32')
-  arr.to_ndarray(raw_data.ctypes.data_as(ctypes.c_void_p).value)
-  dat = raw_data.astype('float32')
-  ret = dat.reshape((arr.get_width(), arr.get_height(), channels))
+  if copy:
+    ret = arr.to_ndarray()
+  else:
+    ret = np.asarray(arr)
+  ret = ret.reshape((arr.get_width(), arr.get_height(), channels))
   if bgr:
     ret = ret[:, :, ::-1]
   return ret
@@ -236,10 +232,7 @@ def save_image(fn, img):
 
 def ndarray_to_array2d(array):
   if array.dtype == np.uint8:
-    array = (array * (1 / 255.0)).astype(np.float32)
-  assert array.dtype == np.float32
-  array = array.copy()
-  input_ptr = array.ctypes.data_as(ctypes.c_void_p).value
+    array = array * (1 / 255.0)
   if len(array.shape) == 2 or array.shape[2] == 1:
     arr = taichi.core.Array2Dreal(Vectori(0, 0))
   elif array.shape[2] == 3:
@@ -248,22 +241,20 @@ def ndarray_to_array2d(array):
     arr = taichi.core.Array2DVector4(Vectori(0, 0), taichi.Vector(0, 0, 0, 0))
   else:
     assert False, 'ndarray has to be n*m, n*m*3, or n*m*4'
-  arr.from_ndarray(input_ptr, array.shape[0], array.shape[1])
+  arr.from_ndarray(array)
   return arr
 
 
-def array2d_to_ndarray(arr):
-  if isinstance(arr, taichi.core.Array2DVector3):
-    ndarray = np.empty((arr.get_width(), arr.get_height(), 3), dtype='float32')
-  elif isinstance(arr, taichi.core.Array2DVector4):
-    ndarray = np.empty((arr.get_width(), arr.get_height(), 4), dtype='float32')
-  elif isinstance(arr, taichi.core.Array2Dreal):
-    ndarray = np.empty((arr.get_width(), arr.get_height()), dtype='float32')
-  else:
-    assert False, 'Array2d must have type real, Vector3, or Vector4'
-  output_ptr = ndarray.ctypes.data_as(ctypes.c_void_p).value
-  arr.to_ndarray(output_ptr)
-  return ndarray
+# With copy=False, a view of the cells of arr that is valid while arr is not
+# reinitialized
+def array2d_to_ndarray(arr, copy=True):
+  types = (taichi.core.Array2DVector3, taichi.core.Array2DVector4,
+           taichi.core.Array2Dreal)
+  assert isinstance(arr,
+                    types), 'Array2d must have type real, Vector3, or Vector4'
+  if copy:
+    return arr.to_ndarray()
+  return np.asarray(arr)
 
 
 def opencv_img_to_taichi_img(img):
@@ -406,6 +397,9 @@ def duplicate_stdout_to_file(fn):
   
 def set_logging_level(level):
   taichi.core.set_logging_level(level)
+
+def set_logging_async(on=True):
+  taichi.core.set_logging_async(on)
   
 def set_gdb_trigger(on=True):
   taichi.core.set_core_trigger_gdb_when_crash(on)
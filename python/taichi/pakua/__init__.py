@@ -1 +1,4 @@
-from .server import get_pakua_server
\ No newline at end of file
+def get_pakua_server():
+  # Flask is imported on first use only, to keep `import taichi` fast
+  from .server import get_pakua_server
+  return get_pakua_server()
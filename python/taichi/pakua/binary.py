@@ -0,0 +1,47 @@
+import struct
+import zlib
+
+import numpy as np
+
+# Reader of the frames of the 'binary' Pakua, see binary_pakua.cpp
+FRAME_HEADER = struct.Struct('<IIII')
+BUFFER_HEADER = struct.Struct('<24sIIQQ')
+MAGIC = 0x4b504354
+VERSION = 1
+
+
+def read_exactly(f, size):
+  data = b''
+  while len(data) < size:
+    chunk = f.read(size - len(data))
+    if not chunk:
+      return None
+    data += chunk
+  return data
+
+
+# Reads the next frame from a file or socket file object (socket.makefile
+# ('rb')), as (frame id, {buffer name: numpy array}), or None at the end
+def read_frame(f):
+  header = read_exactly(f, FRAME_HEADER.size)
+  if header is None:
+    return None
+  magic, version, frame, num_buffers = FRAME_HEADER.unpack(header)
+  assert magic == MAGIC, 'Not a Pakua frame'
+  assert version == VERSION, 'Pakua frame version %d unsupported' % version
+  buffers = {}
+  for i in range(num_buffers):
+    name, type, compressed, num_elements, num_bytes = BUFFER_HEADER.unpack(
+        read_exactly(f, BUFFER_HEADER.size))
+    data = read_exactly(f, num_bytes)
+    if compressed:
+      data = zlib.decompress(data)
+    dtype = np.int32 if type == 1 else np.float32
+    array = np.frombuffer(data, dtype=dtype, count=num_elements)
+    buffers[name.rstrip(b'\0').decode()] = array
+  return frame, buffers
+
+
+def read_frame_file(fn):
+  with open(fn, 'rb') as f:
+    return read_frame(f)
@@ -1,5 +1,15 @@
 from .unit_watcher import UnitWatcher
-from .benchmark import Benchmark
-from .daemon import start
+from .benchmark import Benchmark, save_benchmark_results, compare_with_baseline
+from .statistics import get_statistics, clear_statistics
 
-__all__ = ['UnitWatcher', 'Benchmark', 'start']
\ No newline at end of file
+
+def start(master=False):
+  # The daemon needs flask and requests, imported on first use only
+  from .daemon import start
+  start(master)
+
+
+__all__ = [
+    'UnitWatcher', 'Benchmark', 'save_benchmark_results',
+    'compare_with_baseline', 'start', 'get_statistics', 'clear_statistics'
+]
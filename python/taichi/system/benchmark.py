@@ -1,5 +1,44 @@
+import json
+
 from taichi.core import unit
 
+
 @unit("benchmark")
 class Benchmark:
   pass
+
+
+def save_benchmark_results(results, filename):
+  """Writes {name: BenchmarkStatistics} as JSON."""
+  with open(filename, 'w') as f:
+    json.dump({name: json.loads(stats.to_json())
+               for name, stats in results.items()}, f, indent=2)
+
+
+def compare_with_baseline(results, baseline_filename, tolerance=0.05):
+  """Compares the medians of {name: BenchmarkStatistics} with those saved by
+  save_benchmark_results, and returns the names slower than the baseline by
+  more than |tolerance| (relative) and by more than the baseline's spread,
+  the difference between its p95 and median."""
+  with open(baseline_filename) as f:
+    baseline = json.load(f)
+  regressions = []
+  for name, stats in sorted(results.items()):
+    if name not in baseline:
+      print('%-30s %12.4g %s (no baseline)' % (name, stats.median, stats.unit))
+      continue
+    base = baseline[name]
+    if base['unit'] != stats.unit:
+      print('%-30s unit %s differs from baseline %s' %
+            (name, stats.unit, base['unit']))
+      continue
+    ratio = stats.median / base['median']
+    spread = base['p95'] - base['median']
+    regressed = (ratio > 1 + tolerance and
+                 stats.median - base['median'] > spread)
+    print('%-30s %12.4g -> %12.4g %s (%+.1f%%)%s' %
+          (name, base['median'], stats.median, stats.unit,
+           (ratio - 1) * 100, ' REGRESSION' if regressed else ''))
+    if regressed:
+      regressions.append(name)
+  return regressions
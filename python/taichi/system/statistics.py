@@ -0,0 +1,30 @@
+import taichi as tc
+
+# Ratios of counters, added by get_statistics when their counters are there
+derived_statistics = {
+    'average_path_length': ('path_vertices', 'paths'),
+    'russian_roulette_rate': ('russian_roulette_terminations', 'paths'),
+    'shadow_rays_per_ray': ('shadow_rays', 'rays'),
+    'entries_per_hash_grid_value': ('hash_grid_entries', 'hash_grid_values'),
+}
+
+
+def get_statistics(clear=False):
+  """The counters of all threads, e.g. after a render stage or a simulation
+  step, as {name: count}, with the derived_statistics ratios and the peak
+  resident bytes of the memory phases as 'peak_memory/<phase>'. With
+  |clear|, the counters restart from 0 afterwards."""
+  stats = dict(tc.core.get_statistics())
+  for name, peak in tc.core.get_memory_phase_peaks().items():
+    stats['peak_memory/' + name] = peak
+  if clear:
+    clear_statistics()
+  for name, (num, den) in derived_statistics.items():
+    if stats.get(den, 0) > 0 and num in stats:
+      stats[name] = float(stats[num]) / stats[den]
+  return stats
+
+
+def clear_statistics():
+  tc.core.clear_statistics()
+  tc.core.clear_memory_phase_peaks()
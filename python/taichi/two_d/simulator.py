@@ -94,10 +94,7 @@ class Simulator(object):
 
   @staticmethod
   def config_from_dict(dict):
-    d = copy.deepcopy(dict)
-    for k in d:
-      d[k] = str(d[k])
-    return tc.misc.util.config_from_dict(d)
+    return tc.misc.util.config_from_dict(dict)
 
   def get_background_image(self, width, height):
     return None
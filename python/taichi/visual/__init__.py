@@ -9,9 +9,11 @@ from .texture import Texture
 from .color import color255
 from .image_reader import ImageReader
 from . import post_process
+from . import distributed
 
 __all__ = [
     'Camera', 'Renderer', 'VolumeMaterial', 'SurfaceMaterial', 'Scene', 'Mesh',
-    'EnvironmentMap', 'Texture', 'post_process', 'color255', 'ImageReader',
+    'EnvironmentMap', 'Texture', 'post_process', 'distributed', 'color255',
+    'ImageReader',
     'create_volumetric_block'
 ]
@@ -0,0 +1,59 @@
+from taichi.misc.util import *
+
+import multiprocessing
+
+from taichi.core import tc_core
+
+
+# Renders the samples of worker |worker_id| of |num_workers| and returns them
+# as bytes, to be merged with merge_partial_outputs. |create_scene| must be a
+# module-level function returning a taichi.visual.Scene. This can run on any
+# node: only the returned bytes need to be shipped back.
+def render_partial(create_scene,
+                   worker_id,
+                   num_workers,
+                   stages,
+                   preset='pt',
+                   **kwargs):
+  from taichi.visual.renderer import Renderer
+  renderer = Renderer(
+      output_dir=None,
+      visualize=False,
+      preset=preset,
+      scene=create_scene(),
+      worker_id=worker_id,
+      num_workers=num_workers,
+      **kwargs)
+  for i in range(stages):
+    renderer.render_stage()
+  return renderer.get_partial_output()
+
+
+# Returns the merged image (numpy.ndarray) of the given partial outputs
+def merge_partial_outputs(parts):
+  return image_buffer_to_ndarray(tc_core.merge_partial_outputs(parts))
+
+
+def _render_partial(args):
+  create_scene, worker_id, num_workers, stages, preset, kwargs = args
+  return render_partial(create_scene, worker_id, num_workers, stages, preset,
+                        **kwargs)
+
+
+# Renders one frame with |num_workers| local processes, each taking
+# |stages| stages of a disjoint sample range. The result matches a single
+# renderer running num_workers * stages stages.
+def render_distributed(create_scene,
+                       num_workers,
+                       stages,
+                       preset='pt',
+                       **kwargs):
+  tasks = [(create_scene, i, num_workers, stages, preset, kwargs)
+           for i in range(num_workers)]
+  pool = multiprocessing.Pool(num_workers)
+  try:
+    parts = pool.map(_render_partial, tasks)
+  finally:
+    pool.close()
+    pool.join()
+  return merge_partial_outputs(parts)
@@ -26,7 +26,11 @@ class Mesh:
                translate=None,
                rotation=None,
                scale=None,
-               transform=None):
+               transform=None,
+               lod_levels=0,
+               lod_error=1):
+    # lod_levels: coarser versions of the geometry for far-away instances,
+    # within lod_error pixels (see Scene::add_instance)
     if translate is None:
       translate = Vector(0, 0, 0)
     if rotation is None:
@@ -36,10 +40,19 @@ class Mesh:
     if isinstance(filename_or_triangles, str):
       filename_or_triangles = map_filename(filename_or_triangles)
     self.c = tc_core.create_mesh()
+    config = {'filename': '', 'lod_levels': lod_levels, 'lod_error': lod_error}
     if isinstance(filename_or_triangles, str):
-      self.c.initialize(config_from_dict({'filename': filename_or_triangles}))
+      config['filename'] = filename_or_triangles
+      self.c.initialize(config_from_dict(config))
+    elif isinstance(filename_or_triangles, tc_core.MeshData):
+      self.c.initialize(config_from_dict(config))
+      self.c.load_mesh_data(filename_or_triangles)
+    elif isinstance(filename_or_triangles, tuple):
+      # numpy arrays (positions, indices[, normals[, uvs]])
+      self.c.initialize(config_from_dict(config))
+      self.c.set_geometry(*filename_or_triangles)
     else:
-      self.c.initialize(config_from_dict({'filename': ''}))
+      self.c.initialize(config_from_dict(config))
       self.c.set_untransformed_triangles(filename_or_triangles)
     if transform:
       self.c.transform = transform
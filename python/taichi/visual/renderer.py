@@ -30,18 +30,18 @@ class Renderer(object):
                visualize=True,
                **kwargs):
     self.renderer_name = name
-    if output_dir is not None:
-      self.output_dir = taichi.settings.get_output_path(output_dir + '/')
     self.post_processor = LDRDisplay()
     self.frame = frame
     self.viewer_started = False
     self.viewer_process = None
-    try:
-      os.mkdir(self.output_dir)
-    except Exception as e:
-      if not overwrite:
-        print(e)
-        exit(-1)
+    if output_dir is not None:
+      self.output_dir = taichi.settings.get_output_path(output_dir + '/')
+      try:
+        os.mkdir(self.output_dir)
+      except Exception as e:
+        if not overwrite:
+          print(e)
+          exit(-1)
     if scene:
       self.initialize(preset, scene=scene, **kwargs)
     self.visualize = visualize
@@ -69,9 +69,27 @@ class Renderer(object):
       self.show()
       if cache_interval > 0 and i % cache_interval == 0:
         self.write('img%04d-%06d.png' % (self.frame, i))
+      if self.is_converged():
+        print('converged after', i, 'stages')
+        stages = i
+        break
 
     self.write('img%04d-%06d.png' % (self.frame, stages))
 
+  # Renders on a background thread until cancelled, converged, or out of
+  # time or stages. Use session.get_preview() for the latest image instead of
+  # calling into this renderer while the session runs.
+  def render_async(self, time_budget=0, max_stages=-1, preview_interval=0.5):
+    session = tc_core.RenderSession(
+        self.c,
+        config_from_dict({
+            'time_budget': time_budget,
+            'max_stages': max_stages,
+            'preview_interval': preview_interval
+        }))
+    session.start()
+    return session
+
   def get_full_fn(self, fn):
     return self.output_dir + fn
 
@@ -88,6 +106,16 @@ class Renderer(object):
 
     return output
 
+  # Denoised by the built-in a-trous filter; returns numpy.ndarray
+  def get_denoised_output(self):
+    output = self.c.get_denoised_output()
+    output = image_buffer_to_ndarray(output)
+
+    if self.post_processor:
+      output = self.post_processor.process(output)
+
+    return output
+
   # Returns ImageBuffer<Vector3> a.k.a. Array2DVector3
   def get_image_output(self):
     return taichi.util.ndarray_to_array2d(self.get_output())
@@ -127,7 +155,7 @@ class Renderer(object):
           'min_path_length': 1,
           'max_path_length': 10,
           'initial_radius': 0.5,
-          'sampler': 'sobol',
+          'sampler': 'owen_sobol',
           'shrinking_radius': True,
           'num_threads': get_num_cores()
       },
@@ -146,12 +174,26 @@ class Renderer(object):
           'min_path_length': 1,
           'max_path_length': 10,
           'initial_radius': 0.5,
-          'sampler': 'sobol',
+          'sampler': 'owen_sobol',
+          'russian_roulette': True,
+          'direct_lighting': 1,
+          'direct_lighting_light': 1,
+          'direct_lighting_bsdf': 1,
+          'envmap_is': 1,
+          'num_threads': get_num_cores()
+      },
+      'pt_wavefront': {
+          'name': 'pt_wavefront',
+          'min_path_length': 1,
+          'max_path_length': 10,
+          'initial_radius': 0.5,
+          'sampler': 'owen_sobol',
           'russian_roulette': True,
           'direct_lighting': 1,
           'direct_lighting_light': 1,
           'direct_lighting_bsdf': 1,
           'envmap_is': 1,
+          'wavefront_size': 65536,
           'num_threads': get_num_cores()
       },
       'pt_sdf': {
@@ -159,7 +201,7 @@ class Renderer(object):
           'min_path_length': 1,
           'max_path_length': 10,
           'initial_radius': 0.5,
-          'sampler': 'sobol',
+          'sampler': 'owen_sobol',
           'russian_roulette': True,
           'direct_lighting': 1,
           'direct_lighting_light': 1,
@@ -172,7 +214,7 @@ class Renderer(object):
           'min_path_length': 1,
           'max_path_length': 10,
           'stage_frequence': 3,
-          'sampler': 'sobol',
+          'sampler': 'owen_sobol',
           'num_threads': get_num_cores()
       }
   }
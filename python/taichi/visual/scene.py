@@ -1,6 +1,7 @@
 import traceback
 
 from taichi.core import tc_core
+from taichi.scoping.transform_scope import get_current_transform
 
 
 class Scene:
@@ -11,6 +12,22 @@ class Scene:
   def add_mesh(self, mesh):
     self.c.add_mesh(mesh.c)
 
+  # Places another copy of mesh, sharing its geometry with all other
+  # instances of the same mesh. Uses the current transform scope by default.
+  def add_instance(self, mesh, transform=None):
+    if transform is None:
+      transform = get_current_transform()
+    self.c.add_instance(mesh.c, transform)
+
+  # One instance of meshes[mesh_ids[i]] per world transform transforms[i],
+  # from numpy arrays of shape (n, 4, 4) and (n,). Each mesh has its own
+  # material, so instances of several materials use several meshes.
+  def add_instances(self, meshes, transforms, mesh_ids=None):
+    import numpy as np
+    if mesh_ids is None:
+      mesh_ids = np.zeros(0, dtype=np.int32)
+    self.c.add_instances([mesh.c for mesh in meshes], transforms, mesh_ids)
+
   def __getattr__(self, key):
     return self.c.__getattribute__(key)
 
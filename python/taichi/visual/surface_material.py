@@ -6,10 +6,17 @@ from taichi.misc.util import *
 class SurfaceMaterial:
 
   def __init__(self, name, **kwargs):
-    self.c = tc_core.create_surface_material(name)
-    kwargs = asset_manager.asset_ptr_to_id(kwargs)
-    self.c.initialize(config_from_dict(kwargs))
+    # Shared with the materials of identical configs, until modified
+    self.name = name
+    self.config = config_from_dict(asset_manager.asset_ptr_to_id(kwargs))
+    self.c = tc_core.create_shared_surface_material(name, self.config)
     self.id = tc_core.register_surface_material(self.c)
+    self.shared = True
 
   def set_internal_material(self, vol):
+    if self.shared:
+      self.c = tc_core.create_initialized_surface_material(
+          self.name, self.config)
+      self.id = tc_core.register_surface_material(self.c)
+      self.shared = False
     self.c.set_internal_material(vol.c)
@@ -9,9 +9,9 @@ class Texture:
 
   def __init__(self, name, **kwargs):
     if isinstance(name, str):
-      self.c = tc_core.create_texture(name)
+      # Textures of identical configs (and files) are loaded once, and shared
       kwargs = asset_manager.asset_ptr_to_id(kwargs)
-      self.c.initialize(P(**kwargs))
+      self.c = tc_core.create_shared_texture(name, P(**kwargs))
     else:
       self.c = name
     self.id = tc_core.register_texture(self.c)
@@ -94,6 +94,19 @@ class Texture:
         resolution_x=resolution_x,
         resolution_y=resolution_y)
 
+  # Rasterizes this (static) texture graph into a MIP-mapped image once, so
+  # that lookups no longer evaluate the graph
+  def bake(self, resolution_x=1024, resolution_y=-1):
+    if resolution_y == -1:
+      resolution_y = resolution_x
+    return Texture(
+        "bake", tex=self, resolution_x=resolution_x, resolution_y=resolution_y)
+
+  # Flattens this texture graph into one program evaluated without a virtual
+  # call per node. The graph must not change afterwards.
+  def compile(self):
+    return Texture("compiled", tex=self)
+
   def rasterize_to_ndarray(self, res=(512, 512)):
     array2d = self.c.rasterize(res[0], res[1])
     return array2d_to_ndarray(array2d)
@@ -119,7 +132,12 @@ class Texture:
         repeat_v=n) * 0.8 + 0.1
     return rep.clamp().flip(1)
 
+  # particles: RenderParticles, or MappedRenderParticles, e.g. a frame of
+  # RenderParticleFrames('frames/{:04d}.bin').get(frame)
   @staticmethod
   def from_render_particles(resolution, particles):
-    return Texture(
-        tc_core.rasterize_render_particles(P(resolution=resolution), particles))
+    if isinstance(particles, tc_core.MappedRenderParticles):
+      rasterize = tc_core.rasterize_mapped_render_particles
+    else:
+      rasterize = tc_core.rasterize_render_particles
+    return Texture(rasterize(P(resolution=resolution), particles))
@@ -0,0 +1,401 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#include <taichi/system/benchmark.h>
+#include <taichi/system/profiler.h>
+#include <taichi/geometry/factory.h>
+#include <taichi/visual/renderer.h>
+#include <taichi/visual/ray_intersection.h>
+#include <taichi/visual/surface_material.h>
+#include <taichi/visual/volume_material.h>
+
+#include <atomic>
+
+TC_NAMESPACE_BEGIN
+
+// Forwards to the backend 'counted_ray_intersection', counting the rays
+// queried, of all instances, in slots shared by the threads round-robin
+class CountingRayIntersection : public RayIntersection {
+ public:
+  void initialize(const Config &config) override {
+    base = create_instance<RayIntersection>(
+        config.get("counted_ray_intersection", TC_DEFAULT_RAY_INTERSECTION),
+        config);
+  }
+
+  static uint64 get_num_rays() {
+    uint64 sum = 0;
+    for (auto &slot : slots) {
+      sum += slot.rays.load(std::memory_order_relaxed);
+    }
+    return sum;
+  }
+
+  void clear() override {
+    base->clear();
+  }
+
+  void build() override {
+    base->build();
+  }
+
+  void query(Ray &ray) override {
+    count(1);
+    base->query(ray);
+  }
+
+  bool occlude(Ray &ray) override {
+    count(1);
+    return base->occlude(ray);
+  }
+
+  void query_batch(Ray *rays, int n) override {
+    count(n);
+    base->query_batch(rays, n);
+  }
+
+  void occlude_batch(Ray *rays, int n, bool *occluded) override {
+    count(n);
+    base->occlude_batch(rays, n, occluded);
+  }
+
+  void add_triangle(Triangle &triangle) override {
+    base->add_triangle(triangle);
+  }
+
+  bool set_shared_buffers(const Vector4f *vertices,
+                          int num_vertices,
+                          const int32 *indices,
+                          int num_triangles) override {
+    return base->set_shared_buffers(vertices, num_vertices, indices,
+                                    num_triangles);
+  }
+
+  int add_prototype(const std::vector<Triangle> &triangles,
+                    const std::vector<Vector4f> &vertices,
+                    const std::vector<int32> &indices) override {
+    return base->add_prototype(triangles, vertices, indices);
+  }
+
+  void add_instance(int prototype, const Matrix4 &transform) override {
+    base->add_instance(prototype, transform);
+  }
+
+  bool update_triangles(int begin,
+                        const std::vector<Triangle> &triangles) override {
+    return base->update_triangles(begin, triangles);
+  }
+
+  bool update_instance(int instance, const Matrix4 &transform) override {
+    return base->update_instance(instance, transform);
+  }
+
+  void commit_updates() override {
+    base->commit_updates();
+  }
+
+ private:
+  // One cache line each
+  struct Slot {
+    std::atomic<uint64> rays;
+    char padding[64 - sizeof(std::atomic<uint64>)];
+  };
+
+  static constexpr int num_slots = 64;
+  static Slot slots[num_slots];
+  static std::atomic<int> num_threads;
+
+  std::shared_ptr<RayIntersection> base;
+
+  static void count(int n) {
+    thread_local int slot = num_threads.fetch_add(1) % num_slots;
+    slots[slot].rays.fetch_add(n, std::memory_order_relaxed);
+  }
+};
+
+CountingRayIntersection::Slot
+    CountingRayIntersection::slots[CountingRayIntersection::num_slots];
+std::atomic<int> CountingRayIntersection::num_threads(0);
+
+TC_IMPLEMENTATION(RayIntersection, CountingRayIntersection, "counting");
+
+namespace {
+
+std::shared_ptr<SurfaceMaterial> create_material(const std::string &name,
+                                                 const Config &config) {
+  return create_instance<SurfaceMaterial>(name, config);
+}
+
+std::shared_ptr<SurfaceMaterial> create_diffuse(const Vector3 &color) {
+  return create_material("diffuse", Config().set("color", color));
+}
+
+// Two triangles, facing the side from which a, b, c, d are counter-clockwise
+void add_quad(std::vector<Triangle> &triangles,
+              const Vector3 &a,
+              const Vector3 &b,
+              const Vector3 &c,
+              const Vector3 &d) {
+  Vector3 n = normalized(cross(b - a, d - a));
+  triangles.push_back(Triangle(a, b, c, n, n, n, Vector2(0, 0), Vector2(1, 0),
+                               Vector2(1, 1)));
+  triangles.push_back(Triangle(a, c, d, n, n, n, Vector2(0, 0), Vector2(1, 1),
+                               Vector2(0, 1)));
+}
+
+// Faces pointing out of [lo, hi]
+void add_box(std::vector<Triangle> &triangles,
+             const Vector3 &lo,
+             const Vector3 &hi) {
+  auto corner = [&](int i) {
+    return Vector3(i & 1 ? hi.x : lo.x, i & 2 ? hi.y : lo.y,
+                   i & 4 ? hi.z : lo.z);
+  };
+  add_quad(triangles, corner(0), corner(4), corner(6), corner(2));  // -x
+  add_quad(triangles, corner(1), corner(3), corner(7), corner(5));  // +x
+  add_quad(triangles, corner(0), corner(1), corner(5), corner(4));  // -y
+  add_quad(triangles, corner(2), corner(6), corner(7), corner(3));  // +y
+  add_quad(triangles, corner(0), corner(2), corner(3), corner(1));  // -z
+  add_quad(triangles, corner(4), corner(5), corner(7), corner(6));  // +z
+}
+
+std::vector<Triangle> create_sphere(const Vector3 &center, real radius) {
+  Function23 normal = [](Vector2 uv) {
+    real theta = uv.x * 2 * pi, phi = -uv.y * pi;
+    return Vector3(std::cos(theta) * std::sin(phi), std::cos(phi),
+                   std::sin(theta) * std::sin(phi));
+  };
+  Function23 surface = [&](Vector2 uv) {
+    return center + radius * normal(uv);
+  };
+  return Mesh3D::generate(Vector2i(64, 32), &surface, &normal, nullptr, true);
+}
+
+void add_mesh(Scene &scene,
+              const std::vector<Triangle> &triangles,
+              std::shared_ptr<SurfaceMaterial> material) {
+  auto mesh = std::make_shared<Mesh>();
+  mesh->initialize(Config().set("filename", ""));
+  mesh->set_untransformed_triangles(triangles);
+  mesh->set_material(material);
+  scene.add_mesh(mesh);
+}
+
+// A room [-1, 1]^3, open towards +z, seen from the camera at z = 3.5, with
+// a ceiling light of |light_size| and |emission|
+void add_room(Scene &scene,
+              const Vector2i &res,
+              std::shared_ptr<SurfaceMaterial> floor,
+              std::shared_ptr<SurfaceMaterial> left,
+              std::shared_ptr<SurfaceMaterial> right,
+              real light_size,
+              real emission) {
+  auto camera = create_instance<Camera>(
+      "pinhole", Config()
+                     .set("res", res)
+                     .set("fov", 40.0_f)
+                     .set("origin", Vector3(0, 0, 3.5_f))
+                     .set("look_at", Vector3(0, 0, 0))
+                     .set("up", Vector3(0, 1, 0)));
+  scene.set_camera(camera);
+  auto white = create_diffuse(Vector3(0.75_f));
+  std::vector<Triangle> t;
+  add_quad(t, Vector3(-1, -1, 1), Vector3(1, -1, 1), Vector3(1, -1, -1),
+           Vector3(-1, -1, -1));
+  add_mesh(scene, t, floor);
+  t.clear();
+  add_quad(t, Vector3(-1, 1, -1), Vector3(1, 1, -1), Vector3(1, 1, 1),
+           Vector3(-1, 1, 1));
+  add_quad(t, Vector3(-1, -1, -1), Vector3(1, -1, -1), Vector3(1, 1, -1),
+           Vector3(-1, 1, -1));
+  add_mesh(scene, t, white);
+  t.clear();
+  add_quad(t, Vector3(-1, -1, 1), Vector3(-1, -1, -1), Vector3(-1, 1, -1),
+           Vector3(-1, 1, 1));
+  add_mesh(scene, t, left);
+  t.clear();
+  add_quad(t, Vector3(1, -1, -1), Vector3(1, -1, 1), Vector3(1, 1, 1),
+           Vector3(1, 1, -1));
+  add_mesh(scene, t, right);
+  t.clear();
+  real s = light_size / 2;
+  add_quad(t, Vector3(-s, 0.99_f, -s), Vector3(s, 0.99_f, -s),
+           Vector3(s, 0.99_f, s), Vector3(-s, 0.99_f, s));
+  add_mesh(scene, t, create_material("emissive",
+                                     Config().set("color", Vector3(emission))));
+}
+
+}  // namespace
+
+// The reference scenes of RendererBenchmark
+std::shared_ptr<Scene> create_benchmark_scene(const std::string &name,
+                                              const Vector2i &res) {
+  auto scene = std::make_shared<Scene>();
+  auto white = create_diffuse(Vector3(0.75_f));
+  std::vector<Triangle> t;
+  if (name == "cornell_box") {
+    add_room(*scene, res, white, create_diffuse(Vector3(0.75_f, 0.2_f, 0.2_f)),
+             create_diffuse(Vector3(0.2_f, 0.75_f, 0.2_f)), 0.5_f, 15);
+    add_box(t, Vector3(-0.6_f, -1, -0.6_f), Vector3(-0.05_f, 0.2_f, -0.05_f));
+    add_box(t, Vector3(0.05_f, -1, 0.0_f), Vector3(0.6_f, -0.45_f, 0.55_f));
+    add_mesh(*scene, t, white);
+  } else if (name == "glossy_interior") {
+    auto glossy = [&](real glossiness) {
+      return create_material("glossy",
+                             Config()
+                                 .set("color", Vector3(0.8_f))
+                                 .set("glossiness", Vector3(glossiness)));
+    };
+    add_room(*scene, res, glossy(50), glossy(10), glossy(10), 0.3_f, 30);
+    add_mesh(*scene, create_sphere(Vector3(-0.45_f, -0.6_f, -0.2_f), 0.4_f),
+             glossy(200));
+    add_mesh(*scene, create_sphere(Vector3(0.45_f, -0.7_f, 0.3_f), 0.3_f),
+             white);
+  } else if (name == "caustics") {
+    add_room(*scene, res, white, white, white, 0.1_f, 400);
+    add_mesh(*scene, create_sphere(Vector3(0, -0.5_f, 0), 0.45_f),
+             create_material("refractive", Config()
+                                               .set("color", Vector3(1))
+                                               .set("ior", 1.5_f)));
+  } else if (name == "volumetric_block") {
+    add_room(*scene, res, white, white, white, 0.5_f, 15);
+    auto volume = create_instance<VolumeMaterial>(
+        "homogeneous",
+        Config().set("scattering", 4.0_f).set("absorption", 0.5_f));
+    auto boundary = create_material("plain_interface", Config());
+    boundary->set_internal_material(volume);
+    add_box(t, Vector3(-0.5_f, -1, -0.5_f), Vector3(0.5_f, 0, 0.5_f));
+    add_mesh(*scene, t, boundary);
+  } else {
+    TC_ERROR("Unknown benchmark scene [{}]", name);
+  }
+  scene->finalize();
+  return scene;
+}
+
+// End-to-end throughput of 'renderer' on one of the reference scenes
+// 'scene': cornell_box, glossy_interior (glossy surfaces), caustics (a glass
+// sphere under a small light) and volumetric_block (a scattering medium),
+// at 'res'. The rest of the config goes to the renderer, with defaults for
+// the path lengths, the sampler and the photon radius. run() measures
+// the cost per pixel of a render stage; the metrics are
+//   rays_per_second, samples_per_second (a stage counting as one sample
+//     per pixel), and phase_<scope>, seconds per stage of each TC_PROFILE
+//     scope within render_stage();
+//   if 'reference' names an image written with write_to_disk, e.g. by a
+//     long run with 'write_reference', time_to_rmse and stages_to_rmse of a
+//     fresh render, until its RMSE relative to the mean of the reference is
+//     at most 'target_rmse' (-1 if 'max_rmse_stages' are not enough), and
+//     the final rmse.
+class RendererBenchmark : public Benchmark {
+ protected:
+  std::string scene_name, renderer_name;
+  Vector2i res;
+  Config renderer_config;
+  std::shared_ptr<Scene> scene;
+  std::shared_ptr<Renderer> renderer;
+  int64 num_stages;
+  float64 render_time;
+  uint64 start_rays;
+
+  std::shared_ptr<Renderer> create_renderer() {
+    auto r = create_instance<Renderer>(renderer_name);
+    r->set_scene(scene);
+    r->initialize(renderer_config);
+    return r;
+  }
+
+  void setup() override {
+    scene = create_benchmark_scene(scene_name, res);
+    renderer = create_renderer();
+    ProfilerRecords::get_instance().clear();
+    num_stages = 0;
+    render_time = 0;
+    start_rays = CountingRayIntersection::get_num_rays();
+  }
+
+  void iterate() override {
+    float64 t = Time::get_time();
+    TC_PROFILE("render_stage", renderer->render_stage());
+    render_time += Time::get_time() - t;
+    num_stages += 1;
+  }
+
+  void finalize() override {
+    uint64 rays = CountingRayIntersection::get_num_rays() - start_rays;
+    metrics["rays_per_second"] = rays / render_time;
+    metrics["samples_per_second"] = num_stages * workload / render_time;
+    auto records = ProfilerRecords::get_instance().get_merged_records();
+    auto stage = records->get_child("render_stage");
+    for (auto &phase : stage->childs) {
+      metrics["phase_" + phase->name] = phase->total_time / num_stages;
+    }
+    if (renderer_config.has_key("write_reference")) {
+      renderer->get_output().write_to_disk(
+          renderer_config.get<std::string>("write_reference"));
+    }
+    if (renderer_config.has_key("reference")) {
+      measure_time_to_rmse();
+    }
+    renderer = nullptr;
+  }
+
+  void measure_time_to_rmse() {
+    Array2D<Vector3> reference;
+    std::string fn = renderer_config.get<std::string>("reference");
+    TC_ERROR_IF(!reference.read_from_disk(fn) || reference.get_res() != res,
+                "Invalid reference image [{}]", fn);
+    real target_rmse = renderer_config.get("target_rmse", 0.05_f);
+    int max_stages = renderer_config.get("max_rmse_stages", 1000);
+    float64 mean = 0;
+    for (auto &ind : reference.get_region()) {
+      mean += reference[ind].sum() / 3;
+    }
+    mean = std::max(mean / reference.get_size(), 1e-10);
+    auto r = create_renderer();
+    float64 time = 0, rmse = 0;
+    int stages = -1;
+    for (int i = 1; i <= max_stages; i++) {
+      float64 t = Time::get_time();
+      r->render_stage();
+      time += Time::get_time() - t;
+      auto output = r->get_output();
+      float64 sum = 0;
+      for (auto &ind : output.get_region()) {
+        sum += (output[ind] - reference[ind]).length2();
+      }
+      rmse = std::sqrt(sum / (3 * output.get_size())) / mean;
+      if (rmse <= target_rmse) {
+        stages = i;
+        break;
+      }
+    }
+    metrics["rmse"] = rmse;
+    metrics["stages_to_rmse"] = stages;
+    metrics["time_to_rmse"] = stages == -1 ? -1 : time;
+  }
+
+ public:
+  void initialize(const Config &config) override {
+    Benchmark::initialize(config);
+    scene_name = config.get("scene", "cornell_box");
+    renderer_name = config.get("renderer", "pt");
+    res = config.get("res", Vector2i(256, 256));
+    workload = (int64)res[0] * res[1];
+    renderer_config = config;
+    renderer_config.set("min_path_length", config.get("min_path_length", 1))
+        .set("max_path_length", config.get("max_path_length", 10))
+        .set("sampler", config.get("sampler", "owen_sobol"))
+        .set("initial_radius", config.get("initial_radius", 0.05_f))
+        .set("shrinking_radius", config.get("shrinking_radius", true))
+        .set("counted_ray_intersection",
+             config.get("ray_intersection", TC_DEFAULT_RAY_INTERSECTION))
+        .set("ray_intersection", "counting");
+  }
+};
+
+TC_IMPLEMENTATION(Benchmark, RendererBenchmark, "renderer");
+
+TC_NAMESPACE_END
@@ -0,0 +1,343 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#include <taichi/system/benchmark.h>
+#include <taichi/common/asset_manager.h>
+#include <taichi/dynamics/poisson_solver.h>
+#include <taichi/dynamics/simulation.h>
+#include <taichi/dynamics/fluid2d/fluid.h>
+#include "../simulation/fluid_3d.h"
+
+TC_NAMESPACE_BEGIN
+
+// Bytes per fine cell that one iteration of the Poisson 'solver' would
+// stream from memory without cache reuse between sweeps, which is the
+// roofline traffic of the unblocked algorithm: a red-black sweep reads the
+// residual and reads and writes the pressure, a V-cycle has 16 sweeps and
+// about 3 arrays of transfers per level, the coarse levels adding
+// 1 / (2^dim - 1), and the Krylov updates of CG stream 12 arrays. The
+// system rows of irregular cells are not counted. With blocked sweeps,
+// a bandwidth above the memory peak is the reuse of the cache.
+template <int dim>
+float64 get_poisson_bytes_per_iteration(const std::string &solver) {
+  float64 v_cycle = (16 * 3 + 3) * (1 + 1.0 / ((1 << dim) - 1));
+  float64 arrays;
+  if (solver == "mg") {
+    arrays = v_cycle + 3;
+  } else if (solver == "mgpcg") {
+    arrays = v_cycle + 12;
+  } else {
+    arrays = 12;
+  }
+  return arrays * sizeof(real);
+}
+
+// Simulation benchmarks time steps of 'num_threads' threads (-1: all), and
+// the metrics are over all the steps, warm-up included:
+//   cells_per_second (or particles_per_second), the workload processed
+//   per second of wall time
+class SimulationBenchmark : public Benchmark {
+ protected:
+  int num_threads;
+  int64 num_steps;
+  float64 step_time;
+
+  virtual void step() = 0;
+
+  void setup() override {
+    num_steps = 0;
+    step_time = 0;
+  }
+
+  void iterate() override {
+    float64 t = Time::get_time();
+    step();
+    step_time += Time::get_time() - t;
+    num_steps += 1;
+  }
+
+  float64 get_throughput() const {
+    return num_steps * workload / step_time;
+  }
+
+ public:
+  void initialize(const Config &config) override {
+    Benchmark::initialize(config);
+    num_threads = config.get("num_threads", -1);
+  }
+};
+
+// Solves L x = b from x = 0 to 'tolerance' with the PoissonSolver2D or 3D
+// 'solver' (mg, mgpcg, spectral, and cg in 3D) on a 'res' grid padded with
+// 'padding', for random b. Metrics:
+//   cells_per_second, iterations per solve, bytes_per_cell, the traffic
+//   per solve of get_poisson_bytes_per_iteration(), and bandwidth, the
+//   bytes per second it makes
+template <int dim>
+class PoissonBenchmark : public SimulationBenchmark {
+ protected:
+  using Solver = typename std::conditional<dim == 2,
+                                           PoissonSolver2D,
+                                           PoissonSolver3D>::type;
+  using Array = ArrayND<dim, real>;
+  using VectorI = VectorND<dim, int>;
+
+  VectorI res;
+  std::string solver_name;
+  Config solver_config;
+  real tolerance;
+  std::shared_ptr<Solver> solver;
+  Array b, x;
+  int64 num_iterations;
+
+  void setup() override {
+    SimulationBenchmark::setup();
+    solver = create_instance<Solver>(solver_name, solver_config);
+    solver->set_boundary_condition(typename Solver::BCArray(res));
+    b = Array(res);
+    x = Array(res);
+    for (int i = 0; i < b.get_size(); i++) {
+      b.data[i] = rand() * 2 - 1;
+    }
+    // Neumann padding leaves a null space, which b must be orthogonal to
+    if (solver_config.get<std::string>("padding") == "neumann") {
+      real mean = b.sum() / b.get_size();
+      for (int i = 0; i < b.get_size(); i++) {
+        b.data[i] -= mean;
+      }
+    }
+    num_iterations = 0;
+  }
+
+  void step() override {
+    x.reset(0);
+    solver->run(b, x, tolerance);
+    num_iterations += solver->get_last_iterations();
+  }
+
+  void finalize() override {
+    float64 iterations = (float64)num_iterations / num_steps;
+    float64 bytes_per_cell =
+        iterations * get_poisson_bytes_per_iteration<dim>(solver_name);
+    metrics["cells_per_second"] = get_throughput();
+    metrics["iterations"] = iterations;
+    metrics["bytes_per_cell"] = bytes_per_cell;
+    metrics["bandwidth"] = bytes_per_cell * get_throughput();
+    solver = nullptr;
+  }
+
+ public:
+  void initialize(const Config &config) override {
+    SimulationBenchmark::initialize(config);
+    res = config.get("res", VectorI(dim == 2 ? 512 : 64));
+    solver_name = config.get("solver", "mgpcg");
+    tolerance = config.get("tolerance", 1e-4_f);
+    workload = 1;
+    for (int i = 0; i < dim; i++) {
+      workload *= res[i];
+    }
+    solver_config.set("res", res)
+        .set("num_threads", num_threads)
+        .set("padding", config.get("padding", "dirichlet"))
+        .set("maximum_iterations", config.get("maximum_iterations", 100));
+  }
+};
+
+using PoissonBenchmark2D = PoissonBenchmark<2>;
+using PoissonBenchmark3D = PoissonBenchmark<3>;
+
+TC_IMPLEMENTATION(Benchmark, PoissonBenchmark2D, "poisson_2d");
+
+TC_IMPLEMENTATION(Benchmark, PoissonBenchmark3D, "poisson_3d");
+
+// Steps of 'delta_t' of Smoke3D on a 'res' grid, seeded by a sphere at the
+// bottom, with the 'pressure_solver' projection; the rest of the config
+// goes to the simulation. Metrics:
+//   cells_per_second, pressure_iterations per step, and
+//   pressure_bytes_per_cell, the traffic of the projection per step as
+//   for PoissonBenchmark
+class SmokeBenchmark : public SimulationBenchmark {
+ protected:
+  Config smoke_config;
+  real delta_t;
+  std::shared_ptr<Smoke3D> smoke;
+  // The manager only keeps weak pointers
+  std::vector<std::shared_ptr<Texture>> textures;
+  int64 num_iterations;
+
+  int create_texture(const std::string &name, const Config &config) {
+    textures.push_back(create_instance<Texture>(name, config));
+    return AssetManager::insert_asset(textures.back());
+  }
+
+  void setup() override {
+    SimulationBenchmark::setup();
+    textures.clear();
+    Config config = smoke_config;
+    config
+        .set("generation_tex",
+             create_texture("sphere", Config()
+                                          .set("center", Vector3(0.5_f, 0.1_f,
+                                                                 0.5_f))
+                                          .set("radius", 0.08_f)))
+        .set("initial_velocity_tex",
+             create_texture("const",
+                            Config().set("value", Vector4(0, 1, 0, 0))))
+        .set("color_tex",
+             create_texture("const", Config().set("value", Vector4(1))))
+        .set("temperature_tex",
+             create_texture("const", Config().set("value", Vector4(1))));
+    smoke = std::make_shared<Smoke3D>();
+    smoke->initialize(config);
+    smoke->update(config);
+    num_iterations = 0;
+  }
+
+  void step() override {
+    smoke->step(delta_t);
+    num_iterations += smoke->pressure_solver->get_last_iterations();
+  }
+
+  void finalize() override {
+    float64 iterations = (float64)num_iterations / num_steps;
+    metrics["cells_per_second"] = get_throughput();
+    metrics["pressure_iterations"] = iterations;
+    metrics["pressure_bytes_per_cell"] =
+        iterations * get_poisson_bytes_per_iteration<3>(
+                         smoke_config.get<std::string>("pressure_solver"));
+    smoke = nullptr;
+    textures.clear();
+  }
+
+ public:
+  void initialize(const Config &config) override {
+    SimulationBenchmark::initialize(config);
+    Vector3i res = config.get("res", Vector3i(64));
+    delta_t = config.get("delta_t", 0.1_f);
+    workload = (int64)res[0] * res[1] * res[2];
+    smoke_config = config;
+    smoke_config.set("resolution", res)
+        .set("num_threads", num_threads)
+        .set("super_sampling", config.get("super_sampling", 1))
+        .set("open_boundary", config.get("open_boundary", false))
+        .set("pressure_solver", config.get("pressure_solver", "mgpcg"))
+        .set("pressure_tolerance", config.get("pressure_tolerance", 1e-4_f))
+        .set("maximum_pressure_iterations",
+             config.get("maximum_pressure_iterations", 50));
+  }
+};
+
+TC_IMPLEMENTATION(Benchmark, SmokeBenchmark, "smoke_3d");
+
+// Steps of 'delta_t' of the Simulation3D 'simulator' (nbody or nbody_fmm)
+// with 'num_particles' particles; the rest of the config goes to the
+// simulation. Metrics: particles_per_second.
+class NBodyBenchmark : public SimulationBenchmark {
+ protected:
+  Config nbody_config;
+  std::string simulator;
+  real delta_t;
+  std::shared_ptr<Simulation3D> nbody;
+
+  void setup() override {
+    SimulationBenchmark::setup();
+    nbody = create_instance<Simulation3D>(simulator, nbody_config);
+  }
+
+  void step() override {
+    nbody->step(delta_t);
+  }
+
+  void finalize() override {
+    metrics["particles_per_second"] = get_throughput();
+    nbody = nullptr;
+  }
+
+ public:
+  void initialize(const Config &config) override {
+    SimulationBenchmark::initialize(config);
+    simulator = config.get("simulator", "nbody");
+    workload = config.get("num_particles", 65536);
+    delta_t = config.get("delta_t", 0.01_f);
+    nbody_config = config;
+    nbody_config.set("num_particles", (int)workload)
+        .set("num_threads", num_threads)
+        .set("gravitation", config.get("gravitation", -1e-4_f))
+        .set("vel_scale", config.get("vel_scale", 1.0_f))
+        .set("delta_t", delta_t);
+  }
+};
+
+TC_IMPLEMENTATION(Benchmark, NBodyBenchmark, "nbody");
+
+// Frames of 'delta_t', in CFL substeps, of the 2D Fluid 'simulator'
+// (apic_liquid, flip_liquid) on a 'res' grid in a box, with the lower half
+// filled with 4 particles per cell; the rest of the config goes to the
+// simulation, e.g. 'viscosity' and 'viscosity_solver' (implicit or
+// explicit), which steps_per_second over a range of viscosities compares.
+// Metrics: cells_per_second, particles_per_second and steps_per_second.
+class Fluid2DBenchmark : public SimulationBenchmark {
+ protected:
+  Config fluid_config;
+  std::string simulator;
+  Vector2i res;
+  real delta_t;
+  std::shared_ptr<Fluid> fluid;
+  int64 num_particles;
+
+  void setup() override {
+    SimulationBenchmark::setup();
+    fluid = create_instance<Fluid>(simulator);
+    fluid->initialize(fluid_config);
+    LevelSet2D boundary(res + Vector2i(1), Vector2(0.0_f));
+    Vector2 lower = res.cast<real>() * 0.05_f;
+    Vector2 upper = res.cast<real>() * 0.95_f;
+    boundary.add_polygon({lower, Vector2(upper.x, lower.y), upper,
+                          Vector2(lower.x, upper.y)},
+                         true);
+    fluid->set_levelset(boundary);
+    num_particles = 0;
+    for (real x = lower.x; x < upper.x; x += 0.5_f) {
+      for (real y = lower.y; y < res[1] * 0.5_f; y += 0.5_f) {
+        Fluid::Particle p(Vector2(x + rand() * 0.5_f, y + rand() * 0.5_f));
+        fluid->add_particle(p);
+        num_particles++;
+      }
+    }
+  }
+
+  void step() override {
+    fluid->step(delta_t);
+  }
+
+  void finalize() override {
+    metrics["cells_per_second"] = get_throughput();
+    metrics["particles_per_second"] =
+        num_particles * num_steps / step_time;
+    metrics["steps_per_second"] = num_steps / step_time;
+    fluid = nullptr;
+  }
+
+ public:
+  void initialize(const Config &config) override {
+    SimulationBenchmark::initialize(config);
+    simulator = config.get("simulator", "apic_liquid");
+    res = config.get("res", Vector2i(256));
+    delta_t = config.get("delta_t", 0.01_f);
+    workload = (int64)res[0] * res[1];
+    fluid_config = config;
+    fluid_config.set("simulation_width", res[0])
+        .set("simulation_height", res[1])
+        .set("num_threads", num_threads)
+        .set("gravity", config.get("gravity", Vector2(0, -10)))
+        .set("levelset_band", config.get("levelset_band", 3.0_f))
+        .set("pressure_solver", config.get("pressure_solver", "mgpcg"))
+        .set("cfl", config.get("cfl", 0.5_f));
+  }
+};
+
+TC_IMPLEMENTATION(Benchmark, Fluid2DBenchmark, "fluid_2d");
+
+TC_NAMESPACE_END
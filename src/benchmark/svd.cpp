@@ -0,0 +1,65 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#include <taichi/system/benchmark.h>
+#include <taichi/math/svd.h>
+
+TC_NAMESPACE_BEGIN
+
+// 3x3 float SVDs of 'workload' random matrices, with svd_batch() if
+// 'batched', or with svd() of each matrix otherwise
+class SVDBenchmark : public Benchmark {
+ protected:
+  bool batched;
+  std::vector<Matrix3f> m, u, sig, v;
+
+  void setup() override {
+    m.resize(workload);
+    for (auto &mat : m) {
+      mat = Matrix3f::rand();
+    }
+    u.resize(workload);
+    sig.resize(workload);
+    v.resize(workload);
+  }
+
+  void iterate() override {
+    if (batched) {
+      svd_batch(m.data(), (int)workload, u.data(), sig.data(), v.data());
+    } else {
+      for (int i = 0; i < (int)workload; i++) {
+        svd(m[i], u[i], sig[i], v[i]);
+      }
+    }
+  }
+
+ public:
+  void initialize(const Config &config) override {
+    Benchmark::initialize(config);
+    batched = config.get("batched", true);
+  }
+
+  // Both ways find the same singular values
+  bool test() const override {
+    int n = 1000;
+    std::vector<Matrix3f> m(n), u(n), sig(n), v(n);
+    for (auto &mat : m) {
+      mat = Matrix3f::rand();
+    }
+    svd_batch(m.data(), n, u.data(), sig.data(), v.data());
+    for (int i = 0; i < n; i++) {
+      Matrix3f u_i, sig_i, v_i;
+      svd(m[i], u_i, sig_i, v_i);
+      if ((sig[i] - sig_i).frobenius_norm2() > 1e-8f) {
+        return false;
+      }
+    }
+    return true;
+  }
+};
+
+TC_IMPLEMENTATION(Benchmark, SVDBenchmark, "svd");
+
+TC_NAMESPACE_END
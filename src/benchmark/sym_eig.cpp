@@ -0,0 +1,75 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#include <taichi/system/benchmark.h>
+#include <taichi/math/svd.h>
+
+TC_NAMESPACE_BEGIN
+
+// Eigen-decompositions of 'workload' random symmetric 3x3 float matrices,
+// with sym_eig_batch() if 'batched', or with sym_eig() of each matrix
+// otherwise
+class SymEigBenchmark : public Benchmark {
+ protected:
+  bool batched;
+  std::vector<Matrix3f> m, q;
+  std::vector<Vector3f> lambda;
+
+  static Matrix3f random_symmetric() {
+    Matrix3f a = Matrix3f::rand();
+    return a + transposed(a);
+  }
+
+  void setup() override {
+    m.resize(workload);
+    for (auto &mat : m) {
+      mat = random_symmetric();
+    }
+    q.resize(workload);
+    lambda.resize(workload);
+  }
+
+  void iterate() override {
+    if (batched) {
+      sym_eig_batch(m.data(), (int)workload, q.data(), lambda.data());
+    } else {
+      for (int i = 0; i < (int)workload; i++) {
+        sym_eig(m[i], q[i], lambda[i]);
+      }
+    }
+  }
+
+ public:
+  void initialize(const Config &config) override {
+    Benchmark::initialize(config);
+    batched = config.get("batched", true);
+  }
+
+  // Both ways find the same eigenvalues, which reconstruct the matrices
+  bool test() const override {
+    int n = 1000;
+    std::vector<Matrix3f> m(n), q(n);
+    std::vector<Vector3f> lambda(n);
+    for (auto &mat : m) {
+      mat = random_symmetric();
+    }
+    sym_eig_batch(m.data(), n, q.data(), lambda.data());
+    for (int i = 0; i < n; i++) {
+      Matrix3f q_i;
+      Vector3f lambda_i;
+      sym_eig(m[i], q_i, lambda_i);
+      Matrix3f r = q[i] * Matrix3f(lambda[i]) * transposed(q[i]);
+      if ((lambda[i] - lambda_i).length2() > 1e-8f ||
+          (r - m[i]).frobenius_norm2() > 1e-8f) {
+        return false;
+      }
+    }
+    return true;
+  }
+};
+
+TC_IMPLEMENTATION(Benchmark, SymEigBenchmark, "sym_eig");
+
+TC_NAMESPACE_END
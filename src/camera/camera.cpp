@@ -0,0 +1,71 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#include <taichi/visual/camera.h>
+#include <taichi/math/vector_pack.h>
+
+TC_NAMESPACE_BEGIN
+
+namespace {
+
+// The samples of a ray for generate_rays, replayed to sample()
+class ArrayStateSequence : public StateSequence {
+  const real *samples;
+  int dims;
+
+ public:
+  ArrayStateSequence(const real *samples, int dims)
+      : samples(samples), dims(dims) {
+  }
+
+  real sample() override {
+    TC_ASSERT_INFO(cursor < dims,
+                   "Camera draws more than get_sample_dimensions()");
+    return samples[cursor++];
+  }
+};
+
+}  // namespace
+
+void Camera::generate_rays(const Vector2 *offsets,
+                           Vector2 size,
+                           const real *samples,
+                           int count,
+                           Ray *rays) {
+  int dims = get_sample_dimensions();
+  for (int i = 0; i < count; i++) {
+    ArrayStateSequence rand(samples + i * dims, dims);
+    rays[i] = sample(offsets[i], size, rand);
+  }
+}
+
+void Camera::generate_pinhole_rays(const Vector2 *offsets,
+                                   Vector2 size,
+                                   const real *samples,
+                                   int dims,
+                                   int count,
+                                   Ray *rays) const {
+  constexpr int width = default_pack_width<real>;
+  using Scalar = ScalarPack<real, width>;
+  using Pack = VectorPack<3, real, width>;
+  Pack dir(world_dir), right(world_right), up(world_up);
+  for (int begin = 0; begin < count; begin += width) {
+    // Lanes past the end repeat the last ray
+    real x[width], y[width];
+    for (int l = 0; l < width; l++) {
+      int i = std::min(begin + l, count - 1);
+      x[l] = offsets[i].x + samples[i * dims] * size.x - 0.5_f;
+      y[l] = offsets[i].y + samples[i * dims + 1] * size.y - 0.5_f;
+    }
+    Vector3 dirs[width];
+    normalized(dir + Scalar::load(x) * right + Scalar::load(y) * up)
+        .store(dirs);
+    for (int l = 0; l < width && begin + l < count; l++) {
+      rays[begin + l] = Ray(world_origin, dirs[l]);
+    }
+  }
+}
+
+TC_NAMESPACE_END
@@ -21,6 +21,7 @@ class PinholeCamera : public Camera {
     set_dir_and_right();
     tan_half_fov = tan(fov / 2);
     this->transform = Matrix4(1.0_f);
+    update_basis(tan_half_fov);
   }
 
   real get_pixel_scaling() override {
@@ -30,14 +31,18 @@ class PinholeCamera : public Camera {
   virtual Ray sample(Vector2 offset,
                      Vector2 size,
                      StateSequence &rand) override {
-    Vector2 rand_offset = random_offset(offset, size, rand(), rand());
-    Vector3 local_dir =
-        normalize(dir + rand_offset.x * tan_half_fov * right * aspect_ratio +
-                  rand_offset.y * tan_half_fov * up);
-    Vector3 world_orig = multiply_matrix4(transform, origin, 1);
-    Vector3 world_dir = normalized(multiply_matrix4(
-        transform, local_dir, 0));  // TODO: why normalize here???
-    return Ray(world_orig, world_dir, 0);
+    // Drawn in order, as by generate_rays()
+    real u = rand(), v = rand();
+    Vector2 rand_offset = random_offset(offset, size, u, v);
+    return Ray(world_origin, get_world_dir(rand_offset.x, rand_offset.y), 0);
+  }
+
+  void generate_rays(const Vector2 *offsets,
+                     Vector2 size,
+                     const real *samples,
+                     int count,
+                     Ray *rays) override {
+    generate_pinhole_rays(offsets, size, samples, 2, count, rays);
   }
 
   void get_pixel_coordinate(Vector3 ray_dir, real &u, real &v) override {
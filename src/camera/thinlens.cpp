@@ -4,9 +4,40 @@
 *******************************************************************************/
 
 #include <taichi/visual/camera.h>
+#include <taichi/math/vector_pack.h>
 
 TC_NAMESPACE_BEGIN
 
+namespace {
+
+// sample_lens() of the lanes of |u| and |v|, with the cosine and sine of
+// 2 pi v from those of h = pi v - pi / 2 in [-pi / 2, pi / 2), by their
+// Taylor polynomials (to 3e-8), and the double angle formulas
+template <typename Scalar>
+TC_FORCE_INLINE void sample_lens_pack(const Scalar &u,
+                                      const Scalar &v,
+                                      Scalar &x,
+                                      Scalar &y) {
+  using T = typename std::decay<decltype(u[0])>::type;
+  Scalar h = Scalar(T(pi)) * v - Scalar(T(pi / 2));
+  Scalar h2 = h * h;
+  Scalar sin_h = Scalar(T(-1.0 / 39916800));
+  for (T k : {1.0 / 362880, -1.0 / 5040, 1.0 / 120, -1.0 / 6, 1.0}) {
+    sin_h = sin_h * h2 + Scalar(T(k));
+  }
+  sin_h *= h;
+  Scalar cos_h = Scalar(T(1.0 / 479001600));
+  for (T k : {-1.0 / 3628800, 1.0 / 40320, -1.0 / 720, 1.0 / 24, -0.5, 1.0}) {
+    cos_h = cos_h * h2 + Scalar(T(k));
+  }
+  // cos(2 h + pi) and sin(2 h + pi)
+  Scalar r = sqrt(u);
+  x = (Scalar(T(2)) * sin_h * sin_h - Scalar(T(1))) * r;
+  y = Scalar(T(-2)) * sin_h * cos_h * r;
+}
+
+}  // namespace
+
 class ThinLensCamera : public Camera {
  public:
   ThinLensCamera() {
@@ -26,6 +57,10 @@ class ThinLensCamera : public Camera {
     else
       this->focus = look_at;
     this->aperture = config.get<real>("aperture");
+    update_basis(tan_half_fov);
+    focal_distance = dot(focus - world_origin, world_dir);
+    lens_right = aperture * right;
+    lens_up = aperture * up;
   }
 
   real get_pixel_scaling() override {
@@ -41,20 +76,59 @@ class ThinLensCamera : public Camera {
   virtual Ray sample(Vector2 offset,
                      Vector2 size,
                      StateSequence &rand) override {
-    Vector2 rand_offset = random_offset(offset, size, rand(), rand());
-    Vector3 local_dir =
-        normalize(dir + rand_offset.x * tan_half_fov * right * aspect_ratio +
-                  rand_offset.y * tan_half_fov * up);
-    Vector3 world_dir = normalized(multiply_matrix4(
-        transform, local_dir, 0));  // TODO: why normalize here???
-    Vector3 focus_point = get_origin() +
-                          world_dir * (dot(focus - get_origin(), get_dir()) /
-                                       dot(get_dir(), world_dir));
-    Vector2 uv = sample_lens(rand.next2());
-    Vector3 orig = get_origin() + aperture * (uv[0] * right + uv[1] * up);
+    // Drawn in order, as by generate_rays()
+    real u = rand(), v = rand();
+    Vector2 rand_offset = random_offset(offset, size, u, v);
+    Vector3 pixel_dir = get_world_dir(rand_offset.x, rand_offset.y);
+    Vector3 focus_point =
+        world_origin + pixel_dir * (focal_distance / dot(world_dir, pixel_dir));
+    real lens_u = rand(), lens_v = rand();
+    Vector2 uv = sample_lens(Vector2(lens_u, lens_v));
+    Vector3 orig = world_origin + uv[0] * lens_right + uv[1] * lens_up;
     return Ray(orig, normalized(focus_point - orig));
   }
 
+  int get_sample_dimensions() const override {
+    return 4;
+  }
+
+  // Pinhole rays, refocused through the lens samples
+  void generate_rays(const Vector2 *offsets,
+                     Vector2 size,
+                     const real *samples,
+                     int count,
+                     Ray *rays) override {
+    generate_pinhole_rays(offsets, size, samples, 4, count, rays);
+    constexpr int width = default_pack_width<real>;
+    using Scalar = ScalarPack<real, width>;
+    using Pack = VectorPack<3, real, width>;
+    Pack origin(world_origin), dir(world_dir);
+    Pack right(lens_right), up(lens_up);
+    for (int begin = 0; begin < count; begin += width) {
+      Vector3 dirs[width];
+      real u[width], v[width];
+      for (int l = 0; l < width; l++) {
+        int i = std::min(begin + l, count - 1);
+        dirs[l] = rays[i].dir;
+        u[l] = samples[i * 4 + 2];
+        v[l] = samples[i * 4 + 3];
+      }
+      Scalar lens_x, lens_y;
+      sample_lens_pack(Scalar::load(u), Scalar::load(v), lens_x, lens_y);
+      Pack pinhole_dir = Pack::load(dirs);
+      Pack focus_point =
+          origin + pinhole_dir * (Scalar(focal_distance) /
+                                  dot(dir, pinhole_dir));
+      Pack orig = origin + lens_x * right + lens_y * up;
+      Vector3 origs[width];
+      orig.store(origs);
+      normalized(focus_point - orig).store(dirs);
+      for (int l = 0; l < width && begin + l < count; l++) {
+        rays[begin + l] = Ray(origs[l], dirs[l]);
+      }
+    }
+  }
+
   void get_pixel_coordinate(Vector3 ray_dir, real &u, real &v) override {
     auto inv_transform = inversed(transform);
     auto local_ray_dir = multiply_matrix4(inv_transform, ray_dir, 0);
@@ -69,6 +143,9 @@ class ThinLensCamera : public Camera {
   real tan_half_fov;
   real aperture;
   Vector3 focus;
+  // Along world_dir, and the lens offsets per unit of the lens samples
+  real focal_distance;
+  Vector3 lens_right, lens_up;
 };
 
 TC_IMPLEMENTATION(Camera, ThinLensCamera, "thinlens");
@@ -53,7 +53,7 @@ void Logger::set_level(const std::string &level) {
   }
 }
 
-Logger::Logger() {
+Logger::Logger() : async(false) {
   console = spdlog::stdout_color_mt("console");
   TC_LOG_SET_PATTERN("[%L %D %X.%e] %v")
 
@@ -67,6 +67,30 @@ Logger::Logger() {
   TC_TRACE("Taichi core started. Thread ID = {}", PID::get_pid());
 }
 
+void Logger::set_async(bool async, std::size_t queue_size) {
+  if (async == this->async) {
+    return;
+  }
+  console->flush();
+  // Keeps the sinks, e.g. the colored stdout one
+  std::vector<spdlog::sink_ptr> sinks = console->sinks();
+  spdlog::drop("console");
+  console.reset();
+  if (async) {
+    // A power of two, as the queue requires
+    std::size_t size = 1;
+    while (size < queue_size) {
+      size *= 2;
+    }
+    // Blocks when full, instead of dropping messages
+    console = spdlog::create_async("console", sinks.begin(), sinks.end(), size,
+                                   spdlog::async_overflow_policy::block_retry);
+  } else {
+    console = spdlog::create("console", sinks.begin(), sinks.end());
+  }
+  this->async = async;
+}
+
 void Logger::trace(const std::string &s) {
   console->trace(s);
 }
@@ -85,12 +109,15 @@ void Logger::warn(const std::string &s) {
 void Logger::error(const std::string &s, bool raise_signal) {
   console->error(s);
   if (raise_signal) {
+    // Out of the queue first, in the asynchronous mode
+    console->flush();
     std::raise(SIGABRT);
   }
 }
 void Logger::critical(const std::string &s, bool raise_signal) {
   console->critical(s);
   if (raise_signal) {
+    console->flush();
     std::raise(SIGABRT);
   }
 }
@@ -6,26 +6,44 @@
 #include <taichi/visual/envmap.h>
 #include <taichi/visual/texture.h>
 #include <taichi/common/asset_manager.h>
+#include <taichi/system/threading.h>
+#include <taichi/io/io.h>
 
 TC_NAMESPACE_BEGIN
 
 TC_IMPLEMENTATION(EnvironmentMap, EnvironmentMap, "base");
 
+// Bump when the cache layout or the processing of images changes
+constexpr uint64 envmap_cache_version = 1;
+
 void EnvironmentMap::initialize(const Config &config) {
   set_transform(Matrix4(1.0_f));
+  num_threads = config.get("num_threads", -1);
   if (config.has_key("filepath")) {
-    image =
-        std::make_shared<Array2D<Vector3>>(config.get<std::string>("filepath"));
+    std::string filepath = config.get<std::string>("filepath");
+    std::string cache = filepath + ".envmap.tcb";
+    uint64 stamp = config.get("cache", true) ? get_file_stamp(filepath) : 0;
+    if (stamp != 0 && load_cache(cache, stamp)) {
+      return;
+    }
+    image = std::make_shared<Array2D<Vector3>>(filepath);
     res[0] = image->get_width();
     res[1] = image->get_height();
-  } else {
-    assert_info(config.has_key("texture"),
-                "Either `filenpath` or `texture` should be specified.");
-    res = config.get("res", Vector2i(1024, 512));
-    image = std::make_shared<Array2D<Vector3>>(res);
-    Texture *tex = config.get_asset<Texture>("texture").get();
-    *image = tex->rasterize3(res);
+    flip_rows();
+    build_cdfs();
+    if (stamp != 0) {
+      save_cache(cache, stamp);
+    }
+    return;
   }
+  assert_info(config.has_key("texture"),
+              "Either `filenpath` or `texture` should be specified.");
+  res = config.get("res", Vector2i(1024, 512));
+  image = std::make_shared<Array2D<Vector3>>(res);
+  Texture *tex = config.get_asset<Texture>("texture").get();
+  *image = tex->rasterize3(res);
+  flip_rows();
+  build_cdfs();
   /*
   for (int j = 0; j < height; j++) {
       // conversion
@@ -35,12 +53,6 @@ void EnvironmentMap::initialize(const Config &config) {
       }
   }
   */
-  for (int j = 0; j < res[1] - j - 1; j++) {
-    for (int i = 0; i < res[0]; i++)
-      std::swap((*image)[i][j], (*image)[i][res[1] - j - 1]);
-  }
-
-  build_cdfs();
   /*
   TC_P("test");
   TC_P(uv_to_direction(Vector2(0.0_f, 0.0_f)));
@@ -83,14 +95,13 @@ Vector3 EnvironmentMap::sample_direction(StateSequence &rand,
                                          real &pdf,
                                          Vector3 &illum) const {
   Vector2 uv;
-  real row_pdf, row_cdf;
-  real col_pdf, col_cdf;
+  real row_pdf, col_pdf;
   real row_sample = rand();
   real col_sample = rand();
-  int row = row_sampler.sample(row_sample, row_pdf, row_cdf);
-  int col = col_samplers[row].sample(col_sample, col_pdf, col_cdf);
-  real u = col + 0.5f;  // (col_sample - col_cdf) / col_pdf;
-  real v = row + 0.5f;  // (row_sample - row_cdf) / row_pdf;
+  int row = row_sampler.sample(row_sample, row_pdf);
+  int col = col_samplers[row].sample(col_sample, col_pdf);
+  real u = col + 0.5f;
+  real v = row + 0.5f;
   uv.x = u / res[0];
   uv.y = v / res[1];
   illum = sample_illum(uv);
@@ -99,27 +110,63 @@ Vector3 EnvironmentMap::sample_direction(StateSequence &rand,
   return uv_to_direction(uv);
 }
 
-void EnvironmentMap::build_cdfs() {
-  std::vector<real> row_pdf;
-  avg_illum = 0;
-  real total_weight = 0.0_f;
-  for (int j = 0; j < res[1]; j++) {
-    std::vector<real> col_pdf;
-    real scale = sin(pi * (0.5f + j) / res[1]);
-    real total = 0.0_f;
-    for (int i = 0; i < res[0]; i++) {
-      real pdf =
-          luminance(image->sample((i + 0.5f) / res[0], (j + 0.5f) / res[1]));
-      avg_illum += pdf * scale;
-      total_weight += scale;
-      total += pdf;
-      col_pdf.push_back(pdf);
-    }
-    col_samplers.push_back(DiscreteSampler(col_pdf, true));
-    row_pdf.push_back(total * scale);
+void EnvironmentMap::flip_rows() {
+  for (int j = 0; j < res[1] - j - 1; j++) {
+    for (int i = 0; i < res[0]; i++)
+      std::swap((*image)[i][j], (*image)[i][res[1] - j - 1]);
   }
+}
+
+void EnvironmentMap::build_cdfs() {
+  // Rows are independent; only their totals are combined afterwards
+  std::vector<real> row_total(res[1]);
+  col_samplers.assign(res[1], DiscreteSampler());
+  ThreadedTaskManager::run(
+      [&](int j) {
+        std::vector<real> col_pdf(res[0]);
+        real total = 0.0_f;
+        for (int i = 0; i < res[0]; i++) {
+          real pdf = luminance(
+              image->sample((i + 0.5f) / res[0], (j + 0.5f) / res[1]));
+          total += pdf;
+          col_pdf[i] = pdf;
+        }
+        col_samplers[j].initialize(col_pdf, true);
+        row_total[j] = total;
+      },
+      0, res[1], num_threads);
+  std::vector<real> row_pdf(res[1]);
+  // (illumination, weight) of the rows, with their solid angles
+  Vector2 sums = ThreadedTaskManager::reduce(
+      0, res[1], num_threads, Vector2(0.0_f),
+      [&](int begin, int end) {
+        Vector2 sum(0.0_f);
+        for (int j = begin; j < end; j++) {
+          real scale = sin(pi * (0.5f + j) / res[1]);
+          row_pdf[j] = row_total[j] * scale;
+          sum += Vector2(row_pdf[j], scale * res[0]);
+        }
+        return sum;
+      },
+      [](const Vector2 &a, const Vector2 &b) { return a + b; }, 256);
   row_sampler.initialize(row_pdf);
-  avg_illum /= total_weight;
+  avg_illum = sums.x / sums.y;
+}
+
+bool EnvironmentMap::load_cache(const std::string &fn, uint64 stamp) {
+  auto cached = std::make_shared<Array2D<Vector3>>();
+  if (!read_binary_cache(fn, envmap_cache_version, stamp, *cached, row_sampler,
+                         col_samplers, avg_illum)) {
+    return false;
+  }
+  image = cached;
+  res = image->get_res();
+  return true;
+}
+
+void EnvironmentMap::save_cache(const std::string &fn, uint64 stamp) const {
+  write_binary_cache(fn, envmap_cache_version, stamp, *image, row_sampler,
+                     col_samplers, avg_illum);
 }
 
 TC_NAMESPACE_END
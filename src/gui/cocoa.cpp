@@ -68,19 +68,7 @@ void redraw(id self, SEL _, CGRect __) {
   using namespace taichi;
   auto *gui = gui_from_id[self];
   auto width = gui->width, height = gui->height;
-  auto &img = gui->canvas->img;
   auto &data = gui->img_data;
-  for (int j = 0; j < height; j++) {
-    for (int i = 0; i < width; i++) {
-      int index = 4 * (i + j * width);
-      auto pixel = img[i][height - j - 1];
-      data[index++] = uint8(clamp(int(pixel[0] * 255.0_f), 0, 255));
-      data[index++] = uint8(clamp(int(pixel[1] * 255.0_f), 0, 255));
-      data[index++] = uint8(clamp(int(pixel[2] * 255.0_f), 0, 255));
-      data[index++] = 255;  // alpha
-    }
-  }
-
   CGDataProviderRef provider = CGDataProviderCreateWithData(
       nullptr, data.data(), gui->img_data_length, nullptr);
   CGColorSpaceRef colorspace = CGColorSpaceCreateDeviceRGB();
@@ -186,7 +174,16 @@ void GUI::set_title(std::string title) {
 }
 
 void GUI::redraw() {
-  call(view, "setNeedsDisplay:", YES);
+  Vector2i begin, end;
+  if (!get_redraw_region(begin, end)) {
+    return;
+  }
+  // Converted here instead of in drawRect:, which then only draws the
+  // region, in the view coordinates, which are also from the bottom up
+  convert_to_rgba8(canvas->img, begin, end, img_data.data(), false, 255);
+  CGRect rect{{CGFloat(begin.x), CGFloat(begin.y)},
+              {CGFloat(end.x - begin.x), CGFloat(end.y - begin.y)}};
+  call(view, "setNeedsDisplayInRect:", rect);
 }
 
 GUI::~GUI() {
@@ -1,7 +1,178 @@
 #include <taichi/visual/gui.h>
+#include <taichi/system/threading.h>
 
 TC_NAMESPACE_BEGIN
 
 Vector2 Canvas::Line::vertices[128];
 
+constexpr int shape_tile_size = 32;
+
+// The pixels [begin, end) a shape may cover
+static void get_shape_bounds(const Canvas::Shape &shape,
+                             Vector2i &begin,
+                             Vector2i &end) {
+  Vector2 lower, upper;
+  if (shape.type == Canvas::Shape::Type::circle) {
+    lower = upper = shape.a;
+  } else {
+    lower = Vector2(std::min(shape.a.x, shape.b.x),
+                    std::min(shape.a.y, shape.b.y));
+    upper = Vector2(std::max(shape.a.x, shape.b.x),
+                    std::max(shape.a.y, shape.b.y));
+    if (shape.type == Canvas::Shape::Type::triangle) {
+      lower = Vector2(std::min(lower.x, shape.c.x),
+                      std::min(lower.y, shape.c.y));
+      upper = Vector2(std::max(upper.x, shape.c.x),
+                      std::max(upper.y, shape.c.y));
+    }
+  }
+  // Half a pixel more, for the anti-aliased edges
+  real margin = shape.radius + 0.5_f;
+  // Clamped for the conversion of shapes far off the image
+  auto to_int = [](real x) { return (int)clamp(x, -1.0_f, 1e8_f); };
+  begin = Vector2i(to_int(std::floor(lower.x - margin)),
+                   to_int(std::floor(lower.y - margin)));
+  end = Vector2i(to_int(std::ceil(upper.x + margin)),
+                 to_int(std::ceil(upper.y + margin)));
+}
+
+// The fraction of pixel |p| (its center) the shape covers
+TC_FORCE_INLINE static real get_shape_coverage(const Canvas::Shape &shape,
+                                               Vector2 p) {
+  if (shape.type == Canvas::Shape::Type::circle) {
+    return clamp(shape.radius - length(p - shape.a) + 0.5_f);
+  } else if (shape.type == Canvas::Shape::Type::segment) {
+    Vector2 d = shape.b - shape.a, q = p - shape.a;
+    real t = clamp(dot(q, d) / std::max(dot(d, d), 1e-12_f));
+    return clamp(shape.radius - length(q - t * d) + 0.5_f);
+  } else {
+    const Vector2 *v[3] = {&shape.a, &shape.b, &shape.c};
+    // Distances inside the edges are positive, of either winding
+    real orientation =
+        cross(shape.b - shape.a, shape.c - shape.a) >= 0 ? 1.0_f : -1.0_f;
+    real dist = std::numeric_limits<real>::max();
+    for (int k = 0; k < 3; k++) {
+      Vector2 e = *v[(k + 1) % 3] - *v[k];
+      real l = std::max(length(e), 1e-6_f);
+      dist = std::min(dist, orientation * cross(e, p - *v[k]) / l);
+    }
+    return clamp(dist + 0.5_f);
+  }
+}
+
+void Canvas::draw_shapes(const std::vector<Shape> &shapes, int num_threads) {
+  if (shapes.empty()) {
+    return;
+  }
+  const int width = img.get_width(), height = img.get_height();
+  const int tiles_x = (width + shape_tile_size - 1) / shape_tile_size;
+  const int tiles_y = (height + shape_tile_size - 1) / shape_tile_size;
+  const int num_tiles = tiles_x * tiles_y;
+  // The shapes of every tile, in order, by counts and offsets
+  std::vector<int> tile_begin(num_tiles + 1, 0);
+  auto for_each_tile = [&](const Shape &shape, const auto &f) {
+    Vector2i begin, end;
+    get_shape_bounds(shape, begin, end);
+    begin = Vector2i(std::max(begin.x, 0), std::max(begin.y, 0));
+    end = Vector2i(std::min(end.x, width), std::min(end.y, height));
+    if (!(begin.x < end.x && begin.y < end.y)) {
+      return;
+    }
+    mark_dirty(begin, end);
+    for (int x = begin.x / shape_tile_size;
+         x <= (end.x - 1) / shape_tile_size; x++) {
+      for (int y = begin.y / shape_tile_size;
+           y <= (end.y - 1) / shape_tile_size; y++) {
+        f(x * tiles_y + y);
+      }
+    }
+  };
+  for (auto &shape : shapes) {
+    for_each_tile(shape, [&](int t) { tile_begin[t + 1]++; });
+  }
+  for (int t = 0; t < num_tiles; t++) {
+    tile_begin[t + 1] += tile_begin[t];
+  }
+  std::vector<int> next(tile_begin.begin(), tile_begin.end() - 1);
+  std::vector<int> bins(tile_begin[num_tiles]);
+  for (int i = 0; i < (int)shapes.size(); i++) {
+    for_each_tile(shapes[i], [&](int t) { bins[next[t]++] = i; });
+  }
+  auto draw_tile = [&](int t) {
+    const int x0 = t / tiles_y * shape_tile_size;
+    const int y0 = t % tiles_y * shape_tile_size;
+    const int x1 = std::min(x0 + shape_tile_size, width);
+    const int y1 = std::min(y0 + shape_tile_size, height);
+    for (int k = tile_begin[t]; k < tile_begin[t + 1]; k++) {
+      const Shape &shape = shapes[bins[k]];
+      Vector2i begin, end;
+      get_shape_bounds(shape, begin, end);
+      for (int i = std::max(begin.x, x0); i < std::min(end.x, x1); i++) {
+        for (int j = std::max(begin.y, y0); j < std::min(end.y, y1); j++) {
+          real alpha =
+              shape.color.w *
+              get_shape_coverage(shape, Vector2(i + 0.5_f, j + 0.5_f));
+          if (alpha > 0) {
+            auto &dest = img[i][j];
+            dest = lerp(alpha, dest, shape.color);
+          }
+        }
+      }
+    }
+  };
+#if !defined(TC_AMALGAMATED)
+  ThreadedTaskManager::run(num_tiles, num_threads, draw_tile);
+#else
+  for (int t = 0; t < num_tiles; t++) {
+    draw_tile(t);
+  }
+#endif
+}
+
+template <typename V>
+TC_FORCE_INLINE uint32 pixel_to_rgba8(const V &c, bool bgra, std::true_type) {
+  __m128 v = c.v;
+  if (bgra) {
+    v = _mm_shuffle_ps(v, v, _MM_SHUFFLE(3, 0, 1, 2));
+  }
+  // Saturating packs clamp to [0, 255]
+  __m128i i = _mm_cvttps_epi32(_mm_mul_ps(v, _mm_set1_ps(255.0f)));
+  i = _mm_packs_epi32(i, i);
+  i = _mm_packus_epi16(i, i);
+  return (uint32)_mm_cvtsi128_si32(i);
+}
+
+template <typename V>
+TC_FORCE_INLINE uint32 pixel_to_rgba8(const V &c, bool bgra, std::false_type) {
+  uint32 bytes[4];
+  for (int k = 0; k < 4; k++) {
+    bytes[k] = (uint32)clamp(int(c[k] * 255.0_f), 0, 255);
+  }
+  if (bgra) {
+    std::swap(bytes[0], bytes[2]);
+  }
+  return bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | (bytes[3] << 24);
+}
+
+void convert_to_rgba8(const Array2D<Vector4> &img,
+                      Vector2i begin,
+                      Vector2i end,
+                      uint8 *data,
+                      bool bgra,
+                      int alpha) {
+  int width = img.get_width(), height = img.get_height();
+  uint32 mask = alpha < 0 ? 0xFFFFFFFFu : 0x00FFFFFFu;
+  uint32 alpha_bits = alpha < 0 ? 0u : (uint32)alpha << 24;
+  for (int j = begin.y; j < end.y; j++) {
+    // Pixels are written in the byte order of the channels
+    uint8 *row = data + 4 * (std::size_t)width * (height - 1 - j);
+    for (int i = begin.x; i < end.x; i++) {
+      uint32 p = pixel_to_rgba8(img[i][j], bgra,
+                                std::integral_constant<bool, Vector4::simd>());
+      p = (p & mask) | alpha_bits;
+      std::memcpy(row + 4 * i, &p, 4);
+    }
+  }
+}
+
 TC_NAMESPACE_END
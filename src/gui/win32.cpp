@@ -40,6 +40,9 @@ LRESULT CALLBACK WindowProc(HWND hwnd,
           GUI::MouseEvent{GUI::MouseEvent::Type::move, gui->cursor_pos});
       break;
     case WM_PAINT:
+      if (gui != nullptr && gui->canvas) {
+        gui->canvas->mark_dirty();
+      }
       break;
     case WM_CLOSE:
       exit(0);
@@ -89,26 +92,33 @@ void GUI::create_window() {
 
   ShowWindow(hwnd, SW_SHOWDEFAULT);
   hdc = GetDC(hwnd);
-  data = (COLORREF *)calloc(width * height, sizeof(COLORREF));
   src = CreateCompatibleDC(hdc);
+  // A top-down DIB section, kept selected, which is converted into in
+  // place and blitted from without creating a bitmap per frame
+  BITMAPINFO info = {};
+  info.bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
+  info.bmiHeader.biWidth = width;
+  info.bmiHeader.biHeight = -height;
+  info.bmiHeader.biPlanes = 1;
+  info.bmiHeader.biBitCount = 32;
+  info.bmiHeader.biCompression = BI_RGB;
+  bitmap =
+      CreateDIBSection(src, &info, DIB_RGB_COLORS, (void **)&data, nullptr, 0);
+  TC_ERROR_IF(bitmap == nullptr, "Cannot create the window bitmap");
+  SelectObject(src, bitmap);
 }
 
 void GUI::redraw() {
   UpdateWindow(hwnd);
-  // http:// www.cplusplus.com/reference/cstdlib/calloc/
-  for (int i = 0; i < width; i++) {
-    for (int j = 0; j < height; j++) {
-      auto c = reinterpret_cast<unsigned char *>(data + (j * width) + i);
-      c[0] = (unsigned char)(canvas->img[i][height - j - 1][2] * 255.0_f);
-      c[1] = (unsigned char)(canvas->img[i][height - j - 1][1] * 255.0_f);
-      c[2] = (unsigned char)(canvas->img[i][height - j - 1][0] * 255.0_f);
-      c[3] = 0;
-    }
+  Vector2i begin, end;
+  if (!get_redraw_region(begin, end)) {
+    return;
   }
-  bitmap = CreateBitmap(width, height, 1, 32, (void *)data);
-  SelectObject(src, bitmap);
-  BitBlt(hdc, 0, 0, width, height, src, 0, 0, SRCCOPY);
-  DeleteObject(bitmap);
+  // GDI may still be drawing from the bitmap
+  GdiFlush();
+  convert_to_rgba8(canvas->img, begin, end, (uint8 *)data, true, 0);
+  BitBlt(hdc, begin.x, height - end.y, end.x - begin.x, end.y - begin.y, src,
+         begin.x, height - end.y, SRCCOPY);
 }
 
 void GUI::set_title(std::string title) {
@@ -116,8 +126,9 @@ void GUI::set_title(std::string title) {
 }
 
 GUI::~GUI() {
-  std::free(data);
   DeleteDC(src);
+  // Frees |data|
+  DeleteObject(bitmap);
   gui_from_hwnd.erase(hwnd);
 }
 
@@ -3,6 +3,9 @@
 #if defined(TC_GUI_X11)
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
+#include <X11/extensions/XShm.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
 
 // Undo terrible unprefixed macros in X.h
 #ifdef None
@@ -14,34 +17,99 @@
 
 TC_NAMESPACE_BEGIN
 
+static bool shm_attach_failed;
+
+static int handle_shm_attach_error(Display *, XErrorEvent *) {
+  shm_attach_failed = true;
+  return 0;
+}
+
 class CXImage {
  public:
   XImage *image;
   std::vector<uint8> image_data;
   int width, height;
+  // Shared with the X server, which then reads the pixels in place instead
+  // of from the socket; not for remote displays
+  bool shared;
+  XShmSegmentInfo shm_info;
+
   CXImage(Display *display, Visual *visual, int width, int height)
-      : width(width), height(height) {
-    image_data.resize(width * height * 4);
-    image = XCreateImage(display, visual, 24, ZPixmap, 0,
-                         (char *)image_data.data(), width, height, 32, 0);
-    TC_ASSERT((void *)image->data == image_data.data());
+      : width(width), height(height), shared(false) {
+    if (XShmQueryExtension(display)) {
+      create_shared(display, visual);
+    }
+    if (!shared) {
+      image_data.resize(width * height * 4);
+      image = XCreateImage(display, visual, 24, ZPixmap, 0,
+                           (char *)image_data.data(), width, height, 32, 0);
+      TC_ASSERT((void *)image->data == image_data.data());
+    }
   }
 
-  void set_data(const Array2D<Vector4> &color) {
-    auto p = image_data.data();
-    for (int j = 0; j < height; j++) {
-      for (int i = 0; i < width; i++) {
-        auto c = color[i][height - j - 1];
-        *p++ = uint8(clamp(int(c[2] * 255.0_f), 0, 255));
-        *p++ = uint8(clamp(int(c[1] * 255.0_f), 0, 255));
-        *p++ = uint8(clamp(int(c[0] * 255.0_f), 0, 255));
-        *p++ = uint8(clamp(int(c[3] * 255.0_f), 0, 255));
+  void create_shared(Display *display, Visual *visual) {
+    image = XShmCreateImage(display, visual, 24, ZPixmap, nullptr, &shm_info,
+                            width, height);
+    if (image == nullptr) {
+      return;
+    }
+    shm_info.shmid =
+        shmget(IPC_PRIVATE, image->bytes_per_line * height, IPC_CREAT | 0600);
+    if (shm_info.shmid < 0) {
+      XDestroyImage(image);
+      return;
+    }
+    shm_info.shmaddr = image->data = (char *)shmat(shm_info.shmid, nullptr, 0);
+    shm_info.readOnly = False;
+    // Attaching fails asynchronously, e.g. for remote displays
+    shm_attach_failed = false;
+    auto old_handler = XSetErrorHandler(handle_shm_attach_error);
+    XShmAttach(display, &shm_info);
+    XSync(display, False);
+    XSetErrorHandler(old_handler);
+    // Freed once both sides have detached
+    shmctl(shm_info.shmid, IPC_RMID, nullptr);
+    if (shm_attach_failed || image->bytes_per_line != width * 4) {
+      if (!shm_attach_failed) {
+        XShmDetach(display, &shm_info);
       }
+      shmdt(shm_info.shmaddr);
+      image->data = nullptr;
+      XDestroyImage(image);
+      return;
     }
+    shared = true;
   }
 
-  ~CXImage() {
-    delete image;  // image->data is automatically released in image_data
+  uint8 *data() {
+    return (uint8 *)image->data;
+  }
+
+  void put(Display *display,
+           Window window,
+           int x,
+           int y,
+           int width,
+           int height) {
+    if (shared) {
+      XShmPutImage(display, window, DefaultGC(display, 0), image, x, y, x, y,
+                   width, height, False);
+    } else {
+      XPutImage(display, window, DefaultGC(display, 0), image, x, y, x, y,
+                width, height);
+    }
+  }
+
+  void destroy(Display *display) {
+    if (shared) {
+      XShmDetach(display, &shm_info);
+      XSync(display, False);
+      shmdt(shm_info.shmaddr);
+      image->data = nullptr;
+      XDestroyImage(image);
+    } else {
+      delete image;  // image->data is automatically released in image_data
+    }
   }
 };
 
@@ -51,6 +119,7 @@ void GUI::process_event() {
     XNextEvent((Display *)display, &ev);
     switch (ev.type) {
       case Expose:
+        canvas->mark_dirty();
         break;
       case MotionNotify:
         set_mouse_pos(ev.xbutton.x, height - ev.xbutton.y - 1);
@@ -80,13 +149,35 @@ void GUI::create_window() {
                    ButtonPress | ButtonReleaseMask | EnterWindowMask |
                    LeaveWindowMask | PointerMotionMask);
   XMapWindow((Display *)display, window);
-  img = new CXImage((Display *)display, (Visual *)visual, width, height);
+  for (auto &image : img) {
+    image = new CXImage((Display *)display, (Visual *)visual, width, height);
+  }
+  back = 0;
+  last_dirty_begin = Vector2i(0);
+  last_dirty_end = Vector2i(width, height);
 }
 
 void GUI::redraw() {
-  img->set_data(buffer);
-  XPutImage((Display *)display, window, DefaultGC(display, 0), img->image, 0, 0,
-            0, 0, width, height);
+  Vector2i begin, end;
+  if (!get_redraw_region(begin, end)) {
+    return;
+  }
+  // The back image is two frames old, and so also needs the pixels of the
+  // last frame
+  Vector2i convert_begin(std::min(begin.x, last_dirty_begin.x),
+                         std::min(begin.y, last_dirty_begin.y));
+  Vector2i convert_end(std::max(end.x, last_dirty_end.x),
+                       std::max(end.y, last_dirty_end.y));
+  convert_to_rgba8(buffer, convert_begin, convert_end, img[back]->data(), true);
+  // The server is done with the front image (of the last frame) after this,
+  // so that it is the next back image
+  XSync((Display *)display, False);
+  img[back]->put((Display *)display, window, begin.x, height - end.y,
+                 end.x - begin.x, end.y - begin.y);
+  XFlush((Display *)display);
+  last_dirty_begin = begin;
+  last_dirty_end = end;
+  back = 1 - back;
 }
 
 void GUI::set_title(std::string title) {
@@ -94,7 +185,10 @@ void GUI::set_title(std::string title) {
 }
 
 GUI::~GUI() {
-  delete img;
+  for (auto image : img) {
+    image->destroy((Display *)display);
+    delete image;
+  }
 }
 
 TC_NAMESPACE_END
@@ -4,6 +4,7 @@
 *******************************************************************************/
 
 #include <taichi/image/tone_mapper.h>
+#include <taichi/image/kernels.h>
 #include <taichi/math/array_op.h>
 #include <taichi/physics/physics_constants.h>
 #include <taichi/dynamics/poisson_solver.h>
@@ -21,7 +22,7 @@ class GradientDomainTMO final : public ToneMapper {
  public:
   void initialize(const Config &config) override {
     pyramid_sigma = config.get("pyramid_sigma", 1.0_f);
-    num_threads = config.get("num_threads", 1);
+    num_threads = config.get("num_threads", -1);
     max_solver_iterations = config.get("max_solver_iterations", 100);
     alpha = config.get<real>("alpha");
     beta = config.get<real>("beta");
@@ -30,25 +31,26 @@ class GradientDomainTMO final : public ToneMapper {
 
   virtual Array2D<Vector3> apply(const Array2D<Vector3> &inp) override {
     int width = inp.get_width(), height = inp.get_height();
-    assert_info(inp.get_width() == inp.get_height(),
-                "only square image supported currently.");
 
     Array2D<real> lum(inp.get_res());
     Array2D<real> log_lum(inp.get_res());
-    for (auto &ind : inp.get_region()) {
-      lum[ind] = luminance(inp[ind]);
-      log_lum[ind] = std::log(lum[ind] + 1e-4_f);
-    }
+    parallel_for_pixels(inp.get_res(),
+                        [&](int i, int j) {
+                          lum[i][j] = luminance(inp[i][j]);
+                          log_lum[i][j] = std::log(lum[i][j] + 1e-4_f);
+                        },
+                        num_threads);
     std::vector<Array2D<real>> pyramid;
     std::vector<Array2D<real>> phi;
     Array2D<Vector2> G(Vector2i(width, height));
     Array2D<real> div_G(Vector2i(width, height));
 
     pyramid.push_back(log_lum);
-    int size = inp.get_width();
+    int size = std::min(width, height);
     while (size > 32) {
       size /= 2;
-      auto blurred = gaussian_blur(pyramid.back(), pyramid_sigma);
+      auto blurred =
+          parallel_gaussian_blur(pyramid.back(), pyramid_sigma, num_threads);
       pyramid.push_back(take_downsampled(blurred, 2));
     }
     phi.resize(pyramid.size());
@@ -56,55 +58,67 @@ class GradientDomainTMO final : public ToneMapper {
       phi[k] = Array2D<real>(pyramid[k].get_res());
       Array2D<real> grad_norm(pyramid[k].get_res());
       real scale = std::pow(0.5f, k + 1);
-      for (auto &ind : grad_norm.get_region()) {
-        real grad_x = 0, grad_y = 0;
-        if (ind.i > 0) {
-          grad_x += pyramid[k][ind] - pyramid[k][ind.neighbour(-1, 0)];
-        }
-        if (ind.i < pyramid[k].get_width() - 1) {
-          grad_x += pyramid[k][ind.neighbour(1, 0)] - pyramid[k][ind];
-        }
-        if (ind.j > 0) {
-          grad_y += pyramid[k][ind] - pyramid[k][ind.neighbour(0, -1)];
-        }
-        if (ind.j < pyramid[k].get_height() - 1) {
-          grad_y += pyramid[k][ind.neighbour(0, 1)] - pyramid[k][ind];
-        }
-        grad_x *= 0.5;
-        grad_y *= 0.5;
-        grad_norm[ind] = std::hypot(grad_x, grad_y) * scale;
-      }
-      real avg = grad_norm.get_average();
-      for (auto &ind : phi[k].get_region()) {
-        real norm = std::max(grad_norm[ind], 1e-5_f);
-        phi[k][ind] = std::pow(norm / (alpha * avg), beta - 1);
-        if (k != (int)pyramid.size() - 1) {
-          phi[k][ind] *= phi[k + 1].sample(ind.get_pos() * 2.0_f);
-        }
-      }
+      const Array2D<real> &level = pyramid[k];
+      int level_width = level.get_width(), level_height = level.get_height();
+      parallel_for_pixels(
+          level.get_res(),
+          [&](int i, int j) {
+            real grad_x = 0, grad_y = 0;
+            if (i > 0) {
+              grad_x += level[i][j] - level[i - 1][j];
+            }
+            if (i < level_width - 1) {
+              grad_x += level[i + 1][j] - level[i][j];
+            }
+            if (j > 0) {
+              grad_y += level[i][j] - level[i][j - 1];
+            }
+            if (j < level_height - 1) {
+              grad_y += level[i][j + 1] - level[i][j];
+            }
+            grad_x *= 0.5;
+            grad_y *= 0.5;
+            grad_norm[i][j] = std::hypot(grad_x, grad_y) * scale;
+          },
+          num_threads);
+      real avg = parallel_sum(grad_norm, num_threads) / grad_norm.get_size();
+      bool coarsest = k == (int)pyramid.size() - 1;
+      parallel_for_pixels(
+          level.get_res(),
+          [&](int i, int j) {
+            real norm = std::max(grad_norm[i][j], 1e-5_f);
+            phi[k][i][j] = std::pow(norm / (alpha * avg), beta - 1);
+            if (!coarsest) {
+              // The next level has half the resolution
+              Vector2 pos(i + 0.5_f, j + 0.5_f);
+              phi[k][i][j] *= phi[k + 1].sample(pos * 0.5_f);
+            }
+          },
+          num_threads);
     }
     auto oup = inp;
-    for (auto &ind : G.get_region()) {
-      real grad_x, grad_y;
-      if (ind.i + 1 < width)
-        grad_x = log_lum[ind.neighbour(1, 0)] - log_lum[ind];
-      else
-        grad_x = 0;
-      if (ind.j + 1 < height)
-        grad_y = log_lum[ind.neighbour(0, 1)] - log_lum[ind];
-      else
-        grad_y = 0;
-      G[ind] = Vector2(grad_x, grad_y) * phi[0][ind];
-    }
-    for (auto &ind : div_G.get_region()) {
-      real div_x = G[ind].x, div_y = G[ind].y;
-      if (ind.i > 0)
-        div_x -= G[ind.neighbour(-1, 0)].x;
-      if (ind.j > 0)
-        div_y -= G[ind.neighbour(0, -1)].y;
-      div_G[ind] = -(div_x + div_y);
-    }
-    auto poisson_solver = create_instance<PoissonSolver2D>("mgpcg");
+    parallel_for_pixels(G.get_res(),
+                        [&](int i, int j) {
+                          real grad_x = 0, grad_y = 0;
+                          if (i + 1 < width)
+                            grad_x = log_lum[i + 1][j] - log_lum[i][j];
+                          if (j + 1 < height)
+                            grad_y = log_lum[i][j + 1] - log_lum[i][j];
+                          G[i][j] = Vector2(grad_x, grad_y) * phi[0][i][j];
+                        },
+                        num_threads);
+    parallel_for_pixels(div_G.get_res(),
+                        [&](int i, int j) {
+                          real div_x = G[i][j].x, div_y = G[i][j].y;
+                          if (i > 0)
+                            div_x -= G[i - 1][j].x;
+                          if (j > 0)
+                            div_y -= G[i][j - 1].y;
+                          div_G[i][j] = -(div_x + div_y);
+                        },
+                        num_threads);
+    // A box without obstacles: solved directly
+    auto poisson_solver = create_instance<PoissonSolver2D>("spectral");
     Config cfg;
     cfg.set("res", Vector2i(width, height))
         .set("num_threads", num_threads)
@@ -116,19 +130,24 @@ class GradientDomainTMO final : public ToneMapper {
                                                 PoissonSolver2D::INTERIOR);
     poisson_solver->set_boundary_condition(boundary);
 
-    real avg_div_G = div_G.get_average();
-    for (auto &ind : div_G.get_region()) {
-      div_G[ind] -= avg_div_G;
-    }
+    real avg_div_G = parallel_sum(div_G, num_threads) / div_G.get_size();
+    parallel_for_pixels(div_G.get_res(),
+                        [&](int i, int j) { div_G[i][j] -= avg_div_G; },
+                        num_threads);
 
     Array2D<real> I(Vector2i(width, height));
     poisson_solver->run(div_G, I, 1e-5_f);
-    for (auto &ind : oup.get_region()) {
-      for (int i = 0; i < 3; i++) {
-        oup[ind][i] =
-            std::pow(inp[ind][i] / (lum[ind] + 1e-30f), s) * std::exp(I[ind]);
-      }
-    }
+    parallel_for_pixels(oup.get_res(),
+                        [&](int i, int j) {
+                          real exposure = std::exp(I[i][j]);
+                          for (int c = 0; c < 3; c++) {
+                            oup[i][j][c] =
+                                std::pow(inp[i][j][c] / (lum[i][j] + 1e-30f),
+                                         s) *
+                                exposure;
+                          }
+                        },
+                        num_threads);
     return oup;
   }
 };
@@ -4,6 +4,7 @@
 *******************************************************************************/
 
 #include <taichi/image/tone_mapper.h>
+#include <taichi/image/kernels.h>
 #include <taichi/math/array_op.h>
 #include <taichi/math/array_3d.h>
 #include <taichi/physics/physics_constants.h>
@@ -13,35 +14,32 @@ TC_NAMESPACE_BEGIN
 class HETMO final : public ToneMapper {
  protected:
   int num_bins;
+  int num_threads;
 
  public:
   void initialize(const Config &config) override {
     num_bins = config.get<int>("num_bins");
+    num_threads = config.get("num_threads", -1);
   }
 
   virtual Array2D<Vector3> apply(const Array2D<Vector3> &inp) override {
     int width = inp.get_width(), height = inp.get_height();
-    Array2D<real> lum(inp.get_res());
-    for (auto &ind : inp.get_region()) {
-      lum[ind] = luminance(inp[ind]);
-    }
-    auto scale = num_bins / (1e-30f + lum.max());
-    std::vector<int> cdf(num_bins, 0);
-    for (auto &ind : inp.get_region()) {
-      cdf[std::min(num_bins - 1, (int)(scale * lum[ind]))] += 1;
-    }
+    auto lum = parallel_map(
+        inp, [](const Vector3 &c) { return luminance(c); }, num_threads);
+    auto scale = num_bins / (1e-30f + parallel_max(lum, num_threads));
+    auto bin = [&](real l) { return std::min(num_bins - 1, (int)(scale * l)); };
+    std::vector<int> cdf = parallel_histogram(lum, num_bins, bin, num_threads);
     for (int i = 0; i < num_bins - 1; i++) {
       cdf[i + 1] += cdf[i];
     }
     auto oup = inp;
-    for (auto &ind : oup.get_region()) {
-      real new_lum = 1.0_f *
-                     cdf[std::min(num_bins - 1, (int)(scale * lum[ind]))] /
-                     (width * height);
-      for (int i = 0; i < 3; i++) {
-        oup[ind][i] = inp[ind][i] / (lum[ind] + 1e-30f) * new_lum;
-      }
-    }
+    parallel_for_pixels(
+        oup.get_res(),
+        [&](int i, int j) {
+          real new_lum = 1.0_f * cdf[bin(lum[i][j])] / (width * height);
+          oup[i][j] = inp[i][j] * (new_lum / (lum[i][j] + 1e-30f));
+        },
+        num_threads);
     return oup;
   }
 };
@@ -53,12 +51,14 @@ class CLAHETMO final : public ToneMapper {
   int num_bins;
   int num_slices;
   real contrast_limit;
+  int num_threads;
 
  public:
   void initialize(const Config &config) override {
     num_bins = config.get<int>("num_bins");
     num_slices = config.get<int>("num_slices");
     contrast_limit = config.get("contrast_limit", 0.0_f);
+    num_threads = config.get("num_threads", -1);
   }
 
   virtual Array2D<Vector3> apply(const Array2D<Vector3> &inp) override {
@@ -67,62 +67,82 @@ class CLAHETMO final : public ToneMapper {
     int y_slices = num_slices;
     int x_slice_size = (int)std::ceil(1.0_f * width / num_slices);
     int y_slice_size = (int)std::ceil(1.0_f * height / num_slices);
-    Array2D<real> lum(inp.get_res());
-    for (auto &ind : inp.get_region()) {
-      lum[ind] = luminance(inp[ind]);
-    }
-    real max_lum = lum.max() + 1e-20f;
+    auto lum = parallel_map(
+        inp, [](const Vector3 &c) { return luminance(c); }, num_threads);
+    real max_lum = parallel_max(lum, num_threads) + 1e-20f;
     real scale = num_bins / max_lum;
+    auto bin = [&](real l) { return std::min(num_bins - 1, (int)(scale * l)); };
+    // Each slice's window covers it and its neighbours, so the pixels are
+    // counted once per slice and the windows sum 3x3 slice histograms
+    std::vector<std::vector<int>> slice_histograms(
+        x_slices * y_slices, std::vector<int>(num_bins, 0));
+    ThreadedTaskManager::run(
+        [&](int s) {
+          int i = s / y_slices, j = s % y_slices;
+          accumulate_histogram(lum, bin, std::min(i * x_slice_size, width),
+                               std::min((i + 1) * x_slice_size, width),
+                               std::min(j * y_slice_size, height),
+                               std::min((j + 1) * y_slice_size, height),
+                               slice_histograms[s]);
+        },
+        0, x_slices * y_slices, num_threads);
     Array3D<real> histograms(Vector3i(x_slices, y_slices, num_bins));
-    for (int i = 0; i < x_slices; i++) {
-      for (int j = 0; j < y_slices; j++) {
-        int x_start = std::max(0, (i - 1) * x_slice_size);
-        int x_end = std::min((i + 2) * x_slice_size, width);
-        int y_start = std::max(0, (j - 1) * y_slice_size);
-        int y_end = std::min((j + 2) * y_slice_size, height);
-        std::vector<int> cdf(num_bins, 0);
-        for (int x = x_start; x < x_end; x++) {
-          for (int y = y_start; y < y_end; y++) {
-            cdf[std::min(num_bins - 1, (int)(scale * lum[x][y]))] += 1;
+    ThreadedTaskManager::run(
+        [&](int s) {
+          int i = s / y_slices, j = s % y_slices;
+          int x_start = std::max(0, (i - 1) * x_slice_size);
+          int x_end = std::min((i + 2) * x_slice_size, width);
+          int y_start = std::max(0, (j - 1) * y_slice_size);
+          int y_end = std::min((j + 2) * y_slice_size, height);
+          std::vector<int> cdf(num_bins, 0);
+          for (int p = std::max(i - 1, 0); p <= std::min(i + 1, x_slices - 1);
+               p++) {
+            for (int q = std::max(j - 1, 0);
+                 q <= std::min(j + 1, y_slices - 1); q++) {
+              auto &h = slice_histograms[p * y_slices + q];
+              for (int k = 0; k < num_bins; k++) {
+                cdf[k] += h[k];
+              }
+            }
           }
-        }
-        int num_pixels = (x_end - x_start) * (y_end - y_start);
-        int threshold = int(1.0_f * num_pixels / num_bins * contrast_limit);
-        int clipped = 0;
-        if (contrast_limit != 0.0_f) {
-          for (int k = 0; k < num_bins; k++) {
-            if (cdf[k] > threshold) {
-              clipped += cdf[k] - threshold;
-              cdf[k] = threshold;
+          int num_pixels = (x_end - x_start) * (y_end - y_start);
+          int threshold = int(1.0_f * num_pixels / num_bins * contrast_limit);
+          int clipped = 0;
+          if (contrast_limit != 0.0_f) {
+            for (int k = 0; k < num_bins; k++) {
+              if (cdf[k] > threshold) {
+                clipped += cdf[k] - threshold;
+                cdf[k] = threshold;
+              }
             }
+            int gain = clipped / num_bins;
+            for (int k = 0; k < num_bins; k++) {
+              cdf[k] += gain;
+            }
+          }
+          for (int k = 0; k < num_bins - 1; k++) {
+            cdf[k + 1] += cdf[k];
+          }
+          real inv_scale = 1.0_f / num_pixels;
+          for (int k = num_bins - 2; k >= 0; k--) {
+            cdf[k + 1] = cdf[k];
           }
-          int gain = clipped / num_bins;
+          cdf[0] = 0;
           for (int k = 0; k < num_bins; k++) {
-            cdf[k] += gain;
+            histograms[i][j][k] = cdf[k] * inv_scale;
           }
-        }
-        for (int k = 0; k < num_bins - 1; k++) {
-          cdf[k + 1] += cdf[k];
-        }
-        real inv_scale = 1.0_f / num_pixels;
-        for (int k = num_bins - 2; k >= 0; k--) {
-          cdf[k + 1] = cdf[k];
-        }
-        cdf[0] = 0;
-        for (int k = 0; k < num_bins; k++) {
-          histograms[i][j][k] = cdf[k] * inv_scale;
-        }
-      }
-    }
+        },
+        0, x_slices * y_slices, num_threads);
 
     auto oup = inp;
-    for (auto &ind : oup.get_region()) {
-      real new_lum = histograms.sample_relative_coord(
-          1.0_f * ind.i / width, 1.0_f * ind.j / height, lum[ind] / max_lum);
-      for (int i = 0; i < 3; i++) {
-        oup[ind][i] = inp[ind][i] / (lum[ind] + 1e-30f) * new_lum;
-      }
-    }
+    parallel_for_pixels(
+        oup.get_res(),
+        [&](int i, int j) {
+          real new_lum = histograms.sample_relative_coord(
+              1.0_f * i / width, 1.0_f * j / height, lum[i][j] / max_lum);
+          oup[i][j] = inp[i][j] * (new_lum / (lum[i][j] + 1e-30f));
+        },
+        num_threads);
     return oup;
   }
 };
@@ -0,0 +1,317 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#if defined(__GNUC__)
+// The 64-bit variants of fseeko and ftello, for files over 2 GB
+#ifndef _FILE_OFFSET_BITS
+#define _FILE_OFFSET_BITS 64
+#endif
+#endif
+
+#include <taichi/io/binary_stream.h>
+#include <taichi/common/serialization.h>
+#include <thread>
+
+TC_NAMESPACE_BEGIN
+
+constexpr uint32 binary_stream_magic = 0x53424354;  // "TCBS"
+constexpr uint32 binary_stream_version = 1;
+
+static int get_stream_threads(int num_threads) {
+  if (num_threads > 0) {
+    return num_threads;
+  }
+  return std::max((int)std::thread::hardware_concurrency(), 1);
+}
+
+static void seek_file(std::FILE *f, int64 offset, int origin = SEEK_SET) {
+#if defined(_MSC_VER)
+  int status = _fseeki64(f, offset, origin);
+#else
+  int status = fseeko(f, (off_t)offset, origin);
+#endif
+  TC_ERROR_IF(status != 0, "Cannot seek to {} of a binary stream", offset);
+}
+
+static uint64 tell_file(std::FILE *f) {
+#if defined(_MSC_VER)
+  return (uint64)_ftelli64(f);
+#else
+  return (uint64)ftello(f);
+#endif
+}
+
+static void write_bytes(std::FILE *f, const void *data, std::size_t size) {
+  TC_ERROR_IF(std::fwrite(data, 1, size, f) != size,
+              "Cannot write to a binary stream");
+}
+
+static void read_bytes(std::FILE *f, void *data, std::size_t size) {
+  TC_ERROR_IF(std::fread(data, 1, size, f) != size,
+              "Truncated binary stream");
+}
+
+template <typename T>
+static void write_value(std::FILE *f, const T &val) {
+  write_bytes(f, &val, sizeof(T));
+}
+
+template <typename T>
+static T read_value(std::FILE *f) {
+  T val;
+  read_bytes(f, &val, sizeof(T));
+  return val;
+}
+
+BinaryFileStreamOutput::BinaryFileStreamOutput(const std::string &fn,
+                                               std::size_t chunk_size,
+                                               int level,
+                                               int num_threads)
+    : chunk_size(chunk_size),
+      level(level),
+      num_threads(get_stream_threads(num_threads)),
+      offset(0) {
+  TC_ERROR_IF(chunk_size == 0, "Binary streams need chunks of >0 bytes");
+  f = std::fopen(fn.c_str(), "wb");
+  TC_ERROR_IF(f == nullptr,
+              "Cannot open file [{}] for writing. (Does the directory exist?)",
+              fn);
+  write_value(f, binary_stream_magic);
+  write_value(f, binary_stream_version);
+  write_value(f, (uint64)chunk_size);
+  file_offset = tell_file(f);
+  buffer.reserve(chunk_size);
+}
+
+BinaryFileStreamOutput::~BinaryFileStreamOutput() {
+  close();
+}
+
+void BinaryFileStreamOutput::write(const void *data, std::size_t size) {
+  auto bytes = reinterpret_cast<const uint8 *>(data);
+  while (size > 0) {
+    std::size_t n = std::min(size, chunk_size - buffer.size());
+    buffer.insert(buffer.end(), bytes, bytes + n);
+    bytes += n;
+    size -= n;
+    offset += n;
+    if (buffer.size() == chunk_size) {
+      flush_chunk();
+    }
+  }
+}
+
+void BinaryFileStreamOutput::begin_field(const std::string &name) {
+  fields.push_back(std::make_pair(name, offset));
+}
+
+void BinaryFileStreamOutput::flush_chunk() {
+  if (buffer.empty()) {
+    return;
+  }
+  if ((int)pending.size() >= num_threads) {
+    write_front_chunk();
+  }
+  uint64 size = buffer.size();
+  int deflate_level = level;
+  // The next chunk gets a buffer of its own, so that this one moves
+  auto compress = [deflate_level](std::vector<uint8> data) {
+    if (deflate_level == 0) {
+      return data;
+    }
+    auto compressed =
+        zip::zlib_compress(data.data(), data.size(), deflate_level);
+    return compressed.size() < data.size() ? compressed : data;
+  };
+  pending.push_back(std::make_pair(
+      size, std::async(std::launch::async, compress, std::move(buffer))));
+  buffer = std::vector<uint8>();
+  buffer.reserve(chunk_size);
+}
+
+void BinaryFileStreamOutput::write_front_chunk() {
+  auto front = std::move(pending.front());
+  pending.pop_front();
+  std::vector<uint8> data = front.second.get();
+  write_bytes(f, data.data(), data.size());
+  chunks.push_back(Chunk{file_offset, data.size(), front.first});
+  file_offset += data.size();
+}
+
+void BinaryFileStreamOutput::close() {
+  if (f == nullptr) {
+    return;
+  }
+  flush_chunk();
+  while (!pending.empty()) {
+    write_front_chunk();
+  }
+  uint64 index_offset = file_offset;
+  write_value(f, (uint64)chunks.size());
+  for (auto &chunk : chunks) {
+    write_value(f, chunk.file_offset);
+    write_value(f, chunk.compressed_size);
+    write_value(f, chunk.size);
+  }
+  write_value(f, (uint64)fields.size());
+  for (auto &field : fields) {
+    write_value(f, (uint64)field.first.size());
+    write_bytes(f, field.first.data(), field.first.size());
+    write_value(f, field.second);
+  }
+  write_value(f, index_offset);
+  write_value(f, binary_stream_magic);
+  std::fclose(f);
+  f = nullptr;
+}
+
+BinaryFileStreamInput::BinaryFileStreamInput(const std::string &fn,
+                                             int num_threads)
+    : num_threads(get_stream_threads(num_threads)),
+      offset(0),
+      total_size(0),
+      current(-1) {
+  f = std::fopen(fn.c_str(), "rb");
+  TC_ERROR_IF(f == nullptr, "Cannot open file: {}", fn);
+  TC_ERROR_IF(read_value<uint32>(f) != binary_stream_magic,
+              "[{}] is not a binary stream", fn);
+  uint32 version = read_value<uint32>(f);
+  TC_ERROR_IF(version != binary_stream_version,
+              "Binary stream [{}] of unknown version {}", fn, version);
+  chunk_size = (std::size_t)read_value<uint64>(f);
+  seek_file(f, -(int64)(sizeof(uint64) + sizeof(uint32)), SEEK_END);
+  uint64 index_offset = read_value<uint64>(f);
+  TC_ERROR_IF(read_value<uint32>(f) != binary_stream_magic,
+              "Binary stream [{}] was not closed", fn);
+  seek_file(f, (int64)index_offset);
+  chunks.resize(read_value<uint64>(f));
+  for (auto &chunk : chunks) {
+    chunk.file_offset = read_value<uint64>(f);
+    chunk.compressed_size = read_value<uint64>(f);
+    chunk.size = read_value<uint64>(f);
+    total_size += chunk.size;
+  }
+  uint64 num_fields = read_value<uint64>(f);
+  for (uint64 i = 0; i < num_fields; i++) {
+    std::string name(read_value<uint64>(f), ' ');
+    read_bytes(f, &name[0], name.size());
+    fields[name] = read_value<uint64>(f);
+  }
+}
+
+BinaryFileStreamInput::~BinaryFileStreamInput() {
+  // Waits for the chunks in decompression
+  prefetched.clear();
+  std::fclose(f);
+}
+
+std::shared_future<std::vector<uint8>> BinaryFileStreamInput::fetch_chunk(
+    int i) {
+  auto it = prefetched.find(i);
+  if (it != prefetched.end()) {
+    return it->second;
+  }
+  const Chunk &chunk = chunks[i];
+  std::vector<uint8> compressed(chunk.compressed_size);
+  seek_file(f, (int64)chunk.file_offset);
+  read_bytes(f, compressed.data(), compressed.size());
+  uint64 size = chunk.size;
+  auto uncompress = [size](std::vector<uint8> data) {
+    if (data.size() == size) {
+      // Stored
+      return data;
+    }
+    std::vector<uint8> ret(size);
+    zip::zlib_uncompress(data.data(), data.size(), ret.data(), ret.size());
+    return ret;
+  };
+  auto future =
+      std::async(std::launch::async, uncompress, std::move(compressed)).share();
+  prefetched[i] = future;
+  return future;
+}
+
+void BinaryFileStreamInput::load_chunk(int i) {
+  auto future = fetch_chunk(i);
+  // Keep the chunks ahead, which sequential reads go to next
+  for (auto it = prefetched.begin(); it != prefetched.end();) {
+    if (it->first <= i || it->first > i + num_threads) {
+      it = prefetched.erase(it);
+    } else {
+      ++it;
+    }
+  }
+  for (int j = i + 1; j <= i + num_threads && j < (int)chunks.size(); j++) {
+    fetch_chunk(j);
+  }
+  current_data = future.get();
+  current = i;
+}
+
+void BinaryFileStreamInput::read(void *data, std::size_t size) {
+  TC_ERROR_IF(offset + size > total_size,
+              "Reading {} bytes at {} of a binary stream of {}", size, offset,
+              total_size);
+  auto bytes = reinterpret_cast<uint8 *>(data);
+  while (size > 0) {
+    int i = (int)(offset / chunk_size);
+    if (i != current) {
+      load_chunk(i);
+    }
+    std::size_t begin = (std::size_t)(offset - (uint64)i * chunk_size);
+    std::size_t n = std::min(size, current_data.size() - begin);
+    std::memcpy(bytes, current_data.data() + begin, n);
+    bytes += n;
+    size -= n;
+    offset += n;
+  }
+}
+
+void BinaryFileStreamInput::seek(uint64 offset) {
+  TC_ERROR_IF(offset > total_size,
+              "Seeking to {} of a binary stream of {} bytes", offset,
+              total_size);
+  this->offset = offset;
+}
+
+void BinaryFileStreamInput::seek(const std::string &name) {
+  auto it = fields.find(name);
+  TC_ERROR_IF(it == fields.end(), "No field [{}] in the binary stream", name);
+  seek(it->second);
+}
+
+uint64 BinaryFileStreamInput::get_field_size(const std::string &name) const {
+  auto it = fields.find(name);
+  TC_ERROR_IF(it == fields.end(), "No field [{}] in the binary stream", name);
+  uint64 end = total_size;
+  for (auto &field : fields) {
+    if (field.second > it->second) {
+      end = std::min(end, field.second);
+    }
+  }
+  return end - it->second;
+}
+
+std::vector<std::string> BinaryFileStreamInput::get_fields() const {
+  std::vector<std::string> names;
+  for (auto &field : fields) {
+    names.push_back(field.first);
+  }
+  return names;
+}
+
+void write_stream_bytes(BinaryFileStreamOutput *stream,
+                        const void *data,
+                        std::size_t size) {
+  stream->write(data, size);
+}
+
+void read_stream_bytes(BinaryFileStreamInput *stream,
+                       void *data,
+                       std::size_t size) {
+  stream->read(data, size);
+}
+
+TC_NAMESPACE_END
@@ -0,0 +1,83 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#include <taichi/io/frame_writer.h>
+#include <taichi/system/statistics.h>
+
+TC_NAMESPACE_BEGIN
+
+FrameWriter::FrameWriter(int max_pending_frames, int level, int num_threads)
+    : max_pending_frames(max_pending_frames),
+      level(level),
+      num_threads(num_threads),
+      num_pending(0),
+      stopping(false) {
+  TC_ERROR_IF(max_pending_frames < 1,
+              "Frame writers need max_pending_frames >= 1 instead of {}",
+              max_pending_frames);
+  thread = std::thread([this]() { run(); });
+}
+
+FrameWriter::~FrameWriter() {
+  {
+    std::lock_guard<std::mutex> _(mutex);
+    stopping = true;
+  }
+  queued.notify_one();
+  thread.join();
+}
+
+void FrameWriter::write(const std::string &fn, Frame frame) {
+  std::unique_lock<std::mutex> lock(mutex);
+  if (num_pending >= max_pending_frames) {
+    TC_STAT("frame_writer_stalls", 1);
+    written.wait(lock, [&]() { return num_pending < max_pending_frames; });
+  }
+  frames.push_back(std::make_pair(fn, std::move(frame)));
+  num_pending++;
+  lock.unlock();
+  queued.notify_one();
+}
+
+void FrameWriter::flush() {
+  std::unique_lock<std::mutex> lock(mutex);
+  written.wait(lock, [&]() { return num_pending == 0; });
+}
+
+int FrameWriter::get_num_pending() {
+  std::lock_guard<std::mutex> _(mutex);
+  return num_pending;
+}
+
+void FrameWriter::run() {
+  while (true) {
+    std::unique_lock<std::mutex> lock(mutex);
+    queued.wait(lock, [&]() { return stopping || !frames.empty(); });
+    // Stops once the queue is drained
+    if (frames.empty()) {
+      return;
+    }
+    auto frame = std::move(frames.front());
+    frames.pop_front();
+    lock.unlock();
+    {
+      BinaryFileStreamOutput stream(frame.first, std::size_t(1) << 22, level,
+                                    num_threads);
+      for (auto &field : frame.second.fields) {
+        field(stream);
+      }
+      stream.close();
+    }
+    // Releases the copies before another frame may be queued
+    frame.second.fields.clear();
+    TC_STAT("frames_written", 1);
+    lock.lock();
+    num_pending--;
+    lock.unlock();
+    written.notify_all();
+  }
+}
+
+TC_NAMESPACE_END
@@ -7,45 +7,70 @@
 
 #include <mutex>
 #include <taichi/io/image_reader.h>
+#include <taichi/io/io.h>
+#include <taichi/system/threading.h>
 
 TC_NAMESPACE_BEGIN
 
-Array2D<Vector4> dcraw_read(const std::string &filepath) {
-  // Single threaded...
-  static std::mutex lock;
-  std::lock_guard<std::mutex> lock_guard(lock);
-  std::string filepath_non_const = filepath;
-  std::vector<const char *> argv{"dcraw.exe", "-4", "-T", "-W",
-                                 filepath_non_const.c_str()};
+// Bump when the decoding (e.g. the dcraw options) or the layout changes
+constexpr uint64 raw_cache_version = 1;
+
+Array2D<Vector4> dcraw_read(const std::string &filepath, int num_threads) {
   DCRawOutput output;
-  dcraw_main((int)argv.size(), &argv[0], output);
-  auto img =
-      Array2D<Vector4>(Vector2i(output.width, output.height), Vector4(0.0_f));
-  for (auto &ind : img.get_region()) {
-    for (int i = 0; i < output.channels; i++) {
-      img[ind][i] =
-          output.data[output.channels * (ind.j * output.width + ind.i) + i];
-    }
+  {
+    // dcraw keeps its state in globals, so decode one image at a time
+    static std::mutex lock;
+    std::lock_guard<std::mutex> lock_guard(lock);
+    std::string filepath_non_const = filepath;
+    std::vector<const char *> argv{"dcraw.exe", "-4", "-T", "-W",
+                                   filepath_non_const.c_str()};
+    dcraw_main((int)argv.size(), &argv[0], output);
   }
+  int width = output.width, height = output.height, channels = output.channels;
+  auto img = Array2D<Vector4>(Vector2i(width, height), Vector4(0.0_f));
+  // Rows of dcraw go from the top; columns of the image are contiguous, from
+  // the bottom, so that it is written in place of the copy and flip(1)
+  ThreadedTaskManager::run(width, num_threads, [&](int i) {
+    Vector4 *column = img[i];
+    for (int j = 0; j < height; j++) {
+      const float *pixel =
+          output.data + channels * ((height - 1 - j) * width + i);
+      for (int c = 0; c < channels; c++) {
+        column[j][c] = pixel[c];
+      }
+    }
+  });
   delete[] output.data;
-  img.flip(1);
-  TC_P(output.width);
-  TC_P(output.height);
-  TC_P(img.get_width());
-  TC_P(img.get_height());
-  TC_P(img.get_size());
+  TC_TRACE("Raw image [{}]: {}x{}, {} channels", filepath, width, height,
+           channels);
   return img;
 }
 
+// Decoded images are cached next to their files, as for environment maps,
+// and read back from the mapped cache unless the files change
 class RawImageReader final : public ImageReader {
+  bool cache = true;
+  int num_threads = -1;
+
  public:
   void initialize(const Config &config) override {
+    cache = config.get("cache", true);
+    num_threads = config.get("num_threads", -1);
   }
 
   Array2D<Vector4> read(const std::string &filepath) override {
-    auto tmp = dcraw_read(filepath);
-    TC_P("read!!");
-    return tmp;
+    std::string cache_fn = filepath + ".raw.tcb";
+    uint64 stamp = cache ? get_file_stamp(filepath) : 0;
+    Array2D<Vector4> img;
+    if (stamp != 0 &&
+        read_binary_cache(cache_fn, raw_cache_version, stamp, img)) {
+      return img;
+    }
+    img = dcraw_read(filepath, num_threads);
+    if (stamp != 0) {
+      write_binary_cache(cache_fn, raw_cache_version, stamp, img);
+    }
+    return img;
   }
 };
 
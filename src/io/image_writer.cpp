@@ -0,0 +1,298 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#include <taichi/io/image_writer.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+TC_NAMESPACE_BEGIN
+
+namespace {
+
+void put_bytes(std::vector<uint8> &out, const void *data, std::size_t size) {
+  auto p = reinterpret_cast<const uint8 *>(data);
+  out.insert(out.end(), p, p + size);
+}
+
+// EXR stores little-endian values, PNG big-endian ones
+void put_le32(std::vector<uint8> &out, uint32 v) {
+  for (int k = 0; k < 4; k++) {
+    out.push_back(uint8(v >> (8 * k)));
+  }
+}
+
+void put_be32(std::vector<uint8> &out, uint32 v) {
+  for (int k = 3; k >= 0; k--) {
+    out.push_back(uint8(v >> (8 * k)));
+  }
+}
+
+void put_string(std::vector<uint8> &out, const std::string &s) {
+  put_bytes(out, s.c_str(), s.size() + 1);
+}
+
+uint32 float_bits(float32 v) {
+  uint32 bits;
+  std::memcpy(&bits, &v, 4);
+  return bits;
+}
+
+void write_file(const std::string &fn, const std::vector<uint8> &data) {
+  FILE *f = std::fopen(fn.c_str(), "wb");
+  TC_ASSERT_INFO(f != nullptr, "Cannot open " + fn + " for writing");
+  std::size_t written = std::fwrite(data.data(), 1, data.size(), f);
+  std::fclose(f);
+  TC_ASSERT_INFO(written == data.size(), "Cannot write " + fn);
+}
+
+void put_exr_attribute(std::vector<uint8> &out,
+                       const std::string &name,
+                       const std::string &type,
+                       const std::vector<uint8> &value) {
+  put_string(out, name);
+  put_string(out, type);
+  put_le32(out, (uint32)value.size());
+  put_bytes(out, value.data(), value.size());
+}
+
+// ZIP_COMPRESSION of a block: bytes split into even and odd positions,
+// delta-encoded, and deflated. Blocks that do not shrink are stored raw.
+std::vector<uint8> exr_zip(const std::vector<uint8> &raw) {
+  std::size_t n = raw.size();
+  std::vector<uint8> tmp(n);
+  std::size_t half = (n + 1) / 2;
+  for (std::size_t i = 0; i < n; i++) {
+    tmp[i % 2 ? half + i / 2 : i / 2] = raw[i];
+  }
+  for (std::size_t i = n - 1; i > 0; i--) {
+    tmp[i] = uint8(int(tmp[i]) - tmp[i - 1] + (128 + 256));
+  }
+  auto packed = zip::zlib_compress(tmp.data(), n);
+  return packed.size() < n ? packed : raw;
+}
+
+// PNG of filtered |scanlines| (a filter type byte before each row) of 8- or
+// 16-bit RGB pixels
+std::vector<uint8> png_file(int width,
+                            int height,
+                            int bit_depth,
+                            const std::vector<uint8> &scanlines,
+                            int compression) {
+  std::vector<uint8> out = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+  auto put_chunk = [&](const char *type, const std::vector<uint8> &data) {
+    put_be32(out, (uint32)data.size());
+    std::size_t begin = out.size();
+    put_bytes(out, type, 4);
+    put_bytes(out, data.data(), data.size());
+    put_be32(out, zip::crc32_checksum(0, &out[begin], out.size() - begin));
+  };
+  std::vector<uint8> header;
+  put_be32(header, (uint32)width);
+  put_be32(header, (uint32)height);
+  // RGB, deflate, adaptive filtering, no interlace
+  for (int v : {bit_depth, 2, 0, 0, 0}) {
+    header.push_back((uint8)v);
+  }
+  put_chunk("IHDR", header);
+  put_chunk("IDAT", zip::zlib_compress(scanlines.data(), scanlines.size(),
+                                       compression));
+  put_chunk("IEND", {});
+  return out;
+}
+
+}  // namespace
+
+void write_exr(const std::string &fn,
+               const std::vector<ImageLayer> &layers,
+               int tile_size) {
+  TC_ASSERT_INFO(!layers.empty(), "No layers to write");
+  Vector2i res = layers[0].data.get_res();
+  struct Channel {
+    std::string name;
+    const Array2D<Vector3> *data;
+    int component;
+  };
+  std::vector<Channel> channels;
+  for (auto &layer : layers) {
+    TC_ASSERT_INFO(layer.data.get_res() == res,
+                   "Layer " + layer.name + " has a different resolution");
+    TC_ASSERT_INFO(1 <= layer.channels.size() && layer.channels.size() <= 3,
+                   "Layers have one to three channels");
+    for (int c = 0; c < (int)layer.channels.size(); c++) {
+      std::string name = layer.channels.substr(c, 1);
+      if (!layer.name.empty()) {
+        name = layer.name + "." + name;
+      }
+      channels.push_back(Channel{name, &layer.data, c});
+    }
+  }
+  // Readers expect the channels sorted by name
+  std::sort(channels.begin(), channels.end(),
+            [](const Channel &a, const Channel &b) { return a.name < b.name; });
+
+  std::vector<uint8> out;
+  put_le32(out, 20000630);
+  // Version 2, single-part tiled
+  put_le32(out, 2 | 0x200);
+  std::vector<uint8> value;
+  for (auto &c : channels) {
+    put_string(value, c.name);
+    put_le32(value, 2);  // FLOAT
+    put_le32(value, 0);  // pLinear and reserved bytes
+    put_le32(value, 1);  // x sampling
+    put_le32(value, 1);  // y sampling
+  }
+  value.push_back(0);
+  put_exr_attribute(out, "channels", "chlist", value);
+  put_exr_attribute(out, "compression", "compression", {3});  // ZIP
+  value.clear();
+  for (int v : {0, 0, res[0] - 1, res[1] - 1}) {
+    put_le32(value, (uint32)v);
+  }
+  put_exr_attribute(out, "dataWindow", "box2i", value);
+  put_exr_attribute(out, "displayWindow", "box2i", value);
+  put_exr_attribute(out, "lineOrder", "lineOrder", {0});  // INCREASING_Y
+  value.clear();
+  put_le32(value, float_bits(1.0f));
+  put_exr_attribute(out, "pixelAspectRatio", "float", value);
+  put_exr_attribute(out, "screenWindowWidth", "float", value);
+  value.clear();
+  put_le32(value, float_bits(0.0f));
+  put_le32(value, float_bits(0.0f));
+  put_exr_attribute(out, "screenWindowCenter", "v2f", value);
+  value.clear();
+  put_le32(value, (uint32)tile_size);
+  put_le32(value, (uint32)tile_size);
+  value.push_back(0);  // ONE_LEVEL, ROUND_DOWN
+  put_exr_attribute(out, "tiles", "tiledesc", value);
+  out.push_back(0);
+
+  int tiles_x = (res[0] + tile_size - 1) / tile_size;
+  int tiles_y = (res[1] + tile_size - 1) / tile_size;
+  int num_tiles = tiles_x * tiles_y;
+  std::size_t offset_table = out.size();
+  out.resize(out.size() + 8 * num_tiles);
+  std::vector<std::vector<uint8>> packed(num_tiles);
+  // Serial: writes run on AsyncImageWriter's thread and should not compete
+  // with rendering for the worker threads
+  for (int t = 0; t < num_tiles; t++) {
+    int tx = t % tiles_x, ty = t / tiles_x;
+    int x0 = tx * tile_size, x1 = std::min(x0 + tile_size, res[0]);
+    int y0 = ty * tile_size, y1 = std::min(y0 + tile_size, res[1]);
+    std::vector<uint8> raw;
+    raw.reserve(4 * channels.size() * (x1 - x0) * (y1 - y0));
+    for (int y = y0; y < y1; y++) {
+      // EXR rows go down, Array2D rows up
+      int j = res[1] - 1 - y;
+      for (auto &c : channels) {
+        for (int i = x0; i < x1; i++) {
+          put_le32(raw, float_bits((float32)(*c.data)[i][j][c.component]));
+        }
+      }
+    }
+    packed[t] = exr_zip(raw);
+  }
+  for (int t = 0; t < num_tiles; t++) {
+    uint64 offset = out.size();
+    for (int k = 0; k < 8; k++) {
+      out[offset_table + 8 * t + k] = uint8(offset >> (8 * k));
+    }
+    put_le32(out, (uint32)(t % tiles_x));
+    put_le32(out, (uint32)(t / tiles_x));
+    put_le32(out, 0);  // level x
+    put_le32(out, 0);  // level y
+    put_le32(out, (uint32)packed[t].size());
+    put_bytes(out, packed[t].data(), packed[t].size());
+  }
+  write_file(fn, out);
+}
+
+void write_png16(const std::string &fn, const Array2D<Vector3> &img) {
+  int width = img.get_width(), height = img.get_height();
+  std::vector<uint8> scanlines;
+  scanlines.reserve((std::size_t)height * (1 + 6 * width));
+  for (int y = 0; y < height; y++) {
+    scanlines.push_back(0);  // No filter
+    int j = height - 1 - y;
+    for (int i = 0; i < width; i++) {
+      for (int k = 0; k < 3; k++) {
+        auto v = (uint16)(65535.0f * clamp(img[i][j][k], 0.0_f, 1.0_f) + 0.5f);
+        scanlines.push_back(uint8(v >> 8));
+        scanlines.push_back(uint8(v));
+      }
+    }
+  }
+  write_file(fn, png_file(width, height, 16, scanlines, 6));
+}
+
+std::vector<uint8> encode_png8(const uint8 *rgb,
+                               int width,
+                               int height,
+                               int stride,
+                               int compression) {
+  std::vector<uint8> scanlines((std::size_t)height * (1 + 3 * width));
+  uint8 *out = scanlines.data();
+  for (int y = 0; y < height; y++) {
+    const uint8 *row = rgb + (std::size_t)y * stride;
+    // Sub filter: the difference to the pixel on the left
+    *out++ = 1;
+    for (int i = 0; i < 3 * width; i++) {
+      *out++ = uint8(row[i] - (i >= 3 ? row[i - 3] : 0));
+    }
+  }
+  return png_file(width, height, 8, scanlines, compression);
+}
+
+AsyncImageWriter::AsyncImageWriter(int capacity)
+    : capacity(capacity), busy(false), stopping(false) {
+  TC_ASSERT_INFO(capacity > 0, "capacity must be positive");
+  thread = std::thread([this]() { run(); });
+}
+
+AsyncImageWriter::~AsyncImageWriter() {
+  {
+    std::lock_guard<std::mutex> _(mutex);
+    stopping = true;
+  }
+  changed.notify_all();
+  thread.join();
+}
+
+void AsyncImageWriter::push(std::function<void()> task) {
+  std::unique_lock<std::mutex> lock(mutex);
+  changed.wait(lock, [&]() { return (int)tasks.size() < capacity; });
+  tasks.push_back(std::move(task));
+  lock.unlock();
+  changed.notify_all();
+}
+
+void AsyncImageWriter::flush() {
+  std::unique_lock<std::mutex> lock(mutex);
+  changed.wait(lock, [&]() { return tasks.empty() && !busy; });
+}
+
+void AsyncImageWriter::run() {
+  std::unique_lock<std::mutex> lock(mutex);
+  while (true) {
+    changed.wait(lock, [&]() { return !tasks.empty() || stopping; });
+    if (tasks.empty()) {
+      // Stopping, with every write done
+      return;
+    }
+    auto task = std::move(tasks.front());
+    tasks.pop_front();
+    busy = true;
+    lock.unlock();
+    changed.notify_all();
+    task();
+    lock.lock();
+    busy = false;
+    changed.notify_all();
+  }
+}
+
+TC_NAMESPACE_END
@@ -0,0 +1,529 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#include <taichi/io/mesh_reader.h>
+#include <taichi/io/io.h>
+#include <taichi/system/threading.h>
+
+#include <climits>
+#include <sstream>
+
+TC_NAMESPACE_BEGIN
+
+// Bump when the cache layout or the parsing changes
+constexpr uint64 mesh_cache_version = 1;
+
+// Parsers of the text formats. They never read at or past |end|: mapped
+// files are not null-terminated.
+
+static bool is_space(char c) {
+  return c == ' ' || c == '\t' || c == '\r';
+}
+
+static void skip_spaces(const char *&p, const char *end) {
+  while (p < end && is_space(*p)) {
+    p++;
+  }
+}
+
+static void skip_line(const char *&p, const char *end) {
+  while (p < end && *p != '\n') {
+    p++;
+  }
+  if (p < end) {
+    p++;
+  }
+}
+
+static bool parse_int(const char *&p, const char *end, int &out) {
+  bool negative = false;
+  if (p < end && (*p == '-' || *p == '+')) {
+    negative = *p++ == '-';
+  }
+  if (p == end || *p < '0' || *p > '9') {
+    return false;
+  }
+  int64 v = 0;
+  while (p < end && *p >= '0' && *p <= '9') {
+    v = v * 10 + (*p++ - '0');
+  }
+  out = (int)(negative ? -v : v);
+  return true;
+}
+
+static bool parse_real(const char *&p, const char *end, real &out) {
+  skip_spaces(p, end);
+  bool negative = false;
+  if (p < end && (*p == '-' || *p == '+')) {
+    negative = *p++ == '-';
+  }
+  float64 mantissa = 0;
+  int exponent = 0;
+  bool digits = false;
+  while (p < end && *p >= '0' && *p <= '9') {
+    mantissa = mantissa * 10 + (*p++ - '0');
+    digits = true;
+  }
+  if (p < end && *p == '.') {
+    p++;
+    while (p < end && *p >= '0' && *p <= '9') {
+      mantissa = mantissa * 10 + (*p++ - '0');
+      exponent--;
+      digits = true;
+    }
+  }
+  if (!digits) {
+    return false;
+  }
+  if (p < end && (*p == 'e' || *p == 'E')) {
+    const char *q = p + 1;
+    int e;
+    if (parse_int(q, end, e)) {
+      exponent += e;
+      p = q;
+    }
+  }
+  float64 v = mantissa * std::pow(10.0, exponent);
+  out = (real)(negative ? -v : v);
+  return true;
+}
+
+// OBJ
+
+namespace {
+
+struct ObjChunk {
+  std::vector<Vector3> positions, normals;
+  std::vector<Vector2> uvs;
+  // (position, uv, normal) of the polygon corners
+  std::vector<int> corners;
+  // Bit 0, 1, 2: the corner's position, uv, normal is relative (negative in
+  // the file), i.e. counted back from the end of this chunk's attributes
+  std::vector<uint8> relative;
+  std::vector<int> polygon_sizes;
+  int num_triangles = 0;
+};
+
+}  // namespace
+
+// OBJ index |i| (1-based, or negative for relative) as |value| and the
+// relative |bit|, given |num_local| attributes of the kind in this chunk
+static void parse_obj_index(int i, int num_local, int &value, uint8 &relative,
+                            int bit) {
+  if (i < 0) {
+    // Relative to the attributes defined so far
+    value = num_local + i;
+    relative |= 1 << bit;
+  } else {
+    value = i - 1;
+  }
+}
+
+static void parse_obj_chunk(const char *p, const char *end, ObjChunk &chunk) {
+  while (p < end) {
+    skip_spaces(p, end);
+    if (p + 1 >= end) {
+      break;
+    }
+    if (p[0] == 'v' && is_space(p[1])) {
+      p += 2;
+      Vector3 v;
+      if (parse_real(p, end, v.x) && parse_real(p, end, v.y) &&
+          parse_real(p, end, v.z)) {
+        chunk.positions.push_back(v);
+      }
+    } else if (p[0] == 'v' && p[1] == 'n') {
+      p += 2;
+      Vector3 n;
+      if (parse_real(p, end, n.x) && parse_real(p, end, n.y) &&
+          parse_real(p, end, n.z)) {
+        chunk.normals.push_back(n);
+      }
+    } else if (p[0] == 'v' && p[1] == 't') {
+      p += 2;
+      Vector2 uv(0.0_f);
+      if (parse_real(p, end, uv.x)) {
+        parse_real(p, end, uv.y);
+        chunk.uvs.push_back(uv);
+      }
+    } else if (p[0] == 'f' && is_space(p[1])) {
+      p += 2;
+      int n = 0;
+      while (true) {
+        skip_spaces(p, end);
+        int v, t = INT_MIN, vn = INT_MIN;
+        if (!parse_int(p, end, v)) {
+          break;
+        }
+        if (p < end && *p == '/') {
+          p++;
+          parse_int(p, end, t);
+          if (p < end && *p == '/') {
+            p++;
+            parse_int(p, end, vn);
+          }
+        }
+        int corner[3];
+        uint8 relative = 0;
+        parse_obj_index(v, (int)chunk.positions.size(), corner[0], relative,
+                        0);
+        corner[1] = -1;
+        if (t != INT_MIN) {
+          parse_obj_index(t, (int)chunk.uvs.size(), corner[1], relative, 1);
+        }
+        corner[2] = -1;
+        if (vn != INT_MIN) {
+          parse_obj_index(vn, (int)chunk.normals.size(), corner[2], relative,
+                          2);
+        }
+        chunk.corners.insert(chunk.corners.end(), corner, corner + 3);
+        chunk.relative.push_back(relative);
+        n++;
+      }
+      chunk.polygon_sizes.push_back(n);
+      chunk.num_triangles += std::max(n - 2, 0);
+    }
+    skip_line(p, end);
+  }
+}
+
+static void read_obj(const std::string &fn, MeshData &data, int num_threads) {
+  MappedFile file(fn);
+  TC_ASSERT_INFO(file.data() != nullptr, "Loading " + fn + " failed");
+  const char *begin = (const char *)file.data();
+  const char *end = begin + file.size();
+  // Chunks of about 1 MB, starting at line starts
+  int num_chunks = (int)(file.size() >> 20) + 1;
+  std::vector<const char *> bounds(num_chunks + 1, end);
+  bounds[0] = begin;
+  for (int c = 1; c < num_chunks; c++) {
+    const char *p = std::max(begin + file.size() / num_chunks * c,
+                             bounds[c - 1]);
+    skip_line(p, end);
+    bounds[c] = p;
+  }
+  std::vector<ObjChunk> chunks(num_chunks);
+  ThreadedTaskManager::run(
+      [&](int c) { parse_obj_chunk(bounds[c], bounds[c + 1], chunks[c]); }, 0,
+      num_chunks, num_threads);
+
+  // Offsets of each chunk in the output
+  std::vector<int> position_offset(num_chunks + 1, 0),
+      uv_offset(num_chunks + 1, 0), normal_offset(num_chunks + 1, 0),
+      triangle_offset(num_chunks + 1, 0);
+  for (int c = 0; c < num_chunks; c++) {
+    position_offset[c + 1] =
+        position_offset[c] + (int)chunks[c].positions.size();
+    uv_offset[c + 1] = uv_offset[c] + (int)chunks[c].uvs.size();
+    normal_offset[c + 1] = normal_offset[c] + (int)chunks[c].normals.size();
+    triangle_offset[c + 1] = triangle_offset[c] + chunks[c].num_triangles;
+  }
+  data.positions.resize(position_offset[num_chunks]);
+  data.uvs.resize(uv_offset[num_chunks]);
+  data.normals.resize(normal_offset[num_chunks]);
+  int num_triangles = triangle_offset[num_chunks];
+  data.position_indices.resize(num_triangles * 3);
+  data.uv_indices.resize(num_triangles * 3);
+  data.normal_indices.resize(num_triangles * 3);
+  ThreadedTaskManager::run(
+      [&](int c) {
+        ObjChunk &chunk = chunks[c];
+        std::copy(chunk.positions.begin(), chunk.positions.end(),
+                  data.positions.begin() + position_offset[c]);
+        std::copy(chunk.uvs.begin(), chunk.uvs.end(),
+                  data.uvs.begin() + uv_offset[c]);
+        std::copy(chunk.normals.begin(), chunk.normals.end(),
+                  data.normals.begin() + normal_offset[c]);
+        int offsets[3] = {position_offset[c], uv_offset[c], normal_offset[c]};
+        int sizes[3] = {(int)data.positions.size(), (int)data.uvs.size(),
+                        (int)data.normals.size()};
+        std::vector<int> *outputs[3] = {&data.position_indices,
+                                        &data.uv_indices,
+                                        &data.normal_indices};
+        // Global index of attribute |a| of corner |i|
+        auto resolve = [&](int i, int a) {
+          int v = chunk.corners[i * 3 + a];
+          if (chunk.relative[i] & (1 << a)) {
+            v += offsets[a];
+          } else if (v == -1 && a > 0) {
+            // No uv / normal
+            return -1;
+          }
+          TC_ASSERT_INFO(0 <= v && v < sizes[a],
+                         "Invalid index in " + fn);
+          return v;
+        };
+        int corner = 0, t = triangle_offset[c];
+        for (int n : chunk.polygon_sizes) {
+          for (int k = 1; k + 1 < n; k++, t++) {
+            int fan[3] = {corner, corner + k, corner + k + 1};
+            for (int v = 0; v < 3; v++) {
+              for (int a = 0; a < 3; a++) {
+                (*outputs[a])[t * 3 + v] = resolve(fan[v], a);
+              }
+            }
+          }
+          corner += n;
+        }
+      },
+      0, num_chunks, num_threads);
+}
+
+// PLY
+
+namespace {
+
+struct PlyProperty {
+  std::string name;
+  // Scalar type, or item type of lists
+  std::string type;
+  bool is_list = false;
+  std::string count_type;
+};
+
+struct PlyElement {
+  std::string name;
+  int64 count = 0;
+  std::vector<PlyProperty> properties;
+};
+
+}  // namespace
+
+static int ply_type_size(const std::string &type) {
+  if (type == "char" || type == "uchar" || type == "int8" ||
+      type == "uint8") {
+    return 1;
+  }
+  if (type == "short" || type == "ushort" || type == "int16" ||
+      type == "uint16") {
+    return 2;
+  }
+  if (type == "int" || type == "uint" || type == "int32" ||
+      type == "uint32" || type == "float" || type == "float32") {
+    return 4;
+  }
+  if (type == "double" || type == "float64") {
+    return 8;
+  }
+  TC_ERROR("Unknown PLY type {}", type);
+  return 0;
+}
+
+// Reads one binary value of |type| at |p| as float64
+static float64 ply_read_binary(const std::string &type,
+                               const uint8 *p,
+                               bool big_endian) {
+  uint8 bytes[8];
+  int size = ply_type_size(type);
+  for (int i = 0; i < size; i++) {
+    bytes[i] = big_endian ? p[size - 1 - i] : p[i];
+  }
+  if (type == "char" || type == "int8") {
+    return *(int8 *)bytes;
+  } else if (type == "uchar" || type == "uint8") {
+    return *(uint8 *)bytes;
+  } else if (type == "short" || type == "int16") {
+    return *(int16 *)bytes;
+  } else if (type == "ushort" || type == "uint16") {
+    return *(uint16 *)bytes;
+  } else if (type == "int" || type == "int32") {
+    return *(int32 *)bytes;
+  } else if (type == "uint" || type == "uint32") {
+    return *(uint32 *)bytes;
+  } else if (type == "float" || type == "float32") {
+    return *(float32 *)bytes;
+  } else {
+    return *(float64 *)bytes;
+  }
+}
+
+static void read_ply(const std::string &fn, MeshData &data, int num_threads) {
+  MappedFile file(fn);
+  TC_ASSERT_INFO(file.data() != nullptr, "Loading " + fn + " failed");
+  const char *p = (const char *)file.data();
+  const char *end = p + file.size();
+  auto next_line = [&]() {
+    const char *q = p;
+    skip_line(p, end);
+    std::string line(q, p);
+    while (!line.empty() && (line.back() == '\n' || line.back() == '\r')) {
+      line.pop_back();
+    }
+    return line;
+  };
+  TC_ASSERT_INFO(next_line() == "ply", fn + " is not a PLY file");
+  std::string format;
+  std::vector<PlyElement> elements;
+  while (true) {
+    TC_ASSERT_INFO(p < end, "Unterminated PLY header in " + fn);
+    std::stringstream ss(next_line());
+    std::string keyword;
+    ss >> keyword;
+    if (keyword == "format") {
+      ss >> format;
+    } else if (keyword == "element") {
+      elements.emplace_back();
+      ss >> elements.back().name >> elements.back().count;
+    } else if (keyword == "property") {
+      TC_ASSERT_INFO(!elements.empty(), "PLY property outside an element");
+      PlyProperty prop;
+      ss >> prop.type;
+      if (prop.type == "list") {
+        prop.is_list = true;
+        ss >> prop.count_type >> prop.type;
+      }
+      ss >> prop.name;
+      elements.back().properties.push_back(prop);
+    } else if (keyword == "end_header") {
+      break;
+    }
+  }
+  bool ascii = format == "ascii";
+  bool big_endian = format == "binary_big_endian";
+  TC_ASSERT_INFO(ascii || big_endian || format == "binary_little_endian",
+                 "Unknown PLY format " + format);
+
+  // Attribute slots of the vertex properties
+  auto vertex_slot = [](const std::string &name) {
+    const char *names[8][3] = {
+        {"x", "", ""},          {"y", "", ""},
+        {"z", "", ""},          {"nx", "", ""},
+        {"ny", "", ""},         {"nz", "", ""},
+        {"u", "s", "texture_u"}, {"v", "t", "texture_v"}};
+    for (int i = 0; i < 8; i++) {
+      for (auto n : names[i]) {
+        if (*n && name == n) {
+          return i;
+        }
+      }
+    }
+    return -1;
+  };
+  for (auto &element : elements) {
+    bool is_vertex = element.name == "vertex";
+    bool is_face = element.name == "face";
+    int n = (int)element.count;
+    std::vector<int> slots;
+    bool has_normals = false, has_uvs = false, has_lists = false;
+    int stride = 0;
+    for (auto &prop : element.properties) {
+      int slot = is_vertex ? vertex_slot(prop.name) : -1;
+      slots.push_back(slot);
+      has_normals = has_normals || (slot >= 3 && slot < 6);
+      has_uvs = has_uvs || slot >= 6;
+      has_lists = has_lists || prop.is_list;
+      stride += prop.is_list ? 0 : ply_type_size(prop.type);
+    }
+    if (is_vertex) {
+      data.positions.resize(n);
+      data.normals.resize(has_normals ? n : 0);
+      data.uvs.resize(has_uvs ? n : 0);
+    }
+    auto store = [&](int i, int slot, float64 v) {
+      if (slot < 0) {
+        return;
+      } else if (slot < 3) {
+        data.positions[i][slot] = (real)v;
+      } else if (slot < 6) {
+        data.normals[i][slot - 3] = (real)v;
+      } else {
+        data.uvs[i][slot - 6] = (real)v;
+      }
+    };
+    std::vector<int> polygon;
+    auto add_polygon = [&]() {
+      for (int k = 1; k + 1 < (int)polygon.size(); k++) {
+        int fan[3] = {polygon[0], polygon[k], polygon[k + 1]};
+        for (int v : fan) {
+          TC_ASSERT_INFO(0 <= v && v < (int)data.positions.size(),
+                         "Invalid index in " + fn);
+          data.position_indices.push_back(v);
+          data.normal_indices.push_back(data.normals.empty() ? -1 : v);
+          data.uv_indices.push_back(data.uvs.empty() ? -1 : v);
+        }
+      }
+    };
+    if (!ascii && !has_lists) {
+      // Fixed-size records, e.g. vertices: decode in parallel
+      TC_ASSERT_INFO(end - p >= (int64)stride * n, "Truncated PLY " + fn);
+      const uint8 *base = (const uint8 *)p;
+      if (is_vertex) {
+        ThreadedTaskManager::run(
+            [&](int i) {
+              const uint8 *q = base + (int64)stride * i;
+              for (int k = 0; k < (int)slots.size(); k++) {
+                const std::string &type = element.properties[k].type;
+                if (slots[k] >= 0) {
+                  store(i, slots[k], ply_read_binary(type, q, big_endian));
+                }
+                q += ply_type_size(type);
+              }
+            },
+            0, n, num_threads);
+      }
+      p += (int64)stride * n;
+      continue;
+    }
+    for (int i = 0; i < n; i++) {
+      for (int k = 0; k < (int)element.properties.size(); k++) {
+        auto &prop = element.properties[k];
+        auto read_value = [&](const std::string &type) {
+          if (ascii) {
+            real v = 0;
+            TC_ASSERT_INFO(parse_real(p, end, v), "Invalid PLY data in " + fn);
+            return (float64)v;
+          }
+          TC_ASSERT_INFO(end - p >= ply_type_size(type),
+                         "Truncated PLY " + fn);
+          float64 v = ply_read_binary(type, (const uint8 *)p, big_endian);
+          p += ply_type_size(type);
+          return v;
+        };
+        if (prop.is_list) {
+          int count = (int)read_value(prop.count_type);
+          polygon.resize(count);
+          for (int c = 0; c < count; c++) {
+            polygon[c] = (int)read_value(prop.type);
+          }
+          if (is_face && (prop.name == "vertex_indices" ||
+                          prop.name == "vertex_index")) {
+            add_polygon();
+          }
+        } else {
+          float64 v = read_value(prop.type);
+          if (is_vertex) {
+            store(i, slots[k], v);
+          }
+        }
+      }
+      if (ascii) {
+        skip_line(p, end);
+      }
+    }
+  }
+}
+
+void read_mesh(const std::string &fn,
+               MeshData &data,
+               bool cache,
+               int num_threads) {
+  std::string cache_fn = fn + ".mesh.tcb";
+  uint64 stamp = cache ? get_file_stamp(fn) : 0;
+  if (stamp != 0 &&
+      read_binary_cache(cache_fn, mesh_cache_version, stamp, data)) {
+    return;
+  }
+  data = MeshData();
+  if (ends_with(fn, ".ply") || ends_with(fn, ".PLY")) {
+    read_ply(fn, data, num_threads);
+  } else {
+    read_obj(fn, data, num_threads);
+  }
+  if (stamp != 0) {
+    write_binary_cache(cache_fn, mesh_cache_version, stamp, data);
+  }
+}
+
+TC_NAMESPACE_END
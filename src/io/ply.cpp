@@ -5,6 +5,7 @@
 
 #include <taichi/io/ply_writer.h>
 #include <taichi/io/io.h>
+#include <taichi/common/task.h>
 
 TC_NAMESPACE_BEGIN
 
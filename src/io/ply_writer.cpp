@@ -0,0 +1,202 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#include <taichi/io/ply_writer.h>
+#include <taichi/system/threading.h>
+#include <taichi/visualization/particle_visualization.h>
+
+TC_NAMESPACE_BEGIN
+
+namespace {
+
+// Elements per chunk, and chunks formatted in parallel between writes
+constexpr int chunk_size = 1 << 16;
+constexpr int chunks_per_write = 32;
+
+uint8 to_color_byte(real c) {
+  return (uint8)clamp((int)(c * 255.0_f), 0, 255);
+}
+
+template <typename T>
+void append_bytes(std::string &out, const T &value) {
+  out.append((const char *)&value, sizeof(T));
+}
+
+// Formats elements [0, n) by chunks, in parallel, writing the chunks of
+// each batch in order
+template <typename F>
+void write_chunks(FILE *file, int64 n, int num_threads, const F &format) {
+  int64 num_chunks = (n + chunk_size - 1) / chunk_size;
+  std::vector<std::string> buffers(chunks_per_write);
+  for (int64 first = 0; first < num_chunks; first += chunks_per_write) {
+    int count = (int)std::min<int64>(chunks_per_write, num_chunks - first);
+    ThreadedTaskManager::run(
+        [&](int c) {
+          int64 begin = (first + c) * chunk_size;
+          buffers[c].clear();
+          format(begin, std::min(begin + chunk_size, n), buffers[c]);
+        },
+        0, count, num_threads);
+    for (int c = 0; c < count; c++) {
+      std::fwrite(buffers[c].data(), 1, buffers[c].size(), file);
+    }
+  }
+}
+
+}  // namespace
+
+PLYWriter::PLYWriter(const std::string &file_name,
+                     bool binary,
+                     int num_threads)
+    : file_name(file_name), binary(binary), num_threads(num_threads) {
+}
+
+PLYWriter::~PLYWriter() {
+  if (!closed) {
+    close();
+  }
+}
+
+int PLYWriter::add_vertices(const Vector3 *positions,
+                            const Vector3 *colors,
+                            int n) {
+  TC_ERROR_IF(closed, "Adding to the closed PLY file [{}]", file_name);
+  int first = (int)this->positions.size();
+  this->positions.insert(this->positions.end(), positions, positions + n);
+  this->colors.reserve(this->colors.size() + 3 * n);
+  for (int i = 0; i < n; i++) {
+    Vector3 color = colors ? colors[i] : Vector3(0, 1, 0);
+    for (int k = 0; k < 3; k++) {
+      this->colors.push_back(to_color_byte(color[k]));
+    }
+  }
+  return first;
+}
+
+int PLYWriter::add_points(const std::vector<RenderParticle> &particles) {
+  int n = (int)particles.size();
+  std::vector<Vector3> positions(n), colors(n);
+  for (int i = 0; i < n; i++) {
+    positions[i] = particles[i].position;
+    colors[i] = Vector3(particles[i].color.x, particles[i].color.y,
+                        particles[i].color.z);
+  }
+  return add_vertices(positions.data(), colors.data(), n);
+}
+
+void PLYWriter::add_faces(const int *indices, int n, int vertices_per_face) {
+  TC_ERROR_IF(closed, "Adding to the closed PLY file [{}]", file_name);
+  TC_ERROR_IF(vertices_per_face < 1 || vertices_per_face > 255,
+              "PLY faces have 1 to 255 vertices, instead of {}",
+              vertices_per_face);
+  face_sizes.insert(face_sizes.end(), n, (uint8)vertices_per_face);
+  face_indices.insert(face_indices.end(), indices,
+                      indices + (int64)n * vertices_per_face);
+}
+
+void PLYWriter::add_face(const std::vector<Vertex> &vert) {
+  int n = (int)vert.size();
+  std::vector<int> indices(n);
+  for (int i = 0; i < n; i++) {
+    indices[i] = add_vertex(vert[i].position, vert[i].color);
+  }
+  add_faces(indices.data(), 1, n);
+}
+
+void PLYWriter::add_face(const std::vector<Vector3> &vert) {
+  int first = add_vertices(vert.data(), nullptr, (int)vert.size());
+  std::vector<int> indices(vert.size());
+  for (int i = 0; i < (int)vert.size(); i++) {
+    indices[i] = first + i;
+  }
+  add_faces(indices.data(), 1, (int)vert.size());
+}
+
+void PLYWriter::close() {
+  TC_ERROR_IF(closed, "PLY file [{}] closed twice", file_name);
+  closed = true;
+  FILE *file = std::fopen(file_name.c_str(), "wb");
+  TC_ERROR_IF(!file, "Can not write PLY file [{}]", file_name);
+  std::string header = fmt::format(
+      "ply\n"
+      "format {} 1.0\n"
+      "element vertex {}\n"
+      "property float x\n"
+      "property float y\n"
+      "property float z\n"
+      "property uchar red\n"
+      "property uchar green\n"
+      "property uchar blue\n"
+      "element face {}\n"
+      "property list uchar int vertex_index\n"
+      "end_header\n",
+      binary ? "binary_little_endian" : "ascii", positions.size(),
+      face_sizes.size());
+  std::fwrite(header.data(), 1, header.size(), file);
+
+  // Binary data is written in the byte order of the host, little endian on
+  // the platforms we build for
+  write_chunks(file, (int64)positions.size(), num_threads,
+               [&](int64 begin, int64 end, std::string &out) {
+                 fmt::MemoryWriter writer;
+                 if (binary) {
+                   out.reserve((end - begin) * (3 * sizeof(float32) + 3));
+                 }
+                 for (int64 i = begin; i < end; i++) {
+                   const Vector3 &p = positions[i];
+                   const uint8 *c = &colors[i * 3];
+                   if (binary) {
+                     for (int k = 0; k < 3; k++) {
+                       append_bytes(out, (float32)p[k]);
+                     }
+                     out.append((const char *)c, 3);
+                   } else {
+                     // Enough digits to read back the same floats
+                     writer.write("{:.9g} {:.9g} {:.9g} {} {} {}\n", p.x, p.y,
+                                  p.z, c[0], c[1], c[2]);
+                   }
+                 }
+                 if (!binary) {
+                   out.append(writer.data(), writer.size());
+                 }
+               });
+
+  // Faces of each chunk start at the prefix sums of the sizes
+  int64 num_faces = (int64)face_sizes.size();
+  std::vector<int64> chunk_offsets;
+  int64 offset = 0;
+  for (int64 i = 0; i < num_faces; i++) {
+    if (i % chunk_size == 0) {
+      chunk_offsets.push_back(offset);
+    }
+    offset += face_sizes[i];
+  }
+  write_chunks(file, num_faces, num_threads,
+               [&](int64 begin, int64 end, std::string &out) {
+                 fmt::MemoryWriter writer;
+                 int64 k = chunk_offsets[begin / chunk_size];
+                 for (int64 i = begin; i < end; i++) {
+                   const int *indices = &face_indices[k];
+                   int size = face_sizes[i];
+                   if (binary) {
+                     out.push_back((char)face_sizes[i]);
+                     out.append((const char *)indices, size * sizeof(int));
+                   } else {
+                     writer << size;
+                     for (int j = 0; j < size; j++) {
+                       writer << ' ' << indices[j];
+                     }
+                     writer << '\n';
+                   }
+                   k += size;
+                 }
+                 if (!binary) {
+                   out.append(writer.data(), writer.size());
+                 }
+               });
+  std::fclose(file);
+}
+
+TC_NAMESPACE_END
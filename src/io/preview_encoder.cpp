@@ -0,0 +1,139 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#include <taichi/io/preview_encoder.h>
+#include <taichi/io/image_writer.h>
+#include <taichi/system/threading.h>
+
+#include <cstring>
+
+TC_NAMESPACE_BEGIN
+
+namespace {
+
+const char base64_alphabet[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+// The two characters of each 12-bit value
+struct Base64Table {
+  char pairs[4096][2];
+
+  Base64Table() {
+    for (int i = 0; i < 4096; i++) {
+      pairs[i][0] = base64_alphabet[i >> 6];
+      pairs[i][1] = base64_alphabet[i & 63];
+    }
+  }
+};
+
+}  // namespace
+
+std::string encode_base64(const uint8 *data, std::size_t len) {
+  static const Base64Table table;
+  std::string ret((len + 2) / 3 * 4, '=');
+  char *out = &ret[0];
+  std::size_t i = 0;
+  for (; i + 3 <= len; i += 3) {
+    uint32 v = (uint32(data[i]) << 16) | (uint32(data[i + 1]) << 8) |
+               data[i + 2];
+    std::memcpy(out, table.pairs[v >> 12], 2);
+    std::memcpy(out + 2, table.pairs[v & 4095], 2);
+    out += 4;
+  }
+  if (i < len) {
+    uint32 v = uint32(data[i]) << 16;
+    if (i + 1 < len) {
+      v |= uint32(data[i + 1]) << 8;
+    }
+    std::memcpy(out, table.pairs[v >> 12], 2);
+    if (i + 1 < len) {
+      out[2] = table.pairs[v & 4095][0];
+    }
+  }
+  return ret;
+}
+
+PreviewEncoder::PreviewEncoder(const Config &config) {
+  tile_size = config.get("tile_size", 64);
+  exposure = config.get("exposure", 1.0_f);
+  real gamma = config.get("gamma", 2.2_f);
+  compression = config.get("compression", 1);
+  TC_ERROR_IF(tile_size < 1, "Preview tiles need a positive size");
+  TC_ERROR_IF(gamma <= 0, "Previews need a positive gamma instead of {}",
+              gamma);
+  lut.resize(lut_size);
+  for (int i = 0; i < lut_size; i++) {
+    real v = std::pow((real)i / (lut_size - 1), 1 / gamma);
+    lut[i] = (uint8)(255 * v + 0.5_f);
+  }
+  res = Vector2i(0);
+}
+
+std::vector<PreviewEncoder::Tile> PreviewEncoder::encode(
+    const Array2D<Vector3> &image) {
+  int width = image.get_width(), height = image.get_height();
+  if (res != Vector2i(width, height) || last.empty()) {
+    res = Vector2i(width, height);
+    last.clear();
+  }
+  bool all = last.empty();
+  last.resize((std::size_t)width * height * 3);
+  int tiles_x = (width + tile_size - 1) / tile_size;
+  int tiles_y = (height + tile_size - 1) / tile_size;
+  std::vector<Tile> tiles(tiles_x * tiles_y);
+  std::vector<char> changed(tiles.size(), 0);
+  const real scale = exposure * (lut_size - 1);
+  ThreadedTaskManager::run(
+      [&](int t) {
+        Tile &tile = tiles[t];
+        tile.x = t % tiles_x * tile_size;
+        tile.y = t / tiles_x * tile_size;
+        tile.width = std::min(tile_size, width - tile.x);
+        tile.height = std::min(tile_size, height - tile.y);
+        int stride = tile.width * 3;
+        std::vector<uint8> pixels((std::size_t)stride * tile.height);
+        // Column by column, as Array2D stores them
+        for (int x = 0; x < tile.width; x++) {
+          for (int y = 0; y < tile.height; y++) {
+            const Vector3 &c = image[tile.x + x][height - 1 - (tile.y + y)];
+            uint8 *pixel = &pixels[(std::size_t)y * stride + x * 3];
+            for (int k = 0; k < 3; k++) {
+              // NaNs go to black
+              real v = c[k] * scale;
+              int index = !(v > 0) ? 0 : v < lut_size - 1 ? (int)v
+                                                          : lut_size - 1;
+              pixel[k] = lut[index];
+            }
+          }
+        }
+        bool differs = all;
+        for (int y = 0; y < tile.height; y++) {
+          const uint8 *row = &pixels[(std::size_t)y * stride];
+          uint8 *previous =
+              &last[((std::size_t)(tile.y + y) * width + tile.x) * 3];
+          if (differs || std::memcmp(previous, row, stride) != 0) {
+            differs = true;
+            std::memcpy(previous, row, stride);
+          }
+        }
+        if (differs) {
+          std::vector<uint8> png = encode_png8(pixels.data(), tile.width,
+                                               tile.height, stride,
+                                               compression);
+          tile.png_base64 = encode_base64(png.data(), png.size());
+          changed[t] = 1;
+        }
+      },
+      0, (int)tiles.size(), -1);
+  std::vector<Tile> ret;
+  for (int t = 0; t < (int)tiles.size(); t++) {
+    if (changed[t]) {
+      ret.push_back(std::move(tiles[t]));
+    }
+  }
+  return ret;
+}
+
+TC_NAMESPACE_END
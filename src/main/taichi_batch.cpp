@@ -0,0 +1,15 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+// Runs a job file (see taichi/system/batch_job.h) without Python:
+//   taichi_batch job_file [section.key=value ...]
+
+#include <taichi/common/task.h>
+
+int main(int argc, char **argv) {
+  std::vector<std::string> parameters(argv + 1, argv + argc);
+  taichi::create_instance<taichi::Task>("batch")->run(parameters);
+  return 0;
+}
@@ -6,6 +6,7 @@
 #include <taichi/python/export.h>
 #include <taichi/dynamics/fluid2d/fluid.h>
 #include <taichi/dynamics/simulation.h>
+#include <taichi/dynamics/poisson_solver.h>
 #include <taichi/common/asset_manager.h>
 
 PYBIND11_MAKE_OPAQUE(std::vector<taichi::RenderParticle>);
@@ -26,10 +27,42 @@ void register_simulation(py::module &m) {
       .def("dim", [](Sim *) { return Sim::dim; })
       .def("add_particles", &Sim::add_particles)
       .def("update", &Sim::update)
-      .def("step", &Sim::step)
+      .def("step",
+           [](Sim &sim, real t) {
+             py::gil_scoped_release release;
+             sim.step(t);
+           })
+      .def("step_async",
+           [](py::object self, real t) {
+             auto sim = self.cast<Sim *>();
+             return std::make_shared<AsyncCall>([sim, t]() { sim->step(t); },
+                                                py::make_tuple(self));
+           })
       .def("visualize", &Sim::visualize)
       .def("get_current_time", &Sim::get_current_time)
       .def("get_render_particles", &Sim::get_render_particles)
+      .def("get_render_particles_view", &Sim::get_render_particles_view,
+           py::return_value_policy::reference_internal)
+      .def("write_frame",
+           [](Sim &sim, const std::string &fn) {
+             py::gil_scoped_release release;
+             sim.write_frame(fn);
+           })
+      .def("flush_frames",
+           [](Sim &sim) {
+             py::gil_scoped_release release;
+             sim.flush_frames();
+           })
+      .def("save_checkpoint",
+           [](Sim &sim, const std::string &fn) {
+             py::gil_scoped_release release;
+             sim.save_checkpoint(fn);
+           })
+      .def("load_checkpoint",
+           [](Sim &sim, const std::string &fn) {
+             py::gil_scoped_release release;
+             sim.load_checkpoint(fn);
+           })
       .def("set_levelset", &Sim::set_levelset)
       .def("get_mpi_world_rank", &Sim::get_mpi_world_rank)
       .def("get_vis_resolution", &Sim::get_vis_resolution)
@@ -38,6 +71,40 @@ void register_simulation(py::module &m) {
       .def("test", &Sim::test);
 }
 
+// Solvers of create_pressure_solver_2d/3d. set_interior_boundary_condition
+// makes all cells of a 'res' grid interior, with the padding of the config
+// around.
+template <typename Solver, int dim>
+void register_poisson_solver(py::module &m, const char *name) {
+  using Array = ArrayND<dim, real>;
+  using BCArray = typename Solver::BCArray;
+  using VectorI = VectorND<dim, int>;
+  py::class_<Solver, std::shared_ptr<Solver>>(m, name)
+      .def("initialize",
+           [](Solver &solver, const Config &config) {
+             solver.initialize(config);
+           })
+      .def("set_interior_boundary_condition",
+           [](Solver &solver, const VectorI &res) {
+             solver.set_boundary_condition(BCArray(res));
+           })
+      .def("run",
+           [](Solver &solver, const Array &b, Array &x, real tolerance) {
+             py::gil_scoped_release release;
+             solver.run(b, x, tolerance);
+           })
+      .def("run_async",
+           [](py::object self, py::object b, py::object x, real tolerance) {
+             auto solver = self.cast<Solver *>();
+             auto b_ptr = b.cast<const Array *>();
+             auto x_ptr = x.cast<Array *>();
+             return std::make_shared<AsyncCall>(
+                 [=]() { solver->run(*b_ptr, *x_ptr, tolerance); },
+                 py::make_tuple(self, b, x));
+           })
+      .def("get_last_iterations", &Solver::get_last_iterations);
+}
+
 void export_dynamics(py::module &m) {
   m.def("register_levelset2d", &AssetManager::insert_asset<LevelSet2D>);
   m.def("register_levelset3d", &AssetManager::insert_asset<LevelSet3D>);
@@ -45,7 +112,11 @@ void export_dynamics(py::module &m) {
   py::class_<Fluid>(m, "Fluid")
       .def(py::init<>())
       .def("initialize", &Fluid::initialize)
-      .def("step", &Fluid::step)
+      .def("step",
+           [](Fluid &fluid, real delta_t) {
+             py::gil_scoped_release release;
+             fluid.step(delta_t);
+           })
       .def("add_particle", &Fluid::add_particle)
       .def("get_current_time", &Fluid::get_current_time)
       .def("get_particles", &Fluid::get_particles)
@@ -53,7 +124,19 @@ void export_dynamics(py::module &m) {
       .def("get_liquid_levelset", &Fluid::get_liquid_levelset)
       .def("get_density", &Fluid::get_density)
       .def("get_pressure", &Fluid::get_pressure)
-      .def("add_source", &Fluid::add_source);
+      .def("add_source", &Fluid::add_source)
+      .def("write_frame",
+           [](Fluid &fluid, const std::string &fn) {
+             py::gil_scoped_release release;
+             fluid.write_frame(fn);
+           })
+      .def("flush_frames", [](Fluid &fluid) {
+        py::gil_scoped_release release;
+        fluid.flush_frames();
+      });
+
+  register_poisson_solver<PoissonSolver2D, 2>(m, "PoissonSolver2D");
+  register_poisson_solver<PoissonSolver3D, 3>(m, "PoissonSolver3D");
 
   register_simulation<2>(m);
   register_simulation<3>(m);
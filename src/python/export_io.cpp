@@ -5,6 +5,7 @@
 
 #include <taichi/python/export.h>
 #include <taichi/io/image_reader.h>
+#include <taichi/io/preview_encoder.h>
 
 TC_NAMESPACE_BEGIN
 
@@ -12,6 +13,23 @@ void export_io(py::module &m) {
   py::class_<ImageReader, std::shared_ptr<ImageReader>>(m, "ImageReader")
       .def("initialize", &ImageReader::initialize)
       .def("read", &ImageReader::read);
+
+  py::class_<PreviewEncoder::Tile>(m, "PreviewTile")
+      .def_readonly("x", &PreviewEncoder::Tile::x)
+      .def_readonly("y", &PreviewEncoder::Tile::y)
+      .def_readonly("width", &PreviewEncoder::Tile::width)
+      .def_readonly("height", &PreviewEncoder::Tile::height)
+      .def_readonly("png_base64", &PreviewEncoder::Tile::png_base64);
+
+  py::class_<PreviewEncoder, std::shared_ptr<PreviewEncoder>>(m,
+                                                              "PreviewEncoder")
+      .def(py::init<const Config &>())
+      .def("encode",
+           [](PreviewEncoder &encoder, const Array2D<Vector3> &image) {
+             py::gil_scoped_release release;
+             return encoder.encode(image);
+           })
+      .def("reset", &PreviewEncoder::reset);
 }
 
 TC_NAMESPACE_END
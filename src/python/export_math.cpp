@@ -4,11 +4,13 @@
 *******************************************************************************/
 
 #include <taichi/python/export.h>
+#include <pybind11/numpy.h>
 #include <taichi/common/dict.h>
 #include <taichi/math/levelset.h>
 #include <taichi/visualization/rgb.h>
 #include <taichi/math/levelset.h>
 #include <taichi/image/operations.h>
+#include <taichi/image/kernels.h>
 
 PYBIND11_MAKE_OPAQUE(std::vector<int>);
 PYBIND11_MAKE_OPAQUE(std::vector<taichi::float32>);
@@ -30,21 +32,6 @@ int return_constant(T *) {
   return ret;
 }
 
-template <typename T, int channels>
-void ndarray_to_image_buffer(T *arr,
-                             uint64 input,
-                             int width,
-                             int height)  // 'input' is actually a pointer...
-{
-  arr->initialize(Vector2i(width, height));
-  for (auto &ind : arr->get_region()) {
-    for (int i = 0; i < channels; i++) {
-      (*arr)[ind][i] = reinterpret_cast<real *>(
-          input)[ind.i * channels * height + ind.j * channels + i];
-    }
-  }
-}
-
 std::string rasterize_levelset(const LevelSet2D &levelset,
                                int width,
                                int height) {
@@ -58,63 +45,110 @@ std::string rasterize_levelset(const LevelSet2D &levelset,
   return ret;
 }
 
-template <typename T, int channels>
-void ndarray_to_array2d(T *arr,
-                        long long input,
-                        int width,
-                        int height)  // 'input' is actually a pointer...
-{
-  arr->initialize(Vector2i(width, height));
-  for (auto &ind : arr->get_region()) {
-    for (int i = 0; i < channels; i++) {
-      (*arr)[ind][i] = reinterpret_cast<float *>(
-          input)[ind.i * height * channels + ind.j * channels + i];
-    }
+// Channels of the cells of ArrayND, the last axis of their numpy arrays
+template <typename T>
+struct NDArrayChannels {
+  static constexpr int value = 1;
+};
+
+template <int N, InstSetExt ISE>
+struct NDArrayChannels<VectorND<N, real, ISE>> {
+  static constexpr int value = N;
+};
+
+template <int dim, typename T>
+std::vector<size_t> get_ndarray_shape(const ArrayND<dim, T> &arr) {
+  std::vector<size_t> shape;
+  for (int i = 0; i < dim; i++) {
+    shape.push_back(arr.get_res()[i]);
   }
+  if (NDArrayChannels<T>::value > 1) {
+    shape.push_back(NDArrayChannels<T>::value);
+  }
+  return shape;
 }
 
-void ndarray_to_array2d_real(Array2D<real> *arr,
-                             long long input,
-                             int width,
-                             int height)  // 'input' is actually a pointer...
-{
-  arr->initialize(Vector2i(width, height));
-  for (auto &ind : arr->get_region()) {
-    (*arr)[ind] = reinterpret_cast<float *>(input)[ind.i * height + ind.j];
+// A view of the cells of 'arr' for the buffer protocol, so that
+// numpy.asarray(arr) makes no copy. Vector3 cells are padded to 4
+// channels, which the strides skip. The view keeps 'arr' alive, but is
+// invalidated by its initialize().
+template <int dim, typename T>
+py::buffer_info get_buffer_info(ArrayND<dim, T> &arr) {
+  auto shape = get_ndarray_shape(arr);
+  std::vector<size_t> strides(shape.size());
+  size_t stride = sizeof(T);
+  for (int i = dim - 1; i >= 0; i--) {
+    strides[i] = stride;
+    stride *= shape[i];
+  }
+  if ((int)shape.size() > dim) {
+    strides[dim] = sizeof(real);
   }
+  return py::buffer_info(arr.data.data(), sizeof(real),
+                         py::format_descriptor<real>::format(), shape.size(),
+                         shape, strides);
 }
 
-template <typename T, int channels>
-void array2d_to_ndarray(T *arr,
-                        uint64 output)  // 'output' is actually a pointer...
-{
-  int width = arr->get_width(), height = arr->get_height();
-  TC_ASSERT(width > 0);
-  TC_ASSERT(height > 0);
-  for (auto &ind : arr->get_region()) {
-    for (int k = 0; k < channels; k++) {
-      reinterpret_cast<real *>(
-          output)[ind.i * height * channels + ind.j * channels + k] =
-          *(((float *)(&(*arr)[ind])) + k);
+// Copies between the cells of an array and a C-contiguous buffer of
+// 'channels' reals per cell, by slices of the first axis in parallel
+template <int dim, typename T, bool to_buffer>
+void copy_ndarray(ArrayND<dim, T> &arr, real *buffer) {
+  constexpr int channels = NDArrayChannels<T>::value;
+  int64 cells_per_slice = arr.get_size() / std::max(arr.get_res()[0], 1);
+  for_each_slab(arr.get_res()[0], cells_per_slice, [&](int begin, int end) {
+    int64 i0 = begin * cells_per_slice, i1 = end * cells_per_slice;
+    if (sizeof(T) == channels * sizeof(real)) {
+      // Same layout
+      void *dst = to_buffer ? (void *)(buffer + i0 * channels)
+                            : (void *)(&arr.data[0] + i0);
+      void *src = to_buffer ? (void *)(&arr.data[0] + i0)
+                            : (void *)(buffer + i0 * channels);
+      std::memcpy(dst, src, (i1 - i0) * sizeof(T));
+      return;
     }
-  }
+    for (int64 i = i0; i < i1; i++) {
+      real *cell = reinterpret_cast<real *>(&arr.data[i]);
+      for (int k = 0; k < channels; k++) {
+        if (to_buffer) {
+          buffer[i * channels + k] = cell[k];
+        } else {
+          cell[k] = buffer[i * channels + k];
+        }
+      }
+    }
+  });
 }
 
-// Specialize for Vector3 for the padding float32
-template <int channels>
-void array2d_to_ndarray(Array2D<Vector3> *arr,
-                        uint64 output)  // 'output' is actually a pointer...
-{
-  int width = arr->get_width(), height = arr->get_height();
-  assert_info(width > 0, "");
-  assert_info(height > 0, "");
-  for (auto &ind : arr->get_region()) {
-    for (int k = 0; k < channels; k++) {
-      const Vector3 entry = (*arr)[ind];
-      reinterpret_cast<real *>(
-          output)[ind.i * height * channels + ind.j * channels + k] = entry[k];
-    }
+template <int dim, typename T>
+py::array_t<real> array_to_ndarray(ArrayND<dim, T> &arr) {
+  py::array_t<real> ret(get_ndarray_shape(arr));
+  copy_ndarray<dim, T, true>(arr, ret.mutable_data());
+  return ret;
+}
+
+// Any numpy array of numbers with the shape of get_ndarray_shape(), or
+// without the channel axis for real cells; it is converted to a contiguous
+// array of reals first if it is not one
+template <int dim, typename T>
+void ndarray_to_array(
+    ArrayND<dim, T> &arr,
+    py::array_t<real, py::array::c_style | py::array::forcecast> input) {
+  constexpr int channels = NDArrayChannels<T>::value;
+  int ndim = (int)input.ndim();
+  bool has_channels = ndim == dim + 1;
+  TC_ERROR_IF(ndim != dim && !has_channels,
+              "ndarray of {} dimensions for an array of {}", ndim, dim);
+  TC_ERROR_IF(channels > 1 && !has_channels,
+              "ndarray without channels for an array of {}", channels);
+  TC_ERROR_IF(has_channels && input.shape(dim) != channels,
+              "ndarray of {} channels for an array of {}", input.shape(dim),
+              channels);
+  VectorND<dim, int> res;
+  for (int i = 0; i < dim; i++) {
+    res[i] = (int)input.shape(i);
   }
+  arr.initialize(res);
+  copy_ndarray<dim, T, false>(arr, const_cast<real *>(input.data()));
 }
 
 template <typename T>
@@ -297,55 +331,63 @@ void export_math(py::module &m) {
 
   py::class_<Config>(m, "Config");
 
-#define EXPORT_ARRAY_2D_OF(T, C)                             \
-  py::class_<Array2D<real>> PyArray2D##T(m, "Array2D" #T);   \
-  PyArray2D##T.def(py::init<Vector2i>())                     \
-      .def("to_ndarray", &array2d_to_ndarray<Array2D<T>, C>) \
-      .def("get_width", &Array2D<T>::get_width)              \
-      .def("get_height", &Array2D<T>::get_height)            \
-      .def("rasterize", &Array2D<T>::rasterize)              \
-      .def("rasterize_scale", &Array2D<T>::rasterize_scale)  \
-      .def("from_ndarray", &ndarray_to_array2d_real);
+#define EXPORT_ARRAY_2D_OF(T, C)                                        \
+  py::class_<Array2D<real>> PyArray2D##T(m, "Array2D" #T,               \
+                                         py::buffer_protocol());        \
+  PyArray2D##T.def(py::init<Vector2i>())                                \
+      .def_buffer(&get_buffer_info<2, T>)                               \
+      .def("to_ndarray", &array_to_ndarray<2, T>)                       \
+      .def("get_width", &Array2D<T>::get_width)                         \
+      .def("get_height", &Array2D<T>::get_height)                       \
+      .def("rasterize", &Array2D<T>::rasterize)                         \
+      .def("rasterize_scale", &Array2D<T>::rasterize_scale)             \
+      .def("from_ndarray", &ndarray_to_array<2, T>);
 
   EXPORT_ARRAY_2D_OF(real, 1);
 
-#define EXPORT_ARRAY_3D_OF(T, C)                           \
-  py::class_<Array3D<real>> PyArray3D##T(m, "Array3D" #T); \
-  PyArray3D##T.def(py::init<Vector3i>())                   \
-      .def("get_width", &Array3D<T>::get_width)            \
+#define EXPORT_ARRAY_3D_OF(T, C)                                        \
+  py::class_<Array3D<real>> PyArray3D##T(m, "Array3D" #T,               \
+                                         py::buffer_protocol());        \
+  PyArray3D##T.def(py::init<Vector3i>())                                \
+      .def_buffer(&get_buffer_info<3, T>)                               \
+      .def("to_ndarray", &array_to_ndarray<3, T>)                       \
+      .def("from_ndarray", &ndarray_to_array<3, T>)                     \
+      .def("get_width", &Array3D<T>::get_width)                         \
       .def("get_height", &Array3D<T>::get_height);
 
   EXPORT_ARRAY_3D_OF(real, 1);
 
-  py::class_<Array2D<Vector3>>(m, "Array2DVector3")
+  py::class_<Array2D<Vector3>>(m, "Array2DVector3", py::buffer_protocol())
       .def(py::init<Vector2i, Vector3>())
+      .def_buffer(&get_buffer_info<2, Vector3>)
       .def("get_width", &Array2D<Vector3>::get_width)
       .def("get_height", &Array2D<Vector3>::get_height)
       .def("get_channels", &return_constant<Array2D<Vector3>, 3>)
-      .def("from_ndarray", &ndarray_to_image_buffer<Array2D<Vector3>, 3>)
+      .def("from_ndarray", &ndarray_to_array<2, Vector3>)
       .def("read", &Array2D<Vector3>::load_image)
       .def("write", &Array2D<Vector3>::write_as_image)
       .def("write_to_disk", &Array2D<Vector3>::write_to_disk)
       .def("read_from_disk", &Array2D<Vector3>::read_from_disk)
       .def("rasterize", &Array2D<Vector3>::rasterize)
       .def("rasterize_scale", &Array2D<Vector3>::rasterize_scale)
-      .def("to_ndarray", &array2d_to_ndarray<Array2D<Vector3>, 3>);
+      .def("to_ndarray", &array_to_ndarray<2, Vector3>);
 
-  py::class_<Array2D<Vector4>>(m, "Array2DVector4")
+  py::class_<Array2D<Vector4>>(m, "Array2DVector4", py::buffer_protocol())
       .def(py::init<Vector2i, Vector4>())
+      .def_buffer(&get_buffer_info<2, Vector4>)
       .def("get_width", &Array2D<Vector4>::get_width)
       .def("get_height", &Array2D<Vector4>::get_height)
       .def("get_channels", &return_constant<Array2D<Vector4>, 4>)
       .def("write", &Array2D<Vector4>::write_as_image)
-      .def("from_ndarray", &ndarray_to_image_buffer<Array2D<Vector4>, 4>)
+      .def("from_ndarray", &ndarray_to_array<2, Vector4>)
       .def("write_to_disk", &Array2D<Vector4>::write_to_disk)
       .def("read_from_disk", &Array2D<Vector4>::read_from_disk)
       .def("rasterize", &Array2D<Vector4>::rasterize)
       .def("rasterize_scale", &Array2D<Vector4>::rasterize_scale)
-      .def("to_ndarray", &array2d_to_ndarray<Array2D<Vector4>, 4>);
+      .def("to_ndarray", &array_to_ndarray<2, Vector4>);
 
-  py::class_<LevelSet2D, std::shared_ptr<LevelSet2D>>(m, "LevelSet2D",
-                                                      PyArray2Dreal)
+  py::class_<LevelSet2D, std::shared_ptr<LevelSet2D>>(
+      m, "LevelSet2D", PyArray2Dreal, py::buffer_protocol())
       .def(py::init<Vector2i, Vector2>())
       .def("get_width", &LevelSet2D::get_width)
       .def("get_height", &LevelSet2D::get_height)
@@ -361,7 +403,7 @@ void export_math(py::module &m) {
       .def("sample", static_cast<real (LevelSet2D::*)(real, real) const>(
                          &LevelSet2D::sample))
       .def("get_normalized_gradient", &LevelSet2D::get_normalized_gradient)
-      .def("to_ndarray", &array2d_to_ndarray<LevelSet2D, 1>)
+      .def("to_ndarray", &array_to_ndarray<2, real>)
       .def("get_channels", &return_constant<LevelSet2D, 1>)
       .def_readwrite("friction", &LevelSet2D::friction);
 
@@ -369,8 +411,8 @@ void export_math(py::module &m) {
       .def(py::init<>())
       .def("initialize", &DynamicLevelSet3D::initialize);
 
-  py::class_<LevelSet3D, std::shared_ptr<LevelSet3D>>(m, "LevelSet3D",
-                                                      PyArray3Dreal)
+  py::class_<LevelSet3D, std::shared_ptr<LevelSet3D>>(
+      m, "LevelSet3D", PyArray3Dreal, py::buffer_protocol())
       .def(py::init<Vector3i, Vector3>())
       .def("get_width", &LevelSet3D::get_width)
       .def("get_height", &LevelSet3D::get_height)
@@ -416,8 +458,22 @@ void export_math(py::module &m) {
   m.def("gaussian_blur_real", gaussian_blur<2, real>);
   m.def("gaussian_blur_vec3", gaussian_blur<2, Vector3>);
 
-  m.def("box_blur_real", box_blur<real>);
-  m.def("box_blur_vec3", box_blur<Vector3>);
+  m.def("box_blur_real",
+        [](const Array2D<real> &arr, real radius, int axis) {
+          return parallel_box_blur(arr, radius, axis);
+        });
+  m.def("box_blur_vec3",
+        [](const Array2D<Vector3> &arr, real radius, int axis) {
+          return parallel_box_blur(arr, radius, axis);
+        });
+  m.def("recursive_gaussian_blur_real",
+        [](const Array2D<real> &arr, real sigma) {
+          return parallel_recursive_gaussian_blur(arr, sigma);
+        });
+  m.def("recursive_gaussian_blur_vec3",
+        [](const Array2D<Vector3> &arr, real sigma) {
+          return parallel_recursive_gaussian_blur(arr, sigma);
+        });
 
   m.def("blur_with_depth", blur_with_depth);
   m.def("seam_carving", seam_carving);
@@ -10,7 +10,10 @@
 #include <taichi/python/exception.h>
 #include <taichi/python/export.h>
 #include <taichi/system/benchmark.h>
+#include <taichi/system/cpu_features.h>
 #include <taichi/system/profiler.h>
+#include <taichi/system/statistics.h>
+#include <taichi/system/threading.h>
 #include <taichi/system/memory.h>
 #include <taichi/system/unit_dll.h>
 #include <taichi/visual/texture.h>
@@ -30,11 +33,97 @@ py::dict py_dict_from_py_config(const Config &config) {
 }
 */
 
+Config config_from_py_dict(py::dict &c);
+
+// A MemoryPhase from __enter__ to __exit__
+struct PyMemoryPhase {
+  std::string name;
+  std::unique_ptr<MemoryPhase> phase;
+
+  explicit PyMemoryPhase(const std::string &name) : name(name) {
+  }
+};
+
+// Tuples and lists of 1 to 4 numbers, as vectors of int64 or float64
+template <int N>
+bool set_py_vector(Config &config,
+                   const std::string &key,
+                   const py::sequence &seq) {
+  bool integral = true;
+  for (auto item : seq) {
+    if (py::isinstance<py::bool_>(item) ||
+        !(py::isinstance<py::int_>(item) ||
+          py::isinstance<py::float_>(item))) {
+      return false;
+    }
+    integral = integral && py::isinstance<py::int_>(item);
+  }
+  if (integral) {
+    VectorND<N, int64> v;
+    for (int i = 0; i < N; i++) {
+      v[i] = seq[i].cast<int64>();
+    }
+    config.set(key, v);
+  } else {
+    VectorND<N, float64> v;
+    for (int i = 0; i < N; i++) {
+      v[i] = seq[i].cast<float64>();
+    }
+    config.set(key, v);
+  }
+  return true;
+}
+
+// Typed values, parsed once here, with the string of anything else
+void set_py_value(Config &config, const std::string &key, py::handle value) {
+  if (py::isinstance<py::bool_>(value)) {
+    config.set(key, value.cast<bool>());
+  } else if (py::isinstance<py::int_>(value)) {
+    config.set(key, value.cast<int64>());
+  } else if (py::isinstance<py::float_>(value)) {
+    config.set(key, value.cast<float64>());
+  } else if (py::isinstance<py::str>(value)) {
+    config.set(key, value.cast<std::string>());
+  } else if (py::isinstance<py::dict>(value)) {
+    py::dict d = py::reinterpret_borrow<py::dict>(value);
+    config.set(key, config_from_py_dict(d));
+  } else if (py::isinstance<Vector2>(value)) {
+    config.set(key, value.cast<Vector2>());
+  } else if (py::isinstance<Vector3>(value)) {
+    config.set(key, value.cast<Vector3>());
+  } else if (py::isinstance<Vector4>(value)) {
+    config.set(key, value.cast<Vector4>());
+  } else if (py::isinstance<Vector2i>(value)) {
+    config.set(key, value.cast<Vector2i>());
+  } else if (py::isinstance<Vector3i>(value)) {
+    config.set(key, value.cast<Vector3i>());
+  } else if (py::isinstance<Vector4i>(value)) {
+    config.set(key, value.cast<Vector4i>());
+  } else {
+    bool set = false;
+    if (py::isinstance<py::tuple>(value) || py::isinstance<py::list>(value)) {
+      auto seq = py::reinterpret_borrow<py::sequence>(value);
+      int n = (int)py::len(seq);
+      if (n == 1) {
+        set = set_py_vector<1>(config, key, seq);
+      } else if (n == 2) {
+        set = set_py_vector<2>(config, key, seq);
+      } else if (n == 3) {
+        set = set_py_vector<3>(config, key, seq);
+      } else if (n == 4) {
+        set = set_py_vector<4>(config, key, seq);
+      }
+    }
+    if (!set) {
+      config.set(key, std::string(py::str(value)));
+    }
+  }
+}
+
 Config config_from_py_dict(py::dict &c) {
   Config config;
   for (auto item : c) {
-    config.set(std::string(py::str(item.first)),
-               std::string(py::str(item.second)));
+    set_py_value(config, std::string(py::str(item.first)), item.second);
   }
   return config;
 }
@@ -109,11 +198,38 @@ void export_misc(py::module &m) {
       .def("initialize", &ToneMapper::initialize)
       .def("apply", &ToneMapper::apply);
 
+  py::class_<BenchmarkStatistics>(m, "BenchmarkStatistics")
+      .def_readonly("samples", &BenchmarkStatistics::samples)
+      .def_readonly("mean", &BenchmarkStatistics::mean)
+      .def_readonly("median", &BenchmarkStatistics::median)
+      .def_readonly("p95", &BenchmarkStatistics::p95)
+      .def_readonly("stddev", &BenchmarkStatistics::stddev)
+      .def_readonly("min", &BenchmarkStatistics::min)
+      .def_readonly("max", &BenchmarkStatistics::max)
+      .def_readonly("num_outliers", &BenchmarkStatistics::num_outliers)
+      .def_readonly("unit", &BenchmarkStatistics::unit)
+      .def_readonly("metrics", &BenchmarkStatistics::metrics)
+      .def("to_json", &BenchmarkStatistics::to_json);
+
   py::class_<Benchmark, std::shared_ptr<Benchmark>>(m, "Benchmark")
-      .def("run", &Benchmark::run)
+      .def("run",
+           [](Benchmark &benchmark, int iterations) {
+             py::gil_scoped_release release;
+             return benchmark.run(iterations);
+           })
+      .def("run_trials",
+           [](Benchmark &benchmark, int iterations) {
+             py::gil_scoped_release release;
+             return benchmark.run_trials(iterations);
+           })
       .def("test", &Benchmark::test)
       .def("initialize", &Benchmark::initialize);
 
+  py::class_<AsyncCall, std::shared_ptr<AsyncCall>>(m, "AsyncCall")
+      .def("done", &AsyncCall::done)
+      .def("wait", &AsyncCall::wait)
+      .def("wait", [](AsyncCall &call) { return call.wait(-1); });
+
   py::class_<UnitDLL, std::shared_ptr<UnitDLL>>(m, "UnitDLL")
       .def("open_dll", &UnitDLL::open_dll)
       .def("close_dll", &UnitDLL::close_dll)
@@ -138,6 +254,7 @@ void export_misc(py::module &m) {
   m.def("set_core_debug", CoreState::set_debug);
   m.def("set_logging_level",
         [](const std::string &level) { logger.set_level(level); });
+  m.def("set_logging_async", [](bool async) { logger.set_async(async); });
   m.def("set_core_trigger_gdb_when_crash",
         CoreState::set_trigger_gdb_when_crash);
   m.def("test", test);
@@ -145,6 +262,8 @@ void export_misc(py::module &m) {
   m.def("test_volumetric_io", test_volumetric_io);
   m.def("config_from_dict", config_from_py_dict);
   m.def("get_default_float_size", []() { return sizeof(real); });
+  m.def("get_cpu_instruction_set",
+        []() { return get_cpu_features().get_name(); });
   m.def("register_at_exit",
         [&](uint64 ptr) { python_at_exit = *(Function11 *)(ptr); });
   m.def("trigger_sig_fpe", []() {
@@ -154,7 +273,34 @@ void export_misc(py::module &m) {
   });
   // m.def("dict_from_config", py_dict_from_py_config);
   m.def("print_profile_info", [&]() { print_profile_info(); });
+  m.def("clear_profile_info",
+        [&]() { ProfilerRecords::get_instance().clear(); });
+  m.def("enable_profile_tracing",
+        [&](bool tracing) { Profiler::enable_tracing(tracing); });
+  m.def("enable_profile_counters", [&](const std::vector<std::string> &events) {
+    Profiler::enable_counters(events);
+  });
+  m.def("write_profile_trace", [&](const std::string &file_name) {
+    ProfilerRecords::get_instance().write_chrome_trace(file_name);
+  });
+  m.def("set_thread_pinning", &ThreadedTaskManager::set_thread_pinning);
+  m.def("get_numa_nodes", &ThreadedTaskManager::get_numa_nodes);
+  m.def("get_statistics", &Statistics::get_counters);
+  m.def("clear_statistics", &Statistics::clear);
   m.def("start_memory_monitoring", start_memory_monitoring);
+  m.def("start_memory_sampling", start_memory_sampling);
+  m.def("get_memory_usage", get_memory_usage);
+  m.def("get_peak_memory_usage", get_peak_memory_usage);
+  m.def("get_memory_phase_peaks", &MemoryPhase::get_peaks);
+  m.def("clear_memory_phase_peaks", &MemoryPhase::clear);
+  // For 'with tc.core.MemoryPhase(name):'
+  py::class_<PyMemoryPhase>(m, "MemoryPhase")
+      .def(py::init<std::string>())
+      .def("__enter__",
+           [](PyMemoryPhase &p) {
+             p.phase = std::make_unique<MemoryPhase>(p.name);
+           })
+      .def("__exit__", [](PyMemoryPhase &p, py::args) { p.phase.reset(); });
   m.def("absolute_path", absolute_path);
 }
 
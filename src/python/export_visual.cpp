@@ -4,22 +4,28 @@
 *******************************************************************************/
 
 #include <taichi/python/export.h>
+#include <pybind11/numpy.h>
 
 #include <taichi/math/sdf.h>
 
 #include <taichi/visual/camera.h>
 #include <taichi/visual/renderer.h>
+#include <taichi/visual/render_session.h>
+#include <taichi/visual/render_batch.h>
 #include <taichi/visual/volume_material.h>
 #include <taichi/visual/surface_material.h>
 #include <taichi/visual/envmap.h>
 #include <taichi/visualization/particle_visualization.h>
+#include <taichi/io/mesh_reader.h>
 #include <taichi/common/asset_manager.h>
+#include <taichi/common/asset_cache.h>
 
 #include <taichi/geometry/factory.h>
 #include <taichi/math/levelset.h>
 
 PYBIND11_MAKE_OPAQUE(std::vector<taichi::RenderParticle>);
 PYBIND11_MAKE_OPAQUE(std::vector<taichi::Triangle>);
+PYBIND11_MAKE_OPAQUE(std::vector<taichi::Vector4>);
 
 TC_NAMESPACE_BEGIN
 
@@ -47,8 +53,168 @@ std::vector<Triangle> merge_mesh(const std::vector<Triangle> &a,
   return merged;
 }
 
+using RealNDArray =
+    py::array_t<real, py::array::c_style | py::array::forcecast>;
+using IntNDArray = py::array_t<int, py::array::c_style | py::array::forcecast>;
+
+// Records {position, color} for the buffer protocol, so that
+// numpy.asarray(particles) is a structured view that makes no copy. Padding
+// of SIMD positions to 4 reals is skipped. The view keeps the particles
+// alive, but is invalidated when the vector grows.
+py::buffer_info get_render_particles_buffer_info(
+    std::vector<RenderParticle> &particles) {
+  std::string r = py::format_descriptor<real>::format();
+  std::size_t padding = sizeof(Vector3) - 3 * sizeof(real);
+  std::string format = fmt::format(
+      "T{{(3){}:position:{}(4){}:color:}}", r,
+      padding > 0 ? fmt::format("{}x", padding) : std::string(), r);
+  std::vector<size_t> shape{particles.size()}, strides{sizeof(RenderParticle)};
+  return py::buffer_info(particles.data(), sizeof(RenderParticle), format, 1,
+                         shape, strides);
+}
+
+// Replaces 'particles' with those at 'positions' (n x 3) of 'colors' (n x 3,
+// with alpha 1, or n x 4), in one pass over contiguous arrays of reals
+void render_particles_from_ndarray(std::vector<RenderParticle> &particles,
+                                   RealNDArray positions,
+                                   RealNDArray colors) {
+  TC_ERROR_IF(positions.ndim() != 2 || positions.shape(1) != 3,
+              "Particle positions must be an n x 3 ndarray");
+  std::size_t n = (std::size_t)positions.shape(0);
+  int channels = colors.ndim() == 2 ? (int)colors.shape(1) : 0;
+  TC_ERROR_IF((std::size_t)colors.shape(0) != n ||
+                  (channels != 3 && channels != 4),
+              "Particle colors must be an n x 3 or n x 4 ndarray, with n = {}",
+              n);
+  const real *p = positions.data(), *c = colors.data();
+  particles.resize(n);
+  for (std::size_t i = 0; i < n; i++) {
+    const real *color = c + i * channels;
+    particles[i] = RenderParticle(
+        Vector3(p[i * 3], p[i * 3 + 1], p[i * 3 + 2]),
+        Vector4(color[0], color[1], color[2],
+                channels == 4 ? color[3] : 1.0_f));
+  }
+}
+
+// Replaces the triangles of |mesh| with the indexed geometry of n vertex
+// |positions| (n x 3) and |indices| (m x 3). Per-vertex |normals| (n x 3)
+// and |uvs| (n x 2) are optional; empty arrays give face normals and zero
+// uvs.
+void mesh_set_geometry(Mesh &mesh,
+                       RealNDArray positions,
+                       IntNDArray indices,
+                       RealNDArray normals,
+                       RealNDArray uvs) {
+  TC_ERROR_IF(positions.ndim() != 2 || positions.shape(1) != 3,
+              "Mesh positions must be an n x 3 ndarray");
+  TC_ERROR_IF(indices.ndim() != 2 || indices.shape(1) != 3,
+              "Mesh indices must be an m x 3 ndarray");
+  int n = (int)positions.shape(0);
+  bool has_normals = normals.size() > 0, has_uvs = uvs.size() > 0;
+  TC_ERROR_IF(has_normals && (normals.ndim() != 2 || normals.shape(0) != n ||
+                              normals.shape(1) != 3),
+              "Mesh normals must be an n x 3 ndarray, with n = {}", n);
+  TC_ERROR_IF(has_uvs && (uvs.ndim() != 2 || uvs.shape(0) != n ||
+                          uvs.shape(1) != 2),
+              "Mesh uvs must be an n x 2 ndarray, with n = {}", n);
+  MeshData data;
+  const real *p = positions.data();
+  data.positions.resize(n);
+  for (int i = 0; i < n; i++) {
+    data.positions[i] = Vector3(p[i * 3], p[i * 3 + 1], p[i * 3 + 2]);
+  }
+  if (has_normals) {
+    const real *q = normals.data();
+    data.normals.resize(n);
+    for (int i = 0; i < n; i++) {
+      data.normals[i] = Vector3(q[i * 3], q[i * 3 + 1], q[i * 3 + 2]);
+    }
+  }
+  if (has_uvs) {
+    const real *q = uvs.data();
+    data.uvs.resize(n);
+    for (int i = 0; i < n; i++) {
+      data.uvs[i] = Vector2(q[i * 2], q[i * 2 + 1]);
+    }
+  }
+  const int *index = indices.data();
+  data.position_indices.assign(index, index + indices.size());
+  for (int i : data.position_indices) {
+    TC_ERROR_IF(i < 0 || i >= n, "Mesh index {} out of range [0, {})", i, n);
+  }
+  data.normal_indices = has_normals ? data.position_indices
+                                    : std::vector<int>(indices.size(), -1);
+  data.uv_indices = has_uvs ? data.position_indices
+                            : std::vector<int>(indices.size(), -1);
+  mesh.untransformed_triangles.clear();
+  mesh.positions.clear();
+  mesh.faces.clear();
+  mesh.load_mesh_data(data);
+}
+
+// Row-major, as numpy prints it
+Matrix4 matrix4_from_ndarray(const real *m) {
+  Matrix4 ret;
+  for (int i = 0; i < 4; i++) {
+    for (int j = 0; j < 4; j++) {
+      ret(i, j) = m[i * 4 + j];
+    }
+  }
+  return ret;
+}
+
+void check_transforms_ndarray(const RealNDArray &transforms, std::size_t n) {
+  TC_ERROR_IF(transforms.ndim() != 3 || transforms.shape(1) != 4 ||
+                  transforms.shape(2) != 4 ||
+                  (std::size_t)transforms.shape(0) != n,
+              "Transforms must be an n x 4 x 4 ndarray, with n = {}", n);
+}
+
+// Adds an instance of meshes[mesh_ids[i]] per transform (n x 4 x 4), as
+// Scene::add_instance does. Materials belong to meshes, so instances of
+// several materials use one mesh per material. Without |mesh_ids|, all
+// instances are of meshes[0].
+void scene_add_instances(Scene &scene,
+                         const std::vector<std::shared_ptr<Mesh>> &meshes,
+                         RealNDArray transforms,
+                         IntNDArray mesh_ids) {
+  TC_ERROR_IF(meshes.empty(), "No meshes to instance");
+  bool has_ids = mesh_ids.size() > 0;
+  std::size_t n = has_ids ? (std::size_t)mesh_ids.size()
+                          : (std::size_t)transforms.shape(0);
+  check_transforms_ndarray(transforms, n);
+  const real *m = transforms.data();
+  const int *ids = mesh_ids.data();
+  scene.instances.reserve(scene.instances.size() + n);
+  for (std::size_t i = 0; i < n; i++) {
+    int id = has_ids ? ids[i] : 0;
+    TC_ERROR_IF(id < 0 || id >= (int)meshes.size(),
+                "Mesh id {} out of range [0, {})", id, meshes.size());
+    scene.add_instance(meshes[id], matrix4_from_ndarray(m + i * 16));
+  }
+}
+
+// Scene::set_instance_transform for each of |instances| (n) with
+// |transforms| (n x 4 x 4)
+void scene_set_instance_transforms(Scene &scene,
+                                   IntNDArray instances,
+                                   RealNDArray transforms) {
+  std::size_t n = (std::size_t)instances.size();
+  check_transforms_ndarray(transforms, n);
+  const real *m = transforms.data();
+  const int *ids = instances.data();
+  for (std::size_t i = 0; i < n; i++) {
+    scene.set_instance_transform(ids[i], matrix4_from_ndarray(m + i * 16));
+  }
+}
+
 void export_visual(py::module &m) {
-  DEFINE_VECTOR_OF_NAMED(RenderParticle, "RenderParticles");
+  DEFINE_VECTOR_METHODS(RenderParticle,
+                        py::class_<std::vector<RenderParticle>>(
+                            m, "RenderParticles", py::buffer_protocol()))
+      .def_buffer(&get_render_particles_buffer_info)
+      .def("from_ndarray", &render_particles_from_ndarray);
   DEFINE_VECTOR_OF_NAMED(Triangle, "Triangles");
 
   m.def("get_function11_address", address_as<Function11, uint64>);
@@ -69,9 +235,50 @@ void export_visual(py::module &m) {
 
   // TODO: these should registered by iterating over existing interfaces.
   m.def("merge_mesh", merge_mesh);
-  m.def("generate_mesh", Mesh3D::generate);
-  m.def("rasterize_render_particles", rasterize_render_particles);
+  // Without the GIL, so that the rows are tessellated in parallel; Python
+  // functions take it back for each evaluation
+  m.def("generate_mesh",
+        [](Vector2i res, const Function23 *surf, const Function23 *norm,
+           const Function22 *uv, bool smooth_normal) {
+          py::gil_scoped_release release;
+          return Mesh3D::generate(res, surf, norm, uv, smooth_normal);
+        });
+  m.def("generate_mesh_data",
+        [](Vector2i res, const Function23 *surf, const Function23 *norm,
+           const Function22 *uv, bool smooth_normal) {
+          py::gil_scoped_release release;
+          return Mesh3D::generate_indexed(res, surf, norm, uv, smooth_normal);
+        });
+  py::class_<MeshData, std::shared_ptr<MeshData>>(m, "MeshData")
+      .def("get_num_triangles", &MeshData::get_num_triangles);
+  m.def("rasterize_render_particles",
+        static_cast<std::shared_ptr<Texture> (*)(
+            const Config &, const std::vector<RenderParticle> &)>(
+            rasterize_render_particles));
+
+  // Particle frames of write_vector_to_disk, viewed in their mapped files
+  using MappedRenderParticles = MappedVector<RenderParticle>;
+  py::class_<MappedRenderParticles, std::shared_ptr<MappedRenderParticles>>(
+      m, "MappedRenderParticles")
+      .def(py::init<std::string>())
+      .def("is_valid", &MappedRenderParticles::is_valid)
+      .def("is_mapped", &MappedRenderParticles::is_mapped)
+      .def("__len__", &MappedRenderParticles::size);
+  using RenderParticleFrames = FramePrefetcher<MappedRenderParticles>;
+  py::class_<RenderParticleFrames, std::shared_ptr<RenderParticleFrames>>(
+      m, "RenderParticleFrames")
+      .def(py::init<std::string>())
+      .def("get", &RenderParticleFrames::get)
+      .def("get_file_name", &RenderParticleFrames::get_file_name);
+  m.def("rasterize_mapped_render_particles",
+        [](const Config &config, const MappedRenderParticles &particles) {
+          return rasterize_render_particles(config, particles.data(),
+                                            particles.size());
+        });
   m.def("create_mesh", std::make_shared<Mesh>);
+  // Shared with earlier assets of the same config, see AssetCache
+  m.def("create_shared_texture", &AssetCache::create<Texture>);
+  m.def("create_shared_surface_material", &AssetCache::create<SurfaceMaterial>);
   m.def("create_scene", std::make_shared<Scene>);
 
   py::class_<Texture, std::shared_ptr<Texture>>(m, "Texture")
@@ -102,13 +309,36 @@ void export_visual(py::module &m) {
   py::class_<Mesh, std::shared_ptr<Mesh>>(m, "Mesh")
       .def("initialize", &Mesh::initialize)
       .def("set_untransformed_triangles", &Mesh::set_untransformed_triangles)
+      .def("load_mesh_data", &Mesh::load_mesh_data, py::arg("data"),
+           py::arg("reverse_vertices") = false)
+      .def("set_geometry", &mesh_set_geometry, py::arg("positions"),
+           py::arg("indices"), py::arg("normals") = RealNDArray(),
+           py::arg("uvs") = RealNDArray())
       .def("set_material", &Mesh::set_material)
       .def_readwrite("transform", &Mesh::transform);
 
   py::class_<Scene, std::shared_ptr<Scene>>(m, "Scene")
       //.def("initialize", &Scene::initialize)
       .def("finalize", &Scene::finalize)
+      .def("set_bundle", &Scene::set_bundle)
       .def("add_mesh", &Scene::add_mesh)
+      .def("add_instance", &Scene::add_instance)
+      .def("add_instances", &scene_add_instances, py::arg("meshes"),
+           py::arg("transforms"), py::arg("mesh_ids") = IntNDArray())
+      .def("add_spheres", &Scene::add_spheres)
+      .def("add_particles",
+           [](Scene &scene, const std::vector<RenderParticle> &particles,
+              real radius, std::shared_ptr<SurfaceMaterial> material) {
+             std::vector<Vector4> spheres;
+             spheres.reserve(particles.size());
+             for (auto &p : particles) {
+               spheres.push_back(Vector4(p.position, radius));
+             }
+             scene.add_spheres(spheres, material);
+           })
+      .def("set_mesh_transform", &Scene::set_mesh_transform)
+      .def("set_instance_transform", &Scene::set_instance_transform)
+      .def("set_instance_transforms", &scene_set_instance_transforms)
       .def("set_atmosphere_material", &Scene::set_atmosphere_material)
       .def("set_environment_map", &Scene::set_environment_map)
       .def("set_camera", &Scene::set_camera);
@@ -117,9 +347,83 @@ void export_visual(py::module &m) {
   py::class_<Renderer, std::shared_ptr<Renderer>>(m, "Renderer")
       .def("initialize", &Renderer::initialize)
       .def("set_scene", &Renderer::set_scene)
-      .def("render_stage", &Renderer::render_stage)
+      .def("set_camera", &Renderer::set_camera)
+      .def("render_stage",
+           [](Renderer &renderer) {
+             py::gil_scoped_release release;
+             renderer.render_stage();
+           })
+      .def("render_stage_async",
+           [](py::object self) {
+             auto renderer = self.cast<Renderer *>();
+             return std::make_shared<AsyncCall>(
+                 [renderer]() { renderer->render_stage(); },
+                 py::make_tuple(self));
+           })
+      .def("update_scene", &Renderer::update_scene)
+      .def("material_changed", &Renderer::material_changed)
+      .def("set_crop_window", &Renderer::set_crop_window)
+      .def("set_priority_regions", &Renderer::set_priority_regions)
       .def("write_output", &Renderer::write_output)
-      .def("get_output", &Renderer::get_output);
+      .def("wait_for_output",
+           [](Renderer &renderer) {
+             py::gil_scoped_release release;
+             renderer.wait_for_output();
+           })
+      .def("is_converged", &Renderer::is_converged)
+      .def("save_checkpoint", &Renderer::save_checkpoint)
+      .def("wait_for_checkpoint",
+           [](Renderer &renderer) {
+             py::gil_scoped_release release;
+             renderer.wait_for_checkpoint();
+           })
+      .def("load_checkpoint", &Renderer::load_checkpoint)
+      .def("get_partial_output",
+           [](Renderer &renderer) {
+             std::vector<uint8> data = renderer.get_partial_output();
+             return py::bytes((const char *)data.data(), data.size());
+           })
+      .def("get_output", &Renderer::get_output)
+      .def("get_denoised_output", &Renderer::get_denoised_output);
+
+  // Averages the partial outputs of workers rendering disjoint sample ranges
+  m.def("merge_partial_outputs", [](const std::vector<std::string> &parts) {
+    ImageAccumulator<Vector3> accumulator;
+    for (auto &part : parts) {
+      accumulator.accumulate_binary(
+          std::vector<uint8>(part.begin(), part.end()));
+    }
+    return accumulator.get_averaged();
+  });
+
+  py::class_<RenderSession, std::shared_ptr<RenderSession>>(m,
+                                                            "RenderSession")
+      .def(py::init<std::shared_ptr<Renderer>, const Config &>())
+      .def("start", &RenderSession::start)
+      .def("cancel", &RenderSession::cancel)
+      .def("wait",
+           [](RenderSession &session) {
+             py::gil_scoped_release release;
+             session.wait();
+           })
+      .def("is_running", &RenderSession::is_running)
+      .def("get_stage_count", &RenderSession::get_stage_count)
+      .def("get_preview", &RenderSession::get_preview)
+      .def("get_preview_stage_count", &RenderSession::get_preview_stage_count);
+
+  py::class_<RenderBatch, std::shared_ptr<RenderBatch>>(m, "RenderBatch")
+      .def(py::init<const std::string &, const Config &,
+                    std::shared_ptr<Scene>,
+                    const std::vector<std::shared_ptr<Camera>> &>())
+      .def("render_stage",
+           [](RenderBatch &batch) {
+             py::gil_scoped_release release;
+             batch.render_stage();
+           })
+      .def("get_num_views", &RenderBatch::get_num_views)
+      .def("get_view", &RenderBatch::get_view)
+      .def("write_outputs", &RenderBatch::write_outputs)
+      .def("update_scene", &RenderBatch::update_scene);
 
   py::class_<Camera, std::shared_ptr<Camera>>(m, "Camera")
       .def("initialize", &Camera::initialize);
@@ -128,7 +432,12 @@ void export_visual(py::module &m) {
       m, "ParticleRenderer")
       .def("initialize", &ParticleRenderer::initialize)
       .def("set_camera", &ParticleRenderer::set_camera)
-      .def("render", &ParticleRenderer::render);
+      .def("render",
+           [](ParticleRenderer &renderer, Array2D<Vector3> &buffer,
+              const std::vector<RenderParticle> &particles) {
+             py::gil_scoped_release release;
+             renderer.render(buffer, particles);
+           });
 
   py::class_<SDF, std::shared_ptr<SDF>>(m, "SDF")
       .def("initialize", &SDF::initialize)
@@ -4,81 +4,140 @@
 *******************************************************************************/
 
 #include <taichi/visual/renderer.h>
-#include <taichi/math/averager.h>
+#include <taichi/system/profiler.h>
+#include <atomic>
 
 #include "sppm.h"
 #include "markov_chain.h"
 
 TC_NAMESPACE_BEGIN
 
+// Runs |chains_per_thread| visibility chains per thread, each over its share
+// of the photons of a stage and with its own RNG and adaptive mutation
+// strength. The normalizer is shared: the chains count their visibility
+// tests locally and add them to it every |normalizer_merge_interval| tests.
+// Photons splat into the per-pass arrays of SPPMRenderer, which are atomic.
 class AMCMCPPMRenderer : public SPPMRenderer {
  public:
   virtual void initialize(const Config &config) override {
     SPPMRenderer::initialize(config);
-    uniform_count = 0;
-    accepted = 0;
-    mutated = 0;
-    mutation_strength = 1;
-    mc_initialized = false;
     russian_roulette = config.get("russian_roulette", false);
+    chains_per_thread = config.get("chains_per_thread", 4);
+    normalizer_merge_interval = config.get("normalizer_merge_interval", 256);
+    chains.clear();
+    normalizer_visible = 0;
+    normalizer_tested = 0;
   }
 
   void render_stage() override;
 
+  // The chains restart from uniform states
+  void reset_accumulation() override {
+    SPPMRenderer::reset_accumulation();
+    chains.clear();
+    normalizer_visible = 0;
+    normalizer_tested = 0;
+  }
+
  protected:
+  TC_RENDERER_NO_CHECKPOINT
+
   struct MCMCState {
     // We only need to store the visibility chain
     AMCMCPPMMarkovChain chain;
   };
 
-  // Current state on the *visibility* chain.
-  MCMCState current_state;
+  struct Chain {
+    // Current state on the *visibility* chain.
+    MCMCState current_state;
+    PCG32 rng;
+    bool initialized = false;
+    int64 uniform_count = 0;
+    int64 accepted = 0;
+    int64 mutated = 0;
+    real mutation_strength = 1;
+    // Visibility tests not yet added to the shared normalizer
+    int64 visible = 0;
+    int64 tested = 0;
+  };
+
+  MCMCState create_new_uniform_state(PCG32 &rng) {
+    MCMCState state;
+    state.chain.set_rng(&rng);
+    return state;
+  }
 
-  MCMCState create_new_uniform_state() {
-    return MCMCState();
+  int get_num_chains() const {
+    int threads = num_threads > 0 ? num_threads
+                                  : (int)std::thread::hardware_concurrency();
+    return std::max(1, threads) * chains_per_thread;
   }
 
-  // The ratio of visible part of the PSS hypercube
+  // The ratio of visible part of the PSS hypercube, as seen by |chain|
   // Also the normalizer for the visibility chain
-  RunningAverage normalizer;
+  real get_normalizer(const Chain &chain) const {
+    int64 tested = normalizer_tested.load(std::memory_order_relaxed) +
+                   chain.tested;
+    if (tested == 0) {
+      return 0;
+    }
+    return (real)(normalizer_visible.load(std::memory_order_relaxed) +
+                  chain.visible) /
+           (real)tested;
+  }
 
-  int64 uniform_count;
-  int64 accepted;
-  int64 mutated;
+  void merge_normalizer(Chain &chain) {
+    normalizer_visible.fetch_add(chain.visible, std::memory_order_relaxed);
+    normalizer_tested.fetch_add(chain.tested, std::memory_order_relaxed);
+    chain.visible = 0;
+    chain.tested = 0;
+  }
+
+  void insert_visibility(Chain &chain, bool visible) {
+    chain.visible += visible;
+    chain.tested += 1;
+    if (chain.tested >= normalizer_merge_interval) {
+      merge_normalizer(chain);
+    }
+  }
 
-  real mutation_strength;
-  bool mc_initialized;
+  void initialize_chain(Chain &chain);
+
+  void advance_chain(Chain &chain, int64 num_photons);
+
+  std::vector<Chain> chains;
+  int chains_per_thread;
+  int normalizer_merge_interval;
+  // Of all chains and stages
+  std::atomic<int64> normalizer_visible;
+  std::atomic<int64> normalizer_tested;
 };
 
-void AMCMCPPMRenderer::render_stage() {
-  hash_grid.clear_cache();
-  eye_ray_pass();
-  hash_grid.build_grid();
-  // TODO:....
-  normalizer.clear();
-  if (!mc_initialized) {
-    int64 emitted = 0;
-    while (true) {
-      emitted += 1;
-      if (emitted % 100000 == 0) {
-        printf("Warning: having difficulty initializing...\n");
-        std::cout << emitted << " photons emitted without any visible one."
-                  << std::endl;
-      }
-      current_state = create_new_uniform_state();
-      auto uniform_state_sequence = MCStateSequence(current_state.chain);
-      bool visible = trace_photon(uniform_state_sequence, 0.0_f);
-      normalizer.insert((real)visible, 1);
-      if (visible) {
-        accepted = 1;
-        uniform_count = 1;
-        mc_initialized = true;
-        break;
-      }
+void AMCMCPPMRenderer::initialize_chain(Chain &chain) {
+  int64 emitted = 0;
+  while (true) {
+    emitted += 1;
+    if (emitted % 100000 == 0) {
+      printf("Warning: having difficulty initializing...\n");
+      std::cout << emitted << " photons emitted without any visible one."
+                << std::endl;
+    }
+    chain.current_state = create_new_uniform_state(chain.rng);
+    auto uniform_state_sequence = MCStateSequence(chain.current_state.chain);
+    bool visible = trace_photon(uniform_state_sequence, 0.0_f);
+    insert_visibility(chain, visible);
+    if (visible) {
+      chain.accepted = 1;
+      chain.uniform_count = 1;
+      chain.initialized = true;
+      break;
     }
   }
-  real last_r = 0.0_f;
-  for (int64 i = 0; i < num_photons_per_stage; i++) {
+}
+
+void AMCMCPPMRenderer::advance_chain(Chain &chain, int64 num_photons) {
+  MCMCState &current_state = chain.current_state;
+  for (int64 i = 0; i < num_photons; i++) {
     // ----------------------------------------
     // We do 3 MCMC steps here:
     //   1. Mutate the visibility chain
@@ -97,53 +156,94 @@ void AMCMCPPMRenderer::render_stage() {
 
     // Step 2:
     // Mutate the uniform chain, using a completely random new state
-    MCMCState uniform_state = create_new_uniform_state();
+    MCMCState uniform_state = create_new_uniform_state(chain.rng);
     auto uniform_state_sequence = MCStateSequence(uniform_state.chain);
 
-    real weight = normalizer.get_average();
+    real weight = get_normalizer(chain);
     // The pdf of sampling this point in the PSS hypercube is 1 while
     // the normalization factor for the visibility chain is
-    // normalizer.get_average().
+    // get_normalizer(chain).
     // So we do the corresponding scaling of contribution.
 
     if (trace_photon(uniform_state_sequence, weight)) {
       // Uniform state visible
-      normalizer.insert(1, 1);
+      insert_visibility(chain, true);
       // Step 3:
       // Always do replica exchange in this case
       current_state = uniform_state;
-      uniform_count += 1;
+      chain.uniform_count += 1;
     } else {
       // Uniform state invisible
-      normalizer.insert(0, 1);
+      insert_visibility(chain, false);
       // Step 1:
       // Mutate the visibility chain
       MCMCState candidate_state;
-      mutated += 1;
-      candidate_state.chain = current_state.chain.mutate(mutation_strength);
+      chain.mutated += 1;
+      candidate_state.chain =
+          current_state.chain.mutate(chain.mutation_strength);
       auto candidate_state_sequence = MCStateSequence(candidate_state.chain);
       if (trace_photon(candidate_state_sequence, weight)) {
         current_state = candidate_state;
-        accepted += 1;
+        chain.accepted += 1;
       } else {
         auto rand = MCStateSequence(current_state.chain);
         trace_photon(rand, weight);
       }
     }
-    photon_counter += 1;
 
     // Adaptive MCMC parameter update
-    real r = (real)accepted / (real)mutated;
-    last_r = r;
-    mutation_strength = mutation_strength + (r - 0.234_f) / mutated;
-    mutation_strength = std::min(0.5_f, std::max(0.0001_f, mutation_strength));
+    if (chain.mutated > 0) {
+      real r = (real)chain.accepted / (real)chain.mutated;
+      chain.mutation_strength =
+          chain.mutation_strength + (r - 0.234_f) / chain.mutated;
+      chain.mutation_strength =
+          std::min(0.5_f, std::max(0.0001_f, chain.mutation_strength));
+    }
+  }
+}
+
+void AMCMCPPMRenderer::render_stage() {
+  hash_grid.clear_cache();
+  TC_PROFILE("eye_ray_pass", eye_ray_pass());
+  TC_PROFILE("build_grid", hash_grid.build_grid());
+  if (chains.empty()) {
+    chains.resize(get_num_chains());
+    for (int c = 0; c < (int)chains.size(); c++) {
+      chains[c].rng = PCG32(0, c);
+    }
+  }
+  int num_chains = (int)chains.size();
+  TC_PROFILE(
+      "trace_photons",
+      ThreadedTaskManager::run(
+          [&](int c) {
+            Chain &chain = chains[c];
+            // The photons of the stage, split as evenly as possible
+            int64 begin = (int64)num_photons_per_stage * c / num_chains;
+            int64 end = (int64)num_photons_per_stage * (c + 1) / num_chains;
+            if (!chain.initialized) {
+              initialize_chain(chain);
+            }
+            advance_chain(chain, end - begin);
+          },
+          0, num_chains, num_threads));
+  int64 mutated = 0, accepted = 0;
+  real mutation_strength = 0;
+  for (auto &chain : chains) {
+    merge_normalizer(chain);
+    mutated += chain.mutated;
+    accepted += chain.accepted;
+    mutation_strength += chain.mutation_strength / num_chains;
   }
+  photon_counter += num_photons_per_stage;
 
+  real last_r = (real)accepted / (real)std::max(mutated, (int64)1);
   TC_P(mutated);
   TC_P(accepted);
   TC_P(last_r);
   TC_P(mutation_strength);
-  TC_P(normalizer.get_average());
+  TC_P((real)normalizer_visible / (real)normalizer_tested);
+  TC_PROFILE("update_hit_points", update_hit_points());
   stages += 1;
 
   for (auto &ind : image.get_region()) {
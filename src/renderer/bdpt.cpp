@@ -8,23 +8,165 @@
 TC_NAMESPACE_BEGIN
 
 class BDPTRenderer : public BidirectionalRenderer {
- protected:
  public:
   virtual void initialize(const Config &config) override {
     BidirectionalRenderer::initialize(config);
+    // Over every |stage_frequency| stages, sample_count steps over all the
+    // pixels, in the order of their phases, so that sample k of a pixel is
+    // instance k * width * height + (its rank in that order)
+    this->sampler =
+        create_instance<Sampler>(config.get("sampler", "owen_sobol"),
+                                 Config().set("num_pixels", width * height));
+    light_vertex_cache = config.get("light_vertex_cache", false);
+    num_cached_light_paths = config.get(
+        "cached_light_paths", std::max(1, width * height / stage_frequency));
+    num_cached_connections = config.get("cached_connections", 1);
+    TC_ERROR_IF(light_vertex_cache &&
+                    (num_cached_light_paths < 1 || num_cached_connections < 1),
+                "Light vertex caches need cached_light_paths and "
+                "cached_connections >= 1");
+    // Seeded apart from the eye paths
+    cache_sampler = create_instance<Sampler>("prand", Config().set("seed", 1));
   }
 
+  // Every pixel gets one eye path per |stage_frequency| stages: stage k
+  // renders the pixels whose linear index is k modulo |stage_frequency|.
+  // With a crop window, only its pixels are rendered, and light tracing
+  // makes up for the light paths of the pixels left out.
   void render_stage() override {
-    int num_samples = width * height / stage_frequency;
-    auto func = [&](int i) {
-      auto state_sequence = RandomStateSequence(sampler, sample_count + i);
-      Path eye_path = trace_eye_path(state_sequence);
-      Path light_path = trace_light_path(state_sequence);
-      PathContribution pc = connect(eye_path, light_path);
-      write_path_contribution(pc);
-    };
-    ThreadedTaskManager::run(func, 0, num_samples, num_threads);
+    if (light_vertex_cache) {
+      build_light_vertex_cache();
+    }
+    int phase = stage_count % stage_frequency;
+    int num_samples =
+        (width * height - phase + stage_frequency - 1) / stage_frequency;
+    real light_tracing_scaling = 1;
+    if (is_cropped()) {
+      int num_cropped_samples = 0;
+      for (int i = crop_begin.x; i < crop_end.x; i++) {
+        for (int j = crop_begin.y; j < crop_end.y; j++) {
+          num_cropped_samples += (i * height + j) % stage_frequency == phase;
+        }
+      }
+      light_tracing_scaling =
+          (real)num_samples / std::max(num_cropped_samples, 1);
+    }
+    Vector2 size(1.0_f / width, 1.0_f / height);
+    for_each_tile([&](const Tile &tile) {
+      // Reused for every pixel of the tile
+      Path eye_path, light_path;
+      PathContribution pc;
+      for (int i = tile.begin.x; i < tile.end.x; i++) {
+        for (int j = tile.begin.y; j < tile.end.y; j++) {
+          int pixel = i * height + j;
+          if (pixel % stage_frequency != phase) {
+            continue;
+          }
+          auto state_sequence = RandomStateSequence(
+              sampler, sample_count + pixel / stage_frequency);
+          trace_eye_path(state_sequence, eye_path,
+                         Vector2(i * size.x, j * size.y), size);
+          if (light_vertex_cache) {
+            connect_to_cache(state_sequence, eye_path, pixel / stage_frequency,
+                             light_tracing_scaling, pc);
+            continue;
+          }
+          trace_light_path(state_sequence, light_path);
+          connect_and_write(eye_path, light_path, pc, 1,
+                            light_tracing_scaling);
+        }
+      }
+    });
     sample_count += num_samples;
+    stage_count++;
+  }
+
+ protected:
+  int stage_count = 0;
+
+  // Light vertex cache (after Davidovic et al., "Progressive Light
+  // Transport Simulation on the GPU"): every stage traces
+  // |num_cached_light_paths| light paths, and each eye path connects to
+  // |num_cached_connections| of their vertices, picked uniformly. Light
+  // tracing and unidirectional hits, which take no light vertex picked
+  // from the cache, use a whole cached path per eye path.
+  bool light_vertex_cache;
+  int num_cached_light_paths;
+  int num_cached_connections;
+  std::shared_ptr<Sampler> cache_sampler;
+  int64 cached_light_path_count = 0;
+  std::vector<Path> cached_light_paths;
+  // Prefix of cached_light_paths[path] with |length| vertices
+  struct LightSubpath {
+    int path;
+    int length;
+  };
+  std::vector<LightSubpath> cached_subpaths;
+
+  void build_light_vertex_cache() {
+    cached_light_paths.resize(num_cached_light_paths);
+    ThreadedTaskManager::run(
+        [&](int k) {
+          auto rand = RandomStateSequence(cache_sampler,
+                                          cached_light_path_count + k);
+          trace_light_path(rand, cached_light_paths[k]);
+        },
+        0, num_cached_light_paths, num_threads);
+    cached_light_path_count += num_cached_light_paths;
+    cached_subpaths.clear();
+    for (int k = 0; k < num_cached_light_paths; k++) {
+      for (int l = 1; l <= (int)cached_light_paths[k].size(); l++) {
+        cached_subpaths.push_back(LightSubpath{k, l});
+      }
+    }
+  }
+
+  // The cache holds V vertices of M paths, so a vertex picked uniformly,
+  // weighted by V / M, estimates the sum over the vertices of one light
+  // path; MIS weights stay those of one light path per eye path. Light
+  // tracing is scaled by |light_tracing_scaling|, as in connect_and_write().
+  void connect_to_cache(StateSequence &rand,
+                        const Path &eye_path,
+                        int sample,
+                        real light_tracing_scaling,
+                        PathContribution &pc) {
+    static thread_local Path no_light_path, camera_path;
+    const Path &paired =
+        cached_light_paths[sample % num_cached_light_paths];
+    connect(eye_path, no_light_path, pc);
+    write_path_contribution(pc);
+    if (eye_path.empty() || cached_subpaths.empty()) {
+      return;
+    }
+    camera_path.assign(eye_path.begin(), eye_path.begin() + 1);
+    connect(camera_path, paired, pc);
+    write_path_contribution(pc, light_tracing_scaling);
+    real scaling = (real)cached_subpaths.size() /
+                   ((real)num_cached_light_paths * num_cached_connections);
+    for (int k = 0; k < num_cached_connections; k++) {
+      int picked = std::min((int)(rand() * cached_subpaths.size()),
+                            (int)cached_subpaths.size() - 1);
+      const LightSubpath &subpath = cached_subpaths[picked];
+      for (int e = 2; e <= (int)eye_path.size(); e++) {
+        connect(eye_path, cached_light_paths[subpath.path], pc, e,
+                subpath.length);
+        write_path_contribution(pc, scaling);
+      }
+    }
+  }
+
+  // Stages start over from phase 0
+  void reset_accumulation() override {
+    BidirectionalRenderer::reset_accumulation();
+    stage_count = 0;
+  }
+
+  TC_RENDERER_CHECKPOINT
+
+  template <typename S>
+  void checkpoint_io(S &serializer) {
+    BidirectionalRenderer::checkpoint_io(serializer);
+    TC_IO(stage_count, cached_light_path_count);
   }
 };
 
@@ -14,9 +14,10 @@ TC_NAMESPACE_BEGIN
 
 void BidirectionalRenderer::initialize(const Config &config) {
   Renderer::initialize(config);
-  this->sampler = create_instance<Sampler>(config.get("sampler", "sobol"));
+  this->sampler =
+      create_instance<Sampler>(config.get("sampler", "owen_sobol"));
   this->luminance_clamping = config.get("luminance_clamping", 0.0_f);
-  this->buffer = Array2D<Vector3>(Vector2i(width, height));
+  this->buffer = SplatBuffer(Vector2i(width, height));
   this->max_eye_events = config.get("max_eye_events", 5);
   this->max_light_events = config.get("max_light_events", 5);
   this->max_eye_events =
@@ -62,27 +63,44 @@ void BidirectionalRenderer::trace(Path &path,
   }
 }
 
-Path BidirectionalRenderer::trace_eye_path(StateSequence &rand) {
+Path BidirectionalRenderer::trace_eye_path(StateSequence &rand,
+                                           Vector2 offset,
+                                           Vector2 size) {
   Path result;
+  trace_eye_path(rand, result, offset, size);
+  return result;
+}
+
+void BidirectionalRenderer::trace_eye_path(StateSequence &rand,
+                                           Path &result,
+                                           Vector2 offset,
+                                           Vector2 size) {
+  result.clear();
   result.reserve(max_eye_events);
   if (max_eye_events == 0) {
-    return result;
+    return;
   }
-  Ray r = camera->sample(Vector2(0, 0), Vector2(1.0_f, 1.0_f), rand);
+  Ray r = camera->sample(offset, size, rand);
   IntersectionInfo info;
   info.pos = r.orig;
   info.normal = camera->get_dir();
   info.triangle_id = -1;
   result.push_back(Vertex(info, BSDF()));
   trace(result, r, 1, max_eye_events, rand);
-  return result;
 }
 
 Path BidirectionalRenderer::trace_light_path(StateSequence &rand) {
   Path result;
+  trace_light_path(rand, result);
+  return result;
+}
+
+void BidirectionalRenderer::trace_light_path(StateSequence &rand,
+                                             Path &result) {
+  result.clear();
   result.reserve(max_light_events);
   if (max_light_events == 0) {
-    return result;
+    return;
   }
   real pdf;
   const Triangle &tri = scene->sample_triangle_light_emission(rand(), pdf);
@@ -107,7 +125,6 @@ Path BidirectionalRenderer::trace_light_path(StateSequence &rand) {
   vertex.pdf = dot(info.normal, dir) / pi;
   result.push_back(vertex);
   trace(result, ray, 1, max_light_events, rand);
-  return result;
 }
 
 bool BidirectionalRenderer::connectable(int num_eye_vertices,
@@ -126,8 +143,9 @@ bool BidirectionalRenderer::connectable(int num_eye_vertices,
     // Otherwise, vertex connection
     if (!SurfaceEventClassifier::is_delta(light_end.event) &&
         !SurfaceEventClassifier::is_delta(eye_end.event)) {
-      if (light_end.triangle_id ==
-              eye_end.triangle_id ||  // on the same triangle?
+      if ((light_end.triangle_id == eye_end.triangle_id &&
+           light_end.instance_id ==
+               eye_end.instance_id) ||  // on the same triangle?
           (dot(dir, light_end.normal) > -eps && num_light_vertices == 1)) {
         return false;
       }
@@ -135,21 +153,22 @@ bool BidirectionalRenderer::connectable(int num_eye_vertices,
       return false;
     }
   }
+  // Shadow ray, stopping just short of light_end's own triangle
   Ray r(eye_end.pos, dir);
-  int tri_id = sg->query_hit_triangle_id(r);
-  return tri_id == light_end.triangle_id;  // occluded?
+  r.dist = length(light_end.pos - eye_end.pos) * (1.0_f - 1e-4_f);
+  return !sg->occlude(r);
 }
 
-double BidirectionalRenderer::path_pdf(const Path &path,
-                                       const int num_eye_vert_spec,
-                                       const int num_light_vert_spec) {
+void BidirectionalRenderer::compute_pdf_prefixes(const Path &path,
+                                                 PdfPrefixes &prefixes) {
   int path_length = (int)path.size() - 1;
+  auto &eye = prefixes.eye;
+  auto &light = prefixes.light;
+  eye.resize(path_length + 2);
+  light.resize(path_length + 2);
   double p = 1.0;
-  const int num_eye_vertices = num_eye_vert_spec;
-  const int num_light_vertices = num_light_vert_spec;
-  const int is_vm =
-      ((int)path.size() - 1 == num_eye_vertices + num_light_vertices - 2);
-  for (int i = -1; i <= num_eye_vertices - 2; i++) {
+  eye[0] = p;
+  for (int i = -1; i <= path_length - 1; i++) {
     if (i == -1) {
       p = p * camera->get_pixel_scaling();
     } else if (i == 0) {
@@ -171,14 +190,15 @@ double BidirectionalRenderer::path_pdf(const Path &path,
       }
       p = p * direction_to_area(path[i], path[i + 1]);
     }
+    eye[i + 2] = p;
   }
-  if (p == 0.0)
-    return p;  // Shortcut
-  for (int i = -1; i <= num_light_vertices - 2 - is_vm; i++) {
+  p = 1.0;
+  light[0] = p;
+  for (int i = -1; i <= path_length - 1; i++) {
     if (i == -1) {
       // Light sample PDF
       int id = path[path_length].triangle_id;
-      p = p * scene->get_triangle_pdf(id) / scene->get_triangle(id).area;
+      p = p * scene->get_triangle_pdf(id) / scene->get_triangle_area(id);
     } else if (i == 0) {
       Vector3 in_dir =
           normalize(path[path_length - 1].pos - path[path_length].pos);
@@ -197,7 +217,28 @@ double BidirectionalRenderer::path_pdf(const Path &path,
       p = p *
           direction_to_area(path[path_length - i], path[path_length - (i + 1)]);
     }
+    light[i + 2] = p;
   }
+}
+
+double BidirectionalRenderer::path_pdf(const Path &path,
+                                       const int num_eye_vert_spec,
+                                       const int num_light_vert_spec) {
+  static thread_local PdfPrefixes prefixes;
+  compute_pdf_prefixes(path, prefixes);
+  return path_pdf(path, prefixes, num_eye_vert_spec, num_light_vert_spec);
+}
+
+double BidirectionalRenderer::path_pdf(const Path &path,
+                                       const PdfPrefixes &prefixes,
+                                       const int num_eye_vertices,
+                                       const int num_light_vertices) {
+  const int is_vm =
+      ((int)path.size() - 1 == num_eye_vertices + num_light_vertices - 2);
+  double p = prefixes.eye[num_eye_vertices];
+  if (p == 0.0)
+    return p;  // Shortcut
+  p *= prefixes.light[num_light_vertices - is_vm];
   if (p == 0.0)
     return p;  // Shortcut
   if (is_vm) {
@@ -216,6 +257,15 @@ double BidirectionalRenderer::path_pdf(const Path &path,
 double BidirectionalRenderer::path_total_pdf(const Path &path,
                                              bool including_connection,
                                              int merging_factor) {
+  static thread_local PdfPrefixes prefixes;
+  compute_pdf_prefixes(path, prefixes);
+  return path_total_pdf(path, prefixes, including_connection, merging_factor);
+}
+
+double BidirectionalRenderer::path_total_pdf(const Path &path,
+                                             const PdfPrefixes &prefixes,
+                                             bool including_connection,
+                                             int merging_factor) {
   int path_length = (int)path.size() - 1;
   double vc_pdf(0), vm_pdf(0);
   // We have to calculate all the possibilities...
@@ -237,7 +287,8 @@ double BidirectionalRenderer::path_total_pdf(const Path &path,
           SurfaceEventClassifier::is_delta(path[num_eye_vertices].event)) {
         continue;
       }
-      vc_pdf += path_pdf(path, num_eye_vertices, num_light_vertices);
+      vc_pdf +=
+          path_pdf(path, prefixes, num_eye_vertices, num_light_vertices);
     }
   }
   // Part II: Vertex Merging
@@ -255,7 +306,8 @@ double BidirectionalRenderer::path_total_pdf(const Path &path,
       if (SurfaceEventClassifier::is_delta(path[num_eye_vertices - 1].event)) {
         continue;
       }
-      vm_pdf += path_pdf(path, num_eye_vertices, num_light_vertices);
+      vm_pdf +=
+          path_pdf(path, prefixes, num_eye_vertices, num_light_vertices);
     }
   }
   return vc_pdf + vm_pdf * merging_factor;
@@ -267,11 +319,26 @@ PathContribution BidirectionalRenderer::connect(const Path &eye_path,
                                                 const int num_light_vert_spec,
                                                 const int merging_factor) {
   PathContribution result;
+  connect(eye_path, light_path, result, num_eye_vert_spec, num_light_vert_spec,
+          merging_factor);
+  return result;
+}
+
+void BidirectionalRenderer::connect(const Path &eye_path,
+                                    const Path &light_path,
+                                    PathContribution &result,
+                                    const int num_eye_vert_spec,
+                                    const int num_light_vert_spec,
+                                    const int merging_factor) {
+  result.clear();
   bool specified = (num_eye_vert_spec != -1) && (num_light_vert_spec != -1);
+  // Every strategy overwrites all of its vertices, so one buffer per thread
+  // serves all path lengths
+  static thread_local Path full_path;
+  static thread_local PdfPrefixes prefixes;
 
   for (int path_length = min_path_length; path_length <= max_path_length;
        path_length++) {
-    Path full_path;
     full_path.resize(path_length + 1);
     for (int num_eye_vertices = 1; num_eye_vertices <= path_length + 1;
          num_eye_vertices++) {
@@ -287,7 +354,9 @@ PathContribution BidirectionalRenderer::connect(const Path &eye_path,
         continue;
       } else if (num_light_vertices == 0) {
         const Vertex &eye_end = eye_path[num_eye_vertices - 1];
-        bool valid = scene->get_triangle_emission(eye_end.triangle_id) > 0 &&
+        // Instanced meshes are never emissive
+        bool valid = eye_end.instance_id == -1 &&
+                     scene->get_triangle_emission(eye_end.triangle_id) > 0 &&
                      eye_end.front;
         if (!valid) {
           continue;
@@ -321,13 +390,15 @@ PathContribution BidirectionalRenderer::connect(const Path &eye_path,
         // printf("f\n");
         continue;
       }
-      double p = path_pdf(full_path, num_eye_vertices, num_light_vertices);
+      compute_pdf_prefixes(full_path, prefixes);
+      double p =
+          path_pdf(full_path, prefixes, num_eye_vertices, num_light_vertices);
       if (p <= 0.0_f) {
         // printf("p\n");
         continue;
       }
-      double w = mis_weight(full_path, num_eye_vertices, num_light_vertices,
-                            true, merging_factor);
+      double w = mis_weight(full_path, prefixes, num_eye_vertices,
+                            num_light_vertices, true, merging_factor);
       if (w <= 0.0_f) {
         // printf("w\n");
         continue;
@@ -403,10 +474,9 @@ PathContribution BidirectionalRenderer::connect(const Path &eye_path,
 
       if (specified && (num_eye_vert_spec == num_eye_vertices) &&
           (num_light_vert_spec == num_light_vertices))
-        return result;
+        return;
     }
   }
-  return result;
 }
 
 double BidirectionalRenderer::mis_weight(const Path &path,
@@ -414,11 +484,22 @@ double BidirectionalRenderer::mis_weight(const Path &path,
                                          const int num_light_vert_spec,
                                          bool including_connection,
                                          int merging_factor) {
+  static thread_local PdfPrefixes prefixes;
+  compute_pdf_prefixes(path, prefixes);
+  return mis_weight(path, prefixes, num_eye_vert_spec, num_light_vert_spec,
+                    including_connection, merging_factor);
+}
+
+double BidirectionalRenderer::mis_weight(const Path &path,
+                                         const PdfPrefixes &prefixes,
+                                         const int num_eye_vert_spec,
+                                         const int num_light_vert_spec,
+                                         bool including_connection,
+                                         int merging_factor) {
   const double p_i =
-      path_pdf(path, num_eye_vert_spec,
-               num_light_vert_spec);  // TODO: not necessary re-evaluation
+      path_pdf(path, prefixes, num_eye_vert_spec, num_light_vert_spec);
   const double p_all =
-      path_total_pdf(path, including_connection, merging_factor);
+      path_total_pdf(path, prefixes, including_connection, merging_factor);
   if ((p_i == 0.0) || (p_all == 0.0)) {
     return 0.0;
   } else {
@@ -502,11 +583,69 @@ void BidirectionalRenderer::write_path_contribution(const PathContribution &pc,
         continue;
       }
       int ix = (int)floor(cont.x * width), iy = (int)floor(cont.y * height);
-      output_lock.lock();
-      this->buffer[ix][iy] += width * height * total_scaling * cont.c;
-      output_lock.unlock();
+      if (ix < crop_begin.x || ix >= crop_end.x || iy < crop_begin.y ||
+          iy >= crop_end.y) {
+        continue;
+      }
+      this->buffer.add(ix, iy, width * height * total_scaling * cont.c);
+    }
+  }
+}
+
+void BidirectionalRenderer::connect_and_write(const Path &eye_path,
+                                              const Path &light_path,
+                                              PathContribution &pc,
+                                              real eye_scaling,
+                                              real light_tracing_scaling,
+                                              int merging_factor) {
+  if (eye_scaling == 1 && light_tracing_scaling == 1) {
+    connect(eye_path, light_path, pc, -1, -1, merging_factor);
+    write_path_contribution(pc);
+    return;
+  }
+  if (eye_path.empty()) {
+    return;
+  }
+  static thread_local Path camera_path;
+  camera_path.assign(eye_path.begin(), eye_path.begin() + 1);
+  connect(camera_path, light_path, pc, -1, -1, merging_factor);
+  write_path_contribution(pc, light_tracing_scaling);
+  for (int e = 2; e <= (int)eye_path.size(); e++) {
+    for (int l = 0; l <= (int)light_path.size(); l++) {
+      connect(eye_path, light_path, pc, e, l, merging_factor);
+      write_path_contribution(pc, eye_scaling);
     }
   }
 }
 
+Array2D<Vector3> BidirectionalRenderer::get_output() {
+  Array2D<Vector3> output =
+      sample_count > 0 ? buffer.get_scaled(1.0_f / sample_count)
+                       : Array2D<Vector3>(Vector2i(width, height), Vector3(0));
+  if (!frozen_output.empty()) {
+    for (auto &ind : output.get_region()) {
+      if (ind.i < crop_begin.x || ind.i >= crop_end.x ||
+          ind.j < crop_begin.y || ind.j >= crop_end.y) {
+        output[ind] = frozen_output[ind];
+      }
+    }
+  }
+  return output;
+}
+
+void BidirectionalRenderer::reset_accumulation() {
+  buffer.clear();
+  sample_count = 0;
+  frozen_output = Array2D<Vector3>();
+}
+
+void BidirectionalRenderer::tiles_changed(bool crop_changed) {
+  if (!crop_changed) {
+    return;
+  }
+  frozen_output = get_output();
+  buffer.clear();
+  sample_count = 0;
+}
+
 TC_NAMESPACE_END
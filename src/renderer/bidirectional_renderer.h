@@ -8,6 +8,7 @@
 #include <taichi/visual/renderer.h>
 #include <taichi/visual/sampler.h>
 #include <taichi/visual/bsdf.h>
+#include <taichi/visualization/image_buffer.h>
 
 TC_NAMESPACE_BEGIN
 
@@ -19,6 +20,7 @@ struct Vertex {
     pos = inter.pos;
     normal = inter.normal;
     triangle_id = inter.triangle_id;
+    instance_id = inter.instance_id;
     front = inter.front;
   }
 
@@ -32,6 +34,7 @@ struct Vertex {
   real pdf;
   Vector3 pos, normal;
   int triangle_id;
+  int instance_id = -1;
   bool front;
   bool connected = false;  // if it is connected to the next vertex
 };
@@ -65,6 +68,13 @@ struct PathContribution {
     return contributions.empty();
   }
 
+  // Keeps the capacity, so that reused objects stop allocating
+  void clear() {
+    contributions.clear();
+    scaling = 1.0_f;
+    total_contribution = 0.0;
+  }
+
   double get_total_contribution() {
     return total_contribution;
   }
@@ -84,23 +94,34 @@ class BidirectionalRenderer : public Renderer {
   int max_light_events;
   int stage_frequency;
 
-  Array2D<Vector3> buffer;
+  SplatBuffer buffer;
   std::shared_ptr<Sampler> sampler;
   real luminance_clamping;
   long long sample_count = 0;
   std::string print_path_policy;
   real vm_pdf_constant;
-  Spinlock output_lock;
 
  public:
   virtual void initialize(const Config &config) override;
 
   void trace(Path &path, Ray r, int depth, int max_depth, StateSequence &rand);
 
-  Path trace_eye_path(StateSequence &rand);
+  // The camera ray goes through [offset, offset + size) of the image
+  Path trace_eye_path(StateSequence &rand,
+                      Vector2 offset = Vector2(0.0_f),
+                      Vector2 size = Vector2(1.0_f));
+
+  // Same, overwriting |result|. Reusing one Path per thread avoids an
+  // allocation per sample.
+  void trace_eye_path(StateSequence &rand,
+                      Path &result,
+                      Vector2 offset = Vector2(0.0_f),
+                      Vector2 size = Vector2(1.0_f));
 
   Path trace_light_path(StateSequence &rand);
 
+  void trace_light_path(StateSequence &rand, Path &result);
+
   bool connectable(int num_eye_vertices,
                    int num_light_vertices,
                    const Vertex &eye_end,
@@ -108,11 +129,32 @@ class BidirectionalRenderer : public Renderer {
 
   Vector3d path_throughput(const Path &path);
 
+  // The pdfs of all strategies for one full path share their factors: a
+  // strategy with e eye and l light vertices multiplies the first e factors
+  // from the camera end and the first l (l - 1 for merging) from the light
+  // end. |eye[k]| and |light[k]| are these products, so that once they are
+  // computed (O(path length)), each strategy's pdf costs O(1).
+  struct PdfPrefixes {
+    std::vector<double> eye, light;
+  };
+
+  void compute_pdf_prefixes(const Path &path, PdfPrefixes &prefixes);
+
   double path_pdf(const Path &path,
                   const int num_eye_vert_spec,
                   const int num_light_vert_spec);
 
+  double path_pdf(const Path &path,
+                  const PdfPrefixes &prefixes,
+                  const int num_eye_vertices,
+                  const int num_light_vertices);
+
+  double path_total_pdf(const Path &path,
+                        bool including_connection,
+                        int merging_factor);
+
   double path_total_pdf(const Path &path,
+                        const PdfPrefixes &prefixes,
                         bool including_connection,
                         int merging_factor);
 
@@ -122,26 +164,65 @@ class BidirectionalRenderer : public Renderer {
                            const int num_light_vert_spec = -1,
                            const int merging_factor = 0);
 
+  // Same, overwriting |result|
+  void connect(const Path &eye_path,
+               const Path &light_path,
+               PathContribution &result,
+               const int num_eye_vert_spec = -1,
+               const int num_light_vert_spec = -1,
+               const int merging_factor = 0);
+
   double mis_weight(const Path &path,
                     const int num_eye_vert_spec,
                     const int num_light_vert_spec,
                     bool including_connection,
                     int merging_factor);
 
+  double mis_weight(const Path &path,
+                    const PdfPrefixes &prefixes,
+                    const int num_eye_vert_spec,
+                    const int num_light_vert_spec,
+                    bool including_connection,
+                    int merging_factor);
+
   double geometry_term(const Vertex &e0, const Vertex &e1);
 
   double direction_to_area(const Vertex &current, const Vertex &next);
 
+  // Splats outside the crop window are dropped
   void write_path_contribution(const PathContribution &pc,
                                const real scaling = 1.0_f);
 
-  Array2D<Vector3> get_output() override {
-    Array2D<Vector3> output(Vector2i(width, height));
-    real r = 1.0_f / sample_count;
-    for (auto &ind : output.get_region()) {
-      output[ind] = buffer[ind] * r;
-    }
-    return output;
+  // Writes the contributions of connect(eye_path, light_path), scaled by
+  // |light_tracing_scaling| for light tracing (one eye vertex) and by
+  // |eye_scaling| for the other strategies. With a crop window, eye paths
+  // are only traced in the window, so light tracing gets fewer light paths
+  // than the sample count accounts for.
+  void connect_and_write(const Path &eye_path,
+                         const Path &light_path,
+                         PathContribution &pc,
+                         real eye_scaling,
+                         real light_tracing_scaling,
+                         int merging_factor = 0);
+
+  // Outside the crop window, the output of before the last crop change
+  Array2D<Vector3> get_output() override;
+
+  // The frozen output is dropped too, as it is of the previous scene
+  void reset_accumulation() override;
+
+ protected:
+  Array2D<Vector3> frozen_output;
+
+  // The samples so far are kept as frozen_output, and rendering starts
+  // over in the new window
+  void tiles_changed(bool crop_changed) override;
+
+  TC_RENDERER_CHECKPOINT
+
+  template <typename S>
+  void checkpoint_io(S &serializer) {
+    TC_IO(buffer, sample_count, frozen_output);
   }
 };
 
@@ -5,92 +5,204 @@
 
 #pragma once
 
+#include <algorithm>
+#include <atomic>
 #include <functional>
+#include <memory>
 #include <taichi/math/math.h>
+#include <taichi/system/statistics.h>
+#include <taichi/system/threading.h>
 
 TC_NAMESPACE_BEGIN
 
+// Spatial hash of values with a position and a range, for photon and vertex
+// merging. push_back_to_all_cells_in_range may be called from several
+// threads at once; each thread appends to its own list. build_grid then
+// counting-sorts all lists into one array in parallel. Values within a cell
+// are sorted, so queries do not depend on thread scheduling. The values
+// inserted and the entries built are counted in Statistics.
 class HashGrid {
  private:
+  using Entry = std::pair<int, int>;  // (cell, value)
+
+  struct ThreadCache {
+    std::vector<Entry> entries;
+    std::vector<int> cells;  // Scratch for deduplication
+  };
+
   real hash_cell_size;
-  std::vector<std::pair<int, int>> cache;
-  std::vector<int *> heads;
-  std::vector<int> cell_count;
+#if !defined(TC_AMALGAMATED)
+  tbb::enumerable_thread_specific<ThreadCache> caches;
+#else
+  ThreadCache cache;
+#endif
+  // Values of cell i are built_data[offsets[i], offsets[i + 1])
+  std::vector<int> offsets;
+  std::unique_ptr<std::atomic<int>[]> cursors;
   std::vector<int> built_data;
-  int num_grids;
+  int num_grids = 0;
+
+  template <typename T>
+  static void parallel_for(int begin, int end, const T &body) {
+#if !defined(TC_AMALGAMATED)
+    tbb::parallel_for(tbb::blocked_range<int>(begin, end),
+                      [&](const tbb::blocked_range<int> &r) {
+                        for (int i = r.begin(); i < r.end(); i++) {
+                          body(i);
+                        }
+                      });
+#else
+    for (int i = begin; i < end; i++) {
+      body(i);
+    }
+#endif
+  }
+
+  ThreadCache &local_cache() {
+#if !defined(TC_AMALGAMATED)
+    return caches.local();
+#else
+    return cache;
+#endif
+  }
+
+  std::vector<ThreadCache *> get_caches() {
+    std::vector<ThreadCache *> ret;
+#if !defined(TC_AMALGAMATED)
+    for (auto &c : caches) {
+      ret.push_back(&c);
+    }
+#else
+    ret.push_back(&cache);
+#endif
+    return ret;
+  }
+
+  // Spreads the lower 21 bits of |v| to every third bit
+  static uint64 spread_bits(uint64 v) {
+    v &= 0x1FFFFF;
+    v = (v | (v << 32)) & 0x001F00000000FFFFull;
+    v = (v | (v << 16)) & 0x001F0000FF0000FFull;
+    v = (v | (v << 8)) & 0x100F00F00F00F00Full;
+    v = (v | (v << 4)) & 0x10C30C30C30C30C3ull;
+    v = (v | (v << 2)) & 0x1249249249249249ull;
+    return v;
+  }
+
+  int get_cell(real x) const {
+    return (int)std::floor(x / hash_cell_size);
+  }
 
  public:
-  // spatial hash function from smallppm,
-  // http://www.ci.i.u-tokyo.ac.jp/~hachisuka/smallppm_exp.cpp
+  // Morton code of the cell modulo the table size, so that neighbouring
+  // cells (visited together by range queries) land in nearby buckets
   unsigned int spatial_hash(const int ix, const int iy, const int iz) const {
-    return (unsigned int)((ix * 73856093) ^ (iy * 19349663) ^ (iz * 83492791)) %
-           num_grids;
+    // Make coordinates non-negative
+    const int bias = 1 << 20;
+    uint64 code = spread_bits(uint64(ix + bias)) |
+                  (spread_bits(uint64(iy + bias)) << 1) |
+                  (spread_bits(uint64(iz + bias)) << 2);
+    return (unsigned int)(code % (uint64)num_grids);
   }
 
   void initialize(const real hash_cell_size, int num_grids) {
     this->hash_cell_size = hash_cell_size;
+    if (!cursors || this->num_grids != num_grids) {
+      cursors.reset(new std::atomic<int>[num_grids]);
+    }
     this->num_grids = num_grids;
-    cell_count.resize(num_grids + 1);
-    heads.resize(num_grids + 1);
+    offsets.resize(num_grids + 1);
     clear_cache();
   }
 
   void clear_cache() {
-    cache.clear();
+    for (auto c : get_caches()) {
+      c->entries.clear();
+    }
   }
 
   void build_grid() {
-    memset(&cell_count[0], 0, sizeof(cell_count[0]) * cell_count.size());
-    built_data.resize(cache.size());
-    for (auto p : cache) {
-      cell_count[p.first]++;
-    }
-    for (int i = 0; i + 2 < (int)cell_count.size(); i++) {
-      cell_count[i + 1] += cell_count[i];
+    std::vector<ThreadCache *> lists = get_caches();
+    parallel_for(0, num_grids, [&](int i) {
+      cursors[i].store(0, std::memory_order_relaxed);
+    });
+    // Count
+    for (auto list : lists) {
+      auto &entries = list->entries;
+      parallel_for(0, (int)entries.size(), [&](int i) {
+        cursors[entries[i].first].fetch_add(1, std::memory_order_relaxed);
+      });
     }
-    heads[0] = &built_data[0];
-    for (int i = (int)cell_count.size() - 1; i > 0; i--) {
-      cell_count[i] = cell_count[i - 1];
-      heads[i] = heads[0] + cell_count[i];
-    }
-    cell_count[0] = 0;
-    for (auto p : cache) {
-      built_data[cell_count[p.first]++] = p.second;
+    // Exclusive prefix sum
+    int total = ThreadedTaskManager::scan(
+        0, num_grids, -1, 0,
+        [&](int i) { return cursors[i].load(std::memory_order_relaxed); },
+        [](int a, int b) { return a + b; },
+        [&](int i, int sum) { offsets[i] = sum; });
+    offsets[num_grids] = total;
+    TC_STAT("hash_grid_entries", total);
+    built_data.resize(total);
+    // Scatter
+    parallel_for(0, num_grids, [&](int i) {
+      cursors[i].store(offsets[i], std::memory_order_relaxed);
+    });
+    for (auto list : lists) {
+      auto &entries = list->entries;
+      parallel_for(0, (int)entries.size(), [&](int i) {
+        int pos =
+            cursors[entries[i].first].fetch_add(1, std::memory_order_relaxed);
+        built_data[pos] = entries[i].second;
+      });
     }
+    parallel_for(0, num_grids, [&](int i) {
+      if (offsets[i + 1] - offsets[i] > 1) {
+        std::sort(built_data.begin() + offsets[i],
+                  built_data.begin() + offsets[i + 1]);
+      }
+    });
   }
 
   int *begin(Vector3 p) const {
-    Vector3 ip = p / Vector3(hash_cell_size);
-    return begin(spatial_hash((int)ip.x, (int)ip.y, (int)ip.z));
+    return begin(spatial_hash(get_cell(p.x), get_cell(p.y), get_cell(p.z)));
   }
 
   int *end(Vector3 p) const {
-    Vector3 ip = p / Vector3(hash_cell_size);
-    return end(spatial_hash((int)ip.x, (int)ip.y, (int)ip.z));
+    return end(spatial_hash(get_cell(p.x), get_cell(p.y), get_cell(p.z)));
   }
 
   int *begin(int cell) const {
-    return heads[cell];
+    return const_cast<int *>(built_data.data()) + offsets[cell];
   }
 
   int *end(int cell) const {
-    return heads[cell + 1];
+    return const_cast<int *>(built_data.data()) + offsets[cell + 1];
   }
 
+  // Inserts |val| once into every bucket overlapping the box of half size
+  // |range| around |pos|. Thread-safe.
   void push_back_to_all_cells_in_range(const Vector3 &pos,
                                        real range,
                                        int val) {
     int bounds[3][2];
     for (int k = 0; k < 3; k++) {
-      bounds[k][0] = (int)floor((pos[k] - range) / hash_cell_size);
-      bounds[k][1] = (int)ceil((pos[k] + range) / hash_cell_size);
+      bounds[k][0] = get_cell(pos[k] - range);
+      bounds[k][1] = get_cell(pos[k] + range);
     }
+    TC_STAT("hash_grid_values", 1);
+    ThreadCache &cache = local_cache();
+    auto &cells = cache.cells;
+    cells.clear();
     for (int x = bounds[0][0]; x <= bounds[0][1]; x++)
       for (int y = bounds[1][0]; y <= bounds[1][1]; y++)
         for (int z = bounds[2][0]; z <= bounds[2][1]; z++) {
-          int cell_id = spatial_hash(x, y, z);
-          cache.push_back(std::make_pair(cell_id, val));
+          cells.push_back(spatial_hash(x, y, z));
         }
+    // Different cells may share a bucket
+    std::sort(cells.begin(), cells.end());
+    cells.erase(std::unique(cells.begin(), cells.end()), cells.end());
+    for (int cell : cells) {
+      cache.entries.push_back(std::make_pair(cell, val));
+    }
   }
 };
 
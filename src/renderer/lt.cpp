@@ -22,42 +22,52 @@ struct PathContribution {
 class LTRenderer : public Renderer {
  protected:
   std::shared_ptr<Sampler> sampler;
-  Array2D<Vector3> buffer;
+  SplatBuffer buffer;
   long long photon_counter;
   bool volumetric;
 
+  TC_RENDERER_CHECKPOINT
+
+  template <typename S>
+  void checkpoint_io(S &serializer) {
+    TC_IO(buffer, photon_counter);
+  }
+
  public:
   virtual void initialize(const Config &config) {
     Renderer::initialize(config);
     this->sampler = create_instance<Sampler>(config.get("sampler", "prand"));
     this->volumetric = config.get("volumetric", true);
-    this->buffer.initialize(Vector2i(width, height), Vector3(0.0_f));
+    this->buffer = SplatBuffer(Vector2i(width, height));
     this->photon_counter = 0;
   }
 
   virtual void render_stage() {
     int num_photons_per_stage = width * height;
-    for (int i = 0; i < num_photons_per_stage; i++) {
-      auto state_sequence = RandomStateSequence(sampler, photon_counter);
-      trace_photon(state_sequence);
-      photon_counter += 1;
-    }
+    ThreadedTaskManager::run(
+        [&](int i) {
+          auto state_sequence =
+              RandomStateSequence(sampler, photon_counter + i);
+          trace_photon(state_sequence);
+        },
+        0, num_photons_per_stage, num_threads);
+    photon_counter += num_photons_per_stage;
   }
 
   Array2D<Vector3> get_output() {
-    Array2D<Vector3> output(Vector2i(width, height));
-    real r = 1.0_f / photon_counter;
-    for (auto &ind : output.get_region()) {
-      output[ind] = buffer[ind] * r;
-    }
-    return output;
+    return buffer.get_scaled(1.0_f / photon_counter);
+  }
+
+  void reset_accumulation() override {
+    buffer.clear();
+    photon_counter = 0;
   }
 
   virtual void write_path_contribution(const PathContribution &cont,
                                        real scale = 1.0_f) {
     if (0 <= cont.x && cont.x <= 1 - eps && 0 <= cont.y && cont.y <= 1 - eps) {
       int ix = (int)floor(cont.x * width), iy = (int)floor(cont.y * height);
-      this->buffer[ix][iy] += width * height * scale * cont.c;
+      this->buffer.add(ix, iy, width * height * scale * cont.c);
     }
   }
 
@@ -8,31 +8,166 @@
 #include <taichi/math/math.h>
 #include <taichi/visual/sampler.h>
 
+#include <algorithm>
 #include <vector>
 #include <memory>
 #include <string>
 
 TC_NAMESPACE_BEGIN
 
+// Primary sample space state. Mutations are lazy (Kelemen et al., "A Simple
+// and Robust Mutation Strategy for the Metropolis Light Transport
+// Algorithm"): mutate() and large_step() only advance the chain's clock, and
+// a coordinate catches up on the steps it missed when it is next read. The
+// first |inline_capacity| coordinates are stored in the object itself, and
+// copies only touch the coordinates in use, so the copy-per-proposal pattern
+// of the MCMC renderers does not allocate.
 class MarkovChain {
- protected:
-  std::vector<real> states;
-
  public:
-  virtual real get_state(int d) {
-    while ((int)states.size() <= d) {
-      states.push_back(rand());
+  static constexpr int inline_capacity = 64;
+
+  MarkovChain() {
+  }
+
+  MarkovChain(const MarkovChain &o) {
+    *this = o;
+  }
+
+  MarkovChain &operator=(const MarkovChain &o) {
+    int n = o.num_coordinates < inline_capacity ? o.num_coordinates
+                                                : inline_capacity;
+    std::copy(o.inline_coordinates, o.inline_coordinates + n,
+              inline_coordinates);
+    extra_coordinates = o.extra_coordinates;
+    num_coordinates = o.num_coordinates;
+    time = o.time;
+    large_step_time = o.large_step_time;
+    strength = o.strength;
+    rng = o.rng;
+    return *this;
+  }
+
+  virtual ~MarkovChain() {
+  }
+
+  // All copies of a chain share |rng|, so that proposals made again from a
+  // rejected state differ. Each chain (and thread) needs its own.
+  void set_rng(PCG32 *rng) {
+    this->rng = rng;
+  }
+
+  // Starts the chain at a known point, e.g. a bootstrap sample
+  void set_states(const std::vector<real> &states) {
+    num_coordinates = 0;
+    extra_coordinates.clear();
+    for (auto s : states) {
+      append(s);
     }
-    return states[d];
+  }
+
+  real get_state(int d) {
+    while (num_coordinates <= d) {
+      append(next_random());
+    }
+    Coordinate &c = coordinate(d);
+    if (c.time < large_step_time) {
+      c.value = next_random();
+      c.time = large_step_time;
+    }
+    for (; c.time < time; c.time++) {
+      c.value = perturb(d, c.value);
+    }
+    return c.value;
   }
 
   virtual void print_states() {
     printf("chain = ");
-    for (int i = 0; i < (int)states.size(); i++) {
-      printf("%f ", states[i]);
+    for (int i = 0; i < num_coordinates; i++) {
+      printf("%f ", get_state(i));
     }
     printf("\n");
   }
+
+ protected:
+  struct Coordinate {
+    real value;
+    // Iteration |value| is up to date with
+    int64 time;
+  };
+
+  Coordinate inline_coordinates[inline_capacity];
+  std::vector<Coordinate> extra_coordinates;
+  int num_coordinates = 0;
+  int64 time = 0;
+  int64 large_step_time = 0;
+  // Of the small steps; lazy updates use the latest value
+  real strength = 1.0_f;
+  PCG32 *rng = nullptr;
+
+  real next_random() const {
+    TC_ASSERT_INFO(rng != nullptr, "Markov chain has no RNG");
+    return rng->next();
+  }
+
+  // Advances the clock by one mutation
+  void step(bool large, real strength) {
+    time++;
+    if (large) {
+      large_step_time = time;
+    }
+    this->strength = strength;
+  }
+
+  // One small step of coordinate |d|
+  virtual real perturb(int d, real value) const = 0;
+
+  // Offset with log-uniform magnitude in [s1, s2] and random sign
+  real perturb_exponential(const real value,
+                           const real s1,
+                           const real s2) const {
+    real result;
+    real r = next_random();
+    if (r < 0.5f) {
+      r = r * 2.0f;
+      result = value + s2 * exp(-log(s2 / s1) * r);
+    } else {
+      r = (r - 0.5f) * 2.0f;
+      result = value - s2 * exp(-log(s2 / s1) * r);
+    }
+    result -= floor(result);
+    return result;
+  }
+
+  // TODO: what's the difference between this and the one purposed in the paper?
+  real perturb_power(const real value, const real strength) const {
+    real result;
+    real r = next_random();
+    if (r < 0.5f) {
+      r = r * 2.0f;
+      result = value + pow(r, 1.0_f / strength + 1.0_f);
+    } else {
+      r = (r - 0.5f) * 2.0f;
+      result = value - pow(r, 1.0_f / strength + 1.0_f);
+    }
+    result -= floor(result);
+    return result;
+  }
+
+ private:
+  Coordinate &coordinate(int d) {
+    return d < inline_capacity ? inline_coordinates[d]
+                               : extra_coordinates[d - inline_capacity];
+  }
+
+  void append(real value) {
+    Coordinate c{value, time};
+    if (num_coordinates < inline_capacity) {
+      inline_coordinates[num_coordinates] = c;
+    } else {
+      extra_coordinates.push_back(c);
+    }
+    num_coordinates++;
+  }
 };
 
 class MCStateSequence : public StateSequence {
@@ -65,67 +200,80 @@ class PSSMarkovChain : public MarkovChain {
   }
 
   PSSMarkovChain<starts_from_screen> large_step() const {
-    if (starts_from_screen) {
-      return PSSMarkovChain<starts_from_screen>(resolutions[0], resolutions[1]);
-    } else {
-      return PSSMarkovChain<starts_from_screen>();
-    }
+    PSSMarkovChain<starts_from_screen> result(*this);
+    result.step(true, strength);
+    return result;
   }
 
   PSSMarkovChain<starts_from_screen> mutate(real strength) const {
     PSSMarkovChain<starts_from_screen> result(*this);
-    if (starts_from_screen) {
-    }
-    for (int i = 2 * (int)starts_from_screen; i < (int)states.size(); i++) {
-      result.states[i] = perturb(states[i], strength);
-    }
+    result.step(false, strength);
     return result;
   }
 
  protected:
-  inline static real perturb(const real value, const real strength) {
-    real result;
-    real r = rand();
-    if (r < 0.5f) {
-      r = r * 2.0f;
-      result = value + pow(r, 1.0_f / strength + 1.0_f);
-    } else {
-      r = (r - 0.5f) * 2.0f;
-      result = value - pow(r, 1.0_f / strength + 1.0_f);
+  real perturb(int d, real value) const override {
+    if (d < 2 * (int)starts_from_screen) {
+      return value;
     }
-    result -= floor(result);
+    return perturb_power(value, strength);
+  }
+};
+
+// Screen coordinates first, then path events
+class PSSMLTMarkovChain : public MarkovChain {
+ public:
+  real resolution_x, resolution_y;
+
+  PSSMLTMarkovChain() : PSSMLTMarkovChain(0, 0) {
+  }
+
+  PSSMLTMarkovChain(real resolution_x, real resolution_y)
+      : resolution_x(resolution_x), resolution_y(resolution_y) {
+  }
+
+  PSSMLTMarkovChain large_step() const {
+    PSSMLTMarkovChain result(*this);
+    result.step(true, strength);
+    return result;
+  }
+
+  PSSMLTMarkovChain mutate(real strength = 1.0_f) const {
+    PSSMLTMarkovChain result(*this);
+    result.step(false, strength);
     return result;
   }
+
+ protected:
+  real perturb(int d, real value) const override {
+    if (d < 2) {
+      // Pixel location
+      real delta_pixel = 2.0f / (resolution_x + resolution_y);
+      return perturb_exponential(value, delta_pixel * strength,
+                                 0.1f * strength);
+    }
+    return perturb_exponential(value, 1.0_f / 1024.0f * strength,
+                               1.0_f / 64.0f * strength);
+  }
 };
 
 class AMCMCPPMMarkovChain : public MarkovChain {
  public:
   AMCMCPPMMarkovChain large_step() const {
-    return AMCMCPPMMarkovChain();
+    AMCMCPPMMarkovChain result(*this);
+    result.step(true, strength);
+    return result;
   }
 
   AMCMCPPMMarkovChain mutate(real strength) const {
     AMCMCPPMMarkovChain result(*this);
-    for (int i = 0; i < (int)states.size(); i++) {
-      result.states[i] = perturb(states[i], strength);
-    }
+    result.step(false, strength);
     return result;
   }
 
  protected:
-  // TODO: what's the difference between this and the one purposed in the paper?
-  inline static real perturb(const real value, const real strength) {
-    real result;
-    real r = rand();
-    if (r < 0.5f) {
-      r = r * 2.0f;
-      result = value + pow(r, 1.0_f / strength + 1.0_f);
-    } else {
-      r = (r - 0.5f) * 2.0f;
-      result = value - pow(r, 1.0_f / strength + 1.0_f);
-    }
-    result -= floor(result);
-    return result;
+  real perturb(int d, real value) const override {
+    return perturb_power(value, strength);
   }
 };
 
@@ -4,6 +4,8 @@
 *******************************************************************************/
 
 #include <taichi/math/averager.h>
+#include <taichi/system/profiler.h>
+#include <limits>
 
 #include "bidirectional_renderer.h"
 #include "hash_grid.h"
@@ -44,11 +46,14 @@ class UPSRenderer : public BidirectionalRenderer {
   PathContribution vertex_merge(const Path &full_light_path) {
     PathContribution pc;
     real radius2 = radius * radius;
+    // Buffers of the thread, which keep their capacity for the next merges
+    static thread_local Path light_path, eye_path, full_path;
+    static thread_local PdfPrefixes prefixes;
     for (int num_light_vertices = 2;
          num_light_vertices <= (int)full_light_path.size();
          num_light_vertices++) {
-      Path light_path(full_light_path.begin(),
-                      full_light_path.begin() + num_light_vertices);
+      light_path.assign(full_light_path.begin(),
+                        full_light_path.begin() + num_light_vertices);
       Vector3 merging_pos = light_path.back().pos;
       int *begin = hash_grid.begin(merging_pos),
           *end = hash_grid.end(merging_pos);
@@ -56,7 +61,7 @@ class UPSRenderer : public BidirectionalRenderer {
       for (int *eye_path_id_pointer = begin; eye_path_id_pointer < end;
            eye_path_id_pointer++) {
         int eye_path_id = *eye_path_id_pointer;
-        Path eye_path = eye_paths[eye_path_id];
+        eye_path = eye_paths[eye_path_id];
         int path_length = (int)light_path.size() + (int)eye_path.size() - 2;
         int num_eye_vertices = (int)eye_path.size();
         Vertex merging_vertex_light = light_path.back();
@@ -84,7 +89,6 @@ class UPSRenderer : public BidirectionalRenderer {
           screen_u = clamp(screen_u, 0.0_f, 1.0_f);
           screen_v = clamp(screen_v, 0.0_f, 1.0_f);
           eye_path.back().connected = true;
-          Path full_path;
           full_path.resize(num_eye_vertices + num_light_vertices -
                            1);  // note that last light vertex is deleted
           for (int i = 0; i < num_eye_vertices; i++)
@@ -98,13 +102,16 @@ class UPSRenderer : public BidirectionalRenderer {
             // printf("f\n");
             continue;
           }
-          double p = path_pdf(full_path, num_eye_vertices, num_light_vertices);
+          compute_pdf_prefixes(full_path, prefixes);
+          double p = path_pdf(full_path, prefixes, num_eye_vertices,
+                              num_light_vertices);
           if (p <= 0.0_f) {
             // printf("p\n");
             continue;
           }
-          double w = mis_weight(full_path, num_eye_vertices, num_light_vertices,
-                                use_vc, n_samples_per_stage);
+          double w = mis_weight(full_path, prefixes, num_eye_vertices,
+                                num_light_vertices, use_vc,
+                                n_samples_per_stage);
           if (w <= 0.0_f) {
             // printf("w\n");
             continue;
@@ -119,56 +126,101 @@ class UPSRenderer : public BidirectionalRenderer {
     return pc;
   }
 
+  // Traces the eye paths of the stage in parallel. For vertex merging, their
+  // prefixes of 2 to |max_merging_vertices| vertices go into the hash grid;
+  // eye_paths[first[k]...] are the prefixes of eye path k, so that the ids
+  // do not depend on the order of the threads.
+  void generate_eye_paths(int max_merging_vertices) {
+    hash_grid.initialize(radius, width * height * 10 + 7);
+    eye_paths_for_connection.resize(n_samples_per_stage);
+    TC_PROFILE("eye_paths",
+               ThreadedTaskManager::run(
+                   [&](int k) {
+                     auto state_sequence =
+                         RandomStateSequence(sampler, sample_count * 2 + k);
+                     eye_paths_for_connection[k] =
+                         trace_eye_path(state_sequence);
+                   },
+                   0, n_samples_per_stage, num_threads));
+    eye_paths.clear();
+    if (use_vm) {
+      std::vector<int> first(n_samples_per_stage + 1, 0);
+      for (int k = 0; k < n_samples_per_stage; k++) {
+        int num_vertices = std::min(
+            (int)eye_paths_for_connection[k].size(), max_merging_vertices);
+        first[k + 1] = first[k] + std::max(0, num_vertices - 1);
+      }
+      eye_paths.resize(first[n_samples_per_stage]);
+      ThreadedTaskManager::run(
+          [&](int k) {
+            const Path &eye_path = eye_paths_for_connection[k];
+            for (int id = first[k]; id < first[k + 1]; id++) {
+              int num_eye_vertices = id - first[k] + 2;
+              eye_paths[id].assign(eye_path.begin(),
+                                   eye_path.begin() + num_eye_vertices);
+              hash_grid.push_back_to_all_cells_in_range(
+                  eye_paths[id].back().pos, radius, id);
+            }
+          },
+          0, n_samples_per_stage, num_threads);
+    }
+    TC_PROFILE("build_grid", hash_grid.build_grid());
+  }
+
   virtual void render_stage() override {
     radius = initial_radius *
              (shrinking_radius
                   ? (real)pow(num_stages + 1.0_f, -(1.0_f - alpha) / 2.0f)
                   : 1);
     vm_pdf_constant = pi * radius * radius;
-    hash_grid.initialize(radius, width * height * 10 + 7);
-    eye_paths.clear();
-    eye_paths_for_connection.clear();
     // 1. Generate eye paths (importons)
-    for (int k = 0; k < n_samples_per_stage; k++) {
-      auto state_sequence = RandomStateSequence(sampler, sample_count * 2 + k);
-      Path eye_path = trace_eye_path(state_sequence);
-      eye_paths_for_connection.push_back(eye_path);
-      if (use_vm) {
-        // TODO: correct??? more efficient???
-        for (int num_eye_vertices = 2; num_eye_vertices <= (int)eye_path.size();
-             num_eye_vertices++) {
-          Path partial_eye_path(eye_path.begin(),
-                                eye_path.begin() + num_eye_vertices);
-          hash_grid.push_back_to_all_cells_in_range(
-              partial_eye_path.back().pos, radius, (int)eye_paths.size());
-          eye_paths.push_back(partial_eye_path);
-        }
-      }
-    }
-    hash_grid.build_grid();
+    generate_eye_paths(std::numeric_limits<int>::max());
 
-    // 2. Generate light paths (photons)
-    for (int k = 0; k < n_samples_per_stage; k++) {
-      auto state_sequence = RandomStateSequence(
-          sampler, sample_count * 2 + n_samples_per_stage + k);
-      Path light_path = trace_light_path(state_sequence);
-      if (use_vm) {
-        write_path_contribution(vertex_merge(light_path));
-      }
-      if (use_vc) {
-        write_path_contribution(connect(eye_paths_for_connection[k], light_path,
-                                        -1, -1,
-                                        (int)use_vm * n_samples_per_stage));
-      }
-    }
+    // 2. Generate light paths (photons). The splats are lock-free.
+    TC_PROFILE(
+        "light_paths",
+        ThreadedTaskManager::run(
+            [&](int k) {
+              auto state_sequence = RandomStateSequence(
+                  sampler, sample_count * 2 + n_samples_per_stage + k);
+              Path light_path = trace_light_path(state_sequence);
+              if (use_vm) {
+                write_path_contribution(vertex_merge(light_path));
+              }
+              if (use_vc) {
+                write_path_contribution(
+                    connect(eye_paths_for_connection[k], light_path, -1, -1,
+                            (int)use_vm * n_samples_per_stage));
+              }
+            },
+            0, n_samples_per_stage, num_threads));
 
     sample_count += n_samples_per_stage;
   }
+
+ protected:
+  // The merging radius starts over
+  void reset_accumulation() override {
+    BidirectionalRenderer::reset_accumulation();
+    num_stages = 0;
+    radius = initial_radius;
+  }
+
+  TC_RENDERER_CHECKPOINT
+
+  template <typename S>
+  void checkpoint_io(S &serializer) {
+    BidirectionalRenderer::checkpoint_io(serializer);
+    TC_IO(num_stages);
+  }
 };
 
 TC_IMPLEMENTATION(Renderer, UPSRenderer, "ups");
 
 class MCMCUPSRenderer : public UPSRenderer {
+ protected:
+  TC_RENDERER_NO_CHECKPOINT
+
  public:
   struct MCMCState {
     AMCMCPPMMarkovChain chain;
@@ -185,12 +237,24 @@ class MCMCUPSRenderer : public UPSRenderer {
   };
 
   enum MarkovChainTag { con = 0, vis = 1 };
-  MCMCState states[2];
-  long long accepted;
-  long long mutated;
-  real mutation_strength;
-  RunningAverage normalizers[2];
-  std::vector<PathContribution> all_pcs[2];
+
+  // A contribution and a visibility chain, with replica exchange between
+  // the two. The pairs run in parallel over their shares of the light paths,
+  // each with its own RNG and adaptive mutation strength.
+  struct ChainPair {
+    MCMCState states[2];
+    PCG32 rng;
+    long long accepted = 1;
+    long long mutated = 1;
+    real mutation_strength = 0.001f;
+    // Of the large steps of this pair in the stage, for the MIS weights
+    RunningAverage normalizers[2];
+    std::vector<PathContribution> all_pcs[2];
+    RunningAverage photon_visibility;
+  };
+
+  std::vector<ChainPair> chain_pairs;
+  int chains_per_thread;
   bool use_vis_chain;
   bool use_con_chain;
   bool chain_exchange;
@@ -225,50 +289,33 @@ class MCMCUPSRenderer : public UPSRenderer {
     target_mutation_acceptance =
         config.get("target_mutation_acceptance", 0.234f);
     TC_P(target_mutation_acceptance);
-    mutation_strength = 0.001f;
-    accepted = 1;
-    mutated = 1;
+    chains_per_thread = config.get("chains_per_thread", 1);
+    chain_pairs.clear();
   }
 
-  virtual void render_stage() override {
-    radius = initial_radius *
-             (shrinking_radius
-                  ? (real)pow(num_stages + 1.0_f, -(1.0_f - alpha) / 2.0f)
-                  : 1);
-    vm_pdf_constant = pi * radius * radius;
-    hash_grid.initialize(radius, width * height * 10 + 7);
-    eye_paths.clear();
-    eye_paths_for_connection.clear();
+  // The chains restart from uniform states
+  void reset_accumulation() override {
+    UPSRenderer::reset_accumulation();
+    chain_pairs.clear();
+  }
 
-    // 1. Generate eye paths (importons)
-    for (int k = 0; k < n_samples_per_stage; k++) {
-      auto state_sequence = RandomStateSequence(sampler, sample_count * 2 + k);
-      Path eye_path = trace_eye_path(state_sequence);
-      eye_paths_for_connection.push_back(eye_path);
-      if (use_vm) {
-        // TODO: correct??? more efficient???
-        for (int num_eye_vertices = 2; num_eye_vertices <= (int)eye_path.size();
-             num_eye_vertices++) {
-          if (num_eye_vertices > 2)
-            continue;  // NOTE:debug
-          Path partial_eye_path(eye_path.begin(),
-                                eye_path.begin() + num_eye_vertices);
-          hash_grid.push_back_to_all_cells_in_range(
-              partial_eye_path.back().pos, radius, (int)eye_paths.size());
-          eye_paths.push_back(partial_eye_path);
-        }
-      }
-    }
-    hash_grid.build_grid();
+  int get_num_chain_pairs() const {
+    int threads = num_threads > 0 ? num_threads
+                                  : (int)std::thread::hardware_concurrency();
+    return clamp(std::max(1, threads) * chains_per_thread, 1,
+                 std::max(1, n_samples_per_stage));
+  }
 
+  // Restarts the chains of |pair| and runs them over light paths [begin, end)
+  void advance_chain_pair(ChainPair &pair, int begin, int end) {
+    MCMCState(&states)[2] = pair.states;
     for (int i = 0; i < 2; i++) {
-      normalizers[i].set_safe_value(1e-10f);
-      normalizers[i].clear();
-      all_pcs[i].clear();
+      pair.normalizers[i].set_safe_value(1e-10f);
+      pair.normalizers[i].clear();
+      pair.all_pcs[i].clear();
     }
-    normalizers[vis].insert(1e-6_f, 1e-5_f);
-
-    // 2. Generate light paths (photons)
+    pair.normalizers[vis].insert(1e-6_f, 1e-5_f);
+    pair.photon_visibility.clear();
 
     // Initialize two chains
     long long initializing_count = 0;
@@ -278,6 +325,7 @@ class MCMCUPSRenderer : public UPSRenderer {
         printf("Warning: difficult initilization %lld.\n", initializing_count);
       }
       auto chain = AMCMCPPMMarkovChain();
+      chain.set_rng(&pair.rng);
       auto rand = MCStateSequence(chain);
       auto light_path = trace_light_path(rand);
       auto pc = vertex_merge(light_path);
@@ -292,12 +340,9 @@ class MCMCUPSRenderer : public UPSRenderer {
       }
     }
 
-    // TODO: why unused?
-    // int num_chains = int(use_vis_chain) + int(use_con_chain);
-    RunningAverage photon_visibility;
     // TODO: deferred writting...
-    for (int k = 0; k < n_samples_per_stage; k++) {
-      MarkovChainTag u = (MarkovChainTag)(int(rand() * 2));
+    for (int k = begin; k < end; k++) {
+      MarkovChainTag u = (MarkovChainTag)(int(pair.rng.next() * 2));
       if (!use_vis_chain && u == vis) {
         u = con;
       } else if (!use_con_chain && u == con) {
@@ -306,15 +351,15 @@ class MCMCUPSRenderer : public UPSRenderer {
       MCMCState &previous_state = states[u];
       MCMCState new_state;
       bool is_large_step_done;
-      if (rand() < large_step_probabilities[u]) {  // We use large step only on
-                                                   // visibility chain
+      // We use large step only on visibility chain
+      if (pair.rng.next() < large_step_probabilities[u]) {
         // Large step
         new_state.chain = previous_state.chain.large_step();
         is_large_step_done = true;
       } else {
         // Small step (mutation)
-        mutated += 1;
-        new_state.chain = previous_state.chain.mutate(mutation_strength);
+        pair.mutated += 1;
+        new_state.chain = previous_state.chain.mutate(pair.mutation_strength);
         is_large_step_done = false;
       }
       auto state_sequence = MCStateSequence(new_state.chain);
@@ -332,29 +377,29 @@ class MCMCUPSRenderer : public UPSRenderer {
 
       double a = std::min(1.0, new_state.sc / max(1e-30, previous_state.sc));
       bool is_accepted = false;
-      if (rand() < a) {
+      if (pair.rng.next() < a) {
         if (!is_large_step_done) {
           // accepted mutation
-          accepted += 1;
+          pair.accepted += 1;
         }
         is_accepted = true;
       }
       MCMCState &current_state = is_accepted ? new_state : previous_state;
       if (is_large_step_done) {
         for (int i = 0; i < 2; i++) {
-          normalizers[i].insert((real)new_state.p_star(i), 1);
+          pair.normalizers[i].insert((real)new_state.p_star(i), 1);
         }
       }
       real current_state_weight =
           mutation_expectation ? real(a) : real(is_accepted);
       real last_state_weight = 1.0_f - current_state_weight;
       if (last_state_weight > 0 && previous_state.sc > 0) {
-        all_pcs[u].push_back(previous_state.pc);
+        pair.all_pcs[u].push_back(previous_state.pc);
         real p[2] = {0.0_f};
         for (int i = 0; i < 2; i++) {
           if (markov_chain_mis) {
-            p[i] =
-                (real)previous_state.p_star(i) / normalizers[i].get_average();
+            p[i] = (real)previous_state.p_star(i) /
+                   pair.normalizers[i].get_average();
           } else {
             p[i] = 1.0_f;
           }
@@ -362,14 +407,15 @@ class MCMCUPSRenderer : public UPSRenderer {
         auto s =
             last_state_weight / previous_state.sc * (p[u] / (p[0] + p[1])) * 2;
         assert_info(is_normal(s), "abnormal scaling");
-        all_pcs[u].back().set_scaling(real(s));
+        pair.all_pcs[u].back().set_scaling(real(s));
       }
       if (current_state_weight > 0 && current_state.sc > 0) {
-        all_pcs[u].push_back(current_state.pc);
+        pair.all_pcs[u].push_back(current_state.pc);
         real p[2] = {0.0_f};
         for (int i = 0; i < 2; i++) {
           if (markov_chain_mis) {
-            p[i] = real(current_state.p_star(i) / normalizers[i].get_average());
+            p[i] = real(current_state.p_star(i) /
+                        pair.normalizers[i].get_average());
           } else {
             p[i] = 1.0_f;
           }
@@ -377,19 +423,19 @@ class MCMCUPSRenderer : public UPSRenderer {
         auto s = current_state_weight / current_state.sc *
                  (p[u] / (p[0] + p[1])) * 2;
         assert_info(is_normal(s), "abnormal scaling " + std::to_string(s));
-        all_pcs[u].back().set_scaling(real(s));
+        pair.all_pcs[u].back().set_scaling(real(s));
       }
       if (is_accepted) {
         states[u] = new_state;
       }
       if (u == vis) {
-        photon_visibility.insert((real)current_state.sc, 1);
+        pair.photon_visibility.insert((real)current_state.sc, 1);
       }
       if (chain_exchange) {
         // Replica Exchange
         double r = std::min(
             1.0, states[vis].p_star(con) / max(1e-30, states[con].p_star(con)));
-        if (rand() < r) {
+        if (pair.rng.next() < r) {
           std::swap(states[con], states[vis]);
           for (int i = 0; i < 2; i++) {
             states[i].sc = states[i].p_star(i);
@@ -397,11 +443,58 @@ class MCMCUPSRenderer : public UPSRenderer {
         }
       }
       // Update mutation_strength
-      real ratio_accepted = (real)accepted / (real)mutated;
-      mutation_strength =
-          mutation_strength +
-          (ratio_accepted - target_mutation_acceptance) / mutated;
-      mutation_strength = std::min(10.0_f, max(1e-7_f, mutation_strength));
+      real ratio_accepted = (real)pair.accepted / (real)pair.mutated;
+      pair.mutation_strength =
+          pair.mutation_strength +
+          (ratio_accepted - target_mutation_acceptance) / pair.mutated;
+      pair.mutation_strength =
+          std::min(10.0_f, max(1e-7_f, pair.mutation_strength));
+    }
+  }
+
+  virtual void render_stage() override {
+    radius = initial_radius *
+             (shrinking_radius
+                  ? (real)pow(num_stages + 1.0_f, -(1.0_f - alpha) / 2.0f)
+                  : 1);
+    vm_pdf_constant = pi * radius * radius;
+    // 1. Generate eye paths (importons)
+    generate_eye_paths(2);  // NOTE:debug
+
+    // 2. Generate light paths (photons)
+    if (chain_pairs.empty()) {
+      chain_pairs.resize(get_num_chain_pairs());
+      for (int c = 0; c < (int)chain_pairs.size(); c++) {
+        chain_pairs[c].rng = PCG32(0, c);
+      }
+    }
+    int num_pairs = (int)chain_pairs.size();
+    int steps = (n_samples_per_stage + num_pairs - 1) / num_pairs;
+    TC_PROFILE("chains",
+               ThreadedTaskManager::run(
+                   [&](int c) {
+                     int begin = std::min(c * steps, n_samples_per_stage);
+                     int end = std::min(begin + steps, n_samples_per_stage);
+                     advance_chain_pair(chain_pairs[c], begin, end);
+                   },
+                   0, num_pairs, num_threads));
+
+    // The normalizations are shared: the large steps of all pairs estimate
+    // them, which a single pair's few would do poorly
+    RunningAverage normalizers[2], photon_visibility;
+    long long accepted = 0, mutated = 0;
+    real mutation_strength = 0;
+    for (int i = 0; i < 2; i++) {
+      normalizers[i].set_safe_value(1e-10f);
+    }
+    for (auto &pair : chain_pairs) {
+      for (int i = 0; i < 2; i++) {
+        normalizers[i].merge(pair.normalizers[i]);
+      }
+      photon_visibility.merge(pair.photon_visibility);
+      accepted += pair.accepted;
+      mutated += pair.mutated;
+      mutation_strength += pair.mutation_strength / num_pairs;
     }
     real ratio_accepted = (real)accepted / (real)mutated;
     TC_P(ratio_accepted);
@@ -409,13 +502,20 @@ class MCMCUPSRenderer : public UPSRenderer {
     TC_P(accepted);
     TC_P(mutation_strength);
     TC_P(photon_visibility.get_average());
+    real b[2];
     for (int u = 0; u < 2; u++) {
-      real b = normalizers[u].get_average();
-      TC_P(b);
-      for (auto &pc : all_pcs[u]) {
-        write_path_contribution(pc, b);
-      }
+      b[u] = normalizers[u].get_average();
+      TC_P(b[u]);
     }
+    ThreadedTaskManager::run(
+        [&](int c) {
+          for (int u = 0; u < 2; u++) {
+            for (auto &pc : chain_pairs[c].all_pcs[u]) {
+              write_path_contribution(pc, b[u]);
+            }
+          }
+        },
+        0, num_pairs, num_threads);
     sample_count += n_samples_per_stage;
   }
 };
@@ -10,52 +10,26 @@
 
 TC_NAMESPACE_BEGIN
 
-class PSSMLTMarkovChain : public MarkovChain {
+// Draws samples like RandomStateSequence and records them, so that a
+// bootstrap sample can be turned into a Markov chain state
+class RecordingStateSequence : public RandomStateSequence {
  public:
-  real resolution_x, resolution_y;
+  std::vector<real> draws;
 
-  PSSMLTMarkovChain() : PSSMLTMarkovChain(0, 0) {
+  RecordingStateSequence(std::shared_ptr<Sampler> sampler, long long instance)
+      : RandomStateSequence(sampler, instance) {
   }
 
-  PSSMLTMarkovChain(real resolution_x, real resolution_y)
-      : resolution_x(resolution_x), resolution_y(resolution_y) {
-  }
-
-  PSSMLTMarkovChain large_step() const {
-    PSSMLTMarkovChain result(resolution_x, resolution_y);
-    return result;
-  }
-
-  PSSMLTMarkovChain mutate() const {
-    PSSMLTMarkovChain result(*this);
-    // Screen coordinates
-    real delta_pixel = 2.0f / (resolution_x + resolution_y);
-    result.get_state(2);
-    result.states[0] = perturb(result.states[0], delta_pixel, 0.1f);
-    result.states[1] = perturb(result.states[1], delta_pixel, 0.1f);
-    // Events
-    for (int i = 2; i < (int)result.states.size(); i++)
-      result.states[i] =
-          perturb(result.states[i], 1.0_f / 1024.0f, 1.0_f / 64.0f);
-    return result;
-  }
-
- protected:
-  inline static real perturb(const real value, const real s1, const real s2) {
-    real result;
-    real r = rand();
-    if (r < 0.5f) {
-      r = r * 2.0f;
-      result = value + s2 * exp(-log(s2 / s1) * r);
-    } else {
-      r = (r - 0.5f) * 2.0f;
-      result = value - s2 * exp(-log(s2 / s1) * r);
-    }
-    result -= floor(result);
-    return result;
+  real sample() override {
+    real ret = RandomStateSequence::sample();
+    draws.push_back(ret);
+    return ret;
   }
 };
 
+// Runs |chains_per_thread| independent chains per thread. Each chain owns its
+// RNG and advances its share of a stage's mutations in parallel with the
+// others; splats go to the lock-free buffer of BidirectionalRenderer.
 class PSSMLTRenderer : public BidirectionalRenderer {
  private:
   struct MCMCState {
@@ -73,31 +47,63 @@ class PSSMLTRenderer : public BidirectionalRenderer {
     }
   };
 
-  MCMCState current_state;
+  struct Chain {
+    MCMCState current_state;
+    PCG32 rng;
+  };
+
+  std::vector<Chain> chains;
   bool first_stage_done = false;
   // Normalizer
   real b;
 
  protected:
+  TC_RENDERER_NO_CHECKPOINT
+
   real large_step_prob;
+  int chains_per_thread;
+
+  int get_num_chains() const {
+    int threads = num_threads > 0 ? num_threads
+                                  : (int)std::thread::hardware_concurrency();
+    return std::max(1, threads) * chains_per_thread;
+  }
+
+  // Mutations per chain and stage, so that a stage takes about
+  // width * height / stage_frequency in total
+  int get_steps_per_chain(int num_chains) const {
+    int total = width * height / stage_frequency;
+    return (total + num_chains - 1) / num_chains;
+  }
 
  public:
   virtual void initialize(const Config &config) override {
     BidirectionalRenderer::initialize(config);
     large_step_prob = config.get("large_step_prob", 0.3f);
+    chains_per_thread = config.get("chains_per_thread", 4);
   }
 
-  real estimate_b() {
-    real sum = 0;
+  // Mean scalar contribution of width * height independent samples. The
+  // contribution of sample k is stored in |contributions[k]|.
+  real estimate_b(std::vector<real> &contributions) {
     int n_samples = width * height;
-    for (int k = 0; k < n_samples; k++) {
-      auto state_sequence = RandomStateSequence(sampler, k);
-      Path eye_path = trace_eye_path(state_sequence);
-      Path light_path = trace_light_path(state_sequence);
-      PathContribution pc = connect(eye_path, light_path);
-      sum += scalar_contribution_function(pc);
+    contributions.resize(n_samples);
+    ThreadedTaskManager::run(
+        [&](int k) {
+          auto state_sequence = RandomStateSequence(sampler, k);
+          static thread_local Path eye_path, light_path;
+          static thread_local PathContribution pc;
+          trace_eye_path(state_sequence, eye_path);
+          trace_light_path(state_sequence, light_path);
+          connect(eye_path, light_path, pc);
+          contributions[k] = scalar_contribution_function(pc);
+        },
+        0, n_samples, num_threads);
+    double sum = 0;
+    for (auto c : contributions) {
+      sum += c;
     }
-    return sum / n_samples;
+    return real(sum / n_samples);
   }
 
   real scalar_contribution_function(const PathContribution &pc) {
@@ -114,24 +120,49 @@ class PSSMLTRenderer : public BidirectionalRenderer {
 
   virtual PathContribution get_path_contribution(MarkovChain &mc) {
     auto state_sequence = MCStateSequence(mc);
-    Path eye_path = trace_eye_path(state_sequence);
-    Path light_path = trace_light_path(state_sequence);
+    // Buffers of the thread, for the proposals of its chains
+    static thread_local Path eye_path, light_path;
+    trace_eye_path(state_sequence, eye_path);
+    trace_light_path(state_sequence, light_path);
     return connect(eye_path, light_path);
   }
 
-  virtual void render_stage() override {
-    if (!first_stage_done) {
-      b = estimate_b();
-      TC_P(b);
-      current_state.chain = PSSMLTMarkovChain((real)width, (real)height);
-      current_state.pc = get_path_contribution(current_state.chain);
-      current_state.sc = scalar_contribution_function(current_state.pc);
-      first_stage_done = true;
-    }
+  // Estimates b and starts each chain from a bootstrap sample picked in
+  // proportion to its contribution, which avoids start-up bias
+  void initialize_chains() {
+    std::vector<real> contributions;
+    b = estimate_b(contributions);
+    TC_P(b);
+    DiscreteSampler bootstrap_sampler;
+    bootstrap_sampler.initialize(contributions);
+    chains.resize(get_num_chains());
+    ThreadedTaskManager::run(
+        [&](int i) {
+          Chain &chain = chains[i];
+          chain.rng = PCG32(0, i);
+          MCMCState &state = chain.current_state;
+          state.chain = PSSMLTMarkovChain((real)width, (real)height);
+          state.chain.set_rng(&chain.rng);
+          if (b > 0) {
+            int k = bootstrap_sampler.sample(chain.rng.next());
+            // Replay the sample to record its draws
+            RecordingStateSequence replay(sampler, k);
+            trace_eye_path(replay);
+            trace_light_path(replay);
+            state.chain.set_states(replay.draws);
+          }
+          state.pc = get_path_contribution(state.chain);
+          state.sc = scalar_contribution_function(state.pc);
+        },
+        0, (int)chains.size(), num_threads);
+  }
+
+  void advance_chain(Chain &chain, int steps) {
+    MCMCState &current_state = chain.current_state;
     MCMCState new_state;
-    for (int k = 0; k < width * height / stage_frequency; k++) {
+    for (int k = 0; k < steps; k++) {
       real is_large_step;
-      if (rand() <= large_step_prob) {
+      if (chain.rng.next() <= large_step_prob) {
         new_state.chain = current_state.chain.large_step();
         is_large_step = 1.0;
       } else {
@@ -156,12 +187,29 @@ class PSSMLTRenderer : public BidirectionalRenderer {
             real((1.0 - a) / (current_state.sc / b + large_step_prob)));
       }
       // conditionally accept the chain
-      if (rand() <= a) {
+      if (chain.rng.next() <= a) {
         current_state = new_state;
       }
-      sample_count += 1;
     }
   }
+
+  // The chains are bootstrapped again, from a new estimate of b
+  void reset_accumulation() override {
+    BidirectionalRenderer::reset_accumulation();
+    first_stage_done = false;
+  }
+
+  virtual void render_stage() override {
+    if (!first_stage_done) {
+      initialize_chains();
+      first_stage_done = true;
+    }
+    int steps = get_steps_per_chain((int)chains.size());
+    ThreadedTaskManager::run(
+        [&](int i) { advance_chain(chains[i], steps); }, 0,
+        (int)chains.size(), num_threads);
+    sample_count += (long long)steps * chains.size();
+  }
 };
 
 class MMLTRenderer : public PSSMLTRenderer {
@@ -171,31 +219,27 @@ class MMLTRenderer : public PSSMLTRenderer {
     real technique_state;
 
    public:
-    MMLTMarkovChain() : MMLTMarkovChain(0, 0) {
+    MMLTMarkovChain() : PSSMLTMarkovChain(0, 0), technique_state(0) {
     }
 
-    MMLTMarkovChain(int resolution_x, int resolution_y)
+    MMLTMarkovChain(int resolution_x, int resolution_y, PCG32 *rng = nullptr)
         : PSSMLTMarkovChain((real)resolution_x, (real)resolution_y) {
-      technique_state = rand();
+      set_rng(rng);
+      technique_state = next_random();
     }
 
     MMLTMarkovChain large_step() const {
-      return MMLTMarkovChain((int)resolution_x, (int)resolution_y);
+      MMLTMarkovChain result(*this);
+      result.step(true, strength);
+      result.technique_state = next_random();
+      return result;
     }
 
     MMLTMarkovChain mutate() const {
       MMLTMarkovChain result(*this);
-      // Pixel location
-      real delta_pixel = 2.0f / (resolution_x + resolution_y);
-      result.get_state(2);
-      result.states[0] = perturb(result.states[0], delta_pixel, 0.1f);
-      result.states[1] = perturb(result.states[1], delta_pixel, 0.1f);
+      result.step(false, strength);
       result.technique_state =
-          perturb(result.technique_state, 1.0 / 1024.0f, 1.0 / 64.0f);
-      // Events
-      for (int i = 2; i < (int)result.states.size(); i++)
-        result.states[i] =
-            perturb(result.states[i], 1.0_f / 1024.0f, 1.0_f / 64.0f);
+          perturb_exponential(technique_state, 1.0 / 1024.0f, 1.0 / 64.0f);
       return result;
     }
 
@@ -219,7 +263,13 @@ class MMLTRenderer : public PSSMLTRenderer {
     }
   };
 
-  std::vector<MCMCState> current_states;
+  // One chain per path length
+  struct Chain {
+    std::vector<MCMCState> current_states;
+    PCG32 rng;
+  };
+
+  std::vector<Chain> chains;
   bool first_stage_done = false;
   DiscreteSampler path_length_sampler;
   std::vector<real> normalizers;
@@ -227,34 +277,48 @@ class MMLTRenderer : public PSSMLTRenderer {
  public:
   virtual void initialize(const Config &config) override {
     PSSMLTRenderer::initialize(config);
-    current_states.resize(max_path_length + 1);
     normalizers.resize(max_path_length + 1);
   }
 
+  // The normalizers are estimated again
+  void reset_accumulation() override {
+    PSSMLTRenderer::reset_accumulation();
+    first_stage_done = false;
+  }
+
   void estimate_normalizers() {
     int n_samples = width * height;
-    std::vector<real> intensities(max_path_length + 1, 0.0_f);
-    std::vector<long long> samples(max_path_length + 1, 0LL);
-    for (int k = 0; k < n_samples; k++) {
-      auto state_sequence = RandomStateSequence(sampler, k);
-      Path eye_path = trace_eye_path(state_sequence);
-      Path light_path = trace_light_path(state_sequence);
-      PathContribution pc = connect(eye_path, light_path);
-      for (auto &contribution : pc.contributions) {
-        intensities[contribution.path_length] +=
-            scalar_contribution_function(contribution);
-        samples[contribution.path_length] += 1;
-      }
-    }
+    // Per sample, so that the parallel sum below is deterministic
+    std::vector<std::vector<real>> intensities(n_samples);
+    ThreadedTaskManager::run(
+        [&](int k) {
+          auto state_sequence = RandomStateSequence(sampler, k);
+          static thread_local Path eye_path, light_path;
+          static thread_local PathContribution pc;
+          trace_eye_path(state_sequence, eye_path);
+          trace_light_path(state_sequence, light_path);
+          connect(eye_path, light_path, pc);
+          intensities[k].assign(max_path_length + 1, 0.0_f);
+          for (auto &contribution : pc.contributions) {
+            intensities[k][contribution.path_length] +=
+                scalar_contribution_function(contribution);
+          }
+        },
+        0, n_samples, num_threads);
     for (int k = min_path_length; k <= max_path_length; k++) {
-      normalizers[k] = intensities[k] / n_samples / (k + 1);
+      double sum = 0;
+      for (int i = 0; i < n_samples; i++) {
+        sum += intensities[i][k];
+      }
+      normalizers[k] = real(sum / n_samples / (k + 1));
     }
   }
 
   PathContribution get_path_contribution(MMLTMarkovChain &mc, int path_length) {
     auto state_sequence = MCStateSequence(mc);
-    Path eye_path = trace_eye_path(state_sequence);
-    Path light_path = trace_light_path(state_sequence);
+    static thread_local Path eye_path, light_path;
+    trace_eye_path(state_sequence, eye_path);
+    trace_light_path(state_sequence, light_path);
     int t = std::min(path_length,
                      (int)floor(mc.get_technique_state() * (path_length + 1))) +
             1,
@@ -267,37 +331,57 @@ class MMLTRenderer : public PSSMLTRenderer {
 
   void initialize_path_length_sampler() {
     estimate_normalizers();
-    for (int i = min_path_length; i <= max_path_length; i++) {
-      if (normalizers[i] == 0.0_f) {
-        // No path of such length
-        continue;
-      }
-      while (true) {
-        current_states[i].chain = MMLTMarkovChain(width, height);
-        current_states[i].pc =
-            get_path_contribution(current_states[i].chain, i);
-        current_states[i].sc =
-            scalar_contribution_function(current_states[i].pc);
-        if (current_states[i].sc > 0) {
-          break;
-        }
-      }
-    }
+    chains.resize(get_num_chains());
+    ThreadedTaskManager::run(
+        [&](int c) {
+          Chain &chain = chains[c];
+          chain.rng = PCG32(0, c);
+          auto &current_states = chain.current_states;
+          current_states.resize(max_path_length + 1);
+          for (int i = min_path_length; i <= max_path_length; i++) {
+            if (normalizers[i] == 0.0_f) {
+              // No path of such length
+              continue;
+            }
+            while (true) {
+              current_states[i].chain =
+                  MMLTMarkovChain(width, height, &chain.rng);
+              current_states[i].pc =
+                  get_path_contribution(current_states[i].chain, i);
+              current_states[i].sc =
+                  scalar_contribution_function(current_states[i].pc);
+              if (current_states[i].sc > 0) {
+                break;
+              }
+            }
+          }
+        },
+        0, (int)chains.size(), num_threads);
     path_length_sampler.initialize(normalizers);
   }
 
-  virtual void render_stage() override {
+  // Runs |advance(chain, steps)| on all chains in parallel
+  template <typename T>
+  void advance_chains(const T &advance) {
     if (!first_stage_done) {
       initialize_path_length_sampler();
       first_stage_done = true;
     }
+    int steps = get_steps_per_chain((int)chains.size());
+    ThreadedTaskManager::run([&](int c) { advance(chains[c], steps); }, 0,
+                             (int)chains.size(), num_threads);
+    sample_count += (long long)steps * chains.size();
+  }
+
+  void advance_chain(Chain &chain, int steps) {
     MCMCState new_state;
-    for (int k = 0; k < width * height / stage_frequency; k++) {
+    for (int k = 0; k < steps; k++) {
       real path_length_pdf;
-      int path_length = path_length_sampler.sample(rand(), path_length_pdf);
+      int path_length =
+          path_length_sampler.sample(chain.rng.next(), path_length_pdf);
       real is_large_step;
-      MCMCState &current_state = current_states[path_length];
-      if (rand() < large_step_prob) {
+      MCMCState &current_state = chain.current_states[path_length];
+      if (chain.rng.next() < large_step_prob) {
         new_state.chain = current_state.chain.large_step();
         is_large_step = 1.0;
       } else {
@@ -326,12 +410,16 @@ class MMLTRenderer : public PSSMLTRenderer {
                       large_step_prob)));
       }
       // conditionally accept the chain
-      if (rand() <= a) {
+      if (chain.rng.next() <= a) {
         current_state = new_state;
       }
-      sample_count += 1;
     }
   }
+
+  virtual void render_stage() override {
+    advance_chains(
+        [&](Chain &chain, int steps) { advance_chain(chain, steps); });
+  }
 };
 
 TC_IMPLEMENTATION(Renderer, PSSMLTRenderer, "pssmlt");
@@ -343,16 +431,13 @@ class DWMMLTRenderer : public MMLTRenderer {
     large_step_prob = 0.0_f;
   }
 
-  virtual void render_stage() override {
-    if (!first_stage_done) {
-      initialize_path_length_sampler();
-      first_stage_done = true;
-    }
+  void advance_chain(Chain &chain, int steps) {
     MCMCState new_state;
-    for (int k = 0; k < width * height / stage_frequency; k++) {
+    for (int k = 0; k < steps; k++) {
       real path_length_pdf;
-      int path_length = path_length_sampler.sample(rand(), path_length_pdf);
-      MCMCState &current_state = current_states[path_length];
+      int path_length =
+          path_length_sampler.sample(chain.rng.next(), path_length_pdf);
+      MCMCState &current_state = chain.current_states[path_length];
       // TC_P(current_state.weight);
       new_state.chain = current_state.chain.mutate();
       new_state.pc = get_path_contribution(new_state.chain, path_length);
@@ -362,7 +447,7 @@ class DWMMLTRenderer : public MMLTRenderer {
       if (current_state.sc > 0) {
         r = current_state.weight * new_state.sc / current_state.sc;
         a = r / (r + theta);
-        if (rand() < r) {
+        if (chain.rng.next() < r) {
           accepted = true;
         }
       } else {
@@ -381,9 +466,13 @@ class DWMMLTRenderer : public MMLTRenderer {
             current_state.weight * factor /
                 (current_state.sc / normalizers[path_length]));
       }
-      sample_count += 1;
     }
   }
+
+  virtual void render_stage() override {
+    advance_chains(
+        [&](Chain &chain, int steps) { advance_chain(chain, steps); });
+  }
 };
 
 TC_IMPLEMENTATION(Renderer, MMLTRenderer, "mmlt");
@@ -0,0 +1,164 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+#include <atomic>
+#include <taichi/math/discrete_sampler.h>
+#include <taichi/visual/sampler.h>
+
+TC_NAMESPACE_BEGIN
+
+// Guides photon emission towards the part of the primary sample space whose
+// photons land near hit points. The space of the emission dimensions (light
+// selection and emitted direction) is split into bins, and each bin is
+// sampled with probability proportional to the fraction of its photons
+// found visible so far, mixed with a uniform share so that every bin keeps
+// being sampled and the weights stay below 1 / uniform_share. Photons are
+// weighted by the inverse of the density of their bin, so estimates stay
+// unbiased. The distribution only changes in update(), between passes;
+// record() may be called from several threads at once.
+class PhotonGuide {
+ public:
+  // Guide dimension of state sequence dimension |dim|, or -1 if it is not
+  // warped. trace_photon reads the light selection at 0 and the emitted
+  // direction at 3 and 4.
+  static int get_guide_dim(int dim) {
+    return dim == 0 ? 0 : (dim == 3 || dim == 4) ? dim - 2 : -1;
+  }
+
+  void initialize(Vector3i res, real uniform_share) {
+    TC_ERROR_IF(res.min() < 1, "Photon guides need positive resolutions");
+    TC_ERROR_IF(uniform_share <= 0 || uniform_share > 1,
+                "Photon guides need a uniform share in (0, 1] instead of {}",
+                uniform_share);
+    this->res = res;
+    this->uniform_share = uniform_share;
+    int n = res.x * res.y * res.z;
+    visible.assign(n, 0);
+    tested.assign(n, 0);
+    pass_visible = std::vector<std::atomic<int>>(n);
+    pass_tested = std::vector<std::atomic<int>>(n);
+    distribution.initialize(std::vector<real>(n, 1.0_f));
+  }
+
+  // Forgets the visibility recorded so far
+  void reset() {
+    initialize(res, uniform_share);
+  }
+
+  int get_num_bins() const {
+    return (int)tested.size();
+  }
+
+  // Maps |u| to a bin and |u| to a new uniform number within it
+  int sample_bin(real &u) const {
+    real pdf, cdf;
+    int bin = distribution.sample(u, pdf, cdf);
+    u = clamp((u - (cdf - pdf)) / pdf, 0.0_f, 1.0_f - 1e-7_f);
+    return bin;
+  }
+
+  // The density of |bin| relative to uniform sampling
+  real get_density(int bin) const {
+    return distribution.get_pdf(bin) * get_num_bins();
+  }
+
+  // Cell of |bin| along guide dimension |d|
+  int get_cell(int bin, int d) const {
+    if (d == 0) {
+      return bin / (res.y * res.z);
+    } else if (d == 1) {
+      return bin / res.z % res.y;
+    } else {
+      return bin % res.z;
+    }
+  }
+
+  int get_res(int d) const {
+    return res[d];
+  }
+
+  void record(int bin, bool is_visible) {
+    pass_tested[bin].fetch_add(1, std::memory_order_relaxed);
+    if (is_visible) {
+      pass_visible[bin].fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+
+  // Adds the photons of the pass and rebuilds the distribution. Bins not
+  // tested yet get the mean visible fraction.
+  void update() {
+    int n = get_num_bins();
+    int64 total_visible = 0, total_tested = 0;
+    for (int i = 0; i < n; i++) {
+      visible[i] += pass_visible[i].exchange(0);
+      tested[i] += pass_tested[i].exchange(0);
+      total_visible += visible[i];
+      total_tested += tested[i];
+    }
+    if (total_visible == 0) {
+      return;
+    }
+    real mean = (real)total_visible / total_tested;
+    std::vector<real> fraction(n);
+    real sum = 0;
+    for (int i = 0; i < n; i++) {
+      fraction[i] = tested[i] > 0 ? (real)visible[i] / tested[i] : mean;
+      sum += fraction[i];
+    }
+    for (int i = 0; i < n; i++) {
+      fraction[i] =
+          (1 - uniform_share) * fraction[i] / sum + uniform_share / n;
+    }
+    distribution.initialize(fraction);
+  }
+
+  TC_IO_DEF(res, uniform_share, visible, tested, distribution);
+
+ private:
+  Vector3i res;
+  real uniform_share;
+  // Of all passes so far
+  std::vector<int64> visible, tested;
+  std::vector<std::atomic<int>> pass_visible, pass_tested;
+  DiscreteSampler distribution;
+};
+
+// Reads |base| and warps the emission dimensions through |guide|. The bin,
+// and so the weight of the photon, is drawn on construction.
+class GuidedStateSequence : public StateSequence {
+ private:
+  StateSequence &base;
+  const PhotonGuide &guide;
+  real first;
+  int bin;
+
+ public:
+  GuidedStateSequence(StateSequence &base, const PhotonGuide &guide)
+      : base(base), guide(guide) {
+    first = base();
+    bin = guide.sample_bin(first);
+  }
+
+  real sample() override {
+    int d = PhotonGuide::get_guide_dim(cursor);
+    real u = cursor++ == 0 ? first : base();
+    if (d >= 0) {
+      return (guide.get_cell(bin, d) + u) / guide.get_res(d);
+    }
+    return u;
+  }
+
+  int get_bin() const {
+    return bin;
+  }
+
+  real get_weight() const {
+    return 1.0_f / guide.get_density(bin);
+  }
+};
+
+TC_NAMESPACE_END
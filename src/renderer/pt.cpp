@@ -3,10 +3,13 @@
     The use of this software is governed by the LICENSE file.
 *******************************************************************************/
 
+#include <taichi/system/arena.h>
+#include <taichi/system/statistics.h>
 #include <taichi/system/threading.h>
 #include <taichi/visual/renderer.h>
 #include <taichi/visual/sampler.h>
 #include <taichi/visual/bsdf.h>
+#include <taichi/visual/path_guiding.h>
 #include <taichi/math/sdf.h>
 #include <taichi/common/asset_manager.h>
 
@@ -31,14 +34,24 @@ class PathTracingRenderer : public Renderer {
   virtual void initialize(const Config &config) override;
 
   void render_stage() override {
-    int samples = width * height;
-    auto task = [&](int i) {
-      RandomStateSequence rand(sampler, index + i);
-      auto cont = get_path_contribution(rand);
-      write_path_contribution(cont);
-    };
-    ThreadedTaskManager::run(task, 0, samples, num_threads);
-    index += samples;
+    update_pixel_estimates();
+    prepare_primary_hit_cache();
+    if (!adaptive) {
+      for_each_tile([&](const Tile &tile) { render_tile(tile); });
+    } else {
+      for_each_tile(active_tiles, [&](const Tile &tile) { render_tile(tile); });
+      retire_converged_tiles();
+    }
+    index += (long long)num_workers * width * height;
+    update_guide();
+  }
+
+  bool is_converged() override {
+    return adaptive && active_tiles.empty();
+  }
+
+  std::vector<uint8> get_partial_output() override {
+    return accumulator.to_binary();
   }
 
   virtual Array2D<Vector3> get_output() override {
@@ -46,6 +59,55 @@ class PathTracingRenderer : public Renderer {
     return tmp;
   }
 
+  // Adds the variance of each pixel's mean luminance
+  std::vector<ImageLayer> get_output_layers() override {
+    auto layers = Renderer::get_output_layers();
+    auto variance = get_output_variance();
+    Array2D<Vector3> y(variance.get_res());
+    for (auto &ind : variance.get_region()) {
+      y[ind] = Vector3(variance[ind]);
+    }
+    layers.push_back({"variance", "Y", y});
+    return layers;
+  }
+
+  // Zero for pixels with fewer than two samples
+  Array2D<real> get_output_variance() override {
+    Array2D<real> variance(Vector2i(width, height), 0.0_f);
+    for (auto &ind : variance.get_region()) {
+      int n = accumulator.get_count(ind.i, ind.j);
+      if (n > 1) {
+        variance[ind] = accumulator.get_variance(ind.i, ind.j) / n;
+      }
+    }
+    return variance;
+  }
+
+  void set_scene(std::shared_ptr<Scene> scene) override {
+    Renderer::set_scene(scene);
+    clear_primary_hit_cache();
+  }
+
+  void update_scene() override {
+    Renderer::update_scene();
+    clear_primary_hit_cache();
+  }
+
+  // Starts over, keeping the cached primary hits
+  void material_changed() override {
+    aov_albedo = Array2D<Vector3>();
+    reset_accumulation();
+  }
+
+  void reset_accumulation() override {
+    accumulator = ImageAccumulator<Vector3>(Vector2i(width, height));
+    index = (long long)worker_id * width * height;
+    reset_adaptive_sampling();
+    if (guiding) {
+      initialize_guide();
+    }
+  }
+
  protected:
   VolumeMaterial volume;
 
@@ -55,13 +117,14 @@ class PathTracingRenderer : public Renderer {
                                     const IntersectionInfo &info,
                                     const BSDF &bsdf,
                                     StateSequence &rand,
-                                    VolumeStack &stack) {
+                                    const VolumeStack &stack) {
     Vector3 acc(0);
     real light_source_pdf;
     bool sample_envmap = false;
     const Triangle *p_triangle = nullptr;
     const EnvironmentMap *p_envmap = nullptr;
-    scene->sample_light_source(rand(), light_source_pdf, p_triangle, p_envmap);
+    sample_light_source(rand(), info.pos, light_source_pdf, p_triangle,
+                        p_envmap);
     Triangle tri;
     if (p_envmap) {
       sample_envmap = true;
@@ -77,7 +140,7 @@ class PathTracingRenderer : public Renderer {
       // Note that invisible parts of light sources are filtered by
       // visibility term here, so we can naturally sample them.
       bool sample_bsdf = i < direct_lighting_bsdf;
-      if (!sample_bsdf) {
+      if (!sample_bsdf && direct_lighting_candidates == 0) {
         // Light sampling
         if (!sample_envmap && tri.get_relative_location_to_plane(info.pos) < 0)
           continue;
@@ -87,6 +150,8 @@ class PathTracingRenderer : public Renderer {
       real bsdf_p;
       SurfaceEvent event;
       Vector3 dist;
+      // Replaces 1 / light_p of resampled light samples
+      real resampling_weight = 0;
       if (sample_bsdf) {
         // Sample BSDF
         bsdf.sample(in_dir, rand(), rand(), out_dir, f, bsdf_p, event);
@@ -95,6 +160,23 @@ class PathTracingRenderer : public Renderer {
           // It's included in previous vertex.
           continue;
         }
+      } else if (direct_lighting_candidates > 0) {
+        const Triangle *light;
+        Vector3 light_pos;
+        if (!resample_light(in_dir, info, bsdf, rand, light, light_pos,
+                            out_dir, resampling_weight)) {
+          continue;
+        }
+        sample_envmap = light == nullptr;
+        if (sample_envmap) {
+          p_envmap = scene->envmap.get();
+        } else {
+          p_envmap = nullptr;
+          tri = *light;
+          dist = light_pos - info.pos;
+        }
+        f = bsdf.evaluate(in_dir, out_dir);
+        bsdf_p = bsdf.probability_density(in_dir, out_dir);
       } else {
         // Sample light source
         if (sample_envmap) {
@@ -102,7 +184,7 @@ class PathTracingRenderer : public Renderer {
           real pdf;
           out_dir = p_envmap->sample_direction(rand, pdf, _);
         } else {
-          Vector3 pos = tri.sample_point(rand(), rand());
+          Vector3 pos = sample_light_point(tri, info.pos, rand(), rand());
           dist = pos - info.pos;
           out_dir = normalize(dist);
         }
@@ -111,7 +193,12 @@ class PathTracingRenderer : public Renderer {
       }
       Ray ray(info.pos + out_dir * 1e-3_f, out_dir);
       IntersectionInfo test_info;
-      Vector3 att = get_attenuation(stack, ray, rand, test_info);
+      Vector3 att(1.0_f);
+      if (sample_bsdf ||
+          !test_light_visibility(stack, ray, sample_envmap ? nullptr : &tri,
+                                 info.pos + dist, att, test_info)) {
+        att = get_attenuation(stack, ray, rand, test_info);
+      }
       if (att.max() == 0.0_f) {
         // Completely blocked.
         continue;
@@ -123,15 +210,14 @@ class PathTracingRenderer : public Renderer {
       Vector3 throughput;
       if (test_info.intersected) {
         // Mesh light
-        const Triangle &light_tri = scene->get_triangle(test_info.triangle_id);
         BSDF light_bsdf(scene, test_info);
         if (!light_bsdf.is_emissive() || !test_info.front) {
           continue;
         }
-        real c = abs(dot(ray.dir, tri.normal));
-        dist = test_info.pos - info.pos;
-        light_p = dot(dist, dist) / std::max(1e-20_f, light_tri.area * c) *
-                  scene->get_triangle_pdf(light_tri.id);
+        // Only now known to be a scene triangle (not an instance or sphere)
+        const Triangle &light_tri = scene->get_triangle(test_info.triangle_id);
+        light_p = get_light_point_pdf(light_tri, info.pos, test_info.pos) *
+                  get_light_selection_pdf(light_tri.id, info.pos);
         const Vector3 emission =
             light_bsdf.evaluate(test_info.normal, -out_dir);
         throughput = f * co * emission * att;
@@ -159,32 +245,349 @@ class PathTracingRenderer : public Renderer {
         // Light sampling
         // The prob. of triggering delta BSDF event is 0, thus we ignore this
         // case
-        acc += 1 / (direct_lighting_bsdf * bsdf_p +
-                    direct_lighting_light * light_p) *
+        real scale = direct_lighting_candidates > 0
+                         ? resampling_weight * light_p
+                         : 1.0_f;
+        acc += scale /
+               (direct_lighting_bsdf * bsdf_p +
+                direct_lighting_light * light_p) *
                throughput;
       }
     }
     return acc;
   }
 
+  // Resampled importance sampling (Talbot et al.) of a light sample out of
+  // direct_lighting_candidates ones, drawn as light samples are and kept in
+  // a weighted reservoir. The target is the unshadowed contribution, with
+  // the emission of meshes taken as constant, so candidates cost no rays.
+  // On success the sample is a point |light_pos| on |light|, or a
+  // direction on the environment map if |light| is nullptr, in |out_dir|;
+  // |weight| is the mean candidate weight over the target of the sample,
+  // the unbiased replacement of 1 / pdf.
+  bool resample_light(const Vector3 &in_dir,
+                      const IntersectionInfo &info,
+                      const BSDF &bsdf,
+                      StateSequence &rand,
+                      const Triangle *&light,
+                      Vector3 &light_pos,
+                      Vector3 &out_dir,
+                      real &weight) {
+    real weight_sum = 0, selected_target = 0;
+    for (int k = 0; k < direct_lighting_candidates; k++) {
+      real selection_pdf;
+      const Triangle *triangle = nullptr;
+      const EnvironmentMap *envmap = nullptr;
+      sample_light_source(rand(), info.pos, selection_pdf, triangle, envmap);
+      Vector3 pos, dir;
+      real pdf, target = 0;
+      if (envmap) {
+        Vector3 illum;
+        dir = envmap->sample_direction(rand, pdf, illum);
+        pdf = scene->get_environment_map_pdf() * envmap->pdf(dir);
+        target = luminance(illum);
+      } else {
+        if (triangle->get_relative_location_to_plane(info.pos) <= 0) {
+          continue;
+        }
+        pos = sample_light_point(*triangle, info.pos, rand(), rand());
+        dir = normalized(pos - info.pos);
+        pdf = selection_pdf * get_light_point_pdf(*triangle, info.pos, pos);
+        target = scene->get_triangle_emission(triangle->id);
+      }
+      target *= luminance(bsdf.evaluate(in_dir, dir)) *
+                std::abs(dot(dir, info.normal));
+      real w = pdf > 0 ? target / pdf : 0;
+      weight_sum += w;
+      // Consumed by every candidate, so that dimensions line up
+      real r = rand();
+      if (w > 0 && r * weight_sum < w) {
+        light = triangle;
+        light_pos = pos;
+        out_dir = dir;
+        selected_target = target;
+      }
+    }
+    if (selected_target <= 0) {
+      return false;
+    }
+    weight = weight_sum / (direct_lighting_candidates * selected_target);
+    return true;
+  }
+
+  // Light selection for direct lighting at |pos|, through the scene's light
+  // BVH unless "light_bvh" is off
+  void sample_light_source(real r,
+                           const Vector3 &pos,
+                           real &pdf,
+                           const Triangle *&triangle,
+                           const EnvironmentMap *&envmap) const {
+    if (use_light_bvh) {
+      scene->sample_light_source(r, pos, pdf, triangle, envmap);
+    } else {
+      scene->sample_light_source(r, pdf, triangle, envmap);
+    }
+  }
+
+  real get_light_selection_pdf(int triangle_id, const Vector3 &pos) const {
+    return use_light_bvh ? scene->get_triangle_pdf(triangle_id, pos)
+                         : scene->get_triangle_pdf(triangle_id);
+  }
+
+  // Lights subtending solid angles in this range from the shading point are
+  // sampled by solid angle, as area sampling wastes samples and gets noisy
+  // for large lights nearby; below it spherical sampling loses precision,
+  // and above the triangle is nearly a hemisphere
+  bool samples_solid_angle(const Triangle &tri,
+                           const Vector3 &pos,
+                           real &solid_angle) const {
+    if (!spherical_light_sampling) {
+      return false;
+    }
+    solid_angle = tri.get_solid_angle(pos);
+    return 3e-4_f < solid_angle && solid_angle < 6.22_f;
+  }
+
+  // A point on |tri| to light |pos| from, by solid angle or by area
+  Vector3 sample_light_point(const Triangle &tri,
+                             const Vector3 &pos,
+                             real u,
+                             real v) const {
+    real solid_angle;
+    if (!samples_solid_angle(tri, pos, solid_angle)) {
+      return tri.sample_point(u, v);
+    }
+    Vector3 dir = tri.sample_direction(pos, u, v);
+    real t = dot(tri.v[0] - pos, tri.normal) /
+             std::min(dot(dir, tri.normal), -1e-20_f);
+    return pos + dir * t;
+  }
+
+  // In solid angle, of sample_light_point giving |light_pos|, without the
+  // light selection
+  real get_light_point_pdf(const Triangle &tri,
+                           const Vector3 &pos,
+                           const Vector3 &light_pos) const {
+    real solid_angle;
+    if (samples_solid_angle(tri, pos, solid_angle)) {
+      return 1.0_f / solid_angle;
+    }
+    Vector3 dist = light_pos - pos;
+    real c = std::abs(dot(normalized(dist), tri.normal));
+    return dot(dist, dist) / std::max(1e-20_f, tri.area * c);
+  }
+
   Vector3 calculate_volumetric_direct_lighting(const Vector3 &in_dir,
                                                const Vector3 &orig,
                                                StateSequence &rand,
-                                               VolumeStack &stack);
+                                               const VolumeStack &stack);
+
+  Vector3 clamp_luminance(Vector3 color) const {
+    if (luminance_clamping > 0 && luminance(color) > luminance_clamping) {
+      color = luminance_clamping / luminance(color) * color;
+    }
+    return color;
+  }
 
   PathContribution get_path_contribution(StateSequence &rand) {
     Vector2 offset(rand(), rand());
     Vector2 size(1.0_f / width, 1.0_f / height);
     Ray ray = camera->sample(offset, size, rand);
-    Vector3 color = trace(ray, rand);
-    if (luminance_clamping > 0 && luminance(color) > luminance_clamping) {
-      color = luminance_clamping / luminance(color) * color;
-    }
+    Vector3 color = clamp_luminance(trace(ray, rand));
     return PathContribution(offset.x, offset.y, color);
   }
 
+  // One sample in each pixel of |tile|, skipping converged pixels when
+  // sampling adaptively. Neighbouring pixels are traced together,
+  // intersecting camera rays as packets of |packet_size|.
+  void render_tile(const Tile &tile) {
+    std::vector<Vector2i> pixels;
+    for (int i = tile.begin.x; i < tile.end.x; i++) {
+      for (int j = tile.begin.y; j < tile.end.y; j++) {
+        if (!adaptive || !pixel_converged[i][j]) {
+          pixels.push_back(Vector2i(i, j));
+        }
+      }
+    }
+    int step = std::max(packet_size, 1);
+    for (int begin = 0; begin < (int)pixels.size(); begin += step) {
+      render_packet(&pixels[begin],
+                    std::min(step, (int)pixels.size() - begin));
+    }
+  }
+
+  // Primary hit cache, for material edits: with "primary_hit_cache" = K > 0
+  // (and packets), the camera rays and first hits of the first K stages
+  // after a restart are kept, and stage s replays the jitter pattern (and
+  // lens sample) of stage s mod K; the rest of the path uses the dimensions
+  // of sample s as usual. Pixels are thus estimated at K fixed positions.
+  // Entries take sizeof(PrimaryHit) (~300) bytes each, K per pixel, and are
+  // dropped on set_scene() and update_scene(), but not material_changed().
+  struct PrimaryHit {
+    Ray ray;
+    IntersectionInfo info;
+    // Dimensions taken by the camera
+    int cursor;
+  };
+
+  int primary_hit_patterns;
+  // Entry pattern * width * height + pixel
+  std::vector<PrimaryHit> primary_hits;
+  std::vector<uint8> primary_hit_cached;
+  // Of this stage; -1 without the cache
+  int primary_hit_pattern = -1;
+
+  void clear_primary_hit_cache() {
+    primary_hits = std::vector<PrimaryHit>();
+    primary_hit_cached = std::vector<uint8>();
+  }
+
+  void prepare_primary_hit_cache() {
+    primary_hit_pattern = -1;
+    if (primary_hit_patterns <= 0 || packet_size <= 1) {
+      return;
+    }
+    std::size_t num_entries =
+        (std::size_t)primary_hit_patterns * width * height;
+    if (primary_hits.size() != num_entries) {
+      primary_hits.resize(num_entries);
+      primary_hit_cached.assign(num_entries, 0);
+    }
+    long long pixels = (long long)width * height;
+    long long stage = (index - worker_id * pixels) / (num_workers * pixels);
+    primary_hit_pattern = (int)(stage % primary_hit_patterns);
+  }
+
+  // Samples |count| pixels, using sample |index| + (linear pixel index)
+  void render_packet(const Vector2i *pixels, int count) {
+    // The temporaries of the packet are on the arena of the thread
+    ArenaScope arena_scope;
+    ArenaVector<RandomStateSequence> rands;
+    ArenaVector<Ray> rays(count);
+    ArenaVector<IntersectionInfo> hits(count);
+    // Samples to intersect, and their cache entries (-1 if not caching);
+    // their camera rays are generated together
+    ArenaVector<int> traced;
+    ArenaVector<long long> entries;
+    ArenaVector<Vector2> offsets;
+    ArenaVector<real> camera_samples;
+    int camera_dims = camera->get_sample_dimensions();
+    rands.reserve(count);
+    traced.reserve(count);
+    entries.reserve(count);
+    offsets.reserve(count);
+    camera_samples.reserve(count * camera_dims);
+    Vector2 size(1.0_f / width, 1.0_f / height);
+    for (int i = 0; i < count; i++) {
+      long long pixel = (long long)pixels[i].x * height + pixels[i].y;
+      rands.emplace_back(sampler, index + pixel);
+      long long entry =
+          primary_hit_pattern < 0
+              ? -1
+              : primary_hit_pattern * (long long)width * height + pixel;
+      if (entry >= 0 && primary_hit_cached[entry]) {
+        const PrimaryHit &hit = primary_hits[entry];
+        rays[i] = hit.ray;
+        hits[i] = hit.info;
+        rands[i].skip(hit.cursor);
+        continue;
+      }
+      offsets.push_back(Vector2(pixels[i].x * size.x, pixels[i].y * size.y));
+      for (int k = 0; k < camera_dims; k++) {
+        camera_samples.push_back(rands[i]());
+      }
+      traced.push_back(i);
+      entries.push_back(entry);
+    }
+    int n = (int)traced.size();
+    if (n == count) {
+      camera->generate_rays(&offsets[0], size, &camera_samples[0], n,
+                            &rays[0]);
+      if (packet_size > 1) {
+        sg->query_batch(&rays[0], count, &hits[0]);
+      }
+    } else if (n > 0) {
+      ArenaVector<Ray> traced_rays(n);
+      ArenaVector<IntersectionInfo> traced_hits(n);
+      camera->generate_rays(&offsets[0], size, &camera_samples[0], n,
+                            &traced_rays[0]);
+      // Cached pixels come with packets only
+      sg->query_batch(&traced_rays[0], n, &traced_hits[0]);
+      for (int k = 0; k < n; k++) {
+        rays[traced[k]] = traced_rays[k];
+        hits[traced[k]] = traced_hits[k];
+      }
+    }
+    for (int k = 0; k < (int)traced.size(); k++) {
+      if (entries[k] >= 0) {
+        int i = traced[k];
+        primary_hits[entries[k]] =
+            PrimaryHit{rays[i], hits[i], rands[i].get_cursor()};
+        primary_hit_cached[entries[k]] = 1;
+      }
+    }
+    for (int i = 0; i < count; i++) {
+      Vector3 color;
+      if (packet_size > 1) {
+        real pixel_estimate =
+            pixel_estimates.empty()
+                ? 0.0_f
+                : pixel_estimates[pixels[i].x][pixels[i].y];
+        color = trace_from(rays[i], hits[i], rands[i], pixel_estimate);
+      } else {
+        // Subclasses may override trace()
+        color = trace(rays[i], rands[i]);
+      }
+      color = clamp_luminance(color);
+      write_path_contribution(PathContribution((pixels[i].x + 0.5_f) * size.x,
+                                               (pixels[i].y + 0.5_f) * size.y,
+                                               color));
+    }
+  }
+
   virtual Vector3 trace(Ray ray, StateSequence &rand);
 
+  // Continues a path whose first intersection |info| along |ray| is known.
+  // |pixel_estimate| is the luminance of its pixel so far, for adjoint-driven
+  // Russian roulette; 0 if unknown.
+  Vector3 trace_from(Ray ray,
+                     IntersectionInfo info,
+                     StateSequence &rand,
+                     real pixel_estimate = 0);
+
+  // A bounce of a path, for the radiance it finds after it
+  struct GuidingVertex {
+    Vector3 pos, dir;
+    // Of the path, up to the bounce and from it on
+    Vector3 ret, importance;
+    real pdf;
+  };
+
+  // State of a path between two bounces of trace_from.
+  struct PathState {
+    Ray ray;  // Next ray to intersect
+    Vector3 ret, importance;
+    VolumeStack stack;
+    int path_length;
+    int depth;
+    // Recorded while the guide is trained
+    ArenaVector<GuidingVertex> *guiding_vertices = nullptr;
+    real pixel_estimate = 0;
+    // Set by path_step if the path may split, to the number of copies of it
+    // that continue from |ray|, each with its share of |importance|
+    bool can_split = false;
+    int splits = 1;
+  };
+
+  // Returns false if the path is empty (max_path_length < 1).
+  bool start_path(PathState &path, const Ray &ray);
+
+  // Processes one bounce, given the intersection |info| of |path.ray| with the
+  // scene. Returns false once the path has terminated.
+  bool path_step(PathState &path,
+                 const IntersectionInfo &info,
+                 StateSequence &rand);
+
   virtual void write_path_contribution(const PathContribution &cont,
                                        real scale = 1.0_f) {
     auto x = clamp(cont.x, 0.0_f, 1.0_f - 1e-7_f);
@@ -196,11 +599,72 @@ class PathTracingRenderer : public Renderer {
     accumulator.accumulate(int(x * width), int(y * height), cont.c *scale);
   }
 
-  virtual Vector3 get_attenuation(VolumeStack stack,
+  // Any-hit shadow ray from |ray.orig| to a point sampled on |light|, or to
+  // the environment map if |light| is nullptr, through the surfaces of fixed
+  // transmittance (e.g. cut-outs), in one traversal. On success |att| is
+  // their transmittance and |light_info| is filled as if the ray had hit
+  // the light. Returns false if anything else is in the way or the fast
+  // path does not apply; the caller should then fall back to
+  // get_attenuation, which samples the surfaces in order. No sample is
+  // drawn here, as hits come in traversal order, within which they may
+  // repeat, so the fallback sees the same sequence either way.
+  bool test_light_visibility(const VolumeStack &stack,
+                             const Ray &ray,
+                             const Triangle *light,
+                             const Vector3 &light_pos,
+                             Vector3 &att,
+                             IntersectionInfo &light_info) {
+    if (!shadow_ray_fast_path || stack.size() == 0 ||
+        !stack.top()->is_vacuum()) {
+      return false;
+    }
+    Ray shadow_ray = ray;
+    if (light != nullptr) {
+      // Stop short of the light so that it does not occlude itself.
+      shadow_ray.dist = length(light_pos - ray.orig) * (1.0_f - 1e-4_f);
+    }
+    // Hits may repeat; each surface passed is counted once
+    static thread_local std::vector<std::pair<int, int>> passed;
+    passed.clear();
+    Vector3 transmittance(1.0_f);
+    bool blocked = sg->occlude_filtered(
+        shadow_ray, [&](const IntersectionInfo &hit) {
+          auto id = std::make_pair(hit.instance_id, hit.triangle_id);
+          if (std::find(passed.begin(), passed.end(), id) != passed.end()) {
+            return false;
+          }
+          BSDF bsdf(scene, hit);
+          Vector3 pass;
+          if (bsdf.is_emissive() ||
+              !bsdf.get_fixed_transmittance(-ray.dir, pass)) {
+            return true;
+          }
+          transmittance *= pass;
+          passed.push_back(id);
+          return false;
+        });
+    if (blocked) {
+      return false;
+    }
+    att = transmittance;
+    if (light != nullptr) {
+      Ray hit = ray;
+      light->get_coord(light_pos, hit.u, hit.v);
+      hit.dist = length(light_pos - ray.orig);
+      light_info = scene->get_intersection_info(light->id, hit);
+    } else {
+      light_info = IntersectionInfo();
+    }
+    return true;
+  }
+
+  virtual Vector3 get_attenuation(const VolumeStack &volumes,
                                   Ray ray,
                                   StateSequence &rand,
                                   IntersectionInfo &last_intersection) {
     Vector3 att(1.0_f);
+    // Through index-matched surfaces; an inline copy
+    VolumeStack stack = volumes;
 
     for (int i = 0; i < 100; i++) {
       if (stack.size() == 0) {
@@ -242,7 +706,9 @@ class PathTracingRenderer : public Renderer {
               // with a cube...)
               return Vector3(0.0_f);
             }
-            stack.push(bsdf.get_internal_material());
+            if (!stack.push(bsdf.get_internal_material())) {
+              return Vector3(0.0_f);
+            }
           } else {
             if (stack.top() != bsdf.get_internal_material()) {
               // Same as above...
@@ -258,14 +724,269 @@ class PathTracingRenderer : public Renderer {
     return att;
   }
 
+  // Path guiding: over the first |guiding_iterations| iterations, of 1, 2,
+  // 4, ... stages, paths record the radiance they find into |guide|, which
+  // the next iterations sample from, with |guiding_bsdf_fraction| of the
+  // directions still from the BSDF
+  bool guiding;
+  int guiding_iterations;
+  int guiding_iteration, guiding_stage;
+  real guiding_bsdf_fraction;
+  int64 guiding_spatial_threshold;
+  real guiding_directional_threshold;
+  std::unique_ptr<PathGuide> guide;
+
+  bool is_training_guide() const {
+    return guide != nullptr && guiding_iteration < guiding_iterations;
+  }
+
+  void initialize_guide() {
+    Vector3 lower(std::numeric_limits<real>::max());
+    Vector3 upper(-std::numeric_limits<real>::max());
+    auto add = [&](const Vector3 &v) {
+      for (int k = 0; k < 3; k++) {
+        lower[k] = std::min(lower[k], v[k]);
+        upper[k] = std::max(upper[k], v[k]);
+      }
+    };
+    for (auto &v : scene->vertex_buffer) {
+      add(Vector3(v.x, v.y, v.z));
+    }
+    for (auto &instance : scene->instances) {
+      for (auto &v : scene->prototypes[instance.prototype].vertex_buffer) {
+        add(multiply_matrix4(instance.transform, Vector3(v.x, v.y, v.z),
+                             1.0_f));
+      }
+    }
+    if (!(lower.x <= upper.x)) {
+      lower = upper = Vector3(0.0_f);
+    }
+    guide = std::make_unique<PathGuide>();
+    guide->initialize(lower, upper);
+    guiding_iteration = 0;
+    guiding_stage = 0;
+  }
+
+  // Ends an iteration of the training after its stages
+  void update_guide() {
+    if (!is_training_guide() || ++guiding_stage < (1 << guiding_iteration)) {
+      return;
+    }
+    // As the samples double, so does the threshold by sqrt(2)
+    guide->update((int64)(guiding_spatial_threshold *
+                          std::sqrt(real(1 << guiding_iteration))),
+                  guiding_directional_threshold, num_threads);
+    guiding_iteration += 1;
+    guiding_stage = 0;
+    TC_TRACE("Path guiding iteration {}: {} spatial leaves", guiding_iteration,
+             guide->get_num_leaves());
+  }
+
+  // Incident radiance along the direction of every vertex, from what the
+  // path gathered after it, divided by the pdf of the direction
+  void record_guiding_path(const ArenaVector<GuidingVertex> &vertices,
+                           const Vector3 &ret) {
+    for (auto &vertex : vertices) {
+      Vector3 radiance = ret - vertex.ret;
+      for (int k = 0; k < 3; k++) {
+        radiance[k] = vertex.importance[k] > 0
+                          ? radiance[k] / vertex.importance[k]
+                          : 0.0_f;
+      }
+      guide->record(vertex.pos, vertex.dir, luminance(radiance) / vertex.pdf);
+    }
+  }
+
+  // Samples |out_dir| at a surface from the BSDF, or from the mixture of
+  // the BSDF and the guide, with the pdf of the mixture
+  void sample_direction(const IntersectionInfo &info,
+                        const BSDF &bsdf,
+                        const Vector3 &in_dir,
+                        StateSequence &rand,
+                        Vector3 &out_dir,
+                        Vector3 &f,
+                        real &pdf,
+                        SurfaceEvent &event) const {
+    const DirectionalQuadtree *tree = nullptr;
+    if (guide != nullptr && !bsdf.is_delta() && !bsdf.is_index_matched()) {
+      tree = guide->get_sampling_tree(info.pos);
+    }
+    if (tree == nullptr) {
+      bsdf.sample(in_dir, rand(), rand(), out_dir, f, pdf, event);
+      return;
+    }
+    const real alpha = guiding_bsdf_fraction;
+    if (rand() < alpha) {
+      bsdf.sample(in_dir, rand(), rand(), out_dir, f, pdf, event);
+      if (SurfaceEventClassifier::is_delta(event)) {
+        // Which the guide never samples
+        pdf *= alpha;
+        return;
+      }
+    } else {
+      out_dir = tree->sample(rand(), rand());
+      event = (SurfaceEvent)SurfaceScatteringFlags::non_delta;
+    }
+    f = bsdf.evaluate(in_dir, out_dir);
+    pdf = alpha * bsdf.probability_density(in_dir, out_dir) +
+          (1 - alpha) * tree->pdf(out_dir);
+  }
+
+  // Adjoint-driven Russian roulette and splitting (after Vorba and Krivanek,
+  // "Adjoint-Driven Russian Roulette and Splitting in Light Transport
+  // Simulation"): the expected contribution of a path, its importance times
+  // the radiance that the guide estimates along its ray, is kept within a
+  // window of size |weight_window_size| around the luminance its pixel has
+  // so far. Below, the path survives with the ratio of the two; above, it is
+  // split into up to |max_splitting| paths. Without estimates, the roulette
+  // is by the importance alone.
+  bool adjoint_russian_roulette;
+  real weight_window_size;
+  int max_splitting;
+  Array2D<real> pixel_estimates;
+  // Of the branches a path has split into, to bound its cost
+  static constexpr int max_branches = 64;
+
+  bool is_using_adjoint() const {
+    return adjoint_russian_roulette && guide != nullptr &&
+           guiding_iteration > 0;
+  }
+
+  void update_pixel_estimates() {
+    if (!is_using_adjoint()) {
+      pixel_estimates = Array2D<real>();
+      return;
+    }
+    auto image = accumulator.get_averaged();
+    pixel_estimates.initialize(Vector2i(width, height));
+    for (auto &ind : image.get_region()) {
+      pixel_estimates[ind] = luminance(image[ind]);
+    }
+  }
+
+  // Returns false if the path is terminated
+  bool russian_roulette_and_splitting(PathState &path,
+                                      const Ray &ray,
+                                      StateSequence &rand) {
+    real p = luminance(path.importance);
+    real radiance = 0;
+    if (path.pixel_estimate > 0 && is_using_adjoint()) {
+      radiance = guide->estimate_radiance(ray.orig, ray.dir);
+    }
+    if (radiance > 0) {
+      // Of the expected contribution to the pixel's, with the window
+      // centered at 1
+      real ratio = p * radiance / path.pixel_estimate;
+      real lower = 2 / (1 + weight_window_size);
+      if (ratio < lower) {
+        if (rand() < ratio) {
+          path.importance *= 1.0_f / ratio;
+        } else {
+          TC_STAT("russian_roulette_terminations", 1);
+          return false;
+        }
+      } else if (ratio > lower * weight_window_size && path.can_split) {
+        int n = std::min((int)ratio, max_splitting);
+        if (n > 1) {
+          TC_STAT("path_splits", n - 1);
+          path.importance *= 1.0_f / n;
+          path.splits = n;
+        }
+      }
+      return true;
+    }
+    if (russian_roulette && p <= 1) {
+      if (rand() < p) {
+        path.importance *= 1.0_f / p;
+      } else {
+        TC_STAT("russian_roulette_terminations", 1);
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Adaptive sampling: after |min_samples| samples, a pixel stops being
+  // sampled once the relative standard error of its luminance is below
+  // |relative_error_threshold|, and a tile once all its pixels have.
+  bool adaptive;
+  real relative_error_threshold;
+  int min_samples;
+  std::vector<int> active_tiles;
+  Array2D<int> pixel_converged;
+
+  void reset_adaptive_sampling() {
+    active_tiles.resize(tiles.size());
+    for (int t = 0; t < (int)tiles.size(); t++) {
+      active_tiles[t] = t;
+    }
+    pixel_converged.initialize(Vector2i(width, height), 0);
+  }
+
+  // Converged pixels stay converged; tiles are indexed anew
+  void tiles_changed(bool crop_changed) override {
+    if (adaptive) {
+      active_tiles.resize(tiles.size());
+      for (int t = 0; t < (int)tiles.size(); t++) {
+        active_tiles[t] = t;
+      }
+      retire_converged_tiles();
+    }
+  }
+
+  void retire_converged_tiles() {
+    accumulator.flush();
+    std::vector<int> still_active;
+    for (int t : active_tiles) {
+      const Tile &tile = tiles[t];
+      bool converged = true;
+      for (int i = tile.begin.x; i < tile.end.x; i++) {
+        for (int j = tile.begin.y; j < tile.end.y; j++) {
+          if (!pixel_converged[i][j] &&
+              accumulator.get_count(i, j) >= min_samples &&
+              accumulator.get_relative_error(i, j) <
+                  relative_error_threshold) {
+            pixel_converged[i][j] = 1;
+          }
+          converged = converged && pixel_converged[i][j];
+        }
+      }
+      if (!converged) {
+        still_active.push_back(t);
+      }
+    }
+    active_tiles = still_active;
+  }
+
   bool direct_lighting;
+  bool shadow_ray_fast_path;
+  bool use_light_bvh;
+  int packet_size;
   int direct_lighting_bsdf;
   int direct_lighting_light;
+  // Light samples are resampled out of this many candidates if > 0
+  int direct_lighting_candidates;
+  bool spherical_light_sampling;
   ImageAccumulator<Vector3> accumulator;
   std::shared_ptr<Sampler> sampler;
   long long index;
   real luminance_clamping;
   bool envmap_is;
+
+  TC_RENDERER_CHECKPOINT
+
+  template <typename S>
+  void checkpoint_io(S &serializer) {
+    std::vector<uint8> samples;
+    if (TC_SERIALIZER_IS(BinaryOutputSerializer)) {
+      samples = accumulator.to_binary();
+    }
+    TC_IO(samples, index, active_tiles, pixel_converged);
+    if (TC_SERIALIZER_IS(BinaryInputSerializer)) {
+      accumulator = ImageAccumulator<Vector3>();
+      accumulator.accumulate_binary(samples);
+    }
+  }
 };
 
 void PathTracingRenderer::initialize(const Config &config) {
@@ -273,28 +994,64 @@ void PathTracingRenderer::initialize(const Config &config) {
   this->direct_lighting = config.get("direct_lighting", true);
   this->direct_lighting_light = config.get("direct_lighting_light", 1);
   this->direct_lighting_bsdf = config.get("direct_lighting_bsdf", 1);
+  this->direct_lighting_candidates =
+      config.get("direct_lighting_candidates", 0);
+  this->spherical_light_sampling =
+      config.get("spherical_light_sampling", true);
   assert_info(
       this->direct_lighting_bsdf > 0 || this->direct_lighting_light > 0,
       "Sum of direct_lighting_bsdf and direct_lighting_light should not be 0.");
-  this->sampler = create_instance<Sampler>(config.get("sampler", "prand"));
+  // Sample k of pixel p is instance k * width * height + p
+  this->sampler =
+      create_instance<Sampler>(config.get("sampler", "prand"),
+                               Config().set("num_pixels", width * height));
   this->luminance_clamping = config.get("luminance_clamping", 0.0_f);
   this->accumulator = ImageAccumulator<Vector3>(Vector2i(width, height));
   this->russian_roulette = config.get("russian_roulette", true);
   this->envmap_is = config.get("envmap_is", true);
-  index = 0;
+  this->shadow_ray_fast_path = config.get("shadow_ray_fast_path", true);
+  this->use_light_bvh = config.get("light_bvh", true);
+  this->packet_size = config.get("packet_size", 8);
+  this->primary_hit_patterns = config.get("primary_hit_cache", 0);
+  this->adaptive = config.get("adaptive", false);
+  this->relative_error_threshold =
+      config.get("relative_error_threshold", 0.02_f);
+  this->min_samples = config.get("min_samples", 16);
+  this->guiding = config.get("guiding", false);
+  this->guiding_iterations = config.get("guiding_iterations", 6);
+  this->guiding_bsdf_fraction = config.get("guiding_bsdf_fraction", 0.5_f);
+  this->guiding_spatial_threshold =
+      config.get("guiding_spatial_threshold", 12000);
+  this->guiding_directional_threshold =
+      config.get("guiding_directional_threshold", 0.01_f);
+  TC_ERROR_IF(guiding && !(guiding_bsdf_fraction > 0),
+              "guiding_bsdf_fraction must be positive");
+  this->adjoint_russian_roulette =
+      config.get("adjoint_russian_roulette", false);
+  this->weight_window_size = config.get("weight_window_size", 5.0_f);
+  this->max_splitting = config.get("max_splitting", 4);
+  if (adjoint_russian_roulette && !guiding) {
+    TC_WARN("Adjoint-driven Russian roulette needs the radiance estimates "
+            "of path guiding");
+    adjoint_russian_roulette = false;
+  }
+  TC_ERROR_IF(adjoint_russian_roulette && !(weight_window_size > 1),
+              "weight_window_size must be greater than 1");
+  index = (long long)worker_id * width * height;
+  reset_adaptive_sampling();
 }
 
 Vector3 PathTracingRenderer::calculate_volumetric_direct_lighting(
     const Vector3 &in_dir,
     const Vector3 &orig,
     StateSequence &rand,
-    VolumeStack &stack) {
+    const VolumeStack &stack) {
   Vector3 acc(0);
   real light_source_pdf;
   bool sample_envmap = false;
   const Triangle *p_triangle = nullptr;
   const EnvironmentMap *p_envmap = nullptr;
-  scene->sample_light_source(rand(), light_source_pdf, p_triangle, p_envmap);
+  sample_light_source(rand(), orig, light_source_pdf, p_triangle, p_envmap);
   Triangle tri;
   if (p_envmap) {
     sample_envmap = true;
@@ -319,7 +1076,7 @@ Vector3 PathTracingRenderer::calculate_volumetric_direct_lighting(
     Vector3 f;
     real bsdf_p;
     Vector3 dist;
-    auto vol = *stack.top();
+    const VolumeMaterial &vol = *stack.top();
     if (sample_bsdf) {
       // Sample BSDF
       out_dir = vol.sample_phase(rand, Ray(orig, in_dir));
@@ -331,7 +1088,7 @@ Vector3 PathTracingRenderer::calculate_volumetric_direct_lighting(
         real pdf;
         out_dir = p_envmap->sample_direction(rand, pdf, _);
       } else {
-        Vector3 pos = tri.sample_point(rand(), rand());
+        Vector3 pos = sample_light_point(tri, orig, rand(), rand());
         dist = pos - orig;
         out_dir = normalize(dist);
       }
@@ -340,7 +1097,12 @@ Vector3 PathTracingRenderer::calculate_volumetric_direct_lighting(
     }
     Ray ray(orig + out_dir * 1e-3_f, out_dir);
     IntersectionInfo test_info;
-    Vector3 att = get_attenuation(stack, ray, rand, test_info);
+    Vector3 att(1.0_f);
+    if (sample_bsdf ||
+        !test_light_visibility(stack, ray, sample_envmap ? nullptr : &tri,
+                               orig + dist, att, test_info)) {
+      att = get_attenuation(stack, ray, rand, test_info);
+    }
     if (att.max() == 0.0_f) {
       // Completely blocked.
       continue;
@@ -352,15 +1114,13 @@ Vector3 PathTracingRenderer::calculate_volumetric_direct_lighting(
     Vector3 throughput;
     if (test_info.intersected) {
       // Mesh light
-      const Triangle &light_tri = scene->get_triangle(test_info.triangle_id);
       BSDF light_bsdf(scene, test_info);
       if (!light_bsdf.is_emissive() || !test_info.front) {
         continue;
       }
-      real c = abs(dot(ray.dir, tri.normal));
-      dist = test_info.pos - orig;
-      light_p = dot(dist, dist) / std::max(1e-20_f, light_tri.area * c) *
-                scene->get_triangle_pdf(light_tri.id);
+      const Triangle &light_tri = scene->get_triangle(test_info.triangle_id);
+      light_p = get_light_point_pdf(light_tri, orig, test_info.pos) *
+                get_light_selection_pdf(light_tri.id, orig);
       const Vector3 emission = light_bsdf.evaluate(test_info.normal, -out_dir);
       throughput = f * co * emission * att;
     } else {
@@ -388,148 +1148,370 @@ Vector3 PathTracingRenderer::calculate_volumetric_direct_lighting(
 }
 
 Vector3 PathTracingRenderer::trace(Ray ray, StateSequence &rand) {
-  Vector3 ret(0);
-  Vector3 importance(1);
-  VolumeStack stack;
-  int path_length = 1;
-  if (scene->get_atmosphere_material()) {
-    stack.push(scene->get_atmosphere_material().get());
+  return trace_from(ray, sg->query(ray), rand);
+}
+
+Vector3 PathTracingRenderer::trace_from(Ray ray,
+                                        IntersectionInfo info,
+                                        StateSequence &rand,
+                                        real pixel_estimate) {
+  PathState path;
+  ArenaScope arena_scope;
+  ArenaVector<GuidingVertex> guiding_vertices;
+  // Split off the path, to continue from their rays after it
+  ArenaVector<PathState> branches;
+  if (is_training_guide()) {
+    path.guiding_vertices = &guiding_vertices;
   }
-  for (int depth = 1; path_length <= max_path_length; depth++) {
-    if (depth > 1000) {
-      TC_ERROR("path too long");
-    }
-    if (stack.size() == 0) {
-      // What's going on here...
-      TC_P(stack.size());
-      break;
-    }
-    const VolumeMaterial &volume = *stack.top();
-    IntersectionInfo info = sg->query(ray);
-    real safe_distance = volume.sample_free_distance(rand, ray);
-    Vector3 f(1.0_f);
-    Ray out_ray;
-    if (!info.intersected) {
-      if (scene->envmap && (path_length == 1 || !direct_lighting)) {
-        ret += importance * scene->envmap->sample_illum(ray.dir);
+  path.pixel_estimate = pixel_estimate;
+  int num_branches = 0;
+  Vector3 ret(0.0_f);
+  bool alive = start_path(path, ray);
+  while (true) {
+    while (alive) {
+      // The guide records paths whole
+      path.can_split =
+          path.guiding_vertices == nullptr && num_branches < max_branches;
+      alive = path_step(path, info, rand);
+      if (!alive) {
+        break;
       }
+      for (; path.splits > 1; path.splits--) {
+        branches.push_back(path);
+        branches.back().ret = Vector3(0.0_f);
+        branches.back().splits = 1;
+        num_branches++;
+      }
+      info = sg->query(path.ray);
+    }
+    ret += path.ret;
+    if (branches.empty()) {
       break;
     }
-    if (direct_lighting) {
-      // TOOD: add solid angle IS?
+    path = branches.back();
+    branches.pop_back();
+    info = sg->query(path.ray);
+    alive = true;
+  }
+  if (path.guiding_vertices != nullptr) {
+    record_guiding_path(guiding_vertices, ret);
+  }
+  return ret;
+}
+
+bool PathTracingRenderer::start_path(PathState &path, const Ray &ray) {
+  TC_STAT("paths", 1);
+  path.ray = ray;
+  path.ret = Vector3(0);
+  path.importance = Vector3(1);
+  path.path_length = 1;
+  path.depth = 1;
+  if (scene->get_atmosphere_material()) {
+    path.stack.push(scene->get_atmosphere_material().get());
+  }
+  return path.path_length <= max_path_length;
+}
+
+bool PathTracingRenderer::path_step(PathState &path,
+                                    const IntersectionInfo &info,
+                                    StateSequence &rand) {
+  const Ray &ray = path.ray;
+  Vector3 &ret = path.ret;
+  Vector3 &importance = path.importance;
+  VolumeStack &stack = path.stack;
+  int &path_length = path.path_length;
+  TC_STAT("path_vertices", 1);
+  if (path.depth > 1000) {
+    TC_ERROR("path too long");
+  }
+  if (stack.size() == 0) {
+    // What's going on here...
+    TC_P(stack.size());
+    return false;
+  }
+  const VolumeMaterial &volume = *stack.top();
+  real safe_distance = volume.sample_free_distance(rand, ray);
+  Vector3 f(1.0_f);
+  Ray out_ray;
+  // With the pdf of its direction, if the bounce is recorded for the guide
+  real guiding_pdf = 0;
+  if (!info.intersected) {
+    if (scene->envmap && (path_length == 1 || !direct_lighting)) {
+      ret += importance * scene->envmap->sample_illum(ray.dir);
     }
-    if (info.dist < safe_distance) {
-      // Safely travels to the next surface...
+    return false;
+  }
+  if (direct_lighting) {
+    // TOOD: add solid angle IS?
+  }
+  if (info.dist < safe_distance) {
+    // Safely travels to the next surface...
 
-      // Attenuation
-      Vector3 att(volume.unbiased_sample_attenuation(ray.orig, info.pos, rand));
-      importance *= att;
+    // Attenuation
+    Vector3 att(volume.unbiased_sample_attenuation(ray.orig, info.pos, rand));
+    importance *= att;
 
-      BSDF bsdf(scene, info);
-      const Vector3 in_dir = -ray.dir;
-      if (bsdf.is_emissive()) {
-        // assert(stack.size() == 2);
-        bool count = info.front && (path_length == 1 || !direct_lighting);
-        if (count && path_length_in_range(path_length)) {
-          ret += importance * bsdf.evaluate(info.normal, in_dir);
-        }
-        break;
-      }
-      real pdf;
-      SurfaceEvent event;
-      Vector3 out_dir;
-      bsdf.sample(in_dir, rand(), rand(), out_dir, f, pdf, event);
-      bool index_matched = SurfaceEventClassifier::is_index_matched(event);
-      if (!index_matched) {
-        path_length += 1;
-        if (direct_lighting && path_length_in_range(path_length)) {
-          ret += importance *
-                 calculate_direct_lighting(in_dir, info, bsdf, rand, stack);
-        }
+    BSDF bsdf(scene, info);
+    const Vector3 in_dir = -ray.dir;
+    if (bsdf.is_emissive()) {
+      // assert(stack.size() == 2);
+      bool count = info.front && (path_length == 1 || !direct_lighting);
+      if (count && path_length_in_range(path_length)) {
+        ret += importance * bsdf.evaluate(info.normal, in_dir);
       }
-      if (bsdf.is_entering(in_dir) && !bsdf.is_entering(out_dir)) {
-        if (bsdf.get_internal_material() != nullptr)
-          stack.push(bsdf.get_internal_material());
-      }
-      if (bsdf.is_entering(out_dir) && !bsdf.is_entering(in_dir)) {
-        if (bsdf.get_internal_material() != nullptr) {
-          stack.pop();
-        }
-      }
-      out_ray = Ray(info.pos + out_dir * 1e-4_f, out_dir, 1e-5_f);
-      real c = abs(dot(out_dir, info.normal));
-      if (pdf < 1e-10f) {
-        break;
-      }
-      f *= Vector3(c / pdf);
-    } else if (volume.sample_event(
-                   rand, Ray(ray.orig + ray.dir * safe_distance, ray.dir)) ==
-               VolumeEvent::scattering) {
-      // Volumetric scattering
+      return false;
+    }
+    real pdf;
+    SurfaceEvent event;
+    Vector3 out_dir;
+    sample_direction(info, bsdf, in_dir, rand, out_dir, f, pdf, event);
+    bool index_matched = SurfaceEventClassifier::is_index_matched(event);
+    if (!index_matched) {
       path_length += 1;
-      const Vector3 orig = ray.orig + ray.dir * safe_distance;
-      const Vector3 in_dir = -ray.dir;
-      if (direct_lighting && path_length_in_range(path_length + 1)) {
-        // TC_P(stack.size());
+      if (direct_lighting && path_length_in_range(path_length)) {
         ret += importance *
-               calculate_volumetric_direct_lighting(in_dir, orig, rand, stack);
+               calculate_direct_lighting(in_dir, info, bsdf, rand, stack);
       }
-      Vector3 out_dir = volume.sample_phase(rand, Ray(orig, ray.dir));
-      out_ray = Ray(orig, out_dir, 1e-5_f);
-      f = Vector3(1.0_f);
-    } else {
-      // Volumetric absorption
-      break;
     }
-    ray = out_ray;
-    importance *= f;
-    if (russian_roulette) {
-      real p = luminance(importance);
-      if (p <= 1) {
-        if (rand() < p) {
-          importance *= 1.0_f / p;
-        } else {
-          break;
-        }
+    if (bsdf.is_entering(in_dir) && !bsdf.is_entering(out_dir)) {
+      if (bsdf.get_internal_material() != nullptr &&
+          !stack.push(bsdf.get_internal_material())) {
+        // Nested too deeply
+        return false;
+      }
+    }
+    if (bsdf.is_entering(out_dir) && !bsdf.is_entering(in_dir)) {
+      if (bsdf.get_internal_material() != nullptr) {
+        stack.pop();
       }
     }
+    out_ray = Ray(info.pos + out_dir * 1e-4_f, out_dir, 1e-5_f);
+    real c = abs(dot(out_dir, info.normal));
+    if (pdf < 1e-10f) {
+      return false;
+    }
+    f *= Vector3(c / pdf);
+    if (!index_matched && !SurfaceEventClassifier::is_delta(event)) {
+      guiding_pdf = pdf;
+    }
+  } else if (volume.sample_event(
+                 rand, Ray(ray.orig + ray.dir * safe_distance, ray.dir)) ==
+             VolumeEvent::scattering) {
+    // Volumetric scattering
+    path_length += 1;
+    const Vector3 orig = ray.orig + ray.dir * safe_distance;
+    const Vector3 in_dir = -ray.dir;
+    if (direct_lighting && path_length_in_range(path_length + 1)) {
+      // TC_P(stack.size());
+      ret += importance *
+             calculate_volumetric_direct_lighting(in_dir, orig, rand, stack);
+    }
+    Vector3 out_dir = volume.sample_phase(rand, Ray(orig, ray.dir));
+    out_ray = Ray(orig, out_dir, 1e-5_f);
+    f = Vector3(1.0_f);
+  } else {
+    // Volumetric absorption
+    return false;
   }
-  return ret;
+  path.ray = out_ray;
+  importance *= f;
+  if (!russian_roulette_and_splitting(path, out_ray, rand)) {
+    return false;
+  }
+  if (path.guiding_vertices != nullptr && guiding_pdf > 0) {
+    path.guiding_vertices->push_back(
+        GuidingVertex{info.pos, out_ray.dir, ret, importance, guiding_pdf});
+  }
+  path.depth += 1;
+  return path_length <= max_path_length;
 }
 
 TC_IMPLEMENTATION(Renderer, PathTracingRenderer, "pt");
 
+// Breadth-first ("wavefront") variant of PathTracingRenderer: all paths of a
+// wavefront advance one bounce at a time. Each bounce is split into an
+// intersection stage (packet queries), a shading stage (including shadow rays
+// of direct lighting) and compaction; contributions are accumulated at the
+// end. Paths are sorted by hit triangle before shading. Triangle ids are
+// contiguous per mesh, so this groups paths by material and, roughly, by
+// position. Per-path sample sequences are the same as in "pt".
+class WavefrontPathTracingRenderer : public PathTracingRenderer {
+ public:
+  void initialize(const Config &config) override {
+    PathTracingRenderer::initialize(config);
+    this->wavefront_size = config.get("wavefront_size", 1 << 16);
+    if (guiding) {
+      TC_WARN("Path guiding is not supported by pt_wavefront");
+      guiding = false;
+    }
+    this->packet_size = std::max(packet_size, 1);
+  }
+
+  // One sample per pixel of the crop window, at random positions in it
+  void render_stage() override {
+    int samples = get_crop_area();
+    for (int begin = 0; begin < samples; begin += wavefront_size) {
+      render_wavefront(index + begin,
+                       std::min(wavefront_size, samples - begin));
+    }
+    // As in "pt", so that crop windows draw the same sequences
+    index += (long long)num_workers * width * height;
+  }
+
+ protected:
+  int wavefront_size;
+
+  void render_wavefront(long long first_sample, int count) {
+    // The temporaries of the wavefront are on the arena of this thread
+    ArenaScope arena_scope;
+    ArenaVector<RandomStateSequence> rands;
+    ArenaVector<Vector2> offsets(count);
+    ArenaVector<PathState> paths(count);
+    ArenaVector<uint8> alive(count);
+    rands.reserve(count);
+    for (int i = 0; i < count; i++) {
+      rands.emplace_back(sampler, first_sample + i);
+    }
+
+    // Camera rays, generated in blocks
+    Vector2 size(1.0_f / width, 1.0_f / height);
+    Vector2 crop_offset = crop_begin.cast<real>() * size;
+    Vector2 crop_size = (crop_end - crop_begin).cast<real>() * size;
+    int camera_dims = camera->get_sample_dimensions();
+    ArenaVector<real> camera_samples(count * camera_dims);
+    ArenaVector<Ray> camera_rays(count);
+    constexpr int block_size = 256;
+    ThreadedTaskManager::run(
+        [&](int b) {
+          int begin = b * block_size;
+          int end = std::min(begin + block_size, count);
+          for (int i = begin; i < end; i++) {
+            StateSequence &rand = rands[i];
+            offsets[i] = crop_offset + Vector2(rand(), rand()) * crop_size;
+            for (int k = 0; k < camera_dims; k++) {
+              camera_samples[i * camera_dims + k] = rand();
+            }
+          }
+          camera->generate_rays(&offsets[begin], size,
+                                &camera_samples[begin * camera_dims],
+                                end - begin, &camera_rays[begin]);
+          for (int i = begin; i < end; i++) {
+            alive[i] = start_path(paths[i], camera_rays[i]);
+          }
+        },
+        0, (count + block_size - 1) / block_size, num_threads);
+    ArenaVector<int> active, next;
+    active.reserve(count);
+    next.reserve(count);
+    for (int i = 0; i < count; i++) {
+      if (alive[i]) {
+        active.push_back(i);
+      }
+    }
+
+    ArenaVector<Ray> rays;
+    ArenaVector<IntersectionInfo> hits;
+    ArenaVector<int> order;
+    rays.reserve(count);
+    hits.reserve(count);
+    order.reserve(count);
+    while (!active.empty()) {
+      int n = (int)active.size();
+      // Intersection
+      rays.resize(n);
+      hits.resize(n);
+      for (int k = 0; k < n; k++) {
+        rays[k] = paths[active[k]].ray;
+      }
+      int num_packets = (n + packet_size - 1) / packet_size;
+      ThreadedTaskManager::run(
+          [&](int p) {
+            int begin = p * packet_size;
+            sg->query_batch(&rays[begin], std::min(packet_size, n - begin),
+                            &hits[begin]);
+          },
+          0, num_packets, num_threads);
+
+      // Sort by hit triangle (i.e. mesh and material)
+      order.resize(n);
+      for (int k = 0; k < n; k++) {
+        order[k] = k;
+      }
+      std::sort(order.begin(), order.end(), [&](int a, int b) {
+        return std::make_pair(hits[a].instance_id, hits[a].triangle_id) <
+               std::make_pair(hits[b].instance_id, hits[b].triangle_id);
+      });
+
+      // Shading and shadow rays
+      ThreadedTaskManager::run(
+          [&](int j) {
+            int k = order[j];
+            int i = active[k];
+            alive[i] = path_step(paths[i], hits[k], rands[i]);
+          },
+          0, n, num_threads);
+
+      // Compaction, keeping the sorted order for the next bounce
+      next.clear();
+      for (int j = 0; j < n; j++) {
+        int i = active[order[j]];
+        if (alive[i]) {
+          next.push_back(i);
+        }
+      }
+      active.swap(next);
+    }
+
+    // Accumulation
+    ThreadedTaskManager::run(
+        [&](int i) {
+          write_path_contribution(PathContribution(
+              offsets[i].x, offsets[i].y, clamp_luminance(paths[i].ret)));
+        },
+        0, count, num_threads);
+  }
+};
+
+TC_IMPLEMENTATION(Renderer, WavefrontPathTracingRenderer, "pt_wavefront");
+
 class PTSDFRenderer final : public PathTracingRenderer {
  public:
   void initialize(const Config &config) override {
     PathTracingRenderer::initialize(config);
+    // Both camera and shadow rays have to be ray-marched against the SDF.
+    shadow_ray_fast_path = false;
+    packet_size = 1;
     Config cfg;
     cfg.set("color", Vector3(1, 1, 1));
     material = create_instance<SurfaceMaterial>("diffuse", cfg);
     sdf = AssetManager::get_asset<SDF>(config.get<int>("sdf"));
+    tracer.sdf = sdf.get();
+    tracer.eps = eps;
+    // Over-relaxation, and the stopping distance per unit of distance
+    tracer.omega = config.get("sdf_omega", 1.2_f);
+    tracer.cone = config.get("sdf_cone", 0.0_f);
+    // Empty-space skipping, over the bounds of the SDF's surfaces
+    if (config.has_key("sdf_grid_lower")) {
+      grid.initialize(*sdf, config.get<Vector3>("sdf_grid_lower"),
+                      config.get<Vector3>("sdf_grid_upper"),
+                      config.get("sdf_grid_resolution", 64), eps,
+                      num_threads);
+      tracer.grid = &grid;
+      TC_TRACE("SDF grid: {} empty cells", grid.get_num_empty_cells());
+    }
   }
 
  protected:
   std::shared_ptr<SDF> sdf;
   std::shared_ptr<SurfaceMaterial> material;
+  SDFEmptySpaceGrid grid;
+  SphereTracer tracer;
 
   real ray_march(const Ray &ray, real limit = 1e5) {
-    real dist = 0;
-    for (int i = 0; i < 1000; i++) {
-      const Vector3 p = ray.orig + dist * ray.dir;
-      real d = sdf->eval(p);
-      if (d < eps) {
-        break;
-      }
-      dist += d;
-      if (dist > limit) {
-        break;
-      }
-    }
-    return dist;
+    return tracer.march(ray.orig, ray.dir, limit);
   }
 
-  Vector3 get_attenuation(VolumeStack stack,
+  Vector3 get_attenuation(const VolumeStack &stack,
                           Ray ray,
                           StateSequence &rand,
                           IntersectionInfo &last_intersection) override {
@@ -542,14 +1524,7 @@ class PTSDFRenderer final : public PathTracingRenderer {
   }
 
   Vector3 normal_at(const Vector3 p, const real d) {
-    Vector3 n = Vector3(
-        sdf->eval(p + Vector3(d, 0, 0)) - sdf->eval(p - Vector3(d, 0, 0)),
-        sdf->eval(p + Vector3(0, d, 0)) - sdf->eval(p - Vector3(0, d, 0)),
-        sdf->eval(p + Vector3(0, 0, d)) - sdf->eval(p - Vector3(0, 0, d)));
-    if (dot(n, n) < 1e-20f) {
-      return Vector3(1, 0, 0);
-    }
-    return normalized(n);
+    return get_sdf_normal(*sdf, p, d);
   }
 
   IntersectionInfo query_geometry(const Ray &ray) {
@@ -601,10 +1576,12 @@ class PTSDFRenderer final : public PathTracingRenderer {
     if (scene->get_atmosphere_material()) {
       stack.push(scene->get_atmosphere_material().get());
     }
+    TC_STAT("paths", 1);
     for (int depth = 1; path_length <= max_path_length; depth++) {
       if (depth > 1000) {
         TC_ERROR("path too long");
       }
+      TC_STAT("path_vertices", 1);
       // TODO: why unused?
       // const VolumeMaterial &volume = *stack.top();
       IntersectionInfo info = query_geometry(ray);
@@ -652,6 +1629,7 @@ class PTSDFRenderer final : public PathTracingRenderer {
           if (rand() < p) {
             importance *= 1.0_f / p;
           } else {
+            TC_STAT("russian_roulette_terminations", 1);
             break;
           }
         }
@@ -663,55 +1641,10 @@ class PTSDFRenderer final : public PathTracingRenderer {
 
 TC_IMPLEMENTATION(Renderer, PTSDFRenderer, "pt_sdf");
 
-class PSSMLTMarkovChain : public MarkovChain {
- public:
-  real resolution_x, resolution_y;
-
-  PSSMLTMarkovChain() : PSSMLTMarkovChain(0, 0) {
-  }
-
-  PSSMLTMarkovChain(real resolution_x, real resolution_y)
-      : resolution_x(resolution_x), resolution_y(resolution_y) {
-  }
-
-  PSSMLTMarkovChain large_step() const {
-    return PSSMLTMarkovChain(resolution_x, resolution_y);
-  }
-
-  PSSMLTMarkovChain mutate(real strength = 1.0_f) const {
-    PSSMLTMarkovChain result(*this);
-    // Pixel location
-    real delta_pixel = 2.0f / (resolution_x + resolution_y);
-    result.get_state(2);
-    result.states[0] =
-        perturb(result.states[0], delta_pixel * strength, 0.1f * strength);
-    result.states[1] =
-        perturb(result.states[1], delta_pixel * strength, 0.1f * strength);
-    // Events
-    for (int i = 2; i < (int)result.states.size(); i++)
-      result.states[i] = perturb(result.states[i], 1.0_f / 1024.0f * strength,
-                                 1.0_f / 64.0f * strength);
-    return result;
-  }
-
- protected:
-  inline static real perturb(const real value, const real s1, const real s2) {
-    real result;
-    real r = rand();
-    if (r < 0.5f) {
-      r = r * 2.0f;
-      result = value + s2 * exp(-log(s2 / s1) * r);
-    } else {
-      r = (r - 0.5f) * 2.0f;
-      result = value - s2 * exp(-log(s2 / s1) * r);
-    }
-    result -= floor(result);
-    return result;
-  }
-};
-
 class MCMCPTRenderer : public PathTracingRenderer {
  protected:
+  TC_RENDERER_NO_CHECKPOINT
+
   struct MCMCState {
     PSSMLTMarkovChain chain;
     PathContribution pc;
@@ -735,6 +1668,7 @@ class MCMCPTRenderer : public PathTracingRenderer {
   real mutation_strength;
   long long sample_count;
   Array2D<Vector3> buffer;
+  PCG32 rng;
 
  public:
   Array2D<Vector3> get_output() override {
@@ -755,6 +1689,14 @@ class MCMCPTRenderer : public PathTracingRenderer {
     sample_count = 0;
   }
 
+  // The chain restarts from a new estimate of the normalizer
+  void reset_accumulation() override {
+    PathTracingRenderer::reset_accumulation();
+    buffer.reset(Vector3(0.0_f));
+    sample_count = 0;
+    first_stage_done = false;
+  }
+
   real scalar_contribution_function(const PathContribution &pc) {
     return luminance(pc.c);
   }
@@ -783,6 +1725,7 @@ class MCMCPTRenderer : public PathTracingRenderer {
       b = total_sc / num_samples;
       TC_P(b);
       current_state.chain = PSSMLTMarkovChain((real)width, (real)height);
+      current_state.chain.set_rng(&rng);
       auto rand = MCStateSequence(current_state.chain);
       current_state.pc = get_path_contribution(rand);
       current_state.sc = scalar_contribution_function(current_state.pc);
@@ -791,7 +1734,7 @@ class MCMCPTRenderer : public PathTracingRenderer {
     MCMCState new_state;
     for (int k = 0; k < width * height; k++) {
       real is_large_step;
-      if (rand() <= large_step_prob) {
+      if (rng.next() <= large_step_prob) {
         new_state.chain = current_state.chain.large_step();
         is_large_step = 1.0;
       } else {
@@ -817,7 +1760,7 @@ class MCMCPTRenderer : public PathTracingRenderer {
             real((1.0 - a) / (current_state.sc / b + large_step_prob)));
       }
       // conditionally accept the chain
-      if (rand() <= a) {
+      if (rng.next() <= a) {
         current_state = new_state;
       }
       sample_count += 1;
@@ -0,0 +1,186 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#include <taichi/visual/renderer.h>
+
+#if defined(TC_USE_CUDA)
+
+#include <taichi/system/threading.h>
+#include <taichi/visual/bvh.h>
+#include <taichi/visual/sampler.h>
+#include <taichi/visual/surface_material.h>
+#include "pt_cuda.h"
+
+TC_NAMESPACE_BEGIN
+
+static_assert(sizeof(BVH::Node) == sizeof(CUDAPathTracer::Node),
+              "Device nodes should be those of BVH");
+
+// "pt" on the GPU, for previews and simple final frames. The triangles of
+// the scene are exported with their materials reduced to a diffuse albedo
+// (or an emission), estimated at the center of each triangle; instances,
+// the environment map and textures within a triangle are not rendered.
+// Camera rays are generated on the host by the camera and sampler of "pt",
+// and the samples are accumulated on the device.
+class CUDAPathTracingRenderer : public Renderer {
+ public:
+  void initialize(const Config &config) override {
+    Renderer::initialize(config);
+    this->sampler =
+        create_instance<Sampler>(config.get("sampler", "prand"),
+                                 Config().set("num_pixels", width * height));
+    export_scene();
+    device.reset(width * height);
+    stage = worker_id;
+    num_stages = 0;
+  }
+
+  void update_scene() override {
+    Renderer::update_scene();
+    export_scene();
+  }
+
+  void reset_accumulation() override {
+    device.reset(width * height);
+    stage = worker_id;
+    num_stages = 0;
+  }
+
+  void render_stage() override {
+    rays.resize(6 * width * height);
+    Vector2 size(1.0_f / width, 1.0_f / height);
+    ThreadedTaskManager::run(width, num_threads, [&](int i) {
+      for (int j = 0; j < height; j++) {
+        int pixel = i * height + j;
+        RandomStateSequence rand(sampler,
+                                 (long long)stage * width * height + pixel);
+        Vector2 offset(i * size.x, j * size.y);
+        Ray ray = camera->sample(offset, size, rand);
+        for (int k = 0; k < 3; k++) {
+          rays[6 * pixel + k] = (float32)ray.orig[k];
+          rays[6 * pixel + 3 + k] = (float32)ray.dir[k];
+        }
+      }
+    });
+    device.render(rays.data(), min_path_length, max_path_length,
+                  (unsigned)stage);
+    stage += num_workers;
+    num_stages++;
+  }
+
+  Array2D<Vector3> get_output() override {
+    Array2D<Vector3> output(Vector2i(width, height), Vector3(0.0_f));
+    if (num_stages == 0) {
+      return output;
+    }
+    std::vector<float32> sums(3 * width * height);
+    device.get_sums(sums.data());
+    real inv = 1.0_f / num_stages;
+    for (int i = 0; i < width; i++) {
+      for (int j = 0; j < height; j++) {
+        int pixel = i * height + j;
+        output[i][j] = inv * Vector3(sums[3 * pixel], sums[3 * pixel + 1],
+                                     sums[3 * pixel + 2]);
+      }
+    }
+    return output;
+  }
+
+ private:
+  void export_scene() {
+    if (!scene->instances.empty()) {
+      TC_WARN("pt_cuda does not render instances");
+    }
+    if (scene->envmap) {
+      TC_WARN("pt_cuda does not render the environment map");
+    }
+    constexpr int albedo_samples = 16;
+    int n = scene->num_triangles;
+    TC_ERROR_IF(n == 0, "pt_cuda needs a scene with triangles");
+    std::vector<CUDAPathTracer::Triangle> triangles(n);
+    std::vector<BVH::Box> boxes(n);
+    std::vector<real> power(n, 0.0_f);
+    auto albedo_sampler = create_instance<Sampler>("prand");
+    ThreadedTaskManager::run(n, num_threads, [&](int id) {
+      Triangle t = scene->get_triangle(id);
+      auto &out = triangles[id];
+      Vector3 v[6] = {t.v[0], t.v10, t.v20, t.n0, t.n10, t.n20};
+      float32 *fields[6] = {out.v0, out.e1, out.e2, out.n0, out.n10, out.n20};
+      for (int f = 0; f < 6; f++) {
+        for (int k = 0; k < 3; k++) {
+          fields[f][k] = (float32)v[f][k];
+        }
+      }
+      for (int k = 0; k < 3; k++) {
+        boxes[id].extend(t.v[k].cast<float32>());
+      }
+      // In the local frame of the material, as BSDF sees it
+      const SurfaceMaterial *material =
+          scene->get_mesh_from_triangle_id(id)->material.get();
+      Vector2 uv = t.uv0 + (t.uv10 + t.uv20) * (1.0_f / 3);
+      Vector3 normal(0.0_f, 0.0_f, 1.0_f), albedo(0.0_f), emission(0.0_f);
+      if (material->is_emissive()) {
+        emission = material->evaluate_bsdf(normal, normal, uv);
+        power[id] = t.area * luminance(emission);
+      } else {
+        RandomStateSequence rand(albedo_sampler, id);
+        for (int k = 0; k < albedo_samples; k++) {
+          Vector3 out_dir, f;
+          real pdf;
+          SurfaceEvent event;
+          material->sample(normal, rand(), rand(), out_dir, f, pdf, event, uv);
+          if (pdf > 1e-10_f) {
+            albedo += f * (std::abs(out_dir.z) / pdf);
+          }
+        }
+        albedo *= 1.0_f / albedo_samples;
+      }
+      for (int k = 0; k < 3; k++) {
+        out.albedo[k] = (float32)albedo[k];
+        out.emission[k] = (float32)emission[k];
+      }
+    });
+    std::vector<int> lights;
+    std::vector<float32> light_cdf;
+    real total_power = 0;
+    for (int id = 0; id < n; id++) {
+      if (power[id] > 0) {
+        lights.push_back(id);
+        total_power += power[id];
+        light_cdf.push_back((float32)total_power);
+      }
+    }
+    for (auto &c : light_cdf) {
+      c /= (float32)total_power;
+    }
+    if (!light_cdf.empty()) {
+      light_cdf.back() = 1;
+    }
+    bvh.build(boxes);
+    TC_ASSERT_INFO(!bvh.nodes.empty(), "pt_cuda: empty scene");
+    device.set_scene(
+        triangles,
+        std::vector<CUDAPathTracer::Node>(
+            reinterpret_cast<const CUDAPathTracer::Node *>(bvh.nodes.data()),
+            reinterpret_cast<const CUDAPathTracer::Node *>(bvh.nodes.data()) +
+                bvh.nodes.size()),
+        bvh.primitives, lights, light_cdf);
+  }
+
+  std::shared_ptr<Sampler> sampler;
+  BVH bvh;
+  CUDAPathTracer device;
+  // Camera rays of the stage, six floats per pixel
+  std::vector<float32> rays;
+  // Sampler instance of the next stage, over width * height
+  int stage;
+  int num_stages;
+};
+
+TC_IMPLEMENTATION(Renderer, CUDAPathTracingRenderer, "pt_cuda");
+
+TC_NAMESPACE_END
+
+#endif
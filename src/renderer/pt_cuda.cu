@@ -0,0 +1,375 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+// Path tracing of diffuse triangles on the device: the traversal of BVH and
+// the triangle test of BVHRayIntersection, cosine-weighted bounces, and
+// next event estimation from emissive triangles picked by power. As in
+// "pt" with direct lighting from lights only, emission is counted on the
+// first hit and through shadow rays after that.
+
+#include "pt_cuda.h"
+#include <taichi_gpu/math/util.cuh>
+#include <cuda_runtime.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+
+namespace taichi {
+
+namespace {
+
+constexpr float pi = 3.14159265358979f;
+constexpr int pixel_threads = 128;
+
+__device__ __forceinline__ float3 load3(const float v[3]) {
+  return make_float3(v[0], v[1], v[2]);
+}
+
+__device__ __forceinline__ float3 operator+(float3 a, float3 b) {
+  return make_float3(a.x + b.x, a.y + b.y, a.z + b.z);
+}
+
+__device__ __forceinline__ float3 operator-(float3 a, float3 b) {
+  return make_float3(a.x - b.x, a.y - b.y, a.z - b.z);
+}
+
+__device__ __forceinline__ float3 operator*(float3 a, float3 b) {
+  return make_float3(a.x * b.x, a.y * b.y, a.z * b.z);
+}
+
+__device__ __forceinline__ float3 operator*(float a, float3 b) {
+  return make_float3(a * b.x, a * b.y, a * b.z);
+}
+
+__device__ __forceinline__ float dot(float3 a, float3 b) {
+  return a.x * b.x + a.y * b.y + a.z * b.z;
+}
+
+__device__ __forceinline__ float3 cross(float3 a, float3 b) {
+  return make_float3(a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z,
+                     a.x * b.y - a.y * b.x);
+}
+
+__device__ __forceinline__ float3 normalized(float3 a) {
+  return rsqrtf(fmaxf(dot(a, a), 1e-30f)) * a;
+}
+
+// PCG hash of the state, which advances
+__device__ __forceinline__ float next_random(unsigned &state) {
+  state = state * 747796405u + 2891336453u;
+  unsigned word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+  word = (word >> 22u) ^ word;
+  return (word >> 8) * (1.0f / 16777216.0f);
+}
+
+struct Hit {
+  float t, u, v;
+  int triangle;
+};
+
+// Moller-Trumbore, as BVHRayIntersection
+__device__ __forceinline__ bool intersect_triangle(
+    const CUDAPathTracer::Triangle &tri,
+    float3 orig,
+    float3 dir,
+    float t_far,
+    float &t,
+    float &u,
+    float &v) {
+  float3 e1 = load3(tri.e1), e2 = load3(tri.e2);
+  float3 p = cross(dir, e2);
+  float det = dot(e1, p);
+  if (fabsf(det) < 1e-20f) {
+    return false;
+  }
+  float inv_det = 1.0f / det;
+  float3 s = orig - load3(tri.v0);
+  u = dot(s, p) * inv_det;
+  if (u < 0 || u > 1) {
+    return false;
+  }
+  float3 q = cross(s, e1);
+  v = dot(dir, q) * inv_det;
+  if (v < 0 || u + v > 1) {
+    return false;
+  }
+  t = dot(e2, q) * inv_det;
+  return 0 < t && t < t_far;
+}
+
+__device__ __forceinline__ bool intersect_box(const CUDAPathTracer::Node &node,
+                                              float3 orig,
+                                              float3 inv_dir,
+                                              float t_far) {
+  float3 t0 = (load3(node.lower) - orig) * inv_dir;
+  float3 t1 = (load3(node.upper) - orig) * inv_dir;
+  float enter = fmaxf(fmaxf(fminf(t0.x, t1.x), fminf(t0.y, t1.y)),
+                      fmaxf(fminf(t0.z, t1.z), 0.0f));
+  float exit = fminf(fminf(fmaxf(t0.x, t1.x), fmaxf(t0.y, t1.y)),
+                     fminf(fmaxf(t0.z, t1.z), t_far));
+  return enter <= exit;
+}
+
+// The closest hit before |t_far|, or with |any_hit|, whether there is one
+__device__ bool trace(const CUDAPathTracer::Triangle *triangles,
+                      const CUDAPathTracer::Node *nodes,
+                      const int *primitives,
+                      float3 orig,
+                      float3 dir,
+                      float t_far,
+                      bool any_hit,
+                      Hit &hit) {
+  float3 inv_dir;
+  bool dir_negative[3];
+  float d[3] = {dir.x, dir.y, dir.z}, inv[3];
+  for (int i = 0; i < 3; i++) {
+    // Avoid NaNs for axis-aligned rays (0 * inf)
+    if (fabsf(d[i]) < 1e-20f) {
+      d[i] = d[i] < 0 ? -1e-20f : 1e-20f;
+    }
+    inv[i] = 1.0f / d[i];
+    dir_negative[i] = d[i] < 0;
+  }
+  inv_dir = make_float3(inv[0], inv[1], inv[2]);
+  hit.triangle = -1;
+  hit.t = t_far;
+  int stack[64];
+  int stack_size = 0;
+  int current = 0;
+  while (true) {
+    const CUDAPathTracer::Node &node = nodes[current];
+    if (intersect_box(node, orig, inv_dir, hit.t)) {
+      if (node.count > 0) {
+        for (int i = 0; i < node.count; i++) {
+          int id = primitives[node.offset + i];
+          float t, u, v;
+          if (intersect_triangle(triangles[id], orig, dir, hit.t, t, u, v)) {
+            hit.t = t;
+            hit.u = u;
+            hit.v = v;
+            hit.triangle = id;
+            if (any_hit) {
+              return true;
+            }
+          }
+        }
+      } else {
+        // Front-to-back order along the split axis
+        int first = node.offset, second = node.offset + 1;
+        if (dir_negative[node.axis]) {
+          int tmp = first;
+          first = second;
+          second = tmp;
+        }
+        stack[stack_size++] = second;
+        current = first;
+        continue;
+      }
+    }
+    if (stack_size == 0) {
+      break;
+    }
+    current = stack[--stack_size];
+  }
+  return hit.triangle != -1;
+}
+
+// About a unit normal |n|
+__device__ float3 random_diffuse(float3 n, float u, float v) {
+  float3 t = normalized(fabsf(n.x) > 0.5f ? cross(n, make_float3(0, 1, 0))
+                                          : cross(n, make_float3(1, 0, 0)));
+  float3 b = cross(n, t);
+  float phi = 2 * pi * u, r = sqrtf(v);
+  return (r * cosf(phi)) * t + (r * sinf(phi)) * b + sqrtf(1 - v) * n;
+}
+
+__global__ void render_kernel(const CUDAPathTracer::Triangle *triangles,
+                              const CUDAPathTracer::Node *nodes,
+                              const int *primitives,
+                              const int *lights,
+                              const float *light_cdf,
+                              int num_lights,
+                              const float *rays,
+                              float *sums,
+                              int num_pixels,
+                              int min_path_length,
+                              int max_path_length,
+                              unsigned stage) {
+  int pixel = blockIdx.x * blockDim.x + threadIdx.x;
+  if (pixel >= num_pixels) {
+    return;
+  }
+  unsigned rand = stage;
+  next_random(rand);
+  rand ^= (unsigned)pixel;
+  next_random(rand);
+  float3 orig = load3(rays + 6 * pixel);
+  float3 dir = normalized(load3(rays + 6 * pixel + 3));
+  float3 throughput = make_float3(1, 1, 1), color = make_float3(0, 0, 0);
+  for (int path_length = 1; path_length <= max_path_length; path_length++) {
+    Hit hit;
+    if (!trace(triangles, nodes, primitives, orig, dir, 1e30f, false, hit)) {
+      break;
+    }
+    const CUDAPathTracer::Triangle &tri = triangles[hit.triangle];
+    float3 ng = normalized(cross(load3(tri.e1), load3(tri.e2)));
+    bool front = dot(dir, ng) < 0;
+    float3 emission = load3(tri.emission);
+    if (emission.x + emission.y + emission.z > 0) {
+      if (path_length == 1 && front && min_path_length <= 1) {
+        color = color + throughput * emission;
+      }
+      break;
+    }
+    float3 pos = orig + hit.t * dir;
+    float3 n = normalized(load3(tri.n0) + hit.u * load3(tri.n10) +
+                          hit.v * load3(tri.n20));
+    if (!front) {
+      ng = -1.0f * ng;
+    }
+    if (dot(n, ng) < 0) {
+      n = -1.0f * n;
+    }
+    float3 albedo = load3(tri.albedo);
+    // Offset along the geometric normal, relative to the scene position
+    float eps = 1e-4f * (1 + fmaxf(fmaxf(fabsf(pos.x), fabsf(pos.y)),
+                                   fabsf(pos.z)));
+    float3 surface = pos + eps * ng;
+    if (num_lights > 0 && min_path_length <= path_length + 1 &&
+        path_length + 1 <= max_path_length) {
+      float r = next_random(rand);
+      int begin = 0, end = num_lights - 1;
+      while (begin < end) {
+        int mid = (begin + end) / 2;
+        if (light_cdf[mid] <= r) {
+          begin = mid + 1;
+        } else {
+          end = mid;
+        }
+      }
+      float prob = light_cdf[begin] - (begin > 0 ? light_cdf[begin - 1] : 0);
+      const CUDAPathTracer::Triangle &light = triangles[lights[begin]];
+      float su = sqrtf(next_random(rand)), sv = next_random(rand);
+      float3 e1 = load3(light.e1), e2 = load3(light.e2);
+      float3 target =
+          load3(light.v0) + (su * (1 - sv)) * e1 + (su * sv) * e2;
+      float3 to_light = target - surface;
+      float dist2 = dot(to_light, to_light);
+      float3 wi = rsqrtf(dist2) * to_light;
+      float3 cross_light = cross(e1, e2);
+      float area2 = sqrtf(dot(cross_light, cross_light));
+      float cos_light = -dot(wi, normalized(cross_light));
+      float cos_surface = dot(wi, n);
+      Hit shadow;
+      if (cos_light > 0 && cos_surface > 0 && dot(wi, ng) > 0 &&
+          !trace(triangles, nodes, primitives, surface, wi,
+                 sqrtf(dist2) * (1 - 1e-4f), true, shadow)) {
+        // 1 / pdf, with the pdf over the area of the light converted to
+        // solid angle
+        float weight = 0.5f * area2 * cos_light / (dist2 * prob);
+        color = color + (weight * cos_surface / pi) *
+                            (throughput * albedo * load3(light.emission));
+      }
+    }
+    // f cos / pdf of the cosine-weighted bounce is the albedo
+    throughput = throughput * albedo;
+    if (path_length >= 3) {
+      float survive =
+          fminf(fmaxf(fmaxf(throughput.x, throughput.y), throughput.z), 0.95f);
+      if (next_random(rand) >= survive) {
+        break;
+      }
+      throughput = (1 / survive) * throughput;
+    }
+    float u = next_random(rand), v = next_random(rand);
+    dir = random_diffuse(n, u, v);
+    if (dot(dir, ng) <= 0) {
+      break;
+    }
+    orig = surface;
+  }
+  sums[3 * pixel] += color.x;
+  sums[3 * pixel + 1] += color.y;
+  sums[3 * pixel + 2] += color.z;
+}
+
+template <typename T>
+T *device_alloc(int size) {
+  T *ptr = nullptr;
+  cudaMalloc(&ptr, sizeof(T) * size);
+  TC_CHECK_CUDA_ERROR
+  return ptr;
+}
+
+}  // namespace
+
+template <typename T>
+void CUDAPathTracer::upload(T *&device, const std::vector<T> &host) {
+  cudaFree(device);
+  // Never empty, so that the kernel always gets valid pointers
+  device = device_alloc<T>(std::max((int)host.size(), 1));
+  if (!host.empty()) {
+    cudaMemcpy(device, host.data(), sizeof(T) * host.size(),
+               cudaMemcpyHostToDevice);
+  }
+}
+
+CUDAPathTracer::~CUDAPathTracer() {
+  cudaFree(triangles);
+  cudaFree(nodes);
+  cudaFree(primitives);
+  cudaFree(lights);
+  cudaFree(light_cdf);
+  cudaFree(rays);
+  cudaFree(sums);
+}
+
+void CUDAPathTracer::set_scene(const std::vector<Triangle> &triangles,
+                               const std::vector<Node> &nodes,
+                               const std::vector<int> &primitives,
+                               const std::vector<int> &lights,
+                               const std::vector<float> &light_cdf) {
+  upload(this->triangles, triangles);
+  upload(this->nodes, nodes);
+  upload(this->primitives, primitives);
+  upload(this->lights, lights);
+  upload(this->light_cdf, light_cdf);
+  num_lights = (int)lights.size();
+  TC_CHECK_CUDA_ERROR
+}
+
+void CUDAPathTracer::reset(int num_pixels) {
+  if (num_pixels != this->num_pixels) {
+    cudaFree(rays);
+    cudaFree(sums);
+    rays = device_alloc<float>(6 * num_pixels);
+    sums = device_alloc<float>(3 * num_pixels);
+    this->num_pixels = num_pixels;
+  }
+  cudaMemset(sums, 0, sizeof(float) * 3 * num_pixels);
+  TC_CHECK_CUDA_ERROR
+}
+
+void CUDAPathTracer::render(const float *rays,
+                            int min_path_length,
+                            int max_path_length,
+                            unsigned stage) {
+  cudaMemcpy(this->rays, rays, sizeof(float) * 6 * num_pixels,
+             cudaMemcpyHostToDevice);
+  render_kernel<<<(num_pixels + pixel_threads - 1) / pixel_threads,
+                  pixel_threads>>>(triangles, nodes, primitives, lights,
+                                   light_cdf, num_lights, this->rays, sums,
+                                   num_pixels, min_path_length,
+                                   max_path_length, stage);
+  TC_CHECK_CUDA_ERROR
+}
+
+void CUDAPathTracer::get_sums(float *sums) const {
+  cudaMemcpy(sums, this->sums, sizeof(float) * 3 * num_pixels,
+             cudaMemcpyDeviceToHost);
+  TC_CHECK_CUDA_ERROR
+}
+
+}  // namespace taichi
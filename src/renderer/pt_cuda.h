@@ -0,0 +1,73 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+// Device side of the "pt_cuda" renderer. As in poisson_solver3d_cuda.h,
+// only plain types appear here, so that nvcc compiles the implementation
+// without the taichi headers.
+
+#include <vector>
+
+namespace taichi {
+
+class CUDAPathTracer {
+ public:
+  // In world space, with the material reduced to a diffuse albedo, or to a
+  // front-side emission (then the albedo is 0)
+  struct Triangle {
+    float v0[3], e1[3], e2[3];
+    float n0[3], n10[3], n20[3];
+    float albedo[3], emission[3];
+  };
+
+  // Of BVH, so that its nodes upload as they are
+  struct Node {
+    float lower[3], upper[3];
+    int offset;
+    unsigned short count, axis;
+  };
+
+  ~CUDAPathTracer();
+
+  // |primitives| are the triangle indices of the leaves of |nodes|, which
+  // is not empty; |lights| the emissive triangles, picked by |light_cdf|
+  // (inclusive, ending with 1)
+  void set_scene(const std::vector<Triangle> &triangles,
+                 const std::vector<Node> &nodes,
+                 const std::vector<int> &primitives,
+                 const std::vector<int> &lights,
+                 const std::vector<float> &light_cdf);
+
+  // Clears the sums of |num_pixels| pixels
+  void reset(int num_pixels);
+
+  // Adds one sample to every pixel, along the camera ray of the pixel in
+  // |rays| (origin and direction, six floats each). Random numbers past the
+  // camera come from (pixel, |stage|).
+  void render(const float *rays,
+              int min_path_length,
+              int max_path_length,
+              unsigned stage);
+
+  // The sums of the samples, three floats per pixel
+  void get_sums(float *sums) const;
+
+ private:
+  template <typename T>
+  static void upload(T *&device, const std::vector<T> &host);
+
+  Triangle *triangles = nullptr;
+  Node *nodes = nullptr;
+  int *primitives = nullptr;
+  int *lights = nullptr;
+  float *light_cdf = nullptr;
+  int num_lights = 0;
+  int num_pixels = 0;
+  float *rays = nullptr;
+  float *sums = nullptr;
+};
+
+}  // namespace taichi
@@ -0,0 +1,48 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#include <taichi/visual/render_batch.h>
+#include <taichi/system/threading.h>
+
+TC_NAMESPACE_BEGIN
+
+RenderBatch::RenderBatch(const std::string &name,
+                         const Config &config,
+                         std::shared_ptr<Scene> scene,
+                         const std::vector<std::shared_ptr<Camera>> &cameras) {
+  TC_ERROR_IF(cameras.empty(), "A render batch needs at least one camera");
+  num_threads = config.get("num_threads", 1);
+  for (auto &camera : cameras) {
+    auto view = create_instance<Renderer>(name);
+    view->set_scene(scene);
+    view->set_camera(camera);
+    if (!views.empty()) {
+      view->set_scene_geometry(views[0]->get_scene_geometry());
+    }
+    view->initialize(config);
+    views.push_back(view);
+  }
+}
+
+void RenderBatch::render_stage() {
+  // The tiles of the views are nested tasks of the same arena
+  ThreadedTaskManager::run((int)views.size(), num_threads,
+                           [&](int i) { views[i]->render_stage(); });
+}
+
+void RenderBatch::write_outputs(const std::string &pattern) {
+  for (int i = 0; i < (int)views.size(); i++) {
+    views[i]->write_output(fmt::format(pattern, i));
+  }
+}
+
+void RenderBatch::update_scene() {
+  // The first view updates the shared geometry
+  for (auto &view : views) {
+    view->update_scene();
+  }
+}
+
+TC_NAMESPACE_END
@@ -0,0 +1,95 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#include <taichi/visual/render_session.h>
+#include <taichi/system/timer.h>
+
+TC_NAMESPACE_BEGIN
+
+RenderSession::RenderSession(std::shared_ptr<Renderer> renderer,
+                             const Config &config)
+    : renderer(renderer),
+      running(false),
+      cancelled(false),
+      stage_count(0),
+      front(0) {
+  assert_info(renderer != nullptr, "null renderer");
+  time_budget = config.get("time_budget", 0.0_f);
+  max_stages = config.get("max_stages", -1);
+  preview_interval = config.get("preview_interval", 0.5_f);
+  preview_stage_counts[0] = preview_stage_counts[1] = 0;
+}
+
+RenderSession::~RenderSession() {
+  cancel();
+  wait();
+}
+
+void RenderSession::start() {
+  assert_info(!running.load(), "render session already running");
+  wait();
+  cancelled.store(false);
+  running.store(true);
+  thread = std::thread([this]() { run(); });
+}
+
+void RenderSession::cancel() {
+  cancelled.store(true);
+}
+
+void RenderSession::wait() {
+  if (thread.joinable()) {
+    thread.join();
+  }
+}
+
+Array2D<Vector3> RenderSession::get_preview() {
+  std::lock_guard<std::mutex> _(preview_mutex);
+  return previews[front];
+}
+
+int RenderSession::get_preview_stage_count() {
+  std::lock_guard<std::mutex> _(preview_mutex);
+  return preview_stage_counts[front];
+}
+
+void RenderSession::run() {
+  double start_time = Time::get_time();
+  double last_preview = start_time;
+  while (!cancelled.load()) {
+    if (max_stages >= 0 && stage_count.load() >= max_stages) {
+      break;
+    }
+    if (time_budget > 0 && Time::get_time() - start_time >= time_budget) {
+      break;
+    }
+    renderer->render_stage();
+    stage_count++;
+    if (renderer->is_converged()) {
+      break;
+    }
+    // get_output() cannot overlap a stage, so previews are rate-limited
+    double now = Time::get_time();
+    if (now - last_preview >= preview_interval) {
+      update_preview();
+      last_preview = now;
+    }
+  }
+  if (preview_stage_counts[front] != stage_count.load()) {
+    update_preview();
+  }
+  running.store(false);
+}
+
+void RenderSession::update_preview() {
+  int back = 1 - front;
+  previews[back] = renderer->is_denoising() ? renderer->get_denoised_output()
+                                           : renderer->get_output();
+  preview_stage_counts[back] = stage_count.load();
+  std::lock_guard<std::mutex> _(preview_mutex);
+  front = back;
+}
+
+TC_NAMESPACE_END
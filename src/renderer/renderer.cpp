@@ -4,42 +4,281 @@
 *******************************************************************************/
 
 #include <taichi/visual/renderer.h>
+#include <taichi/visual/bsdf.h>
+#include <taichi/visual/sampler.h>
+#include <taichi/math/array_3d_layout.h>
+#include <algorithm>
+#include <cstdio>
 
 TC_NAMESPACE_BEGIN
 
+constexpr int Renderer::tile_size;
+
 void Renderer::initialize(const Config &config) {
-  this->ray_intersection = create_instance<RayIntersection>(
-      config.get("ray_intersection", "embree"));
-  sg = std::make_shared<SceneGeometry>(scene, ray_intersection);
+  if (!sg) {
+    // Backends read e.g. "dynamic_scene" from the renderer config
+    this->ray_intersection = create_instance<RayIntersection>(
+        config.get("ray_intersection", TC_DEFAULT_RAY_INTERSECTION), config);
+    sg = std::make_shared<SceneGeometry>(scene, ray_intersection);
+  }
   this->min_path_length = config.get<int>("min_path_length");
   this->max_path_length = config.get<int>("max_path_length");
   this->num_threads = config.get("num_threads", 1);
+  if (config.has_key("pin_threads")) {
+    ThreadedTaskManager::set_thread_pinning(config.get<bool>("pin_threads"));
+  }
+  this->worker_id = config.get("worker_id", 0);
+  this->num_workers = config.get("num_workers", 1);
+  this->output_queue_size = config.get("output_queue_size", 2);
+  this->png_bit_depth = config.get("png_bit_depth", 8);
+  this->denoise = config.get("denoise", false);
+  denoiser_config.iterations = config.get("denoise_iterations", 5);
+  denoiser_config.sigma_color = config.get("denoise_sigma_color", 4.0_f);
+  denoiser_config.sigma_normal = config.get("denoise_sigma_normal", 128.0_f);
+  denoiser_config.sigma_depth = config.get("denoise_sigma_depth", 0.05_f);
+  denoiser_config.num_threads = num_threads;
+  assert_info(png_bit_depth == 8 || png_bit_depth == 16,
+              "png_bit_depth must be 8 or 16");
+  assert_info(0 <= worker_id && worker_id < num_workers,
+              "worker_id must be in [0, num_workers)");
   assert_info(min_path_length <= max_path_length,
               "min_path_length > max_path_length");
+  this->crop_window = config.get("crop_window", Vector4i(0));
+  build_tiles();
 }
 
 void Renderer::set_scene(std::shared_ptr<Scene> scene) {
   this->scene = scene;
-  this->camera = scene->camera;
+  set_camera(scene->camera);
+}
+
+void Renderer::set_camera(std::shared_ptr<Camera> camera) {
+  this->camera = camera;
   this->width = camera->get_width();
   this->height = camera->get_height();
+  build_tiles();
+  aov_albedo = Array2D<Vector3>();
+}
+
+void Renderer::build_tiles() {
+  crop_begin = Vector2i(0);
+  crop_end = Vector2i(width, height);
+  if (crop_window.z > crop_window.x && crop_window.w > crop_window.y) {
+    crop_begin = Vector2i(clamp(crop_window.x, 0, width),
+                          clamp(crop_window.y, 0, height));
+    crop_end = Vector2i(clamp(crop_window.z, crop_begin.x, width),
+                        clamp(crop_window.w, crop_begin.y, height));
+  }
+  auto overlaps = [](const Tile &tile, Vector4i region) {
+    return tile.begin.x < region.z && region.x < tile.end.x &&
+           tile.begin.y < region.w && region.y < tile.end.y;
+  };
+  int tiles_x = (width + tile_size - 1) / tile_size;
+  int tiles_y = (height + tile_size - 1) / tile_size;
+  // Sorted by (not prioritized, Morton code)
+  std::vector<std::pair<uint64, Tile>> sorted;
+  for (int i = 0; i < tiles_x; i++) {
+    for (int j = 0; j < tiles_y; j++) {
+      Tile tile;
+      tile.begin = Vector2i(std::max(crop_begin.x, i * tile_size),
+                            std::max(crop_begin.y, j * tile_size));
+      tile.end = Vector2i(std::min(crop_end.x, (i + 1) * tile_size),
+                          std::min(crop_end.y, (j + 1) * tile_size));
+      if (tile.begin.x >= tile.end.x || tile.begin.y >= tile.end.y) {
+        continue;
+      }
+      bool prioritized = false;
+      for (auto &region : priority_regions) {
+        prioritized = prioritized || overlaps(tile, region);
+      }
+      uint64 key = ((uint64)!prioritized << 32) | morton_code(i, j);
+      sorted.push_back(std::make_pair(key, tile));
+    }
+  }
+  std::sort(sorted.begin(), sorted.end(),
+            [](const std::pair<uint64, Tile> &a,
+               const std::pair<uint64, Tile> &b) { return a.first < b.first; });
+  tiles.clear();
+  for (auto &p : sorted) {
+    tiles.push_back(p.second);
+  }
+}
+
+void Renderer::set_crop_window(Vector4i window) {
+  crop_window = window;
+  build_tiles();
+  tiles_changed(true);
+}
+
+void Renderer::set_priority_regions(const std::vector<Vector4i> &regions) {
+  priority_regions = regions;
+  build_tiles();
+  tiles_changed(false);
+}
+
+void Renderer::update_scene() {
+  sg->update();
+  aov_albedo = Array2D<Vector3>();
+  reset_accumulation();
+}
+
+void Renderer::save_checkpoint(const std::string &fn) {
+  wait_for_checkpoint();
+  BinaryOutputSerializer serializer;
+  serializer.initialize();
+  serializer("width", width);
+  serializer("height", height);
+  write_checkpoint(serializer);
+  serializer.finalize();
+  std::size_t size = serializer.head;
+  // Written next to |fn| and renamed, so that a node reclaimed mid-write
+  // leaves the previous checkpoint intact
+  auto slash = fn.find_last_of('/');
+  std::string tmp_fn =
+      slash == std::string::npos
+          ? "partial_" + fn
+          : fn.substr(0, slash + 1) + "partial_" + fn.substr(slash + 1);
+  checkpoint_writer =
+      std::async(std::launch::async,
+                 [data = std::move(serializer.data), size, fn, tmp_fn]() {
+                   write_data_to_file(tmp_fn, const_cast<uint8 *>(data.data()),
+                                      size);
+                   TC_ASSERT_INFO(std::rename(tmp_fn.c_str(), fn.c_str()) == 0,
+                                  "Cannot move checkpoint to " + fn);
+                 });
+}
+
+void Renderer::wait_for_checkpoint() {
+  if (checkpoint_writer.valid()) {
+    checkpoint_writer.get();
+  }
+}
+
+void Renderer::load_checkpoint(const std::string &fn) {
+  wait_for_checkpoint();
+  BinaryInputSerializer serializer;
+  serializer.initialize(fn);
+  int checkpoint_width, checkpoint_height;
+  serializer("width", checkpoint_width);
+  serializer("height", checkpoint_height);
+  TC_ASSERT_INFO(checkpoint_width == width && checkpoint_height == height,
+                 "Checkpoint resolution does not match the camera");
+  read_checkpoint(serializer);
+  serializer.finalize();
 }
 
 void Renderer::write_output(std::string fn) {
-  auto tmp = get_output();
-  Vector3 sum(0.0_f);
-  for (auto p : tmp) {
-    sum += p;
-  }
-  auto scale = luminance(sum) / luminance(Vector3(1.0_f)) / tmp.get_width() /
-               tmp.get_height() / 0.18f;
-  for (auto ind : tmp.get_region()) {
-    for (int i = 0; i < 3; i++) {
-      tmp[ind][i] =
-          std::pow(clamp(tmp[ind][i] / scale, 0.0_f, 1.0_f), 1 / 2.2f);
+  if (!output_writer) {
+    output_writer = std::make_unique<AsyncImageWriter>(output_queue_size);
+  }
+  if (ends_with(fn, ".exr")) {
+    auto layers = get_output_layers();
+    if (denoise) {
+      layers.push_back({"denoised", "RGB", get_denoised_output()});
     }
+    output_writer->push(
+        [layers = std::move(layers), fn]() { write_exr(fn, layers); });
+    return;
+  }
+  auto tmp = denoise ? get_denoised_output() : get_output();
+  bool png16 = png_bit_depth == 16 && ends_with(fn, ".png");
+  output_writer->push([tmp = std::move(tmp), fn, png16]() mutable {
+    Vector3 sum(0.0_f);
+    for (auto p : tmp) {
+      sum += p;
+    }
+    auto scale = luminance(sum) / luminance(Vector3(1.0_f)) /
+                 tmp.get_width() / tmp.get_height() / 0.18f;
+    for (auto ind : tmp.get_region()) {
+      for (int i = 0; i < 3; i++) {
+        tmp[ind][i] =
+            std::pow(clamp(tmp[ind][i] / scale, 0.0_f, 1.0_f), 1 / 2.2f);
+      }
+    }
+    if (png16) {
+      write_png16(fn, tmp);
+    } else {
+      tmp.write_as_image(fn);
+    }
+  });
+}
+
+void Renderer::wait_for_output() {
+  if (output_writer) {
+    output_writer->flush();
+  }
+}
+
+std::vector<ImageLayer> Renderer::get_output_layers() {
+  Array2D<Vector3> albedo, normal;
+  Array2D<real> depth;
+  get_surface_aovs(albedo, normal, depth);
+  Array2D<Vector3> z(depth.get_res());
+  for (auto &ind : depth.get_region()) {
+    z[ind] = Vector3(depth[ind]);
+  }
+  return {{"", "RGB", get_output()},
+          {"albedo", "RGB", albedo},
+          {"normal", "XYZ", normal},
+          {"depth", "Z", z}};
+}
+
+Array2D<Vector3> Renderer::get_denoised_output() {
+  Array2D<Vector3> albedo, normal;
+  Array2D<real> depth;
+  get_surface_aovs(albedo, normal, depth);
+  return atrous_denoise(get_output(), albedo, normal, depth,
+                        get_output_variance(), denoiser_config);
+}
+
+void Renderer::get_surface_aovs(Array2D<Vector3> &albedo,
+                                Array2D<Vector3> &normal,
+                                Array2D<real> &depth) {
+  if (!aov_albedo.empty()) {
+    albedo = aov_albedo;
+    normal = aov_normal;
+    depth = aov_depth;
+    return;
   }
-  tmp.write_as_image(fn);
+  constexpr int albedo_samples = 16;
+  albedo.initialize(Vector2i(width, height), Vector3(0.0_f));
+  normal.initialize(Vector2i(width, height), Vector3(0.0_f));
+  depth.initialize(Vector2i(width, height), 0.0_f);
+  auto sampler = create_instance<Sampler>("prand");
+  Vector2 size(1.0_f / width, 1.0_f / height);
+  // Over the whole frame, not just the crop window
+  ThreadedTaskManager::run(width, num_threads, [&](int i) {
+    for (int j = 0; j < height; j++) {
+      RandomStateSequence rand(sampler, (long long)i * height + j);
+      // Zero-size pixel footprint: through the center
+      Vector2 center((i + 0.5_f) * size.x, (j + 0.5_f) * size.y);
+      Ray ray = camera->sample(center, Vector2(0.0_f), rand);
+      IntersectionInfo info = sg->query(ray);
+      if (!info.intersected) {
+        continue;
+      }
+      normal[i][j] = info.normal;
+      depth[i][j] = info.dist;
+      BSDF bsdf(scene, info);
+      if (bsdf.is_emissive()) {
+        continue;
+      }
+      Vector3 in_dir = -ray.dir, sum(0.0_f);
+      for (int k = 0; k < albedo_samples; k++) {
+        Vector3 out_dir, f;
+        real pdf;
+        SurfaceEvent event;
+        bsdf.sample(in_dir, rand(), rand(), out_dir, f, pdf, event);
+        if (pdf > 1e-10_f) {
+          sum += f * (std::abs(dot(out_dir, info.normal)) / pdf);
+        }
+      }
+      albedo[i][j] = sum * (1.0_f / albedo_samples);
+    }
+  });
+  aov_albedo = albedo;
+  aov_normal = normal;
+  aov_depth = depth;
 }
 
 TC_NAMESPACE_END
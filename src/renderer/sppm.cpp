@@ -4,6 +4,7 @@
 *******************************************************************************/
 
 #include "sppm.h"
+#include <taichi/system/profiler.h>
 
 TC_NAMESPACE_BEGIN
 
@@ -23,24 +24,63 @@ void SPPMRenderer::initialize(const Config &config) {
   stages = 0;
   radius2.initialize(res, initial_radius * initial_radius);
   flux.initialize(res, Vector3(0.0_f));
-  num_photons.initialize(res, 0LL);
+  num_photons.initialize(res, 0.0_f);
+  pass_flux = SplatBuffer(res);
+  pass_photons = std::vector<std::atomic<int>>(width * height);
   image_direct_illum.initialize(res);
+  hit_points.resize(width * height);
+  hit_point_importance.resize(width * height);
+  hit_point_eye_out_dir.resize(width * height);
   num_photons_per_stage = config.get("num_photons_per_stage", width * height);
   eye_ray_stages = 0;
+  photon_guiding = config.get("photon_guiding", false);
+  photon_guide.initialize(
+      config.get("photon_guide_resolution", Vector3i(16, 8, 8)),
+      config.get("photon_guide_uniform_share", 0.25_f));
+}
+
+void SPPMRenderer::reset_accumulation() {
+  image.reset(Vector3(0.0_f));
+  image_direct_illum.reset(Vector3(0.0_f));
+  photon_counter = 0;
+  stages = 0;
+  radius2.reset(initial_radius * initial_radius);
+  flux.reset(Vector3(0.0_f));
+  num_photons.reset(0.0_f);
+  pass_flux.clear();
+  for (auto &count : pass_photons) {
+    count.store(0, std::memory_order_relaxed);
+  }
+  eye_ray_stages = 0;
+  photon_guide.reset();
 }
 
 void SPPMRenderer::render_stage() {
   hash_grid.clear_cache();
   if (stochastic_eye_ray || eye_ray_stages == 0) {
-    eye_ray_pass();
+    TC_PROFILE("eye_ray_pass", eye_ray_pass());
     eye_ray_stages += 1;
   }
-  hash_grid.build_grid();
-  for (int i = 0; i < num_photons_per_stage; i++) {
-    auto state_sequence = RandomStateSequence(sampler, photon_counter);
-    trace_photon(state_sequence);
-    photon_counter += 1;
+  TC_PROFILE("build_grid", hash_grid.build_grid());
+  TC_PROFILE("trace_photons",
+             ThreadedTaskManager::run(
+                 [&](int i) {
+                   auto state_sequence =
+                       RandomStateSequence(sampler, photon_counter + i);
+                   if (!photon_guiding) {
+                     trace_photon(state_sequence);
+                     return;
+                   }
+                   GuidedStateSequence guided(state_sequence, photon_guide);
+                   bool visible = trace_photon(guided, guided.get_weight());
+                   photon_guide.record(guided.get_bin(), visible);
+                 },
+                 0, num_photons_per_stage, num_threads));
+  if (photon_guiding) {
+    photon_guide.update();
   }
+  photon_counter += num_photons_per_stage;
+  TC_PROFILE("update_hit_points", update_hit_points());
   stages += 1;
   for (auto &ind : image.get_region()) {
     image[ind] = 1.0_f / (pi * radius2[ind]) / photon_counter * flux[ind] +
@@ -78,17 +118,16 @@ void SPPMRenderer::trace_eye_path(StateSequence &rand,
       importance = importance * f * bsdf.cos_theta(out_dir) * (1.0_f / pdf);
       ray = Ray(info.pos, out_dir, 0);
     } else {
-      HitPoint hit_point;
-      hit_point.importance = importance;
+      int id = pixel.x * height + pixel.y;
+      HitPoint &hit_point = hit_points[id];
       hit_point.pos = info.pos;
       hit_point.normal = info.normal;
-      hit_point.pixel = pixel;
-      hit_point.eye_out_dir = -ray.dir;
-      hit_point.id = (int)hit_points.size();
+      hit_point.radius2 = radius2[pixel.x][pixel.y];
       hit_point.path_length = depth + 1;
-      hit_points.push_back(hit_point);
-      real radius = std::sqrt(radius2[pixel.x][pixel.y]);
-      hash_grid.push_back_to_all_cells_in_range(info.pos, radius, hit_point.id);
+      hit_point_importance[id] = importance;
+      hit_point_eye_out_dir[id] = -ray.dir;
+      hash_grid.push_back_to_all_cells_in_range(
+          info.pos, std::sqrt(hit_point.radius2), id);
       return;
     }
   }
@@ -133,26 +172,18 @@ bool SPPMRenderer::trace_photon(
       int *begin = hash_grid.begin(info.pos);
       int *end = hash_grid.end(info.pos);
       for (int *p_hp_id = begin; p_hp_id < end; p_hp_id++) {
-        HitPoint &hp = hit_points[*p_hp_id];
+        int id = *p_hp_id;
+        const HitPoint &hp = hit_points[id];
         Vector3 v = (hp.pos - info.pos);
         int path_length = hp.path_length + depth + 1;
-        real &hp_radius2 = radius2[hp.pixel.x][hp.pixel.y];
         if (path_length_in_range(path_length) &&
-            dot(hp.normal, info.normal) > eps && dot(v, v) < hp_radius2) {
+            dot(hp.normal, info.normal) > eps && dot(v, v) < hp.radius2) {
           if (contribution_scaling > 0) {
-            long long &hp_num_photons = num_photons[hp.pixel.x][hp.pixel.y];
-            real g;
-            if (shrinking_radius)
-              g = (hp_num_photons * alpha + alpha) /
-                  (hp_num_photons * alpha + 1.0_f);
-            else
-              g = 1.0_f;
-            hp_radius2 *= g;
-            Vector3 contribution = contribution_scaling * hp.importance * flux *
-                                   bsdf.evaluate(in_dir, hp.eye_out_dir);
-            this->flux[hp.pixel.x][hp.pixel.y] =
-                (this->flux[hp.pixel.x][hp.pixel.y] + contribution) * g;
-            hp_num_photons++;
+            Vector3 contribution =
+                contribution_scaling * hit_point_importance[id] * flux *
+                bsdf.evaluate(in_dir, hit_point_eye_out_dir[id]);
+            pass_flux.add(id / height, id % height, contribution);
+            pass_photons[id].fetch_add(1, std::memory_order_relaxed);
           }
           visible = true;
         }
@@ -175,21 +206,50 @@ bool SPPMRenderer::trace_photon(
   return visible;
 }
 
-void SPPMRenderer::eye_ray_pass() {
-  auto sampler = create_instance<Sampler>("prand");
-  hash_grid.initialize(
-      initial_radius,
-      width * height * 10 + 7);  // TODO: hash cell size should be shrinking...
-  hit_points.clear();
+void SPPMRenderer::update_hit_points() {
   for (int i = 0; i < width; i++) {
     for (int j = 0; j < height; j++) {
-      auto rand = RandomStateSequence(sampler, i * height + j);
-      Vector2 offset(real(i) / (real)width, real(j) / (real)height);
-      Vector2 size(1.0_f / width, 1.0_f / height);
-      Ray ray = camera->sample(offset, size, rand);
-      trace_eye_path(rand, ray, Vector2i(i, j));
+      int m = pass_photons[i * height + j].exchange(0);
+      if (m == 0) {
+        continue;
+      }
+      real &n = num_photons[i][j];
+      real g = 1.0_f;
+      if (shrinking_radius) {
+        g = (n + alpha * m) / (n + m);
+        n += alpha * m;
+      } else {
+        n += m;
+      }
+      radius2[i][j] *= g;
+      hit_points[i * height + j].radius2 = radius2[i][j];
+      flux[i][j] = (flux[i][j] + pass_flux.get(i, j)) * g;
     }
   }
+  pass_flux.clear();
+}
+
+void SPPMRenderer::eye_ray_pass() {
+  // Seeded apart from the photon passes
+  auto sampler = create_instance<Sampler>("prand", Config().set("seed", 1));
+  hash_grid.initialize(
+      initial_radius,
+      width * height * 10 + 7);  // TODO: hash cell size should be shrinking...
+  // Pixels only write their own hit points and direct illumination
+  ThreadedTaskManager::run(
+      [&](int i) {
+        for (int j = 0; j < height; j++) {
+          hit_points[i * height + j].path_length = 0;
+          // A new jitter every pass
+          auto rand = RandomStateSequence(
+              sampler, (int64)eye_ray_stages * width * height + i * height + j);
+          Vector2 offset(real(i) / (real)width, real(j) / (real)height);
+          Vector2 size(1.0_f / width, 1.0_f / height);
+          Ray ray = camera->sample(offset, size, rand);
+          trace_eye_path(rand, ray, Vector2i(i, j));
+        }
+      },
+      0, width, num_threads);
 }
 
 TC_IMPLEMENTATION(Renderer, SPPMRenderer, "sppm");
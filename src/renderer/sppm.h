@@ -9,17 +9,19 @@
 #include <taichi/visual/sampler.h>
 #include <taichi/visual/bsdf.h>
 #include "hash_grid.h"
+#include "photon_guide.h"
 
 TC_NAMESPACE_BEGIN
 
+// What photons test against, once per hit point in a cell they land in;
+// the rest of a hit point is only read when a photon merges with it
 struct HitPoint {
-  Vector2i pixel;
-  Vector3 normal;
   Vector3 pos;
-  Vector3 importance;
-  Vector3 eye_out_dir;
-  int id;
-  int path_length = 0;
+  Vector3 normal;
+  real radius2;
+  int path_length = 0;  // 0 for pixels without a hit point
+
+  TC_IO_DEF(pos, normal, radius2, path_length);
 };
 
 class SPPMRenderer : public Renderer {
@@ -28,6 +30,10 @@ class SPPMRenderer : public Renderer {
 
   virtual void render_stage() override;
 
+  // Radii, fluxes and photon counts start over, and hit points are traced
+  // again, also without stochastic eye rays
+  void reset_accumulation() override;
+
   virtual Array2D<Vector3> get_output() override {
     return image;
   }
@@ -42,24 +48,50 @@ class SPPMRenderer : public Renderer {
 
   virtual void eye_ray_pass();
 
+  // Progressive radius and flux update with the photons gathered since the
+  // last call. Call at the end of each photon pass.
+  void update_hit_points();
+
  protected:
   real alpha;
   real initial_radius;
   int num_photons_per_stage;
   HashGrid hash_grid;
+  // Hit points, indexed by pixel (i * height + j) so that the eye pass can
+  // trace pixels in parallel
   std::vector<HitPoint> hit_points;
+  std::vector<Vector3> hit_point_importance;
+  std::vector<Vector3> hit_point_eye_out_dir;
   Array2D<Vector3> image;
   Array2D<Vector3> image_direct_illum;
   int stages;
   std::shared_ptr<Sampler> sampler;
   Array2D<real> radius2;
   Array2D<Vector3> flux;
-  Array2D<long long> num_photons;
+  // Hachisuka's N, i.e. alpha times the number of photons gathered
+  Array2D<real> num_photons;
+  // Flux and photon counts gathered in the current pass. Photons are traced
+  // in parallel and only add to these; radii do not change within a pass.
+  SplatBuffer pass_flux;
+  std::vector<std::atomic<int>> pass_photons;
   int64 photon_counter;
   bool stochastic_eye_ray;
   bool russian_roulette;
   bool shrinking_radius;
   int eye_ray_stages;
+  // Emit photons where they were found visible (config "photon_guiding")
+  bool photon_guiding;
+  PhotonGuide photon_guide;
+
+  TC_RENDERER_CHECKPOINT
+
+  // Hit points are kept, as PPM (no stochastic eye rays) traces them once
+  template <typename S>
+  void checkpoint_io(S &serializer) {
+    TC_IO(hit_points, hit_point_importance, hit_point_eye_out_dir);
+    TC_IO(image, image_direct_illum, radius2, flux, num_photons);
+    TC_IO(photon_counter, stages, eye_ray_stages, photon_guide);
+  }
 };
 
 TC_NAMESPACE_END
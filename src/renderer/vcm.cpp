@@ -4,6 +4,7 @@
 *******************************************************************************/
 
 #include "bidirectional_renderer.h"
+#include <taichi/system/profiler.h>
 #include "hash_grid.h"
 
 TC_NAMESPACE_BEGIN
@@ -13,7 +14,13 @@ class VCMRenderer : public BidirectionalRenderer {
   int num_stages;
   real initial_radius;
   HashGrid hash_grid;
-  std::vector<Path> light_paths;
+  // Prefix of light_paths_for_connection[path] with |length| vertices
+  struct LightSubpath {
+    int path;
+    int length;
+  };
+  // Merging candidates, indexed by the hash grid
+  std::vector<LightSubpath> light_subpaths;
   std::vector<Path> light_paths_for_connection;
   real radius;
   int n_samples_per_stage;
@@ -39,21 +46,24 @@ class VCMRenderer : public BidirectionalRenderer {
   PathContribution vertex_merge(const Path &full_eye_path) {
     PathContribution pc;
     real radius2 = radius * radius;
+    // Buffers of the thread, which keep their capacity for the next merges
+    static thread_local Path eye_path, full_path;
+    static thread_local PdfPrefixes prefixes;
     for (int num_eye_vertices = 2;
          num_eye_vertices <= (int)full_eye_path.size(); num_eye_vertices++) {
-      Path eye_path(full_eye_path.begin(),
-                    full_eye_path.begin() + num_eye_vertices);
+      eye_path.assign(full_eye_path.begin(),
+                      full_eye_path.begin() + num_eye_vertices);
       Vector3 merging_pos = eye_path.back().pos;
       int *begin = hash_grid.begin(merging_pos),
           *end = hash_grid.end(merging_pos);
       for (int *light_path_id_pointer = begin; light_path_id_pointer < end;
            light_path_id_pointer++) {
-        int light_path_id = *light_path_id_pointer;
-        Path light_path = light_paths[light_path_id];
-        int path_length = (int)eye_path.size() + (int)light_path.size() - 2;
-        int num_light_vertices = (int)light_path.size();
-        Vertex merging_vertex_eye = eye_path.back();
-        Vertex merging_vertex_light = light_path.back();
+        const LightSubpath &subpath = light_subpaths[*light_path_id_pointer];
+        const Path &light_path = light_paths_for_connection[subpath.path];
+        int num_light_vertices = subpath.length;
+        int path_length = (int)eye_path.size() + num_light_vertices - 2;
+        const Vertex &merging_vertex_eye = eye_path.back();
+        const Vertex &merging_vertex_light = light_path[num_light_vertices - 1];
         if (SurfaceEventClassifier::is_delta(merging_vertex_eye.event) ||
             SurfaceEventClassifier::is_delta(merging_vertex_light.event)) {
           // Do not connect Delta BSDF
@@ -79,7 +89,6 @@ class VCMRenderer : public BidirectionalRenderer {
           screen_u = clamp(screen_u, 0.0_f, 1.0_f);
           screen_v = clamp(screen_v, 0.0_f, 1.0_f);
           eye_path.back().connected = true;
-          Path full_path;
           full_path.resize(num_eye_vertices + num_light_vertices -
                            1);  // note that last light vertex is deleted
           for (int i = 0; i < num_eye_vertices; i++)
@@ -92,13 +101,16 @@ class VCMRenderer : public BidirectionalRenderer {
             // printf("f\n");
             continue;
           }
-          double p = path_pdf(full_path, num_eye_vertices, num_light_vertices);
+          compute_pdf_prefixes(full_path, prefixes);
+          double p = path_pdf(full_path, prefixes, num_eye_vertices,
+                              num_light_vertices);
           if (p <= 0.0_f) {
             // printf("p\n");
             continue;
           }
-          double w = mis_weight(full_path, num_eye_vertices, num_light_vertices,
-                                use_vc, n_samples_per_stage);
+          double w = mis_weight(full_path, prefixes, num_eye_vertices,
+                                num_light_vertices, use_vc,
+                                n_samples_per_stage);
           if (w <= 0.0_f) {
             // printf("w\n");
             continue;
@@ -117,51 +129,98 @@ class VCMRenderer : public BidirectionalRenderer {
     radius = initial_radius * pow(num_stages + 1.0_f, -(1.0_f - alpha) / 2.0f);
     vm_pdf_constant = pi * radius * radius;
     hash_grid.initialize(radius, width * height * 10 + 7);
-    light_paths.clear();
+    light_subpaths.clear();
     light_paths_for_connection.resize(n_samples_per_stage);
     // Generate light paths (photons)
-    ThreadedTaskManager::run(
-        [&](int k) {
-          auto state_sequence = RandomStateSequence(
-              sampler, sample_count * 2 + k);  // TODO: wrong...
-          Path light_path = trace_light_path(state_sequence);
-          light_paths_for_connection[k] = light_path;
-        },
-        0, n_samples_per_stage, num_threads);
+    TC_PROFILE("light_paths",
+               ThreadedTaskManager::run(
+                   [&](int k) {
+                     auto state_sequence = RandomStateSequence(
+                         sampler, sample_count * 2 + k);  // TODO: wrong...
+                     light_paths_for_connection[k] =
+                         trace_light_path(state_sequence);
+                   },
+                   0, n_samples_per_stage, num_threads));
 
-    for (int k = 0; k < n_samples_per_stage; k++) {
-      Path &light_path = light_paths_for_connection[k];
-      if (use_vm) {
-        for (int num_light_vertices = 2;
-             num_light_vertices <= (int)light_path.size();
-             num_light_vertices++) {
-          Path partial_light_path(light_path.begin(),
-                                  light_path.begin() + num_light_vertices);
-          hash_grid.push_back_to_all_cells_in_range(
-              partial_light_path.back().pos, radius, (int)light_paths.size());
-          light_paths.push_back(partial_light_path);
-        }
+    if (use_vm) {
+      // Every prefix with at least two vertices is a merging candidate.
+      // light_subpaths[first[k]...] are the prefixes of light path k.
+      std::vector<int> first(n_samples_per_stage + 1, 0);
+      for (int k = 0; k < n_samples_per_stage; k++) {
+        first[k + 1] =
+            first[k] +
+            std::max(0, (int)light_paths_for_connection[k].size() - 1);
       }
+      light_subpaths.resize(first[n_samples_per_stage]);
+      ThreadedTaskManager::run(
+          [&](int k) {
+            const Path &light_path = light_paths_for_connection[k];
+            for (int num_light_vertices = 2;
+                 num_light_vertices <= (int)light_path.size();
+                 num_light_vertices++) {
+              int id = first[k] + num_light_vertices - 2;
+              light_subpaths[id] = LightSubpath{k, num_light_vertices};
+              hash_grid.push_back_to_all_cells_in_range(
+                  light_path[num_light_vertices - 1].pos, radius, id);
+            }
+          },
+          0, n_samples_per_stage, num_threads);
     }
-    hash_grid.build_grid();
-    // Generate eye paths (importons)
-    ThreadedTaskManager::run(
-        [&](int k) {
-          auto state_sequence = RandomStateSequence(
-              sampler, sample_count * 2 + n_samples_per_stage + k);
-          Path eye_path = trace_eye_path(state_sequence);
-          if (use_vm) {
-            write_path_contribution(vertex_merge(eye_path));
-          }
-          if (use_vc) {
-            write_path_contribution(
-                connect(eye_path, light_paths_for_connection[k], -1, -1,
-                        (int)use_vm * n_samples_per_stage));
-          }
-        },
-        0, n_samples_per_stage, num_threads);
+    TC_PROFILE("build_grid", hash_grid.build_grid());
+    // Generate eye paths (importons), as many per pixel of the crop window
+    // as over the whole frame otherwise. Light paths are not cropped, since
+    // merging needs all of them; light tracing, which connects the first
+    // |num_eye_paths| only, is scaled up.
+    int num_eye_paths = n_samples_per_stage;
+    real eye_scaling = 1, light_tracing_scaling = 1;
+    Vector2 size(1.0_f / width, 1.0_f / height);
+    Vector2 crop_offset = crop_begin.cast<real>() * size;
+    Vector2 crop_size = (crop_end - crop_begin).cast<real>() * size;
+    if (is_cropped()) {
+      num_eye_paths = std::max(
+          1, (int)((int64)n_samples_per_stage * get_crop_area() /
+                   ((int64)width * height)));
+      light_tracing_scaling = (real)n_samples_per_stage / num_eye_paths;
+      eye_scaling =
+          light_tracing_scaling * get_crop_area() / ((real)width * height);
+    }
+    TC_PROFILE(
+        "eye_paths",
+        ThreadedTaskManager::run(
+            [&](int k) {
+              auto state_sequence = RandomStateSequence(
+                  sampler, sample_count * 2 + n_samples_per_stage + k);
+              Path eye_path =
+                  trace_eye_path(state_sequence, crop_offset, crop_size);
+              if (use_vm) {
+                write_path_contribution(vertex_merge(eye_path), eye_scaling);
+              }
+              if (use_vc) {
+                PathContribution pc;
+                connect_and_write(eye_path, light_paths_for_connection[k], pc,
+                                  eye_scaling, light_tracing_scaling,
+                                  (int)use_vm * n_samples_per_stage);
+              }
+            },
+            0, num_eye_paths, num_threads));
     sample_count += n_samples_per_stage;
   }
+
+ protected:
+  // The merging radius starts over
+  void reset_accumulation() override {
+    BidirectionalRenderer::reset_accumulation();
+    num_stages = 0;
+    radius = initial_radius;
+  }
+
+  TC_RENDERER_CHECKPOINT
+
+  template <typename S>
+  void checkpoint_io(S &serializer) {
+    BidirectionalRenderer::checkpoint_io(serializer);
+    TC_IO(num_stages);
+  }
 };
 
 TC_IMPLEMENTATION(Renderer, VCMRenderer, "vcm");
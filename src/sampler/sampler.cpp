@@ -5,17 +5,69 @@
 
 #include <taichi/visual/sampler.h>
 
+#include <algorithm>
+
 #include "sobol.h"
 
 TC_NAMESPACE_BEGIN
 
+namespace {
+
+uint32 hash32(uint32 x) {
+  x ^= x >> 16;
+  x *= 0x7feb352du;
+  x ^= x >> 15;
+  x *= 0x846ca68bu;
+  x ^= x >> 16;
+  return x;
+}
+
+uint32 hash_combine(uint32 seed, uint32 v) {
+  return hash32(seed ^ (v + 0x9e3779b9u + (seed << 6) + (seed >> 2)));
+}
+
+uint32 get_pixel_seed(uint64 pixel, uint32 seed) {
+  return hash32(uint32(pixel) ^ hash32(uint32(pixel >> 32) ^ hash32(seed)));
+}
+
+}  // namespace
+
+// Counter-based: each (d, i) is hashed on its own (SplitMix64), so samples
+// are reproducible and threads share no generator state
 class PseudoRandomSampler : public Sampler {
  public:
   void initialize(const Dict &config) override {
+    seed = (uint64)config.get("seed", 0);
+  }
+
+  real sample(int d, long long i) const override {
+    return to_real(mix(instance_key(i) + (uint64(d) + 1) * golden_gamma));
+  }
+
+  void fill(long long i, int d0, int count, real *out) const override {
+    uint64 key = instance_key(i) + uint64(d0) * golden_gamma;
+    for (int k = 0; k < count; k++) {
+      out[k] = to_real(mix(key + uint64(k + 1) * golden_gamma));
+    }
+  }
+
+ private:
+  static constexpr uint64 golden_gamma = 0x9E3779B97F4A7C15ull;
+  uint64 seed = 0;
+
+  static uint64 mix(uint64 z) {
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
   }
 
-  real sample(int d, long long i) const {
-    return rand();
+  uint64 instance_key(long long i) const {
+    return mix(uint64(i) ^ mix(seed));
+  }
+
+  // Top 24 bits, so that the result is exactly representable and below 1
+  static real to_real(uint64 z) {
+    return (real)(z >> 40) * (1.0_f / (1 << 24));
   }
 };
 
@@ -44,15 +96,49 @@ class PrimeList {
   std::vector<int> primes;
 };
 
+// With "num_pixels" > 1, instance i is sample i / num_pixels of pixel
+// i % num_pixels, as the renderers number them, and every pixel has its own
+// toroidal shift of the points [Cranley and Patterson 1976]. Otherwise the
+// low digits of instances k * num_pixels + p would be the same for all the
+// samples of a pixel, and so would its first dimensions.
 class HaltonSampler : public Sampler {
  public:
-  real sample(int d, long long i) const {
+  void initialize(const Dict &config) override {
+    num_pixels = std::max(config.get("num_pixels", 1), 1);
+  }
+
+  real sample(int d, long long i) const override {
     assert(d < prime_list.get_num_primes());
-    real val = hal(d, i + 1);  // The first one is evil...
-    return val;
+    real ret;
+    fill(i, d, 1, &ret);
+    return ret;
+  }
+
+  // Each dimension has its own base, so there is no work to share; this only
+  // keeps look-ahead past the last prime from asserting. Those are 0.
+  void fill(long long i, int d0, int count, real *out) const override {
+    int num_primes = prime_list.get_num_primes();
+    long long index = i / num_pixels;
+    uint32 pixel_seed = get_pixel_seed(uint64(i % num_pixels), 0);
+    for (int k = 0; k < count; k++) {
+      if (d0 + k >= num_primes) {
+        out[k] = 0;
+        continue;
+      }
+      // The first one is evil...
+      real val = hal(d0 + k, index + 1);
+      if (num_pixels > 1) {
+        val += (hash_combine(pixel_seed, uint32(d0 + k)) >> 8) *
+               (1.0_f / (1 << 24));
+        val -= val >= 1 ? 1 : 0;
+      }
+      out[k] = val;
+    }
   }
 
  private:
+  int num_pixels = 1;
+
   inline int rev(const int i, const int p) const {
     return i == 0 ? i : p - i;
   }
@@ -73,13 +159,127 @@ PrimeList HaltonSampler::prime_list;
 
 TC_IMPLEMENTATION(Sampler, HaltonSampler, "halton")
 
+// With "num_pixels" > 1, instance i is sample i / num_pixels of pixel
+// i % num_pixels, as the renderers number them, and every pixel XORs the
+// digits of its points with its own random bits [Kollig and Keller 2002],
+// which keeps them a (0, 2)-sequence. Unscrambled, the low bits of instances
+// k * num_pixels + p would be the same for all the samples of a pixel, and
+// with a power-of-two number of pixels so would its first dimension.
 class SobolSampler : public Sampler {
  public:
-  real sample(int d, long long i) const {
-    return sobol::sample(i, d);
+  void initialize(const Dict &config) override {
+    num_pixels = std::max(config.get("num_pixels", 1), 1);
+  }
+
+  real sample(int d, long long i) const override {
+    return sobol::sample(i / num_pixels, d, get_scramble(i, d));
+  }
+
+  // Dimensions past the table are 0
+  void fill(long long i, int d0, int count, real *out) const override {
+    const int num_dimensions = (int)sobol::Matrices::num_dimensions;
+    const int chunk = 16;
+    long long index = i / num_pixels;
+    unsigned bits[chunk];
+    int k = 0;
+    while (k < count) {
+      int d = d0 + k;
+      int n = std::min(std::min(count - k, chunk), num_dimensions - d);
+      if (n <= 0) {
+        std::fill(out + k, out + count, 0.0_f);
+        break;
+      }
+      sobol::sample_integers((unsigned long long)index, d, n, bits);
+      for (int j = 0; j < n; j++) {
+        bits[j] ^= get_scramble(i, d + j);
+        out[k + j] = bits[j] * (1.0_f / (1ULL << 32));
+      }
+      k += n;
+    }
+  }
+
+ private:
+  int num_pixels = 1;
+
+  uint32 get_scramble(long long i, int d) const {
+    if (num_pixels == 1) {
+      return 0;
+    }
+    return hash_combine(get_pixel_seed(uint64(i % num_pixels), 0), uint32(d));
   }
 };
 
 TC_IMPLEMENTATION(Sampler, SobolSampler, "sobol")
 
+// Sobol points with hash-based Owen scrambling (Burley, "Practical Hash-based
+// Owen Scrambling"). Instance i is sample i / num_pixels of pixel
+// i % num_pixels, as the renderers number them. Every pixel scrambles with
+// its own seeds, so neighbouring pixels do not share their error, while the
+// samples of a pixel keep the stratification of a (0, 2)-sequence however
+// many pixels there are. Dimensions go in groups of four, each with the point
+// index shuffled by its own seed (padding), so there is no limit on them and
+// any sample costs the same few bit operations.
+class OwenSobolSampler : public Sampler {
+ public:
+  void initialize(const Dict &config) override {
+    seed = (uint32)config.get("seed", 0);
+    num_pixels = std::max(config.get("num_pixels", 1), 1);
+  }
+
+  real sample(int d, long long i) const override {
+    real ret;
+    fill(i, d, 1, &ret);
+    return ret;
+  }
+
+  void fill(long long i, int d0, int count, real *out) const override {
+    uint64 pixel = uint64(i) % num_pixels;
+    uint32 index = uint32(uint64(i) / num_pixels);
+    uint32 pixel_seed = get_pixel_seed(pixel, seed);
+    unsigned bits[4];
+    int group = -1;
+    uint32 group_seed = 0;
+    for (int k = 0; k < count; k++) {
+      int d = d0 + k;
+      if (d / 4 != group) {
+        group = d / 4;
+        group_seed = hash_combine(pixel_seed, uint32(group));
+        sobol::sample_integers(nested_uniform_scramble(index, group_seed), 0,
+                               4, bits);
+      }
+      uint32 x = nested_uniform_scramble(
+          bits[d % 4], hash_combine(group_seed, uint32(d % 4 + 1)));
+      // Top 24 bits, so that the result is exactly representable and below 1
+      out[k] = (real)(x >> 8) * (1.0_f / (1 << 24));
+    }
+  }
+
+ private:
+  uint32 seed = 0;
+  int num_pixels = 1;
+
+  static uint32 reverse_bits(uint32 x) {
+    x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+    x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+    x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+    x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+    return (x >> 16) | (x << 16);
+  }
+
+  // Each bit is flipped by a hash of the bits above it, which is an Owen
+  // scramble. The Laine-Karras style permutation mixes upwards only, hence
+  // the reversals; the constants are Vegdahl's.
+  static uint32 nested_uniform_scramble(uint32 x, uint32 seed) {
+    x = reverse_bits(x);
+    x ^= x * 0x3d20adeau;
+    x += seed;
+    x *= (seed >> 16) | 1;
+    x ^= x * 0x05526c56u;
+    x ^= x * 0x53a22864u;
+    return reverse_bits(x);
+  }
+};
+
+TC_IMPLEMENTATION(Sampler, OwenSobolSampler, "owen_sobol")
+
 TC_NAMESPACE_END
@@ -27,6 +27,7 @@
 #define SOBOL_H
 
 #include <taichi/common/util.h>
+#include <vector>
 
 namespace sobol {
 
@@ -56,6 +57,44 @@ inline float sample(unsigned long long index,
   return result * (1.f / (1ULL << 32));
 }
 
+// Matrices::matrices transposed to [bit][dimension]
+inline const unsigned *transposed_matrices() {
+  static const std::vector<unsigned> table = [] {
+    std::vector<unsigned> t(Matrices::size * Matrices::num_dimensions);
+    for (unsigned d = 0; d < Matrices::num_dimensions; d++) {
+      for (unsigned b = 0; b < Matrices::size; b++) {
+        t[b * Matrices::num_dimensions + d] =
+            Matrices::matrices[d * Matrices::size + b];
+      }
+    }
+    return t;
+  }();
+  return table.data();
+}
+
+// Components [dimension, dimension + count) of point |index|, as unscaled
+// 32-bit integers. The loop over index bits is shared, and the inner loop
+// runs over consecutive dimensions of the transposed table, so it
+// vectorizes.
+TC_MULTIVERSIONED inline void sample_integers(unsigned long long index,
+                                              const unsigned dimension,
+                                              const unsigned count,
+                                              unsigned *out,
+                                              const unsigned scramble = 0U) {
+  assert(dimension + count <= Matrices::num_dimensions);
+  for (unsigned k = 0; k < count; k++) {
+    out[k] = scramble;
+  }
+  const unsigned *row = transposed_matrices() + dimension;
+  for (; index; index >>= 1, row += Matrices::num_dimensions) {
+    if (index & 1) {
+      for (unsigned k = 0; k < count; k++) {
+        out[k] ^= row[k];
+      }
+    }
+  }
+}
+
 }  // namespace sobol
 
 #endif
@@ -0,0 +1,1309 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+// Smoke3D distributed over MPI ranks, for grids beyond the memory of one
+// node. Built with TC_USE_MPI.
+
+#ifdef TC_USE_MPI
+
+#include <mpi.h>
+#include <algorithm>
+#include <cstdlib>
+#include <taichi/common/util.h>
+#include <taichi/common/asset_manager.h>
+#include <taichi/dynamics/poisson_solver.h>
+#include <taichi/dynamics/simulation.h>
+#include <taichi/math/array_3d.h>
+#include <taichi/system/statistics.h>
+#include <taichi/system/threading.h>
+#include <taichi/system/timer.h>
+#include <taichi/visual/texture.h>
+#include "fluid_3d.h"
+
+TC_NAMESPACE_BEGIN
+
+// Contiguous ranges of the x slices of a grid: rank r owns the slices
+// [begin[r], begin[r + 1]). The first ranks are active and own at least two
+// slices each, starting at even slices so that a coarser level of the grid
+// is split at the halves; the other ranks own none.
+struct SlabPartition {
+  std::vector<int> begin;
+
+  SlabPartition() {
+  }
+
+  // |slices| split as evenly as possible over the first |active| of
+  // |num_ranks| ranks
+  SlabPartition(int slices, int num_ranks, int active)
+      : begin(num_ranks + 1, slices) {
+    for (int r = 0; r < active; r++) {
+      begin[r] = (int)((int64)slices * r / active) / 2 * 2;
+    }
+  }
+
+  int get_num_ranks() const {
+    return (int)begin.size() - 1;
+  }
+
+  int get_begin(int rank) const {
+    return begin[rank];
+  }
+
+  int get_end(int rank) const {
+    return begin[rank + 1];
+  }
+
+  int get_size(int rank) const {
+    return begin[rank + 1] - begin[rank];
+  }
+
+  int get_num_active() const {
+    int active = 0;
+    while (active < get_num_ranks() && get_size(active) > 0) {
+      active++;
+    }
+    return active;
+  }
+
+  // The rank owning slice |x|
+  int get_owner(int x) const {
+    return int(std::upper_bound(begin.begin(), begin.end(), x) -
+               begin.begin()) -
+           1;
+  }
+
+  // The slices of the coarser level below the slices of each rank
+  SlabPartition coarsen() const {
+    SlabPartition coarse;
+    coarse.begin = begin;
+    for (auto &b : coarse.begin) {
+      b /= 2;
+    }
+    return coarse;
+  }
+
+  bool operator==(const SlabPartition &o) const {
+    return begin == o.begin;
+  }
+};
+
+// Starts the exchange of the halo slices of |arr|, which stores the slices
+// [begin - halo, end + halo + extra) of the rank: the lower neighbour sends
+// its last |halo| slices, and the upper one its first halo + extra (with
+// extra = 1 for the faces along x, the upper one also owning the face
+// between the slabs). The requests are appended to |requests|.
+template <typename T>
+void post_halo_exchange(Array3D<T> &arr,
+                        const SlabPartition &partition,
+                        int rank,
+                        int halo,
+                        int extra,
+                        int tag,
+                        MPI_Comm comm,
+                        std::vector<MPI_Request> &requests) {
+  int n = partition.get_size(rank);
+  if (n == 0) {
+    return;
+  }
+  const int64 stride = (int64)arr.get_res()[1] * arr.get_res()[2];
+  const int64 slice_bytes = stride * sizeof(T);
+  TC_ERROR_IF((halo + extra) * slice_bytes > (int64)1 << 31,
+              "Halos of {} slices of {} bytes are too large", halo + extra,
+              slice_bytes);
+  auto slice = [&](int x) { return (void *)&arr.data[x * stride]; };
+  auto transfer = [&](bool send, int x, int slices, int neighbour, int t) {
+    requests.emplace_back();
+    if (send) {
+      MPI_Isend(slice(x), int(slices * slice_bytes), MPI_BYTE, neighbour, t,
+                comm, &requests.back());
+    } else {
+      MPI_Irecv(slice(x), int(slices * slice_bytes), MPI_BYTE, neighbour, t,
+                comm, &requests.back());
+    }
+  };
+  if (rank > 0) {
+    transfer(false, 0, halo, rank - 1, tag);
+    transfer(true, halo, halo + extra, rank - 1, tag + 1);
+  }
+  if (rank + 1 < partition.get_num_ranks() &&
+      partition.get_size(rank + 1) > 0) {
+    transfer(false, halo + n, halo + extra, rank + 1, tag + 1);
+    transfer(true, n, halo, rank + 1, tag);
+  }
+}
+
+static void wait_all(std::vector<MPI_Request> &requests) {
+  MPI_Waitall((int)requests.size(), requests.data(), MPI_STATUSES_IGNORE);
+  requests.clear();
+}
+
+// Moves the slices of |src|, owned as in |from|, to |dst|, owned as in |to|;
+// both arrays store |halo| slices around those of the rank. Collective.
+template <typename T>
+void redistribute(const Array3D<T> &src,
+                  const SlabPartition &from,
+                  Array3D<T> &dst,
+                  const SlabPartition &to,
+                  int halo,
+                  int rank,
+                  MPI_Comm comm) {
+  const int64 stride = (int64)src.get_res()[1] * src.get_res()[2];
+  if (from == to) {
+    std::copy(&src.data[halo * stride],
+              &src.data[(halo + from.get_size(rank)) * stride],
+              &dst.data[halo * stride]);
+    return;
+  }
+  int num_ranks = from.get_num_ranks();
+  std::vector<int> send_counts(num_ranks), send_displs(num_ranks),
+      recv_counts(num_ranks), recv_displs(num_ranks);
+  for (int r = 0; r < num_ranks; r++) {
+    int lower = std::max(from.get_begin(rank), to.get_begin(r));
+    int upper = std::min(from.get_end(rank), to.get_end(r));
+    send_counts[r] = std::max(0, upper - lower);
+    send_displs[r] = lower - from.get_begin(rank) + halo;
+    lower = std::max(from.get_begin(r), to.get_begin(rank));
+    upper = std::min(from.get_end(r), to.get_end(rank));
+    recv_counts[r] = std::max(0, upper - lower);
+    recv_displs[r] = lower - to.get_begin(rank) + halo;
+  }
+  MPI_Datatype slice;
+  MPI_Type_contiguous(int(stride * sizeof(T)), MPI_BYTE, &slice);
+  MPI_Type_commit(&slice);
+  MPI_Alltoallv((void *)src.data.data(), send_counts.data(),
+                send_displs.data(), slice, (void *)dst.data.data(),
+                recv_counts.data(), recv_displs.data(), slice, comm);
+  MPI_Type_free(&slice);
+}
+
+// The multigrid-preconditioned conjugate gradient of "mgpcg" on a grid split
+// in slabs, with the same operator and boundary conditions. Each level is
+// split over the ranks that keep at least min_slices slices of it, so the
+// coarse levels are gathered to fewer ranks, and the coarsest ones to rank 0
+// only. Smoothing and the operator exchange the halo slices in the
+// background while they update the interior slices.
+class DistributedPoissonSolver3D {
+ public:
+  using CellType = PoissonSolver3D::CellType;
+  using Array = Array3D<real>;
+  static constexpr int min_slices = 4;
+  static constexpr int size_threshold = 64;
+
+  // The slices [begin - 1, end + 1) of the rank
+  struct Level {
+    Vector3i res;
+    SlabPartition partition;
+    int begin, end;
+    Array pressure, residual, tmp;
+    Array3D<CellType> types;
+    // Per cell, the diagonal of the operator (the number of INTERIOR and
+    // DIRICHLET neighbours, or 0 without a degree of freedom), its inverse,
+    // and a bit per INTERIOR neighbour
+    Array3D<uint8> diagonal, neighbours;
+    Array inv_diagonal;
+    // The restriction of this level, or the correction prolongated to it,
+    // over the coarse slices below [begin, end)
+    Array coarse;
+    Array3D<CellType> coarse_types;
+
+    int get_num_slices() const {
+      return end - begin;
+    }
+  };
+
+  std::vector<Level> levels;
+  CellType padding;
+  bool has_null_space;
+  int maximum_iterations;
+  int last_iterations = 0;
+  int num_threads;
+  int rank;
+  MPI_Comm comm;
+
+  void initialize(const Vector3i &res,
+                  const SlabPartition &partition,
+                  CellType padding,
+                  int maximum_iterations,
+                  int num_threads,
+                  MPI_Comm comm) {
+    this->padding = padding;
+    this->maximum_iterations = maximum_iterations;
+    this->num_threads = num_threads;
+    this->comm = comm;
+    MPI_Comm_rank(comm, &rank);
+    levels.clear();
+    Vector3i level_res = res;
+    SlabPartition level_partition = partition;
+    while (true) {
+      levels.emplace_back();
+      Level &level = levels.back();
+      level.res = level_res;
+      level.partition = level_partition;
+      level.begin = level_partition.get_begin(rank);
+      level.end = level_partition.get_end(rank);
+      Vector3i local(level.get_num_slices() + 2, level_res[1], level_res[2]);
+      level.pressure = Array(local);
+      level.residual = Array(local);
+      level.tmp = Array(local);
+      level.types = Array3D<CellType>(local, PoissonSolver3D::INTERIOR);
+      level.diagonal = Array3D<uint8>(local, 0);
+      level.neighbours = Array3D<uint8>(local, 0);
+      level.inv_diagonal = Array(local);
+      bool odd = level_res[0] % 2 || level_res[1] % 2 || level_res[2] % 2;
+      if ((int64)level_res[0] * level_res[1] * level_res[2] <=
+              size_threshold ||
+          odd) {
+        break;
+      }
+      level_res /= Vector3i(2);
+      Vector3i coarse(level.get_num_slices() / 2 + 2, level_res[1],
+                      level_res[2]);
+      level.coarse = Array(coarse);
+      level.coarse_types = Array3D<CellType>(coarse, 0);
+      int active = clamp(level_res[0] / min_slices, 1,
+                         level_partition.get_num_active());
+      level_partition =
+          SlabPartition(level_res[0], level_partition.get_num_ranks(), active);
+    }
+  }
+
+  // |boundary| holds the cell types of the slices [begin - 1, end + 1) of
+  // the finest level; those of the halo are exchanged
+  void set_boundary_condition(const Array3D<CellType> &boundary) {
+    Level &finest = levels[0];
+    int64 stride = (int64)finest.res[1] * finest.res[2];
+    std::copy(&boundary.data[stride],
+              &boundary.data[(finest.get_num_slices() + 1) * stride],
+              &finest.types.data[stride]);
+    int64 num_dirichlet = 0, total = 0;
+    for (int64 c = stride; c < (finest.get_num_slices() + 1) * stride; c++) {
+      num_dirichlet += finest.types.data[c] == PoissonSolver3D::DIRICHLET;
+    }
+    MPI_Allreduce(&num_dirichlet, &total, 1, MPI_INT64_T, MPI_SUM, comm);
+    has_null_space = padding == PoissonSolver3D::NEUMANN && total == 0;
+    for (int l = 0; l < (int)levels.size(); l++) {
+      Level &level = levels[l];
+      if (l > 0) {
+        coarsen_types(l);
+      }
+      std::vector<MPI_Request> requests;
+      post_halo_exchange(level.types, level.partition, rank, 1, 0, 0, comm,
+                         requests);
+      wait_all(requests);
+      build_rows(level);
+    }
+  }
+
+  // Solves L x = b, with |x| holding the initial guess; both store the
+  // slices [begin - 1, end + 1) of the finest level
+  void run(const Array &b, Array &x, real tolerance) {
+    Level &finest = levels[0];
+    Array r = finest.pressure.same_shape(), z = r.same_shape(),
+          q = r.same_shape();
+    compute_residual(finest, x, b, r);
+    // With a null space, the solution of the system without the mean of b
+    remove_mean(r);
+    real nu = abs_max(r);
+    last_iterations = 0;
+    if (nu < tolerance) {
+      return;
+    }
+    Array p = precondition(r);
+    double rho = dot(p, r);
+    for (int count = 0; count <= maximum_iterations; count++) {
+      apply_L(finest, p, q);
+      double sigma = dot(p, q);
+      double alpha = rho / std::max(1e-20, sigma);
+      nu = update_residual(r, -(real)alpha, q);
+      last_iterations = count + 1;
+      TC_STAT("poisson_cg_iterations", 1);
+      if (nu < tolerance || count == maximum_iterations) {
+        for_each_owned(finest,
+                       [&](int64 c) { x.data[c] += (real)alpha * p.data[c]; });
+        return;
+      }
+      z = precondition(r);
+      double rho_new = dot(z, r);
+      double beta = rho_new / rho;
+      rho = rho_new;
+      for_each_owned(finest, [&](int64 c) {
+        x.data[c] += (real)alpha * p.data[c];
+        p.data[c] = z.data[c] + (real)beta * p.data[c];
+      });
+    }
+  }
+
+  int get_last_iterations() const {
+    return last_iterations;
+  }
+
+ private:
+  // Calls f(c) for the data offsets c of the cells of the rank, slices in
+  // parallel
+  template <typename F>
+  void for_each_owned(const Level &level, const F &f) const {
+    const int64 stride = (int64)level.res[1] * level.res[2];
+    ThreadedTaskManager::run(
+        [&](int x) {
+          for (int64 c = x * stride; c < (x + 1) * stride; c++) {
+            f(c);
+          }
+        },
+        1, level.get_num_slices() + 1, num_threads);
+  }
+
+  // Calls f(x) for the local slices of the cells of the rank: the interior
+  // ones while the halo of |arr| is exchanged, then the two next to it
+  template <typename F>
+  void for_each_slice_overlapped(const Level &level, Array &arr, const F &f) {
+    int n = level.get_num_slices();
+    if (n == 0) {
+      return;
+    }
+    std::vector<MPI_Request> requests;
+    post_halo_exchange(arr, level.partition, rank, 1, 0, 0, comm, requests);
+    ThreadedTaskManager::run([&](int x) { f(x); }, 2, n, num_threads);
+    wait_all(requests);
+    f(1);
+    if (n > 1) {
+      f(n);
+    }
+  }
+
+  // The sum over the ranks of the partial results of the slices, combined
+  // in order
+  template <typename F>
+  double reduce_sum(const F &f) const {
+    const Level &finest = levels[0];
+    const int64 stride = (int64)finest.res[1] * finest.res[2];
+    std::vector<double> partial(finest.get_num_slices() + 2, 0.0);
+    ThreadedTaskManager::run(
+        [&](int x) { partial[x] = f(x * stride, (x + 1) * stride); }, 1,
+        finest.get_num_slices() + 1, num_threads);
+    double local = 0, total = 0;
+    for (auto v : partial) {
+      local += v;
+    }
+    MPI_Allreduce(&local, &total, 1, MPI_DOUBLE, MPI_SUM, comm);
+    return total;
+  }
+
+  real abs_max(const Array &r) const {
+    const Level &finest = levels[0];
+    const int64 stride = (int64)finest.res[1] * finest.res[2];
+    double local = 0, total = 0;
+    for (int64 c = stride; c < (finest.get_num_slices() + 1) * stride; c++) {
+      local = std::max(local, (double)std::abs(r.data[c]));
+    }
+    MPI_Allreduce(&local, &total, 1, MPI_DOUBLE, MPI_MAX, comm);
+    return (real)total;
+  }
+
+  double dot(const Array &a, const Array &b) const {
+    return reduce_sum([&](int64 begin, int64 end) {
+      double ret = 0;
+      for (int64 c = begin; c < end; c++) {
+        ret += a.data[c] * b.data[c];
+      }
+      return ret;
+    });
+  }
+
+  // r += alpha z, removing the mean of r if the system has a null space;
+  // returns max |r|
+  real update_residual(Array &r, real alpha, const Array &z) {
+    for_each_owned(levels[0],
+                   [&](int64 c) { r.data[c] += alpha * z.data[c]; });
+    remove_mean(r);
+    return abs_max(r);
+  }
+
+  // Unless the system has no null space
+  void remove_mean(Array &r) {
+    if (!has_null_space) {
+      return;
+    }
+    const Level &finest = levels[0];
+    double num_cells = (double)finest.res[0] * finest.res[1] * finest.res[2];
+    real mean = (real)(reduce_sum([&](int64 begin, int64 end) {
+                         double ret = 0;
+                         for (int64 c = begin; c < end; c++) {
+                           ret += r.data[c];
+                         }
+                         return ret;
+                       }) /
+                       num_cells);
+    for_each_owned(finest, [&](int64 c) { r.data[c] -= mean; });
+  }
+
+  // Without its mean, so that with a null space the directions do not grow
+  // along it, as they do for an inconsistent right-hand side
+  Array precondition(const Array &r) {
+    levels[0].residual = r;
+    v_cycle(0);
+    remove_mean(levels[0].pressure);
+    return levels[0].pressure;
+  }
+
+  // One V-cycle from a zero guess, as that of "mgpcg"; every rank takes
+  // part in those of all levels, for the collective redistributions
+  void v_cycle(int l) {
+    if (l == 0) {
+      TC_STAT("poisson_v_cycles", 1);
+    }
+    Level &level = levels[l];
+    level.pressure.reset(0.0_f);
+    if (l + 1 == (int)levels.size()) {
+      smooth(level, 100);
+      return;
+    }
+    Level &coarse = levels[l + 1];
+    smooth(level, 4);
+    compute_residual(level, level.pressure, level.residual, level.tmp);
+    restrict_residual(level);
+    redistribute(level.coarse, level.partition.coarsen(), coarse.residual,
+                 coarse.partition, 1, rank, comm);
+    for_each_owned(coarse, [&](int64 c) {
+      if (coarse.diagonal.data[c] == 0) {
+        coarse.residual.data[c] = 0.0_f;
+      }
+    });
+    v_cycle(l + 1);
+    redistribute(coarse.pressure, coarse.partition, level.coarse,
+                 level.partition.coarsen(), 1, rank, comm);
+    prolongate(level);
+    smooth(level, 4);
+  }
+
+  // Red-black Gauss-Seidel, with the colors of the global cells
+  void smooth(Level &level, int rounds) {
+    const int sx = level.res[1] * level.res[2], sy = level.res[2];
+    const int offsets[6] = {1, -1, sy, -sy, sx, -sx};
+    for (int s = 0; s < 2 * rounds; s++) {
+      int color = s % 2;
+      const real *r = level.residual.data.data();
+      real *p = level.pressure.data.data();
+      for_each_slice_overlapped(level, level.pressure, [&](int x) {
+        int global_x = level.begin + x - 1;
+        for (int y = 0; y < level.res[1]; y++) {
+          int z = (global_x + y + color) % 2;
+          for (int o = x * sx + y * sy + z; o < x * sx + (y + 1) * sy;
+               o += 2) {
+            real sum = r[o];
+            uint8 mask = level.neighbours.data[o];
+            for (int b = 0; b < 6; b++) {
+              if (mask >> b & 1) {
+                sum += p[o + offsets[b]];
+              }
+            }
+            p[o] = sum * level.inv_diagonal.data[o];
+          }
+        }
+      });
+    }
+  }
+
+  // L p on the cells of the rank
+  TC_FORCE_INLINE static real apply_row(const Level &level,
+                                        const real *p,
+                                        int64 o) {
+    const int64 sx = level.res[1] * level.res[2], sy = level.res[2];
+    const int64 offsets[6] = {1, -1, sy, -sy, sx, -sx};
+    real sum = level.diagonal.data[o] * p[o];
+    uint8 mask = level.neighbours.data[o];
+    for (int b = 0; b < 6; b++) {
+      if (mask >> b & 1) {
+        sum -= p[o + offsets[b]];
+      }
+    }
+    return sum;
+  }
+
+  void apply_L(const Level &level, Array &p, Array &output) {
+    const int64 stride = (int64)level.res[1] * level.res[2];
+    for_each_slice_overlapped(level, p, [&](int x) {
+      for (int64 o = x * stride; o < (x + 1) * stride; o++) {
+        output.data[o] = level.diagonal.data[o] == 0
+                             ? 0.0_f
+                             : apply_row(level, p.data.data(), o);
+      }
+    });
+  }
+
+  void compute_residual(const Level &level,
+                        Array &p,
+                        const Array &b,
+                        Array &residual) {
+    const int64 stride = (int64)level.res[1] * level.res[2];
+    for_each_slice_overlapped(level, p, [&](int x) {
+      for (int64 o = x * stride; o < (x + 1) * stride; o++) {
+        residual.data[o] = level.diagonal.data[o] == 0
+                               ? 0.0_f
+                               : b.data[o] - apply_row(level, p.data.data(), o);
+      }
+    });
+  }
+
+  // Sums the residual of the children of each coarse cell below the slices
+  // of the rank into level.coarse
+  void restrict_residual(Level &level) {
+    const Array &fine = level.tmp;
+    ThreadedTaskManager::run(
+        [&](int x) {
+          for (int y = 0; y < level.coarse.get_res()[1]; y++) {
+            for (int z = 0; z < level.coarse.get_res()[2]; z++) {
+              real sum = 0;
+              for (int i = 0; i < 2; i++) {
+                for (int j = 0; j < 2; j++) {
+                  for (int k = 0; k < 2; k++) {
+                    sum += fine[x * 2 - 1 + i][y * 2 + j][z * 2 + k];
+                  }
+                }
+              }
+              level.coarse[x][y][z] = sum;
+            }
+          }
+        },
+        1, level.get_num_slices() / 2 + 1, num_threads);
+  }
+
+  void prolongate(Level &level) {
+    ThreadedTaskManager::run(
+        [&](int x) {
+          for (int y = 0; y < level.res[1]; y++) {
+            for (int z = 0; z < level.res[2]; z++) {
+              // Do not prolongate to cells without a degree of freedom
+              if (level.diagonal[x][y][z] > 0) {
+                level.pressure[x][y][z] +=
+                    level.coarse[(x + 1) / 2][y / 2][z / 2] * 0.5f;
+              }
+            }
+          }
+        },
+        1, level.get_num_slices() + 1, num_threads);
+  }
+
+  // As in "mgpcg": coarse cells are Dirichlet if a child is, Neumann if all
+  // are, and interior otherwise
+  void coarsen_types(int l) {
+    Level &fine = levels[l - 1];
+    ThreadedTaskManager::run(
+        [&](int x) {
+          for (int y = 0; y < fine.coarse_types.get_res()[1]; y++) {
+            for (int z = 0; z < fine.coarse_types.get_res()[2]; z++) {
+              bool has_dirichlet = false, all_neumann = true;
+              for (int i = 0; i < 2; i++) {
+                for (int j = 0; j < 2; j++) {
+                  for (int k = 0; k < 2; k++) {
+                    CellType c =
+                        fine.types[x * 2 - 1 + i][y * 2 + j][z * 2 + k];
+                    has_dirichlet |= c == PoissonSolver3D::DIRICHLET;
+                    all_neumann &= c == PoissonSolver3D::NEUMANN;
+                  }
+                }
+              }
+              fine.coarse_types[x][y][z] =
+                  has_dirichlet ? PoissonSolver3D::DIRICHLET
+                                : (all_neumann ? PoissonSolver3D::NEUMANN
+                                               : PoissonSolver3D::INTERIOR);
+            }
+          }
+        },
+        1, fine.get_num_slices() / 2 + 1, num_threads);
+    redistribute(fine.coarse_types, fine.partition.coarsen(), levels[l].types,
+                 levels[l].partition, 1, rank, comm);
+  }
+
+  void build_rows(Level &level) {
+    const int offsets[6][3] = {{0, 0, 1},  {0, 0, -1}, {0, 1, 0},
+                               {0, -1, 0}, {1, 0, 0},  {-1, 0, 0}};
+    ThreadedTaskManager::run(
+        [&](int x) {
+          for (int y = 0; y < level.res[1]; y++) {
+            for (int z = 0; z < level.res[2]; z++) {
+              uint8 diagonal = 0, mask = 0;
+              for (int b = 0; b < 6; b++) {
+                Vector3i n(level.begin + x - 1 + offsets[b][0],
+                           y + offsets[b][1], z + offsets[b][2]);
+                CellType type = padding;
+                if (0 <= n.x && n.x < level.res[0] && 0 <= n.y &&
+                    n.y < level.res[1] && 0 <= n.z && n.z < level.res[2]) {
+                  type = level.types[x + offsets[b][0]][n.y][n.z];
+                }
+                if (type == PoissonSolver3D::INTERIOR) {
+                  mask |= 1 << b;
+                }
+                if (type != PoissonSolver3D::NEUMANN) {
+                  diagonal++;
+                }
+              }
+              if (level.types[x][y][z] != PoissonSolver3D::INTERIOR) {
+                diagonal = mask = 0;
+              }
+              level.diagonal[x][y][z] = diagonal;
+              level.neighbours[x][y][z] = mask;
+              level.inv_diagonal[x][y][z] =
+                  diagonal == 0 ? 0.0_f : 1.0_f / diagonal;
+            }
+          }
+        },
+        1, level.get_num_slices() + 1, num_threads);
+  }
+};
+
+// A field over the slices [first, first + values.get_res()[0]) of a global
+// grid of |slices| slices along x, positions being global as in Smoke3D
+struct SlabArray {
+  Array3D<real> values;
+  int first, slices;
+  Vector3 storage_offset;
+
+  TC_IO_DEF(values, first, slices, storage_offset);
+
+  void initialize(int first,
+                  int stored,
+                  int slices,
+                  const Vector2i &res,
+                  const Vector3 &storage_offset) {
+    this->first = first;
+    this->slices = slices;
+    this->storage_offset = storage_offset;
+    values = Array3D<real>(Vector3i(stored, res[0], res[1]), 0.0_f);
+  }
+
+  bool stores(int x) const {
+    return first <= x && x < first + values.get_res()[0];
+  }
+
+  real &operator()(int x, int y, int z) {
+    return values[x - first][y][z];
+  }
+
+  const real &operator()(int x, int y, int z) const {
+    return values[x - first][y][z];
+  }
+};
+
+// The trilinear interpolation of Array3D::sample() of the global grid
+struct SlabStencil {
+  int x_i, y_i, z_i;
+  real x_r, y_r, z_r;
+
+  SlabStencil(const SlabArray &arr, const Vector3 &pos) {
+    Vector3i res(arr.slices, arr.values.get_res()[1], arr.values.get_res()[2]);
+    Vector3 offset = arr.storage_offset;
+    real x = clamp(pos.x - offset.x, 0.0_f, res[0] - 1.0_f - eps);
+    real y = clamp(pos.y - offset.y, 0.0_f, res[1] - 1.0_f - eps);
+    real z = clamp(pos.z - offset.z, 0.0_f, res[2] - 1.0_f - eps);
+    x_i = clamp(int(x), 0, res[0] - 2);
+    y_i = clamp(int(y), 0, res[1] - 2);
+    z_i = clamp(int(z), 0, res[2] - 2);
+    x_r = x - x_i;
+    y_r = y - y_i;
+    z_r = z - z_i;
+  }
+
+  bool is_local(const SlabArray &arr) const {
+    return arr.stores(x_i) && arr.stores(x_i + 1);
+  }
+
+  real sample(const SlabArray &arr) const {
+    const int stride_y = arr.values.get_res()[2];
+    const int64 stride_x = (int64)arr.values.get_res()[1] * stride_y;
+    const real *p =
+        &arr.values.data[(x_i - arr.first) * stride_x + y_i * stride_y + z_i];
+    const real *px = p + stride_x;
+    return lerp(z_r,
+                lerp(x_r, lerp(y_r, p[0], p[stride_y]),
+                     lerp(y_r, px[0], px[stride_y])),
+                lerp(x_r, lerp(y_r, p[1], p[stride_y + 1]),
+                     lerp(y_r, px[1], px[stride_y + 1])));
+  }
+};
+
+// Smoke3D on the ranks of MPI_COMM_WORLD ("distributed_smoke"). The cells
+// are split in slabs along x, each rank storing 'halo_width' slices of u,
+// v, w, rho and t of its neighbours around its own. The exchange of the
+// halos runs while the slices that do not need them are advected, and
+// backtraces leaving the halo are sampled by the ranks that own their
+// stencils. The projection uses DistributedPoissonSolver3D.
+//
+// The forces, the CFL substeps, the sources and the semi-Lagrangian
+// advection are those of Smoke3D, and give the same results; there are no
+// trackers, vorticity confinement, MacCormack advection or sparse blocks.
+// Frames and checkpoints hold the slab of the rank.
+class DistributedSmoke3D : public Simulation3D {
+  using Base = Simulation3D;
+  using CellType = PoissonSolver3D::CellType;
+
+ public:
+  SlabArray u, v, w, rho, t;
+  // Of the cells [begin - 1, end + 1), as the pressure solver takes them
+  Array3D<real> pressure;
+  Array3D<CellType> boundary_condition;
+  Vector3i res;
+  real smoke_alpha, smoke_beta;
+  real temperature_decay;
+  real pressure_tolerance;
+  bool pressure_warm_start;
+  int super_sampling;
+  real cfl;
+  int maximum_substeps;
+  bool open_boundary;
+  int halo_width;
+  SlabArray advected[5];
+  // Of the faces of the rank, from begin; see Smoke3D::FaceMask
+  enum FaceMask : uint8 {
+    SUBTRACT_LOWER_PRESSURE = 1,
+    ADD_UPPER_PRESSURE = 2,
+    WALL = 4
+  };
+  Array3D<uint8> face_masks[3];
+  std::shared_ptr<Texture> generation_tex;
+  std::shared_ptr<Texture> initial_velocity_tex;
+  std::shared_ptr<Texture> color_tex;
+  std::shared_ptr<Texture> temperature_tex;
+  std::vector<SmokeSource> sources;
+  bool sources_dirty = true;
+
+  MPI_Comm comm = MPI_COMM_NULL;
+  int rank, num_ranks;
+  SlabPartition partition;
+  // The cells of the rank
+  int begin, end;
+  DistributedPoissonSolver3D pressure_solver;
+
+  TC_IO_DEF_WITH_BASE(u, v, w, rho, t, pressure);
+
+  ~DistributedSmoke3D() {
+    int finalized;
+    MPI_Finalized(&finalized);
+    if (comm != MPI_COMM_NULL && !finalized) {
+      MPI_Comm_free(&comm);
+    }
+  }
+
+  void initialize(const Config &config) override {
+    Simulation3D::initialize(config);
+    int initialized;
+    MPI_Initialized(&initialized);
+    if (!initialized) {
+      // Only this thread calls MPI
+      int provided;
+      MPI_Init_thread(nullptr, nullptr, MPI_THREAD_FUNNELED, &provided);
+      std::atexit([]() {
+        int finalized;
+        MPI_Finalized(&finalized);
+        if (!finalized) {
+          MPI_Finalize();
+        }
+      });
+    }
+    MPI_Comm_dup(MPI_COMM_WORLD, &comm);
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &num_ranks);
+
+    res = config.get<Vector3i>("resolution");
+    smoke_alpha = config.get("smoke_alpha", 0.0_f);
+    smoke_beta = config.get("smoke_beta", 0.0_f);
+    temperature_decay = config.get("temperature_decay", 0.0_f);
+    pressure_tolerance = config.get("pressure_tolerance", 0.0_f);
+    pressure_warm_start = config.get("pressure_warm_start", false);
+    num_threads = config.get<int>("num_threads");
+    super_sampling = config.get<int>("super_sampling");
+    cfl = config.get("cfl", 0.0_f);
+    maximum_substeps = config.get("maximum_substeps", 16);
+    TC_ASSERT_INFO(maximum_substeps >= 1, "maximum_substeps must be positive");
+    open_boundary = config.get<bool>("open_boundary");
+    TC_ERROR_IF(config.get("vorticity_confinement", 0.0_f) != 0.0_f ||
+                    config.get("sparse", false) ||
+                    config.get("advection", std::string("semi_lagrangian")) !=
+                        "semi_lagrangian",
+                "distributed_smoke supports neither vorticity confinement, "
+                "sparse blocks nor MacCormack advection");
+    // Velocities are sampled one slice into the halo
+    halo_width = config.get("halo_width", 4);
+    TC_ERROR_IF(halo_width < 2, "halo_width must be at least 2 instead of {}",
+                halo_width);
+    partition = SlabPartition(res[0], num_ranks, num_ranks);
+    begin = partition.get_begin(rank);
+    end = partition.get_end(rank);
+    int min_slices = res[0];
+    for (int r = 0; r < num_ranks; r++) {
+      min_slices = std::min(min_slices, partition.get_size(r));
+    }
+    TC_ERROR_IF(min_slices < halo_width + 1,
+                "{} slices over {} ranks leave {} per rank, fewer than "
+                "halo_width + 1 = {}",
+                res[0], num_ranks, min_slices, halo_width + 1);
+
+    int n = end - begin, h = halo_width;
+    u.initialize(begin - h, n + 2 * h + 1, res[0] + 1, Vector2i(res[1], res[2]),
+                 Vector3(0.0_f, 0.5f, 0.5f));
+    v.initialize(begin - h, n + 2 * h, res[0], Vector2i(res[1] + 1, res[2]),
+                 Vector3(0.5f, 0.0_f, 0.5f));
+    w.initialize(begin - h, n + 2 * h, res[0], Vector2i(res[1], res[2] + 1),
+                 Vector3(0.5f, 0.5f, 0.0_f));
+    rho.initialize(begin - h, n + 2 * h, res[0], Vector2i(res[1], res[2]),
+                   Vector3(0.5f));
+    t.initialize(begin - h, n + 2 * h, res[0], Vector2i(res[1], res[2]),
+                 Vector3(0.5f));
+    t.values.reset(config.get("initial_t", 0.0_f));
+    SlabArray *fields[5] = {&rho, &t, &u, &v, &w};
+    for (int f = 0; f < 5; f++) {
+      advected[f] = *fields[f];
+    }
+    pressure = Array3D<real>(Vector3i(n + 2, res[1], res[2]), 0.0_f);
+    boundary_condition = Array3D<CellType>(Vector3i(n + 2, res[1], res[2]),
+                                           PoissonSolver3D::INTERIOR);
+    pressure_solver.initialize(
+        res, partition,
+        open_boundary ? PoissonSolver3D::DIRICHLET : PoissonSolver3D::NEUMANN,
+        config.get<int>("maximum_pressure_iterations"), num_threads, comm);
+    update_boundary_masks();
+    current_t = 0.0_f;
+  }
+
+  int get_mpi_world_rank() const override {
+    return rank;
+  }
+
+  // Call after changing boundary_condition
+  void update_boundary_masks() {
+    std::vector<MPI_Request> requests;
+    post_halo_exchange(boundary_condition, partition, rank, 1, 0, 0, comm,
+                       requests);
+    wait_all(requests);
+    pressure_solver.set_boundary_condition(boundary_condition);
+    auto is_neumann = [&](const Vector3i &cell) -> bool {
+      if (0 <= cell.x && cell.x < res[0] && 0 <= cell.y && cell.y < res[1] &&
+          0 <= cell.z && cell.z < res[2]) {
+        return boundary_condition[cell.x - begin + 1][cell.y][cell.z] ==
+               PoissonSolver3D::NEUMANN;
+      } else {
+        return !open_boundary;
+      }
+    };
+    for (int d = 0; d < 3; d++) {
+      Vector3i axis = Vector3i::axis(d);
+      Vector3i shape = res + axis;
+      shape[0] = get_face_end(d) - begin;
+      Array3D<uint8> &mask = face_masks[d];
+      mask = Array3D<uint8>(shape, 0);
+      for (auto &ind : mask.get_region()) {
+        // The face between the cells lower and upper
+        Vector3i upper(begin + ind.i, ind.j, ind.k), lower = upper - axis;
+        uint8 m = 0;
+        if (upper[d] > 0 && !is_neumann(upper)) {
+          m |= SUBTRACT_LOWER_PRESSURE;
+        }
+        if (upper[d] < res[d] && !is_neumann(lower)) {
+          m |= ADD_UPPER_PRESSURE;
+        }
+        for (auto &cell : {lower, upper}) {
+          if (cell.x >= 0 && cell.x < res[0] && cell.y >= 0 &&
+              cell.y < res[1] && cell.z >= 0 && cell.z < res[2] &&
+              is_neumann(cell)) {
+            m |= WALL;
+          }
+        }
+        if (!open_boundary && (upper[d] == 0 || upper[d] == res[d] - 1)) {
+          m |= WALL;
+        }
+        mask[ind] = m;
+      }
+    }
+  }
+
+  // The end of the faces of the rank along x for u (d = 0), which includes
+  // the upper boundary on the last rank, or v and w
+  int get_face_end(int d) const {
+    return end + int(d == 0 && end == res[0]);
+  }
+
+  void step(real delta_t) override {
+    {
+      Time::Timer _("Seeding");
+      seed();
+    }
+    if (cfl <= 0) {
+      substep(delta_t);
+      return;
+    }
+    real remaining = delta_t;
+    int substeps_left = maximum_substeps;
+    while (substeps_left > 0 && remaining > 0) {
+      real max_speed = get_max_speed();
+      int n = substeps_left;
+      if (max_speed * remaining < cfl * substeps_left) {
+        n = std::max(1, (int)std::ceil(max_speed * remaining / cfl));
+      }
+      real dt = remaining / n;
+      substep(dt);
+      remaining -= dt;
+      substeps_left--;
+    }
+  }
+
+  // As in Smoke3D::step(), from the sources in the cells of the rank
+  void seed() {
+    if (!generation_tex) {
+      return;
+    }
+    if (sources_dirty) {
+      sources = rasterize_smoke_sources(
+          *generation_tex, *initial_velocity_tex, *color_tex,
+          *temperature_tex, res, super_sampling, begin, end, num_threads);
+      sources_dirty = false;
+    }
+    for (auto &source : sources) {
+      const Vector3i &c = source.cell;
+      t(c.x, c.y, c.z) = source.temperature;
+      rho(c.x, c.y, c.z) += source.seed;
+      u(c.x, c.y, c.z) = source.velocity.x;
+      v(c.x, c.y, c.z) = source.velocity.y;
+      w(c.x, c.y, c.z) = source.velocity.z;
+    }
+  }
+
+  void substep(real delta_t) {
+    TC_STAT("smoke_substeps", 1);
+    {
+      Time::Timer _("Forces");
+      real t_decay = std::exp(-delta_t * temperature_decay);
+      ThreadedTaskManager::run(
+          [&](int i) {
+            for (int j = 0; j < res[1]; j++) {
+              for (int k = 0; k < res[2]; k++) {
+                v(i, j, k) += (-smoke_alpha * rho(i, j, k) +
+                               smoke_beta * t(i, j, k)) *
+                              delta_t;
+              }
+            }
+            for (int j = 0; j < res[1]; j++) {
+              for (int k = 0; k < res[2]; k++) {
+                t(i, j, k) *= t_decay;
+              }
+            }
+          },
+          begin, end, num_threads);
+    }
+    apply_boundary_condition();
+    TIME(project());
+    apply_boundary_condition();
+    TIME(advect(delta_t));
+    apply_boundary_condition();
+    current_t += delta_t;
+  }
+
+  void apply_boundary_condition() {
+    SlabArray *velocity[3] = {&u, &v, &w};
+    for (int d = 0; d < 3; d++) {
+      SlabArray &vel = *velocity[d];
+      const Array3D<uint8> &mask = face_masks[d];
+      const int64 slice = (int64)mask.get_res()[1] * mask.get_res()[2];
+      ThreadedTaskManager::run(
+          [&](int i) {
+            real *data = &vel(i, 0, 0);
+            const uint8 *m = &mask.data[(i - begin) * slice];
+            for (int64 f = 0; f < slice; f++) {
+              if (m[f] & WALL) {
+                data[f] = 0;
+              }
+            }
+          },
+          begin, get_face_end(d), num_threads);
+    }
+  }
+
+  void project() {
+    // The divergence of the last cells reads the first faces of u of the
+    // next rank
+    std::vector<MPI_Request> requests;
+    post_halo_exchange(u.values, partition, rank, halo_width, 1, 0, comm,
+                       requests);
+    Array3D<real> divergence = pressure.same_shape();
+    auto divergence_slice = [&](int i) {
+      for (int j = 0; j < res[1]; j++) {
+        for (int k = 0; k < res[2]; k++) {
+          if (boundary_condition[i - begin + 1][j][k] !=
+              PoissonSolver3D::INTERIOR) {
+            divergence[i - begin + 1][j][k] = 0.0_f;
+            continue;
+          }
+          real div = 0.0_f;
+          div -= u(i, j, k);
+          div += u(i + 1, j, k);
+          div -= v(i, j, k);
+          div += v(i, j + 1, k);
+          div -= w(i, j, k);
+          div += w(i, j, k + 1);
+          divergence[i - begin + 1][j][k] = div;
+        }
+      }
+    };
+    ThreadedTaskManager::run(divergence_slice, begin, end - 1, num_threads);
+    wait_all(requests);
+    divergence_slice(end - 1);
+    if (!pressure_warm_start) {
+      pressure.reset(0.0_f);
+    }
+    pressure_solver.run(divergence, pressure, pressure_tolerance);
+    // The faces of u on the lower boundary of the slab read the pressure of
+    // the previous rank
+    post_halo_exchange(pressure, partition, rank, 1, 0, 0, comm, requests);
+    SlabArray *velocity[3] = {&u, &v, &w};
+    auto subtract_gradient = [&](int d, int i) {
+      SlabArray &vel = *velocity[d];
+      const Array3D<uint8> &mask = face_masks[d];
+      Vector3i lower = -Vector3i::axis(d);
+      for (int j = 0; j < mask.get_res()[1]; j++) {
+        for (int k = 0; k < mask.get_res()[2]; k++) {
+          uint8 m = mask[i - begin][j][k];
+          if (m & SUBTRACT_LOWER_PRESSURE) {
+            vel(i, j, k) -=
+                pressure[i - begin + 1 + lower.x][j + lower.y][k + lower.z];
+          }
+          if (m & ADD_UPPER_PRESSURE) {
+            vel(i, j, k) += pressure[i - begin + 1][j][k];
+          }
+        }
+      }
+    };
+    for (int d = 1; d < 3; d++) {
+      ThreadedTaskManager::run([&](int i) { subtract_gradient(d, i); }, begin,
+                               end, num_threads);
+    }
+    ThreadedTaskManager::run([&](int i) { subtract_gradient(0, i); },
+                             begin + 1, get_face_end(0), num_threads);
+    wait_all(requests);
+    subtract_gradient(0, begin);
+  }
+
+  // The upper bound on the speed given by the largest velocity components
+  real get_max_speed() {
+    SlabArray *velocity[3] = {&u, &v, &w};
+    double local[3], global[3];
+    for (int d = 0; d < 3; d++) {
+      SlabArray &vel = *velocity[d];
+      const int64 slice = (int64)vel.values.get_res()[1] *
+                          vel.values.get_res()[2];
+      std::vector<real> slice_max(get_face_end(d) - begin, 0.0_f);
+      ThreadedTaskManager::run(
+          [&](int i) {
+            const real *data = &vel(i, 0, 0);
+            real m = 0.0_f;
+            for (int64 f = 0; f < slice; f++) {
+              m = std::max(m, std::abs(data[f]));
+            }
+            slice_max[i - begin] = m;
+          },
+          begin, get_face_end(d), num_threads);
+      local[d] = 0;
+      for (auto m : slice_max) {
+        local[d] = std::max(local[d], (double)m);
+      }
+    }
+    MPI_Allreduce(local, global, 3, MPI_DOUBLE, MPI_MAX, comm);
+    return length(Vector3((real)global[0], (real)global[1], (real)global[2]));
+  }
+
+  Vector3 sample_velocity(const Vector3 &pos) const {
+    return Vector3(SlabStencil(u, pos).sample(u), SlabStencil(v, pos).sample(v),
+                   SlabStencil(w, pos).sample(w));
+  }
+
+  // A backtrace of a group of fields whose stencil another rank owns
+  struct Query {
+    real position[3];
+    int group;
+  };
+
+  struct Answer {
+    real values[2];
+  };
+
+  void advect(real delta_t) {
+    // rho and t share their samples
+    const std::vector<std::vector<int>> groups = {{0, 1}, {2}, {3}, {4}};
+    SlabArray *fields[5] = {&rho, &t, &u, &v, &w};
+    // Backtraces move by at most |reach| slices, from slices within
+    // |margin| of the halos
+    real reach = delta_t * get_max_speed();
+    int margin = (int)std::ceil(reach) + 2;
+    std::vector<MPI_Request> requests;
+    for (int f = 0; f < 5; f++) {
+      post_halo_exchange(fields[f]->values, partition, rank, halo_width,
+                         int(f == 2), 2 * f, comm, requests);
+    }
+    // Returns the rank owning the stencil if it is not local
+    auto advect_sample = [&](int g, int i, int j, int k, Vector3 &back) {
+      const SlabArray &grid = *fields[groups[g][0]];
+      Vector3 pos = Vector3(i, j, k) + grid.storage_offset;
+      back = pos - delta_t * sample_velocity(pos);
+      SlabStencil stencil(grid, back);
+      if (!stencil.is_local(grid)) {
+        return partition.get_owner(std::min(stencil.x_i, res[0] - 1));
+      }
+      for (int f : groups[g]) {
+        advected[f](i, j, k) = stencil.sample(*fields[f]);
+      }
+      return -1;
+    };
+    auto group_end = [&](int g) { return get_face_end(g == 1 ? 0 : 1); };
+    auto shape = [&](int g) { return fields[groups[g][0]]->values.get_res(); };
+    // The slices that read neither the halos nor other ranks
+    int interior_begin = begin + margin, interior_end = end - margin;
+    for (int g = 0; g < (int)groups.size(); g++) {
+      ThreadedTaskManager::run(
+          [&](int i) {
+            Vector3 back;
+            for (int j = 0; j < shape(g)[1]; j++) {
+              for (int k = 0; k < shape(g)[2]; k++) {
+                advect_sample(g, i, j, k, back);
+              }
+            }
+          },
+          interior_begin, std::max(interior_begin, interior_end), num_threads);
+    }
+    wait_all(requests);
+
+    // The other slices, collecting the backtraces of other ranks
+    struct RemoteSample {
+      int owner;
+      Query query;
+      Vector3i cell;
+    };
+    std::vector<std::vector<Query>> queries(num_ranks);
+    std::vector<std::vector<Vector3i>> origins(num_ranks);
+    for (int g = 0; g < (int)groups.size(); g++) {
+      std::vector<int> slices;
+      for (int i = begin; i < group_end(g); i++) {
+        if (i < interior_begin || i >= std::max(interior_begin, interior_end)) {
+          slices.push_back(i);
+        }
+      }
+      std::vector<std::vector<RemoteSample>> remote(slices.size());
+      ThreadedTaskManager::run((int)slices.size(), num_threads, [&](int s) {
+        int i = slices[s];
+        Vector3 back;
+        for (int j = 0; j < shape(g)[1]; j++) {
+          for (int k = 0; k < shape(g)[2]; k++) {
+            int owner = advect_sample(g, i, j, k, back);
+            if (owner != -1) {
+              Query query{{back.x, back.y, back.z}, g};
+              remote[s].push_back(
+                  RemoteSample{owner, query, Vector3i(i, j, k)});
+            }
+          }
+        }
+      });
+      for (auto &list : remote) {
+        for (auto &sample : list) {
+          queries[sample.owner].push_back(sample.query);
+          origins[sample.owner].push_back(sample.cell);
+        }
+      }
+    }
+    std::vector<Answer> answers = answer_queries(queries, groups, fields);
+    int a = 0;
+    for (int r = 0; r < num_ranks; r++) {
+      for (int q = 0; q < (int)queries[r].size(); q++, a++) {
+        const auto &group = groups[queries[r][q].group];
+        const Vector3i &cell = origins[r][q];
+        for (int f = 0; f < (int)group.size(); f++) {
+          advected[group[f]](cell.x, cell.y, cell.z) = answers[a].values[f];
+        }
+      }
+    }
+    for (int f = 0; f < 5; f++) {
+      std::swap(fields[f]->values.data, advected[f].values.data);
+    }
+  }
+
+  // Sends |queries| to their ranks, and returns the answers in the same
+  // order. Collective.
+  std::vector<Answer> answer_queries(
+      const std::vector<std::vector<Query>> &queries,
+      const std::vector<std::vector<int>> &groups,
+      SlabArray *fields[]) {
+    std::vector<int> send_counts(num_ranks), send_displs(num_ranks),
+        recv_counts(num_ranks), recv_displs(num_ranks);
+    std::vector<Query> outgoing;
+    for (int r = 0; r < num_ranks; r++) {
+      send_counts[r] = (int)queries[r].size();
+      send_displs[r] = (int)outgoing.size();
+      outgoing.insert(outgoing.end(), queries[r].begin(), queries[r].end());
+    }
+    MPI_Alltoall(send_counts.data(), 1, MPI_INT, recv_counts.data(), 1,
+                 MPI_INT, comm);
+    int num_incoming = 0;
+    for (int r = 0; r < num_ranks; r++) {
+      recv_displs[r] = num_incoming;
+      num_incoming += recv_counts[r];
+    }
+    TC_STAT("smoke_remote_backtraces", outgoing.size());
+    MPI_Datatype query_type, answer_type;
+    MPI_Type_contiguous(sizeof(Query), MPI_BYTE, &query_type);
+    MPI_Type_commit(&query_type);
+    MPI_Type_contiguous(sizeof(Answer), MPI_BYTE, &answer_type);
+    MPI_Type_commit(&answer_type);
+    std::vector<Query> incoming(num_incoming);
+    MPI_Alltoallv(outgoing.data(), send_counts.data(), send_displs.data(),
+                  query_type, incoming.data(), recv_counts.data(),
+                  recv_displs.data(), query_type, comm);
+    std::vector<Answer> replies(num_incoming);
+    ThreadedTaskManager::run(num_incoming, num_threads, [&](int q) {
+      const auto &group = groups[incoming[q].group];
+      const SlabArray &grid = *fields[group[0]];
+      Vector3 pos(incoming[q].position[0], incoming[q].position[1],
+                  incoming[q].position[2]);
+      SlabStencil stencil(grid, pos);
+      TC_ASSERT_INFO(stencil.is_local(grid),
+                     "Backtrace sent to a rank without its stencil");
+      for (int f = 0; f < (int)group.size(); f++) {
+        replies[q].values[f] = stencil.sample(*fields[group[f]]);
+      }
+    });
+    std::vector<Answer> answers(outgoing.size());
+    MPI_Alltoallv(replies.data(), recv_counts.data(), recv_displs.data(),
+                  answer_type, answers.data(), send_counts.data(),
+                  send_displs.data(), answer_type, comm);
+    MPI_Type_free(&query_type);
+    MPI_Type_free(&answer_type);
+    return answers;
+  }
+
+  std::vector<RenderParticle> get_render_particles() const override {
+    return std::vector<RenderParticle>();
+  }
+
+  // The density of the cells of the rank, which start at slice slab_begin
+  void snapshot_frame(FrameWriter::Frame &frame) const override {
+    Array3D<real> density(Vector3i(end - begin, res[1], res[2]));
+    const int64 slice = (int64)res[1] * res[2];
+    std::copy(&rho(begin, 0, 0), &rho(begin, 0, 0) + (end - begin) * slice,
+              density.data.data());
+    frame.add("rho", std::move(density));
+    frame.add("slab_begin", begin);
+  }
+
+  void update(const Config &config) override {
+    generation_tex =
+        AssetManager::get_asset<Texture>(config.get<int>("generation_tex"));
+    initial_velocity_tex = AssetManager::get_asset<Texture>(
+        config.get<int>("initial_velocity_tex"));
+    color_tex = AssetManager::get_asset<Texture>(config.get<int>("color_tex"));
+    temperature_tex =
+        AssetManager::get_asset<Texture>(config.get<int>("temperature_tex"));
+    sources_dirty = true;
+  }
+};
+
+TC_IMPLEMENTATION(Simulation3D, DistributedSmoke3D, "distributed_smoke");
+
+TC_NAMESPACE_END
+
+#endif
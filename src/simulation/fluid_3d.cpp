@@ -6,10 +6,13 @@
 #include "fluid_3d.h"
 #include <taichi/common/util.h>
 #include <taichi/math/array.h>
+#include <taichi/math/array_sample.h>
 #include <taichi/dynamics/poisson_solver.h>
 #include <taichi/visualization/particle_visualization.h>
 #include <taichi/common/asset_manager.h>
+#include <taichi/system/statistics.h>
 #include <taichi/system/timer.h>
+#include <taichi/system/threading.h>
 
 TC_NAMESPACE_BEGIN
 // const static Vector3i offsets[]{Vector3i(1, 0, 0), Vector3i(-1, 0, 0),
@@ -17,61 +20,100 @@ TC_NAMESPACE_BEGIN
 //                                Vector3i(0, 0, 1), Vector3i(0, 0, -1)};
 
 void Smoke3D::project() {
-  Array divergence(res, 0.0_f);
-  for (auto &ind : u.get_region()) {
-    if (0 < ind.i)
-      divergence[ind + Vector3i(-1, 0, 0)] += u[ind];
-    if (ind.i < res[0])
-      divergence[ind] -= u[ind];
-  }
-  for (auto &ind : v.get_region()) {
-    if (0 < ind.j)
-      divergence[ind + Vector3i(0, -1, 0)] += v[ind];
-    if (ind.j < res[1])
-      divergence[ind] -= v[ind];
-  }
-  for (auto &ind : w.get_region()) {
-    if (0 < ind.k)
-      divergence[ind + Vector3i(0, 0, -1)] += w[ind];
-    if (ind.k < res[2])
-      divergence[ind] -= w[ind];
-  }
-  pressure = 0;
-  pressure_solver->set_boundary_condition(boundary_condition);
-  for (auto &ind : boundary_condition.get_region()) {
-    if (boundary_condition[ind] != PoissonSolver3D::INTERIOR) {
-      divergence[ind] = 0.0_f;
+  // Gather form, with the additions in the order of the scattering loops
+  // over u, v and w
+  auto divergence_array = scalar_pool.acquire(res);
+  Array &divergence = *divergence_array;
+  ThreadedTaskManager::run(res[0], num_threads, [&](int i) {
+    for (int j = 0; j < res[1]; j++) {
+      for (int k = 0; k < res[2]; k++) {
+        if (boundary_condition[i][j][k] != PoissonSolver3D::INTERIOR) {
+          divergence[i][j][k] = 0.0_f;
+          continue;
+        }
+        real div = 0.0_f;
+        div -= u[i][j][k];
+        div += u[i + 1][j][k];
+        div -= v[i][j][k];
+        div += v[i][j + 1][k];
+        div -= w[i][j][k];
+        div += w[i][j][k + 1];
+        divergence[i][j][k] = div;
+      }
     }
+  });
+  if (pressure_warm_start) {
+    ThreadedTaskManager::run(res[0], num_threads, [&](int i) {
+      int slice = res[1] * res[2];
+      for (int f = i * slice; f < (i + 1) * slice; f++) {
+        real last = last_pressure.data[f];
+        pressure.data[f] =
+            last + pressure_extrapolation * (last - previous_pressure.data[f]);
+      }
+    });
+  } else {
+    pressure = 0;
   }
+  pressure_solver->set_boundary_condition(boundary_condition);
   pressure_solver->run(divergence, pressure, pressure_tolerance);
-  auto is_neumann = [&](Index3D const &ind) -> bool {
-    if (boundary_condition.inside(ind)) {
-      return boundary_condition[ind] == PoissonSolver3D::NEUMANN;
-    } else {
-      if (open_boundary) {
-        return false;
-      } else {
-        return true;
+  Array *velocity[3] = {&u, &v, &w};
+  for (int d = 0; d < 3; d++) {
+    Array &vel = *velocity[d];
+    const Array3D<uint8> &mask = face_masks[d];
+    Vector3i lower = -Vector3i::axis(d);
+    Vector3i shape = vel.get_res();
+    ThreadedTaskManager::run(shape[0], num_threads, [&](int i) {
+      for (int j = 0; j < shape[1]; j++) {
+        for (int k = 0; k < shape[2]; k++) {
+          uint8 m = mask[i][j][k];
+          if (m & SUBTRACT_LOWER_PRESSURE) {
+            vel[i][j][k] -= pressure[i + lower.x][j + lower.y][k + lower.z];
+          }
+          if (m & ADD_UPPER_PRESSURE) {
+            vel[i][j][k] += pressure[i][j][k];
+          }
+        }
       }
+    });
+  }
+  std::swap(previous_pressure.data, last_pressure.data);
+  last_pressure = pressure;
+}
+
+void Smoke3D::update_boundary_masks() {
+  auto is_neumann = [&](const Vector3i &cell) -> bool {
+    if (boundary_condition.inside(cell)) {
+      return boundary_condition[cell] == PoissonSolver3D::NEUMANN;
+    } else {
+      return !open_boundary;
     }
   };
-  for (auto &ind : pressure.get_region()) {
-    if (!is_neumann(ind.neighbour(Vector3i(-1, 0, 0))))
-      u[ind] += pressure[ind];
-    if (!is_neumann(ind.neighbour(Vector3i(1, 0, 0))))
-      u[ind + Vector3i(1, 0, 0)] -= pressure[ind];
-
-    if (!is_neumann(ind.neighbour(Vector3i(0, -1, 0))))
-      v[ind] += pressure[ind];
-    if (!is_neumann(ind.neighbour(Vector3i(0, 1, 0))))
-      v[ind + Vector3i(0, 1, 0)] -= pressure[ind];
-
-    if (!is_neumann(ind.neighbour(Vector3i(0, 0, -1))))
-      w[ind] += pressure[ind];
-    if (!is_neumann(ind.neighbour(Vector3i(0, 0, 1))))
-      w[ind + Vector3i(0, 0, 1)] -= pressure[ind];
+  for (int d = 0; d < 3; d++) {
+    Vector3i axis = Vector3i::axis(d);
+    Array3D<uint8> &mask = face_masks[d];
+    mask = Array3D<uint8>(res + axis, 0);
+    for (auto &ind : mask.get_region()) {
+      // The face between the cells lower and upper
+      Vector3i upper(ind.i, ind.j, ind.k), lower = upper - axis;
+      uint8 m = 0;
+      if (upper[d] > 0 && !is_neumann(upper)) {
+        m |= SUBTRACT_LOWER_PRESSURE;
+      }
+      if (upper[d] < res[d] && !is_neumann(lower)) {
+        m |= ADD_UPPER_PRESSURE;
+      }
+      for (auto &cell : {lower, upper}) {
+        if (boundary_condition.inside(cell) &&
+            boundary_condition[cell] == PoissonSolver3D::NEUMANN) {
+          m |= WALL;
+        }
+      }
+      if (!open_boundary && (upper[d] == 0 || upper[d] == res[d] - 1)) {
+        m |= WALL;
+      }
+      mask[ind] = m;
+    }
   }
-  last_pressure = pressure;
 }
 
 void Smoke3D::initialize(const Config &config) {
@@ -81,10 +123,23 @@ void Smoke3D::initialize(const Config &config) {
   smoke_beta = config.get("smoke_beta", 0.0_f);
   temperature_decay = config.get("temperature_decay", 0.0_f);
   pressure_tolerance = config.get("pressure_tolerance", 0.0_f);
+  pressure_warm_start = config.get("pressure_warm_start", false);
+  pressure_extrapolation = config.get("pressure_extrapolation", 0.0_f);
   density_scaling = config.get("density_scaling", 1.0_f);
+  preview.downsample = config.get("preview_downsample", 1);
+  TC_ASSERT_INFO(preview.downsample >= 1,
+                 "preview_downsample must be positive");
   tracker_generation = config.get("tracker_generation", 100.0_f);
   num_threads = config.get<int>("num_threads");
   super_sampling = config.get<int>("super_sampling");
+  cfl = config.get("cfl", 0.0_f);
+  maximum_substeps = config.get("maximum_substeps", 16);
+  TC_ASSERT_INFO(maximum_substeps >= 1, "maximum_substeps must be positive");
+  advection = config.get("advection", std::string("semi_lagrangian"));
+  TC_ASSERT_INFO(advection == "semi_lagrangian" || advection == "maccormack",
+                 "advection must be semi_lagrangian or maccormack");
+  sparse = config.get("sparse", false);
+  sparse_velocity_threshold = config.get("sparse_velocity_threshold", 0.0_f);
   std::string padding;
   open_boundary = config.get<bool>("open_boundary");
   if (open_boundary) {
@@ -94,6 +149,7 @@ void Smoke3D::initialize(const Config &config) {
   }
 
   perturbation = config.get("perturbation", 0.0_f);
+  vorticity_confinement = config.get("vorticity_confinement", 0.0_f);
   Config solver_config;
   solver_config.set("res", res)
       .set("num_threads", num_threads)
@@ -108,7 +164,17 @@ void Smoke3D::initialize(const Config &config) {
   rho = Array(res, 0.0_f);
   pressure = Array(res, 0.0_f);
   last_pressure = Array(res, 0.0_f);
+  previous_pressure = Array(res, 0.0_f);
   t = Array(res, config.get("initial_t", 0.0_f));
+  Array *fields[5] = {&rho, &t, &u, &v, &w};
+  for (int i = 0; i < 5; i++) {
+    advected[i] = fields[i]->same_shape();
+    if (advection == "maccormack") {
+      corrected[i] = fields[i]->same_shape();
+    }
+  }
+  active_blocks = Array3D<uint8>(
+      (res + Vector3i(block_size - 1)) / Vector3i(block_size), 1);
   current_t = 0.0_f;
   boundary_condition = PoissonSolver3D::BCArray(res);
   for (auto &ind : boundary_condition.get_region()) {
@@ -118,6 +184,45 @@ void Smoke3D::initialize(const Config &config) {
       // boundary_condition[ind] = PoissonSolver3D::NEUMANN;
     }
   }
+  update_boundary_masks();
+}
+
+std::vector<SmokeSource> rasterize_smoke_sources(const Texture &generation,
+                                                 const Texture &velocity,
+                                                 const Texture &color,
+                                                 const Texture &temperature,
+                                                 const Vector3i &res,
+                                                 int super_sampling,
+                                                 int x_begin,
+                                                 int x_end,
+                                                 int num_threads) {
+  // Slices in parallel, each with its own random sequence
+  std::vector<std::vector<SmokeSource>> slices(std::max(0, x_end - x_begin));
+  ThreadedTaskManager::run((int)slices.size(), num_threads, [&](int s) {
+    int i = x_begin + s;
+    PCG32 rng((uint64)i);
+    for (int j = 0; j < res[1]; j++) {
+      for (int k = 0; k < res[2]; k++) {
+        for (int n = 0; n < super_sampling; n++) {
+          Vector3 pos =
+              Vector3(i, j, k) + Vector3(rng.next(), rng.next(), rng.next());
+          Vector3 relative_pos = pos / res.cast<real>();
+          real seed = generation.sample(relative_pos).x / super_sampling;
+          if (seed == 0) {
+            continue;
+          }
+          slices[s].push_back(SmokeSource{
+              Vector3i(i, j, k), seed, temperature.sample3(relative_pos).x,
+              velocity.sample3(relative_pos), color.sample3(relative_pos)});
+        }
+      }
+    }
+  });
+  std::vector<SmokeSource> sources;
+  for (auto &slice : slices) {
+    sources.insert(sources.end(), slice.begin(), slice.end());
+  }
+  return sources;
 }
 
 Vector3 hsv2rgb(Vector3 hsv) {
@@ -153,15 +258,25 @@ Vector3 hsv2rgb(Vector3 hsv) {
   return Vector3(r, g, b);
 }
 
-std::vector<RenderParticle> Smoke3D::get_render_particles() const {
-  using Particle = RenderParticle;
-  std::vector<Particle> render_particles;
-  render_particles.reserve(trackers.size());
+void Smoke3D::fill_render_particles(
+    std::vector<RenderParticle> &particles) const {
   Vector3 center(res[0] / 2.0f, res[1] / 2.0f, res[2] / 2.0f);
-  for (auto p : trackers) {
-    render_particles.push_back(Particle(
-        p.position - center, Vector4(p.color.x, p.color.y, p.color.z, 1.0_f)));
-  }
+  particles.resize(trackers.size());
+  ThreadedTaskManager::run(trackers.size(), num_threads, [&](int i) {
+    Vector3 color = trackers.color[i];
+    particles[i] = RenderParticle(trackers.position[i] - center,
+                                  Vector4(color.x, color.y, color.z, 1.0_f));
+  });
+}
+
+std::vector<RenderParticle> Smoke3D::get_render_particles() const {
+  std::vector<RenderParticle> particles;
+  fill_render_particles(particles);
+  return particles;
+}
+
+const std::vector<RenderParticle> &Smoke3D::get_render_particles_view() {
+  fill_render_particles(render_particles);
   return render_particles;
 }
 
@@ -169,82 +284,78 @@ void Smoke3D::show(Array2D<Vector3> &buffer) {
   buffer.reset(Vector3(0));
   int half_width = buffer.get_width() / 2,
       half_height = buffer.get_height() / 2;
-  for (int i = 0; i < half_width; i++) {
-    for (int j = 0; j < buffer.get_height(); j++) {
-      real rho_sum = 0.0_f;
-      real t_sum = 0.0_f;
-      for (int k = 0; k < res[2]; k++) {
-        real x = (i + 0.5f) / (real)half_width * res[0];
-        real y = (j + 0.5f) / (real)buffer.get_height() * res[1];
-        real z = k + 0.5f;
-        rho_sum += rho.sample(x, y, z);
-        t_sum += t.sample(x, y, z);
-      }
-      rho_sum *= density_scaling;
-      t_sum = std::min(1.0_f, t_sum / res[2]);
-      rho_sum = std::min(1.0_f, rho_sum / res[2]);
-      buffer[i][j] = Vector3(t_sum, rho_sum * 0.3f, rho_sum * 0.8f);
-    }
-  }
-  for (int i = 0; i < half_width; i++) {
-    for (int j = 0; j < half_height; j++) {
-      real rho_sum = 0.0_f;
-      real t_sum = 0.0_f;
-      for (int k = 0; k < res[2]; k++) {
-        real x = (i + 0.5f) / (real)half_width * res[0];
-        real y = k + 0.5f;
-        real z = (j + 0.5f) / (real)half_height * res[2];
-        rho_sum += rho.sample(x, y, z);
-        t_sum += t.sample(x, y, z);
-      }
-      rho_sum *= density_scaling;
-      t_sum = std::min(1.0_f, t_sum / res[2]);
-      rho_sum = std::min(1.0_f, rho_sum / res[2]);
-      buffer[half_width + i][j] =
-          Vector3(t_sum, rho_sum * 0.3f, rho_sum * 0.8f);
-    }
-  }
+  // Thin smoke shows the mean density and temperature along the ray, as
+  // the sums of earlier previews did, saturating where it gets thick
+  preview.absorption = density_scaling / res[2];
+  preview.density_color = Vector3(0.0_f, 0.3_f, 0.8_f) * preview.absorption;
+  preview.emission_color = Vector3(1.0_f / res[2], 0.0_f, 0.0_f);
+  preview.num_threads = num_threads;
+  preview.set_volume(rho, &t);
+  preview.render(buffer, Vector2i(0), Vector2i(half_width, buffer.get_height()),
+                 2);
+  preview.render(buffer, Vector2i(half_width, 0),
+                 Vector2i(2 * half_width, half_height), 1);
 }
 
 void Smoke3D::move_trackers(real delta_t) {
-  for (auto &tracker : trackers) {
-    auto velocity = sample_velocity(tracker.position);
-    tracker.position +=
-        sample_velocity(tracker.position + 0.5f * delta_t * velocity) * delta_t;
-  }
+  // Midpoint (RK2) steps; trackers are independent
+  ThreadedTaskManager::run(trackers.size(), num_threads, [&](int i) {
+    Vector3 &position = trackers.position[i];
+    auto velocity = sample_velocity(position);
+    position += sample_velocity(position + 0.5f * delta_t * velocity) * delta_t;
+  });
 }
 
 void Smoke3D::step(real delta_t) {
   {
     Time::Timer _("Seeding");
-    for (auto &ind : rho.get_region()) {
-      for (int k = 0; k < super_sampling; k++) {
-        Vector3 pos = ind.get_pos() + Vector3(rand(), rand(), rand()) -
-                      ind.storage_offset;
-        Vector3 relative_pos =
-            pos / Vector3i(rho.get_width(), rho.get_height(), rho.get_depth()).template cast<real>();
-        real seed = generation_tex->sample(relative_pos).x / super_sampling;
-        if (seed == 0) {
-          continue;
-        }
-        Vector3 initial_speed = initial_velocity_tex->sample3(relative_pos);
-        Vector3 color = color_tex->sample3(relative_pos);
-        t[ind] = temperature_tex->sample3(relative_pos).x;
-        rho[ind] += seed;
-
-        u[ind] = initial_speed.x;
-        v[ind] = initial_speed.y;
-        w[ind] = initial_speed.z;
-
-        real gen = delta_t * seed;
-        int gen_int =
-            (int)std::floor(gen) + int(rand() < gen - std::floor(gen));
-
-        for (int i = 0; i < gen_int; i++) {
-          trackers.push_back(Tracker3D(pos, color));
-        }
+    if (sources_dirty) {
+      sources = rasterize_smoke_sources(
+          *generation_tex, *initial_velocity_tex, *color_tex,
+          *temperature_tex, res, super_sampling, 0, res[0], num_threads);
+      sources_dirty = false;
+    }
+    for (auto &source : sources) {
+      const Vector3i &cell = source.cell;
+      t[cell] = source.temperature;
+      rho[cell] += source.seed;
+      u[cell] = source.velocity.x;
+      v[cell] = source.velocity.y;
+      w[cell] = source.velocity.z;
+      real gen = delta_t * source.seed;
+      int gen_int = (int)std::floor(gen) + int(rand() < gen - std::floor(gen));
+      for (int i = 0; i < gen_int; i++) {
+        Vector3 pos = cell.cast<real>() + Vector3(rand(), rand(), rand());
+        trackers.push_back(Tracker3D(pos, source.color));
       }
     }
+  }
+  if (cfl <= 0) {
+    substep(delta_t);
+    return;
+  }
+  real remaining = delta_t;
+  int substeps_left = maximum_substeps;
+  while (substeps_left > 0 && remaining > 0) {
+    // Equal substeps over the rest of the frame, re-planned each time with
+    // the current velocity
+    real max_speed = get_max_speed();
+    int n = substeps_left;
+    if (max_speed * remaining < cfl * substeps_left) {
+      n = std::max(1, (int)std::ceil(max_speed * remaining / cfl));
+    }
+    // The last substep takes exactly what remains
+    real dt = remaining / n;
+    substep(dt);
+    remaining -= dt;
+    substeps_left--;
+  }
+}
+
+void Smoke3D::substep(real delta_t) {
+  TC_STAT("smoke_substeps", 1);
+  {
+    Time::Timer _("Forces");
     for (auto &ind : v.get_region()) {
       if (ind.j < res[1]) {
         v[ind] += (-smoke_alpha * rho[ind] + smoke_beta * t[ind]) * delta_t;
@@ -255,6 +366,7 @@ void Smoke3D::step(real delta_t) {
       t[ind] *= t_decay;
     }
   }
+  TIME(confine_vorticity(delta_t));
   apply_boundary_condition();
   TIME(project());
   apply_boundary_condition();
@@ -265,16 +377,66 @@ void Smoke3D::step(real delta_t) {
   current_t += delta_t;
 }
 
+real Smoke3D::get_max_speed() const {
+  const Array *velocity[3] = {&u, &v, &w};
+  Vector3 max_component(0.0_f);
+  for (int d = 0; d < 3; d++) {
+    const Array &vel = *velocity[d];
+    int slice = vel.get_res()[1] * vel.get_res()[2];
+    // Per x slice, then combined
+    std::vector<real> slice_max(vel.get_res()[0], 0.0_f);
+    ThreadedTaskManager::run(vel.get_res()[0], num_threads, [&](int i) {
+      real m = 0.0_f;
+      for (int f = i * slice; f < (i + 1) * slice; f++) {
+        m = std::max(m, std::abs(vel.data[f]));
+      }
+      slice_max[i] = m;
+    });
+    for (auto m : slice_max) {
+      max_component[d] = std::max(max_component[d], m);
+    }
+  }
+  return length(max_component);
+}
+
 void Smoke3D::remove_outside_trackers() {
-  std::vector<Tracker3D> all_trackers = trackers;
-  trackers.clear();
-  for (auto &tracker : all_trackers) {
-    Vector3 p = tracker.position;
-    if (0 <= p.x && p.x <= res[0] && 0 <= p.y && p.y <= res[1] && 0 <= p.z &&
-        p.z <= res[2]) {
-      trackers.push_back(tracker);
+  auto inside = [&](const Vector3 &p) {
+    return 0 <= p.x && p.x <= res[0] && 0 <= p.y && p.y <= res[1] &&
+           0 <= p.z && p.z <= res[2];
+  };
+  // Stream compaction: the trackers kept in each chunk are counted, then
+  // copied to their offsets, in their original order
+  const int chunk_size = 4096;
+  int num_chunks = (trackers.size() + chunk_size - 1) / chunk_size;
+  std::vector<int> offsets(num_chunks + 1, 0);
+  ThreadedTaskManager::run(num_chunks, num_threads, [&](int c) {
+    int end = std::min((c + 1) * chunk_size, trackers.size());
+    int kept = 0;
+    for (int i = c * chunk_size; i < end; i++) {
+      kept += inside(trackers.position[i]);
     }
+    offsets[c + 1] = kept;
+  });
+  for (int c = 0; c < num_chunks; c++) {
+    offsets[c + 1] += offsets[c];
   }
+  if (offsets[num_chunks] == trackers.size()) {
+    return;
+  }
+  TrackerArrays kept;
+  kept.resize(offsets[num_chunks]);
+  ThreadedTaskManager::run(num_chunks, num_threads, [&](int c) {
+    int end = std::min((c + 1) * chunk_size, trackers.size());
+    int k = offsets[c];
+    for (int i = c * chunk_size; i < end; i++) {
+      if (inside(trackers.position[i])) {
+        kept.position[k] = trackers.position[i];
+        kept.color[k] = trackers.color[i];
+        k++;
+      }
+    }
+  });
+  std::swap(trackers, kept);
 }
 
 Vector3 Smoke3D::sample_velocity(const Array &u,
@@ -288,55 +450,268 @@ Vector3 Smoke3D::sample_velocity(const Vector3 &pos) const {
   return sample_velocity(u, v, w, pos);
 }
 
-void Smoke3D::advect(Array &attr, real delta_t) {
-  auto new_attr = attr.same_shape(0);
-  for (auto &ind : new_attr.get_region()) {
-    auto old_position =
-        ind.get_pos() - delta_t * sample_velocity(ind.get_pos());
-    new_attr[ind] = attr.sample(old_position);
-  }
-  attr = new_attr;
-}
 
-void Smoke3D::apply_boundary_condition() {
-  for (auto &ind : boundary_condition.get_region()) {
-    if (boundary_condition[ind] == PoissonSolver3D::NEUMANN) {
-      u[ind] = 0;
-      u[ind + Vector3i(1, 0, 0)] = 0;
-      v[ind] = 0;
-      v[ind + Vector3i(0, 1, 0)] = 0;
-      w[ind] = 0;
-      w[ind + Vector3i(0, 0, 1)] = 0;
+void Smoke3D::advect(const std::vector<const Array *> &src,
+                     const std::vector<Array *> &dst,
+                     real delta_t) {
+  const Array &grid = *src[0];
+  Vector3i shape = grid.get_res();
+  // Slices along x are independent; samples are visited in memory order
+  ThreadedTaskManager::run(shape[0], num_threads, [&](int i) {
+    for (int j = 0; j < shape[1]; j++) {
+      for (int k = 0; k < shape[2]; k++) {
+        if (is_quiet(i, j, k)) {
+          for (int f = 0; f < (int)src.size(); f++) {
+            (*dst[f])[i][j][k] = (*src[f])[i][j][k];
+          }
+          continue;
+        }
+        Vector3 pos = Vector3(i, j, k) + grid.get_storage_offset();
+        TrilinearStencil stencil(grid, pos - delta_t * sample_velocity(pos));
+        for (int f = 0; f < (int)src.size(); f++) {
+          (*dst[f])[i][j][k] = stencil.sample(*src[f]);
+        }
+      }
     }
-  }
-  if (!open_boundary) {
-    for (int i = 0; i < res[0]; i++) {
-      for (int j = 0; j < res[1]; j++) {
-        w[i][j][0] = w[i][j][res[2] - 1] = 0;
+  });
+}
+
+void Smoke3D::correct_advection(const std::vector<const Array *> &src,
+                                const std::vector<const Array *> &hat,
+                                const std::vector<Array *> &dst,
+                                real delta_t) {
+  const Array &grid = *src[0];
+  Vector3i shape = grid.get_res();
+  ThreadedTaskManager::run(shape[0], num_threads, [&](int i) {
+    for (int j = 0; j < shape[1]; j++) {
+      for (int k = 0; k < shape[2]; k++) {
+        if (is_quiet(i, j, k)) {
+          for (int f = 0; f < (int)src.size(); f++) {
+            (*dst[f])[i][j][k] = (*hat[f])[i][j][k];
+          }
+          continue;
+        }
+        Vector3 pos = Vector3(i, j, k) + grid.get_storage_offset();
+        Vector3 velocity = sample_velocity(pos);
+        TrilinearStencil forward(grid, pos - delta_t * velocity);
+        TrilinearStencil backward(grid, pos + delta_t * velocity);
+        for (int f = 0; f < (int)src.size(); f++) {
+          real phi = (*src[f])[i][j][k], phi_hat = (*hat[f])[i][j][k];
+          real error = phi - backward.sample(*hat[f]);
+          (*dst[f])[i][j][k] =
+              forward.clamp_to_samples(*src[f], phi_hat + 0.5_f * error);
+        }
       }
     }
-    for (int i = 0; i < res[0]; i++) {
-      for (int k = 0; k < res[2]; k++) {
-        v[i][0][k] = v[i][res[1] - 1][k] = 0;
+  });
+}
+
+void Smoke3D::apply_boundary_condition() {
+  Array *velocity[3] = {&u, &v, &w};
+  for (int d = 0; d < 3; d++) {
+    Array &vel = *velocity[d];
+    const Array3D<uint8> &mask = face_masks[d];
+    int slice = vel.get_res()[1] * vel.get_res()[2];
+    ThreadedTaskManager::run(vel.get_res()[0], num_threads, [&](int i) {
+      for (int f = i * slice; f < (i + 1) * slice; f++) {
+        if (mask.data[f] & WALL) {
+          vel.data[f] = 0;
+        }
+      }
+    });
+  }
+}
+
+void Smoke3D::update_active_blocks() {
+  if (!sparse) {
+    return;
+  }
+  Vector3i blocks = active_blocks.get_res();
+  Array3D<uint8> occupied(blocks, 0);
+  const Array *fields[5] = {&rho, &t, &u, &v, &w};
+  // Blocks along x are independent; faces on the upper boundaries belong
+  // to the last block
+  ThreadedTaskManager::run(blocks[0], num_threads, [&](int bi) {
+    for (int f = 0; f < 5; f++) {
+      const Array &field = *fields[f];
+      // rho and t, then the velocity components
+      real threshold = f < 2 ? 0.0_f : sparse_velocity_threshold;
+      Vector3i shape = field.get_res();
+      int end = bi == blocks[0] - 1 ? shape[0] : (bi + 1) * block_size;
+      for (int i = bi * block_size; i < end; i++) {
+        for (int j = 0; j < shape[1]; j++) {
+          int bj = std::min(j / block_size, blocks[1] - 1);
+          for (int k = 0; k < shape[2]; k++) {
+            if (std::abs(field[i][j][k]) > threshold) {
+              occupied[bi][bj][std::min(k / block_size, blocks[2] - 1)] = 1;
+            }
+          }
+        }
       }
     }
-    for (int j = 0; j < res[1]; j++) {
-      for (int k = 0; k < res[2]; k++) {
-        u[0][j][k] = u[res[0] - 1][j][k] = 0;
+  });
+  // Dilation by one block, as advection and the curl read one cell
+  // further
+  ThreadedTaskManager::run(blocks[0], num_threads, [&](int bi) {
+    for (int bj = 0; bj < blocks[1]; bj++) {
+      for (int bk = 0; bk < blocks[2]; bk++) {
+        uint8 active = 0;
+        for (int di = -1; di <= 1; di++) {
+          for (int dj = -1; dj <= 1; dj++) {
+            for (int dk = -1; dk <= 1; dk++) {
+              Vector3i n(bi + di, bj + dj, bk + dk);
+              if (occupied.inside(n)) {
+                active |= occupied[n];
+              }
+            }
+          }
+        }
+        active_blocks[bi][bj][bk] = active;
       }
     }
+  });
+}
+
+bool Smoke3D::is_quiet(int i, int j, int k) const {
+  if (!sparse) {
+    return false;
   }
+  Vector3i blocks = active_blocks.get_res();
+  return !active_blocks[std::min(i / block_size, blocks[0] - 1)]
+                       [std::min(j / block_size, blocks[1] - 1)]
+                       [std::min(k / block_size, blocks[2] - 1)];
 }
 
 void Smoke3D::advect(real delta_t) {
-  advect(rho, delta_t);
-  advect(t, delta_t);
-  advect(u, delta_t);
-  advect(v, delta_t);
-  advect(w, delta_t);
+  update_active_blocks();
+  // Every field is advected by the velocity of the previous step, so none
+  // is replaced before all are computed. rho and t share their samples.
+  std::vector<std::vector<int>> groups = {{0, 1}, {2}, {3}, {4}};
+  Array *fields[5] = {&rho, &t, &u, &v, &w};
+  bool maccormack = advection == "maccormack";
+  int num_groups = (int)groups.size();
+  std::vector<std::vector<const Array *>> src(num_groups), hat(num_groups);
+  std::vector<std::vector<Array *>> dst(num_groups), corrected_dst(num_groups);
+  // The groups overlap, each correction following its own advection
+  TaskGraph graph(num_threads);
+  for (int g = 0; g < num_groups; g++) {
+    for (int f : groups[g]) {
+      src[g].push_back(fields[f]);
+      dst[g].push_back(&advected[f]);
+      hat[g].push_back(&advected[f]);
+      corrected_dst[g].push_back(&corrected[f]);
+    }
+    int node = graph.add_node([&, g]() { advect(src[g], dst[g], delta_t); });
+    if (maccormack) {
+      graph.add_continuation(node, [&, g]() {
+        correct_advection(src[g], hat[g], corrected_dst[g], delta_t);
+      });
+    }
+  }
+  graph.run();
+  Array *result = maccormack ? corrected : advected;
+  for (int f = 0; f < 5; f++) {
+    std::swap(fields[f]->data, result[f].data);
+  }
 }
 
 void Smoke3D::confine_vorticity(real delta_t) {
+  if (vorticity_confinement == 0.0_f) {
+    return;
+  }
+  update_active_blocks();
+  const Array *velocity[3] = {&u, &v, &w};
+  // Component d of the velocity at the center of a cell, clamped to the grid
+  auto center_velocity = [&](int d, Vector3i cell) {
+    for (int a = 0; a < 3; a++) {
+      cell[a] = clamp(cell[a], 0, res[a] - 1);
+    }
+    const Array &vel = *velocity[d];
+    return 0.5_f * (vel[cell] + vel[cell + Vector3i::axis(d)]);
+  };
+  // Central difference along axis a, one-sided at the boundary
+  auto difference = [&](const Vector3i &cell, int a, const auto &f) {
+    Vector3i lower = cell, upper = cell;
+    lower[a] = std::max(cell[a] - 1, 0);
+    upper[a] = std::min(cell[a] + 1, res[a] - 1);
+    if (lower[a] == upper[a]) {
+      return 0.0_f;
+    }
+    return (f(upper) - f(lower)) / (real)(upper[a] - lower[a]);
+  };
+
+  auto vorticity_array = vector_pool.acquire(res);
+  Array3D<Vector3> &vorticity = *vorticity_array;
+  ThreadedTaskManager::run(res[0], num_threads, [&](int i) {
+    for (int j = 0; j < res[1]; j++) {
+      for (int k = 0; k < res[2]; k++) {
+        Vector3i cell(i, j, k);
+        if (is_quiet(i, j, k)) {
+          vorticity[cell] = Vector3(0.0_f);
+          continue;
+        }
+        // d(velocity component c) / d(axis a)
+        auto grad = [&](int c, int a) {
+          return difference(cell, a, [&](const Vector3i &n) {
+            return center_velocity(c, n);
+          });
+        };
+        vorticity[cell] =
+            Vector3(grad(2, 1) - grad(1, 2), grad(0, 2) - grad(2, 0),
+                    grad(1, 0) - grad(0, 1));
+      }
+    }
+  });
+
+  auto force_array = vector_pool.acquire(res);
+  Array3D<Vector3> &force = *force_array;
+  ThreadedTaskManager::run(res[0], num_threads, [&](int i) {
+    for (int j = 0; j < res[1]; j++) {
+      for (int k = 0; k < res[2]; k++) {
+        Vector3i cell(i, j, k);
+        if (is_quiet(i, j, k)) {
+          force[cell] = Vector3(0.0_f);
+          continue;
+        }
+        Vector3 grad;
+        for (int a = 0; a < 3; a++) {
+          grad[a] = difference(cell, a, [&](const Vector3i &n) {
+            return length(vorticity[n]);
+          });
+        }
+        real grad_length = length(grad);
+        if (grad_length < 1e-10_f) {
+          force[cell] = Vector3(0.0_f);
+        } else {
+          force[cell] = vorticity_confinement *
+                        cross(grad / grad_length, vorticity[cell]);
+        }
+      }
+    }
+  });
+
+  // Faces take the average force of their cells
+  Array *faces[3] = {&u, &v, &w};
+  for (int d = 0; d < 3; d++) {
+    Array &vel = *faces[d];
+    Vector3i shape = vel.get_res();
+    ThreadedTaskManager::run(shape[0], num_threads, [&](int i) {
+      for (int j = 0; j < shape[1]; j++) {
+        for (int k = 0; k < shape[2]; k++) {
+          Vector3i upper(i, j, k), lower = upper - Vector3i::axis(d);
+          real f = 0.0_f;
+          int n = 0;
+          for (auto &cell : {lower, upper}) {
+            if (cell[d] >= 0 && cell[d] < res[d]) {
+              f += force[cell][d];
+              n++;
+            }
+          }
+          vel[i][j][k] += delta_t * f / n;
+        }
+      }
+    });
+  }
 }
 
 void Smoke3D::update(const Config &config) {
@@ -347,6 +722,7 @@ void Smoke3D::update(const Config &config) {
   color_tex = AssetManager::get_asset<Texture>(config.get<int>("color_tex"));
   temperature_tex =
       AssetManager::get_asset<Texture>(config.get<int>("temperature_tex"));
+  sources_dirty = true;
 }
 
 TC_IMPLEMENTATION(Simulation3D, Smoke3D, "smoke");
@@ -8,8 +8,10 @@
 #include <memory.h>
 #include <string>
 #include <taichi/visualization/image_buffer.h>
+#include <taichi/visualization/volume_preview.h>
 #include <taichi/common/interface.h>
 #include <taichi/math/array_3d.h>
+#include <taichi/math/array_pool.h>
 #include <taichi/dynamics/poisson_solver.h>
 #include <taichi/dynamics/simulation.h>
 #include <taichi/visual/texture.h>
@@ -29,52 +31,194 @@ class Tracker3D {
   }
 };
 
+// A sample of the emitter textures of Smoke3D with a nonzero generation:
+// per step, |seed| is added to rho of |cell| and the other values replace
+// those of the cell
+struct SmokeSource {
+  Vector3i cell;
+  real seed;
+  real temperature;
+  Vector3 velocity;
+  Vector3 color;
+};
+
+// The samples of the textures at |super_sampling| random positions per cell
+// of the slices [x_begin, x_end) of a grid of |res| cells, in the order of
+// the cells
+std::vector<SmokeSource> rasterize_smoke_sources(const Texture &generation,
+                                                 const Texture &velocity,
+                                                 const Texture &color,
+                                                 const Texture &temperature,
+                                                 const Vector3i &res,
+                                                 int super_sampling,
+                                                 int x_begin,
+                                                 int x_end,
+                                                 int num_threads);
+
 class Smoke3D : public Simulation3D {
   typedef Array3D<real> Array;
+  using Base = Simulation3D;
 
  public:
   Array u, v, w, rho, t, pressure, last_pressure;
+  // The solution of the projection before last_pressure
+  Array previous_pressure;
   Vector3i res;
   real smoke_alpha, smoke_beta;
   real temperature_decay;
   real pressure_tolerance;
+  // With pressure_warm_start, the pressure solve starts from the last
+  // solution, extrapolated in time by pressure_extrapolation times the
+  // change over the last step (0: the last solution itself)
+  bool pressure_warm_start;
+  real pressure_extrapolation;
   real density_scaling;
+  // show() traces a ray per block of preview_downsample^2 pixels
+  VolumePreview preview;
   real tracker_generation;
   real perturbation;
+  // Strength of vorticity confinement; 0 disables it
+  real vorticity_confinement;
   int super_sampling;
+  // With cfl > 0, step() splits frames into substeps that move the
+  // fastest velocity component by at most cfl cells, and at most
+  // maximum_substeps of them; otherwise every frame is one step
+  real cfl;
+  int maximum_substeps;
+  // "semi_lagrangian", or "maccormack" for less numerical diffusion
+  std::string advection;
+  // With sparse, advection and vorticity confinement skip the quiet blocks
+  // of block_size^3 cells: those with no smoke and speeds of at most
+  // sparse_velocity_threshold, in them and in their neighbours. Advection
+  // carries the values of quiet blocks over. The default threshold of 0
+  // gives the same results as the dense passes.
+  bool sparse;
+  real sparse_velocity_threshold;
+  static constexpr int block_size = 8;
+  // Per block, 1 unless it is quiet; see update_active_blocks()
+  Array3D<uint8> active_blocks;
+  // Advected values of rho, t, u, v and w; swapped with the fields
+  Array advected[5];
+  // MacCormack-corrected values, likewise
+  Array corrected[5];
+  // Temporaries of the divergence and of vorticity confinement
+  ArrayPool<3, real> scalar_pool;
+  ArrayPool<3, Vector3> vector_pool;
   std::shared_ptr<Texture> generation_tex;
   std::shared_ptr<Texture> initial_velocity_tex;
   std::shared_ptr<Texture> color_tex;
   std::shared_ptr<Texture> temperature_tex;
+  // The textures rasterized at the first step after update(), so that
+  // static emitters are not sampled every step
+  std::vector<SmokeSource> sources;
+  bool sources_dirty = true;
 
   bool open_boundary;
-  std::vector<Tracker3D> trackers;
+  // Tracker positions and colors in separate arrays, so that advection and
+  // compaction stream the positions only
+  struct TrackerArrays {
+    std::vector<Vector3> position, color;
+
+    int size() const {
+      return (int)position.size();
+    }
+
+    void push_back(const Tracker3D &tracker) {
+      position.push_back(tracker.position);
+      color.push_back(tracker.color);
+    }
+
+    Tracker3D get(int i) const {
+      return Tracker3D(position[i], color[i]);
+    }
+
+    void resize(int n) {
+      position.resize(n);
+      color.resize(n);
+    }
+
+    TC_IO_DEF(position, color);
+  };
+  TrackerArrays trackers;
   std::shared_ptr<PoissonSolver3D> pressure_solver;
   PoissonSolver3D::BCArray boundary_condition;
+  // Per face of u, v and w: which pressure gradient terms apply and whether
+  // the face is a wall. Computed from boundary_condition by
+  // update_boundary_masks().
+  enum FaceMask : uint8 {
+    SUBTRACT_LOWER_PRESSURE = 1,
+    ADD_UPPER_PRESSURE = 2,
+    WALL = 4
+  };
+  Array3D<uint8> face_masks[3];
 
   Smoke3D() {
   }
 
+  // The fields that evolve; the rest follows from the config
+  TC_IO_DEF_WITH_BASE(u,
+                      v,
+                      w,
+                      rho,
+                      t,
+                      pressure,
+                      last_pressure,
+                      previous_pressure,
+                      trackers);
+
   void remove_outside_trackers();
 
   void initialize(const Config &config) override;
 
   void project();
 
+  // Adds the force eps (N x omega), with omega the curl of the velocity and
+  // N the normalized gradient of |omega|, which re-energizes the small
+  // vortices that advection smooths away
   void confine_vorticity(real delta_t);
 
   void advect(real delta_t);
 
   void move_trackers(real delta_t);
 
+  // Seeds smoke from the sources once, then advances by |delta_t| in
+  // substeps
   void step(real delta_t) override;
 
+  void substep(real delta_t);
+
+  // The upper bound on the speed given by the largest velocity components
+  real get_max_speed() const;
+
+  // Views of rho and t along z (left half) and y (right, lower half)
   virtual void show(Array2D<Vector3> &buffer);
 
-  void advect(Array &attr, real delta_t);
+  // Semi-Lagrangian advection of the fields |src|, which have the same
+  // shape, into |dst|. The backtrace and the interpolation weights are
+  // computed once per sample and shared by the fields.
+  void advect(const std::vector<const Array *> &src,
+              const std::vector<Array *> &dst,
+              real delta_t);
+
+  // MacCormack step after advect(): |dst| is |hat| corrected by half the
+  // error of advecting |hat| back to |src|, clamped to the values |hat|
+  // was interpolated from
+  void correct_advection(const std::vector<const Array *> &src,
+                         const std::vector<const Array *> &hat,
+                         const std::vector<Array *> &dst,
+                         real delta_t);
 
   void apply_boundary_condition();
 
+  void update_active_blocks();
+
+  // Whether the cell or face (i, j, k) is in a quiet block; always false
+  // unless sparse
+  bool is_quiet(int i, int j, int k) const;
+
+  // Call after changing boundary_condition
+  void update_boundary_masks();
+
   static Vector3 sample_velocity(const Array &u,
                                  const Array &v,
                                  const Array &w,
@@ -84,6 +228,17 @@ class Smoke3D : public Simulation3D {
 
   std::vector<RenderParticle> get_render_particles() const override;
 
+  // The trackers and the smoke density
+  void snapshot_frame(FrameWriter::Frame &frame) const override {
+    frame.add("render_particles", get_render_particles());
+    frame.add("rho", rho);
+  }
+
+  const std::vector<RenderParticle> &get_render_particles_view() override;
+
+  // Trackers centered on the domain, in parallel
+  void fill_render_particles(std::vector<RenderParticle> &particles) const;
+
   void update(const Config &config) override;
 };
 
@@ -0,0 +1,518 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#include <taichi/dynamics/simulation.h>
+#include <taichi/math/sparse_grid.h>
+#include <taichi/math/svd.h>
+#include <taichi/system/statistics.h>
+
+#include <numeric>
+
+TC_NAMESPACE_BEGIN
+
+// Momentum (xyz) and mass, or velocity and mass after the grid update
+struct MPMGridNode {
+  real values[4];
+};
+
+// Moving least squares MPM (Hu et al., "A Moving Least Squares Material
+// Point Method with Displacement Discontinuity and Two-Way Rigid Body
+// Coupling") with APIC transfers and quadratic B-spline weights, on a
+// SparseGrid3D, so that memory follows the particles.
+//
+// Every step, particles are sorted by the grid block of their stencil
+// (their "base" node), and each block of particles is transferred through
+// a dense scratch copy of the (block_size + 2)^3 nodes it reaches. The
+// scratch nodes are added to the grid block by block, in eight passes over
+// the blocks of each parity of their coordinates, whose nodes do not
+// overlap, so that no atomics are needed. Stresses are computed beforehand
+// with the batched SVD of the deformation gradients.
+//
+// Materials are "jelly" (fixed corotated elasticity), "snow" (the same,
+// with the plasticity and hardening of Stomakhin et al. 2013) and "water"
+// (weakly compressible, tracking only the volume ratio). The domain is
+// |res| cells of delta_x, with slip walls within three cells of its faces
+// and, if set, the levelset as a boundary with Coulomb friction.
+class MPM3D : public Simulation3D {
+ protected:
+  static constexpr int log2_block_size = 3;
+  using Grid = SparseGrid3D<MPMGridNode, log2_block_size>;
+  static constexpr int block_size = Grid::block_size;
+  // Nodes reached by the particles of a block, per axis
+  static constexpr int scratch_size = block_size + 2;
+  static constexpr int scratch_volume =
+      scratch_size * scratch_size * scratch_size;
+  static constexpr int boundary = 3;
+
+  using Base = Simulation3D;
+
+  enum class MaterialType { jelly, snow, water };
+
+  struct Material {
+    MaterialType type;
+    real mass, volume;
+    real mu, lambda;
+    // Of snow: critical compression and stretch, and hardening
+    real theta_c, theta_s, hardening;
+    Vector4 color;
+  };
+
+  struct Particle {
+    Vector3 position, velocity;
+    // APIC affine velocity and deformation gradient
+    Matrix3 C, F;
+    // Plastic volume ratio for snow, volume ratio for water
+    real J;
+    int material;
+  };
+
+  // The particles of a grid block, [begin, end) in sorted order
+  struct BlockParticles {
+    int64 code;
+    int begin, end;
+  };
+
+  Vector3i res;
+  real delta_x, inv_delta_x;
+  real delta_t;
+  Vector3 gravity;
+  real friction;
+  Grid grid;
+  std::vector<Material> materials;
+  std::vector<Particle> particles, sorted_particles;
+  // Velocity divergence terms of MLS-MPM scattered with the momentum
+  std::vector<Matrix3> affines;
+  std::vector<uint32> keys;
+  std::vector<int> order, sort_buffer;
+  std::vector<BlockParticles> blocks;
+  // Indices into |blocks|, by the parity of the block coordinates
+  std::vector<int> blocks_of_color[8];
+
+ public:
+  // The grid is rebuilt every substep
+  TC_IO_DEF_WITH_BASE(materials, particles);
+
+  virtual void initialize(const Config &config) override {
+    Simulation3D::initialize(config);
+    res = config.get<Vector3i>("res");
+    delta_x = config.get("delta_x", 1.0_f / res.max());
+    inv_delta_x = 1.0_f / delta_x;
+    delta_t = config.get("delta_t", 1e-4_f);
+    gravity = config.get("gravity", Vector3(0, -9.8_f, 0));
+    friction = config.get("friction", 0.5_f);
+    grid.initialize(res);
+  }
+
+  // Fills the box of 'lower_corner' and 'upper_corner' with (jittered)
+  // 'particles_per_cell' particles of material 'type', of 'density', Young's
+  // modulus 'E' (the bulk modulus for water) and Poisson's ratio 'nu'
+  virtual std::string add_particles(const Config &config) override {
+    std::string type = config.get("type", "jelly");
+    Material material;
+    if (type == "jelly") {
+      material.type = MaterialType::jelly;
+    } else if (type == "snow") {
+      material.type = MaterialType::snow;
+    } else if (type == "water") {
+      material.type = MaterialType::water;
+    } else {
+      TC_ERROR("Unknown material type {}, should be jelly, snow or water",
+               type);
+    }
+    int particles_per_cell = config.get("particles_per_cell", 8);
+    real E = config.get("E", 1e4_f);
+    real nu = config.get("nu", 0.2_f);
+    material.volume = pow<3>(delta_x) / particles_per_cell;
+    material.mass = config.get("density", 1000.0_f) * material.volume;
+    if (material.type == MaterialType::water) {
+      material.mu = 0;
+      material.lambda = E;
+    } else {
+      material.mu = E / (2 * (1 + nu));
+      material.lambda = E * nu / ((1 + nu) * (1 - 2 * nu));
+    }
+    material.theta_c = config.get("theta_c", 2.5e-2_f);
+    material.theta_s = config.get("theta_s", 7.5e-3_f);
+    material.hardening = config.get("hardening", 10.0_f);
+    Vector3 color = config.get("color", Vector3(0.6_f, 0.7_f, 0.9_f));
+    material.color = Vector4(color, 1.0_f);
+    materials.push_back(material);
+
+    Vector3 lower = config.get<Vector3>("lower_corner") * inv_delta_x;
+    Vector3 upper = config.get<Vector3>("upper_corner") * inv_delta_x;
+    Vector3 velocity = config.get("velocity", Vector3(0.0_f));
+    Vector3i begin, end;
+    for (int d = 0; d < 3; d++) {
+      begin[d] = std::max((int)std::floor(lower[d]), boundary);
+      end[d] = std::min((int)std::ceil(upper[d]), res[d] - boundary);
+    }
+    Particle p;
+    p.velocity = velocity;
+    p.C = Matrix3(0.0_f);
+    p.F = Matrix3(1.0_f);
+    p.J = 1;
+    p.material = (int)materials.size() - 1;
+    for (int i = begin[0]; i < end[0]; i++) {
+      for (int j = begin[1]; j < end[1]; j++) {
+        for (int k = begin[2]; k < end[2]; k++) {
+          for (int l = 0; l < particles_per_cell; l++) {
+            Vector3 pos = Vector3(i + rand(), j + rand(), k + rand());
+            if (lower <= pos && pos < upper) {
+              p.position = pos * delta_x;
+              particles.push_back(p);
+            }
+          }
+        }
+      }
+    }
+    return "";
+  }
+
+  virtual void step(real dt) override {
+    int steps = (int)std::ceil(dt / delta_t);
+    for (int i = 0; i < steps; i++) {
+      substep(dt / steps);
+    }
+    TC_STAT("mpm_particle_updates", (int64)steps * particles.size());
+    current_t += dt;
+  }
+
+  std::vector<RenderParticle> get_render_particles() const override {
+    std::vector<RenderParticle> render_particles(particles.size());
+    ThreadedTaskManager::run((int)particles.size(), num_threads, [&](int i) {
+      const Particle &p = particles[i];
+      render_particles[i] =
+          RenderParticle(p.position, materials[p.material].color);
+    });
+    return render_particles;
+  }
+
+ protected:
+  void substep(real dt) {
+    sort_particles();
+    compute_affines(dt);
+    grid.clear(false);
+    for (auto &block : blocks) {
+      // Particles of a block reach into the next block along each axis
+      Vector3i begin = grid.get_block_begin(block.code);
+      for (int c = 0; c < 8; c++) {
+        Vector3i cell = begin + Vector3i(c >> 2, (c >> 1) & 1, c & 1) *
+                                    Vector3i(block_size);
+        if (grid.inside(cell)) {
+          grid.activate(cell);
+        }
+      }
+    }
+    grid.update_active_blocks();
+    for (int color = 0; color < 8; color++) {
+      auto &indices = blocks_of_color[color];
+      ThreadedTaskManager::run((int)indices.size(), num_threads,
+                               [&](int b) { rasterize(blocks[indices[b]]); });
+    }
+    update_grid(dt);
+    ThreadedTaskManager::run((int)blocks.size(), num_threads,
+                             [&](int b) { advect(blocks[b], dt); });
+  }
+
+  Vector3i get_base_node(const Vector3 &position) const {
+    Vector3 g = position * inv_delta_x - Vector3(0.5_f);
+    return Vector3i((int)g.x, (int)g.y, (int)g.z);
+  }
+
+  // Quadratic B-spline weights of the three nodes from |base| along each
+  // axis, and the position relative to |base| in cells
+  void get_weights(const Vector3 &position,
+                   const Vector3i &base,
+                   Vector3 w[3],
+                   Vector3 &fx) const {
+    fx = position * inv_delta_x - base.template cast<real>();
+    w[0] = 0.5_f * sqr(Vector3(1.5_f) - fx);
+    w[1] = Vector3(0.75_f) - sqr(fx - Vector3(1.0_f));
+    w[2] = 0.5_f * sqr(fx - Vector3(0.5_f));
+  }
+
+  static int scratch_index(int i, int j, int k) {
+    return (i * scratch_size + j) * scratch_size + k;
+  }
+
+  // Sorts the particles by the Morton code of the block of their base
+  // node, and groups them by block
+  void sort_particles() {
+    int n = (int)particles.size();
+    keys.resize(n);
+    ThreadedTaskManager::run(n, num_threads, [&](int i) {
+      keys[i] = (uint32)grid.get_block_code(
+          get_base_node(particles[i].position));
+    });
+    radix_sort();
+    sorted_particles.resize(n);
+    ThreadedTaskManager::run(n, num_threads, [&](int i) {
+      sorted_particles[i] = particles[order[i]];
+    });
+    std::swap(particles, sorted_particles);
+    blocks.clear();
+    for (auto &indices : blocks_of_color) {
+      indices.clear();
+    }
+    for (int i = 0; i < n; i++) {
+      uint32 key = keys[order[i]];
+      if (blocks.empty() || blocks.back().code != key) {
+        // The lowest Morton bits are those of the block coordinates
+        blocks_of_color[key & 7].push_back((int)blocks.size());
+        blocks.push_back(BlockParticles{key, i, i});
+      }
+      blocks.back().end = i + 1;
+    }
+  }
+
+  // Stable LSD radix sort of the particle indices by |keys|, with the
+  // digits counted and scattered by chunks of particles in parallel
+  void radix_sort() {
+    constexpr int bits = 16, bins = 1 << bits;
+    int n = (int)keys.size();
+    int num_chunks = std::max(1, std::min(64, n / 65536));
+    order.resize(n);
+    std::iota(order.begin(), order.end(), 0);
+    sort_buffer.resize(n);
+    std::vector<int> counts((std::size_t)num_chunks * bins);
+    auto chunk_begin = [&](int c) { return (int)((int64)n * c / num_chunks); };
+    uint32 max_key = 0;
+    for (auto key : keys) {
+      max_key = std::max(max_key, key);
+    }
+    for (int shift = 0; shift < 32 && (max_key >> shift) != 0;
+         shift += bits) {
+      std::fill(counts.begin(), counts.end(), 0);
+      ThreadedTaskManager::run(num_chunks, num_threads, [&](int c) {
+        int *count = &counts[(std::size_t)c * bins];
+        for (int i = chunk_begin(c); i < chunk_begin(c + 1); i++) {
+          count[(keys[order[i]] >> shift) & (bins - 1)]++;
+        }
+      });
+      int sum = 0;
+      for (int d = 0; d < bins; d++) {
+        for (int c = 0; c < num_chunks; c++) {
+          int &count = counts[(std::size_t)c * bins + d];
+          int t = count;
+          count = sum;
+          sum += t;
+        }
+      }
+      ThreadedTaskManager::run(num_chunks, num_threads, [&](int c) {
+        int *offset = &counts[(std::size_t)c * bins];
+        for (int i = chunk_begin(c); i < chunk_begin(c + 1); i++) {
+          sort_buffer[offset[(keys[order[i]] >> shift) & (bins - 1)]++] =
+              order[i];
+        }
+      });
+      std::swap(order, sort_buffer);
+    }
+  }
+
+  // Plasticity, and the stress terms of the momentum transfer, from the
+  // SVDs of batches of deformation gradients
+  void compute_affines(real dt) {
+    constexpr int batch = 64;
+    int n = (int)particles.size();
+    affines.resize(n);
+    real scale = -dt * 4 * inv_delta_x * inv_delta_x;
+    ThreadedTaskManager::run((n + batch - 1) / batch, num_threads, [&](int b) {
+      int begin = b * batch, m = std::min(n, begin + batch) - begin;
+      Matrix3f F[batch], U[batch], sig[batch], V[batch];
+      for (int i = 0; i < m; i++) {
+        F[i] = Matrix3f(particles[begin + i].F);
+      }
+      svd_batch(F, m, U, sig, V);
+      for (int i = 0; i < m; i++) {
+        Particle &p = particles[begin + i];
+        const Material &material = materials[p.material];
+        real mu = material.mu, lambda = material.lambda;
+        Matrix3 PFt;
+        if (material.type == MaterialType::water) {
+          p.F = Matrix3(1.0_f);
+          PFt = Matrix3(lambda * (p.J - 1) * p.J);
+        } else {
+          Matrix3 u(U[i]), v(V[i]);
+          Vector3 s(sig[i](0, 0), sig[i](1, 1), sig[i](2, 2));
+          if (material.type == MaterialType::snow) {
+            real J_old = s.x * s.y * s.z;
+            for (int d = 0; d < 3; d++) {
+              s[d] = clamp(s[d], 1 - material.theta_c, 1 + material.theta_s);
+            }
+            p.J = clamp(p.J * J_old / (s.x * s.y * s.z), 0.6_f, 20.0_f);
+            p.F = u * Matrix3(s) * transposed(v);
+            real h = std::exp(material.hardening * (1 - p.J));
+            mu *= h;
+            lambda *= h;
+          }
+          real J = s.x * s.y * s.z;
+          Matrix3 R = u * transposed(v);
+          PFt = 2 * mu * (p.F - R) * transposed(p.F) +
+                Matrix3(lambda * (J - 1) * J);
+        }
+        affines[begin + i] =
+            scale * material.volume * PFt + material.mass * p.C;
+      }
+    });
+  }
+
+  // Particle to grid transfer of a block, through the scratch nodes
+  void rasterize(const BlockParticles &block) {
+    static thread_local std::vector<Vector4> scratch;
+    scratch.assign(scratch_volume, Vector4(0.0_f));
+    Vector3i block_begin = grid.get_block_begin(block.code);
+    for (int q = block.begin; q < block.end; q++) {
+      const Particle &p = particles[q];
+      real mass = materials[p.material].mass;
+      Vector3i base = get_base_node(p.position);
+      Vector3 w[3], fx;
+      get_weights(p.position, base, w, fx);
+      // Momentum and mass of a node at dpos (in cells): (A dpos + m v, m)
+      const Matrix3 &A = affines[q];
+      Matrix4 transfer(Vector4(A[0] * delta_x, 0), Vector4(A[1] * delta_x, 0),
+                       Vector4(A[2] * delta_x, 0),
+                       Vector4(mass * p.velocity, mass));
+      Vector3i local = base - block_begin;
+      for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+          real wij = w[i].x * w[j].y;
+          for (int k = 0; k < 3; k++) {
+            Vector3 dpos = Vector3(i, j, k) - fx;
+            scratch[scratch_index(local.x + i, local.y + j, local.z + k)] +=
+                (wij * w[k].z) * (transfer * Vector4(dpos, 1.0_f));
+          }
+        }
+      }
+    }
+    for (int i = 0; i < scratch_size; i++) {
+      for (int j = 0; j < scratch_size; j++) {
+        for (int k = 0; k < scratch_size; k++) {
+          const Vector4 &value = scratch[scratch_index(i, j, k)];
+          Vector3i cell = block_begin + Vector3i(i, j, k);
+          if (value[3] == 0 || !grid.inside(cell)) {
+            continue;
+          }
+          MPMGridNode &node = grid[cell];
+          for (int c = 0; c < 4; c++) {
+            node.values[c] += value[c];
+          }
+        }
+      }
+    }
+  }
+
+  void update_grid(real dt) {
+    bool has_levelset = (bool)levelset.levelset0;
+    real t = current_t;
+    if (has_levelset) {
+      levelset.update(t, num_threads);
+    }
+    grid.for_each_active_block(
+        [&](const Vector3i &begin, MPMGridNode *nodes) {
+          for (int n = 0; n < Grid::block_volume; n++) {
+            MPMGridNode &node = nodes[n];
+            real mass = node.values[3];
+            if (mass == 0) {
+              continue;
+            }
+            Vector3i cell = begin + Vector3i(n >> (2 * log2_block_size),
+                                             (n >> log2_block_size) &
+                                                 (block_size - 1),
+                                             n & (block_size - 1));
+            Vector3 v = Vector3(node.values[0], node.values[1],
+                                node.values[2]) *
+                            (1.0_f / mass) +
+                        dt * gravity;
+            for (int d = 0; d < 3; d++) {
+              if ((cell[d] < boundary && v[d] < 0) ||
+                  (cell[d] > res[d] - boundary && v[d] > 0)) {
+                v[d] = 0;
+              }
+            }
+            Vector3 pos = cell.template cast<real>() * delta_x;
+            if (has_levelset && levelset.inside(pos) &&
+                levelset.sample(pos, t) < 0) {
+              Vector3 normal = levelset.get_spatial_gradient(pos, t);
+              real vn = dot(v, normal);
+              if (vn < 0) {
+                Vector3 vt = v - vn * normal;
+                real vt_norm = length(vt);
+                v = vt_norm > -friction * vn
+                        ? vt * (1 + friction * vn / vt_norm)
+                        : Vector3(0.0_f);
+              }
+            }
+            for (int d = 0; d < 3; d++) {
+              node.values[d] = v[d];
+            }
+          }
+        },
+        num_threads);
+  }
+
+  // Grid to particle transfer of a block, and the particle updates
+  void advect(const BlockParticles &block, real dt) {
+    static thread_local std::vector<Vector4> scratch;
+    scratch.resize(scratch_volume);
+    Vector3i block_begin = grid.get_block_begin(block.code);
+    for (int i = 0; i < scratch_size; i++) {
+      for (int j = 0; j < scratch_size; j++) {
+        for (int k = 0; k < scratch_size; k++) {
+          Vector3i cell = block_begin + Vector3i(i, j, k);
+          Vector4 value(0.0_f);
+          if (grid.inside(cell)) {
+            const real *v = grid[cell].values;
+            value = Vector4(v[0], v[1], v[2], 0);
+          }
+          scratch[scratch_index(i, j, k)] = value;
+        }
+      }
+    }
+    Vector3 lower(boundary * 0.5_f * delta_x);
+    Vector3 upper = (res.template cast<real>() - Vector3(boundary * 0.5_f)) *
+                    delta_x;
+    for (int q = block.begin; q < block.end; q++) {
+      Particle &p = particles[q];
+      Vector3i base = get_base_node(p.position);
+      Vector3 w[3], fx;
+      get_weights(p.position, base, w, fx);
+      Vector3i local = base - block_begin;
+      // Columns of sum w v dpos^T (in cells), and sum w v
+      Vector4 b[4] = {Vector4(0.0_f), Vector4(0.0_f), Vector4(0.0_f),
+                      Vector4(0.0_f)};
+      for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+          real wij = w[i].x * w[j].y;
+          for (int k = 0; k < 3; k++) {
+            Vector3 dpos = Vector3(i, j, k) - fx;
+            real weight = wij * w[k].z;
+            Vector4 v =
+                weight *
+                scratch[scratch_index(local.x + i, local.y + j, local.z + k)];
+            b[0] += v * dpos.x;
+            b[1] += v * dpos.y;
+            b[2] += v * dpos.z;
+            b[3] += v;
+          }
+        }
+      }
+      p.velocity = Vector3(b[3].x, b[3].y, b[3].z);
+      p.C = (4 * inv_delta_x) *
+            Matrix3(Vector3(b[0].x, b[0].y, b[0].z),
+                    Vector3(b[1].x, b[1].y, b[1].z),
+                    Vector3(b[2].x, b[2].y, b[2].z));
+      p.position = clamp(p.position + dt * p.velocity, lower, upper);
+      if (materials[p.material].type == MaterialType::water) {
+        p.J *= 1 + dt * (p.C(0, 0) + p.C(1, 1) + p.C(2, 2));
+      } else {
+        p.F = (Matrix3(1.0_f) + dt * p.C) * p.F;
+      }
+    }
+  }
+};
+
+TC_IMPLEMENTATION(Simulation3D, MPM3D, "mpm_3d");
+
+TC_NAMESPACE_END
@@ -4,13 +4,77 @@
 *******************************************************************************/
 
 #include <taichi/dynamics/simulation.h>
+#include <taichi/system/statistics.h>
 #include <taichi/visualization/particle_visualization.h>
 #include <taichi/visual/texture.h>
 
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#include <malloc.h>
+#endif
+
 TC_NAMESPACE_BEGIN
 
 #define CV(x)
 
+inline int popcount(uint32 x) {
+#if defined(_MSC_VER)
+  return (int)__popcnt(x);
+#else
+  return __builtin_popcount(x);
+#endif
+}
+
+// Cache-line aligned storage for std::vector, as operator new does not
+// honor alignas beyond alignof(std::max_align_t) before C++17
+template <typename T>
+struct CacheLineAllocator {
+  using value_type = T;
+
+  CacheLineAllocator() = default;
+
+  template <typename U>
+  CacheLineAllocator(const CacheLineAllocator<U> &) {
+  }
+
+  T *allocate(std::size_t n) {
+    void *p = nullptr;
+#if defined(_MSC_VER)
+    p = _aligned_malloc(n * sizeof(T), 64);
+#else
+    if (posix_memalign(&p, 64, n * sizeof(T)) != 0) {
+      p = nullptr;
+    }
+#endif
+    if (p == nullptr) {
+      throw std::bad_alloc();
+    }
+    return reinterpret_cast<T *>(p);
+  }
+
+  void deallocate(T *p, std::size_t) {
+#if defined(_MSC_VER)
+    _aligned_free(p);
+#else
+    free(p);
+#endif
+  }
+
+  template <typename U>
+  bool operator==(const CacheLineAllocator<U> &) const {
+    return true;
+  }
+
+  template <typename U>
+  bool operator!=(const CacheLineAllocator<U> &) const {
+    return false;
+  }
+};
+
 class BarnesHutSummation {
  public:
   struct Particle {
@@ -35,46 +99,85 @@ class BarnesHutSummation {
     }
   };
 
+  // Second moments sum(m * d_i * d_j) of the particles of a node about its
+  // center of mass, for the components (i, j) of |index|
+  struct Quadrupole {
+    static constexpr int index[6][2] = {{0, 0}, {1, 1}, {2, 2},
+                                        {0, 1}, {0, 2}, {1, 2}};
+    real q[6];
+  };
+
  protected:
-  struct Node {
-    Particle p;
-    int children[8];  // We do not use pointer here to save memory bandwidth(64
-                      // bit v.s. 32 bit)
-    // There are so many ways to optimize and I'll consider them later...
-    Vector3i bounds[2];  // TODO: this is quite brute-force...
-    Node() {
-      memset(children, 0, sizeof(children));
-      p = Particle();
-    }
-
-    bool is_leaf() {
-      for (int i = 0; i < 8; i++) {
-        if (children[i] != 0) {
-          return false;
-        }
-      }
-      return p.mass > 0;
+  // One cache line. Children are contiguous from first_child, one per set
+  // bit of child_mask, in child index order; leaves (child_mask == 0) are
+  // buckets of the particles [begin, end) in Morton order.
+  struct alignas(64) Node {
+    // Center of mass and mass
+    real position[3];
+    real mass;
+    // Bound on the distance of the particles from the center of mass
+    real radius;
+    // Particles whose grid coordinates are in [bounds[0], bounds[1]] are
+    // too close for the monopole
+    int bounds[2][3];
+    int first_child;
+    int begin, end;
+    uint8 child_mask;
+
+    bool is_leaf() const {
+      return child_mask == 0;
+    }
+
+    bool contains(const Vector3i &u) const {
+      return bounds[0][0] <= u[0] && u[0] <= bounds[1][0] &&
+             bounds[0][1] <= u[1] && u[1] <= bounds[1][1] &&
+             bounds[0][2] <= u[2] && u[2] <= bounds[1][2];
+    }
+
+    Particle get_particle() const {
+      return Particle(Vector3(position[0], position[1], position[2]), mass);
     }
   };
+  static_assert(sizeof(Node) == 64, "Nodes should fill one cache line");
+
+  // A particle in Morton order: the octal digits of |code|, most
+  // significant first, are its child indices from the root down
+  struct SortedParticle {
+    uint64 code;
+    int index;
+  };
 
   real resolution, inv_resolution;
   int total_levels;
   int margin;
 
-  std::vector<Node> nodes;
-  int node_end;
+  std::vector<Node, CacheLineAllocator<Node>> nodes;
+  // Per node, apart as few traversals need them
+  std::vector<Quadrupole> quadrupoles;
+  // Nodes [level_begin[l], level_begin[l + 1]) are those of level l
+  std::vector<int> level_begin;
   Vector3 lower_corner;
+  int num_threads;
+  int bucket_size;
+  // Zero to open nodes by the margin only
+  real opening_angle = 0.0_f;
+  // Particles in Morton order: codes, indices in the input, and positions
+  // and masses in separate arrays for the direct summation of buckets
+  std::vector<uint64> codes;
+  std::vector<int> order;
+  std::vector<real> bucket_x, bucket_y, bucket_z, bucket_mass;
 
-  Vector3i get_coord(const Vector3 &position) {
+  Vector3i get_coord(const Vector3 &position) const {
     Vector3i u;
     Vector3 t = (position - lower_corner) * inv_resolution;
     for (int i = 0; i < 3; i++) {
-      u[i] = int(t[i]);
+      // Particles leave the bounding box of the build between refits
+      u[i] = (int)std::floor(t[i]);
     }
     return u;
   }
 
-  int get_child_index(const Vector3i &u, int level) {
+  int get_child_index(const Vector3i &u, int level) const {
     int ret = 0;
     for (int i = 0; i < 3; i++) {
       ret += ((u[i] >> (total_levels - level - 1)) & 1) << i;
@@ -82,238 +185,695 @@ class BarnesHutSummation {
     return ret;
   }
 
-  void summarize(int t) {
-    Node &node = nodes[t];
-    if (node.is_leaf()) {
-      Vector3i u = get_coord(node.p.position);
-      node.bounds[0] = u - Vector3i(margin);
-      node.bounds[1] = u + Vector3i(margin);
-      return;
+  uint64 get_code(const Vector3 &position) const {
+    Vector3i u = get_coord(position);
+    int max_coord = (1 << total_levels) - 1;
+    for (int i = 0; i < 3; i++) {
+      u[i] = std::min(u[i], max_coord);
     }
-    real mass = 0.0_f;
-    Vector3 total_position(0.0_f);
-    node.bounds[0] = Vector3i(std::numeric_limits<int>::max());
-    node.bounds[1] = Vector3i(std::numeric_limits<int>::min());
-    for (int c = 0; c < 8; c++) {
-      if (node.children[c]) {
-        summarize(nodes[t].children[c]);
-        const Node &ch = nodes[node.children[c]];
-        mass += ch.p.mass;
-        total_position += ch.p.mass * ch.p.position;
-        for (int i = 0; i < 3; i++) {
-          node.bounds[0][i] = std::min(node.bounds[0][i], ch.bounds[0][i]);
-          node.bounds[1][i] = std::max(node.bounds[1][i], ch.bounds[1][i]);
-        }
-      }
+    uint64 code = 0;
+    for (int k = 0; k < total_levels; k++) {
+      code = (code << 3) | (uint64)get_child_index(u, k);
     }
-    total_position *= Vector3(1.0_f / mass);
-    if (total_position.abnormal()) {
-      TC_P(mass);
-      for (int i = 0; i < 8; i++) {
-        TC_P(i);
-        TC_P(node.children[i]);
-        TC_P(nodes[node.children[i]].p.position);
-        TC_P(nodes[node.children[i]].p.mass);
+    return code;
+  }
+
+  int get_digit(uint64 code, int level) const {
+    return int(code >> (3 * (total_levels - level - 1))) & 7;
+  }
+
+  // Stable parallel LSD radix sort by code, 8 bits at a time
+  void radix_sort(std::vector<SortedParticle> &items) {
+    const int n = (int)items.size();
+    const int num_chunks = std::max(1, std::min(256, n / 4096));
+    const int chunk_size = (n + num_chunks - 1) / num_chunks;
+    std::vector<SortedParticle> buffer(n);
+    std::vector<int> offsets(256 * num_chunks);
+    for (int shift = 0; shift < 3 * total_levels; shift += 8) {
+      std::fill(offsets.begin(), offsets.end(), 0);
+      ThreadedTaskManager::run(num_chunks, num_threads, [&](int c) {
+        int end = std::min(n, (c + 1) * chunk_size);
+        for (int i = c * chunk_size; i < end; i++) {
+          offsets[(items[i].code >> shift & 255) * num_chunks + c]++;
+        }
+      });
+      // Exclusive scan, digit-major so that the sort is stable
+      int sum = 0;
+      for (auto &o : offsets) {
+        int count = o;
+        o = sum;
+        sum += count;
       }
+      ThreadedTaskManager::run(num_chunks, num_threads, [&](int c) {
+        int end = std::min(n, (c + 1) * chunk_size);
+        for (int i = c * chunk_size; i < end; i++) {
+          buffer[offsets[(items[i].code >> shift & 255) * num_chunks + c]++] =
+              items[i];
+        }
+      });
+      std::swap(items, buffer);
     }
-    CV(total_position);
-    node.p = Particle(total_position, mass);
   }
 
-  int create_child(int t, int child_index) {
-    return create_child(t, child_index, Particle(Vector3(0.0_f), 0.0_f));
+  // Upward pass, deepest level first
+  void summarize_levels() {
+    for (int level = (int)level_begin.size() - 2; level >= 0; level--) {
+      ThreadedTaskManager::run(
+          level_begin[level + 1] - level_begin[level], num_threads,
+          [&](int j) { summarize(level_begin[level] + j); });
+    }
   }
 
-  int create_child(int t, int child_index, const Particle &p) {
-    int nt = get_new_node();
-    nodes[t].children[child_index] = nt;
-    nodes[nt].p = p;
-    return nt;
-  }
+  // Monopole, quadrupole, radius and bounds of node |t| from its particles
+  // or children
+  void summarize(int t) {
+    Node &node = nodes[t];
+    real mass = 0.0_f;
+    Vector3 total_position(0.0_f);
+    for (int i = 0; i < 3; i++) {
+      node.bounds[0][i] = std::numeric_limits<int>::max();
+      node.bounds[1][i] = std::numeric_limits<int>::min();
+    }
+    auto add = [&](const Vector3 &position, real m, const int *lower,
+                   const int *upper) {
+      mass += m;
+      total_position += m * position;
+      for (int i = 0; i < 3; i++) {
+        node.bounds[0][i] = std::min(node.bounds[0][i], lower[i]);
+        node.bounds[1][i] = std::max(node.bounds[1][i], upper[i]);
+      }
+    };
+    int num_children = popcount(node.child_mask);
+    if (node.is_leaf()) {
+      for (int k = node.begin; k < node.end; k++) {
+        Vector3 position(bucket_x[k], bucket_y[k], bucket_z[k]);
+        Vector3i u = get_coord(position);
+        Vector3i lower = u - Vector3i(margin), upper = u + Vector3i(margin);
+        add(position, bucket_mass[k], &lower[0], &upper[0]);
+      }
+    } else {
+      for (int c = 0; c < num_children; c++) {
+        const Node &ch = nodes[node.first_child + c];
+        add(ch.get_particle().position, ch.mass, ch.bounds[0], ch.bounds[1]);
+      }
+    }
+    total_position *= Vector3(1.0_f / mass);
+    CV(total_position);
+    for (int i = 0; i < 3; i++) {
+      node.position[i] = total_position[i];
+    }
+    node.mass = mass;
 
-  int get_new_node() {
-    nodes[node_end] = Node();
-    return node_end++;
+    // Second moments about the center of mass, with the parallel axis
+    // theorem for children
+    Quadrupole &quadrupole = quadrupoles[t];
+    std::fill(quadrupole.q, quadrupole.q + 6, 0.0_f);
+    node.radius = 0.0_f;
+    auto add_moment = [&](const Vector3 &position, real m) {
+      Vector3 d = position - total_position;
+      for (int e = 0; e < 6; e++) {
+        quadrupole.q[e] +=
+            m * d[Quadrupole::index[e][0]] * d[Quadrupole::index[e][1]];
+      }
+      return length(d);
+    };
+    if (node.is_leaf()) {
+      for (int k = node.begin; k < node.end; k++) {
+        real r = add_moment(Vector3(bucket_x[k], bucket_y[k], bucket_z[k]),
+                            bucket_mass[k]);
+        node.radius = std::max(node.radius, r);
+      }
+    } else {
+      for (int c = 0; c < num_children; c++) {
+        int child = node.first_child + c;
+        const Node &ch = nodes[child];
+        real r = add_moment(ch.get_particle().position, ch.mass);
+        node.radius = std::max(node.radius, r + ch.radius);
+        for (int e = 0; e < 6; e++) {
+          quadrupole.q[e] += quadrupoles[child].q[e];
+        }
+      }
+    }
   }
 
  public:
-  // We do not evaluate the weighted average of position and mass on the fly
-  // for efficiency and accuracy
+  // Builds the octree of |particles| with cells of size |resolution| at the
+  // finest level, as a linear octree over the particles sorted by Morton
+  // code: the children of a node are the runs of its particles with the
+  // same next digit, found by binary search, and nodes of at most
+  // |bucket_size| particles are leaves. The tree is built top-down and
+  // summarized bottom-up one level at a time, in parallel within levels.
+  // Particles with zero mass are skipped.
   void initialize(real resolution,
                   real margin_real,
-                  const std::vector<Particle> &particles) {
+                  const std::vector<Particle> &particles,
+                  int num_threads = -1,
+                  int bucket_size = 8) {
     this->resolution = resolution;
     this->inv_resolution = 1.0_f / resolution;
     this->margin = (int)std::ceil(margin_real * inv_resolution);
+    this->num_threads = num_threads;
+    this->bucket_size = bucket_size;
     assert(particles.size() != 0);
-    Vector3 lower(1e30f);
-    Vector3 upper(-1e30f);
-    for (auto &p : particles) {
+    using Box = std::pair<Vector3, Vector3>;
+    auto merge = [](const Box &a, const Box &b) {
+      Box ret;
       for (int k = 0; k < 3; k++) {
-        lower[k] = std::min(lower[k], p.position[k]);
-        upper[k] = std::max(upper[k], p.position[k]);
+        ret.first[k] = std::min(a.first[k], b.first[k]);
+        ret.second[k] = std::max(a.second[k], b.second[k]);
       }
-      // TC_P(p.position);
-    }
+      return ret;
+    };
+    Box box = ThreadedTaskManager::reduce(
+        0, (int)particles.size(), num_threads,
+        Box(Vector3(1e30f), Vector3(-1e30f)),
+        [&](int begin, int end) {
+          Box ret(Vector3(1e30f), Vector3(-1e30f));
+          for (int i = begin; i < end; i++) {
+            ret = merge(ret, Box(particles[i].position, particles[i].position));
+          }
+          return ret;
+        },
+        merge);
+    Vector3 lower = box.first, upper = box.second;
     lower_corner = lower;
     int intervals = (int)std::ceil((upper - lower).max() / resolution);
     total_levels = 0;
     for (int i = 1; i < intervals; i *= 2, total_levels++)
       ;
-    // We do not use the 0th node...
-    node_end = 1;
-    nodes.clear();
-    nodes.resize(particles.size() * 2);
-    int root = get_new_node();
-    // Make sure that one leaf node contains only one particle.
-    // Unless particles are too close and thereby merged.
-    for (auto &p : particles) {
-      if (p.mass == 0) {
-        continue;
-      }
-      Vector3i u = get_coord(p.position);
-      int t = root;
-      if (nodes[t].is_leaf()) {
-        // First node
-        nodes[t].p = p;
-        continue;
-      }
-      // Traverse down until there's no way...
-      int k = 0;
-      TC_ERROR("cp maybe originally used without initialization");
-      int cp = -1;
-      for (; k < total_levels; k++) {
-        cp = get_child_index(u, k);
-        if (nodes[t].children[cp] != 0) {
-          t = nodes[t].children[cp];
-        } else {
-          break;
+    TC_ASSERT_INFO(total_levels <= 21,
+                   "Too many levels for 64-bit Morton codes; increase the "
+                   "resolution");
+
+    // The particles with mass, coded in place
+    std::vector<SortedParticle> sorted(particles.size());
+    int n = ThreadedTaskManager::compact(
+        0, (int)particles.size(), num_threads,
+        [&](int i) { return particles[i].mass != 0; },
+        [&](int i, int j) {
+          sorted[j] = SortedParticle{get_code(particles[i].position), i};
+        });
+    sorted.resize(n);
+    radix_sort(sorted);
+    codes.resize(n);
+    order.resize(n);
+    for (auto *v : {&bucket_x, &bucket_y, &bucket_z, &bucket_mass}) {
+      v->resize(n);
+    }
+    ThreadedTaskManager::run(n, num_threads, [&](int i) {
+      codes[i] = sorted[i].code;
+      order[i] = sorted[i].index;
+      const Particle &p = particles[sorted[i].index];
+      bucket_x[i] = p.position.x;
+      bucket_y[i] = p.position.y;
+      bucket_z[i] = p.position.z;
+      bucket_mass[i] = p.mass;
+    });
+
+    nodes.resize(1);
+    nodes[0].begin = 0;
+    nodes[0].end = n;
+    level_begin = {0, 1};
+    // child_begin[9 * j + c]: the first particle of child c of the j-th
+    // node of the level; child_begin[9 * j + 8] its end
+    std::vector<int> child_begin, num_children;
+    for (int level = 0;; level++) {
+      int first = level_begin[level], count = level_begin[level + 1] - first;
+      child_begin.resize(9 * count);
+      num_children.assign(count + 1, 0);
+      ThreadedTaskManager::run(count, num_threads, [&](int j) {
+        Node &node = nodes[first + j];
+        node.child_mask = 0;
+        node.first_child = 0;
+        if (node.end - node.begin <= bucket_size || level == total_levels) {
+          return;
         }
-      }
-      if (nodes[t].is_leaf()) {
-        // Leaf node, containing one particle q
-        // Split the node until p and q belong to different children.
-        Particle q = nodes[t].p;
-        nodes[t].p = Particle();
-        Vector3i v = get_coord(q.position);
-        int cq = get_child_index(v, k);
-        while (cp == cq && k < total_levels) {
-          t = create_child(t, cp);
-          k++;
-          cp = get_child_index(u, k);
-          cq = get_child_index(v, k);
+        int *bounds = &child_begin[9 * j];
+        bounds[0] = node.begin;
+        bounds[8] = node.end;
+        for (int c = 1; c < 8; c++) {
+          bounds[c] = (int)(std::partition_point(
+                                codes.begin() + bounds[c - 1],
+                                codes.begin() + node.end,
+                                [&](uint64 code) {
+                                  return get_digit(code, level) < c;
+                                }) -
+                            codes.begin());
         }
-        if (k == total_levels) {
-          // We have to merge two particles since they are too close...
-          q = p + q;
-          create_child(t, cp, q);
-        } else {
-          nodes[t].p = Particle();
-          create_child(t, cp, p);
-          create_child(t, cq, q);
+        for (int c = 0; c < 8; c++) {
+          if (bounds[c] < bounds[c + 1]) {
+            node.child_mask |= 1 << c;
+            num_children[j]++;
+          }
         }
-      } else {
-        // Non-leaf node, simply create a child.
-        create_child(t, cp, p);
+      });
+      // Children are allocated after the level, in the order of their
+      // parents
+      int next = (int)nodes.size() +
+                 ThreadedTaskManager::scan(
+                     0, count, num_threads, 0,
+                     [&](int j) { return num_children[j]; },
+                     [](int a, int b) { return a + b; },
+                     [&](int j, int prefix) {
+                       num_children[j] = (int)nodes.size() + prefix;
+                     });
+      if (next == (int)nodes.size()) {
+        break;
       }
-    }
-    TC_P(node_end);
-    summarize(root);
-  }
-
-  /*
-  template<typename T>
-  Vector3 summation(const Particle &p, const T &func) {
-      // TODO: fine level
-      // TODO: only one particle?
-      int t = 1;
-      Vector3 ret(0.0_f);
-      Vector3 u = get_coord(p.position);
-      for (int k = 0; k < total_levels; k++) {
-          int cp = get_child_index(u, k);
-          for (int c = 0; c < 8; c++) {
-              if (c != cp && nodes[t].children[c]) {
-                  const Node &n = nodes[nodes[t].children[c]];
-                  auto tmp = func(p, n.p);
-                  ret += tmp;
-              }
-          }
-          t = nodes[t].children[cp];
-          if (t == 0) {
-              break;
+      nodes.resize(next);
+      ThreadedTaskManager::run(count, num_threads, [&](int j) {
+        Node &node = nodes[first + j];
+        if (node.is_leaf()) {
+          return;
+        }
+        node.first_child = num_children[j];
+        int t = node.first_child;
+        for (int c = 0; c < 8; c++) {
+          if (node.child_mask >> c & 1) {
+            nodes[t].begin = child_begin[9 * j + c];
+            nodes[t].end = child_begin[9 * j + c + 1];
+            t++;
           }
-      }
-      return ret;
+        }
+      });
+      level_begin.push_back(next);
+    }
+    quadrupoles.resize(nodes.size());
+    summarize_levels();
   }
-  */
 
-  template <typename T>
-  Vector3 summation(int t, const Particle &p, const T &func) {
-    const Node &node = nodes[t];
-    if (nodes[t].is_leaf()) {
-      return func(p, node.p);
-    }
-    Vector3 ret(0.0_f);
+  // Updates the tree for new positions of the particles passed to
+  // initialize(), which keep their masses: the nodes keep their particles,
+  // and their moments, radii and bounds are recomputed. This is much
+  // cheaper than a rebuild, and exact, but nodes grow looser as particles
+  // move and traversals slow down.
+  void refit(const std::vector<Particle> &particles) {
+    ThreadedTaskManager::run((int)order.size(), num_threads, [&](int i) {
+      const Particle &p = particles[order[i]];
+      bucket_x[i] = p.position.x;
+      bucket_y[i] = p.position.y;
+      bucket_z[i] = p.position.z;
+    });
+    summarize_levels();
+  }
+
+  // Also opens in summation() the nodes with radius >= |opening_angle| times
+  // their distance, as multipole expansions need targets outside the radius
+  void set_opening_angle(real opening_angle) {
+    this->opening_angle = opening_angle;
+  }
+
+  // Indices of the particles in Morton order. Evaluating the sums in this
+  // order lets consecutive particles share traversal paths and cache
+  // lines.
+  const std::vector<int> &get_order() const {
+    return order;
+  }
+
+  // Sum of |far(p, q, quadrupole)| over the nodes far enough from |p|,
+  // where q holds their mass at their center of mass, and of
+  // |bucket(p, x, y, z, mass, count)| over the leaves that are not, where
+  // x, y, z and mass are the arrays of the |count| particles of the leaf.
+  // The traversal uses a small stack instead of recursion.
+  template <typename M, typename B>
+  Vector3 summation(const Particle &p, const M &far, const B &bucket) const {
     Vector3i u = get_coord(p.position);
-    for (int c = 0; c < 8; c++) {
-      if (node.children[c]) {
-        const Node &ch = nodes[node.children[c]];
-        if (ch.bounds[0][0] <= u[0] && u[0] <= ch.bounds[1][0] &&
-            ch.bounds[0][1] <= u[1] && u[1] <= ch.bounds[1][1] &&
-            ch.bounds[0][2] <= u[2] && u[2] <= ch.bounds[1][2]) {
-          ret += summation(node.children[c], p, func);
+    // At most 7 pending siblings per level
+    int stack[8 * 22];
+    int top = 0;
+    stack[top++] = 0;
+    Vector3 ret(0.0_f);
+    while (top > 0) {
+      const Node &node = nodes[stack[--top]];
+      if (node.is_leaf()) {
+        int k = node.begin;
+        ret += bucket(p, &bucket_x[k], &bucket_y[k], &bucket_z[k],
+                      &bucket_mass[k], node.end - k);
+        continue;
+      }
+      int num_children = popcount(node.child_mask);
+      for (int c = num_children - 1; c >= 0; c--) {
+        int t = node.first_child + c;
+        const Node &ch = nodes[t];
+        real distance = length(p.position - ch.get_particle().position);
+        if (ch.contains(u) ||
+            (opening_angle > 0 && ch.radius >= opening_angle * distance)) {
+          stack[top++] = t;
         } else {
           // Coarse summation
-          ret += func(p, ch.p);
+          ret += far(p, ch.get_particle(), quadrupoles[t]);
         }
       }
     }
     return ret;
   }
 
+  int get_num_nodes() const {
+    return (int)nodes.size();
+  }
+
   void print_tree(int t, int level) {
     for (int i = 0; i < level; i++) {
       printf("  ");
     }
-    const Particle &p = nodes[t].p;
-    printf("p (%f, %f, %f) m %f ", p.position.x, p.position.y, p.position.z,
-           p.mass);
-    printf("(%d, %d, %d) (%d, %d, %d)\n", nodes[t].bounds[0][0],
-           nodes[t].bounds[0][1], nodes[t].bounds[0][2], nodes[t].bounds[1][0],
-           nodes[t].bounds[1][1], nodes[t].bounds[1][2]);
-    for (int c = 0; c < 8; c++) {
-      if (nodes[t].children[c] != 0) {
-        print_tree(nodes[t].children[c], level + 1);
+    const Node &node = nodes[t];
+    printf("p (%f, %f, %f) m %f ", node.position[0], node.position[1],
+           node.position[2], node.mass);
+    printf("(%d, %d, %d) (%d, %d, %d)\n", node.bounds[0][0],
+           node.bounds[0][1], node.bounds[0][2], node.bounds[1][0],
+           node.bounds[1][1], node.bounds[1][2]);
+    int num_children = popcount(node.child_mask);
+    for (int c = 0; c < num_children; c++) {
+      print_tree(node.first_child + c, level + 1);
+    }
+  }
+};
+
+constexpr int BarnesHutSummation::Quadrupole::index[6][2];
+
+// The softened interaction of NBody: particle q exerts
+//   m_p m_q (p - q) / (|p - q|^2 + eps2)^(3/2)
+// on particle p, that is minus the gradient of the potential m_q / r with
+// r = (|p - q|^2 + eps2)^(1/2). The multipole expansions are those of this
+// potential, whose derivatives have the same form as those of 1 / |p - q|.
+struct SoftenedGravity {
+  using Quadrupole = BarnesHutSummation::Quadrupole;
+
+  real eps2;
+
+  SoftenedGravity(real eps2 = 1e-4_f) : eps2(eps2) {
+  }
+
+  // r^-3, r^-5 and r^-7 at the separation |d|
+  void get_radial_factors(const Vector3 &d, real &d1, real &d2,
+                          real &d3) const {
+    real inv = 1.0_f / (dot(d, d) + eps2);
+    d1 = inv * std::sqrt(inv);
+    d2 = d1 * inv;
+    d3 = d2 * inv;
+  }
+
+  // Field at p of a mass at q, with d = p - q
+  Vector3 monopole(const Vector3 &d, real mass) const {
+    real d1, d2, d3;
+    get_radial_factors(d, d1, d2, d3);
+    return d * Vector3(mass * d1);
+  }
+
+  // Same, for a mass with second moments |quadrupole| about q
+  Vector3 quadrupole(const Vector3 &d,
+                     real mass,
+                     const Quadrupole &quadrupole) const {
+    real d1, d2, d3;
+    get_radial_factors(d, d1, d2, d3);
+    const real *q = quadrupole.q;
+    Vector3 qd(q[0] * d.x + q[3] * d.y + q[4] * d.z,
+               q[3] * d.x + q[1] * d.y + q[5] * d.z,
+               q[4] * d.x + q[5] * d.y + q[2] * d.z);
+    real trace = q[0] + q[1] + q[2];
+    real radial = mass * d1 + 7.5_f * dot(d, qd) * d3 - 1.5_f * trace * d2;
+    return d * Vector3(radial) - qd * Vector3(3.0_f * d2);
+  }
+
+  // Field at |p| of the |count| particles with positions (x, y, z) and
+  // masses |mass|, over arrays so that it vectorizes
+  Vector3 direct(const Vector3 &p, const real *x, const real *y,
+                 const real *z, const real *mass, int count) const {
+    real fx = 0, fy = 0, fz = 0;
+    for (int k = 0; k < count; k++) {
+      real dx = p.x - x[k];
+      real dy = p.y - y[k];
+      real dz = p.z - z[k];
+      real dist2 = dx * dx + dy * dy + dz * dz + eps2;
+      real s = mass[k] / (dist2 * std::sqrt(dist2));
+      fx += dx * s;
+      fy += dy * s;
+      fz += dz * s;
+    }
+    return Vector3(fx, fy, fz);
+  }
+};
+
+// The fast multipole method on the octree of BarnesHutSummation, with
+// quadrupole sources and local expansions of the field to second order
+// (third order in the potential), and a dual-tree traversal: a pair of
+// nodes with (radius_a + radius_b) < opening_angle * (distance of their
+// centers of mass) interacts through one multipole-to-local translation,
+// otherwise the larger node is split, down to direct summation between
+// leaves. The cost is O(N) for a fixed opening angle, and the error falls
+// with it roughly as opening_angle^3.
+class FastMultipoleSummation : public BarnesHutSummation {
+ public:
+  // Adds the field of all particles at every particle to |field|, which is
+  // indexed as the particles passed to initialize(). Particles with zero
+  // mass have no entry in the tree and are left untouched.
+  void evaluate(const SoftenedGravity &kernel,
+                real opening_angle,
+                std::vector<Vector3> &field) {
+    this->kernel = kernel;
+    this->opening_angle = opening_angle;
+    int n = (int)order.size();
+    sorted_field.assign(n, Vector3(0.0_f));
+    locals.resize(nodes.size());
+    std::memset((void *)locals.data(), 0,
+                locals.size() * sizeof(LocalExpansion));
+    // Targets are split into subtrees that are traversed independently
+    // against the whole tree: the first level with enough nodes for the
+    // threads, and the leaves above it
+    int num_levels = (int)level_begin.size() - 1;
+    int level = 0;
+    while (level + 1 < num_levels &&
+           level_begin[level + 1] - level_begin[level] < 256) {
+      level++;
+    }
+    std::vector<int> targets;
+    for (int t = 0; t < level_begin[level + 1]; t++) {
+      if (t >= level_begin[level] || nodes[t].is_leaf()) {
+        targets.push_back(t);
       }
     }
+    ThreadedTaskManager::run((int)targets.size(), num_threads, [&](int i) {
+      interact(targets[i], 0);
+      evaluate_locals(targets[i]);
+    });
+    ThreadedTaskManager::run(n, num_threads, [&](int k) {
+      field[order[k]] += sorted_field[k];
+    });
+  }
+
+ protected:
+  // Taylor expansion of the field about the center of mass of a node:
+  // f(c + t)_i = f1_i + f2_ij t_j + f3_ijk t_j t_k / 2, with the symmetric
+  // tensors stored once per distinct component
+  struct LocalExpansion {
+    real f1[3], f2[6], f3[10];
+  };
+
+  SoftenedGravity kernel;
+  real opening_angle;
+  std::vector<LocalExpansion> locals;
+  // Per particle in Morton order
+  std::vector<Vector3> sorted_field;
+
+  static int sym2(int i, int j) {
+    static const int index[3][3] = {{0, 3, 4}, {3, 1, 5}, {4, 5, 2}};
+    return index[i][j];
+  }
+
+  static int sym3(int i, int j, int k) {
+    static const int index[3][3][3] = {
+        {{0, 1, 2}, {1, 3, 4}, {2, 4, 5}},
+        {{1, 3, 4}, {3, 6, 7}, {4, 7, 8}},
+        {{2, 4, 5}, {4, 7, 8}, {5, 8, 9}}};
+    return index[i][j][k];
+  }
+
+  // The distinct components of f3, in storage order
+  static constexpr int sym3_components[10][3] = {
+      {0, 0, 0}, {0, 0, 1}, {0, 0, 2}, {0, 1, 1}, {0, 1, 2},
+      {0, 2, 2}, {1, 1, 1}, {1, 1, 2}, {1, 2, 2}, {2, 2, 2}};
+
+  static Vector3 get_center(const Node &node) {
+    return Vector3(node.position[0], node.position[1], node.position[2]);
+  }
+
+  static Vector3 evaluate(const LocalExpansion &local, const Vector3 &t) {
+    Vector3 ret;
+    for (int i = 0; i < 3; i++) {
+      real f = local.f1[i];
+      for (int j = 0; j < 3; j++) {
+        f += local.f2[sym2(i, j)] * t[j];
+        for (int k = 0; k < 3; k++) {
+          f += 0.5_f * local.f3[sym3(i, j, k)] * t[j] * t[k];
+        }
+      }
+      ret[i] = f;
+    }
+    return ret;
+  }
+
+  // Multipole of |source| to the local expansion of |target|
+  void translate(int target, int source) {
+    const Node &b = nodes[source];
+    Vector3 d = get_center(nodes[target]) - get_center(b);
+    LocalExpansion &local = locals[target];
+    Vector3 f1 = kernel.quadrupole(d, b.mass, quadrupoles[source]);
+    real d1, d2, d3;
+    kernel.get_radial_factors(d, d1, d2, d3);
+    for (int i = 0; i < 3; i++) {
+      local.f1[i] += f1[i];
+    }
+    for (int e = 0; e < 6; e++) {
+      int i = Quadrupole::index[e][0], j = Quadrupole::index[e][1];
+      local.f2[e] -= b.mass * (3.0_f * d[i] * d[j] * d2 - (i == j) * d1);
+    }
+    for (int e = 0; e < 10; e++) {
+      int i = sym3_components[e][0], j = sym3_components[e][1],
+          k = sym3_components[e][2];
+      real delta = (i == j) * d[k] + (i == k) * d[j] + (j == k) * d[i];
+      local.f3[e] +=
+          b.mass * (15.0_f * d[i] * d[j] * d[k] * d3 - 3.0_f * delta * d2);
+    }
+  }
+
+  // Adds to the targets in the subtree of |target| the field of the
+  // particles of |source|
+  void interact(int target, int source) {
+    const Node &a = nodes[target], &b = nodes[source];
+    real distance = length(get_center(a) - get_center(b));
+    if (a.radius + b.radius < opening_angle * distance) {
+      translate(target, source);
+    } else if (a.is_leaf() && b.is_leaf()) {
+      for (int k = a.begin; k < a.end; k++) {
+        Vector3 p(bucket_x[k], bucket_y[k], bucket_z[k]);
+        int l = b.begin;
+        sorted_field[k] +=
+            kernel.direct(p, &bucket_x[l], &bucket_y[l], &bucket_z[l],
+                          &bucket_mass[l], b.end - l);
+      }
+    } else if (b.is_leaf() || (!a.is_leaf() && a.radius >= b.radius)) {
+      for (int c = 0; c < popcount(a.child_mask); c++) {
+        interact(a.first_child + c, source);
+      }
+    } else {
+      for (int c = 0; c < popcount(b.child_mask); c++) {
+        interact(target, b.first_child + c);
+      }
+    }
+  }
+
+  // Pushes the local expansion of |t| down to its particles
+  void evaluate_locals(int t) {
+    const Node &node = nodes[t];
+    const LocalExpansion &local = locals[t];
+    if (node.is_leaf()) {
+      for (int k = node.begin; k < node.end; k++) {
+        Vector3 p(bucket_x[k], bucket_y[k], bucket_z[k]);
+        sorted_field[k] += evaluate(local, p - get_center(node));
+      }
+      return;
+    }
+    for (int c = 0; c < popcount(node.child_mask); c++) {
+      int child = node.first_child + c;
+      LocalExpansion &shifted = locals[child];
+      Vector3 d = get_center(nodes[child]) - get_center(node);
+      Vector3 f1 = evaluate(local, d);
+      for (int i = 0; i < 3; i++) {
+        shifted.f1[i] += f1[i];
+      }
+      for (int e = 0; e < 6; e++) {
+        int i = Quadrupole::index[e][0], j = Quadrupole::index[e][1];
+        real f = local.f2[e];
+        for (int k = 0; k < 3; k++) {
+          f += local.f3[sym3(i, j, k)] * d[k];
+        }
+        shifted.f2[e] += f;
+      }
+      for (int e = 0; e < 10; e++) {
+        shifted.f3[e] += local.f3[e];
+      }
+      evaluate_locals(child);
+    }
   }
 };
 
+constexpr int FastMultipoleSummation::sym3_components[10][3];
+
 class NBody : public Simulation3D {
   struct Particle {
     Vector3 position, velocity, color;
+    Vector3 acceleration;
+    // Substeps of delta_t / 2^level
+    int level;
+
+    TC_IO_DEF(position, velocity, color, acceleration, level);
+
+    Particle() {
+    }
 
     Particle(const Vector3 &position,
              const Vector3 &velocity,
              const Vector3 &color)
-        : position(position), velocity(velocity), color(color) {
+        : position(position),
+          velocity(velocity),
+          color(color),
+          acceleration(0.0_f),
+          level(0) {
     }
   };
 
  protected:
+  using Base = Simulation3D;
+  using BHP = BarnesHutSummation::Particle;
+
   real gravitation;
   std::shared_ptr<Texture> velocity_field;
   std::vector<Particle> particles;
-  BarnesHutSummation bhs;
+  // For Barnes-Hut summation, and the FMM of NBodyFMM
+  FastMultipoleSummation tree;
+  // Positions as seen by the tree
+  std::vector<BHP> bhps;
+  // Positions of the last rebuild of the tree
+  std::vector<Vector3> build_positions;
+  // The tree is refit until a particle moves this far from its position at
+  // the last rebuild
+  real rebuild_distance;
   real delta_t;
+  // Particles per leaf of the octree
+  int bucket_size;
+  // Whether Barnes-Hut adds the quadrupole moments of far nodes
+  bool use_quadrupoles;
+  // Nodes are also opened when their radius is at least this fraction of
+  // their distance; smaller is more accurate and slower
+  real opening_angle;
+  SoftenedGravity kernel;
+  // Block time steps: particles take substeps of delta_t / 2^level, with
+  // the level from the time step criterion
+  //   time_step_accuracy * (softening length / |acceleration|)^(1/2)
+  // clamped to [0, max_time_step_level]
+  int max_time_step_level;
+  real time_step_accuracy;
+  bool accelerations_valid;
 
  public:
+  // The tree is rebuilt after a restart
+  TC_IO_DEF_WITH_BASE(particles, accelerations_valid);
+
   virtual void initialize(const Config &config) override {
     Simulation3D::initialize(config);
     int num_particles = config.get<int>("num_particles");
     particles.reserve(num_particles);
     gravitation = config.get<real>("gravitation");
     delta_t = config.get<real>("delta_t");
+    bucket_size = config.get("bucket_size", 8);
+    use_quadrupoles = config.get("quadrupole", false);
+    opening_angle = config.get("opening_angle", 0.0_f);
+    rebuild_distance = config.get("rebuild_distance", 1e-3_f);
+    max_time_step_level = config.get("max_time_step_level", 0);
+    time_step_accuracy = config.get("time_step_accuracy", 0.1_f);
+    TC_ASSERT_INFO(0 <= max_time_step_level && max_time_step_level <= 20,
+                   "max_time_step_level should be in [0, 20]");
+    accelerations_valid = false;
     real vel_scale = config.get<real>("vel_scale");
     for (int i = 0; i < num_particles; i++) {
       Vector3 p(rand(), rand(), rand());
@@ -334,59 +894,144 @@ class NBody : public Simulation3D {
     return render_particles;
   }
 
-  void substep(real dt) {
-    using BHP = BarnesHutSummation::Particle;
-    std::vector<BHP> bhps;
-    bhps.reserve(particles.size());
-    for (auto &p : particles) {
-      bhps.push_back(BHP(p.position, 1.0_f));
+  // Rebuilds the tree on the current positions, or only refits it if no
+  // particle moved more than rebuild_distance since the last rebuild
+  void update_tree() {
+    int n = (int)particles.size();
+    bhps.resize(n);
+    ThreadedTaskManager::run(n, num_threads, [&](int i) {
+      bhps[i] = BHP(particles[i].position, 1.0_f);
+    });
+    bool rebuild = (int)build_positions.size() != n;
+    real max_distance2 = rebuild_distance * rebuild_distance;
+    for (int i = 0; i < n && !rebuild; i++) {
+      rebuild = length2(particles[i].position - build_positions[i]) >
+                max_distance2;
     }
+    if (rebuild) {
+      tree.initialize(1e-4_f, 1e-3_f, bhps, num_threads, bucket_size);
+      build_positions.resize(n);
+      for (int i = 0; i < n; i++) {
+        build_positions[i] = particles[i].position;
+      }
+    } else {
+      tree.refit(bhps);
+    }
+    // tree.print_tree(0, 0);
+  }
 
-    bhs.initialize(1e-4_f, 1e-3_f, bhps);
-    // bhs.print_tree(1, 0);
-
-    auto f = [](const BHP &p, const BHP &q) {
+  // Sets |forces[i]| to the force on particle i from all the others for
+  // the particles i of |targets|, given in Morton order
+  virtual void compute_forces(const std::vector<int> &targets,
+                              std::vector<Vector3> &forces) {
+    tree.set_opening_angle(opening_angle);
+    auto f = [&](const BHP &p, const BHP &q,
+                 const BarnesHutSummation::Quadrupole &quadrupole) {
       CV(p.position);
       CV(q.position);
       Vector3 d = p.position - q.position;
-      real dist2 = dot(d, d);
-      dist2 += 1e-4_f;
-      CV(d);
-      d *= Vector3(p.mass * q.mass / (dist2 * std::sqrt(dist2)));
-      CV(p.mass);
-      CV(q.mass);
-      CV(dist2);
+      if (use_quadrupoles) {
+        d = kernel.quadrupole(d, q.mass, quadrupole);
+      } else {
+        d = kernel.monopole(d, q.mass);
+      }
       CV(d);
-      return d;
+      return d * Vector3(p.mass);
     };
-    if (gravitation != 0) {
-      // real max_err = -1;
-      ThreadedTaskManager::run((int)particles.size(), num_threads, [&](int i) {
-        auto &p = particles[i];
-        /*
-        Vector3 total_f(0.0_f);
-        for (int j = 0; j < (int)particles.size(); j++) {
-            auto &q = particles[j];
-            total_f += f(BHP(p.position, 1.0_f), BHP(q.position, 1.0_f));
-        }
+    auto bucket = [&](const BHP &p, const real *x, const real *y,
+                      const real *z, const real *mass, int count) {
+      return kernel.direct(p.position, x, y, z, mass, count) *
+             Vector3(p.mass);
+    };
+    // In Morton order, so that consecutive particles of a thread walk
+    // mostly the same nodes
+    ThreadedTaskManager::run((int)targets.size(), num_threads, [&](int t) {
+      int i = targets[t];
+      forces[i] = tree.summation(bhps[i], f, bucket);
+      CV(forces[i]);
+    });
+  }
 
-        auto err = length(total_f_bhs - total_f) / length(total_f);
-        max_err = std::max(err, max_err);
-
-        TC_P(total_f);
-        TC_P(total_f_bhs);
-        TC_P(err);
-        */
-        Vector3 total_f_bhs = bhs.summation(1, BHP(p.position, 1.0_f), f);
-        CV(total_f_bhs);
-        particles[i].velocity += total_f_bhs * gravitation * dt;
-        CV(particles[i].velocity);
-        CV(total_f_bhs);
+  int get_time_step_level(const Vector3 &acceleration, real dt) const {
+    real a = length(acceleration);
+    if (a == 0) {
+      return 0;
+    }
+    real h = time_step_accuracy * std::sqrt(std::sqrt(kernel.eps2) / a);
+    int level = 0;
+    while (level < max_time_step_level && dt > h) {
+      dt *= 0.5_f;
+      level++;
+    }
+    return level;
+  }
+
+  // New accelerations for the particles of |targets|, in Morton order
+  void update_accelerations(const std::vector<int> &targets) {
+    TC_STAT("nbody_force_evaluations", targets.size());
+    std::vector<Vector3> forces(particles.size());
+    compute_forces(targets, forces);
+    ThreadedTaskManager::run((int)targets.size(), num_threads, [&](int t) {
+      int i = targets[t];
+      particles[i].acceleration = forces[i] * gravitation;
+    });
+  }
+
+  // Kick-drift-kick leapfrog with block time steps: the step is split into
+  // 2^max_time_step_level ticks; each particle is kicked by half of its
+  // own substep when its substep begins and ends, and every particle is
+  // drifted every tick, so that forces are always evaluated on positions
+  // at the same time. Only particles whose substep ends get new forces.
+  void substep(real dt) {
+    int n = (int)particles.size();
+    if (gravitation == 0) {
+      ThreadedTaskManager::run(n, num_threads, [&](int i) {
+        particles[i].position += dt * particles[i].velocity;
       });
-      // TC_P(max_err);
+      current_t += dt;
+      return;
     }
-    for (auto &p : particles) {
-      p.position += dt * p.velocity;
+    int num_ticks = 1 << max_time_step_level;
+    real tick = dt / num_ticks;
+    if (!accelerations_valid) {
+      update_tree();
+      update_accelerations(tree.get_order());
+      accelerations_valid = true;
+    }
+    // A particle may change level where its new substep is aligned with
+    // the ticks
+    ThreadedTaskManager::run(n, num_threads, [&](int i) {
+      particles[i].level = get_time_step_level(particles[i].acceleration, dt);
+    });
+    std::vector<int> targets;
+    for (int s = 0; s < num_ticks; s++) {
+      ThreadedTaskManager::run(n, num_threads, [&](int i) {
+        auto &p = particles[i];
+        int stride = num_ticks >> p.level;
+        if (s % stride == 0) {
+          p.velocity += p.acceleration * (0.5_f * stride * tick);
+        }
+        p.position += tick * p.velocity;
+      });
+      update_tree();
+      targets.clear();
+      for (int i : tree.get_order()) {
+        if ((s + 1) % (num_ticks >> particles[i].level) == 0) {
+          targets.push_back(i);
+        }
+      }
+      update_accelerations(targets);
+      ThreadedTaskManager::run((int)targets.size(), num_threads, [&](int t) {
+        auto &p = particles[targets[t]];
+        int stride = num_ticks >> p.level;
+        p.velocity += p.acceleration * (0.5_f * stride * tick);
+        // Smaller substeps always align; larger ones only where the tick
+        // count is a multiple of theirs
+        int level = get_time_step_level(p.acceleration, dt);
+        if (level > p.level || (s + 1) % (num_ticks >> level) == 0) {
+          p.level = level;
+        }
+      });
     }
     current_t += dt;
   }
@@ -397,8 +1042,42 @@ class NBody : public Simulation3D {
       substep(dt / steps);
     }
   }
+
+  void load_checkpoint(const std::string &fn) override {
+    Simulation3D::load_checkpoint(fn);
+    build_positions.clear();
+  }
 };
 
 TC_IMPLEMENTATION(Simulation3D, NBody, "nbody");
 
+// NBody with the forces of the fast multipole method
+class NBodyFMM : public NBody {
+ public:
+  virtual void initialize(const Config &config) override {
+    NBody::initialize(config);
+    opening_angle = config.get("opening_angle", 0.5_f);
+    TC_ASSERT_INFO(0 < opening_angle && opening_angle < 1,
+                   "opening_angle should be in (0, 1)");
+  }
+
+  void compute_forces(const std::vector<int> &targets,
+                      std::vector<Vector3> &forces) override {
+    // The FMM evaluates every particle at once
+    field.assign(bhps.size(), Vector3(0.0_f));
+    tree.evaluate(kernel, opening_angle, field);
+    // The field is the force on a unit mass
+    ThreadedTaskManager::run((int)targets.size(), num_threads, [&](int t) {
+      int i = targets[t];
+      forces[i] = field[i] * Vector3(bhps[i].mass);
+    });
+  }
+
+ private:
+  // Kept over substeps, as bhps
+  std::vector<Vector3> field;
+};
+
+TC_IMPLEMENTATION(Simulation3D, NBodyFMM, "nbody_fmm");
+
 TC_NAMESPACE_END
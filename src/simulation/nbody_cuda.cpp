@@ -0,0 +1,99 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#include <taichi/dynamics/simulation.h>
+
+#if defined(TC_USE_CUDA)
+
+#include <taichi/system/statistics.h>
+#include "nbody_cuda.h"
+
+TC_NAMESPACE_BEGIN
+
+// NBody on the GPU, with the particles kept on the device: the same
+// initial conditions, softening and kick-drift-kick leapfrog, in float32
+// and with a single time step. Positions are copied back only for
+// get_render_particles(); once the view has been requested, the copy for
+// the next frame is queued at the end of every step, and overlaps with the
+// work queued after it.
+class NBodyCUDA : public Simulation3D {
+ protected:
+  int num_particles;
+  real gravitation;
+  real delta_t;
+  // 0 for direct summation, as "nbody"
+  real opening_angle;
+  Vector3 color;
+  // Waiting for a copy of the positions changes its state
+  mutable CUDANBody device;
+  bool stream_positions;
+
+ public:
+  virtual void initialize(const Config &config) override {
+    Simulation3D::initialize(config);
+    num_particles = config.get<int>("num_particles");
+    gravitation = config.get<real>("gravitation");
+    delta_t = config.get<real>("delta_t");
+    opening_angle = config.get("opening_angle", 0.0_f);
+    int bucket_size = config.get("bucket_size", 8);
+    if (config.get("quadrupole", false) ||
+        config.get("max_time_step_level", 0) != 0) {
+      TC_WARN("nbody_cuda has neither quadrupoles nor block time steps");
+    }
+    real vel_scale = config.get<real>("vel_scale");
+    std::vector<float32> positions, velocities;
+    positions.reserve(3 * num_particles);
+    velocities.reserve(3 * num_particles);
+    for (int i = 0; i < num_particles; i++) {
+      Vector3 p(rand(), rand(), rand());
+      Vector3 v = Vector3(p.y, p.z, p.x) - Vector3(0.5_f);
+      v *= Vector3(vel_scale);
+      for (int k = 0; k < 3; k++) {
+        positions.push_back((float32)p[k]);
+        velocities.push_back((float32)v[k]);
+      }
+    }
+    color = Vector3(0.5_f, 0.7_f, 0.4_f);
+    // The softening of SoftenedGravity
+    device.initialize(num_particles, positions.data(), velocities.data(),
+                      1e-4f, bucket_size);
+    stream_positions = false;
+  }
+
+  virtual void step(real dt) override {
+    int steps = (int)std::ceil(dt / delta_t);
+    for (int i = 0; i < steps; i++) {
+      device.step((float32)(dt / steps), (float32)gravitation,
+                  (float32)opening_angle);
+    }
+    TC_STAT("nbody_force_evaluations", (int64)steps * num_particles);
+    current_t += dt;
+    if (stream_positions) {
+      device.request_positions();
+    }
+  }
+
+  std::vector<RenderParticle> get_render_particles() const override {
+    const float32 *positions = device.get_positions();
+    std::vector<RenderParticle> render_particles;
+    render_particles.reserve(num_particles);
+    for (int i = 0; i < num_particles; i++) {
+      Vector3 p(positions[4 * i], positions[4 * i + 1], positions[4 * i + 2]);
+      render_particles.push_back(RenderParticle(p - Vector3(0.5_f), color));
+    }
+    return render_particles;
+  }
+
+  const std::vector<RenderParticle> &get_render_particles_view() override {
+    stream_positions = true;
+    return Simulation3D::get_render_particles_view();
+  }
+};
+
+TC_IMPLEMENTATION(Simulation3D, NBodyCUDA, "nbody_cuda");
+
+TC_NAMESPACE_END
+
+#endif
@@ -0,0 +1,552 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+// The forces of NBody on the device. The tree is rebuilt for every force
+// evaluation, without synchronizing with the host: the bounds of the
+// particles and their 30-bit Morton codes are computed on the device and
+// sorted with thrust, and the binary radix tree over the sorted codes
+// (Karras, "Maximizing parallelism in the construction of BVHs, octrees,
+// and k-d trees", 2012) is summarized bottom-up, the second child to
+// finish computing the center of mass and bounds of its parent. Internal
+// node i covers a contiguous range of sorted particles, so that near
+// fields are summed directly over consecutive memory.
+
+#include "nbody_cuda.h"
+#include <taichi_gpu/math/util.cuh>
+#include <cuda_runtime.h>
+#include <thrust/device_ptr.h>
+#include <thrust/sort.h>
+#include <thrust/system/cuda/execution_policy.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+namespace taichi {
+
+namespace {
+
+constexpr int particle_threads = 256;
+// The bounds are reduced by a single block
+constexpr int bounds_threads = 1024;
+constexpr int max_depth = 64;
+
+int particle_blocks(int n) {
+  return (n + particle_threads - 1) / particle_threads;
+}
+
+__device__ __forceinline__ int get_index() {
+  return blockIdx.x * blockDim.x + threadIdx.x;
+}
+
+// Field at p of a unit-softened mass at q, added to |a|, as
+// SoftenedGravity::monopole
+__device__ __forceinline__ void add_monopole(float4 p,
+                                             float4 q,
+                                             float eps2,
+                                             float3 &a) {
+  float dx = p.x - q.x, dy = p.y - q.y, dz = p.z - q.z;
+  float inv = 1.0f / (dx * dx + dy * dy + dz * dz + eps2);
+  float s = q.w * inv * sqrtf(inv);
+  a.x += dx * s;
+  a.y += dy * s;
+  a.z += dz * s;
+}
+
+__global__ void bounds_kernel(const float4 *positions, int n, float *bounds) {
+  __shared__ float lower[3][bounds_threads], upper[3][bounds_threads];
+  float lo[3] = {1e30f, 1e30f, 1e30f}, hi[3] = {-1e30f, -1e30f, -1e30f};
+  for (int i = threadIdx.x; i < n; i += blockDim.x) {
+    float4 p = positions[i];
+    float x[3] = {p.x, p.y, p.z};
+    for (int k = 0; k < 3; k++) {
+      lo[k] = fminf(lo[k], x[k]);
+      hi[k] = fmaxf(hi[k], x[k]);
+    }
+  }
+  for (int k = 0; k < 3; k++) {
+    lower[k][threadIdx.x] = lo[k];
+    upper[k][threadIdx.x] = hi[k];
+  }
+  __syncthreads();
+  for (int s = blockDim.x / 2; s > 0; s /= 2) {
+    if (threadIdx.x < s) {
+      for (int k = 0; k < 3; k++) {
+        lower[k][threadIdx.x] =
+            fminf(lower[k][threadIdx.x], lower[k][threadIdx.x + s]);
+        upper[k][threadIdx.x] =
+            fmaxf(upper[k][threadIdx.x], upper[k][threadIdx.x + s]);
+      }
+    }
+    __syncthreads();
+  }
+  if (threadIdx.x == 0) {
+    for (int k = 0; k < 3; k++) {
+      bounds[k] = lower[k][0];
+      bounds[3 + k] = upper[k][0];
+    }
+  }
+}
+
+// Spreads the 10 low bits of |v| to every third bit
+__device__ __forceinline__ unsigned expand_bits(unsigned v) {
+  v = (v * 0x00010001u) & 0xFF0000FFu;
+  v = (v * 0x00000101u) & 0x0F00F00Fu;
+  v = (v * 0x00000011u) & 0xC30C30C3u;
+  v = (v * 0x00000005u) & 0x49249249u;
+  return v;
+}
+
+// In the cube of the largest extent of the bounds, so that the tree is
+// an octree
+__global__ void morton_kernel(const float4 *positions,
+                              int n,
+                              const float *bounds,
+                              unsigned *codes,
+                              int *order) {
+  int i = get_index();
+  if (i >= n) {
+    return;
+  }
+  float extent = fmaxf(fmaxf(bounds[3] - bounds[0], bounds[4] - bounds[1]),
+                       fmaxf(bounds[5] - bounds[2], 1e-20f));
+  float4 p = positions[i];
+  float x[3] = {p.x, p.y, p.z};
+  unsigned code = 0;
+  for (int k = 0; k < 3; k++) {
+    float c = (x[k] - bounds[k]) / extent * 1024.0f;
+    unsigned cell = (unsigned)fminf(fmaxf(c, 0.0f), 1023.0f);
+    code |= expand_bits(cell) << (2 - k);
+  }
+  codes[i] = code;
+  order[i] = i;
+}
+
+__global__ void gather_kernel(const float4 *positions,
+                              const int *order,
+                              int n,
+                              float4 *sorted) {
+  int t = get_index();
+  if (t < n) {
+    sorted[t] = positions[order[t]];
+  }
+}
+
+// Length of the common prefix of the keys of sorted particles i and j,
+// with ties between equal codes broken by the indices
+__device__ __forceinline__ int delta(const unsigned *codes,
+                                     int n,
+                                     int i,
+                                     int j) {
+  if (j < 0 || j >= n) {
+    return -1;
+  }
+  unsigned a = codes[i], b = codes[j];
+  if (a == b) {
+    return 32 + __clz((unsigned)(i ^ j));
+  }
+  return __clz(a ^ b);
+}
+
+__global__ void build_kernel(const unsigned *codes,
+                             int n,
+                             int *children,
+                             int *parents,
+                             int *leaf_parents,
+                             int *ranges) {
+  int i = get_index();
+  if (i >= n - 1) {
+    return;
+  }
+  // Direction of the range of node i, and its other end j
+  int d = delta(codes, n, i, i + 1) > delta(codes, n, i, i - 1) ? 1 : -1;
+  int delta_min = delta(codes, n, i, i - d);
+  int length_max = 2;
+  while (delta(codes, n, i, i + length_max * d) > delta_min) {
+    length_max *= 2;
+  }
+  int length = 0;
+  for (int t = length_max / 2; t >= 1; t /= 2) {
+    if (delta(codes, n, i, i + (length + t) * d) > delta_min) {
+      length += t;
+    }
+  }
+  int j = i + length * d;
+  // The split, where the prefix of the range ends
+  int delta_node = delta(codes, n, i, j);
+  int s = 0;
+  for (int divisor = 2;; divisor *= 2) {
+    int t = (length + divisor - 1) / divisor;
+    if (delta(codes, n, i, i + (s + t) * d) > delta_node) {
+      s += t;
+    }
+    if (t <= 1) {
+      break;
+    }
+  }
+  int split = i + s * d + min(d, 0);
+  int first = min(i, j), last = max(i, j);
+  int left = first == split ? ~split : split;
+  int right = last == split + 1 ? ~(split + 1) : split + 1;
+  children[2 * i] = left;
+  children[2 * i + 1] = right;
+  ranges[2 * i] = first;
+  ranges[2 * i + 1] = last;
+  int node_children[2] = {left, right};
+  for (int c = 0; c < 2; c++) {
+    if (node_children[c] < 0) {
+      leaf_parents[~node_children[c]] = i;
+    } else {
+      parents[node_children[c]] = i;
+    }
+  }
+  if (i == 0) {
+    parents[0] = -1;
+  }
+}
+
+__global__ void summarize_kernel(const float4 *sorted,
+                                 int n,
+                                 const int *children,
+                                 const int *parents,
+                                 const int *leaf_parents,
+                                 int *arrivals,
+                                 float4 *centers,
+                                 float *node_bounds) {
+  int leaf = get_index();
+  if (leaf >= n) {
+    return;
+  }
+  // Written by other threads, so not read through the cache
+  volatile float4 *volatile_centers = centers;
+  volatile float *volatile_bounds = node_bounds;
+  int node = leaf_parents[leaf];
+  while (node != -1) {
+    // The writes of this thread are visible before its arrival
+    __threadfence();
+    if (atomicAdd(&arrivals[node], 1) == 0) {
+      return;
+    }
+    float mass = 0, x = 0, y = 0, z = 0;
+    float lo[3] = {1e30f, 1e30f, 1e30f}, hi[3] = {-1e30f, -1e30f, -1e30f};
+    for (int c = 0; c < 2; c++) {
+      int child = children[2 * node + c];
+      float4 q;
+      float child_lo[3], child_hi[3];
+      if (child < 0) {
+        q = sorted[~child];
+        child_lo[0] = child_hi[0] = q.x;
+        child_lo[1] = child_hi[1] = q.y;
+        child_lo[2] = child_hi[2] = q.z;
+      } else {
+        q.x = volatile_centers[child].x;
+        q.y = volatile_centers[child].y;
+        q.z = volatile_centers[child].z;
+        q.w = volatile_centers[child].w;
+        for (int k = 0; k < 3; k++) {
+          child_lo[k] = volatile_bounds[6 * child + k];
+          child_hi[k] = volatile_bounds[6 * child + 3 + k];
+        }
+      }
+      mass += q.w;
+      x += q.w * q.x;
+      y += q.w * q.y;
+      z += q.w * q.z;
+      for (int k = 0; k < 3; k++) {
+        lo[k] = fminf(lo[k], child_lo[k]);
+        hi[k] = fmaxf(hi[k], child_hi[k]);
+      }
+    }
+    float inv_mass = mass > 0 ? 1.0f / mass : 0.0f;
+    centers[node] = make_float4(x * inv_mass, y * inv_mass, z * inv_mass, mass);
+    for (int k = 0; k < 3; k++) {
+      node_bounds[6 * node + k] = lo[k];
+      node_bounds[6 * node + 3 + k] = hi[k];
+    }
+    node = parents[node];
+  }
+}
+
+// Barnes-Hut, as BarnesHutSummation::summation with monopoles: a node is
+// accepted when its extent is below opening_angle times the distance to
+// its center of mass. Consecutive threads take consecutive sorted
+// particles, which walk mostly the same nodes.
+__global__ void tree_force_kernel(const float4 *sorted,
+                                  const int *order,
+                                  int n,
+                                  const int *children,
+                                  const int *ranges,
+                                  const float4 *centers,
+                                  const float *node_bounds,
+                                  int bucket_size,
+                                  float opening_angle2,
+                                  float eps2,
+                                  float gravitation,
+                                  float4 *accelerations) {
+  int t = get_index();
+  if (t >= n) {
+    return;
+  }
+  float4 p = sorted[t];
+  float3 a = make_float3(0, 0, 0);
+  int stack[max_depth];
+  int stack_size = 0;
+  stack[stack_size++] = n > 1 ? 0 : ~0;
+  while (stack_size > 0) {
+    int node = stack[--stack_size];
+    int first, last;
+    if (node < 0) {
+      first = last = ~node;
+    } else {
+      first = ranges[2 * node];
+      last = ranges[2 * node + 1];
+      if (last - first + 1 > bucket_size) {
+        float4 c = centers[node];
+        float dx = p.x - c.x, dy = p.y - c.y, dz = p.z - c.z;
+        const float *b = node_bounds + 6 * node;
+        float extent = fmaxf(fmaxf(b[3] - b[0], b[4] - b[1]), b[5] - b[2]);
+        if (extent * extent < opening_angle2 * (dx * dx + dy * dy + dz * dz)) {
+          add_monopole(p, c, eps2, a);
+        } else {
+          stack[stack_size++] = children[2 * node + 1];
+          stack[stack_size++] = children[2 * node];
+        }
+        continue;
+      }
+    }
+    // Near field
+    for (int k = first; k <= last; k++) {
+      add_monopole(p, sorted[k], eps2, a);
+    }
+  }
+  accelerations[order[t]] = make_float4(gravitation * p.w * a.x,
+                                        gravitation * p.w * a.y,
+                                        gravitation * p.w * a.z, 0);
+}
+
+// All pairs, through tiles of particles staged in shared memory
+__global__ void direct_force_kernel(const float4 *positions,
+                                    int n,
+                                    float eps2,
+                                    float gravitation,
+                                    float4 *accelerations) {
+  __shared__ float4 tile[particle_threads];
+  int i = get_index();
+  float4 p = i < n ? positions[i] : make_float4(0, 0, 0, 0);
+  float3 a = make_float3(0, 0, 0);
+  for (int begin = 0; begin < n; begin += particle_threads) {
+    int j = begin + threadIdx.x;
+    // Massless padding contributes nothing
+    tile[threadIdx.x] = j < n ? positions[j] : make_float4(0, 0, 0, 0);
+    __syncthreads();
+    for (int k = 0; k < particle_threads; k++) {
+      add_monopole(p, tile[k], eps2, a);
+    }
+    __syncthreads();
+  }
+  if (i < n) {
+    accelerations[i] = make_float4(gravitation * p.w * a.x,
+                                   gravitation * p.w * a.y,
+                                   gravitation * p.w * a.z, 0);
+  }
+}
+
+__global__ void kick_kernel(float4 *velocities,
+                            const float4 *accelerations,
+                            int n,
+                            float h) {
+  int i = get_index();
+  if (i < n) {
+    float4 a = accelerations[i];
+    velocities[i].x += a.x * h;
+    velocities[i].y += a.y * h;
+    velocities[i].z += a.z * h;
+  }
+}
+
+__global__ void drift_kernel(float4 *positions,
+                             const float4 *velocities,
+                             int n,
+                             float dt) {
+  int i = get_index();
+  if (i < n) {
+    float4 v = velocities[i];
+    positions[i].x += v.x * dt;
+    positions[i].y += v.y * dt;
+    positions[i].z += v.z * dt;
+  }
+}
+
+template <typename T>
+T *device_alloc(int size) {
+  T *ptr = nullptr;
+  cudaMalloc(&ptr, sizeof(T) * size);
+  TC_CHECK_CUDA_ERROR
+  return ptr;
+}
+
+std::vector<float> to_float4(int n, const float *v, float w) {
+  std::vector<float> out(4 * n);
+  for (int i = 0; i < n; i++) {
+    for (int k = 0; k < 3; k++) {
+      out[4 * i + k] = v[3 * i + k];
+    }
+    out[4 * i + 3] = w;
+  }
+  return out;
+}
+
+}  // namespace
+
+#define TC_STREAM(s) (static_cast<cudaStream_t>(s))
+#define TC_EVENT(e) (static_cast<cudaEvent_t>(e))
+
+void CUDANBody::initialize(int n,
+                           const float *positions,
+                           const float *velocities,
+                           float eps2,
+                           int bucket_size) {
+  this->n = n;
+  this->eps2 = eps2;
+  this->bucket_size = bucket_size;
+  this->positions = device_alloc<float>(4 * n);
+  this->velocities = device_alloc<float>(4 * n);
+  accelerations = device_alloc<float>(4 * n);
+  auto p = to_float4(n, positions, 1.0f);
+  auto v = to_float4(n, velocities, 0.0f);
+  cudaMemcpy(this->positions, p.data(), sizeof(float) * 4 * n,
+             cudaMemcpyHostToDevice);
+  cudaMemcpy(this->velocities, v.data(), sizeof(float) * 4 * n,
+             cudaMemcpyHostToDevice);
+  codes = device_alloc<unsigned>(n);
+  order = device_alloc<int>(n);
+  sorted = device_alloc<float>(4 * n);
+  bounds = device_alloc<float>(6);
+  int internal = std::max(n - 1, 1);
+  children = device_alloc<int>(2 * internal);
+  parents = device_alloc<int>(internal);
+  leaf_parents = device_alloc<int>(n);
+  ranges = device_alloc<int>(2 * internal);
+  arrivals = device_alloc<int>(internal);
+  centers = device_alloc<float>(4 * internal);
+  node_bounds = device_alloc<float>(6 * internal);
+  staging = device_alloc<float>(4 * n);
+  cudaMallocHost(&host_positions, sizeof(float) * 4 * n);
+  cudaStream_t stream;
+  cudaStreamCreate(&stream);
+  compute_stream = stream;
+  cudaStreamCreate(&stream);
+  copy_stream = stream;
+  cudaEvent_t event;
+  cudaEventCreateWithFlags(&event, cudaEventDisableTiming);
+  staged = event;
+  cudaEventCreateWithFlags(&event, cudaEventDisableTiming);
+  copied = event;
+  accelerations_valid = false;
+  copy_pending = false;
+  TC_CHECK_CUDA_ERROR
+}
+
+CUDANBody::~CUDANBody() {
+  if (n == 0) {
+    return;
+  }
+  cudaStreamSynchronize(TC_STREAM(compute_stream));
+  cudaStreamSynchronize(TC_STREAM(copy_stream));
+  for (void *p : {(void *)positions, (void *)velocities,
+                  (void *)accelerations, (void *)codes, (void *)order,
+                  (void *)sorted, (void *)bounds, (void *)children,
+                  (void *)parents, (void *)leaf_parents, (void *)ranges,
+                  (void *)arrivals, (void *)centers, (void *)node_bounds,
+                  (void *)staging}) {
+    cudaFree(p);
+  }
+  cudaFreeHost(host_positions);
+  cudaEventDestroy(TC_EVENT(staged));
+  cudaEventDestroy(TC_EVENT(copied));
+  cudaStreamDestroy(TC_STREAM(compute_stream));
+  cudaStreamDestroy(TC_STREAM(copy_stream));
+}
+
+void CUDANBody::compute_accelerations(float gravitation,
+                                      float opening_angle) {
+  cudaStream_t stream = TC_STREAM(compute_stream);
+  auto p = reinterpret_cast<float4 *>(positions);
+  auto a = reinterpret_cast<float4 *>(accelerations);
+  int blocks = particle_blocks(n);
+  if (opening_angle <= 0) {
+    direct_force_kernel<<<blocks, particle_threads, 0, stream>>>(
+        p, n, eps2, gravitation, a);
+    return;
+  }
+  auto s = reinterpret_cast<float4 *>(sorted);
+  bounds_kernel<<<1, bounds_threads, 0, stream>>>(p, n, bounds);
+  morton_kernel<<<blocks, particle_threads, 0, stream>>>(p, n, bounds, codes,
+                                                         order);
+  thrust::sort_by_key(thrust::cuda::par.on(stream),
+                      thrust::device_ptr<unsigned>(codes),
+                      thrust::device_ptr<unsigned>(codes + n),
+                      thrust::device_ptr<int>(order));
+  gather_kernel<<<blocks, particle_threads, 0, stream>>>(p, order, n, s);
+  if (n > 1) {
+    build_kernel<<<particle_blocks(n - 1), particle_threads, 0, stream>>>(
+        codes, n, children, parents, leaf_parents, ranges);
+    cudaMemsetAsync(arrivals, 0, sizeof(int) * (n - 1), stream);
+    summarize_kernel<<<blocks, particle_threads, 0, stream>>>(
+        s, n, children, parents, leaf_parents, arrivals,
+        reinterpret_cast<float4 *>(centers), node_bounds);
+  }
+  tree_force_kernel<<<blocks, particle_threads, 0, stream>>>(
+      s, order, n, children, ranges, reinterpret_cast<float4 *>(centers),
+      node_bounds, bucket_size, opening_angle * opening_angle, eps2,
+      gravitation, a);
+}
+
+void CUDANBody::step(float dt, float gravitation, float opening_angle) {
+  cudaStream_t stream = TC_STREAM(compute_stream);
+  auto p = reinterpret_cast<float4 *>(positions);
+  auto v = reinterpret_cast<float4 *>(velocities);
+  auto a = reinterpret_cast<float4 *>(accelerations);
+  int blocks = particle_blocks(n);
+  if (gravitation == 0) {
+    drift_kernel<<<blocks, particle_threads, 0, stream>>>(p, v, n, dt);
+    return;
+  }
+  if (!accelerations_valid) {
+    compute_accelerations(gravitation, opening_angle);
+    accelerations_valid = true;
+  }
+  kick_kernel<<<blocks, particle_threads, 0, stream>>>(v, a, n, 0.5f * dt);
+  drift_kernel<<<blocks, particle_threads, 0, stream>>>(p, v, n, dt);
+  compute_accelerations(gravitation, opening_angle);
+  kick_kernel<<<blocks, particle_threads, 0, stream>>>(v, a, n, 0.5f * dt);
+}
+
+void CUDANBody::request_positions() {
+  cudaStream_t stream = TC_STREAM(compute_stream);
+  cudaStream_t copy = TC_STREAM(copy_stream);
+  // |staging| is free once the previous copy is done
+  cudaStreamWaitEvent(stream, TC_EVENT(copied), 0);
+  cudaMemcpyAsync(staging, positions, sizeof(float) * 4 * n,
+                  cudaMemcpyDeviceToDevice, stream);
+  cudaEventRecord(TC_EVENT(staged), stream);
+  cudaStreamWaitEvent(copy, TC_EVENT(staged), 0);
+  cudaMemcpyAsync(host_positions, staging, sizeof(float) * 4 * n,
+                  cudaMemcpyDeviceToHost, copy);
+  cudaEventRecord(TC_EVENT(copied), copy);
+  copy_pending = true;
+}
+
+const float *CUDANBody::get_positions() {
+  if (!copy_pending) {
+    request_positions();
+  }
+  cudaEventSynchronize(TC_EVENT(copied));
+  copy_pending = false;
+  TC_CHECK_CUDA_ERROR
+  return host_positions;
+}
+
+}  // namespace taichi
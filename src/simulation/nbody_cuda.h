@@ -0,0 +1,71 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+// Device side of the "nbody_cuda" Simulation3D. As in
+// poisson_solver3d_cuda.h, only plain types appear here; the device works
+// in float32, with particles of unit mass.
+
+namespace taichi {
+
+class CUDANBody {
+ public:
+  // Uploads |n| particles, with positions and velocities of three floats
+  // each. |eps2| is the softening of SoftenedGravity.
+  void initialize(int n,
+                  const float *positions,
+                  const float *velocities,
+                  float eps2,
+                  int bucket_size);
+
+  ~CUDANBody();
+
+  // Queues one kick-drift-kick leapfrog step of |dt|. With a positive
+  // |opening_angle|, forces are those of the Barnes-Hut walk of a tree
+  // built over the particles in Morton order, with direct summation over
+  // the particles of nodes of at most bucket_size; otherwise of tiled
+  // direct summation over all pairs.
+  void step(float dt, float gravitation, float opening_angle);
+
+  // Queues a copy of the positions after the steps queued so far, which
+  // runs while later steps are computed
+  void request_positions();
+
+  // Waits for the requested copy, requesting one now if there is none, and
+  // returns the particles (x, y, z and the mass), valid until the next
+  // request
+  const float *get_positions();
+
+ private:
+  void compute_accelerations(float gravitation, float opening_angle);
+
+  int n = 0;
+  int bucket_size;
+  float eps2;
+  bool accelerations_valid = false;
+  bool copy_pending = false;
+  // Particles as (x, y, z, 1), velocities and accelerations
+  float *positions = nullptr, *velocities = nullptr,
+        *accelerations = nullptr;
+  // Of the tree: the Morton codes and particle indices in sorted order,
+  // the sorted particles, the bounds of the scene, and for the n - 1
+  // internal nodes their children (leaves as ~particle), parents, sorted
+  // particle ranges, centers of mass and bounds
+  unsigned *codes = nullptr;
+  int *order = nullptr;
+  float *sorted = nullptr;
+  float *bounds = nullptr;
+  int *children = nullptr, *parents = nullptr, *leaf_parents = nullptr,
+      *ranges = nullptr, *arrivals = nullptr;
+  float *centers = nullptr, *node_bounds = nullptr;
+  // The positions of the requested copy: on the device, then on the host
+  float *staging = nullptr, *host_positions = nullptr;
+  // cudaStream_t and cudaEvent_t, which are pointers
+  void *compute_stream = nullptr, *copy_stream = nullptr;
+  void *staged = nullptr, *copied = nullptr;
+};
+
+}  // namespace taichi
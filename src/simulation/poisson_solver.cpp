@@ -3,8 +3,12 @@
     The use of this software is governed by the LICENSE file.
 *******************************************************************************/
 
+#include <taichi/system/statistics.h>
+#include <taichi/system/autotuner.h>
 #include <taichi/system/threading.h>
+#include <taichi/math/array_parallel.h>
 #include <taichi/dynamics/poisson_solver.h>
+#include <cstring>
 
 TC_NAMESPACE_BEGIN
 
@@ -14,6 +18,8 @@ static const Vector2i neighbour4_2d[]{
 
 // Maybe we are going to need Algebraic Multigrid in the future,
 // but let's have a GMG with different boundary conditions support first...
+// Coarse levels have half the resolution rounded up; coarse cells on the
+// border of an odd-sized level simply have fewer children.
 
 class MultigridPoissonSolver2D : public PoissonSolver2D {
  public:
@@ -23,17 +29,23 @@ class MultigridPoissonSolver2D : public PoissonSolver2D {
   std::vector<BCArray> boundaries;
   const int size_threshold = 64;
   int num_threads;
+  // Of the parallel loops over the cells of the levels; autotuned
+  // ("poisson2d_grain_size") at the first boundary condition
+  int grain_size = -1;
   CellType padding;
   bool has_null_space;
 
   struct SystemRow {
     real inv_numerator;
+    // Added to the diagonal, e.g. by ghost fluid free surfaces
+    real extra_diagonal;
     int neighbours;
 
     SystemRow(
         int _ =
             0) {  // _ is for Array2D initialization... Let's fix it later...
       inv_numerator = 0.0_f;
+      extra_diagonal = 0.0_f;
       neighbours = 0;
     }
 
@@ -78,19 +90,46 @@ class MultigridPoissonSolver2D : public PoissonSolver2D {
     return true;
   }
 
+  bool is_multigrid() const override {
+    return true;
+  }
+
   std::vector<System> systems;
 
   void set_boundary_condition(const BCArray &boundary) override {
-    Vector2i res = this->res;
-    boundaries.clear();
-    boundaries.push_back(BCArray(res));
-    // Iff we pad with Neumann and there's no dirichlet...
-    has_null_space = padding == NEUMANN;
+    set_boundary_condition(boundary, Array(res, 0.0_f));
+  }
 
-    for (auto &ind : boundary.get_region()) {
-      if (boundary[ind] == DIRICHLET)
-        has_null_space = false;
+  // The boundary condition is kept between calls: set_boundary_condition()
+  // rebuilds the cells in the box of those that changed and, level by
+  // level, the coarse cells above them. For static boundaries, it only
+  // compares.
+  std::vector<Array> extra_diagonals;
+  int64 num_dirichlet = 0;
+
+  // Coarse levels get half the sum of the extra diagonal of their children,
+  // as for the unit stencils, which are half the Galerkin coarse operators
+  void set_boundary_condition(const BCArray &boundary,
+                              const Array &extra_diagonal) override {
+    TC_ASSERT_INFO(boundary.get_res() == res &&
+                       extra_diagonal.get_res() == res,
+                   "Boundary condition does not match the solver");
+    Vector2i lower(0), upper = res;
+    if (boundaries.empty() || boundaries[0].get_res() != res) {
+      allocate_levels();
+    } else if (!find_changed_region(boundary, extra_diagonal, lower, upper)) {
+      return;
     }
+    for (int i = lower.x; i < upper.x; i++) {
+      for (int j = lower.y; j < upper.y; j++) {
+        num_dirichlet += int(boundary[i][j] == DIRICHLET) -
+                         int(boundaries[0][i][j] == DIRICHLET);
+        boundaries[0][i][j] = boundary[i][j];
+        extra_diagonals[0][i][j] = extra_diagonal[i][j];
+      }
+    }
+    // Iff we pad with Neumann and there's no dirichlet...
+    has_null_space = padding == NEUMANN && num_dirichlet == 0;
 
     if (has_null_space) {
       // Let's remove the null space in an ad-hoc manner...
@@ -99,59 +138,154 @@ class MultigridPoissonSolver2D : public PoissonSolver2D {
       // error("null space detected");
     }
 
-    // Step 1: figure out cell types
-    for (int l = 0; l < max_level - 1; l++) {
-      res /= Vector2i(2);
-      boundaries.push_back(BCArray(res));
-      for (auto &ind : boundaries.back().get_region()) {
-        auto &previous_boundary = boundaries[(int)boundaries.size() - 2];
-        bool has_dirichlet = false;
-        bool all_neumann = true;
-        for (int i = 0; i < 2; i++) {
-          for (int j = 0; j < 2; j++) {
-            char bc = previous_boundary[ind.i * 2 + i][ind.j * 2 + j];
-            if (bc == DIRICHLET) {
-              has_dirichlet = true;
-              break;
-            }
-            if (bc != NEUMANN) {
-              all_neumann = false;
-            }
+    for (int l = 0; l < max_level; l++) {
+      Vector2i level_res = systems[l].get_res();
+      if (l > 0) {
+        // Step 1: figure out cell types
+        lower = lower / Vector2i(2);
+        upper = taichi::min((upper + Vector2i(1)) / Vector2i(2), level_res);
+        for (int i = lower.x; i < upper.x; i++) {
+          for (int j = lower.y; j < upper.y; j++) {
+            coarsen_cell(l, Vector2i(i, j));
           }
         }
-        CellType bc =
-            has_dirichlet ? DIRICHLET : (all_neumann ? NEUMANN : INTERIOR);
-        boundaries.back()[ind] = bc;
       }
+      // Step 2: build the compressed systems, for the rows of the box and
+      // of the cells next to it
+      Vector2i row_lower = taichi::max(lower - Vector2i(1), Vector2i(0));
+      Vector2i row_upper = taichi::min(upper + Vector2i(1), level_res);
+      for (int i = row_lower.x; i < row_upper.x; i++) {
+        for (int j = row_lower.y; j < row_upper.y; j++) {
+          systems[l][i][j] = build_system_row(l, Vector2i(i, j));
+        }
+      }
+    }
+    if (grain_size < 0) {
+      tune_grain_size();
     }
+  }
 
+  // By the operator and a smoothing round on all levels
+  void tune_grain_size() {
+    grain_size = Autotuner::get(
+        "poisson2d_grain_size", num_threads, region_grain_size,
+        {1024, 2048, 4096, 8192, 16384, 32768}, [&](int grain) {
+          grain_size = grain;
+          std::vector<Array> p, out;
+          for (int l = 0; l < max_level; l++) {
+            p.push_back(Array(systems[l].get_res(), 0.0_f));
+            out.push_back(Array(systems[l].get_res()));
+          }
+          return Autotuner::time_best_of([&]() {
+            for (int l = 0; l < max_level; l++) {
+              apply_L(systems[l], p[l], out[l]);
+              gauss_seidel(systems[l], out[l], p[l], 1);
+            }
+          });
+        });
+  }
+
+  void allocate_levels() {
+    Vector2i res = this->res;
+    boundaries.clear();
+    extra_diagonals.clear();
     systems.clear();
-    res = this->res;
-    // Step 2: build the compressed systems
     for (int l = 0; l < max_level; l++) {
-      System system(res);
-      for (auto &ind : system.get_region()) {
-        for (int i = 0; i < 4; i++) {
-          auto n_ind = ind + neighbour4_2d[i];
-          CellType cell;
-          if (boundaries[l].inside(n_ind)) {
-            cell = boundaries[l][n_ind];
-          } else {
-            cell = padding;
-          }
-          system[ind].set_neighbour_cell_type(i, cell);
-          if (cell == DIRICHLET || cell == INTERIOR) {
-            system[ind].inv_numerator += 1.0_f;
-          }
+      boundaries.push_back(BCArray(res, INTERIOR));
+      extra_diagonals.push_back(Array(res, 0.0_f));
+      systems.push_back(System(res));
+      res = get_coarse_res(res);
+    }
+    num_dirichlet = 0;
+  }
+
+  // Of the cells where |boundary| or |extra_diagonal| differ from the current
+  // ones, as [lower, upper); false if there are none
+  bool find_changed_region(const BCArray &boundary,
+                           const Array &extra_diagonal,
+                           Vector2i &lower,
+                           Vector2i &upper) const {
+    const BCArray &current = boundaries[0];
+    const Array &current_diagonal = extra_diagonals[0];
+    const int column = res[1];
+    lower = res;
+    upper = Vector2i(0);
+    for (int i = 0; i < res[0]; i++) {
+      if (std::memcmp(&boundary.data[i * column], &current.data[i * column],
+                      column * sizeof(CellType)) == 0 &&
+          std::memcmp(&extra_diagonal.data[i * column],
+                      &current_diagonal.data[i * column],
+                      column * sizeof(real)) == 0) {
+        continue;
+      }
+      for (int j = 0; j < res[1]; j++) {
+        if (boundary[i][j] != current[i][j] ||
+            std::memcmp(&extra_diagonal[i][j], &current_diagonal[i][j],
+                        sizeof(real)) != 0) {
+          lower = taichi::min(lower, Vector2i(i, j));
+          upper = taichi::max(upper, Vector2i(i + 1, j + 1));
         }
-        if (boundaries[l][ind] != INTERIOR)
-          system[ind].inv_numerator = 0;
-        else
-          system[ind].inv_numerator = 1.0_f / system[ind].inv_numerator;
       }
-      systems.push_back(system);
-      res /= Vector2i(2);
     }
+    return lower.x < upper.x;
+  }
+
+  // The cell type and extra diagonal of coarse cell |ind| of level |l|
+  void coarsen_cell(int l, const Vector2i &ind) {
+    const BCArray &previous_boundary = boundaries[l - 1];
+    real extra_diagonal = 0;
+    bool has_dirichlet = false;
+    bool all_neumann = true;
+    for (int i = 0; i < 2; i++) {
+      for (int j = 0; j < 2; j++) {
+        Vector2i child(ind.x * 2 + i, ind.y * 2 + j);
+        if (!previous_boundary.inside(child)) {
+          continue;
+        }
+        char bc = previous_boundary[child];
+        if (bc == INTERIOR) {
+          extra_diagonal += 0.5_f * extra_diagonals[l - 1][child];
+        }
+        if (bc == DIRICHLET) {
+          has_dirichlet = true;
+          break;
+        }
+        if (bc != NEUMANN) {
+          all_neumann = false;
+        }
+      }
+    }
+    boundaries[l][ind] =
+        has_dirichlet ? DIRICHLET : (all_neumann ? NEUMANN : INTERIOR);
+    extra_diagonals[l][ind] = extra_diagonal;
+  }
+
+  SystemRow build_system_row(int l, const Vector2i &ind) const {
+    SystemRow row;
+    for (int i = 0; i < 4; i++) {
+      auto n_ind = ind + neighbour4_2d[i];
+      CellType cell;
+      if (boundaries[l].inside(n_ind)) {
+        cell = boundaries[l][n_ind];
+      } else {
+        cell = padding;
+      }
+      row.set_neighbour_cell_type(i, cell);
+      if (cell == DIRICHLET || cell == INTERIOR) {
+        row.inv_numerator += 1.0_f;
+      }
+    }
+    if (boundaries[l][ind] != INTERIOR) {
+      row.inv_numerator = 0;
+    } else {
+      row.extra_diagonal = extra_diagonals[l][ind];
+      row.inv_numerator = 1.0_f / (row.inv_numerator + row.extra_diagonal);
+    }
+    return row;
+  }
+
+  static Vector2i get_coarse_res(const Vector2i &res) {
+    return (res + Vector2i(1)) / Vector2i(2);
   }
 
   void initialize(const Config &config) override {
@@ -172,30 +306,13 @@ class MultigridPoissonSolver2D : public PoissonSolver2D {
       pressures.push_back(Array(res));
       residuals.push_back(Array(res));
       tmp_residuals.push_back(Array(res));
-      assert_info(res[0] % 2 == 0, "odd width");
-      assert_info(res[1] % 2 == 0, "odd height");
-      res /= Vector2i(2);
+      res = get_coarse_res(res);
       max_level++;
     } while (res[0] * res[1] * 8 >= size_threshold);
   }
 
-  void parallel_for_each_cell(
-      Array &arr,
-      int threshold,
-      const std::function<void(const Index2D &index)> &func) {
-    int max_side = std::max(std::max(arr.get_width(), arr.get_height()), 0);
-    int num_threads;
-    if (max_side >= threshold) {
-      num_threads = this->num_threads;
-    } else {
-      num_threads = 1;
-    }
-    ThreadedTaskManager::run(arr.get_width(), num_threads, [&](int x) {
-      const int height = arr.get_height();
-      for (int y = 0; y < height; y++) {
-        func(Index2D(x, y));
-      }
-    });
+  int get_grain_size() const {
+    return grain_size > 0 ? grain_size : region_grain_size;
   }
 
   bool get_has_null_space() {
@@ -208,8 +325,8 @@ class MultigridPoissonSolver2D : public PoissonSolver2D {
                     int rounds) {
     for (int i = 0; i < rounds; i++) {
       for (int c = 0; c < 2; c++) {
-        parallel_for_each_cell(pressure, 64, [&](const Index2D &ind) {
-          int sum = ind.i + ind.j;
+        parallel_for(pressure.get_region(), [&](const Vector2i &ind) {
+          int sum = ind[0] + ind[1];
           if ((sum) % 2 == c) {
             if (system[ind].inv_numerator > 0) {
               real res = residual[ind];
@@ -224,19 +341,24 @@ class MultigridPoissonSolver2D : public PoissonSolver2D {
               pressure[ind] = 0.0_f;
             }
           }
-        });
+        }, num_threads, get_grain_size());
       }
     }
   }
 
-  void apply_L(const System &system, const Array &pressure, Array &output) {
-    for (auto &ind : pressure.get_region()) {
+  // Of the scalar of the vectors, which is |real| for the levels and
+  // float64 for the outer solve of the mixed precision solver
+  template <typename S>
+  void apply_L(const System &system,
+               const Array2D<S> &pressure,
+               Array2D<S> &output) {
+    parallel_for(pressure.get_region(), [&](const Vector2i &ind) {
       if (system[ind].inv_numerator == 0.0_f) {
-        output[ind] = 0.0_f;
-        continue;
+        output[ind] = 0;
+        return;
       }
-      real pressure_center = pressure[ind];
-      real res = 0.0_f;
+      S pressure_center = pressure[ind];
+      S res = system[ind].extra_diagonal * pressure_center;
       for (int k = 0; k < 4; k++) {
         Vector2i offset = neighbour4_2d[k];
         CellType type = system[ind].get_neighbour_cell_type(k);
@@ -247,20 +369,20 @@ class MultigridPoissonSolver2D : public PoissonSolver2D {
         }
       }
       output[ind] = res;
-    }
+    }, num_threads, get_grain_size());
   }
 
   void compute_residual(const System &system,
                         const Array &pressure,
                         const Array &div,
                         Array &residual) {
-    parallel_for_each_cell(residual, 128, [&](const Index2D &ind) {
+    parallel_for(residual.get_region(), [&](const Vector2i &ind) {
       if (system[ind].inv_numerator == 0) {
         residual[ind] = 0.0_f;
         return;
       }
       real pressure_center = pressure[ind];
-      real res = 0.0_f;
+      real res = system[ind].extra_diagonal * pressure_center;
       for (int k = 0; k < 4; k++) {
         Vector2i offset = neighbour4_2d[k];
         CellType type = system[ind].get_neighbour_cell_type(k);
@@ -271,35 +393,41 @@ class MultigridPoissonSolver2D : public PoissonSolver2D {
         }
       }
       residual[ind] = div[ind] - res;
-    });
+    }, num_threads, get_grain_size());
   }
 
   void downsample(const System &system,
                   const Array &x,
                   Array &x_downsampled) {  // Restriction
-    for (auto &ind : x_downsampled.get_region()) {
+    parallel_for(x_downsampled.get_region(), [&](const Vector2i &ind) {
+      real sum = 0.0_f;
       if (system[ind].inv_numerator > 0) {
-        x_downsampled[ind] =
-            x[ind.i * 2 + 0][ind.j * 2 + 0] + x[ind.i * 2 + 0][ind.j * 2 + 1] +
-            x[ind.i * 2 + 1][ind.j * 2 + 0] + x[ind.i * 2 + 1][ind.j * 2 + 1];
-      } else {
-        x_downsampled[ind] = 0.0_f;
+        int i_end = std::min(ind[0] * 2 + 2, x.get_width());
+        int j_end = std::min(ind[1] * 2 + 2, x.get_height());
+        for (int i = ind[0] * 2; i < i_end; i++) {
+          for (int j = ind[1] * 2; j < j_end; j++) {
+            sum += x[i][j];
+          }
+        }
       }
-    }
+      x_downsampled[ind] = sum;
+    }, num_threads, get_grain_size());
   }
 
-  void prolongate(const System &system, Array &x, const Array &x_delta) const {
-    for (auto &ind : x.get_region()) {
+  void prolongate(const System &system, Array &x, const Array &x_delta) {
+    parallel_for(x.get_region(), [&](const Vector2i &ind) {
       // Do not prolongate to cells without a degree of freedom
       if (system[ind].inv_numerator > 0) {
-        x[ind] +=
-            x_delta[ind.i / 2]
-                   [ind.j / 2];  // Note: In 2D, there's no 0.5 factor here
+        // Note: In 2D, there's no 0.5 factor here
+        x[ind] += x_delta[ind[0] / 2][ind[1] / 2];
       }
-    }
+    }, num_threads, get_grain_size());
   }
 
   void run(int level) {
+    if (level == 0) {
+      TC_STAT("poisson_v_cycles", 1);
+    }
     pressures[level].reset(0.0_f);
     if (residuals[level].get_size() <= size_threshold) {  // 4 * 4 * 4
       gauss_seidel(systems[level], residuals[level], pressures[level], 100);
@@ -317,73 +445,131 @@ class MultigridPoissonSolver2D : public PoissonSolver2D {
     }
   }
 
+  void v_cycle(const Array &b, Array &x) override {
+    pressures[0] = 0;
+    residuals[0] = b;
+    run(0);
+    x = pressures[0];
+  }
+
   virtual void run(const Array &residual,
                    Array &pressure,
                    real pressure_tolerance) override {
     pressures[0] = pressure;
     residuals[0] = residual;
     int iterations = 0;
+    real residual_max;
     do {
       iterations++;
       run(0);
       compute_residual(systems[0], pressures[0], residuals[0],
                        tmp_residuals[0]);
+      residual_max = p_abs_max(tmp_residuals[0], num_threads);
       TC_P(iterations);
-      TC_P(tmp_residuals[0].abs_max());
-    } while (tmp_residuals[0].abs_max() > pressure_tolerance);
+      TC_P(residual_max);
+    } while (residual_max > pressure_tolerance);
+    last_iterations = iterations;
     pressure = pressures[0];
   }
 };
 
+// With 'mixed_precision', the conjugate gradient keeps its solution,
+// residual and directions in float64, while the V-cycles of the
+// preconditioner run on the |real| levels, as in the 3D solver
 class MultigridPCGPoissonSolver2D : public MultigridPoissonSolver2D {
  public:
+  int maximum_iterations;
+  bool mixed_precision;
+  // Work arrays, kept between solves
+  Array r, z, p;
+  Array2D<float64> b64, x64, r64, z64, p64;
+
   void initialize(const Config &config) {
     MultigridPoissonSolver2D::initialize(config);
+    maximum_iterations = config.get("maximum_iterations", 20);
+    mixed_precision = config.get("mixed_precision", false);
   }
 
-  Array apply_preconditioner(Array &r) {
-    pressures[0] = 0;
-    residuals[0] = r;
-    MultigridPoissonSolver2D::run(0);
-    return pressures[0];
+  // Removes the mean of r if the system has a null space, returning the
+  // abs max of the new r
+  template <typename S>
+  real project_residual(Array2D<S> &r) {
+    S mu = 0;
+    if (has_null_space) {
+      mu = (S)(p_sum(r, num_threads) / r.get_size());
+    }
+    return p_subtract_abs_max(r, mu, num_threads);
   }
 
-  virtual void run(const Array &residual,
-                   Array &pressure,
-                   real pressure_tolerance) {
+  // Solves from pressure = 0, with |precondition(r, z)| setting z to the
+  // approximate solution of L z = r
+  template <typename S, typename P>
+  void conjugate_gradient(const Array2D<S> &residual,
+                          Array2D<S> &pressure,
+                          real pressure_tolerance,
+                          Array2D<S> &r,
+                          Array2D<S> &z,
+                          Array2D<S> &p,
+                          const P &precondition) {
     pressure = 0;
-    Array r(res), mu(res), tmp(res);
-    mu = has_null_space ? r.get_average() : 0;
     r = residual;  // TODO: r = r - Lx
-    double nu = (r - mu).abs_max();
+    if (z.get_res() != res) {
+      z = Array2D<S>(res);
+      p = Array2D<S>(res);
+    }
+    double nu = project_residual(r);
+    last_iterations = 0;
     if (nu < pressure_tolerance)
       return;
-    r -= mu;
-    Array p = apply_preconditioner(r);
-    double rho = p.dot_double(r);
-    int maximum_iterations = 20;
-    Array z(res);
+    precondition(r, p);
+    double rho = dot_product(p, r, num_threads);
     for (int count = 0; count <= maximum_iterations; count++) {
       apply_L(systems[0], p, z);
-      double sigma = p.dot_double(z);
+      double sigma = dot_product(p, z, num_threads);
       double alpha = rho / max(1e-20, sigma);
-      r.add_in_place(-(real)alpha, z);
-      mu = has_null_space ? r.get_average() : 0;
-      nu = (r - mu).abs_max();
-      (r - mu).print_abs_max_pos();
+      if (has_null_space) {
+        p_add_in_place(r, -(S)alpha, z, num_threads);
+        nu = project_residual(r);
+      } else {
+        nu = p_add_in_place_abs_max(r, -(S)alpha, z, num_threads);
+      }
+      last_iterations = count + 1;
+      TC_STAT("poisson_cg_iterations", 1);
       printf(" MGPCG iteration #%02d, nu=%f\n", count, nu);
+      p_add_in_place(pressure, (S)alpha, p, num_threads);
       if (nu < pressure_tolerance || count == maximum_iterations) {
-        pressure.add_in_place((real)alpha, p);
         return;
       }
-      r -= mu;
-      z = apply_preconditioner(r);
-      double rho_new = z.dot_double(r);
+      precondition(r, z);
+      double rho_new = dot_product(z, r, num_threads);
       double beta = rho_new / rho;
       rho = rho_new;
-      pressure.add_in_place((real)alpha, p);
-      p = z.add((real)beta, p);
+      p_add_in_place2(z, (S)beta, p, num_threads);
+    }
+  }
+
+  virtual void run(const Array &residual,
+                   Array &pressure,
+                   real pressure_tolerance) {
+    if (!mixed_precision) {
+      conjugate_gradient(residual, pressure, pressure_tolerance, r, z, p,
+                         [&](const Array &b, Array &x) { v_cycle(b, x); });
+      return;
     }
+    if (b64.get_res() != res) {
+      b64 = Array2D<float64>(res);
+      x64 = Array2D<float64>(res);
+    }
+    p_copy(residual, b64, num_threads);
+    conjugate_gradient(
+        b64, x64, pressure_tolerance, r64, z64, p64,
+        [&](const Array2D<float64> &b, Array2D<float64> &x) {
+          p_copy(b, residuals[0], num_threads);
+          pressures[0] = 0;
+          MultigridPoissonSolver2D::run(0);
+          p_copy(pressures[0], x, num_threads);
+        });
+    p_copy(x64, pressure, num_threads);
   }
 };
 
@@ -3,8 +3,12 @@
     The use of this software is governed by the LICENSE file.
 *******************************************************************************/
 
+#include <taichi/system/statistics.h>
+#include <taichi/system/autotuner.h>
 #include <taichi/system/threading.h>
+#include <taichi/math/array_parallel.h>
 #include <taichi/dynamics/poisson_solver.h>
+#include <cstring>
 
 TC_NAMESPACE_BEGIN
 
@@ -18,7 +22,7 @@ void PoissonSolver3D::initialize(const Config &config) {
 
 // Maybe we are going to need Algebraic Multigrid in the future,
 // but let's have a GMG with different boundary conditions support first...
-// TODO: AMG, cache
+// TODO: AMG
 
 class MultigridPoissonSolver3D : public PoissonSolver3D {
  public:
@@ -28,6 +32,9 @@ class MultigridPoissonSolver3D : public PoissonSolver3D {
   std::vector<BCArray> boundaries;
   const int size_threshold = 64;
   int num_threads;
+  // Levels at least this many cells wide run in parallel; autotuned
+  // ("poisson3d_parallel_side") at the first boundary condition
+  int parallel_side = -1;
   CellType padding;
   bool has_null_space;
   bool use_as_preconditioner;
@@ -79,24 +86,57 @@ class MultigridPoissonSolver3D : public PoissonSolver3D {
 
   typedef Array3D<SystemRow> System;
 
+  // A run of cells [begin, end) of a z-line. Regular cells are interior
+  // cells with six interior neighbours, where the operator is the plain
+  // 7-point Laplacian and nothing needs to be decoded.
+  struct Segment {
+    int begin, end;
+    bool regular;
+  };
+
+  // The z-lines of a level split into segments: those of line (x, y) are
+  // segments[line_begin[x * height + y]..line_begin[x * height + y + 1])
+  struct LineSegments {
+    std::vector<int> line_begin;
+    std::vector<Segment> segments;
+  };
+
   bool test() const override {
     SystemRow::test();
     return true;
   }
 
   std::vector<System> systems;
+  std::vector<LineSegments> line_segments;
 
-  void set_boundary_condition(const BCArray &boundary) override {
-    Vector3i res = this->res;
-    boundaries.clear();
-    boundaries.push_back(BCArray(res));
-    // Iff we pad with Neumann and there's no dirichlet...
-    has_null_space = padding == NEUMANN;
+  // The boundary condition is kept between calls: set_boundary_condition()
+  // rebuilds the cells in the box of those that changed and, level by
+  // level, the coarse cells above them. For static boundaries, it only
+  // compares.
+  int64 num_dirichlet = 0;
 
-    for (auto &ind : boundary.get_region()) {
-      if (boundary[ind] == DIRICHLET)
-        has_null_space = false;
+  void set_boundary_condition(const BCArray &boundary) override {
+    TC_ASSERT_INFO(boundary.get_res() == res,
+                   "Boundary condition does not match the solver");
+    Vector3i lower(0), upper = res;
+    if (boundaries.empty() || boundaries[0].get_res() != res) {
+      allocate_levels();
+    } else if (!find_changed_region(boundary, lower, upper)) {
+      return;
     }
+    for (int i = lower.x; i < upper.x; i++) {
+      for (int j = lower.y; j < upper.y; j++) {
+        for (int k = lower.z; k < upper.z; k++) {
+          num_dirichlet += int(boundary[i][j][k] == DIRICHLET) -
+                           int(boundaries[0][i][j][k] == DIRICHLET);
+        }
+      }
+    }
+    for_each_in_box(lower, upper, [&](const Vector3i &ind) {
+      boundaries[0][ind.x][ind.y][ind.z] = boundary[ind.x][ind.y][ind.z];
+    });
+    // Iff we pad with Neumann and there's no dirichlet...
+    has_null_space = padding == NEUMANN && num_dirichlet == 0;
 
     if (has_null_space) {
       // Let's remove the null space in an ad-hoc manner...
@@ -105,63 +145,169 @@ class MultigridPoissonSolver3D : public PoissonSolver3D {
       // error("null space detected");
     }
 
-    // Step 1: figure out cell types
-    for (int l = 0; l < max_level - 1; l++) {
-      res /= Vector3i(2);
-      boundaries.push_back(BCArray(res));
-      for (auto &ind : boundaries.back().get_region()) {
-        auto &previous_boundary = boundaries[(int)boundaries.size() - 2];
-        bool has_dirichlet = false;
-        bool all_neumann = true;
-        for (int i = 0; i < 2; i++) {
-          for (int j = 0; j < 2; j++) {
-            for (int k = 0; k < 2; k++) {
-              char bc = previous_boundary[ind.i * 2 + i][ind.j * 2 + j]
-                                         [ind.k * 2 + k];
-              if (bc == DIRICHLET) {
-                has_dirichlet = true;
-                break;
-              }
-              if (bc != NEUMANN) {
-                all_neumann = false;
-              }
+    for (int l = 0; l < max_level; l++) {
+      Vector3i level_res = systems[l].get_res();
+      if (l > 0) {
+        // Step 1: figure out cell types
+        lower = lower / Vector3i(2);
+        upper = (upper + Vector3i(1)) / Vector3i(2);
+        for_each_in_box(lower, upper, [&](const Vector3i &ind) {
+          boundaries[l][ind.x][ind.y][ind.z] = coarsen_cell(l, ind);
+        });
+      }
+      // Step 2: build the compressed systems, for the rows of the box and
+      // of the cells next to it
+      Vector3i row_lower = taichi::max(lower - Vector3i(1), Vector3i(0));
+      Vector3i row_upper = taichi::min(upper + Vector3i(1), level_res);
+      for_each_in_box(row_lower, row_upper, [&](const Vector3i &ind) {
+        systems[l][ind.x][ind.y][ind.z] = build_system_row(l, ind);
+      });
+      line_segments[l] = build_line_segments(systems[l]);
+    }
+    if (parallel_side < 0) {
+      tune_parallel_side();
+    }
+  }
+
+  // By the operator and a smoothing round on all levels
+  void tune_parallel_side() {
+    parallel_side = Autotuner::get(
+        "poisson3d_parallel_side", num_threads, 128,
+        {16, 32, 64, 128, 256, 512}, [&](int side) {
+          parallel_side = side;
+          std::vector<Array> p, out;
+          for (int l = 0; l < max_level; l++) {
+            p.push_back(Array(systems[l].get_res(), 0.0_f));
+            out.push_back(Array(systems[l].get_res()));
+          }
+          return Autotuner::time_best_of([&]() {
+            for (int l = 0; l < max_level; l++) {
+              apply_L(l, p[l], out[l]);
+              gauss_seidel(l, out[l], p[l], 1);
             }
+          });
+        });
+  }
+
+  void allocate_levels() {
+    Vector3i res = this->res;
+    boundaries.clear();
+    systems.clear();
+    line_segments.clear();
+    for (int l = 0; l < max_level; l++) {
+      boundaries.push_back(BCArray(res, INTERIOR));
+      systems.push_back(System(res));
+      line_segments.push_back(LineSegments());
+      res /= Vector3i(2);
+    }
+    num_dirichlet = 0;
+  }
+
+  // Of the cells where |boundary| differs from the current one, as
+  // [lower, upper); false if there are none
+  bool find_changed_region(const BCArray &boundary,
+                           Vector3i &lower,
+                           Vector3i &upper) const {
+    const BCArray &current = boundaries[0];
+    const int64 slice = (int64)res[1] * res[2];
+    lower = res;
+    upper = Vector3i(0);
+    for (int i = 0; i < res[0]; i++) {
+      if (std::memcmp(&boundary.data[i * slice], &current.data[i * slice],
+                      slice * sizeof(CellType)) == 0) {
+        continue;
+      }
+      for (int j = 0; j < res[1]; j++) {
+        for (int k = 0; k < res[2]; k++) {
+          if (boundary[i][j][k] != current[i][j][k]) {
+            lower = taichi::min(lower, Vector3i(i, j, k));
+            upper = taichi::max(upper, Vector3i(i, j, k) + Vector3i(1));
           }
         }
-        CellType bc =
-            has_dirichlet ? DIRICHLET : (all_neumann ? NEUMANN : INTERIOR);
-        boundaries.back()[ind] = bc;
       }
     }
+    return lower.x < upper.x;
+  }
 
-    systems.clear();
-    res = this->res;
-    // Step 2: build the compressed systems
-    for (int l = 0; l < max_level; l++) {
-      System system(res);
-      for (auto &ind : system.get_region()) {
-        for (int i = 0; i < 6; i++) {
-          auto n_ind = ind + neighbour6_3d[i];
-          CellType cell;
-          if (boundaries[l].inside(n_ind)) {
-            cell = boundaries[l][n_ind];
-          } else {
-            cell = padding;
+  // Calls |f(ind)| for the cells of [lower, upper), slices in parallel
+  template <typename F>
+  void for_each_in_box(const Vector3i &lower,
+                       const Vector3i &upper,
+                       const F &f) const {
+    ThreadedTaskManager::run(
+        [&](int i) {
+          for (int j = lower.y; j < upper.y; j++) {
+            for (int k = lower.z; k < upper.z; k++) {
+              f(Vector3i(i, j, k));
+            }
+          }
+        },
+        lower.x, upper.x, num_threads);
+  }
+
+  CellType coarsen_cell(int l, const Vector3i &ind) const {
+    const BCArray &previous_boundary = boundaries[l - 1];
+    bool has_dirichlet = false;
+    bool all_neumann = true;
+    for (int i = 0; i < 2; i++) {
+      for (int j = 0; j < 2; j++) {
+        for (int k = 0; k < 2; k++) {
+          char bc =
+              previous_boundary[ind.x * 2 + i][ind.y * 2 + j][ind.z * 2 + k];
+          if (bc == DIRICHLET) {
+            has_dirichlet = true;
+            break;
           }
-          system[ind].set_neighbour_cell_type(i, cell);
-          if (cell == DIRICHLET || cell == INTERIOR) {
-            system[ind].inv_numerator += 1.0_f;
+          if (bc != NEUMANN) {
+            all_neumann = false;
           }
         }
-        if (boundaries[l][ind] != INTERIOR)
-          system[ind].inv_numerator = 0;
-        else {
-          system[ind].inv_numerator = 1.0_f / system[ind].inv_numerator;
+      }
+    }
+    return has_dirichlet ? DIRICHLET : (all_neumann ? NEUMANN : INTERIOR);
+  }
+
+  SystemRow build_system_row(int l, const Vector3i &ind) const {
+    SystemRow row;
+    for (int i = 0; i < 6; i++) {
+      auto n_ind = ind + neighbour6_3d[i];
+      CellType cell;
+      if (boundaries[l].inside(n_ind)) {
+        cell = boundaries[l][n_ind.x][n_ind.y][n_ind.z];
+      } else {
+        cell = padding;
+      }
+      row.set_neighbour_cell_type(i, cell);
+      if (cell == DIRICHLET || cell == INTERIOR) {
+        row.inv_numerator += 1.0_f;
+      }
+    }
+    if (boundaries[l][ind.x][ind.y][ind.z] != INTERIOR)
+      row.inv_numerator = 0;
+    else {
+      row.inv_numerator = 1.0_f / row.inv_numerator;
+    }
+    return row;
+  }
+
+  static LineSegments build_line_segments(const System &system) {
+    LineSegments lines;
+    for (int x = 0; x < system.get_width(); x++) {
+      for (int y = 0; y < system.get_height(); y++) {
+        lines.line_begin.push_back((int)lines.segments.size());
+        for (int z = 0; z < system.get_depth(); z++) {
+          const SystemRow &row = system[x][y][z];
+          bool regular = row.inv_numerator > 0 && row.neighbours == 0;
+          if (z > 0 && lines.segments.back().regular == regular) {
+            lines.segments.back().end = z + 1;
+          } else {
+            lines.segments.push_back(Segment{z, z + 1, regular});
+          }
         }
       }
-      systems.push_back(system);
-      res /= Vector3i(2);
     }
+    lines.line_begin.push_back((int)lines.segments.size());
+    return lines;
   }
 
   void initialize(const Config &config) override {
@@ -192,177 +338,523 @@ class MultigridPoissonSolver3D : public PoissonSolver3D {
     } while (res[0] * res[1] * res[2] * 8 >= size_threshold);
   }
 
-  void parallel_for_each_cell(
-      Array &arr,
-      int threshold,
-      const std::function<void(const Index3D &index)> &func) {
-    int max_side =
-        std::max(std::max(arr.get_width(), arr.get_height()), arr.get_depth());
-    int num_threads;
-    if (max_side >= threshold) {
-      num_threads = this->num_threads;
-    } else {
-      num_threads = 1;
-    }
-    ThreadedTaskManager::run(arr.get_width(), num_threads, [&](int x) {
-      const int height = arr.get_height();
-      const int depth = arr.get_depth();
-      for (int y = 0; y < height; y++) {
-        for (int z = 0; z < depth; z++) {
-          func(Index3D(x, y, z));
+  // Calls |regular(x, y, z)| or |general(x, y, z)| for the cells of
+  // |color| (those with x + y + z = color mod 2; all cells if color is -1)
+  // of a level, depending on their segment. Cells of one z-line are
+  // visited in order, lines in parallel if the level is at least
+  // |threshold| cells wide.
+  template <typename R, typename G>
+  void for_each_cell(int level,
+                     int color,
+                     int threshold,
+                     const R &regular,
+                     const G &general) const {
+    const System &system = systems[level];
+    const int height = system.get_height();
+    ThreadedTaskManager::run(
+        system.get_width(), get_num_threads(level, threshold), [&](int x) {
+          for (int y = 0; y < height; y++) {
+            for_each_cell_in_line(level, x, y, color, regular, general);
+          }
+        });
+  }
+
+  int get_num_threads(int level, int threshold) const {
+    const System &system = systems[level];
+    int max_side = std::max(std::max(system.get_width(), system.get_height()),
+                            system.get_depth());
+    return max_side >= threshold ? num_threads : 1;
+  }
+
+  // Same, for the cells of z-line (x, y) only
+  template <typename R, typename G>
+  void for_each_cell_in_line(int level,
+                             int x,
+                             int y,
+                             int color,
+                             const R &regular,
+                             const G &general) const {
+    const LineSegments &lines = line_segments[level];
+    const int step = color < 0 ? 1 : 2;
+    int line = x * systems[level].get_height() + y;
+    for (int s = lines.line_begin[line]; s < lines.line_begin[line + 1]; s++) {
+      const Segment &segment = lines.segments[s];
+      int begin = segment.begin;
+      if (color >= 0) {
+        begin += (color + x + y + begin) & 1;
+      }
+      if (segment.regular) {
+        for (int z = begin; z < segment.end; z += step) {
+          regular(x, y, z);
+        }
+      } else {
+        for (int z = begin; z < segment.end; z += step) {
+          general(x, y, z);
         }
       }
-    });
+    }
   }
 
-  bool get_has_null_space() {
-    return has_null_space;
+  // Temporal blocking of a sequence of passes over the x slices of a
+  // level: calls |stage(s, x, y_begin, y_end)| for the stages
+  // s = 0..num_stages - 1 on every slice x, in blocks of z-lines, where
+  // stage s of slice x may read slices x - 1 to x + 1 as left by stage
+  // s - 1 and write slice x only. At step t stage s runs on slice t - 2s,
+  // so that the slices a stage touches are still in cache from the stages
+  // before it, instead of each stage streaming the whole level; the stages
+  // of one step are two slices apart and run in parallel.
+  template <typename F>
+  void for_each_stage(int level,
+                      int num_stages,
+                      int threshold,
+                      const F &stage) const {
+    const int width = systems[level].get_width();
+    const int height = systems[level].get_height();
+    const int block = 8;
+    const int num_blocks = (height + block - 1) / block;
+    const int threads = get_num_threads(level, threshold);
+    for (int t = 0; t < width + 2 * (num_stages - 1); t++) {
+      int first_stage = t < width ? 0 : (t - width) / 2 + 1;
+      int num_active = std::min(num_stages - 1, t / 2) - first_stage + 1;
+      auto task = [&](int i) {
+        int s = first_stage + i / num_blocks;
+        int y_begin = i % num_blocks * block;
+        stage(s, t - 2 * s, y_begin, std::min(y_begin + block, height));
+      };
+      if (threads == 1) {
+        for (int i = 0; i < num_active * num_blocks; i++) {
+          task(i);
+        }
+      } else {
+        ThreadedTaskManager::run(num_active * num_blocks, threads, task);
+      }
+    }
   }
 
-  void gauss_seidel(const System &system,
-                    const Array &residual,
-                    Array &pressure,
-                    int rounds) {
-    for (int i = 0; i < rounds; i++) {
-      for (int c = 0; c < 2; c++) {
-        parallel_for_each_cell(pressure, 128, [&](const Index3D &ind) {
-          int sum = ind.i + ind.j + ind.k;
-          if ((sum) % 2 == c) {
-            if (system[ind].inv_numerator > 0) {
-              real res = residual[ind];
-              for (int k = 0; k < 6; k++) {
-                Vector3i offset = neighbour6_3d[k];
-                if (system[ind].get_neighbour_cell_type(k) == INTERIOR) {
-                  res += pressure[ind + offset];
-                }
-              }
-              pressure[ind] = res * system[ind].inv_numerator;
-            } else {
-              pressure[ind] = 0.0_f;
-            }
-          }
-        });
+  // Sum over the neighbours of (p_center - p_neighbour), and p_center for
+  // Dirichlet ones; in the order of neighbour6_3d. The operators are
+  // templated on the scalar of the vectors, which is |real| for the levels
+  // and float64 for the outer solve of the mixed precision solver.
+  template <typename S>
+  static S apply_row(const SystemRow &row,
+                     const Array3D<S> &pressure,
+                     const Index3D &ind) {
+    S pressure_center = pressure[ind];
+    S res = 0;
+    for (int k = 0; k < 6; k++) {
+      CellType type = row.get_neighbour_cell_type(k);
+      if (type == INTERIOR) {
+        res += pressure_center - pressure[ind + neighbour6_3d[k]];
+      } else if (type == DIRICHLET) {
+        res += pressure_center;
       }
     }
+    return res;
   }
 
-  void damped_jacobi(const System &system,
-                     const Array &residual,
-                     Array &pressure,
-                     int rounds) {
-    for (int i = 0; i < rounds; i++) {
-      for (int c = 0; c < 2; c++) {
-        parallel_for_each_cell(pressure, 128, [&](const Index3D &ind) {
-          int sum = ind.i + ind.j + ind.k;
-          if ((sum) % 2 == c) {
-            if (system[ind].inv_numerator > 0) {
-              real res = residual[ind];
-              for (int k = 0; k < 6; k++) {
-                Vector3i offset = neighbour6_3d[k];
-                if (system[ind].get_neighbour_cell_type(k) == INTERIOR) {
-                  res += pressure[ind + offset];
-                }
-              }
-              real delta = res * system[ind].inv_numerator - pressure[ind];
-              pressure[ind] += delta * 0.666666666667f;
-            } else {
-              pressure[ind] = 0.0_f;
-            }
-          }
-        });
+  // Same, for a regular cell at data offset |c| of an array with strides
+  // |sx| and |sy| along x and y
+  template <typename S>
+  static TC_FORCE_INLINE S apply_regular(const S *p, int c, int sx, int sy) {
+    S pressure_center = p[c];
+    S res = 0;
+    res += pressure_center - p[c + 1];
+    res += pressure_center - p[c - 1];
+    res += pressure_center - p[c + sy];
+    res += pressure_center - p[c - sy];
+    res += pressure_center - p[c + sx];
+    res += pressure_center - p[c - sx];
+    return res;
+  }
+
+  // residual + the sum of the interior neighbours, in the order of
+  // neighbour6_3d
+  static real gather_row(const SystemRow &row,
+                         real residual,
+                         const Array &pressure,
+                         const Index3D &ind) {
+    real res = residual;
+    for (int k = 0; k < 6; k++) {
+      if (row.get_neighbour_cell_type(k) == INTERIOR) {
+        res += pressure[ind + neighbour6_3d[k]];
       }
     }
+    return res;
   }
 
-  void apply_L(const System &system, const Array &pressure, Array &output) {
-    for (auto &ind : pressure.get_region()) {
-      if (system[ind].inv_numerator == 0.0_f) {
-        output[ind] = 0.0_f;
-        continue;
+  static TC_FORCE_INLINE real gather_regular(real residual, const real *p,
+                                             int c, int sx, int sy) {
+    real res = residual;
+    res += p[c + 1];
+    res += p[c - 1];
+    res += p[c + sy];
+    res += p[c - sy];
+    res += p[c + sx];
+    res += p[c - sx];
+    return res;
+  }
+
+  // Vector operations of the conjugate gradient solvers on the finest
+  // level, in parallel over x slices. Reductions combine the results of
+  // the slices in order, so they do not depend on the number of threads.
+  template <typename F>
+  std::vector<double> reduce_slices(const F &f) const {
+    const int slice = res[1] * res[2];
+    std::vector<double> partial(res[0]);
+    ThreadedTaskManager::run(res[0], num_threads, [&](int x) {
+      partial[x] = f(x * slice, (x + 1) * slice);
+    });
+    return partial;
+  }
+
+  static double sum(const std::vector<double> &partial) {
+    double ret = 0;
+    for (auto v : partial) {
+      ret += v;
+    }
+    return ret;
+  }
+
+  static real max(const std::vector<double> &partial) {
+    double ret = 0;
+    for (auto v : partial) {
+      ret = std::max(ret, v);
+    }
+    return (real)ret;
+  }
+
+  template <typename S>
+  double dot(const Array3D<S> &a, const Array3D<S> &b) const {
+    return sum(reduce_slices([&](int begin, int end) {
+      double ret = 0;
+      for (int i = begin; i < end; i++) {
+        ret += a.data[i] * b.data[i];
       }
-      real pressure_center = pressure[ind];
-      real res = 0.0_f;
-      for (int k = 0; k < 6; k++) {
-        Vector3i offset = neighbour6_3d[k];
-        CellType type = system[ind].get_neighbour_cell_type(k);
-        if (type == INTERIOR) {
-          res += pressure_center - pressure[ind + offset];
-        } else if (type == DIRICHLET) {
-          res += pressure_center;
+      return ret;
+    }));
+  }
+
+  // z = L p, returning the dot product of p and z
+  template <typename S>
+  double apply_L_dot(const Array3D<S> &p, Array3D<S> &z) {
+    apply_L(0, p, z);
+    return dot(p, z);
+  }
+
+  // r += alpha z, removing the mean of r if the system has a null space;
+  // returns max |r|
+  template <typename S>
+  real update_residual(Array3D<S> &r, S alpha, const Array3D<S> &z) {
+    auto r_data = r.data.data();
+    auto z_data = z.data.data();
+    if (!has_null_space) {
+      return max(reduce_slices([&](int begin, int end) {
+        S ret = 0;
+        for (int i = begin; i < end; i++) {
+          r_data[i] += alpha * z_data[i];
+          ret = std::max(ret, std::abs(r_data[i]));
         }
-      }
-      output[ind] = res;
+        return ret;
+      }));
     }
+    S mean = (S)(sum(reduce_slices([&](int begin, int end) {
+                   double ret = 0;
+                   for (int i = begin; i < end; i++) {
+                     r_data[i] += alpha * z_data[i];
+                     ret += r_data[i];
+                   }
+                   return ret;
+                 })) /
+                 r.get_size());
+    return max(reduce_slices([&](int begin, int end) {
+      S ret = 0;
+      for (int i = begin; i < end; i++) {
+        r_data[i] -= mean;
+        ret = std::max(ret, std::abs(r_data[i]));
+      }
+      return ret;
+    }));
   }
 
-  void compute_residual(const System &system,
-                        const Array &pressure,
-                        const Array &div,
-                        Array &residual) {
-    parallel_for_each_cell(residual, 128, [&](const Index3D &ind) {
-      if (system[ind].inv_numerator == 0) {
-        residual[ind] = 0.0_f;
+  // x += alpha p, then p = z + beta p, in one pass
+  template <typename S>
+  void update_solution_and_direction(Array3D<S> &x,
+                                     S alpha,
+                                     Array3D<S> &p,
+                                     const Array3D<S> &z,
+                                     S beta) {
+    auto x_data = x.data.data();
+    auto p_data = p.data.data();
+    auto z_data = z.data.data();
+    reduce_slices([&](int begin, int end) {
+      for (int i = begin; i < end; i++) {
+        x_data[i] += alpha * p_data[i];
+        p_data[i] = z_data[i] + beta * p_data[i];
+      }
+      return 0.0;
+    });
+  }
+
+  // Preconditioned conjugate gradient, with |precondition(r)| returning
+  // the approximate solution of L z = r
+  template <typename S, typename P>
+  void conjugate_gradient(const Array3D<S> &residual,
+                          Array3D<S> &pressure,
+                          real pressure_tolerance,
+                          const char *name,
+                          const P &precondition) {
+    // pressure is the initial guess
+    Array3D<S> r(res), z(res);
+    compute_residual(0, pressure, residual, r);
+    double nu = p_abs_max(r, num_threads);
+    last_iterations = 0;
+    if (nu < pressure_tolerance)
+      return;
+    Array3D<S> p = precondition(r);
+    double rho = dot(p, r);
+    for (int count = 0; count <= maximum_iterations; count++) {
+      double sigma = apply_L_dot(p, z);
+      double alpha = rho / std::max(1e-20, sigma);
+      nu = update_residual(r, -(S)alpha, z);
+      last_iterations = count + 1;
+      TC_STAT("poisson_cg_iterations", 1);
+      printf(" %s iteration #%02d, nu=%f\n", name, count, nu);
+      if (nu < pressure_tolerance || count == maximum_iterations) {
+        pressure.add_in_place((S)alpha, p);
         return;
       }
-      real pressure_center = pressure[ind];
-      real res = 0.0_f;
-      for (int k = 0; k < 6; k++) {
-        Vector3i offset = neighbour6_3d[k];
-        CellType type = system[ind].get_neighbour_cell_type(k);
-        if (type == INTERIOR) {
-          res += pressure_center - pressure[ind + offset];
-        } else if (type == DIRICHLET) {
-          res += pressure_center;
+      z = precondition(r);
+      double rho_new = dot(z, r);
+      double beta = rho_new / rho;
+      rho = rho_new;
+      update_solution_and_direction(pressure, (S)alpha, p, z, (S)beta);
+    }
+  }
+
+  bool get_has_null_space() {
+    return has_null_space;
+  }
+
+  // Red-black Gauss-Seidel, or with |damped| the red-black damped Jacobi
+  // of damped_jacobi(), on z-lines [y_begin, y_end) of slice x
+  template <bool damped>
+  TC_MULTIVERSIONED void smooth_slice(int level,
+                                      int color,
+                                      int x,
+                                      int y_begin,
+                                      int y_end,
+                                      const Array &residual,
+                                      Array &pressure) const {
+    const real weight = 0.666666666667f;
+    const System &system = systems[level];
+    const int sx = pressure.get_res()[1] * pressure.get_res()[2];
+    const int sy = pressure.get_res()[2];
+    const real *r = residual.data.data();
+    real *p = pressure.data.data();
+    // 1 / 6, as computed for the rows of regular cells
+    const real inv_regular = 1.0_f / 6.0_f;
+    auto regular = [&](int x, int y, int z) {
+      int o = x * sx + y * sy + z;
+      real target = gather_regular(r[o], p, o, sx, sy) * inv_regular;
+      if (damped) {
+        p[o] += (target - p[o]) * weight;
+      } else {
+        p[o] = target;
+      }
+    };
+    auto general = [&](int x, int y, int z) {
+      Index3D ind(x, y, z);
+      const SystemRow &row = system[ind];
+      if (row.inv_numerator > 0) {
+        real target =
+            gather_row(row, residual[ind], pressure, ind) * row.inv_numerator;
+        if (damped) {
+          pressure[ind] += (target - pressure[ind]) * weight;
+        } else {
+          pressure[ind] = target;
         }
+      } else {
+        pressure[ind] = 0.0_f;
+      }
+    };
+    for (int y = y_begin; y < y_end; y++) {
+      for_each_cell_in_line(level, x, y, color, regular, general);
+    }
+  }
+
+  // |rounds| smoothing rounds in one temporally blocked traversal. With
+  // |correction|, the coarse correction is prolongated to |pressure|
+  // first; with |coarse_residual|, the residual of the result is
+  // restricted to it afterwards. The result is the same as that of the
+  // separate passes, in the same order.
+  template <bool damped>
+  void smooth(int level,
+              const Array &residual,
+              Array &pressure,
+              int rounds,
+              const Array *correction = nullptr,
+              Array *coarse_residual = nullptr) {
+    const int first_sweep = correction ? 1 : 0;
+    const int num_stages = first_sweep + 2 * rounds + (coarse_residual ? 1 : 0);
+    for_each_stage(level, num_stages, parallel_side, [&](int s, int x,
+                                                         int y_begin,
+                                                         int y_end) {
+      if (s < first_sweep) {
+        prolongate_slice(level, x, y_begin, y_end, pressure, *correction);
+      } else if (s < first_sweep + 2 * rounds) {
+        smooth_slice<damped>(level, (s - first_sweep) % 2, x, y_begin, y_end,
+                             residual, pressure);
+      } else if (x % 2 == 1) {
+        // Coarse slice x / 2 reads fine slices x - 2 to x + 1
+        restrict_slice(level + 1, x / 2, y_begin / 2, (y_end + 1) / 2,
+                       pressure, residual, *coarse_residual);
       }
-      residual[ind] = div[ind] - res;
     });
   }
 
-  void downsample(const System &system,
-                  const Array &x,
-                  Array &x_downsampled) {  // Restriction
-    for (auto &ind : x_downsampled.get_region()) {
-      if (system[ind].inv_numerator > 0) {
-        x_downsampled[ind] = x[ind.i * 2 + 0][ind.j * 2 + 0][ind.k * 2 + 0] +
-                             x[ind.i * 2 + 0][ind.j * 2 + 0][ind.k * 2 + 1] +
-                             x[ind.i * 2 + 0][ind.j * 2 + 1][ind.k * 2 + 0] +
-                             x[ind.i * 2 + 0][ind.j * 2 + 1][ind.k * 2 + 1] +
-                             x[ind.i * 2 + 1][ind.j * 2 + 0][ind.k * 2 + 0] +
-                             x[ind.i * 2 + 1][ind.j * 2 + 0][ind.k * 2 + 1] +
-                             x[ind.i * 2 + 1][ind.j * 2 + 1][ind.k * 2 + 0] +
-                             x[ind.i * 2 + 1][ind.j * 2 + 1][ind.k * 2 + 1];
+  void gauss_seidel(int level,
+                    const Array &residual,
+                    Array &pressure,
+                    int rounds) {
+    smooth<false>(level, residual, pressure, rounds);
+  }
+
+  void damped_jacobi(int level,
+                     const Array &residual,
+                     Array &pressure,
+                     int rounds) {
+    smooth<true>(level, residual, pressure, rounds);
+  }
+
+  template <typename S>
+  void apply_L(int level, const Array3D<S> &pressure, Array3D<S> &output) {
+    const System &system = systems[level];
+    const int sx = pressure.get_res()[1] * pressure.get_res()[2];
+    const int sy = pressure.get_res()[2];
+    const S *p = pressure.data.data();
+    S *out = output.data.data();
+    for_each_cell(
+        level, -1, parallel_side,
+        [&](int x, int y, int z) {
+          int o = x * sx + y * sy + z;
+          out[o] = apply_regular(p, o, sx, sy);
+        },
+        [&](int x, int y, int z) {
+          Index3D ind(x, y, z);
+          const SystemRow &row = system[ind];
+          output[ind] = row.inv_numerator == 0.0_f
+                            ? S(0)
+                            : apply_row(row, pressure, ind);
+        });
+  }
+
+  template <typename S>
+  void compute_residual(int level,
+                        const Array3D<S> &pressure,
+                        const Array3D<S> &div,
+                        Array3D<S> &residual) {
+    const System &system = systems[level];
+    const int sx = pressure.get_res()[1] * pressure.get_res()[2];
+    const int sy = pressure.get_res()[2];
+    const S *p = pressure.data.data();
+    const S *d = div.data.data();
+    S *out = residual.data.data();
+    for_each_cell(
+        level, -1, parallel_side,
+        [&](int x, int y, int z) {
+          int o = x * sx + y * sy + z;
+          out[o] = d[o] - apply_regular(p, o, sx, sy);
+        },
+        [&](int x, int y, int z) {
+          Index3D ind(x, y, z);
+          const SystemRow &row = system[ind];
+          residual[ind] = row.inv_numerator == 0
+                              ? S(0)
+                              : div[ind] - apply_row(row, pressure, ind);
+        });
+  }
+
+  // Restriction to |level| >= 1 of the residual div - L pressure of the
+  // finer level, on z-lines [y_begin, y_end) of slice x. The children are
+  // summed in the same order as a restriction of the stored residual.
+  void restrict_slice(int level,
+                      int x,
+                      int y_begin,
+                      int y_end,
+                      const Array &pressure,
+                      const Array &div,
+                      Array &coarse) const {
+    const System &system = systems[level];
+    const System &fine = systems[level - 1];
+    const int sx = pressure.get_res()[1] * pressure.get_res()[2];
+    const int sy = pressure.get_res()[2];
+    const real *p = pressure.data.data();
+    auto residual = [&](int i, int j, int k) -> real {
+      const SystemRow &row = fine[i][j][k];
+      if (row.inv_numerator == 0) {
+        return 0.0_f;
+      }
+      if (row.neighbours == 0) {
+        int o = i * sx + j * sy + k;
+        return div.data[o] - apply_regular(p, o, sx, sy);
+      }
+      return div[i][j][k] - apply_row(row, pressure, Index3D(i, j, k));
+    };
+    auto restrict_cell = [&](int i, int j, int k) {
+      if (system[i][j][k].inv_numerator > 0) {
+        real sum = residual(i * 2 + 0, j * 2 + 0, k * 2 + 0);
+        sum += residual(i * 2 + 0, j * 2 + 0, k * 2 + 1);
+        sum += residual(i * 2 + 0, j * 2 + 1, k * 2 + 0);
+        sum += residual(i * 2 + 0, j * 2 + 1, k * 2 + 1);
+        sum += residual(i * 2 + 1, j * 2 + 0, k * 2 + 0);
+        sum += residual(i * 2 + 1, j * 2 + 0, k * 2 + 1);
+        sum += residual(i * 2 + 1, j * 2 + 1, k * 2 + 0);
+        sum += residual(i * 2 + 1, j * 2 + 1, k * 2 + 1);
+        coarse[i][j][k] = sum;
       } else {
-        x_downsampled[ind] = 0.0_f;
+        coarse[i][j][k] = 0.0_f;
       }
+    };
+    for (int y = y_begin; y < y_end; y++) {
+      for_each_cell_in_line(level, x, y, -1, restrict_cell, restrict_cell);
     }
   }
 
-  void prolongate(const System &system, Array &x, const Array &x_delta) const {
-    for (auto &ind : x.get_region()) {
+  void prolongate_slice(int level,
+                        int x,
+                        int y_begin,
+                        int y_end,
+                        Array &pressure,
+                        const Array &x_delta) const {
+    const System &system = systems[level];
+    auto interpolate = [&](int i, int j, int k) {
       // Do not prolongate to cells without a degree of freedom
-      if (system[ind].inv_numerator > 0) {
-        x[ind] += x_delta[ind.i / 2][ind.j / 2][ind.k / 2] * 0.5f;
+      if (system[i][j][k].inv_numerator > 0) {
+        pressure[i][j][k] += x_delta[i / 2][j / 2][k / 2] * 0.5f;
       }
+    };
+    for (int y = y_begin; y < y_end; y++) {
+      for_each_cell_in_line(level, x, y, -1, interpolate, interpolate);
     }
   }
 
+  // One V-cycle. The pre-smoothing and the residual restriction, and the
+  // prolongation and the post-smoothing, are fused into one traversal
+  // each.
   void run(int level) {
+    if (level == 0) {
+      TC_STAT("poisson_v_cycles", 1);
+    }
     if (use_as_preconditioner)
       pressures[level].reset(0.0_f);
     if (residuals[level].get_size() <= size_threshold) {  // 4 * 4 * 4
-      gauss_seidel(systems[level], residuals[level], pressures[level], 100);
+      gauss_seidel(level, residuals[level], pressures[level], 100);
     } else {
-      gauss_seidel(systems[level], residuals[level], pressures[level], 4);
-      {
-        compute_residual(systems[level], pressures[level], residuals[level],
-                         tmp_residuals[level]);
-        downsample(systems[level + 1], tmp_residuals[level],
-                   residuals[level + 1]);
-        run(level + 1);
-        prolongate(systems[level], pressures[level], pressures[level + 1]);
-      }
-      gauss_seidel(systems[level], residuals[level], pressures[level], 4);
+      smooth<false>(level, residuals[level], pressures[level], 4, nullptr,
+                    &residuals[level + 1]);
+      run(level + 1);
+      smooth<false>(level, residuals[level], pressures[level], 4,
+                    &pressures[level + 1]);
     }
   }
 
@@ -372,14 +864,16 @@ class MultigridPoissonSolver3D : public PoissonSolver3D {
     pressures[0] = pressure;
     residuals[0] = residual;
     int iterations = 0;
+    real residual_max;
     do {
       iterations++;
       run(0);
-      compute_residual(systems[0], pressures[0], residuals[0],
-                       tmp_residuals[0]);
+      compute_residual(0, pressures[0], residuals[0], tmp_residuals[0]);
+      residual_max = p_abs_max(tmp_residuals[0], num_threads);
       TC_P(iterations);
-      TC_P(tmp_residuals[0].abs_max());
-    } while (tmp_residuals[0].abs_max() > pressure_tolerance);
+      TC_P(residual_max);
+    } while (residual_max > pressure_tolerance);
+    last_iterations = iterations;
     pressure = pressures[0];
   }
 };
@@ -397,45 +891,24 @@ class CGPoissonSolver3D : public MultigridPoissonSolver3D {
   virtual void run(const Array &residual,
                    Array &pressure,
                    real pressure_tolerance) {
-    pressure = 0;
-    Array r(res), mu(res), tmp(res);
-    mu = has_null_space ? r.get_average() : 0;
-    r = residual - mu;  // TODO: r = r - Lx
-    double nu = r.abs_max();
-    if (nu < pressure_tolerance)
-      return;
-    Array p = apply_preconditioner(r);
-    double rho = p.dot_double(r);
-    Array z(res);
-    for (int count = 0; count <= maximum_iterations; count++) {
-      apply_L(systems[0], p, z);
-      double sigma = p.dot_double(z);
-      double alpha = rho / max(1e-20, sigma);
-      r.add_in_place(-(real)alpha, z);
-      mu = has_null_space ? r.get_average() : 0.0_f;
-      r -= mu;
-      nu = r.abs_max();
-      r.print_abs_max_pos();
-      printf(" CG iteration #%02d, nu=%f\n", count, nu);
-      if (nu < pressure_tolerance || count == maximum_iterations) {
-        pressure.add_in_place((real)alpha, p);
-        return;
-      }
-      z = apply_preconditioner(r);
-      double rho_new = z.dot_double(r);
-      double beta = rho_new / rho;
-      rho = rho_new;
-      pressure.add_in_place((real)alpha, p);
-      p = z.add((real)beta, p);
-    }
+    conjugate_gradient(residual, pressure, pressure_tolerance, "CG",
+                       [&](Array &r) { return apply_preconditioner(r); });
   }
 };
 
+// With 'mixed_precision', the conjugate gradient keeps its solution,
+// residual and directions in float64, while the V-cycles of the
+// preconditioner run on the |real| levels: the preconditioner only needs
+// to be approximate, but the residual of the outer iteration then does not
+// stall at the round-off of |real|, and reaches tolerances below it.
 class MultigridPCGPoissonSolver3D : public MultigridPoissonSolver3D {
  public:
+  bool mixed_precision;
+
   void initialize(const Config &config) {
     MultigridPoissonSolver3D::initialize(config);
     use_as_preconditioner = true;
+    mixed_precision = config.get("mixed_precision", false);
   }
 
   Array apply_preconditioner(Array &r) {
@@ -449,37 +922,24 @@ class MultigridPCGPoissonSolver3D : public MultigridPoissonSolver3D {
                    Array &pressure,
                    real pressure_tolerance) {
     TC_P(residual.sum());
-    pressure = 0;
-    Array r(res), mu(res), tmp(res);
-    mu = has_null_space ? r.get_average() : 0;
-    r = residual - mu;  // TODO: r = r - Lx
-    double nu = r.abs_max();
-    if (nu < pressure_tolerance)
+    if (!mixed_precision) {
+      conjugate_gradient(residual, pressure, pressure_tolerance, "MGPCG",
+                         [&](Array &r) { return apply_preconditioner(r); });
       return;
-    Array p = apply_preconditioner(r);
-    double rho = p.dot_double(r);
-    Array z(res);
-    for (int count = 0; count <= maximum_iterations; count++) {
-      apply_L(systems[0], p, z);
-      double sigma = p.dot_double(z);
-      double alpha = rho / max(1e-20, sigma);
-      r.add_in_place(-(real)alpha, z);
-      mu = has_null_space ? r.get_average() : 0.0_f;
-      r -= mu;
-      nu = r.abs_max();
-      r.print_abs_max_pos();
-      printf(" MGPCG iteration #%02d, nu=%f\n", count, nu);
-      if (nu < pressure_tolerance || count == maximum_iterations) {
-        pressure.add_in_place((real)alpha, p);
-        return;
-      }
-      z = apply_preconditioner(r);
-      double rho_new = z.dot_double(r);
-      double beta = rho_new / rho;
-      rho = rho_new;
-      pressure.add_in_place((real)alpha, p);
-      p = z.add((real)beta, p);
     }
+    using Array64 = Array3D<float64>;
+    Array64 b(res), x(res);
+    p_copy(residual, b, num_threads);
+    p_copy(pressure, x, num_threads);
+    conjugate_gradient(b, x, pressure_tolerance, "MGPCG", [&](Array64 &r) {
+      p_copy(r, residuals[0], num_threads);
+      pressures[0] = 0;
+      MultigridPoissonSolver3D::run(0);
+      Array64 z(res);
+      p_copy(pressures[0], z, num_threads);
+      return z;
+    });
+    p_copy(x, pressure, num_threads);
   }
 };
 
@@ -0,0 +1,85 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#include <taichi/dynamics/poisson_solver.h>
+
+#if defined(TC_USE_CUDA)
+
+#include <taichi/system/statistics.h>
+#include "poisson_solver3d_cuda.h"
+#include <algorithm>
+#include <cstring>
+#include <type_traits>
+
+TC_NAMESPACE_BEGIN
+
+// MGPCG on the GPU, with the system of "mgpcg". The levels, the boundary
+// condition and the vectors stay on the device between solves; a solve
+// copies the right-hand side and the initial guess in and the solution
+// out, and boundaries are uploaded only when they change.
+class MultigridPCGPoissonSolver3DCUDA : public PoissonSolver3D {
+ public:
+  Vector3i res;
+  bool neumann_padding;
+  bool has_null_space = false;
+  BCArray boundary;
+  CUDAMultigridPCG3D device;
+  // Conversions to the float32 of the device, in builds where real is not
+  std::vector<float32> b_staging, x_staging;
+
+  void initialize(const Config &config) override {
+    PoissonSolver3D::initialize(config);
+    res = config.get<Vector3i>("res");
+    auto padding_name = config.get<std::string>("padding");
+    TC_ERROR_IF(padding_name != "dirichlet" && padding_name != "neumann",
+                "'padding' has to be 'dirichlet' or 'neumann' instead of " +
+                    padding_name);
+    neumann_padding = padding_name == "neumann";
+    int device_res[3] = {res[0], res[1], res[2]};
+    TC_ERROR_IF(!device.initialize(device_res, neumann_padding, 64),
+                "mgpcg_cuda: the resolution has to stay even on every level");
+  }
+
+  void set_boundary_condition(const BCArray &boundary) override {
+    TC_ASSERT_INFO(boundary.get_res() == res,
+                   "Boundary condition does not match the solver");
+    if (this->boundary.get_res() == res &&
+        std::memcmp(boundary.data.data(), this->boundary.data.data(),
+                    boundary.get_size() * sizeof(CellType)) == 0) {
+      return;
+    }
+    this->boundary = boundary;
+    device.set_boundary_condition(boundary.data.data());
+    bool has_dirichlet = false;
+    for (int i = 0; i < boundary.get_size(); i++) {
+      has_dirichlet = has_dirichlet || boundary.data[i] == DIRICHLET;
+    }
+    has_null_space = neumann_padding && !has_dirichlet;
+  }
+
+  void run(const Array &b, Array &x, real tolerance) override {
+    if (std::is_same<real, float32>::value) {
+      last_iterations = device.solve(
+          reinterpret_cast<const float32 *>(b.data.data()),
+          reinterpret_cast<float32 *>(x.data.data()), (float32)tolerance,
+          maximum_iterations, has_null_space);
+    } else {
+      b_staging.assign(b.data.begin(), b.data.end());
+      x_staging.assign(x.data.begin(), x.data.end());
+      last_iterations =
+          device.solve(b_staging.data(), x_staging.data(), (float32)tolerance,
+                       maximum_iterations, has_null_space);
+      std::copy(x_staging.begin(), x_staging.end(), x.data.begin());
+    }
+    TC_STAT("poisson_cg_iterations", last_iterations);
+  }
+};
+
+TC_IMPLEMENTATION(PoissonSolver3D, MultigridPCGPoissonSolver3DCUDA,
+                  "mgpcg_cuda");
+
+TC_NAMESPACE_END
+
+#endif
@@ -0,0 +1,434 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+// The multigrid of MultigridPoissonSolver3D on the device: the same cell
+// types, coarsening, red-black Gauss-Seidel smoother, restriction (sum of
+// the eight children) and prolongation (half the coarse value), with the
+// operator decoded from the cell types on the fly instead of stored rows.
+
+#include "poisson_solver3d_cuda.h"
+#include <taichi_gpu/math/util.cuh>
+#include <cuda_runtime.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+
+namespace taichi {
+
+namespace {
+
+// Of PoissonSolver3D
+constexpr unsigned char interior = 0;
+constexpr unsigned char dirichlet = 1;
+constexpr unsigned char neumann = 2;
+
+constexpr int reduction_blocks = 256;
+constexpr int reduction_threads = 256;
+
+__constant__ int neighbour6[6][3] = {{0, 0, 1},  {0, 0, -1}, {0, 1, 0},
+                                     {0, -1, 0}, {1, 0, 0},  {-1, 0, 0}};
+
+// z is contiguous, and the fastest index of the threads
+dim3 cell_blocks(int3 n) {
+  return dim3((n.z + 31) / 32, (n.y + 3) / 4, (n.x + 1) / 2);
+}
+
+const dim3 cell_threads(32, 4, 2);
+
+int3 to_int3(const int res[3]) {
+  return make_int3(res[0], res[1], res[2]);
+}
+
+__device__ __forceinline__ bool get_cell(int3 n, int &i, int &j, int &k) {
+  k = blockIdx.x * blockDim.x + threadIdx.x;
+  j = blockIdx.y * blockDim.y + threadIdx.y;
+  i = blockIdx.z * blockDim.z + threadIdx.z;
+  return i < n.x && j < n.y && k < n.z;
+}
+
+__device__ __forceinline__ int index(int3 n, int i, int j, int k) {
+  return (i * n.y + j) * n.z + k;
+}
+
+__device__ __forceinline__ unsigned char cell_type(const unsigned char *cells,
+                                                   int3 n,
+                                                   int i,
+                                                   int j,
+                                                   int k,
+                                                   unsigned char padding) {
+  if (i < 0 || j < 0 || k < 0 || i >= n.x || j >= n.y || k >= n.z) {
+    return padding;
+  }
+  return cells[index(n, i, j, k)];
+}
+
+// The number of interior and Dirichlet neighbours of an interior cell, and
+// the sum of |p| over the interior ones: L p = diagonal * p - neighbours
+__device__ __forceinline__ void gather(const unsigned char *cells,
+                                       const float *p,
+                                       int3 n,
+                                       int i,
+                                       int j,
+                                       int k,
+                                       unsigned char padding,
+                                       int &diagonal,
+                                       float &neighbours) {
+  diagonal = 0;
+  neighbours = 0;
+  for (int m = 0; m < 6; m++) {
+    int ni = i + neighbour6[m][0], nj = j + neighbour6[m][1],
+        nk = k + neighbour6[m][2];
+    unsigned char type = cell_type(cells, n, ni, nj, nk, padding);
+    if (type == interior) {
+      diagonal++;
+      neighbours += p[index(n, ni, nj, nk)];
+    } else if (type == dirichlet) {
+      diagonal++;
+    }
+  }
+}
+
+// r - L p of cell (i, j, k); 0 for cells without a degree of freedom
+__device__ __forceinline__ float residual_of(const unsigned char *cells,
+                                             const float *p,
+                                             const float *r,
+                                             int3 n,
+                                             int i,
+                                             int j,
+                                             int k,
+                                             unsigned char padding) {
+  int c = index(n, i, j, k);
+  if (cells[c] != interior) {
+    return 0;
+  }
+  int diagonal;
+  float neighbours;
+  gather(cells, p, n, i, j, k, padding, diagonal, neighbours);
+  if (diagonal == 0) {
+    return 0;
+  }
+  return r[c] - (diagonal * p[c] - neighbours);
+}
+
+__global__ void smooth_kernel(const unsigned char *cells,
+                              const float *r,
+                              float *p,
+                              int3 n,
+                              unsigned char padding,
+                              int color) {
+  int i, j, k;
+  if (!get_cell(n, i, j, k) || ((i + j + k) & 1) != color) {
+    return;
+  }
+  int c = index(n, i, j, k);
+  int diagonal = 0;
+  float neighbours = 0;
+  if (cells[c] == interior) {
+    gather(cells, p, n, i, j, k, padding, diagonal, neighbours);
+  }
+  p[c] = diagonal > 0 ? (r[c] + neighbours) / diagonal : 0.0f;
+}
+
+// out = b - L p, or out = L p without |b|
+__global__ void apply_kernel(const unsigned char *cells,
+                             const float *p,
+                             const float *b,
+                             float *out,
+                             int3 n,
+                             unsigned char padding) {
+  int i, j, k;
+  if (!get_cell(n, i, j, k)) {
+    return;
+  }
+  int c = index(n, i, j, k);
+  int diagonal = 0;
+  float neighbours = 0;
+  if (cells[c] == interior) {
+    gather(cells, p, n, i, j, k, padding, diagonal, neighbours);
+  }
+  float lp = diagonal > 0 ? diagonal * p[c] - neighbours : 0.0f;
+  out[c] = b ? (diagonal > 0 ? b[c] - lp : 0.0f) : lp;
+}
+
+__global__ void restrict_kernel(const unsigned char *fine_cells,
+                                const float *fine_p,
+                                const float *fine_r,
+                                int3 fine_n,
+                                const unsigned char *cells,
+                                float *r,
+                                int3 n,
+                                unsigned char padding) {
+  int i, j, k;
+  if (!get_cell(n, i, j, k)) {
+    return;
+  }
+  float s = 0;
+  if (cells[index(n, i, j, k)] == interior) {
+    for (int c = 0; c < 8; c++) {
+      s += residual_of(fine_cells, fine_p, fine_r, fine_n, i * 2 + (c >> 2),
+                       j * 2 + ((c >> 1) & 1), k * 2 + (c & 1), padding);
+    }
+  }
+  r[index(n, i, j, k)] = s;
+}
+
+__global__ void prolongate_kernel(const unsigned char *cells,
+                                  float *p,
+                                  int3 n,
+                                  const float *coarse_p,
+                                  int3 coarse_n) {
+  int i, j, k;
+  if (!get_cell(n, i, j, k)) {
+    return;
+  }
+  int c = index(n, i, j, k);
+  if (cells[c] == interior) {
+    p[c] += coarse_p[index(coarse_n, i / 2, j / 2, k / 2)] * 0.5f;
+  }
+}
+
+// As MultigridPoissonSolver3D::coarsen_cell
+__global__ void coarsen_kernel(const unsigned char *fine_cells,
+                               int3 fine_n,
+                               unsigned char *cells,
+                               int3 n) {
+  int i, j, k;
+  if (!get_cell(n, i, j, k)) {
+    return;
+  }
+  bool has_dirichlet = false, all_neumann = true;
+  for (int c = 0; c < 8; c++) {
+    unsigned char type =
+        fine_cells[index(fine_n, i * 2 + (c >> 2), j * 2 + ((c >> 1) & 1),
+                         k * 2 + (c & 1))];
+    has_dirichlet = has_dirichlet || type == dirichlet;
+    all_neumann = all_neumann && type == neumann;
+  }
+  cells[index(n, i, j, k)] =
+      has_dirichlet ? dirichlet : (all_neumann ? neumann : interior);
+}
+
+// y += alpha * x
+__global__ void axpy_kernel(float *y, float alpha, const float *x, int size) {
+  for (int i = blockIdx.x * blockDim.x + threadIdx.x; i < size;
+       i += blockDim.x * gridDim.x) {
+    y[i] += alpha * x[i];
+  }
+}
+
+// y = x + beta * y
+__global__ void xpby_kernel(float *y, const float *x, float beta, int size) {
+  for (int i = blockIdx.x * blockDim.x + threadIdx.x; i < size;
+       i += blockDim.x * gridDim.x) {
+    y[i] = x[i] + beta * y[i];
+  }
+}
+
+__global__ void shift_kernel(float *a, float shift, int size) {
+  for (int i = blockIdx.x * blockDim.x + threadIdx.x; i < size;
+       i += blockDim.x * gridDim.x) {
+    a[i] -= shift;
+  }
+}
+
+// partials[block] = sum of a * b, of |a| if |b| is null, or max |a| with
+// |take_max|; in double, over a grid-stride range of the entries
+__global__ void reduce_kernel(const float *a,
+                              const float *b,
+                              int size,
+                              bool take_max,
+                              double *partials) {
+  __shared__ double shared[reduction_threads];
+  double v = 0;
+  for (int i = blockIdx.x * blockDim.x + threadIdx.x; i < size;
+       i += blockDim.x * gridDim.x) {
+    if (take_max) {
+      v = fmax(v, fabs((double)a[i]));
+    } else {
+      v += b ? (double)a[i] * b[i] : (double)a[i];
+    }
+  }
+  shared[threadIdx.x] = v;
+  __syncthreads();
+  for (int s = blockDim.x / 2; s > 0; s /= 2) {
+    if (threadIdx.x < s) {
+      shared[threadIdx.x] =
+          take_max ? fmax(shared[threadIdx.x], shared[threadIdx.x + s])
+                   : shared[threadIdx.x] + shared[threadIdx.x + s];
+    }
+    __syncthreads();
+  }
+  if (threadIdx.x == 0) {
+    partials[blockIdx.x] = shared[0];
+  }
+}
+
+template <typename T>
+T *device_alloc(int size) {
+  T *ptr = nullptr;
+  cudaMalloc(&ptr, sizeof(T) * size);
+  TC_CHECK_CUDA_ERROR
+  return ptr;
+}
+
+}  // namespace
+
+bool CUDAMultigridPCG3D::initialize(const int res[3],
+                                    bool neumann_padding,
+                                    int size_threshold) {
+  int n[3] = {res[0], res[1], res[2]};
+  do {
+    for (int k = 0; k < 3; k++) {
+      if (n[k] % 2 != 0) {
+        return false;
+      }
+      n[k] /= 2;
+    }
+  } while (n[0] * n[1] * n[2] * 8 >= size_threshold);
+  padding = neumann_padding ? neumann : dirichlet;
+  this->size_threshold = size_threshold;
+  std::copy(res, res + 3, n);
+  num_cells = n[0] * n[1] * n[2];
+  do {
+    int size = n[0] * n[1] * n[2];
+    Level level;
+    for (int k = 0; k < 3; k++) {
+      level.res[k] = n[k];
+      n[k] /= 2;
+    }
+    level.cells = device_alloc<unsigned char>(size);
+    level.p = device_alloc<float>(size);
+    level.r = device_alloc<float>(size);
+    cudaMemset(level.cells, interior, size);
+    levels.push_back(level);
+  } while (n[0] * n[1] * n[2] * 8 >= size_threshold);
+  for (float **v : {&b, &x, &r, &z, &d, &q}) {
+    *v = device_alloc<float>(num_cells);
+  }
+  partials = device_alloc<double>(reduction_blocks);
+  return true;
+}
+
+CUDAMultigridPCG3D::~CUDAMultigridPCG3D() {
+  for (auto &level : levels) {
+    cudaFree(level.cells);
+    cudaFree(level.p);
+    cudaFree(level.r);
+  }
+  for (float *v : {b, x, r, z, d, q}) {
+    cudaFree(v);
+  }
+  cudaFree(partials);
+}
+
+void CUDAMultigridPCG3D::set_boundary_condition(const unsigned char *cells) {
+  cudaMemcpy(levels[0].cells, cells, num_cells, cudaMemcpyHostToDevice);
+  for (int l = 1; l < (int)levels.size(); l++) {
+    int3 n = to_int3(levels[l].res);
+    coarsen_kernel<<<cell_blocks(n), cell_threads>>>(
+        levels[l - 1].cells, to_int3(levels[l - 1].res), levels[l].cells, n);
+  }
+  TC_CHECK_CUDA_ERROR
+}
+
+// As MultigridPoissonSolver3D::run(level) used as a preconditioner, from a
+// zero guess; the finest level reads |rhs| and writes |out|
+void CUDAMultigridPCG3D::v_cycle(int l, const float *rhs, float *out) {
+  const Level &level = levels[l];
+  int3 n = to_int3(level.res);
+  int size = n.x * n.y * n.z;
+  cudaMemsetAsync(out, 0, sizeof(float) * size);
+  auto smooth = [&](int rounds) {
+    for (int i = 0; i < rounds * 2; i++) {
+      smooth_kernel<<<cell_blocks(n), cell_threads>>>(level.cells, rhs, out, n,
+                                                      padding, i % 2);
+    }
+  };
+  if (size <= size_threshold || l + 1 == (int)levels.size()) {
+    smooth(100);
+    return;
+  }
+  const Level &coarse = levels[l + 1];
+  int3 coarse_n = to_int3(coarse.res);
+  smooth(4);
+  restrict_kernel<<<cell_blocks(coarse_n), cell_threads>>>(
+      level.cells, out, rhs, n, coarse.cells, coarse.r, coarse_n, padding);
+  v_cycle(l + 1, coarse.r, coarse.p);
+  prolongate_kernel<<<cell_blocks(n), cell_threads>>>(level.cells, out, n,
+                                                      coarse.p, coarse_n);
+  smooth(4);
+}
+
+double CUDAMultigridPCG3D::dot(const float *a, const float *b) {
+  reduce_kernel<<<reduction_blocks, reduction_threads>>>(a, b, num_cells,
+                                                         false, partials);
+  double host[reduction_blocks];
+  cudaMemcpy(host, partials, sizeof(host), cudaMemcpyDeviceToHost);
+  double ret = 0;
+  for (int i = 0; i < reduction_blocks; i++) {
+    ret += host[i];
+  }
+  return ret;
+}
+
+double CUDAMultigridPCG3D::sum(const float *a) {
+  return dot(a, nullptr);
+}
+
+float CUDAMultigridPCG3D::abs_max(const float *a) {
+  reduce_kernel<<<reduction_blocks, reduction_threads>>>(a, nullptr, num_cells,
+                                                         true, partials);
+  double host[reduction_blocks];
+  cudaMemcpy(host, partials, sizeof(host), cudaMemcpyDeviceToHost);
+  return (float)*std::max_element(host, host + reduction_blocks);
+}
+
+// As MultigridPoissonSolver3D::conjugate_gradient
+int CUDAMultigridPCG3D::solve(const float *b_host,
+                              float *x_host,
+                              float tolerance,
+                              int maximum_iterations,
+                              bool has_null_space) {
+  const int vector_blocks = reduction_blocks, vector_threads = 256;
+  const Level &finest = levels[0];
+  int3 n = to_int3(finest.res);
+  cudaMemcpy(b, b_host, sizeof(float) * num_cells, cudaMemcpyHostToDevice);
+  cudaMemcpy(x, x_host, sizeof(float) * num_cells, cudaMemcpyHostToDevice);
+  apply_kernel<<<cell_blocks(n), cell_threads>>>(finest.cells, x, b, r, n,
+                                                 padding);
+  int iterations = 0;
+  float nu = abs_max(r);
+  if (nu >= tolerance) {
+    v_cycle(0, r, d);
+    double rho = dot(d, r);
+    for (int count = 0; count <= maximum_iterations; count++) {
+      apply_kernel<<<cell_blocks(n), cell_threads>>>(finest.cells, d, nullptr,
+                                                     q, n, padding);
+      double sigma = dot(d, q);
+      float alpha = (float)(rho / std::max(1e-20, sigma));
+      axpy_kernel<<<vector_blocks, vector_threads>>>(r, -alpha, q, num_cells);
+      if (has_null_space) {
+        shift_kernel<<<vector_blocks, vector_threads>>>(
+            r, (float)(sum(r) / num_cells), num_cells);
+      }
+      nu = abs_max(r);
+      iterations = count + 1;
+      axpy_kernel<<<vector_blocks, vector_threads>>>(x, alpha, d, num_cells);
+      if (nu < tolerance || count == maximum_iterations) {
+        break;
+      }
+      v_cycle(0, r, z);
+      double rho_new = dot(z, r);
+      float beta = (float)(rho_new / rho);
+      rho = rho_new;
+      xpby_kernel<<<vector_blocks, vector_threads>>>(d, z, beta, num_cells);
+    }
+  }
+  cudaMemcpy(x_host, x, sizeof(float) * num_cells, cudaMemcpyDeviceToHost);
+  TC_CHECK_CUDA_ERROR
+  return iterations;
+}
+
+}  // namespace taichi
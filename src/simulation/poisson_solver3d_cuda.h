@@ -0,0 +1,67 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+// Device side of the "mgpcg_cuda" PoissonSolver3D. Host code includes this
+// header and nvcc compiles its implementation without the taichi headers,
+// so only plain types appear here; the device works in float32.
+
+#include <vector>
+
+namespace taichi {
+
+class CUDAMultigridPCG3D {
+ public:
+  // Allocates the levels on the device, halving |res| until a level has
+  // fewer than |size_threshold| / 8 cells. Returns false, allocating
+  // nothing, if |res| is odd on some level.
+  bool initialize(const int res[3], bool neumann_padding, int size_threshold);
+
+  ~CUDAMultigridPCG3D();
+
+  // Cell types of PoissonSolver3D, as an array of res[0] * res[1] * res[2]
+  // bytes in the order of Array3D; coarsened on the device
+  void set_boundary_condition(const unsigned char *cells);
+
+  // Solves L x = b from the initial guess |x| to max |residual| <
+  // |tolerance|, by conjugate gradient preconditioned with one V-cycle.
+  // With |has_null_space|, the mean is removed from the residual. Returns
+  // the number of iterations.
+  int solve(const float *b,
+            float *x,
+            float tolerance,
+            int maximum_iterations,
+            bool has_null_space);
+
+ private:
+  struct Level {
+    int res[3];
+    unsigned char *cells;
+    // Solution and right-hand side of the V-cycle
+    float *p, *r;
+  };
+
+  void v_cycle(int level, const float *rhs, float *out);
+
+  double dot(const float *a, const float *b);
+
+  float abs_max(const float *a);
+
+  double sum(const float *a);
+
+  std::vector<Level> levels;
+  unsigned char padding;
+  int size_threshold;
+  int num_cells = 0;
+  // Vectors of the conjugate gradient, on the finest level, kept on the
+  // device between solves
+  float *b = nullptr, *x = nullptr, *r = nullptr, *z = nullptr,
+        *d = nullptr, *q = nullptr;
+  // Per-block results of reductions, summed on the host in order
+  double *partials = nullptr;
+};
+
+}  // namespace taichi
@@ -0,0 +1,239 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#include <taichi/dynamics/simulation.h>
+#include <taichi/dynamics/broad_phase.h>
+#include <taichi/system/threading.h>
+#include <taichi/visualization/particle_visualization.h>
+#include <Eigen/Geometry>
+
+TC_NAMESPACE_BEGIN
+
+// Piles of rigid debris, as spheres with discrete element contacts: linear
+// spring-dashpot normal forces, set from the contact duration and the
+// restitution, and Coulomb friction with a viscous regularization. Bodies
+// are stored as structures of arrays and integrated in parallel. Contact
+// candidates come from a sweep and prune broad phase, and every body
+// gathers the forces of its own contacts, so that the force pass is
+// parallel and free of races. Bodies also collide with the level set of the
+// simulation, if one is set; positions are in the units of its cells.
+class RigidBodyPile : public Simulation3D {
+ protected:
+  // Bodies, as structures of arrays
+  std::vector<Vector3> positions, velocities, angular_velocities, colors;
+  // Plain quaternions, as Rotation<3> needs if constexpr
+  std::vector<Eigen::Quaternion<real>> orientations;
+  std::vector<real> radii, inv_masses, inv_inertias;
+  std::vector<Vector3> forces, torques;
+
+  SweepAndPrune<3> broad_phase;
+  std::vector<Vector3> lower, upper;
+  std::vector<SweepAndPrune<3>::Pair> pairs;
+  // The bodies touching body i are contacts[contact_begin[i]] to
+  // contacts[contact_begin[i + 1] - 1]
+  std::vector<int> contact_begin, contacts;
+
+  Vector3 gravity;
+  real delta_t;
+  real density;
+  real contact_time;
+  real restitution;
+  real friction;
+
+ public:
+  virtual void initialize(const Config &config) override {
+    Simulation3D::initialize(config);
+    broad_phase = SweepAndPrune<3>(num_threads);
+    gravity = config.get("gravity", Vector3(0, -9.8_f, 0));
+    delta_t = config.get("delta_t", 1e-3_f);
+    density = config.get("density", 1000.0_f);
+    // Steps should be well below the contact duration
+    contact_time = config.get("contact_time", 20 * delta_t);
+    restitution = config.get("restitution", 0.3_f);
+    friction = config.get("friction", 0.5_f);
+    TC_ASSERT_INFO(contact_time >= 5 * delta_t,
+                   "contact_time should be at least 5 delta_t");
+    TC_ASSERT_INFO(0 < restitution && restitution <= 1,
+                   "restitution should be in (0, 1]");
+  }
+
+  // Adds 'num_bodies' bodies of radius in ['min_radius', 'max_radius'] on a
+  // jittered lattice filling the box of 'lower_corner' and 'upper_corner'
+  virtual std::string add_particles(const Config &config) override {
+    int num_bodies = config.get<int>("num_bodies");
+    real min_radius = config.get<real>("min_radius");
+    real max_radius = config.get("max_radius", min_radius);
+    Vector3 lower_corner = config.get<Vector3>("lower_corner");
+    Vector3 upper_corner = config.get<Vector3>("upper_corner");
+    Vector3 color = config.get("color", Vector3(0.6_f, 0.5_f, 0.4_f));
+    Vector3 extent = upper_corner - lower_corner;
+    real spacing = 2 * max_radius;
+    Vector3i res;
+    for (int d = 0; d < 3; d++) {
+      res[d] = std::max(1, (int)(extent[d] / spacing));
+    }
+    TC_ASSERT_INFO(num_bodies <= res[0] * res[1] * res[2],
+                   "The box is too small for the bodies");
+    for (int k = 0; k < num_bodies; k++) {
+      Vector3i cell(k % res[0], k / res[0] % res[1], k / res[0] / res[1]);
+      real radius = lerp(rand(), min_radius, max_radius);
+      Vector3 jitter =
+          (Vector3(rand(), rand(), rand()) - Vector3(0.5_f)) *
+          (spacing - 2 * radius);
+      Vector3 position = lower_corner +
+                         (cell.template cast<real>() + Vector3(0.5_f)) *
+                             spacing +
+                         jitter;
+      real mass = density * 4.0_f / 3.0_f * pi * radius * radius * radius;
+      positions.push_back(position);
+      velocities.push_back(Vector3(0.0_f));
+      angular_velocities.push_back(Vector3(0.0_f));
+      colors.push_back(color);
+      orientations.push_back(Eigen::Quaternion<real>(1, 0, 0, 0));
+      radii.push_back(radius);
+      inv_masses.push_back(1.0_f / mass);
+      // Solid sphere
+      inv_inertias.push_back(1.0_f / (0.4_f * mass * radius * radius));
+    }
+    return "";
+  }
+
+  std::vector<RenderParticle> get_render_particles() const override {
+    std::vector<RenderParticle> render_particles;
+    render_particles.reserve(positions.size());
+    for (int i = 0; i < (int)positions.size(); i++) {
+      render_particles.push_back(RenderParticle(positions[i], colors[i]));
+    }
+    return render_particles;
+  }
+
+  // Contact lists of all the bodies from the overlapping boxes
+  void find_contacts() {
+    int n = (int)positions.size();
+    lower.resize(n);
+    upper.resize(n);
+    ThreadedTaskManager::run(n, num_threads, [&](int i) {
+      lower[i] = positions[i] - Vector3(radii[i]);
+      upper[i] = positions[i] + Vector3(radii[i]);
+    });
+    broad_phase.update(lower, upper, pairs);
+    contact_begin.assign(n + 1, 0);
+    for (auto &pair : pairs) {
+      contact_begin[pair.first + 1]++;
+      contact_begin[pair.second + 1]++;
+    }
+    for (int i = 0; i < n; i++) {
+      contact_begin[i + 1] += contact_begin[i];
+    }
+    contacts.resize(contact_begin[n]);
+    std::vector<int> cursor(contact_begin.begin(), contact_begin.end() - 1);
+    for (auto &pair : pairs) {
+      contacts[cursor[pair.first]++] = pair.second;
+      contacts[cursor[pair.second]++] = pair.first;
+    }
+  }
+
+  // Spring-dashpot force on a body, with effective mass |mass|, at a contact
+  // of penetration |depth|, normal |normal| (pointing into the body) and
+  // relative velocity |v| (of the body at the contact point, with respect
+  // to the other side)
+  Vector3 get_contact_force(real mass,
+                            real depth,
+                            const Vector3 &normal,
+                            const Vector3 &v) const {
+    real log_e = std::log(restitution);
+    real stiffness = mass * (sqr(pi) + sqr(log_e)) / sqr(contact_time);
+    real damping = -2 * mass * log_e / contact_time;
+    real v_n = dot(v, normal);
+    real f_n = std::max(stiffness * depth - damping * v_n, 0.0_f);
+    Vector3 v_t = v - v_n * normal;
+    real speed_t = length(v_t);
+    Vector3 f = f_n * normal;
+    if (speed_t > 1e-10_f) {
+      f -= std::min(friction * f_n, damping * speed_t) / speed_t * v_t;
+    }
+    return f;
+  }
+
+  void compute_forces() {
+    int n = (int)positions.size();
+    forces.resize(n);
+    torques.resize(n);
+    bool has_levelset = (bool)levelset.levelset0;
+    real t = current_t;
+    if (has_levelset) {
+      levelset.update(t, num_threads);
+    }
+    ThreadedTaskManager::run(n, num_threads, [&](int i) {
+      Vector3 force(0.0_f), torque(0.0_f);
+      auto add = [&](const Vector3 &f, const Vector3 &offset) {
+        force += f;
+        torque += cross(offset, f);
+      };
+      for (int k = contact_begin[i]; k < contact_begin[i + 1]; k++) {
+        int j = contacts[k];
+        Vector3 d = positions[i] - positions[j];
+        real dist = length(d);
+        real depth = radii[i] + radii[j] - dist;
+        if (depth <= 0 || dist < 1e-10_f) {
+          continue;
+        }
+        Vector3 normal = d / dist;
+        Vector3 offset_i = -radii[i] * normal, offset_j = radii[j] * normal;
+        Vector3 v = velocities[i] + cross(angular_velocities[i], offset_i) -
+                    velocities[j] - cross(angular_velocities[j], offset_j);
+        real mass = 1.0_f / (inv_masses[i] + inv_masses[j]);
+        add(get_contact_force(mass, depth, normal, v), offset_i);
+      }
+      if (has_levelset && levelset.inside(positions[i])) {
+        real phi = levelset.sample(positions[i], t);
+        real depth = radii[i] - phi;
+        if (depth > 0) {
+          Vector3 normal = levelset.get_spatial_gradient(positions[i], t);
+          Vector3 offset = -radii[i] * normal;
+          Vector3 v = velocities[i] + cross(angular_velocities[i], offset);
+          add(get_contact_force(1.0_f / inv_masses[i], depth, normal, v),
+              offset);
+        }
+      }
+      forces[i] = force;
+      torques[i] = torque;
+    });
+  }
+
+  // Symplectic Euler
+  void substep(real dt) {
+    find_contacts();
+    compute_forces();
+    ThreadedTaskManager::run((int)positions.size(), num_threads, [&](int i) {
+      velocities[i] += dt * (gravity + forces[i] * inv_masses[i]);
+      angular_velocities[i] += dt * inv_inertias[i] * torques[i];
+      positions[i] += dt * velocities[i];
+      real angle = length(angular_velocities[i]) * dt;
+      if (angle > 1e-10_f) {
+        Vector3 axis = normalized(angular_velocities[i]) * std::sin(angle / 2);
+        orientations[i] = Eigen::Quaternion<real>(std::cos(angle / 2), axis[0],
+                                                  axis[1], axis[2]) *
+                          orientations[i];
+      }
+    });
+    current_t += dt;
+  }
+
+  virtual void step(real dt) override {
+    int steps = (int)std::ceil(dt / delta_t);
+    for (int i = 0; i < steps; i++) {
+      substep(dt / steps);
+    }
+  }
+
+  int get_num_contacts() const {
+    return (int)pairs.size();
+  }
+};
+
+TC_IMPLEMENTATION(Simulation3D, RigidBodyPile, "rigid_body_pile");
+
+TC_NAMESPACE_END
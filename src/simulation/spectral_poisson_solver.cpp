@@ -0,0 +1,277 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#include <taichi/system/statistics.h>
+#include <taichi/system/threading.h>
+#include <taichi/math/fft.h>
+#include <taichi/dynamics/poisson_solver.h>
+#include <algorithm>
+
+TC_NAMESPACE_BEGIN
+
+// Direct solver of L x = b on boxes of interior cells, the operator of the
+// multigrid solvers with uniform 'padding' walls: it is separable, and
+// diagonal in the products of the DCT (Neumann walls) or DST (Dirichlet
+// walls) of the axes. As in FACR [Hockney 1965], b is transformed along
+// all axes but the last, which leaves a tridiagonal system along each
+// z-line (last axis) of the spectrum, and the solution of those is
+// transformed back: O(n log n) with no iterations, exact up to round-off.
+// With Neumann walls, the solution has zero mean and the mean of b is
+// ignored, as in the projected CG.
+//
+// Boundary conditions with any other cell, e.g. obstacles, go to a
+// 'fallback' solver (mgpcg by default) of the same config, so that
+// 'spectral' can be used wherever the boundary may or may not be a box.
+template <typename Base, int dim>
+class SpectralPoissonSolver : public Base {
+ protected:
+  using Array = ArrayND<dim, real>;
+  using BCArray = typename Base::BCArray;
+  using VectorI = VectorND<dim, int>;
+
+  VectorI res;
+  int num_threads;
+  Config config;
+  std::string fallback_name;
+  // Created on first use, also by is_multigrid()
+  mutable std::shared_ptr<Base> fallback;
+  bool use_fallback = false;
+  // Of the axes but the last
+  TrigonometricTransform transforms[dim - 1];
+  std::vector<float64> eigenvalues[dim - 1];
+  bool neumann;
+  std::vector<float64> spectrum;
+
+ public:
+  void initialize(const Config &config) override {
+    this->config = config;
+    res = config.get<VectorI>("res");
+    num_threads = config.get<int>("num_threads");
+    auto padding_name = config.get<std::string>("padding");
+    TC_ERROR_IF(padding_name != "dirichlet" && padding_name != "neumann",
+                "'padding' has to be 'dirichlet' or 'neumann' instead of {}",
+                padding_name);
+    fallback_name = config.get("fallback", std::string("mgpcg"));
+    neumann = padding_name == "neumann";
+    auto type =
+        neumann ? TrigonometricTransform::DCT : TrigonometricTransform::DST;
+    TC_ERROR_IF(res.min() <= 0, "Empty Poisson solver resolution");
+    for (int d = 0; d < dim - 1; d++) {
+      transforms[d] = TrigonometricTransform(res[d], type);
+      eigenvalues[d].resize(res[d]);
+      for (int k = 0; k < res[d]; k++) {
+        eigenvalues[d][k] = transforms[d].get_eigenvalue(k);
+      }
+    }
+  }
+
+  void set_boundary_condition(const BCArray &boundary) override {
+    TC_ASSERT_INFO(boundary.get_res() == res,
+                   "Boundary condition does not match the solver");
+    use_fallback = std::any_of(
+        boundary.data.begin(), boundary.data.end(),
+        [](typename Base::CellType c) { return c != Base::INTERIOR; });
+    if (use_fallback) {
+      get_fallback()->set_boundary_condition(boundary);
+    }
+  }
+
+  void run(const Array &b, Array &x, real tolerance) override {
+    if (use_fallback) {
+      fallback->run(b, x, tolerance);
+      this->last_iterations = fallback->get_last_iterations();
+      return;
+    }
+    solve(b, x);
+    this->last_iterations = 0;
+  }
+
+ protected:
+  std::shared_ptr<Base> get_fallback() const {
+    if (!fallback) {
+      fallback = create_instance<Base>(fallback_name, config);
+    }
+    return fallback;
+  }
+
+  // Calls |f(begin, end)| for about as many chunks of [0, n) as threads
+  template <typename F>
+  void for_each_chunk(int64 n, const F &f) const {
+    int64 num_chunks = std::min<int64>(n, std::max(1, num_threads) * 4);
+    ThreadedTaskManager::run((int)num_chunks, num_threads, [&](int c) {
+      f(n * c / num_chunks, n * (c + 1) / num_chunks);
+    });
+  }
+
+  // Forward or inverse transforms of the lines of |spectrum| along |axis|,
+  // two at a time. Lines across the memory are gathered in groups of
+  // consecutive ones, for whole cache lines.
+  void transform_lines(int axis, bool inverse) {
+    const int group_size = 8;
+    const int n = res[axis];
+    int64 stride = 1;
+    for (int d = axis + 1; d < dim; d++) {
+      stride *= res[d];
+    }
+    int64 num_lines = (int64)spectrum.size() / n;
+    const TrigonometricTransform &transform = transforms[axis];
+    auto transform_pair = [&](float64 *x, float64 *y,
+                              std::vector<FFT::Complex> &work) {
+      if (inverse) {
+        transform.inverse(x, y, work);
+      } else {
+        transform.forward(x, y, work);
+      }
+    };
+    for_each_chunk(num_lines, [&](int64 begin, int64 end) {
+      std::vector<FFT::Complex> work;
+      if (stride == 1) {
+        for (int64 l = begin; l < end; l += 2) {
+          transform_pair(&spectrum[l * n],
+                         l + 1 < end ? &spectrum[(l + 1) * n] : nullptr, work);
+        }
+        return;
+      }
+      std::vector<float64> lines(group_size * n);
+      for (int64 l = begin; l < end;) {
+        // Lines l..l + g share their slice of the outer axes
+        int64 g = std::min<int64>(
+            {(int64)group_size, end - l, stride - l % stride});
+        float64 *first = &spectrum[l / stride * n * stride + l % stride];
+        for (int j = 0; j < n; j++) {
+          for (int t = 0; t < g; t++) {
+            lines[t * n + j] = first[j * stride + t];
+          }
+        }
+        for (int t = 0; t < g; t += 2) {
+          transform_pair(&lines[t * n],
+                         t + 1 < g ? &lines[(t + 1) * n] : nullptr, work);
+        }
+        for (int j = 0; j < n; j++) {
+          for (int t = 0; t < g; t++) {
+            first[j * stride + t] = lines[t * n + j];
+          }
+        }
+        l += g;
+      }
+    });
+  }
+
+  // Solves (lambda + L) x = r along a line of |n| cells, in place, where L
+  // is the 1D Laplacian with the walls, by elimination [Thomas 1949]: the
+  // system is diagonally dominant, except for the Neumann walls with
+  // lambda = 0, where it is singular and solved for zero mean
+  void solve_line(float64 *r,
+                  int n,
+                  float64 lambda,
+                  std::vector<float64> &c) const {
+    auto diagonal = [&](int j) {
+      return lambda + 2 - int(neumann && j == 0) - int(neumann && j == n - 1);
+    };
+    if (neumann && lambda == 0) {
+      float64 mean = 0;
+      for (int j = 0; j < n; j++) {
+        mean += r[j];
+      }
+      mean /= n;
+      // x[0] = 0, and x[j + 1] from the row of x[j]
+      float64 previous = 0, current = 0, sum = 0;
+      for (int j = 0; j < n; j++) {
+        float64 rhs = r[j] - mean;
+        r[j] = current;
+        sum += current;
+        float64 next = diagonal(j) * current - previous - rhs;
+        previous = current;
+        current = next;
+      }
+      for (int j = 0; j < n; j++) {
+        r[j] -= sum / n;
+      }
+      return;
+    }
+    c.resize(n);
+    float64 inv = 1 / diagonal(0);
+    c[0] = -inv;
+    r[0] *= inv;
+    for (int j = 1; j < n; j++) {
+      inv = 1 / (diagonal(j) + c[j - 1]);
+      c[j] = -inv;
+      r[j] = (r[j] + r[j - 1]) * inv;
+    }
+    for (int j = n - 2; j >= 0; j--) {
+      r[j] -= c[j] * r[j + 1];
+    }
+  }
+
+  void solve(const Array &b, Array &x) {
+    int64 size = b.get_size();
+    spectrum.resize(size);
+    for_each_chunk(size, [&](int64 begin, int64 end) {
+      std::copy(b.data.begin() + begin, b.data.begin() + end,
+                spectrum.begin() + begin);
+    });
+    for (int d = 0; d < dim - 1; d++) {
+      transform_lines(d, false);
+    }
+    const int n = res[dim - 1];
+    for_each_chunk(size / n, [&](int64 begin, int64 end) {
+      std::vector<float64> c;
+      for (int64 l = begin; l < end; l++) {
+        float64 lambda = 0;
+        int64 rest = l;
+        for (int d = dim - 2; d >= 0; d--) {
+          lambda += eigenvalues[d][rest % res[d]];
+          rest /= res[d];
+        }
+        solve_line(&spectrum[l * n], n, lambda, c);
+      }
+    });
+    for (int d = 0; d < dim - 1; d++) {
+      transform_lines(d, true);
+    }
+    for_each_chunk(size, [&](int64 begin, int64 end) {
+      for (int64 i = begin; i < end; i++) {
+        x.data[i] = (real)spectrum[i];
+      }
+    });
+    TC_STAT("poisson_spectral_solves", 1);
+  }
+};
+
+class SpectralPoissonSolver2D
+    : public SpectralPoissonSolver<PoissonSolver2D, 2> {
+ public:
+  using SpectralPoissonSolver<PoissonSolver2D, 2>::set_boundary_condition;
+
+  // Extra diagonals always go to the fallback
+  bool is_multigrid() const override {
+    return get_fallback()->is_multigrid();
+  }
+
+  // An exact solve, which makes Krylov methods on L converge at once
+  void v_cycle(const Array &b, Array &x) override {
+    if (use_fallback) {
+      fallback->v_cycle(b, x);
+    } else {
+      solve(b, x);
+    }
+  }
+
+  // The extra diagonal breaks the separability: always the fallback
+  void set_boundary_condition(const BCArray &boundary,
+                              const Array &extra_diagonal) override {
+    use_fallback = true;
+    get_fallback()->set_boundary_condition(boundary, extra_diagonal);
+  }
+};
+
+class SpectralPoissonSolver3D
+    : public SpectralPoissonSolver<PoissonSolver3D, 3> {};
+
+TC_IMPLEMENTATION(PoissonSolver2D, SpectralPoissonSolver2D, "spectral");
+
+TC_IMPLEMENTATION(PoissonSolver3D, SpectralPoissonSolver3D, "spectral");
+
+TC_NAMESPACE_END
@@ -4,6 +4,7 @@
 *******************************************************************************/
 
 #include <taichi/visual/surface_material.h>
+#include <taichi/math/fast_math.h>
 
 TC_NAMESPACE_BEGIN
 
@@ -13,6 +14,12 @@ TC_NAMESPACE_BEGIN
 // GGX, a.k.a. Trowbridge-Reitz, described in the paper "Microfacet Models for
 // Refraction through Rough Surfaces"
 
+// Half vectors are sampled from the distribution of the normals visible
+// from the incoming direction [Heitz 2018, "Sampling the GGX Distribution
+// of Visible Normals"], D(h) G1(in) max(0, in.h) / in.z, and not from
+// D(h) h.z: no half vector faces away from |in|, and the weight f cos / pdf
+// of a sample is F G(in) / G1(in), close to F, at all roughnesses.
+
 class MicrofacetMaterial final : public SurfaceMaterial {
  protected:
   std::shared_ptr<Texture> color_sampler;
@@ -31,17 +38,65 @@ class MicrofacetMaterial final : public SurfaceMaterial {
 
   // D can be GGX, Beckmann, Blinn-Phong
   real evaluateD(real roughness, const Vector3 &h) const {
-    const real cos_t = h.z;
+    return evaluateD(roughness, h.z);
+  }
+
+  real evaluateD(real roughness, real cos_t) const {
     return sqr(roughness) /
            std::max(1e-6_f,
                     (pi * sqr((sqr(roughness) - 1) * sqr(cos_t) + 1.0_f)));
   }
 
-  Vector3 sampleD(real roughness, const Vector2 &p) const {
-    const real phi = p.x * 2 * pi;
-    const real theta = std::acos(
-        std::sqrt((1 - p.y) / (1 + p.y * (roughness * roughness - 1))));
-    return Vector3(sin(theta) * cos(phi), sin(theta) * sin(phi), cos(theta));
+  // A visible normal for the incoming direction |in|, from the point
+  // sqrt(v) (cos_phi, sin_phi) of the unit disk: the disk is projected on
+  // the hemisphere of the stretched configuration (roughness 1), and the
+  // normal there is unstretched. On the side of |in|.
+  static void sample_visible_normal(real roughness,
+                                    real in_x,
+                                    real in_y,
+                                    real in_z,
+                                    real v,
+                                    real sin_phi,
+                                    real cos_phi,
+                                    real &h_x,
+                                    real &h_y,
+                                    real &h_z) {
+    const real side = in_z < 0 ? -1.0_f : 1.0_f;
+    real s_x = roughness * in_x, s_y = roughness * in_y, s_z = side * in_z;
+    real inv_length = 1.0_f / std::sqrt(s_x * s_x + s_y * s_y + s_z * s_z);
+    s_x *= inv_length, s_y *= inv_length, s_z *= inv_length;
+    // Orthonormal basis (t1, t2, s)
+    real length_xy = std::sqrt(s_x * s_x + s_y * s_y);
+    real t1_x = 1, t1_y = 0;
+    if (length_xy > 1e-7_f) {
+      t1_x = -s_y / length_xy;
+      t1_y = s_x / length_xy;
+    }
+    real t2_x = -s_z * t1_y, t2_y = s_z * t1_x, t2_z = length_xy;
+    // The part of the disk that the hemisphere hides from |s| is folded
+    real r = std::sqrt(v);
+    real p1 = r * cos_phi, p2 = r * sin_phi;
+    real l = 0.5_f * (1 + s_z);
+    p2 = (1 - l) * std::sqrt(std::max(0.0_f, 1 - p1 * p1)) + l * p2;
+    real p3 = std::sqrt(std::max(0.0_f, 1 - p1 * p1 - p2 * p2));
+    h_x = roughness * (p1 * t1_x + p2 * t2_x + p3 * s_x);
+    h_y = roughness * (p1 * t1_y + p2 * t2_y + p3 * s_y);
+    h_z = std::max(1e-7_f, p2 * t2_z + p3 * s_z);
+    inv_length = 1.0_f / std::sqrt(h_x * h_x + h_y * h_y + h_z * h_z);
+    h_x *= inv_length, h_y *= inv_length, h_z *= inv_length * side;
+  }
+
+  // Smith's masking of GGX, for a direction at |cos_t| to the normal
+  static real G1(real roughness, real cos_t) {
+    real c2 = sqr(std::max(1e-6_f, std::abs(cos_t)));
+    return 2.0_f /
+           (1 + std::sqrt(1 + roughness * roughness * (1.0_f / c2 - 1.0_f)));
+  }
+
+  // Of the reflections about the visible normals of |in|, in solid angle
+  real visible_normal_pdf(real roughness, real in_z, real h_z) const {
+    return G1(roughness, in_z) * evaluateD(roughness, h_z) /
+           (4.0f * std::max(1e-6_f, std::abs(in_z)));
   }
 
   // Fresnel term: Schlick approx.
@@ -55,14 +110,18 @@ class MicrofacetMaterial final : public SurfaceMaterial {
          const Vector3 &in_dir,
          const Vector3 &out_dir,
          const Vector3 &h) const {
-    if (dot(in_dir, h) * in_dir.z < eps) {
+    return G(roughness, in_dir.z, dot(in_dir, h));
+  }
+
+  real G(real roughness, real in_z, real in_dot_h) const {
+    if (in_dot_h * in_z < eps) {
       return 0.0_f;
     }
     const real a = 0.5f + roughness * 0.5f;
     return 2.0_f /
            (1 + std::sqrt(
                     1 +
-                    a * a * (sqr(1.0_f / std::max(1e-6_f, std::abs(in_dir.z))) -
+                    a * a * (sqr(1.0_f / std::max(1e-6_f, std::abs(in_z))) -
                              1.0_f)));
   }
 
@@ -75,7 +134,12 @@ class MicrofacetMaterial final : public SurfaceMaterial {
                            real u,
                            real v,
                            const Vector2 &uv) const {
-    return reflect(in, sampleD(get_roughness(uv), Vector2(u, v)));
+    real sin_phi, cos_phi;
+    fast_math::sincos(u * 2 * pi, sin_phi, cos_phi);
+    Vector3 h;
+    sample_visible_normal(get_roughness(uv), in.x, in.y, in.z, v, sin_phi,
+                          cos_phi, h.x, h.y, h.z);
+    return reflect(in, h);
     // The result is guarded by evaluate_brdf form penetration
   }
 
@@ -90,8 +154,7 @@ class MicrofacetMaterial final : public SurfaceMaterial {
       return 0;
     }
     const Vector3 h = normalized(in + out);
-    return std::abs(evaluateD(get_roughness(uv), h) * h.z /
-                    std::max(1e-6_f, 4.0f * dot(out, h)));
+    return visible_normal_pdf(get_roughness(uv), in.z, h.z);
   }
 
   Vector3 evaluate_bsdf(const Vector3 &in,
@@ -124,6 +187,88 @@ class MicrofacetMaterial final : public SurfaceMaterial {
     pdf = probability_density(in_dir, out_dir, uv);
   }
 
+  void evaluate_batch(SurfaceBatch &batch) const override {
+    static thread_local std::vector<real> r, g, b, roughness;
+    sample_texture_batch(*color_sampler, batch, r, g, b);
+    get_roughness_batch(batch, roughness);
+    for (int i = 0; i < batch.size; i++) {
+      real in_x = batch.in_x[i], in_y = batch.in_y[i], in_z = batch.in_z[i];
+      real out_z = batch.out_z[i];
+      real h_x = in_x + batch.out_x[i], h_y = in_y + batch.out_y[i],
+           h_z = in_z + out_z;
+      real inv_length = 1.0_f / std::sqrt(h_x * h_x + h_y * h_y + h_z * h_z);
+      h_x *= inv_length, h_y *= inv_length, h_z *= inv_length;
+      real in_dot_h = in_x * h_x + in_y * h_y + in_z * h_z;
+      real factor = F(f0, std::max(0.0_f, in_dot_h)) *
+                    G(roughness[i], in_z, in_dot_h) *
+                    evaluateD(roughness[i], h_z);
+      factor *=
+          1.0_f / (4.0f * std::max(1e-5_f, std::abs(in_z)) * std::abs(out_z));
+      factor = in_z * out_z < eps ? 0.0_f : factor;
+      batch.f_x[i] = r[i] * factor;
+      batch.f_y[i] = g[i] * factor;
+      batch.f_z[i] = b[i] * factor;
+    }
+  }
+
+  void probability_density_batch(SurfaceBatch &batch) const override {
+    static thread_local std::vector<real> roughness;
+    get_roughness_batch(batch, roughness);
+    for (int i = 0; i < batch.size; i++) {
+      real in_z = batch.in_z[i];
+      real out_x = batch.out_x[i], out_y = batch.out_y[i],
+           out_z = batch.out_z[i];
+      real h_x = batch.in_x[i] + out_x, h_y = batch.in_y[i] + out_y,
+           h_z = in_z + out_z;
+      real inv_length = 1.0_f / std::sqrt(h_x * h_x + h_y * h_y + h_z * h_z);
+      h_z *= inv_length;
+      real pdf = visible_normal_pdf(roughness[i], in_z, h_z);
+      batch.pdf[i] = in_z * out_z < eps ? 0.0_f : pdf;
+    }
+  }
+
+  void sample_batch(SurfaceBatch &batch) const override {
+    static thread_local std::vector<real> roughness, sin_phi, cos_phi;
+    get_roughness_batch(batch, roughness);
+    // The azimuths of the half vectors, a pack at a time
+    using Pack = ScalarPack<real, default_pack_width<real>>;
+    constexpr int width = default_pack_width<real>;
+    sin_phi.resize(batch.size);
+    cos_phi.resize(batch.size);
+    int j = 0;
+    for (; j + width <= batch.size; j += width) {
+      Pack s, c;
+      fast_math::sincos(Pack::load(&batch.u[j]) * Pack(2 * pi), s, c);
+      s.store(&sin_phi[j]);
+      c.store(&cos_phi[j]);
+    }
+    for (; j < batch.size; j++) {
+      fast_math::sincos(batch.u[j] * 2 * pi, sin_phi[j], cos_phi[j]);
+    }
+    // Reflects the incoming direction about one of its visible normals
+    for (int i = 0; i < batch.size; i++) {
+      real in_x = batch.in_x[i], in_y = batch.in_y[i], in_z = batch.in_z[i];
+      real h_x, h_y, h_z;
+      sample_visible_normal(roughness[i], in_x, in_y, in_z, batch.v[i],
+                            sin_phi[i], cos_phi[i], h_x, h_y, h_z);
+      real in_dot_h = in_x * h_x + in_y * h_y + in_z * h_z;
+      batch.out_x[i] = in_x - 2.0_f * (in_x - in_dot_h * h_x);
+      batch.out_y[i] = in_y - 2.0_f * (in_y - in_dot_h * h_y);
+      batch.out_z[i] = in_z - 2.0_f * (in_z - in_dot_h * h_z);
+      batch.event[i] = (int)SurfaceScatteringFlags::non_delta;
+    }
+    evaluate_batch(batch);
+    probability_density_batch(batch);
+  }
+
+  void get_roughness_batch(const SurfaceBatch &batch,
+                           std::vector<real> &roughness) const {
+    roughness.resize(batch.size);
+    for (int i = 0; i < batch.size; i++) {
+      roughness[i] = get_roughness(batch.get_uv(i));
+    }
+  }
+
   real get_importance(const Vector2 &uv) const override {
     return luminance(color_sampler->sample3(uv));
   }
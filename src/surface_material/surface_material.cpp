@@ -31,6 +31,22 @@ std::shared_ptr<Texture> SurfaceMaterial::get_color_sampler(
   }
 }
 
+void SurfaceMaterial::sample_texture_batch(const Texture &texture,
+                                           const SurfaceBatch &batch,
+                                           std::vector<real> &r,
+                                           std::vector<real> &g,
+                                           std::vector<real> &b) {
+  r.resize(batch.size);
+  g.resize(batch.size);
+  b.resize(batch.size);
+  for (int i = 0; i < batch.size; i++) {
+    Vector3 c = texture.sample3(batch.get_uv(i));
+    r[i] = c.x;
+    g[i] = c.y;
+    b[i] = c.z;
+  }
+}
+
 class EmissiveMaterial : public SurfaceMaterial {
  protected:
   std::shared_ptr<Texture> color_sampler;
@@ -216,6 +232,58 @@ class DiffuseMaterial : public SurfaceMaterial {
     pdf = out_dir.z / pi;
   }
 
+  void evaluate_batch(SurfaceBatch &batch) const override {
+    static thread_local std::vector<real> r, g, b;
+    sample_texture_batch(*color_sampler, batch, r, g, b);
+    const real inv_pi = 1.0_f / pi;
+    for (int i = 0; i < batch.size; i++) {
+      real mask = batch.in_z[i] * batch.out_z[i] > eps ? 1.0_f : 0.0_f;
+      batch.f_x[i] = mask * r[i] * inv_pi;
+      batch.f_y[i] = mask * g[i] * inv_pi;
+      batch.f_z[i] = mask * b[i] * inv_pi;
+    }
+  }
+
+  void probability_density_batch(SurfaceBatch &batch) const override {
+    for (int i = 0; i < batch.size; i++) {
+      real out_z = batch.out_z[i];
+      batch.pdf[i] =
+          batch.in_z[i] * out_z < eps ? 0.0_f : std::abs(out_z) / pi;
+    }
+  }
+
+  void sample_batch(SurfaceBatch &batch) const override {
+    // Same mapping as sample_direction, branch-free except for the (rare)
+    // lanes whose incoming direction is along the normal
+    for (int i = 0; i < batch.size; i++) {
+      real u = batch.u[i], v = batch.v[i];
+      real lo = std::min(u, v), hi = std::max(u, v);
+      hi = hi < eps ? eps : hi;
+      lo /= hi;
+      real in_x = batch.in_x[i], in_y = batch.in_y[i], in_z = batch.in_z[i];
+      real y = std::sqrt(1 - hi * hi);
+      real phi = lo * 2.0f * pi;
+      real r = hi / std::sqrt(in_x * in_x + in_y * in_y);
+      real p = in_x * r, q = in_y * r;
+      real c = std::cos(phi), s = std::sin(phi);
+      real sign = in_z < -eps ? -1.0_f : (in_z > eps ? 1.0_f : 0.0_f);
+      batch.out_x[i] = p * c - q * s;
+      batch.out_y[i] = q * c + p * s;
+      batch.out_z[i] = y * sign;
+    }
+    for (int i = 0; i < batch.size; i++) {
+      if (std::abs(batch.in_z[i]) > 1 - eps) {
+        batch.set_out(i, sample_direction(batch.get_in(i), batch.u[i],
+                                          batch.v[i], batch.get_uv(i)));
+      }
+    }
+    evaluate_batch(batch);
+    for (int i = 0; i < batch.size; i++) {
+      batch.pdf[i] = batch.out_z[i] / pi;
+      batch.event[i] = (int)SurfaceScatteringFlags::non_delta;
+    }
+  }
+
   virtual real get_importance(const Vector2 &uv) const override {
     return luminance(color_sampler->sample3(uv));
   }
@@ -575,6 +643,114 @@ class PBRMaterial : public SurfaceMaterial {
     return sum;
   }
 
+  void evaluate_batch(SurfaceBatch &batch) const override {
+    static thread_local std::vector<real> sum_x, sum_y, sum_z;
+    sum_x.assign(batch.size, 0.0_f);
+    sum_y.assign(batch.size, 0.0_f);
+    sum_z.assign(batch.size, 0.0_f);
+    for (auto &mat : materials) {
+      if (mat->is_delta())
+        continue;
+      mat->evaluate_batch(batch);
+      for (int i = 0; i < batch.size; i++) {
+        sum_x[i] += batch.f_x[i];
+        sum_y[i] += batch.f_y[i];
+        sum_z[i] += batch.f_z[i];
+      }
+    }
+    std::copy(sum_x.begin(), sum_x.end(), batch.f_x.begin());
+    std::copy(sum_y.begin(), sum_y.end(), batch.f_y.begin());
+    std::copy(sum_z.begin(), sum_z.end(), batch.f_z.begin());
+  }
+
+  void probability_density_batch(SurfaceBatch &batch) const override {
+    // weights[k * batch.size + i]: probability of lane i picking material k
+    static thread_local std::vector<real> weights, sum;
+    int num_materials = (int)materials.size();
+    weights.resize(num_materials * batch.size);
+    for (int i = 0; i < batch.size; i++) {
+      auto material_sampler = get_material_sampler(batch.get_uv(i));
+      for (int k = 0; k < num_materials; k++) {
+        weights[k * batch.size + i] = material_sampler.get_pdf(k);
+      }
+    }
+    sum.assign(batch.size, 0.0_f);
+    for (int k = 0; k < num_materials; k++) {
+      if (materials[k]->is_delta())
+        continue;
+      materials[k]->probability_density_batch(batch);
+      const real *w = &weights[k * batch.size];
+      for (int i = 0; i < batch.size; i++) {
+        sum[i] += batch.pdf[i] * w[i];
+      }
+    }
+    std::copy(sum.begin(), sum.end(), batch.pdf.begin());
+  }
+
+  // Lanes are grouped by the sub-material they pick, and each group is
+  // sampled with one batched call
+  void sample_batch(SurfaceBatch &batch) const override {
+    static thread_local std::vector<int> mat_ids, lanes;
+    static thread_local std::vector<real> mat_pdfs, rescaled_u, delta_pdfs;
+    static thread_local SurfaceBatch sub;
+    mat_ids.resize(batch.size);
+    mat_pdfs.resize(batch.size);
+    rescaled_u.resize(batch.size);
+    delta_pdfs.resize(batch.size);
+    for (int i = 0; i < batch.size; i++) {
+      real mat_pdf, mat_cdf;
+      mat_ids[i] = get_material_sampler(batch.get_uv(i))
+                       .sample(batch.u[i], mat_pdf, mat_cdf);
+      mat_pdfs[i] = mat_pdf;
+      if (mat_pdf != 0.0_f) {
+        rescaled_u[i] = (batch.u[i] - (mat_cdf - mat_pdf)) / mat_pdf;
+        assert(is_normal(rescaled_u[i]));
+      }
+    }
+    for (int k = 0; k < (int)materials.size(); k++) {
+      lanes.clear();
+      for (int i = 0; i < batch.size; i++) {
+        if (mat_pdfs[i] != 0.0_f && mat_ids[i] == k) {
+          lanes.push_back(i);
+        }
+      }
+      if (lanes.empty())
+        continue;
+      sub.resize((int)lanes.size());
+      for (int j = 0; j < sub.size; j++) {
+        int i = lanes[j];
+        sub.set_in(j, batch.get_in(i));
+        sub.set_uv(j, batch.get_uv(i));
+        sub.u[j] = rescaled_u[i];
+        sub.v[j] = batch.v[i];
+      }
+      materials[k]->sample_batch(sub);
+      for (int j = 0; j < sub.size; j++) {
+        int i = lanes[j];
+        batch.set_out(i, sub.get_out(j));
+        batch.set_f(i, sub.get_f(j));
+        batch.event[i] = sub.event[j];
+        delta_pdfs[i] = mat_pdfs[i] * sub.pdf[j];
+      }
+    }
+    for (int i = 0; i < batch.size; i++) {
+      if (mat_pdfs[i] == 0.0_f) {
+        batch.set_out(i, Vector3(0.0_f));
+      }
+    }
+    // Mixture pdf for non-delta events, as in the scalar version
+    probability_density_batch(batch);
+    for (int i = 0; i < batch.size; i++) {
+      if (mat_pdfs[i] == 0.0_f) {
+        batch.set_f(i, Vector3(0.0_f));
+        batch.pdf[i] = 1.0_f;
+        batch.event[i] = (SurfaceEvent)SurfaceScatteringFlags::non_delta;
+      } else if (SurfaceEventClassifier::is_delta(batch.event[i])) {
+        batch.pdf[i] = delta_pdfs[i];
+      }
+    }
+  }
+
   bool is_delta() const override {
     return flag_is_delta;
   }
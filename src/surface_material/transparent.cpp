@@ -26,6 +26,19 @@ class TransparentMaterial : public SurfaceMaterial {
     return nested->is_index_matched();
   }
 
+  // Fully transparent texels always pass, and fully opaque ones are the
+  // nested material
+  bool get_fixed_transmittance(const Vector3 &in,
+                               const Vector2 &uv,
+                               Vector3 &transmittance) const override {
+    real alpha = get_alpha(uv);
+    if (alpha >= 1) {
+      transmittance = Vector3(1);
+      return true;
+    }
+    return alpha <= 0 && nested->get_fixed_transmittance(in, uv, transmittance);
+  }
+
   virtual void sample(const Vector3 &in_dir,
                       real u,
                       real v,
@@ -0,0 +1,72 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#include <taichi/system/arena.h>
+
+TC_NAMESPACE_BEGIN
+
+Arena::Arena(std::size_t block_size)
+    : block_size(block_size), current(-1), offset(0) {
+  TC_ERROR_IF(block_size == 0, "Arenas need blocks of >0 bytes");
+}
+
+void *Arena::allocate(std::size_t bytes, std::size_t alignment) {
+  while (true) {
+    if (current >= 0) {
+      std::size_t begin = (offset + alignment - 1) / alignment * alignment;
+      auto &block = blocks[current];
+      // Blocks are aligned for std::max_align_t only
+      std::size_t misalignment = (std::size_t)(block.data.get() + begin) %
+                                 alignment;
+      if (misalignment != 0) {
+        begin += alignment - misalignment;
+      }
+      if (begin + bytes <= block.size) {
+        offset = begin + bytes;
+        return block.data.get() + begin;
+      }
+    }
+    // The next block, if it is large enough; a new one otherwise, in its
+    // place, so that the block order is that of allocation
+    current++;
+    offset = 0;
+    if (current < (int)blocks.size() &&
+        blocks[current].size >= bytes + alignment) {
+      continue;
+    }
+    std::size_t size = std::max(block_size, bytes + alignment);
+    Block block{std::unique_ptr<char[]>(new char[size]), size};
+    if (current < (int)blocks.size()) {
+      blocks[current] = std::move(block);
+    } else {
+      blocks.push_back(std::move(block));
+    }
+  }
+}
+
+void Arena::deallocate(void *ptr, std::size_t bytes) {
+  if (current < 0) {
+    return;
+  }
+  char *top = blocks[current].data.get() + offset;
+  if ((char *)ptr + bytes == top) {
+    offset -= bytes;
+  }
+}
+
+std::size_t Arena::get_capacity() const {
+  std::size_t capacity = 0;
+  for (auto &block : blocks) {
+    capacity += block.size;
+  }
+  return capacity;
+}
+
+Arena &Arena::get_thread_arena() {
+  thread_local Arena arena;
+  return arena;
+}
+
+TC_NAMESPACE_END
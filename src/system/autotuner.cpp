@@ -0,0 +1,200 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#include <taichi/system/autotuner.h>
+#include <taichi/system/timer.h>
+#include <taichi/io/io.h>
+
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <thread>
+#if !defined(TC_PLATFORM_WINDOWS)
+#include <unistd.h>
+#endif
+
+TC_NAMESPACE_BEGIN
+
+namespace {
+
+struct Profile {
+  std::mutex mutex;
+  bool loaded = false;
+  bool tuning = false;
+  // By (name, threads)
+  std::map<std::pair<std::string, int>, int> values;
+};
+
+Profile &get_profile() {
+  static Profile profile;
+  return profile;
+}
+
+int get_thread_count(int num_threads) {
+  if (num_threads > 0) {
+    return num_threads;
+  }
+  return (int)std::max(1u, std::thread::hardware_concurrency());
+}
+
+std::string get_host_name() {
+#if defined(TC_PLATFORM_WINDOWS)
+  auto name = std::getenv("COMPUTERNAME");
+  return name ? name : "unknown";
+#else
+  char name[256] = {0};
+  if (gethostname(name, sizeof(name) - 1) != 0 || name[0] == 0) {
+    return "unknown";
+  }
+  return name;
+#endif
+}
+
+void read_profile(Profile &profile, const std::string &path) {
+  std::ifstream in(path);
+  if (!in) {
+    return;
+  }
+  profile.values.clear();
+  std::string name;
+  int threads, value;
+  while (in >> name >> threads >> value) {
+    profile.values[std::make_pair(name, threads)] = value;
+  }
+}
+
+bool write_profile(const Profile &profile, const std::string &path) {
+  auto slash = path.find_last_of("/\\");
+  if (slash != std::string::npos && slash > 0) {
+    create_directories(path.substr(0, slash));
+  }
+  std::ofstream out(path);
+  for (auto &entry : profile.values) {
+    out << entry.first.first << " " << entry.first.second << " "
+        << entry.second << "\n";
+  }
+  return (bool)out;
+}
+
+// With the mutex held
+void ensure_loaded(Profile &profile) {
+  if (profile.loaded) {
+    return;
+  }
+  profile.loaded = true;
+  auto tuning = std::getenv("TC_AUTOTUNE");
+  profile.tuning = tuning && std::string(tuning) == "1";
+  read_profile(profile, Autotuner::get_profile_path());
+}
+
+}  // namespace
+
+int Autotuner::get(const std::string &name,
+                   int num_threads,
+                   int default_value,
+                   const std::vector<int> &candidates,
+                   const std::function<double(int)> &benchmark) {
+  Profile &profile = get_profile();
+  auto key = std::make_pair(name, get_thread_count(num_threads));
+  {
+    std::lock_guard<std::mutex> _(profile.mutex);
+    ensure_loaded(profile);
+    auto it = profile.values.find(key);
+    if (it != profile.values.end()) {
+      return it->second;
+    }
+    if (!profile.tuning || candidates.empty()) {
+      return default_value;
+    }
+  }
+  // Unlocked, as the benchmarks may look up other parameters
+  int best = candidates[0];
+  double best_time = 0;
+  for (int c : candidates) {
+    double time = benchmark(c);
+    TC_TRACE("Autotuning {} ({} threads): {} takes {:.3f} ms", name,
+             key.second, c, time * 1e3);
+    if (c == candidates[0] || time < best_time) {
+      best = c;
+      best_time = time;
+    }
+  }
+  TC_INFO("Autotuned {} ({} threads): {}", name, key.second, best);
+  std::lock_guard<std::mutex> _(profile.mutex);
+  profile.values[key] = best;
+  if (!write_profile(profile, get_profile_path())) {
+    TC_WARN("Cannot write the tuning profile {}", get_profile_path());
+  }
+  return best;
+}
+
+int Autotuner::get(const std::string &name,
+                   int num_threads,
+                   int default_value) {
+  return get(name, num_threads, default_value, {}, nullptr);
+}
+
+void Autotuner::set(const std::string &name, int num_threads, int value) {
+  Profile &profile = get_profile();
+  std::lock_guard<std::mutex> _(profile.mutex);
+  ensure_loaded(profile);
+  profile.values[std::make_pair(name, get_thread_count(num_threads))] = value;
+}
+
+void Autotuner::set_tuning(bool tuning) {
+  Profile &profile = get_profile();
+  std::lock_guard<std::mutex> _(profile.mutex);
+  ensure_loaded(profile);
+  profile.tuning = tuning;
+}
+
+bool Autotuner::get_tuning() {
+  Profile &profile = get_profile();
+  std::lock_guard<std::mutex> _(profile.mutex);
+  ensure_loaded(profile);
+  return profile.tuning;
+}
+
+void Autotuner::load(const std::string &path) {
+  Profile &profile = get_profile();
+  std::lock_guard<std::mutex> _(profile.mutex);
+  ensure_loaded(profile);
+  read_profile(profile, path);
+}
+
+void Autotuner::save(const std::string &path) {
+  Profile &profile = get_profile();
+  std::lock_guard<std::mutex> _(profile.mutex);
+  ensure_loaded(profile);
+  TC_ERROR_IF(!write_profile(profile, path),
+              "Cannot write the tuning profile {}", path);
+}
+
+std::string Autotuner::get_profile_path() {
+  auto path = std::getenv("TC_TUNING_PROFILE");
+  if (path) {
+    return path;
+  }
+  auto home = std::getenv(running_on_windows() ? "USERPROFILE" : "HOME");
+  return fmt::format("{}/.taichi/tuning_{}.txt", home ? home : ".",
+                     get_host_name());
+}
+
+double Autotuner::time_best_of(const std::function<void()> &f,
+                               int repetitions) {
+  f();
+  double best = 0;
+  for (int i = 0; i < repetitions; i++) {
+    double start = Time::get_time();
+    f();
+    double time = Time::get_time() - start;
+    if (i == 0 || time < best) {
+      best = time;
+    }
+  }
+  return best;
+}
+
+TC_NAMESPACE_END
@@ -0,0 +1,358 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#include <taichi/system/batch_job.h>
+#include <taichi/common/asset_cache.h>
+#include <taichi/common/task.h>
+#include <taichi/dynamics/simulation.h>
+#include <taichi/io/ply_writer.h>
+#include <taichi/system/timer.h>
+#include <taichi/visual/camera.h>
+#include <taichi/visual/envmap.h>
+#include <taichi/visual/renderer.h>
+#include <taichi/visual/scene.h>
+#include <taichi/visual/surface_material.h>
+#include <taichi/visual/texture.h>
+#include <taichi/visual/volume_material.h>
+
+#include <fstream>
+#include <sstream>
+
+TC_NAMESPACE_BEGIN
+
+namespace {
+
+bool file_exists(const std::string &fn) {
+  return std::ifstream(fn).good();
+}
+
+}  // namespace
+
+void BatchJob::load(const std::string &fn) {
+  if (ends_with(fn, ".tcb")) {
+    read_from_binary_file(*this, fn);
+    return;
+  }
+  std::ifstream f(fn);
+  TC_ERROR_IF(!f, "Can not open job file [{}]", fn);
+  std::stringstream ss;
+  ss << f.rdbuf();
+  parse(ss.str());
+}
+
+void BatchJob::save(const std::string &fn) const {
+  if (ends_with(fn, ".tcb")) {
+    write_to_binary_file(*this, fn);
+    return;
+  }
+  std::ofstream f(fn);
+  TC_ERROR_IF(!f, "Can not write job file [{}]", fn);
+  f << to_text();
+}
+
+void BatchJob::parse(const std::string &text) {
+  sections.clear();
+  std::stringstream ss(text);
+  std::string line;
+  int line_number = 0;
+  while (std::getline(ss, line)) {
+    line_number++;
+    line = trim_string(line);
+    if (line.empty() || line[0] == '#') {
+      continue;
+    }
+    if (line[0] == '[') {
+      TC_ERROR_IF(line.back() != ']', "Line {} of the job: missing ']'",
+                  line_number);
+      Section section;
+      std::stringstream header(line.substr(1, line.size() - 2));
+      std::string token;
+      while (header >> token) {
+        if (section.type.empty()) {
+          section.type = token;
+        } else if (token[0] == '@') {
+          section.name = token.substr(1);
+        } else {
+          section.implementation = token;
+        }
+      }
+      TC_ERROR_IF(section.type.empty(), "Line {} of the job: empty section",
+                  line_number);
+      sections.push_back(section);
+      continue;
+    }
+    auto eq = line.find('=');
+    TC_ERROR_IF(eq == std::string::npos || sections.empty(),
+                "Line {} of the job: expected a section or key = value",
+                line_number);
+    sections.back().config.set(trim_string(line.substr(0, eq)),
+                               trim_string(line.substr(eq + 1)));
+  }
+}
+
+std::string BatchJob::to_text() const {
+  std::string text;
+  for (auto &section : sections) {
+    text += "[" + section.type;
+    if (!section.implementation.empty()) {
+      text += " " + section.implementation;
+    }
+    if (!section.name.empty()) {
+      text += " @" + section.name;
+    }
+    text += "]\n";
+    for (auto &key : section.config.get_keys()) {
+      text += key + " = " + section.config.get_string(key) + "\n";
+    }
+    text += "\n";
+  }
+  return text;
+}
+
+void BatchJob::set_value(const std::string &assignment) {
+  auto eq = assignment.find('=');
+  auto dot = assignment.find('.');
+  TC_ERROR_IF(eq == std::string::npos || dot > eq,
+              "Expected section.key=value instead of [{}]", assignment);
+  std::string target = assignment.substr(0, dot);
+  std::string key = trim_string(assignment.substr(dot + 1, eq - dot - 1));
+  std::string value = trim_string(assignment.substr(eq + 1));
+  bool found = false;
+  for (auto &section : sections) {
+    if (target == section.type || target == "@" + section.name) {
+      section.config.set(key, value);
+      found = true;
+    }
+  }
+  TC_ERROR_IF(!found, "No section [{}] in the job", target);
+}
+
+void BatchJob::run() {
+  for (auto &section : sections) {
+    // The job keeps its references, so that it can be saved or run again
+    Section resolved = section;
+    resolve_references(resolved.config);
+    run_section(resolved);
+  }
+  if (renderer) {
+    renderer->wait_for_output();
+    renderer->wait_for_checkpoint();
+  }
+}
+
+void BatchJob::resolve_references(Config &config) const {
+  for (auto &key : config.get_keys()) {
+    std::string value = config.get_string(key);
+    if (starts_with(value, "@")) {
+      auto it = asset_ids.find(value.substr(1));
+      TC_ERROR_IF(it == asset_ids.end(),
+                  "[{}] of the job is not defined before [{}]", value, key);
+      config.set(key, it->second);
+    }
+  }
+}
+
+template <typename T>
+void BatchJob::add_asset(const std::string &name, std::shared_ptr<T> asset) {
+  int id = AssetManager::insert_asset(asset);
+  assets.push_back(asset);
+  if (!name.empty()) {
+    asset_ids[name] = id;
+  }
+}
+
+template <typename T>
+void BatchJob::add_unit(const Section &section, bool shared) {
+  add_asset(section.name,
+            shared ? AssetCache::create<T>(section.implementation,
+                                           section.config)
+                   : create_instance<T>(section.implementation,
+                                        section.config));
+}
+
+void BatchJob::run_section(Section &section) {
+  const std::string &type = section.type;
+  Config &config = section.config;
+  if (type == "texture") {
+    add_unit<Texture>(section, true);
+  } else if (type == "surface_material") {
+    add_unit<SurfaceMaterial>(section, true);
+  } else if (type == "volume_material") {
+    add_unit<VolumeMaterial>(section);
+  } else if (type == "camera") {
+    add_unit<Camera>(section);
+  } else if (type == "envmap") {
+    add_unit<EnvironmentMap>(section);
+  } else if (type == "mesh" || type == "scene") {
+    if (!scene) {
+      scene = std::make_shared<Scene>();
+    }
+    if (type == "mesh") {
+      auto mesh = std::make_shared<Mesh>();
+      mesh->initialize(config);
+      mesh->set_material(config.get_asset<SurfaceMaterial>("material"));
+      // As in Python: scaled (uniformly for a number), rotated, then
+      // translated
+      Vector3 scale(1);
+      if (config.has_key("scale")) {
+        scale = starts_with(config.get_string("scale"), "(")
+                    ? config.get<Vector3>("scale")
+                    : Vector3(config.get<real>("scale"));
+      }
+      Matrix4 transform(1.0_f);
+      transform = matrix4_scale(&transform, scale);
+      transform = matrix4_rotate_euler(&transform,
+                                       config.get("rotation", Vector3(0)));
+      transform =
+          matrix4_translate(&transform, config.get("translate", Vector3(0)));
+      mesh->transform = transform;
+      scene->add_mesh(mesh);
+      add_asset(section.name, mesh);
+    } else {
+      if (config.has_key("camera")) {
+        scene->set_camera(config.get_asset<Camera>("camera"));
+      }
+      if (config.has_key("envmap")) {
+        scene->set_environment_map(
+            config.get_asset<EnvironmentMap>("envmap"),
+            config.get("envmap_sample_prob", 0.5_f));
+      }
+      if (config.has_key("atmosphere")) {
+        scene->set_atmosphere_material(
+            config.get_asset<VolumeMaterial>("atmosphere"));
+      }
+      if (config.has_key("bundle")) {
+        scene->set_bundle(config.get<std::string>("bundle"));
+      }
+    }
+  } else if (type == "renderer") {
+    TC_ERROR_IF(!scene, "The renderer of the job needs a scene first");
+    scene->finalize();
+    renderer = create_instance<Renderer>(section.implementation);
+    renderer->set_scene(scene);
+    renderer->initialize(config);
+  } else if (type == "render") {
+    TC_ERROR_IF(!renderer, "[render] of the job needs a [renderer] first");
+    render(config);
+  } else if (type == "simulation2" || type == "simulation3") {
+    simulation_dim = type == "simulation2" ? 2 : 3;
+    if (simulation_dim == 2) {
+      simulation = create_instance<Simulation2D>(section.implementation);
+    } else {
+      simulation = create_instance<Simulation3D>(section.implementation);
+    }
+    simulation->initialize(config);
+  } else if (type == "particles") {
+    TC_ERROR_IF(!simulation, "[particles] of the job need a simulation");
+    if (simulation_dim == 2) {
+      std::static_pointer_cast<Simulation2D>(simulation)->add_particles(config);
+    } else {
+      std::static_pointer_cast<Simulation3D>(simulation)->add_particles(config);
+    }
+  } else if (type == "simulate") {
+    TC_ERROR_IF(!simulation, "[simulate] of the job needs a simulation");
+    if (simulation_dim == 2) {
+      simulate(std::static_pointer_cast<Simulation2D>(simulation), config);
+    } else {
+      simulate(std::static_pointer_cast<Simulation3D>(simulation), config);
+    }
+  } else {
+    TC_ERROR("Unknown section [{}] in the job", type);
+  }
+}
+
+void BatchJob::render(const Config &config) {
+  int stages = config.get("stages", 1);
+  real time_budget = config.get("time_budget", 0.0_f);
+  std::string output = config.get("output", std::string("output.png"));
+  int output_interval = config.get("output_interval", 0);
+  std::string checkpoint = config.get("checkpoint", std::string(""));
+  int checkpoint_interval = config.get("checkpoint_interval", 0);
+  if (!checkpoint.empty() && config.get("resume", false) &&
+      file_exists(checkpoint)) {
+    TC_INFO("Resuming from {}", checkpoint);
+    renderer->load_checkpoint(checkpoint);
+  }
+  double start = Time::get_time();
+  int stage = 0;
+  while (stage < stages) {
+    renderer->render_stage();
+    stage++;
+    double elapsed = Time::get_time() - start;
+    TC_INFO("Stage {} finished, {:.2f} s", stage, elapsed);
+    bool last = stage == stages || renderer->is_converged() ||
+                (time_budget > 0 && elapsed >= time_budget);
+    if (output_interval > 0 && stage % output_interval == 0 && !last) {
+      renderer->write_output(fmt::format(output, stage));
+    }
+    if (!checkpoint.empty() &&
+        (last ||
+         (checkpoint_interval > 0 && stage % checkpoint_interval == 0))) {
+      renderer->save_checkpoint(checkpoint);
+    }
+    if (last) {
+      break;
+    }
+  }
+  renderer->write_output(fmt::format(output, stage));
+}
+
+template <typename T>
+void BatchJob::simulate(std::shared_ptr<T> simulation, const Config &config) {
+  int frames = config.get("frames", 1);
+  real frame_dt = config.get<real>("frame_dt");
+  int substeps = config.get("substeps", 1);
+  std::string output = config.get("output", std::string(""));
+  std::string checkpoint = config.get("checkpoint", std::string(""));
+  int checkpoint_interval = config.get("checkpoint_interval", 0);
+  if (!checkpoint.empty() && config.get("resume", false) &&
+      file_exists(checkpoint)) {
+    simulation->load_checkpoint(checkpoint);
+    TC_INFO("Resuming from {}, frame {}", checkpoint, simulation->frame);
+  }
+  double start = Time::get_time();
+  while (simulation->frame < frames) {
+    for (int i = 0; i < substeps; i++) {
+      simulation->step(frame_dt / substeps);
+    }
+    simulation->frame++;
+    TC_INFO("Frame {} finished, {:.2f} s", simulation->frame,
+            Time::get_time() - start);
+    if (!output.empty()) {
+      std::string fn = fmt::format(output, simulation->frame);
+      if (ends_with(fn, ".ply")) {
+        PLYWriter ply(fn);
+        ply.add_points(simulation->get_render_particles());
+      } else {
+        simulation->write_frame(fn);
+      }
+    }
+    if (!checkpoint.empty() && checkpoint_interval > 0 &&
+        simulation->frame % checkpoint_interval == 0) {
+      simulation->save_checkpoint(checkpoint);
+    }
+  }
+  simulation->flush_frames();
+}
+
+// Runs the job file of the first parameter, after the section.key=value
+// assignments of the others
+class RunBatchJob : public Task {
+  std::string run(const std::vector<std::string> &parameters) override {
+    TC_ERROR_IF(parameters.empty(),
+                "Usage: taichi_batch job_file [section.key=value ...]");
+    BatchJob job;
+    job.load(parameters[0]);
+    for (int i = 1; i < (int)parameters.size(); i++) {
+      job.set_value(parameters[i]);
+    }
+    job.run();
+    return "";
+  }
+};
+
+TC_IMPLEMENTATION(Task, RunBatchJob, "batch");
+
+TC_NAMESPACE_END
@@ -0,0 +1,150 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#include <taichi/system/benchmark.h>
+#include <taichi/system/perf_counters.h>
+#include <taichi/system/threading.h>
+
+#include <algorithm>
+#include <cmath>
+
+TC_NAMESPACE_BEGIN
+
+namespace {
+
+// Linear interpolation between the closest ranks of sorted samples
+float64 get_percentile(const std::vector<float64> &sorted, float64 p) {
+  float64 rank = p * (sorted.size() - 1);
+  int lo = (int)std::floor(rank);
+  int hi = std::min(lo + 1, (int)sorted.size() - 1);
+  return sorted[lo] + (rank - lo) * (sorted[hi] - sorted[lo]);
+}
+
+}  // namespace
+
+BenchmarkStatistics::BenchmarkStatistics(const std::vector<float64> &samples,
+                                         const std::string &unit)
+    : samples(samples), unit(unit) {
+  TC_ASSERT(!samples.empty());
+  std::vector<float64> sorted = samples;
+  std::sort(sorted.begin(), sorted.end());
+  min = sorted.front();
+  max = sorted.back();
+  median = get_percentile(sorted, 0.5);
+  p95 = get_percentile(sorted, 0.95);
+  std::vector<float64> deviations;
+  for (auto s : sorted) {
+    deviations.push_back(std::abs(s - median));
+  }
+  std::sort(deviations.begin(), deviations.end());
+  // 1.4826 MAD estimates the standard deviation of normal samples
+  float64 threshold = 3 * 1.4826 * get_percentile(deviations, 0.5);
+  float64 sum = 0, sum2 = 0;
+  int n = 0;
+  num_outliers = 0;
+  for (auto s : sorted) {
+    if (std::abs(s - median) > threshold && threshold > 0) {
+      num_outliers++;
+      continue;
+    }
+    sum += s;
+    sum2 += s * s;
+    n++;
+  }
+  mean = sum / n;
+  stddev = n > 1 ? std::sqrt(std::max(0.0, (sum2 - sum * mean) / (n - 1))) : 0;
+}
+
+std::string BenchmarkStatistics::to_json() const {
+  std::string json = fmt::format(
+      "{{\"unit\": \"{}\", \"trials\": {}, \"mean\": {:.6g}, "
+      "\"median\": {:.6g}, \"p95\": {:.6g}, \"stddev\": {:.6g}, "
+      "\"min\": {:.6g}, \"max\": {:.6g}, \"outliers\": {}, \"samples\": [",
+      unit, samples.size(), mean, median, p95, stddev, min, max,
+      num_outliers);
+  for (int i = 0; i < (int)samples.size(); i++) {
+    json += fmt::format("{}{:.6g}", i ? ", " : "", samples[i]);
+  }
+  json += "], \"metrics\": {";
+  bool first = true;
+  for (auto &metric : metrics) {
+    json += fmt::format("{}\"{}\": {:.6g}", first ? "" : ", ", metric.first,
+                        metric.second);
+    first = false;
+  }
+  return json + "}}";
+}
+
+BenchmarkStatistics Benchmark::run_trials(int iterations) {
+  ThreadPinning pinning(pin_to_cpu);
+  // Cycles of the cores running the calling thread
+  PerfCounterGroup core_cycles({"cycles"});
+  PerfCounterGroup counters(PerfCounterGroup::parse_events(perf_counters));
+  int num_counters = (int)counters.get_events().size();
+  TC_WARN_UNLESS(num_counters == 0 || counters.valid(),
+                 "Perf counters [{}] unavailable", perf_counters);
+  std::string unit = timing == "time" ? "s" : "cycles";
+  bool use_core_cycles = false;
+  if (timing == "core_cycles") {
+    use_core_cycles = core_cycles.valid();
+    TC_WARN_UNLESS(use_core_cycles,
+                   "Core cycle counters unavailable; timing with the time "
+                   "stamp counter");
+    if (use_core_cycles) {
+      unit = "core_cycles";
+    }
+  }
+  auto now = [&]() -> float64 {
+    if (use_core_cycles) {
+      return (float64)core_cycles.read()[0];
+    } else if (unit == "s") {
+      return Time::get_time();
+    } else {
+      return (float64)Time::get_cycles();
+    }
+  };
+  metrics.clear();
+  setup();
+  for (int i = 0; i < warm_up_iterations; i++) {
+    iterate();
+  }
+  std::vector<float64> samples;
+  std::vector<std::vector<float64>> counter_samples(num_counters);
+  std::vector<uint64> counts_begin, counts_end;
+  float64 elements = (float64)iterations * workload;
+  for (int t = 0; t < trials; t++) {
+    counters.read(counts_begin);
+    float64 start_t = now();
+    for (int i = 0; i < iterations; i++) {
+      iterate();
+    }
+    float64 end_t = now();
+    counters.read(counts_end);
+    samples.push_back((end_t - start_t) / elements);
+    for (int k = 0; k < num_counters; k++) {
+      counter_samples[k].push_back((counts_end[k] - counts_begin[k]) /
+                                   elements);
+    }
+  }
+  finalize();
+  if (counters.valid()) {
+    // Medians over the trials, e.g. "cache_misses_per_element"
+    std::map<std::string, float64> medians;
+    for (int k = 0; k < num_counters; k++) {
+      const std::string &event = counters.get_events()[k];
+      medians[event] = BenchmarkStatistics(counter_samples[k], "").median;
+      metrics[event + "_per_element"] = medians[event];
+    }
+    if (medians.count("cycles") && medians.count("instructions") &&
+        medians["cycles"] > 0) {
+      metrics["ipc"] = medians["instructions"] / medians["cycles"];
+    }
+  }
+  BenchmarkStatistics stats(samples, unit);
+  stats.metrics = metrics;
+  return stats;
+}
+
+TC_NAMESPACE_END
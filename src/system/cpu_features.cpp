@@ -0,0 +1,59 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#include <taichi/system/cpu_features.h>
+
+#if defined(TC_PLATFORM_WINDOWS)
+#include <intrin.h>
+#endif
+
+TC_NAMESPACE_BEGIN
+
+static CPUFeatures detect_cpu_features() {
+  CPUFeatures features;
+#if defined(TC_PLATFORM_WINDOWS)
+  // Function 1, ECX; function 7, EBX; and XCR0 for the OS saving the
+  // AVX (bits 1, 2) and AVX-512 (bits 5 to 7) registers
+  int regs[4];
+  __cpuid(regs, 1);
+  bool os_avx = (regs[2] >> 27 & 1) && (_xgetbv(0) & 0x6) == 0x6;
+  bool os_avx512 = os_avx && (_xgetbv(0) & 0xe6) == 0xe6;
+  features.sse4_2 = regs[2] >> 20 & 1;
+  features.fma = os_avx && (regs[2] >> 12 & 1);
+  features.avx = os_avx && (regs[2] >> 28 & 1);
+  __cpuidex(regs, 7, 0);
+  features.avx2 = os_avx && (regs[1] >> 5 & 1);
+  features.avx512f = os_avx512 && (regs[1] >> 16 & 1);
+#else
+  __builtin_cpu_init();
+  features.sse4_2 = __builtin_cpu_supports("sse4.2");
+  features.avx = __builtin_cpu_supports("avx");
+  features.avx2 = __builtin_cpu_supports("avx2");
+  features.fma = __builtin_cpu_supports("fma");
+  features.avx512f = __builtin_cpu_supports("avx512f");
+#endif
+  return features;
+}
+
+std::string CPUFeatures::get_name() const {
+  if (avx512f) {
+    return "AVX-512";
+  } else if (avx2) {
+    return "AVX2";
+  } else if (avx) {
+    return "AVX";
+  } else if (sse4_2) {
+    return "SSE4.2";
+  } else {
+    return "None";
+  }
+}
+
+const CPUFeatures &get_cpu_features() {
+  static CPUFeatures features = detect_cpu_features();
+  return features;
+}
+
+TC_NAMESPACE_END
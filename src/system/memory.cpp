@@ -3,15 +3,22 @@
 #include <taichi/math.h>
 #include <taichi/util.h>
 #include <taichi/system/threading.h>
-#include <taichi/system/timer.h>
-#include <pybind11/pybind11.h>
-#include <pybind11/embed.h>
+#include <atomic>
+#include <cstdio>
+#include <mutex>
+
+#if defined(TC_PLATFORM_LINUX)
+#include <unistd.h>
+#elif defined(TC_PLATFORM_OSX)
+#include <libproc.h>
+#include <mach/mach.h>
+#include <sys/resource.h>
+#elif defined(TC_PLATFORM_WINDOWS)
+#include <psapi.h>
+#endif
 
 TC_NAMESPACE_BEGIN
 
-namespace py = pybind11;
-using namespace py::literals;
-
 constexpr size_t VirtualMemoryAllocator::page_size;
 
 float64 bytes_to_GB(float64 bytes) {
@@ -22,44 +29,96 @@ float64 get_memory_usage_gb(int pid) {
   return bytes_to_GB(get_memory_usage(pid));
 }
 
+// 0 if the process does not exist (any more)
 uint64 get_memory_usage(int pid) {
   if (pid == -1) {
     pid = PID::get_pid();
   }
-
-  auto locals = py::dict("pid"_a = pid);
-  py::exec(R"(
-        import os, psutil
-        process = psutil.Process(pid)
-        mem = process.memory_info().rss)",
-           py::globals(), locals);
-
-  return locals["mem"].cast<int64>();
+#if defined(TC_PLATFORM_LINUX)
+  // The second field of statm is the resident pages
+  auto fn = fmt::format("/proc/{}/statm", pid);
+  std::FILE *f = std::fopen(fn.c_str(), "r");
+  if (f == nullptr) {
+    return 0;
+  }
+  unsigned long long pages = 0, resident = 0;
+  int read = std::fscanf(f, "%llu %llu", &pages, &resident);
+  std::fclose(f);
+  if (read != 2) {
+    return 0;
+  }
+  return (uint64)resident * (uint64)sysconf(_SC_PAGESIZE);
+#elif defined(TC_PLATFORM_OSX)
+  if (pid == PID::get_pid()) {
+    mach_task_basic_info_data_t info;
+    mach_msg_type_number_t count = MACH_TASK_BASIC_INFO_COUNT;
+    if (task_info(mach_task_self(), MACH_TASK_BASIC_INFO,
+                  (task_info_t)&info, &count) != KERN_SUCCESS) {
+      return 0;
+    }
+    return (uint64)info.resident_size;
+  }
+  proc_taskinfo info;
+  if (proc_pidinfo(pid, PROC_PIDTASKINFO, 0, &info, sizeof(info)) !=
+      (int)sizeof(info)) {
+    return 0;
+  }
+  return (uint64)info.pti_resident_size;
+#elif defined(TC_PLATFORM_WINDOWS)
+  HANDLE process = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE,
+                               (DWORD)pid);
+  if (process == nullptr) {
+    return 0;
+  }
+  PROCESS_MEMORY_COUNTERS counters;
+  BOOL ok = GetProcessMemoryInfo(process, &counters, sizeof(counters));
+  CloseHandle(process);
+  return ok ? (uint64)counters.WorkingSetSize : 0;
+#else
+  TC_NOT_IMPLEMENTED
+  return 0;
+#endif
 }
 
-MemoryMonitor::MemoryMonitor(int pid, std::string output_fn) {
-  log.open(output_fn, std::ios_base::out);
-  locals = new py::dict;
-  (*reinterpret_cast<py::dict *>(locals))["pid"] = pid;
-  py::exec(R"(
-        import os, psutil
-        process = psutil.Process(pid))",
-           py::globals(), *reinterpret_cast<py::dict *>(locals));
+uint64 get_peak_memory_usage() {
+#if defined(TC_PLATFORM_WINDOWS)
+  PROCESS_MEMORY_COUNTERS counters;
+  if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters,
+                            sizeof(counters))) {
+    return 0;
+  }
+  return (uint64)counters.PeakWorkingSetSize;
+#elif defined(TC_PLATFORM_LINUX)
+  // The high water mark of the resident set, as counted for statm
+  std::FILE *f = std::fopen("/proc/self/status", "r");
+  if (f == nullptr) {
+    return 0;
+  }
+  char line[256];
+  unsigned long long kb = 0;
+  while (std::fgets(line, sizeof(line), f) != nullptr) {
+    if (std::sscanf(line, "VmHWM: %llu kB", &kb) == 1) {
+      break;
+    }
+  }
+  std::fclose(f);
+  return (uint64)kb * 1024;
+#else
+  rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0) {
+    return 0;
+  }
+  // In bytes on OS X
+  return (uint64)usage.ru_maxrss;
+#endif
 }
 
-MemoryMonitor::~MemoryMonitor() {
-  delete reinterpret_cast<py::dict *>(locals);
+MemoryMonitor::MemoryMonitor(int pid, std::string output_fn) : pid(pid) {
+  log.open(output_fn, std::ios_base::out);
 }
 
 uint64 MemoryMonitor::get_usage() const {
-  py::gil_scoped_acquire acquire;
-  py::exec(R"(
-        try:
-          mem = process.memory_info().rss
-        except:
-          mem = -1)",
-           py::globals(), *reinterpret_cast<py::dict *>(locals));
-  return (*reinterpret_cast<py::dict *>(locals))["mem"].cast<uint64>();
+  return get_memory_usage(pid);
 }
 
 void MemoryMonitor::append_sample() {
@@ -86,6 +145,64 @@ void start_memory_monitoring(std::string output_fn, int pid, real interval) {
   th.detach();
 }
 
+// The peak of the innermost phase running; outer phases take it over when
+// it ends
+static std::atomic<uint64> phase_peak(0);
+static std::atomic<int> phase_depth(0);
+static std::mutex phase_mut;
+static std::map<std::string, uint64> phase_peaks;
+
+static void raise_phase_peak(uint64 usage) {
+  uint64 peak = phase_peak.load(std::memory_order_relaxed);
+  while (usage > peak && !phase_peak.compare_exchange_weak(peak, usage)) {
+  }
+}
+
+MemoryPhase::MemoryPhase(const std::string &name) : name(name) {
+  phase_depth++;
+  outer_peak = phase_peak.exchange(get_memory_usage());
+}
+
+MemoryPhase::~MemoryPhase() {
+  sample();
+  uint64 peak = phase_peak.exchange(outer_peak);
+  raise_phase_peak(peak);
+  phase_depth--;
+  std::lock_guard<std::mutex> _(phase_mut);
+  auto &recorded = phase_peaks[name];
+  recorded = std::max(recorded, peak);
+}
+
+std::map<std::string, uint64> MemoryPhase::get_peaks() {
+  std::lock_guard<std::mutex> _(phase_mut);
+  return phase_peaks;
+}
+
+void MemoryPhase::clear() {
+  std::lock_guard<std::mutex> _(phase_mut);
+  phase_peaks.clear();
+}
+
+void MemoryPhase::sample() {
+  if (phase_depth.load(std::memory_order_relaxed) > 0) {
+    raise_phase_peak(get_memory_usage());
+  }
+}
+
+void start_memory_sampling(real interval) {
+  static std::atomic<bool> started(false);
+  if (started.exchange(true)) {
+    return;
+  }
+  std::thread th([=]() {
+    while (true) {
+      MemoryPhase::sample();
+      Time::sleep(interval);
+    }
+  });
+  th.detach();
+}
+
 class MemoryTest : public Task {
  public:
   std::string run(const std::vector<std::string> &parameters) override {
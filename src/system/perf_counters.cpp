@@ -0,0 +1,144 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#include <taichi/system/perf_counters.h>
+
+#include <algorithm>
+
+#if defined(TC_PLATFORM_LINUX)
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+TC_NAMESPACE_BEGIN
+
+#if defined(TC_PLATFORM_LINUX)
+namespace {
+
+uint64 hw_cache_event(uint64 cache, uint64 op, uint64 result) {
+  return cache | (op << 8) | (result << 16);
+}
+
+// False for unknown names
+bool get_event_attr(const std::string &name, perf_event_attr &attr) {
+  std::fill((char *)&attr, (char *)&attr + sizeof(attr), 0);
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_HARDWARE;
+  if (starts_with(name, "raw:")) {
+    attr.type = PERF_TYPE_RAW;
+    attr.config = std::stoull(name.substr(4), nullptr, 16);
+    return true;
+  }
+  struct Event {
+    const char *name;
+    uint32 type;
+    uint64 config;
+  };
+  static const Event table[] = {
+      {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+      {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+      {"branches", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_INSTRUCTIONS},
+      {"branch_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+      {"cache_references", PERF_TYPE_HARDWARE,
+       PERF_COUNT_HW_CACHE_REFERENCES},
+      {"cache_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+      {"stalled_cycles_frontend", PERF_TYPE_HARDWARE,
+       PERF_COUNT_HW_STALLED_CYCLES_FRONTEND},
+      {"stalled_cycles_backend", PERF_TYPE_HARDWARE,
+       PERF_COUNT_HW_STALLED_CYCLES_BACKEND},
+      {"l1d_read_misses", PERF_TYPE_HW_CACHE,
+       hw_cache_event(PERF_COUNT_HW_CACHE_L1D, PERF_COUNT_HW_CACHE_OP_READ,
+                      PERF_COUNT_HW_CACHE_RESULT_MISS)},
+      {"llc_read_misses", PERF_TYPE_HW_CACHE,
+       hw_cache_event(PERF_COUNT_HW_CACHE_LL, PERF_COUNT_HW_CACHE_OP_READ,
+                      PERF_COUNT_HW_CACHE_RESULT_MISS)},
+      {"dtlb_read_misses", PERF_TYPE_HW_CACHE,
+       hw_cache_event(PERF_COUNT_HW_CACHE_DTLB, PERF_COUNT_HW_CACHE_OP_READ,
+                      PERF_COUNT_HW_CACHE_RESULT_MISS)},
+      {"task_clock", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK},
+      {"page_faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS},
+  };
+  for (auto &event : table) {
+    if (name == event.name) {
+      attr.type = event.type;
+      attr.config = event.config;
+      return true;
+    }
+  }
+  return false;
+}
+
+}  // namespace
+#endif
+
+PerfCounterGroup::PerfCounterGroup(const std::vector<std::string> &events)
+    : events(events) {
+  TC_ERROR_IF(events.size() > 64, "Too many perf events in a group");
+#if defined(TC_PLATFORM_LINUX)
+  for (auto &name : events) {
+    perf_event_attr attr;
+    TC_ERROR_IF(!get_event_attr(name, attr), "Unknown perf event [{}]", name);
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |
+                       PERF_FORMAT_TOTAL_TIME_RUNNING;
+    int leader = fds.empty() ? -1 : fds[0];
+    int fd = (int)syscall(__NR_perf_event_open, &attr, 0, -1, leader, 0);
+    if (fd == -1) {
+      for (int f : fds) {
+        close(f);
+      }
+      fds.clear();
+      return;
+    }
+    fds.push_back(fd);
+  }
+#endif
+}
+
+std::vector<std::string> PerfCounterGroup::parse_events(
+    const std::string &events) {
+  std::vector<std::string> ret;
+  std::size_t begin = 0;
+  while (begin < events.size()) {
+    std::size_t end = std::min(events.find(',', begin), events.size());
+    std::string name = trim_string(events.substr(begin, end - begin));
+    if (!name.empty()) {
+      ret.push_back(name);
+    }
+    begin = end + 1;
+  }
+  return ret;
+}
+
+PerfCounterGroup::~PerfCounterGroup() {
+#if defined(TC_PLATFORM_LINUX)
+  for (int fd : fds) {
+    close(fd);
+  }
+#endif
+}
+
+void PerfCounterGroup::read(uint64 *counts) const {
+  std::fill(counts, counts + events.size(), 0);
+#if defined(TC_PLATFORM_LINUX)
+  if (fds.empty()) {
+    return;
+  }
+  // nr, time_enabled, time_running, then the values
+  uint64 buffer[3 + 64];
+  std::size_t size = (3 + events.size()) * sizeof(uint64);
+  if (::read(fds[0], buffer, size) != (ssize_t)size || buffer[2] == 0) {
+    return;
+  }
+  float64 scale = (float64)buffer[1] / buffer[2];
+  for (int i = 0; i < (int)events.size(); i++) {
+    counts[i] = (uint64)(buffer[3 + i] * scale);
+  }
+#endif
+}
+
+TC_NAMESPACE_END
@@ -0,0 +1,216 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#include <taichi/system/profiler.h>
+
+#include <deque>
+#include <fstream>
+#include <unordered_map>
+
+TC_NAMESPACE_BEGIN
+
+namespace {
+
+class ScopeNames {
+ public:
+  int get_id(const std::string &name) {
+    std::lock_guard<std::mutex> _(mut);
+    auto it = ids.find(name);
+    if (it != ids.end()) {
+      return it->second;
+    }
+    int id = (int)names.size();
+    names.push_back(name);
+    ids[name] = id;
+    return id;
+  }
+
+  const std::string &get_name(int id) {
+    std::lock_guard<std::mutex> _(mut);
+    return names[id];
+  }
+
+  static ScopeNames &get_instance() {
+    static ScopeNames scope_names;
+    return scope_names;
+  }
+
+ private:
+  std::mutex mut;
+  // Deque elements keep their addresses
+  std::deque<std::string> names;
+  std::unordered_map<std::string, int> ids;
+};
+
+void merge_records(const ThreadProfile &profile,
+                   int node,
+                   float64 seconds_per_cycle,
+                   ProfilerRecords::Node *dst) {
+  for (int ch : profile.nodes[node].childs) {
+    auto &src = profile.nodes[ch];
+    if (src.num_samples == 0 && src.childs.empty()) {
+      continue;
+    }
+    auto *dst_ch = dst->get_child(get_profiler_scope_name(src.scope));
+    dst_ch->total_time += src.total_cycles * seconds_per_cycle;
+    dst_ch->num_samples += src.num_samples;
+    dst_ch->total_elements += src.total_elements;
+    dst_ch->account_tpe = dst_ch->account_tpe || src.account_tpe;
+    for (int i = 0; i < (int)src.total_counts.size(); i++) {
+      dst_ch->counts[profile.counters->get_events()[i]] += src.total_counts[i];
+    }
+    merge_records(profile, ch, seconds_per_cycle, dst_ch);
+  }
+}
+
+std::string escape_json(const std::string &s) {
+  std::string escaped;
+  for (char c : s) {
+    if (c == '"' || c == '\\') {
+      escaped += '\\';
+      escaped += c;
+    } else if ((unsigned char)c < 0x20) {
+      escaped += fmt::format("\\u{:04x}", (int)c);
+    } else {
+      escaped += c;
+    }
+  }
+  return escaped;
+}
+
+}  // namespace
+
+int get_profiler_scope_id(const std::string &name) {
+  return ScopeNames::get_instance().get_id(name);
+}
+
+const std::string &get_profiler_scope_name(int scope) {
+  return ScopeNames::get_instance().get_name(scope);
+}
+
+ProfilerRecords::ProfilerRecords() {
+  enabled = true;
+  tracing = false;
+  counter_version = 0;
+  start_time = Time::get_time();
+  start_cycles = Time::get_cycles();
+}
+
+ThreadProfile *ProfilerRecords::register_thread() {
+  std::lock_guard<std::mutex> _(mut);
+  threads.push_back(std::make_unique<ThreadProfile>((int)threads.size()));
+  return threads.back().get();
+}
+
+float64 ProfilerRecords::get_seconds_per_cycle() const {
+  float64 elapsed = Time::get_time() - start_time;
+  uint64 cycles = Time::get_cycles() - start_cycles;
+  return cycles == 0 ? 0.0_f64 : elapsed / (float64)cycles;
+}
+
+std::unique_ptr<ProfilerRecords::Node> ProfilerRecords::get_merged_records()
+    const {
+  auto root = std::make_unique<Node>("[Profiler]", nullptr);
+  float64 seconds_per_cycle = get_seconds_per_cycle();
+  std::lock_guard<std::mutex> _(mut);
+  for (auto &profile : threads) {
+    merge_records(*profile, 0, seconds_per_cycle, root.get());
+  }
+  return root;
+}
+
+void ProfilerRecords::print() {
+  auto root = get_merged_records();
+  fmt::print_colored(fmt::CYAN, std::string(80, '>') + "\n");
+  print(root.get(), 0);
+  fmt::print_colored(fmt::CYAN, std::string(80, '>') + "\n");
+}
+
+void ProfilerRecords::write_chrome_trace(const std::string &file_name) const {
+  std::ofstream os(file_name);
+  TC_ERROR_IF(!os, "Cannot open trace file [{}]", file_name);
+  float64 us_per_cycle = get_seconds_per_cycle() * 1e6;
+  std::lock_guard<std::mutex> _(mut);
+  os << "{\"traceEvents\":[";
+  bool first = true;
+  for (auto &profile : threads) {
+    for (auto &event : profile->events) {
+      os << (first ? "\n" : ",\n");
+      first = false;
+      os << fmt::format(
+          "{{\"name\":\"{}\",\"ph\":\"X\",\"pid\":0,\"tid\":{},"
+          "\"ts\":{:.3f},\"dur\":{:.3f}}}",
+          escape_json(get_profiler_scope_name(event.scope)),
+          profile->thread_index,
+          (int64)(event.begin_cycles - start_cycles) * us_per_cycle,
+          (event.end_cycles - event.begin_cycles) * us_per_cycle);
+    }
+  }
+  os << "\n]}\n";
+}
+
+void ProfilerRecords::clear() {
+  std::lock_guard<std::mutex> _(mut);
+  for (auto &profile : threads) {
+    // Nodes stay, for the scopes open in the calling thread
+    for (auto &node : profile->nodes) {
+      node.total_cycles = 0;
+      node.total_elements = 0;
+      node.num_samples = 0;
+      node.account_tpe = false;
+      node.total_counts.clear();
+    }
+    profile->events.clear();
+  }
+}
+
+std::string ProfilerRecords::get_readable_counts(const Node *node) {
+  std::string ret;
+  for (auto &count : node->counts) {
+    ret += fmt::format("{}{} {:.3g}", ret.empty() ? "" : ", ", count.first,
+                       count.second);
+    if (node->account_tpe && node->total_elements > 0) {
+      ret += fmt::format(" ({:.3g} / element)",
+                         count.second / node->total_elements);
+    }
+  }
+  auto cycles = node->counts.find("cycles");
+  auto instructions = node->counts.find("instructions");
+  if (cycles != node->counts.end() && instructions != node->counts.end() &&
+      cycles->second > 0) {
+    ret += fmt::format(", ipc {:.3g}", instructions->second / cycles->second);
+  }
+  return ret;
+}
+
+void ProfilerRecords::set_counters(const std::vector<std::string> &events) {
+  TC_ERROR_IF((int)events.size() > ThreadProfile::max_counters,
+              "At most {} perf events are counted per scope",
+              ThreadProfile::max_counters);
+  {
+    std::lock_guard<std::mutex> _(mut);
+    counter_events = events;
+    counter_version++;
+  }
+  clear();
+}
+
+void ProfilerRecords::update_counters(ThreadProfile &profile) {
+  std::vector<std::string> events;
+  {
+    std::lock_guard<std::mutex> _(mut);
+    events = counter_events;
+    profile.counter_version = counter_version.load();
+  }
+  profile.counters = nullptr;
+  if (!events.empty()) {
+    profile.counters = std::make_unique<PerfCounterGroup>(events);
+    TC_WARN_UNLESS(profile.counters->valid(),
+                   "Perf counters unavailable in profiler thread {}",
+                   profile.thread_index);
+  }
+}
+
+TC_NAMESPACE_END
@@ -0,0 +1,60 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#include <taichi/system/statistics.h>
+
+TC_NAMESPACE_BEGIN
+
+Statistics &Statistics::get_instance() {
+  static Statistics statistics;
+  return statistics;
+}
+
+int Statistics::get_counter_id(const std::string &name) {
+  auto &s = get_instance();
+  std::lock_guard<std::mutex> _(s.mut);
+  auto it = s.ids.find(name);
+  if (it != s.ids.end()) {
+    return it->second;
+  }
+  int id = (int)s.names.size();
+  TC_ERROR_IF(id >= max_counters, "Too many statistics counters (max {})",
+              max_counters);
+  s.names.push_back(name);
+  s.ids[name] = id;
+  return id;
+}
+
+Statistics::ThreadCounters *Statistics::register_thread() {
+  std::lock_guard<std::mutex> _(mut);
+  threads.push_back(std::make_unique<ThreadCounters>());
+  return threads.back().get();
+}
+
+std::map<std::string, int64> Statistics::get_counters() {
+  auto &s = get_instance();
+  std::lock_guard<std::mutex> _(s.mut);
+  std::map<std::string, int64> counters;
+  for (int i = 0; i < (int)s.names.size(); i++) {
+    int64 sum = 0;
+    for (auto &t : s.threads) {
+      sum += t->values[i].load(std::memory_order_relaxed);
+    }
+    counters[s.names[i]] = sum;
+  }
+  return counters;
+}
+
+void Statistics::clear() {
+  auto &s = get_instance();
+  std::lock_guard<std::mutex> _(s.mut);
+  for (auto &t : s.threads) {
+    for (auto &v : t->values) {
+      v.store(0, std::memory_order_relaxed);
+    }
+  }
+}
+
+TC_NAMESPACE_END
@@ -4,7 +4,258 @@
 *******************************************************************************/
 
 #include <taichi/system/threading.h>
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+
+#if defined(TC_PLATFORM_LINUX)
+#include <pthread.h>
+#include <sched.h>
+#endif
 
 TC_NAMESPACE_BEGIN
 
+static std::atomic<bool> thread_pinning(false);
+
+void ThreadedTaskManager::set_thread_pinning(bool pin) {
+  thread_pinning = pin;
+}
+
+bool ThreadedTaskManager::get_thread_pinning() {
+  return thread_pinning.load(std::memory_order_relaxed);
+}
+
+#if defined(TC_PLATFORM_LINUX)
+// E.g. "0-3,8-11"
+static std::vector<int> parse_cpu_list(const std::string &list) {
+  std::vector<int> cpus;
+  std::stringstream ss(list);
+  std::string range;
+  while (std::getline(ss, range, ',')) {
+    int first, last;
+    int n = std::sscanf(range.c_str(), "%d-%d", &first, &last);
+    if (n == 1) {
+      last = first;
+    } else if (n != 2) {
+      continue;
+    }
+    for (int cpu = first; cpu <= last; cpu++) {
+      cpus.push_back(cpu);
+    }
+  }
+  return cpus;
+}
+#endif
+
+static std::vector<std::vector<int>> find_numa_nodes() {
+  std::vector<std::vector<int>> nodes;
+#if defined(TC_PLATFORM_LINUX)
+  cpu_set_t allowed;
+  CPU_ZERO(&allowed);
+  bool has_mask = sched_getaffinity(0, sizeof(allowed), &allowed) == 0;
+  for (int node = 0;; node++) {
+    std::ifstream f(
+        fmt::format("/sys/devices/system/node/node{}/cpulist", node));
+    if (!f) {
+      break;
+    }
+    std::string list;
+    std::getline(f, list);
+    std::vector<int> cpus;
+    for (int cpu : parse_cpu_list(list)) {
+      if (cpu < CPU_SETSIZE && (!has_mask || CPU_ISSET(cpu, &allowed))) {
+        cpus.push_back(cpu);
+      }
+    }
+    if (!cpus.empty()) {
+      nodes.push_back(cpus);
+    }
+  }
+#endif
+  if (nodes.empty()) {
+    std::vector<int> cpus;
+    for (int i = 0; i < (int)std::max(1u, std::thread::hardware_concurrency());
+         i++) {
+      cpus.push_back(i);
+    }
+    nodes.push_back(cpus);
+  }
+  return nodes;
+}
+
+const std::vector<std::vector<int>> &ThreadedTaskManager::get_numa_nodes() {
+  static std::vector<std::vector<int>> nodes = find_numa_nodes();
+  return nodes;
+}
+
+#if !defined(TC_AMALGAMATED)
+// Pins the threads entering the arena, with pinning on, by their slot
+class ArenaPinningObserver : public tbb::task_scheduler_observer {
+ public:
+  explicit ArenaPinningObserver(tbb::task_arena &arena)
+      : tbb::task_scheduler_observer(arena) {
+    for (auto &node : ThreadedTaskManager::get_numa_nodes()) {
+      cpus.insert(cpus.end(), node.begin(), node.end());
+    }
+    observe(true);
+  }
+
+  void on_scheduler_entry(bool) override {
+    // A stack, for the arenas that threads enter from others
+    int cpu = -1;
+    if (ThreadedTaskManager::get_thread_pinning()) {
+      int slot = tbb::this_task_arena::current_thread_index();
+      cpu = cpus[std::max(slot, 0) % cpus.size()];
+    }
+    get_pinnings().push_back(std::make_unique<ThreadPinning>(cpu));
+  }
+
+  void on_scheduler_exit(bool) override {
+    auto &pinnings = get_pinnings();
+    if (!pinnings.empty()) {
+      pinnings.pop_back();
+    }
+  }
+
+ private:
+  std::vector<int> cpus;
+
+  static std::vector<std::unique_ptr<ThreadPinning>> &get_pinnings() {
+    thread_local std::vector<std::unique_ptr<ThreadPinning>> pinnings;
+    return pinnings;
+  }
+};
+
+tbb::task_arena &ThreadedTaskManager::get_arena(int num_threads) {
+  struct Arena {
+    std::unique_ptr<tbb::task_arena> arena;
+    std::unique_ptr<ArenaPinningObserver> observer;
+  };
+  static std::mutex mut;
+  // Not destructed, as threads may still run in them at exit
+  static auto arenas = new std::map<int, Arena>();
+  std::lock_guard<std::mutex> _(mut);
+  auto &entry = (*arenas)[num_threads];
+  if (!entry.arena) {
+    entry.arena = std::make_unique<tbb::task_arena>(
+        num_threads > 0 ? num_threads : (int)tbb::task_arena::automatic);
+    entry.arena->initialize();
+    entry.observer = std::make_unique<ArenaPinningObserver>(*entry.arena);
+  }
+  return *entry.arena;
+}
+#endif
+
+int TaskGraph::add_node(const std::function<void()> &task) {
+  nodes.push_back(Node{task, {}, 0});
+  return (int)nodes.size() - 1;
+}
+
+void TaskGraph::add_edge(int before, int after) {
+  int n = (int)nodes.size();
+  TC_ERROR_IF(before < 0 || before >= n || after < 0 || after >= n,
+              "Edge ({}, {}) between the nodes of a task graph of {}", before,
+              after, n);
+  nodes[before].successors.push_back(after);
+  nodes[after].num_predecessors++;
+}
+
+void TaskGraph::run() {
+  int n = (int)nodes.size();
+  // The order of Kahn's algorithm, for the cycle check and serial runs
+  std::vector<int> order, pending_serial(n);
+  for (int i = 0; i < n; i++) {
+    pending_serial[i] = nodes[i].num_predecessors;
+    if (pending_serial[i] == 0) {
+      order.push_back(i);
+    }
+  }
+  for (int k = 0; k < (int)order.size(); k++) {
+    for (int s : nodes[order[k]].successors) {
+      if (--pending_serial[s] == 0) {
+        order.push_back(s);
+      }
+    }
+  }
+  TC_ERROR_IF((int)order.size() != n, "The task graph has a cycle");
+#if !defined(TC_AMALGAMATED)
+  std::unique_ptr<std::atomic<int>[]> pending(new std::atomic<int>[n]);
+  for (int i = 0; i < n; i++) {
+    pending[i].store(nodes[i].num_predecessors);
+  }
+  auto body = [&]() {
+    tbb::task_group group;
+    // The last predecessor to finish spawns the node
+    std::function<void(int)> spawn = [&](int i) {
+      group.run([&, i]() {
+        nodes[i].task();
+        for (int s : nodes[i].successors) {
+          if (--pending[s] == 0) {
+            spawn(s);
+          }
+        }
+      });
+    };
+    for (int i = 0; i < n; i++) {
+      if (nodes[i].num_predecessors == 0) {
+        spawn(i);
+      }
+    }
+    group.wait();
+  };
+  if (num_threads > 0 || ThreadedTaskManager::get_thread_pinning()) {
+    ThreadedTaskManager::get_arena(num_threads).execute(body);
+  } else {
+    body();
+  }
+#else
+  for (int i : order) {
+    nodes[i].task();
+  }
+#endif
+}
+
+ThreadPinning::ThreadPinning(int cpu) {
+  pinned = false;
+  if (cpu < 0) {
+    return;
+  }
+#if defined(TC_PLATFORM_LINUX)
+  static_assert(sizeof(cpu_set_t) <= sizeof(saved_mask),
+                "cpu_set_t does not fit the saved mask");
+  cpu_set_t *saved = reinterpret_cast<cpu_set_t *>(saved_mask);
+  TC_ERROR_IF(cpu >= CPU_SETSIZE, "CPU {} out of range", cpu);
+  if (pthread_getaffinity_np(pthread_self(), sizeof(cpu_set_t), saved) != 0) {
+    return;
+  }
+  cpu_set_t mask;
+  CPU_ZERO(&mask);
+  CPU_SET(cpu, &mask);
+  pinned = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &mask) ==
+           0;
+#elif defined(TC_PLATFORM_WINDOWS)
+  TC_ERROR_IF(cpu >= 64, "CPU {} out of range", cpu);
+  DWORD_PTR previous =
+      SetThreadAffinityMask(GetCurrentThread(), DWORD_PTR(1) << cpu);
+  saved_mask[0] = (uint64)previous;
+  pinned = previous != 0;
+#endif
+  TC_WARN_UNLESS(pinned, "Failed to pin the thread to CPU {}", cpu);
+}
+
+ThreadPinning::~ThreadPinning() {
+  if (!pinned) {
+    return;
+  }
+#if defined(TC_PLATFORM_LINUX)
+  pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t),
+                         reinterpret_cast<cpu_set_t *>(saved_mask));
+#elif defined(TC_PLATFORM_WINDOWS)
+  SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)saved_mask[0]);
+#endif
+}
+
 TC_NAMESPACE_END
@@ -6,6 +6,10 @@
 #include <taichi/common/util.h>
 #include <taichi/common/task.h>
 #include <taichi/math/array.h>
+#include <taichi/math/array_parallel.h>
+#include <taichi/math/array_pool.h>
+#include <taichi/math/array_sample.h>
+#include <taichi/math/array_3d_layout.h>
 #include <taichi/testing.h>
 
 TC_NAMESPACE_BEGIN
@@ -17,4 +21,181 @@ TC_TEST("array") {
   TC_CHECK(A.get_size() == B.get_size());
 }
 
+// Against the serial members, on more entries than one block
+TC_TEST("array_parallel") {
+  using Array = Array3D<real>;
+  Vector3i res(17, 33, 29);
+  Array x(res), y(res), p(res), q(res);
+  for (int i = 0; i < x.get_size(); i++) {
+    x.data[i] = rand() - 0.5_f;
+    y.data[i] = rand() - 0.5_f;
+    p.data[i] = rand() - 0.5_f;
+    q.data[i] = rand() - 0.5_f;
+  }
+  auto max_difference = [](const Array &a, const Array &b) {
+    real diff = 0;
+    for (int i = 0; i < a.get_size(); i++) {
+      diff = std::max(diff, std::abs(a.data[i] - b.data[i]));
+    }
+    return diff;
+  };
+  CHECK(std::abs(dot_product(x, y) - x.dot_double(y)) < 1e-3_f);
+  CHECK(p_abs_max(x) == x.abs_max());
+  Array expected_x = x, expected_r = y;
+  expected_x.add_in_place(0.3_f, p);
+  expected_r.add_in_place(-0.3_f, q);
+  real r_max = p_update_solution_and_residual(x, y, 0.3_f, p, q);
+  CHECK(max_difference(x, expected_x) < 1e-6_f);
+  CHECK(max_difference(y, expected_r) < 1e-6_f);
+  CHECK(std::abs(r_max - expected_r.abs_max()) < 1e-6_f);
+  Array expected_p = p;
+  for (int i = 0; i < p.get_size(); i++) {
+    expected_p.data[i] = q.data[i] + 0.5_f * p.data[i];
+  }
+  p_add_in_place2(q, 0.5_f, p);
+  CHECK(max_difference(p, expected_p) < 1e-6_f);
+}
+
+// Every cell once, in regions smaller and larger than a grain
+TC_TEST("parallel_for") {
+  for (int grain_size : {1, 7, region_grain_size}) {
+    Array2D<int> a(Vector2i(70, 90), 0);
+    parallel_for(Region2D(Vector2i(3, 4), Vector2i(60, 90)),
+                 [&](const Vector2i &ind) { a[ind] += 1; }, -1, grain_size);
+    bool correct = true;
+    for (auto &ind : a.get_region()) {
+      bool inside = 3 <= ind.i && ind.i < 60 && 4 <= ind.j;
+      correct = correct && a[ind] == (int)inside;
+    }
+    CHECK(correct);
+    Array3D<int> b(Vector3i(20, 9, 31), 0);
+    parallel_for(b.get_region(), [&](const Vector3i &ind) { b[ind] += 1; },
+                 -1, grain_size);
+    CHECK(std::all_of(b.data.begin(), b.data.end(),
+                      [](int v) { return v == 1; }));
+  }
+}
+
+// Aligned storage, filled with the initial value, for small and page-backed
+// arrays
+TC_TEST("array_storage") {
+  for (int n : {5, 300}) {
+    Array3D<real> a(Vector3i(n, 7, n), 3.0_f);
+    CHECK((std::size_t)a.data.data() % array_alignment == 0);
+    CHECK(std::all_of(a.data.begin(), a.data.end(),
+                      [](real v) { return v == 3.0_f; }));
+    Array2D<Vector3> b(Vector2i(n, n * 7), Vector3(1, 2, 3));
+    CHECK((std::size_t)b.data.data() % array_alignment == 0);
+    CHECK(std::all_of(b.data.begin(), b.data.end(),
+                      [](const Vector3 &v) { return v == Vector3(1, 2, 3); }));
+    Array3D<real> c(a);
+    CHECK(c.data == a.data);
+  }
+}
+
+// Same values and samples as Array3D, and every cell once in storage order
+template <typename Layout>
+static void test_layout(const Array3D<real> &a) {
+  LayoutArray3D<real, Layout> b(a);
+  CHECK(b.get_res() == a.get_res());
+  CHECK(b.to_array().data == a.data);
+  real max_error = 0;
+  for (int t = 0; t < 1000; t++) {
+    Vector3 pos = Vector3(rand(), rand(), rand()) *
+                  (a.get_res().template cast<real>() + Vector3(2)) -
+                  Vector3(1);
+    max_error = std::max(max_error, std::abs(a.sample(pos) - b.sample(pos)));
+  }
+  CHECK(max_error < 1e-5_f);
+  Array3D<int> visits(a.get_res(), 0);
+  b.for_each_cell([&](int i, int j, int k) { visits[i][j][k] += 1; });
+  CHECK(std::all_of(visits.data.begin(), visits.data.end(),
+                    [](int v) { return v == 1; }));
+}
+
+TC_TEST("array_layout") {
+  Array3D<real> a(Vector3i(13, 8, 21));
+  for (auto &ind : a.get_region()) {
+    a[ind] = rand();
+  }
+  test_layout<LinearLayout3D>(a);
+  test_layout<BlockedLayout3D<2>>(a);
+  test_layout<BlockedLayout3D<3>>(a);
+  test_layout<MortonLayout3D>(a);
+}
+
+// Batches against sample(), on partial batches and positions outside the
+// arrays; monotonic cubics within the samples and exact on linear data inside
+TC_TEST("array_sample") {
+  const int n = 203;
+  Array2D<real> a(Vector2i(17, 23));
+  Array3D<real> b(Vector3i(13, 9, 21));
+  for (auto &ind : a.get_region()) {
+    a[ind] = rand();
+  }
+  for (auto &ind : b.get_region()) {
+    b[ind] = rand();
+  }
+  std::vector<Vector2> pos2(n);
+  std::vector<Vector3> pos3(n);
+  for (int i = 0; i < n; i++) {
+    pos2[i] = Vector2(rand(), rand()) * Vector2(19, 25) - Vector2(1.5_f);
+    pos3[i] = Vector3(rand(), rand(), rand()) * Vector3(15, 11, 23) -
+              Vector3(1.5_f);
+  }
+  std::vector<real> out2(n), out3(n);
+  sample_batch(a, pos2.data(), n, out2.data());
+  sample_batch(b, pos3.data(), n, out3.data());
+  real batch_error = 0, cubic_excess = 0;
+  for (int i = 0; i < n; i++) {
+    batch_error = std::max(batch_error, std::abs(out2[i] - a.sample(pos2[i])));
+    batch_error = std::max(batch_error, std::abs(out3[i] - b.sample(pos3[i])));
+    real c = sample_monotonic_cubic(a, pos2[i]);
+    cubic_excess = std::max(cubic_excess, std::max(-c, c - 1));
+  }
+  CHECK(batch_error < 1e-5_f);
+  CHECK(cubic_excess < 1e-5_f);
+  real interior_error = 0, linear_error = 0;
+  Array3D<real> linear(b.get_res());
+  for (auto &ind : linear.get_region()) {
+    linear[ind] = ind.i + 2.0_f * ind.j - 0.5_f * ind.k;
+  }
+  for (int i = 0; i < n; i++) {
+    Vector3 p = Vector3(rand(), rand(), rand()) * Vector3(11, 7, 19) +
+                Vector3(0.5_f);
+    interior_error =
+        std::max(interior_error, std::abs(sample_interior(b, p) - b.sample(p)));
+    Vector2 q(p.x, p.y);
+    interior_error =
+        std::max(interior_error, std::abs(sample_interior(a, q) - a.sample(q)));
+    // Away from the borders, where taps are clamped
+    Vector3 r = Vector3(rand(), rand(), rand()) * Vector3(9, 5, 17) +
+                Vector3(1.5_f);
+    linear_error = std::max(linear_error,
+                            std::abs(sample_monotonic_cubic(linear, r) -
+                                     linear.sample(r)));
+  }
+  CHECK(interior_error < 1e-5_f);
+  CHECK(linear_error < 1e-4_f);
+}
+
+TC_TEST("array_pool") {
+  ArrayPool<3, real> pool;
+  Array3D<real> *first;
+  {
+    auto a = pool.acquire(Vector3i(4, 5, 6));
+    first = a.get();
+    (*a)[1][2][3] = 7;
+  }
+  auto b = pool.acquire(Vector3i(4, 5, 6));
+  // Again, with the cells of its last use
+  TC_CHECK(b.get() == first);
+  TC_CHECK((*b)[1][2][3] == 7);
+  auto c = pool.acquire(Vector3i(4, 5, 6));
+  TC_CHECK(c.get() != first);
+  auto d = pool.acquire(Vector3i(4, 5, 6), Vector3(0.0_f));
+  TC_CHECK(d->get_storage_offset() == Vector3(0.0_f));
+  TC_CHECK(pool.acquire_like(*d)->get_res() == Vector3i(4, 5, 6));
+}
+
 TC_NAMESPACE_END
@@ -0,0 +1,61 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#include <taichi/common/asset_cache.h>
+#include <taichi/visual/texture.h>
+#include <taichi/testing.h>
+
+#include <cstdio>
+#include <fstream>
+
+TC_NAMESPACE_BEGIN
+
+TC_TEST("asset_cache") {
+  auto hits = [] { return Statistics::get_counters()["asset_cache_hits"]; };
+  int64 hits_before = hits();
+  Config red, green;
+  red.set("value", Vector4(1, 0, 0, 1));
+  green.set("value", Vector4(0, 1, 0, 1));
+  auto a = AssetCache::create<Texture>("const", red);
+  auto b = AssetCache::create<Texture>("const", red);
+  auto c = AssetCache::create<Texture>("const", green);
+  CHECK(a == b);
+  CHECK(a != c);
+  CHECK(hits() == hits_before + 1);
+  CHECK(length(a->sample(Vector2(0.5_f)) - Vector4(1, 0, 0, 1)) < 1e-6_f);
+  // Registered once
+  CHECK(AssetManager::insert_asset(a) == AssetManager::insert_asset(b));
+  // Held weakly: made again once released
+  c.reset();
+  c = AssetCache::create<Texture>("const", green);
+  CHECK(hits() == hits_before + 1);
+  CHECK(length(c->sample(Vector2(0.5_f)) - Vector4(0, 1, 0, 1)) < 1e-6_f);
+}
+
+// Files are keyed by their contents, not their names
+TC_TEST("asset_cache_files") {
+  std::string fn[3] = {"test_asset_cache_0.bin", "test_asset_cache_1.bin",
+                       "test_asset_cache_2.bin"};
+  std::string contents[3] = {std::string(100003, 'x'),
+                             std::string(100003, 'x'),
+                             std::string(100003, 'x') + "y"};
+  for (int i = 0; i < 3; i++) {
+    std::ofstream(fn[i], std::ios::binary) << contents[i];
+  }
+  AssetCache &cache = AssetCache::get_instance();
+  auto key = [&](const std::string &name) {
+    Config config;
+    config.set("filename", name);
+    return cache.get_key("Texture", "image", config);
+  };
+  CHECK(key(fn[0]) == key(fn[1]));
+  CHECK(key(fn[0]) != key(fn[2]));
+  CHECK(key(fn[0]) != key("test_asset_cache_missing.bin"));
+  for (auto &f : fn) {
+    std::remove(f.c_str());
+  }
+}
+
+TC_NAMESPACE_END
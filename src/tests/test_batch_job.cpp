@@ -0,0 +1,48 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#include <taichi/system/batch_job.h>
+#include <taichi/testing.h>
+
+TC_NAMESPACE_BEGIN
+
+TC_TEST("batch_job") {
+  BatchJob job;
+  job.parse(
+      "# A comment\n"
+      "[surface_material diffuse @wall]\n"
+      "diffuse_color = (0.5, 0.5, 0.5)\n"
+      "\n"
+      "[mesh @floor]\n"
+      "  filename = plane.obj  \n"
+      "material = @wall\n"
+      "[render]\n"
+      "stages = 10\n");
+  TC_CHECK(job.sections.size() == 3);
+  TC_CHECK(job.sections[0].type == "surface_material");
+  TC_CHECK(job.sections[0].implementation == "diffuse");
+  TC_CHECK(job.sections[0].name == "wall");
+  TC_CHECK(job.sections[0].config.get<Vector3>("diffuse_color") ==
+           Vector3(0.5_f));
+  TC_CHECK(job.sections[1].config.get<std::string>("filename") ==
+           "plane.obj");
+
+  job.set_value("render.stages=20");
+  job.set_value("@floor.filename = sphere.obj");
+  TC_CHECK(job.sections[2].config.get<int>("stages") == 20);
+  TC_CHECK(job.sections[1].config.get<std::string>("filename") ==
+           "sphere.obj");
+
+  // Round trips through both forms
+  for (auto fn : {"test_batch_job.txt", "test_batch_job.tcb"}) {
+    job.save(fn);
+    BatchJob loaded;
+    loaded.load(fn);
+    TC_CHECK(loaded.to_text() == job.to_text());
+    std::remove(fn);
+  }
+}
+
+TC_NAMESPACE_END
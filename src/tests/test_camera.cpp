@@ -0,0 +1,49 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#include <taichi/visual/camera.h>
+#include <taichi/testing.h>
+
+TC_NAMESPACE_BEGIN
+
+// generate_rays() draws the same rays as sample(), for batches of all
+// lengths modulo the SIMD width
+TC_TEST("camera_generate_rays") {
+  auto sampler = create_instance<Sampler>("prand", Config());
+  Config config;
+  config.set("res", Vector2i(64, 48))
+      .set("fov", 60)
+      .set("origin", Vector3(0, 1, 5))
+      .set("look_at", Vector3(0, 0, 0))
+      .set("up", Vector3(0, 1, 0))
+      .set("aperture", 0.1_f)
+      .set("focus", Vector3(0, 0, 1));
+  real tolerance = 1e-5_f;
+  for (auto name : {"pinhole", "thinlens"}) {
+    auto camera = create_instance<Camera>(name, config);
+    int dims = camera->get_sample_dimensions();
+    Vector2 size(1.0_f / 64, 1.0_f / 48);
+    for (int n : {1, 7, 37}) {
+      std::vector<Vector2> offsets(n);
+      std::vector<real> samples(n * dims);
+      std::vector<Ray> rays(n);
+      for (int i = 0; i < n; i++) {
+        offsets[i] = Vector2(i % 64, i % 48) * size;
+        sampler->fill(i, 0, dims, &samples[i * dims]);
+      }
+      camera->generate_rays(&offsets[0], size, &samples[0], n, &rays[0]);
+      for (int i = 0; i < n; i++) {
+        RandomStateSequence rand(sampler, i);
+        Ray ray = camera->sample(offsets[i], size, rand);
+        CHECK(rand.get_cursor() == dims);
+        CHECK(length(rays[i].orig - ray.orig) < tolerance);
+        CHECK(length(rays[i].dir - ray.dir) < tolerance);
+        TC_CHECK_EQUAL(length(rays[i].dir), 1.0_f, tolerance);
+      }
+    }
+  }
+}
+
+TC_NAMESPACE_END
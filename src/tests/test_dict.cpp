@@ -30,4 +30,42 @@ TC_TEST("config") {
   TC_CHECK(dict.get<std::string>("str") == "Hello");
 };
 
+// Conversions between the kinds of typed values, and values from strings
+TC_TEST("config_typed_values") {
+  Dict dict;
+  dict.set("int", 3).set("real", 2.0_f).set("half", 0.5_f);
+  TC_CHECK(dict.get<float32>("int") == 3);
+  TC_CHECK(dict.get<int>("real") == 2);
+  TC_CHECK(dict.get<std::string>("half") == "0.5");
+
+  dict.set("flag", true).set("flag_str", "False");
+  TC_CHECK(dict.get<bool>("flag"));
+  TC_CHECK(!dict.get<bool>("flag_str"));
+
+  dict.set("vec", Vector3(1, 2, 3)).set("vec_str", "(0.25, 0.5, 0.75)");
+  TC_CHECK(dict.get<Vector3i>("vec") == Vector3i(1, 2, 3));
+  TC_CHECK(dict.get<Vector2>("vec") == Vector2(1, 2));
+  TC_CHECK(dict.get<Vector3>("vec_str") == Vector3(0.25_f, 0.5_f, 0.75_f));
+  TC_CHECK(dict.get<std::string>("vec") == "(1,2,3)");
+  TC_CHECK(dict.get<int64>("num_str", int64(7)) == 7);
+  dict.set("num_str", std::string("12"));
+  TC_CHECK(dict.get<int64>("num_str") == 12);
+
+  Vector3 target;
+  dict.set("ptr", &target);
+  TC_CHECK(dict.get_ptr<Vector3>("ptr") == &target);
+  dict.set("ptr_str", Dict::get_ptr_string(&target));
+  TC_CHECK(dict.get_ptr<Vector3>("ptr_str") == &target);
+
+  auto asset = std::make_shared<Vector3>(4);
+  dict.set("asset", asset);
+  TC_CHECK(dict.get_asset<Vector3>("asset") == asset);
+
+  dict.set("nested", Dict("a", 5));
+  TC_CHECK(dict.get<Dict>("nested").get<int>("a") == 5);
+
+  auto keys = dict.get_keys();
+  TC_CHECK(std::is_sorted(keys.begin(), keys.end()));
+}
+
 TC_NAMESPACE_END
@@ -0,0 +1,33 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#include <taichi/common/util.h>
+#include <taichi/math/discrete_sampler.h>
+#include <taichi/testing.h>
+
+TC_NAMESPACE_BEGIN
+
+TC_TEST("discrete_sampler") {
+  std::vector<real> weights = {0, 1, 2, 3, 0, 4};
+  DiscreteSampler sampler(weights);
+  const int n = 100000;
+  std::vector<int> count(weights.size(), 0);
+  for (int i = 0; i < n; i++) {
+    real pdf;
+    int index = sampler.sample((i + 0.5_f) / n, pdf);
+    TC_CHECK(std::abs(pdf - weights[index] / 10) < 1e-6_f);
+    count[index]++;
+  }
+  for (int i = 0; i < (int)weights.size(); i++) {
+    // Stratified samples land in proportion to the pdf
+    TC_CHECK(std::abs((real)count[i] / n - weights[i] / 10) < 1e-3_f);
+  }
+  // The CDF overload picks the same distribution
+  real pdf, cdf;
+  TC_CHECK(sampler.sample(0.05_f, pdf, cdf) == 1);
+  TC_CHECK(std::abs(cdf - 0.1_f) < 1e-6_f);
+}
+
+TC_NAMESPACE_END
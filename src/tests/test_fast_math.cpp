@@ -0,0 +1,67 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#include <taichi/math/fast_math.h>
+#include <taichi/testing.h>
+
+TC_NAMESPACE_BEGIN
+
+TC_TEST("fast_math") {
+  using Pack = ScalarPack<float32, default_pack_width<float32>>;
+  constexpr int width = default_pack_width<float32>;
+  // Errors of scalars and packs against the float64 functions, relative
+  // for exp (and log away from 1) and absolute for the angles
+  float64 errors[6] = {0};
+  auto relative = [](float64 a, float64 b) {
+    return std::abs(a - b) / std::max(std::abs(b), 1.0);
+  };
+  for (int i = 0; i < 4096; i += width) {
+    float32 x[width], t[width], y[width];
+    for (int l = 0; l < width; l++) {
+      float32 u = (i + l + 0.5f) / 4096;
+      x[l] = -80 + 160 * u;
+      t[l] = -1 + 2 * u;
+      y[l] = std::cos(37 * u);
+    }
+    float32 e[width], lg[width], pw[width], s[width], c[width], a[width],
+        ac[width];
+    fast_math::exp(Pack::load(x)).store(e);
+    fast_math::log(Pack::load(x) * Pack::load(x)).store(lg);
+    fast_math::pow(Pack::load(t) * Pack::load(t), Pack(2.5f)).store(pw);
+    Pack sp, cp;
+    fast_math::sincos(Pack::load(x), sp, cp);
+    sp.store(s);
+    cp.store(c);
+    fast_math::atan2(Pack::load(y), Pack::load(t)).store(a);
+    fast_math::acos(Pack::load(t)).store(ac);
+    for (int l = 0; l < width; l++) {
+      // Scalars agree with the lanes, but for contractions into FMAs
+      float32 ss, cs;
+      fast_math::sincos(x[l], ss, cs);
+      CHECK(std::abs(e[l] - fast_math::exp(x[l])) <= 1e-6f * e[l]);
+      CHECK(std::abs(s[l] - ss) + std::abs(c[l] - cs) <= 1e-6f);
+      float64 xd = x[l], td = t[l];
+      float64 x2 = xd * xd, t2 = td * td;
+      errors[0] = std::max(errors[0], relative(e[l], std::exp(xd)));
+      errors[1] = std::max(errors[1], relative(lg[l], std::log(x2)));
+      errors[2] = std::max(errors[2], relative(pw[l], std::pow(t2, 2.5)));
+      errors[3] = std::max(errors[3], std::abs(s[l] - std::sin(xd)) +
+                                          std::abs(c[l] - std::cos(xd)));
+      errors[4] = std::max(errors[4],
+                           std::abs(a[l] - std::atan2((float64)y[l], td)));
+      errors[5] = std::max(errors[5], std::abs(ac[l] - std::acos(td)));
+    }
+  }
+  CHECK(errors[0] < 4e-7);
+  CHECK(errors[1] < 4e-7);
+  CHECK(errors[2] < 2e-6);
+  CHECK(errors[3] < 8e-7);
+  CHECK(errors[4] < 4e-7);
+  CHECK(errors[5] < 6e-7);
+  CHECK(fast_math::atan2(0.0f, 0.0f) == 0.0f);
+  CHECK(fast_math::pow(0.0f, 2.0f) == 0.0f);
+}
+
+TC_NAMESPACE_END
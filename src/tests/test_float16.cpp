@@ -0,0 +1,73 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#include <taichi/math/float16.h>
+#include <taichi/visual/texture_pyramid.h>
+#include <taichi/testing.h>
+
+TC_NAMESPACE_BEGIN
+
+TC_TEST("float16") {
+  // Every value that is not a NaN survives a round trip
+  int mismatches = 0;
+  for (int h = 0; h < 65536; h++) {
+    if ((h & 0x7c00) == 0x7c00 && (h & 0x3ff) != 0) {
+      continue;
+    }
+    mismatches += float32_to_float16(float16_to_float32((uint16)h)) != h;
+  }
+  CHECK(mismatches == 0);
+  CHECK(float16_to_float32(0x3c00) == 1.0f);
+  CHECK(float16_to_float32(0x7bff) == 65504.0f);
+  CHECK(float16_to_float32(0x0001) == std::ldexp(1.0f, -24));
+  // Halfway between 1 and the next half goes to the even one, and a
+  // little more goes up
+  CHECK(float32_to_float16(1.0f + std::ldexp(1.0f, -11)) == 0x3c00);
+  CHECK(float32_to_float16(1.0f + 3 * std::ldexp(1.0f, -11)) == 0x3c02);
+  CHECK(float32_to_float16(1.0f + std::ldexp(1.0f, -11) + 1e-6f) == 0x3c01);
+  CHECK(float32_to_float16(65520.0f) == 0x7c00);
+  CHECK(float32_to_float16(-1e-10f) == 0x8000);
+  uint16 halves[4] = {0x3c00, 0xc000, 0x3555, 0x0000};
+  float32 values[4];
+  float16_to_float32x4(halves, values);
+  for (int i = 0; i < 4; i++) {
+    CHECK(values[i] == float16_to_float32(halves[i]));
+  }
+
+  CHECK(bfloat16_to_float32(float32_to_bfloat16(3.0f)) == 3.0f);
+  CHECK(float32_to_bfloat16(1.0f + std::ldexp(1.0f, -8)) == 0x3f80);
+  CHECK(float32_to_bfloat16(1.0f + 3 * std::ldexp(1.0f, -8)) == 0x3f82);
+  for (int i = 0; i < 256; i++) {
+    mismatches += linear_to_srgb8(srgb8_to_linear((uint8)i)) != i;
+  }
+  CHECK(mismatches == 0);
+
+  // Compact pyramids are within the precision of their format
+  Array2D<Vector4> image(Vector2i(13, 7));
+  for (auto &ind : image.get_region()) {
+    image[ind] = Vector4(ind.i / 13.0_f, ind.j / 7.0_f, 0.3_f, 1);
+  }
+  TexturePyramid full(image);
+  StorageFormat formats[3] = {StorageFormat::float16, StorageFormat::bfloat16,
+                              StorageFormat::srgb8};
+  real tolerances[3] = {1e-3_f, 1e-2_f, 1e-2_f};
+  for (int f = 0; f < 3; f++) {
+    TexturePyramid compact(image, formats[f]);
+    CHECK(compact.get_format() == formats[f]);
+    real error = 0;
+    for (int i = 0; i < 50; i++) {
+      Vector2 coord(i * 0.0193_f, 1 - i * 0.0171_f);
+      for (real lod : {0.0_f, 1.5_f, 3.0_f}) {
+        Vector4 d = compact.sample(coord, lod) - full.sample(coord, lod);
+        for (int c = 0; c < 4; c++) {
+          error = std::max(error, std::abs(d[c]));
+        }
+      }
+    }
+    CHECK(error < tolerances[f]);
+  }
+}
+
+TC_NAMESPACE_END
@@ -0,0 +1,101 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#include <taichi/image/denoiser.h>
+#include <taichi/image/kernels.h>
+#include <taichi/math/array_op.h>
+#include <taichi/testing.h>
+
+TC_NAMESPACE_BEGIN
+
+TC_TEST("image_kernels") {
+  Array2D<Vector3> image(Vector2i(37, 23));
+  for (auto &ind : image.get_region()) {
+    image[ind] = Vector3(ind.i % 7, ind.j % 5, (ind.i * ind.j) % 11);
+  }
+  // Same additions in the same order as the gathering implementation
+  auto blurred = parallel_gaussian_blur(image, 2.5_f);
+  auto reference = gaussian_blur(image, 2.5_f);
+  int different = 0;
+  for (auto &ind : image.get_region()) {
+    different += !(blurred[ind] == reference[ind]);
+  }
+  CHECK(different == 0);
+
+  auto red = parallel_map(image, [](const Vector3 &c) { return c.x; });
+  auto hist = parallel_histogram(red, 4, [](real v) { return v; });
+  // Values 3 to 6 fall into the last bin
+  int count[7] = {0}, sum = 0;
+  for (auto &ind : red.get_region()) {
+    count[(int)red[ind]]++;
+    sum += (int)red[ind];
+  }
+  CHECK(parallel_max(red) == 6);
+  CHECK(parallel_sum(red) == sum);
+  CHECK(hist[0] == count[0]);
+  CHECK(hist[2] == count[2]);
+  CHECK(hist[3] == count[3] + count[4] + count[5] + count[6]);
+}
+
+TC_TEST("image_blur_kernels") {
+  Array2D<Vector3> image(Vector2i(300, 41));
+  for (auto &ind : image.get_region()) {
+    image[ind] = Vector3(ind.i % 7, ind.j % 5, (ind.i * ind.j) % 11);
+  }
+  auto max_difference = [](const Array2D<Vector3> &a,
+                           const Array2D<Vector3> &b) {
+    real diff = 0;
+    for (auto &ind : a.get_region()) {
+      diff = std::max(diff, (a[ind] - b[ind]).abs_max());
+    }
+    return diff;
+  };
+  for (real radius : {1.0_f, 2.0_f, 4.5_f, 60.0_f}) {
+    CHECK(max_difference(parallel_box_blur(image, radius),
+                         box_blur(image, radius)) < 1e-4_f);
+  }
+  // Within 2% of the range of values (0 to 10)
+  for (real sigma : {1.0_f, 2.5_f, 8.0_f, 30.0_f}) {
+    CHECK(max_difference(parallel_recursive_gaussian_blur(image, sigma),
+                         gaussian_blur(image, sigma)) < 0.2_f);
+  }
+}
+
+TC_TEST("atrous_denoise") {
+  // Two walls of radiance 1 and 4 meeting at i = 32, with noise
+  Vector2i res(64, 48);
+  Array2D<Vector3> color(res), albedo(res, Vector3(0.5_f)), normal(res);
+  Array2D<real> depth(res, 3.0_f), variance(res, 0.0_f);
+  uint32 seed = 1;
+  for (auto &ind : color.get_region()) {
+    seed = seed * 1664525u + 1013904223u;
+    real noise = (seed >> 8) * (1.0_f / (1 << 24)) - 0.5_f;
+    bool right = ind.i >= 32;
+    real mean = right ? 2.0_f : 0.5_f;
+    color[ind] = Vector3(mean * (1 + noise));
+    normal[ind] = right ? Vector3(1, 0, 0) : Vector3(0, 0, 1);
+    // Of the uniform noise
+    variance[ind] = sqr(mean) / 12;
+  }
+  auto denoised = atrous_denoise(color, albedo, normal, depth, variance);
+  real error = 0, noisy_error = 0;
+  int leaked = 0;
+  for (auto &ind : color.get_region()) {
+    real expected = ind.i >= 32 ? 2.0_f : 0.5_f;
+    error += std::abs(denoised[ind].x - expected);
+    noisy_error += std::abs(color[ind].x - expected);
+    // Not blurred across the edge of the normals
+    leaked += std::abs(denoised[ind].x - expected) > 0.25_f * expected;
+  }
+  CHECK(error < 0.25_f * noisy_error);
+  CHECK(leaked == 0);
+  // Nothing hit: kept
+  normal[Vector2i(5, 5)] = Vector3(0.0_f);
+  color[Vector2i(5, 5)] = Vector3(10.0_f);
+  denoised = atrous_denoise(color, albedo, normal, depth, Array2D<real>());
+  CHECK(denoised[Vector2i(5, 5)] == Vector3(10.0_f));
+}
+
+TC_NAMESPACE_END
@@ -0,0 +1,78 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#include <taichi/math/levelset.h>
+#include <taichi/testing.h>
+
+TC_NAMESPACE_BEGIN
+
+// Redistances three times the signed distance to a sphere, then again with
+// the sphere moved by a cell within the previous band
+template <int DIM>
+static void test_redistance(int res, real radius, real band) {
+  using Vector = VectorND<DIM, real>;
+  LevelSet<DIM> levelset{VectorND<DIM, int>(res)};
+  for (real shift : {0.0_f, 1.0_f}) {
+    auto distance = [&](const Vector &pos) {
+      return length(pos - Vector(res * 0.5_f + shift)) - radius;
+    };
+    for (auto &ind : levelset.get_region()) {
+      // As advection would, leave the cells out of the band alone
+      if (shift == 0 || std::abs(levelset[ind]) < band) {
+        levelset[ind] = 3 * distance(ind.get_pos());
+      }
+    }
+    levelset.redistance(band);
+    CHECK(levelset.has_narrow_band());
+    real max_error = 0;
+    int wrong_far = 0;
+    for (auto &ind : levelset.get_region()) {
+      real exact = distance(ind.get_pos());
+      if (std::abs(exact) < band - 1) {
+        max_error = std::max(max_error, std::abs(levelset[ind] - exact));
+      } else if (std::abs(exact) > band + 1) {
+        wrong_far += levelset[ind] != (exact < 0 ? -band : band);
+      }
+    }
+    CHECK(max_error < 0.5_f);
+    CHECK(wrong_far == 0);
+  }
+}
+
+TC_TEST("levelset_redistance") {
+  test_redistance<2>(64, 20, 5);
+  test_redistance<3>(32, 9, 4);
+}
+
+// The blended level set of update() against the blending of every query,
+// for a sphere moving by two cells
+TC_TEST("dynamic_levelset_update") {
+  Vector3i res(24);
+  LevelSet3D ls0(res), ls1(res);
+  for (auto &ind : ls0.get_region()) {
+    ls0[ind] = length(ind.get_pos() - Vector3(11)) - 6;
+    ls1[ind] = length(ind.get_pos() - Vector3(13, 11, 11)) - 6;
+  }
+  ls0.redistance(3);
+  ls1.redistance(3);
+  DynamicLevelSet3D uncached;
+  uncached.initialize(0, 1, ls0, ls1);
+  DynamicLevelSet3D cached = uncached;
+  real max_error = 0;
+  for (real t : {0.0_f, 0.3_f, 1.0_f}) {
+    cached.update(t, 1);
+    for (int i = 0; i < 1000; i++) {
+      Vector3 pos = Vector3(rand(), rand(), rand()) * 22.0_f + Vector3(1);
+      max_error = std::max(max_error, std::abs(cached.sample(pos, t) -
+                                               uncached.sample(pos, t)));
+      max_error = std::max(
+          max_error, length(cached.get_spatial_gradient(pos, t) -
+                            uncached.get_spatial_gradient(pos, t)));
+    }
+  }
+  CHECK(max_error < 1e-4_f);
+}
+
+TC_NAMESPACE_END
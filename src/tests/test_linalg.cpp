@@ -7,6 +7,7 @@
 #include <taichi/testing.h>
 #include <taichi/math/svd.h>
 #include <taichi/math/eigen.h>
+#include <taichi/math/vector_pack.h>
 
 TC_NAMESPACE_BEGIN
 
@@ -150,4 +151,101 @@ TC_TEST("decompositions") {
   test_decompositions<3, float64>();
 }
 
+// Batches of all lengths modulo the SIMD width, with diagonal matrices
+TC_TEST("svd_batch") {
+  float32 tolerance = 3e-5_f32;
+  for (int n : {1, 7, 37, 100}) {
+    std::vector<Matrix3f> m(n), U(n), sig(n), V(n), R(n), S(n);
+    for (int i = 0; i < n; i++) {
+      m[i] = i % 5 == 0 ? Matrix3f(Vector3f::rand()) : Matrix3f::rand();
+    }
+    svd_batch(m.data(), n, U.data(), sig.data(), V.data());
+    polar_decomp_batch(m.data(), n, R.data(), S.data());
+    for (int i = 0; i < n; i++) {
+      Matrix3f U_i, sig_i, V_i;
+      svd(m[i], U_i, sig_i, V_i);
+      TC_CHECK_EQUAL(sig[i], sig_i, tolerance);
+      TC_CHECK_EQUAL(m[i], U[i] * sig[i] * transposed(V[i]), tolerance);
+      TC_CHECK_EQUAL(Matrix3f(1), U[i] * transposed(U[i]), tolerance);
+      TC_CHECK_EQUAL(Matrix3f(1), V[i] * transposed(V[i]), tolerance);
+      TC_CHECK_EQUAL(m[i], R[i] * S[i], tolerance);
+      TC_CHECK_EQUAL(S[i], transposed(S[i]), tolerance);
+    }
+  }
+}
+
+// Ascending eigenvalues and orthonormal eigenvectors that reconstruct the
+// matrices, for batches of all lengths modulo the SIMD width
+TC_TEST("sym_eig_batch") {
+  float32 tolerance = 3e-5_f32;
+  for (int n : {1, 7, 37, 100}) {
+    std::vector<Matrix3f> m(n), Q(n);
+    std::vector<Vector3f> lambda(n);
+    for (int i = 0; i < n; i++) {
+      Matrix3f a = Matrix3f::rand();
+      m[i] = i % 5 == 0 ? Matrix3f(Vector3f::rand()) : a + transposed(a);
+    }
+    sym_eig_batch(m.data(), n, Q.data(), lambda.data());
+    for (int i = 0; i < n; i++) {
+      Matrix3f Q_i;
+      Vector3f lambda_i;
+      sym_eig(m[i], Q_i, lambda_i);
+      TC_CHECK_EQUAL(lambda[i], lambda_i, tolerance);
+      CHECK(lambda[i][0] <= lambda[i][1]);
+      CHECK(lambda[i][1] <= lambda[i][2]);
+      TC_CHECK_EQUAL(m[i], Q[i] * Matrix3f(lambda[i]) * transposed(Q[i]),
+                     tolerance);
+      TC_CHECK_EQUAL(Matrix3f(1), Q[i] * transposed(Q[i]), tolerance);
+    }
+  }
+}
+
+
+// Lane by lane against VectorND and MatrixND, in registers and in arrays
+template <typename T, int width>
+void test_vector_pack() {
+  using Vector = VectorND<3, T>;
+  using Matrix = MatrixND<3, T>;
+  using Pack = VectorPack<3, T, width>;
+  using MPack = MatrixPack<3, T, width>;
+  T tolerance = std::is_same<T, float32>() ? 1e-5_f32 : 1e-7_f32;
+  std::vector<Vector> a(width), b(width), c(width);
+  std::vector<Matrix> m(width), n(width), p(width);
+  for (int l = 0; l < width; l++) {
+    a[l] = Vector::rand() + Vector(0.5_f);
+    b[l] = Vector::rand();
+    m[l] = Matrix::rand();
+    n[l] = Matrix::rand();
+  }
+  Pack pa = Pack::load(a.data()), pb = Pack::load(b.data());
+  MPack pm = MPack::load(m.data()), pn = MPack::load(n.data());
+  auto s = dot(pa, pb);
+  auto mask = s > typename Pack::Scalar(T(0));
+  (cross(pa, pb) * s + normalized(pa) - pm * pb).store(c.data());
+  (transposed(pm) * pn + s * pm).store(p.data());
+  bool positive = false;
+  for (int l = 0; l < width; l++) {
+    T s_l = dot(a[l], b[l]);
+    positive = positive || s_l > 0;
+    CHECK(std::abs(s[l] - s_l) < tolerance);
+    TC_CHECK_EQUAL(c[l],
+                   cross(a[l], b[l]) * s_l + normalized(a[l]) - m[l] * b[l],
+                   tolerance);
+    TC_CHECK_EQUAL(p[l], transposed(m[l]) * n[l] + s_l * m[l], tolerance);
+    TC_CHECK_EQUAL(select(mask, pa, pb).get(l), (s_l > 0 ? a[l] : b[l]),
+                   tolerance);
+    TC_CHECK_EQUAL(min(pa, pb).get(l), min(a[l], b[l]), tolerance);
+  }
+  CHECK(any(mask) == positive);
+}
+
+TC_TEST("vector_pack") {
+  test_vector_pack<float32, 8>();
+  test_vector_pack<float32, 16>();
+  test_vector_pack<float64, 4>();
+  test_vector_pack<float64, 8>();
+  test_vector_pack<float32, 5>();
+  test_vector_pack<float64, 3>();
+}
+
 TC_NAMESPACE_END
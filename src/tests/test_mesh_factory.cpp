@@ -0,0 +1,68 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#include <taichi/geometry/factory.h>
+#include <taichi/io/optix.h>
+#include <taichi/testing.h>
+
+TC_NAMESPACE_BEGIN
+
+// The triangles of generate() are those of generate_indexed(), in order
+TC_TEST("mesh3d_generate") {
+  Function23 cylinder = [](Vector2 p) {
+    real theta = p.x * 2 * pi;
+    return Vector3(std::cos(theta), p.y, std::sin(theta));
+  };
+  Function23 normal = [](Vector2 p) {
+    real theta = p.x * 2 * pi;
+    return Vector3(std::cos(theta), 0, std::sin(theta)) * 2.0_f;
+  };
+  Vector2i res(37, 5);
+  for (bool smooth : {true, false}) {
+    MeshData data =
+        Mesh3D::generate_indexed(res, &cylinder, &normal, nullptr, smooth);
+    auto triangles =
+        Mesh3D::generate(res, &cylinder, &normal, nullptr, smooth);
+    CHECK(data.positions.size() == 38 * 6);
+    CHECK(data.get_num_triangles() == 2 * 37 * 5);
+    CHECK((int)triangles.size() == data.get_num_triangles());
+    for (int t = 0; t < (int)triangles.size(); t++) {
+      for (int k = 0; k < 3; k++) {
+        int v = data.position_indices[t * 3 + k];
+        CHECK(triangles[t].v[k] == data.positions[v]);
+        CHECK(data.normal_indices[t * 3 + k] == (smooth ? v : -1));
+      }
+      CHECK(triangles[t].id == t);
+      // Radial, outwards if from |normal|
+      Vector3 radial = triangles[t].v[0];
+      radial.y = 0;
+      real d = dot(triangles[t].n0, radial);
+      CHECK((smooth ? d : std::abs(d)) > 0.9_f);
+    }
+  }
+}
+
+// Unit normals of the faces around each vertex, with tangents
+TC_TEST("optix_recompute_normals") {
+  OptiXMesh mesh;
+  // A tetrahedron, with faces wound outwards
+  Vector3 positions[4] = {Vector3(0, 0, 0), Vector3(1, 0, 0),
+                          Vector3(0, 1, 0), Vector3(0, 0, 1)};
+  for (auto &p : positions) {
+    OptiXMesh::Vertex v;
+    v.position = p;
+    mesh.vertices.push_back(v);
+  }
+  mesh.faces = {{{0, 2, 1}}, {{0, 1, 3}}, {{0, 3, 2}}, {{1, 2, 3}}};
+  mesh.recompute_normals();
+  Vector3 center(0.25_f);
+  for (auto &v : mesh.vertices) {
+    TC_CHECK_EQUAL(length(v.normal), 1.0_f, 1e-5_f);
+    CHECK(dot(v.normal, v.position - center) > 0);
+    CHECK(std::abs(dot(v.normal, v.tangent)) < 1e-5_f);
+  }
+}
+
+TC_NAMESPACE_END
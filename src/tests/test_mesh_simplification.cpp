@@ -0,0 +1,55 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#include <taichi/geometry/factory.h>
+#include <taichi/geometry/simplification.h>
+#include <taichi/testing.h>
+
+TC_NAMESPACE_BEGIN
+
+// Each level has at most half the triangles of the previous one, over the
+// original vertices, facing the same way
+TC_TEST("simplify_mesh") {
+  Function23 plane = [](Vector2 p) { return Vector3(p.x, p.y, 0); };
+  Function23 sphere = [](Vector2 p) {
+    real theta = p.x * 2 * pi, phi = p.y * pi;
+    return Vector3(std::cos(theta) * std::sin(phi), std::cos(phi),
+                   std::sin(theta) * std::sin(phi));
+  };
+  for (auto surf : {&plane, &sphere}) {
+    MeshData data =
+        Mesh3D::generate_indexed(Vector2i(32), surf, nullptr, nullptr, true);
+    auto levels = simplify_mesh(data.positions, data.position_indices, 4);
+    CHECK(levels.size() == 4);
+    int previous = data.get_num_triangles();
+    real error = 0;
+    for (auto &level : levels) {
+      int n = (int)level.indices.size() / 3;
+      CHECK(n <= previous / 2);
+      CHECK(n >= previous / 2 - 1);
+      CHECK(level.error >= error);
+      previous = n;
+      error = level.error;
+      for (int t = 0; t < n; t++) {
+        const int *v = &level.indices[t * 3];
+        Vector3 p[3];
+        for (int k = 0; k < 3; k++) {
+          CHECK(0 <= v[k]);
+          CHECK(v[k] < (int)data.positions.size());
+          p[k] = data.positions[v[k]];
+        }
+        Vector3 normal = cross(p[1] - p[0], p[2] - p[0]);
+        Vector3 outward = surf == &plane ? Vector3(0, 0, 1)
+                                         : p[0] + p[1] + p[2];
+        CHECK(dot(normal, outward) > 0);
+      }
+    }
+    // Exact for the plane; within a quarter of the radius for the sphere at
+    // 128 triangles
+    CHECK(levels.back().error < (surf == &plane ? 1e-5_f : 0.25_f));
+  }
+}
+
+TC_NAMESPACE_END
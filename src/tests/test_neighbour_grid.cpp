@@ -0,0 +1,65 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#include <taichi/nearest_neighbour/neighbour_grid.h>
+#include <taichi/testing.h>
+
+TC_NAMESPACE_BEGIN
+
+// Compares the queries with brute force on a clustered point set, with
+// queries inside and outside its bounding box
+template <int DIM>
+static void test_neighbour_grid(int num_points, int k, real radius) {
+  using Vector = VectorND<DIM, real>;
+  std::vector<Vector> points(num_points);
+  for (int i = 0; i < num_points; i++) {
+    for (int d = 0; d < DIM; d++) {
+      points[i][d] = (i % 3 == 0 ? 0.2_f : 1.0_f) * (rand() * 4 - 1);
+    }
+  }
+  NeighbourGrid<DIM> grid(points, radius);
+  int wrong_radius = 0, wrong_n = 0;
+  for (int q = 0; q < 100; q++) {
+    Vector p;
+    for (int d = 0; d < DIM; d++) {
+      p[d] = rand() * 6 - 2;
+    }
+    std::vector<std::pair<real, int>> expected;
+    for (int i = 0; i < num_points; i++) {
+      expected.push_back(std::make_pair((points[i] - p).length2(), i));
+    }
+    std::sort(expected.begin(), expected.end());
+
+    std::vector<int> index;
+    grid.query_radius(p, radius, index);
+    int num_inside = 0;
+    while (num_inside < num_points &&
+           expected[num_inside].first <= radius * radius) {
+      num_inside++;
+    }
+    wrong_radius += (int)index.size() != num_inside;
+    for (int i = 0; i < std::min(num_inside, (int)index.size()); i++) {
+      wrong_radius += index[i] != expected[i].second;
+    }
+
+    std::vector<real> dist2;
+    grid.query_n(p, k, index, dist2);
+    for (int i = 0; i < k; i++) {
+      int e = i < num_points ? expected[i].second : -1;
+      wrong_n += index[i] != e;
+    }
+  }
+  CHECK(wrong_radius == 0);
+  CHECK(wrong_n == 0);
+}
+
+TC_TEST("neighbour_grid") {
+  test_neighbour_grid<2>(1000, 5, 0.1_f);
+  test_neighbour_grid<3>(1000, 8, 0.3_f);
+  // Fewer points than neighbours asked for
+  test_neighbour_grid<2>(3, 5, 0.5_f);
+}
+
+TC_NAMESPACE_END
@@ -0,0 +1,67 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#include <taichi/visual/path_guiding.h>
+#include <taichi/testing.h>
+
+TC_NAMESPACE_BEGIN
+
+TC_TEST("path_guiding") {
+  // Radiance from a cone around +z, and a little from everywhere
+  const Vector3 light = normalized(Vector3(0.3_f, 0.2_f, 1));
+  DirectionalQuadtree trees[2];
+  for (int iteration = 0; iteration < 3; iteration++) {
+    auto &tree = trees[iteration % 2];
+    for (int i = 0; i < 256; i++) {
+      for (int j = 0; j < 256; j++) {
+        Vector3 dir = square_to_direction(
+            Vector2((i + 0.5_f) / 256, (j + 0.5_f) / 256));
+        tree.record(dir, dot(dir, light) > 0.95_f ? 100.0_f : 0.01_f);
+      }
+    }
+    trees[(iteration + 1) % 2].refine(tree, 0.01_f, 20);
+  }
+  const auto &tree = trees[0];
+  TC_CHECK(tree.get_num_nodes() > 1);
+  real integral = 0, hits = 0;
+  const int n = 100000;
+  for (int i = 0; i < n; i++) {
+    // Of the density over the sphere
+    Vector3 dir = square_to_direction(Vector2(std::fmod(i * 0.618034_f, 1.0_f),
+                                              (i + 0.5_f) / n));
+    integral += tree.pdf(dir) * 4 * pi / n;
+    Vector3 sample =
+        tree.sample(std::fmod(i * 0.754878_f, 1.0_f), (i + 0.5_f) / n);
+    TC_CHECK(tree.pdf(sample) > 0);
+    hits += dot(sample, light) > 0.95_f;
+  }
+  TC_CHECK(std::abs(integral - 1) < 0.02_f);
+  // The cone has about 2.5% of the sphere, and almost all the radiance
+  TC_CHECK(hits / n > 0.9_f);
+
+  PathGuide guide;
+  guide.initialize(Vector3(0.0_f), Vector3(1.0_f));
+  for (int iteration = 0; iteration < 2; iteration++) {
+    TC_CHECK((guide.get_sampling_tree(Vector3(0.5_f)) == nullptr) ==
+             (iteration == 0));
+    for (int i = 0; i < 1000; i++) {
+      guide.record(Vector3(0.1_f, i * 0.001_f, 0.5_f), light, 1);
+    }
+    guide.update(100, 0.01_f);
+  }
+  TC_CHECK(guide.get_num_leaves() > 1);
+  // The leaves split from the first iteration had no records in the second
+  TC_CHECK(guide.get_sampling_tree(Vector3(0.2_f, 0.5_f, 0.5_f)) != nullptr);
+  TC_CHECK(guide.get_sampling_tree(Vector3(0.8_f, 0.5_f, 0.5_f)) == nullptr);
+  TC_CHECK(guide.get_sampling_tree(Vector3(0.1_f, 0.5_f, 0.5_f))->pdf(light) >
+           1);
+  // All records are of 1, so the radiance integrates to 1 over the sphere
+  real pdf = guide.get_sampling_tree(Vector3(0.1_f, 0.5_f, 0.5_f))->pdf(light);
+  real radiance = guide.estimate_radiance(Vector3(0.1_f, 0.5_f, 0.5_f), light);
+  TC_CHECK(std::abs(radiance - pdf) < 1e-3_f * pdf);
+  TC_CHECK(guide.estimate_radiance(Vector3(0.8_f, 0.5_f, 0.5_f), light) == 0);
+}
+
+TC_NAMESPACE_END
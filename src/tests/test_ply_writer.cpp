@@ -0,0 +1,56 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#include <taichi/io/ply_writer.h>
+#include <taichi/io/mesh_reader.h>
+#include <taichi/testing.h>
+
+TC_NAMESPACE_BEGIN
+
+// Both formats read back by read_mesh, through several chunks of vertices
+// and faces, with the quads of add_faces triangulated as fans
+TC_TEST("ply_writer") {
+  const int n = 100000;
+  std::vector<Vector3> positions(n);
+  std::vector<int> quads;
+  for (int i = 0; i < n; i++) {
+    positions[i] = Vector3(i * 0.5_f, -i * 0.25_f, 1.0_f);
+  }
+  for (int i = 0; i + 3 < n; i += 2) {
+    for (int k = 0; k < 4; k++) {
+      quads.push_back(i + k);
+    }
+  }
+  for (bool binary : {true, false}) {
+    std::string fn = binary ? "/tmp/test_binary.ply" : "/tmp/test_ascii.ply";
+    {
+      PLYWriter ply(fn, binary);
+      ply.add_face({Vector3(0), Vector3(1, 0, 0), Vector3(0, 1, 0)});
+      int first = ply.add_vertices(positions.data(), nullptr, n);
+      for (auto &index : quads) {
+        index += first;
+      }
+      ply.add_faces(quads.data(), (int)quads.size() / 4, 4);
+      for (auto &index : quads) {
+        index -= first;
+      }
+      CHECK(ply.get_num_vertices() == n + 3);
+    }
+    MeshData data;
+    read_mesh(fn, data, false);
+    CHECK(data.positions.size() == n + 3);
+    CHECK(data.get_num_triangles() == 1 + (int)quads.size() / 2);
+    for (int i = 0; i < n; i += 997) {
+      CHECK(data.positions[i + 3] == positions[i]);
+    }
+    // The second triangle of the last quad
+    int last = (int)data.position_indices.size() - 3;
+    CHECK(data.position_indices[last] == quads[quads.size() - 4] + 3);
+    CHECK(data.position_indices[last + 2] == quads.back() + 3);
+    std::remove(fn.c_str());
+  }
+}
+
+TC_NAMESPACE_END
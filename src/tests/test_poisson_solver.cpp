@@ -0,0 +1,132 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#include <taichi/math/fft.h>
+#include <taichi/dynamics/poisson_solver.h>
+#include <taichi/testing.h>
+
+TC_NAMESPACE_BEGIN
+
+// Against the sums of the definitions, at radix-2 and Bluestein lengths
+TC_TEST("fft") {
+  const float64 pi = std::acos(-1.0);
+  for (int n : {1, 8, 12, 13}) {
+    std::vector<FFT::Complex> x(n), X(n);
+    for (auto &c : x) {
+      c = FFT::Complex(rand() - 0.5, rand() - 0.5);
+    }
+    FFT fft(n);
+    std::vector<FFT::Complex> y = x, work(fft.get_work_size());
+    fft.transform(y.data(), false, work.data());
+    float64 error = 0;
+    for (int k = 0; k < n; k++) {
+      for (int j = 0; j < n; j++) {
+        X[k] += x[j] * std::polar(1.0, -2 * pi * j * k / n);
+      }
+      error = std::max(error, std::abs(X[k] - y[k]));
+    }
+    CHECK(error < 1e-10);
+    fft.transform(y.data(), true, work.data());
+    error = 0;
+    for (int j = 0; j < n; j++) {
+      error = std::max(error, std::abs(y[j] / (float64)n - x[j]));
+    }
+    CHECK(error < 1e-10);
+  }
+  // On pairs of lines, and single ones
+  for (auto type : {TrigonometricTransform::DCT, TrigonometricTransform::DST}) {
+    for (int n : {7, 8}) {
+      TrigonometricTransform transform(n, type);
+      std::vector<float64> x(n * 2), y(n * 2);
+      std::vector<FFT::Complex> work;
+      for (int j = 0; j < n * 2; j++) {
+        x[j] = y[j] = rand() - 0.5;
+      }
+      transform.forward(&y[0], &y[n], work);
+      float64 error = 0;
+      for (int k = 0; k < n * 2; k++) {
+        float64 X = 0;
+        for (int j = 0; j < n; j++) {
+          float64 x_j = x[k / n * n + j];
+          int f = k % n;
+          X += x_j * (type == TrigonometricTransform::DCT
+                          ? std::cos(pi * f * (j + 0.5) / n)
+                          : std::sin(pi * (f + 1) * (j + 1) / (n + 1)));
+        }
+        error = std::max(error, std::abs(X - y[k]));
+      }
+      CHECK(error < 1e-10);
+      transform.inverse(&y[0], &y[n], work);
+      transform.forward(&y[n], nullptr, work);
+      transform.inverse(&y[n], nullptr, work);
+      error = 0;
+      for (int j = 0; j < n * 2; j++) {
+        error = std::max(error, std::abs(x[j] - y[j]));
+      }
+      CHECK(error < 1e-10);
+    }
+  }
+}
+
+// The residual of the stencil of the multigrid solvers, with ghost cells
+// of the padding beyond the box
+TC_TEST("spectral_poisson_solver") {
+  Vector3i res(12, 7, 9);
+  for (auto padding : {"neumann", "dirichlet"}) {
+    bool dirichlet = std::string(padding) == "dirichlet";
+    Config config;
+    config.set("res", res)
+        .set("num_threads", 1)
+        .set("padding", padding)
+        .set("maximum_iterations", 100);
+    auto solver = create_instance<PoissonSolver3D>("spectral", config);
+    solver->set_boundary_condition(PoissonSolver3D::BCArray(res));
+    Array3D<real> b(res), x(res);
+    for (auto &ind : b.get_region()) {
+      b[ind] = rand() - 0.5_f;
+    }
+    if (!dirichlet) {
+      real mean = b.sum() / b.get_size();
+      for (auto &ind : b.get_region()) {
+        b[ind] -= mean;
+      }
+    }
+    solver->run(b, x, 1e-6_f);
+    CHECK(solver->get_last_iterations() == 0);
+    real error = 0;
+    for (auto &ind : b.get_region()) {
+      Vector3i p(ind.i, ind.j, ind.k);
+      real lx = 0;
+      for (int d = 0; d < 3; d++) {
+        for (int s = -1; s <= 1; s += 2) {
+          Vector3i q = p;
+          q[d] += s;
+          if (x.inside(q)) {
+            lx += x[ind] - x[q];
+          } else if (dirichlet) {
+            lx += x[ind];
+          }
+        }
+      }
+      error = std::max(error, std::abs(lx - b[ind]));
+    }
+    CHECK(error < 1e-4_f);
+  }
+}
+
+// Solvers that can precondition with cycles say so, so that users can check
+// at setup instead of failing in the first solve
+TC_TEST("poisson_solver_is_multigrid") {
+  Config config;
+  config.set("res", Vector2i(16, 16))
+      .set("num_threads", 1)
+      .set("padding", "neumann")
+      .set("maximum_iterations", 100);
+  for (auto name : {"mg", "mgpcg", "spectral"}) {
+    CHECK(create_instance<PoissonSolver2D>(name, config)->is_multigrid());
+  }
+}
+
+TC_NAMESPACE_END
@@ -0,0 +1,41 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#include <taichi/io/preview_encoder.h>
+#include <taichi/io/base64.h>
+#include <taichi/testing.h>
+
+TC_NAMESPACE_BEGIN
+
+TC_TEST("preview_encoder") {
+  // Agrees with the scalar encoder, padding included
+  std::string bytes;
+  for (int n = 0; n < 40; n++) {
+    CHECK(encode_base64(reinterpret_cast<const uint8 *>(bytes.data()),
+                        bytes.size()) == base64_encode(bytes));
+    bytes.push_back(char(n * 73 + 19));
+  }
+
+  // All tiles first, then only those that changed
+  Array2D<Vector3> image(Vector2i(100, 70), Vector3(0.25_f));
+  PreviewEncoder encoder(Config().set("tile_size", 32));
+  auto tiles = encoder.encode(image);
+  CHECK(tiles.size() == 12);
+  CHECK(tiles.back().width == 4);
+  CHECK(tiles.back().height == 6);
+  CHECK(encoder.encode(image).empty());
+  image[40][69] = Vector3(1.0_f);  // Top row, second tile
+  // Below the 8-bit resolution
+  image[5][5] += Vector3(1e-5_f);
+  tiles = encoder.encode(image);
+  CHECK(tiles.size() == 1);
+  CHECK(tiles[0].x == 32);
+  CHECK(tiles[0].y == 0);
+  CHECK(tiles[0].png_base64.substr(0, 8) == "iVBORw0K");
+  encoder.reset();
+  CHECK(encoder.encode(image).size() == 12);
+}
+
+TC_NAMESPACE_END
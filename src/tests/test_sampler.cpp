@@ -0,0 +1,95 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#include <taichi/visual/sampler.h>
+#include <taichi/testing.h>
+
+TC_NAMESPACE_BEGIN
+
+// Counter-based, so any sample can be drawn alone, in any order and on any
+// thread, with the same result
+TC_TEST("prand") {
+  auto sampler = create_instance<Sampler>("prand", Config());
+  auto other = create_instance<Sampler>("prand", Config());
+  auto seeded = create_instance<Sampler>("prand", Config().set("seed", 1));
+  double sum = 0;
+  int same_as_seeded = 0;
+  const int n = 1000, dims = 20;
+  for (int i = n - 1; i >= 0; i--) {
+    real buffer[dims];
+    sampler->fill(i * 7919LL, 0, dims, buffer);
+    for (int d = 0; d < dims; d++) {
+      TC_CHECK(0 <= buffer[d]);
+      TC_CHECK(buffer[d] < 1);
+      TC_CHECK(buffer[d] == other->sample(d, i * 7919LL));
+      same_as_seeded += buffer[d] == seeded->sample(d, i * 7919LL);
+      sum += buffer[d];
+    }
+  }
+  TC_CHECK(std::abs(sum / (n * dims) - 0.5) < 0.01);
+  TC_CHECK(same_as_seeded < 5);
+}
+
+TC_TEST("owen_sobol") {
+  const int num_pixels = 100;
+  auto sampler = create_instance<Sampler>(
+      "owen_sobol", Config().set("num_pixels", num_pixels));
+  // The first 16 samples of a pixel take one cell each of a 4x4 grid, in
+  // every pair of dimensions that starts a group of four
+  for (int pixel : {0, 7, 99}) {
+    for (int d : {0, 4, 12}) {
+      int cells[16] = {0};
+      for (int k = 0; k < 16; k++) {
+        real buffer[2];
+        sampler->fill((long long)k * num_pixels + pixel, d, 2, buffer);
+        TC_CHECK(0 <= buffer[0]);
+        TC_CHECK(buffer[0] < 1);
+        TC_CHECK(0 <= buffer[1]);
+        TC_CHECK(buffer[1] < 1);
+        TC_CHECK(buffer[0] == sampler->sample(d, k * num_pixels + pixel));
+        cells[int(buffer[0] * 4) * 4 + int(buffer[1] * 4)]++;
+      }
+      for (int c = 0; c < 16; c++) {
+        TC_CHECK(cells[c] == 1);
+      }
+    }
+  }
+  // Pixels are scrambled differently
+  TC_CHECK(sampler->sample(0, 7) != sampler->sample(0, 8));
+  TC_CHECK(sampler->sample(1, 7) != sampler->sample(1, 8));
+}
+
+// With pixels numbered apart, the samples of a pixel are stratified, even
+// with a power-of-two number of pixels
+TC_TEST("sobol_num_pixels") {
+  const int num_pixels = 512 * 512;
+  auto sobol = create_instance<Sampler>(
+      "sobol", Config().set("num_pixels", num_pixels));
+  auto halton = create_instance<Sampler>(
+      "halton", Config().set("num_pixels", num_pixels));
+  for (int pixel : {0, 1, 12345, num_pixels - 1}) {
+    int cells[16] = {0};
+    real halton_min = 1, halton_max = 0;
+    for (int k = 0; k < 16; k++) {
+      long long i = (long long)k * num_pixels + pixel;
+      real buffer[2];
+      sobol->fill(i, 0, 2, buffer);
+      TC_CHECK(buffer[0] == sobol->sample(0, i));
+      TC_CHECK(buffer[1] == sobol->sample(1, i));
+      cells[int(buffer[0] * 4) * 4 + int(buffer[1] * 4)]++;
+      real h = halton->sample(0, i);
+      halton_min = std::min(halton_min, h);
+      halton_max = std::max(halton_max, h);
+    }
+    for (int c = 0; c < 16; c++) {
+      TC_CHECK(cells[c] == 1);
+    }
+    TC_CHECK(halton_max - halton_min > 0.5_f);
+  }
+  // Pixels are scrambled differently
+  TC_CHECK(sobol->sample(0, 7) != sobol->sample(0, 8));
+}
+
+TC_NAMESPACE_END
@@ -0,0 +1,201 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#include <taichi/io/binary_stream.h>
+#include <taichi/io/frame_writer.h>
+#include <taichi/io/io.h>
+#include <taichi/math.h>
+#include <taichi/testing.h>
+
+TC_NAMESPACE_BEGIN
+
+TC_TEST("binary_stream") {
+  std::string fn = "test_binary_stream.tcbs";
+  std::vector<int> a(100000), b;
+  std::vector<float64> c(1000), d;
+  std::map<std::string, int> e{{"x", 1}, {"y", 2}}, g;
+  for (int i = 0; i < (int)a.size(); i++) {
+    a[i] = i * 7 % 1000;
+  }
+  for (int i = 0; i < (int)c.size(); i++) {
+    c[i] = std::sin(i);
+  }
+  {
+    // Small chunks, for fields across chunks
+    BinaryFileStreamOutput stream(fn, 4096, 1, 4);
+    BinaryOutputSerializer writer;
+    writer.initialize(stream);
+    stream.begin_field("a");
+    writer(a);
+    stream.begin_field("c");
+    writer(c);
+    stream.begin_field("e");
+    writer(e);
+  }
+  BinaryFileStreamInput stream(fn);
+  BinaryInputSerializer reader;
+  reader.initialize(stream);
+  TC_CHECK(stream.size() == stream.get_field_size("a") +
+                                stream.get_field_size("c") +
+                                stream.get_field_size("e"));
+  stream.seek("e");
+  reader(g);
+  stream.seek("c");
+  reader(d);
+  TC_CHECK(d == c);
+  TC_CHECK(g == e);
+  stream.seek("a");
+  reader(b);
+  TC_CHECK(b == a);
+  TC_CHECK(stream.tell() == stream.get_field_size("a"));
+  std::remove(fn.c_str());
+}
+
+TC_TEST("mapped_vector") {
+  std::string fn = "test_mapped_vector.bin";
+  std::vector<Vector4> a(1000), b;
+  for (int i = 0; i < (int)a.size(); i++) {
+    a[i] = Vector4(i, i * 2, i * 3, i * 4);
+  }
+  write_vector_to_disk(&a, fn);
+  {
+    MappedVector<Vector4> mapped(fn);
+    TC_CHECK(mapped.is_valid());
+    TC_CHECK(mapped.is_mapped());
+    TC_CHECK(std::vector<Vector4>(mapped.begin(), mapped.end()) == a);
+    // Of another element size
+    TC_CHECK(!MappedVector<Vector3i>(fn).is_valid());
+  }
+  TC_CHECK(read_vector_from_disk(&b, fn));
+  TC_CHECK(b == a);
+
+  // Without the header, as written before it
+  FILE *f = fopen(fn.c_str(), "wb");
+  std::size_t n = a.size();
+  fwrite(&n, sizeof(n), 1, f);
+  fwrite(a.data(), sizeof(Vector4), n, f);
+  fclose(f);
+  FramePrefetcher<MappedVector<Vector4>> frames("test_mapped_{}.bin");
+  TC_CHECK(frames.get_file_name(12) == "test_mapped_12.bin");
+  std::rename(fn.c_str(), frames.get_file_name(0).c_str());
+  auto frame = frames.get(0);
+  TC_CHECK(frame->is_valid());
+  TC_CHECK(!frame->is_mapped());
+  TC_CHECK(std::vector<Vector4>(frame->begin(), frame->end()) == a);
+  // Not a file
+  TC_CHECK(!frames.get(1)->is_valid());
+  std::remove(frames.get_file_name(0).c_str());
+}
+
+TC_TEST("frame_writer") {
+  std::vector<real> field(50000);
+  {
+    // One frame at a time, so that every write() after the first may wait
+    FrameWriter writer(1);
+    for (int f = 0; f < 4; f++) {
+      for (int i = 0; i < (int)field.size(); i++) {
+        field[i] = (real)(f * i % 97);
+      }
+      FrameWriter::Frame frame;
+      frame.add("frame", f);
+      frame.add("field", field);
+      writer.write(fmt::format("test_frame_writer_{}.tcbs", f),
+                   std::move(frame));
+      // The frame holds a copy
+      field.assign(field.size(), -1);
+    }
+    writer.flush();
+    TC_CHECK(writer.get_num_pending() == 0);
+  }
+  for (int f = 0; f < 4; f++) {
+    std::string fn = fmt::format("test_frame_writer_{}.tcbs", f);
+    {
+      BinaryFileStreamInput stream(fn);
+      BinaryInputSerializer reader;
+      reader.initialize(stream);
+      int frame = -1;
+      std::vector<real> read_field;
+      stream.seek("field");
+      reader(read_field);
+      stream.seek("frame");
+      reader(frame);
+      TC_CHECK(frame == f);
+      TC_CHECK(read_field.size() == field.size());
+      bool equal = true;
+      for (int i = 0; i < (int)read_field.size(); i++) {
+        equal = equal && read_field[i] == (real)(f * i % 97);
+      }
+      TC_CHECK(equal);
+    }
+    std::remove(fn.c_str());
+  }
+}
+
+TC_TEST("bulk_serialization") {
+  std::vector<Vector3> a(1000);
+  std::vector<std::pair<int, float64>> pairs(10);
+  for (int i = 0; i < (int)a.size(); i++) {
+    a[i] = Vector3(i, i * 2, -i);
+  }
+  for (int i = 0; i < (int)pairs.size(); i++) {
+    pairs[i] = std::make_pair(i, i * 0.5);
+  }
+  int32 tag = 7;
+  BinaryOutputSerializer writer;
+  writer.initialize();
+  writer(nullptr, a, pairs, tag, a);
+  writer.finalize();
+  // One size, then the elements as they are in memory
+  std::size_t offset = sizeof(std::size_t);
+  std::size_t n;
+  std::memcpy(&n, &writer.data[offset], sizeof(n));
+  TC_CHECK(n == a.size());
+  TC_CHECK(std::memcmp(&writer.data[offset + sizeof(n)], a.data(),
+                       sizeof(Vector3) * n) == 0);
+
+  // Into 16-byte aligned memory, so that the first vector is in place and
+  // the second, after the 4-byte tag, is not
+  std::vector<Vector4> buffer(writer.head / sizeof(Vector4) + 1);
+  std::memcpy((void *)buffer.data(), writer.data.data(), writer.head);
+  BinaryInputSerializer reader;
+  reader.initialize(buffer.data());
+  std::vector<Vector3> copy, b;
+  std::vector<std::pair<int, float64>> read_pairs;
+  int32 read_tag;
+  const Vector3 *view = reader.read_view(n, copy);
+  TC_CHECK((const void *)view == (const uint8 *)buffer.data() + 16);
+  TC_CHECK(copy.empty());
+  TC_CHECK(std::vector<Vector3>(view, view + n) == a);
+  reader(nullptr, read_pairs, read_tag);
+  view = reader.read_view(n, copy);
+  TC_CHECK(view == copy.data());
+  TC_CHECK(copy == a);
+  reader.finalize();
+  TC_CHECK(read_pairs == pairs);
+  TC_CHECK(read_tag == tag);
+  reader.initialize(buffer.data());
+  reader(nullptr, b);
+  TC_CHECK(b == a);
+}
+
+TC_TEST("array_3d_io") {
+  std::string fn = "test_array_3d_io.tcbs";
+  Array3D<real> a(Vector3i(7, 5, 3), 0.0_f, Vector3(0.5_f, 0, 0.5_f)), b;
+  for (int i = 0; i < a.get_size(); i++) {
+    a.data[i] = std::sin(i);
+  }
+  write_to_binary_stream(a, fn);
+  read_from_binary_stream(b, fn);
+  TC_CHECK(b.get_res() == a.get_res());
+  TC_CHECK(b.get_storage_offset() == a.get_storage_offset());
+  bool equal = true;
+  for (auto &ind : a.get_region()) {
+    equal = equal && a[ind] == b[ind];
+  }
+  TC_CHECK(equal);
+  std::remove(fn.c_str());
+}
+
+TC_NAMESPACE_END
@@ -0,0 +1,95 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#include <taichi/math/sparse.h>
+#include <taichi/testing.h>
+
+TC_NAMESPACE_BEGIN
+
+// Random triplets with duplicates, inserted in two rounds, against a dense
+// copy
+template <int block_size>
+static void test_assembly(int n) {
+  int size = n * block_size;
+  BlockSparseMatrix<block_size> A(n);
+  std::vector<real> dense(size * size, 0.0_f);
+  for (int round = 0; round < 2; round++) {
+    for (int t = 0; t < 20 * size; t++) {
+      int i = rand_int() % size, j = rand_int() % size;
+      real value = rand() - 0.5_f;
+      A.insert(i, j, value);
+      dense[i * size + j] += value;
+    }
+    A.compress();
+  }
+  Array1D<real> x(size);
+  for (int i = 0; i < size; i++) {
+    x[i] = rand();
+  }
+  Array1D<real> y = A.multiply(x);
+  real max_error = 0;
+  for (int i = 0; i < size; i++) {
+    real sum = 0;
+    for (int j = 0; j < size; j++) {
+      sum += dense[i * size + j] * x[j];
+      max_error =
+          std::max(max_error, std::abs(A.get(i, j) - dense[i * size + j]));
+    }
+    max_error = std::max(max_error, std::abs(y[i] - sum));
+  }
+  CHECK(max_error < 1e-4_f);
+}
+
+// 2D Laplacian with Dirichlet boundaries, of block_size unknowns per cell
+// coupled by an SPD block on the diagonal
+template <int block_size>
+static void test_cg(int res) {
+  int n = res * res;
+  BlockSparseMatrix<block_size> A(n);
+  for (int i = 0; i < res; i++) {
+    for (int j = 0; j < res; j++) {
+      int row = i * res + j;
+      for (int c = 0; c < block_size; c++) {
+        for (int d = 0; d < block_size; d++) {
+          A.insert(row * block_size + c, row * block_size + d, c == d ? 4 : 1);
+        }
+      }
+      int neighbours[4][2] = {{i - 1, j}, {i + 1, j}, {i, j - 1}, {i, j + 1}};
+      for (auto &nb : neighbours) {
+        if (0 <= nb[0] && nb[0] < res && 0 <= nb[1] && nb[1] < res) {
+          int col = nb[0] * res + nb[1];
+          for (int c = 0; c < block_size; c++) {
+            A.insert(row * block_size + c, col * block_size + c, -1);
+          }
+        }
+      }
+    }
+  }
+  A.compress();
+  int size = A.get_size();
+  Array1D<real> x_exact(size), x;
+  for (int i = 0; i < size; i++) {
+    x_exact[i] = rand();
+  }
+  Array1D<real> b = A.multiply(x_exact);
+  int iterations = conjugate_gradient(A, b, x, 1e-5_f);
+  CHECK(iterations > 0);
+  real max_error = 0;
+  for (int i = 0; i < size; i++) {
+    max_error = std::max(max_error, std::abs(x[i] - x_exact[i]));
+  }
+  CHECK(max_error < 1e-2_f);
+}
+
+TC_TEST("sparse_matrix") {
+  test_assembly<1>(50);
+  test_assembly<2>(20);
+  test_assembly<3>(15);
+  test_cg<1>(32);
+  test_cg<2>(24);
+  test_cg<3>(16);
+}
+
+TC_NAMESPACE_END
@@ -0,0 +1,49 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#include <taichi/math/sparse_grid.h>
+#include <taichi/testing.h>
+
+#include <atomic>
+
+TC_NAMESPACE_BEGIN
+
+TC_TEST("sparse_grid") {
+  // Not a power of two, with partial blocks on the upper boundaries
+  Vector3i res(100, 37, 260);
+  SparseGrid3D<real> grid(res);
+  std::vector<Vector3i> cells;
+  for (int i = 0; i < 1000; i++) {
+    Vector3i cell(rand_int() % res[0], rand_int() % res[1],
+                  rand_int() % res[2]);
+    // Untouched cells read as zero
+    CHECK(grid[cell] == 0);
+    cells.push_back(cell);
+  }
+  for (auto &cell : cells) {
+    grid[cell] += 1;
+    grid.activate(cell);
+  }
+  grid.update_active_blocks();
+  std::atomic<int> num_inactive(0), num_blocks(0), num_values(0);
+  grid.for_each_active_block([&](const Vector3i &begin, const real *values) {
+    num_inactive += !grid.is_active(begin);
+    num_blocks++;
+    for (int i = 0; i < SparseGrid3D<real>::block_volume; i++) {
+      num_values += (int)values[i];
+    }
+  });
+  CHECK(num_inactive == 0);
+  CHECK(num_blocks == grid.get_num_active_blocks());
+  CHECK(num_values == (int)cells.size());
+  grid.clear();
+  CHECK(grid.get_num_active_blocks() == 0);
+  for (auto &cell : cells) {
+    CHECK(grid[cell] == 0);
+    CHECK(!grid.is_active(cell));
+  }
+}
+
+TC_NAMESPACE_END
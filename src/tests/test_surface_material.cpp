@@ -0,0 +1,95 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#include <taichi/visual/surface_material.h>
+#include <taichi/testing.h>
+
+TC_NAMESPACE_BEGIN
+
+// Batched kernels must agree with the scalar interface lane by lane
+TC_TEST("surface_material_batch") {
+  auto diffuse = create_instance<SurfaceMaterial>(
+      "diffuse", Config().set("color", std::string("(0.3, 0.5, 0.7)")));
+  auto microfacet = create_instance<SurfaceMaterial>(
+      "microfacet", Config()
+                        .set("color", std::string("(0.3, 0.5, 0.7)"))
+                        .set("roughness", std::string("0.2"))
+                        .set("f0", 0.5_f));
+  auto close = [](real a, real b) {
+    return std::abs(a - b) <= 1e-4_f * std::max(1.0_f, std::abs(b));
+  };
+  const int n = 1000;
+  SurfaceBatch batch;
+  batch.resize(n);
+  for (auto &mat : {diffuse, microfacet}) {
+    for (int i = 0; i < n; i++) {
+      batch.set_in(i, sample_sphere(rand(), rand()));
+      batch.set_out(i, sample_sphere(rand(), rand()));
+      batch.set_uv(i, Vector2(rand(), rand()));
+      batch.u[i] = rand();
+      batch.v[i] = rand();
+    }
+    mat->evaluate_batch(batch);
+    mat->probability_density_batch(batch);
+    for (int i = 0; i < n; i++) {
+      Vector3 f = mat->evaluate_bsdf(batch.get_in(i), batch.get_out(i),
+                                     batch.get_uv(i));
+      real pdf = mat->probability_density(batch.get_in(i), batch.get_out(i),
+                                          batch.get_uv(i));
+      for (int k = 0; k < 3; k++) {
+        TC_CHECK(close(batch.get_f(i)[k], f[k]));
+      }
+      TC_CHECK(close(batch.pdf[i], pdf));
+    }
+    mat->sample_batch(batch);
+    for (int i = 0; i < n; i++) {
+      Vector3 out_dir, f;
+      real pdf;
+      SurfaceEvent event;
+      mat->sample(batch.get_in(i), batch.u[i], batch.v[i], out_dir, f, pdf,
+                  event, batch.get_uv(i));
+      for (int k = 0; k < 3; k++) {
+        TC_CHECK(close(batch.get_out(i)[k], out_dir[k]));
+        TC_CHECK(close(batch.get_f(i)[k], f[k]));
+      }
+      TC_CHECK(close(batch.pdf[i], pdf));
+      TC_CHECK(batch.event[i] == event);
+    }
+  }
+}
+
+// Samples must follow probability_density: the albedo of the material for
+// an incoming direction, as estimated by importance sampling, matches the
+// estimate of uniform sampling
+TC_TEST("microfacet_sampling") {
+  for (real roughness : {0.1_f, 0.5_f, 0.9_f}) {
+    auto mat = create_instance<SurfaceMaterial>(
+        "microfacet", Config()
+                          .set("color", std::string("(1, 1, 1)"))
+                          .set("roughness", fmt::format("{}", roughness))
+                          .set("f0", 0.5_f));
+    const Vector3 in = normalized(Vector3(0.6_f, 0.2_f, 0.5_f));
+    const Vector2 uv(0.5_f);
+    const int n = 200000;
+    real importance = 0, uniform = 0;
+    for (int i = 0; i < n; i++) {
+      Vector3 out, f;
+      real pdf;
+      SurfaceEvent event;
+      mat->sample(in, rand(), rand(), out, f, pdf, event, uv);
+      if (pdf > 0) {
+        importance += f.x * std::abs(out.z) / pdf;
+      }
+      out = sample_sphere(rand(), rand());
+      uniform += mat->evaluate_bsdf(in, out, uv).x * std::abs(out.z) * 4 * pi;
+    }
+    importance /= n;
+    uniform /= n;
+    TC_CHECK(importance <= 1.0_f);
+    TC_CHECK(std::abs(importance - uniform) < 0.03_f * uniform);
+  }
+}
+
+TC_NAMESPACE_END
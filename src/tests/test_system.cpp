@@ -7,7 +7,19 @@
 #include <taichi/testing.h>
 #include <taichi/math/svd.h>
 #include <taichi/math/eigen.h>
+#include <taichi/system/arena.h>
+#include <taichi/system/autotuner.h>
 #include <taichi/system/virtual_memory.h>
+#include <taichi/system/memory.h>
+#include <taichi/system/profiler.h>
+#include <taichi/system/benchmark.h>
+#include <taichi/system/perf_counters.h>
+#include <taichi/system/statistics.h>
+#include <taichi/system/threading.h>
+
+#include <fstream>
+#include <sstream>
+#include <thread>
 
 TC_NAMESPACE_BEGIN
 
@@ -25,4 +37,326 @@ TC_TEST("Virtual Memory") {
 
 }
 
+TC_TEST("memory_usage") {
+  MemoryPhase::clear();
+  auto allocated = [] {
+    return Statistics::get_counters()["memory/virtual_memory"];
+  };
+  int64 outside = allocated();
+  uint64 before = get_memory_usage();
+  TC_CHECK(before > 0);
+  std::size_t size = 256 << 20;
+  {
+    TC_MEMORY_PHASE("touch");
+    VirtualMemoryAllocator vm(size);
+    TC_CHECK(allocated() == outside + (int64)size);
+    std::memset(vm.ptr, 1, size);
+    TC_CHECK(get_memory_usage() >= before + size / 2);
+    // As the thread of start_memory_sampling() does
+    MemoryPhase::sample();
+  }
+  TC_CHECK(allocated() == outside);
+  TC_CHECK(MemoryPhase::get_peaks()["touch"] >= before + size / 2);
+  TC_CHECK(get_peak_memory_usage() >= before + size / 2);
+  // Not a process
+  TC_CHECK(get_memory_usage(-2) == 0);
+}
+
+// Scopes of several threads, merged by name, and their traced events
+TC_TEST("profiler") {
+  auto &records = ProfilerRecords::get_instance();
+  records.clear();
+  Profiler::enable_tracing();
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; t++) {
+    threads.emplace_back([] {
+      for (int i = 0; i < 100; i++) {
+        TC_PROFILER("profiler_test_outer");
+        for (int j = 0; j < 3; j++) {
+          TC_PROFILE("profiler_test_inner", );
+        }
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  Profiler::enable_tracing(false);
+  auto root = records.get_merged_records();
+  auto outer = root->get_child("profiler_test_outer");
+  CHECK(outer->num_samples == 400);
+  CHECK(outer->childs.size() == 1);
+  CHECK(outer->get_child("profiler_test_inner")->num_samples == 1200);
+  records.write_chrome_trace("profiler_trace.json");
+  std::ifstream is("profiler_trace.json");
+  std::stringstream ss;
+  ss << is.rdbuf();
+  std::string trace = ss.str();
+  int num_inner_events = 0;
+  for (auto pos = trace.find("profiler_test_inner"); pos != std::string::npos;
+       pos = trace.find("profiler_test_inner", pos + 1)) {
+    num_inner_events++;
+  }
+  CHECK(num_inner_events == 1200);
+}
+
+// Counters of several threads, summed, including those of exited threads
+TC_TEST("statistics") {
+  Statistics::clear();
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; t++) {
+    threads.emplace_back([t] {
+      for (int i = 0; i < 1000; i++) {
+        TC_STAT("statistics_test_events", 1);
+      }
+      TC_STAT("statistics_test_threads", t + 1);
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  auto counters = Statistics::get_counters();
+  CHECK(counters["statistics_test_events"] == 4000);
+  CHECK(counters["statistics_test_threads"] == 10);
+  Statistics::clear();
+  CHECK(Statistics::get_counters()["statistics_test_events"] == 0);
+}
+
+// Counts grow with the work done, where perf events are available, and
+// reach profiler scopes
+TC_TEST("perf_counters") {
+  // Software events, which need no PMU
+  auto events = PerfCounterGroup::parse_events("task_clock, page_faults,");
+  CHECK(events.size() == 2);
+  CHECK(events[1] == "page_faults");
+  PerfCounterGroup group(events);
+  auto before = group.read();
+  volatile int sum = 0;
+  for (int i = 0; i < 100000; i++) {
+    sum += i;
+  }
+  auto after = group.read();
+  CHECK(after.size() == 2);
+  if (group.valid()) {
+    CHECK(after[0] > before[0]);
+  }
+  auto &records = ProfilerRecords::get_instance();
+  Profiler::enable_counters(events);
+  {
+    TC_PROFILE_TPE("perf_counters_test", sum += 1, 1);
+  }
+  auto root = records.get_merged_records();
+  auto counts = root->get_child("perf_counters_test")->counts;
+  CHECK(counts.size() == (group.valid() ? 2u : 0u));
+  Profiler::enable_counters({});
+}
+
+// Percentiles over all samples; mean and stddev without the outlier
+TC_TEST("benchmark_statistics") {
+  BenchmarkStatistics stats({4, 1, 3, 2, 100}, "s");
+  CHECK(stats.median == 3);
+  CHECK(stats.min == 1);
+  CHECK(stats.max == 100);
+  CHECK(std::abs(stats.p95 - 80.8) < 1e-9);
+  CHECK(stats.num_outliers == 1);
+  CHECK(stats.mean == 2.5);
+  CHECK(std::abs(stats.stddev - std::sqrt(5.0 / 3)) < 1e-9);
+}
+
+// Scopes free their allocations, so loops of them stop growing the arena
+TC_TEST("arena") {
+  Arena arena(1024);
+  void *first;
+  {
+    ArenaScope scope(arena);
+    first = arena.allocate(16);
+  }
+  std::size_t capacity = 0;
+  for (int i = 0; i < 10; i++) {
+    ArenaScope scope(arena);
+    TC_CHECK(arena.allocate(16) == first);
+    ArenaVector<int> a{ArenaAllocator<int>(arena)};
+    for (int j = 0; j < 1000; j++) {
+      a.push_back(j);
+    }
+    ArenaVector<Vector4> b(100, Vector4(1.0_f), ArenaAllocator<Vector4>(arena));
+    TC_CHECK((std::size_t)b.data() % alignof(Vector4) == 0);
+    TC_CHECK(a[999] == 999);
+    TC_CHECK(b[99] == Vector4(1.0_f));
+    if (i == 0) {
+      capacity = arena.get_capacity();
+    }
+    TC_CHECK(arena.get_capacity() == capacity);
+  }
+}
+
+// Nodes start after all their predecessors, also in later runs
+TC_TEST("task_graph") {
+  for (int num_threads : {-1, 2}) {
+    TaskGraph graph(num_threads);
+    std::atomic<int> finished(0);
+    std::vector<int> values(8, 0);
+    std::atomic<bool> ordered(true);
+    int root = graph.add_node([&] { finished++; });
+    int last = graph.add_node([&] {
+      for (int i = 0; i < 8; i++) {
+        if (values[i] != i + 1) {
+          ordered = false;
+        }
+      }
+    });
+    for (int i = 0; i < 8; i++) {
+      int node = graph.add_continuation(root, [&, i] {
+        if (finished < 1) {
+          ordered = false;
+        }
+        ThreadedTaskManager::run(100, num_threads, [&](int) {});
+        values[i] = i + 1;
+      });
+      graph.add_edge(node, last);
+    }
+    for (int k = 0; k < 2; k++) {
+      graph.run();
+    }
+    TC_CHECK(ordered);
+    TC_CHECK(finished == 2);
+  }
+}
+
+// Pinned loops still run every iteration once
+TC_TEST("thread_pinning") {
+  auto &nodes = ThreadedTaskManager::get_numa_nodes();
+  TC_CHECK(!nodes.empty());
+  TC_CHECK(!nodes[0].empty());
+  ThreadedTaskManager::set_thread_pinning(true);
+  for (int num_threads : {-1, 2}) {
+    std::vector<std::atomic<int>> visits(1000);
+    for (int k = 0; k < 2; k++) {
+      ThreadedTaskManager::run(1000, num_threads, [&](int i) { visits[i]++; });
+    }
+    bool all_twice = true;
+    for (auto &v : visits) {
+      if (v != 2) {
+        all_twice = false;
+      }
+    }
+    TC_CHECK(all_twice);
+  }
+  ThreadedTaskManager::set_thread_pinning(false);
+}
+
+// Mutual exclusion, and the counters of the waits for the lock
+TC_TEST("spinlock") {
+  Spinlock lock;
+  lock.set_contention_counter("test_spinlock");
+  int64 sum = 0;
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; t++) {
+    threads.emplace_back([&] {
+      for (int i = 0; i < 10000; i++) {
+        std::lock_guard<Spinlock> _(lock);
+        sum += 1;
+      }
+    });
+  }
+  for (auto &t : threads) {
+    t.join();
+  }
+  TC_CHECK(sum == 40000);
+  TC_CHECK(lock.try_lock());
+  TC_CHECK(!lock.try_lock());
+  lock.unlock();
+  auto counters = Statistics::get_counters();
+  TC_CHECK(counters["test_spinlock_spins"] >=
+           counters["test_spinlock_contentions"]);
+  TC_CHECK(sizeof(PaddedSpinlock) == 64);
+}
+
+// The same float results for any number of threads, against serial loops
+TC_TEST("parallel_reduce_scan") {
+  int n = 100003;
+  std::vector<float32> values(n);
+  for (int i = 0; i < n; i++) {
+    values[i] = (float32)rand() * 1e3f;
+  }
+  auto add = [](float32 a, float32 b) { return a + b; };
+  std::vector<float32> sums;
+  std::vector<std::vector<float32>> prefixes;
+  for (int num_threads : {1, 2, -1}) {
+    sums.push_back(ThreadedTaskManager::reduce(
+        0, n, num_threads, 0.0f,
+        [&](int begin, int end) {
+          float32 sum = 0;
+          for (int i = begin; i < end; i++) {
+            sum += values[i];
+          }
+          return sum;
+        },
+        add));
+    std::vector<float32> prefix(n);
+    ThreadedTaskManager::scan(0, n, num_threads, 0.0f,
+                              [&](int i) { return values[i]; }, add,
+                              [&](int i, float32 p) { prefix[i] = p; });
+    prefixes.push_back(prefix);
+  }
+  TC_CHECK(sums[0] == sums[1]);
+  TC_CHECK(sums[0] == sums[2]);
+  TC_CHECK(prefixes[0] == prefixes[1]);
+  TC_CHECK(prefixes[0] == prefixes[2]);
+  float64 serial = 0;
+  for (auto v : values) {
+    serial += v;
+  }
+  TC_CHECK(std::abs(sums[0] - serial) < 1e-4 * serial);
+  TC_CHECK(prefixes[0][0] == 0);
+  TC_CHECK(prefixes[0][1] == values[0]);
+
+  // In place, and compaction in order
+  std::vector<int> counts(n, 1);
+  int total = ThreadedTaskManager::scan(
+      0, n, -1, 0, [&](int i) { return counts[i]; },
+      [](int a, int b) { return a + b; },
+      [&](int i, int p) { counts[i] = p; });
+  TC_CHECK(total == n);
+  TC_CHECK(counts[n - 1] == n - 1);
+  std::vector<int> odd(n / 2, -1);
+  int num_odd = ThreadedTaskManager::compact(
+      0, n, -1, [](int i) { return i % 2 == 1; },
+      [&](int i, int j) { odd[j] = i; });
+  TC_CHECK(num_odd == n / 2);
+  bool ordered = true;
+  for (int j = 0; j < num_odd; j++) {
+    ordered = ordered && odd[j] == 2 * j + 1;
+  }
+  TC_CHECK(ordered);
+  TC_CHECK(ThreadedTaskManager::reduce(5, 5, -1, 7, [](int, int) { return 0; },
+                                       [](int a, int b) { return a + b; }) ==
+           7);
+}
+
+#if !defined(TC_PLATFORM_WINDOWS)
+TC_TEST("autotuner") {
+  std::string path = "/tmp/taichi_test_tuning.txt";
+  std::remove(path.c_str());
+  setenv("TC_TUNING_PROFILE", path.c_str(), 1);
+  bool tuning = Autotuner::get_tuning();
+  Autotuner::set_tuning(false);
+  auto benchmark = [](int v) { return std::abs(v - 3) + 1.0; };
+  TC_CHECK(Autotuner::get("test_param", 2, 7, {1, 3, 5}, benchmark) == 7);
+  // Tuned and saved on first use, then read from the profile
+  Autotuner::set_tuning(true);
+  TC_CHECK(Autotuner::get("test_param", 2, 7, {1, 3, 5}, benchmark) == 3);
+  TC_CHECK(Autotuner::get("test_param", 2, 7, {1, 5}, benchmark) == 3);
+  Autotuner::set_tuning(false);
+  TC_CHECK(Autotuner::get("test_param", 4, 7) == 7);
+  Autotuner::set("test_param", 2, 9);
+  TC_CHECK(Autotuner::get("test_param", 2, 7) == 9);
+  Autotuner::load(path);
+  TC_CHECK(Autotuner::get("test_param", 2, 7) == 3);
+  Autotuner::set_tuning(tuning);
+  unsetenv("TC_TUNING_PROFILE");
+  std::remove(path.c_str());
+}
+#endif
+
 TC_NAMESPACE_END
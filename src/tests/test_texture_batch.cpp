@@ -0,0 +1,60 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#include <taichi/visual/texture_compiler.h>
+#include <taichi/testing.h>
+
+TC_NAMESPACE_BEGIN
+
+// sample_batch() agrees with sample() point by point
+TC_TEST("texture_batch") {
+  auto perlin = create_instance<Texture>("perlin", Config());
+  const int n = 203;
+  std::vector<Vector3> coords(n);
+  for (int i = 0; i < n; i++) {
+    coords[i] = Vector3(i * 0.0137_f - 1, std::sin(i * 1.3_f), i * 0.0071_f);
+  }
+  // Compiled programs pass batches on to their sample instructions
+  TextureCompiler compiler;
+  int zoomed = compiler.transform(compiler.input(), [](Vector3 c) {
+    return c * 0.5_f + Vector3(0.25_f);
+  });
+  TextureProgram program = compiler.finish(compiler.emit_linear(
+      0.5_f, compiler.compile(*perlin, zoomed), 0.5_f,
+      compiler.emit_constant(Vector4(1.0_f)), false));
+  std::vector<Vector4> noise(n), compiled(n);
+  perlin->sample_batch(coords.data(), n, noise.data());
+  program.run_batch(coords.data(), n, compiled.data());
+  real error = 0;
+  for (int i = 0; i < n; i++) {
+    error = std::max(error, std::abs(noise[i].x - perlin->sample(coords[i]).x));
+    error =
+        std::max(error, std::abs(compiled[i].x - program.run(coords[i]).x));
+  }
+  CHECK(error < 1e-6_f);
+
+  // Baked at the cell centers, up to their rounding (noise varies fast)
+  auto baked = create_instance<Texture>(
+      "perlin", Config()
+                    .set("bake_resolution", Vector3i(8, 16, 4))
+                    .set("bake_lower", Vector3(0.5_f))
+                    .set("bake_upper", Vector3(0.6_f)));
+  error = 0;
+  for (int i = 0; i < 8; i++) {
+    for (int j = 0; j < 16; j++) {
+      for (int k = 0; k < 4; k++) {
+        Vector3 coord = Vector3(0.5_f) + (Vector3(i, j, k) + Vector3(0.5_f)) *
+                                             Vector3(0.1_f / 8, 0.1_f / 16,
+                                                     0.1_f / 4);
+        error = std::max(error, std::abs(baked->sample(coord).x -
+                                         perlin->sample(coord).x));
+      }
+    }
+  }
+  CHECK(error < 1e-3_f);
+  CHECK(baked->sample(Vector3(0.7_f)) == perlin->sample(Vector3(0.7_f)));
+}
+
+TC_NAMESPACE_END
@@ -0,0 +1,50 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#include <taichi/visual/texture_cache.h>
+#include <taichi/testing.h>
+
+TC_NAMESPACE_BEGIN
+
+TC_TEST("texture_cache") {
+  // Spans several tiles, with partial ones at the edges
+  Array2D<Vector4> image(Vector2i(150, 70));
+  for (auto &ind : image.get_region()) {
+    image[ind] = Vector4(ind.i / 150.0_f, ind.j / 70.0_f,
+                         (ind.i * 7 + ind.j * 3) % 11 / 11.0_f, 1);
+  }
+  std::string fn = "test_texture_cache.tct";
+  TextureCache &cache = TextureCache::get_instance();
+  std::size_t budget = cache.get_budget();
+  for (auto format : {StorageFormat::full, StorageFormat::float16}) {
+    TexturePyramid pyramid(image, format);
+    TiledTexturePyramid::write(fn, pyramid, 123);
+    TiledTexturePyramid tiled;
+    CHECK(tiled.open(fn));
+    CHECK(tiled.get_source_stamp() == 123);
+    CHECK(tiled.get_format() == format);
+    CHECK(tiled.get_num_levels() == pyramid.get_num_levels());
+    // Two tiles at most, so that lookups keep evicting
+    cache.set_budget(2 * 64 * 64 * get_texel_bytes(format));
+    real error = 0;
+    for (int i = 0; i < 200; i++) {
+      Vector2 coord(i * 0.0193_f - (int)(i * 0.0193_f), 1 - i * 0.0047_f);
+      for (real lod : {0.0_f, 0.7_f, 2.5_f, 9.0_f}) {
+        Vector4 d = tiled.sample(coord, lod) - pyramid.sample(coord, lod);
+        for (int c = 0; c < 4; c++) {
+          error = std::max(error, std::abs(d[c]));
+        }
+      }
+    }
+    // Exact but for full precision doubles, stored as float32
+    CHECK(error < 1e-6_f);
+    CHECK(cache.get_memory_usage() <= cache.get_budget());
+  }
+  cache.set_budget(budget);
+  std::remove(fn.c_str());
+  CHECK(!TiledTexturePyramid().open(fn));
+}
+
+TC_NAMESPACE_END
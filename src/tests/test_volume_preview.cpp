@@ -0,0 +1,78 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#include <taichi/visualization/volume_preview.h>
+#include <taichi/testing.h>
+
+TC_NAMESPACE_BEGIN
+
+TC_TEST("volume_preview") {
+  // A blob and a constant slab in empty space, across bricks and levels
+  Vector3i res(40, 27, 35);
+  Array3D<real> density(res, 0.0_f), emission(res, 0.0_f);
+  for (auto &ind : density.get_region()) {
+    Vector3 d = ind.get_pos() - Vector3(14, 12, 20);
+    density[ind] = std::max(0.0_f, 1 - length(d) / 9) * 0.4_f;
+    emission[ind] = std::max(0.0_f, 1 - length(d) / 5);
+    if (ind.i >= 24 && ind.i < 40 && ind.k < 16) {
+      density[ind] += 0.05_f;
+    }
+  }
+  VolumePreview preview;
+  preview.absorption = 0.7_f;
+  preview.density_color = Vector3(0.1_f, 0.2_f, 0.3_f);
+  preview.emission_color = Vector3(0.2_f, 0, 0);
+  preview.min_transmittance = 0;
+  preview.set_volume(density, &emission);
+  for (int axis = 0; axis < 3; axis++) {
+    Vector2i size(37, 23);
+    Array2D<Vector3> buffer(size + Vector2i(4, 3), Vector3(-1));
+    preview.render(buffer, Vector2i(4, 3), size + Vector2i(4, 3), axis);
+    int axis_x = axis == 0 ? 1 : 0, axis_y = axis == 2 ? 1 : 2;
+    real error = 0;
+    for (int i = 0; i < size.x; i++) {
+      for (int j = 0; j < size.y; j++) {
+        // A sample per cell, without skipping
+        Vector3 pos;
+        pos[axis_x] = (i + 0.5_f) / size.x * res[axis_x];
+        pos[axis_y] = (j + 0.5_f) / size.y * res[axis_y];
+        Vector3 color(0.0_f);
+        real transmittance = 1;
+        for (int s = 0; s < res[axis]; s++) {
+          pos[axis] = s + 0.5_f;
+          real d = density.sample(pos), e = emission.sample(pos);
+          Vector3 radiance =
+              preview.density_color * d + preview.emission_color * e;
+          if (d > 0) {
+            real opacity = 1 - std::exp(-preview.absorption * d);
+            color += transmittance * opacity / (preview.absorption * d) *
+                     radiance;
+            transmittance *= 1 - opacity;
+          } else {
+            color += transmittance * radiance;
+          }
+        }
+        Vector3 d = buffer[i + 4][j + 3] - color;
+        error = std::max(error, std::abs(d.x) + std::abs(d.y) + std::abs(d.z));
+      }
+    }
+    CHECK(error < 1e-5_f);
+    CHECK(buffer[3][2] == Vector3(-1));
+  }
+  // Early termination and lower resolutions stay close
+  Array2D<Vector3> full(Vector2i(32, 32)), coarse(Vector2i(32, 32));
+  preview.render(full, Vector2i(0), Vector2i(32), 2);
+  preview.min_transmittance = 1e-3_f;
+  preview.downsample = 2;
+  preview.render(coarse, Vector2i(0), Vector2i(32), 2);
+  real error = 0;
+  for (auto &ind : full.get_region()) {
+    CHECK(coarse[ind] == coarse[ind.i / 2 * 2][ind.j / 2 * 2]);
+    error += length(coarse[ind] - full[ind]);
+  }
+  CHECK(error / (32 * 32) < 0.02_f);
+}
+
+TC_NAMESPACE_END
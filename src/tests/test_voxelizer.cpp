@@ -0,0 +1,81 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#include <taichi/visual/voxelizer.h>
+#include <taichi/testing.h>
+
+TC_NAMESPACE_BEGIN
+
+// Outward-facing triangles of the box [lower, upper]
+static std::vector<Triangle> box_triangles(const Vector3 &lower,
+                                           const Vector3 &upper) {
+  std::vector<Triangle> triangles;
+  auto corner = [&](int i) {
+    return Vector3(i & 1 ? upper.x : lower.x, i & 2 ? upper.y : lower.y,
+                   i & 4 ? upper.z : lower.z);
+  };
+  int faces[6][4] = {{0, 2, 3, 1}, {4, 5, 7, 6}, {0, 1, 5, 4},
+                     {2, 6, 7, 3}, {0, 4, 6, 2}, {1, 3, 7, 5}};
+  for (auto &f : faces) {
+    for (int t = 0; t < 2; t++) {
+      Triangle tri;
+      tri.v[0] = corner(f[0]);
+      tri.v[1] = corner(f[t + 1]);
+      tri.v[2] = corner(f[t + 2]);
+      triangles.push_back(tri);
+    }
+  }
+  return triangles;
+}
+
+TC_TEST("voxelizer") {
+  // Box edges pass exactly through voxel samples, and the diagonals of its
+  // faces through the columns
+  Vector3i res(16, 16, 16);
+  real dx = 1.0_f / 16;
+  Voxelizer voxelizer(res, Vector3(0.0_f), dx, 1);
+  Vector3 lower(4 * dx), upper(12 * dx, 10 * dx, 12 * dx);
+  auto triangles = box_triangles(lower, upper);
+  auto occupancy = voxelizer.voxelize(triangles);
+  auto sdf = voxelizer.signed_distance(triangles, 2);
+  int wrong = 0, wrong_sdf = 0;
+  for (int i = 0; i < res.x; i++) {
+    for (int j = 0; j < res.y; j++) {
+      for (int k = 0; k < res.z; k++) {
+        Vector3 p = voxelizer.get_pos(i, j, k);
+        Vector3 d = max(lower - p, p - upper);
+        bool strictly_inside = d.max() < 0, strictly_outside = d.max() > 0;
+        real v = occupancy[i][j][k];
+        if ((strictly_inside && v != 1) || (strictly_outside && v != 0)) {
+          wrong++;
+        }
+        if (strictly_inside || strictly_outside) {
+          real dist = strictly_inside ? d.max() : length(max(d, Vector3(0)));
+          dist = clamp(dist, -2 * dx, 2 * dx);
+          if (std::abs(sdf[i][j][k] - dist) > 1e-5_f) {
+            wrong_sdf++;
+          }
+        }
+      }
+    }
+  }
+  CHECK(wrong == 0);
+  CHECK(wrong_sdf == 0);
+
+  // A triangle far thinner than a voxel, spanning voxels 3 to 13 along x
+  Triangle sliver;
+  sliver.v[0] = Vector3(0.21_f, 0.3_f, 0.5_f);
+  sliver.v[1] = Vector3(0.8_f, 0.3_f, 0.5_f);
+  sliver.v[2] = Vector3(0.8_f, 0.3001_f, 0.5_f);
+  auto shell = voxelizer.voxelize({sliver}, true);
+  int touched = 0;
+  for (auto &ind : shell.get_region()) {
+    touched += shell[ind] > 0;
+  }
+  CHECK(touched == 11);
+  CHECK(shell[8][5][8] == 1);
+}
+
+TC_NAMESPACE_END
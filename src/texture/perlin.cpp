@@ -4,63 +4,248 @@
 *******************************************************************************/
 
 #include <taichi/visual/texture.h>
+#include <taichi/math/fast_math.h>
+#include <taichi/system/threading.h>
 
 TC_NAMESPACE_BEGIN
 
 // Adapted from the Java reference implementation here
 // http://cs.nyu.edu/~perlin/noise/
+//
+// The arithmetic is written once over float32 scalars and packs of eight,
+// for sample() and sample_batch(); the hashes pick the gradients from a
+// table of the permutation. With "bake_resolution", the noise is evaluated
+// once on a grid over [bake_lower, bake_upper) of texture coordinates, for
+// static textures sampled many times, and sample() interpolates it there.
 
 class PerlinNoiseTexture : public Texture {
  protected:
+  using Pack = ScalarPack<float32, 8>;
+  Array3D<real> baked;
+  Vector3 bake_lower, bake_upper;
+
  public:
   void initialize(const Config &config) override {
     Texture::initialize(config);
+    Vector3i res = config.get("bake_resolution", Vector3i(0));
+    if (res.x > 0 && res.y > 0 && res.z > 0) {
+      bake_lower = config.get("bake_lower", Vector3(0.0_f));
+      bake_upper = config.get("bake_upper", Vector3(1.0_f));
+      bake(res);
+    }
   }
+
   virtual Vector4 sample(const Vector3 &coord) const override {
+    if (baked.get_size() > 0 && in_bake(coord)) {
+      return Vector4(baked.sample_relative_coord((coord - bake_lower) /
+                                                 (bake_upper - bake_lower)));
+    }
     return Vector4(noise(coord * 256.0_f));
   }
-  real noise(Vector3 coord) const {
-    return real(noise(coord.x, coord.y, coord.z));
+
+  void sample_batch(const Vector3 *coords,
+                    int n,
+                    Vector4 *out) const override {
+    if (baked.get_size() > 0) {
+      Texture::sample_batch(coords, n, out);
+      return;
+    }
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+      float32 points[3][8], values[8];
+      for (int l = 0; l < 8; l++) {
+        for (int k = 0; k < 3; k++) {
+          points[k][l] = coords[i + l][k] * 256.0_f;
+        }
+      }
+      noise8(points, values);
+      for (int l = 0; l < 8; l++) {
+        out[i + l] = Vector4(values[l]);
+      }
+    }
+    for (; i < n; i++) {
+      out[i] = Vector4(noise(coords[i] * 256.0_f));
+    }
+  }
+
+  static real noise(const Vector3 &coord) {
+    float32 f[3], gradients[8][3];
+    locate(coord.x, coord.y, coord.z, f, gradients);
+    return blend(f[0], f[1], f[2], gradients);
+  }
+
+  // noise() of the points (x[0][l], x[1][l], x[2][l]), l < 8. With AVX2
+  // the table lookups are gathers, otherwise they go a lane at a time.
+  static void noise8(const float32 x[3][8], float32 *out) {
+    Pack f[3], cell[3];
+    for (int k = 0; k < 3; k++) {
+      Pack v = Pack::load(x[k]);
+      cell[k] = fast_math::floor(v);
+      f[k] = v - cell[k];
+    }
+    const int *const p = get_p();
+    const Gradients &table = get_gradients();
+    Pack g[8][3];
+#if defined(__AVX2__)
+    __m256i one = _mm256_set1_epi32(1), mask = _mm256_set1_epi32(255);
+    __m256i X = _mm256_and_si256(_mm256_cvttps_epi32(cell[0].v), mask),
+            Y = _mm256_and_si256(_mm256_cvttps_epi32(cell[1].v), mask),
+            Z = _mm256_and_si256(_mm256_cvttps_epi32(cell[2].v), mask);
+    auto lookup = [&](__m256i i) { return _mm256_i32gather_epi32(p, i, 4); };
+    __m256i A = _mm256_add_epi32(lookup(X), Y),
+            B = _mm256_add_epi32(lookup(_mm256_add_epi32(X, one)), Y);
+    __m256i AA = _mm256_add_epi32(lookup(A), Z),
+            AB = _mm256_add_epi32(lookup(_mm256_add_epi32(A, one)), Z),
+            BA = _mm256_add_epi32(lookup(B), Z),
+            BB = _mm256_add_epi32(lookup(_mm256_add_epi32(B, one)), Z);
+    const __m256i corners[4] = {AA, BA, AB, BB};
+    for (int c = 0; c < 8; c++) {
+      __m256i corner =
+          c < 4 ? corners[c] : _mm256_add_epi32(corners[c - 4], one);
+      __m256i index = _mm256_mullo_epi32(corner, _mm256_set1_epi32(3));
+      for (int k = 0; k < 3; k++) {
+        g[c][k] = Pack(_mm256_i32gather_ps(&table.d[0][k], index, 4));
+      }
+    }
+#else
+    float32 cells[3][8], gradients[8][3][8];
+    for (int k = 0; k < 3; k++) {
+      cell[k].store(cells[k]);
+    }
+    for (int l = 0; l < 8; l++) {
+      int corners[8];
+      hash((int)cells[0][l], (int)cells[1][l], (int)cells[2][l], corners);
+      for (int c = 0; c < 8; c++) {
+        for (int k = 0; k < 3; k++) {
+          gradients[c][k][l] = table.d[corners[c]][k];
+        }
+      }
+    }
+    for (int c = 0; c < 8; c++) {
+      for (int k = 0; k < 3; k++) {
+        g[c][k] = Pack::load(gradients[c][k]);
+      }
+    }
+#endif
+    blend(f[0], f[1], f[2], g).store(out);
+  }
+
+ private:
+  bool in_bake(const Vector3 &coord) const {
+    for (int k = 0; k < 3; k++) {
+      if (coord[k] < bake_lower[k] || coord[k] >= bake_upper[k]) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // At the cell centers, slices of cells in parallel through noise8()
+  void bake(const Vector3i &res) {
+    Array3D<real> volume(res, 0.0_f);
+    Vector3 scale = (bake_upper - bake_lower) / res.cast<real>();
+    ThreadedTaskManager::run(res.x, -1, [&](int i) {
+      std::vector<Vector3> coords(res.z);
+      std::vector<Vector4> values(res.z);
+      for (int j = 0; j < res.y; j++) {
+        for (int k = 0; k < res.z; k++) {
+          coords[k] = bake_lower + (Vector3(i, j, k) + Vector3(0.5_f)) * scale;
+        }
+        sample_batch(coords.data(), res.z, values.data());
+        for (int k = 0; k < res.z; k++) {
+          volume[i][j][k] = values[k].x;
+        }
+      }
+    });
+    baked = std::move(volume);
   }
-  static double noise(double x, double y, double z) {
-    int X = (int)std::floor(x) & 255,  // FIND UNIT CUBE THAT
-        Y = (int)std::floor(y) & 255,  // CONTAINS POINT.
-        Z = (int)std::floor(z) & 255;
-    x -= std::floor(x);  // FIND RELATIVE X,Y,Z
-    y -= std::floor(y);  // OF POINT IN CUBE.
-    z -= std::floor(z);
+
+  // The indices into the tables of the 8 corners of the unit cube at
+  // (X, Y, Z) (hash coordinates of the 8 cube corners), corner c at offsets
+  // (c & 1, (c >> 1) & 1, c >> 2)
+  static void hash(int X, int Y, int Z, int corners[8]) {
+    X &= 255, Y &= 255, Z &= 255;
     const int *const p = get_p();
-    double u = fade(x),  // COMPUTE FADE CURVES
-        v = fade(y),     // FOR EACH OF X,Y,Z.
-        w = fade(z);
-    int A = p[X] + Y, AA = p[A] + Z, AB = p[A + 1] + Z,  // HASH COORDINATES OF
-        B = p[X + 1] + Y, BA = p[B] + Z,
-        BB = p[B + 1] + Z;  // THE 8 CUBE CORNERS,
-
-    return lerp(w, lerp(v, lerp(u, grad(p[AA], x, y, z),         // AND ADD
-                                grad(p[BA], x - 1, y, z)),       // BLENDED
-                        lerp(u, grad(p[AB], x, y - 1, z),        // RESULTS
-                             grad(p[BB], x - 1, y - 1, z))),     // FROM  8
-                lerp(v, lerp(u, grad(p[AA + 1], x, y, z - 1),    // CORNERS
-                             grad(p[BA + 1], x - 1, y, z - 1)),  // OF CUBE
-                     lerp(u, grad(p[AB + 1], x, y - 1, z - 1),
-                          grad(p[BB + 1], x - 1, y - 1, z - 1))));
+    int A = p[X] + Y, AA = p[A] + Z, AB = p[A + 1] + Z, B = p[X + 1] + Y,
+        BA = p[B] + Z, BB = p[B + 1] + Z;
+    const int ret[8] = {AA, BA, AB, BB, AA + 1, BA + 1, AB + 1, BB + 1};
+    std::copy(ret, ret + 8, corners);
+  }
+
+  // The fractions |f| of a point in its unit cube (find unit cube that
+  // contains point, relative x, y, z of point in cube) and the gradients
+  // of its corners
+  static void locate(float32 x,
+                     float32 y,
+                     float32 z,
+                     float32 f[3],
+                     float32 gradients[8][3]) {
+    float32 fx = std::floor(x), fy = std::floor(y), fz = std::floor(z);
+    f[0] = x - fx;
+    f[1] = y - fy;
+    f[2] = z - fz;
+    int corners[8];
+    hash((int)fx, (int)fy, (int)fz, corners);
+    const Gradients &table = get_gradients();
+    for (int c = 0; c < 8; c++) {
+      for (int k = 0; k < 3; k++) {
+        gradients[c][k] = table.d[corners[c]][k];
+      }
+    }
   }
-  static double fade(double t) {
-    return t * t * t * (t * (t * 6 - 15) + 10);
+
+  // And add blended results from 8 corners of cube
+  template <typename S>
+  static S blend(const S &x, const S &y, const S &z, const S g[8][3]) {
+    S one(1.0f);
+    S d[8];
+    for (int c = 0; c < 8; c++) {
+      S dx = c & 1 ? x - one : x, dy = c & 2 ? y - one : y,
+        dz = c & 4 ? z - one : z;
+      d[c] = g[c][0] * dx + g[c][1] * dy + g[c][2] * dz;
+    }
+    S u = fade(x), v = fade(y), w = fade(z);
+    return lerp(w, lerp(v, lerp(u, d[0], d[1]), lerp(u, d[2], d[3])),
+                lerp(v, lerp(u, d[4], d[5]), lerp(u, d[6], d[7])));
   }
-  static double lerp(double t, double a, double b) {
+
+  template <typename S>
+  static S fade(const S &t) {
+    return t * t * t * (t * (t * S(6.0f) - S(15.0f)) + S(10.0f));
+  }
+
+  template <typename S>
+  static S lerp(const S &t, const S &a, const S &b) {
     return a + t * (b - a);
   }
-  static double grad(int hash, double x, double y, double z) {
-    int h = hash & 15;         // CONVERT LO 4 BITS OF HASH CODE
-    double u = h < 8 ? x : y,  // INTO 12 GRADIENT DIRECTIONS.
-        v = h < 4 ? y : h == 12 || h == 14 ? x : z;
-    return ((h & 1) == 0 ? u : -u) + ((h & 2) == 0 ? v : -v);
+
+  struct Gradients {
+    float32 d[512][3];
+  };
+
+  // The gradient of grad(p[i], x, y, z) of the reference implementation:
+  // bits 0 to 3 of the hash pick one of 12 directions (and 4 repeated)
+  static const Gradients &get_gradients() {
+    static const Gradients gradients = []() {
+      const int *const p = get_p();
+      Gradients gradients;
+      for (int i = 0; i < 512; i++) {
+        int h = p[i] & 15;
+        // grad() is u + v, negated by bits 0 and 1
+        int u = h < 8 ? 0 : 1, v = h < 4 ? 1 : h == 12 || h == 14 ? 0 : 2;
+        for (int k = 0; k < 3; k++) {
+          gradients.d[i][k] = 0.0f;
+        }
+        gradients.d[i][u] += (h & 1) == 0 ? 1.0f : -1.0f;
+        gradients.d[i][v] += (h & 2) == 0 ? 1.0f : -1.0f;
+      }
+      return gradients;
+    }();
+    return gradients;
   }
-  static int *get_p() {
-    static int p[512];
-    static int permutation[] = {
+
+  static const int *get_p() {
+    static const int permutation[] = {
         151, 160, 137, 91,  90,  15,  131, 13,  201, 95,  96,  53,  194, 233,
         7,   225, 140, 36,  103, 30,  69,  142, 8,   99,  37,  240, 21,  10,
         23,  190, 6,   148, 247, 120, 234, 75,  0,   26,  197, 62,  94,  252,
@@ -80,11 +265,16 @@ class PerlinNoiseTexture : public Texture {
         184, 84,  204, 176, 115, 121, 50,  45,  127, 4,   150, 254, 138, 236,
         205, 93,  222, 114, 67,  29,  24,  72,  243, 141, 128, 195, 78,  66,
         215, 61,  156, 180};
-    for (int i = 0; i < 256; i++)
-      p[256 + i] = p[i] = permutation[i];
-    return p;
+    // Filled once, not per lookup
+    static const std::vector<int> p = []() {
+      std::vector<int> p(512);
+      for (int i = 0; i < 256; i++)
+        p[256 + i] = p[i] = permutation[i];
+      return p;
+    }();
+    return p.data();
   }
 };
 TC_IMPLEMENTATION(Texture, PerlinNoiseTexture, "perlin");
 
-TC_NAMESPACE_END
\ No newline at end of file
+TC_NAMESPACE_END
@@ -4,17 +4,23 @@
 *******************************************************************************/
 
 #include <taichi/visual/texture.h>
+#include <taichi/system/threading.h>
+#include <taichi/math/fast_math.h>
 
 TC_NAMESPACE_BEGIN
 
 // TODO: generalize
+// The table of the sky takes a few of each per texel; the fast_math
+// approximations are within float32 rounding
 Vector3 exp(Vector3 a) {
-  return Vector3(std::exp(a[0]), std::exp(a[1]), std::exp(a[2]));
+  return Vector3(fast_math::exp(a[0]), fast_math::exp(a[1]),
+                 fast_math::exp(a[2]));
 }
 
+// For nonnegative |a|
 Vector3 pow(Vector3 a, Vector3 b) {
-  return Vector3(std::pow(a[0], b[0]), std::pow(a[1], b[1]),
-                 std::pow(a[2], b[2]));
+  return Vector3(fast_math::pow(a[0], b[0]), fast_math::pow(a[1], b[1]),
+                 fast_math::pow(a[2], b[2]));
 }
 
 Vector3 lerp(Vector3 a, Vector3 b, Vector3 x) {
@@ -42,9 +48,15 @@ real smoothstep(real edge0, real edge1, real x) {
   return t * t * (3.0f - 2.0f * t);
 }
 
+// The sky is tabulated in lat-long at |resolution| when initialized, and
+// sample() interpolates the table. Only the sun disk, too small for the
+// table, is evaluated analytically. A resolution of 0 disables the table.
 class SkyTexture final : public Texture {
  private:
   Vector4 val;
+  Vector2i resolution;
+  // Sky radiance without the sun disk
+  Array2D<Vector3> table;
 
   // Variables
   real luminance;
@@ -84,9 +96,9 @@ class SkyTexture final : public Texture {
     return EE *
            std::max(
                0.0_f,
-               1.0_f - std::pow(e,
-                                -((cutoffAngle - std::acos(zenithAngleCos)) /
-                                  steepness)));
+               1.0_f - fast_math::exp(
+                           -((cutoffAngle - fast_math::acos(zenithAngleCos)) /
+                             steepness)));
   }
 
   static Vector3 totalMie(real T) {
@@ -118,7 +130,8 @@ class SkyTexture final : public Texture {
 
   static real hgPhase(real cosTheta, real g) {
     real g2 = std::pow(g, 2.0f);
-    real inverse = 1.0_f / pow(1.0_f - 2.0_f * g * cosTheta + g2, 1.5_f);
+    real inverse =
+        1.0_f / fast_math::pow(1.0_f - 2.0_f * g * cosTheta + g2, 1.5_f);
     return ONE_OVER_FOURPI * ((1.0_f - g2) * inverse);
   }
 
@@ -135,9 +148,46 @@ class SkyTexture final : public Texture {
     real phi = (config.get("height", 0.0_f) - 0.5_f) * pi;
     sun_position =
         Vector3(cos(theta) * cos(phi), sin(phi), sin(theta) * cos(phi));
+    resolution = config.get("resolution", Vector2i(1024, 512));
+    // Sun parameters only change here, so this is the only rebuild
+    if (resolution[0] > 0 && resolution[1] > 0) {
+      build_table();
+    } else {
+      table = Array2D<Vector3>();
+    }
   }
 
   virtual Vector4 sample(const Vector3 &coord) const override {
+    if (table.get_width() == 0) {
+      return Vector4(evaluate(coord, true), 1.0_f);
+    }
+    real theta_d = coord.x * 2 * pi, phi_d = (coord.y - 0.5f) * pi;
+    Vector3 dir = Vector3(cos(theta_d) * cos(phi_d), sin(phi_d),
+                          sin(theta_d) * cos(phi_d));
+    if (dot(normalize(dir - cameraPos), normalized(sun_position)) >
+        sunAngularDiameterCos) {
+      return Vector4(evaluate(coord, true), 1.0_f);
+    }
+    Vector2 uv(coord.x - std::floor(coord.x), coord.y);
+    return Vector4(table.sample_relative_coord(uv), 1.0_f);
+  }
+
+ private:
+  void build_table() {
+    table = Array2D<Vector3>(resolution);
+    Vector2 inv_res(1.0_f / resolution[0], 1.0_f / resolution[1]);
+    ThreadedTaskManager::run(
+        [&](int j) {
+          for (int i = 0; i < resolution[0]; i++) {
+            // Texel centers, where sample_relative_coord hits texels exactly
+            Vector2 uv = Vector2(i + 0.5_f, j + 0.5_f) * inv_res;
+            table[i][j] = evaluate(Vector3(uv, 0.0_f), false);
+          }
+        },
+        0, resolution[1], -1);
+  }
+
+  Vector3 evaluate(const Vector3 &coord, bool sun_disk) const {
     // TODO: what is position?
     Vector3 vWorldPosition;
     Vector3 vSunDirection;
@@ -157,8 +207,9 @@ class SkyTexture final : public Texture {
 
     vSunE = sunIntensity(dot(vSunDirection, up));
 
-    vSunfade = 1.0_f - clamp(1.0_f - std::exp((sun_position.y / 450000.0_f)),
-                             0.0_f, 1.0_f);
+    vSunfade =
+        1.0_f - clamp(1.0_f - fast_math::exp(sun_position.y / 450000.0_f),
+                      0.0_f, 1.0_f);
 
     real rayleighCoefficient = rayleigh - (1.0_f * (1.0_f - vSunfade));
 
@@ -168,12 +219,13 @@ class SkyTexture final : public Texture {
 
     // mie coefficients
     vBetaM = totalMie(turbidity) * mie_coefficient;
-    real zenithAngle = std::acos(
+    real zenithAngle = fast_math::acos(
         std::max(0.0_f, dot(up, normalize(vWorldPosition - cameraPos))));
     real inverse =
         1.0_f /
         (std::cos(zenithAngle) +
-         0.15f * std::pow(93.885f - ((zenithAngle * 180.0_f) / pi), -1.253f));
+         0.15f * fast_math::pow(93.885f - ((zenithAngle * 180.0_f) / pi),
+                                -1.253f));
     real sR = rayleighZenithLength * inverse;
     real sM = mieZenithLength * inverse;
 
@@ -214,7 +266,9 @@ class SkyTexture final : public Texture {
     // composition + solar disc
     real sundisk = smoothstep(sunAngularDiameterCos,
                               sunAngularDiameterCos + 0.00002f, cosTheta);
-    L0 += (vSunE * 19000.0_f * Fex) * sundisk;
+    if (sun_disk) {
+      L0 += (vSunE * 19000.0_f * Fex) * sundisk;
+    }
 
     Vector3 texColor = (Lin + L0) * 0.04_f + Vector3(0.0_f, 0.0003f, 0.00075f);
 
@@ -224,7 +278,7 @@ class SkyTexture final : public Texture {
 
     // Vector3 retColor = pow( color, Vector3( 1.0 / ( 1.2 + ( 1.2 * vSunfade )
     // ) ) );
-    return Vector4(texColor, 1.0_f);
+    return texColor;
   }
 };
 
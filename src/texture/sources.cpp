@@ -4,12 +4,17 @@
 *******************************************************************************/
 
 #include <taichi/visual/texture.h>
-#include <taichi/visual/scene_geometry.h>
+#include <taichi/visual/texture_pyramid.h>
+#include <taichi/visual/texture_cache.h>
+#include <taichi/visual/texture_compiler.h>
+#include <taichi/visual/scene.h>
+#include <taichi/visual/voxelizer.h>
 #include <taichi/visualization/image_buffer.h>
 #include <taichi/math/array_3d.h>
 #include <taichi/math/levelset.h>
 #include <taichi/math/math.h>
 #include <taichi/common/asset_manager.h>
+#include <taichi/io/io.h>
 #include <taichi/geometry/mesh.h>
 
 TC_NAMESPACE_BEGIN
@@ -27,6 +32,10 @@ class ConstantTexture final : public Texture {
   virtual Vector4 sample(const Vector3 &coord) const override {
     return val;
   }
+
+  int compile(TextureCompiler &compiler, int coord) const override {
+    return compiler.emit_constant(val);
+  }
 };
 
 TC_IMPLEMENTATION(Texture, ConstantTexture, "const");
@@ -48,14 +57,57 @@ class Array3DTexture : public Texture {
 
 TC_IMPLEMENTATION(Texture, Array3DTexture, "array3d");
 
+// With "out_of_core", the pyramid is kept on disk next to the image (as
+// filename + ".tct", rewritten when the image changes) and its tiles are
+// read through the TextureCache, shared by all textures within
+// "cache_budget" MB.
 class ImageTexture : public Texture {
  protected:
-  Array2D<Vector4> image;
+  bool out_of_core;
+  TexturePyramid pyramid;
+  TiledTexturePyramid tiled;
 
  public:
   void initialize(const Config &config) override {
     Texture::initialize(config);
-    image.load_image(config.get<std::string>("filename"));
+    std::string fn = config.get<std::string>("filename");
+    // "float16", "bfloat16" or, for LDR images, "srgb8" to save memory
+    StorageFormat format = get_storage_format(config.get("storage", "full"));
+    out_of_core = config.get("out_of_core", false);
+    if (!out_of_core) {
+      Array2D<Vector4> image;
+      image.load_image(fn);
+      pyramid.initialize(image, format);
+      return;
+    }
+    if (config.has_key("cache_budget")) {
+      TextureCache::get_instance().set_budget(
+          (std::size_t)(config.get<real>("cache_budget") * 1024 * 1024));
+    }
+    uint64 stamp = get_file_stamp(fn);
+    TC_ERROR_IF(stamp == 0, "Cannot read image [{}]", fn);
+    std::string tiled_fn = fn + ".tct";
+    if (!tiled.open(tiled_fn) || tiled.get_source_stamp() != stamp ||
+        tiled.get_format() != format) {
+      Array2D<Vector4> image;
+      image.load_image(fn);
+      TiledTexturePyramid::write(tiled_fn, TexturePyramid(image, format),
+                                 stamp);
+      TC_ERROR_IF(!tiled.open(tiled_fn), "Cannot read [{}]", tiled_fn);
+    }
+  }
+
+  // Out-of-core tiles are accounted for by the TextureCache
+  std::size_t get_memory_usage() const override {
+    return out_of_core ? 0 : pyramid.get_memory_usage();
+  }
+
+  // Filtered over texels |width| wide
+  Vector4 sample_pyramid(const Vector2 &coord, real width) const {
+    if (out_of_core) {
+      return tiled.sample(coord, tiled.get_lod(width));
+    }
+    return pyramid.sample(coord, pyramid.get_lod(width));
   }
 
   bool inside(const Vector3 &coord) const {
@@ -66,7 +118,15 @@ class ImageTexture : public Texture {
   virtual Vector4 sample(const Vector3 &coord_) const override {
     Vector2 coord(coord_.x - floor(coord_.x), coord_.y - floor(coord_.y));
     if (inside(coord_))
-      return image.sample_relative_coord(coord);
+      return sample_pyramid(coord, 0);
+    else
+      return Vector4(0);
+  }
+
+  Vector4 sample_filtered(const Vector2 &coord_, real width) const override {
+    Vector2 coord(coord_.x - floor(coord_.x), coord_.y - floor(coord_.y));
+    if (inside(Vector3(coord_.x, coord_.y, 0.5f)))
+      return sample_pyramid(coord, width);
     else
       return Vector4(0);
   }
@@ -328,6 +388,27 @@ class SlicedTexture : public Texture {
 
 TC_IMPLEMENTATION(Texture, SlicedTexture, "sliced");
 
+// Triangles of |mesh| under |transform|. Only the vertices are transformed
+// (exactly, so that shared vertices stay bitwise equal for the voxelizer).
+static std::vector<Triangle> get_transformed_triangles(
+    const Mesh &mesh,
+    const Matrix4 &transform) {
+  std::vector<Triangle> triangles = mesh.untransformed_triangles;
+  for (auto &t : triangles) {
+    for (int k = 0; k < 3; k++) {
+      t.v[k] = multiply_matrix4(transform, t.v[k], 1.0_f);
+    }
+  }
+  return triangles;
+}
+
+static Matrix4 get_mesh_transform(const Config &config,
+                                  const Vector3 &translate) {
+  Matrix4 trans(1);
+  trans = matrix4_scale(&trans, config.get("scale", Vector3(1)));
+  return matrix4_translate(&trans, translate);
+}
+
 class FastMeshTexture : public Texture {
  protected:
   Array3D<real> arr;
@@ -339,24 +420,11 @@ class FastMeshTexture : public Texture {
     Texture::initialize(config);
     Mesh mesh;
     mesh.initialize(config);
-    Scene scene;
-    Vector3 scale = config.get("scale", Vector3(1));
     Vector3 translate = config.get("translate", Vector3(0));
     bool adaptive = config.get("adaptive", true);
-    auto mesh_p = std::make_shared<Mesh>(mesh);
-    Matrix4 trans(1);
-    trans = matrix4_scale(&trans, scale);
-    trans = matrix4_translate(&trans, translate);
-    mesh_p->transform = trans;
-    scene.add_mesh(mesh_p);
-    scene.finalize_geometry();
-    auto ray_intersection = create_instance<RayIntersection>("embree");
-    std::shared_ptr<SceneGeometry> scene_geometry(
-        new SceneGeometry(std::make_shared<Scene>(scene), ray_intersection));
     BoundingBox bb = mesh.get_bounding_box();
     // calc offset and delta_x to keep the mesh in the center of texture
     resolution = config.get<Vector3i>("resolution");
-    arr = Array3D<real>(resolution);
     real delta_x = 0;
     Vector3i offset;
     for (int i = 0; i < 3; ++i)
@@ -372,34 +440,12 @@ class FastMeshTexture : public Texture {
       delta_x = 1.0_f / resolution[0];
       bb.lower_boundary = Vector3(0);
     }
-    // cast ray for each i, j
-    for (int i = 0; i < resolution.x; ++i) {
-      for (int j = 0; j < resolution.y; ++j) {
-        real x = (i - offset.x) * delta_x + bb.lower_boundary.x;
-        real y = (j - offset.y) * delta_x + bb.lower_boundary.y;
-        real z = (0 - offset.z) * delta_x + bb.lower_boundary.z;
-        real base_z = z - eps;
-        int k = 0;
-        bool inside = false;
-        while (k < resolution.z) {
-          int next_k;
-          Ray ray(Vector3(x, y, z), Vector3(0, 0, 1));
-          scene_geometry->query(ray);
-          if (ray.dist == Ray::DIST_INFINITE) {
-            next_k = resolution.z;
-            inside = false;
-          } else {
-            z += ray.dist;
-            next_k = std::min(int((z - base_z) / delta_x), resolution.z);
-          }
-          while (k < next_k) {
-            arr.set(i, j, k, inside ? 1.0_f : 0.0_f);
-            ++k;
-          }
-          inside = !inside;
-        }
-      }
-    }
+    Voxelizer voxelizer(resolution,
+                        bb.lower_boundary - offset.cast<real>() * delta_x,
+                        delta_x, config.get("num_threads", -1));
+    arr = voxelizer.voxelize(
+        get_transformed_triangles(mesh, get_mesh_transform(config, translate)),
+        config.get("conservative", false));
   }
 
   bool inside(const Vector3 &coord) const {
@@ -417,64 +463,57 @@ class FastMeshTexture : public Texture {
 
 TC_IMPLEMENTATION(Texture, FastMeshTexture, "fast_mesh")
 
+// Inside/outside test of a closed mesh, voxelized over its bounding box with
+// |resolution| voxels along the longest side
 class MeshTexture : public Texture {
  protected:
-  std::shared_ptr<SceneGeometry> scene_geometry;
-  int mesh_accuracy = 3;
+  Array3D<real> arr;
+  Vector3 origin;
+  real dx;
 
  public:
   // parameter name for mesh path is 'filename'
   void initialize(const Config &config) override {
     Texture::initialize(config);
-    mesh_accuracy = config.get("mesh_accuracy", mesh_accuracy);
     Mesh mesh;
     mesh.initialize(config);
-    Scene scene;
     Vector3 scale = config.get("scale", Vector3(1));
     Vector3 translate = config.get("translate", Vector3(0));
-    auto mesh_p = std::make_shared<Mesh>(mesh);
-    Matrix4 trans(1);
-    trans = matrix4_scale(&trans, scale);
     if (config.get("adaptive", true)) {
       BoundingBox bb = mesh.get_bounding_box();
       translate -= (bb.lower_boundary + bb.upper_boundary) / 2.0_f * scale;
     }
-    trans = matrix4_translate(&trans, translate);
-    mesh_p->transform = trans;
-    scene.add_mesh(mesh_p);
-    scene.finalize_geometry();
-    auto ray_intersection = create_instance<RayIntersection>("embree");
-    scene_geometry = std::make_shared<SceneGeometry>(
-        std::make_shared<Scene>(scene), ray_intersection);
+    auto triangles =
+        get_transformed_triangles(mesh, get_mesh_transform(config, translate));
+    TC_ASSERT_INFO(!triangles.empty(), "Mesh texture needs a non-empty mesh");
+    Vector3 lower = triangles[0].v[0], upper = lower;
+    for (auto &t : triangles) {
+      for (int k = 0; k < 3; k++) {
+        lower = min(lower, t.v[k]);
+        upper = max(upper, t.v[k]);
+      }
+    }
+    int resolution = config.get("resolution", 128);
+    dx = std::max((upper - lower).max(), eps) / resolution;
+    Vector3i res;
+    for (int k = 0; k < 3; k++) {
+      res[k] = (int)std::ceil((upper[k] - lower[k]) / dx) + 1;
+    }
+    origin = lower;
+    arr = Voxelizer(res, origin, dx, config.get("num_threads", -1))
+              .voxelize(triangles);
   }
 
   virtual Vector4 sample(const Vector3 &coord) const override {
-    auto emitting_ray_test = [&]() {
-      int inside = 0;
-      real alpha = rand() * 2.0_f * pi;
-      real beta = rand() * 2.0_f * pi;
-      Vector3 direction(
-          Vector3(cos(alpha) * cos(beta), cos(alpha) * sin(beta), sin(alpha)));
-      Vector3 position = coord;
-      while (true) {
-        Ray ray(position, direction);
-        scene_geometry->query(ray);
-        if (ray.dist == Ray::DIST_INFINITE) {
-          break;
-        } else {
-          position += ray.dist * direction;
-          inside = 1 - inside;
-        }
+    Vector3i res = arr.get_res();
+    Vector3i p;
+    for (int k = 0; k < 3; k++) {
+      p[k] = (int)std::floor((coord[k] - origin[k]) / dx + 0.5_f);
+      if (p[k] < 0 || p[k] >= res[k]) {
+        return Vector4(0.0_f);
       }
-      return inside;
-    };
-    int test_count[2];
-    test_count[0] = test_count[1] = 0;
-    for (int i = 0; i < mesh_accuracy; ++i) {
-      int test_result = emitting_ray_test();
-      test_count[test_result]++;
     }
-    return Vector4(test_count[1] > test_count[0] ? 1.0_f : 0.0_f);
+    return Vector4(arr[p.x][p.y][p.z]);
   }
 };
 
@@ -486,10 +525,29 @@ class LevelSet3DTexture : public Texture {
   Vector2 bounds;
 
  public:
+  // Either a registered |levelset|, or the signed distance of the mesh
+  // 'filename' (with 'scale' and 'translate') in the unit cube, computed in
+  // a narrow band of |band| voxels at |resolution|^3 voxels
   void initialize(const Config &config) override {
     Texture::initialize(config);
-    levelset = AssetManager::get_asset<LevelSet3D>(config.get<int>("levelset"));
     bounds = config.get<Vector2>("bounds");
+    if (config.has_key("levelset")) {
+      levelset =
+          AssetManager::get_asset<LevelSet3D>(config.get<int>("levelset"));
+      return;
+    }
+    Mesh mesh;
+    mesh.initialize(config);
+    int resolution = config.get("resolution", 128);
+    real dx = 1.0_f / resolution;
+    Voxelizer voxelizer(Vector3i(resolution), Vector3(0.5_f * dx), dx,
+                        config.get("num_threads", -1));
+    levelset = std::make_shared<LevelSet3D>(Vector3i(resolution));
+    static_cast<Array3D<real> &>(*levelset) = voxelizer.signed_distance(
+        get_transformed_triangles(
+            mesh,
+            get_mesh_transform(config, config.get("translate", Vector3(0)))),
+        config.get("band", 3.0_f));
   }
 
   virtual Vector4 sample(const Vector3 &coord) const override {
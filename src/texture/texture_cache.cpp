@@ -0,0 +1,230 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#if defined(__GNUC__)
+// The 64-bit variants of fseeko and ftello, for files over 2 GB
+#ifndef _FILE_OFFSET_BITS
+#define _FILE_OFFSET_BITS 64
+#endif
+#endif
+
+#include <taichi/visual/texture_cache.h>
+#include <taichi/system/statistics.h>
+
+TC_NAMESPACE_BEGIN
+
+constexpr uint32 tiled_texture_magic = 0x54544354;  // "TCTT"
+constexpr uint32 tiled_texture_version = 1;
+
+static void seek_file(std::FILE *f, int64 offset) {
+#if defined(_MSC_VER)
+  int status = _fseeki64(f, offset, SEEK_SET);
+#else
+  int status = fseeko(f, (off_t)offset, SEEK_SET);
+#endif
+  TC_ERROR_IF(status != 0, "Cannot seek to {} of a tiled texture", offset);
+}
+
+template <typename T>
+static void write_value(std::FILE *f, const T &val) {
+  TC_ERROR_IF(std::fwrite(&val, sizeof(T), 1, f) != 1,
+              "Cannot write to a tiled texture");
+}
+
+template <typename T>
+static bool read_value(std::FILE *f, T &val) {
+  return std::fread(&val, sizeof(T), 1, f) == 1;
+}
+
+// The last tiles fetched by this thread, by key & (micro_cache_size - 1)
+struct MicroCache {
+  uint64 keys[TextureCache::micro_cache_size];
+  std::shared_ptr<const TextureCache::Tile>
+      tiles[TextureCache::micro_cache_size];
+
+  MicroCache() {
+    for (auto &key : keys) {
+      key = ~0ull;
+    }
+  }
+};
+
+static thread_local MicroCache micro_cache;
+
+TextureCache &TextureCache::get_instance() {
+  static TextureCache cache;
+  return cache;
+}
+
+TextureCache::~TextureCache() {
+  for (auto &file : files) {
+    std::fclose(file->f);
+  }
+}
+
+void TextureCache::set_budget(std::size_t budget) {
+  std::lock_guard<std::mutex> _(mutex);
+  this->budget = budget;
+  evict();
+}
+
+std::size_t TextureCache::get_memory_usage() {
+  std::lock_guard<std::mutex> _(mutex);
+  return memory_usage;
+}
+
+int TextureCache::open(const std::string &fn,
+                       int64 data_offset,
+                       int tile_bytes) {
+  std::unique_ptr<File> file = std::make_unique<File>();
+  file->fn = fn;
+  file->f = std::fopen(fn.c_str(), "rb");
+  TC_ERROR_IF(file->f == nullptr, "Cannot open tiled texture [{}]", fn);
+  file->data_offset = data_offset;
+  file->tile_bytes = tile_bytes;
+  std::lock_guard<std::mutex> _(mutex);
+  files.push_back(std::move(file));
+  return (int)files.size() - 1;
+}
+
+const TextureCache::Tile *TextureCache::get_tile(int file, int tile) {
+  uint64 key = (uint64)file << 32 | (uint32)tile;
+  int slot = (int)((key ^ (key >> 32) * 7) & (micro_cache_size - 1));
+  if (micro_cache.keys[slot] != key) {
+    micro_cache.tiles[slot] = load_tile(file, tile);
+    micro_cache.keys[slot] = key;
+  }
+  return micro_cache.tiles[slot].get();
+}
+
+std::shared_ptr<const TextureCache::Tile> TextureCache::load_tile(int file,
+                                                                  int tile) {
+  uint64 key = (uint64)file << 32 | (uint32)tile;
+  File *f;
+  {
+    std::lock_guard<std::mutex> _(mutex);
+    auto it = entries.find(key);
+    if (it != entries.end()) {
+      lru.splice(lru.begin(), lru, it->second.position);
+      return it->second.tile;
+    }
+    f = files[file].get();
+  }
+  // Read without holding the cache, so that other threads keep sampling
+  // cached tiles meanwhile
+  auto loaded = std::make_shared<Tile>(f->tile_bytes);
+  {
+    std::lock_guard<std::mutex> _(f->mutex);
+    seek_file(f->f, f->data_offset + (int64)tile * f->tile_bytes);
+    TC_ERROR_IF(std::fread(loaded->data(), 1, loaded->size(), f->f) !=
+                    loaded->size(),
+                "Truncated tiled texture [{}]", f->fn);
+  }
+  TC_STAT("texture_tile_loads", 1);
+  std::lock_guard<std::mutex> _(mutex);
+  auto it = entries.find(key);
+  if (it != entries.end()) {
+    // Loaded by another thread meanwhile
+    return it->second.tile;
+  }
+  lru.push_front(key);
+  entries[key] = Entry{loaded, lru.begin()};
+  memory_usage += loaded->size();
+  evict();
+  return loaded;
+}
+
+void TextureCache::evict() {
+  // Always keeps the most recent tile
+  while (memory_usage > budget && lru.size() > 1) {
+    auto it = entries.find(lru.back());
+    memory_usage -= it->second.tile->size();
+    entries.erase(it);
+    lru.pop_back();
+  }
+}
+
+bool TiledTexturePyramid::open(const std::string &fn) {
+  std::FILE *f = std::fopen(fn.c_str(), "rb");
+  if (f == nullptr) {
+    return false;
+  }
+  uint32 magic = 0, version = 0;
+  int32 format_id = 0, num_levels = 0, file_tile_size = 0;
+  bool valid = read_value(f, magic) && magic == tiled_texture_magic &&
+               read_value(f, version) && version == tiled_texture_version &&
+               read_value(f, source_stamp) && read_value(f, file_tile_size) &&
+               file_tile_size == tile_size && read_value(f, format_id) &&
+               read_value(f, num_levels) && num_levels > 0;
+  levels.clear();
+  int num_tiles = 0;
+  for (int l = 0; valid && l < num_levels; l++) {
+    Level level;
+    int32 res[2];
+    valid = read_value(f, res) && res[0] > 0 && res[1] > 0;
+    level.res = Vector2i(res[0], res[1]);
+    level.tiles_x = (res[0] + tile_size - 1) / tile_size;
+    level.first_tile = num_tiles;
+    num_tiles += level.tiles_x * ((res[1] + tile_size - 1) / tile_size);
+    levels.push_back(level);
+  }
+  int64 data_offset = (int64)std::ftell(f);
+  std::fclose(f);
+  if (!valid) {
+    levels.clear();
+    return false;
+  }
+  format = (StorageFormat)format_id;
+  texel_bytes = get_texel_bytes(format);
+  file = TextureCache::get_instance().open(
+      fn, data_offset, tile_size * tile_size * texel_bytes);
+  return true;
+}
+
+void TiledTexturePyramid::write(const std::string &fn,
+                                const TexturePyramid &pyramid,
+                                uint64 source_stamp) {
+  std::FILE *f = std::fopen(fn.c_str(), "wb");
+  TC_ERROR_IF(f == nullptr,
+              "Cannot open file [{}] for writing. (Does the directory exist?)",
+              fn);
+  StorageFormat format = pyramid.get_format();
+  int texel_bytes = get_texel_bytes(format);
+  write_value(f, tiled_texture_magic);
+  write_value(f, tiled_texture_version);
+  write_value(f, source_stamp);
+  write_value(f, (int32)tile_size);
+  write_value(f, (int32)format);
+  write_value(f, (int32)pyramid.get_num_levels());
+  for (int l = 0; l < pyramid.get_num_levels(); l++) {
+    Vector2i res = pyramid.get_res(l);
+    int32 r[2] = {res[0], res[1]};
+    write_value(f, r);
+  }
+  // Texels past the edges of a level are never read, and left zero
+  std::vector<uint8> tile(tile_size * tile_size * texel_bytes);
+  for (int l = 0; l < pyramid.get_num_levels(); l++) {
+    Vector2i res = pyramid.get_res(l);
+    for (int tj = 0; tj * tile_size < res[1]; tj++) {
+      for (int ti = 0; ti * tile_size < res[0]; ti++) {
+        std::fill(tile.begin(), tile.end(), 0);
+        for (int j = tj * tile_size; j < std::min(res[1], (tj + 1) * tile_size);
+             j++) {
+          for (int i = ti * tile_size;
+               i < std::min(res[0], (ti + 1) * tile_size); i++) {
+            int t = (j % tile_size) * tile_size + i % tile_size;
+            encode_texel(pyramid.get_texel(l, i, j), format,
+                         &tile[t * texel_bytes]);
+          }
+        }
+        TC_ERROR_IF(std::fwrite(tile.data(), 1, tile.size(), f) != tile.size(),
+                    "Cannot write to a tiled texture");
+      }
+    }
+  }
+  std::fclose(f);
+}
+
+TC_NAMESPACE_END
@@ -0,0 +1,351 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#include <taichi/visual/texture_compiler.h>
+#include <taichi/common/asset_manager.h>
+
+TC_NAMESPACE_BEGIN
+
+int Texture::compile(TextureCompiler &compiler, int coord) const {
+  return compiler.emit_sample(*this, coord);
+}
+
+// As LinearOpTexture
+static Vector4 linear_combination(real alpha,
+                                  const Vector4 &a,
+                                  real beta,
+                                  const Vector4 &b,
+                                  bool need_clamp) {
+  Vector4 p = alpha * a + beta * b;
+  if (need_clamp) {
+    for (int i = 0; i < 3; i++) {
+      p[i] = clamp(p[i], 0.0_f, 1.0_f);
+    }
+  }
+  return p;
+}
+
+// The value of a non-sample instruction
+static Vector4 evaluate(const TextureProgram::Instruction &inst,
+                        const Vector4 &a,
+                        const Vector4 &b) {
+  using Op = TextureProgram::Op;
+  Vector4 dst;
+  switch (inst.op) {
+    case Op::constant:
+      dst = inst.value;
+      break;
+    case Op::affine:
+      dst = Vector4(inst.m * Vector3(a.x, a.y, a.z) + inst.t, 0.0_f);
+      break;
+    case Op::fract:
+      dst = fract(a);
+      break;
+    case Op::repeat:
+      for (int i = 0; i < 3; i++) {
+        dst[i] = (a[i] - floor(a[i] * inst.t[i]) * inst.value[i]) * inst.t[i];
+      }
+      dst[3] = 0.0_f;
+      break;
+    case Op::mul:
+      dst = a * b;
+      break;
+    case Op::linear:
+      dst = linear_combination(inst.alpha, a, inst.beta, b, inst.clamp);
+      break;
+    case Op::bound:
+      dst = inst.alpha <= a[inst.axis] && a[inst.axis] < inst.beta
+                ? b
+                : inst.value;
+      break;
+    case Op::sample:
+      TC_ERROR("Sample instructions are run by their texture");
+  }
+  return dst;
+}
+
+Vector4 TextureProgram::run(const Vector3 &coord) const {
+  constexpr int stack_registers = 32;
+  Vector4 stack[stack_registers];
+  // Large programs only; sample instructions may run programs recursively
+  std::vector<Vector4> heap;
+  Vector4 *regs = stack;
+  if (num_registers > stack_registers) {
+    heap.resize(num_registers);
+    regs = heap.data();
+  }
+  regs[0] = Vector4(coord, 0.0_f);
+  for (auto &inst : instructions) {
+    const Vector4 &a = regs[inst.a];
+    if (inst.op == Op::sample) {
+      regs[inst.dst] = inst.texture->sample(Vector3(a.x, a.y, a.z));
+    } else {
+      regs[inst.dst] = evaluate(inst, a, regs[inst.b]);
+    }
+  }
+  return regs[result];
+}
+
+void TextureProgram::run_batch(const Vector3 *coords,
+                               int n,
+                               Vector4 *out) const {
+  // Register k of point i of a chunk at regs[k * chunk_size + i]
+  constexpr int chunk_size = 64;
+  std::vector<Vector4> regs(num_registers * chunk_size);
+  std::vector<Vector3> points(chunk_size);
+  for (int begin = 0; begin < n; begin += chunk_size) {
+    int m = std::min(chunk_size, n - begin);
+    for (int i = 0; i < m; i++) {
+      regs[i] = Vector4(coords[begin + i], 0.0_f);
+    }
+    for (auto &inst : instructions) {
+      Vector4 *dst = &regs[inst.dst * chunk_size];
+      const Vector4 *a = &regs[inst.a * chunk_size];
+      const Vector4 *b = &regs[inst.b * chunk_size];
+      if (inst.op == Op::sample) {
+        for (int i = 0; i < m; i++) {
+          points[i] = Vector3(a[i].x, a[i].y, a[i].z);
+        }
+        inst.texture->sample_batch(points.data(), m, dst);
+      } else {
+        for (int i = 0; i < m; i++) {
+          dst[i] = evaluate(inst, a[i], b[i]);
+        }
+      }
+    }
+    for (int i = 0; i < m; i++) {
+      out[begin + i] = regs[result * chunk_size + i];
+    }
+  }
+}
+
+TextureCompiler::TextureCompiler() {
+  coords.push_back(Coord{0, Matrix3(1.0_f), Vector3(0.0_f)});
+}
+
+int TextureCompiler::add_coord(int reg, const Matrix3 &m, const Vector3 &t) {
+  for (int i = 0; i < (int)coords.size(); i++) {
+    const Coord &c = coords[i];
+    bool same = c.reg == reg && c.t == t;
+    for (int k = 0; k < 3; k++) {
+      same = same && c.m[k] == m[k];
+    }
+    if (same) {
+      return i;
+    }
+  }
+  coords.push_back(Coord{reg, m, t});
+  return (int)coords.size() - 1;
+}
+
+int TextureCompiler::transform(int coord,
+                               const std::function<Vector3(Vector3)> &f) {
+  Vector3 t = f(Vector3(0.0_f));
+  Matrix3 m(f(Vector3(1, 0, 0)) - t, f(Vector3(0, 1, 0)) - t,
+            f(Vector3(0, 0, 1)) - t);
+  Coord c = coords[coord];
+  // f(c.m * x + c.t) = (m * c.m) * x + (m * c.t + t)
+  return add_coord(c.reg, m * c.m, m * c.t + t);
+}
+
+int TextureCompiler::compile(const Texture &texture, int coord) {
+  auto key = std::make_pair(&texture, coord);
+  auto it = compiled.find(key);
+  if (it != compiled.end()) {
+    return it->second;
+  }
+  int reg = texture.compile(*this, coord);
+  compiled[key] = reg;
+  return reg;
+}
+
+int TextureCompiler::coord_from_register(int reg) {
+  return add_coord(reg, Matrix3(1.0_f), Vector3(0.0_f));
+}
+
+int TextureCompiler::materialize(int coord) {
+  Coord c = coords[coord];
+  if (coord_from_register(c.reg) == coord) {
+    return c.reg;
+  }
+  auto it = materialized.find(coord);
+  if (it != materialized.end()) {
+    return it->second;
+  }
+  auto inst = instruction(TextureProgram::Op::affine);
+  inst.a = c.reg;
+  inst.m = c.m;
+  inst.t = c.t;
+  int reg = emit(inst);
+  materialized[coord] = reg;
+  return reg;
+}
+
+int TextureCompiler::emit_constant(const Vector4 &value) {
+  for (auto &c : constants) {
+    if (c.second == value) {
+      return c.first;
+    }
+  }
+  auto inst = instruction(TextureProgram::Op::constant);
+  inst.value = value;
+  int reg = emit(inst);
+  constants[reg] = value;
+  return reg;
+}
+
+int TextureCompiler::emit_fract(int reg) {
+  if (is_constant(reg)) {
+    return emit_constant(fract(constants[reg]));
+  }
+  auto inst = instruction(TextureProgram::Op::fract);
+  inst.a = reg;
+  return emit(inst);
+}
+
+int TextureCompiler::emit_repeat(int coord, const Vector3 &repeat) {
+  auto inst = instruction(TextureProgram::Op::repeat);
+  inst.a = materialize(coord);
+  inst.t = repeat;
+  inst.value = Vector4(1.0_f / repeat.x, 1.0_f / repeat.y, 1.0_f / repeat.z,
+                       0.0_f);
+  return coord_from_register(emit(inst));
+}
+
+int TextureCompiler::emit_mul(int a, int b) {
+  if (is_constant(a) && is_constant(b)) {
+    return emit_constant(constants[a] * constants[b]);
+  }
+  auto inst = instruction(TextureProgram::Op::mul);
+  inst.a = a;
+  inst.b = b;
+  return emit(inst);
+}
+
+int TextureCompiler::emit_linear(real alpha,
+                                 int a,
+                                 real beta,
+                                 int b,
+                                 bool clamp) {
+  auto inst = instruction(TextureProgram::Op::linear);
+  inst.a = a;
+  inst.b = b;
+  inst.alpha = alpha;
+  inst.beta = beta;
+  inst.clamp = clamp;
+  if (is_constant(a) && is_constant(b)) {
+    return emit_constant(
+        linear_combination(alpha, constants[a], beta, constants[b], clamp));
+  }
+  return emit(inst);
+}
+
+int TextureCompiler::emit_bound(int coord,
+                                int axis,
+                                const Vector2 &bounds,
+                                int value,
+                                const Vector4 &outside) {
+  auto inst = instruction(TextureProgram::Op::bound);
+  inst.a = materialize(coord);
+  inst.b = value;
+  inst.axis = axis;
+  inst.alpha = bounds[0];
+  inst.beta = bounds[1];
+  inst.value = outside;
+  return emit(inst);
+}
+
+int TextureCompiler::emit_sample(const Texture &texture, int coord) {
+  auto inst = instruction(TextureProgram::Op::sample);
+  inst.a = materialize(coord);
+  inst.texture = &texture;
+  return emit(inst);
+}
+
+TextureProgram TextureCompiler::finish(int result) {
+  // Drop the instructions the result does not depend on, e.g. operands of
+  // folded constants
+  std::vector<bool> live(program.num_registers, false);
+  live[result] = true;
+  std::vector<TextureProgram::Instruction> kept;
+  for (int i = (int)program.instructions.size() - 1; i >= 0; i--) {
+    auto &inst = program.instructions[i];
+    if (!live[inst.dst]) {
+      continue;
+    }
+    live[inst.a] = true;
+    if (inst.op == TextureProgram::Op::mul ||
+        inst.op == TextureProgram::Op::linear ||
+        inst.op == TextureProgram::Op::bound) {
+      live[inst.b] = true;
+    }
+    kept.push_back(inst);
+  }
+  TextureProgram ret;
+  ret.instructions.assign(kept.rbegin(), kept.rend());
+  ret.num_registers = program.num_registers;
+  ret.result = result;
+  return ret;
+}
+
+TextureProgram::Instruction TextureCompiler::instruction(
+    TextureProgram::Op op) {
+  TextureProgram::Instruction inst;
+  inst.op = op;
+  inst.dst = inst.a = inst.b = 0;
+  inst.m = Matrix3(1.0_f);
+  inst.t = Vector3(0.0_f);
+  inst.value = Vector4(0.0_f);
+  inst.alpha = inst.beta = 0;
+  inst.axis = 0;
+  inst.clamp = false;
+  inst.texture = nullptr;
+  return inst;
+}
+
+int TextureCompiler::emit(TextureProgram::Instruction inst) {
+  inst.dst = program.num_registers++;
+  program.instructions.push_back(inst);
+  return inst.dst;
+}
+
+bool TextureCompiler::is_constant(int reg) const {
+  return constants.find(reg) != constants.end();
+}
+
+// Runs the flattened program of a texture graph (Texture.compile() in
+// Python). The graph must not change after compilation.
+class CompiledTexture : public Texture {
+ protected:
+  // Keeps the graph alive for sample instructions
+  std::shared_ptr<Texture> tex;
+  TextureProgram program;
+
+ public:
+  void initialize(const Config &config) override {
+    Texture::initialize(config);
+    tex = AssetManager::get_asset<Texture>(config.get<int>("tex"));
+    TextureCompiler compiler;
+    program = compiler.finish(compiler.compile(*tex, compiler.input()));
+  }
+
+  virtual Vector4 sample(const Vector3 &coord) const override {
+    return program.run(coord);
+  }
+
+  void sample_batch(const Vector3 *coords,
+                    int n,
+                    Vector4 *out) const override {
+    program.run_batch(coords, n, out);
+  }
+
+  int compile(TextureCompiler &compiler, int coord) const override {
+    return compiler.compile(*tex, coord);
+  }
+};
+
+TC_IMPLEMENTATION(Texture, CompiledTexture, "compiled");
+
+TC_NAMESPACE_END
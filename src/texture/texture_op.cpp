@@ -4,6 +4,8 @@
 *******************************************************************************/
 
 #include <taichi/visual/texture.h>
+#include <taichi/visual/texture_pyramid.h>
+#include <taichi/visual/texture_compiler.h>
 #include <taichi/common/asset_manager.h>
 
 TC_NAMESPACE_BEGIN
@@ -24,12 +26,25 @@ class ZoomingTexture : public Texture {
     repeat = config.get<bool>("repeat");
   }
 
+  Vector3 zoom(const Vector3 &coord) const {
+    return inv_zoom * (coord - center) + center;
+  }
+
   virtual Vector4 sample(const Vector3 &coord) const override {
-    Vector3 c = inv_zoom * (coord - center) + center;
+    Vector3 c = zoom(coord);
     if (repeat)
       c = fract(c);
     return tex->sample(c);
   }
+
+  int compile(TextureCompiler &compiler, int coord) const override {
+    int c = compiler.transform(coord, [&](Vector3 x) { return zoom(x); });
+    if (repeat) {
+      c = compiler.coord_from_register(
+          compiler.emit_fract(compiler.materialize(c)));
+    }
+    return compiler.compile(*tex, c);
+  }
 };
 
 TC_IMPLEMENTATION(Texture, ZoomingTexture, "zoom");
@@ -59,6 +74,11 @@ class LinearOpTexture : public Texture {
     }
     return p;
   }
+
+  int compile(TextureCompiler &compiler, int coord) const override {
+    return compiler.emit_linear(alpha, compiler.compile(*tex1, coord), beta,
+                                compiler.compile(*tex2, coord), need_clamp);
+  }
 };
 
 TC_IMPLEMENTATION(Texture, LinearOpTexture, "linear_op");
@@ -78,6 +98,11 @@ class MultiplicationTexture : public Texture {
   virtual Vector4 sample(const Vector3 &coord) const override {
     return tex1->sample(coord) * tex2->sample(coord);
   }
+
+  int compile(TextureCompiler &compiler, int coord) const override {
+    return compiler.emit_mul(compiler.compile(*tex1, coord),
+                             compiler.compile(*tex2, coord));
+  }
 };
 
 TC_IMPLEMENTATION(Texture, MultiplicationTexture, "mul");
@@ -95,6 +120,10 @@ class FractTexture : public Texture {
   virtual Vector4 sample(const Vector3 &coord) const override {
     return fract(tex->sample(coord));
   }
+
+  int compile(TextureCompiler &compiler, int coord) const override {
+    return compiler.emit_fract(compiler.compile(*tex, coord));
+  }
 };
 
 TC_IMPLEMENTATION(Texture, FractTexture, "fract");
@@ -123,6 +152,12 @@ class RepeatedTexture : public Texture {
     real w = coord.z - floor(coord.z * repeat_w) * inv_repeat_w;
     return tex->sample(Vector3(u * repeat_u, v * repeat_v, w * repeat_w));
   }
+
+  int compile(TextureCompiler &compiler, int coord) const override {
+    return compiler.compile(
+        *tex,
+        compiler.emit_repeat(coord, Vector3(repeat_u, repeat_v, repeat_w)));
+  }
 };
 
 TC_IMPLEMENTATION(Texture, RepeatedTexture, "repeat");
@@ -141,7 +176,7 @@ class RotatedTexture : public Texture {
     rotate_axis = config.get<int>("rotate_axis");
   }
 
-  virtual Vector4 sample(const Vector3 &coord_) const override {
+  Vector3 rotate(const Vector3 &coord_) const {
     auto coord = coord_;
     coord = coord * 2._f - Vector3(1.f, 1.f, 1.f);
     for (int i = 0; i < rotate_times; i++) {
@@ -157,8 +192,16 @@ class RotatedTexture : public Texture {
           break;
       }
     }
-    coord = (coord + Vector3(1.f, 1.f, 1.f)) * 0.5_f;
-    return tex->sample(coord);
+    return (coord + Vector3(1.f, 1.f, 1.f)) * 0.5_f;
+  }
+
+  virtual Vector4 sample(const Vector3 &coord) const override {
+    return tex->sample(rotate(coord));
+  }
+
+  int compile(TextureCompiler &compiler, int coord) const override {
+    return compiler.compile(
+        *tex, compiler.transform(coord, [&](Vector3 x) { return rotate(x); }));
   }
 };
 
@@ -176,15 +219,23 @@ public:
     angle = config.get<real>("angle");
   }
 
-  virtual Vector4 sample(const Vector3 &coord_) const override {
+  Vector3 rotate(const Vector3 &coord_) const {
     auto coord = coord_;
     coord = coord * 2._f - Vector3(1.f, 1.f, 1.f);
     coord = Vector3(
         cos(angle)*coord.x-sin(angle)*coord.y,
         sin(angle)*coord.x+cos(angle)*coord.y,
         coord.z);
-    coord = (coord + Vector3(1.f, 1.f, 1.f)) * 0.5_f;
-    return tex->sample(coord);
+    return (coord + Vector3(1.f, 1.f, 1.f)) * 0.5_f;
+  }
+
+  virtual Vector4 sample(const Vector3 &coord) const override {
+    return tex->sample(rotate(coord));
+  }
+
+  int compile(TextureCompiler &compiler, int coord) const override {
+    return compiler.compile(
+        *tex, compiler.transform(coord, [&](Vector3 x) { return rotate(x); }));
   }
 };
 
@@ -202,10 +253,19 @@ class FlippedTexture : public Texture {
     flip_axis = config.get<int>("flip_axis");
   }
 
-  virtual Vector4 sample(const Vector3 &coord_) const override {
+  Vector3 flip(const Vector3 &coord_) const {
     auto coord = coord_;
     coord[flip_axis] = 1.0_f - coord[flip_axis];
-    return tex->sample(coord);
+    return coord;
+  }
+
+  virtual Vector4 sample(const Vector3 &coord) const override {
+    return tex->sample(flip(coord));
+  }
+
+  int compile(TextureCompiler &compiler, int coord) const override {
+    return compiler.compile(
+        *tex, compiler.transform(coord, [&](Vector3 x) { return flip(x); }));
   }
 };
 
@@ -234,6 +294,11 @@ class BoundedTexture : public Texture {
     else
       return outside_val;
   }
+
+  int compile(TextureCompiler &compiler, int coord) const override {
+    return compiler.emit_bound(coord, bound_axis, bounds,
+                               compiler.compile(*tex, coord), outside_val);
+  }
 };
 
 TC_IMPLEMENTATION(Texture, BoundedTexture, "bound");
@@ -271,6 +336,37 @@ class RasterizedTexture : public Texture {
 
 TC_IMPLEMENTATION(Texture, RasterizedTexture, "rasterize");
 
+// Rasterizes a static texture graph (the z = 0.5 slice) once at load time
+// into a MIP pyramid, so that lookups no longer walk the graph
+class BakedTexture : public Texture {
+ protected:
+  TexturePyramid pyramid;
+
+ public:
+  void initialize(const Config &config) override {
+    Texture::initialize(config);
+    auto tex = AssetManager::get_asset<Texture>(config.get<int>("tex"));
+    int resolution_x = config.get<int>("resolution_x");
+    int resolution_y = config.get("resolution_y", resolution_x);
+    pyramid.initialize(tex->rasterize(Vector2i(resolution_x, resolution_y)),
+                       get_storage_format(config.get("storage", "full")));
+  }
+
+  virtual Vector4 sample(const Vector2 &coord) const override {
+    return pyramid.sample(coord);
+  }
+
+  virtual Vector4 sample(const Vector3 &coord) const override {
+    return pyramid.sample(Vector2(coord.x, coord.y));
+  }
+
+  Vector4 sample_filtered(const Vector2 &coord, real width) const override {
+    return pyramid.sample(coord, pyramid.get_lod(width));
+  }
+};
+
+TC_IMPLEMENTATION(Texture, BakedTexture, "bake");
+
 class TranslatedTexture : public Texture {
  protected:
   std::shared_ptr<Texture> tex;
@@ -286,6 +382,12 @@ class TranslatedTexture : public Texture {
   virtual Vector4 sample(const Vector3 &coord_) const override {
     return tex->sample(coord_ - translation);
   }
+
+  int compile(TextureCompiler &compiler, int coord) const override {
+    return compiler.compile(
+        *tex, compiler.transform(
+                  coord, [&](Vector3 x) { return x - translation; }));
+  }
 };
 
 TC_IMPLEMENTATION(Texture, TranslatedTexture, "trans");
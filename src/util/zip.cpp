@@ -109,6 +109,34 @@ std::vector<uint8> read(const std::string fn, bool verbose) {
   return ret;
 }
 
+std::vector<uint8> zlib_compress(const uint8 *data,
+                                 std::size_t len,
+                                 int level) {
+  mz_ulong size = mz_compressBound((mz_ulong)len);
+  std::vector<uint8> ret(size);
+  int status = mz_compress2(ret.data(), &size, data, (mz_ulong)len, level);
+  if (status != MZ_OK) {
+    TC_ERROR("mz_compress2() failed: {}", status);
+  }
+  ret.resize(size);
+  return ret;
+}
+
+void zlib_uncompress(const uint8 *data,
+                     std::size_t len,
+                     uint8 *output,
+                     std::size_t output_len) {
+  mz_ulong size = (mz_ulong)output_len;
+  int status = mz_uncompress(output, &size, data, (mz_ulong)len);
+  if (status != MZ_OK || size != output_len) {
+    TC_ERROR("mz_uncompress() failed: {}", status);
+  }
+}
+
+uint32 crc32_checksum(uint32 crc, const uint8 *data, std::size_t len) {
+  return (uint32)mz_crc32(crc, data, len);
+}
+
 }  // namespace zip
 
 TC_NAMESPACE_END
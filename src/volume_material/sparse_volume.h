@@ -0,0 +1,246 @@
+/*******************************************************************************
+    Copyright (c) The Taichi Authors (2016- ). All Rights Reserved.
+    The use of this software is governed by the LICENSE file.
+*******************************************************************************/
+
+#pragma once
+
+#include <taichi/math/math.h>
+#include <taichi/math/float16.h>
+
+#include <vector>
+
+TC_NAMESPACE_BEGIN
+
+// Scalar voxel grid stored in brick_size^3 bricks. Only bricks holding a
+// non-zero voxel are allocated; a dense table over bricks (1 / 512 of the
+// voxel count) maps each brick to its storage. Each brick also keeps a
+// majorant: an upper bound of the interpolated density anywhere in it,
+// which lets integrators skip empty space. Voxels may be stored as float16
+// or bfloat16; majorants are taken from the stored values.
+class SparseVolume {
+ public:
+  static constexpr int brick_log2 = 3;
+  static constexpr int brick_size = 1 << brick_log2;
+  static constexpr int brick_volume = brick_size * brick_size * brick_size;
+
+  // Evaluates |density(i, j, k)| for every voxel, brick by brick, so that no
+  // dense copy of the grid is ever allocated
+  template <typename F>
+  void initialize(const Vector3i &res,
+                  const F &density,
+                  StorageFormat format = StorageFormat::full) {
+    TC_ERROR_IF(format == StorageFormat::srgb8,
+                "Voxels can not be stored as srgb8");
+    this->res = res;
+    this->format = format;
+    for (int k = 0; k < 3; k++) {
+      brick_res[k] = (res[k] + brick_size - 1) / brick_size;
+    }
+    int num_bricks = brick_res[0] * brick_res[1] * brick_res[2];
+    brick_index.assign(num_bricks, -1);
+    std::vector<real> brick_max(num_bricks, 0.0_f);
+    data.clear();
+    data16.clear();
+    maximum = 0.0_f;
+    real brick[brick_volume];
+    for (int bi = 0; bi < brick_res[0]; bi++) {
+      for (int bj = 0; bj < brick_res[1]; bj++) {
+        for (int bk = 0; bk < brick_res[2]; bk++) {
+          real m = 0.0_f;
+          for (int i = 0; i < brick_size; i++) {
+            for (int j = 0; j < brick_size; j++) {
+              for (int k = 0; k < brick_size; k++) {
+                int x = bi * brick_size + i, y = bj * brick_size + j,
+                    z = bk * brick_size + k;
+                real v = 0.0_f;
+                if (x < res[0] && y < res[1] && z < res[2]) {
+                  v = round_to_storage(density(x, y, z));
+                }
+                brick[voxel_offset(i, j, k)] = v;
+                m = std::max(m, v);
+              }
+            }
+          }
+          if (m > 0) {
+            int b = brick_id(bi, bj, bk);
+            brick_index[b] = get_num_allocated_bricks();
+            if (format == StorageFormat::full) {
+              data.insert(data.end(), brick, brick + brick_volume);
+            } else {
+              for (int v = 0; v < brick_volume; v++) {
+                data16.push_back(encode((float32)brick[v]));
+              }
+            }
+            brick_max[b] = m;
+            maximum = std::max(maximum, m);
+          }
+        }
+      }
+    }
+    // Trilinear lookups in a brick reach one voxel into its neighbours
+    majorants.assign(num_bricks, 0.0_f);
+    for (int bi = 0; bi < brick_res[0]; bi++) {
+      for (int bj = 0; bj < brick_res[1]; bj++) {
+        for (int bk = 0; bk < brick_res[2]; bk++) {
+          real m = 0.0_f;
+          for (int i = std::max(bi - 1, 0);
+               i <= std::min(bi + 1, brick_res[0] - 1); i++) {
+            for (int j = std::max(bj - 1, 0);
+                 j <= std::min(bj + 1, brick_res[1] - 1); j++) {
+              for (int k = std::max(bk - 1, 0);
+                   k <= std::min(bk + 1, brick_res[2] - 1); k++) {
+                m = std::max(m, brick_max[brick_id(i, j, k)]);
+              }
+            }
+          }
+          majorants[brick_id(bi, bj, bk)] = m;
+        }
+      }
+    }
+  }
+
+  Vector3i get_res() const {
+    return res;
+  }
+
+  Vector3i get_brick_res() const {
+    return brick_res;
+  }
+
+  int get_num_allocated_bricks() const {
+    return (int)((format == StorageFormat::full ? data.size() : data16.size()) /
+                 brick_volume);
+  }
+
+  real get_maximum() const {
+    return maximum;
+  }
+
+  real get(int i, int j, int k) const {
+    int b = brick_index[brick_id(i >> brick_log2, j >> brick_log2,
+                                 k >> brick_log2)];
+    if (b < 0) {
+      return 0.0_f;
+    }
+    return load((size_t)b * brick_volume +
+                voxel_offset(i & (brick_size - 1), j & (brick_size - 1),
+                             k & (brick_size - 1)));
+  }
+
+  // Trilinear interpolation, as Array3D<real>::sample_relative_coord
+  real sample_relative_coord(const Vector3 &pos) const {
+    real x = clamp(pos.x * res[0] - 0.5_f, 0.0_f, res[0] - 1.0_f - eps);
+    real y = clamp(pos.y * res[1] - 0.5_f, 0.0_f, res[1] - 1.0_f - eps);
+    real z = clamp(pos.z * res[2] - 0.5_f, 0.0_f, res[2] - 1.0_f - eps);
+    int x_i = clamp(int(x), 0, res[0] - 2);
+    int y_i = clamp(int(y), 0, res[1] - 2);
+    int z_i = clamp(int(z), 0, res[2] - 2);
+    real x_r = x - x_i;
+    real y_r = y - y_i;
+    real z_r = z - z_i;
+    real v[2][2][2];
+    const int last = brick_size - 1;
+    if ((x_i & last) != last && (y_i & last) != last && (z_i & last) != last) {
+      // All eight voxels are in one brick
+      int b = brick_index[brick_id(x_i >> brick_log2, y_i >> brick_log2,
+                                   z_i >> brick_log2)];
+      if (b < 0) {
+        return 0.0_f;
+      }
+      std::size_t base = (size_t)b * brick_volume +
+                         voxel_offset(x_i & last, y_i & last, z_i & last);
+      for (int i = 0; i < 2; i++) {
+        for (int j = 0; j < 2; j++) {
+          for (int k = 0; k < 2; k++) {
+            v[i][j][k] = load(base + voxel_offset(i, j, k));
+          }
+        }
+      }
+    } else {
+      for (int i = 0; i < 2; i++) {
+        for (int j = 0; j < 2; j++) {
+          for (int k = 0; k < 2; k++) {
+            v[i][j][k] = get(x_i + i, y_i + j, z_i + k);
+          }
+        }
+      }
+    }
+    return lerp(z_r,
+                lerp(x_r, lerp(y_r, v[0][0][0], v[0][1][0]),
+                     lerp(y_r, v[1][0][0], v[1][1][0])),
+                lerp(x_r, lerp(y_r, v[0][0][1], v[0][1][1]),
+                     lerp(y_r, v[1][0][1], v[1][1][1])));
+  }
+
+  // Brick containing |pos| (in relative coordinates), clamped to the grid
+  Vector3i get_brick(const Vector3 &pos) const {
+    Vector3i b;
+    for (int k = 0; k < 3; k++) {
+      b[k] = clamp(int(pos[k] * res[k]) >> brick_log2, 0, brick_res[k] - 1);
+    }
+    return b;
+  }
+
+  // Upper bound of sample_relative_coord within brick |b|
+  real get_majorant(const Vector3i &b) const {
+    return majorants[brick_id(b[0], b[1], b[2])];
+  }
+
+  // Extent of brick |b| in relative coordinates
+  void get_brick_bounds(const Vector3i &b,
+                        Vector3 &lower,
+                        Vector3 &upper) const {
+    for (int k = 0; k < 3; k++) {
+      lower[k] = real(b[k] * brick_size) / res[k];
+      upper[k] = real((b[k] + 1) * brick_size) / res[k];
+    }
+  }
+
+ private:
+  Vector3i res, brick_res;
+  // Storage index of each brick; -1 for bricks with only zero voxels
+  std::vector<int> brick_index;
+  StorageFormat format = StorageFormat::full;
+  // Voxels of the allocated bricks, in |data| for the full format and in
+  // |data16| otherwise
+  std::vector<real> data;
+  std::vector<uint16> data16;
+  std::vector<real> majorants;
+  real maximum = 0.0_f;
+
+  uint16 encode(float32 v) const {
+    return format == StorageFormat::float16 ? float32_to_float16(v)
+                                            : float32_to_bfloat16(v);
+  }
+
+  // As stored, so that the majorants bound the interpolated stored values
+  real round_to_storage(real v) const {
+    if (format == StorageFormat::full) {
+      return v;
+    }
+    uint16 e = encode((float32)v);
+    return format == StorageFormat::float16 ? float16_to_float32(e)
+                                            : bfloat16_to_float32(e);
+  }
+
+  real load(std::size_t index) const {
+    if (format == StorageFormat::full) {
+      return data[index];
+    } else if (format == StorageFormat::float16) {
+      return float16_to_float32(data16[index]);
+    } else {
+      return bfloat16_to_float32(data16[index]);
+    }
+  }
+
+  int brick_id(int bi, int bj, int bk) const {
+    return (bi * brick_res[1] + bj) * brick_res[2] + bk;
+  }
+
+  static int voxel_offset(int i, int j, int k) {
+    return (i * brick_size + j) * brick_size + k;
+  }
+};
+
+TC_NAMESPACE_END
@@ -8,6 +8,7 @@
 #include <taichi/visual/texture.h>
 #include <taichi/math/array_3d.h>
 #include <taichi/common/asset_manager.h>
+#include "sparse_volume.h"
 
 TC_NAMESPACE_BEGIN
 
@@ -50,59 +51,179 @@ TC_IMPLEMENTATION(VolumeMaterial, VacuumVolumeMaterial, "vacuum");
 
 class VoxelVolumeMaterial : public VolumeMaterial {
  protected:
-  Array3D<real> voxels;
+  SparseVolume voxels;
   std::shared_ptr<Texture> tex;
   Vector3i resolution;
-  real maximum;
 
- public:
-  virtual void initialize(const Config &config) override {
-    VolumeMaterial::initialize(config);
-    this->volumetric_scattering = config.get<real>("scattering");
-    this->volumetric_absorption = config.get<real>("absorption");
-    this->resolution = config.get<Vector3i>("resolution");
-    this->tex = AssetManager::get_asset<Texture>(config.get<int>("tex"));
-    voxels.initialize(resolution, 1.0_f);
-    maximum = 0.0_f;
-    Vector3 inv = Vector3(1.0_f) / resolution.cast<real>();
-    for (auto &ind : voxels.get_region()) {
-      voxels[ind] = tex->sample(ind.get_pos() * inv).x;
-      assert_info(voxels[ind] >= 0.0_f, "Density cannot be negative.");
-      maximum = std::max(maximum, voxels[ind]);
+  // Moves |dist| forward to where the local ray orig + dir * dist enters the
+  // unit cube; false if it misses it
+  static bool enter_volume(const Vector3 &orig,
+                           const Vector3 &dir,
+                           real &dist) {
+    real t0 = dist, t1 = std::numeric_limits<real>::infinity();
+    for (int k = 0; k < 3; k++) {
+      if (dir[k] == 0) {
+        if (orig[k] < 0 || orig[k] >= 1) {
+          return false;
+        }
+        continue;
+      }
+      real ta = -orig[k] / dir[k], tb = (1 - orig[k]) / dir[k];
+      if (ta > tb) {
+        std::swap(ta, tb);
+      }
+      t0 = std::max(t0, ta);
+      t1 = std::min(t1, tb);
+    }
+    if (t0 > t1) {
+      return false;
     }
+    dist = t0;
+    return true;
   }
 
-  virtual real sample_free_distance(StateSequence &rand,
-                                    const Ray &ray) const override {
-    int counter = 0;
-    real kill;
-    real dist = 0.0_f;
+  // Walks the bricks along the local ray (3D DDA) from |dist| until the
+  // optical depth of the brick majorants reaches |tau|. Returns that
+  // tentative collision, whose majorant density goes to |majorant|, or
+  // infinity if the ray leaves the grid first. Bricks without density cost
+  // one step each and no collisions.
+  real march(const Vector3 &orig,
+             const Vector3 &dir,
+             real dist,
+             real tau,
+             real &majorant) const {
+    const real inf = std::numeric_limits<real>::infinity();
     real tot = volumetric_scattering + volumetric_absorption;
-    do {
+    Vector3 pos = orig + dir * dist;
+    Vector3i brick_res = voxels.get_brick_res();
+    Vector3i b = voxels.get_brick(pos);
+    Vector3 lower, upper;
+    voxels.get_brick_bounds(b, lower, upper);
+    real t_max[3], t_delta[3];
+    int step[3];
+    for (int k = 0; k < 3; k++) {
+      if (dir[k] > 0) {
+        step[k] = 1;
+        t_max[k] = dist + (upper[k] - pos[k]) / dir[k];
+        t_delta[k] = (upper[k] - lower[k]) / dir[k];
+      } else if (dir[k] < 0) {
+        step[k] = -1;
+        t_max[k] = dist + (lower[k] - pos[k]) / dir[k];
+        t_delta[k] = (lower[k] - upper[k]) / dir[k];
+      } else {
+        step[k] = 0;
+        t_max[k] = t_delta[k] = inf;
+      }
+    }
+    while (true) {
+      int axis = t_max[0] < t_max[1] ? 0 : 1;
+      axis = t_max[2] < t_max[axis] ? 2 : axis;
+      real length = std::max(t_max[axis] - dist, 0.0_f);
+      real m = voxels.get_majorant(b);
+      real mu = m * tot;
+      if (mu > 0 && mu * length >= tau) {
+        majorant = m;
+        return dist + tau / mu;
+      }
+      tau -= mu * length;
+      dist = std::max(dist, t_max[axis]);
+      b[axis] += step[axis];
+      if (b[axis] < 0 || b[axis] >= brick_res[axis]) {
+        return inf;
+      }
+      t_max[axis] += t_delta[axis];
+    }
+  }
+
+  // Delta tracking along the local ray from |dist| on
+  real track(const Vector3 &orig,
+             const Vector3 &dir,
+             real dist,
+             real max_dist,
+             StateSequence &rand) const {
+    const real inf = std::numeric_limits<real>::infinity();
+    if (!enter_volume(orig, dir, dist)) {
+      return inf;
+    }
+    int counter = 0;
+    while (true) {
       counter += 1;
       if (counter > 10000) {
         printf("Warning: path too long\n");
         break;
       }
-      dist += -log(1 - rand()) / (maximum * tot);
-      Vector3 pos = ray.orig + ray.dir * dist;
-      pos = multiply_matrix4(world2local, pos, 1.0_f);
-      if (pos.x < 0 || pos.x >= 1 || pos.y < 0 || pos.y >= 1 || pos.z < 0 ||
-          pos.z >= 1) {
+      real majorant;
+      dist = march(orig, dir, dist, -log(1 - rand()), majorant);
+      if (dist == inf) {
+        break;
+      }
+      Vector3 pos = orig + dir * dist;
+      if (!inside_unit_cube(pos)) {
         // Outside the texture
-        dist = std::numeric_limits<real>::infinity();
+        return inf;
+      }
+      real kill = voxels.sample_relative_coord(pos);
+      if (!(majorant * rand() > kill && dist < max_dist)) {
         break;
       }
-      kill = voxels.sample_relative_coord(pos);
-    } while (maximum * rand() > kill && dist < ray.dist);
+    }
     return dist;
   }
 
+ public:
+  virtual void initialize(const Config &config) override {
+    VolumeMaterial::initialize(config);
+    this->volumetric_scattering = config.get<real>("scattering");
+    this->volumetric_absorption = config.get<real>("absorption");
+    this->resolution = config.get<Vector3i>("resolution");
+    this->tex = AssetManager::get_asset<Texture>(config.get<int>("tex"));
+    Vector3 inv = Vector3(1.0_f) / resolution.cast<real>();
+    // "float16" or "bfloat16" to halve the memory of the voxels
+    auto format = get_storage_format(config.get("storage", "full"));
+    voxels.initialize(
+        resolution,
+        [&](int i, int j, int k) {
+          real density =
+              tex->sample(Vector3(i + 0.5_f, j + 0.5_f, k + 0.5_f) * inv).x;
+          assert_info(density >= 0.0_f, "Density cannot be negative.");
+          return density;
+        },
+        format);
+  }
+
+  virtual real sample_free_distance(StateSequence &rand,
+                                    const Ray &ray) const override {
+    return track(multiply_matrix4(world2local, ray.orig, 1.0_f),
+                 multiply_matrix4(world2local, ray.dir, 0.0_f), 0.0_f,
+                 ray.dist, rand);
+  }
+
+  // Ratio tracking: the product of the null-collision probabilities of all
+  // tentative collisions before |end|
   virtual real unbiased_sample_attenuation(const Vector3 &start,
                                            const Vector3 &end,
                                            StateSequence &rand) const override {
-    auto dir = normalized(end - start);
-    return sample_free_distance(rand, Ray(start, dir)) >= length(end - start);
+    Vector3 orig = multiply_matrix4(world2local, start, 1.0_f);
+    Vector3 dir = multiply_matrix4(world2local, normalized(end - start), 0.0_f);
+    real max_dist = length(end - start);
+    real dist = 0.0_f;
+    real transmittance = 1.0_f;
+    if (!enter_volume(orig, dir, dist)) {
+      return transmittance;
+    }
+    for (int counter = 0; counter < 10000 && transmittance > 0; counter++) {
+      real majorant;
+      dist = march(orig, dir, dist, -log(1 - rand()), majorant);
+      if (dist >= max_dist) {
+        break;
+      }
+      Vector3 pos = orig + dir * dist;
+      if (!inside_unit_cube(pos)) {
+        break;
+      }
+      transmittance *= 1 - voxels.sample_relative_coord(pos) / majorant;
+    }
+    return transmittance;
   }
 };
 
@@ -110,101 +231,106 @@ TC_IMPLEMENTATION(VolumeMaterial, VoxelVolumeMaterial, "voxel");
 
 class SDFVoxelVolumeMaterial : public VoxelVolumeMaterial {
  protected:
-  Array3D<real> sdf;
+  // Lower bound of the distance from any point in each brick to the nearest
+  // brick with density, in world space. Kept per brick (not per voxel) so
+  // that it stays small next to the sparse voxels.
+  std::vector<real> sdf;
+
+  int brick_id(const Vector3i &b) const {
+    Vector3i brick_res = voxels.get_brick_res();
+    return (b[0] * brick_res[1] + b[1]) * brick_res[2] + b[2];
+  }
 
   // Signed distance field
   void calculate_sdf() {
-    Array3D<Vector3> nearest(resolution, Vector3(1e30f));
+    Vector3i brick_res = voxels.get_brick_res();
+    int num_bricks = brick_res[0] * brick_res[1] * brick_res[2];
+    sdf.assign(num_bricks, 1e30f);
+    std::vector<Vector3i> nearest(num_bricks);
     // Priority queue returns biggest element
-    std::priority_queue<std::pair<real, Index3D>> pq;
-    for (auto &ind : voxels.get_region()) {
-      if (voxels[ind] > 0) {
-        sdf[ind] = 0.0_f;
-        nearest[ind] = ind.get_pos();
-        pq.push(std::make_pair(-sdf[ind], ind));
+    std::priority_queue<std::pair<real, int>> pq;
+    for (int i = 0; i < brick_res[0]; i++) {
+      for (int j = 0; j < brick_res[1]; j++) {
+        for (int k = 0; k < brick_res[2]; k++) {
+          Vector3i b(i, j, k);
+          if (voxels.get_majorant(b) > 0) {
+            sdf[brick_id(b)] = 0.0_f;
+            nearest[brick_id(b)] = b;
+            pq.push(std::make_pair(-0.0_f, brick_id(b)));
+          }
+        }
       }
     }
-    Vector3 inv_res = Vector3(1.0_f) / Vector3(resolution.cast<real>());
+    // Size of a brick in relative coordinates
+    Vector3 brick_size =
+        Vector3(real(SparseVolume::brick_size)) / resolution.cast<real>();
     // Dijkstra
     while (!pq.empty()) {
       auto t = pq.top();
       real dist = -t.first;
-      Index3D ind = t.second;
+      int id = t.second;
       pq.pop();
-      if (dist > sdf[ind]) {
+      if (dist > sdf[id]) {
         // Already outdated
         continue;
       }
-      Vector3 target = nearest[ind];
+      Vector3i target = nearest[id];
+      Vector3i b(id / (brick_res[1] * brick_res[2]),
+                 id / brick_res[2] % brick_res[1], id % brick_res[2]);
       for (auto &st : neighbour6_3d) {
-        Index3D nei_ind = ind + st;
-        if (voxels.inside(nei_ind)) {
+        Vector3i nei = b + st;
+        if (0 <= nei[0] && nei[0] < brick_res[0] && 0 <= nei[1] &&
+            nei[1] < brick_res[1] && 0 <= nei[2] && nei[2] < brick_res[2]) {
           real d = length(multiply_matrix4(
-              local2world, (nei_ind.get_pos() - target) * inv_res, 0));
-          if (d < sdf[nei_ind]) {
+              local2world, (nei - target).cast<real>() * brick_size, 0));
+          int nei_id = brick_id(nei);
+          if (d < sdf[nei_id]) {
             // Update
-            nearest[nei_ind] = target;
-            sdf[nei_ind] = d;
-            pq.push(std::make_pair(-d, nei_ind));
+            nearest[nei_id] = target;
+            sdf[nei_id] = d;
+            pq.push(std::make_pair(-d, nei_id));
           }
         }
       }
     }
-    real shrink =
-        2 * std::max(std::max(length(multiply_matrix4(
-                                  local2world, Vector3(1, 0, 0) * inv_res, 0)),
-                              length(multiply_matrix4(
-                                  local2world, Vector3(0, 1, 0) * inv_res, 0))),
-                     length(multiply_matrix4(local2world,
-                                             Vector3(0, 0, 1) * inv_res, 0)));
-    for (auto &ind : sdf.get_region()) {
-      sdf[ind] -= shrink;
+    // Distances are between brick centers; points of both bricks are at
+    // most half a (world) brick diagonal away from them
+    real shrink = 0;
+    for (int k = 0; k < 3; k++) {
+      Vector3 axis(0.0_f);
+      axis[k] = brick_size[k];
+      shrink += length(multiply_matrix4(local2world, axis, 0));
+    }
+    for (auto &d : sdf) {
+      d -= shrink;
     }
   }
 
  public:
   virtual void initialize(const Config &config) override {
     VoxelVolumeMaterial::initialize(config);
-    sdf.initialize(resolution, 1e30f);
     calculate_sdf();
   }
 
+  // Sphere-traces the empty space in front of the ray, then tracks
   virtual real sample_free_distance(StateSequence &rand,
                                     const Ray &ray) const override {
-    int counter = 0;
-    real kill;
     real dist = 0.0_f;
-    real tot = volumetric_scattering + volumetric_absorption;
-    do {
-      counter += 1;
-      if (counter > 10000) {
-        printf("Warning: path too long\n");
-        break;
-      }
-
-      Vector3 pos;
-      for (int i = 0; i < 100; i++) {
-        pos = multiply_matrix4(world2local, ray.orig + ray.dir * dist, 1.0_f);
-        if (inside_unit_cube(pos)) {
-          real d = sdf.sample_relative_coord(pos);
-          if (d > 1e-4_f) {
-            dist += d;
-            continue;
-          }
+    for (int i = 0; i < 100; i++) {
+      Vector3 pos =
+          multiply_matrix4(world2local, ray.orig + ray.dir * dist, 1.0_f);
+      if (inside_unit_cube(pos)) {
+        real d = sdf[brick_id(voxels.get_brick(pos))];
+        if (d > 1e-4_f) {
+          dist += d;
+          continue;
         }
-        break;
       }
-      dist += -log(1 - rand()) / (maximum * tot);
-      pos = ray.orig + ray.dir * dist;
-      pos = multiply_matrix4(world2local, pos, 1.0_f);
-      if (!inside_unit_cube(pos)) {
-        // Outside the texture
-        dist = std::numeric_limits<real>::infinity();
-        break;
-      }
-      kill = voxels.sample_relative_coord(pos);
-    } while (maximum * rand() > kill && dist < ray.dist);
-    return dist;
+      break;
+    }
+    return track(multiply_matrix4(world2local, ray.orig, 1.0_f),
+                 multiply_matrix4(world2local, ray.dir, 0.0_f), dist,
+                 ray.dist, rand);
   }
 };
 
@@ -213,7 +339,7 @@ TC_IMPLEMENTATION(VolumeMaterial, SDFVoxelVolumeMaterial, "sdf_voxel");
 VolumeStack::VolumeStack() {
   static std::shared_ptr<VolumeMaterial> vacuum =
       create_instance<VolumeMaterial>("vacuum");
-  stack.push_back(vacuum.get());
+  push(vacuum.get());
 }
 
 TC_NAMESPACE_END